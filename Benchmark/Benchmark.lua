@@ -0,0 +1,68 @@
+project "Benchmark"
+    location "../Benchmark"
+    kind "ConsoleApp"
+    includedirs { "../RadeonRays/include", "../Calc/inc", "." }
+    links {"RadeonRays", "Calc"}
+    files { "**.cpp", "**.h", "../Tutorials/Tools/tiny_obj_loader.cpp", "../Tutorials/Tools/mapped_file.cpp", "../Tutorials/Tools/parallel_obj_loader.cpp", "../Tutorials/Tools/scene_file.cpp", "../UnitTest/scene_generator.cpp" }
+
+    if _OPTIONS["shared_calc"] then
+       defines {"CALC_IMPORT_API"};
+    else
+       defines {"CALC_STATIC_LIBRARY"}
+    end
+
+    if os.is("macosx") then
+        buildoptions "-std=c++11 -stdlib=libc++"
+    else if os.is("linux") then
+        buildoptions "-std=c++11"
+        os.execute("rm -rf obj");
+        end
+    end
+
+    if _OPTIONS["use_opencl"] then
+        includedirs { "../CLW" }
+        links {"CLW"}
+    end
+
+    if _OPTIONS["use_embree"] then
+        configuration {"x32"}
+            libdirs { "../3rdParty/embree/lib/x86"}
+        configuration {"x64"}
+            libdirs { "../3rdParty/embree/lib/x64"}
+        configuration {}
+
+        links {"embree"}
+    end
+
+    if _OPTIONS["use_vulkan"] then
+        local vulkanSDKPath = os.getenv( "VK_SDK_PATH" );
+        if vulkanSDKPath == nil then
+            vulkanSDKPath = os.getenv( "VULKAN_SDK" );
+        end
+        if vulkanSDKPath ~= nil then
+            configuration {"x32"}
+            libdirs { vulkanSDKPath .. "/Bin32" }
+            configuration {"x64"}
+            libdirs { vulkanSDKPath .. "/Bin" }
+            configuration {}
+        end
+        if os.is("linux") then
+            libdirs { vulkanSDKPath .. "/lib" }
+            links { "Anvil",
+                    "vulkan",
+                    "pthread"}
+        elseif os.is("windows") then
+            links {"Anvil"}
+            links{"vulkan-1"}
+        end
+    end
+
+    configuration {"x32", "Debug"}
+        targetdir "../Bin/Debug/x86"
+    configuration {"x64", "Debug"}
+        targetdir "../Bin/Debug/x64"
+    configuration {"x32", "Release"}
+        targetdir "../Bin/Release/x86"
+    configuration {"x64", "Release"}
+        targetdir "../Bin/Release/x64"
+    configuration {}
@@ -0,0 +1,814 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+
+// Trace throughput benchmark: measures Mrays/s of every intersector for
+// primary, diffuse bounce, shadow and randomly masked rays at several batch
+// and scene sizes, results are written as JSON to compare between releases.
+// Build mode sweeps builders and their options instead, reporting build time,
+// SAH cost and memory of the trees along with the primary and diffuse Mrays/s
+// at the largest batch size.
+//
+// Usage: Benchmark [-mode trace|build|all] [-backend cl|vk|embree|all] [-scene file.obj|file.rrs]...
+//                  [-grid n]... [-batch n]... [-device idx] [-iterations n] [-output results.json]
+//
+// Every backend traces the same scenes and rays, device idx selects the device of the
+// OpenCL and Vulkan backends. Embree has a single intersector and no builder options,
+// so it only takes part in trace mode.
+//
+// Larger scenes are made by replicating the loaded scene on an n x n grid,
+// copies are separate meshes, so every intersector is able to trace them.
+// Scenes named sphere:N, soup:N or thin:N are generated with about N triangles
+// instead of being loaded, see SceneGenerator. Scenes converted to the binary format by
+// SceneConverter are mapped into memory instead of parsed, instances are placed as copies.
+
+#include "radeon_rays.h"
+#include "../Tutorials/Tools/tiny_obj_loader.h"
+#include "../Tutorials/Tools/parallel_obj_loader.h"
+#include "../Tutorials/Tools/scene_file.h"
+#include "../UnitTest/scene_generator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace RadeonRays;
+using namespace tinyobj;
+
+namespace
+{
+    struct Options
+    {
+        std::vector<std::string> scenes;
+        std::vector<int> grids;
+        std::vector<int> batches;
+        int device = 0;
+        int iterations = 10;
+        std::string output = "benchmark.json";
+        bool trace = true;
+        bool build = false;
+        int backends = DeviceInfo::kAny;
+    };
+
+    struct Result
+    {
+        std::string backend;
+        std::string device;
+        std::string scene;
+        int grid;
+        int num_triangles;
+        std::string intersector;
+        float build_ms;
+        std::string ray_type;
+        int batch;
+        float mrays;
+    };
+
+    // Intersectors and options selecting them
+    struct IntersectorConfig
+    {
+        char const* name;
+        char const* acc_type;
+        bool force2level;
+    };
+
+    IntersectorConfig const kIntersectors[] =
+    {
+        { "bvh", "bvh", false },
+        { "fatbvh", "fatbvh", false },
+        { "hlbvh", "hlbvh", false },
+        { "bvh2l", "bvh", true },
+        { "fatbvh2l", "fatbvh2l", true }
+    };
+
+    // Embree ignores the intersector options
+    IntersectorConfig const kEmbreeIntersector = { "embree", "bvh", false };
+
+    struct BackendConfig
+    {
+        char const* name;
+        DeviceInfo::Platform platform;
+    };
+
+    BackendConfig const kBackends[] =
+    {
+        { "cl", DeviceInfo::kOpenCL },
+        { "vk", DeviceInfo::kVulkan },
+        { "embree", DeviceInfo::kEmbree }
+    };
+
+    // Loaded or generated scene shared by all backends
+    struct SceneSource
+    {
+        std::string name;
+        std::vector<shape_t> shapes;
+        // Binary scenes are mapped instead of parsed
+        std::unique_ptr<SceneFile::MappedScene> file;
+        // Meshes of the shapes or of the file
+        std::vector<SceneFile::PlacedMesh> meshes;
+    };
+
+    struct BuildResult
+    {
+        std::string backend;
+        std::string device;
+        std::string scene;
+        int grid;
+        int num_triangles;
+        std::string config;
+        AccelStats stats;
+        float primary_mrays;
+        float diffuse_mrays;
+    };
+
+    // Builder settings swept by the build mode, all of them are set for every configuration
+    struct BuildConfig
+    {
+        char const* name;
+        char const* acc_type;
+        char const* builder;
+        bool use_splits;
+        int num_bins;
+        float traversal_cost;
+        int max_split_depth;
+        float extra_node_budget;
+    };
+
+    BuildConfig const kBuildConfigs[] =
+    {
+        { "median", "bvh", "median", false, 64, 10.f, 10, 1.f },
+        { "sah_bins16", "bvh", "sah", false, 16, 10.f, 10, 1.f },
+        { "sah_bins64", "bvh", "sah", false, 64, 10.f, 10, 1.f },
+        { "sah_bins128", "bvh", "sah", false, 128, 10.f, 10, 1.f },
+        { "sah_tcost2", "bvh", "sah", false, 64, 2.f, 10, 1.f },
+        { "sah_tcost5", "bvh", "sah", false, 64, 5.f, 10, 1.f },
+        { "sah_tcost20", "bvh", "sah", false, 64, 20.f, 10, 1.f },
+        { "splits_depth5", "bvh", "sah", true, 64, 10.f, 5, 1.f },
+        { "splits_depth10", "bvh", "sah", true, 64, 10.f, 10, 1.f },
+        { "splits_depth20", "bvh", "sah", true, 64, 10.f, 20, 1.f },
+        { "splits_budget0.3", "bvh", "sah", true, 64, 10.f, 10, 0.3f },
+        { "hlbvh", "hlbvh", "sah", false, 64, 10.f, 10, 1.f },
+        { "hlbvh_sah", "hlbvh_sah", "sah", false, 64, 10.f, 10, 1.f },
+        { "hlbvh_ploc", "hlbvh_ploc", "sah", false, 64, 10.f, 10, 1.f }
+    };
+
+    // Number of distinct shape masks for masked rays
+    int const kNumMasks = 4;
+    // Seed of the ray generators, results are comparable between runs
+    unsigned const kSeed = 42;
+
+    bool ParseOptions(int argc, char** argv, Options& options)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+
+            if (i + 1 == argc)
+            {
+                std::cerr << "Missing value of " << arg << "\n";
+                return false;
+            }
+
+            char const* value = argv[++i];
+
+            if (arg == "-scene")
+                options.scenes.push_back(value);
+            else if (arg == "-grid")
+                options.grids.push_back(std::max(1, std::atoi(value)));
+            else if (arg == "-batch")
+                options.batches.push_back(std::max(1, std::atoi(value)));
+            else if (arg == "-device")
+                options.device = std::atoi(value);
+            else if (arg == "-iterations")
+                options.iterations = std::max(1, std::atoi(value));
+            else if (arg == "-output")
+                options.output = value;
+            else if (arg == "-backend")
+            {
+                std::string backend = value;
+                options.backends = 0;
+
+                for (auto const& config : kBackends)
+                {
+                    if (backend == config.name || backend == "all")
+                    {
+                        options.backends |= config.platform;
+                    }
+                }
+
+                if (!options.backends)
+                {
+                    std::cerr << "Unknown backend " << backend << "\n";
+                    return false;
+                }
+            }
+            else if (arg == "-mode")
+            {
+                std::string mode = value;
+                options.trace = mode == "trace" || mode == "all";
+                options.build = mode == "build" || mode == "all";
+
+                if (!options.trace && !options.build)
+                {
+                    std::cerr << "Unknown mode " << mode << "\n";
+                    return false;
+                }
+            }
+            else
+            {
+                std::cerr << "Unknown option " << arg << "\n";
+                return false;
+            }
+        }
+
+        if (options.scenes.empty())
+            options.scenes.push_back("../Resources/CornellBox/orig.objm");
+        if (options.grids.empty())
+            options.grids = { 1, 4, 16 };
+        if (options.batches.empty())
+            options.batches = { 1 << 16, 1 << 18, 1 << 20 };
+
+        return true;
+    }
+
+    // Scene replicated on a grid of copies along x and y
+    class Scene
+    {
+    public:
+        Scene(IntersectionApi* api, std::vector<SceneFile::PlacedMesh> const& meshes, int grid)
+            : m_api(api)
+            , m_num_triangles(0)
+        {
+            float3 objmin(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+            float3 objmax = -objmin;
+
+            for (auto const& placed : meshes)
+            {
+                for (int i = 0; i < placed.mesh.num_vertices; ++i)
+                {
+                    float3 p = GetPosition(placed, i);
+                    objmin = vmin(objmin, p);
+                    objmax = vmax(objmax, p);
+                }
+            }
+
+            float3 spacing = 1.1f * (objmax - objmin);
+            m_pmin = objmin;
+            m_pmax = objmax + float3((grid - 1) * spacing.x, (grid - 1) * spacing.y, 0.f);
+
+            for (int y = 0; y < grid; ++y)
+            {
+                for (int x = 0; x < grid; ++x)
+                {
+                    float3 offset(x * spacing.x, y * spacing.y, 0.f);
+
+                    for (auto const& placed : meshes)
+                    {
+                        auto const& mesh = placed.mesh;
+                        if (mesh.num_faces == 0)
+                        {
+                            continue;
+                        }
+
+                        // Meshes placed as they are in the first cell are passed straight from the loaded data
+                        float const* positions = mesh.positions;
+                        std::vector<float> moved;
+                        if (placed.transform || x > 0 || y > 0)
+                        {
+                            moved.resize(3 * mesh.num_vertices);
+                            for (int i = 0; i < mesh.num_vertices; ++i)
+                            {
+                                float3 p = GetPosition(placed, i) + offset;
+                                moved[3 * i] = p.x;
+                                moved[3 * i + 1] = p.y;
+                                moved[3 * i + 2] = p.z;
+                            }
+                            positions = moved.data();
+                        }
+
+                        Shape* shape = m_api->CreateMesh(positions, mesh.num_vertices, 3 * sizeof(float),
+                            mesh.indices, 0, nullptr, mesh.num_faces);
+
+                        // Masked rays see a subset of the shapes
+                        shape->SetMask(1 << (m_shapes.size() % kNumMasks));
+                        m_api->AttachShape(shape);
+
+                        m_shapes.push_back(shape);
+                        m_num_triangles += mesh.num_faces;
+                    }
+                }
+            }
+        }
+
+        ~Scene()
+        {
+            for (auto shape : m_shapes)
+            {
+                m_api->DetachShape(shape);
+                m_api->DeleteShape(shape);
+            }
+        }
+
+        float3 const& GetMin() const { return m_pmin; }
+        float3 const& GetMax() const { return m_pmax; }
+        int GetNumTriangles() const { return m_num_triangles; }
+
+    private:
+        Scene(Scene const&);
+        Scene& operator = (Scene const&);
+
+        static float3 GetPosition(SceneFile::PlacedMesh const& placed, int idx)
+        {
+            float const* p = placed.mesh.positions + 3 * idx;
+            return placed.transform ? transform_point(float3(p[0], p[1], p[2]), *placed.transform) : float3(p[0], p[1], p[2]);
+        }
+
+        IntersectionApi* m_api;
+        std::vector<Shape*> m_shapes;
+        float3 m_pmin;
+        float3 m_pmax;
+        int m_num_triangles;
+    };
+
+    // Rays of a pinhole camera in front of the scene covering its xy extents
+    void GeneratePrimaryRays(Scene const& scene, int numrays, std::vector<ray>& rays)
+    {
+        float3 const pmin = scene.GetMin();
+        float3 const pmax = scene.GetMax();
+        float3 const extents = pmax - pmin;
+
+        float3 origin = 0.5f * (pmin + pmax);
+        origin.z = pmin.z - std::max(extents.x, extents.y);
+
+        int width = (int)std::ceil(std::sqrt((float)numrays));
+
+        rays.resize(numrays);
+        for (int i = 0; i < numrays; ++i)
+        {
+            float u = ((i % width) + 0.5f) / width;
+            float v = ((i / width) + 0.5f) / width;
+            float3 target(pmin.x + u * extents.x, pmin.y + v * extents.y, pmax.z);
+            rays[i] = ray(origin, normalize(target - origin));
+        }
+    }
+
+    float3 RandomPointInBounds(Scene const& scene, std::mt19937& rng)
+    {
+        std::uniform_real_distribution<float> dist(0.f, 1.f);
+        float3 const pmin = scene.GetMin();
+        float3 const extents = scene.GetMax() - pmin;
+        return pmin + float3(dist(rng) * extents.x, dist(rng) * extents.y, dist(rng) * extents.z);
+    }
+
+    float3 RandomDirection(std::mt19937& rng)
+    {
+        std::uniform_real_distribution<float> dist(0.f, 1.f);
+        float z = 1.f - 2.f * dist(rng);
+        float r = std::sqrt(std::max(0.f, 1.f - z * z));
+        float phi = 2.f * 3.14159265f * dist(rng);
+        return float3(r * std::cos(phi), r * std::sin(phi), z);
+    }
+
+    // Incoherent rays leaving primary hits back towards the side the camera ray came from,
+    // misses are replaced by random rays inside the scene bounds, so every ray is traced
+    void GenerateDiffuseRays(Scene const& scene, std::vector<ray> const& primary, std::vector<Intersection> const& hits,
+        std::vector<ray>& rays)
+    {
+        std::mt19937 rng(kSeed);
+        float const eps = 1e-4f * std::sqrt((scene.GetMax() - scene.GetMin()).sqnorm());
+
+        rays.resize(primary.size());
+        for (std::size_t i = 0; i < primary.size(); ++i)
+        {
+            float3 dir = RandomDirection(rng);
+
+            if (hits[i].shapeid != kNullId)
+            {
+                float3 const d = primary[i].d;
+                if (dot(dir, d) > 0.f)
+                {
+                    dir = -dir;
+                }
+
+                rays[i] = ray(primary[i].o + hits[i].uvwt.w * d - eps * d, dir);
+            }
+            else
+            {
+                rays[i] = ray(RandomPointInBounds(scene, rng), dir);
+            }
+        }
+    }
+
+    // Rays from primary hits to a point light under the top of the scene bounds
+    void GenerateShadowRays(Scene const& scene, std::vector<ray> const& primary, std::vector<Intersection> const& hits,
+        std::vector<ray>& rays)
+    {
+        std::mt19937 rng(kSeed);
+        float3 const pmin = scene.GetMin();
+        float3 const pmax = scene.GetMax();
+        float3 light = 0.5f * (pmin + pmax);
+        light.y = pmax.y - 0.01f * (pmax.y - pmin.y);
+
+        rays.resize(primary.size());
+        for (std::size_t i = 0; i < primary.size(); ++i)
+        {
+            float3 o = hits[i].shapeid != kNullId ? primary[i].o + 0.999f * hits[i].uvwt.w * primary[i].d : RandomPointInBounds(scene, rng);
+            float3 d = light - o;
+            float dist = std::sqrt(d.sqnorm());
+            rays[i] = ray(o, (1.f / dist) * d, 0.999f * dist);
+        }
+    }
+
+    // Primary rays seeing a random subset of the shapes
+    void GenerateMaskedRays(std::vector<ray> const& primary, std::vector<ray>& rays)
+    {
+        std::mt19937 rng(kSeed);
+        std::uniform_int_distribution<int> dist(1, (1 << kNumMasks) - 1);
+
+        rays = primary;
+        for (auto& r : rays)
+        {
+            r.SetMask(dist(rng));
+        }
+    }
+
+    // Generate a procedural scene for names of the form kind:numtriangles, returns false for other names
+    bool GenerateScene(std::string const& name, std::vector<shape_t>& objshapes)
+    {
+        auto colon = name.find(':');
+        if (colon == std::string::npos)
+        {
+            return false;
+        }
+
+        std::string kind = name.substr(0, colon);
+        int numtriangles = std::max(1, std::atoi(name.c_str() + colon + 1));
+        float3 const pmin(-1.f, -1.f, -1.f);
+        float3 const pmax(1.f, 1.f, 1.f);
+
+        SceneGenerator::MeshData data;
+        if (kind == "sphere")
+        {
+            int rings = std::max(2, (int)std::sqrt(numtriangles / 4.f));
+            data = SceneGenerator::GenerateSphere(float3(), 1.f, rings, std::max(3, numtriangles / (2 * rings)));
+        }
+        else if (kind == "soup")
+        {
+            data = SceneGenerator::GenerateTriangleSoup(numtriangles, pmin, pmax, 2.f / std::cbrt((float)numtriangles), kSeed);
+        }
+        else if (kind == "thin")
+        {
+            data = SceneGenerator::GenerateThinTriangles(numtriangles, pmin, pmax, 1e-3f, kSeed);
+        }
+        else
+        {
+            return false;
+        }
+
+        shape_t shape;
+        shape.name = name;
+        shape.mesh.positions.swap(data.positions);
+        shape.mesh.indices.swap(data.indices);
+        objshapes.assign(1, shape);
+        return true;
+    }
+
+    void Wait(IntersectionApi* api, Event* e)
+    {
+        e->Wait();
+        api->DeleteEvent(e);
+    }
+
+    // Run the query once for warm up and then time the iterations, returns Mrays/s
+    float MeasureThroughput(IntersectionApi* api, std::vector<ray>& rays, bool occlusion, int iterations)
+    {
+        int numrays = (int)rays.size();
+        Buffer* ray_buffer = api->CreateBuffer(numrays * sizeof(ray), rays.data());
+        Buffer* hit_buffer = api->CreateBuffer(numrays * (occlusion ? sizeof(int) : sizeof(Intersection)), nullptr);
+
+        auto query = [&]()
+        {
+            Event* e = nullptr;
+            if (occlusion)
+                api->QueryOcclusion(ray_buffer, numrays, hit_buffer, nullptr, &e);
+            else
+                api->QueryIntersection(ray_buffer, numrays, hit_buffer, nullptr, &e);
+            Wait(api, e);
+        };
+
+        query();
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < iterations; ++i)
+        {
+            query();
+        }
+        float seconds = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - start).count();
+
+        api->DeleteBuffer(ray_buffer);
+        api->DeleteBuffer(hit_buffer);
+
+        return seconds > 0.f ? (float)numrays * iterations / seconds * 1e-6f : 0.f;
+    }
+
+    void QueryHits(IntersectionApi* api, std::vector<ray>& rays, std::vector<Intersection>& hits)
+    {
+        int numrays = (int)rays.size();
+        Buffer* ray_buffer = api->CreateBuffer(numrays * sizeof(ray), rays.data());
+        Buffer* hit_buffer = api->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+
+        Event* e = nullptr;
+        api->QueryIntersection(ray_buffer, numrays, hit_buffer, nullptr, &e);
+        Wait(api, e);
+
+        Intersection* data = nullptr;
+        api->MapBuffer(hit_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&data, &e);
+        Wait(api, e);
+        hits.assign(data, data + numrays);
+        api->UnmapBuffer(hit_buffer, data, &e);
+        Wait(api, e);
+
+        api->DeleteBuffer(ray_buffer);
+        api->DeleteBuffer(hit_buffer);
+    }
+
+    std::string Escape(std::string const& str)
+    {
+        std::string res;
+        for (char c : str)
+        {
+            if (c == '"' || c == '\\')
+                res.push_back('\\');
+            res.push_back(c);
+        }
+        return res;
+    }
+
+    void WriteJson(std::ostream& out, Options const& options, std::vector<Result> const& results,
+        std::vector<BuildResult> const& builds)
+    {
+        out << "{\n";
+        out << "  \"iterations\": " << options.iterations << ",\n";
+        out << "  \"results\": [\n";
+
+        for (std::size_t i = 0; i < results.size(); ++i)
+        {
+            auto const& r = results[i];
+            out << "    { \"backend\": \"" << r.backend << "\", \"device\": \"" << Escape(r.device)
+                << "\", \"scene\": \"" << Escape(r.scene) << "\", \"grid\": " << r.grid << ", \"triangles\": " << r.num_triangles
+                << ", \"intersector\": \"" << r.intersector << "\", \"build_ms\": " << r.build_ms
+                << ", \"rays\": \"" << r.ray_type << "\", \"batch\": " << r.batch << ", \"mrays_per_s\": " << r.mrays
+                << (i + 1 < results.size() ? " },\n" : " }\n");
+        }
+
+        out << "  ],\n";
+        out << "  \"builds\": [\n";
+
+        for (std::size_t i = 0; i < builds.size(); ++i)
+        {
+            auto const& b = builds[i];
+            auto const& st = b.stats;
+            out << "    { \"backend\": \"" << b.backend << "\", \"device\": \"" << Escape(b.device)
+                << "\", \"scene\": \"" << Escape(b.scene) << "\", \"grid\": " << b.grid << ", \"triangles\": " << b.num_triangles
+                << ", \"config\": \"" << b.config << "\", \"build_ms\": " << st.build_time << ", \"commit_ms\": " << st.commit_time
+                << ", \"sah_cost\": " << st.sah_cost << ", \"nodes\": " << st.num_nodes << ", \"refs\": " << st.num_refs
+                << ", \"max_depth\": " << st.max_depth << ", \"node_bytes\": " << st.node_memory
+                << ", \"total_bytes\": " << st.node_memory + st.vertex_memory + st.face_memory + st.other_memory
+                << ", \"primary_mrays_per_s\": " << b.primary_mrays << ", \"diffuse_mrays_per_s\": " << b.diffuse_mrays
+                << (i + 1 < builds.size() ? " },\n" : " }\n");
+        }
+
+        out << "  ]\n}\n";
+    }
+
+    // Sweep builder settings over the scene, GPU backends only
+    void RunBuilds(IntersectionApi* api, char const* backend, std::string const& device, Options const& options,
+        SceneSource const& source, int grid, Scene const& scene, std::vector<BuildResult>& builds)
+    {
+        for (auto const& config : kBuildConfigs)
+        {
+            api->SetOption("acc.type", config.acc_type);
+            api->SetOption("bvh.builder", config.builder);
+            api->SetOption("bvh.force2level", 0.f);
+            api->SetOption("bvh.sah.use_splits", config.use_splits ? 1.f : 0.f);
+            api->SetOption("bvh.sah.num_bins", (float)config.num_bins);
+            api->SetOption("bvh.sah.traversal_cost", config.traversal_cost);
+            api->SetOption("bvh.sah.max_split_depth", (float)config.max_split_depth);
+            api->SetOption("bvh.sah.extra_node_budget", config.extra_node_budget);
+            api->Commit();
+
+            BuildResult result = { backend, device, source.name, grid, scene.GetNumTriangles(), config.name, AccelStats(), 0.f, 0.f };
+            api->GetStats(result.stats);
+
+            // Trace speed shows what the tree quality is worth
+            std::vector<ray> primary, rays;
+            std::vector<Intersection> hits;
+            GeneratePrimaryRays(scene, options.batches.back(), primary);
+            QueryHits(api, primary, hits);
+            result.primary_mrays = MeasureThroughput(api, primary, false, options.iterations);
+            GenerateDiffuseRays(scene, primary, hits, rays);
+            result.diffuse_mrays = MeasureThroughput(api, rays, false, options.iterations);
+
+            std::cout << backend << " " << source.name << " grid " << grid << " " << config.name << ": build "
+                << result.stats.build_time << " ms, SAH " << result.stats.sah_cost << ", " << result.primary_mrays
+                << "/" << result.diffuse_mrays << " Mrays/s\n";
+            builds.push_back(result);
+        }
+
+        // Trace runs use the default builder settings
+        api->SetOption("bvh.sah.use_splits", 0.f);
+        api->SetOption("bvh.sah.num_bins", 64.f);
+        api->SetOption("bvh.sah.traversal_cost", 10.f);
+    }
+
+    // Measure every ray type at every batch size with the intersector
+    void RunTraces(IntersectionApi* api, char const* backend, std::string const& device, Options const& options,
+        SceneSource const& source, int grid, Scene const& scene, IntersectorConfig const& config, std::vector<Result>& results)
+    {
+        api->SetOption("acc.type", config.acc_type);
+        api->SetOption("bvh.builder", "sah");
+        api->SetOption("bvh.force2level", config.force2level ? 1.f : 0.f);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        api->Commit();
+        float build_ms = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+        for (auto batch : options.batches)
+        {
+            std::vector<ray> primary, rays;
+            std::vector<Intersection> hits;
+            GeneratePrimaryRays(scene, batch, primary);
+            QueryHits(api, primary, hits);
+
+            auto record = [&](char const* type, float mrays)
+            {
+                results.push_back({ backend, device, source.name, grid, scene.GetNumTriangles(), config.name, build_ms, type, batch, mrays });
+                std::cout << backend << " " << source.name << " grid " << grid << " " << config.name << " " << type << " " << batch
+                    << ": " << mrays << " Mrays/s\n";
+            };
+
+            record("primary", MeasureThroughput(api, primary, false, options.iterations));
+
+            GenerateDiffuseRays(scene, primary, hits, rays);
+            record("diffuse", MeasureThroughput(api, rays, false, options.iterations));
+
+            GenerateShadowRays(scene, primary, hits, rays);
+            record("shadow", MeasureThroughput(api, rays, true, options.iterations));
+
+            GenerateMaskedRays(primary, rays);
+            record("masked", MeasureThroughput(api, rays, false, options.iterations));
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        return EXIT_FAILURE;
+    }
+
+    // Scenes are loaded once for all backends
+    std::vector<SceneSource> sources(options.scenes.size());
+    for (std::size_t i = 0; i < options.scenes.size(); ++i)
+    {
+        std::string const& filename = options.scenes[i];
+        std::vector<material_t> objmaterials;
+        std::string basepath = filename.substr(0, filename.find_last_of("/\\") + 1);
+
+        auto& source = sources[i];
+        source.name = filename;
+        bool binary = filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".rrs") == 0;
+
+        std::string res;
+        if (binary)
+        {
+            source.file.reset(new SceneFile::MappedScene());
+            res = source.file->Open(filename.c_str());
+        }
+        else
+        {
+            res = GenerateScene(filename, source.shapes) ? "" : LoadObjParallel(source.shapes, objmaterials, filename.c_str(), basepath.c_str());
+        }
+
+        if (!res.empty())
+        {
+            std::cerr << res << "\n";
+            return EXIT_FAILURE;
+        }
+
+        if (binary)
+        {
+            source.meshes = source.file->GetPlacedMeshes();
+        }
+        else
+        {
+            for (auto const& objshape : source.shapes)
+            {
+                auto const& mesh = objshape.mesh;
+                SceneFile::Mesh view = { mesh.positions.data(), (int)mesh.positions.size() / 3,
+                    mesh.indices.data(), (int)mesh.indices.size() / 3 };
+                source.meshes.push_back({ view, nullptr });
+            }
+        }
+    }
+
+    std::vector<Result> results;
+    std::vector<BuildResult> builds;
+
+    for (auto const& backend : kBackends)
+    {
+        if (!(options.backends & backend.platform))
+        {
+            continue;
+        }
+
+        IntersectionApi::SetPlatform(backend.platform);
+
+        bool embree = backend.platform == DeviceInfo::kEmbree;
+        int devidx = embree ? 0 : options.device;
+        if (devidx < 0 || devidx >= (int)IntersectionApi::GetDeviceCount())
+        {
+            std::cout << "Skipping " << backend.name << ": no device " << devidx << "\n";
+            continue;
+        }
+
+        DeviceInfo devinfo;
+        IntersectionApi::GetDeviceInfo(devidx, devinfo);
+        std::string device = devinfo.name ? devinfo.name : "unknown";
+        std::cout << "Backend " << backend.name << ", device: " << device << "\n";
+
+        IntersectionApi* api = IntersectionApi::Create(devidx);
+
+        try
+        {
+            for (auto const& source : sources)
+            {
+                for (auto grid : options.grids)
+                {
+                    Scene scene(api, source.meshes, grid);
+
+                    if (options.build && !embree)
+                    {
+                        RunBuilds(api, backend.name, device, options, source, grid, scene, builds);
+                    }
+
+                    if (options.trace && embree)
+                    {
+                        RunTraces(api, backend.name, device, options, source, grid, scene, kEmbreeIntersector, results);
+                    }
+                    else if (options.trace)
+                    {
+                        for (auto const& config : kIntersectors)
+                        {
+                            RunTraces(api, backend.name, device, options, source, grid, scene, config, results);
+                        }
+                    }
+                }
+            }
+        }
+        catch (Exception& e)
+        {
+            std::cerr << backend.name << ": " << e.what() << "\n";
+            IntersectionApi::Delete(api);
+            return EXIT_FAILURE;
+        }
+
+        IntersectionApi::Delete(api);
+    }
+
+    std::ofstream out(options.output);
+    WriteJson(out, options, results, builds);
+    std::cout << "Results written to " << options.output << "\n";
+
+    return out ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1044,51 +1044,520 @@ void ScatterKeysAndValues(// Number of bits to shift
 }
 
 
-__kernel void compact_int(__global int* in_predicate, __global int* in_address,
-    __global int* in_input, uint in_size,
-    __global int* out_output)
+// Compact elements with non-zero predicate, the second version also stores the new size
+#define DEFINE_COMPACT(type)\
+__kernel void compact_##type(__global int* in_predicate, __global int* in_address,\
+    __global type* in_input, uint in_size,\
+    __global type* out_output)\
+{\
+    int global_id = get_global_id(0);\
+    if (global_id < in_size)\
+    {\
+        if (in_predicate[global_id])\
+        {\
+            out_output[in_address[global_id]] = in_input[global_id];\
+        }\
+    }\
+}\
+__kernel void compact_##type##_1(__global int* in_predicate, __global int* in_address,\
+    __global type* in_input, uint in_size,\
+    __global type* out_output,\
+    __global int* out_size)\
+{\
+    int global_id = get_global_id(0);\
+    if (global_id < in_size)\
+    {\
+        if (in_predicate[global_id])\
+        {\
+            out_output[in_address[global_id]] = in_input[global_id];\
+        }\
+    }\
+    if (global_id == 0)\
+    {\
+        *out_size = in_address[in_size - 1] + in_predicate[in_size - 1];\
+    }\
+}
+
+DEFINE_COMPACT(int)
+DEFINE_COMPACT(long)
+
+__kernel void copy(__global int4* in_input,
+    uint  in_size,
+    __global int4* out_output)
+{
+    int global_id = get_global_id(0);
+    int4 value = safe_load_int4(in_input, global_id, in_size);
+    safe_store_int4(value, out_output, global_id, in_size);
+}
+
+#define REDUCE_GROUP_SIZE 64
+
+// Min and max of the floats, launched twice: over the input with pairs = 0
+// and over per group (min, max) pairs of the first pass with a single group
+__kernel
+__attribute__((reqd_work_group_size(REDUCE_GROUP_SIZE, 1, 1)))
+void reduce_min_max_float(__global float const* restrict in_input,
+    uint in_size,
+    int pairs,
+    __global float2* restrict out_output)
 {
+    __local float lds_min[REDUCE_GROUP_SIZE];
+    __local float lds_max[REDUCE_GROUP_SIZE];
+
     int global_id = get_global_id(0);
-    int group_id = get_group_id(0);
+    int local_id = get_local_id(0);
+
+    float vmin = INFINITY;
+    float vmax = -INFINITY;
+
+    for (uint i = global_id; i < in_size; i += get_global_size(0))
+    {
+        vmin = min(vmin, pairs ? in_input[2 * i] : in_input[i]);
+        vmax = max(vmax, pairs ? in_input[2 * i + 1] : in_input[i]);
+    }
+
+    lds_min[local_id] = vmin;
+    lds_max[local_id] = vmax;
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-    if (global_id < in_size)
+    for (int stride = REDUCE_GROUP_SIZE / 2; stride > 0; stride >>= 1)
     {
-        if (in_predicate[global_id])
+        if (local_id < stride)
         {
-            out_output[in_address[global_id]] = in_input[global_id];
+            lds_min[local_id] = min(lds_min[local_id], lds_min[local_id + stride]);
+            lds_max[local_id] = max(lds_max[local_id], lds_max[local_id + stride]);
         }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (local_id == 0)
+    {
+        out_output[get_group_id(0)] = (float2)(lds_min[0], lds_max[0]);
     }
 }
 
-__kernel void compact_int_1(__global int* in_predicate, __global int* in_address,
-    __global int* in_input, uint in_size,
-    __global int* out_output,
-    __global int* out_size)
+// Union of bounding boxes stored as (pmin, pmax) float4 pairs,
+// launched twice: over the input and over per group results with a single group
+__kernel
+__attribute__((reqd_work_group_size(REDUCE_GROUP_SIZE, 1, 1)))
+void reduce_bbox(__global float4 const* restrict in_input,
+    uint in_size,
+    __global float4* restrict out_output)
 {
+    __local float4 lds_min[REDUCE_GROUP_SIZE];
+    __local float4 lds_max[REDUCE_GROUP_SIZE];
+
     int global_id = get_global_id(0);
-    int group_id = get_group_id(0);
+    int local_id = get_local_id(0);
+
+    float4 pmin = (float4)(INFINITY, INFINITY, INFINITY, INFINITY);
+    float4 pmax = (float4)(-INFINITY, -INFINITY, -INFINITY, -INFINITY);
+
+    for (uint i = global_id; i < in_size; i += get_global_size(0))
+    {
+        pmin = min(pmin, in_input[2 * i]);
+        pmax = max(pmax, in_input[2 * i + 1]);
+    }
+
+    lds_min[local_id] = pmin;
+    lds_max[local_id] = pmax;
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-    if (global_id < in_size)
+    for (int stride = REDUCE_GROUP_SIZE / 2; stride > 0; stride >>= 1)
     {
-        if (in_predicate[global_id])
+        if (local_id < stride)
         {
-            out_output[in_address[global_id]] = in_input[global_id];
+            lds_min[local_id] = min(lds_min[local_id], lds_min[local_id + stride]);
+            lds_max[local_id] = max(lds_max[local_id], lds_max[local_id + stride]);
         }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
 
-    if (global_id == 0)
+    if (local_id == 0)
     {
-        *out_size = in_address[in_size - 1] + in_predicate[in_size - 1];
+        out_output[2 * get_group_id(0)] = lds_min[0];
+        out_output[2 * get_group_id(0) + 1] = lds_max[0];
     }
 }
 
-__kernel void copy(__global int4* in_input,
-    uint  in_size,
-    __global int4* out_output)
+// -------------------- DECOUPLED LOOKBACK --------------------------
+// Single pass scan and Onesweep radix sort. Tiles are assigned to groups in
+// the order they start, so a group only waits for tiles of groups which are
+// already running. Each tile publishes its aggregate and then its inclusive
+// prefix once the prefixes of the preceding tiles are known.
+#define LOOKBACK_GROUP_SIZE 64
+#define LOOKBACK_ELEMS_PER_ITEM 8
+#define LOOKBACK_TILE_SIZE (LOOKBACK_GROUP_SIZE * LOOKBACK_ELEMS_PER_ITEM)
+
+// Tile states
+#define LOOKBACK_FLAG_AGGREGATE (1u << 30)
+#define LOOKBACK_FLAG_PREFIX (2u << 30)
+#define LOOKBACK_VALUE_MASK ((1u << 30) - 1)
+
+// Exclusive scan in a single pass, tile_states[0] is the tile counter
+// and tile_states[1 + tile] are the tile flags, all zero on launch
+#define DEFINE_SCAN_EXCLUSIVE_LOOKBACK(type)\
+__kernel\
+__attribute__((reqd_work_group_size(LOOKBACK_GROUP_SIZE, 1, 1)))\
+void scan_exclusive_lookback_##type(__global type const* in_array,\
+    __global type* out_array,\
+    uint numElems,\
+    __global volatile type* tile_aggregates,\
+    __global volatile type* tile_prefixes,\
+    __global volatile uint* tile_states)\
+{\
+    __local type lds_sums[LOOKBACK_GROUP_SIZE];\
+    __local uint lds_tile;\
+    __local type lds_prefix;\
+    int localid = get_local_id(0);\
+    if (localid == 0)\
+    {\
+        lds_tile = atomic_inc(&tile_states[0]);\
+    }\
+    barrier(CLK_LOCAL_MEM_FENCE);\
+    uint tile = lds_tile;\
+    uint base = tile * LOOKBACK_TILE_SIZE + localid * LOOKBACK_ELEMS_PER_ITEM;\
+    type values[LOOKBACK_ELEMS_PER_ITEM];\
+    type sum = 0;\
+    for (int i = 0; i < LOOKBACK_ELEMS_PER_ITEM; ++i)\
+    {\
+        type value = base + i < numElems ? in_array[base + i] : 0;\
+        values[i] = sum;\
+        sum += value;\
+    }\
+    lds_sums[localid] = sum;\
+    barrier(CLK_LOCAL_MEM_FENCE);\
+    for (int offset = 1; offset < LOOKBACK_GROUP_SIZE; offset <<= 1)\
+    {\
+        type other = localid >= offset ? lds_sums[localid - offset] : 0;\
+        barrier(CLK_LOCAL_MEM_FENCE);\
+        lds_sums[localid] += other;\
+        barrier(CLK_LOCAL_MEM_FENCE);\
+    }\
+    if (localid == 0)\
+    {\
+        type aggregate = lds_sums[LOOKBACK_GROUP_SIZE - 1];\
+        type prefix = 0;\
+        if (tile == 0)\
+        {\
+            tile_prefixes[0] = aggregate;\
+            mem_fence(CLK_GLOBAL_MEM_FENCE);\
+            atomic_xchg(&tile_states[1], LOOKBACK_FLAG_PREFIX);\
+        }\
+        else\
+        {\
+            tile_aggregates[tile] = aggregate;\
+            mem_fence(CLK_GLOBAL_MEM_FENCE);\
+            atomic_xchg(&tile_states[1 + tile], LOOKBACK_FLAG_AGGREGATE);\
+            int j = tile - 1;\
+            for (;;)\
+            {\
+                uint flag = atomic_or(&tile_states[1 + j], 0);\
+                if (flag == LOOKBACK_FLAG_PREFIX)\
+                {\
+                    mem_fence(CLK_GLOBAL_MEM_FENCE);\
+                    prefix += tile_prefixes[j];\
+                    break;\
+                }\
+                else if (flag == LOOKBACK_FLAG_AGGREGATE)\
+                {\
+                    mem_fence(CLK_GLOBAL_MEM_FENCE);\
+                    prefix += tile_aggregates[j];\
+                    --j;\
+                }\
+            }\
+            tile_prefixes[tile] = prefix + aggregate;\
+            mem_fence(CLK_GLOBAL_MEM_FENCE);\
+            atomic_xchg(&tile_states[1 + tile], LOOKBACK_FLAG_PREFIX);\
+        }\
+        lds_prefix = prefix;\
+    }\
+    barrier(CLK_LOCAL_MEM_FENCE);\
+    type item_prefix = lds_prefix + (localid > 0 ? lds_sums[localid - 1] : 0);\
+    for (int i = 0; i < LOOKBACK_ELEMS_PER_ITEM; ++i)\
+    {\
+        if (base + i < numElems)\
+        {\
+            out_array[base + i] = item_prefix + values[i];\
+        }\
+    }\
+}
+
+DEFINE_SCAN_EXCLUSIVE_LOOKBACK(int)
+DEFINE_SCAN_EXCLUSIVE_LOOKBACK(float)
+
+// Onesweep radix sort with 8-bit digits, keys are key_words 32-bit words
+// and values are 32-bit
+#define ONESWEEP_RADIX_BITS 8
+#define ONESWEEP_RADIX (1 << ONESWEEP_RADIX_BITS)
+#define ONESWEEP_MAX_PASSES 8
+#define ONESWEEP_KEYS_PER_ITEM 16
+#define ONESWEEP_TILE_SIZE (LOOKBACK_GROUP_SIZE * ONESWEEP_KEYS_PER_ITEM)
+
+// Key types, keys are sorted as unsigned after flipping the sign bit for
+// signed keys and all the bits of negative floats
+#define ONESWEEP_KEY_UNSIGNED 0
+#define ONESWEEP_KEY_SIGNED 1
+#define ONESWEEP_KEY_FLOAT 2
+
+ulong onesweep_sign_bit(int key_words)
 {
-    int global_id = get_global_id(0);
-    int4 value = safe_load_int4(in_input, global_id, in_size);
-    safe_store_int4(value, out_output, global_id, in_size);
+    return key_words == 2 ? 0x8000000000000000UL : 0x80000000UL;
+}
+
+ulong onesweep_key_mask(int key_words)
+{
+    return key_words == 2 ? 0xFFFFFFFFFFFFFFFFUL : 0xFFFFFFFFUL;
+}
+
+// Load a key mapped to its unsigned order
+ulong onesweep_load_key(__global uint const* keys, uint idx, int key_words, int key_type)
+{
+    ulong key = key_words == 2 ? (((ulong)keys[2 * idx + 1] << 32) | keys[2 * idx]) : keys[idx];
+    ulong sign = onesweep_sign_bit(key_words);
+
+    if (key_type == ONESWEEP_KEY_SIGNED)
+    {
+        key ^= sign;
+    }
+    else if (key_type == ONESWEEP_KEY_FLOAT)
+    {
+        key = (key & sign) ? (~key & onesweep_key_mask(key_words)) : (key | sign);
+    }
+
+    return key;
+}
+
+// Store a key mapped back from its unsigned order
+void onesweep_store_key(__global uint* keys, uint idx, ulong key, int key_words, int key_type)
+{
+    ulong sign = onesweep_sign_bit(key_words);
+
+    if (key_type == ONESWEEP_KEY_SIGNED)
+    {
+        key ^= sign;
+    }
+    else if (key_type == ONESWEEP_KEY_FLOAT)
+    {
+        key = (key & sign) ? (key & ~sign) : (~key & onesweep_key_mask(key_words));
+    }
+
+    if (key_words == 2)
+    {
+        keys[2 * idx] = (uint)key;
+        keys[2 * idx + 1] = (uint)(key >> 32);
+    }
+    else
+    {
+        keys[idx] = (uint)key;
+    }
+}
+
+// Digit counts of all the passes in a single read of the keys,
+// out_histograms holds num_passes * ONESWEEP_RADIX zeroed counters
+__kernel
+__attribute__((reqd_work_group_size(LOOKBACK_GROUP_SIZE, 1, 1)))
+void onesweep_histogram(__global uint const* restrict in_keys,
+    uint numElems,
+    int key_words,
+    int key_type,
+    __global volatile uint* out_histograms)
+{
+    __local uint lds_histograms[ONESWEEP_MAX_PASSES * ONESWEEP_RADIX];
+
+    int localid = get_local_id(0);
+    int num_passes = key_words * 32 / ONESWEEP_RADIX_BITS;
+
+    for (int i = localid; i < num_passes * ONESWEEP_RADIX; i += LOOKBACK_GROUP_SIZE)
+    {
+        lds_histograms[i] = 0;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint i = get_global_id(0); i < numElems; i += get_global_size(0))
+    {
+        ulong key = onesweep_load_key(in_keys, i, key_words, key_type);
+
+        for (int pass = 0; pass < num_passes; ++pass)
+        {
+            uint digit = (uint)(key >> (pass * ONESWEEP_RADIX_BITS)) & (ONESWEEP_RADIX - 1);
+            atomic_inc(&lds_histograms[pass * ONESWEEP_RADIX + digit]);
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = localid; i < num_passes * ONESWEEP_RADIX; i += LOOKBACK_GROUP_SIZE)
+    {
+        if (lds_histograms[i])
+        {
+            atomic_add(&out_histograms[i], lds_histograms[i]);
+        }
+    }
+}
+
+// Exclusive scan of the digit counts, a work-item per pass
+__kernel void onesweep_scan_histograms(__global uint* histograms,
+    int num_passes)
+{
+    int pass = get_global_id(0);
+
+    if (pass < num_passes)
+    {
+        uint sum = 0;
+        for (int i = 0; i < ONESWEEP_RADIX; ++i)
+        {
+            uint count = histograms[pass * ONESWEEP_RADIX + i];
+            histograms[pass * ONESWEEP_RADIX + i] = sum;
+            sum += count;
+        }
+    }
+}
+
+// Stable scatter of a single pass. tile_states[0] is the tile counter followed by
+// ONESWEEP_RADIX digit states per tile, all zero on launch. Digit states pack
+// the flag with the count, which fits as long as numElems < 2^30.
+__kernel
+__attribute__((reqd_work_group_size(LOOKBACK_GROUP_SIZE, 1, 1)))
+void onesweep_scatter(__global uint const* restrict in_keys,
+    __global int const* restrict in_values,
+    uint numElems,
+    int key_words,
+    int key_type,
+    // Values are optional
+    int with_values,
+    int pass,
+    // Scanned digit counts of all the passes
+    __global uint const* restrict in_digit_offsets,
+    __global volatile uint* tile_states,
+    __global uint* restrict out_keys,
+    __global int* restrict out_values)
+{
+    __local uint lds_digits[LOOKBACK_GROUP_SIZE];
+    __local uint lds_counts[ONESWEEP_RADIX];
+    __local uint lds_prefixes[ONESWEEP_RADIX];
+    __local uint lds_tile;
+
+    int localid = get_local_id(0);
+    uint shift = pass * ONESWEEP_RADIX_BITS;
+
+    if (localid == 0)
+    {
+        lds_tile = atomic_inc(&tile_states[0]);
+    }
+
+    for (int d = localid; d < ONESWEEP_RADIX; d += LOOKBACK_GROUP_SIZE)
+    {
+        lds_counts[d] = 0;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    uint tile = lds_tile;
+    __global volatile uint* digit_states = tile_states + 1;
+
+    // Rank keys within the tile. Keys are processed in rounds of consecutive
+    // keys, so ranking each round in work-item order keeps the sort stable.
+    ulong keys[ONESWEEP_KEYS_PER_ITEM];
+    uint ranks[ONESWEEP_KEYS_PER_ITEM];
+
+    for (int r = 0; r < ONESWEEP_KEYS_PER_ITEM; ++r)
+    {
+        uint idx = tile * ONESWEEP_TILE_SIZE + r * LOOKBACK_GROUP_SIZE + localid;
+        uint digit = ONESWEEP_RADIX;
+
+        if (idx < numElems)
+        {
+            keys[r] = onesweep_load_key(in_keys, idx, key_words, key_type);
+            digit = (uint)(keys[r] >> shift) & (ONESWEEP_RADIX - 1);
+        }
+
+        lds_digits[localid] = digit;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        // Same digits of lower work-items, the last one updates the count
+        uint below = 0;
+        bool last = true;
+        for (int j = 0; j < LOOKBACK_GROUP_SIZE; ++j)
+        {
+            bool same = lds_digits[j] == digit;
+            below += (same && j < localid) ? 1 : 0;
+            last = last && !(same && j > localid);
+        }
+
+        if (idx < numElems)
+        {
+            ranks[r] = lds_counts[digit] + below;
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        if (idx < numElems && last)
+        {
+            lds_counts[digit] += below + 1;
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    // Publish aggregates first so that following tiles are not held back
+    for (int d = localid; d < ONESWEEP_RADIX; d += LOOKBACK_GROUP_SIZE)
+    {
+        uint flag = tile == 0 ? LOOKBACK_FLAG_PREFIX : LOOKBACK_FLAG_AGGREGATE;
+        atomic_xchg(&digit_states[tile * ONESWEEP_RADIX + d], flag | lds_counts[d]);
+    }
+
+    for (int d = localid; d < ONESWEEP_RADIX; d += LOOKBACK_GROUP_SIZE)
+    {
+        uint prefix = 0;
+
+        if (tile > 0)
+        {
+            int j = tile - 1;
+            for (;;)
+            {
+                uint state = atomic_or(&digit_states[j * ONESWEEP_RADIX + d], 0);
+
+                if (state & LOOKBACK_FLAG_PREFIX)
+                {
+                    prefix += state & LOOKBACK_VALUE_MASK;
+                    break;
+                }
+                else if (state & LOOKBACK_FLAG_AGGREGATE)
+                {
+                    prefix += state & LOOKBACK_VALUE_MASK;
+                    --j;
+                }
+            }
+
+            atomic_xchg(&digit_states[tile * ONESWEEP_RADIX + d], LOOKBACK_FLAG_PREFIX | (prefix + lds_counts[d]));
+        }
+
+        lds_prefixes[d] = prefix;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int r = 0; r < ONESWEEP_KEYS_PER_ITEM; ++r)
+    {
+        uint idx = tile * ONESWEEP_TILE_SIZE + r * LOOKBACK_GROUP_SIZE + localid;
+
+        if (idx < numElems)
+        {
+            uint digit = (uint)(keys[r] >> shift) & (ONESWEEP_RADIX - 1);
+            uint dst = in_digit_offsets[pass * ONESWEEP_RADIX + digit] + lds_prefixes[digit] + ranks[r];
+
+            onesweep_store_key(out_keys, dst, keys[r], key_words, key_type);
+
+            if (with_values)
+            {
+                out_values[dst] = in_values[idx];
+            }
+        }
+    }
 }
 
 
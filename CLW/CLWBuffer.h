@@ -47,11 +47,17 @@ public:
     static CLWBuffer<T> Create(cl_context context, cl_mem_flags flags, size_t elementCount);
     static CLWBuffer<T> Create(cl_context context, cl_mem_flags flags, size_t elementCount, void* data);
     static CLWBuffer<T> CreateFromClBuffer(cl_mem buffer);
+    // Wrap a buffer holding at least elementCount elements, no size query is made
+    static CLWBuffer<T> CreateFromClBuffer(cl_mem buffer, size_t elementCount);
 
     CLWBuffer() : elementCount_(0){}
     virtual ~CLWBuffer();
     
     size_t GetElementCount() const { return elementCount_; }
+
+    // View of a range of the buffer sharing its storage, offset has to respect
+    // CL_DEVICE_MEM_BASE_ADDR_ALIGN and the buffer can't be a sub-buffer itself
+    CLWBuffer<T> CreateSubBuffer(cl_mem_flags flags, size_t offset, size_t elementCount) const;
     
     operator ParameterHolder() const
     {
@@ -60,13 +66,13 @@ public:
     
 private:
     CLWEvent WriteDeviceBuffer(CLWCommandQueue cmdQueue, T const* hostBuffer, size_t elemCount);
-    CLWEvent WriteDeviceBuffer(CLWCommandQueue cmdQueue, T const* hostBuffer, size_t offset, size_t elemCount);
+    CLWEvent WriteDeviceBuffer(CLWCommandQueue cmdQueue, T const* hostBuffer, size_t offset, size_t elemCount, std::vector<CLWEvent> const& events = std::vector<CLWEvent>());
     CLWEvent FillDeviceBuffer(CLWCommandQueue cmdQueue, T const& val, size_t elemCount);
     CLWEvent ReadDeviceBuffer(CLWCommandQueue cmdQueue, T* hostBuffer, size_t elemCount);
-    CLWEvent ReadDeviceBuffer(CLWCommandQueue cmdQueue, T* hostBuffer, size_t offset, size_t elemCount);
+    CLWEvent ReadDeviceBuffer(CLWCommandQueue cmdQueue, T* hostBuffer, size_t offset, size_t elemCount, std::vector<CLWEvent> const& events = std::vector<CLWEvent>());
     CLWEvent MapDeviceBuffer(CLWCommandQueue cmdQueue, cl_map_flags flags, T** mappedData);
-    CLWEvent MapDeviceBuffer(CLWCommandQueue cmdQueue, cl_map_flags flags, size_t offset, size_t elemCount, T** mappedData);
-    CLWEvent UnmapDeviceBuffer(CLWCommandQueue cmdQueue, T* mappedData);
+    CLWEvent MapDeviceBuffer(CLWCommandQueue cmdQueue, cl_map_flags flags, size_t offset, size_t elemCount, T** mappedData, std::vector<CLWEvent> const& events = std::vector<CLWEvent>());
+    CLWEvent UnmapDeviceBuffer(CLWCommandQueue cmdQueue, T* mappedData, std::vector<CLWEvent> const& events = std::vector<CLWEvent>());
 
     CLWBuffer(cl_mem buffer, size_t elementCount);
 
@@ -115,6 +121,26 @@ template <typename T> CLWBuffer<T> CLWBuffer<T>::CreateFromClBuffer(cl_mem buffe
     return CLWBuffer(buffer, bufferSize / sizeof(T));
 }
 
+template <typename T> CLWBuffer<T> CLWBuffer<T>::CreateFromClBuffer(cl_mem buffer, size_t elementCount)
+{
+    return CLWBuffer(buffer, elementCount);
+}
+
+template <typename T> CLWBuffer<T> CLWBuffer<T>::CreateSubBuffer(cl_mem_flags flags, size_t offset, size_t elementCount) const
+{
+    cl_int status = CL_SUCCESS;
+    cl_buffer_region region = { offset * sizeof(T), elementCount * sizeof(T) };
+    cl_mem subBuffer = clCreateSubBuffer(*this, flags, CL_BUFFER_CREATE_TYPE_REGION, &region, &status);
+
+    ThrowIf(status != CL_SUCCESS, status, "clCreateSubBuffer failed");
+
+    CLWBuffer<T> buffer(subBuffer, elementCount);
+
+    clReleaseMemObject(subBuffer);
+
+    return buffer;
+}
+
 template <typename T> CLWBuffer<T>::CLWBuffer(cl_mem buffer, size_t elementCount)
 : ReferenceCounter<cl_mem, clRetainMemObject, clReleaseMemObject>(buffer)
 , elementCount_(elementCount)
@@ -137,11 +163,12 @@ template <typename T> CLWEvent CLWBuffer<T>::WriteDeviceBuffer(CLWCommandQueue c
     return CLWEvent::Create(event);
 }
 
-template <typename T> CLWEvent CLWBuffer<T>::WriteDeviceBuffer(CLWCommandQueue cmdQueue, T const* hostBuffer, size_t offset, size_t elemCount)
+template <typename T> CLWEvent CLWBuffer<T>::WriteDeviceBuffer(CLWCommandQueue cmdQueue, T const* hostBuffer, size_t offset, size_t elemCount, std::vector<CLWEvent> const& events)
 {
     cl_int status = CL_SUCCESS;
     cl_event event = nullptr;
-    status = clEnqueueWriteBuffer(cmdQueue, *this, false, sizeof(T)*offset, sizeof(T)*elemCount, hostBuffer, 0, nullptr, &event);
+    std::vector<cl_event> waitList = CLWEvent::GetWaitList(events);
+    status = clEnqueueWriteBuffer(cmdQueue, *this, false, sizeof(T)*offset, sizeof(T)*elemCount, hostBuffer, (cl_uint)waitList.size(), waitList.empty() ? nullptr : &waitList[0], &event);
 
     ThrowIf(status != CL_SUCCESS, status, "clEnqueueWriteBuffer failed");
 
@@ -159,11 +186,12 @@ template <typename T> CLWEvent CLWBuffer<T>::ReadDeviceBuffer(CLWCommandQueue cm
     return CLWEvent::Create(event);
 }
 
-template <typename T> CLWEvent CLWBuffer<T>::ReadDeviceBuffer(CLWCommandQueue cmdQueue, T* hostBuffer, size_t offset, size_t elemCount)
+template <typename T> CLWEvent CLWBuffer<T>::ReadDeviceBuffer(CLWCommandQueue cmdQueue, T* hostBuffer, size_t offset, size_t elemCount, std::vector<CLWEvent> const& events)
 {
     cl_int status = CL_SUCCESS;
     cl_event event = nullptr;
-    status = clEnqueueReadBuffer(cmdQueue, *this, false, sizeof(T)*offset, sizeof(T)*elemCount, hostBuffer, 0, nullptr, &event);
+    std::vector<cl_event> waitList = CLWEvent::GetWaitList(events);
+    status = clEnqueueReadBuffer(cmdQueue, *this, false, sizeof(T)*offset, sizeof(T)*elemCount, hostBuffer, (cl_uint)waitList.size(), waitList.empty() ? nullptr : &waitList[0], &event);
     
     ThrowIf(status != CL_SUCCESS, status, "clEnqueueReadBuffer failed");
     
@@ -186,12 +214,13 @@ template <typename T> CLWEvent CLWBuffer<T>::MapDeviceBuffer(CLWCommandQueue cmd
     return CLWEvent::Create(event);
 }
 
-template <typename T> CLWEvent CLWBuffer<T>::MapDeviceBuffer(CLWCommandQueue cmdQueue, cl_map_flags flags, size_t offset, size_t elemCount, T** mappedData)
+template <typename T> CLWEvent CLWBuffer<T>::MapDeviceBuffer(CLWCommandQueue cmdQueue, cl_map_flags flags, size_t offset, size_t elemCount, T** mappedData, std::vector<CLWEvent> const& events)
 {
     cl_int status = CL_SUCCESS;
     cl_event event = nullptr;
+    std::vector<cl_event> waitList = CLWEvent::GetWaitList(events);
     
-    T* data = (T*)clEnqueueMapBuffer(cmdQueue, *this, false, flags, sizeof(T) * offset, sizeof(T)*elemCount, 0, nullptr, &event, &status);
+    T* data = (T*)clEnqueueMapBuffer(cmdQueue, *this, false, flags, sizeof(T) * offset, sizeof(T)*elemCount, (cl_uint)waitList.size(), waitList.empty() ? nullptr : &waitList[0], &event, &status);
     
     ThrowIf(status != CL_SUCCESS, status, "clEnqueueMapBuffer failed");
     
@@ -200,12 +229,13 @@ template <typename T> CLWEvent CLWBuffer<T>::MapDeviceBuffer(CLWCommandQueue cmd
     return CLWEvent::Create(event);
 }
 
-template <typename T> CLWEvent CLWBuffer<T>::UnmapDeviceBuffer(CLWCommandQueue cmdQueue, T* mappedData)
+template <typename T> CLWEvent CLWBuffer<T>::UnmapDeviceBuffer(CLWCommandQueue cmdQueue, T* mappedData, std::vector<CLWEvent> const& events)
 {
     cl_int status = CL_SUCCESS;
     cl_event event = nullptr;
+    std::vector<cl_event> waitList = CLWEvent::GetWaitList(events);
 
-    status = clEnqueueUnmapMemObject(cmdQueue, *this,  mappedData, 0, nullptr, &event);
+    status = clEnqueueUnmapMemObject(cmdQueue, *this,  mappedData, (cl_uint)waitList.size(), waitList.empty() ? nullptr : &waitList[0], &event);
 
     ThrowIf(status != CL_SUCCESS, status, "clEnqueueUnmapMemObject failed");
     
@@ -24,15 +24,42 @@ THE SOFTWARE.
 #include "CLWDevice.h"
 #include "CLWExcept.h"
 
+// cl_khr_priority_hints, missing from older headers
+#ifndef CL_QUEUE_PRIORITY_KHR
+#define CL_QUEUE_PRIORITY_KHR 0x1096
+#define CL_QUEUE_PRIORITY_HIGH_KHR (1 << 0)
+#define CL_QUEUE_PRIORITY_MED_KHR (1 << 1)
+#define CL_QUEUE_PRIORITY_LOW_KHR (1 << 2)
+#endif
+
 // Disable OCL 2.0 deprecations
 #pragma warning(push)
 #pragma warning(disable:4996)
 
-CLWCommandQueue CLWCommandQueue::Create(CLWDevice device, CLWContext context)
+CLWCommandQueue CLWCommandQueue::Create(CLWDevice device, CLWContext context, bool outOfOrder, Priority priority)
 {
     cl_int status = CL_SUCCESS;
 
-    cl_command_queue commandQueue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
+    cl_command_queue_properties properties = CL_QUEUE_PROFILING_ENABLE;
+
+    if (outOfOrder)
+        properties |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+
+    cl_command_queue commandQueue = nullptr;
+
+#ifdef CL_VERSION_2_0
+    // Priority hints are only passed through the property list of OpenCL 2.0
+    if (priority != kPriorityDefault && device.HasQueuePriorityHints())
+    {
+        cl_queue_properties const hint = priority == kPriorityHigh ? CL_QUEUE_PRIORITY_HIGH_KHR : CL_QUEUE_PRIORITY_LOW_KHR;
+        cl_queue_properties const queueProperties[] = { CL_QUEUE_PROPERTIES, properties, CL_QUEUE_PRIORITY_KHR, hint, 0 };
+        commandQueue = clCreateCommandQueueWithProperties(context, device, queueProperties, &status);
+    }
+    else
+#endif
+    {
+        commandQueue = clCreateCommandQueue(context, device, properties, &status);
+    }
 
     ThrowIf(status != CL_SUCCESS, status, "clCreateCommandQueue failed");
 
@@ -63,6 +90,16 @@ CLWCommandQueue::~CLWCommandQueue()
 {
 }
 
+bool CLWCommandQueue::IsOutOfOrder() const
+{
+    cl_command_queue_properties properties = 0;
+    cl_int status = clGetCommandQueueInfo(*this, CL_QUEUE_PROPERTIES, sizeof(properties), &properties, nullptr);
+
+    ThrowIf(status != CL_SUCCESS, status, "clGetCommandQueueInfo failed");
+
+    return (properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0;
+}
+
 #pragma warning(pop)
 
 
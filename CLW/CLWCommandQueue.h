@@ -39,15 +39,25 @@ class CLWDevice;
 class CLWCommandQueue : public ReferenceCounter<cl_command_queue, clRetainCommandQueue, clReleaseCommandQueue>
 {
 public:
-    static CLWCommandQueue Create(CLWDevice device, CLWContext context);
+    // Scheduling priority hints, applied on devices with cl_khr_priority_hints only
+    enum Priority
+    {
+        kPriorityDefault,
+        kPriorityHigh,
+        kPriorityLow
+    };
+
+    // Commands of an out of order queue are only ordered by their wait lists
+    static CLWCommandQueue Create(CLWDevice device, CLWContext context, bool outOfOrder = false, Priority priority = kPriorityDefault);
     static CLWCommandQueue Create(cl_command_queue queue);
     
     
     CLWCommandQueue();
     virtual          ~CLWCommandQueue();
     
+    bool IsOutOfOrder() const;
     
-    
+
 private:
     CLWCommandQueue(cl_command_queue cmdQueue);
 };
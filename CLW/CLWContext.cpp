@@ -28,7 +28,7 @@ THE SOFTWARE.
 
 #include <algorithm>
 
-CLWContext CLWContext::Create(std::vector<CLWDevice> const& devices, cl_context_properties* props)
+CLWContext CLWContext::Create(std::vector<CLWDevice> const& devices, cl_context_properties* props, bool outOfOrder)
 {
     std::vector<cl_device_id> deviceIds;
     std::for_each(devices.cbegin(), devices.cend(),
@@ -40,7 +40,7 @@ CLWContext CLWContext::Create(std::vector<CLWDevice> const& devices, cl_context_
     cl_context ctx = clCreateContext(props, static_cast<cl_int>(deviceIds.size()), &deviceIds[0], nullptr, nullptr, &status);
     ThrowIf(status != CL_SUCCESS, status, "clCreateContext failed");
     
-    CLWContext context(ctx, devices);
+    CLWContext context(ctx, devices, outOfOrder);
     
     clReleaseContext(ctx);
     
@@ -96,12 +96,24 @@ CLWEvent CLWContext::Launch1D(unsigned int idx, size_t globalSize, size_t localS
     size_t wgLocalSize = localSize;
     size_t wgGlobalSize = globalSize;
     cl_event event = nullptr;
-    std::vector<cl_event> eventsToWait(events.size());
+    std::vector<cl_event> eventsToWait = CLWEvent::GetWaitList(events);
 
-    for (unsigned i = 0; i < events.size(); ++i)
-        eventsToWait[i] = events[i];
+    status = clEnqueueNDRangeKernel(commandQueues_[idx], kernel, 1, nullptr, &wgGlobalSize, &wgLocalSize, (cl_uint)eventsToWait.size(), eventsToWait.empty() ? nullptr : &eventsToWait[0], &event);
+    ThrowIf(status != CL_SUCCESS, status, "clEnqueueNDRangeKernel failed");
 
-    status = clEnqueueNDRangeKernel(commandQueues_[idx], kernel, 2, nullptr, &wgGlobalSize, &wgLocalSize, (cl_uint)eventsToWait.size(), &eventsToWait[0], &event);
+    return CLWEvent::Create(event);
+}
+
+CLWEvent CLWContext::Launch1D(unsigned int idx, size_t globalOffset, size_t globalSize, size_t localSize, cl_kernel kernel, std::vector<CLWEvent> const& events)
+{
+    cl_int status = CL_SUCCESS;
+    size_t wgOffset = globalOffset;
+    size_t wgLocalSize = localSize;
+    size_t wgGlobalSize = globalSize;
+    cl_event event = nullptr;
+    std::vector<cl_event> eventsToWait = CLWEvent::GetWaitList(events);
+
+    status = clEnqueueNDRangeKernel(commandQueues_[idx], kernel, 1, &wgOffset, &wgGlobalSize, &wgLocalSize, (cl_uint)eventsToWait.size(), eventsToWait.empty() ? nullptr : &eventsToWait[0], &event);
     ThrowIf(status != CL_SUCCESS, status, "clEnqueueNDRangeKernel failed");
 
     return CLWEvent::Create(event);
@@ -186,18 +198,18 @@ CLWEvent CLWContext::Launch3D(unsigned int idx, size_t* globalSize, size_t* loca
     return CLWEvent::Create(event);
 }
 
-CLWContext CLWContext::Create(CLWDevice device, cl_context_properties* props)
+CLWContext CLWContext::Create(CLWDevice device, cl_context_properties* props, bool outOfOrder)
 {
     std::vector<CLWDevice> devices;
     devices.push_back(device);
-    return CLWContext::Create(devices, props);
+    return CLWContext::Create(devices, props, outOfOrder);
 }
 
-CLWContext::CLWContext(cl_context context, std::vector<CLWDevice> const& devices)
+CLWContext::CLWContext(cl_context context, std::vector<CLWDevice> const& devices, bool outOfOrder)
 : ReferenceCounter<cl_context, clRetainContext, clReleaseContext>(context)
 , devices_(devices)
 {
-    InitCL();
+    InitCL(outOfOrder);
 }
 
 CLWContext::CLWContext(cl_context context, std::vector<CLWDevice>&& devices)
@@ -243,12 +255,23 @@ CLWDevice CLWContext::GetDevice(unsigned int idx) const
     return devices_[idx];
 }
 
-void CLWContext::InitCL()
+unsigned int CLWContext::GetCommandQueueCount() const
+{
+    return (unsigned int)commandQueues_.size();
+}
+
+unsigned int CLWContext::CreateCommandQueue(unsigned int deviceIdx, bool outOfOrder, CLWCommandQueue::Priority priority)
+{
+    commandQueues_.push_back(CLWCommandQueue::Create(devices_[deviceIdx], *this, outOfOrder, priority));
+    return (unsigned int)commandQueues_.size() - 1;
+}
+
+void CLWContext::InitCL(bool outOfOrder)
 {
     std::for_each(devices_.begin(), devices_.end(),
-                  [this](CLWDevice const& device)
+                  [this, outOfOrder](CLWDevice const& device)
                   {
-                      commandQueues_.push_back(CLWCommandQueue::Create(device, *this));
+                      commandQueues_.push_back(CLWCommandQueue::Create(device, *this, outOfOrder));
                   });
 }
 
@@ -275,6 +298,28 @@ void CLWContext::ReleaseGLObjects(unsigned int idx, std::vector<cl_mem> const& o
 }
 
 
+CLWEvent CLWContext::Marker(unsigned int idx, std::vector<CLWEvent> const& events) const
+{
+    cl_event event = nullptr;
+    std::vector<cl_event> eventsToWait = CLWEvent::GetWaitList(events);
+
+    cl_int status = clEnqueueMarkerWithWaitList(commandQueues_[idx], (cl_uint)eventsToWait.size(), eventsToWait.empty() ? nullptr : &eventsToWait[0], &event);
+    ThrowIf(status != CL_SUCCESS, status, "clEnqueueMarkerWithWaitList failed");
+
+    return CLWEvent::Create(event);
+}
+
+CLWEvent CLWContext::Barrier(unsigned int idx, std::vector<CLWEvent> const& events) const
+{
+    cl_event event = nullptr;
+    std::vector<cl_event> eventsToWait = CLWEvent::GetWaitList(events);
+
+    cl_int status = clEnqueueBarrierWithWaitList(commandQueues_[idx], (cl_uint)eventsToWait.size(), eventsToWait.empty() ? nullptr : &eventsToWait[0], &event);
+    ThrowIf(status != CL_SUCCESS, status, "clEnqueueBarrierWithWaitList failed");
+
+    return CLWEvent::Create(event);
+}
+
 void CLWContext::Finish(unsigned int idx) const
 {
     cl_int status = clFinish(commandQueues_[idx]);
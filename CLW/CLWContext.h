@@ -47,9 +47,10 @@ class CLWContext : public ReferenceCounter<cl_context, clRetainContext, clReleas
 {
 public:
 
-    static CLWContext Create(std::vector<CLWDevice> const&, cl_context_properties* props = nullptr);
+    // Queues are created out of order if requested, see CLWCommandQueue::Create
+    static CLWContext Create(std::vector<CLWDevice> const&, cl_context_properties* props = nullptr, bool outOfOrder = false);
     static CLWContext Create(cl_context context, cl_device_id* device, cl_command_queue* commandQueues, int numDevices);
-    static CLWContext Create(CLWDevice device, cl_context_properties* props = nullptr);
+    static CLWContext Create(CLWDevice device, cl_context_properties* props = nullptr, bool outOfOrder = false);
 
     CLWContext(){}
     virtual                     ~CLWContext();
@@ -64,14 +65,19 @@ public:
     CLWImage2D                  CreateImage2DFromGLTexture(cl_GLint texture) const;
 
     template <typename T> CLWEvent  WriteBuffer(unsigned int idx, CLWBuffer<T> buffer, T const* hostBuffer, size_t elemCount) const;
-    template <typename T> CLWEvent  WriteBuffer(unsigned int idx, CLWBuffer<T> buffer, T const* hostBuffer, size_t offset, size_t elemCount) const;
+    template <typename T> CLWEvent  WriteBuffer(unsigned int idx, CLWBuffer<T> buffer, T const* hostBuffer, size_t offset, size_t elemCount, std::vector<CLWEvent> const& events = std::vector<CLWEvent>()) const;
     template <typename T> CLWEvent  FillBuffer(unsigned int idx, CLWBuffer<T> buffer, T const& val, size_t elemCount) const;
     template <typename T> CLWEvent  ReadBuffer(unsigned int idx,  CLWBuffer<T> buffer, T* hostBuffer, size_t elemCount) const;
-    template <typename T> CLWEvent  ReadBuffer(unsigned int idx,  CLWBuffer<T> buffer, T* hostBuffer, size_t offset, size_t elemCount) const;
+    template <typename T> CLWEvent  ReadBuffer(unsigned int idx,  CLWBuffer<T> buffer, T* hostBuffer, size_t offset, size_t elemCount, std::vector<CLWEvent> const& events = std::vector<CLWEvent>()) const;
     template <typename T> CLWEvent  CopyBuffer(unsigned int idx,  CLWBuffer<T> source, CLWBuffer<T> dest, size_t srcOffset, size_t destOffset, size_t elemCount) const;
     template <typename T> CLWEvent  MapBuffer(unsigned int idx,  CLWBuffer<T> buffer, cl_map_flags flags, T** mappedData) const;
-    template <typename T> CLWEvent  MapBuffer(unsigned int idx,  CLWBuffer<T> buffer, cl_map_flags flags, size_t offset, size_t elemCount, T** mappedData) const;
-    template <typename T> CLWEvent  UnmapBuffer(unsigned int idx,  CLWBuffer<T> buffer, T* mappedData) const;
+    template <typename T> CLWEvent  MapBuffer(unsigned int idx,  CLWBuffer<T> buffer, cl_map_flags flags, size_t offset, size_t elemCount, T** mappedData, std::vector<CLWEvent> const& events = std::vector<CLWEvent>()) const;
+    template <typename T> CLWEvent  UnmapBuffer(unsigned int idx,  CLWBuffer<T> buffer, T* mappedData, std::vector<CLWEvent> const& events = std::vector<CLWEvent>()) const;
+
+    // Event completing once the events and, for an empty list, all the previous commands are complete
+    CLWEvent Marker(unsigned int idx, std::vector<CLWEvent> const& events) const;
+    // Marker which also holds back all the following commands of the queue
+    CLWEvent Barrier(unsigned int idx, std::vector<CLWEvent> const& events) const;
 
     template <size_t globalSize, size_t localSize, typename ... Types> CLWEvent Launch1D(unsigned int idx, cl_kernel kernel, Types ... args);
     template <size_t globalSize, size_t localSize, typename ... Types> CLWEvent Launch1D(unsigned int idx, cl_kernel kernel, CLWEvent depEvent, Types ... args);
@@ -80,6 +86,8 @@ public:
     CLWEvent Launch1D(unsigned int idx, size_t globalSize, size_t localSize, cl_kernel kernel);
     CLWEvent Launch1D(unsigned int idx, size_t globalSize, size_t localSize, cl_kernel kernel, CLWEvent depEvent);
     CLWEvent Launch1D(unsigned int idx, size_t globalSize, size_t localSize, cl_kernel kernel, std::vector<CLWEvent> const& events);
+    // Work items get global IDs starting at globalOffset
+    CLWEvent Launch1D(unsigned int idx, size_t globalOffset, size_t globalSize, size_t localSize, cl_kernel kernel, std::vector<CLWEvent> const& events);
 
     CLWEvent Launch2D(unsigned int idx, size_t* globalSize, size_t* localSize, cl_kernel kernel);
     CLWEvent Launch2D(unsigned int idx, size_t* globalSize, size_t* localSize, cl_kernel kernel, CLWEvent depEvent);
@@ -97,11 +105,14 @@ public:
     void ReleaseGLObjects(unsigned int idx, std::vector<cl_mem> const& objects) const;
 
     CLWCommandQueue GetCommandQueue(unsigned int idx) const { return commandQueues_[idx]; }
+    unsigned int    GetCommandQueueCount() const;
+    // Create an additional queue on the device, returns queue index
+    unsigned int    CreateCommandQueue(unsigned int deviceIdx, bool outOfOrder = false, CLWCommandQueue::Priority priority = CLWCommandQueue::kPriorityDefault);
 
 private:
-    void InitCL();
+    void InitCL(bool outOfOrder = false);
 
-    CLWContext(cl_context context, std::vector<CLWDevice> const&);
+    CLWContext(cl_context context, std::vector<CLWDevice> const&, bool outOfOrder = false);
     CLWContext(cl_context context, std::vector<CLWDevice> const&, std::vector<CLWCommandQueue> const&);
     CLWContext(cl_context context, std::vector<CLWDevice>&&, std::vector<CLWCommandQueue>&&);
     CLWContext(cl_context context, std::vector<CLWDevice>&&);
@@ -127,9 +138,9 @@ template <typename T> CLWEvent  CLWContext::WriteBuffer(unsigned int idx, CLWBuf
     return buffer.WriteDeviceBuffer(commandQueues_[idx], hostBuffer, elemCount);
 }
 
-template <typename T> CLWEvent  CLWContext::WriteBuffer(unsigned int idx, CLWBuffer<T> buffer, T const* hostBuffer, size_t offset, size_t elemCount) const
+template <typename T> CLWEvent  CLWContext::WriteBuffer(unsigned int idx, CLWBuffer<T> buffer, T const* hostBuffer, size_t offset, size_t elemCount, std::vector<CLWEvent> const& events) const
 {
-    return buffer.WriteDeviceBuffer(commandQueues_[idx], hostBuffer, offset, elemCount);
+    return buffer.WriteDeviceBuffer(commandQueues_[idx], hostBuffer, offset, elemCount, events);
 }
 
 template <typename T> CLWEvent  CLWContext::FillBuffer(unsigned int idx, CLWBuffer<T> buffer, T const& val, size_t elemCount) const
@@ -142,9 +153,9 @@ template <typename T> CLWEvent  CLWContext::ReadBuffer(unsigned int idx, CLWBuff
     return buffer.ReadDeviceBuffer(commandQueues_[idx], hostBuffer, elemCount);
 }
 
-template <typename T> CLWEvent  CLWContext::ReadBuffer(unsigned int idx, CLWBuffer<T> buffer, T* hostBuffer, size_t offset, size_t elemCount) const
+template <typename T> CLWEvent  CLWContext::ReadBuffer(unsigned int idx, CLWBuffer<T> buffer, T* hostBuffer, size_t offset, size_t elemCount, std::vector<CLWEvent> const& events) const
 {
-    return buffer.ReadDeviceBuffer(commandQueues_[idx], hostBuffer, offset, elemCount);
+    return buffer.ReadDeviceBuffer(commandQueues_[idx], hostBuffer, offset, elemCount, events);
 }
 
 template <size_t globalSize, size_t localSize, typename ... Types> CLWEvent CLWContext::Launch1D(unsigned int idx, cl_kernel kernel, Types ... args)
@@ -196,14 +207,14 @@ template <typename T> CLWEvent  CLWContext::MapBuffer(unsigned int idx,  CLWBuff
     return buffer.MapDeviceBuffer(commandQueues_[idx], flags, mappedData);
 }
 
-template <typename T> CLWEvent  CLWContext::MapBuffer(unsigned int idx,  CLWBuffer<T> buffer, cl_map_flags flags, size_t offset, size_t elemCount, T** mappedData) const
+template <typename T> CLWEvent  CLWContext::MapBuffer(unsigned int idx,  CLWBuffer<T> buffer, cl_map_flags flags, size_t offset, size_t elemCount, T** mappedData, std::vector<CLWEvent> const& events) const
 {
-    return buffer.MapDeviceBuffer(commandQueues_[idx], flags, offset, elemCount, mappedData);
+    return buffer.MapDeviceBuffer(commandQueues_[idx], flags, offset, elemCount, mappedData, events);
 }
 
-template <typename T> CLWEvent  CLWContext::UnmapBuffer(unsigned int idx,  CLWBuffer<T> buffer, T* mappedData) const
+template <typename T> CLWEvent  CLWContext::UnmapBuffer(unsigned int idx,  CLWBuffer<T> buffer, T* mappedData, std::vector<CLWEvent> const& events) const
 {
-    return buffer.UnmapDeviceBuffer(commandQueues_[idx], mappedData);
+    return buffer.UnmapDeviceBuffer(commandQueues_[idx], mappedData, events);
 }
 
 
@@ -33,15 +33,28 @@ CLWDevice::CLWDevice(cl_device_id id) : ReferenceCounter<cl_device_id, clRetainD
     GetDeviceInfoParameter(*this, CL_DEVICE_EXTENSIONS, extensions_);
     GetDeviceInfoParameter(*this, CL_DEVICE_VENDOR, vendor_);
     GetDeviceInfoParameter(*this, CL_DEVICE_VERSION, version_);
+    GetDeviceInfoParameter(*this, CL_DRIVER_VERSION, driverVersion_);
     GetDeviceInfoParameter(*this, CL_DEVICE_PROFILE, profile_);
     GetDeviceInfoParameter(*this, CL_DEVICE_TYPE, type_);
     
     GetDeviceInfoParameter(*this, CL_DEVICE_MAX_WORK_GROUP_SIZE, maxWorkGroupSize_);
+    GetDeviceInfoParameter(*this, CL_DEVICE_MAX_COMPUTE_UNITS, maxComputeUnits_);
     GetDeviceInfoParameter(*this, CL_DEVICE_GLOBAL_MEM_SIZE, globalMemSize_);
     GetDeviceInfoParameter(*this, CL_DEVICE_LOCAL_MEM_SIZE, localMemSize_);
     GetDeviceInfoParameter(*this, CL_DEVICE_LOCAL_MEM_TYPE, localMemType_);
     GetDeviceInfoParameter(*this, CL_DEVICE_MAX_MEM_ALLOC_SIZE, maxAllocSize_);
     GetDeviceInfoParameter(*this, CL_DEVICE_MIN_DATA_TYPE_ALIGN_SIZE, minAlignSize_);
+    GetDeviceInfoParameter(*this, CL_DEVICE_MEM_BASE_ADDR_ALIGN, memBaseAddrAlign_);
+    GetDeviceInfoParameter(*this, CL_DEVICE_HOST_UNIFIED_MEMORY, hostUnifiedMemory_);
+
+    // OpenCL 1.2 devices fail the query
+    svmCapabilities_ = 0;
+#ifdef CL_VERSION_2_0
+    if (clGetDeviceInfo(*this, CL_DEVICE_SVM_CAPABILITIES, sizeof(svmCapabilities_), &svmCapabilities_, nullptr) != CL_SUCCESS)
+    {
+        svmCapabilities_ = 0;
+    }
+#endif
 }
 
 CLWDevice::~CLWDevice()
@@ -77,6 +90,11 @@ std::string const& CLWDevice::GetVersion() const
     return version_;
 }
 
+std::string const& CLWDevice::GetDriverVersion() const
+{
+    return driverVersion_;
+}
+
 std::string const& CLWDevice::GetProfile() const
 {
     return profile_;
@@ -108,6 +126,11 @@ size_t   CLWDevice::GetMaxWorkGroupSize() const
     return maxWorkGroupSize_;
 }
 
+cl_uint  CLWDevice::GetMaxComputeUnits() const
+{
+    return maxComputeUnits_;
+}
+
 cl_device_id CLWDevice::GetID() const
 {
     return *this;
@@ -123,6 +146,30 @@ cl_uint CLWDevice::GetMinAlignSize() const
     return minAlignSize_;
 }
 
+cl_uint CLWDevice::GetMemBaseAddrAlign() const
+{
+    return memBaseAddrAlign_;
+}
+
+bool CLWDevice::HasHostUnifiedMemory() const
+{
+    return hostUnifiedMemory_ == CL_TRUE;
+}
+
+bool CLWDevice::HasFineGrainBufferSvm() const
+{
+#ifdef CL_VERSION_2_0
+    return (svmCapabilities_ & CL_DEVICE_SVM_FINE_GRAIN_BUFFER) != 0;
+#else
+    return false;
+#endif
+}
+
+bool CLWDevice::HasQueuePriorityHints() const
+{
+    return extensions_.find("cl_khr_priority_hints") != std::string::npos;
+}
+
 bool CLWDevice::HasGlInterop() const
 {
     return extensions_.find("cl_khr_gl_sharing") != std::string::npos
@@ -51,14 +51,24 @@ public:
     cl_ulong GetGlobalMemSize() const;
     cl_ulong GetMaxAllocSize() const;
     size_t   GetMaxWorkGroupSize() const;
+    cl_uint  GetMaxComputeUnits() const;
     cl_device_type GetType() const;
     cl_device_id GetID() const;
     cl_uint GetMinAlignSize() const;
+    // Alignment of the sub-buffer origins, in bits
+    cl_uint GetMemBaseAddrAlign() const;
+    // True for integrated GPUs sharing the memory with the host
+    bool HasHostUnifiedMemory() const;
+    // True for OpenCL 2.0 devices keeping SVM buffers coherent with the host without maps
+    bool HasFineGrainBufferSvm() const;
+    // True for devices taking scheduling priority hints of command queues (cl_khr_priority_hints)
+    bool HasQueuePriorityHints() const;
 
     // ... GetExecutionCapabilties() const;
     std::string const& GetName() const;
     std::string const& GetVendor() const;
     std::string const& GetVersion() const;
+    std::string const& GetDriverVersion() const;
     std::string const& GetProfile() const;
     std::string const& GetExtensions() const;
 
@@ -79,6 +89,7 @@ private:
     std::string              name_;
     std::string              vendor_;
     std::string              version_;
+    std::string              driverVersion_;
     std::string              profile_;
     std::string              extensions_;
     cl_device_type           type_;
@@ -88,7 +99,11 @@ private:
     cl_ulong                 maxAllocSize_;
     cl_device_local_mem_type localMemType_;
     size_t                   maxWorkGroupSize_;
+    cl_uint                  maxComputeUnits_;
     cl_uint                     minAlignSize_;
+    cl_uint                     memBaseAddrAlign_;
+    cl_bool                  hostUnifiedMemory_;
+    cl_bitfield              svmCapabilities_;
     
     friend class CLWPlatform;
 };
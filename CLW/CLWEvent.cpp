@@ -61,6 +61,30 @@ float CLWEvent::GetDuration() const
     return (float)(commandEnd - commandStart) / 1000000.f;
 }
 
+void CLWEvent::SetCallback(void (CL_CALLBACK* func)(cl_event, cl_int, void*), void* userdata)
+{
+    cl_int status = clSetEventCallback(*this, CL_COMPLETE, func, userdata);
+    ThrowIf(status != CL_SUCCESS, status, "clSetEventCallback failed");
+}
+
+bool CLWEvent::GetProfilingInfo(cl_ulong& start, cl_ulong& end) const
+{
+    cl_int status = clGetEventProfilingInfo(*this, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, nullptr);
+
+    if (status == CL_PROFILING_INFO_NOT_AVAILABLE)
+    {
+        return false;
+    }
+
+    ThrowIf(status != CL_SUCCESS, status, "clGetEventProfilingInfo failed");
+
+    status = clGetEventProfilingInfo(*this, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, nullptr);
+
+    ThrowIf(status != CL_SUCCESS, status, "clGetEventProfilingInfo failed");
+
+    return true;
+}
+
 cl_int CLWEvent::GetCommandExecutionStatus() const
 {
     cl_int status, execstatus;
@@ -70,4 +94,14 @@ cl_int CLWEvent::GetCommandExecutionStatus() const
     ThrowIf(status != CL_SUCCESS, status, "clGetEventInfo failed");
 
     return execstatus;
-}
\ No newline at end of file
+}
+
+std::vector<cl_event> CLWEvent::GetWaitList(std::vector<CLWEvent> const& events)
+{
+    std::vector<cl_event> waitList(events.size());
+
+    for (size_t i = 0; i < events.size(); ++i)
+        waitList[i] = events[i];
+
+    return waitList;
+}
@@ -45,7 +45,14 @@ public:
 
     void  Wait();
     float GetDuration() const;
+    // Command start and end times in nanoseconds, false if the queue doesn't profile
+    bool GetProfilingInfo(cl_ulong& start, cl_ulong& end) const;
     cl_int GetCommandExecutionStatus() const;
+    // Call func from an OpenCL runtime thread once the command completes or fails
+    void SetCallback(void (CL_CALLBACK* func)(cl_event, cl_int, void*), void* userdata);
+
+    // Raw handles to pass as a wait list
+    static std::vector<cl_event> GetWaitList(std::vector<CLWEvent> const& events);
 
 private:
     CLWEvent(cl_event program);
@@ -23,6 +23,35 @@ THE SOFTWARE.
 #include "ParameterHolder.h"
 #include "CLWExcept.h"
 
+#include <cstring>
+#include <vector>
+
+class CLWKernel::ArgumentCache
+{
+public:
+    struct Argument
+    {
+        Argument() : set(false), size(0), mem(nullptr) {}
+
+        bool set;
+        size_t size;
+        // Value bytes, empty for shared memory
+        std::vector<char> data;
+        // Retained memory object for buffer arguments
+        cl_mem mem;
+    };
+
+    ~ArgumentCache()
+    {
+        for (auto& arg : args)
+        {
+            if (arg.mem) clReleaseMemObject(arg.mem);
+        }
+    }
+
+    std::vector<Argument> args;
+};
+
 CLWKernel CLWKernel::Create(cl_kernel kernel)
 {
     CLWKernel k(kernel);
@@ -32,19 +61,53 @@ CLWKernel CLWKernel::Create(cl_kernel kernel)
 
 CLWKernel::CLWKernel(cl_kernel kernel)
 : ReferenceCounter<cl_kernel, clRetainKernel, clReleaseKernel>(kernel)
+, args_(std::make_shared<ArgumentCache>())
 {
 }
 
 void CLWKernel::SetArg(unsigned int idx, ParameterHolder param)
 {
-    param.SetArg(*this, idx); 
+    cl_mem mem = param.GetType() == ParameterHolder::kMem ? *static_cast<cl_mem const*>(param.GetData()) : nullptr;
+    SetArg(idx, param.GetSize(), param.GetData(), mem);
 }
 
 void CLWKernel::SetArg(unsigned int idx, size_t size, void* ptr)
 {
+    SetArg(idx, size, ptr, nullptr);
+}
+
+void CLWKernel::SetArg(unsigned int idx, size_t size, void const* ptr, cl_mem mem)
+{
+    if (args_)
+    {
+        if (args_->args.size() <= idx)
+        {
+            args_->args.resize(idx + 1);
+        }
+
+        ArgumentCache::Argument const& arg = args_->args[idx];
+        size_t datasize = ptr ? size : 0;
+        if (arg.set && arg.size == size && arg.data.size() == datasize &&
+            (datasize == 0 || std::memcmp(arg.data.data(), ptr, datasize) == 0))
+        {
+            return;
+        }
+    }
+
     cl_int status = CL_SUCCESS;
     
     status = clSetKernelArg(*this, idx, size, ptr);
         
     ThrowIf(status != CL_SUCCESS, status, "clSetKernelArg failed");
-}
\ No newline at end of file
+
+    if (args_)
+    {
+        ArgumentCache::Argument& arg = args_->args[idx];
+        if (mem) clRetainMemObject(mem);
+        if (arg.mem) clReleaseMemObject(arg.mem);
+        arg.set = true;
+        arg.size = size;
+        arg.data.assign(static_cast<char const*>(ptr), static_cast<char const*>(ptr) + (ptr ? size : 0));
+        arg.mem = mem;
+    }
+}
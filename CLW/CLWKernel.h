@@ -23,6 +23,7 @@ THE SOFTWARE.
 #define __CLW__CLWKernel__
 
 #include <iostream>
+#include <memory>
 
 #include "ReferenceCounter.h"
 
@@ -42,11 +43,20 @@ public:
     CLWKernel(){}
     virtual ~CLWKernel(){}
 
+    // Arguments are cached per cl_kernel and clSetKernelArg is skipped
+    // if the same value is already bound to the slot
     virtual void SetArg(unsigned int idx, ParameterHolder param);
     virtual void SetArg(unsigned int idx, size_t size, void* ptr);
 
 private:
     CLWKernel(cl_kernel kernel);
+
+    // mem is retained while bound to keep its handle from being reused
+    void SetArg(unsigned int idx, size_t size, void const* ptr, cl_mem mem);
+
+    class ArgumentCache;
+    // Shared between the copies since they refer to the same cl_kernel
+    std::shared_ptr<ArgumentCache> args_;
 };
 
 #endif /* defined(__CLW__CLWKernel__) */
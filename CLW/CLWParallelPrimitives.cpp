@@ -40,8 +40,30 @@ THE SOFTWARE.
 #define NUM_SCAN_ELEMS_PER_WG (WG_SIZE * NUM_SCAN_ELEMS_PER_WI)
 #define NUM_SEG_SCAN_ELEMS_PER_WG (WG_SIZE * NUM_SEG_SCAN_ELEMS_PER_WI)
 
+// Decoupled lookback scan and sort, see CLW.cl
+#define LOOKBACK_TILE_SIZE (WG_SIZE * 8)
+#define ONESWEEP_RADIX 256
+#define ONESWEEP_TILE_SIZE (WG_SIZE * 16)
+#define ONESWEEP_MAX_HISTOGRAM_GROUPS 256
+
+// Temporary buffer pool, sizes are in bytes
+#define TEMP_BUFFER_MIN_SIZE 256
+#define TEMP_BUFFER_DEFAULT_BUDGET (256 << 20)
+// Cached buffers up to this many size classes larger are reused
+#define TEMP_BUFFER_MAX_CLASS_DISTANCE 2
+
+CLWParallelPrimitives::CLWParallelPrimitives()
+    : cacheSize_(0)
+    , cacheBudget_(TEMP_BUFFER_DEFAULT_BUDGET)
+    , useCount_(0)
+{
+}
+
 CLWParallelPrimitives::CLWParallelPrimitives(CLWContext context, char const* buildopts)
     : context_(context)
+    , cacheSize_(0)
+    , cacheBudget_(TEMP_BUFFER_DEFAULT_BUDGET)
+    , useCount_(0)
 {
 #ifndef RR_EMBED_KERNELS
     program_ = CLWProgram::CreateFromFile("../CLW/CL/CLW.cl", buildopts, context_);
@@ -55,60 +77,57 @@ CLWParallelPrimitives::~CLWParallelPrimitives()
     ReclaimDeviceMemory();
 }
 
-CLWEvent CLWParallelPrimitives::ScanExclusiveAddWG(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems)
+CLWEvent CLWParallelPrimitives::ScanExclusiveAddWG(unsigned int deviceIdx, cl_mem input, cl_mem output, int numElems, char const* type)
 {
-    CLWKernel topLevelScan = program_.GetKernel("scan_exclusive_int4");
+    CLWKernel topLevelScan = program_.GetKernel(std::string("scan_exclusive_") + type + "4");
 
     topLevelScan.SetArg(0, input);
     topLevelScan.SetArg(1, output);
     topLevelScan.SetArg(2, (cl_uint)numElems);
     topLevelScan.SetArg(3, SharedMemory(WG_SIZE * sizeof(cl_int)));
 
-    return context_.Launch1D(0, WG_SIZE, WG_SIZE, topLevelScan);
+    return context_.Launch1D(deviceIdx, WG_SIZE, WG_SIZE, topLevelScan);
 }
 
-
-CLWEvent CLWParallelPrimitives::ScanExclusiveAddTwoLevel(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems)
+CLWEvent CLWParallelPrimitives::ScanExclusiveAddLookback(unsigned int deviceIdx, cl_mem input, cl_mem output, int numElems, char const* type, size_t typeSize)
 {
-    int GROUP_BLOCK_SIZE_SCAN = (WG_SIZE << 3);
-    int GROUP_BLOCK_SIZE_DISTRIBUTE = (WG_SIZE << 2);
+    int NUM_TILES = (numElems + LOOKBACK_TILE_SIZE - 1) / LOOKBACK_TILE_SIZE;
 
-    int NUM_GROUPS_BOTTOM_LEVEL_SCAN = (numElems + GROUP_BLOCK_SIZE_SCAN - 1) / GROUP_BLOCK_SIZE_SCAN;
-    int NUM_GROUPS_TOP_LEVEL_SCAN = (NUM_GROUPS_BOTTOM_LEVEL_SCAN + GROUP_BLOCK_SIZE_SCAN - 1) / GROUP_BLOCK_SIZE_SCAN;
-
-    int NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE = (numElems + GROUP_BLOCK_SIZE_DISTRIBUTE - 1) / GROUP_BLOCK_SIZE_DISTRIBUTE;
+    auto deviceAggregates = GetTempBuffer<char>(NUM_TILES * typeSize);
+    auto devicePrefixes = GetTempBuffer<char>(NUM_TILES * typeSize);
+    // Tile counter followed by tile flags
+    auto deviceStates = GetTempBuffer<cl_int>(NUM_TILES + 1);
 
-    auto devicePartSums = GetTempIntBuffer(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
-        //context_.CreateBuffer<cl_int>(NUM_GROUPS_BOTTOM_LEVEL);
+    context_.FillBuffer(deviceIdx, deviceStates, 0, NUM_TILES + 1);
 
-    CLWKernel bottomLevelScan = program_.GetKernel("scan_exclusive_part_int4");
-    CLWKernel topLevelScan = program_.GetKernel("scan_exclusive_int4");
-    CLWKernel distributeSums = program_.GetKernel("distribute_part_sum_int4");
-
-    bottomLevelScan.SetArg(0, input);
-    bottomLevelScan.SetArg(1, output);
-    bottomLevelScan.SetArg(2, numElems);
-    bottomLevelScan.SetArg(3, devicePartSums);
-    bottomLevelScan.SetArg(4, SharedMemory(WG_SIZE * sizeof(cl_int)));
-    context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
-
-    topLevelScan.SetArg(0, devicePartSums);
-    topLevelScan.SetArg(1, devicePartSums);
-    topLevelScan.SetArg(2, (cl_uint)devicePartSums.GetElementCount());
-    topLevelScan.SetArg(3, SharedMemory(WG_SIZE * sizeof(cl_int)));
-    context_.Launch1D(0, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
+    CLWKernel scanKernel = program_.GetKernel(std::string("scan_exclusive_lookback_") + type);
 
-    distributeSums.SetArg(0, devicePartSums);
-    distributeSums.SetArg(1, output);
-    distributeSums.SetArg(2, (cl_uint)numElems);
+    scanKernel.SetArg(0, input);
+    scanKernel.SetArg(1, output);
+    scanKernel.SetArg(2, (cl_uint)numElems);
+    scanKernel.SetArg(3, deviceAggregates);
+    scanKernel.SetArg(4, devicePrefixes);
+    scanKernel.SetArg(5, deviceStates);
 
-    ReclaimTempIntBuffer(devicePartSums);
+    ReclaimTempBuffer(deviceAggregates);
+    ReclaimTempBuffer(devicePrefixes);
+    ReclaimTempBuffer(deviceStates);
 
-    return context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSums);
+    return context_.Launch1D(deviceIdx, NUM_TILES * WG_SIZE, WG_SIZE, scanKernel);
 }
 
-
-
+CLWEvent CLWParallelPrimitives::ScanExclusiveAdd(unsigned int deviceIdx, cl_mem input, cl_mem output, int numElems, char const* type)
+{
+    if (numElems <= NUM_SCAN_ELEMS_PER_WG)
+    {
+        return ScanExclusiveAddWG(deviceIdx, input, output, numElems, type);
+    }
+    else
+    {
+        // Scan types are all 32-bit
+        return ScanExclusiveAddLookback(deviceIdx, input, output, numElems, type, sizeof(cl_int));
+    }
+}
 
 CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddTwoLevel(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> inputHeads, CLWBuffer<cl_int> output)
 {
@@ -118,8 +137,8 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddTwoLevel(unsigned int d
     int NUM_GROUPS_BOTTOM_LEVEL_SCAN = (numElems + GROUP_BLOCK_SIZE_SCAN - 1) / GROUP_BLOCK_SIZE_SCAN;
     int NUM_GROUPS_TOP_LEVEL_SCAN = (NUM_GROUPS_BOTTOM_LEVEL_SCAN + GROUP_BLOCK_SIZE_SCAN - 1) / GROUP_BLOCK_SIZE_SCAN;
     
-    auto devicePartSums = GetTempIntBuffer(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
-    auto devicePartFlags = GetTempIntBuffer(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
+    auto devicePartSums = GetTempBuffer<cl_int>(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
+    auto devicePartFlags = GetTempBuffer<cl_int>(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
     //context_.CreateBuffer<cl_int>(NUM_GROUPS_BOTTOM_LEVEL);
 
     CLWKernel bottomLevelScan = program_.GetKernel("segmented_scan_exclusive_int_part");
@@ -133,7 +152,7 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddTwoLevel(unsigned int d
     bottomLevelScan.SetArg(4, devicePartSums);
     bottomLevelScan.SetArg(5, devicePartFlags);
     bottomLevelScan.SetArg(6, SharedMemory(WG_SIZE * (sizeof(cl_int) + sizeof(cl_char))));
-    context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
 
     //std::vector<cl_int> hostPartSums(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
     //std::vector<cl_int> hostPartFlags(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
@@ -149,7 +168,7 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddTwoLevel(unsigned int d
     topLevelScan.SetArg(2, (cl_uint)devicePartSums.GetElementCount());
     topLevelScan.SetArg(3, devicePartSums);
     topLevelScan.SetArg(4, SharedMemory(WG_SIZE * (sizeof(cl_int) + sizeof(cl_char))));
-    context_.Launch1D(0, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
 
     //context_.ReadBuffer(0,  devicePartSums, &hostPartSums[0], NUM_GROUPS_BOTTOM_LEVEL_SCAN).Wait();
     
@@ -157,7 +176,7 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddTwoLevel(unsigned int d
     distributeSums.SetArg(1, inputHeads);
     distributeSums.SetArg(2, numElems);
     distributeSums.SetArg(3, devicePartSums);
-    return context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, distributeSums);
+    return context_.Launch1D(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, distributeSums);
     
     //context_.ReadBuffer(0,  output, &hostResult[0], numElems).Wait();
     
@@ -166,10 +185,10 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddTwoLevel(unsigned int d
     //distributeSums.SetArg(1, output);
     //distributeSums.SetArg(2, (cl_uint)numElems);
     
-    //ReclaimTempIntBuffer(devicePartSums);
-    //ReclaimTempIntBuffer(devicePartFlags);
+    //ReclaimTempBuffer(devicePartSums);
+    //ReclaimTempBuffer(devicePartFlags);
     
-    //return context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSums);
+    //return context_.Launch1D(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSums);
 }
 
 CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddThreeLevel(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> inputHeads, CLWBuffer<cl_int> output)
@@ -186,10 +205,10 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddThreeLevel(unsigned int
     int NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE = (numElems + GROUP_BLOCK_SIZE_DISTRIBUTE - 1) / GROUP_BLOCK_SIZE_DISTRIBUTE;
     int NUM_GROUPS_MID_LEVEL_DISTRIBUTE = (NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE + GROUP_BLOCK_SIZE_DISTRIBUTE - 1) / GROUP_BLOCK_SIZE_DISTRIBUTE;
 
-    auto devicePartSumsBottomLevel = GetTempIntBuffer(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
-    auto devicePartFlagsBottomLevel = GetTempIntBuffer(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
-    auto devicePartSumsMidLevel = GetTempIntBuffer(NUM_GROUPS_MID_LEVEL_SCAN);
-    auto devicePartFlagsMidLevel = GetTempIntBuffer(NUM_GROUPS_MID_LEVEL_SCAN);
+    auto devicePartSumsBottomLevel = GetTempBuffer<cl_int>(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
+    auto devicePartFlagsBottomLevel = GetTempBuffer<cl_int>(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
+    auto devicePartSumsMidLevel = GetTempBuffer<cl_int>(NUM_GROUPS_MID_LEVEL_SCAN);
+    auto devicePartFlagsMidLevel = GetTempBuffer<cl_int>(NUM_GROUPS_MID_LEVEL_SCAN);
 
     CLWKernel bottomLevelScan = program_.GetKernel("segmented_scan_exclusive_int_part");
     CLWKernel midLevelScan = program_.GetKernel("segmented_scan_exclusive_int_nocut_part");
@@ -204,7 +223,7 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddThreeLevel(unsigned int
     bottomLevelScan.SetArg(4, devicePartSumsBottomLevel);
     bottomLevelScan.SetArg(5, devicePartFlagsBottomLevel);
     bottomLevelScan.SetArg(6, SharedMemory(WG_SIZE * (sizeof(cl_int) + sizeof(cl_char))));
-    context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
 
     //std::vector<cl_int> hostPartSumsBL(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
     //std::vector<cl_int> hostPartFlagsBL(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
@@ -224,7 +243,7 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddThreeLevel(unsigned int
     midLevelScan.SetArg(5, devicePartFlagsMidLevel);
 
     midLevelScan.SetArg(6, SharedMemory(WG_SIZE * (sizeof(cl_int) + sizeof(cl_char))));
-    context_.Launch1D(0, NUM_GROUPS_MID_LEVEL_SCAN * WG_SIZE, WG_SIZE, midLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_MID_LEVEL_SCAN * WG_SIZE, WG_SIZE, midLevelScan);
 
     //context_.ReadBuffer(0,  devicePartSumsMidLevel, &hostPartSumsML[0], NUM_GROUPS_MID_LEVEL_SCAN).Wait();
     //context_.ReadBuffer(0,  devicePartFlagsMidLevel, &hostPartFlagsML[0], NUM_GROUPS_MID_LEVEL_SCAN).Wait();
@@ -234,7 +253,7 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddThreeLevel(unsigned int
     topLevelScan.SetArg(2, (cl_uint)devicePartSumsMidLevel.GetElementCount());
     topLevelScan.SetArg(3, devicePartSumsMidLevel);
     topLevelScan.SetArg(4, SharedMemory(WG_SIZE * (sizeof(cl_int) + sizeof(cl_char))));
-    context_.Launch1D(0, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
 
     //context_.ReadBuffer(0,  devicePartSumsMidLevel, &hostPartSumsML[0], NUM_GROUPS_MID_LEVEL_SCAN).Wait();
     //context_.ReadBuffer(0,  devicePartFlagsMidLevel, &hostPartFlagsML[0], NUM_GROUPS_MID_LEVEL_SCAN).Wait();
@@ -244,7 +263,7 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddThreeLevel(unsigned int
     distributeSumsMidLevel.SetArg(2, NUM_GROUPS_BOTTOM_LEVEL_SCAN);
     distributeSumsMidLevel.SetArg(3, devicePartSumsMidLevel);
 
-    context_.Launch1D(0, NUM_GROUPS_MID_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSumsMidLevel);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_MID_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSumsMidLevel);
 
     //context_.ReadBuffer(0,  devicePartSumsBottomLevel, &hostPartSumsBL[0], NUM_GROUPS_BOTTOM_LEVEL_SCAN).Wait();
     //context_.ReadBuffer(0,  devicePartFlagsBottomLevel, &hostPartFlagsBL[0], NUM_GROUPS_BOTTOM_LEVEL_SCAN).Wait();
@@ -254,7 +273,7 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddThreeLevel(unsigned int
     distributeSumsBottomLevel.SetArg(2, numElems);
     distributeSumsBottomLevel.SetArg(3, devicePartSumsBottomLevel);
 
-    return context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSumsBottomLevel);
+    return context_.Launch1D(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSumsBottomLevel);
 }
 
 
@@ -274,12 +293,12 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddFourLevel(unsigned int
     int NUM_GROUPS_MID_LEVEL_DISTRIBUTE_1 = (NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE + GROUP_BLOCK_SIZE_DISTRIBUTE - 1) / GROUP_BLOCK_SIZE_DISTRIBUTE;
     int NUM_GROUPS_MID_LEVEL_DISTRIBUTE_2 = (NUM_GROUPS_MID_LEVEL_DISTRIBUTE_1 + GROUP_BLOCK_SIZE_DISTRIBUTE - 1) / GROUP_BLOCK_SIZE_DISTRIBUTE;
 
-    auto devicePartSumsBottomLevel = GetTempIntBuffer(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
-    auto devicePartFlagsBottomLevel = GetTempIntBuffer(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
-    auto devicePartSumsMidLevel1 = GetTempIntBuffer(NUM_GROUPS_MID_LEVEL_SCAN_1);
-    auto devicePartFlagsMidLevel1 = GetTempIntBuffer(NUM_GROUPS_MID_LEVEL_SCAN_1);
-    auto devicePartSumsMidLevel2 = GetTempIntBuffer(NUM_GROUPS_MID_LEVEL_SCAN_2);
-    auto devicePartFlagsMidLevel2 = GetTempIntBuffer(NUM_GROUPS_MID_LEVEL_SCAN_2);
+    auto devicePartSumsBottomLevel = GetTempBuffer<cl_int>(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
+    auto devicePartFlagsBottomLevel = GetTempBuffer<cl_int>(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
+    auto devicePartSumsMidLevel1 = GetTempBuffer<cl_int>(NUM_GROUPS_MID_LEVEL_SCAN_1);
+    auto devicePartFlagsMidLevel1 = GetTempBuffer<cl_int>(NUM_GROUPS_MID_LEVEL_SCAN_1);
+    auto devicePartSumsMidLevel2 = GetTempBuffer<cl_int>(NUM_GROUPS_MID_LEVEL_SCAN_2);
+    auto devicePartFlagsMidLevel2 = GetTempBuffer<cl_int>(NUM_GROUPS_MID_LEVEL_SCAN_2);
 
     CLWKernel bottomLevelScan = program_.GetKernel("segmented_scan_exclusive_int_part");
     CLWKernel midLevelScan = program_.GetKernel("segmented_scan_exclusive_int_nocut_part");
@@ -294,7 +313,7 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddFourLevel(unsigned int
     bottomLevelScan.SetArg(4, devicePartSumsBottomLevel);
     bottomLevelScan.SetArg(5, devicePartFlagsBottomLevel);
     bottomLevelScan.SetArg(6, SharedMemory(WG_SIZE * (sizeof(cl_int) + sizeof(cl_char))));
-    context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
 
     midLevelScan.SetArg(0, devicePartSumsBottomLevel);
     midLevelScan.SetArg(1, devicePartFlagsBottomLevel);
@@ -304,7 +323,7 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddFourLevel(unsigned int
     midLevelScan.SetArg(5, devicePartFlagsMidLevel1);
 
     midLevelScan.SetArg(6, SharedMemory(WG_SIZE * (sizeof(cl_int) + sizeof(cl_char))));
-    context_.Launch1D(0, NUM_GROUPS_MID_LEVEL_SCAN_1 * WG_SIZE, WG_SIZE, midLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_MID_LEVEL_SCAN_1 * WG_SIZE, WG_SIZE, midLevelScan);
 
     midLevelScan.SetArg(0, devicePartSumsMidLevel1);
     midLevelScan.SetArg(1, devicePartFlagsMidLevel1);
@@ -314,108 +333,40 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddFourLevel(unsigned int
     midLevelScan.SetArg(5, devicePartFlagsMidLevel2);
 
     midLevelScan.SetArg(6, SharedMemory(WG_SIZE * (sizeof(cl_int) + sizeof(cl_char))));
-    context_.Launch1D(0, NUM_GROUPS_MID_LEVEL_SCAN_2 * WG_SIZE, WG_SIZE, midLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_MID_LEVEL_SCAN_2 * WG_SIZE, WG_SIZE, midLevelScan);
 
     topLevelScan.SetArg(0, devicePartSumsMidLevel2);
     topLevelScan.SetArg(1, devicePartFlagsMidLevel2);
     topLevelScan.SetArg(2, (cl_uint)devicePartSumsMidLevel2.GetElementCount());
     topLevelScan.SetArg(3, devicePartSumsMidLevel2);
     topLevelScan.SetArg(4, SharedMemory(WG_SIZE * (sizeof(cl_int) + sizeof(cl_char))));
-    context_.Launch1D(0, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
 
     distributeSumsMidLevel.SetArg(0, devicePartSumsMidLevel1);
     distributeSumsMidLevel.SetArg(1, devicePartFlagsMidLevel1);
     distributeSumsMidLevel.SetArg(2, NUM_GROUPS_MID_LEVEL_SCAN_1);
     distributeSumsMidLevel.SetArg(3, devicePartSumsMidLevel2);
 
-    context_.Launch1D(0, NUM_GROUPS_MID_LEVEL_DISTRIBUTE_2 * WG_SIZE, WG_SIZE, distributeSumsMidLevel);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_MID_LEVEL_DISTRIBUTE_2 * WG_SIZE, WG_SIZE, distributeSumsMidLevel);
 
     distributeSumsMidLevel.SetArg(0, devicePartSumsBottomLevel);
     distributeSumsMidLevel.SetArg(1, devicePartFlagsBottomLevel);
     distributeSumsMidLevel.SetArg(2, NUM_GROUPS_BOTTOM_LEVEL_SCAN);
     distributeSumsMidLevel.SetArg(3, devicePartSumsMidLevel1);
 
-    context_.Launch1D(0, NUM_GROUPS_MID_LEVEL_DISTRIBUTE_1 * WG_SIZE, WG_SIZE, distributeSumsMidLevel);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_MID_LEVEL_DISTRIBUTE_1 * WG_SIZE, WG_SIZE, distributeSumsMidLevel);
 
     distributeSumsBottomLevel.SetArg(0, output);
     distributeSumsBottomLevel.SetArg(1, inputHeads);
     distributeSumsBottomLevel.SetArg(2, numElems);
     distributeSumsBottomLevel.SetArg(3, devicePartSumsBottomLevel);
 
-    return context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSumsBottomLevel);
+    return context_.Launch1D(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSumsBottomLevel);
 }
 
 
 
 
-CLWEvent CLWParallelPrimitives::ScanExclusiveAddThreeLevel(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems)
-{
-    int GROUP_BLOCK_SIZE_SCAN = (WG_SIZE << 3);
-    int GROUP_BLOCK_SIZE_DISTRIBUTE = (WG_SIZE << 2);
-
-    int NUM_GROUPS_BOTTOM_LEVEL_SCAN = (numElems + GROUP_BLOCK_SIZE_SCAN - 1) / GROUP_BLOCK_SIZE_SCAN;
-    int NUM_GROUPS_MID_LEVEL_SCAN = (NUM_GROUPS_BOTTOM_LEVEL_SCAN + GROUP_BLOCK_SIZE_SCAN - 1) / GROUP_BLOCK_SIZE_SCAN;
-    int NUM_GROUPS_TOP_LEVEL_SCAN = (NUM_GROUPS_MID_LEVEL_SCAN + GROUP_BLOCK_SIZE_SCAN - 1) / GROUP_BLOCK_SIZE_SCAN;
-
-    int NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE = (numElems + GROUP_BLOCK_SIZE_DISTRIBUTE - 1) / GROUP_BLOCK_SIZE_DISTRIBUTE;
-    int NUM_GROUPS_MID_LEVEL_DISTRIBUTE = (NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE + GROUP_BLOCK_SIZE_DISTRIBUTE - 1) / GROUP_BLOCK_SIZE_DISTRIBUTE;
-
-    auto devicePartSumsBottomLevel = GetTempIntBuffer(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
-    auto devicePartSumsMidLevel = GetTempIntBuffer(NUM_GROUPS_MID_LEVEL_SCAN);
-
-    CLWKernel bottomLevelScan = program_.GetKernel("scan_exclusive_part_int4");
-    CLWKernel topLevelScan = program_.GetKernel("scan_exclusive_int4");
-    CLWKernel distributeSums = program_.GetKernel("distribute_part_sum_int4");
-
-    bottomLevelScan.SetArg(0, input);
-    bottomLevelScan.SetArg(1, output);
-    bottomLevelScan.SetArg(2, numElems);
-    bottomLevelScan.SetArg(3, devicePartSumsBottomLevel);
-    bottomLevelScan.SetArg(4, SharedMemory(WG_SIZE * sizeof(cl_int)));
-    context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
-
-    bottomLevelScan.SetArg(0, devicePartSumsBottomLevel);
-    bottomLevelScan.SetArg(1, devicePartSumsBottomLevel);
-    bottomLevelScan.SetArg(2, (cl_uint)devicePartSumsBottomLevel.GetElementCount());
-    bottomLevelScan.SetArg(3, devicePartSumsMidLevel);
-    bottomLevelScan.SetArg(4, SharedMemory(WG_SIZE * sizeof(cl_int)));
-    context_.Launch1D(0, NUM_GROUPS_MID_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
-
-    topLevelScan.SetArg(0, devicePartSumsMidLevel);
-    topLevelScan.SetArg(1, devicePartSumsMidLevel);
-    topLevelScan.SetArg(2, (cl_uint)devicePartSumsMidLevel.GetElementCount());
-    topLevelScan.SetArg(3, SharedMemory(WG_SIZE * sizeof(cl_int)));
-    context_.Launch1D(0, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
-
-    distributeSums.SetArg(0, devicePartSumsMidLevel);
-    distributeSums.SetArg(1, devicePartSumsBottomLevel);
-    distributeSums.SetArg(2, (cl_uint)devicePartSumsBottomLevel.GetElementCount());
-    context_.Launch1D(0, NUM_GROUPS_MID_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSums);
-
-    distributeSums.SetArg(0, devicePartSumsBottomLevel);
-    distributeSums.SetArg(1, output);
-    distributeSums.SetArg(2, (cl_uint)numElems);
-
-    ReclaimTempIntBuffer(devicePartSumsMidLevel);
-    ReclaimTempIntBuffer(devicePartSumsBottomLevel);
-
-    return context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSums);
-}
-
-
-
-CLWEvent CLWParallelPrimitives::ScanExclusiveAddWG(unsigned int deviceIdx, CLWBuffer<cl_float> input, CLWBuffer<cl_float> output, int numElems)
-{
-    CLWKernel topLevelScan = program_.GetKernel("scan_exclusive_float4");
-
-    topLevelScan.SetArg(0, input);
-    topLevelScan.SetArg(1, output);
-    topLevelScan.SetArg(2, (cl_uint)numElems);
-    topLevelScan.SetArg(3, SharedMemory(WG_SIZE * sizeof(cl_int)));
-
-    return context_.Launch1D(0, WG_SIZE, WG_SIZE, topLevelScan);
-}
-
 CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddWG(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> inputHeads, CLWBuffer<cl_int> output)
 {
     cl_uint numElems = (cl_uint)input.GetElementCount();
@@ -428,145 +379,7 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddWG(unsigned int deviceI
     topLevelScan.SetArg(3, output);
     topLevelScan.SetArg(4, SharedMemory(WG_SIZE * (sizeof(cl_int) + sizeof(cl_char))));
     
-    return context_.Launch1D(0, WG_SIZE, WG_SIZE, topLevelScan);
-}
-
-
-CLWEvent CLWParallelPrimitives::ScanExclusiveAddTwoLevel(unsigned int deviceIdx, CLWBuffer<cl_float> input, CLWBuffer<cl_float> output, int numElems)
-{
-    int GROUP_BLOCK_SIZE_SCAN = (WG_SIZE << 3);
-    int GROUP_BLOCK_SIZE_DISTRIBUTE = (WG_SIZE << 2);
-
-    int NUM_GROUPS_BOTTOM_LEVEL_SCAN = (numElems + GROUP_BLOCK_SIZE_SCAN - 1) / GROUP_BLOCK_SIZE_SCAN;
-    int NUM_GROUPS_TOP_LEVEL_SCAN = (NUM_GROUPS_BOTTOM_LEVEL_SCAN + GROUP_BLOCK_SIZE_SCAN - 1) / GROUP_BLOCK_SIZE_SCAN;
-
-    int NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE = (numElems + GROUP_BLOCK_SIZE_DISTRIBUTE - 1) / GROUP_BLOCK_SIZE_DISTRIBUTE;
-
-    auto devicePartSums = GetTempFloatBuffer(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
-        //context_.CreateBuffer<cl_int>(NUM_GROUPS_BOTTOM_LEVEL);
-
-    CLWKernel bottomLevelScan = program_.GetKernel("scan_exclusive_part_float4");
-    CLWKernel topLevelScan = program_.GetKernel("scan_exclusive_float4");
-    CLWKernel distributeSums = program_.GetKernel("distribute_part_sum_float4");
-
-    bottomLevelScan.SetArg(0, input);
-    bottomLevelScan.SetArg(1, output);
-    bottomLevelScan.SetArg(2, numElems);
-    bottomLevelScan.SetArg(3, devicePartSums);
-    bottomLevelScan.SetArg(4, SharedMemory(WG_SIZE * sizeof(cl_int)));
-    context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
-
-    topLevelScan.SetArg(0, devicePartSums);
-    topLevelScan.SetArg(1, devicePartSums);
-    topLevelScan.SetArg(2, (cl_uint)devicePartSums.GetElementCount());
-    topLevelScan.SetArg(3, SharedMemory(WG_SIZE * sizeof(cl_int)));
-    context_.Launch1D(0, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
-
-    distributeSums.SetArg(0, devicePartSums);
-    distributeSums.SetArg(1, output);
-    distributeSums.SetArg(2, (cl_uint)numElems);
-
-    ReclaimTempFloatBuffer(devicePartSums);
-
-    return context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSums);
-}
-
-CLWEvent CLWParallelPrimitives::ScanExclusiveAddThreeLevel(unsigned int deviceIdx, CLWBuffer<cl_float> input, CLWBuffer<cl_float> output, int numElems)
-{
-    int GROUP_BLOCK_SIZE_SCAN = (WG_SIZE << 3);
-    int GROUP_BLOCK_SIZE_DISTRIBUTE = (WG_SIZE << 2);
-
-    int NUM_GROUPS_BOTTOM_LEVEL_SCAN = (numElems + GROUP_BLOCK_SIZE_SCAN - 1) / GROUP_BLOCK_SIZE_SCAN;
-    int NUM_GROUPS_MID_LEVEL_SCAN = (NUM_GROUPS_BOTTOM_LEVEL_SCAN + GROUP_BLOCK_SIZE_SCAN - 1) / GROUP_BLOCK_SIZE_SCAN;
-    int NUM_GROUPS_TOP_LEVEL_SCAN = (NUM_GROUPS_MID_LEVEL_SCAN + GROUP_BLOCK_SIZE_SCAN - 1) / GROUP_BLOCK_SIZE_SCAN;
-
-    int NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE = (numElems + GROUP_BLOCK_SIZE_DISTRIBUTE - 1) / GROUP_BLOCK_SIZE_DISTRIBUTE;
-    int NUM_GROUPS_MID_LEVEL_DISTRIBUTE = (NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE + GROUP_BLOCK_SIZE_DISTRIBUTE - 1) / GROUP_BLOCK_SIZE_DISTRIBUTE;
-
-    auto devicePartSumsBottomLevel = GetTempFloatBuffer(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
-    auto devicePartSumsMidLevel = GetTempFloatBuffer(NUM_GROUPS_MID_LEVEL_SCAN);
-
-    CLWKernel bottomLevelScan = program_.GetKernel("scan_exclusive_part_float4");
-    CLWKernel topLevelScan = program_.GetKernel("scan_exclusive_float4");
-    CLWKernel distributeSums = program_.GetKernel("distribute_part_sum_float4");
-
-    bottomLevelScan.SetArg(0, input);
-    bottomLevelScan.SetArg(1, output);
-    bottomLevelScan.SetArg(2, numElems);
-    bottomLevelScan.SetArg(3, devicePartSumsBottomLevel);
-    bottomLevelScan.SetArg(4, SharedMemory(WG_SIZE * sizeof(cl_int)));
-    context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
-
-    bottomLevelScan.SetArg(0, devicePartSumsBottomLevel);
-    bottomLevelScan.SetArg(1, devicePartSumsBottomLevel);
-    bottomLevelScan.SetArg(2, (cl_uint)devicePartSumsBottomLevel.GetElementCount());
-    bottomLevelScan.SetArg(3, devicePartSumsMidLevel);
-    bottomLevelScan.SetArg(4, SharedMemory(WG_SIZE * sizeof(cl_int)));
-    context_.Launch1D(0, NUM_GROUPS_MID_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
-
-    topLevelScan.SetArg(0, devicePartSumsMidLevel);
-    topLevelScan.SetArg(1, devicePartSumsMidLevel);
-    topLevelScan.SetArg(2, (cl_uint)devicePartSumsMidLevel.GetElementCount());
-    topLevelScan.SetArg(3, SharedMemory(WG_SIZE * sizeof(cl_int)));
-    context_.Launch1D(0, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
-
-    distributeSums.SetArg(0, devicePartSumsMidLevel);
-    distributeSums.SetArg(1, devicePartSumsBottomLevel);
-    distributeSums.SetArg(2, (cl_uint)devicePartSumsBottomLevel.GetElementCount());
-    context_.Launch1D(0, NUM_GROUPS_MID_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSums);
-
-    distributeSums.SetArg(0, devicePartSumsBottomLevel);
-    distributeSums.SetArg(1, output);
-    distributeSums.SetArg(2, (cl_uint)numElems);
-
-    ReclaimTempFloatBuffer(devicePartSumsMidLevel);
-    ReclaimTempFloatBuffer(devicePartSumsBottomLevel);
-
-    return context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSums);
-}
-
-CLWEvent CLWParallelPrimitives::ScanExclusiveAdd(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems)
-{
-    if (numElems < NUM_SCAN_ELEMS_PER_WG)
-    {
-        return ScanExclusiveAddWG(deviceIdx, input, output, numElems);
-    }
-    else if (numElems < NUM_SCAN_ELEMS_PER_WG * NUM_SCAN_ELEMS_PER_WG)
-    {
-        return ScanExclusiveAddTwoLevel(deviceIdx, input, output, numElems);
-    }
-    else if (numElems < NUM_SCAN_ELEMS_PER_WG * NUM_SCAN_ELEMS_PER_WG * NUM_SCAN_ELEMS_PER_WG)
-    {
-        return ScanExclusiveAddThreeLevel(deviceIdx, input, output, numElems);
-    }
-    else
-    {
-        throw std::runtime_error("The maximum number of elements for scan exceeded\n");
-    }
-
-    return CLWEvent::Create(nullptr);
-}
-
-CLWEvent CLWParallelPrimitives::ScanExclusiveAdd(unsigned int deviceIdx, CLWBuffer<cl_float> input, CLWBuffer<cl_float> output, int numElems)
-{
-    if (numElems <= NUM_SCAN_ELEMS_PER_WG)
-    {
-        return ScanExclusiveAddWG(deviceIdx, input, output, numElems);
-    }
-    else if (numElems <= NUM_SCAN_ELEMS_PER_WG * NUM_SCAN_ELEMS_PER_WG)
-    {
-        return ScanExclusiveAddTwoLevel(deviceIdx, input, output, numElems);
-    }
-    else if (numElems <= NUM_SCAN_ELEMS_PER_WG * NUM_SCAN_ELEMS_PER_WG * NUM_SCAN_ELEMS_PER_WG)
-    {
-        return ScanExclusiveAddThreeLevel(deviceIdx, input, output, numElems);
-    }
-    else
-    {
-        throw std::runtime_error("The maximum number of elements for scan exceeded\n");
-    }
-
-    return CLWEvent::Create(nullptr);
+    return context_.Launch1D(deviceIdx, WG_SIZE, WG_SIZE, topLevelScan);
 }
 
 
@@ -600,330 +413,212 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAdd(unsigned int deviceIdx
     return CLWEvent::Create(nullptr);
 }
 
-CLWBuffer<cl_int> CLWParallelPrimitives::GetTempIntBuffer(size_t size)
+CLWEvent CLWParallelPrimitives::SortRadixOnesweep(unsigned int deviceIdx, cl_mem inputKeys, cl_mem outputKeys,
+    cl_mem inputValues, cl_mem outputValues, int numElems, int keyWords, int keyType)
 {
-    auto iter = intBufferCache_.find(size);
-
-    if (iter != intBufferCache_.end())
+    if (numElems == 0)
     {
-        CLWBuffer<int> tmp = iter->second;
-        intBufferCache_.erase(iter);
-        return tmp;
+        return CLWEvent::Create(nullptr);
     }
 
-    return context_.CreateBuffer<cl_int>(size, CL_MEM_READ_WRITE);
-}
-
-CLWBuffer<char> CLWParallelPrimitives::GetTempCharBuffer(size_t size)
-{
-    auto iter = charBufferCache_.find(size);
-
-    if (iter != charBufferCache_.end())
-    {
-        CLWBuffer<char> tmp = iter->second;
-        charBufferCache_.erase(iter);
-        return tmp;
-    }
-
-    return context_.CreateBuffer<char>(size, CL_MEM_READ_WRITE);
-}
-
-CLWBuffer<cl_float> CLWParallelPrimitives::GetTempFloatBuffer(size_t size)
-{
-    auto iter = floatBufferCache_.find(size);
-
-    if (iter != floatBufferCache_.end())
-    {
-        CLWBuffer<cl_float> tmp = iter->second;
-        floatBufferCache_.erase(iter);
-        return tmp;
-    }
-
-    return context_.CreateBuffer<cl_float>(size, CL_MEM_READ_WRITE);
-}
-
-CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<cl_int> inputKeys, CLWBuffer<cl_int> outputKeys,
-    CLWBuffer<cl_int> inputValues, CLWBuffer<cl_int> outputValues, int numElems)
-{
-    assert(inputKeys.GetElementCount() == outputKeys.GetElementCount());
-    assert(inputValues.GetElementCount() == inputValues.GetElementCount());
-
-    //cl_uint numElems = (cl_uint)inputKeys.GetElementCount();
-
-    int GROUP_BLOCK_SIZE = (WG_SIZE * 4 * 8);
-    int NUM_BLOCKS = (numElems + GROUP_BLOCK_SIZE - 1) / GROUP_BLOCK_SIZE;
-
-    auto deviceHistograms = GetTempIntBuffer(NUM_BLOCKS * 16);
-    auto deviceTempKeysBuffer = GetTempIntBuffer(numElems);
-    auto deviceTempValsBuffer = GetTempIntBuffer(numElems);
-
-    auto fromKeys = &inputKeys;
-    auto fromVals = &inputValues;
-    auto toKeys = &deviceTempKeysBuffer;
-    auto toVals = &deviceTempValsBuffer;
-
-    CLWKernel histogramKernel = program_.GetKernel("BitHistogram");
-    CLWKernel scatterKeysAndVals = program_.GetKernel("ScatterKeysAndValues");
-
+    int NUM_PASSES = keyWords * 4;
+    int NUM_TILES = (numElems + ONESWEEP_TILE_SIZE - 1) / ONESWEEP_TILE_SIZE;
+    int NUM_HISTOGRAM_GROUPS = std::min(NUM_TILES, ONESWEEP_MAX_HISTOGRAM_GROUPS);
+    bool withValues = inputValues != nullptr;
+
+    auto deviceHistograms = GetTempBuffer<cl_int>(NUM_PASSES * ONESWEEP_RADIX);
+    // Tile counter followed by digit states of each tile
+    auto deviceStates = GetTempBuffer<cl_int>(NUM_TILES * ONESWEEP_RADIX + 1);
+    auto deviceTempKeys = GetTempBuffer<cl_int>(numElems * keyWords);
+    auto deviceTempVals = GetTempBuffer<cl_int>(withValues ? numElems : 1);
+
+    CLWKernel histogramKernel = program_.GetKernel("onesweep_histogram");
+    CLWKernel scanKernel = program_.GetKernel("onesweep_scan_histograms");
+    CLWKernel scatterKernel = program_.GetKernel("onesweep_scatter");
+
+    // Digit counts of all the passes are gathered in a single read of the keys
+    context_.FillBuffer(deviceIdx, deviceHistograms, 0, deviceHistograms.GetElementCount());
+
+    histogramKernel.SetArg(0, inputKeys);
+    histogramKernel.SetArg(1, (cl_uint)numElems);
+    histogramKernel.SetArg(2, keyWords);
+    histogramKernel.SetArg(3, keyType);
+    histogramKernel.SetArg(4, deviceHistograms);
+    context_.Launch1D(deviceIdx, NUM_HISTOGRAM_GROUPS * WG_SIZE, WG_SIZE, histogramKernel);
+
+    scanKernel.SetArg(0, deviceHistograms);
+    scanKernel.SetArg(1, NUM_PASSES);
+    context_.Launch1D(deviceIdx, WG_SIZE, WG_SIZE, scanKernel);
+
+    // Number of passes is even, so keys go through the temporary buffers
+    // on even passes and end up in the output ones
     CLWEvent event;
 
-    for (int offset = 0; offset < 32; offset += 4)
+    for (int pass = 0; pass < NUM_PASSES; ++pass)
     {
-        // Split
-        histogramKernel.SetArg(0, offset);
-        histogramKernel.SetArg(1, *fromKeys);
-        histogramKernel.SetArg(2, numElems);
-        histogramKernel.SetArg(3, deviceHistograms);
-
-        context_.Launch1D(0, NUM_BLOCKS*WG_SIZE, WG_SIZE, histogramKernel);
-
-        // Scan histograms
-        ScanExclusiveAdd(0, deviceHistograms, deviceHistograms, numElems);
-
-        //context_.ReadBuffer(0, deviceHistograms, &hist[0], 16).Wait();
-
-        // Scatter keys
-        scatterKeysAndVals.SetArg(0, offset);
-        scatterKeysAndVals.SetArg(1, *fromKeys);
-        scatterKeysAndVals.SetArg(2, *fromVals);
-        scatterKeysAndVals.SetArg(3, numElems);
-        scatterKeysAndVals.SetArg(4, deviceHistograms);
-        scatterKeysAndVals.SetArg(5, *toKeys);
-        scatterKeysAndVals.SetArg(6, *toVals);
-
-        event = context_.Launch1D(0, NUM_BLOCKS*WG_SIZE, WG_SIZE, scatterKeysAndVals);
-
-        //context_.ReadBuffer(0, *toKeys, &keys[0], 64).Wait();
-
-        if (offset == 0)
-        {
-            fromKeys = &outputKeys;
-            fromVals = &outputValues;
-        }
-
-        // Swap pointers
-        std::swap(fromKeys, toKeys);
-        std::swap(fromVals, toVals);
+        bool even = (pass & 1) == 0;
+
+        cl_mem fromKeys = even ? (pass == 0 ? inputKeys : outputKeys) : (cl_mem)deviceTempKeys;
+        cl_mem fromVals = even ? (pass == 0 ? inputValues : outputValues) : (cl_mem)deviceTempVals;
+        cl_mem toKeys = even ? (cl_mem)deviceTempKeys : outputKeys;
+        cl_mem toVals = even ? (cl_mem)deviceTempVals : outputValues;
+
+        context_.FillBuffer(deviceIdx, deviceStates, 0, deviceStates.GetElementCount());
+
+        scatterKernel.SetArg(0, fromKeys);
+        scatterKernel.SetArg(1, withValues ? fromVals : (cl_mem)deviceTempVals);
+        scatterKernel.SetArg(2, (cl_uint)numElems);
+        scatterKernel.SetArg(3, keyWords);
+        scatterKernel.SetArg(4, keyType);
+        scatterKernel.SetArg(5, withValues ? 1 : 0);
+        scatterKernel.SetArg(6, pass);
+        scatterKernel.SetArg(7, deviceHistograms);
+        scatterKernel.SetArg(8, deviceStates);
+        scatterKernel.SetArg(9, toKeys);
+        scatterKernel.SetArg(10, withValues ? toVals : (cl_mem)deviceTempVals);
+
+        event = context_.Launch1D(deviceIdx, NUM_TILES * WG_SIZE, WG_SIZE, scatterKernel);
     }
 
     // Return buffers to memory manager
-    ReclaimTempIntBuffer(deviceHistograms);
-    ReclaimTempIntBuffer(deviceTempKeysBuffer);
-    ReclaimTempIntBuffer(deviceTempValsBuffer);
+    ReclaimTempBuffer(deviceHistograms);
+    ReclaimTempBuffer(deviceStates);
+    ReclaimTempBuffer(deviceTempKeys);
+    ReclaimTempBuffer(deviceTempVals);
 
     return event;
 }
 
-CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<char> inputKeys, CLWBuffer<char> outputKeys,
-    CLWBuffer<char> inputValues, CLWBuffer<char> outputValues, int numElems)
+CLWEvent CLWParallelPrimitives::ReduceMinMax(unsigned int deviceIdx, CLWBuffer<cl_float> input, CLWBuffer<cl_float> output, int numElems)
 {
-    int GROUP_BLOCK_SIZE = (WG_SIZE * 4 * 8);
-    int NUM_BLOCKS = (numElems + GROUP_BLOCK_SIZE - 1) / GROUP_BLOCK_SIZE;
-
-    auto deviceHistograms = GetTempIntBuffer(NUM_BLOCKS * 16);
-    auto deviceTempKeysBuffer = GetTempCharBuffer(numElems * 4);
-    auto deviceTempValsBuffer = GetTempCharBuffer(numElems * 4);
-
-    auto fromKeys = &inputKeys;
-    auto fromVals = &inputValues;
-    auto toKeys = &deviceTempKeysBuffer;
-    auto toVals = &deviceTempValsBuffer;
+    // Two passes: per group results and a single group over them
+    int NUM_GROUPS = std::max(1, std::min((numElems + WG_SIZE - 1) / WG_SIZE, WG_SIZE));
 
-    CLWKernel histogramKernel = program_.GetKernel("BitHistogram");
-    CLWKernel scatterKeysAndVals = program_.GetKernel("ScatterKeysAndValues");
-
-    CLWEvent event;
-
-    for (int offset = 0; offset < 32; offset += 4)
-    {
-        // Split
-        histogramKernel.SetArg(0, offset);
-        histogramKernel.SetArg(1, *fromKeys);
-        histogramKernel.SetArg(2, numElems);
-        histogramKernel.SetArg(3, deviceHistograms);
+    auto devicePartResults = GetTempBuffer<cl_float>(NUM_GROUPS * 2);
 
-        context_.Launch1D(0, NUM_BLOCKS*WG_SIZE, WG_SIZE, histogramKernel);
+    CLWKernel reduceKernel = program_.GetKernel("reduce_min_max_float");
 
-        // Scan histograms
-        ScanExclusiveAdd(0, deviceHistograms, deviceHistograms, numElems);
+    reduceKernel.SetArg(0, input);
+    reduceKernel.SetArg(1, (cl_uint)numElems);
+    reduceKernel.SetArg(2, 0);
+    reduceKernel.SetArg(3, devicePartResults);
 
-        //context_.ReadBuffer(0, deviceHistograms, &hist[0], 16).Wait();
+    context_.Launch1D(deviceIdx, NUM_GROUPS * WG_SIZE, WG_SIZE, reduceKernel);
 
-        // Scatter keys
-        scatterKeysAndVals.SetArg(0, offset);
-        scatterKeysAndVals.SetArg(1, *fromKeys);
-        scatterKeysAndVals.SetArg(2, *fromVals);
-        scatterKeysAndVals.SetArg(3, numElems);
-        scatterKeysAndVals.SetArg(4, deviceHistograms);
-        scatterKeysAndVals.SetArg(5, *toKeys);
-        scatterKeysAndVals.SetArg(6, *toVals);
+    reduceKernel.SetArg(0, devicePartResults);
+    reduceKernel.SetArg(1, (cl_uint)NUM_GROUPS);
+    reduceKernel.SetArg(2, 1);
+    reduceKernel.SetArg(3, output);
 
-        event = context_.Launch1D(0, NUM_BLOCKS*WG_SIZE, WG_SIZE, scatterKeysAndVals);
+    CLWEvent event = context_.Launch1D(deviceIdx, WG_SIZE, WG_SIZE, reduceKernel);
 
-        //context_.ReadBuffer(0, *toKeys, &keys[0], 64).Wait();
-
-        if (offset == 0)
-        {
-            fromKeys = &outputKeys;
-            fromVals = &outputValues;
-        }
-
-        // Swap pointers
-        std::swap(fromKeys, toKeys);
-        std::swap(fromVals, toVals);
-    }
-
-    // Return buffers to memory manager
-    ReclaimTempIntBuffer(deviceHistograms);
-    ReclaimTempCharBuffer(deviceTempKeysBuffer);
-    ReclaimTempCharBuffer(deviceTempValsBuffer);
+    ReclaimTempBuffer(devicePartResults);
 
     return event;
 }
 
-
-CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<cl_int> inputKeys, CLWBuffer<cl_int> outputKeys)
+CLWEvent CLWParallelPrimitives::ReduceBbox(unsigned int deviceIdx, CLWBuffer<cl_float> input, CLWBuffer<cl_float> output, int numElems)
 {
-    assert(inputKeys.GetElementCount() == outputKeys.GetElementCount());
-    
-    cl_uint numElems = (cl_uint)inputKeys.GetElementCount();
-    
-    int GROUP_BLOCK_SIZE = (WG_SIZE * 4 * 8);
-    int NUM_BLOCKS =  (numElems + GROUP_BLOCK_SIZE - 1) / GROUP_BLOCK_SIZE;
-    
-    auto deviceHistograms = GetTempIntBuffer(NUM_BLOCKS * 16);
-    auto deviceTempKeys = GetTempIntBuffer(numElems);
-    
-    auto fromKeys = &inputKeys;
-    auto toKeys = &deviceTempKeys;
-    
-    CLWKernel histogramKernel = program_.GetKernel("BitHistogram");
-    CLWKernel scatterKeys = program_.GetKernel("ScatterKeys");
-
-    CLWEvent event;
+    // Two passes: per group results and a single group over them
+    int NUM_GROUPS = std::max(1, std::min((numElems + WG_SIZE - 1) / WG_SIZE, WG_SIZE));
 
-    for (int offset = 0; offset < 32; offset += 4)
-    {
-        // Split
-        histogramKernel.SetArg(0, offset);
-        histogramKernel.SetArg(1, *fromKeys);
-        histogramKernel.SetArg(2, numElems);
-        histogramKernel.SetArg(3, deviceHistograms);
+    auto devicePartResults = GetTempBuffer<cl_float>(NUM_GROUPS * 8);
 
-        context_.Launch1D(0, NUM_BLOCKS*WG_SIZE, WG_SIZE, histogramKernel);
+    CLWKernel reduceKernel = program_.GetKernel("reduce_bbox");
 
-        // Scan histograms
-        ScanExclusiveAdd(0, deviceHistograms, deviceHistograms, deviceHistograms.GetElementCount());
+    reduceKernel.SetArg(0, input);
+    reduceKernel.SetArg(1, (cl_uint)numElems);
+    reduceKernel.SetArg(2, devicePartResults);
 
-        // Scatter keys
-        scatterKeys.SetArg(0, offset);
-        scatterKeys.SetArg(1, *fromKeys);
-        scatterKeys.SetArg(2, (cl_uint)toKeys->GetElementCount());
-        scatterKeys.SetArg(3, deviceHistograms);
-        scatterKeys.SetArg(4, *toKeys);
+    context_.Launch1D(deviceIdx, NUM_GROUPS * WG_SIZE, WG_SIZE, reduceKernel);
 
-        event = context_.Launch1D(0, NUM_BLOCKS*WG_SIZE, WG_SIZE, scatterKeys);
+    reduceKernel.SetArg(0, devicePartResults);
+    reduceKernel.SetArg(1, (cl_uint)NUM_GROUPS);
+    reduceKernel.SetArg(2, output);
 
-        if (offset == 0)
-        {
-            fromKeys = &outputKeys;
-        }
+    CLWEvent event = context_.Launch1D(deviceIdx, WG_SIZE, WG_SIZE, reduceKernel);
 
-        // Swap pointers
-        std::swap(fromKeys, toKeys);
-    }
-
-    // Return buffers to memory manager
-    ReclaimTempIntBuffer(deviceHistograms);
-    ReclaimTempIntBuffer(deviceTempKeys);
+    ReclaimTempBuffer(devicePartResults);
 
-    // Return last copy event back to the user
     return event;
 }
 
 void CLWParallelPrimitives::ReclaimDeviceMemory()
 {
-    intBufferCache_.clear();
-    floatBufferCache_.clear();
+    bufferCache_.clear();
+    cacheSize_ = 0;
 }
 
-void CLWParallelPrimitives::ReclaimTempIntBuffer(CLWBuffer<cl_int> buffer)
+void CLWParallelPrimitives::SetTempBufferBudget(size_t budget)
 {
-    auto iter = intBufferCache_.find(buffer.GetElementCount());
-
-    if (iter != intBufferCache_.end())
-    {
-        return;
-    }
-
-    intBufferCache_[buffer.GetElementCount()] = buffer;
+    cacheBudget_ = budget;
+    EvictTempBuffers(cacheBudget_);
 }
 
-void CLWParallelPrimitives::ReclaimTempCharBuffer(CLWBuffer<char> buffer)
+CLWBuffer<char> CLWParallelPrimitives::AcquireTempBuffer(size_t size)
 {
-    auto iter = charBufferCache_.find(buffer.GetElementCount());
-
-    if (iter != charBufferCache_.end())
+    // Round up to the size class
+    size_t capacity = TEMP_BUFFER_MIN_SIZE;
+    while (capacity < size)
     {
-        return;
+        capacity <<= 1;
     }
 
-    charBufferCache_[buffer.GetElementCount()] = buffer;
-}
-
-void CLWParallelPrimitives::ReclaimTempFloatBuffer(CLWBuffer<cl_float> buffer)
-{
-    auto iter = floatBufferCache_.find(buffer.GetElementCount());
+    // Smallest free buffer which fits, if it is not too large
+    auto iter = bufferCache_.lower_bound(capacity);
 
-    if (iter != floatBufferCache_.end())
+    if (iter != bufferCache_.end() && iter->first <= (capacity << TEMP_BUFFER_MAX_CLASS_DISTANCE))
     {
-        return;
+        CLWBuffer<char> tmp = iter->second.buffer;
+        cacheSize_ -= iter->first;
+        bufferCache_.erase(iter);
+        return tmp;
     }
 
-    floatBufferCache_[buffer.GetElementCount()] = buffer;
+    return context_.CreateBuffer<char>(capacity, CL_MEM_READ_WRITE);
 }
 
-CLWEvent CLWParallelPrimitives::Compact(unsigned int deviceIdx, CLWBuffer<cl_int> predicate, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems, cl_int& newSize)
+void CLWParallelPrimitives::ReleaseTempBuffer(cl_mem buffer)
 {
-    /// Scan predicate array first to temp buffer
-    CLWBuffer<cl_int> addresses = GetTempIntBuffer(numElems);
-
-    ScanExclusiveAdd(deviceIdx, predicate, addresses, numElems).Wait();
-
-    /// New size = scanned[last] + perdicate[last]
-    /// TODO: remove this sync
-    context_.ReadBuffer(deviceIdx, addresses, &newSize, numElems - 1, 1).Wait();
-
-    cl_int lastPredicate = 0;
-    context_.ReadBuffer(deviceIdx, predicate, &lastPredicate, numElems - 1, 1).Wait();
-    newSize += lastPredicate;
-
-    int NUM_BLOCKS =  (int)((numElems + WG_SIZE - 1)/ WG_SIZE);
+    // Views may be smaller than the buffer, so the capacity is queried
+    auto tmp = CLWBuffer<char>::CreateFromClBuffer(buffer);
+    auto capacity = tmp.GetElementCount();
 
-    CLWKernel compactKernel = program_.GetKernel("compact_int");
+    TempBuffer entry = { tmp, ++useCount_ };
+    bufferCache_.insert(std::make_pair(capacity, entry));
+    cacheSize_ += capacity;
 
-    compactKernel.SetArg(0, predicate);
-    compactKernel.SetArg(1, addresses);
-    compactKernel.SetArg(2, input);
-    compactKernel.SetArg(3, (cl_uint)numElems);
-    compactKernel.SetArg(4, output);
+    EvictTempBuffers(cacheBudget_);
+}
 
-    /// TODO: unsafe as it is used in the kernel, may have problems on DMA devices
-    ReclaimTempIntBuffer(addresses);
+void CLWParallelPrimitives::EvictTempBuffers(size_t budget)
+{
+    while (cacheSize_ > budget && !bufferCache_.empty())
+    {
+        auto lru = bufferCache_.begin();
+        for (auto iter = bufferCache_.begin(); iter != bufferCache_.end(); ++iter)
+        {
+            if (iter->second.lastUse < lru->second.lastUse)
+            {
+                lru = iter;
+            }
+        }
 
-    return context_.Launch1D(deviceIdx, NUM_BLOCKS * WG_SIZE, WG_SIZE, compactKernel);
+        cacheSize_ -= lru->first;
+        bufferCache_.erase(lru);
+    }
 }
 
-CLWEvent CLWParallelPrimitives::Compact(unsigned int deviceIdx, CLWBuffer<cl_int> predicate, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems, CLWBuffer<cl_int> newSize)
+CLWEvent CLWParallelPrimitives::Compact(unsigned int deviceIdx, CLWBuffer<cl_int> predicate, cl_mem input, cl_mem output, int numElems, size_t elementSize, cl_mem newSize)
 {
     /// Scan predicate array first to temp buffer
-    CLWBuffer<cl_int> addresses = GetTempIntBuffer(numElems);
+    CLWBuffer<cl_int> addresses = GetTempBuffer<cl_int>(numElems);
 
     ScanExclusiveAdd(deviceIdx, predicate, addresses, numElems);
 
     int NUM_BLOCKS = (int)((numElems + WG_SIZE - 1) / WG_SIZE);
 
-    CLWKernel compactKernel = program_.GetKernel("compact_int_1");
+    CLWKernel compactKernel = program_.GetKernel(elementSize == sizeof(cl_long) ? "compact_long_1" : "compact_int_1");
 
     compactKernel.SetArg(0, predicate);
     compactKernel.SetArg(1, addresses);
@@ -933,12 +628,11 @@ CLWEvent CLWParallelPrimitives::Compact(unsigned int deviceIdx, CLWBuffer<cl_int
     compactKernel.SetArg(5, newSize);
 
     /// TODO: unsafe as it is used in the kernel, may have problems on DMA devices
-    ReclaimTempIntBuffer(addresses);
+    ReclaimTempBuffer(addresses);
 
     return context_.Launch1D(deviceIdx, NUM_BLOCKS * WG_SIZE, WG_SIZE, compactKernel);
 }
 
-
 CLWEvent CLWParallelPrimitives::Copy(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems)
 {
     int ELEMS_PER_WI = 4;
@@ -951,5 +645,5 @@ CLWEvent CLWParallelPrimitives::Copy(unsigned int deviceIdx, CLWBuffer<cl_int> i
     copyKernel.SetArg(1, numElems);
     copyKernel.SetArg(2, output);
 
-    return context_.Launch1D(0, NUM_BLOCKS * WG_SIZE, WG_SIZE, copyKernel);
+    return context_.Launch1D(deviceIdx, NUM_BLOCKS * WG_SIZE, WG_SIZE, copyKernel);
 }
@@ -22,70 +22,188 @@ THE SOFTWARE.
 #ifndef __CLW__CLWParallelPrimitives__
 #define __CLW__CLWParallelPrimitives__
 
+#include <map>
+
 #include "CLWContext.h"
 #include "CLWProgram.h"
 #include "CLWEvent.h"
 #include "CLWBuffer.h"
 
+// Element types of the primitives. Sort keys are sorted by value, values
+// are moved as 32-bit words. Scan runs kernels generated for the OpenCL type
+// doing the same arithmetic, compact copies words of the element size.
+template <typename T> struct CLWPrimitiveTraits;
+
+template <> struct CLWPrimitiveTraits<cl_int>
+{
+    static char const* ScanType() { return "int"; }
+    enum { kKeyWords = 1, kKeyType = 1 };
+};
+
+template <> struct CLWPrimitiveTraits<cl_uint>
+{
+    static char const* ScanType() { return "int"; }
+    enum { kKeyWords = 1, kKeyType = 0 };
+};
+
+template <> struct CLWPrimitiveTraits<cl_float>
+{
+    static char const* ScanType() { return "float"; }
+    enum { kKeyWords = 1, kKeyType = 2 };
+};
+
+template <> struct CLWPrimitiveTraits<cl_long>
+{
+    enum { kKeyWords = 2, kKeyType = 1 };
+};
+
+template <> struct CLWPrimitiveTraits<cl_ulong>
+{
+    enum { kKeyWords = 2, kKeyType = 0 };
+};
+
 class CLWParallelPrimitives
 {
 public:
     // Create primitive instances for the context
     CLWParallelPrimitives(CLWContext context, char const* buildopts = nullptr);
-    CLWParallelPrimitives(){}
+    CLWParallelPrimitives();
     ~CLWParallelPrimitives();
 
-    ///  TODO: Make these templates at some point
-    CLWEvent ScanExclusiveAdd(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems);
+    // Exclusive scan of cl_int, cl_uint or cl_float elements
+    template <typename T>
+    CLWEvent ScanExclusiveAdd(unsigned int deviceIdx, CLWBuffer<T> input, CLWBuffer<T> output, int numElems);
     CLWEvent SegmentedScanExclusiveAdd(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> inputHeads, CLWBuffer<cl_int> output);
 
-    CLWEvent ScanExclusiveAdd(unsigned int deviceIdx, CLWBuffer<cl_float> input, CLWBuffer<cl_float> output, int numElems);
-
-    CLWEvent SortRadix(unsigned int deviceIdx, CLWBuffer<cl_int> inputKeys, CLWBuffer<cl_int> outputKeys,
-                       CLWBuffer<cl_int> inputValues, CLWBuffer<cl_int> outputValues, int numElems);
-
-    CLWEvent SortRadix(unsigned int deviceIdx, CLWBuffer<char> inputKeys, CLWBuffer<char> outputKeys,
-        CLWBuffer<char> inputValues, CLWBuffer<char> outputValues, int numElems);
-
-    CLWEvent SortRadix(unsigned int deviceIdx, CLWBuffer<cl_int> inputKeys, CLWBuffer<cl_int> outputKeys);
-
-    CLWEvent Compact(unsigned int deviceIdx, CLWBuffer<cl_int> predicate, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems, cl_int& newSize);
-    CLWEvent Compact(unsigned int deviceIdx, CLWBuffer<cl_int> predicate, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems, CLWBuffer<cl_int> newSize);
+    // Stable sort of cl_int, cl_uint, cl_float, cl_long or cl_ulong keys with 32-bit values
+    template <typename K, typename V>
+    CLWEvent SortRadix(unsigned int deviceIdx, CLWBuffer<K> inputKeys, CLWBuffer<K> outputKeys,
+                       CLWBuffer<V> inputValues, CLWBuffer<V> outputValues, int numElems);
+
+    // Sort keys only, buffers hold exactly the keys to sort
+    template <typename K>
+    CLWEvent SortRadix(unsigned int deviceIdx, CLWBuffer<K> inputKeys, CLWBuffer<K> outputKeys);
+
+    // Compact 32 or 64-bit elements with non-zero predicate. This overload reads newSize back to
+    // the host and blocks until the compaction is done, the one taking a buffer stays asynchronous
+    template <typename T>
+    CLWEvent Compact(unsigned int deviceIdx, CLWBuffer<cl_int> predicate, CLWBuffer<T> input, CLWBuffer<T> output, int numElems, cl_int& newSize);
+    template <typename T>
+    CLWEvent Compact(unsigned int deviceIdx, CLWBuffer<cl_int> predicate, CLWBuffer<T> input, CLWBuffer<T> output, int numElems, CLWBuffer<cl_int> newSize);
     CLWEvent Copy(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems);
 
+    // Min and max of numElems floats, output holds 2 floats
+    CLWEvent ReduceMinMax(unsigned int deviceIdx, CLWBuffer<cl_float> input, CLWBuffer<cl_float> output, int numElems);
+    // Union of numElems bounding boxes stored as (pmin, pmax) float4 pairs, output holds 8 floats
+    CLWEvent ReduceBbox(unsigned int deviceIdx, CLWBuffer<cl_float> input, CLWBuffer<cl_float> output, int numElems);
+
     void ReclaimDeviceMemory();
 
+    // Limit of the memory kept by the temporary buffer pool, least recently
+    // used buffers are released once it is exceeded
+    void SetTempBufferBudget(size_t budget);
+
 protected:
-    CLWEvent ScanExclusiveAddWG(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems);
+    // Untyped implementations, type is the OpenCL type of the kernels
+    CLWEvent ScanExclusiveAdd(unsigned int deviceIdx, cl_mem input, cl_mem output, int numElems, char const* type);
+    CLWEvent ScanExclusiveAddWG(unsigned int deviceIdx, cl_mem input, cl_mem output, int numElems, char const* type);
+    // Single pass scan with decoupled lookback between tiles
+    CLWEvent ScanExclusiveAddLookback(unsigned int deviceIdx, cl_mem input, cl_mem output, int numElems, char const* type, size_t typeSize);
+
     CLWEvent SegmentedScanExclusiveAddWG(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> inputHeads, CLWBuffer<cl_int> output);
-    
-    CLWEvent ScanExclusiveAddTwoLevel(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems);
     CLWEvent SegmentedScanExclusiveAddTwoLevel(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> inputHeads, CLWBuffer<cl_int> output);
-    
-    CLWEvent ScanExclusiveAddThreeLevel(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems);
     CLWEvent SegmentedScanExclusiveAddThreeLevel(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> inputHeads, CLWBuffer<cl_int> output);
-
     CLWEvent SegmentedScanExclusiveAddFourLevel(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> inputHeads, CLWBuffer<cl_int> output);
 
-    CLWEvent ScanExclusiveAddWG(unsigned int deviceIdx, CLWBuffer<cl_float> input, CLWBuffer<cl_float> output, int numElems);
-    CLWEvent ScanExclusiveAddTwoLevel(unsigned int deviceIdx, CLWBuffer<cl_float> input, CLWBuffer<cl_float> output, int numElems);
-    CLWEvent ScanExclusiveAddThreeLevel(unsigned int deviceIdx, CLWBuffer<cl_float> input, CLWBuffer<cl_float> output, int numElems);
+    // Onesweep radix sort of keys made of keyWords 32-bit words, values are optional
+    CLWEvent SortRadixOnesweep(unsigned int deviceIdx, cl_mem inputKeys, cl_mem outputKeys,
+        cl_mem inputValues, cl_mem outputValues, int numElems, int keyWords, int keyType);
+
+    // Compact elements of elementSize bytes, newSize is optional
+    CLWEvent Compact(unsigned int deviceIdx, CLWBuffer<cl_int> predicate, cl_mem input, cl_mem output, int numElems, size_t elementSize, cl_mem newSize);
+
+    // Temporary buffers come from a pool of power of two sized buffers,
+    // returned buffers may be larger than requested
+    template <typename T> CLWBuffer<T> GetTempBuffer(size_t size);
+    template <typename T> void ReclaimTempBuffer(CLWBuffer<T> buffer);
 
-    CLWBuffer<cl_int> GetTempIntBuffer(size_t size);
-    void              ReclaimTempIntBuffer(CLWBuffer<cl_int> buffer);
-    CLWBuffer<char> GetTempCharBuffer(size_t size);
-    void              ReclaimTempCharBuffer(CLWBuffer<char> buffer);
-    CLWBuffer<cl_float> GetTempFloatBuffer(size_t size);
-    void               ReclaimTempFloatBuffer(CLWBuffer<cl_float> buffer);
+    CLWBuffer<char> AcquireTempBuffer(size_t size);
+    void ReleaseTempBuffer(cl_mem buffer);
+    void EvictTempBuffers(size_t budget);
 
 private:
+    struct TempBuffer
+    {
+        CLWBuffer<char> buffer;
+        unsigned long long lastUse;
+    };
+
     CLWContext context_;
     CLWProgram program_;
 
-    std::map<size_t, CLWBuffer<cl_int> > intBufferCache_;
-    std::map<size_t, CLWBuffer<char> > charBufferCache_;
-    std::map<size_t, CLWBuffer<cl_float> > floatBufferCache_;
+    // Free buffers by capacity in bytes
+    std::multimap<size_t, TempBuffer> bufferCache_;
+    size_t cacheSize_;
+    size_t cacheBudget_;
+    unsigned long long useCount_;
 };
 
+template <typename T>
+inline CLWEvent CLWParallelPrimitives::ScanExclusiveAdd(unsigned int deviceIdx, CLWBuffer<T> input, CLWBuffer<T> output, int numElems)
+{
+    return ScanExclusiveAdd(deviceIdx, (cl_mem)input, (cl_mem)output, numElems, CLWPrimitiveTraits<T>::ScanType());
+}
+
+template <typename K, typename V>
+inline CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<K> inputKeys, CLWBuffer<K> outputKeys,
+    CLWBuffer<V> inputValues, CLWBuffer<V> outputValues, int numElems)
+{
+    static_assert(sizeof(V) == sizeof(cl_uint), "Sort values should be 32-bit");
+
+    return SortRadixOnesweep(deviceIdx, inputKeys, outputKeys, inputValues, outputValues, numElems,
+        CLWPrimitiveTraits<K>::kKeyWords, CLWPrimitiveTraits<K>::kKeyType);
+}
+
+template <typename K>
+inline CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<K> inputKeys, CLWBuffer<K> outputKeys)
+{
+    return SortRadixOnesweep(deviceIdx, inputKeys, outputKeys, nullptr, nullptr, (int)inputKeys.GetElementCount(),
+        CLWPrimitiveTraits<K>::kKeyWords, CLWPrimitiveTraits<K>::kKeyType);
+}
+
+template <typename T>
+inline CLWEvent CLWParallelPrimitives::Compact(unsigned int deviceIdx, CLWBuffer<cl_int> predicate, CLWBuffer<T> input, CLWBuffer<T> output, int numElems, cl_int& newSize)
+{
+    auto deviceNewSize = GetTempBuffer<cl_int>(1);
+
+    Compact(deviceIdx, predicate, input, output, numElems, sizeof(T), deviceNewSize);
+
+    // Blocking by contract, see the declaration
+    CLWEvent event = context_.ReadBuffer(deviceIdx, deviceNewSize, &newSize, 1);
+    event.Wait();
+
+    ReclaimTempBuffer(deviceNewSize);
+
+    return event;
+}
+
+template <typename T>
+inline CLWEvent CLWParallelPrimitives::Compact(unsigned int deviceIdx, CLWBuffer<cl_int> predicate, CLWBuffer<T> input, CLWBuffer<T> output, int numElems, CLWBuffer<cl_int> newSize)
+{
+    return Compact(deviceIdx, predicate, input, output, numElems, sizeof(T), newSize);
+}
+
+template <typename T>
+inline CLWBuffer<T> CLWParallelPrimitives::GetTempBuffer(size_t size)
+{
+    return CLWBuffer<T>::CreateFromClBuffer(AcquireTempBuffer(size * sizeof(T)), size);
+}
+
+template <typename T>
+inline void CLWParallelPrimitives::ReclaimTempBuffer(CLWBuffer<T> buffer)
+{
+    ReleaseTempBuffer(buffer);
+}
+
 
 #endif /* defined(__CLW__CLWParallelPrimitives__) */
\ No newline at end of file
@@ -209,6 +209,43 @@ CLWProgram CLWProgram::CreateFromFile(char const* filename,
     }
 }
 
+CLWProgram CLWProgram::CreateFromBinary(std::uint8_t const* binary,
+                                        size_t binarysize,
+                                        char const* buildopts,
+                                        CLWContext context)
+{
+    cl_int status = CL_SUCCESS;
+
+    std::vector<cl_device_id> deviceIds(context.GetDeviceCount());
+    std::vector<unsigned char const*> binaries(context.GetDeviceCount());
+    std::vector<size_t> binarysizes(context.GetDeviceCount());
+    for(unsigned int i = 0; i < context.GetDeviceCount(); ++i)
+    {
+        deviceIds[i] = context.GetDevice(i);
+        binaries[i] = binary;
+        binarysizes[i] = binarysize;
+    }
+
+    std::vector<cl_int> binarystatus(context.GetDeviceCount());
+    cl_program program = clCreateProgramWithBinary(context, context.GetDeviceCount(), &deviceIds[0], &binarysizes[0], &binaries[0], &binarystatus[0], &status);
+
+    ThrowIf(status != CL_SUCCESS, status, "clCreateProgramWithBinary failed");
+
+    status = clBuildProgram(program, context.GetDeviceCount(), &deviceIds[0], buildopts, nullptr, nullptr);
+
+    if(status != CL_SUCCESS)
+    {
+        clReleaseProgram(program);
+        throw CLWException(status, "clBuildProgram failed for program binary");
+    }
+
+    CLWProgram prg(program);
+
+    clReleaseProgram(program);
+
+    return prg;
+}
+
 CLWProgram::CLWProgram(cl_program program)
 : ReferenceCounter<cl_program, clRetainProgram, clReleaseProgram>(program)
 {
@@ -258,3 +295,27 @@ CLWKernel CLWProgram::GetKernel(std::string const& funcName) const
     
     return iter->second;
 }
+
+std::vector<std::uint8_t> CLWProgram::GetBinary() const
+{
+    cl_uint numDevices = 0;
+    cl_int status = clGetProgramInfo(*this, CL_PROGRAM_NUM_DEVICES, sizeof(numDevices), &numDevices, nullptr);
+    ThrowIf(status != CL_SUCCESS, status, "clGetProgramInfo failed");
+
+    std::vector<size_t> binarysizes(numDevices);
+    status = clGetProgramInfo(*this, CL_PROGRAM_BINARY_SIZES, numDevices * sizeof(size_t), &binarysizes[0], nullptr);
+    ThrowIf(status != CL_SUCCESS, status, "clGetProgramInfo failed");
+
+    std::vector<std::vector<std::uint8_t> > binaries(numDevices);
+    std::vector<unsigned char*> binaryptrs(numDevices);
+    for (cl_uint i = 0; i < numDevices; ++i)
+    {
+        binaries[i].resize(binarysizes[i]);
+        binaryptrs[i] = binarysizes[i] > 0 ? &binaries[i][0] : nullptr;
+    }
+
+    status = clGetProgramInfo(*this, CL_PROGRAM_BINARIES, numDevices * sizeof(unsigned char*), &binaryptrs[0], nullptr);
+    ThrowIf(status != CL_SUCCESS, status, "clGetProgramInfo failed");
+
+    return binaries[0];
+}
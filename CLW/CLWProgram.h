@@ -22,6 +22,7 @@ THE SOFTWARE.
 #ifndef __CLW__CLWProgram__
 #define __CLW__CLWProgram__
 
+#include <cstdint>
 #include <iostream>
 #include <memory>
 #include <vector>
@@ -62,11 +63,21 @@ public:
                                      char const* buildopts,
                                      CLWContext context);
 
+    // Create the program from a device binary previously returned by GetBinary,
+    // the same binary is used for all the devices of the context
+    static CLWProgram CreateFromBinary(std::uint8_t const* binary,
+                                       size_t binarysize,
+                                       char const* buildopts,
+                                       CLWContext context);
+
     CLWProgram() {}
     virtual      ~CLWProgram();
 
     unsigned int GetKernelCount() const;
     CLWKernel    GetKernel(std::string const& funcName) const;
+
+    // Device binary of the program built for the first device of the context
+    std::vector<std::uint8_t> GetBinary() const;
     
 private:
     CLWProgram(cl_program program);
@@ -20,49 +20,43 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 ********************************************************************/
 #include "ParameterHolder.h"
-#include <cassert>
+#include "CLWExcept.h"
 
 
 void ParameterHolder::SetArg(cl_kernel kernel, unsigned int idx)
 {
-    cl_int status = CL_SUCCESS;
+    cl_int status = clSetKernelArg(kernel, idx, GetSize(), GetData());
+
+    ThrowIf(status != CL_SUCCESS, status, "clSetKernelArg failed");
+}
+
+size_t ParameterHolder::GetSize() const
+{
     switch (type_)
     {
         case ParameterHolder::kMem:
-            status = clSetKernelArg(kernel, idx, sizeof(cl_mem), &mem_);
-            break;
+            return sizeof(cl_mem);
         case ParameterHolder::kInt:
-            status = clSetKernelArg(kernel, idx, sizeof(cl_int), &intValue_);
-            break;
-            
+            return sizeof(cl_int);
         case ParameterHolder::kUInt:
-            status = clSetKernelArg(kernel, idx, sizeof(cl_uint), &uintValue_);
-            break;
-            
+            return sizeof(cl_uint);
         case ParameterHolder::kFloat:
-            status = clSetKernelArg(kernel, idx, sizeof(cl_float), &floatValue_);
-            break;
-        
+            return sizeof(cl_float);
         case ParameterHolder::kFloat2:
-            status = clSetKernelArg(kernel, idx, sizeof(cl_float2), &floatValue2_);
-            break;
-        
+            return sizeof(cl_float2);
         case ParameterHolder::kFloat4:
-            status = clSetKernelArg(kernel, idx, sizeof(cl_float4), &floatValue4_);
-            break;
-        
+            return sizeof(cl_float4);
         case ParameterHolder::kDouble:
-            status = clSetKernelArg(kernel, idx, sizeof(cl_double), &doubleValue_);
-            break;
-            
+            return sizeof(cl_double);
         case ParameterHolder::kShmem:
-            status = clSetKernelArg(kernel, idx, uintValue_, nullptr);
-            break;
-            
+            return uintValue_;
         default:
-            break;
+            return 0;
     }
-    
-    assert(status == CL_SUCCESS);
-    // TODO: add error handling
+}
+
+void const* ParameterHolder::GetData() const
+{
+    // All values start at the beginning of the union
+    return type_ == ParameterHolder::kShmem ? nullptr : static_cast<void const*>(&mem_);
 }
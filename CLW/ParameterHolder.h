@@ -63,6 +63,12 @@ public:
     ParameterHolder(SharedMemory shMem) : uintValue_(shMem.size_) { type_ = kShmem; }
     
     void SetArg(cl_kernel kernel, unsigned int idx);
+
+    Type GetType() const { return type_; }
+    // Size and address of the value as passed to clSetKernelArg,
+    // shared memory has no value and returns nullptr
+    size_t GetSize() const;
+    void const* GetData() const;
     
 private:
     
@@ -34,6 +34,30 @@ project "Calc"
 	links {"CLW"}
     end
 
+    if _OPTIONS["embed_kernels"] then
+        defines {"RR_EMBED_KERNELS=1"}
+
+        if _OPTIONS["use_vulkan"] then
+            os.execute( "python ../Tools/scripts/stringify.py " ..
+                                os.getcwd() .. "/../Calc/kernels/GLSL/ "  ..
+                                ".comp " ..
+                                "vulkan " ..
+                                 "> ./kernelcache/calckernels_vk.h"
+                                )
+            print ">> Calc: VK kernels embedded"
+
+            -- SPIR-V is optional, GLSL embedded above is compiled at runtime without it
+            if os.execute( "python ../Tools/scripts/spirvify.py " ..
+                                os.getcwd() .. "/../Calc/kernels/GLSL/ "  ..
+                                ".comp " ..
+                                 "> ./kernelcache/calckernels_vk_spirv.h"
+                                ) == true then
+                defines {"RR_EMBED_SPIRV=1"}
+                print ">> Calc: VK kernels precompiled to SPIR-V"
+            end
+        end
+    end
+
     configuration {"x32", "Debug"}
         targetdir "../Bin/Debug/x86"
     configuration {"x64", "Debug"}
@@ -33,6 +33,8 @@ namespace Calc
         virtual ~Buffer(){};
 
         virtual std::size_t GetSize() const = 0;
+        // Storage is shared with the host, so maps return it in place without copies
+        virtual bool IsShared() const { return false; }
 
         Buffer(Buffer const&) = delete;
         Buffer& operator = (Buffer const&) = delete;
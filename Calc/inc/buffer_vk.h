@@ -40,10 +40,14 @@ namespace Calc {
     class BufferVulkan : public Buffer {
         friend class DeviceVulkanw;
     public:
-        BufferVulkan(Anvil::Buffer *inBuffer, bool inCreatedInternally)
+        BufferVulkan(Anvil::Buffer *inBuffer, bool inCreatedInternally, bool inDeviceLocal = false)
                 : Buffer(), m_anvil_buffer(inBuffer)
                   , m_created_internally(inCreatedInternally)
-                  , m_fence_id(0) {
+                  , m_device_local(inDeviceLocal)
+                  , m_fence_id(0)
+                  , m_write_fence_id(0)
+                  , m_pending_write(false)
+                  , m_pending_read(false) {
             ::memset(&m_mapped_memory, 0, sizeof(m_mapped_memory));
         }
 
@@ -75,14 +79,28 @@ namespace Calc {
         // whether a buffer is internally created by RadeonRays Vulkan implementation. It's used when single value is passed to shaders.
         bool GetIsCreatedInternally() const { return m_created_internally; }
 
+        // device local buffers aren't mappable, data is copied through the staging ring of the device
+        bool IsDeviceLocal() const { return m_device_local; }
+
     private:
         void SetFenceId( uint64_t id ) { m_fence_id = id; }
+        // writes are uses as well
+        void SetWriteFenceId( uint64_t id ) { m_fence_id = id; m_write_fence_id = id; }
 
         Anvil::Buffer *m_anvil_buffer;
         MappedMemory m_mapped_memory;
         bool m_created_internally;
+        bool m_device_local;
 
+        // Fences of the last batch using the buffer and the last one writing it,
+        // host reads only wait for writes while host writes wait for all uses
         std::atomic<uint64_t> m_fence_id;
+        std::atomic<uint64_t> m_write_fence_id;
+
+        // Accesses by dispatches and copies not yet ordered by a barrier:
+        // later accesses have to wait for a write, later writes for a read
+        bool m_pending_write;
+        bool m_pending_read;
     };
 
 }
\ No newline at end of file
@@ -57,6 +57,14 @@ namespace Calc
         // return the platform used
         virtual Platform GetPlatform() = 0;
 
+        // Directory to store compiled kernels in, applies to devices created afterwards.
+        // Caching is disabled if the path is empty or nullptr
+        virtual void SetKernelCachePath(char const* path) = 0;
+
+        // Let devices created afterwards run commands out of order, dependencies
+        // are then tracked per buffer. Ignored by platforms without such queues
+        virtual void SetOutOfOrderQueues(bool enable) = 0;
+
         // Forbidden stuff
         Calc(Calc const&) = delete;
         Calc& operator = (Calc const&) = delete;
@@ -48,13 +48,23 @@ namespace Calc
     {
         kRead = 0x1,
         kWrite = 0x2,
-        kPinned = 0x4
+        // Host accessible memory for buffers the host reads or writes often
+        kPinned = 0x4,
+        // Use initdata as the buffer storage instead of copying it,
+        // only valid for devices with host unified memory
+        kHostPtr = 0x8,
+        // Storage in shared virtual memory the host and the kernels access in place,
+        // so mapping doesn't copy. Falls back to kPinned on devices without it
+        kShared = 0x10
     };
 
     enum MapType
     {
         kMapRead = 0x1,
-        kMapWrite = 0x2
+        kMapWrite = 0x2,
+        // Combined with kMapWrite, the range is overwritten by the host,
+        // so its contents are not copied from the device
+        kMapWriteDiscard = 0x4
     };
 
     enum class DeviceType : std::uint8_t
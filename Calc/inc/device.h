@@ -46,11 +46,22 @@ namespace Calc
 
         std::uint32_t min_alignment;
         std::uint32_t max_num_queues;
+        // Queues for latency bound and background work, created with scheduling
+        // priority hints where the platform supports them, same as 0 with a single queue
+        std::uint32_t high_priority_queue;
+        std::uint32_t low_priority_queue;
+        // Number of compute units, 0 if unknown
+        std::uint32_t max_compute_units;
 
         std::size_t global_mem_size;
         std::size_t local_mem_size;
         std::size_t max_alloc_size;
         std::size_t max_local_size;
+
+        // Device memory is the host memory, e.g. integrated GPUs
+        bool host_unified_memory;
+        // Fine-grained shared virtual memory, kShared buffers are accessed in place
+        bool shared_virtual_memory;
     };
 
     // Main interface to control compute device
@@ -101,10 +112,16 @@ namespace Calc
         // Execution
         // Calls are blocking if passed nullptr for an event, otherwise use Event to sync
         virtual void Execute(Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event** e) = 0;
+        // Launch a part of a larger grid, global ids start at global_offset which is a multiple of local_size.
+        // Kernels using group ids see them relative to the part and can't be split this way.
+        virtual void ExecuteRange(Function const* func, std::uint32_t queue, size_t global_offset, size_t global_size, size_t local_size, Event** e) = 0;
 
         // Events handling
         virtual void WaitForEvent(Event* e) = 0;
         virtual void WaitForMultipleEvents(Event** e, std::size_t num_events) = 0;
+        // Event completing once the events and the commands submitted to the queue before
+        // are complete, so a single event can stand for several dependencies
+        virtual void JoinEvents(std::uint32_t queue, Event** e, std::size_t num_events, Event** joined) = 0;
         virtual void DeleteEvent(Event* e) = 0;
 
         // Queue management functions
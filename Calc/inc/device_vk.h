@@ -35,5 +35,10 @@ namespace Calc
     public:
         DeviceVulkan() = default;
         virtual ~DeviceVulkan() = default;
+
+        // Dispatches are recorded into one command buffer and submitted together
+        // when the batch is full, on Flush/Finish or when the host waits for its results.
+        // 1 submits every dispatch immediately
+        virtual void SetMaxBatchSize(std::uint32_t num_dispatches) = 0;
     };
 }
\ No newline at end of file
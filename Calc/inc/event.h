@@ -34,6 +34,12 @@ namespace Calc
 
         virtual void Wait() = 0;
         virtual bool IsComplete() const = 0;
+        // Device timestamps in nanoseconds taken when the command started and ended,
+        // returns false if the timing is not available. The event has to be complete.
+        virtual bool GetProfilingInfo(std::uint64_t& start, std::uint64_t& end) const = 0;
+        // Have callback(userdata) called from a runtime thread once the event completes,
+        // returns false if the backend has no completion notifications and the event has to be polled
+        virtual bool SetCallback(void (*callback)(void*), void* userdata) { return false; }
 
         Event(Event const&) = delete;
         Event& operator = (Event const&) = delete;
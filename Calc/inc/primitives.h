@@ -34,6 +34,20 @@ namespace Calc
         virtual ~Primitives() = default;
 
         virtual void SortRadixInt32(std::uint32_t queueidx, Buffer const* from_key, Buffer* to_key, Buffer const* from_value, Buffer* to_value, std::size_t size) = 0;
+        // Keys are 64-bit unsigned integers, values are 32-bit
+        virtual void SortRadixInt64(std::uint32_t queueidx, Buffer const* from_key, Buffer* to_key, Buffer const* from_value, Buffer* to_value, std::size_t size) = 0;
+
+        // Exclusive prefix sum of 32-bit integers
+        virtual void ScanExclusiveAddInt32(std::uint32_t queueidx, Buffer const* from, Buffer* to, std::size_t size) = 0;
+        // Exclusive prefix sum restarting at elements with non-zero head flags
+        virtual void SegmentedScanExclusiveAddInt32(std::uint32_t queueidx, Buffer const* from, Buffer const* heads, Buffer* to, std::size_t size) = 0;
+        // Copy 32-bit elements with non-zero predicate keeping their order,
+        // the number of copied elements is written to new_size as a single int
+        virtual void CompactInt32(std::uint32_t queueidx, Buffer const* predicate, Buffer const* from, Buffer* to, std::size_t size, Buffer* new_size) = 0;
+        // Minimum and maximum of floats, written to result as 2 floats
+        virtual void ReduceMinMaxFloat(std::uint32_t queueidx, Buffer const* from, Buffer* result, std::size_t size) = 0;
+        // Union of bounding boxes stored as (pmin, pmax) float4 pairs, written to result as a single box
+        virtual void ReduceBbox(std::uint32_t queueidx, Buffer const* from, Buffer* result, std::size_t size) = 0;
 
 
     private:
@@ -0,0 +1,80 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "calc_common.h"
+
+#include <cstdint>
+
+// Scoped timeline instrumentation of build and query paths.
+// RR_TRACE_SCOPE(name) records the enclosing scope under name, which has to be a string literal.
+// It compiles to nothing unless one of the following is defined:
+//  RR_ENABLE_TRACE - events are saved as Chrome trace JSON (chrome://tracing, Perfetto) on exit,
+//                    to the file named by RR_TRACE_FILE environment variable or radeonrays_trace.json
+//  RR_ENABLE_TRACY - scopes become Tracy zones, Tracy headers and client sources are provided by the user
+namespace Calc
+{
+    class CALC_API Trace
+    {
+    public:
+        // Microseconds since the trace start
+        static std::uint64_t Now();
+        // Record a complete event of the calling thread
+        static void AddEvent(char const* name, std::uint64_t start, std::uint64_t end);
+        // Write events recorded so far as Chrome trace JSON, returns false if the file can't be written
+        static bool Save(char const* path);
+    };
+
+    class ScopedTrace
+    {
+    public:
+        explicit ScopedTrace(char const* name)
+            : m_name(name)
+            , m_start(Trace::Now())
+        {
+        }
+
+        ~ScopedTrace()
+        {
+            Trace::AddEvent(m_name, m_start, Trace::Now());
+        }
+
+        ScopedTrace(ScopedTrace const&) = delete;
+        ScopedTrace& operator = (ScopedTrace const&) = delete;
+
+    private:
+        char const* m_name;
+        std::uint64_t m_start;
+    };
+}
+
+#define RR_TRACE_CONCAT_IMPL(a, b) a##b
+#define RR_TRACE_CONCAT(a, b) RR_TRACE_CONCAT_IMPL(a, b)
+
+#if defined(RR_ENABLE_TRACY)
+#include <Tracy.hpp>
+#define RR_TRACE_SCOPE(name) ZoneScopedN(name)
+#elif defined(RR_ENABLE_TRACE)
+#define RR_TRACE_SCOPE(name) ::Calc::ScopedTrace RR_TRACE_CONCAT(rr_trace_scope_, __LINE__)(name)
+#else
+#define RR_TRACE_SCOPE(name)
+#endif
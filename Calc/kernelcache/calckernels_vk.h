@@ -0,0 +1,605 @@
+/* This is an auto-generated file. Do not edit manually*/
+
+static const char g_primitives_vulkan[]= \
+"#version 430 \n"\
+" \n"\
+"// Note Anvil define system assumes first line is alway a #version so don't rearrange \n"\
+" \n"\
+"// \n"\
+"// Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved. \n"\
+"// \n"\
+"// Permission is hereby granted, free of charge, to any person obtaining a copy \n"\
+"// of this software and associated documentation files (the \"Software\"), to deal \n"\
+"// in the Software without restriction, including without limitation the rights \n"\
+"// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell \n"\
+"// copies of the Software, and to permit persons to whom the Software is \n"\
+"// furnished to do so, subject to the following conditions: \n"\
+"// \n"\
+"// The above copyright notice and this permission notice shall be included in \n"\
+"// all copies or substantial portions of the Software. \n"\
+"// \n"\
+"// THE SOFTWARE IS PROVIDED \"AS IS\", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR \n"\
+"// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, \n"\
+"// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE \n"\
+"// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER \n"\
+"// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, \n"\
+"// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN \n"\
+"// THE SOFTWARE. \n"\
+"// \n"\
+" \n"\
+"// Parallel primitives of the Vulkan backend. \n"\
+"// Function arguments are bound in the order they are set, so every function \n"\
+"// declares its own bindings. The function being compiled is renamed to main \n"\
+"// with a define, which is used here to select its declarations. \n"\
+" \n"\
+"layout( local_size_x = 64, local_size_y = 1, local_size_z = 1 ) in; \n"\
+" \n"\
+"// Has to match local_size_x \n"\
+"#define GROUP_SIZE 64 \n"\
+" \n"\
+"// Scan operations, have to match PrimitivesVulkanw \n"\
+"#define SCAN_OP_ADD 0 \n"\
+"#define SCAN_OP_MAX 1 \n"\
+"#define SCAN_OP_COUNT 2 \n"\
+" \n"\
+"// Elements processed by a work-group of the scan and the radix sort \n"\
+"#define ELEMS_PER_THREAD 4 \n"\
+"#define BLOCK_SIZE (GROUP_SIZE * ELEMS_PER_THREAD) \n"\
+" \n"\
+"// Radix sort digit \n"\
+"#define RADIX_BITS 4 \n"\
+"#define RADIX (1 << RADIX_BITS) \n"\
+" \n"\
+"#define FLT_MAX 3.402823466e+38 \n"\
+" \n"\
+"// \n"\
+"// Exclusive scan of a block of BLOCK_SIZE elements per work-group, \n"\
+"// totals of the blocks are written to BlockSums \n"\
+"// \n"\
+"#if defined(scan_block) \n"\
+"layout( std430, binding = 0 ) buffer restrict readonly InputBlock \n"\
+"{ \n"\
+"    int Input[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 1 ) buffer restrict writeonly OutputBlock \n"\
+"{ \n"\
+"    int Output[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 2 ) buffer restrict readonly NumBlock \n"\
+"{ \n"\
+"    uint Num; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 3 ) buffer restrict readonly OpBlock \n"\
+"{ \n"\
+"    uint Op; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 4 ) buffer restrict writeonly BlockSumsBlock \n"\
+"{ \n"\
+"    int BlockSums[]; \n"\
+"}; \n"\
+" \n"\
+"shared int Partials[GROUP_SIZE]; \n"\
+" \n"\
+"// Identity of both operations is 0 as max scans are only used on non-negative values \n"\
+"int ScanOp( in int a, in int b ) \n"\
+"{ \n"\
+"    return Op == SCAN_OP_MAX ? max(a, b) : a + b; \n"\
+"} \n"\
+" \n"\
+"void scan_block() \n"\
+"{ \n"\
+"    uint localID = gl_LocalInvocationID.x; \n"\
+"    uint base = gl_WorkGroupID.x * BLOCK_SIZE + localID * ELEMS_PER_THREAD; \n"\
+" \n"\
+"    // Scan consecutive elements of the thread \n"\
+"    int values[ELEMS_PER_THREAD]; \n"\
+"    int sum = 0; \n"\
+"    for (uint i = 0; i < ELEMS_PER_THREAD; ++i) \n"\
+"    { \n"\
+"        int value = base + i < Num ? Input[base + i] : 0; \n"\
+" \n"\
+"        if (Op == SCAN_OP_COUNT) \n"\
+"        { \n"\
+"            value = value != 0 ? 1 : 0; \n"\
+"        } \n"\
+" \n"\
+"        values[i] = sum; \n"\
+"        sum = ScanOp(sum, value); \n"\
+"    } \n"\
+" \n"\
+"    // Inclusive scan of thread totals \n"\
+"    Partials[localID] = sum; \n"\
+"    barrier(); \n"\
+" \n"\
+"    for (uint offset = 1; offset < GROUP_SIZE; offset <<= 1) \n"\
+"    { \n"\
+"        int other = localID >= offset ? Partials[localID - offset] : 0; \n"\
+"        barrier(); \n"\
+"        Partials[localID] = ScanOp(Partials[localID], other); \n"\
+"        barrier(); \n"\
+"    } \n"\
+" \n"\
+"    int prefix = localID > 0 ? Partials[localID - 1] : 0; \n"\
+"    for (uint i = 0; i < ELEMS_PER_THREAD; ++i) \n"\
+"    { \n"\
+"        if (base + i < Num) \n"\
+"        { \n"\
+"            Output[base + i] = ScanOp(prefix, values[i]); \n"\
+"        } \n"\
+"    } \n"\
+" \n"\
+"    if (localID == GROUP_SIZE - 1) \n"\
+"    { \n"\
+"        BlockSums[gl_WorkGroupID.x] = Partials[localID]; \n"\
+"    } \n"\
+"} \n"\
+"#endif \n"\
+" \n"\
+"// \n"\
+"// Combine scanned block totals with the blocks \n"\
+"// \n"\
+"#if defined(add_block_sums) \n"\
+"layout( std430, binding = 0 ) buffer restrict readonly BlockSumsBlock \n"\
+"{ \n"\
+"    int BlockSums[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 1 ) buffer restrict OutputBlock \n"\
+"{ \n"\
+"    int Output[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 2 ) buffer restrict readonly NumBlock \n"\
+"{ \n"\
+"    uint Num; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 3 ) buffer restrict readonly OpBlock \n"\
+"{ \n"\
+"    uint Op; \n"\
+"}; \n"\
+" \n"\
+"void add_block_sums() \n"\
+"{ \n"\
+"    int offset = BlockSums[gl_WorkGroupID.x]; \n"\
+"    uint base = gl_WorkGroupID.x * BLOCK_SIZE + gl_LocalInvocationID.x; \n"\
+" \n"\
+"    for (uint i = 0; i < ELEMS_PER_THREAD; ++i) \n"\
+"    { \n"\
+"        uint idx = base + i * GROUP_SIZE; \n"\
+" \n"\
+"        if (idx < Num) \n"\
+"        { \n"\
+"            Output[idx] = Op == SCAN_OP_MAX ? max(offset, Output[idx]) : offset + Output[idx]; \n"\
+"        } \n"\
+"    } \n"\
+"} \n"\
+"#endif \n"\
+" \n"\
+"// \n"\
+"// Indices of segment heads, max scan of them gives segment starts \n"\
+"// \n"\
+"#if defined(segment_heads) \n"\
+"layout( std430, binding = 0 ) buffer restrict readonly HeadsBlock \n"\
+"{ \n"\
+"    int Heads[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 1 ) buffer restrict writeonly OutputBlock \n"\
+"{ \n"\
+"    int Output[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 2 ) buffer restrict readonly NumBlock \n"\
+"{ \n"\
+"    uint Num; \n"\
+"}; \n"\
+" \n"\
+"void segment_heads() \n"\
+"{ \n"\
+"    uint globalID = gl_GlobalInvocationID.x; \n"\
+" \n"\
+"    if (globalID < Num) \n"\
+"    { \n"\
+"        Output[globalID] = Heads[globalID] != 0 ? int(globalID) : 0; \n"\
+"    } \n"\
+"} \n"\
+"#endif \n"\
+" \n"\
+"// \n"\
+"// Segmented scan from the scan of all the elements and segment starts \n"\
+"// \n"\
+"#if defined(segmented_scan_combine) \n"\
+"layout( std430, binding = 0 ) buffer restrict readonly HeadsBlock \n"\
+"{ \n"\
+"    int Heads[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 1 ) buffer restrict readonly SumsBlock \n"\
+"{ \n"\
+"    int Sums[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 2 ) buffer restrict readonly StartsBlock \n"\
+"{ \n"\
+"    int Starts[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 3 ) buffer restrict writeonly OutputBlock \n"\
+"{ \n"\
+"    int Output[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 4 ) buffer restrict readonly NumBlock \n"\
+"{ \n"\
+"    uint Num; \n"\
+"}; \n"\
+" \n"\
+"void segmented_scan_combine() \n"\
+"{ \n"\
+"    uint globalID = gl_GlobalInvocationID.x; \n"\
+" \n"\
+"    if (globalID < Num) \n"\
+"    { \n"\
+"        // Starts is an exclusive scan, so heads start their own segment \n"\
+"        int start = Heads[globalID] != 0 ? int(globalID) : Starts[globalID]; \n"\
+"        Output[globalID] = Sums[globalID] - Sums[start]; \n"\
+"    } \n"\
+"} \n"\
+"#endif \n"\
+" \n"\
+"// \n"\
+"// Scatter elements with non-zero predicate to their scanned positions \n"\
+"// \n"\
+"#if defined(compact_scatter) \n"\
+"layout( std430, binding = 0 ) buffer restrict readonly PredicateBlock \n"\
+"{ \n"\
+"    int Predicate[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 1 ) buffer restrict readonly InputBlock \n"\
+"{ \n"\
+"    int Input[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 2 ) buffer restrict readonly OffsetsBlock \n"\
+"{ \n"\
+"    int Offsets[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 3 ) buffer restrict writeonly OutputBlock \n"\
+"{ \n"\
+"    int Output[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 4 ) buffer restrict writeonly NewSizeBlock \n"\
+"{ \n"\
+"    int NewSize; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 5 ) buffer restrict readonly NumBlock \n"\
+"{ \n"\
+"    uint Num; \n"\
+"}; \n"\
+" \n"\
+"void compact_scatter() \n"\
+"{ \n"\
+"    uint globalID = gl_GlobalInvocationID.x; \n"\
+" \n"\
+"    if (globalID < Num) \n"\
+"    { \n"\
+"        bool keep = Predicate[globalID] != 0; \n"\
+" \n"\
+"        if (keep) \n"\
+"        { \n"\
+"            Output[Offsets[globalID]] = Input[globalID]; \n"\
+"        } \n"\
+" \n"\
+"        if (globalID == Num - 1) \n"\
+"        { \n"\
+"            NewSize = Offsets[globalID] + (keep ? 1 : 0); \n"\
+"        } \n"\
+"    } \n"\
+"} \n"\
+"#endif \n"\
+" \n"\
+"// \n"\
+"// Per work-group digit counts of the radix sort pass, \n"\
+"// stored digit-major so that their scan gives scatter offsets. \n"\
+"// Keys are KeyWords 32-bit words, the digit is taken at Shift bits. \n"\
+"// \n"\
+"#if defined(radix_histogram) \n"\
+"layout( std430, binding = 0 ) buffer restrict readonly KeysBlock \n"\
+"{ \n"\
+"    uint Keys[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 1 ) buffer restrict writeonly HistogramsBlock \n"\
+"{ \n"\
+"    int Histograms[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 2 ) buffer restrict readonly NumBlock \n"\
+"{ \n"\
+"    uint Num; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 3 ) buffer restrict readonly KeyWordsBlock \n"\
+"{ \n"\
+"    uint KeyWords; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 4 ) buffer restrict readonly ShiftBlock \n"\
+"{ \n"\
+"    uint Shift; \n"\
+"}; \n"\
+" \n"\
+"shared uint Counts[RADIX]; \n"\
+" \n"\
+"void radix_histogram() \n"\
+"{ \n"\
+"    uint localID = gl_LocalInvocationID.x; \n"\
+"    uint base = gl_WorkGroupID.x * BLOCK_SIZE + localID * ELEMS_PER_THREAD; \n"\
+" \n"\
+"    if (localID < RADIX) \n"\
+"    { \n"\
+"        Counts[localID] = 0; \n"\
+"    } \n"\
+"    barrier(); \n"\
+" \n"\
+"    for (uint i = 0; i < ELEMS_PER_THREAD; ++i) \n"\
+"    { \n"\
+"        if (base + i < Num) \n"\
+"        { \n"\
+"            uint digit = (Keys[(base + i) * KeyWords + (Shift >> 5)] >> (Shift & 31)) & (RADIX - 1); \n"\
+"            atomicAdd(Counts[digit], 1u); \n"\
+"        } \n"\
+"    } \n"\
+"    barrier(); \n"\
+" \n"\
+"    if (localID < RADIX) \n"\
+"    { \n"\
+"        Histograms[localID * gl_NumWorkGroups.x + gl_WorkGroupID.x] = int(Counts[localID]); \n"\
+"    } \n"\
+"} \n"\
+"#endif \n"\
+" \n"\
+"// \n"\
+"// Stable scatter of keys and values of a radix sort pass \n"\
+"// \n"\
+"#if defined(radix_scatter) \n"\
+"layout( std430, binding = 0 ) buffer restrict readonly KeysBlock \n"\
+"{ \n"\
+"    uint Keys[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 1 ) buffer restrict readonly ValuesBlock \n"\
+"{ \n"\
+"    int Values[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 2 ) buffer restrict readonly OffsetsBlock \n"\
+"{ \n"\
+"    int Offsets[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 3 ) buffer restrict writeonly KeysOutBlock \n"\
+"{ \n"\
+"    uint KeysOut[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 4 ) buffer restrict writeonly ValuesOutBlock \n"\
+"{ \n"\
+"    int ValuesOut[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 5 ) buffer restrict readonly NumBlock \n"\
+"{ \n"\
+"    uint Num; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 6 ) buffer restrict readonly KeyWordsBlock \n"\
+"{ \n"\
+"    uint KeyWords; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 7 ) buffer restrict readonly ShiftBlock \n"\
+"{ \n"\
+"    uint Shift; \n"\
+"}; \n"\
+" \n"\
+"// Digit counts of each thread, digit-major \n"\
+"shared uint ThreadCounts[RADIX * GROUP_SIZE]; \n"\
+" \n"\
+"uint GetDigit( in uint idx ) \n"\
+"{ \n"\
+"    return (Keys[idx * KeyWords + (Shift >> 5)] >> (Shift & 31)) & (RADIX - 1); \n"\
+"} \n"\
+" \n"\
+"void radix_scatter() \n"\
+"{ \n"\
+"    uint localID = gl_LocalInvocationID.x; \n"\
+"    uint base = gl_WorkGroupID.x * BLOCK_SIZE + localID * ELEMS_PER_THREAD; \n"\
+" \n"\
+"    for (uint d = 0; d < RADIX; ++d) \n"\
+"    { \n"\
+"        ThreadCounts[d * GROUP_SIZE + localID] = 0; \n"\
+"    } \n"\
+" \n"\
+"    // Count digits of the thread, only the thread touches its own counters \n"\
+"    for (uint i = 0; i < ELEMS_PER_THREAD; ++i) \n"\
+"    { \n"\
+"        if (base + i < Num) \n"\
+"        { \n"\
+"            ++ThreadCounts[GetDigit(base + i) * GROUP_SIZE + localID]; \n"\
+"        } \n"\
+"    } \n"\
+"    barrier(); \n"\
+" \n"\
+"    // Exclusive scan of the counts of each digit over threads \n"\
+"    if (localID < RADIX) \n"\
+"    { \n"\
+"        uint sum = 0; \n"\
+"        for (uint t = 0; t < GROUP_SIZE; ++t) \n"\
+"        { \n"\
+"            uint count = ThreadCounts[localID * GROUP_SIZE + t]; \n"\
+"            ThreadCounts[localID * GROUP_SIZE + t] = sum; \n"\
+"            sum += count; \n"\
+"        } \n"\
+"    } \n"\
+"    barrier(); \n"\
+" \n"\
+"    // Elements of a thread are consecutive, so writing them in order keeps the sort stable \n"\
+"    for (uint i = 0; i < ELEMS_PER_THREAD; ++i) \n"\
+"    { \n"\
+"        uint idx = base + i; \n"\
+" \n"\
+"        if (idx < Num) \n"\
+"        { \n"\
+"            uint digit = GetDigit(idx); \n"\
+"            uint rank = ThreadCounts[digit * GROUP_SIZE + localID]++; \n"\
+"            uint dst = uint(Offsets[digit * gl_NumWorkGroups.x + gl_WorkGroupID.x]) + rank; \n"\
+" \n"\
+"            for (uint w = 0; w < KeyWords; ++w) \n"\
+"            { \n"\
+"                KeysOut[dst * KeyWords + w] = Keys[idx * KeyWords + w]; \n"\
+"            } \n"\
+" \n"\
+"            ValuesOut[dst] = Values[idx]; \n"\
+"        } \n"\
+"    } \n"\
+"} \n"\
+"#endif \n"\
+" \n"\
+"// \n"\
+"// Min and max of floats, grid-strided over a fixed number of work-groups. \n"\
+"// Pairs selects (min, max) pairs as inputs, which is used to reduce partial results. \n"\
+"// \n"\
+"#if defined(reduce_min_max) \n"\
+"layout( std430, binding = 0 ) buffer restrict readonly InputBlock \n"\
+"{ \n"\
+"    float Input[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 1 ) buffer restrict writeonly OutputBlock \n"\
+"{ \n"\
+"    float Output[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 2 ) buffer restrict readonly NumBlock \n"\
+"{ \n"\
+"    uint Num; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 3 ) buffer restrict readonly PairsBlock \n"\
+"{ \n"\
+"    uint Pairs; \n"\
+"}; \n"\
+" \n"\
+"shared float MinValues[GROUP_SIZE]; \n"\
+"shared float MaxValues[GROUP_SIZE]; \n"\
+" \n"\
+"void reduce_min_max() \n"\
+"{ \n"\
+"    uint localID = gl_LocalInvocationID.x; \n"\
+" \n"\
+"    float minValue = FLT_MAX; \n"\
+"    float maxValue = -FLT_MAX; \n"\
+" \n"\
+"    for (uint i = gl_GlobalInvocationID.x; i < Num; i += gl_NumWorkGroups.x * GROUP_SIZE) \n"\
+"    { \n"\
+"        if (Pairs != 0) \n"\
+"        { \n"\
+"            minValue = min(minValue, Input[2 * i]); \n"\
+"            maxValue = max(maxValue, Input[2 * i + 1]); \n"\
+"        } \n"\
+"        else \n"\
+"        { \n"\
+"            minValue = min(minValue, Input[i]); \n"\
+"            maxValue = max(maxValue, Input[i]); \n"\
+"        } \n"\
+"    } \n"\
+" \n"\
+"    MinValues[localID] = minValue; \n"\
+"    MaxValues[localID] = maxValue; \n"\
+"    barrier(); \n"\
+" \n"\
+"    for (uint stride = GROUP_SIZE / 2; stride > 0; stride >>= 1) \n"\
+"    { \n"\
+"        if (localID < stride) \n"\
+"        { \n"\
+"            MinValues[localID] = min(MinValues[localID], MinValues[localID + stride]); \n"\
+"            MaxValues[localID] = max(MaxValues[localID], MaxValues[localID + stride]); \n"\
+"        } \n"\
+"        barrier(); \n"\
+"    } \n"\
+" \n"\
+"    if (localID == 0) \n"\
+"    { \n"\
+"        Output[2 * gl_WorkGroupID.x] = MinValues[0]; \n"\
+"        Output[2 * gl_WorkGroupID.x + 1] = MaxValues[0]; \n"\
+"    } \n"\
+"} \n"\
+"#endif \n"\
+" \n"\
+"// \n"\
+"// Union of bounding boxes stored as (pmin, pmax) pairs \n"\
+"// \n"\
+"#if defined(reduce_bbox) \n"\
+"layout( std430, binding = 0 ) buffer restrict readonly InputBlock \n"\
+"{ \n"\
+"    vec4 Input[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 1 ) buffer restrict writeonly OutputBlock \n"\
+"{ \n"\
+"    vec4 Output[]; \n"\
+"}; \n"\
+" \n"\
+"layout( std430, binding = 2 ) buffer restrict readonly NumBlock \n"\
+"{ \n"\
+"    uint Num; \n"\
+"}; \n"\
+" \n"\
+"shared vec4 MinValues[GROUP_SIZE]; \n"\
+"shared vec4 MaxValues[GROUP_SIZE]; \n"\
+" \n"\
+"void reduce_bbox() \n"\
+"{ \n"\
+"    uint localID = gl_LocalInvocationID.x; \n"\
+" \n"\
+"    vec4 pmin = vec4(FLT_MAX); \n"\
+"    vec4 pmax = vec4(-FLT_MAX); \n"\
+" \n"\
+"    for (uint i = gl_GlobalInvocationID.x; i < Num; i += gl_NumWorkGroups.x * GROUP_SIZE) \n"\
+"    { \n"\
+"        pmin = min(pmin, Input[2 * i]); \n"\
+"        pmax = max(pmax, Input[2 * i + 1]); \n"\
+"    } \n"\
+" \n"\
+"    MinValues[localID] = pmin; \n"\
+"    MaxValues[localID] = pmax; \n"\
+"    barrier(); \n"\
+" \n"\
+"    for (uint stride = GROUP_SIZE / 2; stride > 0; stride >>= 1) \n"\
+"    { \n"\
+"        if (localID < stride) \n"\
+"        { \n"\
+"            MinValues[localID] = min(MinValues[localID], MinValues[localID + stride]); \n"\
+"            MaxValues[localID] = max(MaxValues[localID], MaxValues[localID + stride]); \n"\
+"        } \n"\
+"        barrier(); \n"\
+"    } \n"\
+" \n"\
+"    if (localID == 0) \n"\
+"    { \n"\
+"        Output[2 * gl_WorkGroupID.x] = MinValues[0]; \n"\
+"        Output[2 * gl_WorkGroupID.x + 1] = MaxValues[0]; \n"\
+"    } \n"\
+"} \n"\
+"#endif \n"\
+;
@@ -0,0 +1,156 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "buffer_heap.h"
+
+#include <cassert>
+
+namespace Calc
+{
+    BufferHeap::BufferHeap(std::size_t block_size, std::size_t alignment)
+        : m_block_size(block_size)
+        , m_alignment(alignment > 0 ? alignment : 1)
+    {
+    }
+
+    bool BufferHeap::Allocate(std::size_t size, Range& range)
+    {
+        // Allocations keep the alignment of the ranges following them
+        std::size_t aligned_size = (size + m_alignment - 1) / m_alignment * m_alignment;
+
+        if (size == 0 || aligned_size > m_block_size)
+        {
+            return false;
+        }
+
+        // First fit
+        for (std::uint32_t i = 0; i < m_blocks.size(); ++i)
+        {
+            auto& block = m_blocks[i];
+
+            if (!block.in_use)
+            {
+                continue;
+            }
+
+            for (auto it = block.free_ranges.begin(); it != block.free_ranges.end(); ++it)
+            {
+                if (it->second < aligned_size)
+                {
+                    continue;
+                }
+
+                range.block = i;
+                range.offset = it->first;
+                range.size = aligned_size;
+
+                if (it->second > aligned_size)
+                {
+                    block.free_ranges[it->first + aligned_size] = it->second - aligned_size;
+                }
+
+                block.free_ranges.erase(it);
+                ++block.num_allocations;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    std::uint32_t BufferHeap::AddBlock()
+    {
+        Block block;
+        block.free_ranges[0] = m_block_size;
+        block.num_allocations = 0;
+        block.in_use = true;
+
+        for (std::uint32_t i = 0; i < m_blocks.size(); ++i)
+        {
+            if (!m_blocks[i].in_use)
+            {
+                m_blocks[i] = block;
+                return i;
+            }
+        }
+
+        m_blocks.push_back(block);
+        return static_cast<std::uint32_t>(m_blocks.size() - 1);
+    }
+
+    std::uint32_t BufferHeap::Free(Range const& range)
+    {
+        assert(range.block < m_blocks.size() && m_blocks[range.block].in_use);
+
+        auto& block = m_blocks[range.block];
+        auto& free_ranges = block.free_ranges;
+
+        std::size_t offset = range.offset;
+        std::size_t size = range.size;
+
+        // Merge with the following range
+        auto next = free_ranges.find(offset + size);
+        if (next != free_ranges.end())
+        {
+            size += next->second;
+            free_ranges.erase(next);
+        }
+
+        // Merge with the preceding range
+        auto prev = free_ranges.lower_bound(offset);
+        if (prev != free_ranges.begin())
+        {
+            --prev;
+
+            if (prev->first + prev->second == offset)
+            {
+                offset = prev->first;
+                size += prev->second;
+                free_ranges.erase(prev);
+            }
+        }
+
+        free_ranges[offset] = size;
+        --block.num_allocations;
+
+        if (!IsEmpty(block))
+        {
+            return kInvalidBlock;
+        }
+
+        for (std::uint32_t i = 0; i < m_blocks.size(); ++i)
+        {
+            if (i != range.block && m_blocks[i].in_use && IsEmpty(m_blocks[i]))
+            {
+                block.in_use = false;
+                block.free_ranges.clear();
+                return range.block;
+            }
+        }
+
+        return kInvalidBlock;
+    }
+
+    bool BufferHeap::IsEmpty(Block const& block) const
+    {
+        return block.num_allocations == 0;
+    }
+}
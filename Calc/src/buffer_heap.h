@@ -0,0 +1,77 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+namespace Calc
+{
+    // Sub-allocator handing out aligned ranges of large device blocks.
+    // The heap only does the bookkeeping, blocks are created and released
+    // by the device, which refers to them by the index AddBlock returns.
+    // Freed ranges are merged with their neighbours and reused.
+    class BufferHeap
+    {
+    public:
+        static std::uint32_t const kInvalidBlock = ~0u;
+
+        struct Range
+        {
+            std::uint32_t block;
+            std::size_t offset;
+            std::size_t size;
+        };
+
+        BufferHeap(std::size_t block_size, std::size_t alignment);
+
+        std::size_t GetBlockSize() const { return m_block_size; }
+
+        // Find a free range in the existing blocks, returns false if none is large enough
+        bool Allocate(std::size_t size, Range& range);
+
+        // Register a new block, its index is reused after the block is released
+        std::uint32_t AddBlock();
+
+        // Return the range to its block. One empty block is kept around,
+        // the index of any other block left empty is returned for the device
+        // to release it, kInvalidBlock otherwise
+        std::uint32_t Free(Range const& range);
+
+    private:
+        struct Block
+        {
+            // Free ranges by offset
+            std::map<std::size_t, std::size_t> free_ranges;
+            std::size_t num_allocations;
+            bool in_use;
+        };
+
+        bool IsEmpty(Block const& block) const;
+
+        std::size_t m_block_size;
+        std::size_t m_alignment;
+        std::vector<Block> m_blocks;
+    };
+}
@@ -30,6 +30,7 @@ THE SOFTWARE.
 namespace Calc
 {
     CalcClw::CalcClw()
+        : m_out_of_order(false)
     {
         try
         {
@@ -81,6 +82,7 @@ namespace Calc
         spec.min_alignment = m_devices[idx].GetMinAlignSize();
         spec.max_alloc_size = m_devices[idx].GetMaxAllocSize();
         spec.max_local_size = m_devices[idx].GetMaxWorkGroupSize();
+        spec.shared_virtual_memory = m_devices[idx].HasFineGrainBufferSvm();
     }
 
     // Create the device with specified index
@@ -93,7 +95,9 @@ namespace Calc
 
         try
         {
-            return new DeviceClw(m_devices[idx]);
+            auto device = new DeviceClw(m_devices[idx], m_out_of_order);
+            device->SetKernelCachePath(m_kernel_cache_path.c_str());
+            return device;
         }
         catch (CLWException& e)
         {
@@ -108,7 +112,9 @@ namespace Calc
             auto clcontext = CLWContext::Create(context, &device, &queue, 1);
             auto cldev = clcontext.GetDevice(0);
             
-            return new DeviceClw(cldev, clcontext);
+            auto device = new DeviceClw(cldev, clcontext);
+            device->SetKernelCachePath(m_kernel_cache_path.c_str());
+            return device;
         }
         catch (CLWException& e)
         {
@@ -122,6 +128,16 @@ namespace Calc
         delete device;
     }
 
+    void CalcClw::SetKernelCachePath(char const* path)
+    {
+        m_kernel_cache_path = path ? path : "";
+    }
+
+    void CalcClw::SetOutOfOrderQueues(bool enable)
+    {
+        m_out_of_order = enable;
+    }
+
 }
 
 Calc::DeviceCl* CreateDeviceFromOpenCL(cl_context context, cl_device_id device, cl_command_queue queue)
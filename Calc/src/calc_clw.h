@@ -24,6 +24,7 @@ THE SOFTWARE.
 #include "calc_cl.h"
 #include "calc.h"
 #include "CLW.h"
+#include <string>
 #include <vector>
 
 namespace Calc
@@ -52,10 +53,15 @@ namespace Calc
 
         Platform GetPlatform() final override { return Platform::kOpenCL; };
 
+        void SetKernelCachePath(char const* path) override;
+
+        void SetOutOfOrderQueues(bool enable) override;
 
     private:
         std::vector<CLWPlatform> m_platforms;
         std::vector<CLWDevice> m_devices;
+        std::string m_kernel_cache_path;
+        bool m_out_of_order;
     };
 }
 
@@ -28,8 +28,15 @@ namespace Calc
 {
     inline cl_mem_flags Convert2ClCreationFlags(std::uint32_t flags)
     {
-        // TODO: implement correctly
-        return CL_MEM_READ_WRITE;
+        // Kernels write buffers created with kRead, so access flags are not restricted
+        cl_mem_flags res = CL_MEM_READ_WRITE;
+
+        if (flags & kHostPtr)
+            res |= CL_MEM_USE_HOST_PTR;
+        else if (flags & (kPinned | kShared))
+            res |= CL_MEM_ALLOC_HOST_PTR;
+
+        return res;
     }
 
     inline cl_mem_flags Convert2ClMapFlags(std::uint32_t flags)
@@ -42,6 +49,12 @@ namespace Calc
         if (flags & kMapWrite)
             res |= CL_MAP_WRITE;
 
+#ifdef CL_VERSION_1_2
+        // Invalidation can't be combined with the other flags
+        if ((flags & kMapWriteDiscard) && res == CL_MAP_WRITE)
+            res = CL_MAP_WRITE_INVALIDATE_REGION;
+#endif
+
         return res;
     }
 
@@ -112,6 +112,7 @@ namespace Calc
             spec.min_alignment = static_cast< std::uint32_t >( device->get_device_properties().limits.minMemoryMapAlignment );
             spec.max_alloc_size = static_cast< std::size_t >(hostMemory);
             spec.max_local_size = static_cast< std::size_t >(localMemory);
+            spec.shared_virtual_memory = false;
         }
 
         else
@@ -156,6 +157,8 @@ namespace Calc
             // pass ownership to DeviceVk
             newDevice->release();            
 
+            toReturn->SetKernelCachePath( m_kernel_cache_path.c_str() );
+
             return toReturn;
         }
 
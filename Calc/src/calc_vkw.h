@@ -22,6 +22,7 @@ THE SOFTWARE.
 #pragma once
 
 #include "calc.h"
+#include <string>
 #include <vector>
 
 #if defined(USE_VULKAN)
@@ -56,12 +57,20 @@ namespace Calc
 
         Platform GetPlatform() final override { return Platform::kVulkan; };
 
+        // Devices created afterwards persist their pipeline cache in the directory
+        void SetKernelCachePath(char const* path) override { m_kernel_cache_path = path ? path : ""; }
+
+        // Vulkan devices keep submission order
+        void SetOutOfOrderQueues(bool enable) override {}
+
     private:
         // Initialize a Vulkan resources
         void InitializeInstance();
 
         // Vulkan instance
         Anvil::Instance*    m_anvil_instance;
+
+        std::string         m_kernel_cache_path;
     };
 }
 
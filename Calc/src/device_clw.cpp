@@ -28,22 +28,86 @@ THE SOFTWARE.
 #include "executable.h"
 #include "except_clw.h"
 #include "calc_clw_common.h"
+#include "buffer_heap.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <thread>
 
 namespace Calc
 {    
+    namespace
+    {
+        // Add the contents of the file to the key, returns false if the file can't be read
+        bool AddFileToKey(char const* filename, KernelCache::Key& key)
+        {
+            std::ifstream in(filename, std::ios::binary);
+
+            if (!in)
+            {
+                return false;
+            }
+
+            std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            key.Add(contents);
+            return true;
+        }
+    }
+
+    // Last commands accessing a buffer, commands of out of order queues wait on them
+    struct BufferAccess
+    {
+        struct Command
+        {
+            CLWEvent event;
+            std::uint32_t queue;
+            // Enqueued to the in order companion queue
+            bool ordered;
+        };
+
+        Command write;
+        // Reads since the last write
+        std::vector<Command> reads;
+    };
+
     // Buffer implementation with CLW
     class BufferClw : public Buffer
     {
     public:
-        BufferClw(CLWBuffer<char> buffer) : m_buffer(buffer) {}
+        BufferClw(CLWBuffer<char> buffer)
+            : m_buffer(buffer), m_offset(0), m_svm(nullptr), m_access(std::make_shared<BufferAccess>()) {}
+        // Sub-buffer of a heap block
+        BufferClw(CLWBuffer<char> buffer, CLWBuffer<char> block, std::size_t offset)
+            : m_buffer(buffer), m_block(block), m_offset(offset), m_svm(nullptr), m_access(std::make_shared<BufferAccess>()) {}
+        // Wrapper of a fine-grained SVM allocation
+        BufferClw(CLWBuffer<char> buffer, void* svm)
+            : m_buffer(buffer), m_offset(0), m_svm(svm), m_access(std::make_shared<BufferAccess>()) {}
         ~BufferClw() override {};
 
         std::size_t GetSize() const override { return m_buffer.GetElementCount(); }
+        bool IsShared() const override { return m_svm != nullptr; }
 
         CLWBuffer<char> GetData() const { return m_buffer; }
 
+        bool IsSuballocated() const { return m_block != nullptr; }
+        CLWBuffer<char> GetBlock() const { return m_block; }
+        std::size_t GetOffset() const { return m_offset; }
+
+        // Host pointer to the storage if the buffer is in shared virtual memory, nullptr otherwise
+        void* GetSvmPointer() const { return m_svm; }
+
+        // Shared with the functions the buffer is bound to, so it outlives the buffer
+        std::shared_ptr<BufferAccess> GetAccess() const { return m_access; }
+
     private:
         CLWBuffer<char> m_buffer;
+        CLWBuffer<char> m_block;
+        std::size_t m_offset;
+        void* m_svm;
+        std::shared_ptr<BufferAccess> m_access;
     };
 
 
@@ -57,8 +121,11 @@ namespace Calc
 
         void Wait() override;
         bool IsComplete() const override;
+        bool GetProfilingInfo(std::uint64_t& start, std::uint64_t& end) const override;
+        bool SetCallback(void (*callback)(void*), void* userdata) override;
 
         void SetEvent(CLWEvent event);
+        CLWEvent GetEvent() const { return m_event; }
 
     private:
         CLWEvent m_event;
@@ -97,11 +164,66 @@ namespace Calc
         }
     }
 
+    bool EventClw::GetProfilingInfo(std::uint64_t& start, std::uint64_t& end) const
+    {
+        try
+        {
+            cl_ulong command_start = 0;
+            cl_ulong command_end = 0;
+
+            if (!m_event.GetProfilingInfo(command_start, command_end))
+            {
+                return false;
+            }
+
+            start = command_start;
+            end = command_end;
+            return true;
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
+    }
+
+    // Callback registered with an event
+    struct EventContinuation
+    {
+        void (*callback)(void*);
+        void* userdata;
+    };
+
+    // Called once, so the continuation is released right after
+    static void CL_CALLBACK NotifyContinuation(cl_event, cl_int, void* data)
+    {
+        auto continuation = static_cast<EventContinuation*>(data);
+        continuation->callback(continuation->userdata);
+        delete continuation;
+    }
+
+    bool EventClw::SetCallback(void (*callback)(void*), void* userdata)
+    {
+        auto continuation = new EventContinuation{ callback, userdata };
+
+        try
+        {
+            m_event.SetCallback(NotifyContinuation, continuation);
+            return true;
+        }
+        catch (CLWException& e)
+        {
+            delete continuation;
+            throw ExceptionClw(e.what());
+        }
+    }
+
     void EventClw::SetEvent(CLWEvent event)
     {
         m_event = event;
     }
 
+    // Arguments are kept per calling thread and bound to the kernel at launch under the
+    // function lock, so threads can set up and launch the same function concurrently
     class FunctionClw : public Function
     {
     public:
@@ -113,11 +235,30 @@ namespace Calc
         void SetArg(std::uint32_t idx, Buffer const* arg) override;
         void SetArg(std::uint32_t idx, std::size_t size, SharedMemory shmem) override;
 
+        // Bind the arguments of the calling thread, the lock has to be held until the launch is enqueued
+        std::unique_lock<std::mutex> Bind() const;
+
         // CLW object access
         CLWKernel GetKernel() const;
 
+        // Access tracking of the buffer arguments of the calling thread, nullptr for other arguments,
+        // valid while the lock returned by Bind is held
+        std::vector<std::shared_ptr<BufferAccess>> const& GetBufferAccesses() const;
+
     private:
-        CLWKernel m_kernel;
+        // Arguments set by a thread
+        struct Arguments
+        {
+            // Values of the argument slots, empty for slots never set
+            std::vector<std::function<void(CLWKernel&)>> setters;
+            std::vector<std::shared_ptr<BufferAccess>> buffers;
+        };
+
+        void SetArg(std::uint32_t idx, std::function<void(CLWKernel&)> setter, std::shared_ptr<BufferAccess> access);
+
+        mutable CLWKernel m_kernel;
+        mutable std::mutex m_mutex;
+        std::map<std::thread::id, Arguments> m_arguments;
     };
 
 
@@ -130,42 +271,88 @@ namespace Calc
     {
     }
 
-    // Argument setters
-    void FunctionClw::SetArg(std::uint32_t idx, std::size_t arg_size, void* arg)
+    void FunctionClw::SetArg(std::uint32_t idx, std::function<void(CLWKernel&)> setter, std::shared_ptr<BufferAccess> access)
     {
-        try
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto& arguments = m_arguments[std::this_thread::get_id()];
+
+        if (idx >= arguments.setters.size())
         {
-            m_kernel.SetArg(idx, arg_size, arg);
+            arguments.setters.resize(idx + 1);
+            arguments.buffers.resize(idx + 1);
         }
-        catch (CLWException& e)
+
+        arguments.setters[idx] = std::move(setter);
+        arguments.buffers[idx] = std::move(access);
+    }
+
+    // Argument setters
+    void FunctionClw::SetArg(std::uint32_t idx, std::size_t arg_size, void* arg)
+    {
+        auto bytes = static_cast<char const*>(arg);
+        std::vector<char> value(bytes, bytes + arg_size);
+
+        SetArg(idx, [idx, value](CLWKernel& kernel)
         {
-            throw ExceptionClw(e.what());
-        }
+            kernel.SetArg(idx, value.size(), const_cast<char*>(value.data()));
+        }, nullptr);
     }
 
     void FunctionClw::SetArg(std::uint32_t idx, Buffer const* arg)
     {
-        try
-        {
-            auto buffer_clw = static_cast<BufferClw const*>(arg);
-            m_kernel.SetArg(idx, buffer_clw->GetData());
-        }
-        catch (CLWException& e)
+        auto buffer_clw = static_cast<BufferClw const*>(arg);
+        CLWBuffer<char> buffer = buffer_clw->GetData();
+
+        SetArg(idx, [idx, buffer](CLWKernel& kernel)
         {
-            throw ExceptionClw(e.what());
-        }
+            kernel.SetArg(idx, buffer);
+        }, buffer_clw->GetAccess());
     }
 
     void FunctionClw::SetArg(std::uint32_t idx, std::size_t size, SharedMemory shmem)
     {
-        try
+        cl_uint const shared_size = static_cast<cl_uint>(size);
+
+        SetArg(idx, [idx, shared_size](CLWKernel& kernel)
         {
-            m_kernel.SetArg(idx, ::SharedMemory(static_cast<cl_uint>(size)));
-        }
-        catch (CLWException& e)
+            kernel.SetArg(idx, ::SharedMemory(shared_size));
+        }, nullptr);
+    }
+
+    std::unique_lock<std::mutex> FunctionClw::Bind() const
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        auto iter = m_arguments.find(std::this_thread::get_id());
+
+        if (iter != m_arguments.cend())
         {
-            throw ExceptionClw(e.what());
+            try
+            {
+                // Kernel skips the values already bound to the slots
+                for (auto const& setter : iter->second.setters)
+                {
+                    if (setter)
+                    {
+                        setter(m_kernel);
+                    }
+                }
+            }
+            catch (CLWException& e)
+            {
+                throw ExceptionClw(e.what());
+            }
         }
+
+        return lock;
+    }
+
+    std::vector<std::shared_ptr<BufferAccess>> const& FunctionClw::GetBufferAccesses() const
+    {
+        static std::vector<std::shared_ptr<BufferAccess>> const none;
+
+        auto iter = m_arguments.find(std::this_thread::get_id());
+        return iter != m_arguments.cend() ? iter->second.buffers : none;
     }
 
     CLWKernel FunctionClw::GetKernel() const
@@ -184,6 +371,8 @@ namespace Calc
         Function* CreateFunction(char const* name) override;
         void DeleteFunction(Function* func) override;
 
+        CLWProgram GetProgram() const { return m_program; }
+
     private:
         CLWProgram m_program;
     };
@@ -217,26 +406,215 @@ namespace Calc
     }
 
     // Device
-    DeviceClw::DeviceClw(CLWDevice device)
+    struct DeviceClw::Heap
+    {
+        Heap(std::size_t block_size, std::size_t alignment) : heap(block_size, alignment) {}
+
+        BufferHeap heap;
+        // Blocks indexed by the heap
+        std::vector<CLWBuffer<char>> blocks;
+        // Ranges are returned from OpenCL callback threads
+        std::mutex mutex;
+    };
+
+    namespace
+    {
+        // Sub-buffer origins need the base address alignment, which is given in bits
+        std::size_t GetHeapAlignment(CLWDevice const& device)
+        {
+            return std::max<std::size_t>(device.GetMinAlignSize(), device.GetMemBaseAddrAlign() / 8);
+        }
+
+        template <typename Heap>
+        struct HeapRange
+        {
+            std::shared_ptr<Heap> heap;
+            BufferHeap::Range range;
+        };
+
+        // Called once the sub-buffer is released and commands using it have completed
+        template <typename Heap>
+        void CL_CALLBACK FreeHeapRange(cl_mem, void* user_data)
+        {
+            auto heap_range = static_cast<HeapRange<Heap>*>(user_data);
+
+            {
+                std::lock_guard<std::mutex> lock(heap_range->heap->mutex);
+
+                auto block = heap_range->heap->heap.Free(heap_range->range);
+                if (block != BufferHeap::kInvalidBlock)
+                {
+                    heap_range->heap->blocks[block] = CLWBuffer<char>();
+                }
+            }
+
+            delete heap_range;
+        }
+
+#ifdef CL_VERSION_2_0
+        struct SvmAllocation
+        {
+            cl_context context;
+            void* ptr;
+        };
+
+        // Called once the buffer wrapping the allocation is released and commands using it have completed
+        void CL_CALLBACK FreeSvmAllocation(cl_mem, void* user_data)
+        {
+            auto allocation = static_cast<SvmAllocation*>(user_data);
+            clSVMFree(allocation->context, allocation->ptr);
+            delete allocation;
+        }
+#endif
+    }
+
+    DeviceClw::DeviceClw(CLWDevice device, bool out_of_order)
         : m_device(device)
-        , m_context(CLWContext::Create(device))
+        , m_context(CLWContext::Create(device, nullptr, out_of_order))
+        , m_heap(std::make_shared<Heap>(HEAP_BLOCK_SIZE, GetHeapAlignment(device)))
+        , m_out_of_order(out_of_order)
     {
         // Initialize event pool
         for (auto i = 0; i < EVENT_POOL_INITIAL_SIZE; ++i)
         {
             m_event_pool.push(new EventClw());
         }
+
+        // Additional queues to overlap independent work, the first and the last of them take
+        // latency bound and background work, devices created from external contexts use the queue passed in only
+        while (m_context.GetCommandQueueCount() < NUM_QUEUES)
+        {
+            auto const idx = m_context.GetCommandQueueCount();
+            auto const priority = idx == HIGH_PRIORITY_QUEUE ? CLWCommandQueue::kPriorityHigh :
+                (idx == NUM_QUEUES - 1 ? CLWCommandQueue::kPriorityLow : CLWCommandQueue::kPriorityDefault);
+            m_context.CreateCommandQueue(0, out_of_order, priority);
+        }
+
+        if (m_out_of_order)
+        {
+            CreateOrderedQueues();
+        }
     }
     
     DeviceClw::DeviceClw(CLWDevice device, CLWContext context)
     : m_device(device)
     , m_context(context)
+    , m_heap(std::make_shared<Heap>(HEAP_BLOCK_SIZE, GetHeapAlignment(device)))
+    , m_out_of_order(context.GetCommandQueue(0).IsOutOfOrder())
     {
         // Initialize event pool
         for (auto i = 0; i < EVENT_POOL_INITIAL_SIZE; ++i)
         {
             m_event_pool.push(new EventClw());
         }
+
+        if (m_out_of_order)
+        {
+            CreateOrderedQueues();
+        }
+    }
+
+    void DeviceClw::CreateOrderedQueues()
+    {
+        cl_device_id device = m_device;
+        CLWCommandQueue ordered_queue = CLWCommandQueue::Create(m_device, m_context);
+        cl_command_queue queue = ordered_queue;
+        m_ordered_context = CLWContext::Create(m_context, &device, &queue, 1);
+
+        while (m_ordered_context.GetCommandQueueCount() < m_context.GetCommandQueueCount())
+        {
+            m_ordered_context.CreateCommandQueue(0);
+        }
+    }
+
+    void DeviceClw::AddWaitList(BufferAccess const& access, bool write, std::uint32_t queue, bool ordered, std::vector<CLWEvent>& events) const
+    {
+        auto add = [&](BufferAccess::Command const& command)
+        {
+            if (command.event == nullptr)
+            {
+                return;
+            }
+
+            events.push_back(command.event);
+
+            // Waiting on commands of a queue which isn't flushed may never complete
+            if (command.queue != queue || command.ordered != ordered)
+            {
+                if (command.ordered)
+                {
+                    m_ordered_context.Flush(command.queue);
+                }
+                else
+                {
+                    m_context.Flush(command.queue);
+                }
+            }
+        };
+
+        add(access.write);
+
+        // Reads can overlap each other
+        if (write)
+        {
+            for (auto const& read : access.reads)
+            {
+                add(read);
+            }
+        }
+    }
+
+    void DeviceClw::AddAccess(BufferAccess& access, bool write, std::uint32_t queue, bool ordered, CLWEvent event) const
+    {
+        BufferAccess::Command command = { event, queue, ordered };
+
+        if (write)
+        {
+            access.write = command;
+            access.reads.clear();
+            return;
+        }
+
+        // Drop completed reads, so buffers only read from don't accumulate events
+        access.reads.erase(std::remove_if(access.reads.begin(), access.reads.end(), [](BufferAccess::Command const& read)
+        {
+            return read.event.GetCommandExecutionStatus() == CL_COMPLETE;
+        }), access.reads.end());
+
+        access.reads.push_back(command);
+    }
+
+    void DeviceClw::EnqueueOrdered(std::uint32_t queue, std::initializer_list<Buffer const*> buffers, std::function<void()> const& enqueue) const
+    {
+        if (!m_out_of_order)
+        {
+            enqueue();
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(m_access_mutex);
+
+        std::vector<CLWEvent> events;
+        for (auto buffer : buffers)
+        {
+            AddWaitList(*static_cast<BufferClw const*>(buffer)->GetAccess(), true, queue, true, events);
+        }
+
+        if (!events.empty())
+        {
+            m_ordered_context.Barrier(queue, events);
+        }
+
+        enqueue();
+
+        // Completes with the last command of the in order queue
+        auto event = m_ordered_context.Marker(queue, std::vector<CLWEvent>());
+        m_ordered_context.Flush(queue);
+
+        for (auto buffer : buffers)
+        {
+            AddAccess(*static_cast<BufferClw const*>(buffer)->GetAccess(), true, queue, true, event);
+        }
     }
 
     DeviceClw::~DeviceClw()
@@ -262,12 +640,124 @@ namespace Calc
         spec.min_alignment = m_device.GetMinAlignSize();
         spec.max_alloc_size = m_device.GetMaxAllocSize();
         spec.max_local_size = m_device.GetMaxWorkGroupSize();
+        spec.max_num_queues = m_context.GetCommandQueueCount();
+        spec.high_priority_queue = spec.max_num_queues > HIGH_PRIORITY_QUEUE ? HIGH_PRIORITY_QUEUE : 0;
+        spec.low_priority_queue = spec.max_num_queues - 1;
+        spec.max_compute_units = m_device.GetMaxComputeUnits();
+        spec.host_unified_memory = m_device.HasHostUnifiedMemory();
+        spec.shared_virtual_memory = m_device.HasFineGrainBufferSvm();
+    }
+
+    // Buffers are read-write sub-buffers of the heap blocks, which are allocated on demand
+    Buffer* DeviceClw::CreateHeapBuffer(std::size_t size)
+    {
+        if (size == 0 || size > HEAP_MAX_BUFFER_SIZE)
+        {
+            return nullptr;
+        }
+
+        std::lock_guard<std::mutex> lock(m_heap->mutex);
+
+        BufferHeap::Range range;
+        if (!m_heap->heap.Allocate(size, range))
+        {
+            auto block = m_context.CreateBuffer<char>(HEAP_BLOCK_SIZE, CL_MEM_READ_WRITE);
+            auto index = m_heap->heap.AddBlock();
+
+            if (index < m_heap->blocks.size())
+            {
+                m_heap->blocks[index] = block;
+            }
+            else
+            {
+                m_heap->blocks.push_back(block);
+            }
+
+            m_heap->heap.Allocate(size, range);
+        }
+
+        auto block = m_heap->blocks[range.block];
+        CLWBuffer<char> buffer;
+
+        try
+        {
+            buffer = block.CreateSubBuffer(Convert2ClCreationFlags(0), range.offset, size);
+        }
+        catch (CLWException&)
+        {
+            m_heap->heap.Free(range);
+            throw;
+        }
+
+        // The range is reused only after the commands using the buffer have completed
+        auto heap_range = new HeapRange<Heap>{ m_heap, range };
+        clSetMemObjectDestructorCallback(buffer, FreeHeapRange<Heap>, heap_range);
+
+        return new BufferClw(buffer, block, range.offset);
+    }
+
+    // Kernels take cl_mem arguments, so the SVM allocation is wrapped into a buffer using it as storage
+    Buffer* DeviceClw::CreateSharedBuffer(std::size_t size, void* initdata)
+    {
+#ifdef CL_VERSION_2_0
+        if (size == 0 || !m_device.HasFineGrainBufferSvm())
+        {
+            return nullptr;
+        }
+
+        auto ptr = clSVMAlloc(m_context, CL_MEM_READ_WRITE | CL_MEM_SVM_FINE_GRAIN_BUFFER, size, 0);
+        if (!ptr)
+        {
+            return nullptr;
+        }
+
+        if (initdata)
+        {
+            std::memcpy(ptr, initdata, size);
+        }
+
+        CLWBuffer<char> buffer;
+
+        try
+        {
+            buffer = m_context.CreateBuffer<char>(size, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, ptr);
+        }
+        catch (CLWException&)
+        {
+            clSVMFree(m_context, ptr);
+            throw;
+        }
+
+        auto allocation = new SvmAllocation{ m_context, ptr };
+        clSetMemObjectDestructorCallback(buffer, FreeSvmAllocation, allocation);
+
+        return new BufferClw(buffer, ptr);
+#else
+        return nullptr;
+#endif
     }
 
     Buffer* DeviceClw::CreateBuffer(std::size_t size, std::uint32_t flags)
     {
         try
         {
+            if (flags & kShared)
+            {
+                if (auto buffer = CreateSharedBuffer(size, nullptr))
+                {
+                    return buffer;
+                }
+            }
+
+            // Heap blocks are device memory, host accessible buffers are separate allocations
+            if (!(flags & (kPinned | kShared)))
+            {
+                if (auto buffer = CreateHeapBuffer(size))
+                {
+                    return buffer;
+                }
+            }
+
             return new BufferClw(m_context.CreateBuffer<char>(size, Convert2ClCreationFlags(flags)));
         }
         catch (CLWException& e)
@@ -280,6 +770,29 @@ namespace Calc
     {
         try
         {
+            if (flags & kHostPtr)
+            {
+                return new BufferClw(m_context.CreateBuffer<char>(size, Convert2ClCreationFlags(flags), initdata));
+            }
+
+            if (flags & kShared)
+            {
+                if (auto buffer = CreateSharedBuffer(size, initdata))
+                {
+                    return buffer;
+                }
+            }
+
+            // Sub-buffers can't copy host memory on creation
+            if (!(flags & (kPinned | kShared)))
+            {
+                if (auto buffer = CreateHeapBuffer(size))
+                {
+                    m_context.WriteBuffer(0, static_cast<BufferClw*>(buffer)->GetData(), static_cast<char const*>(initdata), size).Wait();
+                    return buffer;
+                }
+            }
+
             return new BufferClw(m_context.CreateBuffer<char>(size, Convert2ClCreationFlags(flags) | CL_MEM_COPY_HOST_PTR, initdata));
         }
         catch (CLWException& e)
@@ -295,11 +808,27 @@ namespace Calc
 
     void DeviceClw::ReadBuffer(Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, void* dst, Event** e) const
     {
+        RR_TRACE_SCOPE("DeviceClw::ReadBuffer");
+
         auto buffer_clw = static_cast<BufferClw const*>(buffer);
 
         try
         {
-            CLWEvent event = m_context.ReadBuffer(queue, buffer_clw->GetData(), static_cast<char*>(dst), offset, size);
+            std::unique_lock<std::mutex> lock(m_access_mutex, std::defer_lock);
+            std::vector<CLWEvent> events;
+
+            if (m_out_of_order)
+            {
+                lock.lock();
+                AddWaitList(*buffer_clw->GetAccess(), false, queue, false, events);
+            }
+
+            CLWEvent event = m_context.ReadBuffer(queue, buffer_clw->GetData(), static_cast<char*>(dst), offset, size, events);
+
+            if (m_out_of_order)
+            {
+                AddAccess(*buffer_clw->GetAccess(), false, queue, false, event);
+            }
 
             if (e)
             {
@@ -316,11 +845,27 @@ namespace Calc
 
     void DeviceClw::WriteBuffer(Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, void* src, Event** e)
     {
+        RR_TRACE_SCOPE("DeviceClw::WriteBuffer");
+
         auto buffer_clw = static_cast<BufferClw const*>(buffer);
 
         try
         {
-            CLWEvent event = m_context.WriteBuffer(queue, buffer_clw->GetData(), static_cast<char*>(src), offset, size);
+            std::unique_lock<std::mutex> lock(m_access_mutex, std::defer_lock);
+            std::vector<CLWEvent> events;
+
+            if (m_out_of_order)
+            {
+                lock.lock();
+                AddWaitList(*buffer_clw->GetAccess(), true, queue, false, events);
+            }
+
+            CLWEvent event = m_context.WriteBuffer(queue, buffer_clw->GetData(), static_cast<char*>(src), offset, size, events);
+
+            if (m_out_of_order)
+            {
+                AddAccess(*buffer_clw->GetAccess(), true, queue, false, event);
+            }
 
             if (e)
             {
@@ -337,11 +882,39 @@ namespace Calc
 
     void DeviceClw::MapBuffer(Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, std::uint32_t map_type, void** mapdata, Event** e)
     {
+        RR_TRACE_SCOPE("DeviceClw::MapBuffer");
+
         auto buffer_clw = static_cast<BufferClw const*>(buffer);
 
         try
         {
-            CLWEvent event = m_context.MapBuffer(queue, buffer_clw->GetData(), Convert2ClMapFlags(map_type), offset, size, reinterpret_cast<char**>(mapdata));
+            std::unique_lock<std::mutex> lock(m_access_mutex, std::defer_lock);
+            std::vector<CLWEvent> events;
+            bool write = (map_type & kMapWrite) != 0;
+
+            if (m_out_of_order)
+            {
+                lock.lock();
+                AddWaitList(*buffer_clw->GetAccess(), write, queue, false, events);
+            }
+
+            CLWEvent event;
+
+            // Fine-grained SVM is coherent with the host, the commands accessing it only need to be done
+            if (auto svm = buffer_clw->GetSvmPointer())
+            {
+                *mapdata = static_cast<char*>(svm) + offset;
+                event = m_context.Marker(queue, events);
+            }
+            else
+            {
+                event = m_context.MapBuffer(queue, buffer_clw->GetData(), Convert2ClMapFlags(map_type), offset, size, reinterpret_cast<char**>(mapdata), events);
+            }
+
+            if (m_out_of_order)
+            {
+                AddAccess(*buffer_clw->GetAccess(), write, queue, false, event);
+            }
 
             if (e)
             {
@@ -362,7 +935,24 @@ namespace Calc
 
         try
         {
-            CLWEvent event = m_context.UnmapBuffer(queue, buffer_clw->GetData(), static_cast<char*>(mapdata));
+            // Unmapping publishes host writes, so it is ordered as a write
+            std::unique_lock<std::mutex> lock(m_access_mutex, std::defer_lock);
+            std::vector<CLWEvent> events;
+
+            if (m_out_of_order)
+            {
+                lock.lock();
+                AddWaitList(*buffer_clw->GetAccess(), true, queue, false, events);
+            }
+
+            CLWEvent event = buffer_clw->GetSvmPointer() ?
+                m_context.Marker(queue, events) :
+                m_context.UnmapBuffer(queue, buffer_clw->GetData(), static_cast<char*>(mapdata), events);
+
+            if (m_out_of_order)
+            {
+                AddAccess(*buffer_clw->GetAccess(), true, queue, false, event);
+            }
 
             if (e)
             {
@@ -377,42 +967,117 @@ namespace Calc
         }
     }
 
-    Executable* DeviceClw::CompileExecutable(char const* source_code, std::size_t size, char const* options)
+    std::string DeviceClw::GetBuildOptions(char const* options) const
     {
-        try
-        {
-            std::string buildopts = options ? options : "";
+        std::string buildopts = options ? options : "";
 
-            buildopts.append(" -cl-mad-enable -cl-fast-relaxed-math -cl-std=CL1.2 -I . ");
+        buildopts.append(" -cl-mad-enable -cl-fast-relaxed-math -cl-std=CL1.2 -I . ");
 
-            bool isamd = m_device.GetVendor().find("AMD") != std::string::npos ||
-                m_device.GetVendor().find("Advanced Micro Devices") != std::string::npos;
+        bool isamd = m_device.GetVendor().find("AMD") != std::string::npos ||
+            m_device.GetVendor().find("Advanced Micro Devices") != std::string::npos;
 
-            bool has_mediaops = m_device.GetExtensions().find("cl_amd_media_ops2") != std::string::npos;
+        bool has_mediaops = m_device.GetExtensions().find("cl_amd_media_ops2") != std::string::npos;
 
-            if (isamd)
-            {
-                buildopts.append(" -D AMD ");
-            }
+        if (isamd)
+        {
+            buildopts.append(" -D AMD ");
+        }
 
-            if (has_mediaops)
-            {
-                buildopts.append(" -D AMD_MEDIA_OPS ");
-            }
+        if (has_mediaops)
+        {
+            buildopts.append(" -D AMD_MEDIA_OPS ");
+        }
 
-            buildopts.append(
+        buildopts.append(
 #if defined(__APPLE__)
-                "-D APPLE "
+            "-D APPLE "
 #elif defined(_WIN32) || defined (WIN32)
-                "-D WIN32 "
+            "-D WIN32 "
 #elif defined(__linux__)
-                "-D __linux__ "
+            "-D __linux__ "
 #else
-                ""
+            ""
 #endif
-                );
+            );
+
+        return buildopts;
+    }
+
+    CLWProgram DeviceClw::BuildProgram(KernelCache::Key key, std::string const& buildopts, std::function<CLWProgram()> const& build) const
+    {
+        key.Add(buildopts);
+        key.Add(m_device.GetName());
+        key.Add(m_device.GetVersion());
+        key.Add(m_device.GetDriverVersion());
+
+        std::vector<std::uint8_t> binary;
+        {
+            std::lock_guard<std::mutex> lock(m_program_binaries_mutex);
+            auto iter = m_program_binaries.find(key.Get());
+            if (iter != m_program_binaries.cend())
+            {
+                binary = iter->second;
+            }
+        }
 
-            return new ExecutableClw(CLWProgram::CreateFromSource(source_code, size, buildopts.c_str(), m_context));
+        if (binary.empty() && !m_kernel_cache_path.empty())
+        {
+            KernelCache(m_kernel_cache_path).Load(key.Get(), binary);
+        }
+
+        if (!binary.empty())
+        {
+            try
+            {
+                auto program = CLWProgram::CreateFromBinary(&binary[0], binary.size(), buildopts.c_str(), m_context);
+
+                std::lock_guard<std::mutex> lock(m_program_binaries_mutex);
+                m_program_binaries[key.Get()].swap(binary);
+                return program;
+            }
+            catch (CLWException&)
+            {
+                // The driver rejected the binary, rebuild and overwrite the entry
+            }
+        }
+
+        auto program = build();
+
+        try
+        {
+            binary = program.GetBinary();
+        }
+        catch (CLWException&)
+        {
+            // Some runtimes can't return program binaries, the cache is optional
+            return program;
+        }
+
+        if (!m_kernel_cache_path.empty())
+        {
+            KernelCache(m_kernel_cache_path).Save(key.Get(), binary);
+        }
+
+        std::lock_guard<std::mutex> lock(m_program_binaries_mutex);
+        m_program_binaries[key.Get()].swap(binary);
+        return program;
+    }
+
+    Executable* DeviceClw::CompileExecutable(char const* source_code, std::size_t size, char const* options)
+    {
+        RR_TRACE_SCOPE("DeviceClw::CompileExecutable");
+
+        try
+        {
+            auto buildopts = GetBuildOptions(options);
+
+            KernelCache::Key key;
+            key.Add(source_code, size);
+
+            return new ExecutableClw(BuildProgram(key, buildopts, [&]()
+            {
+                return CLWProgram::CreateFromSource(source_code, size, buildopts.c_str(), m_context);
+            }));
         }
         catch (CLWException& e)
         {
@@ -427,42 +1092,28 @@ namespace Calc
                                              char const* options
                                             )
     {
+        RR_TRACE_SCOPE("DeviceClw::CompileExecutable");
+
         try
         {
-            std::string buildopts = options ? options : "";
-
-            buildopts.append(" -cl-mad-enable -cl-fast-relaxed-math -cl-std=CL1.2 -I . ");
-
-            bool isamd = m_device.GetVendor().find("AMD") != std::string::npos ||
-                m_device.GetVendor().find("Advanced Micro Devices") != std::string::npos;
+            auto buildopts = GetBuildOptions(options);
 
-            bool has_mediaops = m_device.GetExtensions().find("cl_amd_media_ops2") != std::string::npos;
-
-            if (isamd)
+            auto build = [&]()
             {
-                buildopts.append(" -D AMD ");
-            }
+                return CLWProgram::CreateFromFile(filename, headernames, numheaders, buildopts.c_str(), m_context);
+            };
 
-            if (has_mediaops)
+            // Sources are hashed by their contents, only the headers passed in
+            // are tracked, so kernels must list all the files they include
+            KernelCache::Key key;
+            bool cacheable = AddFileToKey(filename, key);
+
+            for (int i = 0; cacheable && i < numheaders; ++i)
             {
-                buildopts.append(" -D AMD_MEDIA_OPS ");
+                cacheable = AddFileToKey(headernames[i], key);
             }
 
-            buildopts.append(
-#if defined(__APPLE__)
-                "-D APPLE " 
-#elif defined(_WIN32) || defined (WIN32)
-                "-D WIN32 "
-#elif defined(__linux__)
-                "-D __linux__ "
-#else
-                ""
-#endif
-                );
-
-            return new ExecutableClw(
-                                     CLWProgram::CreateFromFile(filename, headernames, numheaders, buildopts.c_str(), m_context)
-                                     );
+            return new ExecutableClw(cacheable ? BuildProgram(key, buildopts, build) : build());
         }
         catch (CLWException& e)
         {
@@ -472,7 +1123,15 @@ namespace Calc
 
     Executable* DeviceClw::CompileExecutable(std::uint8_t const* binary_code, std::size_t size, char const* options)
     {
-        return nullptr;
+        try
+        {
+            auto buildopts = GetBuildOptions(options);
+            return new ExecutableClw(CLWProgram::CreateFromBinary(binary_code, size, buildopts.c_str(), m_context));
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
     }
 
     void DeviceClw::DeleteExecutable(Executable* executable)
@@ -482,21 +1141,87 @@ namespace Calc
 
     size_t DeviceClw::GetExecutableBinarySize(Executable const* executable) const
     {
-        return 0;
+        auto executable_clw = static_cast<ExecutableClw const*>(executable);
+
+        try
+        {
+            return executable_clw->GetProgram().GetBinary().size();
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
     }
 
     void DeviceClw::GetExecutableBinary(Executable const* executable, std::uint8_t* binary) const
     {
+        auto executable_clw = static_cast<ExecutableClw const*>(executable);
 
+        try
+        {
+            auto data = executable_clw->GetProgram().GetBinary();
+            std::copy(data.begin(), data.end(), binary);
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
+    }
+
+    void DeviceClw::SetKernelCachePath(char const* path)
+    {
+        m_kernel_cache_path = path ? path : "";
     }
 
     void DeviceClw::Execute(Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event** e)
     {
+        ExecuteRange(func, queue, 0, global_size, local_size, e);
+    }
+
+    void DeviceClw::ExecuteRange(Function const* func, std::uint32_t queue, size_t global_offset, size_t global_size, size_t local_size, Event** e)
+    {
+        RR_TRACE_SCOPE("DeviceClw::Execute");
+
         auto func_clw = static_cast<FunctionClw const*>(func);
+        // Arguments of this thread stay bound until the launch is enqueued
+        auto bind_lock = func_clw->Bind();
 
         try
         {
-            CLWEvent event = m_context.Launch1D(queue, global_size, local_size, func_clw->GetKernel());
+            if (!m_out_of_order)
+            {
+                CLWEvent event = m_context.Launch1D(queue, global_offset, global_size, local_size, func_clw->GetKernel(), std::vector<CLWEvent>());
+
+                if (e)
+                {
+                    auto event_clw = CreateEventClw();
+                    event_clw->SetEvent(event);
+                    *e = event_clw;
+                }
+
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(m_access_mutex);
+
+            std::vector<CLWEvent> events;
+            for (auto const& access : func_clw->GetBufferAccesses())
+            {
+                if (access)
+                {
+                    AddWaitList(*access, true, queue, false, events);
+                }
+            }
+
+            CLWEvent event = m_context.Launch1D(queue, global_offset, global_size, local_size, func_clw->GetKernel(), events);
+
+            for (auto const& access : func_clw->GetBufferAccesses())
+            {
+                if (access)
+                {
+                    AddAccess(*access, true, queue, false, event);
+                }
+            }
 
             if (e)
             {
@@ -513,17 +1238,48 @@ namespace Calc
 
     void DeviceClw::WaitForEvent(Event* e)
     {
+        RR_TRACE_SCOPE("DeviceClw::WaitForEvent");
+
         e->Wait();
     }
 
     void DeviceClw::WaitForMultipleEvents(Event** e, std::size_t num_events)
     {
+        RR_TRACE_SCOPE("DeviceClw::WaitForMultipleEvents");
+
         for (auto i = 0; i < num_events; ++i)
         {
             e[i]->Wait();
         }
     }
 
+    void DeviceClw::JoinEvents(std::uint32_t queue, Event** e, std::size_t num_events, Event** joined)
+    {
+        RR_TRACE_SCOPE("DeviceClw::JoinEvents");
+
+        try
+        {
+            std::vector<CLWEvent> events;
+            for (std::size_t i = 0; i < num_events; ++i)
+            {
+                events.push_back(static_cast<EventClw*>(e[i])->GetEvent());
+            }
+
+            // Events of other queues are waited for by the device, with an empty list
+            // the marker waits for all the commands submitted to the queue before
+            CLWEvent event = m_context.Marker(queue, events);
+            m_context.Flush(queue);
+
+            auto event_clw = CreateEventClw();
+            event_clw->SetEvent(event);
+            *joined = event_clw;
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
+    }
+
     void DeviceClw::DeleteEvent(Event* e)
     {
         ReleaseEventClw(static_cast<EventClw*>(e));
@@ -531,9 +1287,16 @@ namespace Calc
 
     void DeviceClw::Flush(std::uint32_t queue)
     {
+        RR_TRACE_SCOPE("DeviceClw::Flush");
+
         try
         {
             m_context.Flush(queue);
+
+            if (m_out_of_order)
+            {
+                m_ordered_context.Flush(queue);
+            }
         }
         catch (CLWException& e)
         {
@@ -543,8 +1306,18 @@ namespace Calc
 
     void DeviceClw::Finish(std::uint32_t queue)
     {
+        RR_TRACE_SCOPE("DeviceClw::Finish");
+
         try
         {
+            if (m_out_of_order)
+            {
+                // Both queues may wait on each other, so both are flushed first
+                m_ordered_context.Flush(queue);
+                m_context.Flush(queue);
+                m_ordered_context.Finish(queue);
+            }
+
             m_context.Finish(queue);
         }
         catch (CLWException& e)
@@ -555,6 +1328,8 @@ namespace Calc
 
     EventClw* DeviceClw::CreateEventClw() const
     {
+        std::lock_guard<std::mutex> lock(m_event_pool_mutex);
+
         if (m_event_pool.empty())
         {
             auto event = new EventClw();
@@ -570,6 +1345,7 @@ namespace Calc
 
     void DeviceClw::ReleaseEventClw(EventClw* e) const
     {
+        std::lock_guard<std::mutex> lock(m_event_pool_mutex);
         m_event_pool.push(e);
     }
     
@@ -589,7 +1365,10 @@ namespace Calc
     class PrimitivesClw : public Primitives
     {
     public:
-        PrimitivesClw(CLWContext context)
+        // Parallel primitives chain their kernels relying on the queue order,
+        // out of order devices pass their in order companion context
+        PrimitivesClw(CLWContext context, DeviceClw const* device)
+            : m_device(device)
         {
             std::string buildopts = "";
             
@@ -627,16 +1406,99 @@ namespace Calc
 
         void SortRadixInt32(std::uint32_t queueidx, Buffer const* from_key, Buffer* to_key, Buffer const* from_value, Buffer* to_value, std::size_t size) override
         {
-            auto from_key_clw = static_cast<BufferClw const*>(from_key);
-            auto to_key_clw = static_cast<BufferClw*>(to_key);
-            auto from_value_clw = static_cast<BufferClw const*>(from_value);
-            auto to_value_clw = static_cast<BufferClw*>(to_value);
+            m_device->EnqueueOrdered(queueidx, { from_key, to_key, from_value, to_value }, [&]()
+            {
+                m_pp.SortRadix(queueidx, GetView<cl_uint>(from_key, size), GetView<cl_uint>(to_key, size), GetView<cl_int>(from_value, size), GetView<cl_int>(to_value, size), (int)size);
+            });
+        }
+
+        void SortRadixInt64(std::uint32_t queueidx, Buffer const* from_key, Buffer* to_key, Buffer const* from_value, Buffer* to_value, std::size_t size) override
+        {
+            m_device->EnqueueOrdered(queueidx, { from_key, to_key, from_value, to_value }, [&]()
+            {
+                m_pp.SortRadix(queueidx, GetView<cl_ulong>(from_key, size), GetView<cl_ulong>(to_key, size), GetView<cl_int>(from_value, size), GetView<cl_int>(to_value, size), (int)size);
+            });
+        }
 
-            m_pp.SortRadix((int)queueidx, from_key_clw->GetData(), to_key_clw->GetData(), from_value_clw->GetData(), to_value_clw->GetData(), (int)size);
+        void ScanExclusiveAddInt32(std::uint32_t queueidx, Buffer const* from, Buffer* to, std::size_t size) override
+        {
+            m_device->EnqueueOrdered(queueidx, { from, to }, [&]()
+            {
+                m_pp.ScanExclusiveAdd(queueidx, GetView<cl_int>(from, size), GetView<cl_int>(to, size), (int)size);
+            });
+        }
+
+        void SegmentedScanExclusiveAddInt32(std::uint32_t queueidx, Buffer const* from, Buffer const* heads, Buffer* to, std::size_t size) override
+        {
+            // Segmented scan processes whole buffers, so views are sized exactly
+            m_device->EnqueueOrdered(queueidx, { from, heads, to }, [&]()
+            {
+                m_pp.SegmentedScanExclusiveAdd(queueidx, GetView<cl_int>(from, size), GetView<cl_int>(heads, size), GetView<cl_int>(to, size));
+            });
+        }
+
+        void CompactInt32(std::uint32_t queueidx, Buffer const* predicate, Buffer const* from, Buffer* to, std::size_t size, Buffer* new_size) override
+        {
+            m_device->EnqueueOrdered(queueidx, { predicate, from, to, new_size }, [&]()
+            {
+                m_pp.Compact(queueidx, GetView<cl_int>(predicate, size), GetView<cl_int>(from, size), GetView<cl_int>(to, size), (int)size, GetView<cl_int>(new_size, 1));
+            });
+        }
+
+        void ReduceMinMaxFloat(std::uint32_t queueidx, Buffer const* from, Buffer* result, std::size_t size) override
+        {
+            m_device->EnqueueOrdered(queueidx, { from, result }, [&]()
+            {
+                m_pp.ReduceMinMax(queueidx, GetView<cl_float>(from, size), GetView<cl_float>(result, 2), (int)size);
+            });
+        }
+
+        void ReduceBbox(std::uint32_t queueidx, Buffer const* from, Buffer* result, std::size_t size) override
+        {
+            m_device->EnqueueOrdered(queueidx, { from, result }, [&]()
+            {
+                m_pp.ReduceBbox(queueidx, GetView<cl_float>(from, 8 * size), GetView<cl_float>(result, 8), (int)size);
+            });
         }
 
     private:
+        // Typed view of the first count elements of the buffer
+        template <typename T>
+        static CLWBuffer<T> GetView(Buffer const* buffer, std::size_t count)
+        {
+            auto buffer_clw = static_cast<BufferClw const*>(buffer);
+            cl_mem mem = buffer_clw->GetData();
+
+            if (buffer->GetSize() == count * sizeof(T))
+            {
+                return CLWBuffer<T>::CreateFromClBuffer(mem);
+            }
+
+            // Sub-buffers of sub-buffers aren't allowed, views of heap buffers are made from the block
+            std::size_t origin = 0;
+            if (buffer_clw->IsSuballocated())
+            {
+                mem = buffer_clw->GetBlock();
+                origin = buffer_clw->GetOffset();
+            }
+
+            cl_buffer_region region = { origin, count * sizeof(T) };
+            cl_int status = CL_SUCCESS;
+            cl_mem view = clCreateSubBuffer(mem, 0, CL_BUFFER_CREATE_TYPE_REGION, &region, &status);
+
+            if (status != CL_SUCCESS)
+            {
+                throw ExceptionClw("clCreateSubBuffer failed");
+            }
+
+            auto result = CLWBuffer<T>::CreateFromClBuffer(view);
+            // The wrapper holds its own reference
+            clReleaseMemObject(view);
+            return result;
+        }
+
         CLWParallelPrimitives m_pp;
+        DeviceClw const* m_device;
     };
 
 
@@ -647,7 +1509,7 @@ namespace Calc
 
     Primitives* DeviceClw::CreatePrimitives() const
     {
-        return new PrimitivesClw(m_context);
+        return new PrimitivesClw(m_out_of_order ? m_ordered_context : m_context, this);
     }
 
     void DeviceClw::DeletePrimitives(Primitives* prims)
@@ -23,19 +23,32 @@ THE SOFTWARE.
 
 #include "device.h"
 #include "device_cl.h"
+#include "kernel_cache.h"
 #include "CLW.h"
 
+#include <functional>
+#include <initializer_list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <queue>
+#include <string>
+#include <vector>
 
 namespace Calc
 {
     class EventClw;
+    class BufferClw;
+    struct BufferAccess;
     // Device implementation with CLW library
     class DeviceClw : public DeviceCl
     {
     public:
         DeviceClw(cl_context context, cl_device_id device, cl_command_queue queue);
-        DeviceClw(CLWDevice device);
+        // Out of order queues run commands as soon as the commands accessing
+        // the same buffers are complete, instead of in submission order
+        DeviceClw(CLWDevice device, bool out_of_order = false);
+        // Tracks buffer accesses if the queue passed in is out of order
         DeviceClw(CLWDevice device, CLWContext context);
         ~DeviceClw();
 
@@ -69,10 +82,12 @@ namespace Calc
 
         // Execution
         void Execute(Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event** e) override;
+        void ExecuteRange(Function const* func, std::uint32_t queue, size_t global_offset, size_t global_size, size_t local_size, Event** e) override;
 
         // Events handling
         void WaitForEvent(Event* e) override;
         void WaitForMultipleEvents(Event** e, std::size_t num_events) override;
+        void JoinEvents(std::uint32_t queue, Event** e, std::size_t num_events, Event** joined) override;
         void DeleteEvent(Event* e) override;
 
         // Queue management functions
@@ -89,17 +104,73 @@ namespace Calc
 
         Platform GetPlatform() const override { return Platform::kOpenCL; }
 
+        // Directory to store compiled programs in, caching is disabled if empty
+        void SetKernelCachePath(char const* path);
+
     protected:
         EventClw* CreateEventClw() const;
         void      ReleaseEventClw(EventClw* e) const;
 
+        // Append common options to the ones passed by the caller
+        std::string GetBuildOptions(char const* options) const;
+        // Load the program from the in-memory or on-disk kernel cache or build and store it,
+        // key accumulates the sources and is extended with options and device identifiers
+        CLWProgram BuildProgram(KernelCache::Key key, std::string const& buildopts, std::function<CLWProgram()> const& build) const;
+        // Sub-allocate the buffer from the heap, returns nullptr if it is too large
+        Buffer* CreateHeapBuffer(std::size_t size);
+        // Allocate the buffer in fine-grained shared virtual memory and copy initdata if passed,
+        // returns nullptr if the device doesn't support it
+        Buffer* CreateSharedBuffer(std::size_t size, void* initdata);
+
+        // Out of order mode, all the calls below expect m_access_mutex to be locked.
+        // Commands the access to the buffer has to wait for, kernels are writing all the buffers
+        // they are passed. Queues of the commands are flushed, so commands on other queues can wait
+        void AddWaitList(BufferAccess const& access, bool write, std::uint32_t queue, bool ordered, std::vector<CLWEvent>& events) const;
+        // Make the command the last access to the buffer
+        void AddAccess(BufferAccess& access, bool write, std::uint32_t queue, bool ordered, CLWEvent event) const;
+        // Run enqueue on the in order companion queue after the commands accessing the buffers,
+        // parallel primitives rely on the submission order of their kernels
+        void EnqueueOrdered(std::uint32_t queue, std::initializer_list<Buffer const*> buffers, std::function<void()> const& enqueue) const;
+        // In order queues matching m_context queues by index
+        void CreateOrderedQueues();
+
+        friend class PrimitivesClw;
+
     private:
         CLWDevice m_device;
         CLWContext m_context;
+        // Kernel cache directory
+        std::string m_kernel_cache_path;
+        // Binaries of the programs built by the device, intersectors are recreated
+        // with the same kernel variants as scene features come and go
+        mutable std::map<std::uint64_t, std::vector<std::uint8_t>> m_program_binaries;
+        mutable std::mutex m_program_binaries_mutex;
 
         // Initial number of events in the pool
         static const std::size_t EVENT_POOL_INITIAL_SIZE = 100;
+        // Number of queues created for the device
+        static const std::uint32_t NUM_QUEUES = 4;
+        // Queue created with a high priority hint, the last one gets a low priority hint
+        static const std::uint32_t HIGH_PRIORITY_QUEUE = 1;
         // Event pool
         mutable std::queue<EventClw*> m_event_pool;
+        // Events are created and released from multiple threads
+        mutable std::mutex m_event_pool_mutex;
+
+        // Size of the blocks buffers are sub-allocated from
+        static const std::size_t HEAP_BLOCK_SIZE = 32 * 1024 * 1024;
+        // Larger buffers get their own allocation
+        static const std::size_t HEAP_MAX_BUFFER_SIZE = 4 * 1024 * 1024;
+        // Buffer heap, shared with the callbacks returning the ranges
+        // of released buffers, which can run after the device is gone
+        struct Heap;
+        std::shared_ptr<Heap> m_heap;
+
+        // Queues are out of order and commands wait for the ones they depend on
+        bool m_out_of_order;
+        // In order queues of the same context for parallel primitives
+        CLWContext m_ordered_context;
+        // Buffer access tracking is shared by all the queues
+        mutable std::mutex m_access_mutex;
     };
 }
\ No newline at end of file
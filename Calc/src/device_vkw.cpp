@@ -14,8 +14,14 @@
 #include "wrappers/queue.h"
 #include "wrappers/pipeline_layout.h"
 #include "wrappers/physical_device.h"
+#include "wrappers/pipeline_cache.h"
 #include "misc/glsl_to_spirv.h"
 
+#include <algorithm>
+#include <cstring>
+#include <utility>
+#include <vector>
+
 #include "calc_common.h"
 #include "buffer.h"
 #include "event.h"
@@ -27,7 +33,15 @@
 #include "executable_vk.h"
 #include "function_vk.h"
 #include "device_vk.h"
+#include "primitives.h"
+#include "trace.h"
 
+#ifdef RR_EMBED_KERNELS
+#include "../kernelcache/calckernels_vk.h"
+#ifdef RR_EMBED_SPIRV
+#include "../kernelcache/calckernels_vk_spirv.h"
+#endif
+#endif // RR_EMBED_KERNELS
 
 namespace Calc
 {    
@@ -53,25 +67,93 @@ namespace Calc
     DeviceVulkanw::DeviceVulkanw( Anvil::Device* in_new_device, bool in_use_compute_pipe ) :
          DeviceVulkan()
          , m_anvil_device( in_new_device )
-         , m_is_command_buffer_recording( false )
+         , m_max_batch_size( DEFAULT_MAX_BATCH_SIZE )
          , m_use_compute_pipe( in_use_compute_pipe )
-         , m_cpu_fence_id( 0 )
-         , m_gpu_known_fence_id( 1 )
+         , m_timestamp_pool( VK_NULL_HANDLE )
+         , m_timestamp_period( 1.0 )
+         , m_staging_buffer( nullptr )
+         , m_staging_head( 0 )
     {
         m_anvil_device->retain();
 
-        for( auto& fence : m_anvil_fences )
+        // every hardware queue of the family gets a stream, Calc queues beyond them share streams
+        const uint32_t num_queues = m_use_compute_pipe ?
+                                    m_anvil_device->get_n_compute_queues() :
+                                    m_anvil_device->get_n_universal_queues();
+        const uint32_t num_streams = num_queues == 0 ? 1 : ( num_queues < MAX_NUM_QUEUES ? num_queues : MAX_NUM_QUEUES );
+
+        for ( uint32_t i = 0; i < num_streams; ++i )
         {
-            fence.reset( new Anvil::Fence(m_anvil_device, true) );
+            std::unique_ptr<Stream> stream( new Stream() );
+            stream->index = i;
+            stream->queue = ( i < num_queues ) ?
+                            ( m_use_compute_pipe ? m_anvil_device->get_compute_queue( i ) : m_anvil_device->get_universal_queue( i ) ) :
+                            nullptr;
+            stream->waited_ids.resize( num_streams, 0 );
+            stream->is_recording = false;
+            stream->batch_size = 0;
+            stream->cpu_fence_id = 0;
+            stream->gpu_known_fence_id = 1;
+
+            for( auto& fence : stream->fences )
+            {
+                fence.reset( new Anvil::Fence(m_anvil_device, true) );
+            }
+
+            m_streams.push_back( std::move( stream ) );
         }
     }
 
     // dtor
     DeviceVulkanw::~DeviceVulkanw()
     {
-        m_command_buffer.reset();
+        // complete pending work before the command buffers and the staging ring are released
+        for ( auto& stream : m_streams )
+        {
+            if ( stream->is_recording )
+            {
+                CommitCommandBuffer( *stream, false );
+            }
+        }
+
+        for ( auto& stream : m_streams )
+        {
+            WaitForFence( GetFenceId( stream->index ) );
+        }
+
+        if ( nullptr != m_staging_buffer )
+        {
+            m_staging_buffer->release();
+        }
+
+        VkDevice device = m_anvil_device->get_device_vk();
+
+        for ( auto& stream : m_streams )
+        {
+            for ( auto& command_buffer : stream->command_buffers ) { command_buffer.reset(); }
+
+            for ( auto& semaphores : stream->wait_semaphores )
+            {
+                m_free_semaphores.insert( m_free_semaphores.end(), semaphores.begin(), semaphores.end() );
+            }
+        }
+
+        for ( auto semaphore : m_free_semaphores )
+        {
+            vkDestroySemaphore( device, semaphore, nullptr );
+        }
+
+        if ( VK_NULL_HANDLE != m_timestamp_pool )
+        {
+            vkDestroyQueryPool( device, m_timestamp_pool, nullptr );
+        }
+
+        if ( !m_kernel_cache_path.empty() )
+        {
+            SavePipelineCache();
+        }
 
-        for (auto& fence : m_anvil_fences) { fence.reset(); }
+        m_streams.clear();
 
         m_anvil_device->release();
     }
@@ -88,16 +170,49 @@ namespace Calc
             return false;
         }
 
-        m_command_buffer.reset( cmd_pool->alloc_primary_level_command_buffer() );
-
-        return nullptr != m_command_buffer;
+        return InitializeVulkanCommandBuffer( cmd_pool );
     }
 
+    // Queues of a family share the pool, command buffers can be submitted to any of them
     bool DeviceVulkanw::InitializeVulkanCommandBuffer(Anvil::CommandPool* cmd_pool)
     {
-        m_command_buffer.reset(cmd_pool->alloc_primary_level_command_buffer());
+        for ( auto& stream : m_streams )
+        {
+            if ( nullptr == stream->queue )
+            {
+                return false;
+            }
+
+            for ( auto& command_buffer : stream->command_buffers )
+            {
+                command_buffer.reset( cmd_pool->alloc_primary_level_command_buffer() );
+
+                if ( nullptr == command_buffer )
+                {
+                    return false;
+                }
+            }
+        }
+
+        // batches are timed for event profiling where the device supports it
+        auto const& limits = m_anvil_device->get_physical_device()->get_device_properties().limits;
 
-        return nullptr != m_command_buffer;
+        if ( VK_TRUE == limits.timestampComputeAndGraphics )
+        {
+            VkQueryPoolCreateInfo create_info = {};
+            create_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+            create_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+            create_info.queryCount = (uint32_t)( 2 * NUM_FENCE_TRACKERS * m_streams.size() );
+
+            if ( vkCreateQueryPool( m_anvil_device->get_device_vk(), &create_info, nullptr, &m_timestamp_pool ) != VK_SUCCESS )
+            {
+                m_timestamp_pool = VK_NULL_HANDLE;
+            }
+
+            m_timestamp_period = limits.timestampPeriod;
+        }
+
+        return true;
     }
 
     // Return specification of the device
@@ -132,7 +247,13 @@ namespace Calc
         spec.min_alignment = static_cast< std::uint32_t >(device->get_device_properties().limits.minMemoryMapAlignment);
         spec.max_alloc_size = static_cast< std::size_t >(hostMemory);
         spec.max_local_size = static_cast< std::size_t >(localMemory);
-
+        spec.max_num_queues = static_cast< std::uint32_t >( m_streams.size() );
+        // Queue priorities are fixed by the device passed in, streams are told apart by index only
+        spec.high_priority_queue = 0;
+        spec.low_priority_queue = spec.max_num_queues - 1;
+        spec.max_compute_units = 0;
+        spec.host_unified_memory = false;
+        spec.shared_virtual_memory = false;
     }
 
     // Buffer creation and deletion
@@ -152,16 +273,47 @@ namespace Calc
                                                 Anvil::QUEUE_FAMILY_COMPUTE_BIT :
                                                 Anvil::QUEUE_FAMILY_GRAPHICS_BIT;
 
+        if ( flags & BufferType::kHostPtr )
+        {
+            throw ExceptionVk("Host pointer buffers aren't supported" );
+            return nullptr;
+        }
+
+        // small buffers are mostly single values and counters read back right away,
+        // they stay host visible to avoid a copy, same for pinned buffers
+        if ( size < DEVICE_LOCAL_MIN_SIZE || ( flags & BufferType::kPinned ) )
+        {
+            Anvil::Buffer* newBuffer = new Anvil::Buffer( m_anvil_device
+                                                            , size
+                                                            , queueToUse
+                                                            , VK_SHARING_MODE_EXCLUSIVE
+                                                            , VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+                                                            , true
+                                                            , false
+                                                            , initdata );
+
+            return new BufferVulkan( newBuffer, false );
+        }
+
         Anvil::Buffer* newBuffer = new Anvil::Buffer( m_anvil_device
                                                         , size
                                                         , queueToUse
                                                         , VK_SHARING_MODE_EXCLUSIVE
-                                                        , VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
-                                                        , true
+                                                        , VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                                          VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                                                          VK_BUFFER_USAGE_TRANSFER_DST_BIT
                                                         , false
-                                                        , initdata );
+                                                        , false
+                                                        , nullptr );
+
+        BufferVulkan* buffer = new BufferVulkan( newBuffer, false, true );
+
+        if ( nullptr != initdata )
+        {
+            CopyFromStaging( GetStream( 0 ), buffer, 0, size, initdata );
+        }
 
-        return new BufferVulkan( newBuffer, false );
+        return buffer;
     }
 
     void DeviceVulkanw::DeleteBuffer( Buffer* buffer )
@@ -175,32 +327,53 @@ namespace Calc
     // Data movement
     void DeviceVulkanw::ReadBuffer( Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, void* dst, Event** e ) const
     {
-        if (nullptr != e) {
-            *e = new EventVulkan(this);
-        }
+        RR_TRACE_SCOPE("DeviceVulkanw::ReadBuffer");
 
         BufferVulkan* vulkanBuffer = ConstCast<BufferVulkan>( buffer );
 
-        // make sure GPU has stopped using this buffer
-        WaitForFence(vulkanBuffer->m_fence_id);
+        // the copy is recorded after pending work, it waits for its own batch only
+        if ( vulkanBuffer->IsDeviceLocal() )
+        {
+            const_cast<DeviceVulkanw*>( this )->CopyToStaging( GetStream( queue ), vulkanBuffer, offset, size, dst );
+        }
+        else
+        {
+            // make sure GPU has finished writing this buffer, dispatches reading it can go on
+            WaitForFence(vulkanBuffer->m_write_fence_id);
+
+            Anvil::Buffer* anvilBuffer = vulkanBuffer->GetAnvilBuffer();
+            anvilBuffer->read( offset, size, dst );
+        }
 
-        Anvil::Buffer* anvilBuffer = vulkanBuffer->GetAnvilBuffer();
-        anvilBuffer->read( offset, size, dst );
+        if (nullptr != e) {
+            *e = new EventVulkan(this, GetFenceId(queue));
+        }
     }
 
     void DeviceVulkanw::WriteBuffer( Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, void* src, Event** e )
     {
-        if (nullptr != e) {
-            *e = new EventVulkan(this);
-        }
+        RR_TRACE_SCOPE("DeviceVulkanw::WriteBuffer");
 
         BufferVulkan* vulkanBuffer = ConstCast<BufferVulkan>( buffer );
 
-        // make sure GPU has stopped using this buffer
-        WaitForFence(vulkanBuffer->m_fence_id);
+        // the copy is ordered against pending dispatches by a barrier, no wait is needed,
+        // the event is taken after it so it stands for the batch the copy is recorded into
+        if ( vulkanBuffer->IsDeviceLocal() )
+        {
+            CopyFromStaging( GetStream( queue ), vulkanBuffer, offset, size, src );
+        }
+        else
+        {
+            // make sure GPU has stopped using this buffer
+            WaitForFence(vulkanBuffer->m_fence_id);
 
-        Anvil::Buffer* anvilBuffer = vulkanBuffer->GetAnvilBuffer();
-        anvilBuffer->write( offset, size, src );
+            Anvil::Buffer* anvilBuffer = vulkanBuffer->GetAnvilBuffer();
+            anvilBuffer->write( offset, size, src );
+        }
+
+        if (nullptr != e) {
+            *e = new EventVulkan(this, GetFenceId(queue));
+        }
     }
 
     // Buffer mapping 
@@ -212,13 +385,17 @@ namespace Calc
                                     void** mapdata,
                                     Event** e )
     {
+        RR_TRACE_SCOPE("DeviceVulkanw::MapBuffer");
+
         BufferVulkan* vulkanBuffer = ConstCast<BufferVulkan>( buffer );
 
-        // make sure GPU has stopped using this buffer
-        WaitForFence(vulkanBuffer->m_fence_id);
+        // Write proxies are never filled from the buffer
+        map_type &= ~MapType::kMapWriteDiscard;
 
+        // mapping doesn't wait for the GPU, the proxy is filled by a read that waits for
+        // pending writes only and copied back by a write at unmap that waits for all uses
         if( nullptr != e ) {
-            *e = new EventVulkan(this);
+            *e = new EventVulkan(this, GetFenceId(queue));
         }
 
         // allocated a proxy buffer
@@ -246,7 +423,7 @@ namespace Calc
         BufferVulkan* vulkanBuffer = ConstCast<BufferVulkan>( buffer );
 
         if( nullptr != e ) {
-            *e = new EventVulkan(this);
+            *e = new EventVulkan(this, GetFenceId(queue));
         }
 
         const MappedMemory& mappedMemory = vulkanBuffer->GetMappedMemory();
@@ -267,113 +444,591 @@ namespace Calc
     // Kernel compilation
     Executable* DeviceVulkanw::CompileExecutable( char const* source_code, std::size_t size, char const* options )
     {
+        RR_TRACE_SCOPE("DeviceVulkanw::CompileExecutable");
+
         return new ExecutableVulkan( m_anvil_device, source_code, size, m_use_compute_pipe );
     }
 
+    // Binaries hold SPIR-V generated offline, options were applied when it was compiled
     Executable* DeviceVulkanw::CompileExecutable( std::uint8_t const* binary_code, std::size_t size, char const* options )
     {
-        VK_EMPTY_IMPLEMENTATION;
-        return nullptr;
+        RR_TRACE_SCOPE("DeviceVulkanw::CompileExecutable");
+
+        return new ExecutableVulkan( m_anvil_device, binary_code, size, m_use_compute_pipe );
     }
 
     Executable* DeviceVulkanw::CompileExecutable( char const* inFilename, char const** inHeaderNames, int inHeadersNum, char const* options)
     {
+        RR_TRACE_SCOPE("DeviceVulkanw::CompileExecutable");
+
         return new ExecutableVulkan( m_anvil_device, inFilename, m_use_compute_pipe );
     }
 
     void DeviceVulkanw::DeleteExecutable( Executable* executable )
     {
+        // pipelines of the executable may be used by pending dispatches of any queue
+        for ( auto& stream : m_streams )
+        {
+            Finish( stream->index );
+        }
         delete executable;
     }
 
     // Executable management
+    // Only executables created from a binary have one, GLSL is compiled per function
     size_t DeviceVulkanw::GetExecutableBinarySize( Executable const* executable ) const
     {
-        VK_EMPTY_IMPLEMENTATION;
-        return 0;
+        return static_cast<ExecutableVulkan const*>( executable )->GetBinary().size();
     }
 
     void DeviceVulkanw::GetExecutableBinary( Executable const* executable, std::uint8_t* binary ) const
     {
-        VK_EMPTY_IMPLEMENTATION;
+        auto const& data = static_cast<ExecutableVulkan const*>( executable )->GetBinary();
+        std::copy( data.begin(), data.end(), binary );
+    }
+
+    // The pipeline cache is only valid for the same device and driver
+    KernelCache::Key DeviceVulkanw::GetPipelineCacheKey() const
+    {
+        auto const& properties = m_anvil_device->get_physical_device()->get_device_properties();
+
+        KernelCache::Key key;
+        key.Add( "VkPipelineCache" );
+        key.Add( properties.deviceName );
+        key.Add( &properties.vendorID, sizeof( properties.vendorID ) );
+        key.Add( &properties.deviceID, sizeof( properties.deviceID ) );
+        key.Add( &properties.driverVersion, sizeof( properties.driverVersion ) );
+        key.Add( properties.pipelineCacheUUID, sizeof( properties.pipelineCacheUUID ) );
+        return key;
+    }
+
+    // Merge pipelines saved by a previous run into the cache Anvil creates pipelines with
+    void DeviceVulkanw::SetKernelCachePath( char const* path )
+    {
+        m_kernel_cache_path = path ? path : "";
+
+        if ( m_kernel_cache_path.empty() )
+        {
+            return;
+        }
+
+        std::vector<std::uint8_t> data;
+        if ( !KernelCache( m_kernel_cache_path ).Load( GetPipelineCacheKey().Get(), data ) )
+        {
+            return;
+        }
+
+        VkPipelineCacheCreateInfo create_info = {};
+        create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+        create_info.initialDataSize = data.size();
+        create_info.pInitialData = data.data();
+
+        VkDevice device = m_anvil_device->get_device_vk();
+        VkPipelineCache loaded_cache = VK_NULL_HANDLE;
+
+        // the driver discards data it doesn't recognize, a failure only means a cold start
+        if ( vkCreatePipelineCache( device, &create_info, nullptr, &loaded_cache ) != VK_SUCCESS )
+        {
+            return;
+        }
+
+        VkPipelineCache pipeline_cache = m_anvil_device->get_pipeline_cache()->get_pipeline_cache();
+        vkMergePipelineCaches( device, pipeline_cache, 1, &loaded_cache );
+        vkDestroyPipelineCache( device, loaded_cache, nullptr );
+    }
+
+    void DeviceVulkanw::SavePipelineCache() const
+    {
+        VkDevice device = m_anvil_device->get_device_vk();
+        VkPipelineCache pipeline_cache = m_anvil_device->get_pipeline_cache()->get_pipeline_cache();
+
+        size_t size = 0;
+        if ( vkGetPipelineCacheData( device, pipeline_cache, &size, nullptr ) != VK_SUCCESS || size == 0 )
+        {
+            return;
+        }
+
+        std::vector<std::uint8_t> data( size );
+        if ( vkGetPipelineCacheData( device, pipeline_cache, &size, data.data() ) != VK_SUCCESS )
+        {
+            return;
+        }
+
+        data.resize( size );
+        KernelCache( m_kernel_cache_path ).Save( GetPipelineCacheKey().Get(), data );
+    }
+
+    Anvil::PrimaryCommandBuffer* DeviceVulkanw::GetCommandBuffer( std::uint32_t queue ) const
+    {
+        auto const& stream = GetStream( queue );
+        return stream.command_buffers[ stream.cpu_fence_id % NUM_FENCE_TRACKERS ].get();
+    }
+
+    uint64_t DeviceVulkanw::GetFenceId( std::uint32_t queue ) const
+    {
+        auto const& stream = GetStream( queue );
+        return MakeFenceId( stream, stream.cpu_fence_id );
+    }
+
+    // Fences are polled without blocking when the id is not known to have been passed yet,
+    // so events complete and staging regions are freed without anyone waiting for them
+    bool DeviceVulkanw::HasFenceBeenPassed( uint64_t id ) const
+    {
+        auto& stream = GetFenceStream( id );
+        const uint64_t local_id = GetLocalFenceId( id );
+
+        if ( stream.gpu_known_fence_id <= local_id )
+        {
+            PollFences( stream );
+        }
+
+        return stream.gpu_known_fence_id > local_id;
+    }
+
+    void DeviceVulkanw::PollFences( Stream& stream ) const
+    {
+        // fences of a queue are signalled in submission order, so polling stops at the first pending one
+        const uint64_t last_submitted = stream.is_recording ? stream.cpu_fence_id - 1 : stream.cpu_fence_id;
+
+        while ( stream.gpu_known_fence_id <= last_submitted &&
+                vkGetFenceStatus( m_anvil_device->get_device_vk(), *GetFence( stream, stream.gpu_known_fence_id )->get_fence_ptr() ) == VK_SUCCESS )
+        {
+            stream.gpu_known_fence_id++;
+        }
     }
 
-    // Get queue, the execution of vulkan shaders can be done through the compute queue or the graphic queue
-    Anvil::Queue* DeviceVulkanw::GetQueue() const
+    // Allocate a region of the staging ring, waiting for the copies still using it
+    std::size_t DeviceVulkanw::AllocStagingRegion( std::size_t size )
     {
-        Anvil::Queue* toReturn = (true == m_use_compute_pipe) ?
-                                 m_anvil_device->get_compute_queue( 0 ) :
-                                 m_anvil_device->get_universal_queue( 0 );
-        return toReturn;
+        Assert( size <= STAGING_RING_SIZE );
+
+        if ( nullptr == m_staging_buffer )
+        {
+            const Anvil::QueueFamilyBits queueToUse = (true == m_use_compute_pipe) ?
+                                                    Anvil::QUEUE_FAMILY_COMPUTE_BIT :
+                                                    Anvil::QUEUE_FAMILY_GRAPHICS_BIT;
+
+            m_staging_buffer = new Anvil::Buffer( m_anvil_device
+                                                    , STAGING_RING_SIZE
+                                                    , queueToUse
+                                                    , VK_SHARING_MODE_EXCLUSIVE
+                                                    , VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT
+                                                    , true
+                                                    , true
+                                                    , nullptr );
+        }
+
+        // wrap around when the region doesn't fit at the end
+        if ( m_staging_head + size > STAGING_RING_SIZE )
+        {
+            m_staging_head = 0;
+        }
+
+        const std::size_t begin = m_staging_head;
+        const std::size_t end = begin + size;
+
+        // regions copied on different queues complete out of order, so each overlapping one is waited for
+        for ( auto const& region : m_staging_regions )
+        {
+            if ( region.begin < end && begin < region.end )
+            {
+                WaitForFence( region.fence_id );
+            }
+        }
+
+        while ( !m_staging_regions.empty() && HasFenceBeenPassed( m_staging_regions.front().fence_id ) )
+        {
+            m_staging_regions.pop_front();
+        }
+
+        m_staging_head = ( end + STAGING_ALIGNMENT - 1 ) & ~( STAGING_ALIGNMENT - 1 );
+
+        return begin;
+    }
+
+    void DeviceVulkanw::RecordTransferBarrier( Stream& stream, BufferVulkan* buffer, bool is_write ) const
+    {
+        AcquireBuffer( stream, buffer );
+
+        if ( buffer->m_pending_write || ( is_write && buffer->m_pending_read ) )
+        {
+            const VkAccessFlags src_access = buffer->m_pending_write ?
+                                             VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT :
+                                             0;
+            const VkAccessFlags dst_access = is_write ? VK_ACCESS_TRANSFER_WRITE_BIT : VK_ACCESS_TRANSFER_READ_BIT;
+
+            Anvil::BufferBarrier barrier( src_access,
+                                          dst_access,
+                                          stream.queue->get_queue_family_index(),
+                                          stream.queue->get_queue_family_index(),
+                                          buffer->GetAnvilBuffer(),
+                                          0,
+                                          buffer->GetSize() );
+
+            GetCommandBuffer( stream.index )->record_pipeline_barrier( VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                                        VK_FALSE,
+                                                        0, nullptr,
+                                                        1, &barrier,
+                                                        0, nullptr );
+
+            buffer->m_pending_write = false;
+            buffer->m_pending_read = false;
+        }
+
+        if ( is_write )
+        {
+            buffer->m_pending_write = true;
+        }
+        else
+        {
+            buffer->m_pending_read = true;
+        }
+    }
+
+    // Upload through the staging ring, copies are recorded into the open batch
+    void DeviceVulkanw::CopyFromStaging( Stream& stream, BufferVulkan* buffer, std::size_t offset, std::size_t size, void const* src )
+    {
+        auto data = static_cast<std::uint8_t const*>( src );
+
+        while ( size > 0 )
+        {
+            const std::size_t chunk_size = size < STAGING_RING_SIZE ? size : STAGING_RING_SIZE;
+            const std::size_t staging_offset = AllocStagingRegion( chunk_size );
+
+            // host writes are made visible by the submit
+            m_staging_buffer->write( staging_offset, chunk_size, data );
+
+            if ( false == stream.is_recording )
+            {
+                StartRecording( stream );
+            }
+
+            RecordTransferBarrier( stream, buffer, true );
+
+            VkBufferCopy region = {};
+            region.srcOffset = staging_offset;
+            region.dstOffset = offset;
+            region.size = chunk_size;
+            GetCommandBuffer( stream.index )->record_copy_buffer( m_staging_buffer, buffer->GetAnvilBuffer(), 1, &region );
+
+            const uint64_t fence_id = GetFenceId( stream.index );
+            m_staging_regions.push_back( { staging_offset, staging_offset + chunk_size, fence_id } );
+            buffer->SetWriteFenceId( fence_id );
+
+            data += chunk_size;
+            offset += chunk_size;
+            size -= chunk_size;
+        }
+    }
+
+    // Readback through the staging ring, waits for the batch of each copy
+    void DeviceVulkanw::CopyToStaging( Stream& stream, BufferVulkan* buffer, std::size_t offset, std::size_t size, void* dst )
+    {
+        auto data = static_cast<std::uint8_t*>( dst );
+
+        while ( size > 0 )
+        {
+            const std::size_t chunk_size = size < STAGING_RING_SIZE ? size : STAGING_RING_SIZE;
+            const std::size_t staging_offset = AllocStagingRegion( chunk_size );
+
+            if ( false == stream.is_recording )
+            {
+                StartRecording( stream );
+            }
+
+            RecordTransferBarrier( stream, buffer, false );
+
+            VkBufferCopy region = {};
+            region.srcOffset = offset;
+            region.dstOffset = staging_offset;
+            region.size = chunk_size;
+            GetCommandBuffer( stream.index )->record_copy_buffer( buffer->GetAnvilBuffer(), m_staging_buffer, 1, &region );
+
+            // make the copy visible to the host
+            Anvil::BufferBarrier barrier( VK_ACCESS_TRANSFER_WRITE_BIT,
+                                          VK_ACCESS_HOST_READ_BIT,
+                                          stream.queue->get_queue_family_index(),
+                                          stream.queue->get_queue_family_index(),
+                                          m_staging_buffer,
+                                          staging_offset,
+                                          chunk_size );
+
+            GetCommandBuffer( stream.index )->record_pipeline_barrier( VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                                        VK_PIPELINE_STAGE_HOST_BIT,
+                                                        VK_FALSE,
+                                                        0, nullptr,
+                                                        1, &barrier,
+                                                        0, nullptr );
+
+            const uint64_t fence_id = GetFenceId( stream.index );
+            m_staging_regions.push_back( { staging_offset, staging_offset + chunk_size, fence_id } );
+            buffer->SetFenceId( fence_id );
+
+            WaitForFence( fence_id );
+            m_staging_buffer->read( staging_offset, chunk_size, data );
+
+            data += chunk_size;
+            offset += chunk_size;
+            size -= chunk_size;
+        }
     }
 
     // To start recording Vulkan commands to the CommandBuffer
-    void DeviceVulkanw::StartRecording()
+    void DeviceVulkanw::StartRecording( Stream& stream )
     {
-        Assert( false == m_is_command_buffer_recording );
+        Assert( false == stream.is_recording );
 
-        AllocNextFenceId();
-        const auto fence = GetFence( m_cpu_fence_id );
+        AllocNextFenceId( stream );
+        const auto fence = GetFence( stream, stream.cpu_fence_id );
         fence->reset();
 
-        m_is_command_buffer_recording = true;
-        m_command_buffer->reset( false );
-        m_command_buffer->start_recording( true, false );
+        // the batch submitted last from this slot has completed, its semaphores can be reused
+        auto& semaphores = stream.wait_semaphores[ stream.cpu_fence_id % NUM_FENCE_TRACKERS ];
+        m_free_semaphores.insert( m_free_semaphores.end(), semaphores.begin(), semaphores.end() );
+        semaphores.clear();
+
+        stream.is_recording = true;
+        stream.batch_size = 0;
+
+        // the fence of the previous submit from this buffer has been passed in AllocNextFenceId
+        const auto command_buffer = GetCommandBuffer( stream.index );
+        command_buffer->reset( false );
+        command_buffer->start_recording( true, false );
+
+        if ( VK_NULL_HANDLE != m_timestamp_pool )
+        {
+            const uint32_t query = (uint32_t)( 2 * ( stream.index * NUM_FENCE_TRACKERS + stream.cpu_fence_id % NUM_FENCE_TRACKERS ) );
+            vkCmdResetQueryPool( command_buffer->get_command_buffer(), m_timestamp_pool, query, 2 );
+            vkCmdWriteTimestamp( command_buffer->get_command_buffer(), VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_timestamp_pool, query );
+        }
     }
 
-    // Finish recording
-    void DeviceVulkanw::EndRecording( bool in_wait_till_completed, Event** out_event )
+    // Finish recording of a dispatch, the batch is submitted when it is full
+    void DeviceVulkanw::EndRecording( Stream& stream, Event** out_event )
     {
+        const uint64_t fence_id = GetFenceId( stream.index );
 
-        // execute CommandBuffer if either wait_till_completed
-        // TODO buffer n exec's per commit
-        CommitCommandBuffer( in_wait_till_completed );
+        if ( ++stream.batch_size >= m_max_batch_size )
+        {
+            CommitCommandBuffer( stream, false );
+        }
 
         if ( nullptr != out_event )
         {
-            *out_event = new EventVulkan( this );
+            *out_event = new EventVulkan( this, fence_id );
+        }
+    }
+
+    // Execute CommandBuffer, the batch waits for the semaphores of the other queues it depends on
+    void DeviceVulkanw::CommitCommandBuffer( Stream& stream, bool in_wait_till_completed ) const
+    {
+        RR_TRACE_SCOPE("DeviceVulkanw::CommitCommandBuffer");
+
+        const auto fence = GetFence( stream, stream.cpu_fence_id );
+        const auto command_buffer = GetCommandBuffer( stream.index );
+
+        stream.is_recording = false;
+
+        if ( VK_NULL_HANDLE != m_timestamp_pool )
+        {
+            const uint32_t query = (uint32_t)( 2 * ( stream.index * NUM_FENCE_TRACKERS + stream.cpu_fence_id % NUM_FENCE_TRACKERS ) + 1 );
+            vkCmdWriteTimestamp( command_buffer->get_command_buffer(), VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_timestamp_pool, query );
+        }
+
+        command_buffer->stop_recording();
+
+        auto const& semaphores = stream.wait_semaphores[ stream.cpu_fence_id % NUM_FENCE_TRACKERS ];
+        std::vector<VkPipelineStageFlags> wait_stages( semaphores.size(), VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT );
+        VkCommandBuffer command_buffer_vk = command_buffer->get_command_buffer();
+
+        VkSubmitInfo submit_info = {};
+        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submit_info.waitSemaphoreCount = (uint32_t)( semaphores.size() );
+        submit_info.pWaitSemaphores = semaphores.empty() ? nullptr : semaphores.data();
+        submit_info.pWaitDstStageMask = wait_stages.empty() ? nullptr : wait_stages.data();
+        submit_info.commandBufferCount = 1;
+        submit_info.pCommandBuffers = &command_buffer_vk;
+
+        if ( vkQueueSubmit( stream.queue->get_queue(), 1, &submit_info, *fence->get_fence_ptr() ) != VK_SUCCESS )
+        {
+            throw ExceptionVk( "Failed to submit a command buffer" );
+        }
+
+        if ( in_wait_till_completed )
+        {
+            WaitForFence( MakeFenceId( stream, stream.cpu_fence_id ) );
+        }
+    }
+
+    void DeviceVulkanw::AddStreamDependency( Stream& stream, uint64_t id ) const
+    {
+        Assert( stream.is_recording );
+
+        auto& other = GetFenceStream( id );
+        const uint64_t local_id = GetLocalFenceId( id );
+
+        if ( other.index == stream.index || stream.waited_ids[ other.index ] >= local_id || HasFenceBeenPassed( id ) )
+        {
+            return;
+        }
+
+        if ( other.is_recording && local_id >= other.cpu_fence_id )
+        {
+            CommitCommandBuffer( other, false );
+        }
+
+        VkDevice device = m_anvil_device->get_device_vk();
+        VkSemaphore semaphore = VK_NULL_HANDLE;
+
+        if ( m_free_semaphores.empty() )
+        {
+            VkSemaphoreCreateInfo create_info = {};
+            create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+            if ( vkCreateSemaphore( device, &create_info, nullptr, &semaphore ) != VK_SUCCESS )
+            {
+                throw ExceptionVk( "Failed to create a semaphore" );
+            }
+        }
+        else
+        {
+            semaphore = m_free_semaphores.back();
+            m_free_semaphores.pop_back();
+        }
+
+        // an empty submit signals once everything submitted to the other queue before is complete,
+        // so the semaphore doesn't have to be known when the batch it follows is committed
+        VkSubmitInfo submit_info = {};
+        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submit_info.signalSemaphoreCount = 1;
+        submit_info.pSignalSemaphores = &semaphore;
+
+        if ( vkQueueSubmit( other.queue->get_queue(), 1, &submit_info, VK_NULL_HANDLE ) != VK_SUCCESS )
+        {
+            m_free_semaphores.push_back( semaphore );
+            throw ExceptionVk( "Failed to signal a semaphore" );
+        }
+
+        stream.wait_semaphores[ stream.cpu_fence_id % NUM_FENCE_TRACKERS ].push_back( semaphore );
+        stream.waited_ids[ other.index ] = other.is_recording ? other.cpu_fence_id - 1 : other.cpu_fence_id;
+    }
+
+    void DeviceVulkanw::AcquireBuffer( Stream& stream, BufferVulkan* buffer ) const
+    {
+        if ( GetFenceStream( buffer->m_fence_id ).index == stream.index )
+        {
+            return;
         }
+
+        AddStreamDependency( stream, buffer->m_fence_id );
+
+        // the semaphore or the passed fence make the accesses of the other queue visible,
+        // barriers of this queue only have to cover its own accesses from now on
+        buffer->m_pending_write = false;
+        buffer->m_pending_read = false;
+        buffer->SetFenceId( GetFenceId( stream.index ) );
     }
 
-    // Execute CommandBuffer
-    void DeviceVulkanw::CommitCommandBuffer( bool in_wait_till_completed )
+    bool DeviceVulkanw::GetBatchTimestamps( uint64_t id, uint64_t& start, uint64_t& end ) const
     {
-        const auto fence = GetFence( m_cpu_fence_id );
+        auto const& stream = GetFenceStream( id );
+        const uint64_t local_id = GetLocalFenceId( id );
+
+        // the queries are reset once the fence tracker is reused
+        if ( VK_NULL_HANDLE == m_timestamp_pool || !HasFenceBeenPassed( id ) || stream.cpu_fence_id >= local_id + NUM_FENCE_TRACKERS )
+        {
+            return false;
+        }
+
+        uint64_t timestamps[ 2 ] = { 0, 0 };
+
+        if ( vkGetQueryPoolResults( m_anvil_device->get_device_vk(), m_timestamp_pool,
+                                    (uint32_t)( 2 * ( stream.index * NUM_FENCE_TRACKERS + local_id % NUM_FENCE_TRACKERS ) ), 2,
+                                    sizeof( timestamps ), timestamps, sizeof( uint64_t ),
+                                    VK_QUERY_RESULT_64_BIT ) != VK_SUCCESS )
+        {
+            return false;
+        }
 
-        m_is_command_buffer_recording = false;
-        m_command_buffer->stop_recording();
+        start = (uint64_t)( timestamps[ 0 ] * m_timestamp_period );
+        end = (uint64_t)( timestamps[ 1 ] * m_timestamp_period );
+        return true;
+    }
+
+    void DeviceVulkanw::SetMaxBatchSize( std::uint32_t num_dispatches )
+    {
+        m_max_batch_size = num_dispatches > 0 ? num_dispatches : 1;
+
+        for ( auto& stream : m_streams )
+        {
+            if ( stream->is_recording && stream->batch_size >= m_max_batch_size )
+            {
+                CommitCommandBuffer( *stream, false );
+            }
+        }
+    }
+
+    void DeviceVulkanw::ExecuteRange( Function const* func, std::uint32_t queue, size_t global_offset, size_t global_size, size_t local_size, Event** e )
+    {
+        // Shaders have no global offset, so only whole grids are launched
+        if ( global_offset != 0 )
+        {
+            throw ExceptionVk( "Global offsets aren't supported" );
+        }
 
-        GetQueue()->submit_command_buffer( m_command_buffer.get(), in_wait_till_completed, fence );
+        Execute( func, queue, global_size, local_size, e );
     }
 
     // Execution Not thread safe
     void DeviceVulkanw::Execute( Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event** e )
     {
+        RR_TRACE_SCOPE("DeviceVulkanw::Execute");
+
         FunctionVulkan* vulkan_function = ConstCast<FunctionVulkan>( func );
+        auto& stream = GetStream( queue );
 
         uint32_t number_of_parameters = (uint32_t)( vulkan_function->GetParameters().size() );
 
-        // get the Function's descriptor set group
-        Anvil::DescriptorSetGroup* new_descriptor_set = vulkan_function->GetDescriptorSetGroup();
+        // pick a descriptor set group no pending command buffer uses, descriptor sets can't be
+        // updated while they are pending, so switching arguments doesn't submit and wait
+        auto& descriptor_sets = vulkan_function->GetDescriptorSets();
+        std::size_t set_index = descriptor_sets.size();
 
-        // if it's empty, this is 1st run of the Function so we have to create it
-        if ( nullptr == new_descriptor_set )
+        for ( std::size_t i = 0; i < descriptor_sets.size(); ++i )
         {
-            // allocate it through Anvil
-            new_descriptor_set = new Anvil::DescriptorSetGroup( m_anvil_device, false, 1 );
-
-            // add bindings and items (Buffers) to the new DSG
-            for ( uint32_t i = 0; i < number_of_parameters; ++i )
+            if ( HasFenceBeenPassed( descriptor_sets[ i ].fence_id ) )
             {
-                const Buffer* parameter = vulkan_function->GetParameters()[ i ];
-                BufferVulkan* buffer = ConstCast<BufferVulkan>( parameter );
-                new_descriptor_set->add_binding( 0, i, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT );
+                set_index = i;
+                break;
             }
+        }
+
+        if ( set_index == descriptor_sets.size() )
+        {
+            if ( descriptor_sets.size() < MAX_DESCRIPTOR_SETS )
+            {
+                // allocate it through Anvil, groups of a Function have identical layouts
+                Anvil::DescriptorSetGroup* group = new Anvil::DescriptorSetGroup( m_anvil_device, false, 1 );
+
+                // add bindings and items (Buffers) to the new DSG
+                for ( uint32_t i = 0; i < number_of_parameters; ++i )
+                {
+                    group->add_binding( 0, i, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT );
+                }
 
-            // set it to the Function to be reused during any subsequent run
-            vulkan_function->SetDescriptorSetGroup( new_descriptor_set );
+                descriptor_sets.push_back( { group, 0 } );
+            }
+            else
+            {
+                set_index = vulkan_function->GetNextDescriptorSet();
+                WaitForFence( descriptor_sets[ set_index ].fence_id );
+            }
         }
 
+        auto& descriptor_set_entry = descriptor_sets[ set_index ];
+        Anvil::DescriptorSetGroup* new_descriptor_set = descriptor_set_entry.group;
+
         // bind new items (Buffers), releasing the old ones
         for ( uint32_t i = 0; i < number_of_parameters; ++i )
         {
@@ -399,17 +1054,22 @@ namespace Calc
             vulkan_function->SetPipelineID( pipeline_id );
         }
 
-        // indicate we'll be recording Vulkan commands to the CommandBuffer from now on
-        StartRecording();
+        // open a new batch unless there is one recording already
+        if ( false == stream.is_recording )
+        {
+            StartRecording( stream );
+        }
+
+        const auto command_buffer = GetCommandBuffer( stream.index );
 
         // attach pipeline
-        m_command_buffer->record_bind_pipeline( VK_PIPELINE_BIND_POINT_COMPUTE, pipeline_id );
+        command_buffer->record_bind_pipeline( VK_PIPELINE_BIND_POINT_COMPUTE, pipeline_id );
 
         Anvil::PipelineLayout* pipeline_layout = m_anvil_device->get_compute_pipeline_manager()->get_compute_pipeline_layout( pipeline_id );
         Anvil::DescriptorSet* descriptor_set = new_descriptor_set->get_descriptor_set( 0 );
 
         // attach layout and 0 descriptor set (we don't use any other set currently)
-        m_command_buffer->record_bind_descriptor_sets( VK_PIPELINE_BIND_POINT_COMPUTE,
+        command_buffer->record_bind_descriptor_sets( VK_PIPELINE_BIND_POINT_COMPUTE,
                                                     pipeline_layout,
                                                     0,
                                                     1,
@@ -417,36 +1077,84 @@ namespace Calc
                                                     0,
                                                     nullptr );
 
-        // set memory barriers 
+        // buffers last used by other queues are waited for with a semaphore instead of a barrier
+        for ( uint32_t i = 0; i < number_of_parameters; ++i )
+        {
+            AcquireBuffer( stream, ConstCast<BufferVulkan>( vulkan_function->GetParameters()[ i ] ) );
+        }
+
+        // barriers only for the hazards with previous dispatches and copies: accesses of buffers
+        // written by them and writes of buffers read by them, host writes are made
+        // visible by the submit itself. Read only buffers don't serialize dispatches
+        std::vector<Anvil::BufferBarrier> buffer_barriers;
+
         for ( uint32_t i = 0; i < number_of_parameters; ++i )
         {
             const Buffer* parameter = vulkan_function->GetParameters()[ i ];
             BufferVulkan* buffer = ConstCast<BufferVulkan>( parameter );
 
-            Anvil::BufferBarrier bufferBarrier( VK_ACCESS_HOST_WRITE_BIT,
-                                                VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
-                                                GetQueue()->get_queue_family_index(),
-                                                GetQueue()->get_queue_family_index(),
-                                                buffer->GetAnvilBuffer(),
-                                                0,
-                                                buffer->GetSize() );
+            const bool is_write = !vulkan_function->IsReadOnly( i );
 
-            m_command_buffer->record_pipeline_barrier( VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-                                                    VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+            if ( buffer->m_pending_write || ( is_write && buffer->m_pending_read ) )
+            {
+                // write after read only needs an execution dependency
+                const VkAccessFlags src_access = buffer->m_pending_write ?
+                                                 VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT :
+                                                 0;
+                const VkAccessFlags dst_access = is_write ?
+                                                 VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT :
+                                                 VK_ACCESS_SHADER_READ_BIT;
+
+                buffer_barriers.push_back( Anvil::BufferBarrier( src_access,
+                                                                 dst_access,
+                                                                 stream.queue->get_queue_family_index(),
+                                                                 stream.queue->get_queue_family_index(),
+                                                                 buffer->GetAnvilBuffer(),
+                                                                 0,
+                                                                 buffer->GetSize() ) );
+
+                buffer->m_pending_write = false;
+                buffer->m_pending_read = false;
+            }
+        }
+
+        if ( false == buffer_barriers.empty() )
+        {
+            command_buffer->record_pipeline_barrier( VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                                    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
                                                     VK_FALSE,
                                                     0, nullptr,
-                                                    1, &bufferBarrier,
+                                                    (uint32_t)( buffer_barriers.size() ), &buffer_barriers[0],
                                                     0, nullptr );
-            // tell buffer that we are used by this submit
-            buffer->SetFenceId( GetFenceId() );
+        }
 
+        // record accesses of this dispatch once all the barriers are known,
+        // so a buffer bound twice doesn't get a barrier against itself
+        for ( uint32_t i = 0; i < number_of_parameters; ++i )
+        {
+            const Buffer* parameter = vulkan_function->GetParameters()[ i ];
+            BufferVulkan* buffer = ConstCast<BufferVulkan>( parameter );
+
+            // tell buffer that we are used by this submit
+            if ( vulkan_function->IsReadOnly( i ) )
+            {
+                buffer->m_pending_read = true;
+                buffer->SetFenceId( GetFenceId( stream.index ) );
+            }
+            else
+            {
+                buffer->m_pending_write = true;
+                buffer->SetWriteFenceId( GetFenceId( stream.index ) );
+            }
         }
 
-        // dispatch the Function's shader module
-        m_command_buffer->record_dispatch( (uint32_t)global_size, 1, 1 );
+        descriptor_set_entry.fence_id = GetFenceId( stream.index );
+
+        // dispatch the Function's shader module, global size is given in work items
+        command_buffer->record_dispatch( (uint32_t)( ( global_size + local_size - 1 ) / local_size ), 1, 1 );
 
         // end recording
-        EndRecording( false, e );
+        EndRecording( stream, e );
 
         // remove references to buffers. they were already referenced by the CommandBuffer.
         vulkan_function->UnreferenceParametersBuffers();
@@ -467,8 +1175,32 @@ namespace Calc
         // TODO optimize
         for (size_t i = 0; i < num_events; ++i)
         {
-            (*e)[i].Wait();
+            e[i]->Wait();
+        }
+    }
+
+    void DeviceVulkanw::JoinEvents( std::uint32_t queue, Event** e, std::size_t num_events, Event** joined )
+    {
+        // Commands of a queue complete in submission order, events of other queues
+        // are waited for on the GPU by the next batch of this one
+        auto& stream = GetStream( queue );
+
+        for ( std::size_t i = 0; i < num_events; ++i )
+        {
+            const uint64_t id = static_cast<EventVulkan*>( e[ i ] )->GetFenceId();
+
+            if ( GetFenceStream( id ).index != stream.index && !HasFenceBeenPassed( id ) )
+            {
+                if ( false == stream.is_recording )
+                {
+                    StartRecording( stream );
+                }
+
+                AddStreamDependency( stream, id );
+            }
         }
+
+        *joined = new EventVulkan( this, GetFenceId( queue ) );
     }
 
     void DeviceVulkanw::DeleteEvent( Event* e )
@@ -480,62 +1212,436 @@ namespace Calc
     }
 
     // Queue management functions
+    // Submit the pending batch
     void DeviceVulkanw::Flush( std::uint32_t queue )
     {
-        if(false == m_is_command_buffer_recording)
+        auto& stream = GetStream( queue );
+
+        if ( stream.is_recording )
         {
-            StartRecording();
+            CommitCommandBuffer( stream, false );
         }
-        EndRecording(true, nullptr);
     }
 
+    // Submit the pending batch and wait for all work submitted to the queue to complete
     void DeviceVulkanw::Finish( std::uint32_t queue )
     {
-        // TODO work out semantics of these two
-        Flush(queue);
+        RR_TRACE_SCOPE("DeviceVulkanw::Finish");
+
+        Flush( queue );
+        WaitForFence( GetFenceId( queue ) );
     }
 
+    // Have to match primitives.comp
+    static const std::size_t kGroupSize = 64;
+    static const std::size_t kBlockSize = 256;
+    static const std::size_t kRadix = 16;
+    static const std::uint32_t kRadixBits = 4;
+    // Work-groups of the first reduction pass
+    static const std::size_t kMaxReduceGroups = 64;
+
+    // Parallel primitives implemented with compute shaders
+    class PrimitivesVulkanw : public Primitives
+    {
+    public:
+        PrimitivesVulkanw( DeviceVulkanw* in_device )
+            : m_device( in_device )
+            , m_queue( 0 )
+        {
+#ifndef RR_EMBED_KERNELS
+            m_executable = m_device->CompileExecutable( "../Calc/kernels/GLSL/primitives.comp", nullptr, 0, nullptr );
+#elif defined(RR_EMBED_SPIRV)
+            m_executable = m_device->CompileExecutable( g_primitives_spirv, sizeof( g_primitives_spirv ), nullptr );
+#else
+            m_executable = m_device->CompileExecutable( g_primitives_vulkan, std::strlen( g_primitives_vulkan ), nullptr );
+#endif
+            m_scan_block = m_executable->CreateFunction( "scan_block" );
+            m_add_block_sums = m_executable->CreateFunction( "add_block_sums" );
+            m_segment_heads = m_executable->CreateFunction( "segment_heads" );
+            m_segmented_scan_combine = m_executable->CreateFunction( "segmented_scan_combine" );
+            m_compact_scatter = m_executable->CreateFunction( "compact_scatter" );
+            m_radix_histogram = m_executable->CreateFunction( "radix_histogram" );
+            m_radix_scatter = m_executable->CreateFunction( "radix_scatter" );
+            m_reduce_min_max = m_executable->CreateFunction( "reduce_min_max" );
+            m_reduce_bbox = m_executable->CreateFunction( "reduce_bbox" );
+        }
+
+        ~PrimitivesVulkanw()
+        {
+            for ( auto& temp : m_temps )
+            {
+                m_device->DeleteBuffer( temp.first );
+            }
+
+            m_executable->DeleteFunction( m_scan_block );
+            m_executable->DeleteFunction( m_add_block_sums );
+            m_executable->DeleteFunction( m_segment_heads );
+            m_executable->DeleteFunction( m_segmented_scan_combine );
+            m_executable->DeleteFunction( m_compact_scatter );
+            m_executable->DeleteFunction( m_radix_histogram );
+            m_executable->DeleteFunction( m_radix_scatter );
+            m_executable->DeleteFunction( m_reduce_min_max );
+            m_executable->DeleteFunction( m_reduce_bbox );
+            m_device->DeleteExecutable( m_executable );
+        }
+
+        void SortRadixInt32( std::uint32_t queueidx, Buffer const* from_key, Buffer* to_key, Buffer const* from_value, Buffer* to_value, std::size_t size ) override
+        {
+            m_queue = queueidx;
+
+            SortRadix( from_key, to_key, from_value, to_value, size, 1 );
+        }
+
+        void SortRadixInt64( std::uint32_t queueidx, Buffer const* from_key, Buffer* to_key, Buffer const* from_value, Buffer* to_value, std::size_t size ) override
+        {
+            m_queue = queueidx;
+
+            SortRadix( from_key, to_key, from_value, to_value, size, 2 );
+        }
+
+        void ScanExclusiveAddInt32( std::uint32_t queueidx, Buffer const* from, Buffer* to, std::size_t size ) override
+        {
+            m_queue = queueidx;
+
+            Scan( from, to, size, kScanOpAdd, 0 );
+        }
+
+        void SegmentedScanExclusiveAddInt32( std::uint32_t queueidx, Buffer const* from, Buffer const* heads, Buffer* to, std::size_t size ) override
+        {
+            m_queue = queueidx;
+
+            if ( size == 0 )
+            {
+                return;
+            }
+
+            // Segmented scan is the difference between the scan of all the elements
+            // and its value at the segment start found with a max scan of head indices
+            Buffer* sums = GetTemp( kTempSegmentSums, size * sizeof( int ) );
+            Buffer* heads_idx = GetTemp( kTempSegmentHeads, size * sizeof( int ) );
+            Buffer* starts = GetTemp( kTempSegmentStarts, size * sizeof( int ) );
+
+            Scan( from, sums, size, kScanOpAdd, 0 );
+
+            std::uint32_t num = static_cast<std::uint32_t>( size );
+            std::uint32_t arg = 0;
+            m_segment_heads->SetArg( arg++, heads );
+            m_segment_heads->SetArg( arg++, heads_idx );
+            m_segment_heads->SetArg( arg++, sizeof( num ), &num );
+            Dispatch( m_segment_heads, NumGroups( size, kGroupSize ) );
+
+            Scan( heads_idx, starts, size, kScanOpMax, 0 );
+
+            arg = 0;
+            m_segmented_scan_combine->SetArg( arg++, heads );
+            m_segmented_scan_combine->SetArg( arg++, sums );
+            m_segmented_scan_combine->SetArg( arg++, starts );
+            m_segmented_scan_combine->SetArg( arg++, to );
+            m_segmented_scan_combine->SetArg( arg++, sizeof( num ), &num );
+            Dispatch( m_segmented_scan_combine, NumGroups( size, kGroupSize ) );
+        }
+
+        void CompactInt32( std::uint32_t queueidx, Buffer const* predicate, Buffer const* from, Buffer* to, std::size_t size, Buffer* new_size ) override
+        {
+            m_queue = queueidx;
+
+            if ( size == 0 )
+            {
+                int zero = 0;
+                m_device->WriteBuffer( new_size, m_queue, 0, sizeof( zero ), &zero, nullptr );
+                return;
+            }
+
+            Buffer* offsets = GetTemp( kTempCompactOffsets, size * sizeof( int ) );
+
+            Scan( predicate, offsets, size, kScanOpCount, 0 );
+
+            std::uint32_t num = static_cast<std::uint32_t>( size );
+            std::uint32_t arg = 0;
+            m_compact_scatter->SetArg( arg++, predicate );
+            m_compact_scatter->SetArg( arg++, from );
+            m_compact_scatter->SetArg( arg++, offsets );
+            m_compact_scatter->SetArg( arg++, to );
+            m_compact_scatter->SetArg( arg++, new_size );
+            m_compact_scatter->SetArg( arg++, sizeof( num ), &num );
+            Dispatch( m_compact_scatter, NumGroups( size, kGroupSize ) );
+        }
+
+        void ReduceMinMaxFloat( std::uint32_t queueidx, Buffer const* from, Buffer* result, std::size_t size ) override
+        {
+            m_queue = queueidx;
+
+            std::size_t num_groups = ReduceGroups( size );
+            Buffer* partial = GetTemp( kTempReducePartials, num_groups * 2 * sizeof( float ) );
+
+            // Per work-group (min, max) pairs, then a single pair out of them
+            ReduceMinMaxPass( from, partial, size, 0, num_groups );
+            ReduceMinMaxPass( partial, result, num_groups, 1, 1 );
+        }
+
+        void ReduceBbox( std::uint32_t queueidx, Buffer const* from, Buffer* result, std::size_t size ) override
+        {
+            m_queue = queueidx;
+
+            std::size_t num_groups = ReduceGroups( size );
+            Buffer* partial = GetTemp( kTempReducePartials, num_groups * 8 * sizeof( float ) );
+
+            ReduceBboxPass( from, partial, size, num_groups );
+            ReduceBboxPass( partial, result, num_groups, 1 );
+        }
+
+    private:
+        enum ScanOp
+        {
+            kScanOpAdd = 0,
+            kScanOpMax = 1,
+            kScanOpCount = 2
+        };
+
+        // Temporary buffers, scan levels go last as their number depends on the size
+        enum TempBuffer
+        {
+            kTempSortKeys = 0,
+            kTempSortValues,
+            kTempHistograms,
+            kTempOffsets,
+            kTempSegmentSums,
+            kTempSegmentHeads,
+            kTempSegmentStarts,
+            kTempCompactOffsets,
+            kTempReducePartials,
+            kTempScanLevels
+        };
+
+        static std::size_t NumGroups( std::size_t size, std::size_t elems_per_group )
+        {
+            return ( size + elems_per_group - 1 ) / elems_per_group;
+        }
+
+        static std::size_t ReduceGroups( std::size_t size )
+        {
+            return std::max<std::size_t>( 1, std::min( NumGroups( size, kGroupSize ), kMaxReduceGroups ) );
+        }
+
+        // Temporary buffers are kept between the calls and only grow
+        Buffer* GetTemp( std::size_t slot, std::size_t size )
+        {
+            if ( slot >= m_temps.size() )
+            {
+                m_temps.resize( slot + 1, std::make_pair( nullptr, 0 ) );
+            }
+
+            auto& temp = m_temps[ slot ];
+
+            if ( temp.second < size )
+            {
+                m_device->DeleteBuffer( temp.first );
+                temp.first = m_device->CreateBuffer( size, BufferType::kWrite );
+                temp.second = size;
+            }
+
+            return temp.first;
+        }
+
+        // Functions are reused with different arguments within a single primitive
+        // while the device updates their descriptors in place, so every dispatch
+        // has to complete before the next one is recorded.
+        void Dispatch( Function* func, std::size_t num_groups )
+        {
+            Event* e = nullptr;
+            m_device->Execute( func, m_queue, num_groups * kGroupSize, kGroupSize, &e );
+            m_device->WaitForEvent( e );
+            m_device->DeleteEvent( e );
+        }
+
+        // Exclusive scan, block totals are scanned recursively
+        void Scan( Buffer const* from, Buffer* to, std::size_t size, std::uint32_t op, std::size_t level )
+        {
+            if ( size == 0 )
+            {
+                return;
+            }
+
+            std::size_t num_blocks = NumGroups( size, kBlockSize );
+            Buffer* block_sums = GetTemp( kTempScanLevels + 2 * level, num_blocks * sizeof( int ) );
+
+            std::uint32_t num = static_cast<std::uint32_t>( size );
+            std::uint32_t arg = 0;
+            m_scan_block->SetArg( arg++, from );
+            m_scan_block->SetArg( arg++, to );
+            m_scan_block->SetArg( arg++, sizeof( num ), &num );
+            m_scan_block->SetArg( arg++, sizeof( op ), &op );
+            m_scan_block->SetArg( arg++, block_sums );
+            Dispatch( m_scan_block, num_blocks );
+
+            if ( num_blocks == 1 )
+            {
+                return;
+            }
+
+            // Totals of counted elements are plain sums
+            std::uint32_t combine_op = op == kScanOpCount ? kScanOpAdd : op;
+
+            Buffer* scanned_sums = GetTemp( kTempScanLevels + 2 * level + 1, num_blocks * sizeof( int ) );
+            Scan( block_sums, scanned_sums, num_blocks, combine_op, level + 1 );
+
+            arg = 0;
+            m_add_block_sums->SetArg( arg++, scanned_sums );
+            m_add_block_sums->SetArg( arg++, to );
+            m_add_block_sums->SetArg( arg++, sizeof( num ), &num );
+            m_add_block_sums->SetArg( arg++, sizeof( combine_op ), &combine_op );
+            Dispatch( m_add_block_sums, num_blocks );
+        }
+
+        // LSD radix sort of keys made of key_words 32-bit words
+        void SortRadix( Buffer const* from_key, Buffer* to_key, Buffer const* from_value, Buffer* to_value, std::size_t size, std::uint32_t key_words )
+        {
+            if ( size == 0 )
+            {
+                return;
+            }
+
+            std::size_t num_blocks = NumGroups( size, kBlockSize );
+            Buffer* histograms = GetTemp( kTempHistograms, kRadix * num_blocks * sizeof( int ) );
+            Buffer* offsets = GetTemp( kTempOffsets, kRadix * num_blocks * sizeof( int ) );
+            Buffer* temp_keys = GetTemp( kTempSortKeys, size * key_words * sizeof( std::uint32_t ) );
+            Buffer* temp_values = GetTemp( kTempSortValues, size * sizeof( int ) );
+
+            // Even number of passes ends in the output buffers
+            std::uint32_t num_passes = key_words * 32 / kRadixBits;
+            std::uint32_t num = static_cast<std::uint32_t>( size );
+
+            Buffer const* src_keys = from_key;
+            Buffer const* src_values = from_value;
+
+            for ( std::uint32_t pass = 0; pass < num_passes; ++pass )
+            {
+                std::uint32_t shift = pass * kRadixBits;
+                Buffer* dst_keys = ( pass & 1 ) ? to_key : temp_keys;
+                Buffer* dst_values = ( pass & 1 ) ? to_value : temp_values;
+
+                std::uint32_t arg = 0;
+                m_radix_histogram->SetArg( arg++, src_keys );
+                m_radix_histogram->SetArg( arg++, histograms );
+                m_radix_histogram->SetArg( arg++, sizeof( num ), &num );
+                m_radix_histogram->SetArg( arg++, sizeof( key_words ), &key_words );
+                m_radix_histogram->SetArg( arg++, sizeof( shift ), &shift );
+                Dispatch( m_radix_histogram, num_blocks );
+
+                Scan( histograms, offsets, kRadix * num_blocks, kScanOpAdd, 0 );
+
+                arg = 0;
+                m_radix_scatter->SetArg( arg++, src_keys );
+                m_radix_scatter->SetArg( arg++, src_values );
+                m_radix_scatter->SetArg( arg++, offsets );
+                m_radix_scatter->SetArg( arg++, dst_keys );
+                m_radix_scatter->SetArg( arg++, dst_values );
+                m_radix_scatter->SetArg( arg++, sizeof( num ), &num );
+                m_radix_scatter->SetArg( arg++, sizeof( key_words ), &key_words );
+                m_radix_scatter->SetArg( arg++, sizeof( shift ), &shift );
+                Dispatch( m_radix_scatter, num_blocks );
+
+                src_keys = dst_keys;
+                src_values = dst_values;
+            }
+        }
+
+        void ReduceMinMaxPass( Buffer const* from, Buffer* to, std::size_t size, std::uint32_t pairs, std::size_t num_groups )
+        {
+            std::uint32_t num = static_cast<std::uint32_t>( size );
+            std::uint32_t arg = 0;
+            m_reduce_min_max->SetArg( arg++, from );
+            m_reduce_min_max->SetArg( arg++, to );
+            m_reduce_min_max->SetArg( arg++, sizeof( num ), &num );
+            m_reduce_min_max->SetArg( arg++, sizeof( pairs ), &pairs );
+            Dispatch( m_reduce_min_max, num_groups );
+        }
+
+        void ReduceBboxPass( Buffer const* from, Buffer* to, std::size_t size, std::size_t num_groups )
+        {
+            std::uint32_t num = static_cast<std::uint32_t>( size );
+            std::uint32_t arg = 0;
+            m_reduce_bbox->SetArg( arg++, from );
+            m_reduce_bbox->SetArg( arg++, to );
+            m_reduce_bbox->SetArg( arg++, sizeof( num ), &num );
+            Dispatch( m_reduce_bbox, num_groups );
+        }
+
+        DeviceVulkanw* m_device;
+        Executable* m_executable;
+        // Queue of the primitive being run
+        std::uint32_t m_queue;
+
+        Function* m_scan_block;
+        Function* m_add_block_sums;
+        Function* m_segment_heads;
+        Function* m_segmented_scan_combine;
+        Function* m_compact_scatter;
+        Function* m_radix_histogram;
+        Function* m_radix_scatter;
+        Function* m_reduce_min_max;
+        Function* m_reduce_bbox;
+
+        // Temporary buffers with their sizes
+        std::vector<std::pair<Buffer*, std::size_t>> m_temps;
+    };
+
     bool DeviceVulkanw::HasBuiltinPrimitives() const
     {
-        VK_EMPTY_IMPLEMENTATION;
-        return false;
+        return true;
     }
 
     Primitives* DeviceVulkanw::CreatePrimitives() const
     {
-        VK_EMPTY_IMPLEMENTATION;
-        return nullptr;
+        return new PrimitivesVulkanw( const_cast<DeviceVulkanw*>( this ) );
     }
 
     void DeviceVulkanw::DeletePrimitives( Primitives* prims )
     {
-        VK_EMPTY_IMPLEMENTATION;
+        delete prims;
     }
 
-    uint64_t DeviceVulkanw::AllocNextFenceId() {
-        // stall if we have run out of fences to use
-        while( m_cpu_fence_id >= m_gpu_known_fence_id + NUM_FENCE_TRACKERS)
+    uint64_t DeviceVulkanw::AllocNextFenceId( Stream& stream ) {
+        // stall if we have run out of fences to use, the fence and the command buffer
+        // of the new id are shared with id - NUM_FENCE_TRACKERS which has to be passed
+        while( stream.cpu_fence_id + 1 >= stream.gpu_known_fence_id + NUM_FENCE_TRACKERS)
         {
-            WaitForFence(m_gpu_known_fence_id+1);
+            WaitForFence( MakeFenceId( stream, stream.gpu_known_fence_id ) );
         }
 
-        return m_cpu_fence_id.fetch_add(1);
+        return stream.cpu_fence_id.fetch_add(1);
     }
 
     void DeviceVulkanw::WaitForFence( uint64_t id ) const
     {
-        AssertEx( id < m_gpu_known_fence_id + NUM_FENCE_TRACKERS,
+        RR_TRACE_SCOPE("DeviceVulkanw::WaitForFence");
+
+        auto& stream = GetFenceStream( id );
+        const uint64_t local_id = GetLocalFenceId( id );
+
+        AssertEx( local_id < stream.gpu_known_fence_id + NUM_FENCE_TRACKERS,
                 "CPU too far ahead of GPU" );
 
-        while(HasFenceBeenPassed(id) == false ) {
-            vkWaitForFences(m_anvil_device->get_device_vk(), 1,
-                            GetFence(m_gpu_known_fence_id)->get_fence_ptr(),
-                            VK_TRUE,
-                            UINT64_MAX);
+        // the batch being recorded has to be submitted before its fence can be waited for
+        if ( stream.is_recording && local_id >= stream.cpu_fence_id )
+        {
+            CommitCommandBuffer( stream, false );
+        }
 
-            // don't known id update until wait has finished
-            m_gpu_known_fence_id++;
+        if ( stream.gpu_known_fence_id > local_id )
+        {
+            return;
         }
+
+        // the fence of the batch is signalled after all the batches submitted to the queue before it,
+        // so a single wait passes all of them
+        vkWaitForFences(m_anvil_device->get_device_vk(), 1,
+                        GetFence(stream, local_id)->get_fence_ptr(),
+                        VK_TRUE,
+                        UINT64_MAX);
+
+        // don't known id update until wait has finished
+        stream.gpu_known_fence_id = local_id + 1;
     }
 
 }
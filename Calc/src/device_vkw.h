@@ -25,9 +25,13 @@ THE SOFTWARE.
 #include "wrappers/command_buffer.h"
 #include "wrappers/device.h"
 #include "wrappers/fence.h"
+#include "kernel_cache.h"
 #include <atomic>
 #include <array>
+#include <deque>
 #include <memory>
+#include <string>
+#include <vector>
 #include <device_vk.h>
 
 
@@ -42,6 +46,19 @@ namespace Calc
     {
     public:
         static const unsigned int NUM_FENCE_TRACKERS = 16;
+        // Dispatches recorded into a command buffer before it is submitted automatically
+        static const std::uint32_t DEFAULT_MAX_BATCH_SIZE = 64;
+        // Buffers from this size on are allocated in device local memory
+        static const std::size_t DEVICE_LOCAL_MIN_SIZE = 64 * 1024;
+        // Host visible memory uploads and readbacks of device local buffers go through
+        static const std::size_t STAGING_RING_SIZE = 16 * 1024 * 1024;
+        static const std::size_t STAGING_ALIGNMENT = 256;
+        // Calc queues are mapped to hardware queues of the family up to this number
+        static const std::uint32_t MAX_NUM_QUEUES = 8;
+        // Descriptor set groups a Function writes its arguments to while previous dispatches are pending
+        static const std::size_t MAX_DESCRIPTOR_SETS = 16;
+        // Fence ids carry the index of their queue in the top bits
+        static const unsigned int FENCE_QUEUE_SHIFT = 56;
 
         DeviceVulkanw( Anvil::Device* inDevice, bool in_use_compute_pipe );
         ~DeviceVulkanw();
@@ -77,10 +94,12 @@ namespace Calc
 
         // Execution
         void Execute( Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event** e ) override;
+        void ExecuteRange( Function const* func, std::uint32_t queue, size_t global_offset, size_t global_size, size_t local_size, Event** e ) override;
 
         // Events handling
         void WaitForEvent( Event* e ) override;
         void WaitForMultipleEvents( Event** e, std::size_t num_events ) override;
+        void JoinEvents( std::uint32_t queue, Event** e, std::size_t num_events, Event** joined ) override;
         void DeleteEvent( Event* e ) override;
 
         // Queue management functions
@@ -95,7 +114,8 @@ namespace Calc
         bool InitializeVulkanResources();
         bool InitializeVulkanCommandBuffer(Anvil::CommandPool* cmd_pool);
         
-        Anvil::PrimaryCommandBuffer* GetCommandBuffer() const { return m_command_buffer.get(); }
+        // Command buffer of the batch being recorded or submitted last on the queue
+        Anvil::PrimaryCommandBuffer* GetCommandBuffer( std::uint32_t queue = 0 ) const;
 
         // Return platform to allow running together with OpenCL
         Platform GetPlatform() const override { return Platform::kVulkan; }
@@ -103,43 +123,125 @@ namespace Calc
         // returns true if the compute pipeline should be used
         bool GetUseComputePipe() const { return m_use_compute_pipe; }
 
-        uint64_t GetFenceId() const { return m_cpu_fence_id; }
+        // Fence of the batch being recorded or submitted last on the queue
+        uint64_t GetFenceId( std::uint32_t queue ) const;
 
-        bool HasFenceBeenPassed(uint64_t id) const { return m_gpu_known_fence_id > id; }
+        bool HasFenceBeenPassed( uint64_t id ) const;
 
+        // Submits the batch first if the fence belongs to it
         void WaitForFence( uint64_t id ) const;
 
+        // Device timestamps in nanoseconds taken at the start and the end of the batch,
+        // false if the batch has not completed or its timestamps have been reused
+        bool GetBatchTimestamps( uint64_t id, uint64_t& start, uint64_t& end ) const;
+
+        void SetMaxBatchSize( std::uint32_t num_dispatches ) override;
+
+        // Loads the pipeline cache saved in the directory, it is written back there on destruction
+        void SetKernelCachePath( char const* path );
+
     private:
         typedef std::unique_ptr<Anvil::PrimaryCommandBuffer, Anvil::CommandBufferDeleter> PrimaryCommandBuffer;
+        typedef std::array<PrimaryCommandBuffer, NUM_FENCE_TRACKERS> CommandBufferArray;
         typedef std::array<std::unique_ptr<Anvil::Fence, Anvil::FenceDeleter>, NUM_FENCE_TRACKERS> FenceArray;
 
-        uint64_t AllocNextFenceId();
+        // Batches of a Calc queue, recorded and fenced independently of the other queues.
+        // Work of other queues a batch depends on is waited for with semaphores on submit.
+        struct Stream
+        {
+            // Index of the stream, the top bits of its fence ids
+            std::uint32_t index;
+            Anvil::Queue* queue;
+
+            // CommandBuffers to record Vulkan commands, one per fence so a batch
+            // can be recorded while the previous ones are executed
+            CommandBufferArray command_buffers;
+            FenceArray fences;
+
+            // Semaphores the batch of each fence waits for, recycled once the fence is passed
+            std::array<std::vector<VkSemaphore>, NUM_FENCE_TRACKERS> wait_semaphores;
+            // Last fence id of each stream the submitted and open batches wait for
+            std::vector<uint64_t> waited_ids;
+
+            // To indicate whether recording is already in progress
+            bool is_recording;
+            // Number of dispatches recorded into the open batch
+            std::uint32_t batch_size;
+
+            std::atomic<uint64_t> cpu_fence_id;
+            mutable std::atomic<uint64_t> gpu_known_fence_id;
+        };
+
+        Stream& GetStream( std::uint32_t queue ) const { return *m_streams[ queue % m_streams.size() ]; }
+        Stream& GetFenceStream( uint64_t id ) const { return *m_streams[ id >> FENCE_QUEUE_SHIFT ]; }
+        static uint64_t GetLocalFenceId( uint64_t id ) { return id & ( ( 1ull << FENCE_QUEUE_SHIFT ) - 1 ); }
+        static uint64_t MakeFenceId( Stream const& stream, uint64_t local_id ) { return ( uint64_t( stream.index ) << FENCE_QUEUE_SHIFT ) | local_id; }
+
+        uint64_t AllocNextFenceId( Stream& stream );
+
+        // Managing CommandBuffer to record Vulkan commands,
+        // dispatches are appended to the open batch until it is committed
+        void StartRecording( Stream& stream );
+        void EndRecording( Stream& stream, Event** out_event );
+        void CommitCommandBuffer( Stream& stream, bool in_wait_till_completed ) const;
+
+        // Advance the passed fence id of the stream over the completed batches without blocking
+        void PollFences( Stream& stream ) const;
+
+        Anvil::Fence* GetFence( Stream const& stream, uint64_t local_id ) const { return stream.fences[ local_id % NUM_FENCE_TRACKERS ].get(); }
+
+        // Make the open batch of the stream wait for the submitted work of another stream up to the fence
+        void AddStreamDependency( Stream& stream, uint64_t id ) const;
+        // Order the access of the buffer by the open batch after other streams still using it
+        void AcquireBuffer( Stream& stream, BufferVulkan* buffer ) const;
 
-        // Managing CommandBuffer to record Vulkan commands
-        void StartRecording();
-        void EndRecording( bool in_wait_till_completed, Event** out_event );
-        void CommitCommandBuffer( bool in_wait_till_completed );
+        // Staging ring management, a region can be reused once the fence of its copy has been passed
+        std::size_t AllocStagingRegion( std::size_t size );
+        void CopyFromStaging( Stream& stream, BufferVulkan* buffer, std::size_t offset, std::size_t size, void const* src );
+        void CopyToStaging( Stream& stream, BufferVulkan* buffer, std::size_t offset, std::size_t size, void* dst );
 
-        Anvil::Fence* GetFence( uint64_t id ) const { return m_anvil_fences[id%NUM_FENCE_TRACKERS].get(); }
+        // Barrier before a copy to or from the buffer against previous dispatches and copies
+        void RecordTransferBarrier( Stream& stream, BufferVulkan* buffer, bool is_write ) const;
 
-        Anvil::Queue* GetQueue() const;
+        KernelCache::Key GetPipelineCacheKey() const;
+        void SavePipelineCache() const;
 
         // Anvil device
         Anvil::Device* m_anvil_device;
 
-        // Main CommandBuffer to record Vulkan commands
-        PrimaryCommandBuffer m_command_buffer;
+        // One stream per hardware queue of the family
+        std::vector<std::unique_ptr<Stream>> m_streams;
 
-        // To indicate whether recording is already in progress
-        bool m_is_command_buffer_recording;
+        // Dispatches recorded into a batch before it is submitted automatically
+        std::uint32_t m_max_batch_size;
 
         // Whether to use compute pipe
         bool m_use_compute_pipe;
 
-        // Fences for synchronization
-        FenceArray    m_anvil_fences;
-        std::atomic<uint64_t> m_cpu_fence_id;
-        mutable std::atomic<uint64_t> m_gpu_known_fence_id;
+        // Timestamps at the start and the end of each batch, two per fence of each stream,
+        // VK_NULL_HANDLE if the queue doesn't support them
+        VkQueryPool m_timestamp_pool;
+        // Nanoseconds per timestamp tick
+        double m_timestamp_period;
+
+        // Semaphores no batch waits for anymore
+        mutable std::vector<VkSemaphore> m_free_semaphores;
+
+        // Region of the staging ring used by a submitted or recording copy
+        struct StagingRegion
+        {
+            std::size_t begin;
+            std::size_t end;
+            uint64_t fence_id;
+        };
+
+        // Host visible ring buffer allocated on first use, regions are in allocation order
+        Anvil::Buffer* m_staging_buffer;
+        std::deque<StagingRegion> m_staging_regions;
+        std::size_t m_staging_head;
+
+        // Directory the pipeline cache is persisted in, empty to disable
+        std::string m_kernel_cache_path;
 
     };
 
@@ -31,10 +31,11 @@ namespace Calc {
     class EventVulkan : public Event
     {
     public:
-        EventVulkan( const DeviceVulkanw* in_device ) :
+        // Completes with the batch of the fence, ids are taken from DeviceVulkanw::GetFenceId of the queue
+        EventVulkan( const DeviceVulkanw* in_device, uint64_t in_fence_id ) :
                 m_device( in_device )
         {
-            m_event_fence = m_device->GetFenceId();
+            m_event_fence = in_fence_id;
         }
 
         virtual ~EventVulkan()
@@ -53,6 +54,15 @@ namespace Calc {
             Assert( nullptr != m_device );
             return m_device->HasFenceBeenPassed(m_event_fence);
         }
+
+        // Commands are timed per batch, so the timing covers the whole batch the command is in
+        bool GetProfilingInfo( std::uint64_t& start, std::uint64_t& end ) const override
+        {
+            Assert( nullptr != m_device );
+            return m_device->GetBatchTimestamps(m_event_fence, start, end);
+        }
+        uint64_t GetFenceId() const { return m_event_fence; }
+
     private:
         const DeviceVulkanw* m_device;
         std::atomic<uint64_t>           m_event_fence;
@@ -24,6 +24,10 @@ THE SOFTWARE.
 //#define DUMP_SPIRV_BLOB
 
 #include "function_vk.h"
+#include "spirv_vk.h"
+#include "except_vk.h"
+#include <map>
+#include <vector>
 namespace Calc {
 
 
@@ -48,6 +52,19 @@ namespace Calc {
                                                      in_source_code_size);
         }
 
+        // precompiled SPIR-V of all functions, see ParseSpirvExecutable
+        ExecutableVulkan(Anvil::Device *in_device, std::uint8_t const *in_binary,
+                         size_t in_binary_size, bool in_use_compute_pipe)
+                : Executable(), m_device(in_device),
+                  m_file_name_or_source_code(), m_source_mode(
+                        Anvil::GLSLShaderToSPIRVGenerator::MODE_USE_SPECIFIED_SOURCE),
+                  m_binary(in_binary, in_binary + in_binary_size),
+                  m_use_compute_pipe(in_use_compute_pipe) {
+            if (!ParseSpirvExecutable(in_binary, in_binary_size, m_spirv)) {
+                throw ExceptionVk("Invalid SPIR-V executable binary");
+            }
+        }
+
         virtual ~ExecutableVulkan() { }
 
         // adds a defination to all future CreateFunction calls, replaces if
@@ -70,6 +87,10 @@ namespace Calc {
         // useful whilst developing, not currently used
         Function *CreateFunction(char const *name, const std::map<const std::string, const std::string>& defines ) {
 
+            if (!m_binary.empty()) {
+                return CreateFunctionFromBinary(name);
+            }
+
             Anvil::GLSLShaderToSPIRVGenerator toSPIRVConverter(    m_device->get_physical_device(),
                                                                 m_source_mode,
                                                                 m_file_name_or_source_code,
@@ -105,24 +126,65 @@ namespace Calc {
             Anvil::ShaderModuleStageEntryPoint functionEntryPoint = Anvil::ShaderModuleStageEntryPoint(
                     "main", shaderModule, Anvil::SHADER_STAGE_COMPUTE);
 
-            return new FunctionVulkan(m_device, functionEntryPoint,
-                                      shaderModule, m_use_compute_pipe
+            FunctionVulkan *function = new FunctionVulkan(m_device, functionEntryPoint,
+                                                          shaderModule, m_use_compute_pipe
 #if _DEBUG
                     , m_file_name_or_source_code
 #endif
             );
+
+            // find out buffers the shader doesn't write to avoid barriers on them
+            auto blob = static_cast<const void *>(toSPIRVConverter.get_spirv_blob());
+            function->SetReadOnlyBindings(GetReadOnlyBindings(static_cast<const std::uint32_t *>(blob),
+                                                              toSPIRVConverter.get_spirv_blob_size() / sizeof(std::uint32_t)));
+
+            return function;
         }
 
         void DeleteFunction(Function *func) {
             delete func;
         }
 
+        // empty unless created from a binary
+        std::vector<std::uint8_t> const &GetBinary() const { return m_binary; }
+
     private:
+        // definitions can't be applied to precompiled functions,
+        // they are built with the same defines as the runtime path uses by default
+        Function *CreateFunctionFromBinary(char const *name) {
+            auto spirv = m_spirv.find(name);
+            if (spirv == m_spirv.end() || spirv->second.empty()) {
+                throw ExceptionVk(std::string("Function not found in SPIR-V executable: ") + name);
+            }
+
+            auto const &words = spirv->second;
+            Anvil::ShaderModule *shaderModule = new Anvil::ShaderModule(
+                    m_device, reinterpret_cast<const char *>(words.data()),
+                    static_cast<uint32_t>(words.size() * sizeof(std::uint32_t)),
+                    "main", nullptr, nullptr, nullptr, nullptr, nullptr);
+
+            Anvil::ShaderModuleStageEntryPoint functionEntryPoint = Anvil::ShaderModuleStageEntryPoint(
+                    "main", shaderModule, Anvil::SHADER_STAGE_COMPUTE);
+
+            FunctionVulkan *function = new FunctionVulkan(m_device, functionEntryPoint,
+                                                          shaderModule, m_use_compute_pipe
+#if _DEBUG
+                    , name
+#endif
+            );
+
+            function->SetReadOnlyBindings(GetReadOnlyBindings(words.data(), words.size()));
+
+            return function;
+        }
+
         Anvil::Device *m_device;
         std::string m_file_name_or_source_code;
         Anvil::GLSLShaderToSPIRVGenerator::Mode m_source_mode;
         typedef std::map<std::string, std::string> define_table;
         define_table m_defines;
+        std::vector<std::uint8_t> m_binary;
+        std::map<std::string, std::vector<std::uint32_t>> m_spirv;
         bool m_use_compute_pipe;
     };
 }
\ No newline at end of file
@@ -37,8 +37,8 @@ namespace Calc {
                 : Function(), m_anvil_device(in_anvil_device),
                   m_function_entry_point(in_function_entry_point),
                   m_shader_module(in_shader_module), m_parameters(),
-                  m_descriptor_set_group(nullptr), m_pipeline_id(~0u),
-                  m_use_compute_pipe(in_use_compute_pipe)
+                  m_pipeline_id(~0u),
+                  m_use_compute_pipe(in_use_compute_pipe), m_next_descriptor_set(0)
 #if _DEBUG
         , FileName( in_file_name )
 #endif
@@ -59,11 +59,11 @@ namespace Calc {
                 m_pipeline_id = ~0u;
             }
 
-            // release a descriptor set group
-            if (nullptr != m_descriptor_set_group) {
-                m_descriptor_set_group->release();
-                m_descriptor_set_group = nullptr;
+            // release descriptor set groups
+            for (auto& descriptor_set : m_descriptor_sets) {
+                descriptor_set.group->release();
             }
+            m_descriptor_sets.clear();
 
             // release spirv shader module
             m_shader_module->release();
@@ -144,32 +144,49 @@ namespace Calc {
 
         const std::vector<Buffer const *> &GetParameters() const { return m_parameters; }
 
-        Anvil::DescriptorSetGroup *GetDescriptorSetGroup() const { return m_descriptor_set_group; }
+        // Descriptor set group with the fence of the last submit using it,
+        // its bindings can be rewritten once the fence is passed
+        struct DescriptorSet {
+            Anvil::DescriptorSetGroup *group;
+            uint64_t fence_id;
+        };
 
-        void SetDescriptorSetGroup(
-                Anvil::DescriptorSetGroup *in_new_descriptor_set_group) {
-            m_descriptor_set_group = in_new_descriptor_set_group;
-        }
+        std::vector<DescriptorSet> &GetDescriptorSets() { return m_descriptor_sets; }
+
+        // Round robin index of the set to wait for when all of them are in use
+        std::size_t GetNextDescriptorSet() { return m_next_descriptor_set++ % m_descriptor_sets.size(); }
 
         Anvil::ComputePipelineID GetPipelineID() const { return m_pipeline_id; }
 
         void SetPipelineID(
                 Anvil::ComputePipelineID in_new_pipeline_id) { m_pipeline_id = in_new_pipeline_id; }
 
+        // whether the shader never writes the buffer bound at idx
+        bool IsReadOnly(std::uint32_t idx) const {
+            return idx < m_read_only.size() && m_read_only[idx];
+        }
+
+        void SetReadOnlyBindings(const std::vector<bool> &in_read_only) { m_read_only = in_read_only; }
+
     private:
         Anvil::Device *m_anvil_device;
         Anvil::ShaderModuleStageEntryPoint m_function_entry_point;
         Anvil::ShaderModule *m_shader_module;
         std::vector<Buffer const *> m_parameters;
 
-        // descriptor set group used by this function
-        Anvil::DescriptorSetGroup *m_descriptor_set_group;
+        // descriptor set groups used by this function, dispatches with different
+        // arguments use different groups while the previous ones are pending
+        std::vector<DescriptorSet> m_descriptor_sets;
+        std::size_t m_next_descriptor_set;
 
         // Vulkan pipeline attached with the descriptor set group and shader module defined above
         Anvil::ComputePipelineID m_pipeline_id;
 
         // Whether Vulkan implementation should use Compute pipe or Graphics pipe to dispatch this Function's shader
         bool m_use_compute_pipe;
+
+        // Per binding flag telling the buffer is only read, used to skip barriers
+        std::vector<bool> m_read_only;
 #if _DEBUG
         std::string FileName;
 #endif
@@ -0,0 +1,162 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "kernel_cache.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+namespace Calc
+{
+    namespace
+    {
+        // File header, entry is discarded if any of the fields does not match
+        struct Header
+        {
+            std::uint32_t magic;
+            std::uint32_t version;
+            std::uint64_t key;
+            std::uint64_t size;
+        };
+
+        std::uint32_t const kMagic = 0x434b5252; // "RRKC"
+        // Bump this when the file layout changes
+        std::uint32_t const kVersion = 1;
+    }
+
+    KernelCache::Key::Key()
+        : m_hash(14695981039346656037ull)
+    {
+        Add(&kVersion, sizeof(kVersion));
+    }
+
+    void KernelCache::Key::Add(void const* data, std::size_t size)
+    {
+        auto bytes = static_cast<unsigned char const*>(data);
+
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            m_hash ^= bytes[i];
+            m_hash *= 1099511628211ull;
+        }
+    }
+
+    void KernelCache::Key::Add(std::string const& value)
+    {
+        std::uint64_t const size = value.size();
+        Add(&size, sizeof(size));
+        Add(value.data(), value.size());
+    }
+
+    KernelCache::KernelCache(std::string const& path)
+        : m_path(path)
+    {
+    }
+
+    std::string KernelCache::GetFileName(std::uint64_t key) const
+    {
+        std::ostringstream name;
+        name << m_path;
+
+        if (!m_path.empty() && m_path.back() != '/' && m_path.back() != '\\')
+        {
+            name << '/';
+        }
+
+        name << std::hex << std::setw(16) << std::setfill('0') << key << ".rrkernel";
+        return name.str();
+    }
+
+    bool KernelCache::Load(std::uint64_t key, std::vector<std::uint8_t>& binary) const
+    {
+        std::ifstream in(GetFileName(key), std::ios::binary);
+
+        if (!in)
+        {
+            return false;
+        }
+
+        Header header;
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+            header.magic != kMagic ||
+            header.version != kVersion ||
+            header.key != key ||
+            header.size == 0)
+        {
+            return false;
+        }
+
+        binary.resize(static_cast<std::size_t>(header.size));
+
+        if (!in.read(reinterpret_cast<char*>(&binary[0]), binary.size()))
+        {
+            binary.clear();
+            return false;
+        }
+
+        return true;
+    }
+
+    void KernelCache::Save(std::uint64_t key, std::vector<std::uint8_t> const& binary) const
+    {
+        if (binary.empty())
+        {
+            return;
+        }
+
+        auto filename = GetFileName(key);
+
+        // Write into a temporary file first, so concurrent readers
+        // never see partially written entries
+        std::ostringstream tmpname;
+        tmpname << filename << '.' << std::hex << std::chrono::steady_clock::now().time_since_epoch().count();
+
+        {
+            std::ofstream out(tmpname.str(), std::ios::binary | std::ios::trunc);
+
+            if (!out)
+            {
+                return;
+            }
+
+            Header header = { kMagic, kVersion, key, binary.size() };
+            out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+            out.write(reinterpret_cast<char const*>(&binary[0]), binary.size());
+
+            if (!out)
+            {
+                out.close();
+                std::remove(tmpname.str().c_str());
+                return;
+            }
+        }
+
+        // Rename fails on some platforms if the file exists,
+        // in this case the other process has already stored the same entry
+        if (std::rename(tmpname.str().c_str(), filename.c_str()) != 0)
+        {
+            std::remove(tmpname.str().c_str());
+        }
+    }
+}
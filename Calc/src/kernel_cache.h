@@ -0,0 +1,67 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Calc
+{
+    // On-disk cache of compiled device programs.
+    // Entries are keyed by a hash of everything affecting the compiled code:
+    // program sources, build options and the device and driver identifiers,
+    // so a process starting with the same kernels can skip their compilation.
+    class KernelCache
+    {
+    public:
+        // Incremental 64-bit FNV-1a hash used to build the keys
+        class Key
+        {
+        public:
+            Key();
+
+            void Add(void const* data, std::size_t size);
+            void Add(std::string const& value);
+
+            std::uint64_t Get() const { return m_hash; }
+
+        private:
+            std::uint64_t m_hash;
+        };
+
+        // Cache files are stored in the directory specified
+        explicit KernelCache(std::string const& path);
+
+        // Load the binary, returns false if there is no valid entry for the key
+        bool Load(std::uint64_t key, std::vector<std::uint8_t>& binary) const;
+        // Save the binary, failures are silently ignored as the cache is optional
+        void Save(std::uint64_t key, std::vector<std::uint8_t> const& binary) const;
+
+    private:
+        // Full path of the entry file
+        std::string GetFileName(std::uint64_t key) const;
+
+        // Cache directory
+        std::string m_path;
+    };
+}
@@ -0,0 +1,178 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace Calc {
+
+    // Minimal SPIR-V reflection used to find out how shaders access their buffers.
+    // Returns for every binding of descriptor set 0 whether the buffer bound is
+    // never written by the shader (declared readonly in GLSL). Bindings which
+    // can't be resolved are reported as written to stay on the safe side.
+    inline std::vector<bool> GetReadOnlyBindings(std::uint32_t const* words, std::size_t num_words) {
+        static const std::uint32_t kMagicNumber = 0x07230203;
+        static const std::uint32_t kHeaderSize = 5;
+
+        static const std::uint32_t kOpTypeStruct = 30;
+        static const std::uint32_t kOpTypePointer = 32;
+        static const std::uint32_t kOpVariable = 59;
+        static const std::uint32_t kOpDecorate = 71;
+        static const std::uint32_t kOpMemberDecorate = 72;
+
+        static const std::uint32_t kDecorationNonWritable = 24;
+        static const std::uint32_t kDecorationBinding = 33;
+
+        std::vector<bool> read_only;
+
+        if (nullptr == words || num_words < kHeaderSize || words[0] != kMagicNumber) {
+            return read_only;
+        }
+
+        std::map<std::uint32_t, std::uint32_t> bindings;
+        std::set<std::uint32_t> non_writable;
+        std::map<std::uint32_t, std::set<std::uint32_t>> non_writable_members;
+        std::map<std::uint32_t, std::uint32_t> num_members;
+        std::map<std::uint32_t, std::uint32_t> pointee_types;
+        std::map<std::uint32_t, std::uint32_t> variable_types;
+
+        for (std::size_t i = kHeaderSize; i < num_words;) {
+            std::uint32_t const opcode = words[i] & 0xffff;
+            std::uint32_t const count = words[i] >> 16;
+
+            if (0 == count || i + count > num_words) {
+                break;
+            }
+
+            std::uint32_t const* operands = &words[i + 1];
+
+            if (kOpDecorate == opcode && count >= 3) {
+                if (kDecorationBinding == operands[1] && count >= 4) {
+                    bindings[operands[0]] = operands[2];
+                }
+                else if (kDecorationNonWritable == operands[1]) {
+                    non_writable.insert(operands[0]);
+                }
+            }
+            else if (kOpMemberDecorate == opcode && count >= 4 && kDecorationNonWritable == operands[2]) {
+                non_writable_members[operands[0]].insert(operands[1]);
+            }
+            else if (kOpTypeStruct == opcode && count >= 2) {
+                num_members[operands[0]] = count - 2;
+            }
+            else if (kOpTypePointer == opcode && count >= 4) {
+                pointee_types[operands[0]] = operands[2];
+            }
+            else if (kOpVariable == opcode && count >= 4) {
+                variable_types[operands[1]] = operands[0];
+            }
+
+            i += count;
+        }
+
+        for (auto &&binding : bindings) {
+            std::uint32_t const variable = binding.first;
+            std::uint32_t const index = binding.second;
+
+            bool is_read_only = non_writable.count(variable) > 0;
+
+            // GLSL readonly blocks are decorated member by member
+            auto variable_type = variable_types.find(variable);
+            if (!is_read_only && variable_type != variable_types.end()) {
+                auto pointee = pointee_types.find(variable_type->second);
+                if (pointee != pointee_types.end()) {
+                    auto members = num_members.find(pointee->second);
+                    auto decorated = non_writable_members.find(pointee->second);
+                    is_read_only = members != num_members.end() && decorated != non_writable_members.end() &&
+                                   members->second > 0 && decorated->second.size() == members->second;
+                }
+            }
+
+            if (index >= read_only.size()) {
+                read_only.resize(index + 1, false);
+            }
+
+            read_only[index] = is_read_only;
+        }
+
+        return read_only;
+    }
+
+    // Executable binaries hold SPIR-V of every function of a GLSL file, they are
+    // generated at build time by Tools/scripts/spirvify.py. All fields are 32-bit
+    // little endian: magic, version, number of functions, then for each function
+    // name length, name padded to 4 bytes, number of words and the SPIR-V words
+    static const std::uint32_t kSpirvExecutableMagic = 0x56535252; // "RRSV"
+    static const std::uint32_t kSpirvExecutableVersion = 1;
+
+    // Split the binary into functions, returns false if it is malformed
+    inline bool ParseSpirvExecutable(std::uint8_t const* data, std::size_t size,
+                                     std::map<std::string, std::vector<std::uint32_t>>& functions) {
+        std::size_t offset = 0;
+
+        auto read_word = [&](std::uint32_t& value) {
+            if (offset + sizeof(value) > size) {
+                return false;
+            }
+
+            std::memcpy(&value, data + offset, sizeof(value));
+            offset += sizeof(value);
+            return true;
+        };
+
+        std::uint32_t magic = 0, version = 0, num_functions = 0;
+        if (nullptr == data || !read_word(magic) || !read_word(version) || !read_word(num_functions) ||
+            magic != kSpirvExecutableMagic || version != kSpirvExecutableVersion) {
+            return false;
+        }
+
+        for (std::uint32_t i = 0; i < num_functions; ++i) {
+            std::uint32_t name_size = 0;
+            if (!read_word(name_size) || name_size > size - offset) {
+                return false;
+            }
+
+            std::string name(reinterpret_cast<char const*>(data + offset), name_size);
+            offset += (name_size + 3) & ~3u;
+
+            std::uint32_t num_words = 0;
+            if (!read_word(num_words) || offset > size || num_words > (size - offset) / sizeof(std::uint32_t)) {
+                return false;
+            }
+
+            std::vector<std::uint32_t> words(num_words);
+            if (num_words > 0) {
+                std::memcpy(&words[0], data + offset, num_words * sizeof(std::uint32_t));
+            }
+            offset += num_words * sizeof(std::uint32_t);
+
+            functions[name] = std::move(words);
+        }
+
+        return true;
+    }
+}
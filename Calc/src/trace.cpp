@@ -0,0 +1,127 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "trace.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace Calc
+{
+    namespace
+    {
+        // Events are dropped past this count to keep a forgotten trace from eating the memory
+        std::size_t const kMaxEvents = 1 << 22;
+
+        struct TraceEvent
+        {
+            char const* name;
+            std::uint64_t start;
+            std::uint64_t end;
+            int tid;
+        };
+
+        struct TraceData
+        {
+            TraceData()
+                : start(std::chrono::steady_clock::now())
+            {
+            }
+
+            // Recorded events are saved on exit
+            ~TraceData()
+            {
+#ifdef RR_ENABLE_TRACE
+                auto path = std::getenv("RR_TRACE_FILE");
+                Write(path ? path : "radeonrays_trace.json");
+#endif
+            }
+
+            bool Write(char const* path)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+
+                auto file = std::fopen(path, "w");
+                if (!file)
+                {
+                    return false;
+                }
+
+                std::fprintf(file, "{\"traceEvents\":[\n");
+
+                for (auto i = 0U; i < events.size(); ++i)
+                {
+                    auto const& e = events[i];
+                    // Names are string literals, so they need no escaping
+                    std::fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%llu,\"dur\":%llu}%s\n",
+                        e.name, e.tid, (unsigned long long)e.start, (unsigned long long)(e.end - e.start),
+                        i + 1 < events.size() ? "," : "");
+                }
+
+                std::fprintf(file, "],\"displayTimeUnit\":\"ms\"}\n");
+
+                return std::fclose(file) == 0;
+            }
+
+            std::chrono::steady_clock::time_point start;
+            std::vector<TraceEvent> events;
+            // Small thread ids are easier to read on the timeline
+            std::unordered_map<std::thread::id, int> thread_ids;
+            std::mutex mutex;
+        };
+
+        TraceData& GetTraceData()
+        {
+            static TraceData data;
+            return data;
+        }
+    }
+
+    std::uint64_t Trace::Now()
+    {
+        auto& data = GetTraceData();
+        return (std::uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - data.start).count();
+    }
+
+    void Trace::AddEvent(char const* name, std::uint64_t start, std::uint64_t end)
+    {
+        auto& data = GetTraceData();
+        std::lock_guard<std::mutex> lock(data.mutex);
+
+        if (data.events.size() >= kMaxEvents)
+        {
+            return;
+        }
+
+        auto tid = data.thread_ids.emplace(std::this_thread::get_id(), (int)data.thread_ids.size()).first->second;
+        data.events.push_back({ name, start, end, tid });
+    }
+
+    bool Trace::Save(char const* path)
+    {
+        return GetTraceData().Write(path);
+    }
+}
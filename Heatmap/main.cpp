@@ -0,0 +1,480 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+
+// BVH cost heatmap: commits a scene with the chosen intersector, traces a grid of camera
+// rays with traversal statistics enabled and writes an image of a per-pixel counter
+// along with a per-mesh cost breakdown, to find geometry the trees handle badly,
+// e.g. huge thin triangles or stacked coplanar duplicates, before it goes to production.
+//
+// Usage: Heatmap -scene file.obj [-intersector bvh|fatbvh|fatbvh_q|hlbvh|bvh4|hashbvh|bvh2l] [-width n] [-height n]
+//                [-view x|y|z] [-counter nodes|primitives|spills|iterations] [-device idx]
+//                [-output heatmap.ppm] [-report costs.csv]
+//
+// The camera looks along the view axis at the scene bounds from their negative side.
+// Pixels are scaled by the largest count in the image, black to red, missed rays count too,
+// since they traverse the top of the tree. Per-mesh costs sum the counters of the rays
+// ending on the mesh, the overlap column is the summed surface area of the triangle bounds
+// relative to the mesh bounds, meshes the tree can't separate have large values.
+// Traversal statistics are written by the OpenCL kernels only.
+
+#include "radeon_rays.h"
+#include "../Tutorials/Tools/tiny_obj_loader.h"
+#include "../Tutorials/Tools/parallel_obj_loader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+using namespace RadeonRays;
+using namespace tinyobj;
+
+namespace
+{
+    struct Options
+    {
+        std::string scene;
+        std::string intersector = "bvh";
+        int width = 512;
+        int height = 512;
+        // Axis the camera looks along
+        int view = 2;
+        TraversalCounter counter = kTraversalNodes;
+        int device = 0;
+        std::string output = "heatmap.ppm";
+        std::string report = "costs.csv";
+    };
+
+    // Intersectors and options selecting them
+    struct IntersectorConfig
+    {
+        char const* name;
+        char const* acc_type;
+        bool force2level;
+    };
+
+    IntersectorConfig const kIntersectors[] =
+    {
+        { "bvh", "bvh", false },
+        { "fatbvh", "fatbvh", false },
+        { "hlbvh", "hlbvh", false },
+        { "fatbvh_q", "fatbvh_q", false },
+        { "bvh4", "bvh4", false },
+        { "hashbvh", "hashbvh", false },
+        { "bvh2l", "bvh", true },
+        { "fatbvh2l", "fatbvh2l", true }
+    };
+
+    char const* const kCounterNames[] = { "nodes", "primitives", "spills", "iterations" };
+
+    // Cost of the rays ending on a mesh
+    struct MeshCost
+    {
+        std::string name;
+        int num_triangles;
+        // Summed surface area of triangle bounds relative to the mesh bounds
+        float overlap;
+        int num_rays;
+        long long cost;
+    };
+
+    bool ParseOptions(int argc, char** argv, Options& options)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+
+            if (i + 1 == argc)
+            {
+                std::cerr << "Missing value of " << arg << "\n";
+                return false;
+            }
+
+            std::string value = argv[++i];
+
+            if (arg == "-scene")
+                options.scene = value;
+            else if (arg == "-intersector")
+                options.intersector = value;
+            else if (arg == "-width")
+                options.width = std::max(1, std::atoi(value.c_str()));
+            else if (arg == "-height")
+                options.height = std::max(1, std::atoi(value.c_str()));
+            else if (arg == "-device")
+                options.device = std::atoi(value.c_str());
+            else if (arg == "-output")
+                options.output = value;
+            else if (arg == "-report")
+                options.report = value;
+            else if (arg == "-view")
+            {
+                if (value != "x" && value != "y" && value != "z")
+                {
+                    std::cerr << "Unknown view axis " << value << "\n";
+                    return false;
+                }
+
+                options.view = value[0] - 'x';
+            }
+            else if (arg == "-counter")
+            {
+                auto name = std::find(std::begin(kCounterNames), std::end(kCounterNames), value);
+                if (name == std::end(kCounterNames))
+                {
+                    std::cerr << "Unknown counter " << value << "\n";
+                    return false;
+                }
+
+                options.counter = (TraversalCounter)(name - std::begin(kCounterNames));
+            }
+            else
+            {
+                std::cerr << "Unknown option " << arg << "\n";
+                return false;
+            }
+        }
+
+        if (options.scene.empty())
+        {
+            std::cerr << "Usage: Heatmap -scene file.obj [-intersector name] [-width n] [-height n] [-view x|y|z]\n"
+                << "               [-counter nodes|primitives|spills|iterations] [-device idx] [-output file.ppm] [-report file.csv]\n";
+            return false;
+        }
+
+        return true;
+    }
+
+    float SurfaceArea(float3 const& pmin, float3 const& pmax)
+    {
+        float3 const e = pmax - pmin;
+        return 2.f * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+
+    float GetAxis(float3 const& v, int axis)
+    {
+        return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+    }
+
+    void SetAxis(float3& v, int axis, float value)
+    {
+        (axis == 0 ? v.x : (axis == 1 ? v.y : v.z)) = value;
+    }
+
+    // Summed surface area of the triangle bounds relative to the bounds of the mesh
+    float ComputeOverlap(mesh_t const& mesh)
+    {
+        auto const& p = mesh.positions;
+        float3 mmin(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+        float3 mmax = -mmin;
+        float area = 0.f;
+
+        for (std::size_t i = 0; i + 2 < mesh.indices.size(); i += 3)
+        {
+            float3 tmin(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+            float3 tmax = -tmin;
+
+            for (int j = 0; j < 3; ++j)
+            {
+                int const idx = 3 * mesh.indices[i + j];
+                float3 v(p[idx], p[idx + 1], p[idx + 2]);
+                tmin = vmin(tmin, v);
+                tmax = vmax(tmax, v);
+            }
+
+            area += SurfaceArea(tmin, tmax);
+            mmin = vmin(mmin, tmin);
+            mmax = vmax(mmax, tmax);
+        }
+
+        float const mesharea = SurfaceArea(mmin, mmax);
+        return mesharea > 0.f ? area / mesharea : 0.f;
+    }
+
+    // Orthographic grid of rays along the view axis covering the other two extents of the bounds
+    void GenerateRays(Options const& options, float3 const& pmin, float3 const& pmax, std::vector<ray>& rays)
+    {
+        int const u_axis = (options.view + 1) % 3;
+        int const v_axis = (options.view + 2) % 3;
+        float3 const extents = pmax - pmin;
+
+        float3 dir;
+        SetAxis(dir, options.view, 1.f);
+
+        float const start = GetAxis(pmin, options.view) - 0.01f * GetAxis(extents, options.view) - 1e-3f;
+
+        rays.resize(options.width * options.height);
+        for (int y = 0; y < options.height; ++y)
+        {
+            for (int x = 0; x < options.width; ++x)
+            {
+                float3 o;
+                SetAxis(o, options.view, start);
+                SetAxis(o, u_axis, GetAxis(pmin, u_axis) + (x + 0.5f) / options.width * GetAxis(extents, u_axis));
+                // Rows go top down in the image
+                SetAxis(o, v_axis, GetAxis(pmax, v_axis) - (y + 0.5f) / options.height * GetAxis(extents, v_axis));
+                rays[y * options.width + x] = ray(o, dir);
+            }
+        }
+    }
+
+    int GetCounter(TraversalStats const& stats, TraversalCounter counter)
+    {
+        switch (counter)
+        {
+        case kTraversalNodes: return stats.nodes;
+        case kTraversalPrimitives: return stats.primitives;
+        case kTraversalSpills: return stats.spills;
+        default: return stats.iterations;
+        }
+    }
+
+    // Black to blue to green to yellow to red
+    void HeatColor(float t, unsigned char* rgb)
+    {
+        float const stops[5][3] = { { 0.f, 0.f, 0.f }, { 0.f, 0.f, 1.f }, { 0.f, 1.f, 0.f }, { 1.f, 1.f, 0.f }, { 1.f, 0.f, 0.f } };
+
+        float const s = std::min(std::max(t, 0.f), 1.f) * 4.f;
+        int const i = std::min((int)s, 3);
+        float const f = s - i;
+
+        for (int c = 0; c < 3; ++c)
+        {
+            rgb[c] = (unsigned char)(255.f * (stops[i][c] + f * (stops[i + 1][c] - stops[i][c])) + 0.5f);
+        }
+    }
+
+    bool WriteImage(Options const& options, std::vector<TraversalStats> const& stats, int maxcount)
+    {
+        std::ofstream out(options.output, std::ios::binary);
+        out << "P6\n" << options.width << " " << options.height << "\n255\n";
+
+        for (auto const& s : stats)
+        {
+            unsigned char rgb[3];
+            HeatColor(maxcount > 0 ? (float)GetCounter(s, options.counter) / maxcount : 0.f, rgb);
+            out.write((char const*)rgb, 3);
+        }
+
+        return (bool)out;
+    }
+
+    bool WriteReport(Options const& options, std::vector<MeshCost> const& costs, long long total)
+    {
+        std::ofstream out(options.report);
+        out << "mesh,triangles,overlap,rays," << kCounterNames[options.counter] << ",avg_per_ray,share\n";
+
+        for (auto const& c : costs)
+        {
+            out << "\"" << c.name << "\"," << c.num_triangles << "," << c.overlap << "," << c.num_rays << "," << c.cost << ","
+                << (c.num_rays ? (float)c.cost / c.num_rays : 0.f) << "," << (total ? (float)c.cost / total : 0.f) << "\n";
+        }
+
+        return (bool)out;
+    }
+
+    void Wait(IntersectionApi* api, Event* e)
+    {
+        e->Wait();
+        api->DeleteEvent(e);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        return EXIT_FAILURE;
+    }
+
+    auto config = std::find_if(std::begin(kIntersectors), std::end(kIntersectors),
+        [&options](IntersectorConfig const& c) { return options.intersector == c.name; });
+    if (config == std::end(kIntersectors))
+    {
+        std::cerr << "Unknown intersector " << options.intersector << "\n";
+        return EXIT_FAILURE;
+    }
+
+    std::vector<shape_t> objshapes;
+    std::vector<material_t> objmaterials;
+    std::string basepath = options.scene.substr(0, options.scene.find_last_of("/\\") + 1);
+    std::string res = LoadObjParallel(objshapes, objmaterials, options.scene.c_str(), basepath.c_str());
+    if (!res.empty())
+    {
+        std::cerr << res << "\n";
+        return EXIT_FAILURE;
+    }
+
+    IntersectionApi::SetPlatform(DeviceInfo::kOpenCL);
+    if (options.device < 0 || options.device >= (int)IntersectionApi::GetDeviceCount())
+    {
+        std::cerr << "No OpenCL device " << options.device << "\n";
+        return EXIT_FAILURE;
+    }
+
+    IntersectionApi* api = IntersectionApi::Create(options.device);
+
+    std::vector<Shape*> shapes;
+    std::vector<MeshCost> costs;
+    int const numrays = options.width * options.height;
+    Buffer* ray_buffer = nullptr;
+    Buffer* hit_buffer = nullptr;
+    Buffer* stats_buffer = nullptr;
+    bool written = false;
+
+    try
+    {
+        float3 pmin(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+        float3 pmax = -pmin;
+
+        for (auto const& objshape : objshapes)
+        {
+            auto const& mesh = objshape.mesh;
+            int numfaces = (int)mesh.indices.size() / 3;
+            if (numfaces == 0)
+            {
+                continue;
+            }
+
+            for (std::size_t i = 0; i + 2 < mesh.positions.size(); i += 3)
+            {
+                float3 p(mesh.positions[i], mesh.positions[i + 1], mesh.positions[i + 2]);
+                pmin = vmin(pmin, p);
+                pmax = vmax(pmax, p);
+            }
+
+            Shape* shape = api->CreateMesh(mesh.positions.data(), (int)mesh.positions.size() / 3, 3 * sizeof(float),
+                mesh.indices.data(), 0, nullptr, numfaces);
+            // Hits report the index of the mesh cost
+            shape->SetId((Id)costs.size());
+            api->AttachShape(shape);
+            shapes.push_back(shape);
+
+            MeshCost cost = { objshape.name, numfaces, ComputeOverlap(mesh), 0, 0 };
+            costs.push_back(cost);
+        }
+
+        api->SetOption("acc.type", config->acc_type);
+        api->SetOption("bvh.force2level", config->force2level ? 1.f : 0.f);
+        api->SetOption("profile.traversal_stats", 1.f);
+        api->Commit();
+
+        AccelStats accel;
+        api->GetStats(accel);
+        std::cout << options.intersector << ": " << accel.num_nodes << " nodes, " << accel.num_leaves << " leaves, depth "
+            << accel.max_depth << ", SAH cost " << accel.sah_cost << ", build " << accel.build_time << " ms\n";
+
+        std::vector<ray> rays;
+        GenerateRays(options, pmin, pmax, rays);
+
+        ray_buffer = api->CreateBuffer(numrays * sizeof(ray), rays.data());
+        hit_buffer = api->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+        stats_buffer = api->CreateBuffer(numrays * sizeof(TraversalStats), nullptr);
+        api->SetTraversalStatsBuffer(stats_buffer);
+
+        Event* e = nullptr;
+        api->QueryIntersection(ray_buffer, numrays, hit_buffer, nullptr, &e);
+        Wait(api, e);
+
+        std::vector<TraversalStats> stats(numrays);
+        std::vector<Intersection> hits(numrays);
+        TraversalStats* stats_data = nullptr;
+        Intersection* hit_data = nullptr;
+        api->MapBuffer(stats_buffer, kMapRead, 0, numrays * sizeof(TraversalStats), (void**)&stats_data, &e);
+        Wait(api, e);
+        stats.assign(stats_data, stats_data + numrays);
+        api->UnmapBuffer(stats_buffer, stats_data, &e);
+        Wait(api, e);
+        api->MapBuffer(hit_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&hit_data, &e);
+        Wait(api, e);
+        hits.assign(hit_data, hit_data + numrays);
+        api->UnmapBuffer(hit_buffer, hit_data, &e);
+        Wait(api, e);
+
+        // Missed rays are reported as a separate row
+        MeshCost miss = { "(miss)", 0, 0.f, 0, 0 };
+        int maxcount = 0;
+        long long total = 0;
+
+        for (int i = 0; i < numrays; ++i)
+        {
+            int const count = GetCounter(stats[i], options.counter);
+            maxcount = std::max(maxcount, count);
+            total += count;
+
+            MeshCost& cost = hits[i].shapeid != kNullId ? costs[hits[i].shapeid] : miss;
+            ++cost.num_rays;
+            cost.cost += count;
+        }
+
+        costs.push_back(miss);
+        std::sort(costs.begin(), costs.end(), [](MeshCost const& a, MeshCost const& b) { return a.cost > b.cost; });
+
+        std::cout << "Max " << kCounterNames[options.counter] << " per ray " << maxcount << ", average "
+            << (float)total / numrays << "\n";
+        std::cout << "Most expensive meshes:\n";
+        for (std::size_t i = 0; i < std::min<std::size_t>(costs.size(), 10); ++i)
+        {
+            auto const& c = costs[i];
+            std::cout << "  " << std::setw(24) << std::left << c.name << std::right << " " << std::setw(8) << c.num_rays << " rays, "
+                << std::setw(8) << (c.num_rays ? (float)c.cost / c.num_rays : 0.f) << " per ray, overlap " << c.overlap << "\n";
+        }
+
+        written = WriteImage(options, stats, maxcount) && WriteReport(options, costs, total);
+        std::cout << "Heatmap written to " << options.output << ", costs to " << options.report << "\n";
+    }
+    catch (Exception& e)
+    {
+        std::cerr << e.what() << "\n";
+    }
+
+    if (stats_buffer)
+    {
+        api->SetTraversalStatsBuffer(nullptr);
+        api->DeleteBuffer(stats_buffer);
+    }
+
+    if (ray_buffer)
+    {
+        api->DeleteBuffer(ray_buffer);
+    }
+
+    if (hit_buffer)
+    {
+        api->DeleteBuffer(hit_buffer);
+    }
+
+    for (auto shape : shapes)
+    {
+        api->DetachShape(shape);
+        api->DeleteShape(shape);
+    }
+
+    IntersectionApi::Delete(api);
+
+    return written ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,527 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+
+// Wavefront path tracer: renders an OBJ scene lit by a sun and sky with paths of several
+// bounces, every stage runs on the device. Each bounce traces the extension rays with the
+// ray count in device memory, shades the hits, traces shadow rays towards the sun and
+// compacts the rays of live paths for the next bounce, so the host only issues work.
+// It is the end-to-end workload for intersector changes, reporting samples/s and Mrays/s
+// of the whole query mix instead of single query types as Benchmark does.
+//
+// Usage: PathTracer [-scene file.obj] [-intersector bvh|fatbvh|hlbvh|bvh4|bvh2l] [-width n] [-height n]
+//                   [-bounces n] [-frames n] [-device idx] [-output image.ppm]
+//
+// Frames take one sample per pixel and are averaged into the image, the first frame is
+// a warm up and is not timed. The camera looks along -z at the scene bounds.
+// Kernels are loaded from ../PathTracer/path_tracer.cl, compaction is supported by
+// the OpenCL devices only, so the sample runs on the OpenCL backend.
+
+#include "radeon_rays.h"
+#include "radeon_rays_cl.h"
+#include "CLW.h"
+#include "../Tutorials/Tools/tiny_obj_loader.h"
+#include "../Tutorials/Tools/parallel_obj_loader.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+using namespace RadeonRays;
+using namespace tinyobj;
+
+namespace
+{
+    struct Options
+    {
+        std::string scene = "../Resources/CornellBox/orig.objm";
+        std::string intersector = "bvh";
+        int width = 512;
+        int height = 512;
+        int bounces = 4;
+        int frames = 32;
+        int device = 0;
+        std::string output = "path_tracer.ppm";
+    };
+
+    // Intersectors and options selecting them
+    struct IntersectorConfig
+    {
+        char const* name;
+        char const* acc_type;
+        bool force2level;
+    };
+
+    IntersectorConfig const kIntersectors[] =
+    {
+        { "bvh", "bvh", false },
+        { "fatbvh", "fatbvh", false },
+        { "hlbvh", "hlbvh", false },
+        { "bvh4", "bvh4", false },
+        { "bvh2l", "bvh", true },
+        { "fatbvh2l", "fatbvh2l", true }
+    };
+
+    // Structures shared with path_tracer.cl
+    struct Path
+    {
+        cl_float4 throughput;
+        cl_int pixel;
+        cl_int rng;
+        cl_int padding0;
+        cl_int padding1;
+    };
+
+    struct Material
+    {
+        cl_float4 diffuse;
+        cl_float4 emission;
+    };
+
+    struct Camera
+    {
+        cl_float4 p;
+        cl_float4 forward;
+        cl_float4 right;
+        cl_float4 up;
+    };
+
+    // Triangles of all the meshes, hits are mapped to them by the shape id
+    struct SceneData
+    {
+        std::vector<cl_float4> vertices;
+        // Vertex indices and material
+        std::vector<cl_int4> triangles;
+        // First triangle of every mesh
+        std::vector<cl_int> shape_triangles;
+        std::vector<Material> materials;
+        float3 pmin;
+        float3 pmax;
+    };
+
+    // Work items per group of the stage kernels
+    int const kGroupSize = 64;
+
+    bool ParseOptions(int argc, char** argv, Options& options)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+
+            if (i + 1 == argc)
+            {
+                std::cerr << "Missing value of " << arg << "\n";
+                return false;
+            }
+
+            std::string value = argv[++i];
+
+            if (arg == "-scene")
+                options.scene = value;
+            else if (arg == "-intersector")
+                options.intersector = value;
+            else if (arg == "-width")
+                options.width = std::max(1, std::atoi(value.c_str()));
+            else if (arg == "-height")
+                options.height = std::max(1, std::atoi(value.c_str()));
+            else if (arg == "-bounces")
+                options.bounces = std::max(1, std::atoi(value.c_str()));
+            else if (arg == "-frames")
+                options.frames = std::max(1, std::atoi(value.c_str()));
+            else if (arg == "-device")
+                options.device = std::atoi(value.c_str());
+            else if (arg == "-output")
+                options.output = value;
+            else
+            {
+                std::cerr << "Unknown option " << arg << "\n";
+                std::cerr << "Usage: PathTracer [-scene file.obj] [-intersector name] [-width n] [-height n]\n"
+                    << "                  [-bounces n] [-frames n] [-device idx] [-output file.ppm]\n";
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    cl_float4 MakeFloat4(float x, float y, float z, float w = 0.f)
+    {
+        cl_float4 v = { { x, y, z, w } };
+        return v;
+    }
+
+    cl_float4 MakeFloat4(float3 const& v)
+    {
+        return MakeFloat4(v.x, v.y, v.z);
+    }
+
+    void BuildScene(std::vector<shape_t> const& objshapes, std::vector<material_t> const& objmaterials, SceneData& scene)
+    {
+        // Faces without a material get the last one
+        for (auto const& m : objmaterials)
+        {
+            Material material = { MakeFloat4(m.diffuse[0], m.diffuse[1], m.diffuse[2]), MakeFloat4(m.emission[0], m.emission[1], m.emission[2]) };
+            scene.materials.push_back(material);
+        }
+
+        Material const gray = { MakeFloat4(0.5f, 0.5f, 0.5f), MakeFloat4(0.f, 0.f, 0.f) };
+        scene.materials.push_back(gray);
+        int const default_material = (int)scene.materials.size() - 1;
+
+        scene.pmin = float3(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+        scene.pmax = -scene.pmin;
+
+        for (auto const& objshape : objshapes)
+        {
+            auto const& mesh = objshape.mesh;
+            int const base = (int)scene.vertices.size();
+            scene.shape_triangles.push_back((cl_int)scene.triangles.size());
+
+            for (std::size_t i = 0; i + 2 < mesh.positions.size(); i += 3)
+            {
+                float3 p(mesh.positions[i], mesh.positions[i + 1], mesh.positions[i + 2]);
+                scene.pmin = vmin(scene.pmin, p);
+                scene.pmax = vmax(scene.pmax, p);
+                scene.vertices.push_back(MakeFloat4(p));
+            }
+
+            for (std::size_t i = 0; i + 2 < mesh.indices.size(); i += 3)
+            {
+                int const face = (int)i / 3;
+                int material = face < (int)mesh.material_ids.size() ? mesh.material_ids[face] : -1;
+                if (material < 0 || material >= default_material)
+                {
+                    material = default_material;
+                }
+
+                cl_int4 tri = { { base + (int)mesh.indices[i], base + (int)mesh.indices[i + 1], base + (int)mesh.indices[i + 2], material } };
+                scene.triangles.push_back(tri);
+            }
+        }
+    }
+
+    // Pinhole looking along -z at the bounds with a 45 degree vertical field of view
+    Camera GetCamera(Options const& options, SceneData const& scene)
+    {
+        float3 const center = 0.5f * (scene.pmin + scene.pmax);
+        float3 const extents = scene.pmax - scene.pmin;
+        float const halfsize = 0.5f * std::max(extents.x, extents.y);
+        float const tanfov = std::tan(22.5f * 3.14159265f / 180.f);
+        float const aspect = (float)options.width / options.height;
+
+        Camera camera;
+        camera.p = MakeFloat4(center.x, center.y, scene.pmax.z + 1.1f * halfsize / tanfov);
+        camera.forward = MakeFloat4(0.f, 0.f, -1.f);
+        camera.right = MakeFloat4(tanfov * aspect, 0.f, 0.f);
+        camera.up = MakeFloat4(0.f, tanfov, 0.f);
+        return camera;
+    }
+
+    bool CreateContext(int device, CLWContext& context)
+    {
+        std::vector<CLWPlatform> platforms;
+        CLWPlatform::CreateAllPlatforms(platforms);
+
+        for (auto& platform : platforms)
+        {
+            int const count = (int)platform.GetDeviceCount();
+            if (device < count)
+            {
+                context = CLWContext::Create(platform.GetDevice(device));
+                return true;
+            }
+
+            device -= count;
+        }
+
+        return false;
+    }
+
+    bool WriteImage(Options const& options, std::vector<cl_float4> const& radiance, int frames)
+    {
+        std::ofstream out(options.output, std::ios::binary);
+        out << "P6\n" << options.width << " " << options.height << "\n255\n";
+
+        for (auto const& r : radiance)
+        {
+            unsigned char rgb[3];
+            for (int c = 0; c < 3; ++c)
+            {
+                float const v = std::pow(std::min(std::max(r.s[c] / frames, 0.f), 1.f), 1.f / 2.2f);
+                rgb[c] = (unsigned char)(255.f * v + 0.5f);
+            }
+            out.write((char const*)rgb, 3);
+        }
+
+        return (bool)out;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        return EXIT_FAILURE;
+    }
+
+    auto config = std::find_if(std::begin(kIntersectors), std::end(kIntersectors),
+        [&options](IntersectorConfig const& c) { return options.intersector == c.name; });
+    if (config == std::end(kIntersectors))
+    {
+        std::cerr << "Unknown intersector " << options.intersector << "\n";
+        return EXIT_FAILURE;
+    }
+
+    std::vector<shape_t> objshapes;
+    std::vector<material_t> objmaterials;
+    std::string basepath = options.scene.substr(0, options.scene.find_last_of("/\\") + 1);
+    std::string res = LoadObjParallel(objshapes, objmaterials, options.scene.c_str(), basepath.c_str());
+    if (!res.empty())
+    {
+        std::cerr << res << "\n";
+        return EXIT_FAILURE;
+    }
+
+    SceneData scene;
+    BuildScene(objshapes, objmaterials, scene);
+    if (scene.triangles.empty())
+    {
+        std::cerr << "No triangles in " << options.scene << "\n";
+        return EXIT_FAILURE;
+    }
+
+    CLWContext context;
+    CLWProgram program;
+    try
+    {
+        if (!CreateContext(options.device, context))
+        {
+            std::cerr << "No OpenCL device " << options.device << "\n";
+            return EXIT_FAILURE;
+        }
+
+        program = CLWProgram::CreateFromFile("../PathTracer/path_tracer.cl", "-cl-mad-enable -cl-std=CL1.2", context);
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << e.what() << "\n";
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "Device: " << context.GetDevice(0).GetName() << "\n";
+
+    IntersectionApi* api = CreateFromOpenClContext(context, context.GetDevice(0).GetID(), context.GetCommandQueue(0));
+
+    std::vector<Shape*> shapes;
+    std::vector<Buffer*> buffers;
+    bool written = false;
+
+    try
+    {
+        for (std::size_t i = 0; i < objshapes.size(); ++i)
+        {
+            auto const& mesh = objshapes[i].mesh;
+            int numfaces = (int)mesh.indices.size() / 3;
+            if (numfaces == 0)
+            {
+                continue;
+            }
+
+            Shape* shape = api->CreateMesh(mesh.positions.data(), (int)mesh.positions.size() / 3, 3 * sizeof(float),
+                mesh.indices.data(), 0, nullptr, numfaces);
+            // Hits find the first triangle of the mesh by its id
+            shape->SetId((Id)i);
+            api->AttachShape(shape);
+            shapes.push_back(shape);
+        }
+
+        api->SetOption("acc.type", config->acc_type);
+        api->SetOption("bvh.force2level", config->force2level ? 1.f : 0.f);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        api->Commit();
+        float const commit_ms = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        std::cout << options.intersector << ": " << scene.triangles.size() << " triangles, commit " << commit_ms << " ms\n";
+
+        int const numpixels = options.width * options.height;
+        std::size_t const globalsize = ((numpixels + kGroupSize - 1) / kGroupSize) * kGroupSize;
+
+        // Scene and camera
+        Camera camera = GetCamera(options, scene);
+        auto vertices = CLWBuffer<cl_float4>::Create(context, CL_MEM_READ_ONLY, scene.vertices.size(), scene.vertices.data());
+        auto triangles = CLWBuffer<cl_int4>::Create(context, CL_MEM_READ_ONLY, scene.triangles.size(), scene.triangles.data());
+        auto shape_triangles = CLWBuffer<cl_int>::Create(context, CL_MEM_READ_ONLY, scene.shape_triangles.size(), scene.shape_triangles.data());
+        auto materials = CLWBuffer<Material>::Create(context, CL_MEM_READ_ONLY, scene.materials.size(), scene.materials.data());
+        auto camera_buffer = CLWBuffer<Camera>::Create(context, CL_MEM_READ_ONLY, 1, &camera);
+
+        // Path state, rays of the current bounce are compacted from the extension rays of the previous one
+        auto rays = CLWBuffer<ray>::Create(context, CL_MEM_READ_WRITE, numpixels);
+        auto next_rays = CLWBuffer<ray>::Create(context, CL_MEM_READ_WRITE, numpixels);
+        auto shadow_rays = CLWBuffer<ray>::Create(context, CL_MEM_READ_WRITE, numpixels);
+        auto hits = CLWBuffer<Intersection>::Create(context, CL_MEM_READ_WRITE, numpixels);
+        auto occluded = CLWBuffer<cl_int>::Create(context, CL_MEM_READ_WRITE, numpixels);
+        auto shadow_radiance = CLWBuffer<cl_float4>::Create(context, CL_MEM_READ_WRITE, numpixels);
+        auto paths = CLWBuffer<Path>::Create(context, CL_MEM_READ_WRITE, numpixels);
+        auto compacted_paths = CLWBuffer<Path>::Create(context, CL_MEM_READ_WRITE, numpixels);
+        auto alive = CLWBuffer<cl_int>::Create(context, CL_MEM_READ_WRITE, numpixels);
+        auto indices = CLWBuffer<cl_int>::Create(context, CL_MEM_READ_WRITE, numpixels);
+        auto numrays = CLWBuffer<cl_int>::Create(context, CL_MEM_READ_WRITE, 1);
+        auto radiance = CLWBuffer<cl_float4>::Create(context, CL_MEM_READ_WRITE, numpixels);
+        auto raycount = CLWBuffer<cl_ulong>::Create(context, CL_MEM_READ_WRITE, 2);
+
+        Buffer* rays_rr = CreateFromOpenClBuffer(api, rays);
+        Buffer* next_rays_rr = CreateFromOpenClBuffer(api, next_rays);
+        Buffer* shadow_rays_rr = CreateFromOpenClBuffer(api, shadow_rays);
+        Buffer* hits_rr = CreateFromOpenClBuffer(api, hits);
+        Buffer* occluded_rr = CreateFromOpenClBuffer(api, occluded);
+        Buffer* alive_rr = CreateFromOpenClBuffer(api, alive);
+        Buffer* indices_rr = CreateFromOpenClBuffer(api, indices);
+        Buffer* numrays_rr = CreateFromOpenClBuffer(api, numrays);
+        buffers = { rays_rr, next_rays_rr, shadow_rays_rr, hits_rr, occluded_rr, alive_rr, indices_rr, numrays_rr };
+
+        // Sun from the upper front right and a blue sky
+        float3 sun(0.3f, 1.f, 0.5f);
+        sun.normalize();
+
+        CLWKernel generate = program.GetKernel("GeneratePrimaryRays");
+        CLWKernel shade = program.GetKernel("ShadeHits");
+        CLWKernel accumulate = program.GetKernel("AccumulateShadows");
+        CLWKernel gather = program.GetKernel("GatherPaths");
+
+        int arg = 0;
+        shade.SetArg(arg++, rays);
+        shade.SetArg(arg++, hits);
+        shade.SetArg(arg++, numrays);
+        shade.SetArg(arg++, paths);
+        shade.SetArg(arg++, vertices);
+        shade.SetArg(arg++, triangles);
+        shade.SetArg(arg++, shape_triangles);
+        shade.SetArg(arg++, materials);
+        shade.SetArg(arg++, MakeFloat4(sun));
+        shade.SetArg(arg++, MakeFloat4(3.f, 2.9f, 2.7f));
+        shade.SetArg(arg++, MakeFloat4(0.4f, 0.5f, 0.7f));
+        shade.SetArg(arg++, shadow_rays);
+        shade.SetArg(arg++, shadow_radiance);
+        shade.SetArg(arg++, next_rays);
+        shade.SetArg(arg++, alive);
+        shade.SetArg(arg++, radiance);
+        shade.SetArg(arg++, raycount);
+
+        accumulate.SetArg(0, shadow_rays);
+        accumulate.SetArg(1, occluded);
+        accumulate.SetArg(2, shadow_radiance);
+        accumulate.SetArg(3, paths);
+        accumulate.SetArg(4, numrays);
+        accumulate.SetArg(5, radiance);
+
+        gather.SetArg(0, paths);
+        gather.SetArg(1, indices);
+        gather.SetArg(2, numrays);
+        gather.SetArg(3, compacted_paths);
+
+        auto render_frame = [&](int frame)
+        {
+            generate.SetArg(0, rays);
+            generate.SetArg(1, paths);
+            generate.SetArg(2, numrays);
+            generate.SetArg(3, camera_buffer);
+            generate.SetArg(4, options.width);
+            generate.SetArg(5, options.height);
+            generate.SetArg(6, frame);
+            context.Launch1D(0, globalsize, kGroupSize, generate);
+
+            for (int bounce = 0; bounce < options.bounces; ++bounce)
+            {
+                api->QueryIntersection(rays_rr, numrays_rr, numpixels, hits_rr, nullptr, nullptr);
+                context.Launch1D(0, globalsize, kGroupSize, shade);
+                api->QueryOcclusion(shadow_rays_rr, numrays_rr, numpixels, occluded_rr, nullptr, nullptr);
+                context.Launch1D(0, globalsize, kGroupSize, accumulate);
+
+                if (bounce + 1 < options.bounces)
+                {
+                    // The count of live paths replaces the count of the bounce on the device
+                    api->CompactRays(next_rays_rr, numrays_rr, numpixels, alive_rr, rays_rr, numrays_rr, indices_rr, nullptr, nullptr);
+                    context.Launch1D(0, globalsize, kGroupSize, gather);
+                    context.CopyBuffer(0, compacted_paths, paths, 0, 0, numpixels);
+                }
+            }
+        };
+
+        // Warm up, then restart the image and the counts
+        render_frame(0);
+        context.FillBuffer(0, radiance, MakeFloat4(0.f, 0.f, 0.f), numpixels);
+        context.FillBuffer(0, raycount, (cl_ulong)0, 2);
+        context.Finish(0);
+
+        start = std::chrono::high_resolution_clock::now();
+        for (int frame = 1; frame <= options.frames; ++frame)
+        {
+            render_frame(frame);
+        }
+        context.Finish(0);
+        double const seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+        cl_ulong counts[2] = {};
+        context.ReadBuffer(0, raycount, counts, 2).Wait();
+        std::vector<cl_float4> image(numpixels);
+        context.ReadBuffer(0, radiance, image.data(), numpixels).Wait();
+
+        double const samples = (double)numpixels * options.frames;
+        std::cout << options.frames << " frames of " << options.width << "x" << options.height << ", " << options.bounces << " bounces in "
+            << seconds * 1000.0 << " ms\n";
+        std::cout << "Samples/s: " << samples / seconds << "\n";
+        std::cout << "Mrays/s: " << (counts[0] + counts[1]) / seconds * 1e-6 << " (closest hit " << counts[0] / seconds * 1e-6
+            << ", shadow " << counts[1] / seconds * 1e-6 << ")\n";
+
+        written = WriteImage(options, image, options.frames);
+        std::cout << "Image written to " << options.output << "\n";
+    }
+    catch (Exception& e)
+    {
+        std::cerr << e.what() << "\n";
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << e.what() << "\n";
+    }
+
+    for (auto buffer : buffers)
+    {
+        api->DeleteBuffer(buffer);
+    }
+
+    for (auto shape : shapes)
+    {
+        api->DetachShape(shape);
+        api->DeleteShape(shape);
+    }
+
+    IntersectionApi::Delete(api);
+
+    return written ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,286 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file path_tracer.cl
+    \brief Wavefront path tracing stages of the PathTracer sample.
+
+    Paths advance one bounce per pass of the stages: closest hits are shaded into a
+    shadow ray towards the sun and an extension ray, shadowed contributions are accumulated
+    and the extension rays of live paths are compacted for the next bounce. The number of
+    rays is read from the count buffer, so the host never waits between the stages.
+ */
+
+#define PI 3.14159265358979f
+#define EPSILON 0.0001f
+#define NULL_ID -1
+
+// Matches RadeonRays::ray
+typedef struct
+{
+    // xyz - origin, w - max range
+    float4 o;
+    // xyz - direction, w - time
+    float4 d;
+    // x - ray mask, y - activity flag
+    int2 extra;
+    int2 padding;
+} Ray;
+
+// Matches RadeonRays::Intersection
+typedef struct
+{
+    int shapeid;
+    int primid;
+    int padding0;
+    int padding1;
+    // uv - hit barycentrics, w - ray distance
+    float4 uvwt;
+} Intersection;
+
+// Matches Path of main.cpp
+typedef struct
+{
+    float4 throughput;
+    int pixel;
+    int rng;
+    int padding0;
+    int padding1;
+} Path;
+
+// Matches Material of main.cpp
+typedef struct
+{
+    float4 diffuse;
+    float4 emission;
+} Material;
+
+// Matches Camera of main.cpp
+typedef struct
+{
+    float4 p;
+    float4 forward;
+    float4 right;
+    float4 up;
+} Camera;
+
+uint WangHash(uint seed)
+{
+    seed = (seed ^ 61u) ^ (seed >> 16u);
+    seed *= 9u;
+    seed = seed ^ (seed >> 4u);
+    seed *= 0x27d4eb2du;
+    seed = seed ^ (seed >> 15u);
+    return seed;
+}
+
+// Xorshift step, returns a float in [0, 1)
+float Random(uint* state)
+{
+    uint x = *state;
+    x ^= x << 13u;
+    x ^= x >> 17u;
+    x ^= x << 5u;
+    *state = x;
+    return (float)(x >> 8u) * (1.f / 16777216.f);
+}
+
+Ray MakeRay(float3 o, float3 d, float maxt)
+{
+    Ray r;
+    r.o = (float4)(o, maxt);
+    r.d = (float4)(d, 0.f);
+    r.extra = (int2)(0xFFFFFFFF, 1);
+    r.padding = (int2)(0, 0);
+    return r;
+}
+
+// Cosine weighted direction around n
+float3 SampleHemisphere(float3 n, float u, float v)
+{
+    float3 t = fabs(n.x) > 0.5f ? (float3)(0.f, 1.f, 0.f) : (float3)(1.f, 0.f, 0.f);
+    float3 b = normalize(cross(n, t));
+    t = cross(b, n);
+
+    float r = sqrt(u);
+    float phi = 2.f * PI * v;
+    return normalize(t * (r * cos(phi)) + b * (r * sin(phi)) + n * sqrt(max(0.f, 1.f - u)));
+}
+
+// Primary ray and path of every pixel, jittered within the pixel
+__kernel void GeneratePrimaryRays(
+    __global Ray* rays,
+    __global Path* paths,
+    __global int* numrays,
+    __global Camera const* camera,
+    int width,
+    int height,
+    int frame)
+{
+    int id = get_global_id(0);
+
+    if (id == 0)
+    {
+        *numrays = width * height;
+    }
+
+    if (id < width * height)
+    {
+        uint rng = WangHash(id * 9781u + frame * 6271u + 1u);
+        float x = ((id % width) + Random(&rng)) / width * 2.f - 1.f;
+        float y = 1.f - ((id / width) + Random(&rng)) / height * 2.f;
+
+        float3 d = camera->forward.xyz + camera->right.xyz * x + camera->up.xyz * y;
+        rays[id] = MakeRay(camera->p.xyz, normalize(d), FLT_MAX);
+
+        Path path;
+        path.throughput = (float4)(1.f, 1.f, 1.f, 1.f);
+        path.pixel = id;
+        path.rng = (int)rng;
+        path.padding0 = 0;
+        path.padding1 = 0;
+        paths[id] = path;
+    }
+}
+
+// Add emission and sky of the hits, write a shadow ray to the sun with its unoccluded contribution
+// and an extension ray, alive is 0 for paths ending at this bounce
+__kernel void ShadeHits(
+    __global Ray const* rays,
+    __global Intersection const* hits,
+    __global int const* numrays,
+    __global Path* paths,
+    // Scene
+    __global float4 const* vertices,
+    __global int4 const* triangles,
+    __global int const* shape_triangles,
+    __global Material const* materials,
+    // Lighting
+    float4 sun_direction,
+    float4 sun_radiance,
+    float4 sky_radiance,
+    // Output
+    __global Ray* shadow_rays,
+    __global float4* shadow_radiance,
+    __global Ray* next_rays,
+    __global int* alive,
+    __global float4* radiance,
+    // Intersection and shadow rays traced so far
+    __global ulong* raycount)
+{
+    int id = get_global_id(0);
+    int count = *numrays;
+
+    if (id == 0)
+    {
+        raycount[0] += count;
+        raycount[1] += count;
+    }
+
+    if (id >= count)
+    {
+        return;
+    }
+
+    Path path = paths[id];
+    Intersection hit = hits[id];
+    Ray r = rays[id];
+
+    shadow_rays[id].extra.y = 0;
+    next_rays[id].extra.y = 0;
+    alive[id] = 0;
+
+    if (hit.shapeid == NULL_ID)
+    {
+        radiance[path.pixel] += path.throughput * sky_radiance;
+        return;
+    }
+
+    int4 tri = triangles[shape_triangles[hit.shapeid] + hit.primid];
+    float3 v0 = vertices[tri.x].xyz;
+    float3 v1 = vertices[tri.y].xyz;
+    float3 v2 = vertices[tri.z].xyz;
+    Material material = materials[tri.w];
+
+    radiance[path.pixel] += path.throughput * material.emission;
+
+    // Geometric normal facing the ray
+    float3 n = normalize(cross(v1 - v0, v2 - v0));
+    if (dot(n, r.d.xyz) > 0.f)
+    {
+        n = -n;
+    }
+
+    float3 p = v0 * (1.f - hit.uvwt.x - hit.uvwt.y) + v1 * hit.uvwt.x + v2 * hit.uvwt.y;
+    float3 o = p + n * EPSILON;
+
+    float cosl = dot(n, sun_direction.xyz);
+    if (cosl > 0.f)
+    {
+        shadow_rays[id] = MakeRay(o, sun_direction.xyz, FLT_MAX);
+        shadow_radiance[id] = path.throughput * material.diffuse * sun_radiance * (cosl / PI);
+    }
+
+    uint rng = (uint)path.rng;
+    float u = Random(&rng);
+    float v = Random(&rng);
+    path.throughput *= material.diffuse;
+    path.rng = (int)rng;
+    paths[id] = path;
+
+    if (max(path.throughput.x, max(path.throughput.y, path.throughput.z)) > 0.f)
+    {
+        next_rays[id] = MakeRay(o, SampleHemisphere(n, u, v), FLT_MAX);
+        alive[id] = 1;
+    }
+}
+
+// Add contributions of the shadow rays reaching the sun
+__kernel void AccumulateShadows(
+    __global Ray const* shadow_rays,
+    __global int const* occluded,
+    __global float4 const* shadow_radiance,
+    __global Path const* paths,
+    __global int const* numrays,
+    __global float4* radiance)
+{
+    int id = get_global_id(0);
+
+    if (id < *numrays && shadow_rays[id].extra.y && occluded[id] == NULL_ID)
+    {
+        radiance[paths[id].pixel] += shadow_radiance[id];
+    }
+}
+
+// Move the paths of the compacted extension rays next to them
+__kernel void GatherPaths(
+    __global Path const* paths,
+    __global int const* indices,
+    __global int const* numrays,
+    __global Path* compacted)
+{
+    int id = get_global_id(0);
+
+    if (id < *numrays)
+    {
+        compacted[id] = paths[indices[id]];
+    }
+}
@@ -0,0 +1,402 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+
+// Parallel primitives benchmark: measures scan, segmented scan, compact and radix sort
+// of Calc::Primitives, which run CLWParallelPrimitives on OpenCL, at power of 4 sizes,
+// results are written as JSON to track primitive regressions apart from traversal.
+//
+// Usage: PrimitivesBenchmark [-backend cl|vk|all] [-device idx] [-min n] [-max n]
+//                            [-iterations n] [-output results.json]
+//
+// Throughput is reported in keys/s and GB/s, where bytes are the data each primitive
+// reads and writes once, e.g. 8 bytes per element for a scan, so multi-pass algorithms
+// show how far they are from a single pass over memory. Sizes not fitting into the
+// device allocation limits are skipped.
+
+#include "calc.h"
+#include "device.h"
+#include "buffer.h"
+#include "except.h"
+#include "primitives.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+    struct Options
+    {
+        int backends = Calc::Platform::kOpenCL | Calc::Platform::kVulkan;
+        std::uint32_t device = 0;
+        std::size_t min_size = 1 << 10;
+        std::size_t max_size = 1 << 26;
+        int iterations = 10;
+        std::string output = "primitives.json";
+    };
+
+    struct Result
+    {
+        std::string backend;
+        std::string device;
+        std::string primitive;
+        std::size_t size;
+        float ms;
+        float mkeys;
+        float gbytes;
+    };
+
+    struct BackendConfig
+    {
+        char const* name;
+        Calc::Platform platform;
+    };
+
+    BackendConfig const kBackends[] =
+    {
+        { "cl", Calc::Platform::kOpenCL },
+        { "vk", Calc::Platform::kVulkan }
+    };
+
+    enum PrimitiveType
+    {
+        kScan,
+        kSegmentedScan,
+        kCompact,
+        kSortInt32,
+        kSortInt64
+    };
+
+    struct PrimitiveConfig
+    {
+        char const* name;
+        PrimitiveType type;
+        // Bytes read and written per element by a single pass
+        std::size_t bytes_per_key;
+    };
+
+    PrimitiveConfig const kPrimitives[] =
+    {
+        { "scan", kScan, 8 },
+        { "segmented_scan", kSegmentedScan, 12 },
+        // Half of the elements pass the predicate
+        { "compact", kCompact, 10 },
+        // Keys and 32-bit values in and out
+        { "sort_radix_int32", kSortInt32, 16 },
+        { "sort_radix_int64", kSortInt64, 24 }
+    };
+
+    // Seed of the input generator, results are comparable between runs
+    unsigned const kSeed = 42;
+    // Average segment length of segmented scans
+    int const kSegmentLength = 64;
+
+    bool ParseOptions(int argc, char** argv, Options& options)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+
+            if (i + 1 == argc)
+            {
+                std::cerr << "Missing value of " << arg << "\n";
+                return false;
+            }
+
+            char const* value = argv[++i];
+
+            if (arg == "-device")
+                options.device = (std::uint32_t)std::max(0, std::atoi(value));
+            else if (arg == "-min")
+                options.min_size = (std::size_t)std::max(1, std::atoi(value));
+            else if (arg == "-max")
+                options.max_size = (std::size_t)std::max(1, std::atoi(value));
+            else if (arg == "-iterations")
+                options.iterations = std::max(1, std::atoi(value));
+            else if (arg == "-output")
+                options.output = value;
+            else if (arg == "-backend")
+            {
+                std::string backend = value;
+                options.backends = 0;
+
+                for (auto const& config : kBackends)
+                {
+                    if (backend == config.name || backend == "all")
+                    {
+                        options.backends |= config.platform;
+                    }
+                }
+
+                if (!options.backends)
+                {
+                    std::cerr << "Unknown backend " << backend << "\n";
+                    return false;
+                }
+            }
+            else
+            {
+                std::cerr << "Unknown option " << arg << "\n";
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Inputs of all the primitives for the largest size, smaller sizes use their prefix
+    class Inputs
+    {
+    public:
+        Inputs(Calc::Device* device, std::size_t size)
+            : m_device(device)
+        {
+            std::mt19937 rng(kSeed);
+            std::vector<std::uint32_t> keys(2 * size);
+            std::vector<int> values(size);
+            std::vector<int> heads(size);
+            std::vector<int> predicate(size);
+
+            for (std::size_t i = 0; i < size; ++i)
+            {
+                keys[2 * i] = rng();
+                keys[2 * i + 1] = rng();
+                values[i] = (int)i;
+                heads[i] = rng() % kSegmentLength == 0 ? 1 : 0;
+                predicate[i] = rng() & 1;
+            }
+
+            // Random keys give every radix digit the same share
+            m_keys = Create(keys.size() * sizeof(std::uint32_t), keys.data());
+            m_values = Create(values.size() * sizeof(int), values.data());
+            m_heads = Create(heads.size() * sizeof(int), heads.data());
+            m_predicate = Create(predicate.size() * sizeof(int), predicate.data());
+            m_out_keys = Create(keys.size() * sizeof(std::uint32_t), nullptr);
+            m_out_values = Create(values.size() * sizeof(int), nullptr);
+            m_new_size = Create(sizeof(int), nullptr);
+        }
+
+        ~Inputs()
+        {
+            for (auto buffer : m_buffers)
+            {
+                m_device->DeleteBuffer(buffer);
+            }
+        }
+
+        void Run(Calc::Primitives* prims, PrimitiveType type, std::size_t size)
+        {
+            switch (type)
+            {
+            case kScan:
+                prims->ScanExclusiveAddInt32(0, m_values, m_out_values, size);
+                break;
+            case kSegmentedScan:
+                prims->SegmentedScanExclusiveAddInt32(0, m_values, m_heads, m_out_values, size);
+                break;
+            case kCompact:
+                prims->CompactInt32(0, m_predicate, m_values, m_out_values, size, m_new_size);
+                break;
+            case kSortInt32:
+                prims->SortRadixInt32(0, m_keys, m_out_keys, m_values, m_out_values, size);
+                break;
+            case kSortInt64:
+                prims->SortRadixInt64(0, m_keys, m_out_keys, m_values, m_out_values, size);
+                break;
+            }
+        }
+
+    private:
+        Inputs(Inputs const&);
+        Inputs& operator = (Inputs const&);
+
+        Calc::Buffer* Create(std::size_t size, void* data)
+        {
+            auto buffer = data ? m_device->CreateBuffer(size, Calc::BufferType::kRead | Calc::BufferType::kWrite, data) :
+                m_device->CreateBuffer(size, Calc::BufferType::kRead | Calc::BufferType::kWrite);
+            m_buffers.push_back(buffer);
+            return buffer;
+        }
+
+        Calc::Device* m_device;
+        std::vector<Calc::Buffer*> m_buffers;
+        Calc::Buffer* m_keys;
+        Calc::Buffer* m_values;
+        Calc::Buffer* m_heads;
+        Calc::Buffer* m_predicate;
+        Calc::Buffer* m_out_keys;
+        Calc::Buffer* m_out_values;
+        Calc::Buffer* m_new_size;
+    };
+
+    // Largest size whose buffers fit into the allocation limits of the device
+    std::size_t GetMaxSize(Calc::DeviceSpec const& spec, std::size_t size)
+    {
+        // 64-bit keys are the largest buffers, all of them take 40 bytes per element
+        while (size > 1 && ((spec.max_alloc_size && 8 * size > spec.max_alloc_size) ||
+            (spec.global_mem_size && 40 * size > spec.global_mem_size / 2)))
+        {
+            size /= 4;
+        }
+
+        return size;
+    }
+
+    // Run once for warm up and then time the iterations, returns milliseconds per run
+    float Measure(Calc::Device* device, Calc::Primitives* prims, Inputs& inputs, PrimitiveType type, std::size_t size, int iterations)
+    {
+        inputs.Run(prims, type, size);
+        device->Finish(0);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < iterations; ++i)
+        {
+            inputs.Run(prims, type, size);
+        }
+        device->Finish(0);
+
+        return std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / iterations;
+    }
+
+    std::string Escape(std::string const& str)
+    {
+        std::string res;
+        for (char c : str)
+        {
+            if (c == '"' || c == '\\')
+                res.push_back('\\');
+            res.push_back(c);
+        }
+        return res;
+    }
+
+    void WriteJson(std::ostream& out, Options const& options, std::vector<Result> const& results)
+    {
+        out << "{\n";
+        out << "  \"iterations\": " << options.iterations << ",\n";
+        out << "  \"results\": [\n";
+
+        for (std::size_t i = 0; i < results.size(); ++i)
+        {
+            auto const& r = results[i];
+            out << "    { \"backend\": \"" << r.backend << "\", \"device\": \"" << Escape(r.device)
+                << "\", \"primitive\": \"" << r.primitive << "\", \"size\": " << r.size << ", \"ms\": " << r.ms
+                << ", \"mkeys_per_s\": " << r.mkeys << ", \"gb_per_s\": " << r.gbytes
+                << (i + 1 < results.size() ? " },\n" : " }\n");
+        }
+
+        out << "  ]\n}\n";
+    }
+
+    void RunBackend(BackendConfig const& backend, Options const& options, std::vector<Result>& results)
+    {
+        Calc::Calc* calc = CreateCalc(backend.platform, 0);
+        if (!calc || options.device >= calc->GetDeviceCount())
+        {
+            std::cout << "Skipping " << backend.name << ": no device " << options.device << "\n";
+            if (calc)
+            {
+                DeleteCalc(calc);
+            }
+            return;
+        }
+
+        Calc::Device* device = calc->CreateDevice(options.device);
+        Calc::DeviceSpec spec;
+        device->GetSpec(spec);
+        std::string name = spec.name ? spec.name : "unknown";
+        std::cout << "Backend " << backend.name << ", device: " << name << "\n";
+
+        std::size_t max_size = GetMaxSize(spec, options.max_size);
+        if (max_size < options.max_size)
+        {
+            std::cout << "Sizes above " << max_size << " don't fit into device memory, skipped\n";
+        }
+
+        Calc::Primitives* prims = device->CreatePrimitives();
+
+        {
+            Inputs inputs(device, max_size);
+
+            for (auto const& primitive : kPrimitives)
+            {
+                for (std::size_t size = options.min_size; size <= max_size; size *= 4)
+                {
+                    float ms = Measure(device, prims, inputs, primitive.type, size, options.iterations);
+                    float seconds = ms * 1e-3f;
+                    Result result = { backend.name, name, primitive.name, size, ms,
+                        seconds > 0.f ? size / seconds * 1e-6f : 0.f,
+                        seconds > 0.f ? size * primitive.bytes_per_key / seconds * 1e-9f : 0.f };
+                    results.push_back(result);
+
+                    std::cout << backend.name << " " << primitive.name << " " << size << ": " << ms << " ms, "
+                        << result.mkeys << " Mkeys/s, " << result.gbytes << " GB/s\n";
+                }
+            }
+        }
+
+        device->DeletePrimitives(prims);
+        calc->DeleteDevice(device);
+        DeleteCalc(calc);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        return EXIT_FAILURE;
+    }
+
+    std::vector<Result> results;
+
+    for (auto const& backend : kBackends)
+    {
+        if (!(options.backends & backend.platform))
+        {
+            continue;
+        }
+
+        try
+        {
+            RunBackend(backend, options, results);
+        }
+        catch (Calc::Exception& e)
+        {
+            std::cerr << backend.name << ": " << e.what() << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::ofstream out(options.output);
+    WriteJson(out, options, results);
+    std::cout << "Results written to " << options.output << "\n";
+
+    return out ? EXIT_SUCCESS : EXIT_FAILURE;
+}
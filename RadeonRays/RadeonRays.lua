@@ -73,6 +73,16 @@ project "RadeonRays"
                                  "> ./src/kernelcache/kernels_vk.h"
                                 )
             print ">> RadeonRays: VK kernels embedded"
+
+            -- SPIR-V is optional, GLSL embedded above is compiled at runtime without it
+            if os.execute( "python ../Tools/scripts/spirvify.py " ..
+                                os.getcwd() .. "/../RadeonRays/src/kernels/GLSL/ "  ..
+                                ".comp " ..
+                                 "> ./src/kernelcache/kernels_vk_spirv.h"
+                                ) == true then
+                defines {"RR_EMBED_SPIRV=1"}
+                print ">> RadeonRays: VK kernels precompiled to SPIR-V"
+            end
         end
 
         if _OPTIONS["use_opencl"] then
@@ -142,6 +152,11 @@ project "RadeonRays"
         end
     end
 
+    -- sockets of the remote device
+    if os.is("windows") then
+        links {"ws2_32"}
+    end
+
     configuration {"x32", "Debug"}
         targetdir "../Bin/Debug/x86"
     configuration {"x64", "Debug"}
@@ -24,6 +24,8 @@ THE SOFTWARE.
 #include <cmath>
 #include <algorithm>
 
+#include "simd.h"
+
 #if defined(_WIN32) && !defined(NO_MIN_MAX)
 #undef MIN
 #undef MAX
@@ -33,7 +35,7 @@ THE SOFTWARE.
 
 namespace RadeonRays
 {
-    class float3
+    class RR_SIMD_ALIGN float3
     {
     public:
         float3(float xx = 0.f, float yy = 0.f, float zz = 0.f, float ww = 0.f) : x(xx), y(yy), z(zz), w(ww) {}
@@ -45,15 +47,34 @@ namespace RadeonRays
         float  sqnorm() const           { return x*x + y*y + z*z; }
         void   normalize()              { (*this)/=(std::sqrt(sqnorm()));} 
 
+#ifdef RR_SIMD
+        // w is left untouched by the arithmetic, same as the scalar path
+        float3& operator += (float3 const& o) { return assign_xyz(simd::add(load(), o.load())); }
+        float3& operator -= (float3 const& o) { return assign_xyz(simd::sub(load(), o.load())); }
+        float3& operator *= (float3 const& o) { return assign_xyz(simd::mul(load(), o.load())); }
+        float3& operator *= (float c) { return assign_xyz(simd::mul(load(), simd::splat(c))); }
+        float3& operator /= (float c) { return assign_xyz(simd::mul(load(), simd::splat(1.f / c))); }
+
+        simd::vec4 load() const { return simd::load(&x); }
+        void store(simd::vec4 v) { simd::store(&x, v); }
+        float3& assign_xyz(simd::vec4 v) { store(simd::select_xyz(v, load())); return *this; }
+#else
         float3& operator += (float3 const& o) { x+=o.x; y+=o.y; z+= o.z; return *this;}
         float3& operator -= (float3 const& o) { x-=o.x; y-=o.y; z-= o.z; return *this;}
         float3& operator *= (float3 const& o) { x*=o.x; y*=o.y; z*= o.z; return *this;}
         float3& operator *= (float c) { x*=c; y*=c; z*= c; return *this;}
         float3& operator /= (float c) { float cinv = 1.f/c; x*=cinv; y*=cinv; z*=cinv; return *this;}
+#endif
 
         float x, y, z, w;
     };
 
+    // Kernels and serialized scenes read float3 as 4 packed floats with either setting
+    static_assert(sizeof(float3) == 4 * sizeof(float), "float3 has to stay 4 packed floats");
+#ifdef RR_SIMD
+    static_assert(alignof(float3) == 16, "float3 is loaded with aligned vector loads");
+#endif
+
     typedef float3 float4;
 
 
@@ -106,6 +127,31 @@ namespace RadeonRays
         return float3(v1.y * v2.z - v2.y * v1.z, v2.x * v1.z - v1.x * v2.z, v1.x * v2.y - v1.y * v2.x);
     }
 
+#ifdef RR_SIMD
+    inline float3 vmin(float3 const& v1, float3 const& v2)
+    {
+        float3 res;
+        res.store(simd::zero_w(simd::min(v1.load(), v2.load())));
+        return res;
+    }
+
+    inline void vmin(float3 const& v1, float3 const& v2, float3& v)
+    {
+        v.assign_xyz(simd::min(v1.load(), v2.load()));
+    }
+
+    inline float3 vmax(float3 const& v1, float3 const& v2)
+    {
+        float3 res;
+        res.store(simd::zero_w(simd::max(v1.load(), v2.load())));
+        return res;
+    }
+
+    inline void vmax(float3 const& v1, float3 const& v2, float3& v)
+    {
+        v.assign_xyz(simd::max(v1.load(), v2.load()));
+    }
+#else
     inline float3 vmin(float3 const& v1, float3 const& v2)
     {
         return float3(std::min(v1.x, v2.x), std::min(v1.y, v2.y), std::min(v1.z, v2.z));
@@ -129,4 +175,5 @@ namespace RadeonRays
         v.y = std::max(v1.y, v2.y);
         v.z = std::max(v1.z, v2.z);
     }
+#endif
 }
\ No newline at end of file
@@ -107,6 +107,22 @@ namespace RadeonRays
         spherical_to_cartesian(sph.x, sph.y, sph.z, cart); 
     }
 
+#ifdef RR_SIMD
+    /// Transform a point using a matrix
+    inline float3 transform_point(float3 const& p, matrix const& m)
+    {
+        simd::vec4 c0 = m.row(0), c1 = m.row(1), c2 = m.row(2), c3 = m.row(3);
+        simd::transpose(c0, c1, c2, c3);
+
+        simd::vec4 r = simd::madd(c0, simd::splat(p.x), c3);
+        r = simd::madd(c1, simd::splat(p.y), r);
+        r = simd::madd(c2, simd::splat(p.z), r);
+
+        float3 res;
+        res.store(simd::zero_w(r));
+        return res;
+    }
+#else
     /// Transform a point using a matrix
     inline float3 transform_point(float3 const& p, matrix const& m)
     {
@@ -116,6 +132,7 @@ namespace RadeonRays
         res.z += m.m23;
         return res;
     }
+#endif
 
     /// Transform a vector using a matrix
     inline float3 transform_vector(float3 const& v, matrix const& m)
@@ -138,6 +155,32 @@ namespace RadeonRays
         return ray(transform_point(r.o, m), transform_vector(r.d, m), r.o.w, r.d.w);
     }
     
+#ifdef RR_SIMD
+    /// Transform bounding box
+    /// Each matrix column contributes to the new box by the smaller and larger of its
+    /// products with the box extremes, which bounds all 8 transformed corners (Arvo)
+    inline bbox transform_bbox(bbox const& b, matrix const& m)
+    {
+        simd::vec4 c0 = m.row(0), c1 = m.row(1), c2 = m.row(2), c3 = m.row(3);
+        simd::transpose(c0, c1, c2, c3);
+
+        simd::vec4 newmin = c3;
+        simd::vec4 newmax = c3;
+        simd::vec4 const cols[3] = { c0, c1, c2 };
+        for (int i = 0; i < 3; ++i)
+        {
+            simd::vec4 lo = simd::mul(cols[i], simd::splat(b.pmin[i]));
+            simd::vec4 hi = simd::mul(cols[i], simd::splat(b.pmax[i]));
+            newmin = simd::add(newmin, simd::min(lo, hi));
+            newmax = simd::add(newmax, simd::max(lo, hi));
+        }
+
+        bbox newbox;
+        newbox.pmin.store(simd::zero_w(newmin));
+        newbox.pmax.store(simd::zero_w(newmax));
+        return newbox;
+    }
+#else
     /// Transform bounding box
     inline bbox transform_bbox(bbox const& b, matrix const& m)
     {
@@ -156,6 +199,7 @@ namespace RadeonRays
         
         return newbox;
     }
+#endif
 
     /// Solve quadratic equation
     /// Returns false in case of no real roots exist
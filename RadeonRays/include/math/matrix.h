@@ -26,10 +26,11 @@ THE SOFTWARE.
 #include <cstring>
 
 #include "float3.h"
+#include "simd.h"
 
 namespace RadeonRays
 {
-    class matrix
+    class RR_SIMD_ALIGN matrix
     {
     public:
         matrix(float mm00 = 1.f, float mm01 = 0.f, float mm02 = 0.f, float mm03 = 0.f,
@@ -59,6 +60,11 @@ namespace RadeonRays
             return *this;
         }
 
+#ifdef RR_SIMD
+        simd::vec4 row(int i) const { return simd::load(m[i]); }
+        void set_row(int i, simd::vec4 v) { simd::store(m[i], v); }
+#endif
+
         matrix operator-() const;
         matrix transpose() const;
         float  trace() const { return m00 + m11 + m22 + m33; }
@@ -81,6 +87,12 @@ namespace RadeonRays
         };
     };
 
+    // Row major 4x4 floats with either setting, rows are loaded with aligned vector loads by the SIMD path
+    static_assert(sizeof(matrix) == 16 * sizeof(float), "matrix has to stay 16 packed floats");
+#ifdef RR_SIMD
+    static_assert(alignof(matrix) == 16, "matrix rows are loaded with aligned vector loads");
+#endif
+
 
     inline matrix matrix::operator -() const
     {
@@ -91,6 +103,49 @@ namespace RadeonRays
         return res;
     }
 
+#ifdef RR_SIMD
+    inline matrix operator*(matrix const& m1, matrix const& m2);
+
+    inline matrix matrix::transpose() const
+    {
+        simd::vec4 r0 = row(0), r1 = row(1), r2 = row(2), r3 = row(3);
+        simd::transpose(r0, r1, r2, r3);
+        matrix res;
+        res.set_row(0, r0);
+        res.set_row(1, r1);
+        res.set_row(2, r2);
+        res.set_row(3, r3);
+        return res;
+    }
+
+    inline matrix& matrix::operator += (matrix const& o)
+    {
+        for (int i = 0; i < 4; ++i)
+            set_row(i, simd::add(row(i), o.row(i)));
+        return *this;
+    }
+
+    inline matrix& matrix::operator -= (matrix const& o)
+    {
+        for (int i = 0; i < 4; ++i)
+            set_row(i, simd::sub(row(i), o.row(i)));
+        return *this;
+    }
+
+    inline matrix& matrix::operator *= (matrix const& o)
+    {
+        *this = *this * o;
+        return *this;
+    }
+
+    inline matrix& matrix::operator *= (float c)
+    {
+        simd::vec4 const cc = simd::splat(c);
+        for (int i = 0; i < 4; ++i)
+            set_row(i, simd::mul(row(i), cc));
+        return *this;
+    }
+#else
     inline matrix matrix::transpose() const
     {
         matrix res;
@@ -139,6 +194,7 @@ namespace RadeonRays
                 m[i][j] *= c; 
         return *this;
     }
+#endif
 
     inline matrix operator+(matrix const& m1, matrix const& m2)
     {
@@ -152,6 +208,23 @@ namespace RadeonRays
         return res-=m2;
     }
 
+#ifdef RR_SIMD
+    inline matrix operator*(matrix const& m1, matrix const& m2)
+    {
+        // Row i of the product is a combination of the rows of m2 weighted by row i of m1
+        simd::vec4 const b0 = m2.row(0), b1 = m2.row(1), b2 = m2.row(2), b3 = m2.row(3);
+        matrix res;
+        for (int i = 0; i < 4; ++i)
+        {
+            simd::vec4 r = simd::mul(simd::splat(m1.m[i][0]), b0);
+            r = simd::madd(simd::splat(m1.m[i][1]), b1, r);
+            r = simd::madd(simd::splat(m1.m[i][2]), b2, r);
+            r = simd::madd(simd::splat(m1.m[i][3]), b3, r);
+            res.set_row(i, r);
+        }
+        return res;
+    }
+#else
     inline matrix operator*(matrix const& m1, matrix const& m2)
     {
         matrix res;
@@ -166,6 +239,7 @@ namespace RadeonRays
         }
         return res;
     }
+#endif
 
     inline matrix operator*(matrix const& m, float c)
     {
@@ -179,6 +253,21 @@ namespace RadeonRays
         return res*=c;
     }
 
+#ifdef RR_SIMD
+    inline float3 operator * (matrix const& m, float3 const& v)
+    {
+        simd::vec4 c0 = m.row(0), c1 = m.row(1), c2 = m.row(2), c3 = m.row(3);
+        simd::transpose(c0, c1, c2, c3);
+
+        simd::vec4 r = simd::mul(c0, simd::splat(v.x));
+        r = simd::madd(c1, simd::splat(v.y), r);
+        r = simd::madd(c2, simd::splat(v.z), r);
+
+        float3 res;
+        res.store(simd::zero_w(r));
+        return res;
+    }
+#else
     inline float3 operator * (matrix const& m, float3 const& v)
     {
         float3 res;
@@ -192,6 +281,7 @@ namespace RadeonRays
 
         return res;
     }
+#endif
 
     inline matrix inverse(matrix const& m)
     {
@@ -0,0 +1,140 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+/**
+    Four wide float vector used by the host math types when RR_SIMD_MATH is defined
+    and by the CPU traversal.
+
+    RR_SIMD_SSE or RR_SIMD_NEON is defined depending on the target, if neither
+    instruction set is available callers fall back to scalar code. RR_SIMD_MATH
+    switches the math types to the vector implementation and changes the alignment
+    of float3 and matrix to 16 bytes, so every module including these headers has
+    to be built with the same setting.
+ */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   define RR_SIMD_SSE 1
+#   include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#   define RR_SIMD_NEON 1
+#   include <arm_neon.h>
+#endif
+
+#if defined(RR_SIMD_MATH) && (defined(RR_SIMD_SSE) || defined(RR_SIMD_NEON))
+#define RR_SIMD 1
+#define RR_SIMD_ALIGN alignas(16)
+#else
+#define RR_SIMD_ALIGN
+#endif
+
+#if defined(RR_SIMD_SSE) || defined(RR_SIMD_NEON)
+namespace RadeonRays
+{
+    namespace simd
+    {
+#if defined(RR_SIMD_SSE)
+        typedef __m128 vec4;
+
+        inline vec4 load(float const* p)              { return _mm_load_ps(p); }
+        inline vec4 loadu(float const* p)             { return _mm_loadu_ps(p); }
+        inline void store(float* p, vec4 v)           { _mm_store_ps(p, v); }
+        inline vec4 splat(float c)                    { return _mm_set1_ps(c); }
+        inline vec4 add(vec4 a, vec4 b)               { return _mm_add_ps(a, b); }
+        inline vec4 sub(vec4 a, vec4 b)               { return _mm_sub_ps(a, b); }
+        inline vec4 mul(vec4 a, vec4 b)               { return _mm_mul_ps(a, b); }
+        inline vec4 madd(vec4 a, vec4 b, vec4 c)      { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+        // Operands are swapped to return a for NaNs, same as std::min(a, b) and std::max(a, b)
+        inline vec4 min(vec4 a, vec4 b)               { return _mm_min_ps(b, a); }
+        inline vec4 max(vec4 a, vec4 b)               { return _mm_max_ps(b, a); }
+
+        // xyz lanes of a, w lane of b
+        inline vec4 select_xyz(vec4 a, vec4 b)
+        {
+            __m128 const mask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+            return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+        }
+
+        // xyz lanes of a, w lane zeroed
+        inline vec4 zero_w(vec4 a)
+        {
+            __m128 const mask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+            return _mm_and_ps(mask, a);
+        }
+
+        // Bit i is set if lane i of a is less than or equal to lane i of b
+        inline int le_mask(vec4 a, vec4 b)            { return _mm_movemask_ps(_mm_cmple_ps(a, b)); }
+
+        inline void transpose(vec4& r0, vec4& r1, vec4& r2, vec4& r3)
+        {
+            _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+        }
+#else
+        typedef float32x4_t vec4;
+
+        inline vec4 load(float const* p)              { return vld1q_f32(p); }
+        inline vec4 loadu(float const* p)             { return vld1q_f32(p); }
+        inline void store(float* p, vec4 v)           { vst1q_f32(p, v); }
+        inline vec4 splat(float c)                    { return vdupq_n_f32(c); }
+        inline vec4 add(vec4 a, vec4 b)               { return vaddq_f32(a, b); }
+        inline vec4 sub(vec4 a, vec4 b)               { return vsubq_f32(a, b); }
+        inline vec4 mul(vec4 a, vec4 b)               { return vmulq_f32(a, b); }
+        inline vec4 madd(vec4 a, vec4 b, vec4 c)      { return vmlaq_f32(c, a, b); }
+        inline vec4 min(vec4 a, vec4 b)               { return vminq_f32(a, b); }
+        inline vec4 max(vec4 a, vec4 b)               { return vmaxq_f32(a, b); }
+
+        inline uint32x4_t xyz_mask()
+        {
+            static uint32_t const mask[4] = { 0xffffffffu, 0xffffffffu, 0xffffffffu, 0u };
+            return vld1q_u32(mask);
+        }
+
+        // xyz lanes of a, w lane of b
+        inline vec4 select_xyz(vec4 a, vec4 b) { return vbslq_f32(xyz_mask(), a, b); }
+
+        // xyz lanes of a, w lane zeroed
+        inline vec4 zero_w(vec4 a) { return vsetq_lane_f32(0.f, a, 3); }
+
+        // Bit i is set if lane i of a is less than or equal to lane i of b
+        inline int le_mask(vec4 a, vec4 b)
+        {
+            static uint32_t const bits[4] = { 1u, 2u, 4u, 8u };
+            uint32x4_t const m = vandq_u32(vcleq_f32(a, b), vld1q_u32(bits));
+            uint32x2_t const h = vorr_u32(vget_low_u32(m), vget_high_u32(m));
+            return static_cast<int>(vget_lane_u32(h, 0) | vget_lane_u32(h, 1));
+        }
+
+        inline void transpose(vec4& r0, vec4& r1, vec4& r2, vec4& r3)
+        {
+            float32x4x2_t t02 = vzipq_f32(r0, r2);
+            float32x4x2_t t13 = vzipq_f32(r1, r3);
+            float32x4x2_t c01 = vzipq_f32(t02.val[0], t13.val[0]);
+            float32x4x2_t c23 = vzipq_f32(t02.val[1], t13.val[1]);
+            r0 = c01.val[0];
+            r1 = c01.val[1];
+            r2 = c23.val[0];
+            r3 = c23.val[1];
+        }
+#endif
+    }
+}
+
+#endif
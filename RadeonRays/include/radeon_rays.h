@@ -28,8 +28,14 @@ THE SOFTWARE.
 #include "math/matrix.h"
 #include "math/ray.h"
 #include "math/mathutils.h"
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
         
-#define RADEONRAYS_API_VERSION 2.0
+// Bumped whenever the interfaces change layout, the shared library soname is derived from it
+#define RADEONRAYS_API_VERSION 3.0
 
 #if !RR_STATIC_LIBRARY
 #ifdef WIN32
@@ -71,6 +77,8 @@ namespace RadeonRays
             kOpenCL = 0x1,
             kVulkan = 0x2,
             kEmbree = 0x4,
+            // Built-in CPU traversal, available in every build
+            kNative = 0x8,
 
             kAny = 0xFF
         };
@@ -87,6 +95,27 @@ namespace RadeonRays
     // Forward declaration of entities
     typedef int Id;
     const Id kNullId = -1;
+    // Maximum number of hits per ray returned by QueryIntersectionMulti
+    const int kMaxMultiHits = 8;
+    // Maximum number of float4 vertex attributes of a mesh interpolated by QueryIntersectionAttributes
+    const int kMaxVertexAttributes = 4;
+    // Maximum image width and height of QueryIntersection2D
+    const int kMaxImageSize = 32768;
+    // Maximum number of scene layers, see IntersectionApi::CreateLayer
+    const int kMaxLayers = 8;
+
+    // How the geometry of a shape is going to change, 2-level BVHs choose the builder of each mesh by it
+    enum BuildHint
+    {
+        // Built as set by the bvh2l.bottom.* and bvh.* options
+        kBuildDefault,
+        // Vertices never change, built with SAH regardless of the options, updated vertices rebuild instead of refit
+        kBuildStatic,
+        // Only the transform changes, built as by default
+        kBuildDynamic,
+        // Vertices are updated every frame, built as an LBVH and refitted on updates
+        kBuildDeforming
+    };
 
     // Shape interface to repesent intersectable entities
     // The shape is assigned a particular ID which
@@ -100,10 +129,12 @@ namespace RadeonRays
         virtual void SetTransform(matrix const& m, matrix const& minv) = 0;
         virtual void GetTransform(matrix& m, matrix& minv) const = 0;
 
-        // Motion blur
+        // Motion blur, the shape is translated by v * time for rays with time in [0, 1],
+        // moving shapes select the 2-level intersector, motion is applied on OpenCL only
         virtual void SetLinearVelocity(float3 const& v) = 0;
         virtual float3 GetLinearVelocity() const = 0;
 
+        // Stored for the intersectors, currently not applied in traversal
         virtual void SetAngularVelocity(quaternion const& q) = 0;
         virtual quaternion GetAngularVelocity() const = 0;
 
@@ -113,7 +144,27 @@ namespace RadeonRays
 
         // Geometry mask to mask out intersections
         virtual void SetMask(int mask) = 0;
+        // Mask tested against rays. Once scene layers exist and the shape has been committed,
+        // the layer bits are its layer membership rather than the bits passed to SetMask,
+        // see IntersectionApi::CreateLayer
         virtual int  GetMask() const = 0;
+
+        // Replace vertex positions keeping the topology, vertices holds as many positions as
+        // the mesh was created with. The next commit refits the acceleration structure where
+        // the intersector supports it. Meshes referencing caller memory switch to the passed
+        // array, nullptr means their memory has been updated in place. Only meshes support it.
+        virtual void UpdateVertices(float const* vertices, int vstride) = 0;
+
+        // Attach numattributes float4 attributes per vertex, e.g. normals and texture coordinates, interpolated
+        // at the hits of QueryIntersectionAttributes. Attribute j of vertex i starts at attributes[4 * (i * numattributes + j)],
+        // the array is copied. 0 attributes detach them, 1 <= numattributes <= kMaxVertexAttributes otherwise.
+        // Only meshes support it, instances use the attributes of their base shape.
+        virtual void SetVertexAttributes(float const* attributes, int numattributes) = 0;
+
+        // Build quality hint, kBuildDefault unless set. It is applied the next time the BVH
+        // of the mesh is built, instances follow the hint of their base shape.
+        virtual void SetBuildHint(BuildHint hint) = 0;
+        virtual BuildHint GetBuildHint() const = 0;
     };
 
     // Buffer represents a chunk of memory hosted inside the API
@@ -133,6 +184,19 @@ namespace RadeonRays
         virtual bool Complete() const = 0;
         // Blocks execution until the event is completed
         virtual void Wait() = 0;
+        // Calls callback(userdata) once the event is completed, right away on the calling
+        // thread if it already is and from a runtime or service thread otherwise, so the
+        // callback must not block. The event has to stay alive until the callback is called,
+        // Wait still reports errors of the action afterwards.
+        typedef void (*CompletionFunc)(void* userdata);
+        virtual void OnComplete(CompletionFunc callback, void* userdata);
+    };
+
+    // Immutable copy of a committed scene, APIs created from it share its device memory
+    class RRAPI SceneSnapshot
+    {
+    public:
+        virtual ~SceneSnapshot() = 0;
     };
 
     // Exception class
@@ -160,12 +224,271 @@ namespace RadeonRays
         Intersection();
     };
 
+    // Primitive overlapping a box of IntersectionApi::QueryOverlap,
+    // must match Overlap struct on the GPU side exactly!
+    struct Overlap
+    {
+        // Shape ID
+        Id shapeid;
+        // Primitve ID
+        Id primid;
+    };
+
+    // Closest surface point of IntersectionApi::QueryClosestPoint,
+    // must match ClosestPoint struct on the GPU side exactly!
+    struct ClosestPoint
+    {
+        // Shape ID, kNullId if there is no surface within the distance
+        Id shapeid;
+        // Primitve ID
+        Id primid;
+
+        int padding0;
+        int padding1;
+
+        // Barycentrics of the point as for hits, distance to the query point in w
+        float4 uvwt;
+        // Point on the surface
+        float4 p;
+    };
+
+    // Compact hit record written by QueryIntersection if "acc.hit.format" option is "compact",
+    // must match PackedIntersection struct on the GPU side exactly!
+    struct PackedIntersection
+    {
+        // Shape ID
+        Id shapeid;
+        // Primitve ID
+        Id primid;
+        // Barycentrics as half floats, u in the low 16 bits, see GetPackedUv
+        std::uint32_t uv;
+        // Hit distance
+        float t;
+    };
+
+    // Compact 32 byte ray read by queries if "acc.ray.format" option is "compact",
+    // must match PackedRay struct on the GPU side exactly! Use PackRay to fill it.
+    struct PackedRay
+    {
+        // Origin, w holds maxt with the sign bit set for inactive rays
+        float4 o;
+        // Direction, w holds time as a half float in the low 16 bits
+        // and the low 16 bits of the ray mask in the high ones
+        float4 d;
+    };
+
+    // Camera of the built-in primary ray generator, see IntersectionApi::QueryPrimaryPinhole.
+    // Pixel (x, y) of a width x height image gets direction forward + sx * right + sy * up,
+    // sx = 2 * (x + 0.5) / width - 1, sy = 2 * (y + 0.5) / height - 1, so right and up
+    // hold the image plane half extents at unit distance.
+    struct PinholeCamera
+    {
+        // Position, w holds maxt of the rays
+        float4 position;
+        float4 forward;
+        float4 right;
+        float4 up;
+    };
+
+    // Order the rays of an image-shaped batch are traversed in, see IntersectionApi::QueryIntersection2D
+    enum RayOrder
+    {
+        // User order, no remapping
+        kRayOrderScanline = 0,
+        // Morton order of the pixels
+        kRayOrderMorton = 1,
+        // Scanline order of 8x8 pixel tiles, scanline order within a tile
+        kRayOrderTiled = 2
+    };
+
+    // Scheduling class of subsequent queries, see IntersectionApi::SetQueryPriority
+    enum QueryPriority
+    {
+        // Queue 0
+        kQueryPriorityNormal = 0,
+        // Latency bound work, e.g. queries of the next viewport frame
+        kQueryPriorityHigh = 1,
+        // Throughput work filling idle device time, e.g. light baking
+        kQueryPriorityLow = 2
+    };
+
+    // Kind of rays of subsequent queries, see IntersectionApi::SetQueryHint
+    enum QueryHint
+    {
+        // Traversal selected by the options
+        kQueryHintDefault = 0,
+        // Rays with similar origins and directions, e.g. primary rays
+        kQueryHintCoherent = 1,
+        // Rays in random directions, e.g. diffuse bounces
+        kQueryHintIncoherent = 2,
+        // Rays with a small maxt, e.g. ambient occlusion
+        kQueryHintShortRays = 3,
+        // Occlusion rays towards lights
+        kQueryHintShadow = 4
+    };
+
     enum MapType
     {
         kMapRead = 0x1,
         kMapWrite = 0x2
     };
 
+    // How the host accesses a buffer, see IntersectionApi::CreateBuffer
+    enum BufferUsage
+    {
+        // Accessed by queries, host reads and writes are rare
+        kBufferDefault = 0,
+        // Written or read back by the host on every query, e.g. rays and hits.
+        // Allocated in pinned host memory, which is zero-copy on integrated GPUs, or in fine-grained
+        // shared virtual memory mapped in place on OpenCL 2.0 devices supporting it
+        kBufferStream = 0x1
+    };
+
+    // Acceleration structure statistics of the last commit, see IntersectionApi::GetStats.
+    // Values the current acceleration structure doesn't provide are 0.
+    struct AccelStats
+    {
+        // Tree shape, 2-level structures sum up all the trees, depth goes through both levels
+        int num_nodes;
+        int num_leaves;
+        int max_depth;
+        float avg_leaf_prims;
+        // SAH cost relative to a single primitive test, of the top level tree for 2-level structures
+        float sah_cost;
+        // Primitives built over and their references in leaves,
+        // the difference is the number of spatial split duplicates
+        int num_primitives;
+        int num_refs;
+        // Device memory in bytes
+        size_t node_memory;
+        size_t vertex_memory;
+        size_t face_memory;
+        // Traversal stacks, shape data and lookup tables
+        size_t other_memory;
+        // Tree construction and the whole commit including translation and upload, in milliseconds
+        float build_time;
+        float commit_time;
+    };
+
+    // Host mesh description for IntersectionApi::CreateMeshes, fields match CreateMesh arguments
+    struct MeshDesc
+    {
+        // Position data
+        float const* vertices;
+        int vnum;
+        int vstride;
+        // Index data for vertices
+        int const* indices;
+        int istride;
+        // Numbers of vertices per face
+        int const* numfacevertices;
+        // Number of faces
+        int numfaces;
+    };
+
+    // Kind of query submitted by IntersectionApi::SubmitQueries
+    enum QueryType
+    {
+        // Closest hit, hits are written as by QueryIntersection
+        kQueryIntersection = 0,
+        // Any hit, hits are written as by QueryOcclusion
+        kQueryOcclusion = 1
+    };
+
+    // Query description for IntersectionApi::SubmitQueries, fields match QueryIntersection arguments
+    struct QueryDesc
+    {
+        QueryType type;
+        Buffer const* rays;
+        int numrays;
+        Buffer* hits;
+    };
+
+    // Structure of arrays ray layout, element i of every stream belongs to ray i.
+    // Rays are active and have zero time.
+    struct RayLayout
+    {
+        // 3 floats per ray, tightly packed
+        Buffer const* origins;
+        Buffer const* directions;
+        // Float per ray, nullptr for unbounded rays
+        Buffer const* maxt;
+        // Int per ray, nullptr for all mask bits set
+        Buffer const* masks;
+    };
+
+    // Structure of arrays hit layout, element i of every stream belongs to ray i.
+    // Streams which are nullptr are not written.
+    struct HitLayout
+    {
+        // Id per ray, kNullId for missed rays
+        Buffer* shapeids;
+        Buffer* primids;
+        // 2 floats per ray, barycentrics of the hit, untouched for missed rays
+        Buffer* uvs;
+        // Float per ray, distance of the hit, untouched for missed rays
+        Buffer* distances;
+    };
+
+    // Device time spent in a kernel, collected while the "profile.kernels" option is set
+    struct KernelProfile
+    {
+        // Kernel name, e.g. "hlbvh.morton"
+        char const* name;
+        // Number of launches
+        int calls;
+        // Total time in milliseconds
+        float time;
+    };
+
+    // Per-ray counters of a closest hit traversal, written while the "profile.traversal_stats" option is set,
+    // see IntersectionApi::SetTraversalStatsBuffer. Inactive rays get zeros.
+    struct TraversalStats
+    {
+        // Bounding boxes tested
+        int nodes;
+        // Primitives intersected in leafs
+        int primitives;
+        // Short stack offloads to global memory, counted by "fatbvh", "fatbvh_q" and "hlbvh" only
+        int spills;
+        // Traversal loop iterations
+        int iterations;
+    };
+
+    // Counter of TraversalStats, see BuildTraversalHistogram
+    enum TraversalCounter
+    {
+        kTraversalNodes = 0,
+        kTraversalPrimitives = 1,
+        kTraversalSpills = 2,
+        kTraversalIterations = 3
+    };
+
+    // Ring of ray and hit buffers for streaming closest hit queries, see IntersectionApi::CreateRayStream.
+    // The host fills the rays of the next batch while the previous ones are traced:
+    //    ray* rays = stream->AcquireRays(); ... stream->Submit(n);
+    //    Intersection const* hits = stream->AcquireHits(&n); ...
+    // Hits come back in submission order. At most depth batches can be submitted or have their hits
+    // held at once, AcquireRays throws once all of them are, so tracing a batch while the next one is
+    // filled and the hits of the previous one are read takes 3 slots. The stream is not thread safe.
+    class RRAPI RayStream
+    {
+    public:
+        virtual ~RayStream() = 0;
+        // Host memory for the rays of the next batch, blocks until its slot is free.
+        // Returns the same memory until the batch is submitted.
+        virtual ray* AcquireRays() = 0;
+        // Find closest intersections of the first numrays acquired rays, the call is asynchronous
+        virtual void Submit(int numrays) = 0;
+        // Hits of the oldest submitted batch, blocks until they are ready. They stay valid
+        // until the next AcquireHits, numrays receives the size of the batch and might be nullptr.
+        virtual Intersection const* AcquireHits(int* numrays) = 0;
+        // Hand the slot of the acquired hits back before the next AcquireHits
+        virtual void ReleaseHits() = 0;
+        // Maximum number of rays per batch
+        virtual int GetMaxRays() const = 0;
+    };
+
     // IntersectionApi is designed to provide fast means for ray-scene intersection
     // for AMD architectures. It effectively absracts underlying AMD hardware and
     // software stack and allows user to issue low-latency batched ray queries.
@@ -190,6 +513,41 @@ namespace RadeonRays
         // device(s) to use
         static void SetPlatform(const DeviceInfo::Platform platform);
 
+        // Directory to store compiled GPU kernels in, so subsequent processes
+        // can skip their compilation. Entries are keyed by kernel sources, build
+        // options, device name and driver version. Call before Create*, affects
+        // APIs created afterwards. Caching is disabled if not set or set to nullptr
+        static void SetKernelCachePath(char const* path);
+
+        // Run OpenCL commands on out of order queues, so independent queries and
+        // transfers can overlap on the device. Dependencies are derived from the
+        // buffers commands access. Call before Create*, affects APIs created
+        // afterwards. Disabled by default, ignored by other platforms
+        static void SetOutOfOrderQueues(bool enable);
+
+        // Host memory callbacks for BVH build temporaries, e.g. to serve them from
+        // preallocated arenas. alloc returns size bytes aligned to alignment or nullptr,
+        // free releases memory returned by alloc, both are called from build threads
+        // with userdata. Allocations keep the callbacks they were made with, so they
+        // and userdata have to stay valid until the APIs are deleted. Call before
+        // Create*, nullptr alloc restores the default allocator
+        typedef void* (*AllocFunc)(std::size_t size, std::size_t alignment, void* userdata);
+        typedef void (*FreeFunc)(void* ptr, void* userdata);
+        static void SetAllocator(AllocFunc alloc, FreeFunc free, void* userdata);
+
+        // Number of threads host BVH builds and mesh creation use and number of
+        // threads of the CPU device query pools, zero means hardware concurrency.
+        // With low_priority_builds the build threads the library starts, including
+        // the one running CommitAsync, run below normal priority, Commit builds on
+        // the calling thread at its priority. Call before Create*
+        static void SetThreadLimits(int build_threads, int query_threads, bool low_priority_builds);
+
+        // Pin query threads of the CPU devices to NUMA nodes and give each node a
+        // contiguous share of the rays of a query, so rays mostly stay in the memory
+        // of the node tracing them. No-op on systems with a single node. Call before
+        // Create*, disabled by default
+        static void SetNumaAware(bool enable);
+
 
         /******************************************
         Device management
@@ -205,9 +563,34 @@ namespace RadeonRays
         API lifetime management
         ******************************************/
         static IntersectionApi* Create(std::uint32_t devidx);
+        // Create API splitting each query between GPU device devidx and the built-in
+        // CPU device in proportion to their measured throughput. Queries are blocking.
+        static IntersectionApi* CreateHybrid(std::uint32_t devidx);
+        // Create API sharing each query between count devices, every device
+        // holds a copy of the scene and traces a range of the ray batch.
+        static IntersectionApi* CreateMultiDevice(std::uint32_t const* devidx, std::uint32_t count);
+        // Create API tracing on count worker nodes running ServeRemote, endpoints are "host:port"
+        // strings. Committed scenes are sent to all the workers, queries stream the rays to them
+        // in chunks and the hits back, see the "remote.*" options. Buffers live in host memory and
+        // queries are blocking, only QueryIntersection and QueryOcclusion are supported.
+        // Returns nullptr if an endpoint is malformed, failed connections throw.
+        static IntersectionApi* CreateRemote(char const* const* endpoints, std::uint32_t count);
+        // Serve a single CreateRemote client with device devidx on the port of the local address,
+        // loopback unless given. Clients aren't authenticated, so only bind addresses reachable from
+        // trusted hosts. Port 0 picks a free port, ready is called with the bound port once the worker
+        // listens, might be nullptr. The call is blocking and returns once the client disconnects.
+        typedef void (*ServeReadyFunc)(std::uint16_t port, void* userdata);
+        static void ServeRemote(std::uint32_t devidx, std::uint16_t port, char const* address = "127.0.0.1",
+            ServeReadyFunc ready = nullptr, void* userdata = nullptr);
+        // Create API querying the scene of a snapshot. It shares the device, the scene memory
+        // and buffers with the API the snapshot was taken from, but submits to its own queue
+        // and has its own events, so several of them can query concurrently. Its scene can't
+        // be changed, Commit throws. The snapshot may be deleted while the API is alive.
+        static IntersectionApi* CreateFromSnapshot(SceneSnapshot const* snapshot);
 
         // Deallocation
         static void Delete(IntersectionApi* api);
+        static void DeleteSnapshot(SceneSnapshot* snapshot);
 
         /******************************************
         Geometry manipulation
@@ -217,6 +600,8 @@ namespace RadeonRays
         // The mesh might be mixed quad\triangle mesh which is determined
         // by numfacevertices array containing numfaces entries describing
         // the number of vertices for current face (3 or 4)
+        // The 2-level intersector ("bvh.force2level" or instances) intersects quads natively
+        // as a single primitive, their hits report uv in the unit square spanned by the quad.
         // The call is blocking, so the returned value is ready upon return.
         virtual Shape* CreateMesh(
             // Position data
@@ -229,19 +614,101 @@ namespace RadeonRays
             int  numfaces
             ) const = 0;
 
+        // Create a triangle mesh referencing the caller memory instead of copying it.
+        // The vertex and index arrays must stay valid and unchanged until the shape
+        // is deleted, strides are in bytes and 0 means dense packing.
+        virtual Shape* CreateMeshFromExternalMemory(
+            // Position data
+            float const * vertices, int vnum, int vstride,
+            // Index data for vertices, 3 per face
+            int const * indices, int istride,
+            // Number of faces
+            int  numfaces
+            ) const = 0;
+
+        // Create a triangle mesh reading positions and indices from buffers created by
+        // CreateBuffer, CreateFromOpenClBuffer or CreateFromVulkanBuffer, so interop geometry
+        // never travels through the host. The buffers are referenced, must stay valid until
+        // the shape is deleted and are read again on every commit. Strides are in bytes and
+        // 0 means dense packing. Only supported by the OpenCL HLBVH intersector.
+        virtual Shape* CreateMeshFromDeviceBuffers(
+            // Position data, 3 floats per vertex
+            Buffer const* vertices, int vnum, int vstride,
+            // Index data for vertices, 3 ints per face
+            Buffer const* indices, int istride,
+            // Number of faces
+            int  numfaces
+            ) const = 0;
+
+        // Create a shape of count spheres intersected analytically, hits report the sphere
+        // index as the primitive ID and the spherical coordinates of the hit point around
+        // the center, divided by 2 pi and pi, as uv. Centers have 3 floats per sphere.
+        // Only supported by the flat "bvh" intersector, which is used for scenes holding
+        // spheres whatever "acc.type" is, spheres can't be instanced.
+        virtual Shape* CreateSpheres(float const* centers, float const* radii, int count) const = 0;
+
+        // Create count meshes at once, constructing them in parallel. Shapes are written
+        // to out in the order of descs and get consecutive IDs. The call is blocking.
+        virtual void CreateMeshes(MeshDesc const* descs, int count, Shape** out) const = 0;
+
         // Create an instance of a shape with its own transform (set via Shape interface).
         // The call is blocking, so the returned value is ready upon return.
         virtual Shape* CreateInstance(Shape const* shape) const = 0;
+        // Create an instance with up to 4 levels of detail. shapes[0] is used near the instance,
+        // shapes[i] from distances[i - 1] to the world space bounds center of shapes[0] on, so
+        // distances has count - 1 increasing entries. The OpenCL 2-level intersector picks the
+        // level per ray on entering the instance, randomly within the "bvh2l.lod.transition"
+        // band around the thresholds. Hits report the instance ID and the primitive IDs of the
+        // level hit. Other intersectors and instances inside groups always use shapes[0].
+        virtual Shape* CreateLodInstance(Shape const* const* shapes, float const* distances, int count) const = 0;
+        // Create a group of meshes and instances, which can only be used as the base shape of instances.
+        // Instances nest up to 4 levels deep, memory stays proportional to the unique geometry.
+        // Masks, transforms and IDs of shapes inside groups are read on commits changing the scene,
+        // hits report the ID of the shape attached to the scene. OpenCL only.
+        virtual Shape* CreateGroup(Shape const* const* shapes, int count) const = 0;
         // Delete the shape (to simplify DLL boundary crossing
         virtual void DeleteShape(Shape const* shape) = 0;
         // Attach shape to participate in intersection process
         virtual void AttachShape(Shape const* shape) = 0;
+        // Attach count shapes at once, cheaper than attaching them one by one
+        virtual void AttachShapes(Shape const* const* shapes, int count) = 0;
         // Detach shape, i.e. it is not going to be considered part of the scene anymore
         virtual void DetachShape(Shape const* shape) = 0;
         // Detach all objects
         virtual void DetachAll() = 0;
+        // Create a named scene layer, a subset of the attached shapes sharing the acceleration structure
+        // of the scene. Layer i takes mask bit i of shapes in place of their own mask, so rays with
+        // the mask GetLayerMask(i) only hit shapes of layer i and switching layers needs no commit.
+        // Once a layer exists, shapes outside of it are hidden from its rays and mask updates
+        // of layer members are applied on commit. Layers need the ray mask tests compiled in with
+        // the enable_raymask premake option and a GPU device, CreateLayer throws otherwise.
+        // Returns the layer index, throws if all kMaxLayers layers exist or the name is taken.
+        virtual int CreateLayer(char const* name) = 0;
+        // Index of the layer with the name, -1 if there is none
+        virtual int GetLayer(char const* name) const = 0;
+        // Add the shape to or remove it from the layer, a shape can be in several layers
+        virtual void SetLayerMembership(int layer, Shape const* shape, bool member) = 0;
         // Commit all geometry creations/changes
         virtual void Commit() = 0;
+        // Commit all geometry creations/changes without blocking. The acceleration structure
+        // is built on a worker thread, queries keep using the previously committed one until
+        // the event completes. Shapes can be attached and detached meanwhile, but the committed
+        // ones must not be changed or deleted before the event completes. Build errors are
+        // thrown from Event::Wait. Event pointer might be nullptr.
+        virtual void CommitAsync(Event** event) = 0;
+        // Abort the build of the running CommitAsync, e.g. when the scene has been changed meanwhile.
+        // Builds check for it at large BVH nodes and between stages, the event throws from Wait and
+        // the previously committed scene stays in use. Commit and devices building in place can't
+        // be cancelled. Does nothing if no build is running.
+        virtual void CancelCommit() = 0;
+        // Receive the progress of commits in [0..1], calls come from build threads one at a time.
+        // Waits for CommitAsync, nullptr func stops reporting.
+        typedef void (*ProgressFunc)(float progress, void* userdata);
+        virtual void SetProgressCallback(ProgressFunc func, void* userdata) = 0;
+        // Capture the committed scene for CreateFromSnapshot, waits for CommitAsync. Later commits
+        // build into new device memory and don't change the snapshot, shapes can be changed or
+        // deleted. OpenCL and Vulkan devices only.
+        virtual SceneSnapshot* CreateSnapshot() = 0;
         //Sets the shape id allocator to its default value (1)
         virtual void ResetIdCounter() = 0;
         //Returns true if no shapes are in the world
@@ -252,6 +719,12 @@ namespace RadeonRays
         ******************************************/
         // Create a buffer to use the most efficient acceleration possible
         virtual Buffer* CreateBuffer(size_t size, void* initdata) const = 0;
+        // Create a buffer placed according to the usage hint
+        virtual Buffer* CreateBuffer(size_t size, void* initdata, BufferUsage usage) const = 0;
+        // Create a buffer wrapping host memory without copying, queries read and write it in place.
+        // The memory should outlive the buffer. Supported by CPU devices and OpenCL devices with
+        // host unified memory, page aligned memory avoids driver copies on the latter.
+        virtual Buffer* CreateBufferFromHostPtr(void* ptr, size_t size) const = 0;
         // Delete the buffer
         virtual void DeleteBuffer(Buffer* buffer) const = 0;
         // Map buffer. Event pointer might be nullptr.
@@ -264,6 +737,22 @@ namespace RadeonRays
           Events handling
         *******************************************/
         virtual void DeleteEvent(Event* event) const = 0;
+        // Event completing once all the events are, pass it as waitevent of a call depending
+        // on several others. GPU devices keep the dependencies on the device, CPU devices wait
+        // for the events before returning. nullptr entries are skipped, delete the event as usual.
+        virtual void JoinEvents(Event const* const* events, int count, Event** event) const = 0;
+        // Block until all the events are complete, nullptr entries are skipped
+        virtual void WaitForEvents(Event* const* events, int count) const = 0;
+
+        /******************************************
+          Streaming
+        *******************************************/
+        // Create a stream of depth >= 2 slots of maxrays rays each, its buffers are allocated with
+        // kBufferStream. Queries are issued on the queue of the API, with full ray and hit formats.
+        // The stream has to be deleted before the API.
+        virtual RayStream* CreateRayStream(int maxrays, int depth) const = 0;
+        // Delete the stream, waits for its queries
+        virtual void DeleteRayStream(RayStream* stream) const = 0;
 
         /******************************************
           Ray casting
@@ -276,6 +765,31 @@ namespace RadeonRays
         // The call is asynchronous. Event pointer mights be nullptrs.
         virtual void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const = 0;
 
+        // Submit count queries in order with a single call, arguments are validated once. On OpenCL devices
+        // consecutive small queries of the same type are traversed in shared dispatches, queries writing
+        // the same hit buffer never share one. Other devices run them one by one.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        virtual void SubmitQueries(QueryDesc const* descs, int count, Event const* waitevent, Event** event) const = 0;
+
+        // Find closest intersection of rays in structure of arrays layout, hits are split into the streams of the
+        // hit layout. OpenCL devices convert the layouts on the device with coalesced stream accesses, other devices
+        // convert them on the host and complete the query before returning.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        virtual void QueryIntersection(RayLayout const& rays, int numrays, HitLayout const& hits, Event const* waitevent, Event** event) const = 0;
+        // Find any intersection of rays in structure of arrays layout, results are written as by QueryOcclusion.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        virtual void QueryOcclusion(RayLayout const& rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const = 0;
+
+        // Find closest intersection distances for depth passes, distances holds a float per ray, -1 for missed and
+        // inactive rays. On OpenCL devices hits are reduced on the device, other devices reduce them on the host.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        virtual void QueryDistance(Buffer const* rays, int numrays, Buffer* distances, Event const* waitevent, Event** event) const = 0;
+        // Count occluded rays of every group of groupsize consecutive rays for ambient occlusion passes, counts holds
+        // (numrays + groupsize - 1) / groupsize ints, the last group might be partial. Inactive rays are not occluded.
+        // On OpenCL devices results are reduced on the device, other devices reduce them on the host.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        virtual void QueryOcclusionCount(Buffer const* rays, int numrays, int groupsize, Buffer* counts, Event const* waitevent, Event** event) const = 0;
+
         // Find closest intersection, number of rays is in remote memory
         // The call is asynchronous. Event pointers might be nullptrs.
         virtual void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const = 0;
@@ -283,26 +797,263 @@ namespace RadeonRays
         // The call is asynchronous. Event pointer mights be nullptrs.
         virtual void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const = 0;
 
+        // Find any intersection, writing 1 bit per ray instead of an int.
+        // Bit i % 32 of word i / 32 of hitbits is set if ray i is occluded, inactive rays give 0,
+        // hitbits should hold GetPackedOcclusionSize(numrays) words. See IsOccluded and ForEachOccluded helpers.
+        // Supported by OpenCL devices only.
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        virtual void QueryOcclusionPacked(Buffer const* rays, int numrays, Buffer* hitbits, Event const* waitevent, Event** event) const = 0;
+        // Find any intersection writing 1 bit per ray, number of rays is in remote memory
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        virtual void QueryOcclusionPacked(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitbits, Event const* waitevent, Event** event) const = 0;
+
+        // Find k closest intersections in a single traversal, 1 <= k <= kMaxMultiHits.
+        // hitinfos holds numrays * k hit records, hits of ray i start at i * k and are sorted by distance,
+        // missing ones have kNullId shapeid. Supported by "fatbvh", "fatbvh_q", "fatbvh_h" and 2-level BVH on OpenCL devices.
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        virtual void QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hitinfos, Event const* waitevent, Event** event) const = 0;
+        // Find k closest intersections, number of rays is in remote memory
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        virtual void QueryIntersectionMulti(Buffer const* rays, Buffer const* numrays, int maxrays, int k, Buffer* hitinfos, Event const* waitevent, Event** event) const = 0;
+
+        // Find closest intersection and interpolate the vertex attributes of the hit triangle with its barycentrics in
+        // the same kernel, while its vertices are still in cache. attributes holds numrays * numattributes float4,
+        // attribute j of ray i is at i * numattributes + j, 1 <= numattributes <= kMaxVertexAttributes. Missed rays,
+        // spheres and meshes with fewer attributes get zeros, inactive rays are left untouched.
+        // Supported by the "bvh" accelerator on OpenCL devices, so scenes without instances only.
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        virtual void QueryIntersectionAttributes(Buffer const* rays, int numrays, int numattributes, Buffer* hitinfos, Buffer* attributes, Event const* waitevent, Event** event) const = 0;
+
+        // Find any intersection testing the last occluder of every ray first, shadow rays of the same pixel and light
+        // are usually blocked by the same primitive sample after sample. occluders holds an int per ray, -1 before the
+        // first query, and is updated with the primitive blocking each occluded ray, the traversal is skipped while the
+        // stored one still blocks it. The values are internal to the scene build, stale ones after a commit only cost a
+        // traversal. Results are written as by QueryOcclusion, one int per ray.
+        // Supported by the "bvh" accelerator on OpenCL devices, so scenes without instances only.
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        virtual void QueryOcclusionCached(Buffer const* rays, int numrays, Buffer* occluders, Buffer* hitresults, Event const* waitevent, Event** event) const = 0;
+
+        // Find primitives overlapping axis aligned boxes by traversing the same BVH rays are traced against, so tools
+        // placing or colliding objects don't need a spatial index of their own. boxes holds count bbox records,
+        // overlaps holds count * maxoverlaps records, overlaps of box i start at i * maxoverlaps in no particular order.
+        // counts holds an int per box, the number of overlapping primitives, which might exceed maxoverlaps, only the
+        // first maxoverlaps are written then. Triangles and spheres are tested exactly, with "acc.triangle.precompute"
+        // triangles are tested by the bounds of their leaves, which is conservative. Empty boxes overlap nothing.
+        // Supported by the "bvh" accelerator on OpenCL devices, so scenes without instances only.
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        virtual void QueryOverlap(Buffer const* boxes, int count, int maxoverlaps, Buffer* overlaps, Buffer* counts, Event const* waitevent, Event** event) const = 0;
+
+        // Find the closest surface points, e.g. for baking, distance fields or snapping, by traversing the same BVH
+        // rays are traced against and pruning nodes farther than the closest point found so far. points holds count
+        // float3 records, results count ClosestPoint records. Only surfaces within maxdist of a point are considered,
+        // points without one get kNullId shapeid and maxdist distance, so a tight maxdist speeds the query up.
+        // Supported by the "bvh" accelerator on OpenCL devices and by the CPU device, so scenes without instances
+        // on the GPU. The call is asynchronous. Event pointer mights be nullptrs.
+        virtual void QueryClosestPoint(Buffer const* points, int count, float maxdist, Buffer* results, Event const* waitevent, Event** event) const = 0;
+
+        // Find closest intersections of a width x height image-shaped batch, ray i belongs to pixel (i % width, i / width).
+        // The rays are traversed in the given order of their pixels, so neighbouring work items trace neighbouring
+        // pixels, and the hits are written in the original order. Width and height should not exceed kMaxImageSize.
+        // Orders other than kRayOrderScanline are applied on OpenCL devices with built-in primitives,
+        // other devices traverse in scanline order. The rays are traversed as coherent ones, see SetQueryHint,
+        // so kRayOrderTiled gives packets of 8x8 pixels.
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        virtual void QueryIntersection2D(Buffer const* rays, int width, int height, RayOrder order, Buffer* hitinfos, Event const* waitevent, Event** event) const = 0;
+
+        // Find closest intersections of the primary rays of a width x height pinhole camera. The rays are
+        // generated on the device, hit i belongs to pixel (i % width, i / width). Rays have all mask bits set.
+        // Supported by OpenCL devices only.
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        virtual void QueryPrimaryPinhole(PinholeCamera const& camera, int width, int height, Buffer* hitinfos, Event const* waitevent, Event** event) const = 0;
+        // Find any intersection of shadow rays going from the closest hits of rays towards a point light,
+        // results are written as by QueryOcclusion. Shadow rays start and end epsilon away from the hit point
+        // and the light, keep the mask and time of their rays, and are inactive for missed or inactive rays.
+        // Supported by OpenCL devices only.
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        virtual void QueryShadowFromHits(Buffer const* rays, Buffer const* hitinfos, int numrays, float3 const& light, float epsilon, Buffer* hitresults, Event const* waitevent, Event** event) const = 0;
+
+        // Copy rays of the first numrays keeping their order to the front of compacted, for wavefront loops running
+        // without host synchronization. Active rays are kept, or rays with a non-zero int in predicate if it isn't nullptr.
+        // The number of kept rays is written to newnumrays, which might be numrays, and the source index of every
+        // kept ray to indices if it isn't nullptr. rays and compacted have to be different buffers.
+        // Supported by OpenCL devices only.
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        virtual void CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* compacted, Buffer* newnumrays, Buffer* indices, Event const* waitevent, Event** event) const = 0;
+        // Sort indices of the first numrays rays by the shape ID of their closest hits in hitinfos, so shading can
+        // be grouped by material. Rays with a hit come first in increasing shape ID order followed by the missed ones,
+        // indices holds maxrays ints. The number of hits is written to numhits, which might be numrays, if it isn't
+        // nullptr. Hits of inactive rays are taken as they are in hitinfos.
+        // Supported by OpenCL devices only.
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        virtual void SortHits(Buffer const* hitinfos, Buffer const* numrays, int maxrays, Buffer* indices, Buffer* numhits, Event const* waitevent, Event** event) const = 0;
+
+        /******************************************
+          Queue management
+        ******************************************/
+        // Get the number of device queues work can be submitted to
+        virtual std::uint32_t GetQueueCount() const = 0;
+        // Select the queue for subsequent buffer operations and queries.
+        // Work on different queues may overlap, pass waitevent to order it.
+        // Queries of APIs on different queues may be issued from several host threads at once,
+        // on OpenCL devices they are submitted concurrently, queries to the same queue are
+        // serialized. The queue of an API must not be changed while another thread queries it.
+        virtual void SetQueue(std::uint32_t queue) = 0;
+        // Select the queue of the priority class as SetQueue does. OpenCL devices create the high and
+        // low priority queues with cl_khr_priority_hints where it is supported, Vulkan queue priorities
+        // are fixed by the device passed in, so there the classes only get queues of their own. Closest hit
+        // and occlusion launches of more than "acc.lowpriority.slice" rays on the low priority queue are
+        // split and submitted slice by slice, so high priority queries are scheduled in between.
+        // Devices with a single queue ignore it.
+        virtual void SetQueryPriority(QueryPriority priority) = 0;
+        // Hint the kind of rays of subsequent QueryIntersection, QueryOcclusion and SubmitQueries calls,
+        // so the device picks the traversal suiting them. On OpenCL devices with built-in primitives
+        // incoherent rays are sorted before traversal as with "acc.reorder", from the commit following
+        // the first incoherent query if the option is not set, the other hints traverse rays in the user
+        // order. Closest hit queries of coherent rays traverse the "bvh" intersector in packets of 64
+        // consecutive rays sharing node fetches, unless "acc.octant_links" or "acc.persistent" is set.
+        // Queries sharing a dispatch ignore the hint, other devices ignore it.
+        virtual void SetQueryHint(QueryHint hint) = 0;
+        // Set the buffer closest hit queries write a TraversalStats record per ray to while "profile.traversal_stats"
+        // is set, nullptr unsets it. The buffer should hold a record per ray of the largest query, queries throw if it
+        // is not set or too small. Records follow the traversal order, which is the sorted one if rays are sorted,
+        // see "acc.reorder". Packet traversal is disabled by the option. OpenCL devices only, others ignore it.
+        virtual void SetTraversalStatsBuffer(Buffer* stats) = 0;
+
         /******************************************
         Utility
         ******************************************/
         // Supported options:
         // option "bvh.type" values {"bvh" (regular bvh, default), "qbvh" (4 branching factor), "hlbvh" (fast builds)}
+        // option "acc.type" values {"bvh" (skip links, default), "fatbvh" (short stack), "fatbvh_q" (short stack, quantized nodes),
+        //         "fatbvh_h" (short stack, half float nodes, size of "fatbvh_q" with tighter bounds for small coordinates), "bvh4" (4-wide nodes, short stack), "hlbvh" (fast builds),
+        //         "hlbvh_sah" (fast builds, binned SAH over Morton clusters for the upper levels, OpenCL only),
+        //         "hlbvh_ploc" (device builds by parallel locally-ordered clustering, close to SAH quality, OpenCL only),
+        //         "hashbvh" (stackless, no traversal stack memory, OpenCL only),
+        //         "auto" (picked from the scene size, rebuild rate and device type, instances still use 2-level),
+        //         "fatbvh2l" (scenes with instances use a 2-level BVH with short stack traversal of fat nodes at both levels
+        //         instead of skip links, groups, moving shapes, compact faces and quantized vertices still use skip links,
+        //         flat scenes use "fatbvh", OpenCL only)}
+        // option "acc.persistent" values {0(default), 1} (skip links traversal with work groups fetching ray batches
+        //         until all rays are done, launches only as many groups as the device can keep resident, OpenCL only)
+        // option "acc.indirect" values {0, 1(default)} (queries taking the number of rays from a device buffer use the persistent
+        //         skip links kernels, so the work launched follows the live ray count rather than maxrays, OpenCL only)
+        // option "acc.reorder" values {0(default), 1} (sort rays by direction octant and origin before traversal
+        //         and scatter hits back, improves incoherent ray performance, OpenCL only)
+        // option "acc.shortstack.autotune" values {0(default), 1} (benchmark short stack and work group sizes for
+        //         "fatbvh" once per device on first commit and keep the fastest, OpenCL only)
+        // option "acc.hit.format" values {"full"(default), "compact"} (QueryIntersection writes 16 byte PackedIntersection records
+        //         with half float barycentrics instead of Intersection, OpenCL only)
+        // option "acc.ray.format" values {"full"(default), "compact"} (queries read 32 byte PackedRay records instead of ray,
+        //         time is kept as a half float and only the low 16 bits of the ray mask are kept, OpenCL only)
+        // option "acc.triangle.precompute" values {0(default), 1} (the "bvh" intersector stores a 48 byte transform per face in BVH
+        //         order and tests it with a single contiguous load instead of fetching 3 vertices, OpenCL only, ignored elsewhere)
+        // option "acc.octant_links" values {0(default), 1} (the "bvh" intersector keeps a child order and skip links per ray
+        //         direction octant, visiting near children first for any direction, 64 extra bytes per node, OpenCL only, ignored elsewhere)
+        // option "acc.face.format" values {"full"(default), "compact"} (the 2-level BVH stores 8 byte faces with 16-bit mesh-local
+        //         vertex indices, meshes with 65535 or more vertices take 16 bytes per face, IDs are taken from the shapes and
+        //         primitive IDs from the face position, "mem.budget" and "bvh.2level.device_rebuild" are ignored then, OpenCL only)
+        // option "acc.vertex.format" values {"full"(default), "quantized"} (the 2-level BVH stores 6 byte vertices as 16-bit unorm
+        //         positions within the bounds of the mesh vertices, mesh BVHs are grown by a quantization step to stay conservative,
+        //         positions move by up to half a step, "mem.budget" and "bvh.2level.device_rebuild" are ignored then, OpenCL only)
+        // option "acc.occlusion.compact" values {0(default), 1} (QueryOcclusion writes 1 bit per ray, bit i % 32 of word i / 32
+        //         is set if ray i is occluded, inactive rays give 0, rays are not reordered, OpenCL only)
+        // option "acc.shared_memory" values {0(default), 1} (BVH, vertex and face buffers are allocated in fine-grained shared
+        //         virtual memory and written by the host in place instead of copied by the device, OpenCL 2.0 devices reporting
+        //         fine-grained buffer SVM only, e.g. APUs, ignored elsewhere)
+        // option "acc.lowpriority.slice" values {0, N(default = 262144)} (closest hit and occlusion launches of the "bvh" intersector
+        //         on the low priority queue, see SetQueryPriority, are split into launches of N rays flushed one by one, persistent
+        //         and packet traversal launches are not split, 0 disables splitting, OpenCL devices with several queues only)
+        // option "acc.batch" values {0(default), N} (QueryIntersection and QueryOcclusion calls with fewer than N rays are collected
+        //         and traversed in a single dispatch of up to N rays once it fills up, their events are waited or polled, or the API
+        //         makes another call on the queue, returned events complete with the combined dispatch, OpenCL only)
+        // option "mem.budget" values {float, default = 0.f} (device memory in MB the 2-level BVH may take for nodes, faces, vertices
+        //         and shape data, meshes exceeding it are kept on the host in pages and the pages reached by the rays of a query
+        //         are uploaded and traversed one after another, queries block until the pages are known and share the uploaded
+        //         pages, so they should stay on one queue, multi-hit queries are not supported then, 0 keeps everything resident, OpenCL without motion blur only)
+        // option "mem.keep_host_copies" values {0, 1(default)} (0 drops host BVHs, translated nodes and face copies once they are
+        //         uploaded, refits, ID and mask updates and 2-level top level rebuilds then rebuild from the world instead, pages
+        //         of "mem.budget" stay on the host, "hlbvh" builds on the device and keeps nothing)
+        // option "bvh.cache.path" (directory to store built BVHs keyed by scene geometry and bvh.* options, disabled if not set)
         // option "bvh.force2level" values {0(default), 1}
         //         by default 2-level BVH is used only if there is instancing in the scene or
         //         motion blur is enabled. 1 forces 2-level BVH for all cases.
-        // option "bvh.builder" values {"sah" (use surface area heuristic), "median" (use spatial median, faster to build, default)}
+        // option "bvh.2level.device_rebuild" values {0(default), 1} (2-level BVH rebuilds meshes with updated vertices as LBVHs
+        //         on the device in a single batch instead of refitting them on the host, OpenCL only)
+        // option "bvh.2level.device_top_level" values {0(default), 1} (2-level BVH rebuilds the top level as an LBVH on the device
+        //         when only shapes move, bounds are calculated from shape transforms by a kernel, OpenCL without motion blur only)
+        // option "bvh.2level.dedup" values {0(default), 1} (2-level BVH finds meshes with the same vertices and faces by content
+        //         hashes at full rebuilds and traverses them as instances of the first one, sharing its BVH, faces and vertices,
+        //         updating vertices of such a mesh rebuilds the scene)
+        // option "bvh2l.top.builder", "bvh2l.bottom.builder" values as "bvh.builder" (builders of the top level and group BVHs
+        //         rebuilt on shape changes and of the mesh BVHs kept across commits of 2-level BVHs, e.g. "sah" bottom levels under an
+        //         "lbvh" top level, "bvh.builder" is used until set, spatial splits are not supported by 2-level BVHs)
+        // option "bvh2l.top.sah.num_bins", "bvh2l.top.sah.traversal_cost", "bvh2l.bottom.sah.num_bins",
+        //         "bvh2l.bottom.sah.traversal_cost" (per level "bvh.sah.num_bins" and "bvh.sah.traversal_cost", used until set)
+        // option "bvh.2level.tight_instance_bounds" values {0(default), 1} (2-level BVH bounds instances and group shapes by a few
+        //         transformed nodes of their BVH instead of its transformed root bounds, tighter for rotated thin shapes, not used
+        //         by "bvh.2level.device_top_level" builds)
+        // option "bvh2l.lod.transition" values {float, default = 0.1f} (level of detail instances compare ray origin distances
+        //         jittered randomly by up to this fraction against their thresholds, blending levels around them, 0 switches
+        //         sharply, clamped to 0.5)
+        // option "bvh.refit.rotations" values {0(default), 1} (2-level BVH refits of meshes with updated vertices swap nodes
+        //         above moved faces with their grandchildren when that reduces the SAH cost, close to refit cost)
+        // option "bvh.refit.max_degradation" values {float, default = 0.f} (2-level BVH rebuilds a refitted mesh BVH on the host
+        //         once its SAH cost exceeds the cost after the build by this fraction, e.g. 0.5 = 50% worse, 0 disables)
+        // option "bvh.refit.background" values {0(default), 1} (degraded mesh BVHs are rebuilt on a background thread and
+        //         picked up by the first refit after the build completes, the refitted ones are traversed meanwhile)
+        // option "bvh.builder" values {"sah" (use surface area heuristic), "median" (use spatial median, faster to build, default),
+        //         "lbvh" (Morton order, sorted and emitted in parallel, fastest host build with lower tree quality, ignored with splits)}
         // option "bvh.sah.use_splits" values {0(default),1} (allow spatial splits for BVH)
+        // option "bvh.presplit.budget" values {float, default = 0.f} (split bounds of faces wasting a lot of space into references
+        //         clipped to the face before "bvh", "fatbvh", "bvh4", "bittrail" and "hlbvh" builds, the value is the number of extra
+        //         references relative to the number of faces, e.g. 0.3 = 30% more, 0 disables, ignored with spatial splits)
+        // option "bvh.sah.num_bins" values {int, default = 64} (centroid bins per axis at the largest SAH nodes, smaller nodes
+        //         bin with fewer and nodes below 32 primitives evaluate every split between sorted centroids exactly)
         // option "bvh.sah.traversal_cost" values {float, default = 10.f for GPU } (cost of node traversal vs triangle intersection)
+        // option "bvh.sah.calibrate" values {0(default), 1} (replace "bvh.sah.traversal_cost" by the node to triangle cost ratio
+        //         measured with the traversal kernels of the device on two synthetic scenes, runs once per device and node layout
+        //         in the process and slows the first commit down. "fatbvh" variants on OpenCL only)
         // option "bvh.sah.min_overlap" values { float < 1.f, default = 0.005f } 
         //         (overlap area which is considered for a spatial splits, fraction of parent bbox)
+        // option "bvh.sah.max_leaf_prims" values {int 1..8, default = 1} (largest leaf SAH may keep instead of splitting further,
+        //         leaf faces are stored contiguously, used by "bvh" on OpenCL, fewer nodes and traversal steps on dense meshes)
         // option "bvh.sah.max_split_depth" values {int, default = 10} (max depth in the tree where spatial split can happen)
         // option "bvh.sah.extra_node_budget" values {float, default = 1.f} (maximum node memory budget compared to normal bvh (2*num_tris - 1), for ex. 0.3 = 30% more nodes allowed
+        // option "bvh.layout" values {"bfs"(default), "veb"} (node order in memory of "fatbvh", "veb" stores nodes in van Emde Boas
+        //         order keeping nearby tree levels close to each other, traversal is unchanged)
+        // option "hlbvh.restructure_passes" values {int, default = 0} (treelet restructuring passes after "hlbvh" build, improve
+        //         trace speed at the cost of build time, OpenCL only)
+        // option "hlbvh.single_pass" values {0(default), 1} (emit "hlbvh" and "hlbvh_sah" nodes and bounds bottom-up in one launch
+        //         instead of emission and refit, the tree is the same, OpenCL only)
+        // option "hlbvh.sah.top_bits" values {int 1..63, default = 18} (Morton code bits resolved by the SAH top tree of "hlbvh_sah",
+        //         primitives sharing these bits form a cluster, bvh.sah.traversal_cost and bvh.sah.num_bins apply)
+        // option "hlbvh.ploc.radius" values {int 1..64, default = 16} (clusters of "hlbvh_ploc" in Morton order searched for
+        //         the nearest neighbour, larger radius gives better trees and slower builds)
+        // option "profile.kernels" values {0(default), 1} (time kernel launches with device timestamps, read with GetKernelProfile,
+        //         launches returning an event are waited for, on Vulkan the time of the whole dispatch batch is reported.
+        //         GPU devices only)
+        // option "profile.traversal_stats" values {0(default), 1} (compile closest hit kernels counting nodes, primitives,
+        //         stack spills and iterations per ray, see SetTraversalStatsBuffer, slows traversal down. OpenCL only)
+        // option "remote.partition" values {0(default), 1} (workers of CreateRemote hold parts of the scene split by whole shapes
+        //         along the largest axis of their centers with even primitive counts instead of copies of it, every worker traces
+        //         all the rays and the closest hits are merged, so scene memory scales with the workers rather than throughput)
+        // option "remote.chunk_rays" values {int, default = 65536} (rays sent to a CreateRemote worker per message, rounded up to
+        //         a multiple of 32, the worker traces a chunk while the next one is received)
         // Set API global option: string
         virtual void SetOption(char const* name, char const* value) = 0;
         // Set API global option: float
         virtual void SetOption(char const* name, float value) = 0;
 
+        // Get kernel times accumulated since profiling has been enabled or the last reset,
+        // waits for the profiled launches to finish. Up to maxprofiles entries are written,
+        // profiles might be nullptr. Returns the number of profiled kernels.
+        // Names are valid until the next reset.
+        virtual int GetKernelProfile(KernelProfile* profiles, int maxprofiles) const = 0;
+        // Drop accumulated kernel times
+        virtual void ResetKernelProfile() = 0;
+        // Get statistics of the committed acceleration structure, GPU devices only
+        virtual void GetStats(AccelStats& stats) const = 0;
+
     protected:
         IntersectionApi();
         IntersectionApi(IntersectionApi const&);
@@ -320,9 +1071,201 @@ namespace RadeonRays
     {
     }
 
+    // Convert IEEE half float bits to float
+    inline float HalfToFloat(std::uint16_t h)
+    {
+        std::uint32_t const sign = static_cast<std::uint32_t>(h & 0x8000u) << 16;
+        std::uint32_t exponent = (h >> 10) & 0x1Fu;
+        std::uint32_t mantissa = h & 0x3FFu;
+        std::uint32_t bits = 0;
+
+        if (exponent == 0x1Fu)
+        {
+            // Inf or NaN
+            bits = sign | 0x7F800000u | (mantissa << 13);
+        }
+        else if (exponent != 0)
+        {
+            bits = sign | ((exponent + 112u) << 23) | (mantissa << 13);
+        }
+        else if (mantissa != 0)
+        {
+            // Denormal, normalize it
+            exponent = 113u;
+            while ((mantissa & 0x400u) == 0)
+            {
+                mantissa <<= 1;
+                --exponent;
+            }
+            bits = sign | (exponent << 23) | ((mantissa & 0x3FFu) << 13);
+        }
+        else
+        {
+            bits = sign;
+        }
+
+        float f;
+        std::memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+
+    // Convert float to IEEE half float bits, rounding to nearest even
+    inline std::uint16_t FloatToHalf(float f)
+    {
+        std::uint32_t bits;
+        std::memcpy(&bits, &f, sizeof(bits));
+
+        std::uint16_t const sign = static_cast<std::uint16_t>((bits >> 16) & 0x8000u);
+        int const exponent = static_cast<int>((bits >> 23) & 0xFFu) - 127 + 15;
+        std::uint32_t mantissa = bits & 0x7FFFFFu;
+
+        if (exponent == 0xFF - 127 + 15)
+        {
+            // Inf or NaN, keep NaN quiet
+            return static_cast<std::uint16_t>(sign | 0x7C00u | (mantissa ? 0x200u : 0u));
+        }
+
+        if (exponent >= 0x1F)
+        {
+            // Overflow
+            return static_cast<std::uint16_t>(sign | 0x7C00u);
+        }
+
+        std::uint32_t shift = 13;
+        std::uint32_t h = 0;
+
+        if (exponent > 0)
+        {
+            h = (static_cast<std::uint32_t>(exponent) << 10) | (mantissa >> 13);
+        }
+        else if (exponent >= -10)
+        {
+            // Denormal, add implicit bit
+            mantissa |= 0x800000u;
+            shift = static_cast<std::uint32_t>(14 - exponent);
+            h = mantissa >> shift;
+        }
+        else
+        {
+            // Underflow
+            return sign;
+        }
+
+        // Round to nearest even, carry into exponent is handled by the addition
+        std::uint32_t const rem = mantissa & ((1u << shift) - 1u);
+        std::uint32_t const half = 1u << (shift - 1u);
+        if (rem > half || (rem == half && (h & 1u)))
+        {
+            ++h;
+        }
+
+        return static_cast<std::uint16_t>(sign | h);
+    }
+
+    // Ray mask hitting the shapes of the layer, masks of several layers can be ORed to query their union
+    inline int GetLayerMask(int layer)
+    {
+        return 1 << layer;
+    }
+
+    // Convert the ray to the compact ray record
+    inline PackedRay PackRay(ray const& r)
+    {
+        float const maxt = std::abs(r.GetMaxT());
+        std::uint32_t maxtbits;
+        std::memcpy(&maxtbits, &maxt, sizeof(maxtbits));
+        maxtbits |= r.IsActive() ? 0u : 0x80000000u;
+
+        std::uint32_t const extrabits = FloatToHalf(r.GetTime()) |
+            (static_cast<std::uint32_t>(r.GetMask()) << 16);
+
+        PackedRay res;
+        res.o = r.o;
+        res.d = r.d;
+        std::memcpy(&res.o.w, &maxtbits, sizeof(maxtbits));
+        std::memcpy(&res.d.w, &extrabits, sizeof(extrabits));
+        return res;
+    }
+
+    // Decode barycentrics of the compact hit record
+    inline float2 GetPackedUv(PackedIntersection const& isect)
+    {
+        return float2(HalfToFloat(static_cast<std::uint16_t>(isect.uv & 0xFFFFu)),
+            HalfToFloat(static_cast<std::uint16_t>(isect.uv >> 16)));
+    }
+
+    // Number of 32-bit words needed to hold packed occlusion results of numrays rays
+    inline int GetPackedOcclusionSize(int numrays)
+    {
+        return (numrays + 31) / 32;
+    }
+
+    // Check packed occlusion result of the ray
+    inline bool IsOccluded(std::uint32_t const* hitbits, int index)
+    {
+        return ((hitbits[index >> 5] >> (index & 31)) & 1u) != 0;
+    }
+
+    // Call f(index) for every occluded ray of packed occlusion results, skipping empty words
+    template <typename F>
+    inline void ForEachOccluded(std::uint32_t const* hitbits, int numrays, F f)
+    {
+        // De Bruijn sequence lookup of the lowest set bit position
+        static int const kBitPosition[32] =
+        {
+            0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+            31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+        };
+
+        for (int i = 0; i < GetPackedOcclusionSize(numrays); ++i)
+        {
+            for (std::uint32_t word = hitbits[i]; word != 0; word &= word - 1)
+            {
+                std::uint32_t const lowest = word & (~word + 1u);
+                f(i * 32 + kBitPosition[(lowest * 0x077CB531u) >> 27]);
+            }
+        }
+    }
+
+    // Expand packed occlusion results into QueryOcclusion format (1 for hit and -1 for miss)
+    inline void UnpackOcclusion(std::uint32_t const* hitbits, int numrays, int* hitresults)
+    {
+        for (int i = 0; i < numrays; ++i)
+        {
+            hitresults[i] = IsOccluded(hitbits, i) ? 1 : -1;
+        }
+    }
+
+    // Count rays per bin of a traversal counter, ray i goes to bin min(value / binwidth, numbins - 1).
+    // histogram holds numbins ints and is overwritten.
+    inline void BuildTraversalHistogram(TraversalStats const* stats, int numrays, TraversalCounter counter, int binwidth, int numbins, int* histogram)
+    {
+        for (int i = 0; i < numbins; ++i)
+        {
+            histogram[i] = 0;
+        }
+
+        for (int i = 0; i < numrays; ++i)
+        {
+            int value = 0;
+            switch (counter)
+            {
+            case kTraversalNodes: value = stats[i].nodes; break;
+            case kTraversalPrimitives: value = stats[i].primitives; break;
+            case kTraversalSpills: value = stats[i].spills; break;
+            case kTraversalIterations: value = stats[i].iterations; break;
+            }
+
+            int const bin = value / binwidth;
+            ++histogram[bin < numbins ? bin : numbins - 1];
+        }
+    }
+
     inline Buffer::~Buffer(){}
     inline Shape::~Shape(){}
     inline Event::~Event(){}
+    inline SceneSnapshot::~SceneSnapshot(){}
+    inline RayStream::~RayStream(){}
     inline Exception::~Exception(){}
 }
 
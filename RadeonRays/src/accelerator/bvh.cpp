@@ -20,9 +20,12 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 ********************************************************************/
 #include "bvh.h"
+#include "sah_binner.h"
+#include "radeon_rays.h"
+#include "trace.h"
 
 #include <algorithm>
-#include <thread>
+#include <chrono>
 #include <stack>
 #include <numeric>
 #include <cassert>
@@ -31,15 +34,118 @@ THE SOFTWARE.
 
 namespace RadeonRays
 {
-    static int constexpr kMaxPrimitivesPerLeaf = 1;
+    // Minimum number of primitives in both children to build them as separate tasks
+    static int constexpr kParallelBuildThreshold = 4096;
+    // Minimum number of primitives in a node to bin and partition it using several threads
+    static int constexpr kParallelBinningThreshold = 65536;
+    // Minimum number of primitives processed by a single binning or partitioning job
+    static int constexpr kMinPrimsPerJob = 16384;
+
+    static bool same_bounds(bbox const& b1, bbox const& b2)
+    {
+        return b1.pmin.x == b2.pmin.x && b1.pmin.y == b2.pmin.y && b1.pmin.z == b2.pmin.z &&
+            b1.pmax.x == b2.pmax.x && b1.pmax.y == b2.pmax.y && b1.pmax.z == b2.pmax.z;
+    }
 
-    static bool is_nan(float v)
+    int Bvh::GetNumJobs(int numprims, int level)
     {
-        return v != v;
+        if (numprims < kParallelBinningThreshold)
+            return 1;
+
+        // Deeper nodes are already processed by concurrent subtree tasks,
+        // so the threads are shared between them
+        int numthreads = std::max(GetNumBuildThreads() >> std::min(level, 30), 1);
+        return std::max(std::min(numthreads, numprims / kMinPrimsPerJob), 1);
+    }
+
+    int Bvh::GetNumParallelLevels()
+    {
+        // Spawn subtree tasks until there are a few times more of them than cores
+        // to balance the load between unevenly sized subtrees
+        if (GetNumBuildThreads() == 1)
+            return 0;
+
+        int numlevels = 2;
+        while ((1 << numlevels) < 4 * GetNumBuildThreads())
+        {
+            ++numlevels;
+        }
+
+        return numlevels;
+    }
+
+    bool Bvh::IsLargeSplit(SplitRequest const& left, SplitRequest const& right)
+    {
+        return std::min(left.numprims, right.numprims) >= kParallelBuildThreshold;
+    }
+
+    bool Bvh::ShouldSpawnTasks(SplitRequest const& left, SplitRequest const& right) const
+    {
+        return left.level <= m_num_parallel_levels && IsLargeSplit(left, right);
+    }
+
+    void Bvh::ScheduleBuilds(int const* numprims, int count, std::function<void(int)> const& build)
+    {
+        RR_TRACE_SCOPE("Bvh::ScheduleBuilds");
+
+        std::vector<int> order(count);
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [numprims](int a, int b)
+        {
+            return numprims[a] > numprims[b];
+        });
+
+        // Root nodes of these are binned by several jobs and their subtrees spawn tasks
+        int numlarge = 0;
+        while (numlarge < count && GetNumJobs(numprims[order[numlarge]], 0) > 1)
+        {
+            build(order[numlarge++]);
+        }
+
+        int numsmall = count - numlarge;
+        if (numsmall == 0)
+        {
+            return;
+        }
+
+        // Each tree goes to the least loaded task, going from the largest ones keeps the tasks even
+        int numtasks = std::min(GetNumBuildThreads(), numsmall);
+        std::vector<std::vector<int>> tasks(numtasks);
+        std::vector<std::int64_t> loads(numtasks, 0);
+
+        for (int i = numlarge; i < count; ++i)
+        {
+            int task = static_cast<int>(std::min_element(loads.cbegin(), loads.cend()) - loads.cbegin());
+            tasks[task].push_back(order[i]);
+            // Tiny trees still have a fixed cost
+            loads[task] += numprims[order[i]] + 1;
+        }
+
+        ParallelForChunks(numtasks, 0, numtasks, [&tasks, &build](int, int begin, int end)
+        {
+            for (int task = begin; task < end; ++task)
+            {
+                for (auto i : tasks[task])
+                {
+                    build(i);
+                }
+            }
+        });
     }
 
     void Bvh::Build(bbox const* bounds, int numbounds)
     {
+        RR_TRACE_SCOPE("Bvh::Build");
+
+        auto start = std::chrono::high_resolution_clock::now();
+
+        if (m_monitor)
+        {
+            m_monitor->Check();
+            m_monitor->AddWork(numbounds);
+            m_monitored_prims = 0;
+        }
+
         for (int i = 0; i < numbounds; ++i)
         {
             // Calc bbox
@@ -47,6 +153,179 @@ namespace RadeonRays
         }
 
         BuildImpl(bounds, numbounds);
+
+        // Small trees and builders not advancing by subtrees report the whole tree
+        if (m_monitor && m_monitored_prims < numbounds)
+        {
+            m_monitor->Advance(numbounds - m_monitored_prims);
+        }
+
+        m_num_prims = numbounds;
+        m_build_cost = m_refit_cost = 0.f;
+        m_build_time = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+
+    void Bvh::Build(bbox const* bounds, int numbounds, int const* refprims, int numprims)
+    {
+        Build(bounds, numbounds);
+
+        // Leafs keep their slots, only the primitives in them are replaced
+        for (auto& index : m_packed_indices)
+        {
+            index = refprims[index];
+        }
+
+        m_num_prims = numprims;
+    }
+
+    void Bvh::Refit(bbox const* bounds, bool rotate)
+    {
+        RR_TRACE_SCOPE("Bvh::Refit");
+
+        if (m_nodecnt == 0)
+        {
+            return;
+        }
+
+        // Trees which are never refitted don't pay for the cost evaluation
+        if (m_build_cost == 0.f)
+        {
+            m_build_cost = ComputeSahCost();
+        }
+
+        // Rotations only look at nodes above leaves which have moved and change the height
+        std::vector<char> moved(rotate ? m_nodecnt.load() : 0);
+        std::vector<int> heights(rotate ? m_nodecnt.load() : 0);
+
+        // Children are always allocated after their parent, so walking the array
+        // backwards visits both children before the node
+        int const* indices = GetIndices();
+        for (int i = m_nodecnt - 1; i >= 0; --i)
+        {
+            Node& node = m_nodes[i];
+
+            if (node.type == kLeaf)
+            {
+                bbox const old_bounds = node.bounds;
+
+                // Spatial split references get their whole primitive bounds, which is conservative
+                node.bounds = bbox();
+                for (int j = 0; j < node.numprims; ++j)
+                {
+                    node.bounds.grow(bounds[indices[node.startidx + j]]);
+                }
+
+                if (rotate)
+                {
+                    moved[i] = !same_bounds(node.bounds, old_bounds);
+                    heights[i] = 0;
+                }
+            }
+            else
+            {
+                if (rotate)
+                {
+                    moved[i] = moved[node.lc] || moved[node.rc];
+
+                    if (moved[i])
+                    {
+                        Rotate(i, heights.data());
+                    }
+
+                    heights[i] = std::max(heights[node.lc], heights[node.rc]) + 1;
+                }
+
+                node.bounds = bboxunion(m_nodes[node.lc].bounds, m_nodes[node.rc].bounds);
+            }
+        }
+
+        if (rotate)
+        {
+            m_height = heights[0];
+        }
+
+        m_bounds = m_nodes[0].bounds;
+        m_refit_cost = ComputeSahCost();
+    }
+
+    void Bvh::Rotate(int nodeidx, int* heights)
+    {
+        Node& node = m_nodes[nodeidx];
+
+        // Swapping a child with a grandchild under its sibling only changes the area of the sibling.
+        // The child moving down has to come after the sibling in the array to keep refits bottom-up.
+        int* best_child = nullptr;
+        int* best_grandchild = nullptr;
+        bbox best_bounds;
+        float best_gain = 0.f;
+
+        int* children[] = { &node.lc, &node.rc };
+        for (int c = 0; c < 2; ++c)
+        {
+            int child = *children[c];
+            Node& sibling = m_nodes[*children[1 - c]];
+
+            if (sibling.type == kLeaf || child < *children[1 - c])
+            {
+                continue;
+            }
+
+            float area = sibling.bounds.surface_area();
+
+            int* grandchildren[] = { &sibling.lc, &sibling.rc };
+            for (int g = 0; g < 2; ++g)
+            {
+                bbox bounds = bboxunion(m_nodes[child].bounds, m_nodes[*grandchildren[1 - g]].bounds);
+                float gain = area - bounds.surface_area();
+
+                if (gain > best_gain)
+                {
+                    best_child = children[c];
+                    best_grandchild = grandchildren[g];
+                    best_bounds = bounds;
+                    best_gain = gain;
+                }
+            }
+        }
+
+        if (best_child)
+        {
+            int sibling = best_child == &node.lc ? node.rc : node.lc;
+            std::swap(*best_child, *best_grandchild);
+
+            m_nodes[sibling].bounds = best_bounds;
+            heights[sibling] = std::max(heights[m_nodes[sibling].lc], heights[m_nodes[sibling].rc]) + 1;
+        }
+    }
+
+    float Bvh::ComputeSahCost() const
+    {
+        float node_term, prim_term;
+        GetSahTerms(node_term, prim_term);
+        return m_traversal_cost * node_term + prim_term;
+    }
+
+    void Bvh::GetSahTerms(float& node_term, float& prim_term) const
+    {
+        float root_area = m_nodes[0].bounds.surface_area();
+        float inv_root_area = root_area > 0.f ? 1.f / root_area : 0.f;
+
+        // All the allocated nodes are in the tree, so the array is summed directly
+        node_term = prim_term = 0.f;
+        for (int i = 0; i < m_nodecnt; ++i)
+        {
+            Node const& node = m_nodes[i];
+            float area = node.bounds.surface_area() * inv_root_area;
+
+            if (node.type == kLeaf)
+            {
+                prim_term += area * node.numprims;
+            }
+            else
+            {
+                node_term += area;
+            }
+        }
     }
 
     bbox const& Bvh::Bounds() const
@@ -54,42 +333,83 @@ namespace RadeonRays
         return m_bounds;
     }
 
+    void Bvh::GetCutBounds(int maxcount, std::vector<bbox>& bounds) const
+    {
+        bounds.clear();
+
+        if (m_nodecnt == 0)
+        {
+            bounds.push_back(m_bounds);
+            return;
+        }
+
+        // Replace the internal node of the largest area with its children until the cut is full
+        std::vector<int> cut(1, 0);
+        while ((int)cut.size() < maxcount)
+        {
+            int best = -1;
+            float best_area = -1.f;
+            for (int i = 0; i < (int)cut.size(); ++i)
+            {
+                Node const& node = m_nodes[cut[i]];
+                float area = node.bounds.surface_area();
+                if (node.type == kInternal && area > best_area)
+                {
+                    best = i;
+                    best_area = area;
+                }
+            }
+
+            if (best < 0)
+            {
+                break;
+            }
+
+            Node const& node = m_nodes[cut[best]];
+            cut[best] = node.lc;
+            cut.push_back(node.rc);
+        }
+
+        for (auto nodeidx : cut)
+        {
+            bounds.push_back(m_nodes[nodeidx].bounds);
+        }
+    }
+
     void  Bvh::InitNodeAllocator(size_t maxnum)
     {
         m_nodecnt = 0;
         m_nodes.resize(maxnum);
     }
 
-    Bvh::Node* Bvh::AllocateNode()
+    int Bvh::AllocateNode()
     {
-        return &m_nodes[m_nodecnt++];
+        return m_nodecnt++;
     }
 
     void Bvh::BuildNode(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices)
     {
-        m_height = std::max(m_height, req.level);
+        UpdateHeight(req.level);
+        CheckMonitor(req.numprims);
 
-        Node* node = AllocateNode();
+        int nodeidx = AllocateNode();
+        Node* node = &m_nodes[nodeidx];
         node->bounds = req.bounds;
         node->index = req.index;
 
         // Create leaf node if we have enough prims
         if (req.numprims < 2)
         {
-#ifdef USE_TBB
-            primitive_mutex_.lock();
-#endif
+            // Leaves own disjoint ranges of primindices, so the packed
+            // indices are written in place and subtrees do not need to synchronize
             node->type = kLeaf;
-            node->startidx = static_cast<int>(m_packed_indices.size());
+            node->startidx = req.startidx;
             node->numprims = req.numprims;
 
-            for (auto i = 0U; i < req.numprims; ++i)
+            for (auto i = 0; i < req.numprims; ++i)
             {
-                m_packed_indices.push_back(primindices[req.startidx + i]);
+                m_packed_indices[req.startidx + i] = primindices[req.startidx + i];
             }
-#ifdef USE_TBB
-            primitive_mutex_.unlock();
-#endif
         }
         else
         {
@@ -101,25 +421,29 @@ namespace RadeonRays
             {
                 SahSplit ss = FindSahSplit(req, bounds, centroids, primindices);
 
+                // Leaf is cheaper than the best split, or primitives can't be binned
+                bool const makeleaf = req.numprims <= m_max_leaf_prims &&
+                    (is_nan(ss.split) || req.numprims < ss.sah);
+
                 if (!is_nan(ss.split))
                 {
                     axis = ss.dim;
                     border = ss.split;
+                }
 
-                    if (req.numprims < ss.sah && req.numprims < kMaxPrimitivesPerLeaf)
-                    {
-                        node->type = kLeaf;
-                        node->startidx = static_cast<int>(m_packed_indices.size());
-                        node->numprims = req.numprims;
-
-                        for (auto i = 0U; i < req.numprims; ++i)
-                        {
-                            m_packed_indices.push_back(primindices[req.startidx + i]);
-                        }
+                if (makeleaf)
+                {
+                    node->type = kLeaf;
+                    node->startidx = req.startidx;
+                    node->numprims = req.numprims;
 
-                        if (req.ptr) *req.ptr = node;
-                        return;
+                    for (auto i = 0; i < req.numprims; ++i)
+                    {
+                        m_packed_indices[req.startidx + i] = primindices[req.startidx + i];
                     }
+
+                    if (req.ptr) *req.ptr = nodeidx;
+                    return;
                 }
             }
 
@@ -131,7 +455,14 @@ namespace RadeonRays
 
             bool near2far = (req.numprims + req.startidx) & 0x1;
 
-            if (req.centroid_bounds.extents()[axis] > 0.f)
+            // Large nodes always take the stable partition, whatever the number of jobs,
+            // so the primitive order and the resulting tree do not depend on the thread count
+            if (req.centroid_bounds.extents()[axis] > 0.f && req.numprims >= kParallelBinningThreshold)
+            {
+                splitidx = PartitionParallel(req, axis, border, bounds, centroids, primindices,
+                    leftbounds, leftcentroid_bounds, rightbounds, rightcentroid_bounds);
+            }
+            else if (req.centroid_bounds.extents()[axis] > 0.f)
             {
                 auto first = req.startidx;
                 auto last = req.startidx + req.numprims;
@@ -228,29 +559,36 @@ namespace RadeonRays
             // Right request
             SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightcentroid_bounds, req.level + 1, (req.index << 1) + 1 };
 
+            // Build large subtrees on the top levels as independent tasks
+            if (ShouldSpawnTasks(leftrequest, rightrequest))
             {
-                // Put those to stack
-                BuildNode(leftrequest, bounds, centroids, primindices);
-            }
+                auto left = std::async(std::launch::async, [&]()
+                {
+                    SetBuildThreadPriority();
+                    BuildNode(leftrequest, bounds, centroids, primindices);
+                });
+
+                BuildNode(rightrequest, bounds, centroids, primindices);
 
+                left.get();
+            }
+            else
             {
+                BuildNode(leftrequest, bounds, centroids, primindices);
                 BuildNode(rightrequest, bounds, centroids, primindices);
             }
+
+            AdvanceMonitor(req.numprims, leftrequest.numprims, rightrequest.numprims);
         }
 
         // Set parent ptr if any
-        if (req.ptr) *req.ptr = node;
+        if (req.ptr) *req.ptr = nodeidx;
     }
 
     Bvh::SahSplit Bvh::FindSahSplit(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices) const
     {
         // SAH implementation
         // calc centroids histogram
-        // int const kNumBins = 128;
-        // moving split bin index
-        int splitidx = -1;
-        // Set SAH to maximum float value as a start
-        float sah = std::numeric_limits<float>::max();
         SahSplit split;
         split.dim = 0;
         split.split = std::numeric_limits<float>::quiet_NaN();
@@ -265,95 +603,207 @@ namespace RadeonRays
             return split;
         }
 
-        // Bin has bbox and occurence count
-        struct Bin
+        // Sorting a few primitives costs less than binning them and
+        // the leaf decision gets the exact cost of the best split
+        if (req.numprims < kSweepSahPrims)
         {
-            bbox bounds;
-            int count;
-        };
+            return FindSweepSplit(req, bounds, centroids, primindices);
+        }
 
-        // Keep bins for each dimension
-        std::vector<Bin> bins[3];
-        bins[0].resize(m_num_bins);
-        bins[1].resize(m_num_bins);
-        bins[2].resize(m_num_bins);
+        int numbins = GetNumBins(req.numprims);
 
-        // Precompute inverse parent area
+        // Keep histogram for each binning job,
+        // jobs bin disjoint primitive ranges and are merged afterwards
+        int numjobs = GetNumJobs(req.numprims, req.level);
+        std::vector<SahBinner> binners(numjobs, SahBinner(numbins, req.centroid_bounds));
+
+        // Calc primitive refs histogram
+        ParallelForChunks(numjobs, req.startidx, req.startidx + req.numprims, [&](int job, int begin, int end)
+        {
+            SahBinner& binner = binners[job];
+
+            for (int i = begin; i < end; ++i)
+            {
+                int idx = primindices[i];
+                binner.Add(bounds[idx], centroids[idx]);
+            }
+        });
+
+        for (int job = 1; job < numjobs; ++job)
+        {
+            binners[0].Merge(binners[job]);
+        }
+
+        // Start best SAH search
         float invarea = 1.f / req.bounds.surface_area();
-        // Precompute min point
-        float3 rootmin = req.centroid_bounds.pmin;
+        auto best = binners[0].FindBestSplit(m_traversal_cost, invarea, req.numprims);
 
-        // Evaluate all dimensions
-        for (int axis = 0; axis < 3; ++axis)
+        // Choose split plane
+        if (best.dim != -1)
         {
-            float rootminc = rootmin[axis];
-            // Range for histogram
-            float centroid_rng = centroid_extents[axis];
-            float invcentroid_rng = 1.f / centroid_rng;
+            split.dim = best.dim;
+            split.sah = best.sah;
+            split.split = req.centroid_bounds.pmin[split.dim] + (best.binidx + 1) * (centroid_extents[split.dim] / numbins);
+        }
+
+        return split;
+    }
+
+    Bvh::SahSplit Bvh::FindSweepSplit(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices) const
+    {
+        SahSplit split;
+        split.dim = 0;
+        split.split = std::numeric_limits<float>::quiet_NaN();
+        split.sah = std::numeric_limits<float>::max();
+
+        assert(req.numprims < kSweepSahPrims);
+
+        int sorted[kSweepSahPrims];
+        float rightarea[kSweepSahPrims];
+        float3 centroid_extents = req.centroid_bounds.extents();
+        float invarea = 1.f / req.bounds.surface_area();
 
+        for (int axis = 0; axis < 3; ++axis)
+        {
             // If the box is degenerate in that dimension skip it
-            if (centroid_rng == 0.f) continue;
+            if (centroid_extents[axis] == 0.f) continue;
 
-            // Initialize bins
-            for (unsigned i = 0; i < m_num_bins; ++i)
+            std::copy(primindices + req.startidx, primindices + req.startidx + req.numprims, sorted);
+            std::sort(sorted, sorted + req.numprims, [&](int a, int b)
             {
-                bins[axis][i].count = 0;
-                bins[axis][i].bounds = bbox();
+                return centroids[a][axis] < centroids[b][axis];
+            });
+
+            // rightarea[i] bounds primitives from i to the end
+            bbox right;
+            for (int i = req.numprims - 1; i > 0; --i)
+            {
+                right.grow(bounds[sorted[i]]);
+                rightarea[i] = right.surface_area();
             }
 
-            // Calc primitive refs histogram
-            for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
+            bbox left;
+            for (int i = 0; i < req.numprims - 1; ++i)
             {
-                int idx = primindices[i];
-                int binidx = (int)std::min<float>(m_num_bins * ((centroids[idx][axis] - rootminc) * invcentroid_rng), m_num_bins - 1);
+                left.grow(bounds[sorted[i]]);
 
-                ++bins[axis][binidx].count;
-                bins[axis][binidx].bounds.grow(bounds[idx]);
-            }
+                // Partitioning goes by centroids, so equal ones can't be separated
+                float border = centroids[sorted[i + 1]][axis];
+                if (centroids[sorted[i]][axis] == border) continue;
 
-            std::vector<bbox> rightbounds(m_num_bins - 1);
+                float sah = m_traversal_cost + ((i + 1) * left.surface_area() + (req.numprims - i - 1) * rightarea[i + 1]) * invarea;
 
-            // Start with 1-bin right box
-            bbox rightbox = bbox();
-            for (int i = m_num_bins - 1; i > 0; --i)
-            {
-                rightbox.grow(bins[axis][i].bounds);
-                rightbounds[i - 1] = rightbox;
+                if (sah < split.sah)
+                {
+                    split.dim = axis;
+                    split.sah = sah;
+                    // Primitives with centroids below the next one go left
+                    split.split = border;
+                }
             }
+        }
 
-            bbox leftbox = bbox();
-            int  leftcount = 0;
-            int  rightcount = req.numprims;
+        return split;
+    }
 
-            // Start best SAH search
-            // i is current split candidate (split between i and i + 1)
-            float sahtmp = 0.f;
-            for (int i = 0; i < m_num_bins - 1; ++i)
-            {
-                leftbox.grow(bins[axis][i].bounds);
-                leftcount += bins[axis][i].count;
-                rightcount -= bins[axis][i].count;
+    int Bvh::PartitionParallel(SplitRequest const& req, int axis, float border,
+        bbox const* bounds, float3 const* centroids, int* primindices,
+        bbox& leftbounds, bbox& leftcentroid_bounds,
+        bbox& rightbounds, bbox& rightcentroid_bounds) const
+    {
+        // Per job partitioning results
+        struct JobResult
+        {
+            int numprims;
+            int numleft;
+            bbox leftbounds;
+            bbox leftcentroid_bounds;
+            bbox rightbounds;
+            bbox rightcentroid_bounds;
+        };
+
+        int numjobs = GetNumJobs(req.numprims, req.level);
+        int begin = req.startidx;
+        int end = req.startidx + req.numprims;
 
-                // Compute SAH
-                sahtmp = m_traversal_cost + (leftcount * leftbox.surface_area() + rightcount * rightbounds[i].surface_area()) * invarea;
+        // First pass: count primitives falling to the left and calc children extents
+        std::vector<JobResult> results(numjobs);
+        ParallelForChunks(numjobs, begin, end, [&](int job, int chunkbegin, int chunkend)
+        {
+            JobResult& result = results[job];
+            result.numprims = chunkend - chunkbegin;
+            result.numleft = 0;
 
-                // Check if it is better than what we found so far
-                if (sahtmp < sah)
+            for (int i = chunkbegin; i < chunkend; ++i)
+            {
+                int idx = primindices[i];
+
+                if (centroids[idx][axis] < border)
                 {
-                    split.dim = axis;
-                    splitidx = i;
-                    split.sah = sah = sahtmp;
+                    ++result.numleft;
+                    result.leftbounds.grow(bounds[idx]);
+                    result.leftcentroid_bounds.grow(centroids[idx]);
+                }
+                else
+                {
+                    result.rightbounds.grow(bounds[idx]);
+                    result.rightcentroid_bounds.grow(centroids[idx]);
                 }
             }
+        });
+
+        // Calc output offsets for each job
+        std::vector<int> leftoffsets(numjobs);
+        std::vector<int> rightoffsets(numjobs);
+
+        int numleft = 0;
+        for (int job = 0; job < numjobs; ++job)
+        {
+            leftoffsets[job] = numleft;
+            numleft += results[job].numleft;
+
+            leftbounds.grow(results[job].leftbounds);
+            leftcentroid_bounds.grow(results[job].leftcentroid_bounds);
+            rightbounds.grow(results[job].rightbounds);
+            rightcentroid_bounds.grow(results[job].rightcentroid_bounds);
         }
 
-        // Choose split plane
-        if (splitidx != -1)
+        int rightoffset = numleft;
+        for (int job = 0; job < numjobs; ++job)
         {
-            split.split = rootmin[split.dim] + (splitidx + 1) * (centroid_extents[split.dim] / m_num_bins);
+            rightoffsets[job] = rightoffset;
+            rightoffset += results[job].numprims - results[job].numleft;
         }
 
-        return split;
+        // Second pass: scatter indices into temporary storage
+        std::vector<int> tmp(req.numprims);
+        ParallelForChunks(numjobs, begin, end, [&](int job, int chunkbegin, int chunkend)
+        {
+            int left = leftoffsets[job];
+            int right = rightoffsets[job];
+
+            for (int i = chunkbegin; i < chunkend; ++i)
+            {
+                int idx = primindices[i];
+
+                if (centroids[idx][axis] < border)
+                {
+                    tmp[left++] = idx;
+                }
+                else
+                {
+                    tmp[right++] = idx;
+                }
+            }
+        });
+
+        // Copy partitioned indices back
+        ParallelForChunks(numjobs, begin, end, [&](int, int chunkbegin, int chunkend)
+        {
+            std::copy(tmp.begin() + (chunkbegin - begin), tmp.begin() + (chunkend - begin), primindices + chunkbegin);
+        });
+
+        return begin + numleft;
     }
 
     void Bvh::BuildImpl(bbox const* bounds, int numbounds)
@@ -361,10 +811,17 @@ namespace RadeonRays
         // Structure describing split request
         InitNodeAllocator(2 * numbounds - 1);
 
-        // Cache some stuff to have faster partitioning
-        std::vector<float3> centroids(numbounds);
-        m_indices.resize(numbounds);
-        std::iota(m_indices.begin(), m_indices.end(), 0);
+        // Cache some stuff to have faster partitioning, in the scratch arrays if there are any
+        host_vector<float3> local_centroids;
+        host_vector<float3>& centroids = m_scratch ? m_scratch->centroids : local_centroids;
+        host_vector<int>& indices = m_scratch ? m_scratch->indices : m_indices;
+        centroids.resize(numbounds);
+        indices.resize(numbounds);
+        std::iota(indices.begin(), indices.end(), 0);
+
+        // Leaves write their primitives in place
+        m_packed_indices.resize(numbounds);
+        m_height = 0;
 
         // Calc bbox
         bbox centroid_bounds;
@@ -388,7 +845,8 @@ namespace RadeonRays
             SplitRequest req = stack.top();
             stack.pop();
 
-            Node* node = AllocateNode();
+            int nodeidx = AllocateNode();
+            Node* node = &m_nodes[nodeidx];
             node->bounds = req.bounds;
 
             // Create leaf node if we have enough prims
@@ -481,14 +939,57 @@ namespace RadeonRays
             }
 
             // Set parent ptr if any
-            if (req.ptr) *req.ptr = node;
+            if (req.ptr) *req.ptr = nodeidx;
         }
 #else
-        BuildNode(init, bounds, &centroids[0], &m_indices[0]);
+        BuildNode(init, bounds, &centroids[0], &indices[0]);
 #endif
+    }
+
+    void Bvh::GetStats(AccelStats& stats) const
+    {
+        stats = AccelStats();
+        stats.num_primitives = m_num_prims;
+        stats.build_time = m_build_time;
+
+        if (m_nodecnt == 0)
+        {
+            return;
+        }
+
+        // Areas are relative to the root, so the cost is the expected work per ray hitting the scene
+        float root_area = m_nodes[0].bounds.surface_area();
+        float inv_root_area = root_area > 0.f ? 1.f / root_area : 0.f;
+
+        std::stack<std::pair<int, int>> stack;
+        stack.push(std::make_pair(0, 0));
+
+        while (!stack.empty())
+        {
+            auto node = &m_nodes[stack.top().first];
+            auto depth = stack.top().second;
+            stack.pop();
+
+            float area = node->bounds.surface_area() * inv_root_area;
+
+            ++stats.num_nodes;
+            stats.max_depth = std::max(stats.max_depth, depth);
+
+            if (node->type == kLeaf)
+            {
+                ++stats.num_leaves;
+                stats.num_refs += node->numprims;
+                stats.sah_cost += area * node->numprims;
+            }
+            else
+            {
+                stats.sah_cost += area * m_traversal_cost;
+                stack.push(std::make_pair(node->lc, depth + 1));
+                stack.push(std::make_pair(node->rc, depth + 1));
+            }
+        }
 
-        // Set root_ pointer
-        m_root = &m_nodes[0];
+        stats.avg_leaf_prims = stats.num_leaves > 0 ? (float)stats.num_refs / stats.num_leaves : 0.f;
     }
 
     void Bvh::PrintStatistics(std::ostream& os) const
@@ -496,7 +997,7 @@ namespace RadeonRays
         os << "Class name: " << "Bvh\n";
         os << "SAH: " << (m_usesah ? "enabled\n" : "disabled\n");
         os << "SAH bins: " << m_num_bins << "\n";
-        os << "Number of triangles: " << m_indices.size() << "\n";
+        os << "Number of triangles: " << m_num_prims << "\n";
         os << "Number of nodes: " << m_nodecnt << "\n";
         os << "Tree height: " << GetHeight() << "\n";
     }
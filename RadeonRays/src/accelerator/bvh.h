@@ -22,29 +22,48 @@ THE SOFTWARE.
 #ifndef BVH_H
 #define BVH_H
 
+#include <algorithm>
+#include <functional>
 #include <memory>
 #include <vector>
 #include <list>
 #include <atomic>
+#include <future>
 #include <iostream>
 
 
 #include "math/bbox.h"
+#include "../util/build_scratch.h"
+#include "../util/build_monitor.h"
+#include "../util/thread_settings.h"
 
 namespace RadeonRays
 {
+    struct AccelStats;
+
     ///< The class represents bounding volume hierarachy
     ///< intersection accelerator
     ///<
     class Bvh
     {
     public:
-        Bvh(float traversal_cost, int num_bins = 64, bool usesah = false)
-            : m_root(nullptr)
+        // SAH builds may stop at leaves of up to max_leaf_prims primitives stored
+        // contiguously in GetIndices order, median builds always split down to 1
+        Bvh(float traversal_cost, int num_bins = 64, bool usesah = false, int max_leaf_prims = 1)
+            : m_nodecnt(0)
             , m_num_bins(num_bins)
             , m_usesah(usesah)
             , m_height(0)
             , m_traversal_cost(traversal_cost)
+            , m_max_leaf_prims(max_leaf_prims)
+            , m_num_parallel_levels(GetNumParallelLevels())
+            , m_num_prims(0)
+            , m_scratch(nullptr)
+            , m_monitor(nullptr)
+            , m_monitored_prims(0)
+            , m_build_time(0.f)
+            , m_build_cost(0.f)
+            , m_refit_cost(0.f)
         {
         }
 
@@ -53,13 +72,47 @@ namespace RadeonRays
         // World space bounding box
         bbox const& Bounds() const;
 
+        // Bounds of at most maxcount nodes which together cover all primitives, nodes of
+        // the largest area are split first. Transformed one by one they bound a rotated
+        // tree much tighter than the transformed root bounds.
+        void GetCutBounds(int maxcount, std::vector<bbox>& bounds) const;
+
         // Build function
         // bounds is an array of bounding boxes
         void Build(bbox const* bounds, int numbounds);
 
+        // Build over numbounds references of numprims primitives, refprims maps references to
+        // the primitives GetIndices returns, leafs might reference the same primitive.
+        // Refit takes primitive bounds and fits leafs to them conservatively.
+        void Build(bbox const* bounds, int numbounds, int const* refprims, int numprims);
+
+        // Recompute node bounds bottom-up keeping the topology, bounds has the same
+        // primitives in the same order as passed to Build. With rotate, nodes above moved
+        // primitives swap a child with a grandchild if that reduces the SAH cost, leafs
+        // and primitive indices are kept.
+        void Refit(bbox const* bounds, bool rotate = false);
+
+        // Ratio of the SAH cost of the refitted tree to its cost right after the build,
+        // both relative to the root area, 1 if the tree has not been refitted
+        float GetRefitDegradation() const;
+
+        // Areas of internal nodes and areas of leaves times their primitives, both relative to the
+        // root area, the SAH cost is traversal_cost * node_term + prim_term
+        void GetSahTerms(float& node_term, float& prim_term) const;
+
+        // Build centroids and indices in the arrays of the owner instead of
+        // allocating them, the scratch has to outlive the builds
+        void SetScratch(BuildScratch* scratch) { m_scratch = scratch; }
+
+        // Report build progress to the monitor and throw from builds it cancels, might be nullptr
+        void SetMonitor(BuildMonitor* monitor) { m_monitor = monitor; }
+
         // Get tree height
         int GetHeight() const;
 
+        // Get number of nodes, which is the number of translated nodes as well
+        int GetNumNodes() const;
+
         // Get reordered prim indices Nodes are pointing to
         virtual int const* GetIndices() const;
 
@@ -70,13 +123,21 @@ namespace RadeonRays
 
         // Print BVH statistics
         virtual void PrintStatistics(std::ostream& os) const;
+
+        // Get tree shape, SAH cost and build time, memory is left for the caller
+        void GetStats(AccelStats& stats) const;
+
+        // Run build(i) for count trees of numprims[i] primitives, largest first. Trees large enough
+        // to spread across threads by themselves are built one after another, the rest are packed
+        // into a task per thread of about the same number of primitives.
+        static void ScheduleBuilds(int const* numprims, int count, std::function<void(int)> const& build);
     protected:
         // Build function
         virtual void BuildImpl(bbox const* bounds, int numbounds);
         // BVH node
         struct Node;
-        // Node allocation
-        virtual Node* AllocateNode();
+        // Node allocation, returns the index of the node in m_nodes
+        virtual int   AllocateNode();
         virtual void  InitNodeAllocator(size_t maxnum);
 
         struct SplitRequest
@@ -85,8 +146,8 @@ namespace RadeonRays
             int startidx;
             // Number of primitives
             int numprims;
-            // Root node
-            Node** ptr;
+            // Child index slot of the parent node to write the node index to
+            int* ptr;
             // Bounding box
             bbox bounds;
             // Centroid bounds
@@ -107,8 +168,57 @@ namespace RadeonRays
 
         void BuildNode(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices);
 
+        // Nodes below kSweepSahPrims primitives get the exact sweep, larger
+        // nodes are binned with GetNumBins bins
         SahSplit FindSahSplit(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices) const;
 
+        // Evaluate SAH between every pair of neighbouring centroids along each axis
+        SahSplit FindSweepSplit(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices) const;
+
+        // Number of bins for a node of numprims primitives, up to m_num_bins
+        int GetNumBins(int numprims) const;
+
+        // Partition request primitives by border using several threads,
+        // returns split index and fills children extents
+        int PartitionParallel(SplitRequest const& req, int axis, float border,
+            bbox const* bounds, float3 const* centroids, int* primindices,
+            bbox& leftbounds, bbox& leftcentroid_bounds,
+            bbox& rightbounds, bbox& rightcentroid_bounds) const;
+
+        // Update tree height, safe to call from several build tasks
+        void UpdateHeight(int level);
+
+        // Check for cancellation at nodes of at least BuildMonitor::kCheckPrims primitives
+        void CheckMonitor(int numprims) const;
+        // Advance the monitor by the children of a checked node built without checks
+        void AdvanceMonitor(int numprims, int leftprims, int rightprims);
+
+        // Check if children of a node are large enough to be built as separate tasks
+        bool ShouldSpawnTasks(SplitRequest const& left, SplitRequest const& right) const;
+        // Size part of the above check, independent of the number of build threads
+        static bool IsLargeSplit(SplitRequest const& left, SplitRequest const& right);
+
+        // SAH cost of the tree relative to the root area
+        float ComputeSahCost() const;
+
+        // Apply the best SAH reducing rotation at a refitted node, children bounds and heights are final
+        void Rotate(int nodeidx, int* heights);
+
+        // Largest node split by the exact sweep SAH and the fewest bins of a binned node
+        static int const kSweepSahPrims = 32;
+        static int const kMinNumBins = 8;
+
+        // Number of jobs to bin or partition numprims primitives of a node at a given level
+        static int GetNumJobs(int numprims, int level);
+
+        // Number of top tree levels allowed to spawn subtree tasks
+        static int GetNumParallelLevels();
+
+        // Split [begin, end) range into numjobs contiguous chunks and
+        // call func(job, chunkbegin, chunkend) for each chunk concurrently
+        template <typename F>
+        static void ParallelForChunks(int numjobs, int begin, int end, F const& func);
+
         // Enum for node type
         enum NodeType
         {
@@ -116,10 +226,10 @@ namespace RadeonRays
             kLeaf
         };
 
-        // Bvh nodes
+        // Bvh nodes, the root is the first one and children are referenced by index
         std::vector<Node> m_nodes;
         // Identifiers of leaf primitives
-        std::vector<int> m_indices;
+        host_vector<int> m_indices;
         // Node allocator counter, atomic for thread safety
         std::atomic<int> m_nodecnt;
 
@@ -128,16 +238,31 @@ namespace RadeonRays
 
         // Bounding box containing all primitives
         bbox m_bounds;
-        // Root node
-        Node* m_root;
         // SAH flag
         bool m_usesah;
-        // Tree height
-        int m_height;
+        // Tree height, atomic since subtrees can be built concurrently
+        std::atomic<int> m_height;
         // Node traversal cost
         float m_traversal_cost;
-        // Number of spatial bins to use for SAH
+        // Number of spatial bins to use for SAH at the largest nodes
         int m_num_bins;
+        // Maximum number of primitives in a leaf created by SAH
+        int m_max_leaf_prims;
+        // Number of top tree levels spawning concurrent subtree build tasks
+        int m_num_parallel_levels;
+        // Number of primitives the tree is built over
+        int m_num_prims;
+        // Arrays reused across builds, might be nullptr
+        BuildScratch* m_scratch;
+        // Progress and cancellation of the build, might be nullptr
+        BuildMonitor* m_monitor;
+        // Primitives of the build the monitor has been advanced by
+        std::atomic<int> m_monitored_prims;
+        // Duration of the last build in milliseconds
+        float m_build_time;
+        // SAH cost after the build, evaluated by the first refit, and after the last refit
+        float m_build_cost;
+        float m_refit_cost;
 
 
     private:
@@ -146,6 +271,10 @@ namespace RadeonRays
 
         friend class PlainBvhTranslator;
         friend class FatNodeBvhTranslator;
+        friend class WideBvhTranslator;
+        friend class QuantizedBvhTranslator;
+        friend class HalfBvhTranslator;
+        friend class Hlbvh;
     };
 
     struct Bvh::Node
@@ -159,11 +288,11 @@ namespace RadeonRays
 
         union
         {
-            // For internal nodes: left and right children
+            // For internal nodes: left and right children indices in m_nodes
             struct
             {
-                Node* lc;
-                Node* rc;
+                int lc;
+                int rc;
             };
 
             // For leaves: starting primitive index and number of primitives
@@ -193,6 +322,80 @@ namespace RadeonRays
     {
         return m_height;
     }
+
+    inline int Bvh::GetNumNodes() const
+    {
+        return m_nodecnt;
+    }
+
+    inline float Bvh::GetRefitDegradation() const
+    {
+        return m_build_cost > 0.f ? m_refit_cost / m_build_cost : 1.f;
+    }
+
+    template <typename F>
+    inline void Bvh::ParallelForChunks(int numjobs, int begin, int end, F const& func)
+    {
+        int chunksize = (end - begin + numjobs - 1) / numjobs;
+
+        std::vector<std::future<void>> jobs;
+        for (int i = 1; i < numjobs; ++i)
+        {
+            int chunkbegin = std::min(begin + i * chunksize, end);
+            int chunkend = std::min(chunkbegin + chunksize, end);
+            jobs.push_back(std::async(std::launch::async, [&func, i, chunkbegin, chunkend]()
+            {
+                SetBuildThreadPriority();
+                func(i, chunkbegin, chunkend);
+            }));
+        }
+
+        // Process the first chunk on the calling thread
+        func(0, begin, std::min(begin + chunksize, end));
+
+        for (auto& job : jobs)
+        {
+            job.get();
+        }
+    }
+
+    inline int Bvh::GetNumBins(int numprims) const
+    {
+        // Bins beyond a few per primitive stay mostly empty and only slow down the sweep
+        return std::max(std::min(numprims / 4, m_num_bins), std::min(static_cast<int>(kMinNumBins), m_num_bins));
+    }
+
+    inline void Bvh::CheckMonitor(int numprims) const
+    {
+        if (m_monitor && numprims >= BuildMonitor::kCheckPrims)
+        {
+            m_monitor->Check();
+        }
+    }
+
+    inline void Bvh::AdvanceMonitor(int numprims, int leftprims, int rightprims)
+    {
+        if (!m_monitor || numprims < BuildMonitor::kCheckPrims)
+        {
+            return;
+        }
+
+        int done = (leftprims < BuildMonitor::kCheckPrims ? leftprims : 0) +
+            (rightprims < BuildMonitor::kCheckPrims ? rightprims : 0);
+        if (done > 0)
+        {
+            m_monitored_prims += done;
+            m_monitor->Advance(done);
+        }
+    }
+
+    inline void Bvh::UpdateHeight(int level)
+    {
+        int height = m_height;
+        while (height < level && !m_height.compare_exchange_weak(height, level))
+        {
+        }
+    }
 }
 
 #endif // BVH_H
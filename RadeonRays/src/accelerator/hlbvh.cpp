@@ -24,11 +24,15 @@ THE SOFTWARE.
 #include "primitives.h"
 #include "executable.h"
 #include "../except/except.h"
+#include "../util/kernel_profiler.h"
 #include "calc.h"
 #include "event.h"
+#include "trace.h"
 
 #include <vector>
 #include <numeric>
+#include <cstdint>
+#include <algorithm>
 #include <chrono>
 #include <cstring>
 #include <iostream>
@@ -38,6 +42,12 @@ THE SOFTWARE.
 #if USE_OPENCL
 #    include "RadeonRays/src/kernelcache/kernels_cl.h"
 #endif
+#if USE_VULKAN
+#    include "RadeonRays/src/kernelcache/kernels_vk.h"
+#    ifdef RR_EMBED_SPIRV
+#        include "RadeonRays/src/kernelcache/kernels_vk_spirv.h"
+#    endif
+#endif
 #endif // RR_EMBED_KERNELS
 
 #define INITIAL_TRIANGLE_CAPACITY 100000
@@ -49,7 +59,16 @@ namespace RadeonRays
     
     Hlbvh::Hlbvh(Calc::Device* device)
     : m_device(device)
+    , m_profiler(nullptr)
     , m_gpudata(new GpuData(device))
+    , m_capacity(0)
+    , m_restructure_passes(0)
+    , m_sah_top_bits(0)
+    , m_sah_traversal_cost(10.f)
+    , m_sah_num_bins(64)
+    , m_ploc_radius(0)
+    , m_single_pass(false)
+    , m_segments_event(nullptr)
     {
         InitGpuData();
     }
@@ -57,31 +76,62 @@ namespace RadeonRays
     
     Hlbvh::~Hlbvh()
     {
+        if (m_segments_event)
+        {
+            m_segments_event->Wait();
+            m_device->DeleteEvent(m_segments_event);
+        }
     }
     
     void Hlbvh::AllocateBuffers(size_t num_prims)
     {
         // * 3 since only triangles are supported just yet
         m_gpudata->positions = m_device->CreateBuffer(num_prims * sizeof(float3), Calc::BufferType::kWrite);
-        // * 3 since 3 vertex indices + 1 material idx
-        m_gpudata->morton_codes = m_device->CreateBuffer(num_prims * sizeof(int), Calc::BufferType::kWrite);
-        
         
         std::vector<int> iota(num_prims);
         std::iota(iota.begin(), iota.end(), 0);
         
         m_gpudata->prim_indices = m_device->CreateBuffer(num_prims * sizeof(int), Calc::BufferType::kWrite, &iota[0]);
-        m_gpudata->morton_codes = m_device->CreateBuffer(num_prims * sizeof(int), Calc::BufferType::kWrite);
-        m_gpudata->sorted_morton_codes = m_device->CreateBuffer(num_prims * sizeof(int), Calc::BufferType::kWrite);
+        // 64-bit Morton codes
+        m_gpudata->morton_codes = m_device->CreateBuffer(num_prims * sizeof(std::uint64_t), Calc::BufferType::kWrite);
+        m_gpudata->sorted_morton_codes = m_device->CreateBuffer(num_prims * sizeof(std::uint64_t), Calc::BufferType::kWrite);
         m_gpudata->sorted_prim_indices = m_device->CreateBuffer(num_prims * sizeof(int), Calc::BufferType::kWrite);
         
         m_gpudata->nodes = m_device->CreateBuffer(2 * num_prims * sizeof(Node), Calc::BufferType::kWrite);
         // Bounds
         m_gpudata->bounds = m_device->CreateBuffer(num_prims * sizeof(bbox), Calc::BufferType::kWrite);
         m_gpudata->scene_bound = m_device->CreateBuffer(sizeof(bbox), Calc::BufferType::kRead);
-        m_gpudata->sorted_bounds = m_device->CreateBuffer(num_prims * sizeof(bbox), Calc::BufferType::kWrite);
+        m_gpudata->sorted_bounds = m_device->CreateBuffer(2 * num_prims * sizeof(bbox), Calc::BufferType::kWrite);
         // Propagation flags
         m_gpudata->flags = m_device->CreateBuffer(2 * num_prims * sizeof(int), Calc::BufferType::kWrite);
+
+        m_capacity = num_prims;
+    }
+
+    void Hlbvh::ReleaseBuffers()
+    {
+        m_device->DeleteBuffer(m_gpudata->positions);
+        m_device->DeleteBuffer(m_gpudata->morton_codes);
+        m_device->DeleteBuffer(m_gpudata->prim_indices);
+        m_device->DeleteBuffer(m_gpudata->sorted_morton_codes);
+        m_device->DeleteBuffer(m_gpudata->sorted_prim_indices);
+        m_device->DeleteBuffer(m_gpudata->nodes);
+        m_device->DeleteBuffer(m_gpudata->bounds);
+        m_device->DeleteBuffer(m_gpudata->sorted_bounds);
+        m_device->DeleteBuffer(m_gpudata->scene_bound);
+        m_device->DeleteBuffer(m_gpudata->flags);
+        m_gpudata->ReleaseClusterBuffers();
+    }
+
+    void Hlbvh::EnsureCapacity(size_t num_prims)
+    {
+        // We are trying to reuse space as reallocation takes time
+        // but this call might be really frequent
+        if (num_prims > m_capacity)
+        {
+            ReleaseBuffers();
+            AllocateBuffers(num_prims);
+        }
     }
     
     void Hlbvh::InitGpuData()
@@ -90,7 +140,11 @@ namespace RadeonRays
 #ifndef RR_EMBED_KERNELS
         if ( m_device->GetPlatform() == Calc::Platform::kOpenCL )
         {
-            m_gpudata->executable = m_device->CompileExecutable( "../RadeonRays/src/kernels/CL/build_hlbvh.cl", nullptr, 0, nullptr );
+            char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+            int numheaders = sizeof(headers) / sizeof(char const*);
+
+            m_gpudata->executable = m_device->CompileExecutable( "../RadeonRays/src/kernels/CL/build_hlbvh.cl", headers, numheaders, nullptr );
         }
 
         else
@@ -110,7 +164,11 @@ namespace RadeonRays
 #if USE_VULKAN
         if (m_gpudata->executable == nullptr && device->GetPlatform() == Calc::Platform::kVulkan)
         {
+#ifdef RR_EMBED_SPIRV
+            m_gpudata->executable = m_device->CompileExecutable(g_hlbvh_build_spirv, sizeof(g_hlbvh_build_spirv), nullptr);
+#else
             m_gpudata->executable = m_device->CompileExecutable(g_hlbvh_build_vulkan, std::strlen(g_hlbvh_build_vulkan), nullptr);
+#endif
         }
 #endif
 
@@ -119,6 +177,25 @@ namespace RadeonRays
         m_gpudata->build_func = m_gpudata->executable->CreateFunction("emit_hierarchy_main");
         m_gpudata->refit_func = m_gpudata->executable->CreateFunction("refit_bounds_main");
 
+        // Device bounds evaluation and restructuring are only implemented in OpenCL kernels
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_gpudata->face_bounds_func = m_gpudata->executable->CreateFunction("calculate_face_bounds_main");
+            m_gpudata->restructure_func = m_gpudata->executable->CreateFunction("restructure_treelets_main");
+            m_gpudata->prefixes_func = m_gpudata->executable->CreateFunction("calculate_node_prefixes_main");
+            m_gpudata->clusters_func = m_gpudata->executable->CreateFunction("find_clusters_main");
+            m_gpudata->top_tree_func = m_gpudata->executable->CreateFunction("apply_top_tree_main");
+            m_gpudata->segment_face_bounds_func = m_gpudata->executable->CreateFunction("calculate_segment_face_bounds_main");
+            m_gpudata->segment_bounds_func = m_gpudata->executable->CreateFunction("calculate_segment_bounds_main");
+            m_gpudata->segment_morton_code_func = m_gpudata->executable->CreateFunction("calculate_segment_morton_code_main");
+            m_gpudata->node_ranges_func = m_gpudata->executable->CreateFunction("calculate_node_ranges_main");
+            m_gpudata->segment_nodes_func = m_gpudata->executable->CreateFunction("emit_segment_nodes_main");
+            m_gpudata->ploc_init_func = m_gpudata->executable->CreateFunction("init_ploc_clusters_main");
+            m_gpudata->ploc_neighbours_func = m_gpudata->executable->CreateFunction("find_ploc_neighbours_main");
+            m_gpudata->ploc_merge_func = m_gpudata->executable->CreateFunction("merge_ploc_clusters_main");
+            m_gpudata->bottom_up_func = m_gpudata->executable->CreateFunction("emit_hierarchy_bottom_up_main");
+        }
+
         // Allocate GPU buffers
         AllocateBuffers(INITIAL_TRIANGLE_CAPACITY);
         
@@ -134,20 +211,73 @@ namespace RadeonRays
     // Build function
     void Hlbvh::Build(bbox const* bounds, int numbounds)
     {
-//#ifdef _DEBUG
+        RR_TRACE_SCOPE("Hlbvh::Build");
+
+#ifdef _DEBUG
         auto s = std::chrono::high_resolution_clock::now();
-//#endif
+#endif
         BuildImpl(bounds, numbounds);
-//#ifdef _DEBUG
+#ifdef _DEBUG
         m_device->Finish(0);
         // Note, that this is total time spent for setup and construction 
         // including the time spent waiting in the queue.
         auto d = std::chrono::high_resolution_clock::now() - s;
         std::cout << "HLBVH setup + construction CPU time: " << std::chrono::duration_cast<std::chrono::milliseconds>(d).count() << "ms\n";
-//#endif
+#endif
+    }
+
+    void Hlbvh::Build(Calc::Buffer const* vertices, Calc::Buffer const* faces, int numfaces)
+    {
+        RR_TRACE_SCOPE("Hlbvh::Build");
+
+#ifdef _DEBUG
+        auto s = std::chrono::high_resolution_clock::now();
+#endif
+        BuildImpl(vertices, faces, numfaces);
+#ifdef _DEBUG
+        m_device->Finish(0);
+        auto d = std::chrono::high_resolution_clock::now() - s;
+        std::cout << "HLBVH device bounds + construction CPU time: " << std::chrono::duration_cast<std::chrono::milliseconds>(d).count() << "ms\n";
+#endif
     }
     
     
+    void Hlbvh::SetSahTopTree(int top_bits, float traversal_cost, int num_bins)
+    {
+        m_sah_top_bits = top_bits;
+        m_sah_traversal_cost = traversal_cost;
+        m_sah_num_bins = num_bins;
+    }
+
+    void Hlbvh::GetMemoryUsage(std::size_t& tree, std::size_t& scratch) const
+    {
+        tree = scratch = 0;
+
+        // Buffers are allocated by the first build
+        if (m_capacity == 0)
+        {
+            return;
+        }
+
+        tree = m_gpudata->nodes->GetSize() + m_gpudata->sorted_bounds->GetSize();
+
+        Calc::Buffer const* buffers[] =
+        {
+            m_gpudata->positions, m_gpudata->morton_codes, m_gpudata->prim_indices,
+            m_gpudata->sorted_morton_codes, m_gpudata->sorted_prim_indices, m_gpudata->bounds,
+            m_gpudata->scene_bound, m_gpudata->flags, m_gpudata->node_prefixes, m_gpudata->top_nodes,
+            m_gpudata->top_children, m_gpudata->clusters, m_gpudata->cluster_bounds, m_gpudata->cluster_counters,
+            m_gpudata->segments, m_gpudata->segment_bounds, m_gpudata->node_ranges, m_gpudata->ploc_clusters,
+            m_gpudata->ploc_neighbours, m_gpudata->ploc_merged, m_gpudata->ploc_valid, m_gpudata->ploc_counter,
+            m_gpudata->ploc_size, m_gpudata->links
+        };
+
+        for (auto buffer : buffers)
+        {
+            scratch += buffer ? buffer->GetSize() : 0;
+        }
+    }
+
     // World space bounding box
     bbox const& Hlbvh::Bounds() const
     {
@@ -162,40 +292,257 @@ namespace RadeonRays
         int size = numbounds;
         
         // Make sure to allocate enough mem on GPU
-        // We are trying to reuse space as reallocation takes time
-        // but this call might be really frequent
-        if (size > m_gpudata->positions->GetSize())
+        EnsureCapacity(size);
+
+        // Write bounds buffer
+        m_device->WriteBuffer(m_gpudata->bounds, 0, 0, sizeof(bbox) * numbounds, const_cast<bbox*>(bounds), nullptr);
+
+        // Evaluate scene bouds
+        ProfiledRun(m_profiler, 0, "hlbvh.scene_bound", [&]()
         {
-            AllocateBuffers(size);
+            m_gpudata->pp->ReduceBbox(0, m_gpudata->bounds, m_gpudata->scene_bound, size);
+        });
+
+        // OpenCL Morton code kernel resets the flags
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            BuildHierarchy(size);
+            return;
         }
 
-        // Evaluate scene bouds
-        bbox scene_bound = bbox();
-        for (auto i = 0; i < numbounds; ++i)
-            scene_bound.grow(bounds[i]);
+        // Initialize flags with zero, kept alive until the build is done
+        std::vector<int> flags(2 * numbounds, 0);
+        m_device->WriteBuffer(m_gpudata->flags, 0, 0, sizeof(int) * 2 * numbounds, &flags[0], nullptr);
 
-        m_device->WriteBuffer(m_gpudata->scene_bound, 0, 0, sizeof(bbox), &scene_bound, nullptr);
+        BuildHierarchy(size);
+    }
 
-        // Write bounds buffer
+    void Hlbvh::BuildImpl(Calc::Buffer const* vertices, Calc::Buffer const* faces, int numfaces)
+    {
+        if (!m_gpudata->face_bounds_func)
         {
-            bbox* tmp = nullptr;
-            m_device->MapBuffer(m_gpudata->bounds, 0, 0, sizeof(bbox) * numbounds, Calc::kMapWrite, (void**)&tmp, nullptr);
-            m_device->Finish(0);
-            std::memcpy(tmp, bounds, sizeof(bbox) * numbounds);
-            m_device->UnmapBuffer(m_gpudata->bounds, 0, tmp, nullptr);
-            m_device->Finish(0);
+            throw ExceptionImpl("Device HLBVH bounds evaluation is not supported on this platform\n");
         }
-        
-        // Initialize flags with zero 
+
+        int size = numfaces;
+
+        // Make sure to allocate enough mem on GPU
+        EnsureCapacity(size);
+
+        // Calculate face bounds
+        int arg = 0;
+        m_gpudata->face_bounds_func->SetArg(arg++, vertices);
+        m_gpudata->face_bounds_func->SetArg(arg++, faces);
+        m_gpudata->face_bounds_func->SetArg(arg++, sizeof(size), &size);
+        m_gpudata->face_bounds_func->SetArg(arg++, m_gpudata->bounds);
+
+        int globalsize = ((size + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        ProfiledExecute(m_profiler, m_device, m_gpudata->face_bounds_func, 0, globalsize, kWorkGroupSize, nullptr, "hlbvh.face_bounds");
+
+        // Scene bound
+        ProfiledRun(m_profiler, 0, "hlbvh.scene_bound", [&]()
+        {
+            m_gpudata->pp->ReduceBbox(0, m_gpudata->bounds, m_gpudata->scene_bound, size);
+        });
+
+        BuildHierarchy(size);
+    }
+
+    void Hlbvh::EnsureBufferSize(Calc::Buffer*& buffer, std::size_t size)
+    {
+        if (!buffer || buffer->GetSize() < size)
+        {
+            if (buffer)
+            {
+                m_device->DeleteBuffer(buffer);
+            }
+
+            buffer = m_device->CreateBuffer(size, Calc::BufferType::kWrite);
+        }
+    }
+
+    void Hlbvh::BuildSegments(Calc::Buffer const* vertices, Calc::Buffer const* faces,
+        Segment const* segments, int numsegments, Calc::Buffer* nodes, bbox* bounds)
+    {
+        RR_TRACE_SCOPE("Hlbvh::BuildSegments");
+
+        if (!m_gpudata->segment_nodes_func)
+        {
+            throw ExceptionImpl("Segmented HLBVH builds are not supported on this platform\n");
+        }
+
+        // Empty segments have no tree, the others get consecutive primitive ranges
+        std::vector<int> table;
+        std::vector<int> built;
+        int size = 0;
+        for (int i = 0; i < numsegments; ++i)
+        {
+            bounds[i] = bbox();
+
+            if (segments[i].num_faces > 0)
+            {
+                int const entry[] = { size, segments[i].num_faces, segments[i].face_start, segments[i].node_start };
+                table.insert(table.end(), entry, entry + 4);
+                built.push_back(i);
+                size += segments[i].num_faces;
+            }
+        }
+
+        int count = (int)built.size();
+        if (count == 0)
+        {
+            return;
+        }
+
+        UploadSegments(table, size);
+
+        // Face bounds
+        int arg = 0;
+        m_gpudata->segment_face_bounds_func->SetArg(arg++, vertices);
+        m_gpudata->segment_face_bounds_func->SetArg(arg++, faces);
+        m_gpudata->segment_face_bounds_func->SetArg(arg++, m_gpudata->segments);
+        m_gpudata->segment_face_bounds_func->SetArg(arg++, sizeof(count), &count);
+        m_gpudata->segment_face_bounds_func->SetArg(arg++, sizeof(size), &size);
+        m_gpudata->segment_face_bounds_func->SetArg(arg++, m_gpudata->bounds);
+
+        int globalsize = ((size + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        ProfiledExecute(m_profiler, m_device, m_gpudata->segment_face_bounds_func, 0, globalsize, kWorkGroupSize, nullptr, "hlbvh.segment_face_bounds");
+
+        EmitSegments(m_gpudata->bounds, count, size, nodes);
+
+        // The only synchronization of the build
+        std::vector<bbox> segment_bounds(count);
+        Calc::Event* e = nullptr;
+        m_device->ReadBuffer(m_gpudata->segment_bounds, 0, 0, count * sizeof(bbox), &segment_bounds[0], &e);
+        e->Wait();
+        m_device->DeleteEvent(e);
+
+        for (int k = 0; k < count; ++k)
+        {
+            bounds[built[k]] = segment_bounds[k];
+        }
+    }
+
+    void Hlbvh::BuildNodes(Calc::Buffer const* bounds, int numbounds, int leaf_start, int node_start, Calc::Buffer* nodes)
+    {
+        RR_TRACE_SCOPE("Hlbvh::BuildNodes");
+
+        if (!m_gpudata->segment_nodes_func)
+        {
+            throw ExceptionImpl("Segmented HLBVH builds are not supported on this platform\n");
+        }
+
+        if (numbounds == 0)
+        {
+            return;
+        }
+
+        // A single segment over all the bounds
+        std::vector<int> table = { 0, numbounds, leaf_start, node_start };
+        UploadSegments(table, numbounds);
+        EmitSegments(bounds, 1, numbounds, nodes);
+    }
+
+    void Hlbvh::UploadSegments(std::vector<int>& table, int numprims)
+    {
+        // The previous table might still be read by its upload
+        if (m_segments_event)
+        {
+            m_segments_event->Wait();
+            m_device->DeleteEvent(m_segments_event);
+            m_segments_event = nullptr;
+        }
+
+        m_segment_table.swap(table);
+
+        int count = (int)m_segment_table.size() / 4;
+        EnsureCapacity(numprims);
+        EnsureBufferSize(m_gpudata->segments, m_segment_table.size() * sizeof(int));
+        EnsureBufferSize(m_gpudata->segment_bounds, count * sizeof(bbox));
+        EnsureBufferSize(m_gpudata->node_ranges, 2 * numprims * 2 * sizeof(int));
+
+        m_device->WriteBuffer(m_gpudata->segments, 0, 0, m_segment_table.size() * sizeof(int), &m_segment_table[0], &m_segments_event);
+    }
+
+    void Hlbvh::EmitSegments(Calc::Buffer const* bounds, int count, int size, Calc::Buffer* nodes)
+    {
+        // The segment index goes above the Morton code, which gets the rest of 63 bits
+        int segment_bits = 0;
+        while ((count - 1) >> segment_bits)
+        {
+            ++segment_bits;
+        }
+
+        int axis_bits = std::min(21, (63 - segment_bits) / 3);
+        int globalsize = ((size + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        // Work group per segment
+        int arg = 0;
+        m_gpudata->segment_bounds_func->SetArg(arg++, bounds);
+        m_gpudata->segment_bounds_func->SetArg(arg++, m_gpudata->segments);
+        m_gpudata->segment_bounds_func->SetArg(arg++, m_gpudata->segment_bounds);
+        ProfiledExecute(m_profiler, m_device, m_gpudata->segment_bounds_func, 0, count * kWorkGroupSize, kWorkGroupSize, nullptr, "hlbvh.segment_bounds");
+
+        // Morton codes, this also resets propagation flags
+        arg = 0;
+        m_gpudata->segment_morton_code_func->SetArg(arg++, bounds);
+        m_gpudata->segment_morton_code_func->SetArg(arg++, m_gpudata->segments);
+        m_gpudata->segment_morton_code_func->SetArg(arg++, sizeof(count), &count);
+        m_gpudata->segment_morton_code_func->SetArg(arg++, sizeof(size), &size);
+        m_gpudata->segment_morton_code_func->SetArg(arg++, m_gpudata->segment_bounds);
+        m_gpudata->segment_morton_code_func->SetArg(arg++, sizeof(axis_bits), &axis_bits);
+        m_gpudata->segment_morton_code_func->SetArg(arg++, m_gpudata->morton_codes);
+        m_gpudata->segment_morton_code_func->SetArg(arg++, m_gpudata->flags);
+        ProfiledExecute(m_profiler, m_device, m_gpudata->segment_morton_code_func, 0, globalsize, kWorkGroupSize, nullptr, "hlbvh.segment_morton");
+
+        // A single sort keeps the primitives of each segment together
+        ProfiledRun(m_profiler, 0, "hlbvh.sort", [&]()
+        {
+            m_gpudata->pp->SortRadixInt64(0, m_gpudata->morton_codes, m_gpudata->sorted_morton_codes, m_gpudata->prim_indices, m_gpudata->sorted_prim_indices, size);
+        });
+
+        arg = 0;
+        m_gpudata->build_func->SetArg(arg++, m_gpudata->sorted_morton_codes);
+        m_gpudata->build_func->SetArg(arg++, bounds);
+        m_gpudata->build_func->SetArg(arg++, m_gpudata->sorted_prim_indices);
+        m_gpudata->build_func->SetArg(arg++, sizeof(size), &size);
+        m_gpudata->build_func->SetArg(arg++, m_gpudata->nodes);
+        m_gpudata->build_func->SetArg(arg++, m_gpudata->sorted_bounds);
+        ProfiledExecute(m_profiler, m_device, m_gpudata->build_func, 0, globalsize, kWorkGroupSize, nullptr, "hlbvh.emit");
+
+        // A single leaf has no parent to refit
+        if (size > 1)
         {
-            int* tmp = nullptr;
-            m_device->MapBuffer(m_gpudata->flags, 0, 0, sizeof(int) * 2 * numbounds, Calc::kMapWrite, (void**)&tmp, nullptr);
-            m_device->Finish(0);
-            std::memset(tmp, 0, sizeof(int) * numbounds * 2);
-            m_device->UnmapBuffer(m_gpudata->flags, 0, tmp, nullptr);
-            m_device->Finish(0);
+            arg = 0;
+            m_gpudata->refit_func->SetArg(arg++, m_gpudata->sorted_bounds);
+            m_gpudata->refit_func->SetArg(arg++, sizeof(size), &size);
+            m_gpudata->refit_func->SetArg(arg++, m_gpudata->nodes);
+            m_gpudata->refit_func->SetArg(arg++, m_gpudata->flags);
+            ProfiledExecute(m_profiler, m_device, m_gpudata->refit_func, 0, globalsize, kWorkGroupSize, nullptr, "hlbvh.refit");
         }
 
+        arg = 0;
+        m_gpudata->node_ranges_func->SetArg(arg++, m_gpudata->sorted_morton_codes);
+        m_gpudata->node_ranges_func->SetArg(arg++, sizeof(size), &size);
+        m_gpudata->node_ranges_func->SetArg(arg++, m_gpudata->node_ranges);
+        ProfiledExecute(m_profiler, m_device, m_gpudata->node_ranges_func, 0, globalsize, kWorkGroupSize, nullptr, "hlbvh.node_ranges");
+
+        // Segment subtrees are written in the 2-level layout
+        arg = 0;
+        m_gpudata->segment_nodes_func->SetArg(arg++, m_gpudata->nodes);
+        m_gpudata->segment_nodes_func->SetArg(arg++, m_gpudata->sorted_bounds);
+        m_gpudata->segment_nodes_func->SetArg(arg++, m_gpudata->node_ranges);
+        m_gpudata->segment_nodes_func->SetArg(arg++, m_gpudata->segments);
+        m_gpudata->segment_nodes_func->SetArg(arg++, sizeof(count), &count);
+        m_gpudata->segment_nodes_func->SetArg(arg++, sizeof(size), &size);
+        m_gpudata->segment_nodes_func->SetArg(arg++, nodes);
+
+        int nodes_globalsize = ((2 * size - 1 + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        ProfiledExecute(m_profiler, m_device, m_gpudata->segment_nodes_func, 0, nodes_globalsize, kWorkGroupSize, nullptr, "hlbvh.segment_nodes");
+    }
+
+    void Hlbvh::BuildHierarchy(int size)
+    {
         // Calculate Morton codes array
         int arg = 0;
         m_gpudata->morton_code_func->SetArg(arg++, m_gpudata->bounds);
@@ -203,20 +550,58 @@ namespace RadeonRays
         m_gpudata->morton_code_func->SetArg(arg++, m_gpudata->scene_bound);
         m_gpudata->morton_code_func->SetArg(arg++, m_gpudata->morton_codes);
 
+        // Flags are reset by OpenCL kernel only
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_gpudata->morton_code_func->SetArg(arg++, m_gpudata->flags);
+        }
+
         // Calculate global size
         int globalsize = ((size + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
         
         // Launch Morton codes kernel
-        m_device->Execute(m_gpudata->morton_code_func, 0, globalsize, kWorkGroupSize, nullptr);
-        m_device->Finish(0);
+        ProfiledExecute(m_profiler, m_device, m_gpudata->morton_code_func, 0, globalsize, kWorkGroupSize, nullptr, "hlbvh.morton");
         
         // Sort primitives according to their Morton codes
-        m_gpudata->pp->SortRadixInt32(0, m_gpudata->morton_codes, m_gpudata->sorted_morton_codes, m_gpudata->prim_indices, m_gpudata->sorted_prim_indices, size);
+        ProfiledRun(m_profiler, 0, "hlbvh.sort", [&]()
+        {
+            m_gpudata->pp->SortRadixInt64(0, m_gpudata->morton_codes, m_gpudata->sorted_morton_codes, m_gpudata->prim_indices, m_gpudata->sorted_prim_indices, size);
+        });
+
+        // Clustering emits the nodes with their bounds, SAH top tree needs the LBVH prefixes
+        if (m_ploc_radius > 0 && m_gpudata->ploc_init_func)
+        {
+            BuildPloc(size);
+            RestructureTreelets(size, 1);
+            return;
+        }
+
+        // Internal node flags are left at 2 by the single pass build and at 1 by refit
+        if (m_single_pass && m_gpudata->bottom_up_func)
+        {
+            EnsureBufferSize(m_gpudata->links, 4 * m_capacity * sizeof(int));
+
+            arg = 0;
+            m_gpudata->bottom_up_func->SetArg(arg++, m_gpudata->sorted_morton_codes);
+            m_gpudata->bottom_up_func->SetArg(arg++, m_gpudata->bounds);
+            m_gpudata->bottom_up_func->SetArg(arg++, m_gpudata->sorted_prim_indices);
+            m_gpudata->bottom_up_func->SetArg(arg++, sizeof(size), &size);
+            m_gpudata->bottom_up_func->SetArg(arg++, m_gpudata->nodes);
+            m_gpudata->bottom_up_func->SetArg(arg++, m_gpudata->sorted_bounds);
+            m_gpudata->bottom_up_func->SetArg(arg++, m_gpudata->links);
+            m_gpudata->bottom_up_func->SetArg(arg++, m_gpudata->flags);
+
+            ProfiledExecute(m_profiler, m_device, m_gpudata->bottom_up_func, 0, globalsize, kWorkGroupSize, nullptr, "hlbvh.emit_bottom_up");
+
+            if (m_sah_top_bits > 0)
+            {
+                BuildSahTopTree(size);
+            }
+
+            RestructureTreelets(size, 2);
+            return;
+        }
 
-        std::vector<int> codes(size);
-        m_device->ReadBuffer(m_gpudata->sorted_prim_indices, 0, 0, sizeof(int) * size, &codes[0], nullptr);
-        m_device->Finish(0);
-       
         // Prepare tree construction kernel
         arg = 0;
         m_gpudata->build_func->SetArg(arg++, m_gpudata->sorted_morton_codes);
@@ -230,7 +615,7 @@ namespace RadeonRays
         globalsize = ((size + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
         
         // Launch hierarchy emission kernel
-        m_device->Execute(m_gpudata->build_func, 0, globalsize, kWorkGroupSize, nullptr);
+        ProfiledExecute(m_profiler, m_device, m_gpudata->build_func, 0, globalsize, kWorkGroupSize, nullptr, "hlbvh.emit");
         
         // Refit bounds
         arg = 0;
@@ -242,6 +627,239 @@ namespace RadeonRays
         globalsize = ((size + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
         
         // Launch refit kernel
-        m_device->Execute(m_gpudata->refit_func, 0, globalsize, kWorkGroupSize, nullptr);
+        ProfiledExecute(m_profiler, m_device, m_gpudata->refit_func, 0, globalsize, kWorkGroupSize, nullptr, "hlbvh.refit");
+
+        if (!m_gpudata->restructure_func)
+        {
+            return;
+        }
+
+        if (m_sah_top_bits > 0)
+        {
+            BuildSahTopTree(size);
+        }
+
+        RestructureTreelets(size, 1);
+    }
+
+    void Hlbvh::RestructureTreelets(int size, int flags)
+    {
+        int globalsize = ((size + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        // Each pass advances the flags by 2
+        for (int pass = 0; pass < m_restructure_passes; ++pass)
+        {
+            int flag_base = flags + 2 * pass;
+
+            int arg = 0;
+            m_gpudata->restructure_func->SetArg(arg++, m_gpudata->sorted_bounds);
+            m_gpudata->restructure_func->SetArg(arg++, sizeof(size), &size);
+            m_gpudata->restructure_func->SetArg(arg++, m_gpudata->nodes);
+            m_gpudata->restructure_func->SetArg(arg++, m_gpudata->flags);
+            m_gpudata->restructure_func->SetArg(arg++, sizeof(flag_base), &flag_base);
+
+            ProfiledExecute(m_profiler, m_device, m_gpudata->restructure_func, 0, globalsize, kWorkGroupSize, nullptr, "hlbvh.restructure");
+        }
+    }
+
+    void Hlbvh::BuildPloc(int size)
+    {
+        if (!m_gpudata->ploc_clusters)
+        {
+            m_gpudata->ploc_clusters = m_device->CreateBuffer(m_capacity * sizeof(int), Calc::BufferType::kWrite);
+            m_gpudata->ploc_neighbours = m_device->CreateBuffer(m_capacity * sizeof(int), Calc::BufferType::kWrite);
+            m_gpudata->ploc_merged = m_device->CreateBuffer(m_capacity * sizeof(int), Calc::BufferType::kWrite);
+            m_gpudata->ploc_valid = m_device->CreateBuffer(m_capacity * sizeof(int), Calc::BufferType::kWrite);
+            m_gpudata->ploc_counter = m_device->CreateBuffer(sizeof(int), Calc::BufferType::kWrite);
+            m_gpudata->ploc_size = m_device->CreateBuffer(sizeof(int), Calc::BufferType::kWrite);
+        }
+
+        int arg = 0;
+        m_gpudata->ploc_init_func->SetArg(arg++, m_gpudata->bounds);
+        m_gpudata->ploc_init_func->SetArg(arg++, m_gpudata->sorted_prim_indices);
+        m_gpudata->ploc_init_func->SetArg(arg++, sizeof(size), &size);
+        m_gpudata->ploc_init_func->SetArg(arg++, m_gpudata->nodes);
+        m_gpudata->ploc_init_func->SetArg(arg++, m_gpudata->sorted_bounds);
+        m_gpudata->ploc_init_func->SetArg(arg++, m_gpudata->ploc_clusters);
+
+        int globalsize = ((size + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        ProfiledExecute(m_profiler, m_device, m_gpudata->ploc_init_func, 0, globalsize, kWorkGroupSize, nullptr, "hlbvh.ploc_init");
+
+        // Single leaf is the root
+        if (size < 2)
+        {
+            return;
+        }
+
+        // Kept alive by the blocking read of the first pass
+        int counter = 0;
+        m_device->WriteBuffer(m_gpudata->ploc_counter, 0, 0, sizeof(counter), &counter, nullptr);
+
+        // Each pass merges at least one pair, the number of clusters
+        // is read back to size the next pass and to stop
+        int numclusters = size;
+        while (numclusters > 1)
+        {
+            globalsize = ((numclusters + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+            arg = 0;
+            m_gpudata->ploc_neighbours_func->SetArg(arg++, m_gpudata->sorted_bounds);
+            m_gpudata->ploc_neighbours_func->SetArg(arg++, m_gpudata->ploc_clusters);
+            m_gpudata->ploc_neighbours_func->SetArg(arg++, sizeof(numclusters), &numclusters);
+            m_gpudata->ploc_neighbours_func->SetArg(arg++, sizeof(m_ploc_radius), &m_ploc_radius);
+            m_gpudata->ploc_neighbours_func->SetArg(arg++, m_gpudata->ploc_neighbours);
+            ProfiledExecute(m_profiler, m_device, m_gpudata->ploc_neighbours_func, 0, globalsize, kWorkGroupSize, nullptr, "hlbvh.ploc_neighbours");
+
+            arg = 0;
+            m_gpudata->ploc_merge_func->SetArg(arg++, m_gpudata->ploc_clusters);
+            m_gpudata->ploc_merge_func->SetArg(arg++, m_gpudata->ploc_neighbours);
+            m_gpudata->ploc_merge_func->SetArg(arg++, sizeof(numclusters), &numclusters);
+            m_gpudata->ploc_merge_func->SetArg(arg++, sizeof(size), &size);
+            m_gpudata->ploc_merge_func->SetArg(arg++, m_gpudata->nodes);
+            m_gpudata->ploc_merge_func->SetArg(arg++, m_gpudata->sorted_bounds);
+            m_gpudata->ploc_merge_func->SetArg(arg++, m_gpudata->flags);
+            m_gpudata->ploc_merge_func->SetArg(arg++, m_gpudata->ploc_counter);
+            m_gpudata->ploc_merge_func->SetArg(arg++, m_gpudata->ploc_merged);
+            m_gpudata->ploc_merge_func->SetArg(arg++, m_gpudata->ploc_valid);
+            ProfiledExecute(m_profiler, m_device, m_gpudata->ploc_merge_func, 0, globalsize, kWorkGroupSize, nullptr, "hlbvh.ploc_merge");
+
+            // Survivors keep their Morton order
+            ProfiledRun(m_profiler, 0, "hlbvh.ploc_compact", [&]()
+            {
+                m_gpudata->pp->CompactInt32(0, m_gpudata->ploc_valid, m_gpudata->ploc_merged, m_gpudata->ploc_clusters, numclusters, m_gpudata->ploc_size);
+            });
+
+            Calc::Event* e = nullptr;
+            m_device->ReadBuffer(m_gpudata->ploc_size, 0, 0, sizeof(numclusters), &numclusters, &e);
+            e->Wait();
+            m_device->DeleteEvent(e);
+        }
+    }
+
+    void Hlbvh::BuildSahTopTree(int size)
+    {
+        // Single internal node has a single topology
+        if (size < 3)
+        {
+            return;
+        }
+
+        if (!m_gpudata->node_prefixes)
+        {
+            m_gpudata->node_prefixes = m_device->CreateBuffer(m_capacity * sizeof(int), Calc::BufferType::kWrite);
+            m_gpudata->top_nodes = m_device->CreateBuffer(m_capacity * sizeof(int), Calc::BufferType::kWrite);
+            m_gpudata->top_children = m_device->CreateBuffer(2 * m_capacity * sizeof(int), Calc::BufferType::kWrite);
+            m_gpudata->clusters = m_device->CreateBuffer(m_capacity * sizeof(int), Calc::BufferType::kWrite);
+            m_gpudata->cluster_bounds = m_device->CreateBuffer(m_capacity * sizeof(bbox), Calc::BufferType::kWrite);
+            m_gpudata->cluster_counters = m_device->CreateBuffer(2 * sizeof(int), Calc::BufferType::kWrite);
+        }
+
+        int counters[2] = { 0, 0 };
+        m_device->WriteBuffer(m_gpudata->cluster_counters, 0, 0, sizeof(counters), counters, nullptr);
+
+        int globalsize = ((size + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        // Morton prefix of internal nodes
+        int arg = 0;
+        m_gpudata->prefixes_func->SetArg(arg++, m_gpudata->sorted_morton_codes);
+        m_gpudata->prefixes_func->SetArg(arg++, sizeof(size), &size);
+        m_gpudata->prefixes_func->SetArg(arg++, m_gpudata->node_prefixes);
+        ProfiledExecute(m_profiler, m_device, m_gpudata->prefixes_func, 0, globalsize, kWorkGroupSize, nullptr, "hlbvh.prefixes");
+
+        // Collect top nodes and clusters
+        arg = 0;
+        m_gpudata->clusters_func->SetArg(arg++, m_gpudata->nodes);
+        m_gpudata->clusters_func->SetArg(arg++, m_gpudata->sorted_bounds);
+        m_gpudata->clusters_func->SetArg(arg++, m_gpudata->node_prefixes);
+        m_gpudata->clusters_func->SetArg(arg++, sizeof(size), &size);
+        m_gpudata->clusters_func->SetArg(arg++, sizeof(m_sah_top_bits), &m_sah_top_bits);
+        m_gpudata->clusters_func->SetArg(arg++, m_gpudata->top_nodes);
+        m_gpudata->clusters_func->SetArg(arg++, m_gpudata->clusters);
+        m_gpudata->clusters_func->SetArg(arg++, m_gpudata->cluster_bounds);
+        m_gpudata->clusters_func->SetArg(arg++, m_gpudata->cluster_counters);
+        ProfiledExecute(m_profiler, m_device, m_gpudata->clusters_func, 0, globalsize, kWorkGroupSize, nullptr, "hlbvh.clusters");
+
+        // The top tree is built on the host, only clusters are read back
+        m_device->ReadBuffer(m_gpudata->cluster_counters, 0, 0, sizeof(counters), counters, nullptr);
+
+        int numtop = counters[0];
+        int numclusters = counters[1];
+
+        if (numclusters < 3 || numtop != numclusters - 1)
+        {
+            return;
+        }
+
+        std::vector<int> top(numtop);
+        std::vector<int> clusters(numclusters);
+        std::vector<bbox> cluster_bounds(numclusters);
+        m_device->ReadBuffer(m_gpudata->top_nodes, 0, 0, numtop * sizeof(int), &top[0], nullptr);
+        m_device->ReadBuffer(m_gpudata->clusters, 0, 0, numclusters * sizeof(int), &clusters[0], nullptr);
+        m_device->ReadBuffer(m_gpudata->cluster_bounds, 0, 0, numclusters * sizeof(bbox), &cluster_bounds[0], nullptr);
+
+        // Clusters are appended in arbitrary order, sort them to keep builds deterministic
+        std::vector<int> order(numclusters);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&clusters](int lhs, int rhs) { return clusters[lhs] < clusters[rhs]; });
+
+        std::vector<int> sorted_clusters(numclusters);
+        std::vector<bbox> sorted_cluster_bounds(numclusters);
+        for (auto i = 0; i < numclusters; ++i)
+        {
+            sorted_clusters[i] = clusters[order[i]];
+            sorted_cluster_bounds[i] = cluster_bounds[order[i]];
+        }
+
+        // Root has to stay at node 0
+        std::sort(top.begin(), top.end());
+
+        Bvh bvh(m_sah_traversal_cost, m_sah_num_bins, true);
+        bvh.Build(&sorted_cluster_bounds[0], numclusters);
+
+        // Assign top node slots in depth first order, leaves map to cluster roots
+        std::vector<int> children(2 * numtop);
+        std::vector<bbox> top_bounds(numtop);
+        std::vector<std::pair<Bvh::Node const*, int>> stack;
+        int next = 0;
+
+        stack.push_back(std::make_pair(&bvh.m_nodes[0], next++));
+
+        while (!stack.empty())
+        {
+            auto node = stack.back().first;
+            auto slot = stack.back().second;
+            stack.pop_back();
+
+            top_bounds[slot] = node->bounds;
+
+            Bvh::Node const* kids[2] = { &bvh.m_nodes[node->lc], &bvh.m_nodes[node->rc] };
+            for (auto i = 0; i < 2; ++i)
+            {
+                if (kids[i]->type == Bvh::kLeaf)
+                {
+                    children[2 * slot + i] = sorted_clusters[bvh.GetIndices()[kids[i]->startidx]];
+                }
+                else
+                {
+                    children[2 * slot + i] = top[next];
+                    stack.push_back(std::make_pair(kids[i], next++));
+                }
+            }
+        }
+
+        m_device->WriteBuffer(m_gpudata->top_nodes, 0, 0, numtop * sizeof(int), &top[0], nullptr);
+        m_device->WriteBuffer(m_gpudata->top_children, 0, 0, 2 * numtop * sizeof(int), &children[0], nullptr);
+        m_device->WriteBuffer(m_gpudata->cluster_bounds, 0, 0, numtop * sizeof(bbox), &top_bounds[0], nullptr);
+
+        arg = 0;
+        m_gpudata->top_tree_func->SetArg(arg++, m_gpudata->top_nodes);
+        m_gpudata->top_tree_func->SetArg(arg++, m_gpudata->top_children);
+        m_gpudata->top_tree_func->SetArg(arg++, m_gpudata->cluster_bounds);
+        m_gpudata->top_tree_func->SetArg(arg++, sizeof(numtop), &numtop);
+        m_gpudata->top_tree_func->SetArg(arg++, m_gpudata->nodes);
+        m_gpudata->top_tree_func->SetArg(arg++, m_gpudata->sorted_bounds);
+
+        globalsize = ((numtop + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        ProfiledExecute(m_profiler, m_device, m_gpudata->top_tree_func, 0, globalsize, kWorkGroupSize, nullptr, "hlbvh.top_tree");
     }
 }
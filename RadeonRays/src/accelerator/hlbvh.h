@@ -32,6 +32,8 @@ THE SOFTWARE.
 
 namespace RadeonRays
 {
+    class KernelProfiler;
+
     ///< The class represents hierarchical LBVH constructed fully on GPU
     ///< https://research.nvidia.com/sites/default/files/publications/HLBVH-final.pdf
     ///
@@ -47,6 +49,50 @@ namespace RadeonRays
         
         // Build function
         void Build(bbox const* bounds, int numbounds);
+        // Build from the triangles resident in device memory: face bounds and
+        // scene bound are calculated on the device without host synchronization.
+        // Faces use the layout of intersector face buffer.
+        void Build(Calc::Buffer const* vertices, Calc::Buffer const* faces, int numfaces);
+
+        // Face range of a batched build and the node the tree is written at
+        struct Segment
+        {
+            int face_start;
+            int num_faces;
+            int node_start;
+        };
+
+        // Build a tree over each of the face ranges with a single sort and a few launches for all of them.
+        // Faces use the layout of the 2-level intersector face buffer, trees of 2 * num_faces - 1 nodes
+        // are written to nodes in PlainBvhTranslator layout and their bounds are returned. OpenCL only.
+        void BuildSegments(Calc::Buffer const* vertices, Calc::Buffer const* faces,
+            Segment const* segments, int numsegments, Calc::Buffer* nodes, bbox* bounds);
+        // Build a tree over device resident bounds and write it to nodes at node_start in PlainBvhTranslator
+        // layout, leafs reference leaf_start plus the index of their bound. Does not wait for the device. OpenCL only.
+        void BuildNodes(Calc::Buffer const* bounds, int numbounds, int leaf_start, int node_start, Calc::Buffer* nodes);
+
+        // Number of treelet restructuring passes improving the tree quality
+        // after the build, 0 disables restructuring. OpenCL only.
+        void SetRestructurePasses(int passes) { m_restructure_passes = passes; }
+        int GetRestructurePasses() const { return m_restructure_passes; }
+
+        // Build the top of the tree with binned SAH over clusters of primitives sharing
+        // top_bits of their Morton codes, LBVH is kept below. 0 disables SAH top tree. OpenCL only.
+        void SetSahTopTree(int top_bits, float traversal_cost, int num_bins);
+        int GetSahTopBits() const { return m_sah_top_bits; }
+
+        // Build the tree by parallel locally-ordered clustering of the Morton sorted primitives,
+        // clusters merge with their nearest neighbour within radius. 0 builds LBVH. OpenCL only.
+        void SetPlocRadius(int radius) { m_ploc_radius = radius; }
+        int GetPlocRadius() const { return m_ploc_radius; }
+
+        // Emit the LBVH and its bounds in a single bottom-up pass instead of emission and refit,
+        // the tree is the same. OpenCL only.
+        void SetSinglePass(bool single_pass) { m_single_pass = single_pass; }
+        bool GetSinglePass() const { return m_single_pass; }
+
+        // Set the profiler build kernels are timed with, might be nullptr
+        void SetProfiler(KernelProfiler* profiler) { m_profiler = profiler; }
         
         // This class has its own  GPU data,
         // and it provides it as an interface in GPU memory
@@ -56,20 +102,45 @@ namespace RadeonRays
         // Get reordered indices
         int const* GetIndices() const { return &m_prim_indices[0]; }
 
+        // Device memory of the nodes with their bounds and of the construction scratch buffers
+        void GetMemoryUsage(std::size_t& tree, std::size_t& scratch) const;
+
     
     protected:
         // Build function
         virtual void BuildImpl(bbox const* bounds, int numbounds);
+        // Build from device resident triangles
+        virtual void BuildImpl(Calc::Buffer const* vertices, Calc::Buffer const* faces, int numfaces);
         
     private:
         void InitGpuData();
         void AllocateBuffers(size_t numprims);
+        void ReleaseBuffers();
+        // Reallocate buffers if current capacity is not enough
+        void EnsureCapacity(size_t numprims);
+        // Morton codes, sort, emission and refit of bounds buffer
+        void BuildHierarchy(int numprims);
+        // Replace LBVH top levels by the SAH tree over Morton clusters
+        void BuildSahTopTree(int numprims);
+        // Replace emission and refit of the sorted primitives by PLOC
+        void BuildPloc(int numprims);
+        // Treelet restructuring passes, flags of all internal nodes have to be equal to flags
+        void RestructureTreelets(int numprims, int flags);
+        // Reallocate the buffer if it is smaller than size bytes
+        void EnsureBufferSize(Calc::Buffer*& buffer, std::size_t size);
+        // Upload the segment table of int4 entries and make sure the buffers fit numprims primitives
+        void UploadSegments(std::vector<int>& table, int numprims);
+        // Build and write the trees of count uploaded segments over size primitive bounds
+        void EmitSegments(Calc::Buffer const* bounds, int count, int size, Calc::Buffer* nodes);
         
         Hlbvh(Hlbvh const&);
         Hlbvh& operator = (Hlbvh const&);
         
         // Context for GPU work submision
         Calc::Device* m_device;
+
+        // Kernel timing, might be nullptr
+        KernelProfiler* m_profiler;
         
         // Device data types
         struct Box;
@@ -81,6 +152,27 @@ namespace RadeonRays
         
         // Primitive indices
         std::vector<int> m_prim_indices;
+
+        // Number of primitives GPU buffers are allocated for
+        size_t m_capacity;
+
+        // Number of treelet restructuring passes
+        int m_restructure_passes;
+
+        // SAH top tree settings
+        int m_sah_top_bits;
+        float m_sah_traversal_cost;
+        int m_sah_num_bins;
+
+        // PLOC search radius
+        int m_ploc_radius;
+
+        // Single pass LBVH emission
+        bool m_single_pass;
+
+        // Segment table being uploaded and the upload event, kept until the next segmented build
+        std::vector<int> m_segment_table;
+        Calc::Event* m_segments_event;
     };
     
     // BVH node
@@ -105,6 +197,24 @@ namespace RadeonRays
         Calc::Function* morton_code_func;
         Calc::Function* build_func;
         Calc::Function* refit_func;
+        // Device bounds evaluation, OpenCL only
+        Calc::Function* face_bounds_func;
+        Calc::Function* restructure_func;
+        Calc::Function* prefixes_func;
+        Calc::Function* clusters_func;
+        Calc::Function* top_tree_func;
+        // Segmented builds, OpenCL only
+        Calc::Function* segment_face_bounds_func;
+        Calc::Function* segment_bounds_func;
+        Calc::Function* segment_morton_code_func;
+        Calc::Function* node_ranges_func;
+        Calc::Function* segment_nodes_func;
+        // PLOC, OpenCL only
+        Calc::Function* ploc_init_func;
+        Calc::Function* ploc_neighbours_func;
+        Calc::Function* ploc_merge_func;
+        // Single pass emission, OpenCL only
+        Calc::Function* bottom_up_func;
         
         // Parallel primitives instance
         //CLWParallelPrimitives pp_;
@@ -131,8 +241,70 @@ namespace RadeonRays
         // Atomic flags
         Calc::Buffer*  flags;
 
+        // SAH top tree data, allocated on first use
+        // Morton prefix length of internal nodes
+        Calc::Buffer* node_prefixes;
+        // Top node indices and their new children
+        Calc::Buffer* top_nodes;
+        Calc::Buffer* top_children;
+        // Cluster roots and bounds, bounds are reused for top nodes
+        Calc::Buffer* clusters;
+        Calc::Buffer* cluster_bounds;
+        // Number of top nodes and clusters
+        Calc::Buffer* cluster_counters;
+
+        // Segmented build data, allocated on first use and grown as needed
+        // Segment table and bounds
+        Calc::Buffer* segments;
+        Calc::Buffer* segment_bounds;
+        // Sorted primitive range of each node
+        Calc::Buffer* node_ranges;
+
+        // PLOC data, allocated on first use
+        // Clusters, their nearest neighbours and clusters after the merge with the predicate
+        Calc::Buffer* ploc_clusters;
+        Calc::Buffer* ploc_neighbours;
+        Calc::Buffer* ploc_merged;
+        Calc::Buffer* ploc_valid;
+        // Number of allocated nodes and number of clusters after compaction
+        Calc::Buffer* ploc_counter;
+        Calc::Buffer* ploc_size;
+
+        // Children and span of each split of the single pass emission, allocated on first use
+        Calc::Buffer* links;
+
         GpuData(Calc::Device* dev)
             : device(dev)
+            , face_bounds_func(nullptr)
+            , restructure_func(nullptr)
+            , prefixes_func(nullptr)
+            , clusters_func(nullptr)
+            , top_tree_func(nullptr)
+            , segment_face_bounds_func(nullptr)
+            , segment_bounds_func(nullptr)
+            , segment_morton_code_func(nullptr)
+            , node_ranges_func(nullptr)
+            , segment_nodes_func(nullptr)
+            , ploc_init_func(nullptr)
+            , ploc_neighbours_func(nullptr)
+            , ploc_merge_func(nullptr)
+            , bottom_up_func(nullptr)
+            , node_prefixes(nullptr)
+            , top_nodes(nullptr)
+            , top_children(nullptr)
+            , clusters(nullptr)
+            , cluster_bounds(nullptr)
+            , cluster_counters(nullptr)
+            , segments(nullptr)
+            , segment_bounds(nullptr)
+            , node_ranges(nullptr)
+            , ploc_clusters(nullptr)
+            , ploc_neighbours(nullptr)
+            , ploc_merged(nullptr)
+            , ploc_valid(nullptr)
+            , ploc_counter(nullptr)
+            , ploc_size(nullptr)
+            , links(nullptr)
         {
         }
 
@@ -141,6 +313,20 @@ namespace RadeonRays
             executable->DeleteFunction(morton_code_func);
             executable->DeleteFunction(build_func);
             executable->DeleteFunction(refit_func);
+            if (face_bounds_func) executable->DeleteFunction(face_bounds_func);
+            if (restructure_func) executable->DeleteFunction(restructure_func);
+            if (prefixes_func) executable->DeleteFunction(prefixes_func);
+            if (clusters_func) executable->DeleteFunction(clusters_func);
+            if (top_tree_func) executable->DeleteFunction(top_tree_func);
+            if (segment_face_bounds_func) executable->DeleteFunction(segment_face_bounds_func);
+            if (segment_bounds_func) executable->DeleteFunction(segment_bounds_func);
+            if (segment_morton_code_func) executable->DeleteFunction(segment_morton_code_func);
+            if (node_ranges_func) executable->DeleteFunction(node_ranges_func);
+            if (segment_nodes_func) executable->DeleteFunction(segment_nodes_func);
+            if (ploc_init_func) executable->DeleteFunction(ploc_init_func);
+            if (ploc_neighbours_func) executable->DeleteFunction(ploc_neighbours_func);
+            if (ploc_merge_func) executable->DeleteFunction(ploc_merge_func);
+            if (bottom_up_func) executable->DeleteFunction(bottom_up_func);
             device->DeleteExecutable(executable);
             device->DeletePrimitives(pp);
             device->DeleteBuffer(positions);
@@ -153,6 +339,30 @@ namespace RadeonRays
             device->DeleteBuffer(sorted_bounds);
             device->DeleteBuffer(scene_bound);
             device->DeleteBuffer(flags);
+            ReleaseClusterBuffers();
+            if (segments) device->DeleteBuffer(segments);
+            if (segment_bounds) device->DeleteBuffer(segment_bounds);
+            if (node_ranges) device->DeleteBuffer(node_ranges);
+            if (links) device->DeleteBuffer(links);
+        }
+
+        void ReleaseClusterBuffers()
+        {
+            if (node_prefixes) device->DeleteBuffer(node_prefixes);
+            if (top_nodes) device->DeleteBuffer(top_nodes);
+            if (top_children) device->DeleteBuffer(top_children);
+            if (clusters) device->DeleteBuffer(clusters);
+            if (cluster_bounds) device->DeleteBuffer(cluster_bounds);
+            if (cluster_counters) device->DeleteBuffer(cluster_counters);
+            node_prefixes = top_nodes = top_children = clusters = cluster_bounds = cluster_counters = nullptr;
+
+            if (ploc_clusters) device->DeleteBuffer(ploc_clusters);
+            if (ploc_neighbours) device->DeleteBuffer(ploc_neighbours);
+            if (ploc_merged) device->DeleteBuffer(ploc_merged);
+            if (ploc_valid) device->DeleteBuffer(ploc_valid);
+            if (ploc_counter) device->DeleteBuffer(ploc_counter);
+            if (ploc_size) device->DeleteBuffer(ploc_size);
+            ploc_clusters = ploc_neighbours = ploc_merged = ploc_valid = ploc_counter = ploc_size = nullptr;
         }
     };
 }
@@ -0,0 +1,245 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "linear_bvh.h"
+
+#include <algorithm>
+#include <future>
+#include <numeric>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace RadeonRays
+{
+    // Radix sort digit
+    static int constexpr kRadixBits = 8;
+    static int constexpr kRadixSize = 1 << kRadixBits;
+
+    // Number of leading zero bits, v is not zero
+    static int count_leading_zeros(std::uint64_t v)
+    {
+#ifdef _MSC_VER
+        unsigned long idx = 0;
+        _BitScanReverse64(&idx, v);
+        return 63 - (int)idx;
+#else
+        return __builtin_clzll(v);
+#endif
+    }
+
+    // Expands a 10-bit integer into 30 bits by inserting 2 zeros after each bit
+    static std::uint32_t expand_bits(std::uint32_t v)
+    {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    // 30-bit Morton code of a point in the unit cube
+    static std::uint32_t calculate_morton_code(float3 const& p)
+    {
+        auto quantize = [](float v)
+        {
+            return static_cast<std::uint32_t>(std::min(std::max(v * 1024.f, 0.f), 1023.f));
+        };
+
+        return expand_bits(quantize(p.x)) * 4 + expand_bits(quantize(p.y)) * 2 + expand_bits(quantize(p.z));
+    }
+
+    void LinearBvh::BuildImpl(bbox const* bounds, int numbounds)
+    {
+        m_indices.resize(numbounds);
+        m_packed_indices.resize(numbounds);
+        m_height = 0;
+
+        if (numbounds == 0)
+        {
+            InitNodeAllocator(0);
+            return;
+        }
+
+        InitNodeAllocator(2 * numbounds - 1);
+
+        int numjobs = GetNumJobs(numbounds, 0);
+
+        // Centroid bounds normalize the codes, each chunk grows its own box
+        std::vector<bbox> chunk_bounds(numjobs);
+        ParallelForChunks(numjobs, 0, numbounds, [&](int job, int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                chunk_bounds[job].grow(bounds[i].center());
+            }
+        });
+
+        bbox centroid_bounds;
+        for (auto const& b : chunk_bounds)
+        {
+            centroid_bounds.grow(b);
+        }
+
+        // Flat dimensions map to zero
+        float3 extents = centroid_bounds.extents();
+        float3 scale(extents.x > 0.f ? 1.f / extents.x : 0.f,
+            extents.y > 0.f ? 1.f / extents.y : 0.f,
+            extents.z > 0.f ? 1.f / extents.z : 0.f);
+
+        // Primitive index in the lower bits keeps keys unique, so duplicated codes still split
+        std::vector<std::uint64_t> keys(numbounds);
+        ParallelForChunks(numjobs, 0, numbounds, [&](int, int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                float3 p = (bounds[i].center() - centroid_bounds.pmin) * scale;
+                keys[i] = (static_cast<std::uint64_t>(calculate_morton_code(p)) << 32) | static_cast<std::uint32_t>(i);
+            }
+        });
+
+        SortKeys(keys);
+
+        SplitRequest init = { 0, numbounds, nullptr, m_bounds, centroid_bounds, 0, 1 };
+        EmitNode(init, 0, keys.data(), bounds);
+
+        m_nodecnt = 2 * numbounds - 1;
+    }
+
+    void LinearBvh::SortKeys(std::vector<std::uint64_t>& keys)
+    {
+        int numkeys = static_cast<int>(keys.size());
+        int numjobs = GetNumJobs(numkeys, 0);
+
+        std::vector<std::uint64_t> sorted(numkeys);
+        std::vector<int> offsets(numjobs * kRadixSize);
+
+        // Indices are sorted already, only the code bits are processed
+        for (int shift = 32; shift < 64; shift += kRadixBits)
+        {
+            std::fill(offsets.begin(), offsets.end(), 0);
+
+            ParallelForChunks(numjobs, 0, numkeys, [&](int job, int begin, int end)
+            {
+                int* counts = &offsets[job * kRadixSize];
+                for (int i = begin; i < end; ++i)
+                {
+                    ++counts[(keys[i] >> shift) & (kRadixSize - 1)];
+                }
+            });
+
+            // Digits first and chunks second keep the sort stable
+            int sum = 0;
+            for (int digit = 0; digit < kRadixSize; ++digit)
+            {
+                for (int job = 0; job < numjobs; ++job)
+                {
+                    int count = offsets[job * kRadixSize + digit];
+                    offsets[job * kRadixSize + digit] = sum;
+                    sum += count;
+                }
+            }
+
+            ParallelForChunks(numjobs, 0, numkeys, [&](int job, int begin, int end)
+            {
+                int* dst = &offsets[job * kRadixSize];
+                for (int i = begin; i < end; ++i)
+                {
+                    sorted[dst[(keys[i] >> shift) & (kRadixSize - 1)]++] = keys[i];
+                }
+            });
+
+            keys.swap(sorted);
+        }
+    }
+
+    void LinearBvh::EmitNode(SplitRequest const& req, int nodeidx, std::uint64_t const* keys, bbox const* bounds)
+    {
+        UpdateHeight(req.level);
+
+        Node* node = &m_nodes[nodeidx];
+        node->index = req.index;
+
+        if (req.numprims == 1)
+        {
+            // Leaves own disjoint ranges of the sorted order, so indices are written in place
+            int prim = static_cast<int>(keys[req.startidx] & 0xffffffffu);
+            m_indices[req.startidx] = m_packed_indices[req.startidx] = prim;
+
+            node->type = kLeaf;
+            node->bounds = bounds[prim];
+            node->startidx = req.startidx;
+            node->numprims = 1;
+            return;
+        }
+
+        // Keys of the range share the prefix of the first and the last one,
+        // the split is the last key sharing a longer one with the first
+        int first = req.startidx;
+        int last = req.startidx + req.numprims - 1;
+        int prefix = count_leading_zeros(keys[first] ^ keys[last]);
+
+        int split = first;
+        int step = last - first;
+        do
+        {
+            step = (step + 1) >> 1;
+            int candidate = split + step;
+
+            if (candidate < last && count_leading_zeros(keys[first] ^ keys[candidate]) > prefix)
+            {
+                split = candidate;
+            }
+        }
+        while (step > 1);
+
+        // Depth first order, the left subtree of n primitives takes 2 * n - 1 nodes
+        int numleft = split - first + 1;
+        node->type = kInternal;
+        node->lc = nodeidx + 1;
+        node->rc = nodeidx + 2 * numleft;
+
+        SplitRequest leftrequest = { first, numleft, &node->lc, bbox(), bbox(), req.level + 1, (req.index << 1) };
+        SplitRequest rightrequest = { split + 1, req.numprims - numleft, &node->rc, bbox(), bbox(), req.level + 1, (req.index << 1) + 1 };
+
+        // Build large subtrees on the top levels as independent tasks
+        if (ShouldSpawnTasks(leftrequest, rightrequest))
+        {
+            auto left = std::async(std::launch::async, [&]()
+            {
+                SetBuildThreadPriority();
+                EmitNode(leftrequest, node->lc, keys, bounds);
+            });
+
+            EmitNode(rightrequest, node->rc, keys, bounds);
+
+            left.get();
+        }
+        else
+        {
+            EmitNode(leftrequest, node->lc, keys, bounds);
+            EmitNode(rightrequest, node->rc, keys, bounds);
+        }
+
+        node->bounds = bboxunion(m_nodes[node->lc].bounds, m_nodes[node->rc].bounds);
+    }
+}
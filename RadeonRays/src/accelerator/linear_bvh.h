@@ -0,0 +1,56 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "bvh.h"
+
+#include <cstdint>
+
+namespace RadeonRays
+{
+    ///< LBVH built on the host: primitives are sorted by Morton codes of their centroids
+    ///< with a parallel radix sort and the hierarchy is emitted top-down splitting at the
+    ///< highest differing bit, large subtrees are emitted as concurrent tasks, see
+    ///< "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees"
+    ///< Tero Karras (NVIDIA), in High Performance Graphics 2012.
+    ///< Nodes are stored depth first with one primitive per leaf, so translators
+    ///< and Refit handle them the same way as the nodes of Bvh.
+    ///<
+    class LinearBvh : public Bvh
+    {
+    public:
+        LinearBvh(float traversal_cost, int num_bins = 64)
+            : Bvh(traversal_cost, num_bins, false)
+        {
+        }
+
+    protected:
+        void BuildImpl(bbox const* bounds, int numbounds) override;
+
+    private:
+        // Stable sort of the keys by their upper 32 bits, chunks are counted and scattered concurrently
+        static void SortKeys(std::vector<std::uint64_t>& keys);
+        // Emit the subtree of sorted primitives of the request at nodeidx, node index of the request
+        // is the index in a complete tree. Keys hold Morton codes above primitive indices.
+        void EmitNode(SplitRequest const& req, int nodeidx, std::uint64_t const* keys, bbox const* bounds);
+    };
+}
@@ -0,0 +1,189 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "presplit.h"
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
+#include "math/mathutils.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace RadeonRays
+{
+    // Largest number of references a single face is split into
+    static int constexpr kMaxRefsPerFace = 256;
+
+    // Clip the polygon to box and split the clipped bounds in the middle of
+    // their largest extent until there is a reference for each of count
+    static void split_reference(float3 const* poly, int numverts, bbox const& box, int count,
+        std::vector<bbox>& refbounds)
+    {
+        if (count == 1)
+        {
+            refbounds.push_back(box);
+            return;
+        }
+
+        int axis = box.maxdim();
+        float split = box.center()[axis];
+
+        bbox left, right;
+        for (int i = 0; i < numverts; ++i)
+        {
+            if (poly[i][axis] <= split)
+            {
+                left.grow(poly[i]);
+            }
+
+            if (poly[i][axis] >= split)
+            {
+                right.grow(poly[i]);
+            }
+        }
+
+        // Edges crossing the plane contribute their intersection point to both sides,
+        // quads are intersected as two triangles sharing the 0-2 diagonal
+        int numedges = numverts == 4 ? 5 : 3;
+        for (int i = 0; i < numedges; ++i)
+        {
+            float3 const& v0 = poly[i < numverts ? i : 0];
+            float3 const& v1 = poly[i < numverts ? (i + 1) % numverts : 2];
+
+            if ((v0[axis] < split && v1[axis] > split) || (v0[axis] > split && v1[axis] < split))
+            {
+                float t = (split - v0[axis]) / (v1[axis] - v0[axis]);
+                float3 p = v0 + t * (v1 - v0);
+                p[axis] = split;
+                left.grow(p);
+                right.grow(p);
+            }
+        }
+
+        // The polygon is only clipped against the split plane, so the parent box clips the rest
+        bbox leftbox = box;
+        leftbox.pmax[axis] = split;
+        bbox rightbox = box;
+        rightbox.pmin[axis] = split;
+
+        left = intersection(left, leftbox);
+        right = intersection(right, rightbox);
+
+        bool has_left = left.pmin.x <= left.pmax.x && left.pmin.y <= left.pmax.y && left.pmin.z <= left.pmax.z;
+        bool has_right = right.pmin.x <= right.pmax.x && right.pmin.y <= right.pmax.y && right.pmin.z <= right.pmax.z;
+
+        if (!has_left || !has_right)
+        {
+            // Degenerate split, the face doesn't benefit from more references
+            refbounds.push_back(box);
+            return;
+        }
+
+        split_reference(poly, numverts, left, count / 2, refbounds);
+        split_reference(poly, numverts, right, count - count / 2, refbounds);
+    }
+
+    void PresplitFaces(std::vector<Shape const*> const& shapes, std::vector<int> const& faces_start_idx,
+        bbox const* bounds, int numfaces, float budget, std::vector<bbox>& refbounds, std::vector<int>& refprims)
+    {
+        RR_TRACE_SCOPE("PresplitFaces");
+
+        int numshapes = (int)shapes.size();
+
+        // Faces are resolved to the mesh and the world transform of their shape
+        std::vector<Mesh const*> meshes(numshapes);
+        std::vector<matrix> transforms(numshapes);
+        for (int i = 0; i < numshapes; ++i)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shapes[i]);
+
+            matrix minv;
+            shapeimpl->GetTransform(transforms[i], minv);
+
+            meshes[i] = shapeimpl->is_instance() ?
+                static_cast<Mesh const*>(static_cast<Instance const*>(shapeimpl)->GetBaseShape()) :
+                static_cast<Mesh const*>(shapeimpl);
+        }
+
+        auto get_polygon = [&](int faceidx, float3* poly)
+        {
+            auto iter = std::upper_bound(faces_start_idx.cbegin(), faces_start_idx.cend(), faceidx);
+            int shapeidx = static_cast<int>(std::distance(faces_start_idx.cbegin(), iter) - 1);
+
+            Mesh::Face const face = meshes[shapeidx]->GetFace(faceidx - faces_start_idx[shapeidx]);
+            int numverts = face.type_ == Mesh::QUAD ? 4 : 3;
+            for (int j = 0; j < numverts; ++j)
+            {
+                poly[j] = transform_point(meshes[shapeidx]->GetVertex(face.idx[j]), transforms[shapeidx]);
+            }
+
+            return numverts;
+        };
+
+        // Splitting approaches half of the face area on each side, the rest is wasted
+        std::vector<float> waste(numfaces);
+        double total_waste = 0.0;
+
+#pragma omp parallel for reduction(+:total_waste)
+        for (int i = 0; i < numfaces; ++i)
+        {
+            float3 poly[4];
+            int numverts = get_polygon(i, poly);
+
+            float3 normal = cross(poly[1] - poly[0], poly[2] - poly[0]);
+            if (numverts == 4)
+            {
+                normal += cross(poly[2] - poly[0], poly[3] - poly[0]);
+            }
+
+            // Twice the face area is the area of both sides
+            waste[i] = std::max(bounds[i].surface_area() - std::sqrt(dot(normal, normal)), 0.f);
+            total_waste += waste[i];
+        }
+
+        int budget_refs = static_cast<int>(budget * numfaces);
+        double refs_per_waste = total_waste > 0.0 ? budget_refs / total_waste : 0.0;
+
+        refbounds.clear();
+        refprims.clear();
+        refbounds.reserve(numfaces + budget_refs);
+        refprims.reserve(numfaces + budget_refs);
+
+        for (int i = 0; i < numfaces; ++i)
+        {
+            int count = 1 + std::min(static_cast<int>(waste[i] * refs_per_waste), kMaxRefsPerFace - 1);
+
+            if (count == 1)
+            {
+                refbounds.push_back(bounds[i]);
+                refprims.push_back(i);
+                continue;
+            }
+
+            float3 poly[4];
+            int numverts = get_polygon(i, poly);
+
+            split_reference(poly, numverts, bounds[i], count, refbounds);
+            refprims.resize(refbounds.size(), i);
+        }
+    }
+}
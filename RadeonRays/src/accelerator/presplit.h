@@ -0,0 +1,42 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "math/bbox.h"
+
+#include <vector>
+
+namespace RadeonRays
+{
+    class Shape;
+
+    ///< Early split clipping: bounds of faces wasting a lot of space are split into
+    ///< several references clipped to the face before a build, see "Early Split Clipping
+    ///< for Bounding Volume Hierarchies" Manfred Ernst, Guenther Greiner, RT 2007.
+    ///< Faces get extra references in proportion to the area their bounds waste over
+    ///< the face, the number of extra references is limited to budget * numfaces.
+    ///< shapes are meshes and instances of meshes with faces starting at faces_start_idx,
+    ///< bounds are their world space face bounds. refprims maps references to faces.
+    ///<
+    void PresplitFaces(std::vector<Shape const*> const& shapes, std::vector<int> const& faces_start_idx,
+        bbox const* bounds, int numfaces, float budget, std::vector<bbox>& refbounds, std::vector<int>& refprims);
+}
@@ -0,0 +1,233 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include <vector>
+#include <limits>
+
+#include "math/bbox.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RR_SAH_BINNER_SSE 1
+#include <emmintrin.h>
+#endif
+
+namespace RadeonRays
+{
+    ///< Histogram of primitive centroids used to find SAH split.
+    ///< All three axes are binned at once: bin indices are calculated
+    ///< for x, y and z in a single 4-wide operation and bin extents are
+    ///< kept as 4-wide min/max values, so growing a bin is two SIMD instructions.
+    ///<
+    class SahBinner
+    {
+    public:
+        // Best split found by the sweep
+        struct Split
+        {
+            // Split axis, -1 if no split has been found
+            int dim;
+            // Split is between bins binidx and binidx + 1
+            int binidx;
+            // SAH value of the split
+            float sah;
+            // Children extents
+            bbox leftbounds;
+            bbox rightbounds;
+        };
+
+        SahBinner(int num_bins, bbox const& centroid_bounds);
+
+        // Add primitive to the histogram
+        void Add(bbox const& bounds, float3 const& centroid);
+
+        // Add another histogram of the same node to this one
+        void Merge(SahBinner const& other);
+
+        // Sweep all the axes and find the split with minimal SAH
+        Split FindBestSplit(float traversal_cost, float invarea, int numprims) const;
+
+    private:
+#ifdef RR_SAH_BINNER_SSE
+        struct vec4 { __m128 m; };
+        static vec4 Load(float3 const& v) { return vec4{ _mm_loadu_ps(&v.x) }; }
+        static float3 Store(vec4 v) { float3 res; _mm_storeu_ps(&res.x, v.m); return res; }
+        static vec4 Min(vec4 a, vec4 b) { return vec4{ _mm_min_ps(a.m, b.m) }; }
+        static vec4 Max(vec4 a, vec4 b) { return vec4{ _mm_max_ps(a.m, b.m) }; }
+#else
+        typedef float3 vec4;
+        static vec4 Load(float3 const& v) { return v; }
+        static float3 Store(vec4 v) { return v; }
+        static vec4 Min(vec4 a, vec4 b) { return vmin(a, b); }
+        static vec4 Max(vec4 a, vec4 b) { return vmax(a, b); }
+#endif
+        static float SurfaceArea(vec4 pmin, vec4 pmax);
+
+        // Number of bins per axis
+        int m_num_bins;
+        // Histogram origin and scale for each axis, zero scale marks degenerate axis
+        vec4 m_origin;
+        vec4 m_scale;
+        vec4 m_maxbin;
+        // Bin extents and primitive counts, m_num_bins for each axis
+        std::vector<vec4> m_bin_min;
+        std::vector<vec4> m_bin_max;
+        std::vector<int> m_bin_count;
+        // Axes with non-zero centroid extents
+        bool m_active[3];
+    };
+
+    inline SahBinner::SahBinner(int num_bins, bbox const& centroid_bounds)
+        : m_num_bins(num_bins)
+        , m_bin_min(3 * num_bins, Load(bbox().pmin))
+        , m_bin_max(3 * num_bins, Load(bbox().pmax))
+        , m_bin_count(3 * num_bins, 0)
+    {
+        float3 extents = centroid_bounds.extents();
+        float3 scale;
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            m_active[axis] = extents[axis] != 0.f;
+            scale[axis] = m_active[axis] ? 1.f / extents[axis] : 0.f;
+        }
+
+        float3 origin = centroid_bounds.pmin;
+        origin.w = 0.f;
+        scale.w = 0.f;
+
+        float maxbin = static_cast<float>(num_bins - 1);
+
+        m_origin = Load(origin);
+        m_scale = Load(scale);
+        m_maxbin = Load(float3(maxbin, maxbin, maxbin, maxbin));
+    }
+
+    inline void SahBinner::Add(bbox const& bounds, float3 const& centroid)
+    {
+        int binidx[4];
+
+#ifdef RR_SAH_BINNER_SSE
+        // Same operation order as scalar num_bins * ((c - origin) * scale) to get identical bins
+        __m128 t = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&centroid.x), m_origin.m), m_scale.m);
+        t = _mm_min_ps(_mm_mul_ps(t, _mm_set1_ps(static_cast<float>(m_num_bins))), m_maxbin.m);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(binidx), _mm_cvttps_epi32(t));
+#else
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float t = (centroid[axis] - m_origin[axis]) * m_scale[axis];
+            binidx[axis] = static_cast<int>(std::min<float>(m_num_bins * t, m_maxbin[axis]));
+        }
+#endif
+
+        vec4 pmin = Load(bounds.pmin);
+        vec4 pmax = Load(bounds.pmax);
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            int idx = axis * m_num_bins + binidx[axis];
+            m_bin_min[idx] = Min(m_bin_min[idx], pmin);
+            m_bin_max[idx] = Max(m_bin_max[idx], pmax);
+            ++m_bin_count[idx];
+        }
+    }
+
+    inline void SahBinner::Merge(SahBinner const& other)
+    {
+        for (int i = 0; i < 3 * m_num_bins; ++i)
+        {
+            m_bin_min[i] = Min(m_bin_min[i], other.m_bin_min[i]);
+            m_bin_max[i] = Max(m_bin_max[i], other.m_bin_max[i]);
+            m_bin_count[i] += other.m_bin_count[i];
+        }
+    }
+
+    inline float SahBinner::SurfaceArea(vec4 pmin, vec4 pmax)
+    {
+        float3 ext = Store(pmax) - Store(pmin);
+        return 2.f * (ext.x * ext.y + ext.x * ext.z + ext.y * ext.z);
+    }
+
+    inline SahBinner::Split SahBinner::FindBestSplit(float traversal_cost, float invarea, int numprims) const
+    {
+        Split split;
+        split.dim = -1;
+        split.binidx = -1;
+        split.sah = std::numeric_limits<float>::max();
+
+        std::vector<vec4> rightmin(m_num_bins - 1);
+        std::vector<vec4> rightmax(m_num_bins - 1);
+        std::vector<float> rightarea(m_num_bins - 1);
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            // If the box is degenerate in that dimension skip it
+            if (!m_active[axis]) continue;
+
+            vec4 const* binmin = &m_bin_min[axis * m_num_bins];
+            vec4 const* binmax = &m_bin_max[axis * m_num_bins];
+            int const* bincount = &m_bin_count[axis * m_num_bins];
+
+            // Start with 1-bin right box
+            vec4 boxmin = Load(bbox().pmin);
+            vec4 boxmax = Load(bbox().pmax);
+            for (int i = m_num_bins - 1; i > 0; --i)
+            {
+                boxmin = Min(boxmin, binmin[i]);
+                boxmax = Max(boxmax, binmax[i]);
+                rightmin[i - 1] = boxmin;
+                rightmax[i - 1] = boxmax;
+                rightarea[i - 1] = SurfaceArea(boxmin, boxmax);
+            }
+
+            boxmin = Load(bbox().pmin);
+            boxmax = Load(bbox().pmax);
+            int leftcount = 0;
+            int rightcount = numprims;
+
+            // i is current split candidate (split between i and i + 1)
+            for (int i = 0; i < m_num_bins - 1; ++i)
+            {
+                boxmin = Min(boxmin, binmin[i]);
+                boxmax = Max(boxmax, binmax[i]);
+                leftcount += bincount[i];
+                rightcount -= bincount[i];
+
+                float sah = traversal_cost + (leftcount * SurfaceArea(boxmin, boxmax) + rightcount * rightarea[i]) * invarea;
+
+                // Check if it is better than what we found so far
+                if (sah < split.sah)
+                {
+                    split.dim = axis;
+                    split.binidx = i;
+                    split.sah = sah;
+                    split.leftbounds.pmin = Store(boxmin);
+                    split.leftbounds.pmax = Store(boxmax);
+                    split.rightbounds.pmin = Store(rightmin[i]);
+                    split.rightbounds.pmax = Store(rightmax[i]);
+                }
+            }
+        }
+
+        return split;
+    }
+}
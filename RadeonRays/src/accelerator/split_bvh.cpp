@@ -1,6 +1,9 @@
 #include "split_bvh.h"
+#include "sah_binner.h"
 #include "math/mathutils.h"
+#include "trace.h"
 #include <cassert>
+#include <future>
 
 namespace RadeonRays
 {
@@ -11,11 +14,13 @@ namespace RadeonRays
 
     void SplitBvh::BuildImpl(bbox const* bounds, int numbounds)
     {
+        RR_TRACE_SCOPE("SplitBvh::BuildImpl");
+
         // Initialize prim refs structures
         PrimRefArray primrefs(numbounds);
 
         // Keep centroids to speed up partitioning
-        std::vector<float3> centroids(numbounds);
+        host_vector<float3> centroids(numbounds);
         bbox centroid_bounds;
 
         for (auto i = 0; i < numbounds; ++i)
@@ -29,33 +34,111 @@ namespace RadeonRays
         m_num_nodes_for_regular = (2 * numbounds - 1);
         m_num_nodes_required = (int)(m_num_nodes_for_regular * (1.f + m_extra_refs_budget));
 
-        InitNodeAllocator(m_num_nodes_required);
+        m_contexts.clear();
+        m_packed_indices.clear();
+        m_height = 0;
+
+        SplitRequest init = { 0, numbounds, nullptr, m_bounds, centroid_bounds, 0, 1 };
+
+        // Start from the top, the root context gets the whole node budget
+        BuildNode(init, primrefs, *CreateContext(m_num_nodes_required, nullptr, nullptr));
+
+        // Contexts are laid out one after another, a context is always created after
+        // the one holding its parent, so children still follow their parents
+        m_nodecnt = 0;
+        for (auto& ctx : m_contexts)
+        {
+            ctx->offset = m_nodecnt;
+            m_nodecnt += static_cast<int>(ctx->nodes.size());
+        }
+
+        // Task roots were linked with their local index, make the link relative to the parent context
+        for (auto& ctx : m_contexts)
+        {
+            if (ctx->parent_slot)
+            {
+                *ctx->parent_slot = ctx->offset - ctx->parent->offset;
+            }
+        }
 
-        SplitRequest init = { 0, numbounds, nullptr, m_bounds, centroid_bounds, 0 };
+        // Merge nodes into the flat array releasing task storage on the way,
+        // leaves are made to point to the gathered indices
+        m_nodes.resize(m_nodecnt);
+        for (auto& ctx : m_contexts)
+        {
+            int offset = static_cast<int>(m_packed_indices.size());
+            m_packed_indices.insert(m_packed_indices.end(), ctx->packed_indices.begin(), ctx->packed_indices.end());
 
-        // Start from the top
-        BuildNode(init, primrefs);
+            int nodeidx = ctx->offset;
+            for (auto const& node : ctx->nodes)
+            {
+                Node& out = m_nodes[nodeidx++];
+                out = node;
+
+                if (node.type == kLeaf)
+                {
+                    out.startidx += offset;
+                }
+                else
+                {
+                    out.lc += ctx->offset;
+                    out.rc += ctx->offset;
+                }
+            }
+
+            std::deque<Node>().swap(ctx->nodes);
+            std::vector<int>().swap(ctx->packed_indices);
+        }
+
+        m_contexts.clear();
+    }
+
+    SplitBvh::BuildContext* SplitBvh::CreateContext(int node_budget, BuildContext* parent, int* slot)
+    {
+        std::unique_ptr<BuildContext> ctx(new BuildContext());
+        ctx->node_budget = node_budget;
+        ctx->parent = parent;
+        ctx->parent_slot = slot;
+        ctx->offset = 0;
+        ctx->base = 0;
+
+        std::lock_guard<std::mutex> lock(m_contexts_mutex);
+        m_contexts.push_back(std::move(ctx));
+        return m_contexts.back().get();
     }
 
-    void SplitBvh::BuildNode(SplitRequest& req, PrimRefArray& primrefs)
+    void SplitBvh::BuildNode(SplitRequest& req, PrimRefArray& primrefs, BuildContext& ctx)
     {
         // Update current height
-        m_height = std::max(m_height, req.level);
+        UpdateHeight(req.level);
+        // Spatial splits add references to the request
+        int const numprims = req.numprims;
+        CheckMonitor(numprims);
 
         // Allocate new node
-        Node* node = AllocateNode();
+        int nodeidx = ctx.AllocateNode();
+        Node* node = &ctx.nodes[nodeidx];
         node->bounds = req.bounds;
+        node->index = req.index;
+
+        // Object split cost also decides if a small node is cheaper as a leaf
+        SahSplit os;
+        os.sah = std::numeric_limits<float>::max();
+        if (req.numprims >= 2)
+        {
+            os = FindObjectSahSplit(req, primrefs);
+        }
 
         // Create leaf node if we have enough prims
-        if (req.numprims < 2)
+        if (req.numprims < 2 || (req.numprims <= m_max_leaf_prims && req.numprims < os.sah))
         {
             node->type = kLeaf;
-            node->startidx = (int)m_packed_indices.size();
+            node->startidx = (int)ctx.packed_indices.size();
             node->numprims = req.numprims;
 
             for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
             {
-                m_packed_indices.push_back(primrefs[i].idx);
+                ctx.packed_indices.push_back(primrefs[i].idx);
             }
         }
         else
@@ -66,7 +149,6 @@ namespace RadeonRays
             int axis = req.centroid_bounds.maxdim();
             float border = req.centroid_bounds.center()[axis];
 
-            SahSplit os = FindObjectSahSplit(req, primrefs);
             SahSplit ss;
             auto split_type = SplitType::kObject;
 
@@ -76,7 +158,7 @@ namespace RadeonRays
             // 3. It is better than object split
             // 4. Object split is not good enought (too much overlap)
             // 5. Our node budget still allows us to split references
-            if (req.level < m_max_split_depth && m_nodecnt < m_num_nodes_required && os.overlap > m_min_overlap)
+            if (req.level < m_max_split_depth && (int)ctx.nodes.size() < ctx.node_budget && os.overlap > m_min_overlap)
             {
                 ss = FindSpatialSahSplit(req, primrefs);
 
@@ -112,7 +194,7 @@ namespace RadeonRays
             bbox leftbounds, rightbounds, leftcentroid_bounds, rightcentroid_bounds;
             int splitidx = req.startidx;
 
-            bool near2far = (req.numprims + req.startidx) & 0x1;
+            bool near2far = (req.numprims + req.startidx + ctx.base) & 0x1;
 
             bool(*cmpl)(float, float) = [](float a, float b) -> bool { return a < b; };
             bool(*cmpge)(float, float) = [](float a, float b) -> bool { return a >= b; };
@@ -176,38 +258,79 @@ namespace RadeonRays
             }
 
             // Left request
-            SplitRequest leftrequest = { req.startidx, splitidx - req.startidx, &node->lc, leftbounds, leftcentroid_bounds, req.level + 1 };
+            SplitRequest leftrequest = { req.startidx, splitidx - req.startidx, &node->lc, leftbounds, leftcentroid_bounds, req.level + 1, (req.index << 1) };
             // Right request
-            SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightcentroid_bounds, req.level + 1 };
+            SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightcentroid_bounds, req.level + 1, (req.index << 1) + 1 };
 
+            // Children builds change their requests
+            int const leftprims = leftrequest.numprims;
+            int const rightprims = rightrequest.numprims;
 
-            // The order is very important here since right node uses the space at the end of the array to partition
+            // Left subtree of a large split gets a share of the remaining node budget
+            // proportional to its size, whether it is built by a task or not,
+            // so spatial splits do not depend on the number of build threads
+            int left_budget = 0;
+            if (IsLargeSplit(leftrequest, rightrequest))
             {
-                BuildNode(rightrequest, primrefs);
+                int remaining_budget = std::max(ctx.node_budget - (int)ctx.nodes.size(), 0);
+                left_budget = (int)((long long)remaining_budget * leftrequest.numprims / req.numprims);
+                ctx.node_budget -= left_budget;
             }
 
+            if (ShouldSpawnTasks(leftrequest, rightrequest))
             {
-                // Put those to stack
-                BuildNode(leftrequest, primrefs);
+                // Left subtree is built by a separate task with its own copy of prim refs
+
+                BuildContext* leftctx = CreateContext(left_budget, &ctx, &node->lc);
+                leftctx->base = ctx.base + leftrequest.startidx;
+                PrimRefArray leftrefs(primrefs.begin() + leftrequest.startidx,
+                    primrefs.begin() + leftrequest.startidx + leftrequest.numprims);
+                leftrequest.startidx = 0;
+
+                auto left = std::async(std::launch::async, [&]()
+                {
+                    SetBuildThreadPriority();
+                    BuildNode(leftrequest, leftrefs, *leftctx);
+                });
+
+                BuildNode(rightrequest, primrefs, ctx);
+
+                left.get();
             }
+            else if (IsLargeSplit(leftrequest, rightrequest))
+            {
+                // Right node goes first as it uses the space at the end of the array to partition
+                BuildNode(rightrequest, primrefs, ctx);
+
+                // Left subtree may allocate its share only, unused nodes are returned afterwards
+                int node_budget = ctx.node_budget;
+                int numnodes = static_cast<int>(ctx.nodes.size());
+                ctx.node_budget = numnodes + left_budget;
+                BuildNode(leftrequest, primrefs, ctx);
+                ctx.node_budget = node_budget + static_cast<int>(ctx.nodes.size()) - numnodes;
+            }
+            else
+            {
+                // The order is very important here since right node uses the space at the end of the array to partition
+                BuildNode(rightrequest, primrefs, ctx);
+                BuildNode(leftrequest, primrefs, ctx);
+            }
+
+            AdvanceMonitor(numprims, leftprims, rightprims);
         }
 
         // Set parent ptr if any
-        if (req.ptr) *req.ptr = node;
+        if (req.ptr) *req.ptr = nodeidx;
     }
 
     SplitBvh::SahSplit SplitBvh::FindObjectSahSplit(SplitRequest const& req, PrimRefArray const& refs) const
     {
         // SAH implementation
         // calc centroids histogram
-        // moving split bin index
-        int splitidx = -1;
-        // Set SAH to maximum float value as a start
-        auto sah = std::numeric_limits<float>::max();
         SahSplit split;
         split.dim = 0;
         split.split = std::numeric_limits<float>::quiet_NaN();
-        split.sah = sah;
+        split.sah = std::numeric_limits<float>::max();
 
         // if we cannot apply histogram algorithm
         // put NAN sentinel as split border
@@ -219,97 +342,40 @@ namespace RadeonRays
             return split;
         }
 
-        // Bin has bbox and occurence count
-        struct Bin
-        {
-            bbox bounds;
-            int count;
-        };
-
-        // Keep bins for each dimension
-        std::vector<Bin> bins[3];
-        bins[0].resize(m_num_bins);
-        bins[1].resize(m_num_bins);
-        bins[2].resize(m_num_bins);
-
-        // Precompute inverse parent area
-        auto invarea = 1.f / req.bounds.surface_area();
-        // Precompute min point
-        auto rootmin = req.centroid_bounds.pmin;
+        // Keep histogram for each binning job,
+        // jobs bin disjoint ref ranges and are merged afterwards
+        int numjobs = GetNumJobs(req.numprims, req.level);
+        std::vector<SahBinner> binners(numjobs, SahBinner(m_num_bins, req.centroid_bounds));
 
-        // Evaluate all dimensions
-        for (int axis = 0; axis < 3; ++axis)
+        // Calc primitive refs histogram
+        ParallelForChunks(numjobs, req.startidx, req.startidx + req.numprims, [&](int job, int begin, int end)
         {
-            float rootminc = rootmin[axis];
-            // Range for histogram
-            auto centroid_rng = centroid_extents[axis];
-            auto invcentroid_rng = 1.f / centroid_rng;
-
-            // If the box is degenerate in that dimension skip it
-            if (centroid_rng == 0.f) continue;
+            SahBinner& binner = binners[job];
 
-            // Initialize bins
-            for (unsigned i = 0; i < m_num_bins; ++i)
+            for (int i = begin; i < end; ++i)
             {
-                bins[axis][i].count = 0;
-                bins[axis][i].bounds = bbox();
+                binner.Add(refs[i].bounds, refs[i].center);
             }
+        });
 
-            // Calc primitive refs histogram
-            for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
-            {
-                auto idx = i;
-                auto binidx = (int)std::min<float>(m_num_bins * ((refs[idx].center[axis] - rootminc) * invcentroid_rng), m_num_bins - 1);
-
-                ++bins[axis][binidx].count;
-                bins[axis][binidx].bounds.grow(refs[idx].bounds);
-            }
-
-            std::vector<bbox> rightbounds(m_num_bins - 1);
-
-            // Start with 1-bin right box
-            bbox rightbox = bbox();
-            for (int i = m_num_bins - 1; i > 0; --i)
-            {
-                rightbox.grow(bins[axis][i].bounds);
-                rightbounds[i - 1] = rightbox;
-            }
-
-            bbox leftbox = bbox();
-            int  leftcount = 0;
-            int  rightcount = req.numprims;
-
-            // Start best SAH search
-            // i is current split candidate (split between i and i + 1)
-            float sahtmp = 0.f;
-            for (int i = 0; i < m_num_bins - 1; ++i)
-            {
-                leftbox.grow(bins[axis][i].bounds);
-                leftcount += bins[axis][i].count;
-                rightcount -= bins[axis][i].count;
-
-                // Compute SAH
-                sahtmp = m_traversal_cost + (leftcount * leftbox.surface_area() + rightcount * rightbounds[i].surface_area()) * invarea;
-
-                // Check if it is better than what we found so far
-                if (sahtmp < sah)
-                {
-                    split.dim = axis;
-                    splitidx = i;
-                    sah = sahtmp;
-
-                    // Calculate percentage of overlap 
-                    split.overlap = intersection(leftbox, rightbounds[i]).surface_area() * invarea;
-                }
-            }
+        for (int job = 1; job < numjobs; ++job)
+        {
+            binners[0].Merge(binners[job]);
         }
 
+        // Start best SAH search
+        auto invarea = 1.f / req.bounds.surface_area();
+        auto best = binners[0].FindBestSplit(m_traversal_cost, invarea, req.numprims);
+
         // Choose split plane
-        if (splitidx != -1)
+        if (best.dim != -1)
         {
-            split.split = rootmin[split.dim] + (splitidx + 1) * (centroid_extents[split.dim] / m_num_bins);
-            split.sah = sah;
+            split.dim = best.dim;
+            split.sah = best.sah;
+            split.split = req.centroid_bounds.pmin[split.dim] + (best.binidx + 1) * (centroid_extents[split.dim] / m_num_bins);
 
+            // Calculate percentage of overlap 
+            split.overlap = intersection(best.leftbounds, best.rightbounds).surface_area() * invarea;
         }
 
         return split;
@@ -346,61 +412,70 @@ namespace RadeonRays
             int exit;
         };
 
-        Bin bins[3][kNumBins];
+        // Keep bins for each dimension and each binning job
+        int numjobs = GetNumJobs(req.numprims, req.level);
+        std::vector<Bin> jobbins(3 * kNumBins * numjobs, Bin{ bbox(), 0, 0 });
 
         // Prepcompute some useful stuff
         float3 origin = req.bounds.pmin;
         float3 binsize = req.bounds.extents() * (1.f / kNumBins);
         float3 invbinsize = float3(1.f / binsize.x, 1.f / binsize.y, 1.f / binsize.z);
 
-        // Initialize bins
-        for (int axis = 0; axis < 3; ++axis)
-        {
-            for (int i = 0; i < kNumBins; ++i)
-            {
-                bins[axis][i].bounds = bbox();
-                bins[axis][i].enter = 0;
-                bins[axis][i].exit = 0;
-            }
-        }
-
         // Iterate thru all primitive refs
-        for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
+        ParallelForChunks(numjobs, req.startidx, req.startidx + req.numprims, [&](int job, int begin, int end)
         {
-            PrimRef const& primref(refs[i]);
-            // Determine starting bin for this primitive
-            float3 firstbin = clamp3((primref.bounds.pmin - origin) * invbinsize, float3(0, 0, 0), float3(kNumBins - 1, kNumBins - 1, kNumBins - 1));
-            // Determine finishing bin
-            float3 lastbin = clamp3((primref.bounds.pmax - origin) * invbinsize, firstbin, float3(kNumBins - 1, kNumBins - 1, kNumBins - 1));
-            // Iterate over axis
-            for (int axis = 0; axis < 3; ++axis)
-            {
-                // Skip in case of a degenerate dimension
-                if (extents[axis] == 0.f) continue;
-                // Break the prim into bins
-                auto tempref = primref;
+            Bin* bins = &jobbins[3 * kNumBins * job];
 
-                for (int j = (int)firstbin[axis]; j < (int)lastbin[axis]; ++j)
+            for (int i = begin; i < end; ++i)
+            {
+                PrimRef const& primref(refs[i]);
+                // Determine starting bin for this primitive
+                float3 firstbin = clamp3((primref.bounds.pmin - origin) * invbinsize, float3(0, 0, 0), float3(kNumBins - 1, kNumBins - 1, kNumBins - 1));
+                // Determine finishing bin
+                float3 lastbin = clamp3((primref.bounds.pmax - origin) * invbinsize, firstbin, float3(kNumBins - 1, kNumBins - 1, kNumBins - 1));
+                // Iterate over axis
+                for (int axis = 0; axis < 3; ++axis)
                 {
-                    PrimRef leftref, rightref;
-                    // Split primitive ref into left and right
-                    float splitval = origin[axis] + binsize[axis] * (j + 1);
-                    if (SplitPrimRef(tempref, axis, splitval, leftref, rightref))
+                    // Skip in case of a degenerate dimension
+                    if (extents[axis] == 0.f) continue;
+                    // Break the prim into bins
+                    auto tempref = primref;
+
+                    for (int j = (int)firstbin[axis]; j < (int)lastbin[axis]; ++j)
                     {
-                        // Add left one
-                        bins[axis][j].bounds.grow(leftref.bounds);
-                        // Save right to add part of it into the next bin
-                        tempref = rightref;
+                        PrimRef leftref, rightref;
+                        // Split primitive ref into left and right
+                        float splitval = origin[axis] + binsize[axis] * (j + 1);
+                        if (SplitPrimRef(tempref, axis, splitval, leftref, rightref))
+                        {
+                            // Add left one
+                            bins[axis * kNumBins + j].bounds.grow(leftref.bounds);
+                            // Save right to add part of it into the next bin
+                            tempref = rightref;
+                        }
                     }
+                    // Add the last piece into the last bin
+                    bins[axis * kNumBins + (int)lastbin[axis]].bounds.grow(tempref.bounds);
+                    // Adjust enter & exit counters
+                    bins[axis * kNumBins + (int)firstbin[axis]].enter++;
+                    bins[axis * kNumBins + (int)lastbin[axis]].exit++;
                 }
-                // Add the last piece into the last bin
-                bins[axis][(int)lastbin[axis]].bounds.grow(tempref.bounds);
-                // Adjust enter & exit counters
-                bins[axis][(int)firstbin[axis]].enter++;
-                bins[axis][(int)lastbin[axis]].exit++;
+            }
+        });
+
+        // Merge job histograms into the first one
+        for (int job = 1; job < numjobs; ++job)
+        {
+            for (int i = 0; i < 3 * kNumBins; ++i)
+            {
+                jobbins[i].bounds.grow(jobbins[3 * kNumBins * job + i].bounds);
+                jobbins[i].enter += jobbins[3 * kNumBins * job + i].enter;
+                jobbins[i].exit += jobbins[3 * kNumBins * job + i].exit;
             }
         }
 
+        Bin const* bins = &jobbins[0];
+
         // Prepare moving window data
         bbox rightbounds[kNumBins - 1];
         split.sah = std::numeric_limits<float>::max();
@@ -416,7 +491,7 @@ namespace RadeonRays
             bbox rightbox = bbox();
             for (int i = kNumBins - 1; i > 0; --i)
             {
-                rightbox = bboxunion(rightbox, bins[axis][i].bounds);
+                rightbox = bboxunion(rightbox, bins[axis * kNumBins + i].bounds);
                 rightbounds[i - 1] = rightbox;
             }
 
@@ -428,11 +503,11 @@ namespace RadeonRays
             for (int i = 1; i < kNumBins; ++i)
             {
                 // New left box
-                leftbox.grow(bins[axis][i - 1].bounds);
+                leftbox.grow(bins[axis * kNumBins + i - 1].bounds);
                 // New left box count
-                leftcount += bins[axis][i - 1].enter;
+                leftcount += bins[axis * kNumBins + i - 1].enter;
                 // Adjust right box
-                rightcount -= bins[axis][i - 1].exit;
+                rightcount -= bins[axis * kNumBins + i - 1].exit;
                 // Calc SAH
                 float sah = m_traversal_cost + (leftbox.surface_area() *
                     +rightbounds[i - 1].surface_area() * rightcount)  * invarea;
@@ -496,28 +571,6 @@ namespace RadeonRays
         extra_refs = appendprims - req.numprims;
     }
 
-    SplitBvh::Node* SplitBvh::AllocateNode()
-    {
-        if (m_nodecnt - m_num_nodes_archived >= m_num_nodes_for_regular)
-        {
-            m_node_archive.push_back(std::move(m_nodes));
-            m_num_nodes_archived += m_num_nodes_for_regular;
-            m_nodes = std::vector<Node>(m_num_nodes_for_regular);
-        }
-
-        return &m_nodes[m_nodecnt++ - m_num_nodes_archived];
-    }
-
-    void SplitBvh::InitNodeAllocator(size_t maxnum)
-    {
-        m_node_archive.clear();
-        m_nodecnt = 0;
-        m_nodes.resize(maxnum);
-
-        // Set root_ pointer
-        m_root = &m_nodes[0];
-    }
-
     void SplitBvh::PrintStatistics(std::ostream& os) const
     {
         size_t num_triangles = (m_num_nodes_for_regular + 1) / 2;
@@ -23,6 +23,9 @@
 
 #include "bvh.h"
 
+#include <deque>
+#include <mutex>
+
 
 namespace RadeonRays
 {
@@ -33,14 +36,14 @@ namespace RadeonRays
                  int num_bins,
                  int max_split_depth, 
                  float min_overlap,
-                 float extra_refs_budget)
-        : Bvh(traversal_cost, num_bins, true)
+                 float extra_refs_budget,
+                 int max_leaf_prims = 1)
+        : Bvh(traversal_cost, num_bins, true, max_leaf_prims)
         , m_max_split_depth(max_split_depth)
         , m_min_overlap(min_overlap)
         , m_extra_refs_budget(extra_refs_budget)
         , m_num_nodes_required(0)
         , m_num_nodes_for_regular(0)
-        , m_num_nodes_archived(0)
         {
         }
 
@@ -48,7 +51,9 @@ namespace RadeonRays
 
     protected:
         struct PrimRef;
-        using PrimRefArray = std::vector<PrimRef>;
+        using PrimRefArray = host_vector<PrimRef>;
+        // Storage owned by a single build task
+        struct BuildContext;
         
         enum class SplitType
         {
@@ -58,7 +63,7 @@ namespace RadeonRays
 
         // Build function
         void BuildImpl(bbox const* bounds, int numbounds) override;
-        void BuildNode(SplitRequest& req, PrimRefArray& primrefs);
+        void BuildNode(SplitRequest& req, PrimRefArray& primrefs, BuildContext& ctx);
         
         SahSplit FindObjectSahSplit(SplitRequest const& req, PrimRefArray const& refs) const;
         SahSplit FindSpatialSahSplit(SplitRequest const& req, PrimRefArray const& refs) const;
@@ -69,11 +74,10 @@ namespace RadeonRays
         // Print BVH statistics
         void PrintStatistics(std::ostream& os) const override;
 
-    protected:
-        Node* AllocateNode() override;
-        void  InitNodeAllocator(size_t maxnum) override;
-
     private:
+        // Create storage for a new build task, slot is the child index of the parent
+        // context node the task root is linked to
+        BuildContext* CreateContext(int node_budget, BuildContext* parent, int* slot);
 
         int m_max_split_depth;
         float m_min_overlap;
@@ -81,20 +85,20 @@ namespace RadeonRays
         int m_num_nodes_required;
         int m_num_nodes_for_regular;
 
-        // Node archive for memory management
-        // As m_nodes fills up we archive it into m_node_archive
-        // allocate new chunk and work there.
-
-        // How many nodes have been archived so far
-        int m_num_nodes_archived;
-        // Container for archived chunks
-        std::list<std::vector<Node>> m_node_archive;
+        // Build task storage, each task owns nodes of its subtree until they are
+        // merged into m_nodes, the first context holds the root node
+        std::vector<std::unique_ptr<BuildContext>> m_contexts;
+        // Guards m_contexts when tasks are spawned
+        std::mutex m_contexts_mutex;
 
         SplitBvh(SplitBvh const&);
         SplitBvh& operator = (SplitBvh const&);
 
         friend class PlainBvhTranslator;
         friend class FatNodeBvhTranslator;
+        friend class WideBvhTranslator;
+        friend class QuantizedBvhTranslator;
+        friend class HalfBvhTranslator;
     };
     
     struct SplitBvh::PrimRef
@@ -105,6 +109,31 @@ namespace RadeonRays
         int idx;
     };
     
+    struct SplitBvh::BuildContext
+    {
+        // Nodes allocated by the task, deque keeps node addresses stable while growing,
+        // child indices are local to this array
+        std::deque<Node> nodes;
+        // Primitive indices of task leaves, leaf start indices are local to this array
+        std::vector<int> packed_indices;
+        // Maximum number of nodes the task is allowed to allocate for spatial splits
+        int node_budget;
+        // Context owning the parent of the task root and its child index slot, null for the root task
+        BuildContext* parent;
+        int* parent_slot;
+        // First node of the task in m_nodes once merged
+        int offset;
+        // Position of the task prim refs in the serial build, keeps partitioning
+        // the same whether a subtree is built by a task or in place
+        int base;
+
+        int AllocateNode()
+        {
+            nodes.emplace_back();
+            return static_cast<int>(nodes.size()) - 1;
+        }
+    };
+
     inline SplitBvh::~SplitBvh()
     {
     }
@@ -26,7 +26,18 @@ THE SOFTWARE.
 #include "device.h"
 
 #include "../device/calc_intersection_device.h"
+#include "../device/cpu_intersection_device.h"
+#include "../device/hybrid_intersection_device.h"
+#include "../device/multi_intersection_device.h"
+#include "../device/remote_intersection_device.h"
+#include "remote_worker.h"
+#include "../util/event_watcher.h"
+#include "../util/hostalloc.h"
+#include "../util/thread_settings.h"
+#include "../except/except.h"
 #include <cassert>
+#include <memory>
+#include <string>
 
 #if USE_OPENCL
 #include "../device/calc_intersection_device_cl.h"
@@ -92,6 +103,8 @@ THE SOFTWARE.
 namespace RadeonRays
 {
     static RadeonRays::DeviceInfo::Platform s_calc_platform = RadeonRays::DeviceInfo::Platform::kAny;
+    static std::string s_kernel_cache_path;
+    static bool s_out_of_order_queues = false;
 
 #ifndef CALC_STATIC_LIBRARY
     static void* GetCalcEntryPoint(Calc::Platform platform, char const* name)
@@ -158,7 +171,12 @@ namespace RadeonRays
         if( s_calc_platform & DeviceInfo::Platform::kOpenCL )
         {
             auto* calc = GetCalcOpenCL();
-            if (calc != nullptr) { return calc; }
+            if (calc != nullptr)
+            {
+                calc->SetKernelCachePath(s_kernel_cache_path.c_str());
+                calc->SetOutOfOrderQueues(s_out_of_order_queues);
+                return calc;
+            }
         }
 #endif
 
@@ -166,53 +184,127 @@ namespace RadeonRays
         if ( s_calc_platform & DeviceInfo::Platform::kVulkan )
         {
             auto* calc = GetCalcVulkan();
-            if (calc != nullptr) { return calc; }
+            if (calc != nullptr)
+            {
+                calc->SetKernelCachePath(s_kernel_cache_path.c_str());
+                calc->SetOutOfOrderQueues(s_out_of_order_queues);
+                return calc;
+            }
         }
 #endif
         return nullptr;
     }
 
+    void Event::OnComplete(CompletionFunc callback, void* userdata)
+    {
+        ThrowIf(!callback, "Invalid completion callback.");
+
+        // Events without completion notifications are polled
+        if (Complete())
+        {
+            callback(userdata);
+            return;
+        }
+
+        WatchEvent(this, callback, userdata);
+    }
+
     void IntersectionApi::SetPlatform(const DeviceInfo::Platform platform)
     {
         s_calc_platform = platform;
     }
 
-    std::uint32_t IntersectionApi::GetDeviceCount()
+    void IntersectionApi::SetKernelCachePath(char const* path)
+    {
+        s_kernel_cache_path = path ? path : "";
+    }
+
+    void IntersectionApi::SetOutOfOrderQueues(bool enable)
+    {
+        s_out_of_order_queues = enable;
+    }
+
+    void IntersectionApi::SetAllocator(AllocFunc alloc, FreeFunc free, void* userdata)
+    {
+        ThrowIf(alloc && !free, "Allocator requires a free function.");
+
+        HostMemoryHooks hooks;
+        hooks.alloc = alloc;
+        hooks.free = alloc ? free : nullptr;
+        hooks.userdata = alloc ? userdata : nullptr;
+        SetHostMemoryHooks(hooks);
+    }
+
+    void IntersectionApi::SetThreadLimits(int build_threads, int query_threads, bool low_priority_builds)
+    {
+        ThrowIf(build_threads < 0 || query_threads < 0, "Number of threads can't be negative.");
+
+        ThreadSettings settings = GetThreadSettings();
+        settings.build_threads = build_threads;
+        settings.query_threads = query_threads;
+        settings.low_priority_builds = low_priority_builds;
+        SetThreadSettings(settings);
+    }
+
+    void IntersectionApi::SetNumaAware(bool enable)
+    {
+        ThreadSettings settings = GetThreadSettings();
+        settings.numa_aware = enable;
+        SetThreadSettings(settings);
+    }
+
+    static std::uint32_t GetCalcDeviceCount()
     {
         auto* calc = GetCalc();
-        std::uint32_t result = 0;
-        if (calc != nullptr)
-        {
-            result += GetCalc()->GetDeviceCount();
-        }
-        // embree is always the last device
+        return calc != nullptr ? calc->GetDeviceCount() : 0;
+    }
+
+    static bool HasEmbreeDevice()
+    {
 #ifdef USE_EMBREE
-        if (s_calc_platform & DeviceInfo::Platform::kEmbree)
-        {
-            ++result;
-        }
+        return (s_calc_platform & DeviceInfo::Platform::kEmbree) != 0;
+#else
+        return false;
 #endif //USE_EMBREE
+    }
+
+    static bool HasNativeDevice()
+    {
+        return (s_calc_platform & DeviceInfo::Platform::kNative) != 0;
+    }
 
-        return result;
+    std::uint32_t IntersectionApi::GetDeviceCount()
+    {
+        // CPU devices go after the calc ones, embree first
+        return GetCalcDeviceCount() + (HasEmbreeDevice() ? 1 : 0) + (HasNativeDevice() ? 1 : 0);
     }
+
     static bool IsDeviceIndexEmbree(uint32_t devidx)
     {
+        return HasEmbreeDevice() && devidx == GetCalcDeviceCount();
+    }
 
-#ifdef USE_EMBREE
-        auto* calc = GetCalc();
-        if (calc != nullptr)
+    static bool IsDeviceIndexNative(uint32_t devidx)
+    {
+        return HasNativeDevice() && devidx == GetCalcDeviceCount() + (HasEmbreeDevice() ? 1 : 0);
+    }
+
+    // Create a CPU device for the index or nullptr if the index belongs to a calc device
+    static IntersectionDevice* CreateCpuDevice(uint32_t devidx)
+    {
+        if (IsDeviceIndexNative(devidx))
         {
-            if (devidx == GetCalc()->GetDeviceCount())
-            {
-                return true;
-            }
+            return new CpuIntersectionDevice();
         }
-        else if(devidx == 0)
+
+        if (IsDeviceIndexEmbree(devidx))
         {
-            return true;
-        }
+#ifdef USE_EMBREE
+            return new EmbreeIntersectionDevice();
 #endif //USE_EMBREE
-        return false;
+        }
+
+        return nullptr;
     }
 
     void IntersectionApi::GetDeviceInfo(std::uint32_t devidx, DeviceInfo& devinfo)
@@ -222,14 +314,19 @@ namespace RadeonRays
 
         if (IsDeviceIndexEmbree(devidx))
         {
-#ifdef USE_EMBREE
             devinfo.name = "embree";
             devinfo.vendor = "intel";
             devinfo.type = DeviceInfo::kCpu;
             devinfo.platform = DeviceInfo::kEmbree;
-#else
-            assert(false);
-#endif //USE_EMBREE
+            return;
+        }
+
+        if (IsDeviceIndexNative(devidx))
+        {
+            devinfo.name = "cpu";
+            devinfo.vendor = "radeonrays";
+            devinfo.type = DeviceInfo::kCpu;
+            devinfo.platform = DeviceInfo::kNative;
             return;
         }
         assert(calc);
@@ -245,22 +342,103 @@ namespace RadeonRays
 
     IntersectionApi* IntersectionApi::Create(std::uint32_t devidx)
     {
-        if (IsDeviceIndexEmbree(devidx))
+        if (devidx >= GetCalcDeviceCount())
         {
-#ifdef USE_EMBREE
-            return new IntersectionApiImpl(new EmbreeIntersectionDevice());
-#endif //USE_EMBREE
+            auto* device = CreateCpuDevice(devidx);
+            return device ? new IntersectionApiImpl(device) : nullptr;
         }
-        else
+
+        auto* calc = GetCalc();
+        return new IntersectionApiImpl(new CalcIntersectionDevice(calc, calc->CreateDevice(devidx)));
+    }
+
+    IntersectionApi* IntersectionApi::CreateHybrid(std::uint32_t devidx)
+    {
+        if (devidx < GetCalcDeviceCount())
         {
             auto* calc = GetCalc();
-            if (calc != nullptr)
+            auto gpu = new CalcIntersectionDevice(calc, calc->CreateDevice(devidx));
+            return new IntersectionApiImpl(new HybridIntersectionDevice(gpu, new CpuIntersectionDevice()));
+        }
+
+        return nullptr;
+    }
+
+    IntersectionApi* IntersectionApi::CreateMultiDevice(std::uint32_t const* devidx, std::uint32_t count)
+    {
+        std::vector<IntersectionDevice*> devices;
+
+        for (auto i = 0U; i < count; ++i)
+        {
+            if (devidx[i] >= GetCalcDeviceCount())
+            {
+                auto* device = CreateCpuDevice(devidx[i]);
+                if (device)
+                {
+                    devices.push_back(device);
+                }
+            }
+            else
             {
-                return new IntersectionApiImpl(new CalcIntersectionDevice(calc, calc->CreateDevice(devidx)));
+                auto* calc = GetCalc();
+                devices.push_back(new CalcIntersectionDevice(calc, calc->CreateDevice(devidx[i])));
             }
         }
 
-        return nullptr;
+        if (devices.size() != count || count == 0)
+        {
+            for (auto device : devices)
+            {
+                delete device;
+            }
+
+            return nullptr;
+        }
+
+        return new IntersectionApiImpl(new MultiIntersectionDevice(devices));
+    }
+
+    IntersectionApi* IntersectionApi::CreateRemote(char const* const* endpoints, std::uint32_t count)
+    {
+        if (!endpoints || count == 0)
+        {
+            return nullptr;
+        }
+
+        std::vector<std::unique_ptr<TcpStream>> connections;
+
+        for (auto i = 0U; i < count; ++i)
+        {
+            auto connection = endpoints[i] ? RemoteIntersectionDevice::Connect(endpoints[i]) : nullptr;
+            if (!connection)
+            {
+                return nullptr;
+            }
+
+            connections.push_back(std::move(connection));
+        }
+
+        return new IntersectionApiImpl(new RemoteIntersectionDevice(std::move(connections)));
+    }
+
+    void IntersectionApi::ServeRemote(std::uint32_t devidx, std::uint16_t port, char const* address,
+        ServeReadyFunc ready, void* userdata)
+    {
+        std::unique_ptr<IntersectionApi, void(*)(IntersectionApi*)> api(Create(devidx), &IntersectionApi::Delete);
+        ThrowIf(!api, "Invalid device index.");
+
+        auto stream = TcpStream::Accept(address ? address : "127.0.0.1", port, [ready, userdata](std::uint16_t bound)
+        {
+            if (ready)
+                ready(bound, userdata);
+        });
+        RemoteWorker(api.get(), *stream).Run();
+    }
+
+    IntersectionApi* IntersectionApi::CreateFromSnapshot(SceneSnapshot const* snapshot)
+    {
+        auto device = static_cast<SceneSnapshotImpl const*>(snapshot)->GetDevice()->CreateSnapshot();
+        return new IntersectionApiImpl(device);
     }
 
     // Deallocation (to simplify DLL scenario)
@@ -269,6 +447,11 @@ namespace RadeonRays
         delete api;
     }
 
+    void IntersectionApi::DeleteSnapshot(SceneSnapshot* snapshot)
+    {
+        delete snapshot;
+    }
+
 #ifdef USE_VULKAN
     RRAPI IntersectionApi* CreateFromVulkan(Anvil::Device* device, Anvil::CommandPool* cmd_pool)
     {
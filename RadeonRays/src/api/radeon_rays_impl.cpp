@@ -23,8 +23,14 @@ THE SOFTWARE.
 #include "radeon_rays_impl.h"
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
+#include "../primitive/device_mesh.h"
+#include "../primitive/spheres.h"
+#include "../primitive/group.h"
 #include "../except/except.h"
 #include "../device/intersection_device.h"
+#include "../util/thread_settings.h"
+#include "ray_stream.h"
+#include "trace.h"
 
 #if USE_OPENCL
 #include "../device/calc_intersection_device_cl.h"
@@ -35,11 +41,81 @@ THE SOFTWARE.
 #include <wrappers/buffer.h>
 #endif
 
+#include <algorithm>
 #include <vector>
 #include <cfloat>
+#include <chrono>
+#include <exception>
+#include <future>
+#include <memory>
 
 namespace RadeonRays
 {
+    namespace
+    {
+        // Minimum number of meshes created by a single CreateMeshes job
+        int constexpr kMinMeshesPerJob = 64;
+
+        // Completion of an asynchronous commit
+        class CommitEvent : public Event
+        {
+        public:
+            CommitEvent(std::shared_future<void> const& future)
+                : m_future(future)
+            {
+            }
+
+            bool Complete() const override
+            {
+                return m_future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+            }
+
+            void Wait() override
+            {
+                // Rethrows the error of a failed build
+                m_future.get();
+            }
+
+            // Wait without reporting the error of a failed build
+            void WaitForBuild() const
+            {
+                m_future.wait();
+            }
+
+        private:
+            std::shared_future<void> m_future;
+        };
+
+        // Progress of commits forwarded to the user callback
+        class CallbackProgressReporter : public ProgressReporter
+        {
+        public:
+            CallbackProgressReporter(IntersectionApi::ProgressFunc func, void* userdata)
+                : m_func(func)
+                , m_userdata(userdata)
+            {
+            }
+
+            void Report(float progress) override
+            {
+                m_func(progress, m_userdata);
+            }
+
+        private:
+            IntersectionApi::ProgressFunc m_func;
+            void* m_userdata;
+        };
+    }
+
+    SceneSnapshotImpl::SceneSnapshotImpl(IntersectionDevice* device)
+        : m_device(device)
+    {
+    }
+
+    SceneSnapshotImpl::~SceneSnapshotImpl()
+    {
+    }
+
     IntersectionApiImpl::IntersectionApiImpl(IntersectionDevice* device)
         : nextid_(1)
     , m_device(device)
@@ -59,6 +135,7 @@ namespace RadeonRays
 
     IntersectionApiImpl::~IntersectionApiImpl()
     {
+        WaitForCommit();
     }
 
     Shape* IntersectionApiImpl::CreateMesh(
@@ -79,9 +156,114 @@ namespace RadeonRays
         return mesh;
     }
 
+    Shape* IntersectionApiImpl::CreateMeshFromExternalMemory(
+        // Position data
+        float const * vertices, int vnum, int vstride,
+        // Index data for vertices
+        int const * indices, int istride,
+        // Number of faces
+        int  numface
+        ) const
+    {
+        Mesh* mesh = new Mesh(vertices, vnum, vstride, indices, istride, numface, Mesh::ExternalMemory());
+
+        mesh->SetId(nextid_++);
+
+        return mesh;
+    }
+
+    Shape* IntersectionApiImpl::CreateMeshFromDeviceBuffers(
+        // Position data
+        Buffer const* vertices, int vnum, int vstride,
+        // Index data for vertices
+        Buffer const* indices, int istride,
+        // Number of faces
+        int  numface
+        ) const
+    {
+        ThrowIf(!m_device->SupportsDeviceMeshes(), "Device does not support meshes in device buffers.");
+        ThrowIf(!vertices || !indices, "Vertex and index buffers are required.");
+
+        DeviceMesh* mesh = new DeviceMesh(vertices, vnum, vstride, indices, istride, numface);
+
+        mesh->SetId(nextid_++);
+
+        return mesh;
+    }
+
+    Shape* IntersectionApiImpl::CreateSpheres(float const* centers, float const* radii, int count) const
+    {
+        ThrowIf(!m_device->SupportsSpheres(), "Device does not support analytic spheres.");
+        ThrowIf(count > 0 && (!centers || !radii), "Sphere centers and radii are required.");
+
+        Spheres* spheres = new Spheres(centers, radii, count);
+
+        spheres->SetId(nextid_++);
+
+        return spheres;
+    }
+
+    void IntersectionApiImpl::CreateMeshes(MeshDesc const* descs, int count, Shape** out) const
+    {
+        RR_TRACE_SCOPE("IntersectionApi::CreateMeshes");
+
+        std::vector<std::unique_ptr<Mesh>> meshes(count);
+
+        auto create = [descs, &meshes](int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                MeshDesc const& desc = descs[i];
+                meshes[i].reset(new Mesh(desc.vertices, desc.vnum, desc.vstride, desc.indices, desc.istride,
+                    desc.numfacevertices, desc.numfaces));
+            }
+        };
+
+        int numthreads = GetNumBuildThreads();
+        int numjobs = std::max(std::min(numthreads, count / kMinMeshesPerJob), 1);
+        int chunksize = (count + numjobs - 1) / numjobs;
+
+        std::vector<std::future<void>> jobs;
+        for (int i = 1; i < numjobs; ++i)
+        {
+            int begin = std::min(i * chunksize, count);
+            int end = std::min(begin + chunksize, count);
+            jobs.push_back(std::async(std::launch::async, create, begin, end));
+        }
+
+        // The first chunk is created on the calling thread
+        create(0, std::min(chunksize, count));
+
+        // Wait for all the jobs before rethrowing, meshes created so far are released
+        std::exception_ptr error;
+        for (auto& job : jobs)
+        {
+            try
+            {
+                job.get();
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+        }
+
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+
+        for (int i = 0; i < count; ++i)
+        {
+            meshes[i]->SetId(nextid_++);
+            out[i] = meshes[i].release();
+        }
+    }
 
     Shape* IntersectionApiImpl::CreateInstance(Shape const* shape) const
     {
+        ThrowIf(static_cast<ShapeImpl const*>(shape)->is_spheres(), "Spheres can't be instanced.");
+
         Mesh const* mesh = static_cast<Mesh const*>(shape);
 
         Instance* instance = new Instance(mesh);
@@ -91,6 +273,47 @@ namespace RadeonRays
         return instance;
     }
 
+    Shape* IntersectionApiImpl::CreateLodInstance(Shape const* const* shapes, float const* distances, int count) const
+    {
+        ThrowIf(!shapes || count <= 0 || count > Instance::kMaxLods, "Instances have 1 to 4 levels of detail.");
+        ThrowIf(count > 1 && !distances, "Level of detail distances are required.");
+
+        for (int i = 0; i < count; ++i)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shapes[i]);
+            ThrowIf(!shapeimpl || shapeimpl->is_instance() || shapeimpl->is_group() || shapeimpl->is_spheres(),
+                "Levels of detail can only be meshes.");
+            ThrowIf(i > 0 && (distances[i - 1] <= 0.f || (i > 1 && distances[i - 1] <= distances[i - 2])),
+                "Level of detail distances have to be positive and increasing.");
+        }
+
+        Instance* instance = new Instance(shapes[0]);
+        instance->SetLods(shapes, distances, count);
+
+        instance->SetId(nextid_++);
+
+        return instance;
+    }
+
+    Shape* IntersectionApiImpl::CreateGroup(Shape const* const* shapes, int count) const
+    {
+        ThrowIf(!m_device->SupportsNestedInstances(), "Device does not support nested instances.");
+        ThrowIf(!shapes || count <= 0, "Groups need at least one shape.");
+
+        for (int i = 0; i < count; ++i)
+        {
+            ThrowIf(!shapes[i] || static_cast<ShapeImpl const*>(shapes[i])->is_group() ||
+                static_cast<ShapeImpl const*>(shapes[i])->is_spheres(),
+                "Groups can only contain meshes and instances.");
+        }
+
+        Group* group = new Group(shapes, count);
+
+        group->SetId(nextid_++);
+
+        return group;
+    }
+
     void IntersectionApiImpl::DeleteShape(Shape const* shape)
     {
         delete shape;
@@ -98,9 +321,21 @@ namespace RadeonRays
 
     void IntersectionApiImpl::AttachShape(Shape const* shape)
     {
+        ThrowIf(static_cast<ShapeImpl const*>(shape)->is_group(), "Groups can only be attached through instances.");
+
         world_.AttachShape(shape);
     }
 
+    void IntersectionApiImpl::AttachShapes(Shape const* const* shapes, int count)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            ThrowIf(static_cast<ShapeImpl const*>(shapes[i])->is_group(), "Groups can only be attached through instances.");
+        }
+
+        world_.AttachShapes(shapes, count);
+    }
+
     void IntersectionApiImpl::DetachShape(Shape const* shape)
     {
         world_.DetachShape(shape);
@@ -111,15 +346,141 @@ namespace RadeonRays
         world_.DetachAll();
     }
 
+    int IntersectionApiImpl::CreateLayer(char const* name)
+    {
+        ThrowIf(!m_device->SupportsRayMasks(), "Device does not support ray masks.");
+        ThrowIf(world_.GetLayer(name) >= 0, "Layer name is taken.");
+        ThrowIf(world_.layers_.size() >= static_cast<std::size_t>(kMaxLayers), "Too many layers.");
+
+        world_.layers_.push_back(name);
+        return static_cast<int>(world_.layers_.size()) - 1;
+    }
+
+    int IntersectionApiImpl::GetLayer(char const* name) const
+    {
+        return world_.GetLayer(name);
+    }
+
+    void IntersectionApiImpl::SetLayerMembership(int layer, Shape const* shape, bool member)
+    {
+        ThrowIf(layer < 0 || layer >= static_cast<int>(world_.layers_.size()), "Invalid layer.");
+
+        static_cast<ShapeImpl const*>(shape)->SetLayer(layer, member);
+    }
+
 
     void IntersectionApiImpl::Commit()
     {
+        RR_TRACE_SCOPE("IntersectionApi::Commit");
+
         ThrowIf(world_.shapes_.empty(), "Scene is empty.");
-        m_device->Preprocess(world_);
+        WaitForCommit();
+
+        world_.UpdateLayerMasks();
+
+        // The device is updated in place, so the build only reports its progress
+        auto monitor = std::make_shared<BuildMonitor>(m_progress.get(), false);
+        world_.monitor_ = monitor;
+
+        try
+        {
+            m_device->Preprocess(world_);
+        }
+        catch (...)
+        {
+            world_.monitor_.reset();
+            throw;
+        }
+
+        world_.monitor_.reset();
+        monitor->Finish();
 
         world_.OnCommit();
     }
 
+    void IntersectionApiImpl::CommitAsync(Event** event)
+    {
+        RR_TRACE_SCOPE("IntersectionApi::CommitAsync");
+
+        ThrowIf(world_.shapes_.empty(), "Scene is empty.");
+        WaitForCommit();
+
+        world_.UpdateLayerMasks();
+
+        if (m_device->SupportsConcurrentPreprocess())
+        {
+            // The build runs on a snapshot of the world, so shapes can be attached
+            // and detached meanwhile. The device builds a fresh copy of the scene data,
+            // change flags are not needed and can be reset right away.
+            // The build goes into fresh scene data, so it can be cancelled.
+            auto world = std::make_shared<World>(world_);
+            world_.OnCommit();
+
+            auto monitor = std::make_shared<BuildMonitor>(m_progress.get(), true);
+            world->monitor_ = monitor;
+            m_monitor = monitor;
+
+            auto device = m_device.get();
+            m_commit = std::async(std::launch::async, [device, world, monitor]()
+            {
+                RR_TRACE_SCOPE("IntersectionApi::CommitAsync.build");
+
+                SetBuildThreadPriority();
+                device->PreprocessConcurrent(*world);
+                monitor->Finish();
+            }).share();
+        }
+        else
+        {
+            Commit();
+
+            std::promise<void> done;
+            done.set_value();
+            m_commit = done.get_future().share();
+        }
+
+        if (event)
+        {
+            *event = new CommitEvent(m_commit);
+        }
+    }
+
+    void IntersectionApiImpl::CancelCommit()
+    {
+        if (m_monitor)
+        {
+            m_monitor->Cancel();
+        }
+    }
+
+    void IntersectionApiImpl::SetProgressCallback(ProgressFunc func, void* userdata)
+    {
+        // Running builds keep reporting to the previous callback
+        WaitForCommit();
+        m_progress.reset(func ? new CallbackProgressReporter(func, userdata) : nullptr);
+    }
+
+    SceneSnapshot* IntersectionApiImpl::CreateSnapshot()
+    {
+        WaitForCommit();
+
+        auto device = m_device->CreateSnapshot();
+        ThrowIf(!device, "Device does not support scene snapshots.");
+
+        return new SceneSnapshotImpl(device);
+    }
+
+    void IntersectionApiImpl::WaitForCommit()
+    {
+        RR_TRACE_SCOPE("IntersectionApi::WaitForCommit");
+
+        // Errors of the previous build are reported through its event
+        if (m_commit.valid())
+        {
+            m_commit.wait();
+        }
+    }
+
     void IntersectionApiImpl::DeleteBuffer(Buffer* buffer) const
     {
         m_device->DeleteBuffer(buffer);
@@ -127,34 +488,277 @@ namespace RadeonRays
 
     void IntersectionApiImpl::QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const
     {
+        RR_TRACE_SCOPE("IntersectionApi::QueryIntersection");
+
         m_device->QueryIntersection(rays, numrays, hitinfos, waitevent, event);
     }
 
     void IntersectionApiImpl::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const
     {
+        RR_TRACE_SCOPE("IntersectionApi::QueryOcclusion");
+
+        m_device->QueryOcclusion(rays, numrays, hitresults, waitevent, event);
+    }
+
+    void IntersectionApiImpl::SubmitQueries(QueryDesc const* descs, int count, Event const* waitevent, Event** event) const
+    {
+        RR_TRACE_SCOPE("IntersectionApi::SubmitQueries");
+
+        ThrowIf(count < 0 || (count > 0 && !descs), "Invalid query descriptions.");
+
+        for (int i = 0; i < count; ++i)
+        {
+            ThrowIf(descs[i].type != kQueryIntersection && descs[i].type != kQueryOcclusion, "Invalid query type.");
+            ThrowIf(!descs[i].rays || !descs[i].hits || descs[i].numrays < 0, "Invalid query buffers.");
+        }
+
+        m_device->SubmitQueries(descs, count, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryIntersection(RayLayout const& rays, int numrays, HitLayout const& hits, Event const* waitevent, Event** event) const
+    {
+        RR_TRACE_SCOPE("IntersectionApi::QueryIntersection");
+
+        ThrowIf(!rays.origins || !rays.directions || numrays < 0, "Invalid ray layout.");
+
+        m_device->QueryIntersection(rays, numrays, hits, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryOcclusion(RayLayout const& rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const
+    {
+        RR_TRACE_SCOPE("IntersectionApi::QueryOcclusion");
+
+        ThrowIf(!rays.origins || !rays.directions || numrays < 0, "Invalid ray layout.");
+        ThrowIf(!hitresults, "Invalid query buffers.");
+
         m_device->QueryOcclusion(rays, numrays, hitresults, waitevent, event);
     }
 
+    void IntersectionApiImpl::QueryDistance(Buffer const* rays, int numrays, Buffer* distances, Event const* waitevent, Event** event) const
+    {
+        RR_TRACE_SCOPE("IntersectionApi::QueryDistance");
+
+        ThrowIf(!rays || !distances || numrays < 0, "Invalid query buffers.");
+
+        m_device->QueryDistance(rays, numrays, distances, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryOcclusionCount(Buffer const* rays, int numrays, int groupsize, Buffer* counts, Event const* waitevent, Event** event) const
+    {
+        RR_TRACE_SCOPE("IntersectionApi::QueryOcclusionCount");
+
+        ThrowIf(!rays || !counts || numrays < 0, "Invalid query buffers.");
+        ThrowIf(groupsize < 1, "Group size should be at least 1.");
+
+        m_device->QueryOcclusionCount(rays, numrays, groupsize, counts, waitevent, event);
+    }
+
     void IntersectionApiImpl::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const
     {
+        RR_TRACE_SCOPE("IntersectionApi::QueryIntersection");
+
         m_device->QueryIntersection(rays, numrays, maxrays, hitinfos, waitevent, event);
     }
 
     void IntersectionApiImpl::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const
     {
+        RR_TRACE_SCOPE("IntersectionApi::QueryOcclusion");
+
         m_device->QueryOcclusion(rays, numrays, maxrays, hitresults, waitevent, event);
     }
 
+    void IntersectionApiImpl::QueryOcclusionPacked(Buffer const* rays, int numrays, Buffer* hitbits, Event const* waitevent, Event** event) const
+    {
+        RR_TRACE_SCOPE("IntersectionApi::QueryOcclusionPacked");
+
+        m_device->QueryOcclusionPacked(rays, numrays, hitbits, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryOcclusionPacked(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitbits, Event const* waitevent, Event** event) const
+    {
+        RR_TRACE_SCOPE("IntersectionApi::QueryOcclusionPacked");
+
+        m_device->QueryOcclusionPacked(rays, numrays, maxrays, hitbits, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hitinfos, Event const* waitevent, Event** event) const
+    {
+        RR_TRACE_SCOPE("IntersectionApi::QueryIntersectionMulti");
+
+        m_device->QueryIntersectionMulti(rays, numrays, k, hitinfos, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryIntersectionMulti(Buffer const* rays, Buffer const* numrays, int maxrays, int k, Buffer* hitinfos, Event const* waitevent, Event** event) const
+    {
+        RR_TRACE_SCOPE("IntersectionApi::QueryIntersectionMulti");
+
+        m_device->QueryIntersectionMulti(rays, numrays, maxrays, k, hitinfos, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryIntersectionAttributes(Buffer const* rays, int numrays, int numattributes, Buffer* hitinfos, Buffer* attributes, Event const* waitevent, Event** event) const
+    {
+        RR_TRACE_SCOPE("IntersectionApi::QueryIntersectionAttributes");
+
+        m_device->QueryIntersectionAttributes(rays, numrays, numattributes, hitinfos, attributes, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryOcclusionCached(Buffer const* rays, int numrays, Buffer* occluders, Buffer* hitresults, Event const* waitevent, Event** event) const
+    {
+        RR_TRACE_SCOPE("IntersectionApi::QueryOcclusionCached");
+
+        m_device->QueryOcclusionCached(rays, numrays, occluders, hitresults, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryOverlap(Buffer const* boxes, int count, int maxoverlaps, Buffer* overlaps, Buffer* counts, Event const* waitevent, Event** event) const
+    {
+        RR_TRACE_SCOPE("IntersectionApi::QueryOverlap");
+
+        m_device->QueryOverlap(boxes, count, maxoverlaps, overlaps, counts, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryClosestPoint(Buffer const* points, int count, float maxdist, Buffer* results, Event const* waitevent, Event** event) const
+    {
+        RR_TRACE_SCOPE("IntersectionApi::QueryClosestPoint");
+
+        m_device->QueryClosestPoint(points, count, maxdist, results, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryIntersection2D(Buffer const* rays, int width, int height, RayOrder order, Buffer* hitinfos, Event const* waitevent, Event** event) const
+    {
+        RR_TRACE_SCOPE("IntersectionApi::QueryIntersection2D");
+
+        m_device->QueryIntersection2D(rays, width, height, order, hitinfos, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryPrimaryPinhole(PinholeCamera const& camera, int width, int height, Buffer* hitinfos, Event const* waitevent, Event** event) const
+    {
+        RR_TRACE_SCOPE("IntersectionApi::QueryPrimaryPinhole");
+
+        m_device->QueryPrimaryPinhole(camera, width, height, hitinfos, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryShadowFromHits(Buffer const* rays, Buffer const* hitinfos, int numrays, float3 const& light, float epsilon, Buffer* hitresults, Event const* waitevent, Event** event) const
+    {
+        RR_TRACE_SCOPE("IntersectionApi::QueryShadowFromHits");
+
+        m_device->QueryShadowFromHits(rays, hitinfos, numrays, light, epsilon, hitresults, waitevent, event);
+    }
+
+    void IntersectionApiImpl::CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* compacted, Buffer* newnumrays, Buffer* indices, Event const* waitevent, Event** event) const
+    {
+        RR_TRACE_SCOPE("IntersectionApi::CompactRays");
+
+        m_device->CompactRays(rays, numrays, maxrays, predicate, compacted, newnumrays, indices, waitevent, event);
+    }
+
+    void IntersectionApiImpl::SortHits(Buffer const* hitinfos, Buffer const* numrays, int maxrays, Buffer* indices, Buffer* numhits, Event const* waitevent, Event** event) const
+    {
+        RR_TRACE_SCOPE("IntersectionApi::SortHits");
+
+        m_device->SortHits(hitinfos, numrays, maxrays, indices, numhits, waitevent, event);
+    }
+
+    std::uint32_t IntersectionApiImpl::GetQueueCount() const
+    {
+        return m_device->GetQueueCount();
+    }
+
+    void IntersectionApiImpl::SetQueue(std::uint32_t queue)
+    {
+        m_device->SetQueue(queue);
+    }
+
+    void IntersectionApiImpl::SetQueryPriority(QueryPriority priority)
+    {
+        m_device->SetQueryPriority(priority);
+    }
+
+    void IntersectionApiImpl::SetQueryHint(QueryHint hint)
+    {
+        m_device->SetQueryHint(hint);
+    }
+
+    void IntersectionApiImpl::SetTraversalStatsBuffer(Buffer* stats)
+    {
+        m_device->SetTraversalStatsBuffer(stats);
+    }
+
     void IntersectionApiImpl::DeleteEvent(Event* event) const
     {
+        // Commit events are not owned by the device
+        if (auto commit_event = dynamic_cast<CommitEvent*>(event))
+        {
+            delete commit_event;
+            return;
+        }
+
         m_device->DeleteEvent(event);
     }
 
+    void IntersectionApiImpl::JoinEvents(Event const* const* events, int count, Event** event) const
+    {
+        ThrowIf(count < 0 || (count > 0 && !events) || !event, "Invalid arguments.");
+
+        std::vector<Event const*> device_events;
+        for (int i = 0; i < count; ++i)
+        {
+            if (!events[i])
+            {
+                continue;
+            }
+
+            // Commit events are not owned by the device, so the build is waited for here,
+            // its error is still reported by the event
+            if (auto commit_event = dynamic_cast<CommitEvent const*>(events[i]))
+            {
+                commit_event->WaitForBuild();
+                continue;
+            }
+
+            device_events.push_back(events[i]);
+        }
+
+        m_device->JoinEvents(device_events.data(), static_cast<int>(device_events.size()), event);
+    }
+
+    void IntersectionApiImpl::WaitForEvents(Event* const* events, int count) const
+    {
+        ThrowIf(count < 0 || (count > 0 && !events), "Invalid arguments.");
+
+        for (int i = 0; i < count; ++i)
+        {
+            if (events[i])
+            {
+                events[i]->Wait();
+            }
+        }
+    }
+
     Buffer* IntersectionApiImpl::CreateBuffer(size_t size, void* initdata) const
     {
         return m_device->CreateBuffer(size, initdata);
     }
 
+    Buffer* IntersectionApiImpl::CreateBuffer(size_t size, void* initdata, BufferUsage usage) const
+    {
+        return m_device->CreateBuffer(size, initdata, usage);
+    }
+
+    Buffer* IntersectionApiImpl::CreateBufferFromHostPtr(void* ptr, size_t size) const
+    {
+        return m_device->CreateBufferFromHostPtr(ptr, size);
+    }
+
+    RayStream* IntersectionApiImpl::CreateRayStream(int maxrays, int depth) const
+    {
+        return new RayStreamImpl(this, maxrays, depth);
+    }
+
+    void IntersectionApiImpl::DeleteRayStream(RayStream* stream) const
+    {
+        delete stream;
+    }
+
     void IntersectionApiImpl::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const
     {
         return m_device->MapBuffer(buffer, type, offset, size, data, event);
@@ -165,6 +769,30 @@ namespace RadeonRays
         return m_device->UnmapBuffer(buffer, ptr, event);
     }
 
+    int IntersectionApiImpl::GetKernelProfile(KernelProfile* profiles, int maxprofiles) const
+    {
+        std::vector<KernelProfile> profile;
+        m_device->GetKernelProfile(profile);
+
+        if (profiles)
+        {
+            auto count = std::min(static_cast<int>(profile.size()), maxprofiles);
+            std::copy(profile.begin(), profile.begin() + count, profiles);
+        }
+
+        return static_cast<int>(profile.size());
+    }
+
+    void IntersectionApiImpl::ResetKernelProfile()
+    {
+        m_device->ResetKernelProfile();
+    }
+
+    void IntersectionApiImpl::GetStats(AccelStats& stats) const
+    {
+        m_device->GetStats(stats);
+    }
+
     void IntersectionApiImpl::ResetIdCounter()
     {
         nextid_ = 1;
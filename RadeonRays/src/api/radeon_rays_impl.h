@@ -23,14 +23,30 @@ THE SOFTWARE.
 #define INTERSECTIONAPI_IMPL
 
 #include <atomic>
+#include <future>
 
 #include "radeon_rays.h"
 #include "../world/world.h"
+#include "../util/build_monitor.h"
 
 namespace RadeonRays
 {
     class IntersectionDevice;
 
+    // Snapshot keeps a device querying the captured scene,
+    // APIs created from it get their own copies of the device
+    class SceneSnapshotImpl : public SceneSnapshot
+    {
+    public:
+        SceneSnapshotImpl(IntersectionDevice* device);
+        ~SceneSnapshotImpl();
+
+        IntersectionDevice* GetDevice() const { return m_device.get(); }
+
+    private:
+        std::unique_ptr<IntersectionDevice> m_device;
+    };
+
     /// IntersectionApi is designed to provide fast means for ray-scene intersection
     /// for AMD architectures. It effectively absracts underlying AMD hardware and
     /// software stack and allows user to issue low-latency batched ray queries.
@@ -62,19 +78,64 @@ namespace RadeonRays
             int  numfaces
             ) const override;
 
+        Shape* CreateMeshFromDeviceBuffers(
+            // Position data
+            Buffer const* vertices, int vnum, int vstride,
+            // Index data for vertices
+            Buffer const* indices, int istride,
+            // Number of faces
+            int  numfaces
+            ) const override;
+
+        // Create a triangle mesh referencing the caller memory instead of copying it
+        Shape* CreateMeshFromExternalMemory(
+            // Position data
+            float const * vertices, int vnum, int vstride,
+            // Index data for vertices
+            int const * indices, int istride,
+            // Number of faces
+            int  numfaces
+            ) const override;
+
+        // Create a shape of analytic spheres
+        Shape* CreateSpheres(float const* centers, float const* radii, int count) const override;
+
+        // Create count meshes at once, constructing them in parallel
+        void CreateMeshes(MeshDesc const* descs, int count, Shape** out) const override;
+
         // Create an instance of a shape with its own transform (set via Shape interface).
         // The call is blocking, so the returned value is ready upon return.
         Shape* CreateInstance(Shape const* shape) const override;
+        // Create an instance switching between meshes by distance
+        Shape* CreateLodInstance(Shape const* const* shapes, float const* distances, int count) const override;
+        // Create a group of shapes to be instanced as a whole
+        Shape* CreateGroup(Shape const* const* shapes, int count) const override;
         // Delete the shape (to simplify DLL boundary crossing
         void DeleteShape(Shape const* shape) override;
         // Attach shape to participate in intersection process
         void AttachShape(Shape const* shape) override;
+        // Attach count shapes at once
+        void AttachShapes(Shape const* const* shapes, int count) override;
         // Detach shape, i.e. it is not going to be considered part of the scene anymore
         void DetachShape(Shape const* shape) override;
         // Detach all objects
         void DetachAll() override;
+        // Create a named subset of the scene
+        int CreateLayer(char const* name) override;
+        // Find the layer by name
+        int GetLayer(char const* name) const override;
+        // Add the shape to or remove it from the layer
+        void SetLayerMembership(int layer, Shape const* shape, bool member) override;
         // Commit all geometry creations/changes
         void Commit() override;
+        // Commit all geometry creations/changes on a worker thread
+        void CommitAsync(Event** event) override;
+        // Abort the build of the running CommitAsync
+        void CancelCommit() override;
+        // Report the progress of commits
+        void SetProgressCallback(ProgressFunc func, void* userdata) override;
+        // Capture the committed scene
+        SceneSnapshot* CreateSnapshot() override;
 
         //Sets the shape id allocator to its default value (1)
         void ResetIdCounter() override;
@@ -85,6 +146,9 @@ namespace RadeonRays
         Memory management
         ******************************************/
         Buffer* CreateBuffer(size_t size, void* initdata) const override;
+        Buffer* CreateBuffer(size_t size, void* initdata, BufferUsage usage) const override;
+        // Wrap host memory without copying
+        Buffer* CreateBufferFromHostPtr(void* ptr, size_t size) const override;
 
         // Delete the buffer
         void DeleteBuffer(Buffer* buffer) const override;
@@ -98,6 +162,14 @@ namespace RadeonRays
           Events handling
         *******************************************/
         void DeleteEvent(Event* event) const override;
+        void JoinEvents(Event const* const* events, int count, Event** event) const override;
+        void WaitForEvents(Event* const* events, int count) const override;
+
+        /******************************************
+          Streaming
+        *******************************************/
+        RayStream* CreateRayStream(int maxrays, int depth) const override;
+        void DeleteRayStream(RayStream* stream) const override;
 
         /******************************************
         Ray casting
@@ -111,6 +183,13 @@ namespace RadeonRays
         // Find any intersection.
         // The call is asynchronous. Event pointer mights be nullptrs.
         void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        // Submit several queries at once.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        void SubmitQueries(QueryDesc const* descs, int count, Event const* waitevent, Event** event) const override;
+        void QueryIntersection(RayLayout const& rays, int numrays, HitLayout const& hits, Event const* waitevent, Event** event) const override;
+        void QueryOcclusion(RayLayout const& rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryDistance(Buffer const* rays, int numrays, Buffer* distances, Event const* waitevent, Event** event) const override;
+        void QueryOcclusionCount(Buffer const* rays, int numrays, int groupsize, Buffer* counts, Event const* waitevent, Event** event) const override;
 
         // Find closest intersection, number of rays is in remote memory
         // TODO: do we need to modify rays' intersection range?
@@ -120,6 +199,50 @@ namespace RadeonRays
         // Find any intersection.
         // The call is asynchronous. Event pointer mights be nullptrs.
         void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        // Find any intersection writing 1 bit per ray.
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        void QueryOcclusionPacked(Buffer const* rays, int numrays, Buffer* hitbits, Event const* waitevent, Event** event) const override;
+        // Find any intersection writing 1 bit per ray, number of rays is in remote memory
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        void QueryOcclusionPacked(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitbits, Event const* waitevent, Event** event) const override;
+        // Find k closest intersections.
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        void QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        // Find k closest intersections, number of rays is in remote memory
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        void QueryIntersectionMulti(Buffer const* rays, Buffer const* numrays, int maxrays, int k, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        // Find closest intersections interpolating vertex attributes of the hits.
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        void QueryIntersectionAttributes(Buffer const* rays, int numrays, int numattributes, Buffer* hitinfos, Buffer* attributes, Event const* waitevent, Event** event) const override;
+        void QueryOcclusionCached(Buffer const* rays, int numrays, Buffer* occluders, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        // Find primitives overlapping the boxes
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        void QueryOverlap(Buffer const* boxes, int count, int maxoverlaps, Buffer* overlaps, Buffer* counts, Event const* waitevent, Event** event) const override;
+        // Find the closest surface points
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        void QueryClosestPoint(Buffer const* points, int count, float maxdist, Buffer* results, Event const* waitevent, Event** event) const override;
+        // Find closest intersections of an image-shaped batch traversed in the given order
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        void QueryIntersection2D(Buffer const* rays, int width, int height, RayOrder order, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        // Find closest intersections of pinhole camera rays generated on the device
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        void QueryPrimaryPinhole(PinholeCamera const& camera, int width, int height, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        // Find any intersection of shadow rays generated on the device from the hits
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        void QueryShadowFromHits(Buffer const* rays, Buffer const* hitinfos, int numrays, float3 const& light, float epsilon, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        // Copy the kept rays to the front of compacted, the new count is written on the device
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        void CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* compacted, Buffer* newnumrays, Buffer* indices, Event const* waitevent, Event** event) const override;
+        void SortHits(Buffer const* hitinfos, Buffer const* numrays, int maxrays, Buffer* indices, Buffer* numhits, Event const* waitevent, Event** event) const override;
+
+        /******************************************
+          Queue management
+        ******************************************/
+        std::uint32_t GetQueueCount() const override;
+        void SetQueue(std::uint32_t queue) override;
+        void SetQueryPriority(QueryPriority priority) override;
+        void SetQueryHint(QueryHint hint) override;
+        void SetTraversalStatsBuffer(Buffer* stats) override;
 
         /******************************************
         Utility
@@ -128,6 +251,12 @@ namespace RadeonRays
         void SetOption(char const* name, char const* value) override;
         // Set API global option: float
         void SetOption(char const* name, float value) override;
+        // Get kernel times collected while "profile.kernels" is set
+        int GetKernelProfile(KernelProfile* profiles, int maxprofiles) const override;
+        // Drop accumulated kernel times
+        void ResetKernelProfile() override;
+        // Get statistics of the committed acceleration structure
+        void GetStats(AccelStats& stats) const override;
         
 
         IntersectionDevice* GetDevice() const { return m_device.get(); }
@@ -139,12 +268,21 @@ namespace RadeonRays
         ~IntersectionApiImpl();
 
     private:
+        // Wait for the build started by CommitAsync
+        void WaitForCommit();
+
         // Container for all shapes
         World world_;
         // Shape ID tracker
         mutable std::atomic<Id> nextid_;
         // Intersection device
         std::unique_ptr<IntersectionDevice> m_device;
+        // Build started by the last CommitAsync
+        std::shared_future<void> m_commit;
+        // Progress and cancellation of the last CommitAsync
+        std::shared_ptr<BuildMonitor> m_monitor;
+        // Progress callback of the commits, might be nullptr
+        std::unique_ptr<ProgressReporter> m_progress;
     };
 }
 
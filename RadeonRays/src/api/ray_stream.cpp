@@ -0,0 +1,155 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "ray_stream.h"
+#include "../except/except.h"
+
+#include <algorithm>
+
+namespace RadeonRays
+{
+    RayStreamImpl::RayStreamImpl(IntersectionApi const* api, int maxrays, int depth)
+        : m_api(api)
+        , m_maxrays(maxrays)
+        , m_next(0)
+        , m_num_submitted(0)
+        , m_rays_slot(-1)
+        , m_hits_slot(-1)
+    {
+        ThrowIf(maxrays <= 0, "Ray stream needs at least 1 ray per batch.");
+        ThrowIf(depth < 2, "Ray stream needs at least 2 slots.");
+
+        m_slots.resize(depth);
+        for (auto& slot : m_slots)
+        {
+            slot.rays = m_api->CreateBuffer(maxrays * sizeof(ray), nullptr, kBufferStream);
+            slot.hits = m_api->CreateBuffer(maxrays * sizeof(Intersection), nullptr, kBufferStream);
+            slot.mapped_rays = nullptr;
+            slot.mapped_hits = nullptr;
+            slot.event = nullptr;
+            slot.numrays = 0;
+        }
+    }
+
+    RayStreamImpl::~RayStreamImpl()
+    {
+        for (auto& slot : m_slots)
+        {
+            if (slot.event)
+            {
+                slot.event->Wait();
+                m_api->DeleteEvent(slot.event);
+            }
+
+            if (slot.mapped_rays)
+            {
+                m_api->UnmapBuffer(slot.rays, slot.mapped_rays, nullptr);
+            }
+
+            if (slot.mapped_hits)
+            {
+                m_api->UnmapBuffer(slot.hits, slot.mapped_hits, nullptr);
+            }
+
+            m_api->DeleteBuffer(slot.rays);
+            m_api->DeleteBuffer(slot.hits);
+        }
+    }
+
+    ray* RayStreamImpl::AcquireRays()
+    {
+        if (m_rays_slot >= 0)
+        {
+            return m_slots[m_rays_slot].mapped_rays;
+        }
+
+        // The slot of the held hits is in use as well
+        int const num_used = m_num_submitted + (m_hits_slot >= 0 ? 1 : 0);
+        ThrowIf(num_used >= static_cast<int>(m_slots.size()), "All ray stream slots are in flight, acquire hits first.");
+
+        // The queue is in-order, so the map waits for the previous query of the slot
+        auto& slot = m_slots[m_next];
+        Event* event = nullptr;
+        m_api->MapBuffer(slot.rays, kMapWrite, 0, m_maxrays * sizeof(ray), reinterpret_cast<void**>(&slot.mapped_rays), &event);
+        event->Wait();
+        m_api->DeleteEvent(event);
+
+        m_rays_slot = m_next;
+        return slot.mapped_rays;
+    }
+
+    void RayStreamImpl::Submit(int numrays)
+    {
+        ThrowIf(m_rays_slot < 0, "No rays acquired.");
+        ThrowIf(numrays < 0 || numrays > m_maxrays, "Number of rays exceeds the ray stream batch size.");
+
+        auto& slot = m_slots[m_rays_slot];
+        m_api->UnmapBuffer(slot.rays, slot.mapped_rays, nullptr);
+        slot.mapped_rays = nullptr;
+        m_rays_slot = -1;
+
+        m_api->QueryIntersection(slot.rays, numrays, slot.hits, nullptr, nullptr);
+
+        // Map at least one record, so empty batches don't need special handling
+        auto const mapped = std::max(numrays, 1) * sizeof(Intersection);
+        m_api->MapBuffer(slot.hits, kMapRead, 0, mapped, reinterpret_cast<void**>(&slot.mapped_hits), &slot.event);
+        slot.numrays = numrays;
+
+        m_next = (m_next + 1) % static_cast<int>(m_slots.size());
+        ++m_num_submitted;
+    }
+
+    Intersection const* RayStreamImpl::AcquireHits(int* numrays)
+    {
+        ThrowIf(m_num_submitted == 0, "No ray batch submitted.");
+
+        ReleaseHits();
+
+        int const depth = static_cast<int>(m_slots.size());
+        m_hits_slot = (m_next - m_num_submitted + depth) % depth;
+        --m_num_submitted;
+
+        auto& slot = m_slots[m_hits_slot];
+        slot.event->Wait();
+        m_api->DeleteEvent(slot.event);
+        slot.event = nullptr;
+
+        if (numrays)
+        {
+            *numrays = slot.numrays;
+        }
+
+        return slot.mapped_hits;
+    }
+
+    void RayStreamImpl::ReleaseHits()
+    {
+        if (m_hits_slot < 0)
+        {
+            return;
+        }
+
+        auto& slot = m_slots[m_hits_slot];
+        m_api->UnmapBuffer(slot.hits, slot.mapped_hits, nullptr);
+        slot.mapped_hits = nullptr;
+        m_hits_slot = -1;
+    }
+}
@@ -0,0 +1,68 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "radeon_rays.h"
+
+#include <vector>
+
+namespace RadeonRays
+{
+    // Ring of stream buffer pairs, the host fills the rays of one slot while the
+    // queries of the previous ones run. Rays are unmapped, traced and the hits mapped
+    // back with a single in-order submission per slot, so only acquiring waits.
+    class RayStreamImpl : public RayStream
+    {
+    public:
+        RayStreamImpl(IntersectionApi const* api, int maxrays, int depth);
+        ~RayStreamImpl();
+
+        ray* AcquireRays() override;
+        void Submit(int numrays) override;
+        Intersection const* AcquireHits(int* numrays) override;
+        void ReleaseHits() override;
+        int GetMaxRays() const override { return m_maxrays; }
+
+    private:
+        struct Slot
+        {
+            Buffer* rays;
+            Buffer* hits;
+            // Host pointers while the buffers are mapped, nullptr otherwise
+            ray* mapped_rays;
+            Intersection* mapped_hits;
+            // Completes once the hits are mapped
+            Event* event;
+            int numrays;
+        };
+
+        IntersectionApi const* m_api;
+        int m_maxrays;
+        std::vector<Slot> m_slots;
+        // Slot filled next, the oldest submitted one is m_num_submitted slots before it
+        int m_next;
+        int m_num_submitted;
+        // Slot with acquired rays or hits, -1 if there is none
+        int m_rays_slot;
+        int m_hits_slot;
+    };
+}
@@ -0,0 +1,424 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "remote_worker.h"
+#include "../except/except.h"
+#include "../primitive/shapeimpl.h"
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+
+namespace RadeonRays
+{
+    namespace
+    {
+        // Message of the exception being handled, sent back to the client
+        std::string GetErrorMessage()
+        {
+            try
+            {
+                throw;
+            }
+            catch (Exception const& e)
+            {
+                return e.what();
+            }
+            catch (std::exception const& e)
+            {
+                return e.what();
+            }
+            catch (...)
+            {
+                return "Unknown error.";
+            }
+        }
+
+        void* MapBlocking(IntersectionApi* api, Buffer* buffer, MapType type, std::size_t size)
+        {
+            void* data = nullptr;
+            Event* e = nullptr;
+            api->MapBuffer(buffer, type, 0, size, &data, &e);
+            e->Wait();
+            api->DeleteEvent(e);
+            return data;
+        }
+
+        void UnmapBlocking(IntersectionApi* api, Buffer* buffer, void* data)
+        {
+            Event* e = nullptr;
+            api->UnmapBuffer(buffer, data, &e);
+            e->Wait();
+            api->DeleteEvent(e);
+        }
+    }
+
+    RemoteWorker::RemoteWorker(IntersectionApi* api, TcpStream& stream)
+        : m_api(api)
+        , m_stream(stream)
+    {
+        m_format.ray_size = sizeof(ray);
+        m_format.hit_size = sizeof(Intersection);
+        m_format.compact_occlusion = 0;
+
+        for (auto& slot : m_slots)
+        {
+            slot.rays = nullptr;
+            slot.hits = nullptr;
+            slot.rays_size = 0;
+            slot.hits_size = 0;
+            slot.event = nullptr;
+            slot.count = 0;
+            slot.occlusion = false;
+        }
+    }
+
+    RemoteWorker::~RemoteWorker()
+    {
+        for (auto& slot : m_slots)
+        {
+            if (slot.event)
+            {
+                slot.event->Wait();
+                m_api->DeleteEvent(slot.event);
+            }
+
+            if (slot.rays)
+                m_api->DeleteBuffer(slot.rays);
+            if (slot.hits)
+                m_api->DeleteBuffer(slot.hits);
+        }
+
+        ReleaseScene();
+    }
+
+    void RemoteWorker::Run()
+    {
+        // Malformed messages end the session with an error reply, so the client doesn't wait for
+        // an answer and the caller of ServeRemote isn't taken down by a misbehaving peer
+        try
+        {
+            Serve();
+        }
+        catch (...)
+        {
+            auto const error = GetErrorMessage();
+
+            try
+            {
+                Remote::SendError(m_stream, error);
+                m_stream.Shutdown();
+            }
+            catch (...)
+            {
+                // The connection is lost already
+            }
+        }
+    }
+
+    void RemoteWorker::Serve()
+    {
+        Remote::MessageHeader header;
+        std::vector<char> payload;
+
+        if (!Remote::ReceiveMessage(m_stream, header, payload, m_format, 0))
+            return;
+
+        ThrowIf(header.type != Remote::kHello, "Malformed remote message.");
+        ThrowIf(header.count != Remote::kProtocolVersion, "Protocol version mismatch.");
+
+        Remote::SendMessage(m_stream, Remote::kHello, Remote::kProtocolVersion, 0, nullptr, 0);
+
+        int current = 0;
+        while (Remote::ReceiveMessage(m_stream, header, payload, m_format, 0))
+        {
+            if (header.type == Remote::kScene)
+            {
+                try
+                {
+                    LoadScene(payload);
+                }
+                catch (...)
+                {
+                    Remote::SendError(m_stream, GetErrorMessage());
+                    continue;
+                }
+
+                Remote::SendMessage(m_stream, Remote::kResult, 0, 0, nullptr, 0);
+            }
+            else if (header.type == Remote::kIntersect || header.type == Remote::kOcclude)
+            {
+                auto& slot = m_slots[current];
+                auto& previous = m_slots[1 - current];
+
+                std::string error;
+                try
+                {
+                    Launch(slot, header, payload);
+                }
+                catch (...)
+                {
+                    error = GetErrorMessage();
+                }
+
+                // Chunks are answered in order, the previous one is done while this one is traced
+                if (previous.event)
+                {
+                    Finish(previous);
+                }
+
+                if (!error.empty())
+                {
+                    Remote::SendError(m_stream, error);
+                }
+                else if (!(header.flags & Remote::kMessageMore))
+                {
+                    Finish(slot);
+                }
+
+                current = 1 - current;
+            }
+            else
+            {
+                Throw("Malformed remote message.");
+            }
+        }
+    }
+
+    void RemoteWorker::ReleaseScene()
+    {
+        m_api->DetachAll();
+
+        for (auto shape : m_shapes)
+        {
+            m_api->DeleteShape(shape);
+        }
+
+        m_shapes.clear();
+    }
+
+    void RemoteWorker::LoadScene(std::vector<char> const& payload)
+    {
+        ReleaseScene();
+
+        Remote::MessageReader reader(payload.data(), payload.size());
+        auto const format = reader.Read<Remote::RecordFormat>();
+
+        // Only the options shaping the acceleration structure and the records are applied
+        Options options;
+        auto const numoptions = reader.Read<std::uint32_t>();
+        for (auto i = 0U; i < numoptions; ++i)
+        {
+            auto const name = reader.ReadString();
+
+            if (reader.Read<std::uint32_t>())
+                options.SetValue(name, reader.ReadString());
+            else
+                options.SetValue(name, reader.Read<float>());
+        }
+
+        // Records are sized by the format, it has to be the one the options give
+        ThrowIf(!(format == Remote::GetRecordFormat(options)), "Malformed remote message.");
+
+        for (auto const& option : options.GetOptions())
+        {
+            if (!Remote::IsForwardedOption(option.first))
+                continue;
+
+            if (option.second.isstring)
+                m_api->SetOption(option.first.c_str(), option.second.AsString().c_str());
+            else
+                m_api->SetOption(option.first.c_str(), option.second.AsFloat());
+        }
+
+        std::vector<Shape const*> attached;
+
+        auto const numshapes = reader.Read<std::uint32_t>();
+        for (auto i = 0U; i < numshapes; ++i)
+        {
+            auto const kind = reader.Read<std::uint32_t>();
+            auto const attach = reader.Read<std::uint32_t>();
+            auto const id = reader.Read<Id>();
+            auto const mask = reader.Read<int>();
+            auto const m = reader.Read<matrix>();
+            auto const minv = reader.Read<matrix>();
+            auto const linear_velocity = reader.Read<float3>();
+            auto const angular_velocity = reader.Read<quaternion>();
+
+            Shape* shape = nullptr;
+
+            if (kind == Remote::kInstance)
+            {
+                auto const base = reader.Read<std::uint32_t>();
+                ThrowIf(base >= m_shapes.size(), "Malformed remote message.");
+
+                // Devices take instance bases for meshes, see RemoteIntersectionDevice::SerializeScene
+                auto const baseimpl = static_cast<ShapeImpl const*>(m_shapes[base]);
+                ThrowIf(baseimpl->is_instance() || baseimpl->is_group() || baseimpl->is_device_mesh(), "Malformed remote message.");
+
+                shape = m_api->CreateInstance(m_shapes[base]);
+            }
+            else if (kind == Remote::kSpheres)
+            {
+                auto const count = reader.Read<std::uint32_t>();
+                reader.CheckCount(count, sizeof(float3));
+
+                std::vector<float> centers(3 * count);
+                std::vector<float> radii(count);
+                for (auto s = 0U; s < count; ++s)
+                {
+                    auto const sphere = reader.Read<float3>();
+                    centers[3 * s] = sphere.x;
+                    centers[3 * s + 1] = sphere.y;
+                    centers[3 * s + 2] = sphere.z;
+                    radii[s] = sphere.w;
+                }
+
+                shape = m_api->CreateSpheres(centers.data(), radii.data(), static_cast<int>(count));
+            }
+            else if (kind == Remote::kMesh)
+            {
+                auto const numvertices = reader.Read<std::uint32_t>();
+                reader.CheckCount(numvertices, sizeof(float3));
+                std::vector<float3> vertices(numvertices);
+                reader.Read(vertices.data(), vertices.size() * sizeof(float3));
+
+                auto const numfaces = reader.Read<std::uint32_t>();
+                reader.CheckCount(numfaces, 5 * sizeof(int));
+                std::vector<int> numfaceverts(numfaces);
+                std::vector<int> faces(4 * numfaces);
+                reader.Read(numfaceverts.data(), numfaceverts.size() * sizeof(int));
+                reader.Read(faces.data(), faces.size() * sizeof(int));
+
+                // Meshes don't check their indices
+                for (auto f = 0U; f < numfaces; ++f)
+                {
+                    ThrowIf(numfaceverts[f] != 3 && numfaceverts[f] != 4, "Malformed remote message.");
+                    for (int v = 0; v < numfaceverts[f]; ++v)
+                    {
+                        ThrowIf(faces[4 * f + v] < 0 || faces[4 * f + v] >= static_cast<int>(numvertices), "Malformed remote message.");
+                    }
+                }
+
+                shape = m_api->CreateMesh(reinterpret_cast<float const*>(vertices.data()), static_cast<int>(numvertices), sizeof(float3),
+                    faces.data(), 4 * sizeof(int), numfaceverts.data(), static_cast<int>(numfaces));
+            }
+            else
+            {
+                Throw("Malformed remote message.");
+            }
+
+            m_shapes.push_back(shape);
+
+            shape->SetTransform(m, minv);
+            shape->SetLinearVelocity(linear_velocity);
+            shape->SetAngularVelocity(angular_velocity);
+            shape->SetId(id);
+            shape->SetMask(mask);
+
+            if (attach)
+            {
+                attached.push_back(shape);
+            }
+        }
+
+        m_api->AttachShapes(attached.data(), static_cast<int>(attached.size()));
+        m_api->Commit();
+
+        m_format = format;
+    }
+
+    void RemoteWorker::Reserve(Buffer*& buffer, std::size_t& capacity, std::size_t size)
+    {
+        if (capacity >= size)
+            return;
+
+        if (buffer)
+        {
+            m_api->DeleteBuffer(buffer);
+            buffer = nullptr;
+        }
+
+        // Rays and hits are copied on every chunk
+        buffer = m_api->CreateBuffer(size, nullptr, kBufferStream);
+        capacity = size;
+    }
+
+    void RemoteWorker::Launch(Slot& slot, Remote::MessageHeader const& header, std::vector<char> const& payload)
+    {
+        bool const occlusion = header.type == Remote::kOcclude;
+        std::size_t const rays_size = header.count * std::size_t(m_format.ray_size);
+        std::size_t const hits_size = m_format.GetResultSize(header.count, occlusion);
+
+        ThrowIf(header.count == 0 || payload.size() != rays_size, "Malformed remote message.");
+
+        Reserve(slot.rays, slot.rays_size, rays_size);
+        Reserve(slot.hits, slot.hits_size, hits_size);
+
+        void* rays = MapBlocking(m_api, slot.rays, kMapWrite, rays_size);
+        std::memcpy(rays, payload.data(), rays_size);
+        UnmapBlocking(m_api, slot.rays, rays);
+
+        int const count = static_cast<int>(header.count);
+        if (occlusion)
+            m_api->QueryOcclusion(slot.rays, count, slot.hits, nullptr, &slot.event);
+        else
+            m_api->QueryIntersection(slot.rays, count, slot.hits, nullptr, &slot.event);
+
+        slot.count = count;
+        slot.occlusion = occlusion;
+    }
+
+    void RemoteWorker::Finish(Slot& slot)
+    {
+        std::string error;
+        try
+        {
+            slot.event->Wait();
+            m_api->DeleteEvent(slot.event);
+            slot.event = nullptr;
+
+            m_results.resize(m_format.GetResultSize(slot.count, slot.occlusion));
+
+            void* hits = MapBlocking(m_api, slot.hits, kMapRead, m_results.size());
+            std::memcpy(m_results.data(), hits, m_results.size());
+            UnmapBlocking(m_api, slot.hits, hits);
+        }
+        catch (...)
+        {
+            error = GetErrorMessage();
+        }
+
+        if (slot.event)
+        {
+            m_api->DeleteEvent(slot.event);
+            slot.event = nullptr;
+        }
+
+        if (!error.empty())
+        {
+            Remote::SendError(m_stream, error);
+            return;
+        }
+
+        Remote::SendMessage(m_stream, Remote::kResult, static_cast<std::uint32_t>(slot.count), 0, m_results.data(), m_results.size());
+    }
+}
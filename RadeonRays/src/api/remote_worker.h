@@ -0,0 +1,79 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "radeon_rays.h"
+#include "../device/remote_protocol.h"
+
+#include <string>
+#include <vector>
+
+namespace RadeonRays
+{
+    // Serves a RemoteIntersectionDevice client with the API. Scenes are rebuilt from
+    // the scene messages, ray chunks are traced in 2 slots, so the next chunk is
+    // received and uploaded while the previous one is traced and its hits sent back.
+    class RemoteWorker
+    {
+    public:
+        RemoteWorker(IntersectionApi* api, TcpStream& stream);
+        ~RemoteWorker();
+
+        // Handle requests until the client disconnects
+        void Run();
+
+    private:
+        // Handle requests, malformed ones throw
+        void Serve();
+
+        struct Slot
+        {
+            Buffer* rays;
+            Buffer* hits;
+            std::size_t rays_size;
+            std::size_t hits_size;
+            // Completes once the query is done, nullptr if the slot is idle
+            Event* event;
+            int count;
+            bool occlusion;
+        };
+
+        // Replace the scene with the one of the message
+        void LoadScene(std::vector<char> const& payload);
+        void ReleaseScene();
+        // Upload the chunk and start tracing it
+        void Launch(Slot& slot, Remote::MessageHeader const& header, std::vector<char> const& payload);
+        // Wait for the query of the slot and send its results
+        void Finish(Slot& slot);
+        // Grow the buffer to hold size bytes
+        void Reserve(Buffer*& buffer, std::size_t& capacity, std::size_t size);
+
+        IntersectionApi* m_api;
+        TcpStream& m_stream;
+        // Record sizes of the current scene
+        Remote::RecordFormat m_format;
+        // Shapes of the current scene in the message order
+        std::vector<Shape*> m_shapes;
+        Slot m_slots[2];
+        std::vector<char> m_results;
+    };
+}
@@ -0,0 +1,170 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef LOCKFREE_POOL_H
+#define LOCKFREE_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <new>
+
+namespace RadeonRays
+{
+    ///< Pool of reusable objects which can be acquired and released from
+    ///< any thread without locks. Free objects form a Treiber stack linked by
+    ///< 32-bit indices, the head carries a tag incremented on each update
+    ///< to rule out ABA. Objects are allocated in chunks which are never freed
+    ///< until the pool is destroyed, so indices always stay valid. Only
+    ///< growing the pool takes a lock.
+    ///<
+    template <typename T> class lockfree_pool
+    {
+    public:
+        explicit lockfree_pool(std::uint32_t initial_size)
+            : head_(kNull)
+            , num_chunks_(0)
+            , initial_size_(std::min(std::max(initial_size, 1U), kMaxChunkSize))
+        {
+            for (auto& chunk : chunks_)
+            {
+                chunk.store(nullptr, std::memory_order_relaxed);
+            }
+
+            grow();
+        }
+
+        ~lockfree_pool()
+        {
+            for (auto& chunk : chunks_)
+            {
+                delete[] chunk.load(std::memory_order_relaxed);
+            }
+        }
+
+        // Get an object from the pool, the pool grows if it is empty
+        T* acquire()
+        {
+            auto head = head_.load(std::memory_order_acquire);
+
+            for (;;)
+            {
+                auto idx = static_cast<std::uint32_t>(head);
+
+                if (idx == kNull)
+                {
+                    grow();
+                    head = head_.load(std::memory_order_acquire);
+                    continue;
+                }
+
+                auto n = get_node(idx);
+                auto next = n->next_.load(std::memory_order_relaxed);
+
+                if (head_.compare_exchange_weak(head, make_head(head, next), std::memory_order_acquire, std::memory_order_acquire))
+                {
+                    return n;
+                }
+            }
+        }
+
+        // Return the object acquired from this pool
+        void release(T* t)
+        {
+            auto n = static_cast<node*>(t);
+            push(n, n);
+        }
+
+        lockfree_pool(lockfree_pool const&) = delete;
+        lockfree_pool& operator = (lockfree_pool const&) = delete;
+
+    private:
+        struct node : public T
+        {
+            std::atomic<std::uint32_t> next_;
+            std::uint32_t index_;
+        };
+
+        // Index is a chunk number in the high bits and an offset within the chunk
+        static std::uint32_t const kOffsetBits = 24;
+        static std::uint32_t const kMaxChunkSize = 1U << kOffsetBits;
+        static std::uint32_t const kMaxChunks = 255;
+        static std::uint32_t const kNull = 0xFFFFFFFF;
+
+        static std::uint64_t make_head(std::uint64_t old_head, std::uint32_t idx)
+        {
+            return (((old_head >> 32) + 1) << 32) | idx;
+        }
+
+        node* get_node(std::uint32_t idx) const
+        {
+            return chunks_[idx >> kOffsetBits].load(std::memory_order_acquire) + (idx & (kMaxChunkSize - 1));
+        }
+
+        // Push the list linked from first to last
+        void push(node* first, node* last)
+        {
+            auto head = head_.load(std::memory_order_relaxed);
+
+            do
+            {
+                last->next_.store(static_cast<std::uint32_t>(head), std::memory_order_relaxed);
+            }
+            while (!head_.compare_exchange_weak(head, make_head(head, first->index_), std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        // Allocate a new chunk, each one is twice as large as the previous
+        void grow()
+        {
+            std::lock_guard<std::mutex> lock(grow_mutex_);
+
+            // Some other thread might have refilled the pool already
+            if (static_cast<std::uint32_t>(head_.load(std::memory_order_acquire)) != kNull)
+                return;
+
+            if (num_chunks_ == kMaxChunks)
+                throw std::bad_alloc();
+
+            auto size = static_cast<std::uint32_t>(std::min(static_cast<std::uint64_t>(initial_size_) << std::min(num_chunks_, kOffsetBits), static_cast<std::uint64_t>(kMaxChunkSize)));
+            auto chunk = new node[size];
+
+            for (auto i = 0U; i < size; ++i)
+            {
+                chunk[i].index_ = (num_chunks_ << kOffsetBits) | i;
+                chunk[i].next_.store(i + 1 < size ? chunk[i].index_ + 1 : kNull, std::memory_order_relaxed);
+            }
+
+            chunks_[num_chunks_++].store(chunk, std::memory_order_release);
+
+            push(&chunk[0], &chunk[size - 1]);
+        }
+
+        // Tag in the high 32 bits, index of the first free node in the low ones
+        std::atomic<std::uint64_t> head_;
+        std::atomic<node*> chunks_[kMaxChunks];
+        std::uint32_t num_chunks_;
+        std::uint32_t initial_size_;
+        std::mutex grow_mutex_;
+    };
+}
+
+#endif // LOCKFREE_POOL_H
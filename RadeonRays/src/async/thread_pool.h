@@ -22,150 +22,502 @@ THE SOFTWARE.
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
-#include <queue>
-#include <thread>
-#include <mutex>
-#include <condition_variable>
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <future>
-#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 namespace RadeonRays
 {
-    ///< An implementation of a concurrent queue
-    ///< which is providing the means to wait until 
-    ///< elements are available or use non-blocking
-    ///< try_pop method.
+    ///< Bounded single producer multiple consumer deque
+    ///< (Chase-Lev, "Correct and Efficient Work-Stealing for Weak Memory Models").
+    ///< The owner thread pushes and pops at the bottom, other threads
+    ///< steal from the top without taking any locks.
     ///<
-    template <typename T> class thread_safe_queue
+    template <typename T> class work_stealing_deque
     {
     public:
-        thread_safe_queue(){}
-        ~thread_safe_queue(){}
+        static std::int64_t const kCapacity = 4096;
 
-        // Push element: one of the threads is going to 
-        // be woken up to process this if any
-        void push(T const& t)
+        work_stealing_deque()
+            : top_(0)
+            , bottom_(0)
+            , items_(new std::atomic<T*>[kCapacity])
         {
-            std::lock_guard<std::mutex> lock(mutex_);
-            queue_.push(t);
-            cv_.notify_one();
         }
 
-        // Push element: one of the threads is going to 
-        // be woken up to process this if any
-        void push(T&& t)
+        // Owner only: returns false if the deque is full
+        bool push(T* t)
         {
-            std::lock_guard<std::mutex> lock(mutex_);
-            queue_.push(std::move(t));
-            cv_.notify_one();
-        }
+            auto b = bottom_.load(std::memory_order_relaxed);
+            auto tp = top_.load(std::memory_order_acquire);
 
-        // Wait until there are element to process.
-        void wait_and_pop(T& t)
-        {
-            std::unique_lock<std::mutex> lock(mutex_);
-            cv_.wait(lock, [this](){return !queue_.empty();});
-            t = queue_.front();
-            queue_.pop();
+            if (b - tp >= kCapacity)
+                return false;
+
+            items_[b & (kCapacity - 1)].store(t, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return true;
         }
 
-        // Try to pop element. Returns true if element has been popped, 
-        // false if there are no element in the queue
-        bool try_pop(T& t)
+        // Owner only: returns nullptr if the deque is empty
+        T* pop()
         {
-            std::lock_guard<std::mutex> lock(mutex_);
-            if (queue_.empty())
-                return false;
-            t = std::move(queue_.front());
-            queue_.pop();
-            return true;
+            auto b = bottom_.load(std::memory_order_relaxed) - 1;
+            bottom_.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            auto tp = top_.load(std::memory_order_relaxed);
+
+            if (tp > b)
+            {
+                bottom_.store(b + 1, std::memory_order_relaxed);
+                return nullptr;
+            }
+
+            T* t = items_[b & (kCapacity - 1)].load(std::memory_order_relaxed);
+
+            if (tp == b)
+            {
+                // Last element, race against thieves
+                if (!top_.compare_exchange_strong(tp, tp + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                    t = nullptr;
+                bottom_.store(b + 1, std::memory_order_relaxed);
+            }
+
+            return t;
         }
 
-        size_t size() const
+        // Any thread: returns nullptr if the deque is empty or the steal lost a race
+        T* steal()
         {
-            std::unique_lock<std::mutex> lock(mutex_);
-            return queue_.size();
+            auto tp = top_.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            auto b = bottom_.load(std::memory_order_acquire);
+
+            if (tp >= b)
+                return nullptr;
+
+            T* t = items_[tp & (kCapacity - 1)].load(std::memory_order_relaxed);
+
+            if (!top_.compare_exchange_strong(tp, tp + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                return nullptr;
+
+            return t;
         }
 
     private:
-        mutable std::mutex mutex_;
-        std::condition_variable cv_;
-        std::queue<T> queue_;
+        std::atomic<std::int64_t> top_;
+        std::atomic<std::int64_t> bottom_;
+        std::unique_ptr<std::atomic<T*>[]> items_;
+
+        work_stealing_deque(work_stealing_deque const&);
+        work_stealing_deque& operator = (work_stealing_deque const&);
     };
 
 
-    ///< Thread pool implementation which is using concurrency
-    ///< available in the system
+    ///< Work-stealing thread pool which is using concurrency
+    ///< available in the system. Each worker owns a deque, jobs
+    ///< submitted from a worker go to its own deque, jobs submitted
+    ///< from other threads go to a shared queue. Idle workers steal from
+    ///< each other and sleep on a condition variable when there is no work.
+    ///< Besides std::function tasks the pool runs caller owned jobs
+    ///< and parallel_for without any heap allocations.
+    ///< Workers might be split into parts, e.g. one per NUMA node,
+    ///< parallel_for then gives each part a contiguous share of the range
+    ///< and workers only move to other shares once theirs is done.
     ///<
     template <typename RetType> class thread_pool
     {
     public:
-        explicit thread_pool(int sleep_time = 50)
-            : sleep_time_(sleep_time)
+        ///< Job owned by the caller: it has to stay alive until executed,
+        ///< the same job might be submitted several times.
+        struct job
         {
-            done_ = false;
-            int num_threads = std::thread::hardware_concurrency();
-            num_threads = num_threads == 0 ? 2 : num_threads;
+            // Called on a pool thread for each submission
+            void (*execute)(job*);
+            // Called instead of execute if the pool is destroyed first, might be nullptr
+            void (*discard)(job*);
+        };
 
-            //#ifdef _DEBUG
-            //        std::cout << num_threads << " hardware threads available\n";
-            //#endif
+        // Maximum number of parts workers are split into
+        static int const kMaxParts = 8;
 
-            for (int i=0; i < num_threads; ++i)
+        // Zero number of threads means hardware concurrency. Workers are split
+        // between num_parts parts in index order, init(part) is called on each
+        // worker before it runs any jobs, e.g. to pin it, might be empty.
+        explicit thread_pool(int num_threads = 0, int num_parts = 1,
+            std::function<void(int)> const& init = std::function<void(int)>())
+            : shared_queue_(kSharedQueueInitialSize)
+            , shared_head_(0)
+            , shared_count_(0)
+            , done_(false)
+            , pending_(0)
+            , sleeping_(0)
+        {
+            if (num_threads <= 0)
+            {
+                num_threads = std::thread::hardware_concurrency();
+                num_threads = num_threads == 0 ? 2 : num_threads;
+            }
+
+            num_parts_ = std::max(std::min(std::min(num_parts, kMaxParts), num_threads), 1);
+            init_ = init;
+
+            for (int i = 0; i < num_threads; ++i)
             {
-                threads_.push_back(std::thread(&thread_pool::run_loop, this));
+                workers_.emplace_back(new work_stealing_deque<job>());
+            }
+
+            for (int i = 0; i < num_threads; ++i)
+            {
+                threads_.push_back(std::thread(&thread_pool::run_loop, this, i));
             }
         }
 
         ~thread_pool()
         {
-            done_ = true;
-            std::for_each(threads_.begin(), threads_.end(), std::mem_fun_ref(&std::thread::join));
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                done_ = true;
+            }
+
+            cv_.notify_all();
+            for (auto& thread : threads_)
+                thread.join();
+
+            // Drop jobs which have never been started
+            for (auto& worker : workers_)
+            {
+                while (job* j = worker->pop())
+                    discard(j);
+            }
+
+            for (; shared_count_ > 0; --shared_count_)
+            {
+                discard(shared_queue_[shared_head_]);
+                shared_head_ = (shared_head_ + 1) % shared_queue_.size();
+            }
         }
 
         // Submit a new task into the pool. Future is returned in
         // order for caller to track the execution of the task
         std::future<RetType> submit(std::function<RetType()>&& f)
         {
-            std::packaged_task<RetType()> task(std::move(f));
-            auto future = task.get_future();
-            work_queue_.push(std::move(task));
+            auto j = new task_job(std::move(f));
+            auto future = j->task.get_future();
+            push(j);
             return future;
         }
 
-        size_t size() const
+        // Submit a caller owned job, no allocations are made
+        void submit(job* j)
+        {
+            push(j);
+        }
+
+        // Call f(begin, end) for subranges of [begin, end) of at most grain_size elements.
+        // The calling thread takes part in the work and returns once all the subranges
+        // are processed, the first exception thrown by f is rethrown.
+        template <typename Func> void parallel_for(int begin, int end, int grain_size, Func const& f)
+        {
+            if (begin >= end)
+                return;
+
+            grain_size = std::max(grain_size, 1);
+
+            int num_chunks = (end - begin + grain_size - 1) / grain_size;
+            int num_helpers = std::min(num_chunks - 1, (int)threads_.size());
+
+            range_job<Func> helper(this, f, begin, end, grain_size, num_helpers);
+
+            // All the helpers share the job living on this stack frame
+            for (int i = 0; i < num_helpers; ++i)
+            {
+                push(&helper);
+            }
+
+            int index = current_worker_index();
+            helper.run(index < 0 ? 0 : part_of(index));
+
+            // Helpers might still sit in the deques, so keep running jobs while waiting
+            while (helper.remaining.load() > 0)
+            {
+                if (!run_one(index))
+                    std::this_thread::yield();
+            }
+
+            if (helper.error)
+                std::rethrow_exception(helper.error);
+        }
+
+        // Number of threads in the pool
+        size_t num_threads() const
+        {
+            return threads_.size();
+        }
+
+        // Number of parts workers are split into
+        int num_parts() const
         {
-            return work_queue_.size();
+            return num_parts_;
         }
 
-        void setSleepTime(int sleep_time)
+        // Number of jobs waiting for execution
+        size_t size() const
         {
-            sleep_time_ = sleep_time;
+            return static_cast<size_t>(pending_.load());
         }
 
     private:
-        void run_loop()
+        static size_t const kSharedQueueInitialSize = 1024;
+
+        // Heap allocated job wrapping a task submitted with std::function
+        struct task_job : job
         {
-            std::packaged_task<RetType()> f;
-            while(!done_)
+            explicit task_job(std::function<RetType()>&& f)
+                : task(std::move(f))
             {
-                if (work_queue_.try_pop(f))
+                this->execute = [](job* j)
                 {
-                    f();
+                    auto self = static_cast<task_job*>(j);
+                    self->task();
+                    delete self;
+                };
+
+                this->discard = [](job* j)
+                {
+                    delete static_cast<task_job*>(j);
+                };
+            }
+
+            std::packaged_task<RetType()> task;
+        };
+
+        // Job splitting a range between the caller and helpers of parallel_for,
+        // each part gets a contiguous share of whole grains
+        template <typename Func> struct range_job : job
+        {
+            range_job(thread_pool const* p, Func const& f, int begin, int end, int grain_size, int num_helpers)
+                : pool(p)
+                , func(f)
+                , grain_size(grain_size)
+                , num_parts(p->num_parts_)
+                , remaining(num_helpers)
+            {
+                int num_chunks = (end - begin + grain_size - 1) / grain_size;
+                for (int p = 0; p < num_parts; ++p)
+                {
+                    next[p] = std::min(begin + num_chunks * p / num_parts * grain_size, end);
+                    ends[p] = std::min(begin + num_chunks * (p + 1) / num_parts * grain_size, end);
+                }
+
+                this->execute = [](job* j)
+                {
+                    auto self = static_cast<range_job*>(j);
+                    int index = self->pool->current_worker_index();
+                    self->run(index < 0 ? 0 : self->pool->part_of(index));
+                    // The caller might return right after this, do not touch self anymore
+                    self->remaining.fetch_sub(1);
+                };
+
+                this->discard = nullptr;
+            }
+
+            // Process the share of the part first, then help the other parts
+            void run(int part)
+            {
+                try
+                {
+                    for (int i = 0; i < num_parts; ++i)
+                    {
+                        int p = (part + i) % num_parts;
+                        for (int b = next[p].fetch_add(grain_size); b < ends[p]; b = next[p].fetch_add(grain_size))
+                        {
+                            func(b, std::min(b + grain_size, ends[p]));
+                        }
+                    }
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!error)
+                        error = std::current_exception();
+                    // Let other threads bail out early
+                    for (int p = 0; p < num_parts; ++p)
+                        next[p].store(ends[p]);
+                }
+            }
+
+            thread_pool const* pool;
+            Func const& func;
+            std::atomic<int> next[kMaxParts];
+            int ends[kMaxParts];
+            int grain_size;
+            int num_parts;
+            std::atomic<int> remaining;
+            std::exception_ptr error;
+            std::mutex error_mutex;
+        };
+
+        struct worker_info
+        {
+            thread_pool const* pool;
+            int index;
+        };
+
+        static worker_info& current_worker()
+        {
+            static thread_local worker_info info = { nullptr, -1 };
+            return info;
+        }
+
+        static void discard(job* j)
+        {
+            if (j->discard)
+                j->discard(j);
+        }
+
+        // Index of the calling thread in this pool or -1 for external threads
+        int current_worker_index() const
+        {
+            auto& info = current_worker();
+            return info.pool == this ? info.index : -1;
+        }
+
+        // Part of the worker, consecutive workers share parts
+        int part_of(int index) const
+        {
+            return static_cast<int>(static_cast<std::int64_t>(index) * num_parts_ / (std::int64_t)workers_.size());
+        }
+
+        void push(job* j)
+        {
+            // Account for the job before it becomes visible, so it never goes negative
+            pending_.fetch_add(1);
+
+            int index = current_worker_index();
+            if (index < 0 || !workers_[index]->push(j))
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                // Ring buffer only grows, so steady state submission does not allocate
+                if (shared_count_ == shared_queue_.size())
+                {
+                    std::vector<job*> queue(shared_queue_.size() * 2);
+                    for (size_t i = 0; i < shared_count_; ++i)
+                        queue[i] = shared_queue_[(shared_head_ + i) % shared_queue_.size()];
+                    shared_queue_.swap(queue);
+                    shared_head_ = 0;
                 }
-                else
+
+                shared_queue_[(shared_head_ + shared_count_) % shared_queue_.size()] = j;
+                ++shared_count_;
+            }
+
+            // Waiters check pending_ under the mutex, lock it to avoid missing a wakeup
+            if (sleeping_.load() > 0)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                }
+                cv_.notify_one();
+            }
+        }
+
+        job* find_job(int index)
+        {
+            if (index >= 0)
+            {
+                if (job* j = workers_[index]->pop())
+                    return j;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (shared_count_ > 0)
                 {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(sleep_time_));
+                    job* j = shared_queue_[shared_head_];
+                    shared_head_ = (shared_head_ + 1) % shared_queue_.size();
+                    --shared_count_;
+                    return j;
                 }
             }
+
+            int num_workers = (int)workers_.size();
+            int start = index < 0 ? 0 : index + 1;
+            for (int i = 0; i < num_workers; ++i)
+            {
+                int victim = (start + i) % num_workers;
+                if (victim == index)
+                    continue;
+
+                if (job* j = workers_[victim]->steal())
+                    return j;
+            }
+
+            return nullptr;
         }
 
+        // Run a single job if there is any, returns false otherwise
+        bool run_one(int index)
+        {
+            job* j = find_job(index);
+
+            if (!j)
+                return false;
+
+            pending_.fetch_sub(1);
+            j->execute(j);
+            return true;
+        }
+
+        void run_loop(int index)
+        {
+            current_worker().pool = this;
+            current_worker().index = index;
+
+            if (init_)
+                init_(part_of(index));
+
+            for (;;)
+            {
+                if (run_one(index))
+                    continue;
 
-        thread_safe_queue<std::packaged_task<RetType()> > work_queue_;
-        std::atomic_bool done_;
+                std::unique_lock<std::mutex> lock(mutex_);
+                sleeping_.fetch_add(1);
+                cv_.wait(lock, [this]() { return done_ || pending_.load() > 0; });
+                sleeping_.fetch_sub(1);
+
+                if (done_)
+                    return;
+            }
+        }
+
+        std::vector<std::unique_ptr<work_stealing_deque<job> > > workers_;
+        // Ring buffer of jobs submitted from outside of the pool or from workers with full deques
+        std::vector<job*> shared_queue_;
+        size_t shared_head_;
+        size_t shared_count_;
         std::vector<std::thread> threads_;
-        int sleep_time_;
+        // Parts workers are split into and the worker initialization
+        int num_parts_;
+        std::function<void(int)> init_;
+
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        bool done_;
+        std::atomic<int> pending_;
+        std::atomic<int> sleeping_;
     };
 }
 
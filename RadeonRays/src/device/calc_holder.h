@@ -25,6 +25,7 @@ THE SOFTWARE.
 #include "buffer.h"
 #include "device.h"
 #include "event.h"
+#include "../except/except.h"
 #include <memory>
 #include <functional>
 
@@ -48,41 +49,104 @@ namespace RadeonRays
         std::unique_ptr<Calc::Buffer, std::function<void(Calc::Buffer*)>> m_buffer;
     };
 
+    // Event of queries collected into a batch, shared by the events returned for them
+    struct CalcBatchEvent
+    {
+        // Dispatch the batch if it is still pending, afterwards event is set
+        std::function<void()> dispatch;
+        // Event of the combined dispatch
+        std::shared_ptr<Calc::Event> event;
+    };
+
     struct CalcEventHolder : public RadeonRays::Event
     {
         CalcEventHolder()
             : m_event()
+            , m_queue(0)
         {
         }
 
-        CalcEventHolder(Calc::Device* device, Calc::Event* event)
+        CalcEventHolder(Calc::Device* device, Calc::Event* event, std::uint32_t queue = 0)
             : m_event(event, [device](Calc::Event* event) { device->DeleteEvent(event); })
+            , m_queue(queue)
         {
         }
 
         ~CalcEventHolder() = default;
 
-        void Set(Calc::Device* device, Calc::Event* event)
+        void Set(Calc::Device* device, Calc::Event* event, std::uint32_t queue = 0)
         {
             m_event = decltype(m_event)(event, [device](Calc::Event* event) { device->DeleteEvent(event); });
+            m_batch.reset();
+            m_queue = queue;
+        }
+
+        // Complete with the batch the query has been collected into
+        void SetBatch(std::shared_ptr<CalcBatchEvent> batch, std::uint32_t queue)
+        {
+            m_event.reset();
+            m_batch = batch;
+            m_queue = queue;
         }
 
         bool Complete() const override
         {
+            // A pending batch would never complete, so polling dispatches it
+            if (m_batch)
+            {
+                // The event is left unset if the dispatch failed, the error is thrown by the call dispatching it
+                m_batch->dispatch();
+                return !m_batch->event || m_batch->event->IsComplete();
+            }
+
             return m_event->IsComplete();
         }
 
         void Wait() override
         {
+            if (m_batch)
+            {
+                m_batch->dispatch();
+                return m_batch->event ? m_batch->event->Wait() : void();
+            }
+
             return m_event->Wait();
         }
 
+        void OnComplete(CompletionFunc callback, void* userdata) override
+        {
+            ThrowIf(!callback, "Invalid completion callback.");
+
+            if (m_batch)
+            {
+                m_batch->dispatch();
+            }
+
+            // Failed batches complete right away, the error is thrown by the call dispatching them
+            Calc::Event* event = m_batch ? m_batch->event.get() : m_event.get();
+            if (!event)
+            {
+                callback(userdata);
+                return;
+            }
+
+            // Backends without notifications are polled
+            if (!event->SetCallback(callback, userdata))
+            {
+                RadeonRays::Event::OnComplete(callback, userdata);
+            }
+        }
+
         Calc::Event* GetData()
         {
             return m_event.get();
         }
 
         std::unique_ptr<Calc::Event, std::function<void(Calc::Event*)>> m_event;
+        // Batch of the query, set instead of m_event
+        std::shared_ptr<CalcBatchEvent> m_batch;
+        // Queue the event has been signaled from
+        std::uint32_t m_queue;
     };
 }
 
@@ -25,329 +25,1727 @@ THE SOFTWARE.
 #include "buffer.h"
 #include "device.h"
 #include "event.h"
+#include "trace.h"
 #include "../primitive/shapeimpl.h"
+#include "../primitive/instance.h"
+#include "../primitive/mesh.h"
+#include "../except/except.h"
 
 #include "calc_holder.h"
 
 #include "../intersector/intersector.h"
 #include "../intersector/intersector_2level.h"
+#include "../intersector/intersector_2level_short_stack.h"
 #include "../intersector/intersector_skip_links.h"
 #include "../intersector/intersector_short_stack.h"
+#include "../intersector/intersector_bvh4.h"
 #include "../intersector/intersector_hlbvh.h"
 #include "../intersector/intersector_bittrail.h"
+#include "../intersector/ray_layout.h"
+#include "../util/kernel_profiler.h"
 #include "../world/world.h"
+#include <algorithm>
 #include <iostream>
 
 namespace RadeonRays
 {
     // TODO: handle different BVH strategies, for now hardcoded
-    CalcIntersectionDevice::CalcIntersectionDevice(Calc::Calc* calc, Calc::Device* device)
+    CalcIntersectionDevice::CalcIntersectionDevice(Calc::Calc* calc, Calc::Device* device, std::uint32_t event_pool_size)
         : m_device(device, [calc](Calc::Device* device) { calc->DeleteDevice(device); })
-        , m_intersector(new IntersectorSkipLinks(device))
+        , m_profiler(new KernelProfiler(device))
+        , m_intersector(CreateIntersector("bvh", kFullRecords))
         , m_intersector_string("bvh")
+        , m_formats(kFullRecords)
+        , m_intersector_stale(false)
+        , m_batch_rays(0)
+        , m_queue(0)
+        , m_hint(kQueryHintDefault)
+        , m_traversal_stats(nullptr)
+        , m_snapshot(false)
+        , m_shared(std::make_shared<SharedState>())
+        , m_event_pool(event_pool_size)
+        , m_auto_rebuilds(0)
     {
-        // Initialize event pool
-        for (auto i = 0; i < EVENT_POOL_INITIAL_SIZE; ++i)
+        Calc::DeviceSpec spec;
+        device->GetSpec(spec);
+        m_num_queues = std::max(spec.max_num_queues, 1U);
+        m_host_unified_memory = spec.host_unified_memory;
+        m_shared->num_snapshots = 0;
+
+        auto const num_locks = device->GetPlatform() == Calc::Platform::kOpenCL ? m_num_queues : 1U;
+        for (auto i = 0U; i < num_locks; ++i)
+        {
+            m_shared->queue_mutexes.emplace_back(new std::mutex());
+        }
+
+        m_shared->batches.resize(m_num_queues);
+
+        // Kernels of the GPU choices of "auto" and of instanced scenes are built in the background.
+        // The device keeps the binaries of the programs it builds, so the intersectors created on
+        // commits skip compilation once it is done. Vulkan command recording is not thread safe.
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
         {
-            m_event_pool.push(new CalcEventHolder());
+            m_precompile = std::async(std::launch::async, [this]()
+            {
+                for (auto type : { "fatbvh", "hlbvh", "bvh2l" })
+                {
+                    try
+                    {
+                        CreateIntersector(type, kFullRecords);
+                    }
+                    catch (...)
+                    {
+                        // Errors are reported once the intersector is actually used
+                    }
+                }
+            });
         }
     }
 
+    CalcIntersectionDevice::CalcIntersectionDevice(CalcIntersectionDevice const& source, std::uint32_t queue)
+        : m_device(source.m_device)
+        , m_profiler(source.m_profiler)
+        , m_intersector(source.m_intersector)
+        , m_intersector_string(source.m_intersector_string)
+        , m_formats(source.m_formats)
+        , m_intersector_stale(false)
+        , m_batch_rays(source.m_batch_rays)
+        , m_queue(queue)
+        , m_hint(kQueryHintDefault)
+        , m_traversal_stats(nullptr)
+        , m_num_queues(source.m_num_queues)
+        , m_host_unified_memory(source.m_host_unified_memory)
+        , m_snapshot(true)
+        , m_shared(source.m_shared)
+        , m_event_pool(EVENT_POOL_INITIAL_SIZE)
+        , m_auto_rebuilds(0)
+    {
+    }
+
     CalcIntersectionDevice::~CalcIntersectionDevice()
     {
-        while (!m_event_pool.empty())
+        WaitForPrecompile();
+    }
+
+    void CalcIntersectionDevice::WaitForPrecompile() const
+    {
+        if (m_precompile.valid())
         {
-            auto event = m_event_pool.front();
-            m_event_pool.pop();
-            delete event;
+            m_precompile.wait();
         }
     }
 
-    void CalcIntersectionDevice::Preprocess(World const& world)
+    // Shapes with linear velocity need motion blurred traversal
+    static bool IsMoving(ShapeImpl const* shape)
+    {
+        return shape->GetLinearVelocity().sqnorm() > 0.f;
+    }
+
+    std::string CalcIntersectionDevice::SelectIntersector(World const& world, int& formats) const
     {
         bool use2level = false;
 
+        // Record layouts are compiled into the kernels, so the intersector
+        // has to be recreated once they change
+        auto opthitformat = world.options_.GetOption("acc.hit.format");
+        auto optrayformat = world.options_.GetOption("acc.ray.format");
+        formats = kFullRecords;
+
+        if (opthitformat && opthitformat->AsString() == "compact")
+        {
+            formats |= kCompactHits;
+        }
+
+        if (optrayformat && optrayformat->AsString() == "compact")
+        {
+            formats |= kCompactRays;
+        }
+
+        ThrowIf(formats != kFullRecords && m_device->GetPlatform() != Calc::Platform::kOpenCL,
+            "Compact hit and ray records are only supported on OpenCL devices.");
+
+        // Precomputed triangles only change the flat skip links kernels, so other
+        // platforms and intersectors simply keep reading vertices
+        auto optprecompute = world.options_.GetOption("acc.triangle.precompute");
+        if (optprecompute && optprecompute->AsFloat() > 0.f && m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            formats |= kPrecomputedTriangles;
+        }
+
+        // Octant links only change the flat skip links kernels as well
+        auto optoctantlinks = world.options_.GetOption("acc.octant_links");
+        if (optoctantlinks && optoctantlinks->AsFloat() > 0.f && m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            formats |= kOctantLinks;
+        }
+
+        // Compact faces and quantized vertices only change the 2-level kernels
+        auto optfaceformat = world.options_.GetOption("acc.face.format");
+        if (optfaceformat && optfaceformat->AsString() == "compact" && m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            formats |= kCompactFaces;
+        }
+
+        auto optvertexformat = world.options_.GetOption("acc.vertex.format");
+        if (optvertexformat && optvertexformat->AsString() == "quantized" && m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            formats |= kQuantizedVertices;
+        }
+
+        // Counters are written by the OpenCL closest hit kernels only
+        auto opttraversalstats = world.options_.GetOption("profile.traversal_stats");
+        if (opttraversalstats && opttraversalstats->AsFloat() > 0.f && m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            formats |= kTraversalStats;
+        }
+
+#ifdef RR_RAY_MASK
+        // Mask tests are only compiled into the kernels once some shape is masked
+        for (auto shape : world.shapes_)
+        {
+            if (static_cast<ShapeImpl const*>(shape)->GetMask() != -1)
+            {
+                formats |= kRayMask;
+                break;
+            }
+        }
+#endif
+
+        // Device meshes are only read by the HLBVH intersector, which builds on the device
+        bool has_device_meshes = false;
+        for (auto shape : world.shapes_)
+        {
+            has_device_meshes = has_device_meshes || static_cast<ShapeImpl const*>(shape)->is_device_mesh();
+        }
+
+        if (has_device_meshes)
+        {
+            for (auto shape : world.shapes_)
+            {
+                ThrowIf(static_cast<ShapeImpl const*>(shape)->is_instance(),
+                    "Instances can't be combined with meshes in device buffers.");
+            }
+
+            auto optacctype = world.options_.GetOption("acc.type");
+            std::string acctype = optacctype ? optacctype->AsString() : "hlbvh";
+            return acctype == "hlbvh_sah" || acctype == "hlbvh_ploc" ? acctype : "hlbvh";
+        }
+
+        // Spheres are only intersected by the flat skip links kernels, which read vertices
+        bool has_spheres = false;
+        for (auto shape : world.shapes_)
+        {
+            has_spheres = has_spheres || static_cast<ShapeImpl const*>(shape)->is_spheres();
+        }
+
+        if (has_spheres)
+        {
+            for (auto shape : world.shapes_)
+            {
+                ThrowIf(static_cast<ShapeImpl const*>(shape)->is_instance(),
+                    "Instances can't be combined with analytic spheres.");
+            }
+
+            formats &= ~kPrecomputedTriangles;
+            return "bvh";
+        }
+
+        // Instances of groups are only traversed by the 2-level intersector, whatever the options
+        bool has_groups = false;
+        for (auto shape : world.shapes_)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+            has_groups = has_groups || (shapeimpl->is_instance() &&
+                static_cast<ShapeImpl const*>(static_cast<Instance const*>(shapeimpl)->GetBaseShape())->is_group());
+        }
+
         // First check if 2 level BVH has been forced
-        auto opt2level = world.options_.GetOption("bvh.force2level");
-        if (opt2level && opt2level->AsFloat() > 0.f)
+        auto const& settings = world.options_.GetBvhSettings();
+        if (has_groups || settings.force2level)
         {
             use2level = true;
         }
+
+        // Kernels only keep a stack of shape levels if groups are entered
+        if (has_groups)
+        {
+            formats |= kNestedInstances;
+        }
+        else
+        {
+            if (settings.forceflat)
+            {
+                use2level = false;
+            }
+            else
+            {
+                // Otherwise check if there are instances or moving shapes in the world
+                for (auto iter = world.shapes_.cbegin(); iter != world.shapes_.cend(); ++iter)
+                {
+                    // Get implementation
+                    auto shapeimpl = static_cast<ShapeImpl const*>(*iter);
+                    // Check if it is an instance and update flag
+                    use2level = use2level | shapeimpl->is_instance() | IsMoving(shapeimpl);
+                }
+            }
+        }
+
+        if (use2level)
+        {
+            // Moving shapes are only interpolated by the OpenCL 2-level kernels
+            if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+            {
+                for (auto shape : world.shapes_)
+                {
+                    if (IsMoving(static_cast<ShapeImpl const*>(shape)))
+                    {
+                        formats |= kMotionBlur;
+                        break;
+                    }
+                }
+            }
+
+            // Levels of detail are only picked by the OpenCL 2-level kernels, others trace the finest one
+            if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+            {
+                for (auto shape : world.shapes_)
+                {
+                    auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+                    if (shapeimpl->is_instance() && static_cast<Instance const*>(shapeimpl)->GetNumLods() > 1)
+                    {
+                        formats |= kLodInstances;
+                        break;
+                    }
+                }
+            }
+
+            // Fat node short stack traversal handles plain instances of meshes,
+            // layouts specific to the skip links kernels keep using them
+            auto optacctype = world.options_.GetOption("acc.type");
+            int const skiplinks_formats = kNestedInstances | kMotionBlur | kCompactFaces | kQuantizedVertices | kLodInstances;
+            if (optacctype && optacctype->AsString() == "fatbvh2l" &&
+                m_device->GetPlatform() == Calc::Platform::kOpenCL && (formats & skiplinks_formats) == 0)
+            {
+                return "fatbvh2l";
+            }
+
+            return "bvh2l";
+        }
+
+        auto optacctype = world.options_.GetOption("acc.type");
+        std::string acctype = optacctype ? optacctype->AsString() : "bvh";
+
+        if (acctype == "bvh" || acctype == "fatbvh" || acctype == "fatbvh_q" || acctype == "fatbvh_h" ||
+            acctype == "bvh4" || acctype == "hlbvh" || acctype == "hlbvh_sah" || acctype == "hlbvh_ploc" ||
+            acctype == "hashbvh")
+        {
+            return acctype;
+        }
+
+        // Flat scenes don't need the top level
+        if (acctype == "fatbvh2l")
+        {
+            return "fatbvh";
+        }
+
+        if (acctype == "auto")
+        {
+            return SelectAutoIntersector(world);
+        }
+
+        // Unknown types keep the current intersector
+        return m_intersector_string;
+    }
+
+    std::string CalcIntersectionDevice::SelectAutoIntersector(World const& world) const
+    {
+        // Scenes below this size trace fast enough with skip links, beyond the
+        // host SAH build takes longer than the device HLBVH builds save in traversal
+        const int kSmallSceneFaces = 64 * 1024;
+        const int kHostBuildFaces = 4 * 1024 * 1024;
+        // Commits in a row rebuilding the scene before it is treated as dynamic
+        const int kDynamicCommits = 3;
+
+        // Instances and moving shapes already went to the 2-level intersector,
+        // so everything here is a mesh
+        int num_faces = 0;
+        for (auto shape : world.shapes_)
+        {
+            num_faces += static_cast<Mesh const*>(shape)->num_faces();
+        }
+
+        bool rebuilt = world.has_changed() || (world.GetStateChange() & ShapeImpl::kStateChangeGeometry) != 0;
+        m_auto_rebuilds = rebuilt ? m_auto_rebuilds + 1 : 0;
+        bool dynamic = m_auto_rebuilds >= kDynamicCommits;
+
+        // Face counts are bucketed by powers of two, small edits keep the decision
+        int size_bucket = 0;
+        while ((1 << size_bucket) < num_faces && size_bucket < 30)
+        {
+            ++size_bucket;
+        }
+
+        auto signature = std::make_tuple(size_bucket, static_cast<int>(world.shapes_.size()), dynamic);
+        auto iter = m_auto_intersectors.find(signature);
+        if (iter != m_auto_intersectors.cend())
+        {
+            return iter->second;
+        }
+
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+
+        std::string type;
+        if (spec.type != Calc::DeviceType::kGpu)
+        {
+            // Short stacks live in local memory, which CPUs emulate in global memory
+            type = "bvh";
+        }
+        else if (dynamic)
+        {
+            // Rebuilding every commit, build time dominates
+            type = "hlbvh";
+        }
+        else if (num_faces > kHostBuildFaces)
+        {
+            // SAH over Morton clusters keeps most of the tree quality at device build speed
+            type = m_device->GetPlatform() == Calc::Platform::kOpenCL ? "hlbvh_sah" : "hlbvh";
+        }
+        else if (num_faces > kSmallSceneFaces)
+        {
+            // Fat nodes test both children at once, which pays off once the tree is deep
+            type = "fatbvh";
+        }
+        else
+        {
+            type = "bvh";
+        }
+
+        m_auto_intersectors[signature] = type;
+        return type;
+    }
+
+    std::unique_ptr<Intersector> CalcIntersectionDevice::CreateIntersector(std::string const& type, int formats) const
+    {
+        std::unique_ptr<Intersector> intersector;
+
+        if (type == "bvh2l")
+        {
+            intersector.reset(new IntersectorTwoLevel(m_device.get(), formats));
+        }
+        else if (type == "fatbvh2l")
+        {
+            intersector.reset(new IntersectorTwoLevelShortStack(m_device.get(), formats));
+        }
+        else if (type == "fatbvh")
+        {
+            intersector.reset(new IntersectorShortStack(m_device.get(), IntersectorShortStack::kFullNodes, formats));
+        }
+        else if (type == "fatbvh_q")
+        {
+            intersector.reset(new IntersectorShortStack(m_device.get(), IntersectorShortStack::kQuantizedNodes, formats));
+        }
+        else if (type == "fatbvh_h")
+        {
+            intersector.reset(new IntersectorShortStack(m_device.get(), IntersectorShortStack::kHalfNodes, formats));
+        }
+        else if (type == "bvh4")
+        {
+            intersector.reset(new IntersectorBvh4(m_device.get(), formats));
+        }
+        else if (type == "hlbvh")
+        {
+            intersector.reset(new IntersectorHlbvh(m_device.get(), IntersectorHlbvh::kLbvh, formats));
+        }
+        else if (type == "hlbvh_sah")
+        {
+            intersector.reset(new IntersectorHlbvh(m_device.get(), IntersectorHlbvh::kSahTopTree, formats));
+        }
+        else if (type == "hlbvh_ploc")
+        {
+            intersector.reset(new IntersectorHlbvh(m_device.get(), IntersectorHlbvh::kPloc, formats));
+        }
+        else if (type == "hashbvh")
+        {
+            intersector.reset(new IntersectorBitTrail(m_device.get(), formats));
+        }
+        else
+        {
+            intersector.reset(new IntersectorSkipLinks(m_device.get(), formats));
+        }
+
+        intersector->SetProfiler(m_profiler.get());
+        return intersector;
+    }
+
+    // Maximum number of rays of a combined dispatch of small queries
+    static std::uint32_t GetBatchSize(World const& world)
+    {
+        auto optbatch = world.options_.GetOption("acc.batch");
+        return optbatch && optbatch->AsFloat() > 0.f ? static_cast<std::uint32_t>(optbatch->AsFloat()) : 0U;
+    }
+
+    void CalcIntersectionDevice::Preprocess(World const& world)
+    {
+        RR_TRACE_SCOPE("CalcIntersectionDevice::Preprocess");
+
+        ThrowIf(m_snapshot, "The scene of an API created from a snapshot can't be changed.");
+
+        std::lock_guard<std::mutex> preprocess_lock(m_preprocess_mutex);
+
+        int formats = kFullRecords;
+        auto type = SelectIntersector(world, formats);
+
+        auto optprofile = world.options_.GetOption("profile.kernels");
+        m_profiler->SetEnabled(optprofile && optprofile->AsFloat() > 0.f);
+        m_batch_rays = GetBatchSize(world);
+
+        // Snapshots and pending batches keep querying the current intersector, so the scene goes into a fresh one
+        if (type != m_intersector_string || formats != m_formats || m_intersector.use_count() > 1 || m_intersector_stale)
+        {
+            WaitForPrecompile();
+            m_intersector = CreateIntersector(type, formats);
+            m_intersector->SetTraversalStatsBuffer(m_queue, m_traversal_stats);
+            m_intersector_string = type;
+            m_formats = formats;
+            m_intersector_stale = false;
+        }
+
+        try
+        {
+            // Let intersector to do its preprocessing job
+            m_intersector->SetWorld(world);
+        }
+        catch (Exception& e)
+        {
+            std::cout << e.what();
+            throw;
+        }
+    }
+
+    bool CalcIntersectionDevice::SupportsConcurrentPreprocess() const
+    {
+        // Vulkan command recording is not thread safe
+        return m_device->GetPlatform() == Calc::Platform::kOpenCL;
+    }
+
+    bool CalcIntersectionDevice::SupportsDeviceMeshes() const
+    {
+        // Vulkan HLBVH builds from face bounds computed on the host
+        return m_device->GetPlatform() == Calc::Platform::kOpenCL;
+    }
+
+    bool CalcIntersectionDevice::SupportsSpheres() const
+    {
+        // Both skip links kernels carry the sphere test
+        return true;
+    }
+
+    bool CalcIntersectionDevice::SupportsNestedInstances() const
+    {
+        // Only the OpenCL 2-level kernels keep a stack of shape levels
+        return m_device->GetPlatform() == Calc::Platform::kOpenCL;
+    }
+
+    bool CalcIntersectionDevice::SupportsRayMasks() const
+    {
+        // Mask tests are only compiled into the kernels with the enable_raymask premake option
+#ifdef RR_RAY_MASK
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void CalcIntersectionDevice::PreprocessConcurrent(World const& world)
+    {
+        RR_TRACE_SCOPE("CalcIntersectionDevice::PreprocessConcurrent");
+
+        ThrowIf(m_snapshot, "The scene of an API created from a snapshot can't be changed.");
+
+        std::lock_guard<std::mutex> preprocess_lock(m_preprocess_mutex);
+
+        int formats = kFullRecords;
+        auto type = SelectIntersector(world, formats);
+
+        auto optprofile = world.options_.GetOption("profile.kernels");
+        m_profiler->SetEnabled(optprofile && optprofile->AsFloat() > 0.f);
+
+        // The current intersector keeps serving queries, so the
+        // new scene data always goes into a fresh one
+        WaitForPrecompile();
+        std::shared_ptr<Intersector> intersector = CreateIntersector(type, formats);
+        intersector->SetTraversalStatsBuffer(m_queue, m_traversal_stats);
+
+        try
+        {
+            intersector->SetWorld(world);
+        }
+        catch (Exception& e)
+        {
+            std::cout << e.what();
+            m_intersector_stale = true;
+            throw;
+        }
+
+        // Queries are submitted under the queue locks, so none of them sees a half swapped state
+        {
+            auto locks = LockAllQueues();
+            m_intersector.swap(intersector);
+            m_batch_rays = GetBatchSize(world);
+            m_intersector_string = type;
+            m_formats = formats;
+            m_intersector_stale = false;
+        }
+
+        // Queries submitted with the previous intersector may still read its buffers
+        for (auto i = 0U; i < m_num_queues; ++i)
+        {
+            m_device->Finish(i);
+        }
+    }
+
+    void CalcIntersectionDevice::GetKernelProfile(std::vector<KernelProfile>& profile) const
+    {
+        m_profiler->GetProfile(profile);
+    }
+
+    void CalcIntersectionDevice::ResetKernelProfile()
+    {
+        m_profiler->Reset();
+    }
+
+    void CalcIntersectionDevice::GetStats(AccelStats& stats) const
+    {
+        // Queries may allocate traversal stacks
+        auto locks = LockAllQueues();
+        m_intersector->GetStats(stats);
+    }
+
+    Buffer* CalcIntersectionDevice::CreateBuffer(size_t size, void* initdata) const
+    {
+        return CreateBuffer(size, initdata, kBufferDefault);
+    }
+
+    Buffer* CalcIntersectionDevice::CreateBuffer(size_t size, void* initdata, BufferUsage usage) const
+    {
+        std::uint32_t flags = Calc::BufferType::kWrite;
+
+        // Shared virtual memory is mapped in place where the device has it
+        if (usage == kBufferStream)
+        {
+            flags |= Calc::BufferType::kPinned | Calc::BufferType::kShared;
+        }
+
+        // If initdata is passed in use different Calc call with init data
+        if (initdata)
+        {
+            auto calc_buffer = m_device->CreateBuffer(size, flags, initdata);
+            return new CalcBufferHolder(m_device.get(), calc_buffer);
+        }
+        else
+        {
+            auto calc_buffer = m_device->CreateBuffer(size, flags);
+            return new CalcBufferHolder(m_device.get(), calc_buffer);
+        }
+    }
+
+    Buffer* CalcIntersectionDevice::CreateBufferFromHostPtr(void* ptr, size_t size) const
+    {
+        // Discrete GPUs would read host memory over the bus on every access
+        ThrowIf(!m_host_unified_memory, "Host pointer buffers are not supported by devices without host unified memory.");
+
+        auto calc_buffer = m_device->CreateBuffer(size, Calc::BufferType::kWrite | Calc::BufferType::kHostPtr, ptr);
+        return new CalcBufferHolder(m_device.get(), calc_buffer);
+    }
+
+    void CalcIntersectionDevice::DeleteBuffer(Buffer* const buffer) const
+    {
+        // The buffer might be read by a pending batch
+        FlushBatch();
+        delete buffer;
+    }
+
+    void CalcIntersectionDevice::DeleteEvent(Event* const event) const
+    {
+        ReleaseEventHolder(static_cast<CalcEventHolder*>(event));
+    }
+
+    void CalcIntersectionDevice::JoinEvents(Event const* const* events, int count, Event** event) const
+    {
+        std::vector<Calc::Event*> calc_events;
+        for (int i = 0; i < count; ++i)
+        {
+            auto holder = static_cast<CalcEventHolder const*>(events[i]);
+
+            // Pending batches would never complete, so they are dispatched first
+            if (holder->m_batch)
+            {
+                holder->m_batch->dispatch();
+
+                if (holder->m_batch->event)
+                {
+                    calc_events.push_back(holder->m_batch->event.get());
+                }
+            }
+            else if (holder->m_event)
+            {
+                calc_events.push_back(holder->m_event.get());
+            }
+        }
+
+        Calc::Event* calc_event = nullptr;
+        {
+            auto lock = LockQueue();
+            m_device->JoinEvents(m_queue, calc_events.data(), calc_events.size(), &calc_event);
+        }
+
+        auto holder = CreateEventHolder();
+        holder->Set(m_device.get(), calc_event, m_queue);
+        *event = holder;
+    }
+
+    static Calc::MapType CalcMapType(MapType type)
+    {
+        switch (type)
+        {
+        case kMapRead:
+            return Calc::MapType::kMapRead;
+        case kMapWrite:
+            return Calc::MapType::kMapWrite;
+        default:
+            return Calc::MapType::kMapWrite;
+        }
+    }
+
+    void CalcIntersectionDevice::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const
+    {
+        // Hits of batched queries are written once their batch is dispatched
+        FlushBatch();
+
+        auto calc_buffer = static_cast<CalcBufferHolder*>(buffer);
+
+        if (event)
+        {
+            Calc::Event* e = nullptr;
+            m_device->MapBuffer(calc_buffer->GetData(), m_queue, offset, size, CalcMapType(type), data, &e);
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), e, m_queue);
+            *event = holder;
+        }
+        else
+        {
+            m_device->MapBuffer(calc_buffer->GetData(), m_queue, offset, size, CalcMapType(type), data, nullptr);
+        }
+    }
+
+    void CalcIntersectionDevice::UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const
+    {
+        // Hits of batched queries are written once their batch is dispatched
+        FlushBatch();
+
+        auto calc_buffer = static_cast<CalcBufferHolder*>(buffer);
+
+        if (event)
+        {
+            Calc::Event* e = nullptr;
+            m_device->UnmapBuffer(calc_buffer->GetData(), m_queue, ptr, &e);
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), e, m_queue);
+            *event = holder;
+        }
+        else
+        {
+            m_device->UnmapBuffer(calc_buffer->GetData(), m_queue, ptr, nullptr);
+        }
+    }
+
+
+    void CalcIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        // Extract Calc buffers from their holders
+        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
+
+        if (BatchQuery(ray_buffer, numrays, hit_buffer, false, event))
+        {
+            return;
+        }
+
+        if (event)
+        {
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            {
+                auto lock = LockQueue();
+                m_intersector->QueryIntersection(m_queue, ray_buffer, numrays, hit_buffer, m_hint, e, &calc_event);
+            }
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event, m_queue);
+            *event = holder;
+        }
+        else
+        {
+            auto lock = LockQueue();
+            m_intersector->QueryIntersection(m_queue, ray_buffer, numrays, hit_buffer, m_hint, e, nullptr);
+        }
+    }
+
+    void CalcIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        // Extract Calc buffers from their holders
+        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
+
+        if (BatchQuery(ray_buffer, numrays, hit_buffer, true, event))
+        {
+            return;
+        }
+
+        if (event)
+        {
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            {
+                auto lock = LockQueue();
+                m_intersector->QueryOcclusion(m_queue, ray_buffer, numrays, hit_buffer, m_hint, e, &calc_event);
+            }
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event, m_queue);
+            *event = holder;
+        }
+        else
+        {
+            auto lock = LockQueue();
+            m_intersector->QueryOcclusion(m_queue, ray_buffer, numrays, hit_buffer, m_hint, e, nullptr);
+        }
+    }
+
+    // Largest query SubmitQueries traverses together with others if "acc.batch" is not set,
+    // the copies of larger ones would cost more than the launches they save
+    static std::uint32_t const kMaxFusedRays = 8192;
+
+    void CalcIntersectionDevice::SubmitQueries(QueryDesc const* descs, int count, Event const* waitevent, Event** event) const
+    {
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
+
+        auto lock = LockQueue();
+
+        // Consecutive queries of the same type are grouped as long as they fit into a dispatch,
+        // a group of a single query is launched on its own without copies
+        struct Launch
+        {
+            bool occlusion;
+            std::size_t first;
+            std::size_t count;
+            std::uint32_t num_rays;
+        };
+
+        auto const max_rays = m_batch_rays > 0 ? m_batch_rays : kMaxFusedRays;
+        std::vector<BatchedQuery> queries(count);
+        std::vector<Launch> launches;
+
+        for (int i = 0; i < count; ++i)
+        {
+            bool const occlusion = descs[i].type == kQueryOcclusion;
+            auto const num_rays = static_cast<std::uint32_t>(descs[i].numrays);
+            queries[i].rays = static_cast<CalcBufferHolder const*>(descs[i].rays)->m_buffer.get();
+            queries[i].hits = static_cast<CalcBufferHolder const*>(descs[i].hits)->m_buffer.get();
+            queries[i].num_rays = num_rays;
+
+            bool const fusable = num_rays > 0 && num_rays < max_rays && m_intersector->SupportsBatching(occlusion);
+
+            if (fusable && !launches.empty())
+            {
+                auto& launch = launches.back();
+                auto const begin = queries.cbegin() + launch.first;
+                auto const end = begin + launch.count;
+                bool const same_hits = std::any_of(begin, end,
+                    [&queries, i](BatchedQuery const& query) { return query.hits == queries[i].hits; });
+
+                if (launch.num_rays > 0 && launch.occlusion == occlusion &&
+                    launch.num_rays + num_rays <= max_rays && !same_hits)
+                {
+                    ++launch.count;
+                    launch.num_rays += num_rays;
+                    continue;
+                }
+            }
+
+            // Groups only start at fusable queries, the others keep 0 rays
+            Launch launch = { occlusion, static_cast<std::size_t>(i), 1, fusable ? num_rays : 0 };
+            launches.push_back(launch);
+        }
+
+        // The queue is in-order, so only the last launch needs an event
+        Calc::Event* calc_event = nullptr;
+        for (std::size_t i = 0; i < launches.size(); ++i)
+        {
+            auto const& launch = launches[i];
+            auto const& query = queries[launch.first];
+            auto const launch_event = event && i + 1 == launches.size() ? &calc_event : nullptr;
+
+            if (launch.count > 1)
+            {
+                m_intersector->QueryBatch(m_queue, &query, static_cast<std::uint32_t>(launch.count), launch.occlusion, launch_event);
+            }
+            else if (launch.occlusion)
+            {
+                m_intersector->QueryOcclusion(m_queue, query.rays, query.num_rays, query.hits, m_hint, e, launch_event);
+            }
+            else
+            {
+                m_intersector->QueryIntersection(m_queue, query.rays, query.num_rays, query.hits, m_hint, e, launch_event);
+            }
+        }
+
+        if (event)
+        {
+            // Nothing has been launched, so the event follows the work already on the queue
+            if (launches.empty())
+            {
+                m_device->JoinEvents(m_queue, nullptr, 0, &calc_event);
+            }
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event, m_queue);
+            *event = holder;
+        }
+    }
+
+    void CalcIntersectionDevice::QueryIntersection(RayLayout const& rays, int numrays, HitLayout const& hits, Event const* waitevent, Event** event) const
+    {
+        // Conversion kernels are written in OpenCL only
+        if (m_device->GetPlatform() != Calc::Platform::kOpenCL)
+        {
+            IntersectionDevice::QueryIntersection(rays, numrays, hits, waitevent, event);
+            return;
+        }
+
+        // Extract Calc buffers from their holders, optional streams might be nullptr
+        auto get_buffer = [](Buffer const* buffer) -> Calc::Buffer*
+        {
+            return buffer ? static_cast<CalcBufferHolder const*>(buffer)->m_buffer.get() : nullptr;
+        };
+
+        RayStreams const ray_streams = { get_buffer(rays.origins), get_buffer(rays.directions), get_buffer(rays.maxt), get_buffer(rays.masks) };
+        HitStreams const hit_streams = { get_buffer(hits.shapeids), get_buffer(hits.primids), get_buffer(hits.uvs), get_buffer(hits.distances) };
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
+
+        if (event)
+        {
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            {
+                auto lock = LockQueue();
+                m_intersector->QueryIntersection(m_queue, ray_streams, numrays, hit_streams, m_hint, e, &calc_event);
+            }
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event, m_queue);
+            *event = holder;
+        }
+        else
+        {
+            auto lock = LockQueue();
+            m_intersector->QueryIntersection(m_queue, ray_streams, numrays, hit_streams, m_hint, e, nullptr);
+        }
+    }
+
+    void CalcIntersectionDevice::QueryOcclusion(RayLayout const& rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        // Conversion kernels are written in OpenCL only
+        if (m_device->GetPlatform() != Calc::Platform::kOpenCL)
+        {
+            IntersectionDevice::QueryOcclusion(rays, numrays, hits, waitevent, event);
+            return;
+        }
+
+        // Extract Calc buffers from their holders, optional streams might be nullptr
+        auto get_buffer = [](Buffer const* buffer) -> Calc::Buffer*
+        {
+            return buffer ? static_cast<CalcBufferHolder const*>(buffer)->m_buffer.get() : nullptr;
+        };
+
+        RayStreams const ray_streams = { get_buffer(rays.origins), get_buffer(rays.directions), get_buffer(rays.maxt), get_buffer(rays.masks) };
+        auto hit_buffer = get_buffer(hits);
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
+
+        if (event)
+        {
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            {
+                auto lock = LockQueue();
+                m_intersector->QueryOcclusion(m_queue, ray_streams, numrays, hit_buffer, m_hint, e, &calc_event);
+            }
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event, m_queue);
+            *event = holder;
+        }
+        else
+        {
+            auto lock = LockQueue();
+            m_intersector->QueryOcclusion(m_queue, ray_streams, numrays, hit_buffer, m_hint, e, nullptr);
+        }
+    }
+
+    void CalcIntersectionDevice::QueryDistance(Buffer const* rays, int numrays, Buffer* distances, Event const* waitevent, Event** event) const
+    {
+        // Reduction kernels are written in OpenCL only
+        if (m_device->GetPlatform() != Calc::Platform::kOpenCL)
+        {
+            IntersectionDevice::QueryDistance(rays, numrays, distances, waitevent, event);
+            return;
+        }
+
+        // Extract Calc buffers from their holders
+        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        auto distance_buffer = static_cast<CalcBufferHolder const*>(distances)->m_buffer.get();
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
+
+        if (event)
+        {
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            {
+                auto lock = LockQueue();
+                m_intersector->QueryDistance(m_queue, ray_buffer, numrays, distance_buffer, m_hint, e, &calc_event);
+            }
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event, m_queue);
+            *event = holder;
+        }
+        else
+        {
+            auto lock = LockQueue();
+            m_intersector->QueryDistance(m_queue, ray_buffer, numrays, distance_buffer, m_hint, e, nullptr);
+        }
+    }
+
+    void CalcIntersectionDevice::QueryOcclusionCount(Buffer const* rays, int numrays, int groupsize, Buffer* counts, Event const* waitevent, Event** event) const
+    {
+        // Reduction kernels are written in OpenCL only
+        if (m_device->GetPlatform() != Calc::Platform::kOpenCL)
+        {
+            IntersectionDevice::QueryOcclusionCount(rays, numrays, groupsize, counts, waitevent, event);
+            return;
+        }
+
+        // Extract Calc buffers from their holders
+        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        auto count_buffer = static_cast<CalcBufferHolder const*>(counts)->m_buffer.get();
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
+
+        if (event)
+        {
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            {
+                auto lock = LockQueue();
+                m_intersector->QueryOcclusionCount(m_queue, ray_buffer, numrays, groupsize, count_buffer, m_hint, e, &calc_event);
+            }
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event, m_queue);
+            *event = holder;
+        }
+        else
+        {
+            auto lock = LockQueue();
+            m_intersector->QueryOcclusionCount(m_queue, ray_buffer, numrays, groupsize, count_buffer, m_hint, e, nullptr);
+        }
+    }
+
+    void CalcIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        // Extract Calc buffers from their holders
+        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+        auto numrays_buffer = static_cast<CalcBufferHolder const*>(numrays)->m_buffer.get();
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
+
+        if (event)
+        {
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            {
+                auto lock = LockQueue();
+                m_intersector->QueryIntersection(m_queue, ray_buffer, numrays_buffer, maxrays, hit_buffer, m_hint, e, &calc_event);
+            }
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event, m_queue);
+            *event = holder;
+        }
+        else
+        {
+            auto lock = LockQueue();
+            m_intersector->QueryIntersection(m_queue, ray_buffer, numrays_buffer, maxrays, hit_buffer, m_hint, e, nullptr);
+        }
+    }
+
+    void CalcIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        // Extract Calc buffers from their holders
+        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+        auto numrays_buffer = static_cast<CalcBufferHolder const*>(numrays)->m_buffer.get();
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
+
+        if (event)
+        {
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            {
+                auto lock = LockQueue();
+                m_intersector->QueryOcclusion(m_queue, ray_buffer, numrays_buffer, maxrays, hit_buffer, m_hint, e, &calc_event);
+            }
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event, m_queue);
+            *event = holder;
+        }
+        else
+        {
+            auto lock = LockQueue();
+            m_intersector->QueryOcclusion(m_queue, ray_buffer, numrays_buffer, maxrays, hit_buffer, m_hint, e, nullptr);
+        }
+
+    }
+
+    void CalcIntersectionDevice::QueryOcclusionPacked(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        // Extract Calc buffers from their holders
+        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
+
+        if (event)
+        {
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            {
+                auto lock = LockQueue();
+                m_intersector->QueryOcclusionPacked(m_queue, ray_buffer, numrays, hit_buffer, e, &calc_event);
+            }
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event, m_queue);
+            *event = holder;
+        }
+        else
+        {
+            auto lock = LockQueue();
+            m_intersector->QueryOcclusionPacked(m_queue, ray_buffer, numrays, hit_buffer, e, nullptr);
+        }
+    }
+
+    void CalcIntersectionDevice::QueryOcclusionPacked(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        // Extract Calc buffers from their holders
+        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+        auto numrays_buffer = static_cast<CalcBufferHolder const*>(numrays)->m_buffer.get();
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
+
+        if (event)
+        {
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            {
+                auto lock = LockQueue();
+                m_intersector->QueryOcclusionPacked(m_queue, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, &calc_event);
+            }
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event, m_queue);
+            *event = holder;
+        }
+        else
+        {
+            auto lock = LockQueue();
+            m_intersector->QueryOcclusionPacked(m_queue, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, nullptr);
+        }
+    }
+
+    void CalcIntersectionDevice::QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        // Extract Calc buffers from their holders
+        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
+
+        if (event)
+        {
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            {
+                auto lock = LockQueue();
+                m_intersector->QueryIntersectionMulti(m_queue, ray_buffer, numrays, k, hit_buffer, e, &calc_event);
+            }
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event, m_queue);
+            *event = holder;
+        }
         else
         {
-            auto opt_force_flat = world.options_.GetOption("bvh.forceflat");
-
-            if (opt_force_flat && opt_force_flat->AsFloat() > 0.f)
-            {
-                use2level = false;
-            }
-            else
-            {
-                // Otherwise check if there are instances in the world
-                for (auto iter = world.shapes_.cbegin(); iter != world.shapes_.cend(); ++iter)
-                {
-                    // Get implementation
-                    auto shapeimpl = static_cast<ShapeImpl const*>(*iter);
-                    // Check if it is an instance and update flag
-                    use2level = use2level | shapeimpl->is_instance();
-                }
-            }
+            auto lock = LockQueue();
+            m_intersector->QueryIntersectionMulti(m_queue, ray_buffer, numrays, k, hit_buffer, e, nullptr);
         }
+    }
 
-        if (use2level)
+    void CalcIntersectionDevice::QueryIntersectionMulti(Buffer const* rays, Buffer const* numrays, int maxrays, int k, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        // Extract Calc buffers from their holders
+        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+        auto numrays_buffer = static_cast<CalcBufferHolder const*>(numrays)->m_buffer.get();
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
+
+        if (event)
         {
-            if (m_intersector_string != "bvh2l")
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
             {
-                m_intersector.reset(new IntersectorTwoLevel(m_device.get()));
-                m_intersector_string = "bvh2l";
+                auto lock = LockQueue();
+                m_intersector->QueryIntersectionMulti(m_queue, ray_buffer, numrays_buffer, maxrays, k, hit_buffer, e, &calc_event);
             }
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event, m_queue);
+            *event = holder;
         }
         else
         {
-            {
-                auto optacctype = world.options_.GetOption("acc.type");
-                std::string acctype = optacctype ? optacctype->AsString() : "bvh";
-
-                if (acctype == "bvh")
-                {
-                    if (m_intersector_string != "bvh")
-                    {
-                        m_intersector.reset(new IntersectorSkipLinks(m_device.get()));
-                        m_intersector_string = "bvh";
-                    }
-                }
-                else if (acctype == "fatbvh")
-                {
-                    if (m_intersector_string != "fatbvh")
-                    {
-                        m_intersector.reset(new IntersectorShortStack(m_device.get()));
-                        m_intersector_string = "fatbvh";
-                    }
-                }
-                else if (acctype == "hlbvh")
-                {
-                    if (m_intersector_string != "hlbvh")
-                    {
-                        m_intersector.reset(new IntersectorHlbvh(m_device.get()));
-                        m_intersector_string = "hlbvh";
-                    }
-                }
-                /*else if (acctype == "hashbvh")
-                {
-                    if (m_intersector_string != "hashbvh")
-                    {
-                        m_intersector.reset(new IntersectorBitTrail(m_device.get()));
-                        m_intersector_string = "hashbvh";
-                    }
-                }*/
-            }
+            auto lock = LockQueue();
+            m_intersector->QueryIntersectionMulti(m_queue, ray_buffer, numrays_buffer, maxrays, k, hit_buffer, e, nullptr);
         }
+    }
 
-        try
+    void CalcIntersectionDevice::QueryIntersectionAttributes(Buffer const* rays, int numrays, int numattributes, Buffer* hits, Buffer* attributes, Event const* waitevent, Event** event) const
+    {
+        // Extract Calc buffers from their holders
+        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+        auto attribute_buffer = static_cast<CalcBufferHolder const*>(attributes)->m_buffer.get();
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
+
+        if (event)
         {
-            // Let intersector to do its preprocessing job
-            m_intersector->SetWorld(world);
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            {
+                auto lock = LockQueue();
+                m_intersector->QueryIntersectionAttributes(m_queue, ray_buffer, numrays, numattributes, hit_buffer, attribute_buffer, e, &calc_event);
+            }
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event, m_queue);
+            *event = holder;
         }
-        catch (Exception& e)
+        else
         {
-            std::cout << e.what();
-            throw;
+            auto lock = LockQueue();
+            m_intersector->QueryIntersectionAttributes(m_queue, ray_buffer, numrays, numattributes, hit_buffer, attribute_buffer, e, nullptr);
         }
     }
 
-    Buffer* CalcIntersectionDevice::CreateBuffer(size_t size, void* initdata) const
+    void CalcIntersectionDevice::QueryOcclusionCached(Buffer const* rays, int numrays, Buffer* occluders, Buffer* hitresults, Event const* waitevent, Event** event) const
     {
-        // If initdata is passed in use different Calc call with init data
-        if (initdata)
+        // Extract Calc buffers from their holders
+        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        auto occluder_buffer = static_cast<CalcBufferHolder const*>(occluders)->m_buffer.get();
+        auto hit_buffer = static_cast<CalcBufferHolder const*>(hitresults)->m_buffer.get();
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
+
+        if (event)
         {
-            auto calc_buffer = m_device->CreateBuffer(size, Calc::BufferType::kWrite, initdata);
-            return new CalcBufferHolder(m_device.get(), calc_buffer);
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            {
+                auto lock = LockQueue();
+                m_intersector->QueryOcclusionCached(m_queue, ray_buffer, numrays, occluder_buffer, hit_buffer, e, &calc_event);
+            }
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event, m_queue);
+            *event = holder;
         }
         else
         {
-            auto calc_buffer = m_device->CreateBuffer(size, Calc::BufferType::kWrite);
-            return new CalcBufferHolder(m_device.get(), calc_buffer);
+            auto lock = LockQueue();
+            m_intersector->QueryOcclusionCached(m_queue, ray_buffer, numrays, occluder_buffer, hit_buffer, e, nullptr);
         }
     }
 
-    void CalcIntersectionDevice::DeleteBuffer(Buffer* const buffer) const
+    void CalcIntersectionDevice::QueryOverlap(Buffer const* boxes, int count, int maxoverlaps, Buffer* overlaps, Buffer* counts, Event const* waitevent, Event** event) const
     {
-        delete buffer;
-    }
+        // Extract Calc buffers from their holders
+        auto box_buffer = static_cast<CalcBufferHolder const*>(boxes)->m_buffer.get();
+        auto overlap_buffer = static_cast<CalcBufferHolder const*>(overlaps)->m_buffer.get();
+        auto count_buffer = static_cast<CalcBufferHolder const*>(counts)->m_buffer.get();
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
 
-    void CalcIntersectionDevice::DeleteEvent(Event* const event) const
-    {
-        ReleaseEventHolder(static_cast<CalcEventHolder*>(event));
-    }
+        if (event)
+        {
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            {
+                auto lock = LockQueue();
+                m_intersector->QueryOverlap(m_queue, box_buffer, count, maxoverlaps, overlap_buffer, count_buffer, e, &calc_event);
+            }
 
-    static Calc::MapType CalcMapType(MapType type)
-    {
-        switch (type)
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event, m_queue);
+            *event = holder;
+        }
+        else
         {
-        case kMapRead:
-            return Calc::MapType::kMapRead;
-        case kMapWrite:
-            return Calc::MapType::kMapWrite;
-        default:
-            return Calc::MapType::kMapWrite;
+            auto lock = LockQueue();
+            m_intersector->QueryOverlap(m_queue, box_buffer, count, maxoverlaps, overlap_buffer, count_buffer, e, nullptr);
         }
     }
 
-    void CalcIntersectionDevice::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const
+    void CalcIntersectionDevice::QueryClosestPoint(Buffer const* points, int count, float maxdist, Buffer* results, Event const* waitevent, Event** event) const
     {
-        auto calc_buffer = static_cast<CalcBufferHolder*>(buffer);
+        // Extract Calc buffers from their holders
+        auto point_buffer = static_cast<CalcBufferHolder const*>(points)->m_buffer.get();
+        auto result_buffer = static_cast<CalcBufferHolder const*>(results)->m_buffer.get();
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
 
         if (event)
         {
-            Calc::Event* e = nullptr;
-            m_device->MapBuffer(calc_buffer->GetData(), 0, offset, size, CalcMapType(type), data, &e);
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            {
+                auto lock = LockQueue();
+                m_intersector->QueryClosestPoint(m_queue, point_buffer, count, maxdist, result_buffer, e, &calc_event);
+            }
 
             auto holder = CreateEventHolder();
-            holder->Set(m_device.get(), e);
+            holder->Set(m_device.get(), calc_event, m_queue);
             *event = holder;
         }
         else
         {
-            m_device->MapBuffer(calc_buffer->GetData(), 0, offset, size, CalcMapType(type), data, nullptr);
+            auto lock = LockQueue();
+            m_intersector->QueryClosestPoint(m_queue, point_buffer, count, maxdist, result_buffer, e, nullptr);
         }
     }
 
-    void CalcIntersectionDevice::UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const
+    void CalcIntersectionDevice::QueryIntersection2D(Buffer const* rays, int width, int height, RayOrder order, Buffer* hits, Event const* waitevent, Event** event) const
     {
-        auto calc_buffer = static_cast<CalcBufferHolder*>(buffer);
+        // Extract Calc buffers from their holders
+        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
 
         if (event)
         {
-            Calc::Event* e = nullptr;
-            m_device->UnmapBuffer(calc_buffer->GetData(), 0, ptr, &e);
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            {
+                auto lock = LockQueue();
+                m_intersector->QueryIntersection2D(m_queue, ray_buffer, width, height, order, hit_buffer, e, &calc_event);
+            }
 
             auto holder = CreateEventHolder();
-            holder->Set(m_device.get(), e);
+            holder->Set(m_device.get(), calc_event, m_queue);
             *event = holder;
         }
         else
         {
-            m_device->UnmapBuffer(calc_buffer->GetData(), 0, ptr, nullptr);
+            auto lock = LockQueue();
+            m_intersector->QueryIntersection2D(m_queue, ray_buffer, width, height, order, hit_buffer, e, nullptr);
         }
     }
 
-
-    void CalcIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    void CalcIntersectionDevice::QueryPrimaryPinhole(PinholeCamera const& camera, int width, int height, Buffer* hits, Event const* waitevent, Event** event) const
     {
         // Extract Calc buffers from their holders
-        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
         auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
         // If waitevent is passed in we have to extract it as well
         auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
 
         if (event)
         {
             // event pointer has been provided, so construct holder and return event to the user
             Calc::Event* calc_event = nullptr;
-            m_intersector->QueryIntersection(0, ray_buffer, numrays, hit_buffer, e, &calc_event);
+            {
+                auto lock = LockQueue();
+                m_intersector->QueryPrimaryPinhole(m_queue, camera, width, height, hit_buffer, e, &calc_event);
+            }
 
             auto holder = CreateEventHolder();
-            holder->Set(m_device.get(), calc_event);
+            holder->Set(m_device.get(), calc_event, m_queue);
             *event = holder;
         }
         else
         {
-            m_intersector->QueryIntersection(0, ray_buffer, numrays, hit_buffer, e, nullptr);
+            auto lock = LockQueue();
+            m_intersector->QueryPrimaryPinhole(m_queue, camera, width, height, hit_buffer, e, nullptr);
         }
     }
 
-    void CalcIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    void CalcIntersectionDevice::QueryShadowFromHits(Buffer const* rays, Buffer const* hits, int numrays, float3 const& light, float epsilon, Buffer* results, Event const* waitevent, Event** event) const
     {
         // Extract Calc buffers from their holders
         auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
         auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+        auto result_buffer = static_cast<CalcBufferHolder const*>(results)->m_buffer.get();
         // If waitevent is passed in we have to extract it as well
         auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
 
         if (event)
         {
             // event pointer has been provided, so construct holder and return event to the user
             Calc::Event* calc_event = nullptr;
-            m_intersector->QueryOcclusion(0, ray_buffer, numrays, hit_buffer, e, &calc_event);
+            {
+                auto lock = LockQueue();
+                m_intersector->QueryShadowFromHits(m_queue, ray_buffer, hit_buffer, numrays, light, epsilon, result_buffer, e, &calc_event);
+            }
 
             auto holder = CreateEventHolder();
-            holder->Set(m_device.get(), calc_event);
+            holder->Set(m_device.get(), calc_event, m_queue);
             *event = holder;
         }
         else
         {
-            m_intersector->QueryOcclusion(0, ray_buffer, numrays, hit_buffer, e, nullptr);
+            auto lock = LockQueue();
+            m_intersector->QueryShadowFromHits(m_queue, ray_buffer, hit_buffer, numrays, light, epsilon, result_buffer, e, nullptr);
         }
     }
 
-    void CalcIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    void CalcIntersectionDevice::CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* compacted, Buffer* newnumrays, Buffer* indices, Event const* waitevent, Event** event) const
     {
-        // Extract Calc buffers from their holders
+        // Extract Calc buffers from their holders, predicate and indices are optional
         auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
-        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
         auto numrays_buffer = static_cast<CalcBufferHolder const*>(numrays)->m_buffer.get();
+        auto predicate_buffer = predicate ? static_cast<CalcBufferHolder const*>(predicate)->m_buffer.get() : nullptr;
+        auto compacted_buffer = static_cast<CalcBufferHolder const*>(compacted)->m_buffer.get();
+        auto newnumrays_buffer = static_cast<CalcBufferHolder const*>(newnumrays)->m_buffer.get();
+        auto index_buffer = indices ? static_cast<CalcBufferHolder const*>(indices)->m_buffer.get() : nullptr;
         // If waitevent is passed in we have to extract it as well
         auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
 
         if (event)
         {
             // event pointer has been provided, so construct holder and return event to the user
             Calc::Event* calc_event = nullptr;
-            m_intersector->QueryIntersection(0, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, &calc_event);
+            {
+                auto lock = LockQueue();
+                m_intersector->CompactRays(m_queue, ray_buffer, numrays_buffer, maxrays, predicate_buffer, compacted_buffer, newnumrays_buffer, index_buffer, e, &calc_event);
+            }
 
             auto holder = CreateEventHolder();
-            holder->Set(m_device.get(), calc_event);
+            holder->Set(m_device.get(), calc_event, m_queue);
             *event = holder;
         }
         else
         {
-            m_intersector->QueryIntersection(0, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, nullptr);
+            auto lock = LockQueue();
+            m_intersector->CompactRays(m_queue, ray_buffer, numrays_buffer, maxrays, predicate_buffer, compacted_buffer, newnumrays_buffer, index_buffer, e, nullptr);
         }
     }
 
-    void CalcIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    void CalcIntersectionDevice::SortHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer* indices, Buffer* numhits, Event const* waitevent, Event** event) const
     {
-        // Extract Calc buffers from their holders
-        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        // Extract Calc buffers from their holders, numhits is optional
         auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
         auto numrays_buffer = static_cast<CalcBufferHolder const*>(numrays)->m_buffer.get();
+        auto index_buffer = static_cast<CalcBufferHolder const*>(indices)->m_buffer.get();
+        auto numhits_buffer = numhits ? static_cast<CalcBufferHolder const*>(numhits)->m_buffer.get() : nullptr;
         // If waitevent is passed in we have to extract it as well
         auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        WaitForEvent(waitevent);
 
         if (event)
         {
             // event pointer has been provided, so construct holder and return event to the user
             Calc::Event* calc_event = nullptr;
-            m_intersector->QueryOcclusion(0, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, &calc_event);
+            {
+                auto lock = LockQueue();
+                m_intersector->SortHits(m_queue, hit_buffer, numrays_buffer, maxrays, index_buffer, numhits_buffer, e, &calc_event);
+            }
 
             auto holder = CreateEventHolder();
-            holder->Set(m_device.get(), calc_event);
+            holder->Set(m_device.get(), calc_event, m_queue);
             *event = holder;
         }
         else
         {
-            m_intersector->QueryOcclusion(0, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, nullptr);
+            auto lock = LockQueue();
+            m_intersector->SortHits(m_queue, hit_buffer, numrays_buffer, maxrays, index_buffer, numhits_buffer, e, nullptr);
         }
+    }
 
+    std::uint32_t CalcIntersectionDevice::GetQueueCount() const
+    {
+        return m_num_queues;
     }
 
-    CalcEventHolder* CalcIntersectionDevice::CreateEventHolder() const
+    void CalcIntersectionDevice::SetQueue(std::uint32_t queue)
     {
-        if (m_event_pool.empty())
+        ThrowIf(queue >= m_num_queues, "Queue index is out of range.");
+
+        // Counters follow the queries to the new queue
+        if (m_traversal_stats && m_intersector)
         {
-            auto event = new CalcEventHolder();
-            return event;
+            auto lock = LockQueue();
+            m_intersector->SetTraversalStatsBuffer(m_queue, nullptr);
+            m_intersector->SetTraversalStatsBuffer(queue, m_traversal_stats);
         }
-        else
+
+        m_queue = queue;
+    }
+
+    void CalcIntersectionDevice::SetQueryPriority(QueryPriority priority)
+    {
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+
+        switch (priority)
+        {
+        case kQueryPriorityHigh:
+            SetQueue(spec.high_priority_queue);
+            break;
+        case kQueryPriorityLow:
+            SetQueue(spec.low_priority_queue);
+            break;
+        default:
+            SetQueue(0);
+            break;
+        }
+    }
+
+    void CalcIntersectionDevice::SetQueryHint(QueryHint hint)
+    {
+        m_hint = hint;
+    }
+
+    void CalcIntersectionDevice::SetTraversalStatsBuffer(Buffer* stats)
+    {
+        m_traversal_stats = stats ? static_cast<CalcBufferHolder*>(stats)->m_buffer.get() : nullptr;
+
+        if (m_intersector)
+        {
+            auto lock = LockQueue();
+            m_intersector->SetTraversalStatsBuffer(m_queue, m_traversal_stats);
+        }
+    }
+
+    IntersectionDevice* CalcIntersectionDevice::CreateSnapshot() const
+    {
+        // Wait for a build in progress, so the snapshot gets a complete scene
+        std::lock_guard<std::mutex> preprocess_lock(m_preprocess_mutex);
+        std::lock_guard<std::mutex> lock(GetSubmitMutex());
+
+        // The source device submits to the first queue, snapshots take the next ones
+        auto queue = (++m_shared->num_snapshots) % m_num_queues;
+        return new CalcIntersectionDevice(*this, queue);
+    }
+
+    std::mutex& CalcIntersectionDevice::GetSubmitMutex() const
+    {
+        auto const& mutexes = m_shared->queue_mutexes;
+        return *mutexes[m_queue % mutexes.size()];
+    }
+
+    std::unique_lock<std::mutex> CalcIntersectionDevice::LockQueue() const
+    {
+        std::unique_lock<std::mutex> lock(GetSubmitMutex());
+        DispatchBatch(m_shared->batches[m_queue], m_queue);
+        return lock;
+    }
+
+    void CalcIntersectionDevice::FlushBatch() const
+    {
+        LockQueue();
+    }
+
+    void CalcIntersectionDevice::DispatchBatch(PendingBatch& batch, std::uint32_t queue)
+    {
+        if (batch.queries.empty())
+        {
+            return;
+        }
+
+        // The batch is taken first, so a failed dispatch isn't retried by every later call
+        PendingBatch dispatched;
+        std::swap(dispatched, batch);
+
+        Calc::Event* e = nullptr;
+        dispatched.intersector->QueryBatch(queue, dispatched.queries.data(), static_cast<std::uint32_t>(dispatched.queries.size()),
+            dispatched.occlusion, dispatched.event ? &e : nullptr);
+
+        if (dispatched.event)
+        {
+            auto device = dispatched.device;
+            dispatched.event->event.reset(e, [device](Calc::Event* event) { device->DeleteEvent(event); });
+        }
+    }
+
+    bool CalcIntersectionDevice::BatchQuery(Calc::Buffer const* rays, int numrays, Calc::Buffer* hits, bool occlusion, Event** event) const
+    {
+        if (numrays <= 0)
+        {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(GetSubmitMutex());
+
+        auto const num_rays = static_cast<std::uint32_t>(numrays);
+        if (num_rays >= m_batch_rays || !m_intersector->SupportsBatching(occlusion))
+        {
+            return false;
+        }
+
+        // Queries of a batch are traversed at once, so they are of the same kind and intersector,
+        // and hits written by a query have to be copied back before a later one overwrites them
+        auto& batch = m_shared->batches[m_queue];
+        bool const same_hits = std::any_of(batch.queries.cbegin(), batch.queries.cend(),
+            [hits](BatchedQuery const& query) { return query.hits == hits; });
+
+        if (batch.intersector != m_intersector || batch.occlusion != occlusion ||
+            batch.num_rays + num_rays > m_batch_rays || same_hits)
+        {
+            DispatchBatch(batch, m_queue);
+        }
+
+        if (batch.queries.empty())
+        {
+            batch.intersector = m_intersector;
+            batch.device = m_device;
+            batch.occlusion = occlusion;
+        }
+
+        BatchedQuery query = { rays, hits, num_rays };
+        batch.queries.push_back(query);
+        batch.num_rays += num_rays;
+
+        if (event)
+        {
+            if (!batch.event)
+            {
+                // Waiting for the event dispatches the batch unless something else did it before
+                std::weak_ptr<SharedState> shared = m_shared;
+                auto queue = m_queue;
+                auto batch_event = std::make_shared<CalcBatchEvent>();
+                auto self = batch_event.get();
+
+                batch_event->dispatch = [shared, queue, self]()
+                {
+                    if (auto state = shared.lock())
+                    {
+                        auto const& mutexes = state->queue_mutexes;
+                        std::lock_guard<std::mutex> lock(*mutexes[queue % mutexes.size()]);
+
+                        auto& pending = state->batches[queue];
+                        if (pending.event.get() == self)
+                        {
+                            DispatchBatch(pending, queue);
+                        }
+                    }
+                };
+
+                batch.event = batch_event;
+            }
+
+            auto holder = CreateEventHolder();
+            holder->SetBatch(batch.event, m_queue);
+            *event = holder;
+        }
+
+        if (batch.num_rays == m_batch_rays)
+        {
+            DispatchBatch(batch, m_queue);
+        }
+
+        return true;
+    }
+
+    std::vector<std::unique_lock<std::mutex>> CalcIntersectionDevice::LockAllQueues() const
+    {
+        // Always taken in the same order, so two callers never deadlock
+        std::vector<std::unique_lock<std::mutex>> locks;
+        for (auto const& mutex : m_shared->queue_mutexes)
+        {
+            locks.emplace_back(*mutex);
+        }
+
+        return locks;
+    }
+
+    void CalcIntersectionDevice::WaitForEvent(Event const* waitevent) const
+    {
+        // Queues are in-order, so only dependencies on other queues are waited for.
+        // Calc has no cross queue dependencies, so the wait happens on the host.
+        auto holder = static_cast<CalcEventHolder const*>(waitevent);
+
+        if (holder && holder->m_queue != m_queue)
         {
-            auto event = m_event_pool.front();
-            m_event_pool.pop();
-            return event;
+            holder->m_event->Wait();
         }
     }
 
+    CalcEventHolder* CalcIntersectionDevice::CreateEventHolder() const
+    {
+        return m_event_pool.acquire();
+    }
+
     void    CalcIntersectionDevice::ReleaseEventHolder(CalcEventHolder* e) const
     {
-        m_event_pool.push(e);
+        // Release Calc event right away rather than on reuse
+        e->m_event.reset();
+        e->m_batch.reset();
+        m_event_pool.release(e);
     }
 }
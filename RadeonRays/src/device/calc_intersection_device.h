@@ -25,16 +25,25 @@ THE SOFTWARE.
 
 #include "calc.h"
 #include "device.h"
+#include "calc_holder.h"
+#include "../async/lockfree_pool.h"
+#include "../intersector/ray_batcher.h"
 
+#include <atomic>
 #include <memory>
 #include <functional>
-#include <queue>
+#include <future>
+#include <mutex>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
 
 
 namespace RadeonRays
 {
     class Intersector;
-    struct CalcEventHolder;
+    class KernelProfiler;
 
     ///< The class represents Calc based intersection device.
     ///< It uses Calc::Device abstraction to implement intersection algorithm.
@@ -43,16 +52,40 @@ namespace RadeonRays
     {
     public:
         //
-        CalcIntersectionDevice(Calc::Calc* calc, Calc::Device* device);
+        // Initial number of events in the pool
+        static const std::uint32_t EVENT_POOL_INITIAL_SIZE = 100;
+
+        // event_pool_size is the number of events preallocated,
+        // the pool grows if more events are in flight
+        CalcIntersectionDevice(Calc::Calc* calc, Calc::Device* device, std::uint32_t event_pool_size = EVENT_POOL_INITIAL_SIZE);
         ~CalcIntersectionDevice();
 
         void Preprocess(World const& world) override;
 
+        bool SupportsConcurrentPreprocess() const override;
+
+        void PreprocessConcurrent(World const& world) override;
+
+        bool SupportsDeviceMeshes() const override;
+        bool SupportsSpheres() const override;
+
+        bool SupportsNestedInstances() const override;
+        bool SupportsRayMasks() const override;
+
+        void GetKernelProfile(std::vector<KernelProfile>& profile) const override;
+
+        void ResetKernelProfile() override;
+
+        void GetStats(AccelStats& stats) const override;
+
         Buffer* CreateBuffer(size_t size, void* initdata) const override;
+        Buffer* CreateBuffer(size_t size, void* initdata, BufferUsage usage) const override;
+        Buffer* CreateBufferFromHostPtr(void* ptr, size_t size) const override;
 
         void DeleteBuffer(Buffer* const) const override;
 
         void DeleteEvent(Event* const) const override;
+        void JoinEvents(Event const* const* events, int count, Event** event) const override;
 
         void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const override;
 
@@ -62,23 +95,151 @@ namespace RadeonRays
 
         void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
 
+        void SubmitQueries(QueryDesc const* descs, int count, Event const* waitevent, Event** event) const override;
+
+        void QueryIntersection(RayLayout const& rays, int numrays, HitLayout const& hits, Event const* waitevent, Event** event) const override;
+
+        void QueryOcclusion(RayLayout const& rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+
+        void QueryDistance(Buffer const* rays, int numrays, Buffer* distances, Event const* waitevent, Event** event) const override;
+
+        void QueryOcclusionCount(Buffer const* rays, int numrays, int groupsize, Buffer* counts, Event const* waitevent, Event** event) const override;
+
         void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
 
         void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
 
+        void QueryOcclusionPacked(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+
+        void QueryOcclusionPacked(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+
+        void QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+
+        void QueryIntersectionMulti(Buffer const* rays, Buffer const* numrays, int maxrays, int k, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryIntersectionAttributes(Buffer const* rays, int numrays, int numattributes, Buffer* hits, Buffer* attributes, Event const* waitevent, Event** event) const override;
+        void QueryOcclusionCached(Buffer const* rays, int numrays, Buffer* occluders, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryOverlap(Buffer const* boxes, int count, int maxoverlaps, Buffer* overlaps, Buffer* counts, Event const* waitevent, Event** event) const override;
+        void QueryClosestPoint(Buffer const* points, int count, float maxdist, Buffer* results, Event const* waitevent, Event** event) const override;
+
+        void QueryIntersection2D(Buffer const* rays, int width, int height, RayOrder order, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryPrimaryPinhole(PinholeCamera const& camera, int width, int height, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryShadowFromHits(Buffer const* rays, Buffer const* hits, int numrays, float3 const& light, float epsilon, Buffer* results, Event const* waitevent, Event** event) const override;
+
+        void CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* compacted, Buffer* newnumrays, Buffer* indices, Event const* waitevent, Event** event) const override;
+        void SortHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer* indices, Buffer* numhits, Event const* waitevent, Event** event) const override;
+
+        std::uint32_t GetQueueCount() const override;
+
+        void SetQueue(std::uint32_t queue) override;
+
+        void SetQueryPriority(QueryPriority priority) override;
+
+        void SetQueryHint(QueryHint hint) override;
+
+        void SetTraversalStatsBuffer(Buffer* stats) override;
+
+        IntersectionDevice* CreateSnapshot() const override;
+
         Calc::Platform GetPlatform() const { return m_device->GetPlatform(); }
     protected:
+        // Snapshot of the source scene submitting to the queue
+        CalcIntersectionDevice(CalcIntersectionDevice const& source, std::uint32_t queue);
+
         CalcEventHolder* CreateEventHolder() const;
         void      ReleaseEventHolder(CalcEventHolder* e) const;
-
-        std::unique_ptr<Calc::Device, std::function<void(Calc::Device*)>> m_device;
-        std::unique_ptr<Intersector> m_intersector;
+        // Wait for the event if it comes from another queue
+        void WaitForEvent(Event const* waitevent) const;
+        // Intersector type for the world options, sets the record layouts it needs
+        std::string SelectIntersector(World const& world, int& formats) const;
+        // Intersector for acc.type "auto", estimated from the scene size, rebuild rate and device
+        std::string SelectAutoIntersector(World const& world) const;
+        std::unique_ptr<Intersector> CreateIntersector(std::string const& type, int formats) const;
+        // Wait until the kernels compiled in the background at creation are ready
+        void WaitForPrecompile() const;
+        // Lock serializing the submissions to the queue of the device
+        std::mutex& GetSubmitMutex() const;
+        // Lock the queue of the device and dispatch its pending batch, so work submitted under the lock follows it
+        std::unique_lock<std::mutex> LockQueue() const;
+        // Dispatch the pending batch of the queue of the device
+        void FlushBatch() const;
+        // Collect a small query into the batch of the queue, returns false if it has to be submitted on its own
+        bool BatchQuery(Calc::Buffer const* rays, int numrays, Calc::Buffer* hits, bool occlusion, Event** event) const;
+        // Lock all the queues, so no query sees a half swapped intersector
+        std::vector<std::unique_lock<std::mutex>> LockAllQueues() const;
+
+        // Small queries collected into a single dispatch, see "acc.batch"
+        struct PendingBatch
+        {
+            PendingBatch() : num_rays(0), occlusion(false) {}
+
+            // Device the event of the dispatch is released with, outlives the intersector
+            std::shared_ptr<Calc::Device> device;
+            // Intersector the queries are traversed with
+            std::shared_ptr<Intersector> intersector;
+            std::vector<BatchedQuery> queries;
+            std::uint32_t num_rays;
+            bool occlusion;
+            // Shared by the events returned for the queries, nullptr if none has been requested
+            std::shared_ptr<CalcBatchEvent> event;
+        };
+
+        // State shared with the devices created from snapshots
+        struct SharedState
+        {
+            // Intersectors keep per queue state, so submissions to a queue are serialized
+            // while different queues are submitted to concurrently. Vulkan command recording
+            // is not thread safe, so all the queues share a single lock there.
+            std::vector<std::unique_ptr<std::mutex>> queue_mutexes;
+            // Pending batch of every queue, guarded by its lock
+            std::vector<PendingBatch> batches;
+            // Number of snapshot devices created, they are spread over the queues
+            std::atomic<std::uint32_t> num_snapshots;
+        };
+
+        // Dispatch the pending batch of a queue, its lock has to be held
+        static void DispatchBatch(PendingBatch& batch, std::uint32_t queue);
+
+        // Calc device, the scene and kernel timing are shared with snapshot devices
+        std::shared_ptr<Calc::Device> m_device;
+        // Kernel timing shared by the intersectors of the device
+        std::shared_ptr<KernelProfiler> m_profiler;
+        // Snapshots keep querying it after this device moves to a new scene
+        std::shared_ptr<Intersector> m_intersector;
         std::string m_intersector_string;
-
-        // Initial number of events in the pool
-        static const std::size_t EVENT_POOL_INITIAL_SIZE = 100;
-        // Event pool
-        mutable std::queue<CalcEventHolder*> m_event_pool;
+        // Record layouts of the current intersector, combination of RecordFormat flags
+        int m_formats;
+        // Set if a concurrent build failed or was cancelled after the world change flags
+        // had been reset, the current intersector misses those changes then
+        bool m_intersector_stale;
+        // Maximum number of rays of a combined dispatch of small queries, 0 if they aren't batched
+        std::uint32_t m_batch_rays;
+        // Queue used for submission
+        std::uint32_t m_queue;
+        // Kind of rays of the queries
+        QueryHint m_hint;
+        // Traversal counters of the queries, set on the intersector for the queue
+        Calc::Buffer* m_traversal_stats;
+        std::uint32_t m_num_queues;
+        // Device shares the memory with the host, so host pointers can be used in place
+        bool m_host_unified_memory;
+        // Scene is a snapshot of another device and can't be changed
+        bool m_snapshot;
+        std::shared_ptr<SharedState> m_shared;
+
+        // Event pool, events are created and released from any thread
+        mutable lockfree_pool<CalcEventHolder> m_event_pool;
+        // Preprocessing may be done from a worker thread, builds are serialized
+        mutable std::mutex m_preprocess_mutex;
+        // Automatic intersector choices by (face count bucket, shape count, dynamic),
+        // only touched during preprocessing
+        mutable std::map<std::tuple<int, int, bool>, std::string> m_auto_intersectors;
+        // Consecutive commits rebuilding the scene while acc.type is "auto"
+        mutable int m_auto_rebuilds;
+        // Compilation of the kernels of the intersectors scenes likely switch to,
+        // destroyed first so the task never outlives the device
+        std::future<void> m_precompile;
     };
 }
 
@@ -0,0 +1,1497 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "cpu_intersection_device.h"
+
+#include "../world/world.h"
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
+#include "../accelerator/bvh.h"
+#include "../accelerator/split_bvh.h"
+#include "../accelerator/linear_bvh.h"
+#include "../accelerator/presplit.h"
+#include "../except/except.h"
+#include "math/mathutils.h"
+#include "math/simd.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+
+//minimum count of elements for one parallel_for subrange
+#define TASK_SIZE 256
+
+namespace RadeonRays
+{
+    namespace
+    {
+        // Traversal stack entries per ray, each wide level can postpone up to 3 children
+        int const kMaxStackSize = 256;
+        // Occlusion results, same as HIT_MARKER and MISS_MARKER of the kernels
+        int const kHitMarker = 1;
+        int const kMissMarker = -1;
+
+        // Ray data precomputed for the box tests
+        struct TraversalRay
+        {
+            float3 o;
+            float3 d;
+            float invdir[3];
+            float oxinvdir[3];
+        };
+
+        void InitTraversalRay(ray const& r, TraversalRay& tr)
+        {
+            tr.o = float3(r.o.x, r.o.y, r.o.z);
+            tr.d = float3(r.d.x, r.d.y, r.d.z);
+
+            // Tiny direction components are clamped, so there are no infinities
+            // and no NaNs coming out of 0 * inf in the slab test
+            float const ooeps = std::ldexp(1.f, -80);
+            float const dir[3] = { r.d.x, r.d.y, r.d.z };
+            float const org[3] = { r.o.x, r.o.y, r.o.z };
+
+            for (int i = 0; i < 3; ++i)
+            {
+                tr.invdir[i] = 1.f / (std::fabs(dir[i]) > ooeps ? dir[i] : std::copysign(ooeps, dir[i]));
+                tr.oxinvdir[i] = -org[i] * tr.invdir[i];
+            }
+        }
+
+        // Slab test of the ray against children boxes of a wide node, returns a bit
+        // per child hit within [0, t_max] and writes entry distances of the children
+        inline int IntersectChildren(WideBvhTranslator::Node const& node, TraversalRay const& r, float t_max, float* t)
+        {
+            int const valid = (1 << node.numchildren) - 1;
+
+#if defined(RR_SIMD_SSE) || defined(RR_SIMD_NEON)
+            using namespace simd;
+
+            vec4 const idx = splat(r.invdir[0]);
+            vec4 const idy = splat(r.invdir[1]);
+            vec4 const idz = splat(r.invdir[2]);
+            vec4 const ox = splat(r.oxinvdir[0]);
+            vec4 const oy = splat(r.oxinvdir[1]);
+            vec4 const oz = splat(r.oxinvdir[2]);
+
+            vec4 const fx = madd(loadu(node.maxx), idx, ox);
+            vec4 const fy = madd(loadu(node.maxy), idy, oy);
+            vec4 const fz = madd(loadu(node.maxz), idz, oz);
+            vec4 const nx = madd(loadu(node.minx), idx, ox);
+            vec4 const ny = madd(loadu(node.miny), idy, oy);
+            vec4 const nz = madd(loadu(node.minz), idz, oz);
+
+            vec4 const t1 = min(min(max(fx, nx), max(fy, ny)), min(max(fz, nz), splat(t_max)));
+            vec4 const t0 = max(max(min(fx, nx), min(fy, ny)), max(min(fz, nz), splat(0.f)));
+
+            store(t, t0);
+            return le_mask(t0, t1) & valid;
+#else
+            int mask = 0;
+
+            for (int i = 0; i < node.numchildren; ++i)
+            {
+                float const fx = node.maxx[i] * r.invdir[0] + r.oxinvdir[0];
+                float const fy = node.maxy[i] * r.invdir[1] + r.oxinvdir[1];
+                float const fz = node.maxz[i] * r.invdir[2] + r.oxinvdir[2];
+                float const nx = node.minx[i] * r.invdir[0] + r.oxinvdir[0];
+                float const ny = node.miny[i] * r.invdir[1] + r.oxinvdir[1];
+                float const nz = node.minz[i] * r.invdir[2] + r.oxinvdir[2];
+
+                float const t1 = std::min(std::min(std::max(fx, nx), std::max(fy, ny)), std::min(std::max(fz, nz), t_max));
+                float const t0 = std::max(std::max(std::min(fx, nx), std::min(fy, ny)), std::max(std::min(fz, nz), 0.f));
+
+                t[i] = t0;
+                mask |= (t0 <= t1) ? (1 << i) : 0;
+            }
+
+            return mask & valid;
+#endif
+        }
+
+        // Moller-Trumbore test, returns true for a hit closer than t_max and writes
+        // its distance and barycentrics. Degenerate triangles give NaNs and are rejected.
+        inline bool IntersectTriangle(TraversalRay const& r, float3 const& v1, float3 const& v2, float3 const& v3, float t_max, float& t, float& u, float& v)
+        {
+            float3 const e1 = v2 - v1;
+            float3 const e2 = v3 - v1;
+            float3 const s1 = cross(r.d, e2);
+            float const invd = 1.f / dot(s1, e1);
+
+            float3 const d = r.o - v1;
+            float const b1 = dot(d, s1) * invd;
+            float3 const s2 = cross(d, e1);
+            float const b2 = dot(r.d, s2) * invd;
+            float const temp = dot(e2, s2) * invd;
+
+            if (b1 >= 0.f && b2 >= 0.f && b1 + b2 <= 1.f && temp >= 0.f && temp < t_max)
+            {
+                t = temp;
+                u = b1;
+                v = b2;
+                return true;
+            }
+
+            return false;
+        }
+
+        // Squared distances of the point to children boxes of a wide node
+        inline void DistanceToChildren(WideBvhTranslator::Node const& node, float3 const& p, float* d2)
+        {
+#if defined(RR_SIMD_SSE) || defined(RR_SIMD_NEON)
+            using namespace simd;
+
+            vec4 const px = splat(p.x);
+            vec4 const py = splat(p.y);
+            vec4 const pz = splat(p.z);
+
+            // Offsets to the points of the boxes closest to p, zero inside
+            vec4 const dx = sub(px, min(max(px, loadu(node.minx)), loadu(node.maxx)));
+            vec4 const dy = sub(py, min(max(py, loadu(node.miny)), loadu(node.maxy)));
+            vec4 const dz = sub(pz, min(max(pz, loadu(node.minz)), loadu(node.maxz)));
+
+            store(d2, madd(dx, dx, madd(dy, dy, mul(dz, dz))));
+#else
+            for (int i = 0; i < node.numchildren; ++i)
+            {
+                float const dx = p.x - std::min(std::max(p.x, node.minx[i]), node.maxx[i]);
+                float const dy = p.y - std::min(std::max(p.y, node.miny[i]), node.maxy[i]);
+                float const dz = p.z - std::min(std::max(p.z, node.minz[i]), node.maxz[i]);
+
+                d2[i] = dx * dx + dy * dy + dz * dz;
+            }
+#endif
+        }
+
+        // Closest point of the triangle to p, barycentrics are written
+        // the same way as for hits, so the weights of v2 and v3
+        inline float3 ClosestPointOnTriangle(float3 const& p, float3 const& v1, float3 const& v2, float3 const& v3, float& u, float& v)
+        {
+            float3 const e1 = v2 - v1;
+            float3 const e2 = v3 - v1;
+
+            // Vertex region of v1
+            float3 const p1 = p - v1;
+            float const d1 = dot(e1, p1);
+            float const d2 = dot(e2, p1);
+            if (d1 <= 0.f && d2 <= 0.f)
+            {
+                u = 0.f;
+                v = 0.f;
+                return v1;
+            }
+
+            // Vertex region of v2
+            float3 const p2 = p - v2;
+            float const d3 = dot(e1, p2);
+            float const d4 = dot(e2, p2);
+            if (d3 >= 0.f && d4 <= d3)
+            {
+                u = 1.f;
+                v = 0.f;
+                return v2;
+            }
+
+            // Edge region of v1 v2
+            float const vc = d1 * d4 - d3 * d2;
+            if (vc <= 0.f && d1 >= 0.f && d3 <= 0.f)
+            {
+                u = d1 / (d1 - d3);
+                v = 0.f;
+                return v1 + u * e1;
+            }
+
+            // Vertex region of v3
+            float3 const p3 = p - v3;
+            float const d5 = dot(e1, p3);
+            float const d6 = dot(e2, p3);
+            if (d6 >= 0.f && d5 <= d6)
+            {
+                u = 0.f;
+                v = 1.f;
+                return v3;
+            }
+
+            // Edge region of v1 v3
+            float const vb = d5 * d2 - d1 * d6;
+            if (vb <= 0.f && d2 >= 0.f && d6 <= 0.f)
+            {
+                u = 0.f;
+                v = d2 / (d2 - d6);
+                return v1 + v * e2;
+            }
+
+            // Edge region of v2 v3
+            float const va = d3 * d6 - d5 * d4;
+            if (va <= 0.f && d4 - d3 >= 0.f && d5 - d6 >= 0.f)
+            {
+                v = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+                u = 1.f - v;
+                return v2 + v * (v3 - v2);
+            }
+
+            // Inside the face
+            float const denom = 1.f / (va + vb + vc);
+            u = vb * denom;
+            v = vc * denom;
+            return v1 + u * e1 + v * e2;
+        }
+
+        // Child address decoding, see WideBvhTranslator::EncodeLeaf
+        inline bool IsLeaf(int address) { return address < WideBvhTranslator::kInvalidChild; }
+        inline int GetStartIdx(int address) { return -address - 2; }
+
+        void SetMiss(Intersection& hit)
+        {
+            hit.shapeid = kNullId;
+            hit.primid = kNullId;
+        }
+    }
+
+    //simple RadeonRays::Buffer implementation
+    class CpuBuffer : public Buffer
+    {
+    public:
+        CpuBuffer(size_t size, void* init)
+            : m_data(nullptr)
+            , m_owned(true)
+        {
+            m_data = new char[size];
+            if (init)
+                memcpy(m_data, init, size);
+        }
+
+        // Wrap caller memory, it is neither copied nor released
+        explicit CpuBuffer(void* host_ptr)
+            : m_data(host_ptr)
+            , m_owned(false)
+        {
+        }
+
+        virtual ~CpuBuffer()
+        {
+            if (m_owned)
+                delete[] static_cast<char*>(m_data);
+            m_data = nullptr;
+        }
+
+        void* GetData()
+        {
+            return m_data;
+        }
+
+        const void* GetData() const
+        {
+            return m_data;
+        }
+
+    private:
+        void* m_data;
+        bool m_owned;
+    };
+
+    //pooled RadeonRays::Event implementation, asynchronous queries run as thread pool jobs
+    class CpuEvent : public Event, public thread_pool<void>::job
+    {
+    public:
+        enum class Query
+        {
+            kNone,
+            kIntersection,
+            kOcclusion
+        };
+
+        CpuEvent()
+            : m_complete(true)
+            , m_query(Query::kNone)
+            , m_device(nullptr)
+            , m_rays(nullptr)
+            , m_hits(nullptr)
+            , m_numrays(0)
+            , m_callback(nullptr)
+            , m_callback_data(nullptr)
+        {
+            execute = &CpuEvent::Execute;
+            discard = &CpuEvent::Discard;
+        }
+
+        virtual ~CpuEvent()
+        {
+            WaitForCompletion();
+        }
+
+        virtual bool Complete() const
+        {
+            return m_complete.load();
+        }
+
+        // Rethrows an exception raised by the query if any
+        virtual void Wait()
+        {
+            WaitForCompletion();
+
+            if (m_error)
+            {
+                auto error = m_error;
+                m_error = nullptr;
+                std::rethrow_exception(error);
+            }
+        }
+
+        // The query job calls it once it is done
+        virtual void OnComplete(CompletionFunc callback, void* userdata)
+        {
+            ThrowIf(!callback, "Invalid completion callback.");
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (!m_complete.load())
+                {
+                    m_callback = callback;
+                    m_callback_data = userdata;
+                    return;
+                }
+            }
+
+            callback(userdata);
+        }
+
+        // Make the event pending until the query is executed by the pool
+        void SetQuery(Query query, CpuIntersectionDevice const* device, Buffer const* rays, int numrays, Buffer* hits)
+        {
+            m_query = query;
+            m_device = device;
+            m_rays = rays;
+            m_hits = hits;
+            m_numrays = numrays;
+            m_error = nullptr;
+            m_complete = false;
+        }
+
+        void WaitForCompletion()
+        {
+            // Always lock, so the pool thread is done with the event once we return
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]() { return m_complete.load(); });
+        }
+
+    private:
+        static void Execute(thread_pool<void>::job* j)
+        {
+            auto ev = static_cast<CpuEvent*>(j);
+
+            try
+            {
+                if (ev->m_query == Query::kIntersection)
+                    ev->m_device->IntersectRays(ev->m_rays, ev->m_numrays, ev->m_hits);
+                else if (ev->m_query == Query::kOcclusion)
+                    ev->m_device->OccludeRays(ev->m_rays, ev->m_numrays, ev->m_hits);
+            }
+            catch (...)
+            {
+                ev->m_error = std::current_exception();
+            }
+
+            ev->Signal();
+        }
+
+        static void Discard(thread_pool<void>::job* j)
+        {
+            static_cast<CpuEvent*>(j)->Signal();
+        }
+
+        void Signal()
+        {
+            CompletionFunc callback = nullptr;
+            void* userdata = nullptr;
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_complete = true;
+                std::swap(callback, m_callback);
+                std::swap(userdata, m_callback_data);
+                m_cv.notify_all();
+            }
+
+            // The event might be reused by now, only the copies are touched
+            if (callback)
+            {
+                callback(userdata);
+            }
+        }
+
+        std::atomic<bool> m_complete;
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+
+        Query m_query;
+        CpuIntersectionDevice const* m_device;
+        Buffer const* m_rays;
+        Buffer* m_hits;
+        int m_numrays;
+        std::exception_ptr m_error;
+        // Continuation set while the query is pending
+        CompletionFunc m_callback;
+        void* m_callback_data;
+    };
+
+    namespace
+    {
+        // Queries read their input once the event they are chained to is complete
+        void WaitForEvent(Event const* waitevent)
+        {
+            if (waitevent)
+                static_cast<CpuEvent*>(const_cast<Event*>(waitevent))->WaitForCompletion();
+        }
+
+        template <typename T> T* GetData(Buffer* buffer)
+        {
+            return static_cast<T*>(static_cast<CpuBuffer*>(buffer)->GetData());
+        }
+
+        template <typename T> T const* GetData(Buffer const* buffer)
+        {
+            return static_cast<T const*>(static_cast<CpuBuffer const*>(buffer)->GetData());
+        }
+    }
+
+    CpuIntersectionDevice::CpuIntersectionDevice()
+        : m_stats()
+        , m_bvh_settings_version(0)
+        , m_pool(GetNumQueryThreads(), GetNumQueryNodes(), PinThreadToNode)
+    {
+        // Initialize event pool
+        for (std::size_t i = 0; i < EVENT_POOL_INITIAL_SIZE; ++i)
+        {
+            m_event_pool.push_back(new CpuEvent());
+        }
+    }
+
+    CpuIntersectionDevice::~CpuIntersectionDevice()
+    {
+        for (auto event : m_event_pool)
+        {
+            delete event;
+        }
+    }
+
+    void CpuIntersectionDevice::Preprocess(World const& world)
+    {
+        // Queries write one int per ray and full hit records
+        auto compact = world.options_.GetOption("acc.occlusion.compact");
+        ThrowIf(compact && compact->AsFloat() > 0.f, "CPU device does not support compact occlusion output.");
+        auto hitformat = world.options_.GetOption("acc.hit.format");
+        ThrowIf(hitformat && hitformat->AsString() == "compact", "CPU device does not support compact hit records.");
+        auto rayformat = world.options_.GetOption("acc.ray.format");
+        ThrowIf(rayformat && rayformat->AsString() == "compact", "CPU device does not support compact ray records.");
+
+        auto const& settings = world.options_.GetBvhSettings();
+
+        // The scene is flattened into a single tree, so any change requires a rebuild
+        if (m_bvh && !world.has_changed() && settings.version == m_bvh_settings_version &&
+            world.GetStateChange() == ShapeImpl::kStateChangeNone)
+        {
+            return;
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+
+        m_bvh.reset();
+        m_nodes.clear();
+        m_vertices.clear();
+        m_faces.clear();
+        m_stats = AccelStats();
+
+        if (world.shapes_.empty())
+            return;
+
+        // Partition the array into meshes and instances
+        std::vector<Shape const*> shapes(world.shapes_);
+
+        auto firstinst = std::partition(shapes.begin(), shapes.end(),
+            [&](Shape const* shape)
+        {
+            return !static_cast<ShapeImpl const*>(shape)->is_instance();
+        });
+
+        int nummeshes = (int)std::distance(shapes.begin(), firstinst);
+        int numshapes = (int)shapes.size();
+
+        // Base meshes and transforms of the shapes, instances use their own transform for the base mesh
+        std::vector<Mesh const*> meshes(numshapes);
+        std::vector<matrix> transforms(numshapes);
+        // Mesh start indices in the flattened arrays as mesh face indices are relative to 0
+        std::vector<int> mesh_vertices_start_idx(numshapes);
+        std::vector<int> mesh_faces_start_idx(numshapes);
+
+        int numvertices = 0;
+        int numfaces = 0;
+
+        for (int i = 0; i < numshapes; ++i)
+        {
+            matrix minv;
+
+            auto geometry = static_cast<ShapeImpl const*>(i < nummeshes ? shapes[i] : static_cast<Instance const*>(shapes[i])->GetBaseShape());
+            ThrowIf(geometry->is_spheres() || geometry->is_group() || geometry->is_device_mesh() || geometry->is_instance(),
+                "CPU device only supports meshes and instances of meshes.");
+
+            if (i < nummeshes)
+            {
+                meshes[i] = static_cast<Mesh const*>(shapes[i]);
+                meshes[i]->GetTransform(transforms[i], minv);
+            }
+            else
+            {
+                Instance const* instance = static_cast<Instance const*>(shapes[i]);
+                meshes[i] = static_cast<Mesh const*>(instance->GetBaseShape());
+                instance->GetTransform(transforms[i], minv);
+            }
+
+            ThrowIf(!meshes[i]->puretriangle(), "Only triangle meshes supported by now.");
+
+            mesh_faces_start_idx[i] = numfaces;
+            mesh_vertices_start_idx[i] = numvertices;
+
+            numfaces += meshes[i]->num_faces();
+            numvertices += meshes[i]->num_vertices();
+        }
+
+        // World space bounds of all the faces, the same tree as the bvh4 GPU accelerator is built
+        // Face bounds are kept across commits, so they are allocated only when the scene grows
+        host_vector<bbox>& bounds = m_scratch.bounds;
+        bounds.resize(numfaces);
+        for (int i = 0; i < numshapes; ++i)
+        {
+            meshes[i]->ComputeAllFaceBounds(transforms[i], &bounds[mesh_faces_start_idx[i]]);
+        }
+
+        m_bvh.reset(settings.use_splits ?
+            new SplitBvh(settings.traversal_cost, settings.num_bins, settings.max_split_depth, settings.min_overlap, settings.extra_node_budget) :
+            settings.use_lbvh ? new LinearBvh(settings.traversal_cost, settings.num_bins) :
+            new Bvh(settings.traversal_cost, settings.num_bins, settings.use_sah)
+        );
+
+        // Centroids and indices are reused across commits, the monitor of the commit can cancel the build
+        m_bvh->SetScratch(&m_scratch);
+        m_bvh->SetMonitor(world.monitor_.get());
+
+        // Large faces are split into several references clipped to them, spatial splits do that during the build
+        if (settings.presplit_budget > 0.f && !settings.use_splits)
+        {
+            std::vector<bbox> refbounds;
+            std::vector<int> refprims;
+            PresplitFaces(shapes, mesh_faces_start_idx, &bounds[0], numfaces, settings.presplit_budget, refbounds, refprims);
+            m_bvh->Build(refbounds.data(), (int)refbounds.size(), refprims.data(), numfaces);
+        }
+        else
+        {
+            m_bvh->Build(&bounds[0], numfaces);
+        }
+        m_bvh->GetStats(m_stats);
+
+        WideBvhTranslator translator;
+        translator.Process(*m_bvh);
+
+        if ((WideBvhTranslator::kWidth - 1) * translator.GetDepth() >= kMaxStackSize)
+        {
+            m_bvh.reset();
+            Throw("CPU device traversal stack can overflow for this scene.");
+        }
+
+        m_nodes = std::move(translator.nodes_);
+
+        // World space vertices
+        m_vertices.resize(numvertices);
+        m_pool.parallel_for(0, numshapes, 1, [&](int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                float3* dst = &m_vertices[mesh_vertices_start_idx[i]];
+
+                for (int j = 0; j < meshes[i]->num_vertices(); ++j)
+                {
+                    dst[j] = transform_point(meshes[i]->GetVertex(j), transforms[i]);
+                }
+            }
+        });
+
+        // Faces permuted in the leaf order, this number is different from the number of faces for some BVHs
+        int numindices = static_cast<int>(m_bvh->GetNumIndices());
+        int const* reordering = m_bvh->GetIndices();
+        m_faces.resize(numindices);
+
+        m_pool.parallel_for(0, numindices, TASK_SIZE, [&](int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                int indextolook4 = reordering[i];
+
+                // Find the shape the face belongs to
+                auto iter = std::upper_bound(mesh_faces_start_idx.cbegin(), mesh_faces_start_idx.cend(), indextolook4);
+                int shapeidx = static_cast<int>(std::distance(mesh_faces_start_idx.cbegin(), iter) - 1);
+
+                int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
+                Mesh::Face const face = meshes[shapeidx]->GetFace(faceidx);
+                int mystartidx = mesh_vertices_start_idx[shapeidx];
+
+                m_faces[i].idx[0] = face.idx[0] + mystartidx;
+                m_faces[i].idx[1] = face.idx[1] + mystartidx;
+                m_faces[i].idx[2] = face.idx[2] + mystartidx;
+                m_faces[i].shape_mask = shapes[shapeidx]->GetMask();
+                m_faces[i].shape_id = shapes[shapeidx]->GetId();
+                m_faces[i].prim_id = faceidx;
+            }
+        });
+
+        m_bvh_settings_version = settings.version;
+
+        m_stats.node_memory = m_nodes.size() * sizeof(WideBvhTranslator::Node);
+        m_stats.vertex_memory = m_vertices.size() * sizeof(float3);
+        m_stats.face_memory = m_faces.size() * sizeof(Face);
+        m_stats.other_memory = 0;
+        m_stats.commit_time = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+
+    void CpuIntersectionDevice::GetStats(AccelStats& stats) const
+    {
+        stats = m_stats;
+    }
+
+    bool CpuIntersectionDevice::IntersectRay(ray const& r, Intersection& hit) const
+    {
+        if (m_nodes.empty())
+            return false;
+
+        TraversalRay tr;
+        InitTraversalRay(r, tr);
+
+        float t_max = r.GetMaxT();
+        float u = 0.f;
+        float v = 0.f;
+        int isect_idx = -1;
+
+        // Postponed children along with their entry distances
+        int stack[kMaxStackSize];
+        float stack_t[kMaxStackSize];
+        int sp = 0;
+
+        int addr = 0;
+
+        while (addr != WideBvhTranslator::kInvalidChild)
+        {
+            WideBvhTranslator::Node const& node = m_nodes[addr];
+
+            alignas(16) float dist[WideBvhTranslator::kWidth];
+            int mask = IntersectChildren(node, tr, t_max, dist);
+
+            // Internal children to traverse sorted by entry distance
+            int sorted_addr[WideBvhTranslator::kWidth];
+            float sorted_dist[WideBvhTranslator::kWidth];
+            int num_sorted = 0;
+
+            for (int i = 0; mask; ++i, mask >>= 1)
+            {
+                if (!(mask & 1))
+                    continue;
+
+                int const child = node.child[i];
+
+                if (IsLeaf(child))
+                {
+                    int const face_idx = GetStartIdx(child);
+                    Face const& face = m_faces[face_idx];
+
+                    float t;
+                    if (IntersectTriangle(tr, m_vertices[face.idx[0]], m_vertices[face.idx[1]], m_vertices[face.idx[2]], t_max, t, u, v))
+                    {
+                        t_max = t;
+                        isect_idx = face_idx;
+                        hit.uvwt = float4(u, v, 0.f, t);
+                    }
+                }
+                else
+                {
+                    // Insertion sort, there are at most 4 entries
+                    int j = num_sorted++;
+                    while (j > 0 && sorted_dist[j - 1] > dist[i])
+                    {
+                        sorted_dist[j] = sorted_dist[j - 1];
+                        sorted_addr[j] = sorted_addr[j - 1];
+                        --j;
+                    }
+
+                    sorted_dist[j] = dist[i];
+                    sorted_addr[j] = child;
+                }
+            }
+
+            if (num_sorted > 0)
+            {
+                // Postpone farther children, the farthest one goes first
+                for (int i = num_sorted - 1; i > 0; --i)
+                {
+                    stack[sp] = sorted_addr[i];
+                    stack_t[sp] = sorted_dist[i];
+                    ++sp;
+                }
+
+                // Continue traversal with the closest child
+                addr = sorted_addr[0];
+                continue;
+            }
+
+            // Skip postponed children which are farther than the closest hit found since
+            addr = WideBvhTranslator::kInvalidChild;
+            while (sp > 0)
+            {
+                --sp;
+                if (stack_t[sp] <= t_max)
+                {
+                    addr = stack[sp];
+                    break;
+                }
+            }
+        }
+
+        if (isect_idx == -1)
+            return false;
+
+        hit.shapeid = m_faces[isect_idx].shape_id;
+        hit.primid = m_faces[isect_idx].prim_id;
+        return true;
+    }
+
+    bool CpuIntersectionDevice::OccludeRay(ray const& r) const
+    {
+        if (m_nodes.empty())
+            return false;
+
+        TraversalRay tr;
+        InitTraversalRay(r, tr);
+
+        float const t_max = r.GetMaxT();
+
+        int stack[kMaxStackSize];
+        int sp = 0;
+
+        int addr = 0;
+
+        while (addr != WideBvhTranslator::kInvalidChild)
+        {
+            WideBvhTranslator::Node const& node = m_nodes[addr];
+
+            alignas(16) float dist[WideBvhTranslator::kWidth];
+            int mask = IntersectChildren(node, tr, t_max, dist);
+
+            addr = WideBvhTranslator::kInvalidChild;
+
+            // Children slots are sorted by the translator (leaves first, then larger boxes),
+            // so they are visited in slot order without any distance sorting
+            for (int i = 0; mask; ++i, mask >>= 1)
+            {
+                if (!(mask & 1))
+                    continue;
+
+                int const child = node.child[i];
+
+                if (IsLeaf(child))
+                {
+                    Face const& face = m_faces[GetStartIdx(child)];
+
+                    float t, u, v;
+                    if (IntersectTriangle(tr, m_vertices[face.idx[0]], m_vertices[face.idx[1]], m_vertices[face.idx[2]], t_max, t, u, v))
+                    {
+                        return true;
+                    }
+                }
+                else if (addr == WideBvhTranslator::kInvalidChild)
+                {
+                    // Traverse the most likely occluder first
+                    addr = child;
+                }
+                else
+                {
+                    stack[sp++] = child;
+                }
+            }
+
+            if (addr == WideBvhTranslator::kInvalidChild && sp > 0)
+            {
+                addr = stack[--sp];
+            }
+        }
+
+        return false;
+    }
+
+    bool CpuIntersectionDevice::FindClosestPoint(float3 const& p, float max_dist, ClosestPoint& result) const
+    {
+        if (m_nodes.empty())
+            return false;
+
+        // Squared distance to the closest point so far
+        float d2_max = max_dist * max_dist;
+        int closest_idx = -1;
+
+        // Postponed children along with their squared distances
+        int stack[kMaxStackSize];
+        float stack_d2[kMaxStackSize];
+        int sp = 0;
+
+        int addr = 0;
+
+        while (addr != WideBvhTranslator::kInvalidChild)
+        {
+            WideBvhTranslator::Node const& node = m_nodes[addr];
+
+            alignas(16) float dist[WideBvhTranslator::kWidth];
+            DistanceToChildren(node, p, dist);
+
+            // Internal children to traverse sorted by distance
+            int sorted_addr[WideBvhTranslator::kWidth];
+            float sorted_dist[WideBvhTranslator::kWidth];
+            int num_sorted = 0;
+
+            for (int i = 0; i < node.numchildren; ++i)
+            {
+                if (dist[i] > d2_max)
+                    continue;
+
+                int const child = node.child[i];
+
+                if (IsLeaf(child))
+                {
+                    int const face_idx = GetStartIdx(child);
+                    Face const& face = m_faces[face_idx];
+
+                    float u, v;
+                    float3 const q = ClosestPointOnTriangle(p, m_vertices[face.idx[0]], m_vertices[face.idx[1]], m_vertices[face.idx[2]], u, v);
+                    float const d2 = (q - p).sqnorm();
+
+                    if (d2 <= d2_max)
+                    {
+                        d2_max = d2;
+                        closest_idx = face_idx;
+                        result.uvwt = float4(u, v, 0.f, 0.f);
+                        result.p = q;
+                    }
+                }
+                else
+                {
+                    // Insertion sort, there are at most 4 entries
+                    int j = num_sorted++;
+                    while (j > 0 && sorted_dist[j - 1] > dist[i])
+                    {
+                        sorted_dist[j] = sorted_dist[j - 1];
+                        sorted_addr[j] = sorted_addr[j - 1];
+                        --j;
+                    }
+
+                    sorted_dist[j] = dist[i];
+                    sorted_addr[j] = child;
+                }
+            }
+
+            if (num_sorted > 0)
+            {
+                // Postpone farther children, the farthest one goes first
+                for (int i = num_sorted - 1; i > 0; --i)
+                {
+                    stack[sp] = sorted_addr[i];
+                    stack_d2[sp] = sorted_dist[i];
+                    ++sp;
+                }
+
+                // Continue traversal with the closest child
+                addr = sorted_addr[0];
+                continue;
+            }
+
+            // Skip postponed children which are farther than the closest point found since
+            addr = WideBvhTranslator::kInvalidChild;
+            while (sp > 0)
+            {
+                --sp;
+                if (stack_d2[sp] <= d2_max)
+                {
+                    addr = stack[sp];
+                    break;
+                }
+            }
+        }
+
+        if (closest_idx == -1)
+            return false;
+
+        result.shapeid = m_faces[closest_idx].shape_id;
+        result.primid = m_faces[closest_idx].prim_id;
+        result.uvwt.w = std::sqrt(d2_max);
+        result.p.w = 0.f;
+        return true;
+    }
+
+    bool CpuIntersectionDevice::IsListed(Face const& face, float t, float const* hit_t, int const* hit_idx, int k) const
+    {
+        // Spatial splits reference a face from several leaves, its copies are hit at the same distance
+        for (int i = 0; i < k && hit_t[i] <= t; ++i)
+        {
+            if (hit_idx[i] != -1 && hit_t[i] == t &&
+                m_faces[hit_idx[i]].shape_id == face.shape_id && m_faces[hit_idx[i]].prim_id == face.prim_id)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void CpuIntersectionDevice::IntersectRayMulti(ray const& r, int k, Intersection* hits) const
+    {
+        float hit_t[kMaxMultiHits];
+        float hit_u[kMaxMultiHits];
+        float hit_v[kMaxMultiHits];
+        int hit_idx[kMaxMultiHits];
+
+        for (int i = 0; i < k; ++i)
+        {
+            hit_t[i] = r.GetMaxT();
+            hit_idx[i] = -1;
+        }
+
+        if (!m_nodes.empty())
+        {
+            TraversalRay tr;
+            InitTraversalRay(r, tr);
+
+            // Culling distance, distance of the k-th closest hit found so far
+            float cull_t = r.GetMaxT();
+
+            int stack[kMaxStackSize];
+            float stack_t[kMaxStackSize];
+            int sp = 0;
+
+            int addr = 0;
+
+            while (addr != WideBvhTranslator::kInvalidChild)
+            {
+                WideBvhTranslator::Node const& node = m_nodes[addr];
+
+                alignas(16) float dist[WideBvhTranslator::kWidth];
+                int mask = IntersectChildren(node, tr, cull_t, dist);
+
+                int sorted_addr[WideBvhTranslator::kWidth];
+                float sorted_dist[WideBvhTranslator::kWidth];
+                int num_sorted = 0;
+
+                for (int i = 0; mask; ++i, mask >>= 1)
+                {
+                    if (!(mask & 1))
+                        continue;
+
+                    int const child = node.child[i];
+
+                    if (IsLeaf(child))
+                    {
+                        int face_idx = GetStartIdx(child);
+                        Face const& face = m_faces[face_idx];
+
+                        float t, u, v;
+                        if (IntersectTriangle(tr, m_vertices[face.idx[0]], m_vertices[face.idx[1]], m_vertices[face.idx[2]], cull_t, t, u, v) &&
+                            !IsListed(face, t, hit_t, hit_idx, k))
+                        {
+                            // Insert into the sorted list, the last entry drops out
+                            for (int j = 0; j < k; ++j)
+                            {
+                                if (t < hit_t[j])
+                                {
+                                    std::swap(t, hit_t[j]);
+                                    std::swap(u, hit_u[j]);
+                                    std::swap(v, hit_v[j]);
+                                    std::swap(face_idx, hit_idx[j]);
+                                }
+                            }
+
+                            cull_t = hit_t[k - 1];
+                        }
+                    }
+                    else
+                    {
+                        int j = num_sorted++;
+                        while (j > 0 && sorted_dist[j - 1] > dist[i])
+                        {
+                            sorted_dist[j] = sorted_dist[j - 1];
+                            sorted_addr[j] = sorted_addr[j - 1];
+                            --j;
+                        }
+
+                        sorted_dist[j] = dist[i];
+                        sorted_addr[j] = child;
+                    }
+                }
+
+                if (num_sorted > 0)
+                {
+                    for (int i = num_sorted - 1; i > 0; --i)
+                    {
+                        stack[sp] = sorted_addr[i];
+                        stack_t[sp] = sorted_dist[i];
+                        ++sp;
+                    }
+
+                    addr = sorted_addr[0];
+                    continue;
+                }
+
+                addr = WideBvhTranslator::kInvalidChild;
+                while (sp > 0)
+                {
+                    --sp;
+                    if (stack_t[sp] <= cull_t)
+                    {
+                        addr = stack[sp];
+                        break;
+                    }
+                }
+            }
+        }
+
+        // Write the list, unused entries are misses
+        for (int i = 0; i < k; ++i)
+        {
+            if (hit_idx[i] != -1)
+            {
+                hits[i].shapeid = m_faces[hit_idx[i]].shape_id;
+                hits[i].primid = m_faces[hit_idx[i]].prim_id;
+                hits[i].uvwt = float4(hit_u[i], hit_v[i], 0.f, hit_t[i]);
+            }
+            else
+            {
+                SetMiss(hits[i]);
+            }
+        }
+    }
+
+    Buffer* CpuIntersectionDevice::CreateBuffer(size_t size, void* initdata) const
+    {
+        return new CpuBuffer(size, initdata);
+    }
+
+    Buffer* CpuIntersectionDevice::CreateBufferFromHostPtr(void* ptr, size_t size) const
+    {
+        ThrowIf(!ptr && size > 0, "Invalid host pointer.");
+        return new CpuBuffer(ptr);
+    }
+
+    void CpuIntersectionDevice::DeleteBuffer(Buffer* const buffer) const
+    {
+        delete buffer;
+    }
+
+    void CpuIntersectionDevice::DeleteEvent(Event* const event) const
+    {
+        CpuEvent* ev = static_cast<CpuEvent*>(event);
+        ev->WaitForCompletion();
+
+        std::lock_guard<std::mutex> lock(m_event_pool_mutex);
+        m_event_pool.push_back(ev);
+    }
+
+    void CpuIntersectionDevice::JoinEvents(Event const* const* events, int count, Event** event) const
+    {
+        // Queries wait for their input on the host anyway
+        for (int i = 0; i < count; ++i)
+        {
+            WaitForEvent(events[i]);
+        }
+
+        SetEvent(event);
+    }
+
+    CpuEvent* CpuIntersectionDevice::CreateEvent() const
+    {
+        std::lock_guard<std::mutex> lock(m_event_pool_mutex);
+
+        if (m_event_pool.empty())
+        {
+            return new CpuEvent();
+        }
+
+        auto event = m_event_pool.back();
+        m_event_pool.pop_back();
+        return event;
+    }
+
+    void CpuIntersectionDevice::SetEvent(Event** event) const
+    {
+        if (event)
+        {
+            *event = CreateEvent();
+        }
+    }
+
+    int CpuIntersectionDevice::GetTaskSize(int numrays) const
+    {
+        // A few subranges per thread balance the load, the minimum amortizes scheduling.
+        // Subranges are multiples of 32 rays, so packed occlusion words are never shared.
+        int num_tasks = static_cast<int>(m_pool.num_threads()) * 4;
+        int task_size = (numrays + num_tasks - 1) / num_tasks;
+        task_size = (task_size + 31) & ~31;
+        return std::max(task_size, TASK_SIZE);
+    }
+
+    int CpuIntersectionDevice::GetNumRays(Buffer const* numrays, int maxrays) const
+    {
+        ThrowIf(!numrays, "Invalid ray count buffer.");
+        return std::min(*GetData<int>(numrays), maxrays);
+    }
+
+    void CpuIntersectionDevice::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const
+    {
+        if (data)
+        {
+            CpuBuffer* buf = dynamic_cast<CpuBuffer*>(buffer);
+            ThrowIf(!buf, "Invalid CPU buffer.");
+            *data = static_cast<char*>(buf->GetData()) + offset;
+        }
+
+        SetEvent(event);
+    }
+
+    void CpuIntersectionDevice::UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const
+    {
+        SetEvent(event);
+    }
+
+    void CpuIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        ThrowIf(!dynamic_cast<const CpuBuffer*>(rays) || !dynamic_cast<CpuBuffer*>(hits), "Invalid CPU buffer.");
+        WaitForEvent(waitevent);
+
+        if (event)
+        {
+            CpuEvent* ev = CreateEvent();
+            ev->SetQuery(CpuEvent::Query::kIntersection, this, rays, numrays, hits);
+            m_pool.submit(ev);
+            *event = ev;
+        }
+        else
+        {
+            IntersectRays(rays, numrays, hits);
+        }
+    }
+
+    void CpuIntersectionDevice::IntersectRays(Buffer const* rays, int numrays, Buffer* hits) const
+    {
+        ray const* src = GetData<ray>(rays);
+        Intersection* dst = GetData<Intersection>(hits);
+
+        m_pool.parallel_for(0, numrays, GetTaskSize(numrays), [this, src, dst](int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                // Inactive rays are left untouched
+                if (!src[i].IsActive())
+                    continue;
+
+                if (!IntersectRay(src[i], dst[i]))
+                    SetMiss(dst[i]);
+            }
+        });
+    }
+
+    void CpuIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        ThrowIf(!dynamic_cast<const CpuBuffer*>(rays) || !dynamic_cast<CpuBuffer*>(hits), "Invalid CPU buffer.");
+        WaitForEvent(waitevent);
+
+        if (event)
+        {
+            CpuEvent* ev = CreateEvent();
+            ev->SetQuery(CpuEvent::Query::kOcclusion, this, rays, numrays, hits);
+            m_pool.submit(ev);
+            *event = ev;
+        }
+        else
+        {
+            OccludeRays(rays, numrays, hits);
+        }
+    }
+
+    void CpuIntersectionDevice::OccludeRays(Buffer const* rays, int numrays, Buffer* hits) const
+    {
+        ray const* src = GetData<ray>(rays);
+        int* dst = GetData<int>(hits);
+
+        m_pool.parallel_for(0, numrays, GetTaskSize(numrays), [this, src, dst](int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                if (!src[i].IsActive())
+                    continue;
+
+                dst[i] = OccludeRay(src[i]) ? kHitMarker : kMissMarker;
+            }
+        });
+    }
+
+    void CpuIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        WaitForEvent(waitevent);
+        QueryIntersection(rays, GetNumRays(numrays, maxrays), hits, nullptr, event);
+    }
+
+    void CpuIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        WaitForEvent(waitevent);
+        QueryOcclusion(rays, GetNumRays(numrays, maxrays), hits, nullptr, event);
+    }
+
+    void CpuIntersectionDevice::QueryOcclusionPacked(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        WaitForEvent(waitevent);
+
+        ray const* src = GetData<ray>(rays);
+        std::uint32_t* dst = GetData<std::uint32_t>(hits);
+
+        // Subranges start at multiples of 32 rays, so each word is written by a single task
+        m_pool.parallel_for(0, numrays, GetTaskSize(numrays), [this, src, dst, numrays](int begin, int end)
+        {
+            for (int w = begin; w < end; w += 32)
+            {
+                std::uint32_t word = 0;
+
+                for (int i = w; i < std::min(w + 32, numrays); ++i)
+                {
+                    if (src[i].IsActive() && OccludeRay(src[i]))
+                        word |= 1u << (i - w);
+                }
+
+                dst[w >> 5] = word;
+            }
+        });
+
+        SetEvent(event);
+    }
+
+    void CpuIntersectionDevice::QueryOcclusionPacked(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        WaitForEvent(waitevent);
+        QueryOcclusionPacked(rays, GetNumRays(numrays, maxrays), hits, nullptr, event);
+    }
+
+    void CpuIntersectionDevice::QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        ThrowIf(k < 1 || k > kMaxMultiHits, "Number of hits per ray is out of range");
+        WaitForEvent(waitevent);
+
+        ray const* src = GetData<ray>(rays);
+        Intersection* dst = GetData<Intersection>(hits);
+
+        m_pool.parallel_for(0, numrays, GetTaskSize(numrays), [this, src, dst, k](int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                if (src[i].IsActive())
+                    IntersectRayMulti(src[i], k, dst + i * k);
+            }
+        });
+
+        SetEvent(event);
+    }
+
+    void CpuIntersectionDevice::QueryIntersectionMulti(Buffer const* rays, Buffer const* numrays, int maxrays, int k, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        WaitForEvent(waitevent);
+        QueryIntersectionMulti(rays, GetNumRays(numrays, maxrays), k, hits, nullptr, event);
+    }
+
+    void CpuIntersectionDevice::QueryIntersectionAttributes(Buffer const* rays, int numrays, int numattributes, Buffer* hits, Buffer* attributes, Event const* waitevent, Event** event) const
+    {
+        Throw("Attribute queries are not supported by CPU device.");
+    }
+
+    void CpuIntersectionDevice::QueryOcclusionCached(Buffer const* rays, int numrays, Buffer* occluders, Buffer* hitresults, Event const* waitevent, Event** event) const
+    {
+        Throw("Occluder caching is not supported by CPU device.");
+    }
+
+    void CpuIntersectionDevice::QueryOverlap(Buffer const* boxes, int count, int maxoverlaps, Buffer* overlaps, Buffer* counts, Event const* waitevent, Event** event) const
+    {
+        Throw("Overlap queries are not supported by CPU device.");
+    }
+
+    void CpuIntersectionDevice::QueryClosestPoint(Buffer const* points, int count, float maxdist, Buffer* results, Event const* waitevent, Event** event) const
+    {
+        ThrowIf(!(maxdist >= 0.f), "Closest point distance is out of range");
+        WaitForEvent(waitevent);
+
+        float3 const* src = GetData<float3>(points);
+        ClosestPoint* dst = GetData<ClosestPoint>(results);
+
+        m_pool.parallel_for(0, count, GetTaskSize(count), [this, src, dst, maxdist](int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                if (!FindClosestPoint(src[i], maxdist, dst[i]))
+                {
+                    dst[i].shapeid = kNullId;
+                    dst[i].primid = kNullId;
+                    dst[i].uvwt = float4(0.f, 0.f, 0.f, maxdist);
+                    dst[i].p = float4(src[i].x, src[i].y, src[i].z, 0.f);
+                }
+            }
+        });
+
+        SetEvent(event);
+    }
+
+    void CpuIntersectionDevice::QueryIntersection2D(Buffer const* rays, int width, int height, RayOrder order, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        // Rays are traversed in scanline order, the hits are the same
+        QueryIntersection(rays, width * height, hits, waitevent, event);
+    }
+
+    void CpuIntersectionDevice::QueryPrimaryPinhole(PinholeCamera const& camera, int width, int height, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        WaitForEvent(waitevent);
+
+        Intersection* dst = GetData<Intersection>(hits);
+        int const numrays = width * height;
+
+        // Same rays as generated by the pinhole kernel, traced without storing them
+        m_pool.parallel_for(0, numrays, GetTaskSize(numrays), [this, &camera, dst, width, height](int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                float const sx = 2.f * ((i % width) + 0.5f) / width - 1.f;
+                float const sy = 2.f * ((i / width) + 0.5f) / height - 1.f;
+
+                float3 const d = normalize(float3(
+                    camera.forward.x + sx * camera.right.x + sy * camera.up.x,
+                    camera.forward.y + sx * camera.right.y + sy * camera.up.y,
+                    camera.forward.z + sx * camera.right.z + sy * camera.up.z));
+
+                ray r(float3(camera.position.x, camera.position.y, camera.position.z), d, camera.position.w);
+
+                if (!IntersectRay(r, dst[i]))
+                    SetMiss(dst[i]);
+            }
+        });
+
+        SetEvent(event);
+    }
+
+    void CpuIntersectionDevice::QueryShadowFromHits(Buffer const* rays, Buffer const* hits, int numrays, float3 const& light, float epsilon, Buffer* results, Event const* waitevent, Event** event) const
+    {
+        WaitForEvent(waitevent);
+
+        ray const* src = GetData<ray>(rays);
+        Intersection const* isect = GetData<Intersection>(hits);
+        int* dst = GetData<int>(results);
+
+        // Same rays as generated by the shadow kernel, rays which missed
+        // or were inactive are reported as not occluded
+        m_pool.parallel_for(0, numrays, GetTaskSize(numrays), [this, src, isect, dst, light, epsilon](int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                ray const& r = src[i];
+
+                if (!r.IsActive() || isect[i].shapeid == kNullId)
+                {
+                    dst[i] = kMissMarker;
+                    continue;
+                }
+
+                float3 const p = float3(r.o.x, r.o.y, r.o.z) + isect[i].uvwt.w * float3(r.d.x, r.d.y, r.d.z);
+                float3 const to_light = float3(light.x, light.y, light.z) - p;
+                float const dist = std::sqrt(to_light.sqnorm());
+                float3 const d = to_light * (1.f / std::max(dist, 1e-8f));
+
+                ray s(p + epsilon * d, d, std::max(dist - 2.f * epsilon, 0.f), r.GetTime());
+                s.SetMask(r.GetMask());
+
+                dst[i] = OccludeRay(s) ? kHitMarker : kMissMarker;
+            }
+        });
+
+        SetEvent(event);
+    }
+
+    void CpuIntersectionDevice::CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* compacted, Buffer* newnumrays, Buffer* indices, Event const* waitevent, Event** event) const
+    {
+        WaitForEvent(waitevent);
+
+        ray const* src = GetData<ray>(rays);
+        int const* keep = predicate ? GetData<int>(predicate) : nullptr;
+        ray* dst = GetData<ray>(compacted);
+        int* srcidx = indices ? GetData<int>(indices) : nullptr;
+
+        int const count = GetNumRays(numrays, maxrays);
+        int num_kept = 0;
+
+        // Memory bound, so a single pass on the calling thread keeps the order for free
+        for (int i = 0; i < count; ++i)
+        {
+            if (keep ? keep[i] != 0 : src[i].IsActive())
+            {
+                dst[num_kept] = src[i];
+                if (srcidx)
+                    srcidx[num_kept] = i;
+                ++num_kept;
+            }
+        }
+
+        *GetData<int>(newnumrays) = num_kept;
+
+        SetEvent(event);
+    }
+
+    void CpuIntersectionDevice::SortHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer* indices, Buffer* numhits, Event const* waitevent, Event** event) const
+    {
+        WaitForEvent(waitevent);
+
+        Intersection const* src = GetData<Intersection>(hits);
+        int* dst = GetData<int>(indices);
+
+        int const count = GetNumRays(numrays, maxrays);
+
+        // Hits in increasing shape order keeping the ray order of a shape, misses after them
+        for (int i = 0; i < count; ++i)
+        {
+            dst[i] = i;
+        }
+
+        int* const misses = std::stable_partition(dst, dst + count, [src](int i) { return src[i].shapeid != kNullId; });
+        std::stable_sort(dst, misses, [src](int a, int b) { return src[a].shapeid < src[b].shapeid; });
+
+        if (numhits)
+        {
+            *GetData<int>(numhits) = static_cast<int>(misses - dst);
+        }
+
+        SetEvent(event);
+    }
+}
@@ -0,0 +1,134 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "intersection_device.h"
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "../async/thread_pool.h"
+#include "../translator/wide_bvh_translator.h"
+#include "../util/build_scratch.h"
+
+namespace RadeonRays
+{
+    class Bvh;
+    class CpuEvent;
+    ///< The class represents built-in CPU intersection device.
+    ///< It traverses the same 4-wide BVH layout as the bvh4 GPU kernels
+    ///< with SIMD box tests, rays are distributed across the thread pool.
+    ///<
+    class CpuIntersectionDevice : public IntersectionDevice
+    {
+    public:
+        //
+        CpuIntersectionDevice();
+        ~CpuIntersectionDevice();
+
+        //IntersectionDevice
+        void Preprocess(World const& world) override;
+        void GetStats(AccelStats& stats) const override;
+        Buffer* CreateBuffer(size_t size, void* initdata) const override;
+        Buffer* CreateBufferFromHostPtr(void* ptr, size_t size) const override;
+        void DeleteBuffer(Buffer* const) const override;
+        void DeleteEvent(Event* const) const override;
+        void JoinEvents(Event const* const* events, int count, Event** event) const override;
+        void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const override;
+        void UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const override;
+        void QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryOcclusionPacked(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryOcclusionPacked(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryIntersectionMulti(Buffer const* rays, Buffer const* numrays, int maxrays, int k, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryIntersectionAttributes(Buffer const* rays, int numrays, int numattributes, Buffer* hits, Buffer* attributes, Event const* waitevent, Event** event) const override;
+        void QueryOcclusionCached(Buffer const* rays, int numrays, Buffer* occluders, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryOverlap(Buffer const* boxes, int count, int maxoverlaps, Buffer* overlaps, Buffer* counts, Event const* waitevent, Event** event) const override;
+        void QueryClosestPoint(Buffer const* points, int count, float maxdist, Buffer* results, Event const* waitevent, Event** event) const override;
+        void QueryIntersection2D(Buffer const* rays, int width, int height, RayOrder order, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryPrimaryPinhole(PinholeCamera const& camera, int width, int height, Buffer* hits, Event const* waitevent, Event** event) const override;
+        void QueryShadowFromHits(Buffer const* rays, Buffer const* hits, int numrays, float3 const& light, float epsilon, Buffer* results, Event const* waitevent, Event** event) const override;
+        void CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* compacted, Buffer* newnumrays, Buffer* indices, Event const* waitevent, Event** event) const override;
+        void SortHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer* indices, Buffer* numhits, Event const* waitevent, Event** event) const override;
+
+    protected:
+        // Triangle in the BVH leaf order, matches Face of the bvh4 kernels
+        struct Face
+        {
+            // Indices into m_vertices
+            int idx[3];
+            int shape_mask;
+            int shape_id;
+            int prim_id;
+        };
+
+        // Single ray traversal, return false if there is no hit
+        bool IntersectRay(ray const& r, Intersection& hit) const;
+        bool OccludeRay(ray const& r) const;
+        // Write k closest hits of the ray sorted by distance
+        void IntersectRayMulti(ray const& r, int k, Intersection* hits) const;
+        // Find the closest surface point within max_dist, return false if there is none
+        bool FindClosestPoint(float3 const& p, float max_dist, ClosestPoint& result) const;
+        // Check if the face hit at distance t is already in the sorted list of k hits
+        bool IsListed(Face const& face, float t, float const* hit_t, int const* hit_idx, int k) const;
+
+        // Trace all the rays on the calling thread and the pool
+        void IntersectRays(Buffer const* rays, int numrays, Buffer* hits) const;
+        void OccludeRays(Buffer const* rays, int numrays, Buffer* hits) const;
+        // Number of rays in a single parallel_for subrange
+        int GetTaskSize(int numrays) const;
+        // Read number of rays from a buffer
+        int GetNumRays(Buffer const* numrays, int maxrays) const;
+        // Get a completed event from the pool
+        CpuEvent* CreateEvent() const;
+        // Return a complete event if requested, queries not running on the pool are blocking
+        void SetEvent(Event** event) const;
+
+        // Binary tree the wide one is collapsed from, kept for statistics
+        std::unique_ptr<Bvh> m_bvh;
+        // Build arrays reused across commits
+        BuildScratch m_scratch;
+        // 4-wide nodes, leaves point to m_faces
+        std::vector<WideBvhTranslator::Node> m_nodes;
+        // World space vertices
+        std::vector<float3> m_vertices;
+        std::vector<Face> m_faces;
+        // Statistics of the last build
+        AccelStats m_stats;
+        // Bvh settings version the tree has been built with
+        std::uint32_t m_bvh_settings_version;
+
+        //thread pool for parallelizing work with buffers
+        mutable thread_pool<void> m_pool;
+
+        // Events are reused to avoid allocations on each query
+        static const std::size_t EVENT_POOL_INITIAL_SIZE = 100;
+        mutable std::vector<CpuEvent*> m_event_pool;
+        mutable std::mutex m_event_pool_mutex;
+
+        friend class CpuEvent;
+    };
+}
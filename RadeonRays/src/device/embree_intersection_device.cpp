@@ -34,33 +34,221 @@ THE SOFTWARE.
 #include "embree2/rtcore.h"
 #include "embree2/rtcore_ray.h"
 #include "../async/thread_pool.h"
+#include "../util/thread_settings.h"
+#include "math/bbox.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
 #include <xmmintrin.h>
 #include <pmmintrin.h>
+#include <emmintrin.h>
 
-//count of elements for one thread pool task
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+//minimum count of elements for one parallel_for subrange
 #define TASK_SIZE 256
 
-//switch between rtcIntersect4 and rtcIntercetN
+//count of rays sorted and traced as one stream by a single thread
+#define STREAM_SIZE 1024
+
+//switch between ray packets and sorted ray streams (rtcIntersectN)
 //#define INTERSECTN
 
 
 namespace RadeonRays
 {
+    namespace
+    {
+        // Widest SIMD width in floats the host CPU and OS support
+        int GetHostSimdWidth()
+        {
+#if defined(_MSC_VER)
+            int info[4];
+            __cpuidex(info, 1, 0);
+
+            bool osxsave = (info[2] & (1 << 27)) != 0;
+            bool avx = (info[2] & (1 << 28)) != 0;
+
+            if (!osxsave || !avx)
+                return 4;
+
+            // OS has to save YMM (and ZMM for AVX-512) state
+            unsigned long long xcr0 = _xgetbv(0);
+
+            if ((xcr0 & 0x6) != 0x6)
+                return 4;
+
+            __cpuidex(info, 7, 0);
+            bool avx512f = (info[1] & (1 << 16)) != 0;
+
+            return avx512f && (xcr0 & 0xe6) == 0xe6 ? 16 : 8;
+#elif defined(__GNUC__)
+            __builtin_cpu_init();
+
+            if (__builtin_cpu_supports("avx512f"))
+                return 16;
+
+            return __builtin_cpu_supports("avx") ? 8 : 4;
+#else
+            return 4;
+#endif
+        }
+
+        void IntersectPacket(int const* valid, RTCScene scene, RTCRay4& packet) { rtcIntersect4(valid, scene, packet); }
+        void IntersectPacket(int const* valid, RTCScene scene, RTCRay8& packet) { rtcIntersect8(valid, scene, packet); }
+        void IntersectPacket(int const* valid, RTCScene scene, RTCRay16& packet) { rtcIntersect16(valid, scene, packet); }
+
+        void OccludePacket(int const* valid, RTCScene scene, RTCRay4& packet) { rtcOccluded4(valid, scene, packet); }
+        void OccludePacket(int const* valid, RTCScene scene, RTCRay8& packet) { rtcOccluded8(valid, scene, packet); }
+        void OccludePacket(int const* valid, RTCScene scene, RTCRay16& packet) { rtcOccluded16(valid, scene, packet); }
+
+        // Transpose rays [lane, lane + 4) of src into SoA lanes of the packet.
+        // Origin and direction are loaded as float4 (o.w is max t, d.w is time),
+        // so 4x4 transposes give org, dir, tfar and time without scalar copies.
+        // Lanes past count are disabled.
+        template <typename Packet> void LoadRays(Packet& dst, int* valid, const ray* src, int count, int lane)
+        {
+            __m128 o[4];
+            __m128 d[4];
+
+            for (int k = 0; k < 4; ++k)
+            {
+                int i = lane + k;
+
+                if (i < count)
+                {
+                    o[k] = _mm_loadu_ps(&src[i].o.x);
+                    d[k] = _mm_loadu_ps(&src[i].d.x);
+                    valid[i] = src[i].IsActive() ? -1 : 0;
+                    dst.mask[i] = src[i].GetMask();
+                }
+                else
+                {
+                    o[k] = _mm_setzero_ps();
+                    d[k] = _mm_setzero_ps();
+                    valid[i] = 0;
+                    dst.mask[i] = 0;
+                }
+            }
+
+            _MM_TRANSPOSE4_PS(o[0], o[1], o[2], o[3]);
+            _MM_TRANSPOSE4_PS(d[0], d[1], d[2], d[3]);
+
+            _mm_store_ps(&dst.orgx[lane], o[0]);
+            _mm_store_ps(&dst.orgy[lane], o[1]);
+            _mm_store_ps(&dst.orgz[lane], o[2]);
+            _mm_store_ps(&dst.tfar[lane], o[3]);
+
+            _mm_store_ps(&dst.dirx[lane], d[0]);
+            _mm_store_ps(&dst.diry[lane], d[1]);
+            _mm_store_ps(&dst.dirz[lane], d[2]);
+            _mm_store_ps(&dst.time[lane], d[3]);
+
+            _mm_store_ps(&dst.tnear[lane], _mm_setzero_ps());
+
+            __m128i invalid = _mm_set1_epi32(static_cast<int>(RTC_INVALID_GEOMETRY_ID));
+            _mm_store_si128(reinterpret_cast<__m128i*>(&dst.geomID[lane]), invalid);
+            _mm_store_si128(reinterpret_cast<__m128i*>(&dst.primID[lane]), invalid);
+            _mm_store_si128(reinterpret_cast<__m128i*>(&dst.instID[lane]), invalid);
+        }
+
+        // Per thread storage for ray streams, reused between queries
+        struct StreamScratch
+        {
+            // Rays in traversal order
+            std::vector<RTCRay> rays;
+            // Sort key in high 32 bits, source ray index in low 32 bits
+            std::vector<std::uint64_t> keys;
+        };
+
+        StreamScratch& GetStreamScratch()
+        {
+            static thread_local StreamScratch scratch;
+            return scratch;
+        }
+
+        // Spread lower 10 bits of v so there are two zero bits between each of them
+        std::uint32_t ExpandBits(std::uint32_t v)
+        {
+            v = (v * 0x00010001u) & 0xFF0000FFu;
+            v = (v * 0x00000101u) & 0x0F00F00Fu;
+            v = (v * 0x00000011u) & 0xC30C30C3u;
+            v = (v * 0x00000005u) & 0x49249249u;
+            return v;
+        }
+
+        // Order active rays by direction octant and then by Morton code of the origin
+        // within the origin bounds of the stream, so neighbouring rays of the stream
+        // are coherent. Inactive rays are dropped. Returns the number of active rays.
+        int SortRays(const ray* rays, int count, std::vector<std::uint64_t>& keys)
+        {
+            keys.clear();
+
+            bbox bounds;
+            for (int i = 0; i < count; ++i)
+            {
+                if (rays[i].IsActive())
+                    bounds.grow(rays[i].o);
+            }
+
+            float3 extents = bounds.extents();
+            float3 scale(extents.x > 0.f ? 1023.f / extents.x : 0.f,
+                         extents.y > 0.f ? 1023.f / extents.y : 0.f,
+                         extents.z > 0.f ? 1023.f / extents.z : 0.f);
+
+            for (int i = 0; i < count; ++i)
+            {
+                const ray& r = rays[i];
+
+                if (!r.IsActive())
+                    continue;
+
+                std::uint32_t octant = (r.d.x < 0.f ? 1u : 0u) | (r.d.y < 0.f ? 2u : 0u) | (r.d.z < 0.f ? 4u : 0u);
+
+                std::uint32_t x = static_cast<std::uint32_t>((r.o.x - bounds.pmin.x) * scale.x);
+                std::uint32_t y = static_cast<std::uint32_t>((r.o.y - bounds.pmin.y) * scale.y);
+                std::uint32_t z = static_cast<std::uint32_t>((r.o.z - bounds.pmin.z) * scale.z);
+
+                std::uint32_t morton = (ExpandBits(x) << 2) | (ExpandBits(y) << 1) | ExpandBits(z);
+                std::uint32_t key = (octant << 29) | (morton >> 1);
+
+                keys.push_back((static_cast<std::uint64_t>(key) << 32) | static_cast<std::uint32_t>(i));
+            }
+
+            std::sort(keys.begin(), keys.end());
+
+            return static_cast<int>(keys.size());
+        }
+    }
+
     //simple RadeonRays::Buffer implementation
     class EmbreeBuffer : public Buffer
     {
     public:
         EmbreeBuffer(size_t size, void* init)
             : m_data(nullptr)
+            , m_owned(true)
         {
             m_data = new char[size];
             if (init)
                 memcpy(m_data, init, size);
         }
+
+        // Wrap caller memory, it is neither copied nor released
+        explicit EmbreeBuffer(void* host_ptr)
+            : m_data(host_ptr)
+            , m_owned(false)
+        {
+        }
+
         virtual ~EmbreeBuffer()
         {
-            delete[] m_data;
+            if (m_owned)
+                delete[] static_cast<char*>(m_data);
             m_data = nullptr;
         }
 
@@ -76,47 +264,181 @@ namespace RadeonRays
 
     private:
         void* m_data;
+        bool m_owned;
     };
 
-    //simple RadeonRays::Event implementation
-    class EmbreeEvent : public Event
+    //pooled RadeonRays::Event implementation, asynchronous queries run as thread pool jobs
+    class EmbreeEvent : public Event, public thread_pool<void>::job
     {
     public:
-        EmbreeEvent(std::function<void()>&& f)
-            : m_ftr()
+        enum class Query
+        {
+            kNone,
+            kIntersection,
+            kOcclusion
+        };
+
+        EmbreeEvent()
+            : m_complete(true)
+            , m_query(Query::kNone)
+            , m_device(nullptr)
+            , m_rays(nullptr)
+            , m_hits(nullptr)
+            , m_numrays(0)
+            , m_callback(nullptr)
+            , m_callback_data(nullptr)
         {
-            std::packaged_task<void()> task(std::move(f));
-            m_ftr = task.get_future();
-            std::thread(std::move(task)).detach();
+            execute = &EmbreeEvent::Execute;
+            discard = &EmbreeEvent::Discard;
         }
 
         virtual ~EmbreeEvent()
         {
-            Wait();
+            WaitForCompletion();
         }
 
         virtual bool Complete() const
         {
-            return m_ftr.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+            return m_complete.load();
         }
 
+        // Rethrows an exception raised by the query if any
         virtual void Wait()
         {
-            m_ftr.wait();
+            WaitForCompletion();
+
+            if (m_error)
+            {
+                auto error = m_error;
+                m_error = nullptr;
+                std::rethrow_exception(error);
+            }
         }
+
+        // The query job calls it once it is done
+        virtual void OnComplete(CompletionFunc callback, void* userdata)
+        {
+            ThrowIf(!callback, "Invalid completion callback.");
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (!m_complete.load())
+                {
+                    m_callback = callback;
+                    m_callback_data = userdata;
+                    return;
+                }
+            }
+
+            callback(userdata);
+        }
+
+        // Make the event pending until the query is executed by the pool
+        void SetQuery(Query query, EmbreeIntersectionDevice const* device, Buffer const* rays, int numrays, Buffer* hits)
+        {
+            m_query = query;
+            m_device = device;
+            m_rays = rays;
+            m_hits = hits;
+            m_numrays = numrays;
+            m_error = nullptr;
+            m_complete = false;
+        }
+
+        void WaitForCompletion()
+        {
+            // Always lock, so the pool thread is done with the event once we return
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]() { return m_complete.load(); });
+        }
+
     private:
-        std::future<void> m_ftr;
+        static void Execute(thread_pool<void>::job* j)
+        {
+            auto ev = static_cast<EmbreeEvent*>(j);
+
+            try
+            {
+                if (ev->m_query == Query::kIntersection)
+                    ev->m_device->IntersectRays(ev->m_rays, ev->m_numrays, ev->m_hits);
+                else if (ev->m_query == Query::kOcclusion)
+                    ev->m_device->OccludeRays(ev->m_rays, ev->m_numrays, ev->m_hits);
+            }
+            catch (...)
+            {
+                ev->m_error = std::current_exception();
+            }
+
+            ev->Signal();
+        }
+
+        static void Discard(thread_pool<void>::job* j)
+        {
+            static_cast<EmbreeEvent*>(j)->Signal();
+        }
+
+        void Signal()
+        {
+            CompletionFunc callback = nullptr;
+            void* userdata = nullptr;
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_complete = true;
+                std::swap(callback, m_callback);
+                std::swap(userdata, m_callback_data);
+                m_cv.notify_all();
+            }
+
+            // The event might be reused by now, only the copies are touched
+            if (callback)
+            {
+                callback(userdata);
+            }
+        }
+
+        std::atomic<bool> m_complete;
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+
+        Query m_query;
+        EmbreeIntersectionDevice const* m_device;
+        Buffer const* m_rays;
+        Buffer* m_hits;
+        int m_numrays;
+        std::exception_ptr m_error;
+        // Continuation set while the query is pending
+        CompletionFunc m_callback;
+        void* m_callback_data;
     };
 
     EmbreeIntersectionDevice::EmbreeIntersectionDevice()
-        : m_pool(1)
+        : m_pool(GetNumQueryThreads(), GetNumQueryNodes(), PinThreadToNode)
+        , m_packet_width(4)
     {
-        m_device = rtcNewDevice(nullptr);
+        // Embree builds scenes on its own threads, limit them to the build threads
+        auto const settings = GetThreadSettings();
+        std::string const config = settings.build_threads > 0 ? "threads=" + std::to_string(settings.build_threads) : "";
+        m_device = rtcNewDevice(config.empty() ? nullptr : config.c_str());
         RTCError result = rtcDeviceGetError(m_device);
         if (result != RTC_NO_ERROR)
             std::cout << "Failed to create embree rtcDevice: " << result << std::endl;
 
-        m_scene = rtcDeviceNewScene(m_device, RTC_SCENE_STATIC, RTC_INTERSECT1 | RTC_INTERSECT4 | RTC_INTERSECT8 | RTC_INTERSECT16 | RTC_INTERSECTN);
+        // Use the widest packets both the CPU and embree build can handle
+        int simd_width = GetHostSimdWidth();
+        if (simd_width >= 16 && rtcDeviceGetParameter1i(m_device, RTC_CONFIG_INTERSECT16))
+            m_packet_width = 16;
+        else if (simd_width >= 8 && rtcDeviceGetParameter1i(m_device, RTC_CONFIG_INTERSECT8))
+            m_packet_width = 8;
+
+        // Initialize event pool
+        for (std::size_t i = 0; i < EVENT_POOL_INITIAL_SIZE; ++i)
+        {
+            m_event_pool.push_back(new EmbreeEvent());
+        }
+
+        //top level scene holds instances only and is updated in place on transform changes
+        m_scene = rtcDeviceNewScene(m_device, RTC_SCENE_DYNAMIC, RTC_INTERSECT1 | RTC_INTERSECT4 | RTC_INTERSECT8 | RTC_INTERSECT16 | RTC_INTERSECTN);
         result = rtcDeviceGetError(m_device);
         if (result != RTC_NO_ERROR)
             std::cout << "Failed to create embree scene: " << result << std::endl;
@@ -124,6 +446,11 @@ namespace RadeonRays
     
     EmbreeIntersectionDevice::~EmbreeIntersectionDevice()
     {
+        for (auto event : m_event_pool)
+        {
+            delete event;
+        }
+
         if (m_device)
         {
             rtcDeleteDevice(m_device);
@@ -134,51 +461,35 @@ namespace RadeonRays
 
     void EmbreeIntersectionDevice::Preprocess(World const& world)
     {
+        // Embree queries write one int per ray
+        auto compact = world.options_.GetOption("acc.occlusion.compact");
+        ThrowIf(compact && compact->AsFloat() > 0.f, "Embree device does not support compact occlusion output.");
+        auto hitformat = world.options_.GetOption("acc.hit.format");
+        ThrowIf(hitformat && hitformat->AsString() == "compact", "Embree device does not support compact hit records.");
+        auto rayformat = world.options_.GetOption("acc.ray.format");
+        ThrowIf(rayformat && rayformat->AsString() == "compact", "Embree device does not support compact ray records.");
+
         for (auto& it : m_instances)
             it.second.updated = false;
 
-        //checking removed shapes
-        for (auto it = world.shapes_.begin(); it != world.shapes_.end(); ++it)
-        {
-            auto& i = *it;
-            const ShapeImpl* shape = dynamic_cast<const ShapeImpl*>(i);
-            if (m_instances.count(shape))
-                m_instances[shape].updated = true;
-        }
-
-        //cleanup not updated instances
-        auto itr = m_instances.begin();
-        while (itr != m_instances.end())
-        {
-            if (!itr->second.updated)
-            {
-                //if no instances left => clear stored mesh
-                auto& mesh = m_meshes[itr->first];
-                ThrowIf(mesh.instance_count <= 0, "Invalid embree mesh");
-                --mesh.instance_count;
-                if (mesh.instance_count == 0)
-                {
-                    rtcDeleteScene(itr->second.scene);
-                    CheckEmbreeError();
-                    m_meshes.erase(itr->first);
-                }
-                itr = m_instances.erase(itr);
-            }
-            else
-            {
-                ++itr;
-            }
-        }
-        m_instances.clear();
-        rtcDeleteScene(m_scene); CheckEmbreeError();
-        m_scene = rtcDeviceNewScene(m_device, RTC_SCENE_STATIC, RTC_INTERSECT1 | RTC_INTERSECT4 | RTC_INTERSECT8 | RTC_INTERSECT16 | RTC_INTERSECTN); CheckEmbreeError();
+        // Scenes of new meshes, committed concurrently once all of them are created
+        std::vector<RTCScene> uncommitted;
 
+        //top level scene is dynamic, so existing instances only get their state updated
+        //and new ones are added, no rebuild of the instanced meshes is needed
         for (auto i : world.shapes_)
         {
             const ShapeImpl* shape = dynamic_cast<const ShapeImpl*>(i);
             ThrowIf(!shape, "Invalid shape.");
 
-            //update only if shape already precessed before
+            auto found = m_instances.find(shape);
+            if (found != m_instances.end())
+            {
+                found->second.updated = true;
+                UpdateShape(shape);
+                continue;
+            }
+
             EmbreeSceneData& data = m_instances[shape];
             data.mesh_id = shape->GetId();
             data.updated = true;
@@ -186,21 +497,19 @@ namespace RadeonRays
             //for each new Shape creating new embree scene with geometry
             //and adding its instance to m_scene
             const Mesh* mesh = dynamic_cast<const Mesh*> (shape);
-            if (mesh)
-            {
-                data.scene = GetEmbreeMesh(mesh);
-            }
-            else // instance
+            if (!mesh) // instance
             {
                 const Instance* inst = dynamic_cast<const Instance*> (shape);
                 ThrowIf(!inst, "Invalid shape.");
                 mesh = dynamic_cast<const Mesh*> (inst->GetBaseShape());
                 ThrowIf(!mesh, "Invalid mesh.");
-                //adding mesh of instance if it's not being processed before
-                data.scene = GetEmbreeMesh(mesh);
-                ++m_meshes[mesh].instance_count;
             }
 
+            //adding mesh if it's not being processed before
+            data.scene = GetEmbreeMesh(mesh, uncommitted);
+            data.mesh = mesh;
+            ++m_meshes[mesh].instance_count;
+
             unsigned geom = rtcNewInstance(m_scene, data.scene);
             CheckEmbreeError();
             matrix trans, transInv;
@@ -213,9 +522,46 @@ namespace RadeonRays
             CheckEmbreeError();
 
             data.geom = geom;
+        }
+
+        //cleanup instances of removed shapes
+        auto itr = m_instances.begin();
+        while (itr != m_instances.end())
+        {
+            if (!itr->second.updated)
+            {
+                rtcDeleteGeometry(m_scene, itr->second.geom);
+                CheckEmbreeError();
 
+                //if no instances left => clear stored mesh
+                auto& mesh = m_meshes[itr->second.mesh];
+                ThrowIf(mesh.instance_count <= 0, "Invalid embree mesh");
+                --mesh.instance_count;
+                if (mesh.instance_count == 0)
+                {
+                    rtcDeleteScene(mesh.scene);
+                    CheckEmbreeError();
+                    m_meshes.erase(itr->second.mesh);
+                }
+                itr = m_instances.erase(itr);
+            }
+            else
+            {
+                ++itr;
+            }
         }
 
+        // Mesh scenes are independent, so they are built on the pool, each
+        // build runs on Embree threads as well
+        m_pool.parallel_for(0, static_cast<int>(uncommitted.size()), 1, [this, &uncommitted](int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                rtcCommit(uncommitted[i]);
+                CheckEmbreeError();
+            }
+        });
+
         rtcCommit(m_scene);
         CheckEmbreeError();
     }
@@ -225,6 +571,12 @@ namespace RadeonRays
         return new EmbreeBuffer(size, initdata);
     }
 
+    Buffer* EmbreeIntersectionDevice::CreateBufferFromHostPtr(void* ptr, size_t size) const
+    {
+        ThrowIf(!ptr && size > 0, "Invalid host pointer.");
+        return new EmbreeBuffer(ptr);
+    }
+
     void EmbreeIntersectionDevice::DeleteBuffer(Buffer* const buffer) const
     {
         delete buffer;
@@ -232,12 +584,51 @@ namespace RadeonRays
 
     void EmbreeIntersectionDevice::DeleteEvent(Event* const event) const
     {
-        delete event;
+        EmbreeEvent* ev = static_cast<EmbreeEvent*>(event);
+        ev->WaitForCompletion();
+
+        std::lock_guard<std::mutex> lock(m_event_pool_mutex);
+        m_event_pool.push_back(ev);
+    }
+
+    void EmbreeIntersectionDevice::JoinEvents(Event const* const* events, int count, Event** event) const
+    {
+        // Queries are ordered on the host, so the events are waited for here
+        for (int i = 0; i < count; ++i)
+        {
+            static_cast<EmbreeEvent*>(const_cast<Event*>(events[i]))->WaitForCompletion();
+        }
+
+        *event = CreateEvent();
+    }
+
+    EmbreeEvent* EmbreeIntersectionDevice::CreateEvent() const
+    {
+        std::lock_guard<std::mutex> lock(m_event_pool_mutex);
+
+        if (m_event_pool.empty())
+        {
+            return new EmbreeEvent();
+        }
+
+        auto event = m_event_pool.back();
+        m_event_pool.pop_back();
+        return event;
+    }
+
+    int EmbreeIntersectionDevice::GetTaskSize(int numrays) const
+    {
+        // A few subranges per thread balance the load, rounding to the widest
+        // packet keeps packets full and the minimum amortizes scheduling
+        int num_tasks = static_cast<int>(m_pool.num_threads()) * 4;
+        int task_size = (numrays + num_tasks - 1) / num_tasks;
+        task_size = (task_size + 15) & ~15;
+        return std::max(task_size, TASK_SIZE);
     }
 
     void EmbreeIntersectionDevice::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const
     {
-        EmbreeEvent* ev = new EmbreeEvent([]() {});
+        EmbreeEvent* ev = CreateEvent();
         if (data)
         {
             EmbreeBuffer* buf = dynamic_cast<EmbreeBuffer*>(buffer);
@@ -258,7 +649,7 @@ namespace RadeonRays
 
     void EmbreeIntersectionDevice::UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const
     {
-        EmbreeEvent* ev = new EmbreeEvent([]() {});
+        EmbreeEvent* ev = CreateEvent();
 
         if (event)
         {
@@ -277,213 +668,141 @@ namespace RadeonRays
         const EmbreeBuffer* fireRays = dynamic_cast<const EmbreeBuffer*>(rays); ThrowIf(!fireRays, "Invalid embree buffer.");
         EmbreeBuffer* fireHits = dynamic_cast<EmbreeBuffer*>(hits); ThrowIf(!fireHits, "Invalid embree buffer.");
 
-        EmbreeEvent* ev = new EmbreeEvent([this, fireRays, fireHits, numrays]() 
+        if (event)
         {
-            m_pool.setSleepTime(0);
-            //processing buffers workflow:
-            //1. convert RadeonRays::ray to RTCRay
-            //2. rtcIntersect
-            //3. convert RTCRay hit result to RadeonRays::Intersection
-            std::vector<std::future<void> > jobs;
-            jobs.reserve(numrays / TASK_SIZE);
+            EmbreeEvent* ev = CreateEvent();
+            ev->SetQuery(EmbreeEvent::Query::kIntersection, this, rays, numrays, hits);
+            m_pool.submit(ev);
+            *event = ev;
+        }
+        else
+        {
+            IntersectRays(rays, numrays, hits);
+        }
+    }
+
+    void EmbreeIntersectionDevice::IntersectRays(Buffer const* rays, int numrays, Buffer* hits) const
+    {
+        const EmbreeBuffer* fireRays = static_cast<const EmbreeBuffer*>(rays);
+        EmbreeBuffer* fireHits = static_cast<EmbreeBuffer*>(hits);
+
+        //processing buffers workflow:
+        //1. convert RadeonRays::ray to RTCRay
+        //2. rtcIntersect
+        //3. convert RTCRay hit result to RadeonRays::Intersection
 #ifndef INTERSECTN
-            for (int i = 0; i < numrays; i += TASK_SIZE)
-            {
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                Intersection* hit = &static_cast<Intersection*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
+        m_pool.parallel_for(0, numrays, GetTaskSize(numrays), [this, fireRays, fireHits](int begin, int end)
+        {
+            const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[begin];
+            Intersection* hit = &static_cast<Intersection*>(fireHits->GetData())[begin];
+            int count = end - begin;
 
-                jobs.push_back(std::move(m_pool.submit(([this, src_ray, hit, count]()
-                {
-                    RTCRay4 data;
-                    for (int i = 0; i < count; i+=4)
-                    {
-                        int rays_count = (i + 4) < count ? 4 : count - i; // count of valid rays
-                        RTCORE_ALIGN(16) int valid[4] = { 0, 0, 0, 0,}; //disable all rays
-                        for (int j = 0; j < rays_count; ++j)
-                        {
-                            valid[j] = src_ray[i + j].IsActive() ? -1 : 0;
-                            FillRTCRay(data, j, src_ray[i+j]);
-                        }
-                        rtcIntersect4(valid, m_scene, data); CheckEmbreeError();
-                        for (int j = 0; j < rays_count; ++j)
-                            FillIntersection(hit[i+j], data, j);
-                    }
-                }))));
-            }
-#else
-            std::vector<RTCRay> data(numrays);
-            for (int i = 0; i < numrays; i += TASK_SIZE)
+            switch (m_packet_width)
             {
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                RTCRay* dst_ray = &data[i];
-                Intersection* hit = &static_cast<Intersection*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
-                jobs.push_back(std::move(m_pool.submit([this, dst_ray, src_ray, count]()
-                {
-                    for (int j = 0; j < count; ++j)
-                        FillRTCRay(dst_ray[j], src_ray[j]);
-                })));
+            case 16: IntersectPackets<RTCRay16>(src_ray, hit, count); break;
+            case 8: IntersectPackets<RTCRay8>(src_ray, hit, count); break;
+            default: IntersectPackets<RTCRay4>(src_ray, hit, count); break;
             }
-            std::for_each(jobs.begin(), jobs.end(), [](std::future<void>& j) {j.wait(); });
-            jobs.clear();
-            rtcIntersectN(m_scene, &data[0], numrays, sizeof(RTCRay));
+        });
+#else
+        m_pool.parallel_for(0, numrays, STREAM_SIZE, [this, fireRays, fireHits](int begin, int end)
+        {
+            const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[begin];
+            Intersection* hit = &static_cast<Intersection*>(fireHits->GetData())[begin];
+
+            auto& scratch = GetStreamScratch();
+            int count = SortRays(src_ray, end - begin, scratch.keys);
+
+            if (count == 0)
+                return;
+
+            scratch.rays.resize(count);
+            for (int i = 0; i < count; ++i)
+                FillRTCRay(scratch.rays[i], src_ray[scratch.keys[i] & 0xFFFFFFFF]);
+
+            rtcIntersectN(m_scene, &scratch.rays[0], count, sizeof(RTCRay));
             CheckEmbreeError();
-            for (int i = 0; i < numrays; i += TASK_SIZE)
-            {
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                RTCRay* src_hit = &data[i];
-                Intersection* hit = &static_cast<Intersection*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
 
-                jobs.push_back(std::move(m_pool.submit([this, hit, src_hit, src_ray, count]()
-                {
-                    for (int i = 0; i < count; ++i)
-                        if (src_ray[i].IsActive())
-                        {
-                            FillIntersection(hit[i], src_hit[i]);
-                        }
-                })));
-            }
-            
+            for (int i = 0; i < count; ++i)
+                FillIntersection(hit[scratch.keys[i] & 0xFFFFFFFF], scratch.rays[i]);
+        });
 #endif // INTERSECTN
+    }
 
-            std::for_each(jobs.begin(), jobs.end(), [](std::future<void>& j) {j.wait(); });
-            m_pool.setSleepTime(1);
-        });
+    void EmbreeIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        const EmbreeBuffer* fireRays = dynamic_cast<const EmbreeBuffer*>(rays); ThrowIf(!fireRays, "Invalid embree buffer.");
+        EmbreeBuffer* fireHits = dynamic_cast<EmbreeBuffer*>(hits); ThrowIf(!fireHits, "Invalid embree buffer.");
 
         if (event)
         {
+            EmbreeEvent* ev = CreateEvent();
+            ev->SetQuery(EmbreeEvent::Query::kOcclusion, this, rays, numrays, hits);
+            m_pool.submit(ev);
             *event = ev;
         }
         else
         {
-            ev->Wait();
-            DeleteEvent(ev);
+            OccludeRays(rays, numrays, hits);
         }
     }
 
-    void EmbreeIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    void EmbreeIntersectionDevice::OccludeRays(Buffer const* rays, int numrays, Buffer* hits) const
     {
-        const EmbreeBuffer* fireRays = dynamic_cast<const EmbreeBuffer*>(rays); ThrowIf(!fireRays, "Invalid embree buffer.");
-        EmbreeBuffer* fireHits = dynamic_cast<EmbreeBuffer*>(hits); ThrowIf(!fireHits, "Invalid embree buffer.");
+        const EmbreeBuffer* fireRays = static_cast<const EmbreeBuffer*>(rays);
+        EmbreeBuffer* fireHits = static_cast<EmbreeBuffer*>(hits);
 
-        EmbreeEvent* ev = new EmbreeEvent([this, fireRays, fireHits, numrays]()
-        {
-            m_pool.setSleepTime(0);
-            //processing buffers workflow:
-            //1. convert RadeonRays::ray to RTCRay
-            //2. rtcOccluded
-            //3. convert RTCRay hit result
-            std::vector<std::future<void> > jobs;
-            jobs.reserve(numrays / TASK_SIZE);
+        //processing buffers workflow:
+        //1. convert RadeonRays::ray to RTCRay
+        //2. rtcOccluded
+        //3. convert RTCRay hit result
 #ifndef INTERSECTN
-            for (int i = 0; i < numrays; i += TASK_SIZE)
-            {
-
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                int* hit = &static_cast<int*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
+        m_pool.parallel_for(0, numrays, GetTaskSize(numrays), [this, fireRays, fireHits](int begin, int end)
+        {
+            const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[begin];
+            int* hit = &static_cast<int*>(fireHits->GetData())[begin];
+            int count = end - begin;
 
-                jobs.push_back(std::move(m_pool.submit(([this, src_ray, hit, count]()
-                {
-                    RTCRay4 data;
-                    for (int i = 0; i < count; i += 4)
-                    {
-                        int rays_count = (i + 4) < count ? 4 : count - i; // count of valid rays
-                        RTCORE_ALIGN(16) int valid[4] = { 0, 0, 0, 0, }; //disable all rays
-                        for (int j = 0; j < 4; ++j)
-                        {
-                            data.orgx[j] = 0;
-                            data.orgy[j] = 0;
-                            data.orgz[j] = 0;
-
-                            data.dirx[j] = 0;
-                            data.diry[j] = 0;
-                            data.dirz[j] = 0;
-
-                            data.tnear[j] = 0;
-                            data.tfar[j] = 0;
-                            data.geomID[j] = RTC_INVALID_GEOMETRY_ID;
-                            data.primID[j] = RTC_INVALID_GEOMETRY_ID;
-                            data.instID[j] = RTC_INVALID_GEOMETRY_ID;
-                            data.time[j] = 0;
-                            data.mask[j] = 0xFFFFFF;
-                        }
-                        for (int j = 0; j < rays_count; ++j)
-                        {
-                            valid[j] = src_ray[i + j].IsActive() ? -1 : 0;
-                            FillRTCRay(data, j, src_ray[i + j]);
-                        }
-                        rtcOccluded4(valid, m_scene, data); CheckEmbreeError();
-                        for (int j = 0; j < rays_count; ++j)
-                        {
-                            if (data.instID[j] == RTC_INVALID_GEOMETRY_ID || data.geomID[j] == RTC_INVALID_GEOMETRY_ID)
-                            {
-                                hit[i + j] = RTC_INVALID_GEOMETRY_ID;
-                                continue;
-                            }
-                            hit[i + j] = data.instID[j];
-                            EmbreeSceneData* data = static_cast<EmbreeSceneData*>(rtcGetUserData(m_scene, hit[i + j]));
-                            hit[i + j] = data->mesh_id;
-                        }
-                    }
-                }))));
-            }
-#else
-            std::vector<RTCRay> data(numrays);
-            for (int i = 0; i < numrays; i += TASK_SIZE)
+            switch (m_packet_width)
             {
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                RTCRay* dst_ray = &data[i];
-                Intersection* hit = &static_cast<Intersection*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
-                jobs.push_back(std::move(m_pool.submit([this, dst_ray, src_ray, count]()
-                {
-                    for (int j = 0; j < count; ++j)
-                        FillRTCRay(dst_ray[j], src_ray[j]);
-                })));
+            case 16: OccludePackets<RTCRay16>(src_ray, hit, count); break;
+            case 8: OccludePackets<RTCRay8>(src_ray, hit, count); break;
+            default: OccludePackets<RTCRay4>(src_ray, hit, count); break;
             }
-            std::for_each(jobs.begin(), jobs.end(), [](std::future<void>& j) {j.wait(); });
-            jobs.clear();
-            rtcOccludedN(m_scene, &data[0], numrays, sizeof(RTCRay));
+        });
+#else
+        m_pool.parallel_for(0, numrays, STREAM_SIZE, [this, fireRays, fireHits](int begin, int end)
+        {
+            const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[begin];
+            int* hit = &static_cast<int*>(fireHits->GetData())[begin];
+
+            auto& scratch = GetStreamScratch();
+            int count = SortRays(src_ray, end - begin, scratch.keys);
+
+            if (count == 0)
+                return;
+
+            scratch.rays.resize(count);
+            for (int i = 0; i < count; ++i)
+                FillRTCRay(scratch.rays[i], src_ray[scratch.keys[i] & 0xFFFFFFFF]);
+
+            rtcOccludedN(m_scene, &scratch.rays[0], count, sizeof(RTCRay));
             CheckEmbreeError();
-            for (int i = 0; i < numrays; i += TASK_SIZE)
+
+            for (int i = 0; i < count; ++i)
             {
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                int* hit = &static_cast<int*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
-                RTCRay* hit_src = &data[i];
-                jobs.push_back(std::move(m_pool.submit([this, hit, hit_src, src_ray, count]()
+                int idx = static_cast<int>(scratch.keys[i] & 0xFFFFFFFF);
+
+                if (scratch.rays[i].instID == RTC_INVALID_GEOMETRY_ID || scratch.rays[i].geomID == RTC_INVALID_GEOMETRY_ID)
                 {
-                    for (int i = 0; i < count; ++i)
-                    {
-                        if (hit_src[i].instID == RTC_INVALID_GEOMETRY_ID || hit_src[i].geomID == RTC_INVALID_GEOMETRY_ID)
-                        {
-                            hit[i] = RTC_INVALID_GEOMETRY_ID;
-                            continue;
-                        }
-                        hit[i] = hit_src[i].instID;
-                        EmbreeSceneData* data = static_cast<EmbreeSceneData*>(rtcGetUserData(m_scene, hit[i]));
-                        hit[i] = data->mesh_id;
-                    }
-                })));
+                    hit[idx] = RTC_INVALID_GEOMETRY_ID;
+                    continue;
+                }
+                const EmbreeSceneData* kData = static_cast<const EmbreeSceneData*>(rtcGetUserData(m_scene, scratch.rays[i].instID));
+                hit[idx] = kData->mesh_id;
             }
-#endif // INTERSECTN
-
-            std::for_each(jobs.begin(), jobs.end(), [](std::future<void>& j) {j.wait(); });
-            m_pool.setSleepTime(1);
         });
-
-        if (event)
-        {
-            *event = ev;
-        }
-        else
-        {
-            ev->Wait();
-            DeleteEvent(ev);
-        }
+#endif // INTERSECTN
     }
 
     void EmbreeIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
@@ -496,7 +815,73 @@ namespace RadeonRays
         Throw("Not implemented for embree device.");
     }
 
-    RTCScene EmbreeIntersectionDevice::GetEmbreeMesh(const RadeonRays::Mesh* mesh)
+    void EmbreeIntersectionDevice::QueryOcclusionPacked(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::QueryOcclusionPacked(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::QueryIntersectionMulti(Buffer const* rays, Buffer const* numrays, int maxrays, int k, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::QueryIntersectionAttributes(Buffer const* rays, int numrays, int numattributes, Buffer* hits, Buffer* attributes, Event const* waitevent, Event** event) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::QueryOcclusionCached(Buffer const* rays, int numrays, Buffer* occluders, Buffer* hitresults, Event const* waitevent, Event** event) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::QueryOverlap(Buffer const* boxes, int count, int maxoverlaps, Buffer* overlaps, Buffer* counts, Event const* waitevent, Event** event) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::QueryClosestPoint(Buffer const* points, int count, float maxdist, Buffer* results, Event const* waitevent, Event** event) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::QueryIntersection2D(Buffer const* rays, int width, int height, RayOrder order, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        // Rays are traversed in scanline order, the hits are the same
+        QueryIntersection(rays, width * height, hits, waitevent, event);
+    }
+
+    void EmbreeIntersectionDevice::QueryPrimaryPinhole(PinholeCamera const& camera, int width, int height, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::QueryShadowFromHits(Buffer const* rays, Buffer const* hits, int numrays, float3 const& light, float epsilon, Buffer* results, Event const* waitevent, Event** event) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* compacted, Buffer* newnumrays, Buffer* indices, Event const* waitevent, Event** event) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::SortHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer* indices, Buffer* numhits, Event const* waitevent, Event** event) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    RTCScene EmbreeIntersectionDevice::GetEmbreeMesh(const RadeonRays::Mesh* mesh, std::vector<RTCScene>& uncommitted)
     {
         if (m_meshes.count(mesh))
             return m_meshes[mesh].scene;
@@ -506,36 +891,55 @@ namespace RadeonRays
 
         unsigned id = rtcNewTriangleMesh(result, RTC_GEOMETRY_STATIC, mesh->num_faces(), mesh->num_vertices());
         CheckEmbreeError();
-        
-        const float3* kMeshVerts = mesh->GetVertexData();
-        float* verts = static_cast<float*>(rtcMapBuffer(result, id, RTC_VERTEX_BUFFER));
-        CheckEmbreeError();
-        ThrowIf(!verts, "Failed to map embree buffer.");
-        for (int i = 0; i < mesh->num_vertices(); ++i)
+
+        // Embree reads the mesh arrays directly where their layout allows, the mesh outlives
+        // the scene since it is released once the last instance of the mesh is detached.
+        // External positions aren't padded for float4 loads and are copied.
+        if (!mesh->is_external() && mesh->vertex_stride() % 4 == 0)
         {
-            verts[4 * i] = kMeshVerts[i].x;
-            verts[4 * i + 1] = kMeshVerts[i].y;
-            verts[4 * i + 2] = kMeshVerts[i].z;
-            verts[4 * i + 3] = kMeshVerts[i].w;
+            rtcSetBuffer(result, id, RTC_VERTEX_BUFFER, mesh->vertex_data(), 0, mesh->vertex_stride());
+            CheckEmbreeError();
+        }
+        else
+        {
+            float* verts = static_cast<float*>(rtcMapBuffer(result, id, RTC_VERTEX_BUFFER));
+            CheckEmbreeError();
+            ThrowIf(!verts, "Failed to map embree buffer.");
+            for (int i = 0; i < mesh->num_vertices(); ++i)
+            {
+                const float3 vertex = mesh->GetVertex(i);
+                verts[4 * i] = vertex.x;
+                verts[4 * i + 1] = vertex.y;
+                verts[4 * i + 2] = vertex.z;
+                verts[4 * i + 3] = vertex.w;
+            }
+            rtcUnmapBuffer(result, id, RTC_VERTEX_BUFFER);
         }
-        rtcUnmapBuffer(result, id, RTC_VERTEX_BUFFER);
 
-        int* indices = static_cast<int*>(rtcMapBuffer(result, id, RTC_INDEX_BUFFER));
-        CheckEmbreeError();
-        ThrowIf(!indices, "Failed to map embree buffer.");
-        const Mesh::Face* kFaces = mesh->GetFaceData();
-        for (int i = 0; i < mesh->num_faces(); ++i)
+        if (mesh->index_data() && mesh->index_stride() % 4 == 0)
         {
-            indices[3 * i] = kFaces[i].i0;
-            indices[3 * i + 1] = kFaces[i].i1;
-            indices[3 * i + 2] = kFaces[i].i2;
+            rtcSetBuffer(result, id, RTC_INDEX_BUFFER, mesh->index_data(), 0, mesh->index_stride());
+            CheckEmbreeError();
+        }
+        else
+        {
+            int* indices = static_cast<int*>(rtcMapBuffer(result, id, RTC_INDEX_BUFFER));
+            CheckEmbreeError();
+            ThrowIf(!indices, "Failed to map embree buffer.");
+            for (int i = 0; i < mesh->num_faces(); ++i)
+            {
+                const Mesh::Face face = mesh->GetFace(i);
+                indices[3 * i] = face.i0;
+                indices[3 * i + 1] = face.i1;
+                indices[3 * i + 2] = face.i2;
+            }
+            rtcUnmapBuffer(result, id, RTC_INDEX_BUFFER);
         }
-        rtcUnmapBuffer(result, id, RTC_INDEX_BUFFER);
         CheckEmbreeError();
-        rtcCommit(result);
+        uncommitted.push_back(result);
 
         m_meshes[mesh].scene = result;
-        m_meshes[mesh].instance_count = 1;
+        m_meshes[mesh].instance_count = 0;
 
         return result;
     }
@@ -554,10 +958,13 @@ namespace RadeonRays
         }
         if (state & ShapeImpl::kStateChangeTransform)
         {
+            //only the instance matrix changes, instanced mesh BVH is kept as is
             matrix trans, transInv;
             shape->GetTransform(trans, transInv);
             rtcSetTransform(m_scene, data.geom, RTC_MATRIX_ROW_MAJOR, &trans.m00);
             CheckEmbreeError();
+            rtcUpdate(m_scene, data.geom);
+            CheckEmbreeError();
         }
         if (state & ShapeImpl::kStateChangeId)
         {
@@ -565,6 +972,8 @@ namespace RadeonRays
         }
 
         ThrowIf((state & ShapeImpl::kStateChangeMotion) ? true : false, "Not implemented for embree device");
+        // Mesh scenes are static, so deforming them would require recreating every instance
+        ThrowIf((state & ShapeImpl::kStateChangeGeometry) ? true : false, "Vertex updates not implemented for embree device");
     }
 
     void EmbreeIntersectionDevice::FillRTCRay(RTCRay& dst, const ray& src) const
@@ -586,26 +995,6 @@ namespace RadeonRays
         dst.mask = src.GetMask();
     }
 
-    void EmbreeIntersectionDevice::FillRTCRay(RTCRay4& dst, int i, const ray& src) const
-    {
-        dst.orgx[i] = src.o.x;
-        dst.orgy[i] = src.o.y;
-        dst.orgz[i] = src.o.z;
-
-        dst.dirx[i] = src.d.x;
-        dst.diry[i] = src.d.y;
-        dst.dirz[i] = src.d.z;
-
-        dst.tnear[i] = 0;
-        dst.tfar[i] = src.GetMaxT();
-        dst.geomID[i] = RTC_INVALID_GEOMETRY_ID;
-        dst.primID[i] = RTC_INVALID_GEOMETRY_ID;
-        dst.instID[i] = RTC_INVALID_GEOMETRY_ID;
-        dst.time[i] = src.GetTime();
-        dst.mask[i] = src.GetMask();
-    }
-
-
     void EmbreeIntersectionDevice::FillIntersection(Intersection& dst, const RTCRay& src) const
     {
         dst.shapeid = src.instID;
@@ -621,22 +1010,87 @@ namespace RadeonRays
         dst.uvwt.z = 0;
         dst.uvwt.w = src.tfar;
     }
-    void EmbreeIntersectionDevice::FillIntersection(Intersection& dst, const RTCRay4& src, int i) const
+    template <typename Packet>
+    void EmbreeIntersectionDevice::IntersectPackets(const ray* rays, Intersection* hits, int count) const
     {
-        dst.shapeid = src.instID[i];
-        if (dst.shapeid != RTC_INVALID_GEOMETRY_ID)
+        static int const kWidth = sizeof(Packet::tfar) / sizeof(float);
+
+        Packet data;
+        RTCORE_ALIGN(64) int valid[kWidth];
+
+        for (int i = 0; i < count; i += kWidth)
         {
-            const EmbreeSceneData* kData = static_cast<const EmbreeSceneData*>(rtcGetUserData(m_scene, dst.shapeid));
-            dst.shapeid = kData->mesh_id;
-        }
-        dst.primid = src.primID[i];
+            int rays_count = (i + kWidth) < count ? kWidth : count - i; // count of valid rays
 
-        dst.uvwt.x = src.u[i];
-        dst.uvwt.y = src.v[i];
-        dst.uvwt.z = 0;
-        dst.uvwt.w = src.tfar[i];
+            for (int lane = 0; lane < kWidth; lane += 4)
+            {
+                LoadRays(data, valid, rays + i, rays_count, lane);
+            }
+
+            IntersectPacket(valid, m_scene, data); CheckEmbreeError();
+
+            for (int lane = 0; lane < rays_count; lane += 4)
+            {
+                // Transpose u, v, 0, t back into per ray uvwt
+                __m128 uvwt[4] =
+                {
+                    _mm_load_ps(&data.u[lane]),
+                    _mm_load_ps(&data.v[lane]),
+                    _mm_setzero_ps(),
+                    _mm_load_ps(&data.tfar[lane])
+                };
+
+                _MM_TRANSPOSE4_PS(uvwt[0], uvwt[1], uvwt[2], uvwt[3]);
+
+                for (int k = 0; k < 4 && lane + k < rays_count; ++k)
+                {
+                    Intersection& dst = hits[i + lane + k];
+
+                    dst.shapeid = data.instID[lane + k];
+                    if (dst.shapeid != RTC_INVALID_GEOMETRY_ID)
+                    {
+                        const EmbreeSceneData* kData = static_cast<const EmbreeSceneData*>(rtcGetUserData(m_scene, dst.shapeid));
+                        dst.shapeid = kData->mesh_id;
+                    }
+                    dst.primid = data.primID[lane + k];
+
+                    _mm_storeu_ps(&dst.uvwt.x, uvwt[k]);
+                }
+            }
+        }
     }
 
+    template <typename Packet>
+    void EmbreeIntersectionDevice::OccludePackets(const ray* rays, int* hits, int count) const
+    {
+        static int const kWidth = sizeof(Packet::tfar) / sizeof(float);
+
+        Packet data;
+        RTCORE_ALIGN(64) int valid[kWidth];
+
+        for (int i = 0; i < count; i += kWidth)
+        {
+            int rays_count = (i + kWidth) < count ? kWidth : count - i; // count of valid rays
+
+            for (int lane = 0; lane < kWidth; lane += 4)
+            {
+                LoadRays(data, valid, rays + i, rays_count, lane);
+            }
+
+            OccludePacket(valid, m_scene, data); CheckEmbreeError();
+
+            for (int j = 0; j < rays_count; ++j)
+            {
+                if (data.instID[j] == RTC_INVALID_GEOMETRY_ID || data.geomID[j] == RTC_INVALID_GEOMETRY_ID)
+                {
+                    hits[i + j] = RTC_INVALID_GEOMETRY_ID;
+                    continue;
+                }
+                const EmbreeSceneData* kData = static_cast<const EmbreeSceneData*>(rtcGetUserData(m_scene, data.instID[j]));
+                hits[i + j] = kData->mesh_id;
+            }
+        }
+    }
 
     void EmbreeIntersectionDevice::CheckEmbreeError() const
     {
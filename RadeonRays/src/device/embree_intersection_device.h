@@ -23,6 +23,8 @@ THE SOFTWARE.
 
 #include "intersection_device.h"
 #include <map>
+#include <mutex>
+#include <vector>
 
 #include <embree2/rtcore.h>
 #include "../async/thread_pool.h"
@@ -32,6 +34,7 @@ namespace RadeonRays
     class Mesh;
     class Shape;
     class ShapeImpl;
+    class EmbreeEvent;
     ///< The class represents Embree based intersection device.
     ///< It uses embree RTCDevice abstraction to implement intersection algorithm.
     ///<
@@ -45,23 +48,51 @@ namespace RadeonRays
         //IntersectionDevice
         void Preprocess(World const& world) override;
         Buffer* CreateBuffer(size_t size, void* initdata) const override;
+        Buffer* CreateBufferFromHostPtr(void* ptr, size_t size) const override;
         void DeleteBuffer(Buffer* const) const override;
         void DeleteEvent(Event* const) const override;
+        void JoinEvents(Event const* const* events, int count, Event** event) const override;
         void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const override;
         void UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const override;
         void QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
         void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
         void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
         void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryOcclusionPacked(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryOcclusionPacked(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryIntersectionMulti(Buffer const* rays, Buffer const* numrays, int maxrays, int k, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryIntersectionAttributes(Buffer const* rays, int numrays, int numattributes, Buffer* hits, Buffer* attributes, Event const* waitevent, Event** event) const override;
+        void QueryOcclusionCached(Buffer const* rays, int numrays, Buffer* occluders, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryOverlap(Buffer const* boxes, int count, int maxoverlaps, Buffer* overlaps, Buffer* counts, Event const* waitevent, Event** event) const override;
+        void QueryClosestPoint(Buffer const* points, int count, float maxdist, Buffer* results, Event const* waitevent, Event** event) const override;
+        void QueryIntersection2D(Buffer const* rays, int width, int height, RayOrder order, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryPrimaryPinhole(PinholeCamera const& camera, int width, int height, Buffer* hits, Event const* waitevent, Event** event) const override;
+        void QueryShadowFromHits(Buffer const* rays, Buffer const* hits, int numrays, float3 const& light, float epsilon, Buffer* results, Event const* waitevent, Event** event) const override;
+        void CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* compacted, Buffer* newnumrays, Buffer* indices, Event const* waitevent, Event** event) const override;
+        void SortHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer* indices, Buffer* numhits, Event const* waitevent, Event** event) const override;
     
     protected:
-        RTCScene GetEmbreeMesh(const Mesh*);
+        // Get the scene of the mesh, new scenes are appended to uncommitted
+        // and have to be committed before the top level scene
+        RTCScene GetEmbreeMesh(const Mesh*, std::vector<RTCScene>& uncommitted);
         void UpdateShape(const ShapeImpl*);
         void FillRTCRay(RTCRay& dst, const ray& src) const;
-        void FillRTCRay(RTCRay4& dst, int i, const ray& src) const;
         void FillIntersection(Intersection& dst, const RTCRay& src) const;
-        void FillIntersection(Intersection& dst, const RTCRay4& src, int i) const;
         void CheckEmbreeError() const;
+
+        // Trace all the rays on the calling thread and the pool
+        void IntersectRays(Buffer const* rays, int numrays, Buffer* hits) const;
+        void OccludeRays(Buffer const* rays, int numrays, Buffer* hits) const;
+        // Number of rays in a single parallel_for subrange
+        int GetTaskSize(int numrays) const;
+        // Get a completed event from the pool
+        EmbreeEvent* CreateEvent() const;
+
+        // Trace rays in SoA packets of Packet width (RTCRay4, RTCRay8 or RTCRay16)
+        template <typename Packet> void IntersectPackets(const ray* rays, Intersection* hits, int count) const;
+        template <typename Packet> void OccludePackets(const ray* rays, int* hits, int count) const;
         
         // embree device
         RTCDevice m_device;
@@ -72,6 +103,16 @@ namespace RadeonRays
         //thread pool for parallelizing work with buffers
         mutable thread_pool<void> m_pool;
 
+        // Widest ray packet supported by both the host CPU and embree: 4, 8 or 16
+        int m_packet_width;
+
+        // Events are reused to avoid allocations on each query
+        static const std::size_t EVENT_POOL_INITIAL_SIZE = 100;
+        mutable std::vector<EmbreeEvent*> m_event_pool;
+        mutable std::mutex m_event_pool_mutex;
+
+        friend class EmbreeEvent;
+
         struct EmbreeMesh
         {
             RTCScene scene = nullptr; // scene with mesh geometry
@@ -83,11 +124,13 @@ namespace RadeonRays
         {
             EmbreeSceneData()
                 : scene(nullptr)
+                , mesh(nullptr)
                 , mesh_id(kNullId)
                 , geom(RTC_INVALID_GEOMETRY_ID)
                 , updated(false)
             {}
             RTCScene scene; //instantiated scene
+            const Mesh* mesh; //instantiated mesh, key in m_meshes
             Id mesh_id; //FireRays::Shape id
             unsigned geom; //embree geometry id
             bool updated;  //shows is data updated through last IntersectionDevice::Preprocess call
@@ -0,0 +1,370 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "hybrid_intersection_device.h"
+
+#include "../except/except.h"
+#include "../world/world.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+namespace RadeonRays
+{
+    namespace
+    {
+        // Initial fraction of rays traced on the GPU
+        double const kInitialGpuShare = 0.75;
+        // Neither of the devices gets less than this fraction to keep measuring both
+        double const kMinShare = 0.05;
+        // Weight of the last query in the split update
+        double const kShareSmoothing = 0.25;
+
+        using Clock = std::chrono::high_resolution_clock;
+
+        // Buffer mirrored on both devices, the CPU device copy holds the data
+        class HybridBuffer : public Buffer
+        {
+        public:
+            HybridBuffer(Buffer* g, Buffer* c, size_t s)
+                : gpu(g)
+                , cpu(c)
+                , size(s)
+            {
+            }
+
+            Buffer* gpu;
+            Buffer* cpu;
+            size_t size;
+        };
+
+        // Event for the blocking calls
+        class HybridEvent : public Event
+        {
+        public:
+            bool Complete() const override
+            {
+                return true;
+            }
+
+            void Wait() override
+            {
+            }
+        };
+
+        // Map the buffer contents on the device, blocking
+        void* MapBlocking(IntersectionDevice* device, Buffer* buffer, MapType type, size_t size)
+        {
+            void* data = nullptr;
+            Event* e = nullptr;
+            device->MapBuffer(buffer, type, 0, size, &data, &e);
+            e->Wait();
+            device->DeleteEvent(e);
+            return data;
+        }
+
+        void UnmapBlocking(IntersectionDevice* device, Buffer* buffer, void* data)
+        {
+            Event* e = nullptr;
+            device->UnmapBuffer(buffer, data, &e);
+            e->Wait();
+            device->DeleteEvent(e);
+        }
+    }
+
+    HybridIntersectionDevice::HybridIntersectionDevice(IntersectionDevice* gpu, IntersectionDevice* cpu)
+        : m_gpu(gpu)
+        , m_cpu(cpu)
+        , m_gpu_share(kInitialGpuShare)
+    {
+    }
+
+    HybridIntersectionDevice::~HybridIntersectionDevice()
+    {
+    }
+
+    void HybridIntersectionDevice::Preprocess(World const& world)
+    {
+        // Results are split and merged per ray, so they have to be one int per ray
+        auto compact = world.options_.GetOption("acc.occlusion.compact");
+        ThrowIf(compact && compact->AsFloat() > 0.f, "Hybrid device does not support compact occlusion output.");
+        auto hitformat = world.options_.GetOption("acc.hit.format");
+        ThrowIf(hitformat && hitformat->AsString() == "compact", "Hybrid device does not support compact hit records.");
+        auto rayformat = world.options_.GetOption("acc.ray.format");
+        ThrowIf(rayformat && rayformat->AsString() == "compact", "Hybrid device does not support compact ray records.");
+
+        m_gpu->Preprocess(world);
+        m_cpu->Preprocess(world);
+    }
+
+    Buffer* HybridIntersectionDevice::CreateBuffer(size_t size, void* initdata) const
+    {
+        // GPU copy is uploaded before each query, so it needs no init data
+        return new HybridBuffer(m_gpu->CreateBuffer(size, nullptr, kBufferStream), m_cpu->CreateBuffer(size, initdata), size);
+    }
+
+    Buffer* HybridIntersectionDevice::CreateBufferFromHostPtr(void* ptr, size_t size) const
+    {
+        return new HybridBuffer(m_gpu->CreateBuffer(size, nullptr, kBufferStream), m_cpu->CreateBufferFromHostPtr(ptr, size), size);
+    }
+
+    void HybridIntersectionDevice::DeleteBuffer(Buffer* const buffer) const
+    {
+        auto hybrid_buffer = static_cast<HybridBuffer*>(buffer);
+        m_gpu->DeleteBuffer(hybrid_buffer->gpu);
+        m_cpu->DeleteBuffer(hybrid_buffer->cpu);
+        delete hybrid_buffer;
+    }
+
+    void HybridIntersectionDevice::DeleteEvent(Event* const event) const
+    {
+        delete event;
+    }
+
+    void HybridIntersectionDevice::JoinEvents(Event const* const* events, int count, Event** event) const
+    {
+        // Queries are blocking, so the events are complete already
+        SetEvent(event);
+    }
+
+    void HybridIntersectionDevice::SetEvent(Event** event) const
+    {
+        if (event)
+        {
+            *event = new HybridEvent();
+        }
+    }
+
+    void HybridIntersectionDevice::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const
+    {
+        auto hybrid_buffer = static_cast<HybridBuffer*>(buffer);
+        m_cpu->MapBuffer(hybrid_buffer->cpu, type, offset, size, data, nullptr);
+        SetEvent(event);
+    }
+
+    void HybridIntersectionDevice::UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const
+    {
+        auto hybrid_buffer = static_cast<HybridBuffer*>(buffer);
+        m_cpu->UnmapBuffer(hybrid_buffer->cpu, ptr, nullptr);
+        SetEvent(event);
+    }
+
+    void HybridIntersectionDevice::Query(Buffer const* rays, int numrays, Buffer* hits, size_t hitsize, bool occlusion) const
+    {
+        auto hybrid_rays = static_cast<HybridBuffer const*>(rays);
+        auto hybrid_hits = static_cast<HybridBuffer*>(hits);
+
+        ThrowIf(numrays * sizeof(ray) > hybrid_rays->size || numrays * hitsize > hybrid_hits->size, "Buffer is too small for the query.");
+
+        if (numrays <= 0)
+            return;
+
+        int numgpu = static_cast<int>(numrays * m_gpu_share + 0.5);
+        int numcpu = numrays - numgpu;
+
+        char* host_rays = static_cast<char*>(MapBlocking(m_cpu.get(), hybrid_rays->cpu, kMapRead, hybrid_rays->size));
+        char* host_hits = static_cast<char*>(MapBlocking(m_cpu.get(), hybrid_hits->cpu, kMapWrite, hybrid_hits->size));
+
+        auto start = Clock::now();
+
+        // Upload and start the GPU part first, it runs while the CPU traces its own part.
+        // Device queues are in order, so there is no need to wait for the upload.
+        Event* gpu_event = nullptr;
+        if (numgpu > 0)
+        {
+            void* gpu_rays = MapBlocking(m_gpu.get(), hybrid_rays->gpu, kMapWrite, numgpu * sizeof(ray));
+            std::memcpy(gpu_rays, host_rays, numgpu * sizeof(ray));
+
+            Event* e = nullptr;
+            m_gpu->UnmapBuffer(hybrid_rays->gpu, gpu_rays, &e);
+            m_gpu->DeleteEvent(e);
+
+            if (occlusion)
+                m_gpu->QueryOcclusion(hybrid_rays->gpu, numgpu, hybrid_hits->gpu, nullptr, &gpu_event);
+            else
+                m_gpu->QueryIntersection(hybrid_rays->gpu, numgpu, hybrid_hits->gpu, nullptr, &gpu_event);
+        }
+
+        // Trace the rest in place in host memory
+        if (numcpu > 0)
+        {
+            Buffer* cpu_rays = m_cpu->CreateBufferFromHostPtr(host_rays + numgpu * sizeof(ray), numcpu * sizeof(ray));
+            Buffer* cpu_hits = m_cpu->CreateBufferFromHostPtr(host_hits + numgpu * hitsize, numcpu * hitsize);
+
+            if (occlusion)
+                m_cpu->QueryOcclusion(cpu_rays, numcpu, cpu_hits, nullptr, nullptr);
+            else
+                m_cpu->QueryIntersection(cpu_rays, numcpu, cpu_hits, nullptr, nullptr);
+
+            m_cpu->DeleteBuffer(cpu_rays);
+            m_cpu->DeleteBuffer(cpu_hits);
+        }
+
+        auto cpu_done = Clock::now();
+
+        if (numgpu > 0)
+        {
+            bool gpu_finished_first = gpu_event->Complete();
+            gpu_event->Wait();
+            m_gpu->DeleteEvent(gpu_event);
+
+            auto gpu_done = Clock::now();
+
+            // Merge GPU hits into the host copy
+            void* gpu_hits = MapBlocking(m_gpu.get(), hybrid_hits->gpu, kMapRead, numgpu * hitsize);
+            std::memcpy(host_hits, gpu_hits, numgpu * hitsize);
+            UnmapBlocking(m_gpu.get(), hybrid_hits->gpu, gpu_hits);
+
+            // Rebalance the split. If the GPU finished later both times are known and
+            // the split balancing them is computed from measured throughputs, otherwise
+            // GPU time is unknown, so just move some work to the GPU.
+            double target = m_gpu_share;
+            if (!gpu_finished_first && numcpu > 0)
+            {
+                double gpu_time = std::chrono::duration<double>(gpu_done - start).count();
+                double cpu_time = std::chrono::duration<double>(cpu_done - start).count();
+
+                double gpu_throughput = numgpu / std::max(gpu_time, 1e-6);
+                double cpu_throughput = numcpu / std::max(cpu_time, 1e-6);
+
+                target = gpu_throughput / (gpu_throughput + cpu_throughput);
+            }
+            else if (gpu_finished_first)
+            {
+                target = m_gpu_share + (1.0 - m_gpu_share) * 0.5;
+            }
+
+            m_gpu_share += (target - m_gpu_share) * kShareSmoothing;
+        }
+        else
+        {
+            // Only the CPU traced, give some work back to the GPU
+            m_gpu_share += kShareSmoothing * kMinShare;
+        }
+
+        m_gpu_share = std::min(std::max(m_gpu_share, kMinShare), 1.0 - kMinShare);
+
+        m_cpu->UnmapBuffer(hybrid_hits->cpu, host_hits, nullptr);
+        m_cpu->UnmapBuffer(hybrid_rays->cpu, host_rays, nullptr);
+    }
+
+    int HybridIntersectionDevice::GetNumRays(Buffer const* numrays, int maxrays) const
+    {
+        auto hybrid_numrays = static_cast<HybridBuffer const*>(numrays);
+
+        int* count = static_cast<int*>(MapBlocking(m_cpu.get(), hybrid_numrays->cpu, kMapRead, sizeof(int)));
+        int result = std::min(*count, maxrays);
+        m_cpu->UnmapBuffer(hybrid_numrays->cpu, count, nullptr);
+
+        return result;
+    }
+
+    void HybridIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Query(rays, numrays, hits, sizeof(Intersection), false);
+        SetEvent(event);
+    }
+
+    void HybridIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Query(rays, numrays, hits, sizeof(int), true);
+        SetEvent(event);
+    }
+
+    void HybridIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Query(rays, GetNumRays(numrays, maxrays), hits, sizeof(Intersection), false);
+        SetEvent(event);
+    }
+
+    void HybridIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Query(rays, GetNumRays(numrays, maxrays), hits, sizeof(int), true);
+        SetEvent(event);
+    }
+
+    void HybridIntersectionDevice::QueryOcclusionPacked(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Throw("Packed occlusion queries are not supported by hybrid device.");
+    }
+
+    void HybridIntersectionDevice::QueryOcclusionPacked(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Throw("Packed occlusion queries are not supported by hybrid device.");
+    }
+
+    void HybridIntersectionDevice::QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Throw("Multi-hit queries are not supported by hybrid device.");
+    }
+
+    void HybridIntersectionDevice::QueryIntersectionMulti(Buffer const* rays, Buffer const* numrays, int maxrays, int k, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Throw("Multi-hit queries are not supported by hybrid device.");
+    }
+
+    void HybridIntersectionDevice::QueryIntersectionAttributes(Buffer const* rays, int numrays, int numattributes, Buffer* hits, Buffer* attributes, Event const* waitevent, Event** event) const
+    {
+        Throw("Attribute queries are not supported by hybrid device.");
+    }
+
+    void HybridIntersectionDevice::QueryOcclusionCached(Buffer const* rays, int numrays, Buffer* occluders, Buffer* hitresults, Event const* waitevent, Event** event) const
+    {
+        Throw("Occluder caching is not supported by hybrid device.");
+    }
+
+    void HybridIntersectionDevice::QueryOverlap(Buffer const* boxes, int count, int maxoverlaps, Buffer* overlaps, Buffer* counts, Event const* waitevent, Event** event) const
+    {
+        Throw("Overlap queries are not supported by hybrid device.");
+    }
+
+    void HybridIntersectionDevice::QueryClosestPoint(Buffer const* points, int count, float maxdist, Buffer* results, Event const* waitevent, Event** event) const
+    {
+        Throw("Closest point queries are not supported by hybrid device.");
+    }
+
+    void HybridIntersectionDevice::QueryIntersection2D(Buffer const* rays, int width, int height, RayOrder order, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        // Rays are traversed in scanline order, the hits are the same
+        QueryIntersection(rays, width * height, hits, waitevent, event);
+    }
+
+    void HybridIntersectionDevice::QueryPrimaryPinhole(PinholeCamera const& camera, int width, int height, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Throw("Built-in ray generators are not supported by hybrid device.");
+    }
+
+    void HybridIntersectionDevice::QueryShadowFromHits(Buffer const* rays, Buffer const* hits, int numrays, float3 const& light, float epsilon, Buffer* results, Event const* waitevent, Event** event) const
+    {
+        Throw("Built-in ray generators are not supported by hybrid device.");
+    }
+
+    void HybridIntersectionDevice::CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* compacted, Buffer* newnumrays, Buffer* indices, Event const* waitevent, Event** event) const
+    {
+        Throw("Ray compaction is not supported by hybrid device.");
+    }
+
+    void HybridIntersectionDevice::SortHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer* indices, Buffer* numhits, Event const* waitevent, Event** event) const
+    {
+        Throw("Hit sorting is not supported by hybrid device.");
+    }
+}
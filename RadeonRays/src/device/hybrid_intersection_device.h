@@ -0,0 +1,101 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "intersection_device.h"
+
+#include <memory>
+
+namespace RadeonRays
+{
+    ///< The class represents a device splitting each query between a GPU (Calc)
+    ///< device and a CPU device. CPU part of a batch is traced in place
+    ///< in host memory while the GPU part is uploaded, traced and copied back,
+    ///< so buffers always hold merged results on the host side. The split
+    ///< follows throughput of both devices measured on previous queries.
+    ///<
+    class HybridIntersectionDevice : public IntersectionDevice
+    {
+    public:
+        // Takes ownership of both devices
+        HybridIntersectionDevice(IntersectionDevice* gpu, IntersectionDevice* cpu);
+        ~HybridIntersectionDevice();
+
+        void Preprocess(World const& world) override;
+
+        Buffer* CreateBuffer(size_t size, void* initdata) const override;
+        Buffer* CreateBufferFromHostPtr(void* ptr, size_t size) const override;
+
+        void DeleteBuffer(Buffer* const) const override;
+
+        void DeleteEvent(Event* const) const override;
+        void JoinEvents(Event const* const* events, int count, Event** event) const override;
+
+        void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const override;
+
+        void UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const override;
+
+        // Queries are blocking, returned events are already complete
+        void QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryOcclusionPacked(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryOcclusionPacked(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryIntersectionMulti(Buffer const* rays, Buffer const* numrays, int maxrays, int k, Buffer* hits, Event const* waitevent, Event** event) const override;
+        void QueryIntersectionAttributes(Buffer const* rays, int numrays, int numattributes, Buffer* hits, Buffer* attributes, Event const* waitevent, Event** event) const override;
+        void QueryOcclusionCached(Buffer const* rays, int numrays, Buffer* occluders, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryOverlap(Buffer const* boxes, int count, int maxoverlaps, Buffer* overlaps, Buffer* counts, Event const* waitevent, Event** event) const override;
+        void QueryClosestPoint(Buffer const* points, int count, float maxdist, Buffer* results, Event const* waitevent, Event** event) const override;
+
+        void QueryIntersection2D(Buffer const* rays, int width, int height, RayOrder order, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryPrimaryPinhole(PinholeCamera const& camera, int width, int height, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryShadowFromHits(Buffer const* rays, Buffer const* hits, int numrays, float3 const& light, float epsilon, Buffer* results, Event const* waitevent, Event** event) const override;
+
+        void CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* compacted, Buffer* newnumrays, Buffer* indices, Event const* waitevent, Event** event) const override;
+        void SortHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer* indices, Buffer* numhits, Event const* waitevent, Event** event) const override;
+
+    private:
+        // Trace the batch on both devices, hitsize is the size of a single hit record
+        void Query(Buffer const* rays, int numrays, Buffer* hits, size_t hitsize, bool occlusion) const;
+        // Read number of rays from a buffer
+        int GetNumRays(Buffer const* numrays, int maxrays) const;
+        // Create a complete event if requested
+        void SetEvent(Event** event) const;
+
+        std::unique_ptr<IntersectionDevice> m_gpu;
+        std::unique_ptr<IntersectionDevice> m_cpu;
+
+        // Fraction of rays traced on the GPU
+        mutable double m_gpu_share;
+    };
+}
@@ -0,0 +1,224 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "intersection_device.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <memory>
+
+namespace RadeonRays
+{
+    namespace
+    {
+        // Blocking map of a whole stream, unmapped when the scope ends
+        class StreamMapping
+        {
+        public:
+            StreamMapping(IntersectionDevice const& device, Buffer const* buffer, MapType type, size_t size)
+                : m_device(device)
+                , m_buffer(const_cast<Buffer*>(buffer))
+                , m_data(nullptr)
+            {
+                if (m_buffer)
+                {
+                    m_device.MapBuffer(m_buffer, type, 0, size, &m_data, nullptr);
+                }
+            }
+
+            ~StreamMapping()
+            {
+                if (m_buffer)
+                {
+                    m_device.UnmapBuffer(m_buffer, m_data, nullptr);
+                }
+            }
+
+            template <typename T>
+            T* Get() const { return static_cast<T*>(m_data); }
+
+            StreamMapping(StreamMapping const&) = delete;
+            StreamMapping& operator = (StreamMapping const&) = delete;
+
+        private:
+            IntersectionDevice const& m_device;
+            Buffer* m_buffer;
+            void* m_data;
+        };
+
+        // Build ray records of the streams on the host
+        Buffer* CreateRayRecords(IntersectionDevice const& device, RayLayout const& rays, int numrays, Event const* waitevent)
+        {
+            if (waitevent)
+            {
+                const_cast<Event*>(waitevent)->Wait();
+            }
+
+            std::vector<ray> records(numrays);
+            {
+                StreamMapping origins(device, rays.origins, kMapRead, numrays * 3 * sizeof(float));
+                StreamMapping directions(device, rays.directions, kMapRead, numrays * 3 * sizeof(float));
+                StreamMapping maxt(device, rays.maxt, kMapRead, numrays * sizeof(float));
+                StreamMapping masks(device, rays.masks, kMapRead, numrays * sizeof(int));
+
+                for (int i = 0; i < numrays; ++i)
+                {
+                    float const* o = origins.Get<float>() + 3 * i;
+                    float const* d = directions.Get<float>() + 3 * i;
+                    records[i].o = float3(o[0], o[1], o[2]);
+                    records[i].d = float3(d[0], d[1], d[2]);
+                    records[i].SetMaxT(rays.maxt ? maxt.Get<float>()[i] : std::numeric_limits<float>::max());
+                    records[i].SetTime(0.f);
+                    records[i].SetMask(rays.masks ? masks.Get<int>()[i] : 0xFFFFFFFF);
+                    records[i].SetActive(true);
+                }
+            }
+
+            return device.CreateBuffer(numrays * sizeof(ray), records.data());
+        }
+    }
+
+    void IntersectionDevice::QueryIntersection(RayLayout const& rays, int numrays, HitLayout const& hits, Event const* waitevent, Event** event) const
+    {
+        // Records are built and split on the host around a blocking query
+        if (numrays > 0)
+        {
+            auto deleter = [this](Buffer* buffer) { DeleteBuffer(buffer); };
+            std::unique_ptr<Buffer, decltype(deleter)> ray_buffer(CreateRayRecords(*this, rays, numrays, waitevent), deleter);
+            std::unique_ptr<Buffer, decltype(deleter)> hit_buffer(CreateBuffer(numrays * sizeof(Intersection), nullptr), deleter);
+            QueryIntersection(ray_buffer.get(), numrays, hit_buffer.get(), nullptr, nullptr);
+
+            StreamMapping records(*this, hit_buffer.get(), kMapRead, numrays * sizeof(Intersection));
+            StreamMapping shapeids(*this, hits.shapeids, kMapWrite, numrays * sizeof(Id));
+            StreamMapping primids(*this, hits.primids, kMapWrite, numrays * sizeof(Id));
+            StreamMapping uvs(*this, hits.uvs, kMapWrite, numrays * 2 * sizeof(float));
+            StreamMapping distances(*this, hits.distances, kMapWrite, numrays * sizeof(float));
+
+            for (int i = 0; i < numrays; ++i)
+            {
+                auto const& hit = records.Get<Intersection>()[i];
+
+                if (hits.shapeids)
+                {
+                    shapeids.Get<Id>()[i] = hit.shapeid;
+                }
+
+                if (hits.primids)
+                {
+                    primids.Get<Id>()[i] = hit.primid;
+                }
+
+                // Barycentrics and distances of missed rays are left untouched as in hit records
+                if (hit.shapeid != kNullId)
+                {
+                    if (hits.uvs)
+                    {
+                        uvs.Get<float>()[2 * i] = hit.uvwt.x;
+                        uvs.Get<float>()[2 * i + 1] = hit.uvwt.y;
+                    }
+
+                    if (hits.distances)
+                    {
+                        distances.Get<float>()[i] = hit.uvwt.w;
+                    }
+                }
+            }
+        }
+
+        if (event)
+        {
+            JoinEvents(nullptr, 0, event);
+        }
+    }
+
+    void IntersectionDevice::QueryOcclusion(RayLayout const& rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        // Records are built on the host, results are a stream already
+        if (numrays > 0)
+        {
+            auto deleter = [this](Buffer* buffer) { DeleteBuffer(buffer); };
+            std::unique_ptr<Buffer, decltype(deleter)> ray_buffer(CreateRayRecords(*this, rays, numrays, waitevent), deleter);
+            QueryOcclusion(ray_buffer.get(), numrays, hits, nullptr, nullptr);
+        }
+
+        if (event)
+        {
+            JoinEvents(nullptr, 0, event);
+        }
+    }
+
+    void IntersectionDevice::QueryDistance(Buffer const* rays, int numrays, Buffer* distances, Event const* waitevent, Event** event) const
+    {
+        // Hits are reduced on the host after a blocking query
+        if (numrays > 0)
+        {
+            // Inactive rays leave their records untouched, so they start as misses
+            std::vector<Intersection> records(numrays);
+            auto deleter = [this](Buffer* buffer) { DeleteBuffer(buffer); };
+            std::unique_ptr<Buffer, decltype(deleter)> hit_buffer(CreateBuffer(numrays * sizeof(Intersection), records.data()), deleter);
+            QueryIntersection(rays, numrays, hit_buffer.get(), waitevent, nullptr);
+
+            StreamMapping hits(*this, hit_buffer.get(), kMapRead, numrays * sizeof(Intersection));
+            StreamMapping output(*this, distances, kMapWrite, numrays * sizeof(float));
+
+            for (int i = 0; i < numrays; ++i)
+            {
+                auto const& hit = hits.Get<Intersection>()[i];
+                output.Get<float>()[i] = hit.shapeid != kNullId ? hit.uvwt.w : -1.f;
+            }
+        }
+
+        if (event)
+        {
+            JoinEvents(nullptr, 0, event);
+        }
+    }
+
+    void IntersectionDevice::QueryOcclusionCount(Buffer const* rays, int numrays, int groupsize, Buffer* counts, Event const* waitevent, Event** event) const
+    {
+        // Results are reduced on the host after a blocking query
+        if (numrays > 0)
+        {
+            // Inactive rays leave their results untouched, so they start as misses
+            std::vector<int> results(numrays, -1);
+            auto deleter = [this](Buffer* buffer) { DeleteBuffer(buffer); };
+            std::unique_ptr<Buffer, decltype(deleter)> result_buffer(CreateBuffer(numrays * sizeof(int), results.data()), deleter);
+            QueryOcclusion(rays, numrays, result_buffer.get(), waitevent, nullptr);
+
+            int const numgroups = (numrays + groupsize - 1) / groupsize;
+            StreamMapping occluded(*this, result_buffer.get(), kMapRead, numrays * sizeof(int));
+            StreamMapping output(*this, counts, kMapWrite, numgroups * sizeof(int));
+
+            for (int group = 0; group < numgroups; ++group)
+            {
+                int const begin = group * groupsize;
+                int const end = std::min(begin + groupsize, numrays);
+                output.Get<int>()[group] = static_cast<int>(std::count(occluded.Get<int>() + begin, occluded.Get<int>() + end, 1));
+            }
+        }
+
+        if (event)
+        {
+            JoinEvents(nullptr, 0, event);
+        }
+    }
+}
@@ -25,6 +25,8 @@ THE SOFTWARE.
 #define INTERSECTION_DEVICE_H
 #include "radeon_rays.h"
 
+#include <vector>
+
 namespace RadeonRays
 {
     class World;
@@ -41,16 +43,58 @@ namespace RadeonRays
         // The call is blocking.
         virtual void Preprocess(World const& world) = 0;
 
+        // Returns true if PreprocessConcurrent is supported.
+        virtual bool SupportsConcurrentPreprocess() const { return false; }
+
+        // Do the preprocessing into a separate copy of the scene data and make
+        // it current once done, queries keep using the previous one meanwhile.
+        // The call is blocking and meant to be done from a worker thread.
+        virtual void PreprocessConcurrent(World const& world) { Preprocess(world); }
+
+        // Returns true if meshes reading their geometry from device buffers can be committed.
+        virtual bool SupportsDeviceMeshes() const { return false; }
+
+        // Returns true if shapes of analytic spheres can be committed.
+        virtual bool SupportsSpheres() const { return false; }
+
+        // Returns true if instances of groups, and so nested instances, can be committed.
+        virtual bool SupportsNestedInstances() const { return false; }
+
+        // Returns true if queries test ray masks against shape masks, which scene layers rely on.
+        virtual bool SupportsRayMasks() const { return false; }
+
+        // Get kernel times collected while the "profile.kernels" option is set.
+        // The call is blocking.
+        virtual void GetKernelProfile(std::vector<KernelProfile>& profile) const { profile.clear(); }
+
+        // Drop accumulated kernel times
+        virtual void ResetKernelProfile() {}
+
+        // Get statistics of the acceleration structure built by the last preprocessing
+        virtual void GetStats(AccelStats& stats) const { stats = AccelStats(); }
+
         // Create a buffer of a specified size with specified initial data.
         // if initdata == nullptr the buffer is allocated, but not initialized.
         virtual Buffer* CreateBuffer(size_t size, void* initdata) const = 0;
 
+        // Create a buffer placed according to the usage hint,
+        // devices without host accessible memory ignore the hint.
+        virtual Buffer* CreateBuffer(size_t size, void* initdata, BufferUsage usage) const { return CreateBuffer(size, initdata); }
+
+        // Create a buffer referencing host memory, no copies are made.
+        // The memory should outlive the buffer.
+        virtual Buffer* CreateBufferFromHostPtr(void* ptr, size_t size) const = 0;
+
         // Release buffer memory.
         virtual void DeleteBuffer(Buffer* const) const = 0;
 
         // Release an event (this method is optimized for frequent calls)
         virtual void DeleteEvent(Event* const) const = 0;
 
+        // Event of the device completing once all the events of the device are complete,
+        // the device waits for them without blocking the call where it can
+        virtual void JoinEvents(Event const* const* events, int count, Event** event) const = 0;
+
         // Map buffer data.
         // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
         virtual void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const = 0;
@@ -73,6 +117,36 @@ namespace RadeonRays
         // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
         virtual void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
 
+        // Run count queries in order as by QueryIntersection and QueryOcclusion, the descriptions are valid.
+        // Devices able to traverse several queries at once override it.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void SubmitQueries(QueryDesc const* descs, int count, Event const* waitevent, Event** event) const;
+
+        // Find intersection for rays in structure of arrays layout and split the hits into streams, the layouts are valid.
+        // Devices able to convert the layouts where the buffers live override it, the default converts them on the host.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryIntersection(RayLayout const& rays, int numrays, HitLayout const& hits, Event const* waitevent, Event** event) const;
+
+        // Find if rays in structure of arrays layout intersect any of the primitives in the scene, the layout is valid.
+        // hits is assumed AOS with elements of type int (-1 if no intersection, 1 otherwise).
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryOcclusion(RayLayout const& rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const;
+
+        // Find closest intersection distances, distances is assumed an array of numrays floats (-1 if no intersection).
+        // Devices able to reduce the hits where they live override it, the default reduces them on the host.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryDistance(Buffer const* rays, int numrays, Buffer* distances, Event const* waitevent, Event** event) const;
+
+        // Count occluded rays per group of groupsize rays, counts is assumed an array of (numrays + groupsize - 1) / groupsize ints.
+        // Devices able to reduce the results where they live override it, the default reduces them on the host.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryOcclusionCount(Buffer const* rays, int numrays, int groupsize, Buffer* counts, Event const* waitevent, Event** event) const;
+
         // Find intersection for the rays in rays buffer and write them into hits buffer. Take the number of rays from the buffer in remote memory.
         // rays is assumed AOS with elements of type RadeonRays::ray.
         // numrays is assumed an array with a single int element.
@@ -88,10 +162,152 @@ namespace RadeonRays
         // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
         // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
         virtual void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+
+        // Find if the rays in rays buffer intersect any of the primitives in the scene.
+        // rays is assumed AOS with elements of type RadeonRays::ray.
+        // hits is assumed an array of (numrays + 31) / 32 uint32 words, bit i % 32 of word i / 32 is set if ray i is occluded.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryOcclusionPacked(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+
+        // Find if the rays in rays buffer intersect any of the primitives in the scene writing 1 bit per ray.
+        // Take the number of rays from the buffer in remote memory.
+        // rays is assumed AOS with elements of type RadeonRays::ray.
+        // numrays is assumed an array with a single int element.
+        // hits is assumed an array of (maxrays + 31) / 32 uint32 words.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryOcclusionPacked(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+
+        // Find k closest intersections of the rays in rays buffer in a single traversal.
+        // rays is assumed AOS with elements of type RadeonRays::ray.
+        // hits is assumed AOS of numrays * k elements of type RadeonRays::Intersection, sorted by distance per ray.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+
+        // Find k closest intersections of the rays in rays buffer in a single traversal.
+        // Take the number of rays from the buffer in remote memory.
+        // rays is assumed AOS with elements of type RadeonRays::ray.
+        // numrays is assumed an array with a single int element.
+        // hits is assumed AOS of maxrays * k elements of type RadeonRays::Intersection.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryIntersectionMulti(Buffer const* rays, Buffer const* numrays, int maxrays, int k, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+
+        // Find closest intersections and interpolate vertex attributes of the hit faces in the same pass.
+        // rays is assumed AOS with elements of type RadeonRays::ray, hits AOS with elements of type RadeonRays::Intersection.
+        // attributes is assumed an array of numrays * numattributes float4 elements.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryIntersectionAttributes(Buffer const* rays, int numrays, int numattributes, Buffer* hits, Buffer* attributes, Event const* waitevent, Event** event) const = 0;
+
+        // Find any intersection testing the last occluder of every ray before traversal and store the new ones.
+        // rays is assumed AOS with elements of type RadeonRays::ray, occluders and hitresults arrays of numrays int elements.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryOcclusionCached(Buffer const* rays, int numrays, Buffer* occluders, Buffer* hitresults, Event const* waitevent, Event** event) const = 0;
+
+        // Find primitives overlapping axis aligned boxes.
+        // boxes is assumed an array of count elements of type RadeonRays::bbox, overlaps AOS of count * maxoverlaps
+        // elements of type RadeonRays::Overlap and counts an array of count int elements.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryOverlap(Buffer const* boxes, int count, int maxoverlaps, Buffer* overlaps, Buffer* counts, Event const* waitevent, Event** event) const = 0;
+
+        // Find the closest surface points within maxdist.
+        // points is assumed an array of count elements of type RadeonRays::float3 and results AOS of count
+        // elements of type RadeonRays::ClosestPoint.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryClosestPoint(Buffer const* points, int count, float maxdist, Buffer* results, Event const* waitevent, Event** event) const = 0;
+
+        // Find closest intersections of a width x height image-shaped batch traversed in the given order of its pixels.
+        // rays is assumed AOS of width * height elements of type RadeonRays::ray, hits is assumed AOS of width * height elements
+        // of type RadeonRays::Intersection and is written in the original ray order.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryIntersection2D(Buffer const* rays, int width, int height, RayOrder order, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+
+        // Find closest intersections of the primary rays of a width x height pinhole camera generated on the device.
+        // hits is assumed AOS of width * height elements of type RadeonRays::Intersection, hit i belongs to pixel (i % width, i / width).
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryPrimaryPinhole(PinholeCamera const& camera, int width, int height, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+
+        // Find any intersection of shadow rays generated on the device from the closest hits of rays towards a point light.
+        // rays is assumed AOS with elements of type RadeonRays::ray, hits AOS of numrays elements of type RadeonRays::Intersection.
+        // results is assumed an array of numrays int elements.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryShadowFromHits(Buffer const* rays, Buffer const* hits, int numrays, float3 const& light, float epsilon, Buffer* results, Event const* waitevent, Event** event) const = 0;
+
+        // Copy the active rays, or rays with a non-zero int in predicate if it isn't nullptr, of the first numrays rays to compacted.
+        // numrays and newnumrays are assumed arrays with a single int element, indices an array of maxrays int elements or nullptr.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* compacted, Buffer* newnumrays, Buffer* indices, Event const* waitevent, Event** event) const = 0;
+
+        // Sort indices of the first numrays rays by the shape ID of their closest hits, missed rays last.
+        // numrays and numhits are assumed arrays with a single int element, numhits might be nullptr, indices an array of maxrays int elements.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void SortHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer* indices, Buffer* numhits, Event const* waitevent, Event** event) const = 0;
+
+        // Get the number of queues work can be submitted to.
+        virtual std::uint32_t GetQueueCount() const { return 1; }
+
+        // Select the queue for subsequent calls. Devices with a single queue ignore it.
+        virtual void SetQueue(std::uint32_t queue) {}
+
+        // Select the queue of the priority class for subsequent calls. Devices with a single queue ignore it.
+        virtual void SetQueryPriority(QueryPriority priority) {}
+
+        // Hint the kind of rays of subsequent queries. Devices with a single traversal ignore it.
+        virtual void SetQueryHint(QueryHint hint) {}
+
+        // Set the buffer of per-ray traversal counters of subsequent closest hit queries. Devices without counters ignore it.
+        virtual void SetTraversalStatsBuffer(Buffer* stats) {}
+
+        // Create a device querying the scene of the last preprocessing in the same device memory,
+        // with its own queue and events. Its scene can't be changed and later preprocessing of
+        // this device doesn't affect it. Returns nullptr if the device can't share its scene.
+        virtual IntersectionDevice* CreateSnapshot() const { return nullptr; }
     
         IntersectionDevice(IntersectionDevice const&) = delete;
         IntersectionDevice& operator = (IntersectionDevice const&) = delete;
     };
+
+    inline void IntersectionDevice::SubmitQueries(QueryDesc const* descs, int count, Event const* waitevent, Event** event) const
+    {
+        // Every query waits for waitevent, their events are joined into the returned one
+        std::vector<Event*> events(event ? count : 0, nullptr);
+
+        for (int i = 0; i < count; ++i)
+        {
+            auto const& desc = descs[i];
+            auto query_event = event ? &events[i] : nullptr;
+
+            if (desc.type == kQueryOcclusion)
+            {
+                QueryOcclusion(desc.rays, desc.numrays, desc.hits, waitevent, query_event);
+            }
+            else
+            {
+                QueryIntersection(desc.rays, desc.numrays, desc.hits, waitevent, query_event);
+            }
+        }
+
+        if (event)
+        {
+            JoinEvents(events.data(), count, event);
+
+            for (auto e : events)
+            {
+                DeleteEvent(e);
+            }
+        }
+    }
 }
 
 
@@ -0,0 +1,451 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "multi_intersection_device.h"
+
+#include "../except/except.h"
+#include "../world/world.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace RadeonRays
+{
+    namespace
+    {
+        // Device ranges are aligned to this number of rays
+        int const kRangeAlignment = 64;
+
+        struct PendingQuery;
+
+        // Buffer contents live in host memory, device copies are holding
+        // query ranges only and are allocated on first use
+        class MultiBuffer : public Buffer
+        {
+        public:
+            MultiBuffer(size_t s, void* host_ptr, size_t numdevices)
+                : size(s)
+                , device_buffers(numdevices, nullptr)
+            {
+                if (host_ptr)
+                {
+                    data = static_cast<char*>(host_ptr);
+                }
+                else
+                {
+                    storage.resize(size);
+                    data = storage.data();
+                }
+            }
+
+            char* data;
+            size_t size;
+            std::vector<char> storage;
+            std::vector<Buffer*> device_buffers;
+            // Query writing to the buffer which results are not gathered yet
+            std::shared_ptr<PendingQuery> pending;
+        };
+
+        // Query running on the devices
+        struct PendingQuery
+        {
+            struct Range
+            {
+                IntersectionDevice* device;
+                Buffer* hits;
+                Event* event;
+                int begin;
+                int end;
+            };
+
+            PendingQuery(MultiBuffer* h, size_t s)
+                : hits(h)
+                , hitsize(s)
+                , done(false)
+            {
+            }
+
+            bool Complete() const
+            {
+                return done || std::all_of(ranges.cbegin(), ranges.cend(), [](Range const& r) { return r.event->Complete(); });
+            }
+
+            // Wait for the devices and gather the hits
+            void Resolve()
+            {
+                if (done)
+                    return;
+
+                done = true;
+
+                for (auto& r : ranges)
+                {
+                    r.event->Wait();
+                    r.device->DeleteEvent(r.event);
+
+                    void* data = nullptr;
+                    Event* e = nullptr;
+                    size_t size = (r.end - r.begin) * hitsize;
+                    r.device->MapBuffer(r.hits, kMapRead, 0, size, &data, &e);
+                    e->Wait();
+                    r.device->DeleteEvent(e);
+
+                    std::memcpy(hits->data + r.begin * hitsize, data, size);
+
+                    r.device->UnmapBuffer(r.hits, data, &e);
+                    e->Wait();
+                    r.device->DeleteEvent(e);
+                }
+            }
+
+            MultiBuffer* hits;
+            size_t hitsize;
+            std::vector<Range> ranges;
+            bool done;
+        };
+
+        // Event of all the devices participating in the call
+        class MultiEvent : public Event
+        {
+        public:
+            explicit MultiEvent(std::shared_ptr<PendingQuery> p = nullptr)
+                : pending(p)
+            {
+            }
+
+            bool Complete() const override
+            {
+                return !pending || pending->Complete();
+            }
+
+            void Wait() override
+            {
+                if (pending)
+                {
+                    pending->Resolve();
+                }
+            }
+
+            std::shared_ptr<PendingQuery> pending;
+        };
+
+        // Gather results of the query writing to the buffer
+        void ResolvePending(MultiBuffer const* buffer)
+        {
+            if (buffer->pending)
+            {
+                buffer->pending->Resolve();
+            }
+        }
+
+        // Gather results of the query the event belongs to
+        void ResolvePending(Event const* event)
+        {
+            auto multi_event = static_cast<MultiEvent const*>(event);
+
+            if (multi_event && multi_event->pending)
+            {
+                multi_event->pending->Resolve();
+            }
+        }
+
+        Buffer* GetDeviceBuffer(IntersectionDevice* device, MultiBuffer const* buffer, std::size_t idx)
+        {
+            auto& device_buffer = const_cast<MultiBuffer*>(buffer)->device_buffers[idx];
+
+            if (!device_buffer)
+            {
+                // Ranges are copied from and to the host on every query
+                device_buffer = device->CreateBuffer(buffer->size, nullptr, kBufferStream);
+            }
+
+            return device_buffer;
+        }
+    }
+
+    MultiIntersectionDevice::MultiIntersectionDevice(std::vector<IntersectionDevice*> const& devices)
+    {
+        for (auto device : devices)
+        {
+            m_devices.emplace_back(device);
+        }
+    }
+
+    MultiIntersectionDevice::~MultiIntersectionDevice()
+    {
+    }
+
+    void MultiIntersectionDevice::Preprocess(World const& world)
+    {
+        // Results are split and merged per ray, so they have to be one int per ray
+        auto compact = world.options_.GetOption("acc.occlusion.compact");
+        ThrowIf(compact && compact->AsFloat() > 0.f, "Multi device does not support compact occlusion output.");
+        auto hitformat = world.options_.GetOption("acc.hit.format");
+        ThrowIf(hitformat && hitformat->AsString() == "compact", "Multi device does not support compact hit records.");
+        auto rayformat = world.options_.GetOption("acc.ray.format");
+        ThrowIf(rayformat && rayformat->AsString() == "compact", "Multi device does not support compact ray records.");
+
+        for (auto& device : m_devices)
+        {
+            device->Preprocess(world);
+        }
+    }
+
+    Buffer* MultiIntersectionDevice::CreateBuffer(size_t size, void* initdata) const
+    {
+        auto buffer = new MultiBuffer(size, nullptr, m_devices.size());
+
+        if (initdata)
+        {
+            std::memcpy(buffer->data, initdata, size);
+        }
+
+        return buffer;
+    }
+
+    Buffer* MultiIntersectionDevice::CreateBufferFromHostPtr(void* ptr, size_t size) const
+    {
+        return new MultiBuffer(size, ptr, m_devices.size());
+    }
+
+    void MultiIntersectionDevice::DeleteBuffer(Buffer* const buffer) const
+    {
+        auto multi_buffer = static_cast<MultiBuffer*>(buffer);
+
+        ResolvePending(multi_buffer);
+
+        for (std::size_t i = 0; i < m_devices.size(); ++i)
+        {
+            if (multi_buffer->device_buffers[i])
+            {
+                m_devices[i]->DeleteBuffer(multi_buffer->device_buffers[i]);
+            }
+        }
+
+        delete multi_buffer;
+    }
+
+    void MultiIntersectionDevice::DeleteEvent(Event* const event) const
+    {
+        delete event;
+    }
+
+    void MultiIntersectionDevice::JoinEvents(Event const* const* events, int count, Event** event) const
+    {
+        // Results are gathered on the host, so the queries are resolved right away
+        for (int i = 0; i < count; ++i)
+        {
+            ResolvePending(events[i]);
+        }
+
+        *event = new MultiEvent();
+    }
+
+    void MultiIntersectionDevice::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const
+    {
+        auto multi_buffer = static_cast<MultiBuffer*>(buffer);
+
+        ThrowIf(offset + size > multi_buffer->size, "Map range is out of buffer bounds.");
+
+        ResolvePending(multi_buffer);
+
+        *data = multi_buffer->data + offset;
+
+        if (event)
+        {
+            *event = new MultiEvent();
+        }
+    }
+
+    void MultiIntersectionDevice::UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const
+    {
+        if (event)
+        {
+            *event = new MultiEvent();
+        }
+    }
+
+    void MultiIntersectionDevice::Query(Buffer const* rays, int numrays, Buffer* hits, size_t hitsize, bool occlusion, Event const* waitevent, Event** event) const
+    {
+        auto multi_rays = static_cast<MultiBuffer const*>(rays);
+        auto multi_hits = static_cast<MultiBuffer*>(hits);
+
+        ThrowIf(numrays * sizeof(ray) > multi_rays->size || numrays * hitsize > multi_hits->size, "Buffer is too small for the query.");
+
+        // Ray data is staged from host memory, so dependencies are resolved here
+        ResolvePending(waitevent);
+
+        ResolvePending(multi_rays);
+        ResolvePending(multi_hits);
+
+        auto pending = std::make_shared<PendingQuery>(multi_hits, hitsize);
+
+        int numdevices = static_cast<int>(m_devices.size());
+        int range_size = (numrays + numdevices - 1) / numdevices;
+        range_size = (range_size + kRangeAlignment - 1) / kRangeAlignment * kRangeAlignment;
+
+        // Upload the range and start the device before the next one is uploaded
+        for (int i = 0; i < numdevices; ++i)
+        {
+            int begin = std::min(i * range_size, numrays);
+            int end = std::min(begin + range_size, numrays);
+
+            if (begin == end)
+                break;
+
+            auto device = m_devices[i].get();
+            auto device_rays = GetDeviceBuffer(device, multi_rays, i);
+            auto device_hits = GetDeviceBuffer(device, multi_hits, i);
+
+            void* data = nullptr;
+            Event* e = nullptr;
+            device->MapBuffer(device_rays, kMapWrite, 0, (end - begin) * sizeof(ray), &data, &e);
+            e->Wait();
+            device->DeleteEvent(e);
+
+            std::memcpy(data, multi_rays->data + begin * sizeof(ray), (end - begin) * sizeof(ray));
+
+            // Queries are ordered after unmap on the device queue
+            device->UnmapBuffer(device_rays, data, &e);
+            device->DeleteEvent(e);
+
+            Event* query_event = nullptr;
+            if (occlusion)
+                device->QueryOcclusion(device_rays, end - begin, device_hits, nullptr, &query_event);
+            else
+                device->QueryIntersection(device_rays, end - begin, device_hits, nullptr, &query_event);
+
+            pending->ranges.push_back({ device, device_hits, query_event, begin, end });
+        }
+
+        multi_hits->pending = pending;
+
+        if (event)
+        {
+            *event = new MultiEvent(pending);
+        }
+        else
+        {
+            pending->Resolve();
+        }
+    }
+
+    int MultiIntersectionDevice::GetNumRays(Buffer const* numrays, int maxrays) const
+    {
+        auto multi_numrays = static_cast<MultiBuffer const*>(numrays);
+
+        ResolvePending(multi_numrays);
+
+        int count = 0;
+        std::memcpy(&count, multi_numrays->data, sizeof(int));
+
+        return std::min(count, maxrays);
+    }
+
+    void MultiIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Query(rays, numrays, hits, sizeof(Intersection), false, waitevent, event);
+    }
+
+    void MultiIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Query(rays, numrays, hits, sizeof(int), true, waitevent, event);
+    }
+
+    void MultiIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        // The count is needed to split the batch, so it is read on the host
+        ResolvePending(waitevent);
+        Query(rays, GetNumRays(numrays, maxrays), hits, sizeof(Intersection), false, nullptr, event);
+    }
+
+    void MultiIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        ResolvePending(waitevent);
+        Query(rays, GetNumRays(numrays, maxrays), hits, sizeof(int), true, nullptr, event);
+    }
+
+    void MultiIntersectionDevice::QueryOcclusionPacked(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Throw("Packed occlusion queries are not supported by multi device.");
+    }
+
+    void MultiIntersectionDevice::QueryOcclusionPacked(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Throw("Packed occlusion queries are not supported by multi device.");
+    }
+
+    void MultiIntersectionDevice::QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Throw("Multi-hit queries are not supported by multi device.");
+    }
+
+    void MultiIntersectionDevice::QueryIntersectionMulti(Buffer const* rays, Buffer const* numrays, int maxrays, int k, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Throw("Multi-hit queries are not supported by multi device.");
+    }
+
+    void MultiIntersectionDevice::QueryIntersectionAttributes(Buffer const* rays, int numrays, int numattributes, Buffer* hits, Buffer* attributes, Event const* waitevent, Event** event) const
+    {
+        Throw("Attribute queries are not supported by multi device.");
+    }
+
+    void MultiIntersectionDevice::QueryOcclusionCached(Buffer const* rays, int numrays, Buffer* occluders, Buffer* hitresults, Event const* waitevent, Event** event) const
+    {
+        Throw("Occluder caching is not supported by multi device.");
+    }
+
+    void MultiIntersectionDevice::QueryOverlap(Buffer const* boxes, int count, int maxoverlaps, Buffer* overlaps, Buffer* counts, Event const* waitevent, Event** event) const
+    {
+        Throw("Overlap queries are not supported by multi device.");
+    }
+
+    void MultiIntersectionDevice::QueryClosestPoint(Buffer const* points, int count, float maxdist, Buffer* results, Event const* waitevent, Event** event) const
+    {
+        Throw("Closest point queries are not supported by multi device.");
+    }
+
+    void MultiIntersectionDevice::QueryIntersection2D(Buffer const* rays, int width, int height, RayOrder order, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        // Rays are traversed in scanline order, the hits are the same
+        QueryIntersection(rays, width * height, hits, waitevent, event);
+    }
+
+    void MultiIntersectionDevice::QueryPrimaryPinhole(PinholeCamera const& camera, int width, int height, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Throw("Built-in ray generators are not supported by multi device.");
+    }
+
+    void MultiIntersectionDevice::QueryShadowFromHits(Buffer const* rays, Buffer const* hits, int numrays, float3 const& light, float epsilon, Buffer* results, Event const* waitevent, Event** event) const
+    {
+        Throw("Built-in ray generators are not supported by multi device.");
+    }
+
+    void MultiIntersectionDevice::CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* compacted, Buffer* newnumrays, Buffer* indices, Event const* waitevent, Event** event) const
+    {
+        Throw("Ray compaction is not supported by multi device.");
+    }
+
+    void MultiIntersectionDevice::SortHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer* indices, Buffer* numhits, Event const* waitevent, Event** event) const
+    {
+        Throw("Hit sorting is not supported by multi device.");
+    }
+}
@@ -0,0 +1,834 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "remote_intersection_device.h"
+
+#include "../except/except.h"
+#include "../primitive/instance.h"
+#include "../primitive/mesh.h"
+#include "../primitive/spheres.h"
+#include "../world/world.h"
+#include "math/mathutils.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <map>
+#include <thread>
+
+namespace RadeonRays
+{
+    namespace
+    {
+        // Worker ranges are aligned to this number of rays, a multiple of
+        // 32 keeps compact occlusion words of the workers apart
+        int const kRangeAlignment = 64;
+        // Rays per message unless "remote.chunk_rays" is set
+        int const kDefaultChunkRays = 65536;
+
+        // Buffer contents live in host memory
+        class RemoteBuffer : public Buffer
+        {
+        public:
+            RemoteBuffer(size_t s, void* host_ptr)
+                : size(s)
+            {
+                if (host_ptr)
+                {
+                    data = static_cast<char*>(host_ptr);
+                }
+                else
+                {
+                    storage.resize(size);
+                    data = storage.data();
+                }
+            }
+
+            char* data;
+            size_t size;
+            std::vector<char> storage;
+        };
+
+        // Event for the blocking calls
+        class RemoteEvent : public Event
+        {
+        public:
+            bool Complete() const override
+            {
+                return true;
+            }
+
+            void Wait() override
+            {
+            }
+        };
+
+        // Object space bounds of a mesh or spheres
+        bbox GetObjectBounds(ShapeImpl const* shape)
+        {
+            bbox bounds;
+
+            if (shape->is_spheres())
+            {
+                auto spheres = static_cast<Spheres const*>(shape);
+                for (int i = 0; i < spheres->num_spheres(); ++i)
+                {
+                    auto const& s = spheres->GetSphere(i);
+                    bounds.grow(float3(s.x - s.w, s.y - s.w, s.z - s.w));
+                    bounds.grow(float3(s.x + s.w, s.y + s.w, s.z + s.w));
+                }
+            }
+            else
+            {
+                auto mesh = static_cast<Mesh const*>(shape);
+                for (int i = 0; i < mesh->num_vertices(); ++i)
+                {
+                    bounds.grow(mesh->GetVertex(i));
+                }
+            }
+
+            return bounds;
+        }
+
+        // Number of primitives a shape adds to the scene
+        double GetNumPrimitives(ShapeImpl const* shape)
+        {
+            if (shape->is_spheres())
+                return static_cast<Spheres const*>(shape)->num_spheres();
+
+            return static_cast<Mesh const*>(shape)->num_faces();
+        }
+
+        // Options of the world as sent in scene messages
+        std::vector<char> SerializeOptions(Options const& options)
+        {
+            Remote::MessageWriter writer;
+            writer.Write(static_cast<std::uint32_t>(options.GetOptions().size()));
+
+            for (auto const& option : options.GetOptions())
+            {
+                writer.WriteString(option.first);
+                writer.Write(static_cast<std::uint32_t>(option.second.isstring));
+
+                if (option.second.isstring)
+                    writer.WriteString(option.second.AsString());
+                else
+                    writer.Write(option.second.AsFloat());
+            }
+
+            return writer.GetData();
+        }
+    }
+
+    std::unique_ptr<TcpStream> RemoteIntersectionDevice::Connect(std::string const& endpoint)
+    {
+        auto const colon = endpoint.rfind(':');
+        if (colon == std::string::npos || colon == 0 || colon + 1 == endpoint.size())
+            return nullptr;
+
+        auto const port = endpoint.substr(colon + 1);
+        if (port.size() > 5 || port.find_first_not_of("0123456789") != std::string::npos || std::stoi(port) > 65535)
+            return nullptr;
+
+        // IPv6 addresses are bracketed
+        auto host = endpoint.substr(0, colon);
+        if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+            host = host.substr(1, host.size() - 2);
+
+        auto stream = TcpStream::Connect(host, static_cast<std::uint16_t>(std::stoi(port)));
+
+        Remote::SendMessage(*stream, Remote::kHello, Remote::kProtocolVersion, 0, nullptr, 0);
+
+        std::vector<char> payload;
+        auto header = Remote::ReceiveReply(*stream, payload, Remote::RecordFormat(), 0);
+        ThrowIf(header.type != Remote::kHello || header.count != Remote::kProtocolVersion, "Remote worker protocol version mismatch.");
+
+        return stream;
+    }
+
+    RemoteIntersectionDevice::RemoteIntersectionDevice(std::vector<std::unique_ptr<TcpStream>> connections)
+        : m_connections(std::move(connections))
+        , m_partitioned(false)
+        , m_chunk_rays(kDefaultChunkRays)
+        , m_has_scene(false)
+        , m_broken(false)
+    {
+        m_format.ray_size = sizeof(ray);
+        m_format.hit_size = sizeof(Intersection);
+        m_format.compact_occlusion = 0;
+    }
+
+    RemoteIntersectionDevice::~RemoteIntersectionDevice()
+    {
+    }
+
+    void RemoteIntersectionDevice::Preprocess(World const& world)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        ThrowIf(m_broken, "Remote device has lost its connection.");
+
+        auto options = SerializeOptions(world.options_);
+
+        // Workers rebuild from scratch, so skip commits changing nothing
+        if (m_has_scene && !world.has_changed() && world.GetStateChange() == ShapeImpl::kStateChangeNone && options == m_options)
+            return;
+
+        auto const format = Remote::GetRecordFormat(world.options_);
+
+        auto partition = world.options_.GetOption("remote.partition");
+        bool const partitioned = partition && partition->AsFloat() > 0.f && m_connections.size() > 1;
+
+        auto chunk = world.options_.GetOption("remote.chunk_rays");
+        ThrowIf(chunk && !(chunk->AsFloat() >= 1.f && chunk->AsFloat() <= Remote::kMaxChunkRays), "Remote chunk size is out of range.");
+        // Chunks of a range keep compact occlusion words apart as well
+        int const chunk_rays = chunk ? (static_cast<int>(chunk->AsFloat()) + 31) / 32 * 32 : kDefaultChunkRays;
+
+        std::vector<std::vector<Shape const*>> parts;
+        if (partitioned)
+        {
+            PartitionShapes(world, parts);
+        }
+        else
+        {
+            parts.push_back(world.shapes_);
+        }
+
+        std::vector<std::vector<char>> messages;
+        for (auto const& part : parts)
+        {
+            Remote::MessageWriter writer;
+            writer.Write(format);
+            writer.Write(options.data(), options.size());
+            SerializeScene(world, part, writer);
+            messages.push_back(writer.GetData());
+        }
+
+        // Workers keep the previous scene if anything fails below
+        m_has_scene = false;
+
+        std::string worker_error;
+        try
+        {
+            // Send all the scenes first, so the workers build them at the same time
+            for (std::size_t i = 0; i < m_connections.size(); ++i)
+            {
+                auto const& message = messages[partitioned ? i : 0];
+                Remote::SendMessage(*m_connections[i], Remote::kScene, 0, 0, message.data(), message.size());
+            }
+
+            std::vector<char> payload;
+            for (auto& connection : m_connections)
+            {
+                Remote::MessageHeader header;
+                ThrowIf(!Remote::ReceiveMessage(*connection, header, payload, format, 0), "Remote connection is closed.");
+
+                if (header.type == Remote::kError)
+                {
+                    if (worker_error.empty())
+                        worker_error.assign(payload.begin(), payload.end());
+                }
+                else
+                {
+                    ThrowIf(header.type != Remote::kResult, "Malformed remote message.");
+                }
+            }
+        }
+        catch (...)
+        {
+            m_broken = true;
+            throw;
+        }
+
+        ThrowIf(!worker_error.empty(), "Remote worker: " + worker_error);
+
+        m_format = format;
+        m_partitioned = partitioned;
+        m_chunk_rays = chunk_rays;
+        m_options = options;
+        m_has_scene = true;
+    }
+
+    void RemoteIntersectionDevice::PartitionShapes(World const& world, std::vector<std::vector<Shape const*>>& parts) const
+    {
+        struct Entry
+        {
+            Shape const* shape;
+            float3 centroid;
+            double cost;
+        };
+
+        std::vector<Entry> entries;
+        bbox centroids;
+        double total = 0.0;
+
+        for (auto shape : world.shapes_)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+            auto geometry = shapeimpl->is_instance() ? static_cast<ShapeImpl const*>(static_cast<Instance const*>(shapeimpl)->GetBaseShape()) : shapeimpl;
+
+            // Unsupported shapes are reported by SerializeScene
+            ThrowIf(geometry->is_group() || geometry->is_device_mesh() || geometry->is_instance(),
+                "Remote device only supports meshes, spheres and instances of meshes.");
+
+            matrix m, minv;
+            shape->GetTransform(m, minv);
+
+            Entry entry = { shape, transform_bbox(GetObjectBounds(geometry), m).center(), GetNumPrimitives(geometry) };
+            centroids.grow(entry.centroid);
+            total += entry.cost;
+            entries.push_back(entry);
+        }
+
+        int const axis = entries.empty() ? 0 : centroids.maxdim();
+        std::stable_sort(entries.begin(), entries.end(), [axis](Entry const& a, Entry const& b)
+        {
+            return a.centroid[axis] < b.centroid[axis];
+        });
+
+        // Consecutive shapes along the axis go to the same worker, primitives are split evenly
+        parts.assign(m_connections.size(), std::vector<Shape const*>());
+
+        double before = 0.0;
+        for (auto const& entry : entries)
+        {
+            auto const part = total > 0.0 ? static_cast<std::size_t>(before * parts.size() / total) : 0;
+            parts[std::min(part, parts.size() - 1)].push_back(entry.shape);
+            before += entry.cost;
+        }
+    }
+
+    void RemoteIntersectionDevice::SerializeScene(World const& world, std::vector<Shape const*> const& shapes, Remote::MessageWriter& writer) const
+    {
+        // Meshes and spheres come first, so instances reference the ones before them
+        std::vector<ShapeImpl const*> table;
+        std::vector<std::uint32_t> attached;
+        std::map<Shape const*, std::uint32_t> indices;
+
+        auto add = [&](Shape const* shape, bool attach)
+        {
+            auto iter = indices.find(shape);
+            if (iter != indices.end())
+            {
+                attached[iter->second] |= attach ? 1 : 0;
+                return iter->second;
+            }
+
+            auto const idx = static_cast<std::uint32_t>(table.size());
+            indices[shape] = idx;
+            table.push_back(static_cast<ShapeImpl const*>(shape));
+            attached.push_back(attach ? 1 : 0);
+            return idx;
+        };
+
+        for (auto shape : shapes)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+            ThrowIf(shapeimpl->is_group() || shapeimpl->is_device_mesh(), "Remote device only supports meshes, spheres and instances of meshes.");
+
+            if (!shapeimpl->is_instance())
+                add(shape, true);
+        }
+
+        for (auto shape : shapes)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+            if (!shapeimpl->is_instance())
+                continue;
+
+            auto instance = static_cast<Instance const*>(shapeimpl);
+            ThrowIf(instance->GetNumLods() > 1, "Remote device does not support instances with levels of detail.");
+
+            auto base = static_cast<ShapeImpl const*>(instance->GetBaseShape());
+            ThrowIf(base->is_group() || base->is_device_mesh() || base->is_instance(), "Remote device only supports meshes, spheres and instances of meshes.");
+
+            add(base, false);
+        }
+
+        for (auto shape : shapes)
+        {
+            if (static_cast<ShapeImpl const*>(shape)->is_instance())
+                add(shape, true);
+        }
+
+        writer.Write(static_cast<std::uint32_t>(table.size()));
+
+        for (std::size_t i = 0; i < table.size(); ++i)
+        {
+            auto shape = table[i];
+
+            std::uint32_t const kind = shape->is_instance() ? Remote::kInstance : (shape->is_spheres() ? Remote::kSpheres : Remote::kMesh);
+            writer.Write(kind);
+            writer.Write(attached[i]);
+            writer.Write(shape->GetId());
+            writer.Write(shape->GetMask());
+
+            matrix m, minv;
+            shape->GetTransform(m, minv);
+            writer.Write(m);
+            writer.Write(minv);
+            writer.Write(shape->GetLinearVelocity());
+            writer.Write(shape->GetAngularVelocity());
+
+            if (kind == Remote::kInstance)
+            {
+                writer.Write(indices[static_cast<Instance const*>(shape)->GetBaseShape()]);
+            }
+            else if (kind == Remote::kSpheres)
+            {
+                auto spheres = static_cast<Spheres const*>(shape);
+                writer.Write(static_cast<std::uint32_t>(spheres->num_spheres()));
+                for (int s = 0; s < spheres->num_spheres(); ++s)
+                {
+                    writer.Write(spheres->GetSphere(s));
+                }
+            }
+            else
+            {
+                auto mesh = static_cast<Mesh const*>(shape);
+
+                std::vector<float3> vertices(mesh->num_vertices());
+                for (int v = 0; v < mesh->num_vertices(); ++v)
+                {
+                    vertices[v] = mesh->GetVertex(v);
+                }
+
+                // Faces have 4 indices, the number of vertices tells quads from triangles
+                std::vector<int> numfaceverts(mesh->num_faces());
+                std::vector<int> faces(4 * mesh->num_faces());
+                for (int f = 0; f < mesh->num_faces(); ++f)
+                {
+                    auto face = mesh->GetFace(f);
+                    numfaceverts[f] = face.type_ == Mesh::QUAD ? 4 : 3;
+                    std::copy(face.idx, face.idx + 4, &faces[4 * f]);
+                }
+
+                writer.Write(static_cast<std::uint32_t>(vertices.size()));
+                writer.Write(vertices.data(), vertices.size() * sizeof(float3));
+                writer.Write(static_cast<std::uint32_t>(numfaceverts.size()));
+                writer.Write(numfaceverts.data(), numfaceverts.size() * sizeof(int));
+                writer.Write(faces.data(), faces.size() * sizeof(int));
+            }
+        }
+    }
+
+    Buffer* RemoteIntersectionDevice::CreateBuffer(size_t size, void* initdata) const
+    {
+        auto buffer = new RemoteBuffer(size, nullptr);
+
+        if (initdata)
+        {
+            std::memcpy(buffer->data, initdata, size);
+        }
+
+        return buffer;
+    }
+
+    Buffer* RemoteIntersectionDevice::CreateBufferFromHostPtr(void* ptr, size_t size) const
+    {
+        return new RemoteBuffer(size, ptr);
+    }
+
+    void RemoteIntersectionDevice::DeleteBuffer(Buffer* const buffer) const
+    {
+        delete static_cast<RemoteBuffer*>(buffer);
+    }
+
+    void RemoteIntersectionDevice::DeleteEvent(Event* const event) const
+    {
+        delete event;
+    }
+
+    void RemoteIntersectionDevice::JoinEvents(Event const* const* events, int count, Event** event) const
+    {
+        // Queries are blocking, so the events are complete already
+        SetEvent(event);
+    }
+
+    void RemoteIntersectionDevice::SetEvent(Event** event) const
+    {
+        if (event)
+        {
+            *event = new RemoteEvent();
+        }
+    }
+
+    void RemoteIntersectionDevice::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const
+    {
+        *data = static_cast<RemoteBuffer*>(buffer)->data + offset;
+        SetEvent(event);
+    }
+
+    void RemoteIntersectionDevice::UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const
+    {
+        SetEvent(event);
+    }
+
+    bool RemoteIntersectionDevice::IsActive(char const* r) const
+    {
+        if (m_format.ray_size == sizeof(ray))
+            return reinterpret_cast<ray const*>(r)->IsActive();
+
+        // Inactive compact rays have the sign bit of maxt set
+        std::uint32_t maxtbits;
+        std::memcpy(&maxtbits, r + offsetof(PackedRay, o) + 3 * sizeof(float), sizeof(maxtbits));
+        return (maxtbits & 0x80000000u) == 0;
+    }
+
+    void RemoteIntersectionDevice::CopyResults(char const* rays, int begin, int count, char const* src, char* dst, bool occlusion) const
+    {
+        if (occlusion && m_format.compact_occlusion)
+        {
+            std::memcpy(dst, src, m_format.GetResultSize(count, true));
+            return;
+        }
+
+        // Results of inactive rays are left untouched, as on the other devices
+        auto const size = m_format.GetResultSize(1, occlusion);
+        for (int i = 0; i < count; ++i)
+        {
+            if (IsActive(rays + (begin + i) * m_format.ray_size))
+            {
+                std::memcpy(dst + i * size, src + i * size, size);
+            }
+        }
+    }
+
+    void RemoteIntersectionDevice::MergeResults(char const* rays, int numrays, std::vector<std::vector<char>> const& results, char* dst, bool occlusion) const
+    {
+        if (occlusion && m_format.compact_occlusion)
+        {
+            auto words = reinterpret_cast<std::uint32_t*>(dst);
+            for (std::size_t i = 0; i < m_format.GetResultSize(numrays, true) / sizeof(std::uint32_t); ++i)
+            {
+                std::uint32_t bits = 0;
+                for (auto const& r : results)
+                {
+                    bits |= reinterpret_cast<std::uint32_t const*>(r.data())[i];
+                }
+
+                words[i] = bits;
+            }
+
+            return;
+        }
+
+        auto const size = m_format.GetResultSize(1, occlusion);
+        for (int i = 0; i < numrays; ++i)
+        {
+            if (!IsActive(rays + i * m_format.ray_size))
+                continue;
+
+            // Misses of all the workers are the same, take the first one
+            std::size_t best = 0;
+            float best_t = std::numeric_limits<float>::max();
+
+            for (std::size_t w = 0; w < results.size(); ++w)
+            {
+                char const* result = results[w].data() + i * size;
+
+                if (occlusion)
+                {
+                    if (*reinterpret_cast<int const*>(result) != kNullId)
+                    {
+                        best = w;
+                        break;
+                    }
+                }
+                else if (m_format.hit_size == sizeof(Intersection))
+                {
+                    auto hit = reinterpret_cast<Intersection const*>(result);
+                    if (hit->shapeid != kNullId && hit->uvwt.w < best_t)
+                    {
+                        best = w;
+                        best_t = hit->uvwt.w;
+                    }
+                }
+                else
+                {
+                    auto hit = reinterpret_cast<PackedIntersection const*>(result);
+                    if (hit->shapeid != kNullId && hit->t < best_t)
+                    {
+                        best = w;
+                        best_t = hit->t;
+                    }
+                }
+            }
+
+            std::memcpy(dst + i * size, results[best].data() + i * size, size);
+        }
+    }
+
+    void RemoteIntersectionDevice::RunRange(std::size_t worker, Range const& range, char const* rays, char* results, bool occlusion, std::string& worker_error) const
+    {
+        auto& stream = *m_connections[worker];
+        std::uint32_t const type = occlusion ? Remote::kOcclude : Remote::kIntersect;
+
+        // Chunks are sent ahead while the results of the previous ones are received,
+        // so the worker always has the next chunk at hand
+        std::exception_ptr send_error;
+        std::thread sender([&]()
+        {
+            try
+            {
+                for (int begin = range.begin; begin < range.end; begin += m_chunk_rays)
+                {
+                    int const count = std::min(m_chunk_rays, range.end - begin);
+                    std::uint32_t const flags = begin + count < range.end ? Remote::kMessageMore : 0;
+                    Remote::SendMessage(stream, type, count, flags, rays + begin * m_format.ray_size, count * m_format.ray_size);
+                }
+            }
+            catch (...)
+            {
+                send_error = std::current_exception();
+                stream.Shutdown();
+            }
+        });
+
+        try
+        {
+            std::vector<char> payload;
+            for (int begin = range.begin; begin < range.end; begin += m_chunk_rays)
+            {
+                int const count = std::min(m_chunk_rays, range.end - begin);
+
+                Remote::MessageHeader header;
+                ThrowIf(!Remote::ReceiveMessage(stream, header, payload, m_format, m_format.GetResultSize(count, occlusion)), "Remote connection is closed.");
+
+                // Every chunk is answered, keep receiving after a failed one
+                if (header.type == Remote::kError)
+                {
+                    if (worker_error.empty())
+                        worker_error.assign(payload.begin(), payload.end());
+                    continue;
+                }
+
+                ThrowIf(header.type != Remote::kResult || header.count != static_cast<std::uint32_t>(count) ||
+                    payload.size() != m_format.GetResultSize(count, occlusion), "Malformed remote message.");
+
+                CopyResults(rays, begin, count, payload.data(), results + m_format.GetResultSize(begin, occlusion), occlusion);
+            }
+        }
+        catch (...)
+        {
+            stream.Shutdown();
+            sender.join();
+            throw;
+        }
+
+        sender.join();
+
+        if (send_error)
+        {
+            std::rethrow_exception(send_error);
+        }
+    }
+
+    void RemoteIntersectionDevice::Query(Buffer const* rays, int numrays, Buffer* hits, bool occlusion) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        ThrowIf(m_broken, "Remote device has lost its connection.");
+        ThrowIf(!m_has_scene, "Remote device has no scene committed.");
+
+        auto remote_rays = static_cast<RemoteBuffer const*>(rays);
+        auto remote_hits = static_cast<RemoteBuffer*>(hits);
+
+        ThrowIf(numrays * m_format.ray_size > remote_rays->size || m_format.GetResultSize(numrays, occlusion) > remote_hits->size,
+            "Buffer is too small for the query.");
+
+        if (numrays <= 0)
+            return;
+
+        auto const numworkers = m_connections.size();
+
+        // Partitions trace the whole batch into their own results, copies of the scene trace ranges in place
+        std::vector<Range> ranges(numworkers);
+        std::vector<std::vector<char>> results;
+
+        if (m_partitioned)
+        {
+            results.resize(numworkers, std::vector<char>(m_format.GetResultSize(numrays, occlusion)));
+            for (auto& range : ranges)
+            {
+                range.begin = 0;
+                range.end = numrays;
+            }
+        }
+        else
+        {
+            int const size = (numrays + static_cast<int>(numworkers) - 1) / static_cast<int>(numworkers);
+            int const aligned = (size + kRangeAlignment - 1) / kRangeAlignment * kRangeAlignment;
+
+            for (std::size_t i = 0; i < numworkers; ++i)
+            {
+                ranges[i].begin = std::min(static_cast<int>(i) * aligned, numrays);
+                ranges[i].end = std::min(ranges[i].begin + aligned, numrays);
+            }
+        }
+
+        std::vector<std::exception_ptr> errors(numworkers);
+        std::vector<std::string> worker_errors(numworkers);
+        std::vector<std::thread> threads;
+
+        for (std::size_t i = 0; i < numworkers; ++i)
+        {
+            if (ranges[i].begin == ranges[i].end)
+                continue;
+
+            threads.emplace_back([&, i]()
+            {
+                try
+                {
+                    char* dst = m_partitioned ? results[i].data() : remote_hits->data;
+                    RunRange(i, ranges[i], remote_rays->data, dst, occlusion, worker_errors[i]);
+                }
+                catch (...)
+                {
+                    errors[i] = std::current_exception();
+                }
+            });
+        }
+
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        for (auto const& error : errors)
+        {
+            if (error)
+            {
+                // Messages of the failed query might still be in flight
+                m_broken = true;
+                std::rethrow_exception(error);
+            }
+        }
+
+        for (auto const& error : worker_errors)
+        {
+            ThrowIf(!error.empty(), "Remote worker: " + error);
+        }
+
+        if (m_partitioned)
+        {
+            MergeResults(remote_rays->data, numrays, results, remote_hits->data, occlusion);
+        }
+    }
+
+    int RemoteIntersectionDevice::GetNumRays(Buffer const* numrays, int maxrays) const
+    {
+        auto remote_numrays = static_cast<RemoteBuffer const*>(numrays);
+        return std::min(*reinterpret_cast<int const*>(remote_numrays->data), maxrays);
+    }
+
+    void RemoteIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Query(rays, numrays, hits, false);
+        SetEvent(event);
+    }
+
+    void RemoteIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Query(rays, numrays, hits, true);
+        SetEvent(event);
+    }
+
+    void RemoteIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Query(rays, GetNumRays(numrays, maxrays), hits, false);
+        SetEvent(event);
+    }
+
+    void RemoteIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Query(rays, GetNumRays(numrays, maxrays), hits, true);
+        SetEvent(event);
+    }
+
+    void RemoteIntersectionDevice::QueryOcclusionPacked(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Throw("Packed occlusion queries are not supported by remote device, use \"acc.occlusion.compact\" instead.");
+    }
+
+    void RemoteIntersectionDevice::QueryOcclusionPacked(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Throw("Packed occlusion queries are not supported by remote device, use \"acc.occlusion.compact\" instead.");
+    }
+
+    void RemoteIntersectionDevice::QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Throw("Multi-hit queries are not supported by remote device.");
+    }
+
+    void RemoteIntersectionDevice::QueryIntersectionMulti(Buffer const* rays, Buffer const* numrays, int maxrays, int k, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Throw("Multi-hit queries are not supported by remote device.");
+    }
+
+    void RemoteIntersectionDevice::QueryIntersectionAttributes(Buffer const* rays, int numrays, int numattributes, Buffer* hits, Buffer* attributes, Event const* waitevent, Event** event) const
+    {
+        Throw("Attribute queries are not supported by remote device.");
+    }
+
+    void RemoteIntersectionDevice::QueryOcclusionCached(Buffer const* rays, int numrays, Buffer* occluders, Buffer* hitresults, Event const* waitevent, Event** event) const
+    {
+        Throw("Occluder caching is not supported by remote device.");
+    }
+
+    void RemoteIntersectionDevice::QueryOverlap(Buffer const* boxes, int count, int maxoverlaps, Buffer* overlaps, Buffer* counts, Event const* waitevent, Event** event) const
+    {
+        Throw("Overlap queries are not supported by remote device.");
+    }
+
+    void RemoteIntersectionDevice::QueryClosestPoint(Buffer const* points, int count, float maxdist, Buffer* results, Event const* waitevent, Event** event) const
+    {
+        Throw("Closest point queries are not supported by remote device.");
+    }
+
+    void RemoteIntersectionDevice::QueryIntersection2D(Buffer const* rays, int width, int height, RayOrder order, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        // Rays are traversed in scanline order, the hits are the same
+        QueryIntersection(rays, width * height, hits, waitevent, event);
+    }
+
+    void RemoteIntersectionDevice::QueryPrimaryPinhole(PinholeCamera const& camera, int width, int height, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Throw("Built-in ray generators are not supported by remote device.");
+    }
+
+    void RemoteIntersectionDevice::QueryShadowFromHits(Buffer const* rays, Buffer const* hits, int numrays, float3 const& light, float epsilon, Buffer* results, Event const* waitevent, Event** event) const
+    {
+        Throw("Built-in ray generators are not supported by remote device.");
+    }
+
+    void RemoteIntersectionDevice::CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* compacted, Buffer* newnumrays, Buffer* indices, Event const* waitevent, Event** event) const
+    {
+        Throw("Ray compaction is not supported by remote device.");
+    }
+
+    void RemoteIntersectionDevice::SortHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer* indices, Buffer* numhits, Event const* waitevent, Event** event) const
+    {
+        Throw("Hit sorting is not supported by remote device.");
+    }
+}
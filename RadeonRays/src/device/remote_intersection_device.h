@@ -0,0 +1,143 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "intersection_device.h"
+#include "remote_protocol.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace RadeonRays
+{
+    ///< The class represents a device tracing on worker nodes running
+    ///< IntersectionApi::ServeRemote. Committed scenes are sent to the workers
+    ///< once, queries stream chunks of rays to them and the hits back while the
+    ///< workers trace. Workers either hold copies of the scene and trace ranges
+    ///< of the batch, or with "remote.partition" hold spatially sorted parts of it
+    ///< and trace the whole batch, the closest hits are merged then. Buffers are
+    ///< kept in host memory and queries are blocking.
+    ///<
+    class RemoteIntersectionDevice : public IntersectionDevice
+    {
+    public:
+        // Connect to a worker at "host:port" and check its protocol version, returns
+        // nullptr if the endpoint is malformed, failed connections throw
+        static std::unique_ptr<TcpStream> Connect(std::string const& endpoint);
+
+        // Takes ownership of the connections returned by Connect
+        explicit RemoteIntersectionDevice(std::vector<std::unique_ptr<TcpStream>> connections);
+        ~RemoteIntersectionDevice();
+
+        void Preprocess(World const& world) override;
+
+        bool SupportsSpheres() const override { return true; }
+
+        Buffer* CreateBuffer(size_t size, void* initdata) const override;
+        Buffer* CreateBufferFromHostPtr(void* ptr, size_t size) const override;
+
+        void DeleteBuffer(Buffer* const) const override;
+
+        void DeleteEvent(Event* const) const override;
+        void JoinEvents(Event const* const* events, int count, Event** event) const override;
+
+        void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const override;
+
+        void UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const override;
+
+        // Queries are blocking, returned events are already complete
+        void QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryOcclusionPacked(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryOcclusionPacked(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryIntersectionMulti(Buffer const* rays, Buffer const* numrays, int maxrays, int k, Buffer* hits, Event const* waitevent, Event** event) const override;
+        void QueryIntersectionAttributes(Buffer const* rays, int numrays, int numattributes, Buffer* hits, Buffer* attributes, Event const* waitevent, Event** event) const override;
+        void QueryOcclusionCached(Buffer const* rays, int numrays, Buffer* occluders, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryOverlap(Buffer const* boxes, int count, int maxoverlaps, Buffer* overlaps, Buffer* counts, Event const* waitevent, Event** event) const override;
+        void QueryClosestPoint(Buffer const* points, int count, float maxdist, Buffer* results, Event const* waitevent, Event** event) const override;
+
+        void QueryIntersection2D(Buffer const* rays, int width, int height, RayOrder order, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryPrimaryPinhole(PinholeCamera const& camera, int width, int height, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryShadowFromHits(Buffer const* rays, Buffer const* hits, int numrays, float3 const& light, float epsilon, Buffer* results, Event const* waitevent, Event** event) const override;
+
+        void CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* compacted, Buffer* newnumrays, Buffer* indices, Event const* waitevent, Event** event) const override;
+        void SortHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer* indices, Buffer* numhits, Event const* waitevent, Event** event) const override;
+
+    private:
+        // Rays of a query sent to a single worker
+        struct Range
+        {
+            int begin;
+            int end;
+        };
+
+        // Split attached shapes between the workers along the largest axis of their centroids
+        void PartitionShapes(World const& world, std::vector<std::vector<Shape const*>>& parts) const;
+        // Scene message with the shapes attached, the base shapes of instances are sent detached
+        void SerializeScene(World const& world, std::vector<Shape const*> const& shapes, Remote::MessageWriter& writer) const;
+        // Trace the rays on the workers and gather the results
+        void Query(Buffer const* rays, int numrays, Buffer* hits, bool occlusion) const;
+        // Stream the range to the worker in chunks, results are written to results as for
+        // the whole batch. Errors reported by the worker are returned in worker_error,
+        // failed connections throw.
+        void RunRange(std::size_t worker, Range const& range, char const* rays, char* results, bool occlusion, std::string& worker_error) const;
+        // Copy results of the active rays of a chunk, compact occlusion words are copied as is
+        void CopyResults(char const* rays, int begin, int count, char const* src, char* dst, bool occlusion) const;
+        // Merge the closest hits of the partitions into dst
+        void MergeResults(char const* rays, int numrays, std::vector<std::vector<char>> const& results, char* dst, bool occlusion) const;
+        // Check the active flag of the ray record
+        bool IsActive(char const* r) const;
+        // Read number of rays from a buffer
+        int GetNumRays(Buffer const* numrays, int maxrays) const;
+        // Create a complete event if requested
+        void SetEvent(Event** event) const;
+
+        std::vector<std::unique_ptr<TcpStream>> m_connections;
+        // Record sizes of the committed scene
+        Remote::RecordFormat m_format;
+        // Workers hold parts of the scene
+        bool m_partitioned;
+        // Rays per message
+        int m_chunk_rays;
+        // Options of the last scene sent, it's resent if they change
+        std::vector<char> m_options;
+        bool m_has_scene;
+        // Set once a connection has failed in the middle of a message
+        mutable bool m_broken;
+        // Messages of a query aren't interleaved with other ones
+        mutable std::mutex m_mutex;
+    };
+}
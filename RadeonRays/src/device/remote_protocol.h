@@ -0,0 +1,282 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "radeon_rays.h"
+#include "../except/except.h"
+#include "../util/options.h"
+#include "../util/tcp_stream.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace RadeonRays
+{
+    // Messages between RemoteIntersectionDevice and the workers of IntersectionApi::ServeRemote.
+    // Both ends are expected to share the byte order and the record layouts, records are sent as is.
+    namespace Remote
+    {
+        // Bumped on any change of the messages below
+        std::uint32_t const kProtocolVersion = 1;
+
+        enum MessageType
+        {
+            // Client and worker exchange the protocol version in count on connection
+            kHello = 0,
+            // Scene to commit, see RemoteIntersectionDevice::SerializeScene, answered by kResult or kError
+            kScene,
+            // Chunk of count ray records to trace, answered by kResult with count hit records or kError
+            kIntersect,
+            kOcclude,
+            // Reply to the request, chunks are answered in order
+            kResult,
+            // Failed request, the payload is the message
+            kError
+        };
+
+        // Set on query chunks followed by another one of the same query,
+        // so the worker reads it while the current chunk is traced
+        std::uint32_t const kMessageMore = 0x1;
+
+        // Largest number of rays of a query chunk, see "remote.chunk_rays"
+        std::uint32_t const kMaxChunkRays = 1 << 24;
+        // Largest payloads of scene and error messages
+        std::uint64_t const kMaxSceneSize = 1ull << 32;
+        std::uint64_t const kMaxErrorSize = 1 << 16;
+
+        struct MessageHeader
+        {
+            // MessageType
+            std::uint32_t type;
+            // Number of records of query chunks and their results
+            std::uint32_t count;
+            // kMessage* flags
+            std::uint32_t flags;
+            std::uint32_t padding;
+            // Payload bytes following the header
+            std::uint64_t size;
+        };
+
+        // Shapes of a scene message
+        enum ShapeKind
+        {
+            kMesh = 0,
+            kSpheres,
+            kInstance
+        };
+
+        // Record sizes of the ray and hit formats the client has set, see "acc.ray.format",
+        // "acc.hit.format" and "acc.occlusion.compact"
+        struct RecordFormat
+        {
+            std::uint32_t ray_size;
+            std::uint32_t hit_size;
+            std::uint32_t compact_occlusion;
+
+            // Bytes of the results of count rays, compact occlusion
+            // results of chunks starting at multiples of 32 don't overlap
+            std::size_t GetResultSize(std::size_t count, bool occlusion) const
+            {
+                if (!occlusion)
+                    return count * hit_size;
+
+                return compact_occlusion ? (count + 31) / 32 * sizeof(std::uint32_t) : count * sizeof(int);
+            }
+
+            bool operator == (RecordFormat const& other) const
+            {
+                return ray_size == other.ray_size && hit_size == other.hit_size && compact_occlusion == other.compact_occlusion;
+            }
+        };
+
+        // Record sizes set by the options
+        inline RecordFormat GetRecordFormat(Options const& options)
+        {
+            RecordFormat format;
+            auto rayformat = options.GetOption("acc.ray.format");
+            format.ray_size = rayformat && rayformat->AsString() == "compact" ? sizeof(PackedRay) : sizeof(ray);
+            auto hitformat = options.GetOption("acc.hit.format");
+            format.hit_size = hitformat && hitformat->AsString() == "compact" ? sizeof(PackedIntersection) : sizeof(Intersection);
+            auto compact = options.GetOption("acc.occlusion.compact");
+            format.compact_occlusion = compact && compact->AsFloat() > 0.f ? 1 : 0;
+            return format;
+        }
+
+        // Options of scene messages applied by the workers, the others are ignored,
+        // so clients can't reach settings beyond the acceleration structure
+        inline bool IsForwardedOption(std::string const& name)
+        {
+            return name.compare(0, 4, "bvh.") == 0 || name.compare(0, 6, "bvh2l.") == 0 || name == "acc.type" ||
+                name == "acc.ray.format" || name == "acc.hit.format" || name == "acc.occlusion.compact";
+        }
+
+        // Serializes plain values into a message payload
+        class MessageWriter
+        {
+        public:
+            template <typename T> void Write(T const& value)
+            {
+                Write(&value, sizeof(T));
+            }
+
+            void Write(void const* data, std::size_t size)
+            {
+                auto const offset = m_data.size();
+                m_data.resize(offset + size);
+                if (size > 0)
+                    std::memcpy(&m_data[offset], data, size);
+            }
+
+            void WriteString(std::string const& value)
+            {
+                Write(static_cast<std::uint32_t>(value.size()));
+                Write(value.data(), value.size());
+            }
+
+            std::vector<char> const& GetData() const { return m_data; }
+
+        private:
+            std::vector<char> m_data;
+        };
+
+        // Reads the values back, throws on truncated payloads
+        class MessageReader
+        {
+        public:
+            MessageReader(char const* data, std::size_t size)
+                : m_ptr(data)
+                , m_end(data + size)
+            {
+            }
+
+            template <typename T> T Read()
+            {
+                T value;
+                Read(&value, sizeof(T));
+                return value;
+            }
+
+            void Read(void* data, std::size_t size)
+            {
+                ThrowIf(static_cast<std::size_t>(m_end - m_ptr) < size, "Malformed remote message.");
+                if (size > 0)
+                    std::memcpy(data, m_ptr, size);
+                m_ptr += size;
+            }
+
+            std::string ReadString()
+            {
+                auto const size = Read<std::uint32_t>();
+                CheckCount(size, 1);
+                std::string value(m_ptr, size);
+                m_ptr += size;
+                return value;
+            }
+
+            // Check a count read from the message against the bytes left, so
+            // malformed messages don't allocate huge arrays
+            void CheckCount(std::size_t count, std::size_t element_size) const
+            {
+                ThrowIf(element_size > 0 && count > static_cast<std::size_t>(m_end - m_ptr) / element_size, "Malformed remote message.");
+            }
+
+        private:
+            char const* m_ptr;
+            char const* m_end;
+        };
+
+        inline void SendMessage(TcpStream& stream, std::uint32_t type, std::uint32_t count, std::uint32_t flags, void const* payload, std::size_t size)
+        {
+            MessageHeader header = { type, count, flags, 0, size };
+            stream.Send(&header, sizeof(header));
+            stream.Send(payload, size);
+        }
+
+        inline void SendError(TcpStream& stream, std::string const& message)
+        {
+            SendMessage(stream, kError, 0, 0, message.data(), message.size());
+        }
+
+        // Largest payload of the message, result_size is the one of the kResult expected,
+        // query chunks have to carry count records of the format
+        inline std::uint64_t GetMaxPayloadSize(MessageHeader const& header, RecordFormat const& format, std::size_t result_size)
+        {
+            switch (header.type)
+            {
+            case kScene:
+                return kMaxSceneSize;
+            case kIntersect:
+            case kOcclude:
+                return header.count <= kMaxChunkRays ? std::uint64_t(header.count) * format.ray_size : 0;
+            case kResult:
+                return result_size;
+            case kError:
+                return kMaxErrorSize;
+            default:
+                return 0;
+            }
+        }
+
+        // Receive a message, returns false if the peer has closed the connection before it.
+        // Payloads larger than GetMaxPayloadSize are malformed, the buffer grows as the bytes
+        // arrive, so a header can't make the receiver allocate more than the peer has sent.
+        inline bool ReceiveMessage(TcpStream& stream, MessageHeader& header, std::vector<char>& payload,
+            RecordFormat const& format, std::size_t result_size)
+        {
+            if (!stream.TryReceive(&header, sizeof(header)))
+                return false;
+
+            ThrowIf(header.size > GetMaxPayloadSize(header, format, result_size), "Malformed remote message.");
+
+            std::size_t const kReceiveBlock = 1 << 24;
+            auto const size = static_cast<std::size_t>(header.size);
+
+            payload.clear();
+            while (payload.size() < size)
+            {
+                auto const offset = payload.size();
+                payload.resize(offset + std::min(size - offset, kReceiveBlock));
+                stream.Receive(&payload[offset], payload.size() - offset);
+            }
+
+            return true;
+        }
+
+        // Receive the reply to a request, a kError one is thrown
+        inline MessageHeader ReceiveReply(TcpStream& stream, std::vector<char>& payload, RecordFormat const& format, std::size_t result_size)
+        {
+            MessageHeader header;
+            ThrowIf(!ReceiveMessage(stream, header, payload, format, result_size), "Remote connection is closed.");
+
+            if (header.type == kError)
+            {
+                Throw("Remote worker: " + std::string(payload.begin(), payload.end()));
+            }
+
+            ThrowIf(header.type != kResult && header.type != kHello, "Malformed remote message.");
+            return header;
+        }
+    }
+}
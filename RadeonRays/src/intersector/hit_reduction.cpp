@@ -0,0 +1,183 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "hit_reduction.h"
+#include "intersector.h"
+
+#include "../util/kernel_profiler.h"
+
+#include "buffer.h"
+#include "executable.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#ifdef RR_EMBED_KERNELS
+#if USE_OPENCL
+#    include "RadeonRays/src/kernelcache/kernels_cl.h"
+#endif
+#endif // RR_EMBED_KERNELS
+
+// Preferred work group size for Radeon devices
+static int const kWorkGroupSize = 64;
+
+namespace RadeonRays
+{
+    struct HitReduction::QueueData
+    {
+        // Device
+        Calc::Device* device;
+        // Hit records or occlusion results to reduce
+        Calc::Buffer* results;
+        // Bytes the buffer can hold
+        std::size_t capacity;
+
+        QueueData(Calc::Device* d)
+            : device(d)
+            , results(nullptr)
+            , capacity(0)
+        {
+        }
+
+        ~QueueData()
+        {
+            if (results)
+            {
+                device->DeleteBuffer(results);
+            }
+        }
+    };
+
+    HitReduction::HitReduction(Calc::Device* device, int formats)
+        : m_device(device)
+        , m_profiler(nullptr)
+        , m_executable(nullptr)
+    {
+        assert(device->GetPlatform() == Calc::Platform::kOpenCL);
+
+        // Rays and hits are read in the intersector layout
+        std::string const buildopts = GetRecordFormatOptions(formats);
+
+#ifndef RR_EMBED_KERNELS
+        char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+        int numheaders = sizeof(headers) / sizeof(char const*);
+
+        m_executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/hit_reduction.cl", headers, numheaders, buildopts.c_str());
+#else
+#if USE_OPENCL
+        m_executable = m_device->CompileExecutable(g_hit_reduction_opencl, std::strlen(g_hit_reduction_opencl), buildopts.c_str());
+#endif
+#endif
+
+        assert(m_executable);
+
+        m_distances_func = m_executable->CreateFunction("hit_distances_main");
+        m_count_func = m_executable->CreateFunction("count_occluded_main");
+
+        // Concurrent queries on other queues never resize the per queue storage
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+        m_queues.resize(std::max(spec.max_num_queues, 1U));
+    }
+
+    HitReduction::~HitReduction()
+    {
+        m_queues.clear();
+        m_executable->DeleteFunction(m_distances_func);
+        m_executable->DeleteFunction(m_count_func);
+        m_device->DeleteExecutable(m_executable);
+    }
+
+    Calc::Buffer* HitReduction::GetResults(std::uint32_t queue_idx, std::size_t size)
+    {
+        if (m_queues.size() <= queue_idx)
+        {
+            m_queues.resize(queue_idx + 1);
+        }
+
+        auto& data = m_queues[queue_idx];
+
+        if (!data)
+        {
+            data.reset(new QueueData(m_device));
+        }
+
+        // Empty queries still get a valid buffer
+        size = std::max(size, sizeof(int));
+
+        if (data->capacity < size)
+        {
+            if (data->results)
+            {
+                m_device->DeleteBuffer(data->results);
+            }
+
+            data->results = m_device->CreateBuffer(size, Calc::BufferType::kWrite);
+            data->capacity = size;
+        }
+
+        return data->results;
+    }
+
+    void HitReduction::WriteDistances(std::uint32_t queue_idx, Calc::Buffer const* rays, std::uint32_t num_rays,
+        Calc::Buffer* distances, Calc::Event** event)
+    {
+        auto& data = *m_queues[queue_idx];
+        int count = static_cast<int>(num_rays);
+
+        int arg = 0;
+        m_distances_func->SetArg(arg++, rays);
+        m_distances_func->SetArg(arg++, data.results);
+        m_distances_func->SetArg(arg++, sizeof(count), &count);
+        m_distances_func->SetArg(arg++, distances);
+
+        std::size_t const localsize = kWorkGroupSize;
+        std::size_t const globalsize = ((std::max(num_rays, 1U) + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        ProfiledExecute(m_profiler, m_device, m_distances_func, queue_idx, globalsize, localsize, event, "reduction.distances");
+    }
+
+    void HitReduction::CountOccluded(std::uint32_t queue_idx, Calc::Buffer const* rays, std::uint32_t num_rays, bool packed,
+        std::uint32_t group_size, Calc::Buffer* counts, Calc::Event** event)
+    {
+        auto& data = *m_queues[queue_idx];
+        int count = static_cast<int>(num_rays);
+        int size = static_cast<int>(group_size);
+        int is_packed = packed ? 1 : 0;
+
+        int arg = 0;
+        m_count_func->SetArg(arg++, rays);
+        m_count_func->SetArg(arg++, data.results);
+        m_count_func->SetArg(arg++, sizeof(is_packed), &is_packed);
+        m_count_func->SetArg(arg++, sizeof(count), &count);
+        m_count_func->SetArg(arg++, sizeof(size), &size);
+        m_count_func->SetArg(arg++, counts);
+
+        // A work item per group
+        std::uint32_t const num_groups = std::max((num_rays + group_size - 1) / group_size, 1U);
+        std::size_t const localsize = kWorkGroupSize;
+        std::size_t const globalsize = ((num_groups + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        ProfiledExecute(m_profiler, m_device, m_count_func, queue_idx, globalsize, localsize, event, "reduction.count_occluded");
+    }
+}
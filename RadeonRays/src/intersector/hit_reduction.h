@@ -0,0 +1,84 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file hit_reduction.h
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Reduced query outputs for depth and ambient occlusion passes.
+
+    Closest hits are reduced to their distances and occlusion results to the number of occluded
+    rays per group of consecutive rays on the device, so passes only needing those don't read
+    back full hit records or run a reduction of their own.
+ */
+
+#pragma once
+#include "calc.h"
+#include "device.h"
+
+#include <memory>
+#include <vector>
+
+namespace RadeonRays
+{
+    class KernelProfiler;
+
+    /**
+    \brief Reduces hit records and occlusion results on the GPU.
+
+    Every queue has its own temporary storage, so reductions on different queues can overlap.
+    */
+    class HitReduction
+    {
+    public:
+        // Constructor, formats has to match the record layouts of the intersector
+        HitReduction(Calc::Device* device, int formats = 0);
+        // Destructor
+        ~HitReduction();
+
+        // Set the profiler kernel launches are timed with, might be nullptr
+        void SetProfiler(KernelProfiler* profiler) { m_profiler = profiler; }
+
+        // Get a temporary buffer of the queue holding at least size bytes, valid until the next reduction on the queue
+        Calc::Buffer* GetResults(std::uint32_t queue_idx, std::size_t size);
+        // Write the distances of the closest hits in the results of the queue, -1 for missed and inactive rays
+        void WriteDistances(std::uint32_t queue_idx, Calc::Buffer const* rays, std::uint32_t num_rays,
+            Calc::Buffer* distances, Calc::Event** event);
+        // Count occluded rays of every group of group_size rays in the results of the queue,
+        // which hold 1 bit per ray if packed is set and an int per ray otherwise
+        void CountOccluded(std::uint32_t queue_idx, Calc::Buffer const* rays, std::uint32_t num_rays, bool packed,
+            std::uint32_t group_size, Calc::Buffer* counts, Calc::Event** event);
+
+        HitReduction(HitReduction const&) = delete;
+        HitReduction& operator = (HitReduction const&) = delete;
+
+    private:
+        struct QueueData;
+
+        Calc::Device* m_device;
+        KernelProfiler* m_profiler;
+        Calc::Executable* m_executable;
+        Calc::Function* m_distances_func;
+        Calc::Function* m_count_func;
+        // Temporary storage, one per queue
+        std::vector<std::unique_ptr<QueueData>> m_queues;
+    };
+}
@@ -0,0 +1,198 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "hit_sorting.h"
+#include "intersector.h"
+
+#include "../util/kernel_profiler.h"
+
+#include "buffer.h"
+#include "executable.h"
+#include "primitives.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#ifdef RR_EMBED_KERNELS
+#if USE_OPENCL
+#    include "RadeonRays/src/kernelcache/kernels_cl.h"
+#endif
+#endif // RR_EMBED_KERNELS
+
+// Preferred work group size for Radeon devices
+static int const kWorkGroupSize = 64;
+
+namespace RadeonRays
+{
+    struct HitSorting::QueueData
+    {
+        // Device
+        Calc::Device* device;
+        // Sorting primitives, temporary storage is not shared between queues
+        Calc::Primitives* primitives;
+        // Hit keys and ray indices before sorting, keys after it
+        Calc::Buffer* keys;
+        Calc::Buffer* indices;
+        Calc::Buffer* sorted_keys;
+        // Number of hits if the caller doesn't want it
+        Calc::Buffer* num_hits;
+        // Number of rays the buffers can hold
+        std::uint32_t capacity;
+
+        QueueData(Calc::Device* d)
+            : device(d)
+            , primitives(d->CreatePrimitives())
+            , keys(nullptr)
+            , indices(nullptr)
+            , sorted_keys(nullptr)
+            , num_hits(d->CreateBuffer(sizeof(int), Calc::BufferType::kWrite))
+            , capacity(0)
+        {
+        }
+
+        void Release()
+        {
+            if (capacity)
+            {
+                device->DeleteBuffer(keys);
+                device->DeleteBuffer(indices);
+                device->DeleteBuffer(sorted_keys);
+                capacity = 0;
+            }
+        }
+
+        ~QueueData()
+        {
+            Release();
+            device->DeleteBuffer(num_hits);
+            device->DeletePrimitives(primitives);
+        }
+    };
+
+    HitSorting::HitSorting(Calc::Device* device, int formats)
+        : m_device(device)
+        , m_profiler(nullptr)
+        , m_executable(nullptr)
+    {
+        assert(device->GetPlatform() == Calc::Platform::kOpenCL);
+        assert(device->HasBuiltinPrimitives());
+
+        // Shape IDs are read from hit records in the intersector layout
+        std::string const buildopts = GetRecordFormatOptions(formats);
+
+#ifndef RR_EMBED_KERNELS
+        char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+        int numheaders = sizeof(headers) / sizeof(char const*);
+
+        m_executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/sort_hits.cl", headers, numheaders, buildopts.c_str());
+#else
+#if USE_OPENCL
+        m_executable = m_device->CompileExecutable(g_sort_hits_opencl, std::strlen(g_sort_hits_opencl), buildopts.c_str());
+#endif
+#endif
+
+        assert(m_executable);
+
+        m_key_func = m_executable->CreateFunction("calculate_hit_keys_main");
+        m_count_func = m_executable->CreateFunction("count_hits_main");
+
+        // Concurrent queries on other queues never resize the per queue storage
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+        m_queues.resize(std::max(spec.max_num_queues, 1U));
+    }
+
+    HitSorting::~HitSorting()
+    {
+        m_queues.clear();
+        m_executable->DeleteFunction(m_key_func);
+        m_executable->DeleteFunction(m_count_func);
+        m_device->DeleteExecutable(m_executable);
+    }
+
+    HitSorting::QueueData& HitSorting::GetQueueData(std::uint32_t queue_idx, std::uint32_t max_rays)
+    {
+        if (m_queues.size() <= queue_idx)
+        {
+            m_queues.resize(queue_idx + 1);
+        }
+
+        auto& data = m_queues[queue_idx];
+
+        if (!data)
+        {
+            data.reset(new QueueData(m_device));
+        }
+
+        if (data->capacity < max_rays)
+        {
+            data->Release();
+            data->keys = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+            data->indices = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+            data->sorted_keys = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+            data->capacity = max_rays;
+        }
+
+        return *data;
+    }
+
+    void HitSorting::Sort(std::uint32_t queue_idx, Calc::Buffer const* hits, Calc::Buffer const* num_rays,
+        std::uint32_t max_rays, Calc::Buffer* indices, Calc::Buffer* num_hits, Calc::Event** event)
+    {
+        auto& data = GetQueueData(queue_idx, max_rays);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        int num_keys = static_cast<int>(max_rays);
+
+        // Calculate keys, the count is only known on the device, so all max_rays keys are
+        // sorted with the padding after the misses
+        {
+            int arg = 0;
+
+            m_key_func->SetArg(arg++, hits);
+            m_key_func->SetArg(arg++, num_rays);
+            m_key_func->SetArg(arg++, sizeof(int), &num_keys);
+            m_key_func->SetArg(arg++, data.keys);
+            m_key_func->SetArg(arg++, data.indices);
+
+            ProfiledExecute(m_profiler, m_device, m_key_func, queue_idx, globalsize, localsize, nullptr, "sort_hits.keys");
+        }
+
+        ProfiledRun(m_profiler, queue_idx, "sort_hits.sort", [&]()
+        {
+            data.primitives->SortRadixInt32(queue_idx, data.keys, data.sorted_keys, data.indices, indices, max_rays);
+        });
+
+        // The queue is in-order, so num_hits can be num_rays, it is read by the keys kernel before
+        {
+            int arg = 0;
+
+            m_count_func->SetArg(arg++, data.sorted_keys);
+            m_count_func->SetArg(arg++, sizeof(int), &num_keys);
+            m_count_func->SetArg(arg++, num_hits ? num_hits : data.num_hits);
+
+            ProfiledExecute(m_profiler, m_device, m_count_func, queue_idx, globalsize, localsize, event, "sort_hits.count");
+        }
+    }
+}
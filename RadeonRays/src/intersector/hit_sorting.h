@@ -0,0 +1,84 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file hit_sorting.h
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Hit sorting by shape for coherent shading.
+
+    Indices of the rays are sorted by the shape ID of their closest hit, so shading
+    passes keyed by shape can process hits of the same material together. The keys
+    are calculated from the hit buffer on the device and never read back.
+ */
+
+#pragma once
+#include "calc.h"
+#include "device.h"
+#include "radeon_rays.h"
+
+#include <memory>
+#include <vector>
+
+namespace RadeonRays
+{
+    class KernelProfiler;
+
+    /**
+    \brief Sorts ray indices by hit shape on the GPU.
+
+    Every queue has its own temporary storage, so sorts on different queues can overlap.
+    */
+    class HitSorting
+    {
+    public:
+        // Constructor, formats has to match the record layouts of the intersector
+        HitSorting(Calc::Device* device, int formats = 0);
+        // Destructor
+        ~HitSorting();
+
+        // Set the profiler kernel launches are timed with, might be nullptr
+        void SetProfiler(KernelProfiler* profiler) { m_profiler = profiler; }
+
+        // Write indices of the first num_rays rays to indices, rays with a hit first in increasing
+        // shape ID order followed by the missed ones. The number of hits is written to num_hits
+        // if it isn't nullptr, it can be num_rays.
+        void Sort(std::uint32_t queue_idx, Calc::Buffer const* hits, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Buffer* indices, Calc::Buffer* num_hits, Calc::Event** event);
+
+        HitSorting(HitSorting const&) = delete;
+        HitSorting& operator = (HitSorting const&) = delete;
+
+    private:
+        struct QueueData;
+
+        // Get storage of the queue, reallocate if it is too small
+        QueueData& GetQueueData(std::uint32_t queue_idx, std::uint32_t max_rays);
+
+        Calc::Device* m_device;
+        KernelProfiler* m_profiler;
+        Calc::Executable* m_executable;
+        Calc::Function* m_key_func;
+        Calc::Function* m_count_func;
+        // Temporary storage, one per queue
+        std::vector<std::unique_ptr<QueueData>> m_queues;
+    };
+}
@@ -1,22 +1,335 @@
 #include "intersector.h"
+#include "ray_reorder.h"
+#include "ray_generator.h"
+#include "ray_compaction.h"
+#include "hit_sorting.h"
+#include "ray_batcher.h"
+#include "ray_layout.h"
+#include "hit_reduction.h"
 #include "device.h"
+#include "../world/world.h"
+#include "../except/except.h"
+#include "../util/kernel_profiler.h"
+#include "../util/build_monitor.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+// Rays per launch of background queries unless "acc.lowpriority.slice" is set
+static int const kDefaultLowPrioritySlice = 262144;
 
 namespace RadeonRays
 {
-    Intersector::Intersector(Calc::Device *device)
-        : m_device(device),
-        m_counter(device->CreateBuffer(sizeof(int), Calc::BufferType::kRead),
-                  [device](Calc::Buffer* buffer) { device->DeleteBuffer(buffer); })
+    Intersector::Intersector(Calc::Device *device, int formats)
+        : m_device(device)
+        , m_profiler(nullptr)
+        , m_num_queues(1)
+        , m_reorder_by_default(false)
+        , m_reorder_hinted(false)
+        , m_compact_occlusion(false)
+        , m_indirect_dispatch(true)
+        , m_low_priority_queue(0)
+        , m_low_priority_slice(0)
+        , m_shared_scene(false)
+        , m_formats(formats)
+        , m_stats()
+        , m_bvh_settings_version(0)
     {
+        Calc::DeviceSpec spec;
+        device->GetSpec(spec);
+
+        // The last queue is the least likely to be busy with queries
+        m_upload_queue = spec.max_num_queues > 1 ? spec.max_num_queues - 1 : 0;
+
+        m_num_queues = std::max(spec.max_num_queues, 1U);
+        m_traversal_stats.resize(m_num_queues, nullptr);
+        m_low_priority_queue = spec.low_priority_queue;
+
+        // Queries on different queues may run concurrently, so each gets its own counter
+        for (auto i = 0U; i < m_num_queues; ++i)
+        {
+            m_counters.emplace_back(device->CreateBuffer(sizeof(int), Calc::BufferType::kRead),
+                [device](Calc::Buffer* buffer) { device->DeleteBuffer(buffer); });
+        }
     }
 
     Intersector::~Intersector()
     {
+        WaitForUploads();
+    }
+
+    void Intersector::SetProfiler(KernelProfiler* profiler)
+    {
+        m_profiler = profiler;
+
+        if (m_reorder)
+        {
+            m_reorder->SetProfiler(profiler);
+        }
+
+        if (m_image_reorder)
+        {
+            m_image_reorder->SetProfiler(profiler);
+        }
+
+        if (m_generator)
+        {
+            m_generator->SetProfiler(profiler);
+        }
+
+        if (m_compaction)
+        {
+            m_compaction->SetProfiler(profiler);
+        }
+
+        if (m_hit_sorting)
+        {
+            m_hit_sorting->SetProfiler(profiler);
+        }
+
+        if (m_batcher)
+        {
+            m_batcher->SetProfiler(profiler);
+        }
+
+        if (m_layout)
+        {
+            m_layout->SetProfiler(profiler);
+        }
+
+        if (m_reduction)
+        {
+            m_reduction->SetProfiler(profiler);
+        }
+    }
+
+    void Intersector::SetTraversalStatsBuffer(std::uint32_t queue_idx, Calc::Buffer* stats)
+    {
+        m_traversal_stats[queue_idx] = stats;
+    }
+
+    void Intersector::SetTraversalStatsArg(Calc::Function* func, int& arg, std::uint32_t queue_idx, std::uint32_t max_rays) const
+    {
+        if (!(m_formats & kTraversalStats))
+        {
+            return;
+        }
+
+        auto stats = m_traversal_stats[queue_idx];
+
+        // Kernels write the counters of every ray up to the number of rays
+        if (!stats || stats->GetSize() < max_rays * 4 * sizeof(int))
+        {
+            throw ExceptionImpl("Traversal statistics buffer is not set or too small");
+        }
+
+        func->SetArg(arg++, stats);
+    }
+
+    void Intersector::Execute(Calc::Function const* func, std::uint32_t queue_idx, std::size_t global_size, std::size_t local_size,
+        Calc::Event** event, char const* name) const
+    {
+        ProfiledExecute(m_profiler, m_device, func, queue_idx, global_size, local_size, event, name);
+    }
+
+    void Intersector::ExecuteSliced(Calc::Function const* func, std::uint32_t queue_idx, std::size_t global_size, std::size_t local_size,
+        Calc::Event** event, char const* name) const
+    {
+        // Slices start at multiples of the group size
+        std::size_t const slice = ((m_low_priority_slice + local_size - 1) / local_size) * local_size;
+
+        if (queue_idx != m_low_priority_queue || slice == 0 || global_size <= slice)
+        {
+            Execute(func, queue_idx, global_size, local_size, event, name);
+            return;
+        }
+
+        // Each slice is submitted on its own, so the device schedules launches of other queues in between
+        for (std::size_t offset = 0; offset < global_size; offset += slice)
+        {
+            bool const last = offset + slice >= global_size;
+            ProfiledExecuteRange(m_profiler, m_device, func, queue_idx, offset, std::min(slice, global_size - offset), local_size,
+                last ? event : nullptr, name);
+
+            if (!last)
+            {
+                m_device->Flush(queue_idx);
+            }
+        }
+    }
+
+    void Intersector::Upload(Calc::Buffer* buffer, std::size_t size, void const* data)
+    {
+        AddUpload(buffer, 0, size, data, nullptr);
+    }
+
+    void Intersector::UploadRange(Calc::Buffer* buffer, std::size_t offset, std::size_t size, void const* data)
+    {
+        AddUpload(buffer, offset, size, data, nullptr);
+    }
+
+    Calc::Buffer* Intersector::CreateSceneBuffer(std::size_t size) const
+    {
+        return m_device->CreateBuffer(size, m_shared_scene ? Calc::BufferType::kRead | Calc::BufferType::kShared : Calc::BufferType::kRead);
+    }
+
+    void* Intersector::MapSceneBuffer(Calc::Buffer* buffer, std::size_t size)
+    {
+        void* mapped = nullptr;
+        Calc::Event* e = nullptr;
+        m_device->MapBuffer(buffer, m_upload_queue, 0, size, Calc::MapType::kMapWrite | Calc::MapType::kMapWriteDiscard, &mapped, &e);
+        m_device->WaitForEvent(e);
+        m_device->DeleteEvent(e);
+
+        return mapped;
+    }
+
+    void Intersector::UnmapSceneBuffer(Calc::Buffer* buffer, void* data)
+    {
+        Calc::Event* e = nullptr;
+        m_device->UnmapBuffer(buffer, m_upload_queue, data, &e);
+        m_device->Flush(m_upload_queue);
+
+        std::lock_guard<std::mutex> lock(m_uploads_mutex);
+        m_uploads.push_back({ e, nullptr });
+    }
+
+    void Intersector::AddUpload(Calc::Buffer* buffer, std::size_t offset, std::size_t size, void const* data, std::shared_ptr<void> owner)
+    {
+        if (size == 0)
+        {
+            return;
+        }
+
+        Calc::Event* e = nullptr;
+
+        if (buffer->IsShared())
+        {
+            // The map only waits for the commands using the buffer, the data is copied on the host
+            void* mapped = nullptr;
+            Calc::Event* map_event = nullptr;
+            m_device->MapBuffer(buffer, m_upload_queue, offset, size, Calc::MapType::kMapWrite, &mapped, &map_event);
+            m_device->WaitForEvent(map_event);
+            m_device->DeleteEvent(map_event);
+
+            std::memcpy(mapped, data, size);
+            m_device->UnmapBuffer(buffer, m_upload_queue, mapped, &e);
+        }
+        else
+        {
+            m_device->WriteBuffer(buffer, m_upload_queue, offset, size, const_cast<void*>(data), &e);
+        }
+
+        // Start the transfer while the CPU keeps building
+        m_device->Flush(m_upload_queue);
+
+        std::lock_guard<std::mutex> lock(m_uploads_mutex);
+        m_uploads.push_back({ e, owner });
+    }
+
+    void Intersector::WaitForUploads() const
+    {
+        RR_TRACE_SCOPE("Intersector::WaitForUploads");
+
+        std::lock_guard<std::mutex> lock(m_uploads_mutex);
+
+        for (auto& upload : m_uploads)
+        {
+            upload.event->Wait();
+            m_device->DeleteEvent(upload.event);
+        }
+
+        m_uploads.clear();
     }
     
     void Intersector::SetWorld(World const &world)
     {
+        RR_TRACE_SCOPE("Intersector::SetWorld");
+
+        // Buffers written by the previous Process may be reallocated
+        WaitForUploads();
+
+        // Bit packed occlusion results are written by OpenCL kernels only
+        auto compact = world.options_.GetOption("acc.occlusion.compact");
+        m_compact_occlusion = compact && compact->AsFloat() > 0.f;
+        if (m_compact_occlusion && m_device->GetPlatform() != Calc::Platform::kOpenCL)
+        {
+            throw ExceptionImpl("acc.occlusion.compact is supported on OpenCL devices only");
+        }
+
+        auto indirect = world.options_.GetOption("acc.indirect");
+        m_indirect_dispatch = !indirect || indirect->AsFloat() > 0.f;
+
+        // Splitting only lets other queues in if background work has a queue of its own,
+        // global offsets are OpenCL only
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+        auto slice = world.options_.GetOption("acc.lowpriority.slice");
+        auto const slice_rays = slice ? std::max(static_cast<int>(slice->AsFloat()), 0) : kDefaultLowPrioritySlice;
+        m_low_priority_slice = m_device->GetPlatform() == Calc::Platform::kOpenCL && spec.low_priority_queue != spec.high_priority_queue ?
+            static_cast<std::size_t>(slice_rays) : 0;
+
+        // Devices without fine-grained shared virtual memory keep copying the scene
+        auto shared_memory = world.options_.GetOption("acc.shared_memory");
+        m_shared_scene = shared_memory && shared_memory->AsFloat() > 0.f && spec.shared_virtual_memory;
+
+        auto start = std::chrono::high_resolution_clock::now();
+
         Process(world);
+
+        m_bvh_settings_version = world.options_.GetBvhSettings().version;
+
+        m_stats.commit_time = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+        // Sorting relies on OpenCL kernels and device radix sort
+        auto reorder = world.options_.GetOption("acc.reorder");
+        m_reorder_by_default = reorder && reorder->AsFloat() > 0.f;
+        if ((m_reorder_by_default || m_reorder_hinted) &&
+            m_device->GetPlatform() == Calc::Platform::kOpenCL && m_device->HasBuiltinPrimitives())
+        {
+            if (!m_reorder)
+            {
+                m_reorder.reset(new RayReorder(m_device, m_formats));
+                m_reorder->SetProfiler(m_profiler);
+            }
+
+            m_reorder->SetWorld(world);
+        }
+        else
+        {
+            m_reorder.reset();
+        }
+    }
+
+    bool Intersector::BvhSettingsChanged(World const& world) const
+    {
+        return world.options_.GetBvhSettings().version != m_bvh_settings_version;
+    }
+
+    bool Intersector::KeepHostCopies(World const& world)
+    {
+        auto keep = world.options_.GetOption("mem.keep_host_copies");
+        return !keep || keep->AsFloat() > 0.f;
+    }
+
+    void Intersector::CheckCancelled(World const& world)
+    {
+        if (world.monitor_)
+        {
+            world.monitor_->Check();
+        }
+    }
+
+    void Intersector::GetStats(AccelStats& stats) const
+    {
+        stats = m_stats;
+        GetMemoryStats(stats);
+    }
+
+    void Intersector::GetMemoryStats(AccelStats& stats) const
+    {
     }
 
     bool Intersector::IsCompatible(World const& world) const
@@ -28,32 +341,612 @@ namespace RadeonRays
     {
         return true;
     }
+
+    void Intersector::OccludedCompact(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+        std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
+    {
+        throw ExceptionImpl("Compact occlusion output is not supported by the accelerator");
+    }
+
+    bool Intersector::SupportsCompactOcclusion() const
+    {
+        return false;
+    }
+
+    void Intersector::IntersectCoherent(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+        std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
+    {
+        Intersect(queue_idx, rays, num_rays, max_rays, hits, wait_event, event);
+    }
+
+    void Intersector::IntersectMulti(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+        std::uint32_t max_rays, int k, Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
+    {
+        throw ExceptionImpl("Multi-hit queries are not supported by the accelerator");
+    }
+
+    void Intersector::IntersectAttributes(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+        std::uint32_t max_rays, int num_attributes, Calc::Buffer *hits, Calc::Buffer *attributes,
+        Calc::Event const *wait_event, Calc::Event **event) const
+    {
+        throw ExceptionImpl("Attribute queries are not supported by the accelerator");
+    }
+
+    void Intersector::OccludedCached(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+        std::uint32_t max_rays, Calc::Buffer *occluders, Calc::Buffer *hits,
+        Calc::Event const *wait_event, Calc::Event **event) const
+    {
+        throw ExceptionImpl("Occluder caching is not supported by the accelerator");
+    }
+
+    void Intersector::FindOverlaps(std::uint32_t queue_idx, Calc::Buffer const *boxes, Calc::Buffer const *num_boxes,
+        std::uint32_t max_boxes, int max_overlaps, Calc::Buffer *overlaps, Calc::Buffer *counts,
+        Calc::Event const *wait_event, Calc::Event **event) const
+    {
+        throw ExceptionImpl("Overlap queries are not supported by the accelerator");
+    }
+
+    void Intersector::FindClosestPoints(std::uint32_t queue_idx, Calc::Buffer const *points, Calc::Buffer const *num_points,
+        std::uint32_t max_points, float max_dist, Calc::Buffer *results,
+        Calc::Event const *wait_event, Calc::Event **event) const
+    {
+        throw ExceptionImpl("Closest point queries are not supported by the accelerator");
+    }
     
     void Intersector::QueryIntersection(std::uint32_t queue_idx, Calc::Buffer const *rays, std::uint32_t num_rays,
-        Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
+        Calc::Buffer *hits, QueryHint hint, Calc::Event const *wait_event, Calc::Event **event) const
     {
-        m_device->WriteBuffer(m_counter.get(), 0, 0, sizeof(num_rays), &num_rays, nullptr);
-        m_device->Finish(0);
-        Intersect(queue_idx, rays, m_counter.get(), num_rays, hits, wait_event, event);
+        RR_TRACE_SCOPE("Intersector::QueryIntersection");
+
+        auto counter = m_counters[queue_idx].get();
+        m_device->WriteBuffer(counter, queue_idx, 0, sizeof(num_rays), &num_rays, nullptr);
+        m_device->Finish(queue_idx);
+        QueryIntersection(queue_idx, rays, counter, num_rays, hits, hint, wait_event, event);
     }
 
     void Intersector::QueryOcclusion(std::uint32_t queue_idx, Calc::Buffer const *rays, std::uint32_t num_rays,
-        Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
+        Calc::Buffer *hits, QueryHint hint, Calc::Event const *wait_event, Calc::Event **event) const
     {
-        m_device->WriteBuffer(m_counter.get(), 0, 0, sizeof(num_rays), &num_rays, nullptr);
-        m_device->Finish(0);
-        Occluded(queue_idx, rays, m_counter.get(), num_rays, hits, wait_event, event);
+        RR_TRACE_SCOPE("Intersector::QueryOcclusion");
+
+        auto counter = m_counters[queue_idx].get();
+        m_device->WriteBuffer(counter, queue_idx, 0, sizeof(num_rays), &num_rays, nullptr);
+        m_device->Finish(queue_idx);
+        QueryOcclusion(queue_idx, rays, counter, num_rays, hits, hint, wait_event, event);
     }
 
     void Intersector::QueryIntersection(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
-        std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
+        std::uint32_t max_rays, Calc::Buffer *hits, QueryHint hint, Calc::Event const *wait_event, Calc::Event **event) const
     {
-        Intersect(queue_idx, rays, num_rays, max_rays, hits, wait_event, event);
+        RR_TRACE_SCOPE("Intersector::QueryIntersection");
+
+        // Scene data may still be in flight on the upload queue
+        WaitForUploads();
+
+        if (UseReorder(hint))
+        {
+            // Traverse in sorted order, queue is in-order so only the scatter needs an event
+            Calc::Buffer* sorted_rays = nullptr;
+            Calc::Buffer* sorted_hits = nullptr;
+            m_reorder->GatherIntersections(queue_idx, rays, num_rays, max_rays, hits, &sorted_rays, &sorted_hits);
+            Intersect(queue_idx, sorted_rays, num_rays, max_rays, sorted_hits, wait_event, nullptr);
+            m_reorder->ScatterIntersections(queue_idx, num_rays, max_rays, hits, event);
+        }
+        else if (hint == kQueryHintCoherent)
+        {
+            IntersectCoherent(queue_idx, rays, num_rays, max_rays, hits, wait_event, event);
+        }
+        else
+        {
+            Intersect(queue_idx, rays, num_rays, max_rays, hits, wait_event, event);
+        }
     }
 
     void Intersector::QueryOcclusion(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+        std::uint32_t max_rays, Calc::Buffer *hits, QueryHint hint, Calc::Event const *wait_event, Calc::Event **event) const
+    {
+        RR_TRACE_SCOPE("Intersector::QueryOcclusion");
+
+        WaitForUploads();
+
+        if (m_compact_occlusion)
+        {
+            // Bits of neighbouring rays share a word, so the results can not be
+            // scattered back after reordering and the rays are traversed in the user order
+            OccludedCompact(queue_idx, rays, num_rays, max_rays, hits, wait_event, event);
+        }
+        else if (UseReorder(hint))
+        {
+            // Traverse in sorted order, queue is in-order so only the scatter needs an event
+            Calc::Buffer* sorted_rays = nullptr;
+            Calc::Buffer* sorted_hits = nullptr;
+            m_reorder->GatherOcclusions(queue_idx, rays, num_rays, max_rays, hits, &sorted_rays, &sorted_hits);
+            Occluded(queue_idx, sorted_rays, num_rays, max_rays, sorted_hits, wait_event, nullptr);
+            m_reorder->ScatterOcclusions(queue_idx, num_rays, max_rays, hits, event);
+        }
+        else
+        {
+            Occluded(queue_idx, rays, num_rays, max_rays, hits, wait_event, event);
+        }
+    }
+
+    void Intersector::QueryIntersection(std::uint32_t queue_idx, RayStreams const& rays, std::uint32_t num_rays,
+        HitStreams const& hits, QueryHint hint, Calc::Event const* wait_event, Calc::Event** event) const
+    {
+        RR_TRACE_SCOPE("Intersector::QueryIntersection");
+
+        auto layout = GetLayoutConverter();
+        std::size_t const hit_size = (m_formats & kCompactHits) ? sizeof(PackedIntersection) : sizeof(Intersection);
+
+        // Queue is in-order, so traversal sees the built records and the scatter its hits
+        Calc::Buffer* ray_records = nullptr;
+        Calc::Buffer* hit_records = nullptr;
+        layout->GatherRays(queue_idx, rays, num_rays, hit_size, &ray_records, &hit_records);
+        QueryIntersection(queue_idx, ray_records, num_rays, hit_records, hint, wait_event, nullptr);
+        layout->ScatterHits(queue_idx, hits, num_rays, event);
+    }
+
+    void Intersector::QueryOcclusion(std::uint32_t queue_idx, RayStreams const& rays, std::uint32_t num_rays,
+        Calc::Buffer* hits, QueryHint hint, Calc::Event const* wait_event, Calc::Event** event) const
+    {
+        RR_TRACE_SCOPE("Intersector::QueryOcclusion");
+
+        // Results are a stream already, only the rays are converted
+        Calc::Buffer* ray_records = nullptr;
+        Calc::Buffer* unused = nullptr;
+        GetLayoutConverter()->GatherRays(queue_idx, rays, num_rays, 0, &ray_records, &unused);
+        QueryOcclusion(queue_idx, ray_records, num_rays, hits, hint, wait_event, event);
+    }
+
+    void Intersector::QueryDistance(std::uint32_t queue_idx, Calc::Buffer const* rays, std::uint32_t num_rays,
+        Calc::Buffer* distances, QueryHint hint, Calc::Event const* wait_event, Calc::Event** event) const
+    {
+        RR_TRACE_SCOPE("Intersector::QueryDistance");
+
+        auto reduction = GetHitReduction();
+        std::size_t const hit_size = (m_formats & kCompactHits) ? sizeof(PackedIntersection) : sizeof(Intersection);
+
+        // Queue is in-order, so the reduction sees the hits of the traversal
+        auto hits = reduction->GetResults(queue_idx, num_rays * hit_size);
+        QueryIntersection(queue_idx, rays, num_rays, hits, hint, wait_event, nullptr);
+        reduction->WriteDistances(queue_idx, rays, num_rays, distances, event);
+    }
+
+    void Intersector::QueryOcclusionCount(std::uint32_t queue_idx, Calc::Buffer const* rays, std::uint32_t num_rays,
+        std::uint32_t group_size, Calc::Buffer* counts, QueryHint hint, Calc::Event const* wait_event, Calc::Event** event) const
+    {
+        RR_TRACE_SCOPE("Intersector::QueryOcclusionCount");
+
+        auto reduction = GetHitReduction();
+
+        // Bit packed results are a 32nd of the int ones, they are traversed in the user order
+        bool const packed = SupportsCompactOcclusion();
+        std::size_t const size = packed ? GetPackedOcclusionSize(static_cast<int>(num_rays)) * sizeof(std::uint32_t) : num_rays * sizeof(int);
+
+        // Queue is in-order, so the reduction sees the results of the traversal
+        auto results = reduction->GetResults(queue_idx, size);
+        if (packed)
+        {
+            QueryOcclusionPacked(queue_idx, rays, num_rays, results, wait_event, nullptr);
+        }
+        else
+        {
+            QueryOcclusion(queue_idx, rays, num_rays, results, hint, wait_event, nullptr);
+        }
+
+        reduction->CountOccluded(queue_idx, rays, num_rays, packed, group_size, counts, event);
+    }
+
+    bool Intersector::UseReorder(QueryHint hint) const
+    {
+        switch (hint)
+        {
+        case kQueryHintIncoherent:
+            // Sorting is prepared by the next Process if it isn't enabled yet
+            m_reorder_hinted = true;
+            return m_reorder != nullptr;
+        case kQueryHintCoherent:
+        case kQueryHintShortRays:
+        case kQueryHintShadow:
+            // Coherent rays gain nothing from sorting, short and any hit traversals don't pay for it
+            return false;
+        default:
+            return m_reorder && m_reorder_by_default;
+        }
+    }
+
+    void Intersector::QueryOcclusionPacked(std::uint32_t queue_idx, Calc::Buffer const *rays, std::uint32_t num_rays,
+        Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
+    {
+        RR_TRACE_SCOPE("Intersector::QueryOcclusionPacked");
+
+        auto counter = m_counters[queue_idx].get();
+        m_device->WriteBuffer(counter, queue_idx, 0, sizeof(num_rays), &num_rays, nullptr);
+        m_device->Finish(queue_idx);
+        QueryOcclusionPacked(queue_idx, rays, counter, num_rays, hits, wait_event, event);
+    }
+
+    void Intersector::QueryOcclusionPacked(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
         std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
     {
-        Occluded(queue_idx, rays, num_rays, max_rays, hits, wait_event, event);
+        RR_TRACE_SCOPE("Intersector::QueryOcclusionPacked");
+
+        WaitForUploads();
+
+        // Bit packed results are written by OpenCL kernels only
+        if (m_device->GetPlatform() != Calc::Platform::kOpenCL)
+        {
+            throw ExceptionImpl("Packed occlusion queries are supported on OpenCL devices only");
+        }
+
+        OccludedCompact(queue_idx, rays, num_rays, max_rays, hits, wait_event, event);
+    }
+
+    void Intersector::QueryIntersectionMulti(std::uint32_t queue_idx, Calc::Buffer const *rays, std::uint32_t num_rays,
+        int k, Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
+    {
+        RR_TRACE_SCOPE("Intersector::QueryIntersectionMulti");
+
+        auto counter = m_counters[queue_idx].get();
+        m_device->WriteBuffer(counter, queue_idx, 0, sizeof(num_rays), &num_rays, nullptr);
+        m_device->Finish(queue_idx);
+        QueryIntersectionMulti(queue_idx, rays, counter, num_rays, k, hits, wait_event, event);
+    }
+
+    void Intersector::QueryIntersectionMulti(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+        std::uint32_t max_rays, int k, Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
+    {
+        RR_TRACE_SCOPE("Intersector::QueryIntersectionMulti");
+
+        WaitForUploads();
+
+        // Hit lists are kept in registers, so their size is bounded at compile time
+        if (k < 1 || k > kMaxMultiHits)
+        {
+            throw ExceptionImpl("Number of hits per ray is out of range");
+        }
+
+        if (m_device->GetPlatform() != Calc::Platform::kOpenCL)
+        {
+            throw ExceptionImpl("Multi-hit queries are supported on OpenCL devices only");
+        }
+
+        // Reordering scatters a single record per ray, so the rays are traversed in the user order
+        IntersectMulti(queue_idx, rays, num_rays, max_rays, k, hits, wait_event, event);
+    }
+
+    void Intersector::QueryIntersectionAttributes(std::uint32_t queue_idx, Calc::Buffer const* rays, std::uint32_t num_rays,
+        int num_attributes, Calc::Buffer* hits, Calc::Buffer* attributes, Calc::Event const* wait_event, Calc::Event** event) const
+    {
+        RR_TRACE_SCOPE("Intersector::QueryIntersectionAttributes");
+
+        WaitForUploads();
+
+        // Meshes keep at most kMaxVertexAttributes, more would only add zeros
+        if (num_attributes < 1 || num_attributes > kMaxVertexAttributes)
+        {
+            throw ExceptionImpl("Number of attributes per ray is out of range");
+        }
+
+        if (m_device->GetPlatform() != Calc::Platform::kOpenCL)
+        {
+            throw ExceptionImpl("Attribute queries are supported on OpenCL devices only");
+        }
+
+        auto counter = m_counters[queue_idx].get();
+        m_device->WriteBuffer(counter, queue_idx, 0, sizeof(num_rays), &num_rays, nullptr);
+        m_device->Finish(queue_idx);
+
+        // Reordering scatters the hits only, so the rays are traversed in the user order
+        IntersectAttributes(queue_idx, rays, counter, num_rays, num_attributes, hits, attributes, wait_event, event);
+    }
+
+    void Intersector::QueryOcclusionCached(std::uint32_t queue_idx, Calc::Buffer const* rays, std::uint32_t num_rays,
+        Calc::Buffer* occluders, Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const
+    {
+        RR_TRACE_SCOPE("Intersector::QueryOcclusionCached");
+
+        WaitForUploads();
+
+        if (m_device->GetPlatform() != Calc::Platform::kOpenCL)
+        {
+            throw ExceptionImpl("Occluder caching is supported on OpenCL devices only");
+        }
+
+        auto counter = m_counters[queue_idx].get();
+        m_device->WriteBuffer(counter, queue_idx, 0, sizeof(num_rays), &num_rays, nullptr);
+        m_device->Finish(queue_idx);
+
+        // Occluders are per ray, so the rays are traversed in the user order
+        OccludedCached(queue_idx, rays, counter, num_rays, occluders, hits, wait_event, event);
+    }
+
+    void Intersector::QueryOverlap(std::uint32_t queue_idx, Calc::Buffer const* boxes, std::uint32_t num_boxes, int max_overlaps,
+        Calc::Buffer* overlaps, Calc::Buffer* counts, Calc::Event const* wait_event, Calc::Event** event) const
+    {
+        RR_TRACE_SCOPE("Intersector::QueryOverlap");
+
+        WaitForUploads();
+
+        if (max_overlaps < 1)
+        {
+            throw ExceptionImpl("Number of overlaps per box is out of range");
+        }
+
+        if (m_device->GetPlatform() != Calc::Platform::kOpenCL)
+        {
+            throw ExceptionImpl("Overlap queries are supported on OpenCL devices only");
+        }
+
+        auto counter = m_counters[queue_idx].get();
+        m_device->WriteBuffer(counter, queue_idx, 0, sizeof(num_boxes), &num_boxes, nullptr);
+        m_device->Finish(queue_idx);
+
+        FindOverlaps(queue_idx, boxes, counter, num_boxes, max_overlaps, overlaps, counts, wait_event, event);
+    }
+
+    void Intersector::QueryClosestPoint(std::uint32_t queue_idx, Calc::Buffer const* points, std::uint32_t num_points, float max_dist,
+        Calc::Buffer* results, Calc::Event const* wait_event, Calc::Event** event) const
+    {
+        RR_TRACE_SCOPE("Intersector::QueryClosestPoint");
+
+        WaitForUploads();
+
+        if (!(max_dist >= 0.f))
+        {
+            throw ExceptionImpl("Closest point distance is out of range");
+        }
+
+        if (m_device->GetPlatform() != Calc::Platform::kOpenCL)
+        {
+            throw ExceptionImpl("Closest point queries are supported on OpenCL devices only");
+        }
+
+        auto counter = m_counters[queue_idx].get();
+        m_device->WriteBuffer(counter, queue_idx, 0, sizeof(num_points), &num_points, nullptr);
+        m_device->Finish(queue_idx);
+
+        FindClosestPoints(queue_idx, points, counter, num_points, max_dist, results, wait_event, event);
+    }
+
+    RayGenerator* Intersector::GetRayGenerator() const
+    {
+        // Generation kernels are written in OpenCL only
+        if (m_device->GetPlatform() != Calc::Platform::kOpenCL)
+        {
+            throw ExceptionImpl("Built-in ray generators are supported on OpenCL devices only");
+        }
+
+        std::lock_guard<std::mutex> lock(m_passes_mutex);
+
+        if (!m_generator)
+        {
+            m_generator.reset(new RayGenerator(m_device, m_formats));
+            m_generator->SetProfiler(m_profiler);
+        }
+
+        return m_generator.get();
+    }
+
+    RayLayoutConverter* Intersector::GetLayoutConverter() const
+    {
+        // Conversion kernels are written in OpenCL only
+        if (m_device->GetPlatform() != Calc::Platform::kOpenCL)
+        {
+            throw ExceptionImpl("Ray and hit streams are supported on OpenCL devices only");
+        }
+
+        std::lock_guard<std::mutex> lock(m_passes_mutex);
+
+        if (!m_layout)
+        {
+            m_layout.reset(new RayLayoutConverter(m_device, m_formats));
+            m_layout->SetProfiler(m_profiler);
+        }
+
+        return m_layout.get();
+    }
+
+    HitReduction* Intersector::GetHitReduction() const
+    {
+        // Reduction kernels are written in OpenCL only
+        if (m_device->GetPlatform() != Calc::Platform::kOpenCL)
+        {
+            throw ExceptionImpl("Distance and occlusion count queries are supported on OpenCL devices only");
+        }
+
+        std::lock_guard<std::mutex> lock(m_passes_mutex);
+
+        if (!m_reduction)
+        {
+            m_reduction.reset(new HitReduction(m_device, m_formats));
+            m_reduction->SetProfiler(m_profiler);
+        }
+
+        return m_reduction.get();
+    }
+
+    void Intersector::QueryIntersection2D(std::uint32_t queue_idx, Calc::Buffer const* rays, std::uint32_t width,
+        std::uint32_t height, RayOrder order, Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const
+    {
+        RR_TRACE_SCOPE("Intersector::QueryIntersection2D");
+
+        // Pixel keys hold 15 bits per axis
+        if (width > static_cast<std::uint32_t>(kMaxImageSize) || height > static_cast<std::uint32_t>(kMaxImageSize))
+        {
+            throw ExceptionImpl("Image is too large for ordered traversal");
+        }
+
+        // Remapping relies on OpenCL kernels and device radix sort, hits don't depend on the order
+        if (order == kRayOrderScanline ||
+            m_device->GetPlatform() != Calc::Platform::kOpenCL || !m_device->HasBuiltinPrimitives())
+        {
+            QueryIntersection(queue_idx, rays, width * height, hits, kQueryHintCoherent, wait_event, event);
+            return;
+        }
+
+        if (order != kRayOrderMorton && order != kRayOrderTiled)
+        {
+            throw ExceptionImpl("Unknown ray order");
+        }
+
+        std::uint32_t num_rays = width * height;
+        auto counter = m_counters[queue_idx].get();
+        m_device->WriteBuffer(counter, queue_idx, 0, sizeof(num_rays), &num_rays, nullptr);
+        m_device->Finish(queue_idx);
+
+        WaitForUploads();
+
+        {
+            std::lock_guard<std::mutex> lock(m_passes_mutex);
+
+            if (!m_image_reorder)
+            {
+                m_image_reorder.reset(new RayReorder(m_device, m_formats));
+                m_image_reorder->SetProfiler(m_profiler);
+            }
+        }
+
+        // Image order replaces "acc.reorder" sorting, queue is in-order so only the scatter needs an event
+        Calc::Buffer* sorted_rays = nullptr;
+        Calc::Buffer* sorted_hits = nullptr;
+        m_image_reorder->GatherImageIntersections(queue_idx, rays, counter, width, height, order, hits, &sorted_rays, &sorted_hits);
+        IntersectCoherent(queue_idx, sorted_rays, counter, num_rays, sorted_hits, wait_event, nullptr);
+        m_image_reorder->ScatterIntersections(queue_idx, counter, num_rays, hits, event);
+    }
+
+    void Intersector::QueryPrimaryPinhole(std::uint32_t queue_idx, PinholeCamera const& camera, std::uint32_t width,
+        std::uint32_t height, Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const
+    {
+        RR_TRACE_SCOPE("Intersector::QueryPrimaryPinhole");
+
+        // Queue is in-order, so traversal sees the generated rays, camera rays are coherent
+        auto rays = GetRayGenerator()->GeneratePinhole(queue_idx, camera, width, height);
+        QueryIntersection(queue_idx, rays, width * height, hits, kQueryHintCoherent, wait_event, event);
+    }
+
+    void Intersector::QueryShadowFromHits(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* hits,
+        std::uint32_t num_rays, float3 const& light, float epsilon, Calc::Buffer* results,
+        Calc::Event const* wait_event, Calc::Event** event) const
+    {
+        RR_TRACE_SCOPE("Intersector::QueryShadowFromHits");
+
+        auto generator = GetRayGenerator();
+
+        auto counter = m_counters[queue_idx].get();
+        m_device->WriteBuffer(counter, queue_idx, 0, sizeof(num_rays), &num_rays, nullptr);
+        m_device->Finish(queue_idx);
+
+        auto shadow_rays = generator->GenerateShadow(queue_idx, rays, hits, counter, num_rays, light, epsilon,
+            results, m_compact_occlusion);
+        QueryOcclusion(queue_idx, shadow_rays, counter, num_rays, results, kQueryHintDefault, wait_event, event);
+    }
+
+    void Intersector::CompactRays(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+        std::uint32_t max_rays, Calc::Buffer const* predicate, Calc::Buffer* compacted, Calc::Buffer* new_num_rays,
+        Calc::Buffer* indices, Calc::Event const* wait_event, Calc::Event** event) const
+    {
+        RR_TRACE_SCOPE("Intersector::CompactRays");
+
+        // Compaction relies on OpenCL kernels and device primitives
+        if (m_device->GetPlatform() != Calc::Platform::kOpenCL || !m_device->HasBuiltinPrimitives())
+        {
+            throw ExceptionImpl("Ray compaction is supported on OpenCL devices only");
+        }
+
+        if (rays == compacted)
+        {
+            throw ExceptionImpl("Rays can't be compacted in place");
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_passes_mutex);
+
+            if (!m_compaction)
+            {
+                m_compaction.reset(new RayCompaction(m_device, m_formats));
+                m_compaction->SetProfiler(m_profiler);
+            }
+        }
+
+        m_compaction->Compact(queue_idx, rays, num_rays, max_rays, predicate, compacted, new_num_rays, indices, event);
+    }
+
+    void Intersector::SortHits(std::uint32_t queue_idx, Calc::Buffer const* hits, Calc::Buffer const* num_rays,
+        std::uint32_t max_rays, Calc::Buffer* indices, Calc::Buffer* num_hits,
+        Calc::Event const* wait_event, Calc::Event** event) const
+    {
+        RR_TRACE_SCOPE("Intersector::SortHits");
+
+        // Sorting relies on OpenCL kernels and device primitives
+        if (m_device->GetPlatform() != Calc::Platform::kOpenCL || !m_device->HasBuiltinPrimitives())
+        {
+            throw ExceptionImpl("Hit sorting is supported on OpenCL devices only");
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_passes_mutex);
+
+            if (!m_hit_sorting)
+            {
+                m_hit_sorting.reset(new HitSorting(m_device, m_formats));
+                m_hit_sorting->SetProfiler(m_profiler);
+            }
+        }
+
+        m_hit_sorting->Sort(queue_idx, hits, num_rays, max_rays, indices, num_hits, event);
+    }
+
+    bool Intersector::SupportsBatching(bool occlusion) const
+    {
+        // Copy kernels are written in OpenCL only
+        return m_device->GetPlatform() == Calc::Platform::kOpenCL && !(occlusion && m_compact_occlusion);
+    }
+
+    void Intersector::QueryBatch(std::uint32_t queue_idx, BatchedQuery const* queries, std::uint32_t num_queries,
+        bool occlusion, Calc::Event** event) const
+    {
+        RR_TRACE_SCOPE("Intersector::QueryBatch");
+
+        if (!SupportsBatching(occlusion))
+        {
+            throw ExceptionImpl("Query batches are supported on OpenCL devices only");
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_passes_mutex);
+
+            if (!m_batcher)
+            {
+                m_batcher.reset(new RayBatcher(m_device));
+                m_batcher->SetProfiler(m_profiler);
+            }
+        }
+
+        std::size_t const ray_size = (m_formats & kCompactRays) ? sizeof(PackedRay) : sizeof(ray);
+        std::size_t const hit_size = occlusion ? sizeof(int) :
+            (m_formats & kCompactHits) ? sizeof(PackedIntersection) : sizeof(Intersection);
+
+        std::uint32_t num_rays = 0;
+        for (auto i = 0U; i < num_queries; ++i)
+        {
+            num_rays += queries[i].num_rays;
+        }
+
+        // Queue is in-order, so traversal sees the gathered records and the scatter its hits
+        Calc::Buffer* rays = nullptr;
+        Calc::Buffer* hits = nullptr;
+        m_batcher->Gather(queue_idx, queries, num_queries, ray_size, hit_size, &rays, &hits);
+
+        if (occlusion)
+        {
+            QueryOcclusion(queue_idx, rays, num_rays, hits, kQueryHintDefault, nullptr, nullptr);
+        }
+        else
+        {
+            QueryIntersection(queue_idx, rays, num_rays, hits, kQueryHintDefault, nullptr, nullptr);
+        }
+
+        m_batcher->Scatter(queue_idx, queries, num_queries, hit_size, event);
     }
 }
@@ -31,13 +31,120 @@ THE SOFTWARE.
 #include "calc.h"
 #include "buffer.h"
 #include "event.h"
+#include "executable.h"
 
+#include <atomic>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 namespace RadeonRays
 {
     class World;
+    class RayReorder;
+    class RayGenerator;
+    class RayCompaction;
+    class HitSorting;
+    class RayBatcher;
+    class RayLayoutConverter;
+    class HitReduction;
+    class KernelProfiler;
+    struct BatchedQuery;
+    struct RayStreams;
+    struct HitStreams;
+
+    // Hit and ray record layouts and traversal features compiled into the kernels, flags can be combined
+    enum RecordFormat
+    {
+        kFullRecords = 0,
+        // Intersection kernels write PackedIntersection records
+        kCompactHits = 0x1,
+        // Queries read PackedRay records
+        kCompactRays = 0x2,
+        // Leaves test precomputed triangle transforms instead of fetching vertices
+        kPrecomputedTriangles = 0x4,
+        // Top level bounds and shape transforms follow linear velocity over ray time
+        kMotionBlur = 0x8,
+        // Traversal tests ray masks against shape masks
+        kRayMask = 0x10,
+        // 2-level traversal enters groups, otherwise it keeps a single shape level
+        kNestedInstances = 0x20,
+        // Skip links traversal follows the child order of the ray direction octant
+        kOctantLinks = 0x40,
+        // 2-level faces keep 16-bit mesh-local vertex indices in the mesh face order
+        kCompactFaces = 0x80,
+        // 2-level vertices are 16-bit unorm positions within the vertex bounds of their mesh
+        kQuantizedVertices = 0x100,
+        // Closest hit kernels write per-ray traversal counters
+        kTraversalStats = 0x200,
+        // 2-level traversal picks the level of detail of top level instances by distance
+        kLodInstances = 0x400
+    };
+
+    // Kernel build options selecting the record layouts and features
+    inline std::string GetRecordFormatOptions(int formats)
+    {
+        std::string options;
+
+        if (formats & kCompactHits)
+        {
+            options.append("-D RR_COMPACT_HITS ");
+        }
+
+        if (formats & kCompactRays)
+        {
+            options.append("-D RR_COMPACT_RAYS ");
+        }
+
+        if (formats & kPrecomputedTriangles)
+        {
+            options.append("-D RR_PRECOMPUTED_TRIANGLES ");
+        }
+
+        if (formats & kMotionBlur)
+        {
+            options.append("-D RR_MOTION_BLUR ");
+        }
+
+        if (formats & kRayMask)
+        {
+            options.append("-D RR_RAY_MASK ");
+        }
+
+        if (formats & kNestedInstances)
+        {
+            options.append("-D RR_NESTED_INSTANCES ");
+        }
+
+        if (formats & kOctantLinks)
+        {
+            options.append("-D RR_OCTANT_LINKS ");
+        }
+
+        if (formats & kCompactFaces)
+        {
+            options.append("-D RR_COMPACT_FACES ");
+        }
+
+        if (formats & kQuantizedVertices)
+        {
+            options.append("-D RR_QUANTIZED_VERTICES ");
+        }
+
+        if (formats & kTraversalStats)
+        {
+            options.append("-D RR_TRAVERSAL_STATS ");
+        }
+
+        if (formats & kLodInstances)
+        {
+            options.append("-D RR_LOD_INSTANCES ");
+        }
+
+        return options;
+    }
 
     /** 
     \brief Intersector interface
@@ -53,7 +160,8 @@ namespace RadeonRays
     public:
         // Constructor accepts Calc::Device paramter 
         // which is going to be used by an intersector.
-        Intersector(Calc::Device* device);
+        // formats is a combination of RecordFormat flags.
+        Intersector(Calc::Device* device, int formats = kFullRecords);
         // Destructor.
         virtual ~Intersector();
 
@@ -71,6 +179,24 @@ namespace RadeonRays
         */
         void SetWorld(World const& world);
 
+        /**
+        \brief Set the profiler kernel launches are timed with.
+
+        \param profiler Profiler which outlives the intersector, nullptr to launch directly.
+        */
+        virtual void SetProfiler(KernelProfiler* profiler);
+
+        /**
+        \brief Set the buffer closest hit queries on a queue write traversal counters to.
+
+        Used only if the kernels are compiled with kTraversalStats, the buffer holds
+        4 ints per ray in the order rays are traversed.
+
+        \param queue_idx Device queue index.
+        \param stats Counter buffer, nullptr to unset.
+        */
+        void SetTraversalStatsBuffer(std::uint32_t queue_idx, Calc::Buffer* stats);
+
         /** 
         \brief Query intersection for a batch of rays
 
@@ -81,11 +207,12 @@ namespace RadeonRays
         \param rays Ray buffer.
         \param num_rays Number of rays in the buffer.
         \param hits Hit data buffer.
+        \param hint Kind of rays, selects sorted, packet or user order traversal.
         \param wait_event Event to wait for before execution.
         \param event Completion event.
         */
         void QueryIntersection(std::uint32_t queue_idx, Calc::Buffer const* rays, std::uint32_t num_rays,
-            Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const;
+            Calc::Buffer* hits, QueryHint hint, Calc::Event const* wait_event, Calc::Event** event) const;
 
         /** 
         \brief Query occlusion for a batch of rays
@@ -97,11 +224,12 @@ namespace RadeonRays
         \param rays Ray buffer.
         \param num_rays Number of rays in the buffer.
         \param hits Hit data buffer.
+        \param hint Kind of rays, selects sorted or user order traversal.
         \param wait_event Event to wait for before execution.
         \param event Completion event.
         */
         void QueryOcclusion(std::uint32_t queue_idx, Calc::Buffer const* rays, std::uint32_t num_rays,
-            Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const;
+            Calc::Buffer* hits, QueryHint hint, Calc::Event const* wait_event, Calc::Event** event) const;
 
         /** 
         \brief Query intersection for a batch of rays
@@ -113,11 +241,12 @@ namespace RadeonRays
         \param rays Ray buffer.
         \param num_rays Buffer, containing the number of rays in rays buffer.
         \param hits Hit data buffer.
+        \param hint Kind of rays, selects sorted, packet or user order traversal.
         \param wait_event Event to wait for before execution.
         \param event Completion event.
         */
         void QueryIntersection(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
-            std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const;
+            std::uint32_t max_rays, Calc::Buffer *hits, QueryHint hint, Calc::Event const *wait_event, Calc::Event **event) const;
 
         /** 
         \brief Query occlusion for a batch of rays
@@ -129,12 +258,336 @@ namespace RadeonRays
         \param rays Ray buffer.
         \param num_rays Buffer, containing the number of rays in rays buffer.
         \param hits Hit data buffer.
+        \param hint Kind of rays, selects sorted or user order traversal.
         \param wait_event Event to wait for before execution.
         \param event Completion event.
         */
         void QueryOcclusion(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Buffer* hits, QueryHint hint, Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /** 
+        \brief Query intersection for a batch of rays in structure of arrays layout
+
+        Ray records are built from the streams on the device and the hit records are split into
+        the hit streams after traversal, so the result is the same as querying records.
+        Supported on OpenCL devices only.
+
+        \param queue_idx Device queue index.
+        \param rays Ray streams.
+        \param num_rays Number of rays in the streams.
+        \param hits Hit streams.
+        \param hint Kind of rays, selects sorted, packet or user order traversal.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void QueryIntersection(std::uint32_t queue_idx, RayStreams const& rays, std::uint32_t num_rays,
+            HitStreams const& hits, QueryHint hint, Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /** 
+        \brief Query occlusion for a batch of rays in structure of arrays layout
+
+        Results are written as by QueryOcclusion. Supported on OpenCL devices only.
+
+        \param queue_idx Device queue index.
+        \param rays Ray streams.
+        \param num_rays Number of rays in the streams.
+        \param hits Hit data buffer.
+        \param hint Kind of rays, selects sorted or user order traversal.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void QueryOcclusion(std::uint32_t queue_idx, RayStreams const& rays, std::uint32_t num_rays,
+            Calc::Buffer* hits, QueryHint hint, Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /** 
+        \brief Query closest hit distances for a batch of rays
+
+        Hits are traversed into temporary records of the queue and reduced to a float per ray,
+        -1 for missed and inactive rays. Supported on OpenCL devices only.
+
+        \param queue_idx Device queue index.
+        \param rays Ray buffer.
+        \param num_rays Number of rays in the buffer.
+        \param distances Float per ray.
+        \param hint Kind of rays, selects sorted, packet or user order traversal.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void QueryDistance(std::uint32_t queue_idx, Calc::Buffer const* rays, std::uint32_t num_rays,
+            Calc::Buffer* distances, QueryHint hint, Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /** 
+        \brief Count occluded rays of every group of consecutive rays
+
+        Occlusion is traversed into 1 bit per ray where the intersector supports it and reduced to
+        an int per group of group_size rays, the last group might be partial. Inactive rays are not
+        occluded. Supported on OpenCL devices only.
+
+        \param queue_idx Device queue index.
+        \param rays Ray buffer.
+        \param num_rays Number of rays in the buffer.
+        \param group_size Number of rays per group, at least 1.
+        \param counts Int per group.
+        \param hint Kind of rays, selects sorted or user order traversal of int results.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void QueryOcclusionCount(std::uint32_t queue_idx, Calc::Buffer const* rays, std::uint32_t num_rays,
+            std::uint32_t group_size, Calc::Buffer* counts, QueryHint hint, Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /** 
+        \brief Query occlusion for a batch of rays writing 1 bit per ray
+
+        Bit i % 32 of word i / 32 of hits is set if ray i is occluded, inactive rays give 0.
+        Rays are traversed in the user order even if ray reordering is enabled.
+
+        \param queue_idx Device queue index.
+        \param rays Ray buffer.
+        \param num_rays Number of rays in the buffer.
+        \param hits Hit bits buffer, (num_rays + 31) / 32 words.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void QueryOcclusionPacked(std::uint32_t queue_idx, Calc::Buffer const* rays, std::uint32_t num_rays,
+            Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /** 
+        \brief Query occlusion for a batch of rays writing 1 bit per ray
+
+        \param queue_idx Device queue index.
+        \param rays Ray buffer.
+        \param num_rays Buffer, containing the number of rays in rays buffer.
+        \param hits Hit bits buffer, (max_rays + 31) / 32 words.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void QueryOcclusionPacked(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
             std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const;
 
+        /** 
+        \brief Query k closest intersections for a batch of rays in a single traversal
+
+        Hits of ray i are written to hits[i * k, i * k + k) sorted by distance, missing ones are marked
+        with kNullId shape. Rays are traversed in the user order even if ray reordering is enabled.
+
+        \param queue_idx Device queue index.
+        \param rays Ray buffer.
+        \param num_rays Number of rays in the buffer.
+        \param k Number of hits per ray, 1 <= k <= kMaxMultiHits.
+        \param hits Hit data buffer, num_rays * k hit records.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void QueryIntersectionMulti(std::uint32_t queue_idx, Calc::Buffer const* rays, std::uint32_t num_rays,
+            int k, Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /** 
+        \brief Query k closest intersections for a batch of rays in a single traversal
+
+        \param queue_idx Device queue index.
+        \param rays Ray buffer.
+        \param num_rays Buffer, containing the number of rays in rays buffer.
+        \param k Number of hits per ray, 1 <= k <= kMaxMultiHits.
+        \param hits Hit data buffer, max_rays * k hit records.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void QueryIntersectionMulti(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, int k, Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /** 
+        \brief Query closest intersections and interpolate vertex attributes of the hit faces in the same kernel
+
+        Attributes of missed rays are zero, inactive rays are left untouched.
+
+        \param queue_idx Device queue index.
+        \param rays Ray buffer.
+        \param num_rays Number of rays in ray buffer.
+        \param num_attributes Number of float4 attributes per ray, 1 <= num_attributes <= kMaxVertexAttributes.
+        \param hits Hit data buffer.
+        \param attributes Interpolated attributes, num_rays * num_attributes float4.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void QueryIntersectionAttributes(std::uint32_t queue_idx, Calc::Buffer const* rays, std::uint32_t num_rays,
+            int num_attributes, Calc::Buffer* hits, Calc::Buffer* attributes, Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /** 
+        \brief Query occlusion testing the last occluder of every ray before traversal
+
+        The occluder of an occluded ray is stored for the next query, the traversal is skipped if
+        the stored one still blocks the ray. Results are one int per ray even with compact occlusion.
+
+        \param queue_idx Device queue index.
+        \param rays Ray buffer.
+        \param num_rays Number of rays in ray buffer.
+        \param occluders One int per ray, the last occluder of the ray in the accelerator order or -1.
+        \param hits Occlusion results.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void QueryOcclusionCached(std::uint32_t queue_idx, Calc::Buffer const* rays, std::uint32_t num_rays,
+            Calc::Buffer* occluders, Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /** 
+        \brief Query primitives overlapping axis aligned boxes
+
+        Overlaps of a box are written in traversal order until max_overlaps of them are found,
+        the count keeps going, so counts above max_overlaps tell the list has been cut.
+
+        \param queue_idx Device queue index.
+        \param boxes Box buffer, bbox records.
+        \param num_boxes Number of boxes in box buffer.
+        \param max_overlaps Number of Overlap records per box, at least 1.
+        \param overlaps Overlap records, max_overlaps per box.
+        \param counts Number of overlapping primitives per box.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void QueryOverlap(std::uint32_t queue_idx, Calc::Buffer const* boxes, std::uint32_t num_boxes, int max_overlaps,
+            Calc::Buffer* overlaps, Calc::Buffer* counts, Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /** 
+        \brief Query closest surface points
+
+        Nodes farther than the closest point found so far are skipped, so the cost
+        is close to a ray query for points near the surface and a small max_dist.
+
+        \param queue_idx Device queue index.
+        \param points Point buffer, float3 records.
+        \param num_points Number of points in point buffer.
+        \param max_dist Distance to search the surface within.
+        \param results ClosestPoint records, kNullId shape for points without a surface within max_dist.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void QueryClosestPoint(std::uint32_t queue_idx, Calc::Buffer const* points, std::uint32_t num_points, float max_dist,
+            Calc::Buffer* results, Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /** 
+        \brief Query closest intersections of an image-shaped batch of rays
+
+        Ray i belongs to pixel (i % width, i / width). Rays are traversed in the given order of their
+        pixels and hits are written in the original order. Orders other than kRayOrderScanline are
+        applied on OpenCL devices with built-in primitives only, and replace ray reordering.
+
+        \param queue_idx Device queue index.
+        \param rays Ray buffer, width * height rays.
+        \param width Image width, at most kMaxImageSize.
+        \param height Image height, at most kMaxImageSize.
+        \param order Order the rays are traversed in.
+        \param hits Hit data buffer, width * height hit records.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void QueryIntersection2D(std::uint32_t queue_idx, Calc::Buffer const* rays, std::uint32_t width,
+            std::uint32_t height, RayOrder order, Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /** 
+        \brief Query closest intersections of the primary rays of a pinhole camera
+
+        Rays are generated on the device, hit i belongs to pixel (i % width, i / width).
+
+        \param queue_idx Device queue index.
+        \param camera Camera the rays are generated for.
+        \param width Image width.
+        \param height Image height.
+        \param hits Hit data buffer, width * height hit records.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void QueryPrimaryPinhole(std::uint32_t queue_idx, PinholeCamera const& camera, std::uint32_t width,
+            std::uint32_t height, Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /** 
+        \brief Query occlusion of shadow rays from the closest hits of rays towards a point light
+
+        Shadow rays of missed and inactive rays are inactive. Results are written as by QueryOcclusion.
+
+        \param queue_idx Device queue index.
+        \param rays Ray buffer the hits belong to.
+        \param hits Closest hits of the rays.
+        \param num_rays Number of rays in the buffer.
+        \param light Light position.
+        \param epsilon Offset of the shadow rays from the hit point and the light.
+        \param results Occlusion results buffer.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void QueryShadowFromHits(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* hits,
+            std::uint32_t num_rays, float3 const& light, float epsilon, Calc::Buffer* results,
+            Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /** 
+        \brief Copy the active rays, or the rays selected by a predicate, to the front of another buffer
+
+        Rays keep their order and the new count is written on the device, so it never has to be read back.
+
+        \param queue_idx Device queue index.
+        \param rays Ray buffer.
+        \param num_rays Buffer, containing the number of rays in rays buffer.
+        \param max_rays Capacity of the ray buffers.
+        \param predicate One int per ray, non-zero keeps the ray, the active flag is used if it is nullptr.
+        \param compacted Compacted ray buffer, can't be rays.
+        \param new_num_rays Buffer the number of kept rays is written to, can be num_rays.
+        \param indices Source index of every kept ray, might be nullptr.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void CompactRays(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Buffer const* predicate, Calc::Buffer* compacted, Calc::Buffer* new_num_rays,
+            Calc::Buffer* indices, Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /**
+        \brief Sort ray indices by the shape of their closest hits
+
+        Rays with a hit come first in increasing shape ID order followed by the missed ones, so shading
+        passes can group hits by material. Keys are calculated from the hits on the device.
+
+        \param queue_idx Device queue index.
+        \param hits Closest hit buffer.
+        \param num_rays Buffer, containing the number of rays in hits buffer.
+        \param max_rays Capacity of the hit and index buffers.
+        \param indices Buffer the sorted ray indices are written to.
+        \param num_hits Buffer the number of hits is written to, might be nullptr or num_rays.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void SortHits(std::uint32_t queue_idx, Calc::Buffer const* hits, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Buffer* indices, Calc::Buffer* num_hits,
+            Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /**
+        \brief Check if small queries can be combined into a single traversal with QueryBatch
+
+        Batches are OpenCL only, bit packed occlusion results can't be split at ray boundaries.
+
+        \param occlusion Occlusion queries if set, closest hit ones otherwise.
+        */
+        bool SupportsBatching(bool occlusion) const;
+
+        /**
+        \brief Query several small batches of rays in a single traversal
+
+        Rays and hits of the queries are copied into batch buffers of the queue, traversed at once
+        and the hits are copied back. The result is the same as querying them one by one.
+
+        \param queue_idx Device queue index.
+        \param queries Queries to combine.
+        \param num_queries Number of queries.
+        \param occlusion Occlusion queries if set, closest hit ones otherwise.
+        \param event Completion event of all the queries.
+        */
+        void QueryBatch(std::uint32_t queue_idx, BatchedQuery const* queries, std::uint32_t num_queries,
+            bool occlusion, Calc::Event** event) const;
+
+        /** 
+        \brief Get statistics of the acceleration structure built by the last SetWorld.
+
+        \param stats Tree shape, build times and device memory of the acceleration structure.
+        */
+        void GetStats(AccelStats& stats) const;
+
         // Disallow intersector copies
         Intersector(Intersector const&) = delete;
         Intersector& operator = (Intersector const&) = delete;
@@ -148,17 +601,177 @@ namespace RadeonRays
         virtual void Intersect(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
             std::uint32_t max_rays, Calc::Buffer *hits, 
             Calc::Event const *wait_event, Calc::Event **event) const = 0;
+        // Intersection implementation for coherent rays, e.g. camera rays in pixel order,
+        // runs Intersect unless the intersector has a packet traversal
+        virtual void IntersectCoherent(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
+            std::uint32_t max_rays, Calc::Buffer *hits, 
+            Calc::Event const *wait_event, Calc::Event **event) const;
         // Occlusion implementation
         virtual void Occluded(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
             std::uint32_t max_rays, Calc::Buffer *hits, 
             Calc::Event const *wait_event, Calc::Event **event) const = 0;
+        // Occlusion implementation writing 1 bit per ray, used by packed queries
+        // and by regular ones if "acc.occlusion.compact" option is enabled
+        virtual void OccludedCompact(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
+            std::uint32_t max_rays, Calc::Buffer *hits, 
+            Calc::Event const *wait_event, Calc::Event **event) const;
+        // Whether OccludedCompact is implemented
+        virtual bool SupportsCompactOcclusion() const;
+        // Multi-hit intersection implementation, k is validated by the caller
+        virtual void IntersectMulti(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
+            std::uint32_t max_rays, int k, Calc::Buffer *hits, 
+            Calc::Event const *wait_event, Calc::Event **event) const;
+        // Intersection implementation interpolating vertex attributes, num_attributes is validated by the caller
+        virtual void IntersectAttributes(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
+            std::uint32_t max_rays, int num_attributes, Calc::Buffer *hits, Calc::Buffer *attributes, 
+            Calc::Event const *wait_event, Calc::Event **event) const;
+        // Occlusion implementation reading and updating the last occluders of the rays
+        virtual void OccludedCached(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
+            std::uint32_t max_rays, Calc::Buffer *occluders, Calc::Buffer *hits, 
+            Calc::Event const *wait_event, Calc::Event **event) const;
+        // Box overlap implementation, the number of boxes is in num_boxes
+        virtual void FindOverlaps(std::uint32_t queue_idx, Calc::Buffer const *boxes, Calc::Buffer const *num_boxes, 
+            std::uint32_t max_boxes, int max_overlaps, Calc::Buffer *overlaps, Calc::Buffer *counts, 
+            Calc::Event const *wait_event, Calc::Event **event) const;
+        // Closest point implementation, the number of points is in num_points
+        virtual void FindClosestPoints(std::uint32_t queue_idx, Calc::Buffer const *points, Calc::Buffer const *num_points, 
+            std::uint32_t max_points, float max_dist, Calc::Buffer *results, 
+            Calc::Event const *wait_event, Calc::Event **event) const;
+        // Add device memory of the acceleration structure to the stats
+        virtual void GetMemoryStats(AccelStats& stats) const;
 
     protected: 
+        // Non-blocking write for Process, done on a separate queue where the device has one.
+        // The data has to stay unchanged until the next SetWorld, queries wait for the write
+        void Upload(Calc::Buffer* buffer, std::size_t size, void const* data);
+        // Non-blocking write keeping the data alive until it completes
+        template <typename T>
+        void Upload(Calc::Buffer* buffer, std::vector<T>&& data);
+        // Non-blocking write of a range starting offset bytes into the buffer, the data is kept as above
+        void UploadRange(Calc::Buffer* buffer, std::size_t offset, std::size_t size, void const* data);
+        template <typename T>
+        void UploadRange(Calc::Buffer* buffer, std::size_t offset, std::vector<T>&& data);
+        // Buffer for scene data filled by uploads, in shared virtual memory with "acc.shared_memory"
+        Calc::Buffer* CreateSceneBuffer(std::size_t size) const;
+        // Map the first size bytes of a scene buffer for Process to write them in place, e.g. translators
+        // writing nodes straight into it, the previous contents are discarded. Unmapping starts the write
+        // as an upload, so queries wait for it.
+        void* MapSceneBuffer(Calc::Buffer* buffer, std::size_t size);
+        void UnmapSceneBuffer(Calc::Buffer* buffer, void* data);
+        // Wait for the writes started by Process
+        void WaitForUploads() const;
+        // Get the ray generators, throws on devices they don't support
+        RayGenerator* GetRayGenerator() const;
+        // Get the structure of arrays conversion, throws on devices it doesn't support
+        RayLayoutConverter* GetLayoutConverter() const;
+        // Get the output reductions, throws on devices they don't support
+        HitReduction* GetHitReduction() const;
+        // Whether the number of rays comes from the caller's device buffer rather than a host count
+        bool IsDeviceCount(std::uint32_t queue_idx, Calc::Buffer const* num_rays) const { return num_rays != m_counters[queue_idx].get(); }
+        // Size of a buffer which might not be allocated yet
+        static std::size_t GetBufferSize(Calc::Buffer const* buffer) { return buffer ? buffer->GetSize() : 0; }
+        // Set the traversal counter buffer of the queue as argument arg of a closest hit kernel,
+        // nothing is set unless the kernels are compiled with kTraversalStats
+        void SetTraversalStatsArg(Calc::Function* func, int& arg, std::uint32_t queue_idx, std::uint32_t max_rays) const;
+        // Launch a kernel, timed under the name if profiling is enabled
+        void Execute(Calc::Function const* func, std::uint32_t queue_idx, std::size_t global_size, std::size_t local_size,
+            Calc::Event** event, char const* name) const;
+        // Launch a kernel using global ids only, split into slices on the low priority queue, see "acc.lowpriority.slice"
+        void ExecuteSliced(Calc::Function const* func, std::uint32_t queue_idx, std::size_t global_size, std::size_t local_size,
+            Calc::Event** event, char const* name) const;
+        // Whether bvh.* options have been set since the last Process, trees have to be rebuilt with them
+        bool BvhSettingsChanged(World const& world) const;
+        // Whether host copies of the acceleration structure are kept after the upload to update it
+        // without a rebuild, "mem.keep_host_copies" 0 drops them and changes rebuild from the world
+        static bool KeepHostCopies(World const& world);
+        // Throw if the commit building the world has been cancelled, called between build stages
+        static void CheckCancelled(World const& world);
+
         // Device to use
         Calc::Device* m_device;
-        // Buffer holding ray count
-        std::unique_ptr<Calc::Buffer, std::function<void(Calc::Buffer*)>> m_counter;
+        // Kernel timing, might be nullptr
+        KernelProfiler* m_profiler;
+        // Number of queues queries may be submitted to, per queue state is allocated for all of them
+        // up front since queries on different queues may run concurrently
+        std::uint32_t m_num_queues;
+        // Buffers holding ray count, one per queue
+        std::vector<std::unique_ptr<Calc::Buffer, std::function<void(Calc::Buffer*)>>> m_counters;
+        // Ray sorting pass run before traversal, set if "acc.reorder" option is enabled
+        // or a query has been hinted as incoherent before the last Process
+        std::unique_ptr<RayReorder> m_reorder;
+        // Sort rays of queries without a hint, set if "acc.reorder" option is enabled
+        bool m_reorder_by_default;
+        // A query has been hinted as incoherent, so sorting is prepared by the next Process
+        mutable std::atomic<bool> m_reorder_hinted;
+        // Pixel order remapping of image-shaped batches, created by the first ordered query
+        mutable std::unique_ptr<RayReorder> m_image_reorder;
+        // Built-in ray generators, created by the first query using them
+        mutable std::unique_ptr<RayGenerator> m_generator;
+        // Ray compaction, created by the first compaction
+        mutable std::unique_ptr<RayCompaction> m_compaction;
+        // Hit sorting by shape, created by the first sort
+        mutable std::unique_ptr<HitSorting> m_hit_sorting;
+        // Combined traversal of small queries, created by the first batch
+        mutable std::unique_ptr<RayBatcher> m_batcher;
+        // Structure of arrays conversion, created by the first query using streams
+        mutable std::unique_ptr<RayLayoutConverter> m_layout;
+        // Distance and occlusion count outputs, created by the first query using them
+        mutable std::unique_ptr<HitReduction> m_reduction;
+        // Guards creation of the passes above by the first query, which may run on any queue
+        mutable std::mutex m_passes_mutex;
+        // Occlusion results are packed into bits, set if "acc.occlusion.compact" option is enabled
+        bool m_compact_occlusion;
+        // Queries with device ray counts are sized on the device where the intersector supports it,
+        // unset if "acc.indirect" option is disabled
+        bool m_indirect_dispatch;
+        // Queue of background queries and the number of work items its launches are split into, 0 if they aren't
+        std::uint32_t m_low_priority_queue;
+        std::size_t m_low_priority_slice;
+        // Scene buffers are in shared virtual memory written by the host in place,
+        // set if "acc.shared_memory" option is enabled and the device supports it
+        bool m_shared_scene;
+        // Record layouts of the kernels, combination of RecordFormat flags
+        int m_formats;
+        // Traversal counter buffers, one per queue, used with kTraversalStats
+        std::vector<Calc::Buffer*> m_traversal_stats;
+        // Statistics of the last Process, memory is filled in by GetMemoryStats
+        AccelStats m_stats;
+        // Version of the BVH settings used by the last Process
+        std::uint32_t m_bvh_settings_version;
+
+    private:
+        // Whether rays of a query with the hint are sorted before traversal
+        bool UseReorder(QueryHint hint) const;
+
+        struct PendingUpload
+        {
+            Calc::Event* event;
+            // Source data owned by the upload
+            std::shared_ptr<void> data;
+        };
+
+        void AddUpload(Calc::Buffer* buffer, std::size_t offset, std::size_t size, void const* data, std::shared_ptr<void> owner);
+
+        // Queue the uploads are done on
+        std::uint32_t m_upload_queue;
+        // Uploads of the last Process, queries on several queues may wait for them
+        mutable std::vector<PendingUpload> m_uploads;
+        mutable std::mutex m_uploads_mutex;
     };
+
+    template <typename T>
+    inline void Intersector::Upload(Calc::Buffer* buffer, std::vector<T>&& data)
+    {
+        auto owner = std::make_shared<std::vector<T>>(std::move(data));
+        AddUpload(buffer, 0, owner->size() * sizeof(T), owner->data(), owner);
+    }
+
+    template <typename T>
+    inline void Intersector::UploadRange(Calc::Buffer* buffer, std::size_t offset, std::vector<T>&& data)
+    {
+        auto owner = std::make_shared<std::vector<T>>(std::move(data));
+        AddUpload(buffer, offset, owner->size() * sizeof(T), owner->data(), owner);
+    }
 }
 
 #ifdef RR_EMBED_KERNELS
@@ -168,6 +781,9 @@ namespace RadeonRays
 
 #if USE_VULKAN
 #    include <RadeonRays/src/kernelcache/kernels_vk.h>
+#    ifdef RR_EMBED_SPIRV
+#        include <RadeonRays/src/kernelcache/kernels_vk_spirv.h>
+#    endif
 #endif
 #endif // RR_EMBED_KERNELS
 
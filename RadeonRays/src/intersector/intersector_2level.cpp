@@ -21,47 +21,101 @@ THE SOFTWARE.
 ********************************************************************/
 #include "intersector_2level.h"
 #include "../accelerator/bvh.h"
+#include "../accelerator/hlbvh.h"
+#include "../accelerator/linear_bvh.h"
 #include "../translator/plain_bvh_translator.h"
 #include "../world/world.h"
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
+#include "../primitive/group.h"
 #include "../except/except.h"
+#include "trace.h"
 
 #include "device.h"
 #include "executable.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <numeric>
 #include <set>
+#include <unordered_map>
 
 static int const kWorkGroupSize = 64;
+// Number of persistent work groups launched per compute unit
+static int const kGroupsPerComputeUnit = 8;
+// Compute unit count assumed when the device does not report it
+static int const kDefaultComputeUnits = 16;
+// Maximum number of shapes entered on the way to geometry, matches MAX_INSTANCE_DEPTH of the kernels with RR_NESTED_INSTANCES
+static int const kMaxInstanceDepth = 4;
+// Number of node bounds per mesh or group BVH transformed to bound shapes with "bvh.2level.tight_instance_bounds"
+static int const kNumCutBounds = 8;
+// Default "bvh2l.lod.transition", levels of detail are picked randomly within 10% of the threshold distances
+static float const kDefaultLodTransition = 0.1f;
 
 namespace RadeonRays
 {
     struct IntersectorTwoLevel::ShapeData
     {
+        // Rows of the inverse transform, the last one is always (0, 0, 0, 1).
+        // Entering a shape only reads the first 64 bytes: the rows, ID, root and mask.
+        float3 m0;
+        float3 m1;
+        float3 m2;
         // Shape ID
         Id id;
         // Index of root bvh node
         int bvhidx;
         int mask;
-        int padding1;
-        // Transform
-        matrix minv;
-        // Motion blur data
-        float3 linearvelocity;
+        // Non-zero if bvhidx references a group BVH with shape leafs
+        int is_group;
         // Angular veocity (quaternion)
         quaternion angularvelocity;
+        // Motion blur data
+        float linearvelocity[3];
+        // Start of the mesh vertices, compact faces index vertices relative to it
+        int vertex_start;
+        // Quantized vertices of the mesh are vertex_min + q * vertex_scale
+        float vertex_min[3];
+        // Start of the mesh faces
+        int face_start;
+        float vertex_scale[3];
+        // 1 if the compact faces of the mesh keep 32-bit indices in two records, 0 otherwise
+        int face_shift;
     };
 
     struct IntersectorTwoLevel::Face
     {
-        // Up to 3 indices
-        int idx[3];
+        // Up to 4 indices, quads are intersected natively, idx[3] is -1 for triangles
+        int idx[4];
         // Shape maks
         int shape_mask;
         // Shape ID
         int shape_id;
         // Primitive ID
         int prim_id;
+        int padding;
+    };
+
+    // Face of kCompactFaces, mesh-local vertex indices in the mesh face order, idx[3] is 0xFFFF for triangles
+    struct IntersectorTwoLevel::CompactFace
+    {
+        std::uint16_t idx[4];
+    };
+
+    // Level of detail selection of a top level shape, matches Lod of the kernels
+    struct IntersectorTwoLevel::Lod
+    {
+        // World space point distances to the shape are measured from
+        float center[3];
+        // Number of levels, 1 for shapes without levels of detail
+        int num_levels;
+        // Shape data of level 1, the coarser levels follow it
+        int first_level;
+        // Distances from which levels 1 to 3 are used
+        float distance[Instance::kMaxLods - 1];
     };
 
     struct IntersectorTwoLevel::GpuData
@@ -76,12 +130,58 @@ namespace RadeonRays
         Calc::Buffer* faces;
         // Shape IDs
         Calc::Buffer* shapes;
+        // Top level node bounds at ray time 1, motion blur only
+        Calc::Buffer* motion_nodes;
+        // Union of shape masks below each top level node, OpenCL ray masks only
+        Calc::Buffer* top_masks;
+        // Level of detail records of the top level shapes, kLodInstances only
+        Calc::Buffer* lods;
 
         int bvhrootidx;
 
         Calc::Executable* executable;
         Calc::Function* isect_func;
         Calc::Function* occlude_func;
+        // Persistent threads variants, OpenCL only
+        Calc::Function* isect_persistent_func;
+        Calc::Function* occlude_persistent_func;
+        // Bit packed occlusion variants, OpenCL only
+        Calc::Function* occlude_compact_func;
+        Calc::Function* occlude_persistent_compact_func;
+        // Multi-hit variant, OpenCL only
+        Calc::Function* isect_multi_func;
+
+        // Ray counters of persistent launches, one per queue
+        std::vector<Calc::Buffer*> counters;
+        // Source of counter resets, has to outlive asynchronous writes
+        int zero;
+        // Use persistent threads traversal
+        bool persistent;
+        // Number of work items of a persistent launch
+        std::uint32_t persistent_size;
+        // Batched builder of deformed meshes and top levels, created on first use
+        std::unique_ptr<Hlbvh> builder;
+        // Top level builds on the device, OpenCL only
+        Calc::Function* shape_bounds_func;
+        // Mesh or group BVH index of each shape, uploaded once per full rebuild
+        Calc::Buffer* shape_bvhidx;
+        // Object space bounds of mesh and group BVHs and world space bounds of the shapes
+        Calc::Buffer* bvh_bounds;
+        Calc::Buffer* shape_bounds;
+        // Top level masks are all set, device built top levels are not culled by masks
+        bool top_masks_set;
+        // Geometry paging, OpenCL only
+        Calc::Function* page_requests_func;
+        Calc::Function* merge_hits_func;
+        Calc::Function* merge_occlusion_func;
+        Calc::Function* merge_occlusion_bits_func;
+        // World space bounds of the pages and flags of the pages reached by the rays of a query
+        Calc::Buffer* page_bounds;
+        Calc::Buffer* page_requests;
+        // Source of page request resets, has to outlive asynchronous writes
+        std::vector<int> page_zeros;
+        // Hits of the pages traversed after the first one, one per queue
+        std::vector<Calc::Buffer*> page_hits;
 
         GpuData(Calc::Device* d)
             : device(d)
@@ -89,11 +189,75 @@ namespace RadeonRays
             , vertices(nullptr)
             , faces(nullptr)
             , shapes(nullptr)
+            , motion_nodes(nullptr)
+            , top_masks(nullptr)
+            , lods(nullptr)
             , bvhrootidx(-1)
             , executable(nullptr)
             , isect_func(nullptr)
             , occlude_func(nullptr)
+            , isect_persistent_func(nullptr)
+            , occlude_persistent_func(nullptr)
+            , occlude_compact_func(nullptr)
+            , occlude_persistent_compact_func(nullptr)
+            , isect_multi_func(nullptr)
+            , zero(0)
+            , persistent(false)
+            , persistent_size(0)
+            , shape_bounds_func(nullptr)
+            , shape_bvhidx(nullptr)
+            , bvh_bounds(nullptr)
+            , shape_bounds(nullptr)
+            , top_masks_set(false)
+            , page_requests_func(nullptr)
+            , merge_hits_func(nullptr)
+            , merge_occlusion_func(nullptr)
+            , merge_occlusion_bits_func(nullptr)
+            , page_bounds(nullptr)
+            , page_requests(nullptr)
+        {
+        }
+
+        // Get ray counter of the queue
+        Calc::Buffer* GetCounter(std::uint32_t queueidx)
+        {
+            if (counters.size() <= queueidx)
+            {
+                counters.resize(queueidx + 1, nullptr);
+            }
+
+            auto& counter = counters[queueidx];
+
+            if (!counter)
+            {
+                counter = device->CreateBuffer(sizeof(int), Calc::BufferType::kWrite);
+            }
+
+            return counter;
+        }
+
+        // Get page hits buffer of the queue holding at least size bytes
+        Calc::Buffer* GetPageHits(std::uint32_t queueidx, std::size_t size)
         {
+            if (page_hits.size() <= queueidx)
+            {
+                page_hits.resize(queueidx + 1, nullptr);
+            }
+
+            auto& buffer = page_hits[queueidx];
+
+            if (buffer && buffer->GetSize() < size)
+            {
+                device->DeleteBuffer(buffer);
+                buffer = nullptr;
+            }
+
+            if (!buffer)
+            {
+                buffer = device->CreateBuffer(size, Calc::BufferType::kWrite);
+            }
+
+            return buffer;
         }
 
         ~GpuData()
@@ -102,43 +266,351 @@ namespace RadeonRays
             device->DeleteBuffer(vertices);
             device->DeleteBuffer(faces);
             device->DeleteBuffer(shapes);
+            device->DeleteBuffer(motion_nodes);
+            device->DeleteBuffer(top_masks);
+            device->DeleteBuffer(lods);
+            device->DeleteBuffer(shape_bvhidx);
+            device->DeleteBuffer(bvh_bounds);
+            device->DeleteBuffer(shape_bounds);
+            device->DeleteBuffer(page_bounds);
+            device->DeleteBuffer(page_requests);
+            for (auto counter : counters)
+            {
+                if (counter)
+                {
+                    device->DeleteBuffer(counter);
+                }
+            }
+            for (auto buffer : page_hits)
+            {
+                if (buffer)
+                {
+                    device->DeleteBuffer(buffer);
+                }
+            }
             if(executable != nullptr)
             {
                 executable->DeleteFunction(isect_func);
                 executable->DeleteFunction(occlude_func);
+                if (isect_persistent_func)
+                {
+                    executable->DeleteFunction(isect_persistent_func);
+                    executable->DeleteFunction(occlude_persistent_func);
+                    executable->DeleteFunction(occlude_compact_func);
+                    executable->DeleteFunction(occlude_persistent_compact_func);
+                    executable->DeleteFunction(isect_multi_func);
+                    executable->DeleteFunction(shape_bounds_func);
+                    executable->DeleteFunction(page_requests_func);
+                    executable->DeleteFunction(merge_hits_func);
+                    executable->DeleteFunction(merge_occlusion_func);
+                    executable->DeleteFunction(merge_occlusion_bits_func);
+                }
                 device->DeleteExecutable(executable);
             }
         }
     };
 
 
+    // Bottom level BVH of a mesh and the ranges it occupies in the node, face and vertex buffers
+    struct IntersectorTwoLevel::MeshEntry
+    {
+        std::shared_ptr<Bvh> bvh;
+        // Version of the mesh the BVH matches
+        std::uint64_t version;
+        // Start of the ranges, node_start is -1 until the mesh is placed
+        int node_start;
+        int face_start;
+        int vertex_start;
+        // Object space bounds of the vertices quantized vertices are relative to
+        bbox vertex_bounds;
+        // Referenced by the scene of the last full rebuild
+        bool used;
+        // Tree rebuilt in the background over the bounds of a degraded refit
+        std::future<std::shared_ptr<Bvh>> rebuild;
+        // Build hint of the mesh the tree has been built with
+        BuildHint hint;
+
+        MeshEntry()
+            : version(0)
+            , node_start(-1)
+            , face_start(-1)
+            , vertex_start(-1)
+            , used(false)
+            , hint(kBuildDefault)
+        {
+        }
+    };
+
+    // Meshes streamed into the device window together, their nodes, faces and vertices are kept
+    // on the host translated to offsets in the window
+    struct IntersectorTwoLevel::Page
+    {
+        std::vector<int> meshes;
+        std::vector<PlainBvhTranslator::Node> nodes;
+        std::vector<Face> faces;
+        std::vector<float3> vertices;
+        // Shape data with the masks of shapes referencing meshes of other pages cleared
+        std::vector<ShapeData> shapedata;
+        // World space bounds of the shapes reaching the meshes
+        bbox bounds;
+    };
+
     struct IntersectorTwoLevel::CpuData
     {
         std::vector<int> mesh_vertices_start_idx;
         std::vector<int> mesh_faces_start_idx;
         std::vector<Bvh const*> bvhptrs;
         std::vector<ShapeData> shapedata;
-        std::vector<bbox> bounds;
+        // Object space face bounds of the meshes being built or refitted
+        host_vector<bbox> bounds;
+        // Object space bounds of the meshes, their BVHs are stale after device rebuilds
+        std::vector<bbox> mesh_bounds;
+
+        // Cached meshes, keys of detached ones might be deleted already and are never dereferenced
+        std::unordered_map<Mesh const*, MeshEntry> mesh_cache;
+        // Cache entry for each of the meshes
+        std::vector<MeshEntry*> mesh_entries;
+        // Ends of the mesh ranges, group and top level nodes follow nodes_end
+        int nodes_end;
+        int faces_end;
+        int vertices_end;
+        // Number of nodes, faces and vertices the buffers hold
+        int node_capacity;
+        int face_capacity;
+        int vertex_capacity;
+
+        // Shapes partitioned into meshes followed by instances,
+        // including base shapes which are not present in the scene
+        std::vector<Shape const*> shapes;
+        // Bottom level BVH index for each of the shapes
+        std::vector<int> shape_bvhidx;
+        // Base shapes added only to be referenced by instances
+        std::set<Shape const*> shapes_disabled;
+        // Number of meshes in shapes array
+        int nummeshes;
+        // Groups referenced by instances, each one after the groups it contains,
+        // group BVHs follow the mesh ones
+        std::vector<Group const*> groups;
+        // Start of the shape data of each group, the top level shapes come first
+        std::vector<int> group_offsets;
+        // Bottom level BVH index for each of the group shapes, laid out as the shape data
+        std::vector<int> group_shape_bvhidx;
+
+        // Mesh or group BVH index of each shape data entry
+        std::vector<int> shapedata_bvhidx;
+
+        // First shape data entry of the coarser levels of detail of each of the shapes, -1 if it has none.
+        // The entries follow the group ones from lod_start on.
+        std::vector<int> lod_offsets;
+        int lod_start;
+        // Mesh BVH index for each of the level of detail entries, laid out as the shape data
+        std::vector<int> lod_bvhidx;
+        // Level of detail records in the order of the top level shape data, kLodInstances only
+        std::vector<Lod> lods;
+        // "bvh2l.lod.transition" of the last commit
+        float lod_transition;
+
+        // Pages of the meshes, empty unless they exceeded "mem.budget" at the last full rebuild
+        std::vector<Page> pages;
+        // Page of each of the meshes
+        std::vector<int> mesh_page;
+        // Page held by the device window, -1 if none, changed by queries
+        int resident_page;
+        // "mem.budget" of the last full rebuild in megabytes
+        float memory_budget;
+        // BVHs and translated nodes have been dropped after the last full rebuild
+        bool host_released;
+        // "bvh.2level.dedup" of the last full rebuild and the number of meshes it found duplicated
+        bool dedup;
+        int num_duplicates;
+        // "bvh.2level.tight_instance_bounds" of the last full rebuild, kNumCutBounds node bounds covering each
+        // mesh and group BVH then, shapes are bounded by the union of them transformed, empty otherwise
+        bool tight_bounds;
+        std::vector<bbox> cut_bounds;
+        // Content hashes of the meshes of the last full rebuild keyed by mesh version
+        std::unordered_map<std::uint64_t, std::uint64_t> mesh_hashes;
 
         PlainBvhTranslator translator;
+
+        CpuData()
+            : nodes_end(0)
+            , faces_end(0)
+            , vertices_end(0)
+            , node_capacity(0)
+            , face_capacity(0)
+            , vertex_capacity(0)
+            , nummeshes(0)
+            , lod_start(0)
+            , lod_transition(kDefaultLodTransition)
+            , resident_page(-1)
+            , memory_budget(0.f)
+            , host_released(false)
+            , dedup(false)
+            , num_duplicates(0)
+            , tight_bounds(false)
+        {
+        }
     };
 
-    IntersectorTwoLevel::IntersectorTwoLevel(Calc::Device* device)
-        : Intersector(device)
+    namespace
+    {
+        // Bottom level BVH of a mesh, single face leafs keep the node count at 2 * num_faces - 1.
+        // Static meshes always get SAH trees and deforming ones LBVHs.
+        std::shared_ptr<Bvh> CreateMeshBvh(BvhLevelSettings const& settings, BuildHint hint)
+        {
+            if (hint == kBuildDeforming || (settings.use_lbvh && hint != kBuildStatic))
+            {
+                return std::make_shared<LinearBvh>(settings.traversal_cost, settings.num_bins);
+            }
+
+            return std::make_shared<Bvh>(settings.traversal_cost, settings.num_bins, settings.use_sah || hint == kBuildStatic);
+        }
+
+        // 64-bit FNV-1a hash of the vertices and faces of the mesh
+        std::uint64_t HashMesh(Mesh const* mesh)
+        {
+            std::uint64_t hash = 14695981039346656037ull;
+            auto add = [&hash](void const* data, std::size_t size)
+            {
+                auto bytes = static_cast<unsigned char const*>(data);
+
+                for (std::size_t i = 0; i < size; ++i)
+                {
+                    hash ^= bytes[i];
+                    hash *= 1099511628211ull;
+                }
+            };
+
+            int numvertices = mesh->num_vertices();
+            int numfaces = mesh->num_faces();
+            add(&numvertices, sizeof(numvertices));
+            add(&numfaces, sizeof(numfaces));
+
+            for (int i = 0; i < numvertices; ++i)
+            {
+                float3 v = mesh->GetVertex(i);
+                float xyz[3] = { v.x, v.y, v.z };
+                add(xyz, sizeof(xyz));
+            }
+
+            for (int i = 0; i < numfaces; ++i)
+            {
+                Mesh::Face face = mesh->GetFace(i);
+                int idx[5] = { face.idx[0], face.idx[1], face.idx[2], face.type_ == Mesh::QUAD ? face.idx[3] : -1, face.type_ };
+                add(idx, sizeof(idx));
+            }
+
+            return hash;
+        }
+
+        // Largest 16-bit unorm value of quantized vertices
+        float const kQuantizedMax = 65535.f;
+
+        // Distance between neighbouring quantized positions along each axis
+        float3 GetQuantizationStep(bbox const& vertex_bounds)
+        {
+            return vertex_bounds.extents() * (1.f / kQuantizedMax);
+        }
+
+        // Check if the meshes have the same vertices and faces
+        bool SameMesh(Mesh const* a, Mesh const* b)
+        {
+            if (a->num_vertices() != b->num_vertices() || a->num_faces() != b->num_faces())
+            {
+                return false;
+            }
+
+            for (int i = 0; i < a->num_vertices(); ++i)
+            {
+                float3 va = a->GetVertex(i);
+                float3 vb = b->GetVertex(i);
+
+                if (va.x != vb.x || va.y != vb.y || va.z != vb.z)
+                {
+                    return false;
+                }
+            }
+
+            for (int i = 0; i < a->num_faces(); ++i)
+            {
+                Mesh::Face fa = a->GetFace(i);
+                Mesh::Face fb = b->GetFace(i);
+
+                if (fa.type_ != fb.type_ || fa.idx[0] != fb.idx[0] || fa.idx[1] != fb.idx[1] || fa.idx[2] != fb.idx[2] ||
+                    (fa.type_ == Mesh::QUAD && fa.idx[3] != fb.idx[3]))
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        // Collect meshes and groups referenced by the shape, groups are added after their shapes.
+        // Returns the number of shapes entered on the way from the shape to its geometry.
+        int CollectReferencedShapes(Shape const* shape, std::vector<Shape const*>& meshes,
+            std::vector<Group const*>& groups, std::unordered_map<Shape const*, int>& depths)
+        {
+            auto iter = depths.find(shape);
+            if (iter != depths.cend())
+            {
+                return iter->second;
+            }
+
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+            int depth = 1;
+
+            if (shapeimpl->is_instance())
+            {
+                auto instance = static_cast<Instance const*>(shapeimpl);
+                depth = CollectReferencedShapes(instance->GetBaseShape(), meshes, groups, depths);
+
+                // Coarser levels of detail are meshes, so they don't nest any deeper
+                for (int i = 1; i < instance->GetNumLods(); ++i)
+                {
+                    CollectReferencedShapes(instance->GetLod(i), meshes, groups, depths);
+                }
+            }
+            else if (shapeimpl->is_group())
+            {
+                auto group = static_cast<Group const*>(shapeimpl);
+                int max_depth = 0;
+
+                for (auto child : group->GetShapes())
+                {
+                    max_depth = std::max(max_depth, CollectReferencedShapes(child, meshes, groups, depths));
+                }
+
+                groups.push_back(group);
+                depth = max_depth + 1;
+            }
+            else
+            {
+                meshes.push_back(shape);
+            }
+
+            depths[shape] = depth;
+            return depth;
+        }
+    }
+
+    IntersectorTwoLevel::IntersectorTwoLevel(Calc::Device* device, int formats)
+        : Intersector(device, formats)
         , m_gpudata(new GpuData(device))
         , m_cpudata(new CpuData)
     {
-        std::string buildopts =
-#ifdef RR_RAY_MASK
-            "-D RR_RAY_MASK ";
-#else
-            "";
-#endif
+        // Concurrent queries on other queues never resize the vector
+        m_gpudata->counters.resize(m_num_queues, nullptr);
+        m_gpudata->page_hits.resize(m_num_queues, nullptr);
+
+        std::string buildopts;
         
 #ifdef USE_SAFE_MATH
         buildopts.append("-D USE_SAFE_MATH ");
 #endif
 
+        buildopts.append(GetRecordFormatOptions(m_formats));
+
 #ifndef RR_EMBED_KERNELS
         if ( device->GetPlatform() == Calc::Platform::kOpenCL )
         {
@@ -165,542 +637,2171 @@ namespace RadeonRays
 #if USE_VULKAN
         if (m_gpudata->executable == nullptr && device->GetPlatform() == Calc::Platform::kVulkan)
         {
+#ifdef RR_EMBED_SPIRV
+            m_gpudata->executable = m_device->CompileExecutable(g_bvh2l_spirv, sizeof(g_bvh2l_spirv), buildopts.c_str());
+#else
             m_gpudata->executable = m_device->CompileExecutable(g_bvh2l_vulkan, std::strlen(g_bvh2l_vulkan), buildopts.c_str());
+#endif
         }
 #endif
 #endif
 
         m_gpudata->isect_func = m_gpudata->executable->CreateFunction("intersect_main");
         m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("occluded_main");
+
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_gpudata->isect_persistent_func = m_gpudata->executable->CreateFunction("intersect_persistent_main");
+            m_gpudata->occlude_persistent_func = m_gpudata->executable->CreateFunction("occluded_persistent_main");
+            m_gpudata->occlude_compact_func = m_gpudata->executable->CreateFunction("occluded_compact_main");
+            m_gpudata->occlude_persistent_compact_func = m_gpudata->executable->CreateFunction("occluded_persistent_compact_main");
+            m_gpudata->isect_multi_func = m_gpudata->executable->CreateFunction("intersect_multi_main");
+            m_gpudata->shape_bounds_func = m_gpudata->executable->CreateFunction("calculate_shape_bounds_main");
+            m_gpudata->page_requests_func = m_gpudata->executable->CreateFunction("page_requests_main");
+            m_gpudata->merge_hits_func = m_gpudata->executable->CreateFunction("merge_page_hits_main");
+            m_gpudata->merge_occlusion_func = m_gpudata->executable->CreateFunction("merge_page_occlusion_main");
+            m_gpudata->merge_occlusion_bits_func = m_gpudata->executable->CreateFunction("merge_page_occlusion_bits_main");
+        }
+
+        // Launch just enough work groups to fill the device
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+        std::uint32_t num_units = spec.max_compute_units ? spec.max_compute_units : kDefaultComputeUnits;
+        m_gpudata->persistent_size = num_units * kGroupsPerComputeUnit * kWorkGroupSize;
     }
 
     void IntersectorTwoLevel::Process(World const& world)
     {
+        auto persistent = world.options_.GetOption("acc.persistent");
+        m_gpudata->persistent = persistent && persistent->AsFloat() > 0.f && m_gpudata->isect_persistent_func;
+
+        // Batched builds need device sort and kernels which are only available on OpenCL
+        auto device_rebuild = world.options_.GetOption("bvh.2level.device_rebuild");
+        // Builds read full vertices and write full faces in BVH order, compact records are refitted on the host
+        bool rebuild_on_device = device_rebuild && device_rebuild->AsFloat() > 0.f &&
+            m_device->GetPlatform() == Calc::Platform::kOpenCL && m_device->HasBuiltinPrimitives() &&
+            !(m_formats & (kCompactFaces | kQuantizedVertices));
+
+        // Motion nodes are translated from the host top level BVH
+        auto device_top_level = world.options_.GetOption("bvh.2level.device_top_level");
+        // Shape bounds of the device build don't cover levels of detail
+        bool top_level_on_device = device_top_level && device_top_level->AsFloat() > 0.f &&
+            m_device->GetPlatform() == Calc::Platform::kOpenCL && m_device->HasBuiltinPrimitives() &&
+            !(m_formats & (kMotionBlur | kLodInstances));
+
+        // Passed to the kernels on each query, the jitter keeps the distances positive
+        auto lod_transition = world.options_.GetOption("bvh2l.lod.transition");
+        m_cpudata->lod_transition = lod_transition ? std::min(std::max(lod_transition->AsFloat(), 0.f), 0.5f) : kDefaultLodTransition;
+
         // If something has been changed we need to rebuild BVH
         int statechange = world.GetStateChange();
 
-        // Full rebuild in case number of objects changes
-        if (m_bvhs.size() == 0 || world.has_changed())
+        // Cached mesh BVHs have been built with the previous settings
+        bool settings_changed = BvhSettingsChanged(world);
+
+        // Paged meshes are translated to window offsets and dropped host copies can't be updated,
+        // so any change rebuilds from the world
+        auto budget = world.options_.GetOption("mem.budget");
+        float memory_budget = budget ? budget->AsFloat() : 0.f;
+        bool paged = !m_cpudata->pages.empty();
+        bool rebuild_on_change = paged || m_cpudata->host_released;
+
+        // Duplicate meshes share a BVH, so updating the vertices of one of them rebuilds from the world
+        auto dedup_option = world.options_.GetOption("bvh.2level.dedup");
+        bool dedup = dedup_option && dedup_option->AsFloat() > 0.f;
+        bool shared_geometry_changed = m_cpudata->num_duplicates > 0 && (statechange & ShapeImpl::kStateChangeGeometry);
+
+        auto tight_bounds_option = world.options_.GetOption("bvh.2level.tight_instance_bounds");
+        bool tight_bounds = tight_bounds_option && tight_bounds_option->AsFloat() > 0.f;
+
+        // Full rebuild in case number of objects changes, cached meshes are reused
+        if (m_bvhs.size() == 0 || world.has_changed() || settings_changed || dedup != m_cpudata->dedup || tight_bounds != m_cpudata->tight_bounds ||
+            memory_budget != m_cpudata->memory_budget || shared_geometry_changed ||
+            (rebuild_on_change && statechange != ShapeImpl::kStateChangeNone))
         {
             if (m_bvhs.size() != 0)
             {
-                m_device->DeleteBuffer(m_gpudata->bvh);
-                m_device->DeleteBuffer(m_gpudata->vertices);
-                m_device->DeleteBuffer(m_gpudata->faces);
                 m_device->DeleteBuffer(m_gpudata->shapes);
+                m_device->DeleteBuffer(m_gpudata->motion_nodes);
+                m_gpudata->motion_nodes = nullptr;
+                m_device->DeleteBuffer(m_gpudata->top_masks);
+                m_gpudata->top_masks = nullptr;
+                m_device->DeleteBuffer(m_gpudata->lods);
+                m_gpudata->lods = nullptr;
+                m_device->DeleteBuffer(m_gpudata->shape_bvhidx);
+                m_gpudata->shape_bvhidx = nullptr;
+                m_device->DeleteBuffer(m_gpudata->bvh_bounds);
+                m_gpudata->bvh_bounds = nullptr;
+                m_device->DeleteBuffer(m_gpudata->shape_bounds);
+                m_gpudata->shape_bounds = nullptr;
             }
 
-
-            auto builder = world.options_.GetOption("bvh.builder");
-            auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
-            auto nbins = world.options_.GetOption("bvh.sah.num_bins");
-
-            bool use_sah = false;
-            float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
-            int num_bins = nbins ? (int)nbins->AsFloat() : 64;
-
-
-            if (builder && builder->AsString() == "sah")
+            if (settings_changed)
             {
-                use_sah = true;
+                // Ranges of the dropped meshes are reused from the start
+                m_cpudata->mesh_cache.clear();
+                m_cpudata->nodes_end = 0;
+                m_cpudata->faces_end = 0;
+                m_cpudata->vertices_end = 0;
             }
 
+
+            // Build settings are resolved when the options are set, groups are built as the top level
+            auto const& settings = world.options_.GetBvhSettings().bottom;
+            auto const& top_settings = world.options_.GetBvhSettings().top;
+            bool use_sah = top_settings.use_sah;
+            bool use_lbvh = top_settings.use_lbvh;
+            float traversal_cost = top_settings.traversal_cost;
+            int num_bins = top_settings.num_bins;
+
             // Copy the shapes here to be able to partition them and handle more efficiently
             // #22: we need to be able to handle instances whos base shapes are not present 
-            // in the scene, so we have to add them manually here.
+            // in the scene, so we have to add them manually here. The same goes for
+            // the meshes of groups, which get their own BVHs built across their shapes.
             std::vector<Shape const*> shapes;
+            std::vector<Shape const*> instances;
+            std::vector<Group const*> groups;
             std::set<Shape const*> shapes_disabled;
+            std::unordered_map<Shape const*, int> depths;
 
             for (auto s : world.shapes_)
             {
-                auto shapeimpl = static_cast<ShapeImpl const*>(s);
+                ThrowIf(CollectReferencedShapes(s, shapes, groups, depths) > kMaxInstanceDepth, "Instances are nested too deep.");
 
-                if (shapeimpl->is_instance())
+                if (static_cast<ShapeImpl const*>(s)->is_instance())
                 {
-                    // Here we know this is an instance, need to check if its base shape has been added as well
-                    auto instance = static_cast<Instance const*>(shapeimpl);
-                    auto base_shape = instance->GetBaseShape();
+                    instances.push_back(s);
+                }
+            }
+
+            // Meshes go first followed by instances
+            std::set<Shape const*> attached(world.shapes_.cbegin(), world.shapes_.cend());
+            for (auto mesh : shapes)
+            {
+                if (attached.find(mesh) == attached.cend())
+                {
+                    // Mark the shape disabled as it is only referenced
+                    shapes_disabled.insert(mesh);
+                }
+            }
 
-                    if (std::find(world.shapes_.cbegin(), world.shapes_.cend(), base_shape) == world.shapes_.cend())
+            // Meshes with the same vertices and faces as an earlier one are referenced like its instances,
+            // attached ones go to the top level with their own transforms, IDs and masks
+            std::unordered_map<Shape const*, Shape const*> duplicates;
+            m_cpudata->dedup = dedup;
+            m_cpudata->tight_bounds = tight_bounds;
+            if (dedup)
+            {
+                std::vector<int> canonical;
+                FindDuplicateMeshes(shapes, canonical);
+
+                std::vector<Shape const*> unique;
+                std::vector<Shape const*> attached_duplicates;
+                for (int i = 0; i < (int)shapes.size(); ++i)
+                {
+                    if (canonical[i] == i)
+                    {
+                        unique.push_back(shapes[i]);
+                    }
+                    else
                     {
-                        // Need to add the shape to the list
-                        shapes.push_back(base_shape);
-                        // And mark it disabled
-                        shapes_disabled.insert(base_shape);
+                        duplicates[shapes[i]] = shapes[canonical[i]];
+
+                        if (attached.find(shapes[i]) != attached.cend())
+                        {
+                            attached_duplicates.push_back(shapes[i]);
+                        }
                     }
                 }
 
-                shapes.push_back(s);
+                shapes.swap(unique);
+                instances.insert(instances.begin(), attached_duplicates.cbegin(), attached_duplicates.cend());
             }
 
-            // Now partition the range into meshes and instances
-            auto firstinst = std::partition(shapes.begin(), shapes.end(), [&](Shape const* shape)
-            {
-                return !static_cast<ShapeImpl const*>(shape)->is_instance();
-            });
+            m_cpudata->num_duplicates = (int)duplicates.size();
 
             // Count the number of meshes
-            int nummeshes = (int)std::distance(shapes.begin(), firstinst);
+            int nummeshes = (int)shapes.size();
             // Count the number of instances
-            int numinstances = (int)std::distance(firstinst, shapes.end());
+            int numinstances = (int)instances.size();
+            // Count the number of groups
+            int numgroups = (int)groups.size();
 
-            int numvertices = 0;
-            int numfaces = 0;
+            shapes.insert(shapes.end(), instances.cbegin(), instances.cend());
 
-            // This buffer tracks mesh start index for next stage as mesh face indices are relative to 0
-            m_cpudata->mesh_vertices_start_idx.resize(nummeshes);
-            m_cpudata->mesh_faces_start_idx.resize(nummeshes);
-            m_cpudata->bvhptrs.resize(nummeshes + 1);
-            m_cpudata->shapedata.resize(nummeshes + numinstances);
-
-            // [0...numshapes-1] contain bottom level BVHs
-            // [numshapes] is the top level one
-            m_bvhs.resize(nummeshes + 1);
-            // Create actual BVH objects
-            for (int i = 0; i < nummeshes + 1; ++i)
+            // Keep the layout, it is reused while the set of shapes stays the same
+            std::unordered_map<Shape const*, int> base_bvhidx;
+            for (int i = 0; i < nummeshes; ++i)
             {
-                m_bvhs[i].reset(new Bvh(traversal_cost, num_bins, use_sah));
-                m_cpudata->bvhptrs[i] = m_bvhs[i].get();
+                base_bvhidx[shapes[i]] = i;
             }
 
-            // Prepare necessary offsets in the arrays
-            // in order to be able to parallelize
-            for (int i = 0; i < nummeshes; ++i)
+            for (int i = 0; i < numgroups; ++i)
             {
-                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-
-                m_cpudata->mesh_faces_start_idx[i] = numfaces;
-                m_cpudata->mesh_vertices_start_idx[i] = numvertices;
+                base_bvhidx[groups[i]] = nummeshes + i;
+            }
 
-                numfaces += mesh->num_faces();
-                numvertices += mesh->num_vertices();
+            for (auto const& duplicate : duplicates)
+            {
+                base_bvhidx[duplicate.first] = base_bvhidx[duplicate.second];
             }
 
-            // We can't avoild allocating it here, since bounds aren't stored anywhere
-            m_cpudata->bounds.resize(numfaces);
+            auto get_bvhidx = [&](Shape const* shape)
+            {
+                auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+                auto iter = base_bvhidx.find(shapeimpl->is_instance() ? static_cast<Instance const*>(shapeimpl)->GetBaseShape() : shape);
 
-            // We are storing individual object bounds here to build top level BVH
-            std::vector<bbox> object_bounds(nummeshes + numinstances);
+                // Base shapes are always added above
+                ThrowIf(iter == base_bvhidx.cend(), "Internal error");
 
-            matrix m, minv;
+                return iter->second;
+            };
 
-            // Handle simple shapes
-#pragma omp parallel for
-            for (int i = 0; i < nummeshes; ++i)
+            m_cpudata->shape_bvhidx.resize(nummeshes + numinstances);
+            for (int i = 0; i < nummeshes + numinstances; ++i)
             {
+                m_cpudata->shape_bvhidx[i] = get_bvhidx(shapes[i]);
+            }
 
-                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                // Get transform to apply to object bounds
-                mesh->GetTransform(m, minv);
+            // Shape data of the groups follows the top level one
+            int numshapedata = nummeshes + numinstances;
+            m_cpudata->group_offsets.resize(numgroups);
+            m_cpudata->group_shape_bvhidx.clear();
+            for (int i = 0; i < numgroups; ++i)
+            {
+                m_cpudata->group_offsets[i] = numshapedata;
 
-                for (int j = 0; j < mesh->num_faces(); ++j)
+                for (auto shape : groups[i]->GetShapes())
                 {
-                    // Request bounds in object space since we build BVHs for objects locally
-                    mesh->GetFaceBounds(j, true, m_cpudata->bounds[m_cpudata->mesh_faces_start_idx[i] + j]);
+                    m_cpudata->group_shape_bvhidx.push_back(get_bvhidx(shape));
                 }
 
-                // Build BVH for current mesh
-                m_bvhs[i]->Build(&m_cpudata->bounds[m_cpudata->mesh_faces_start_idx[i]], mesh->num_faces());
-
-                // Extract and store bounds. Note they are in object space and we need to translate them to world space
-                object_bounds[i] = transform_bbox(m_bvhs[i]->Bounds(), m);
-
-                // Collect BVH pointers for toip level build
-                m_cpudata->bvhptrs[i] = m_bvhs[i].get();
+                numshapedata += (int)groups[i]->GetShapes().size();
             }
 
-            // Handle instances
-#pragma omp parallel for
-            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+            // Shape data of the coarser levels of detail follows the group one, instances inside groups
+            // and other platforms always trace the finest level
+            m_cpudata->lod_start = numshapedata;
+            m_cpudata->lod_offsets.assign(nummeshes + numinstances, -1);
+            m_cpudata->lod_bvhidx.clear();
+            if (m_formats & kLodInstances)
             {
+                for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+                {
+                    // Attached duplicates of meshes are placed among the instances
+                    auto shapeimpl = static_cast<ShapeImpl const*>(shapes[i]);
+                    if (!shapeimpl->is_instance() || static_cast<Instance const*>(shapeimpl)->GetNumLods() == 1)
+                    {
+                        continue;
+                    }
 
-                Instance const* instance = static_cast<Instance const*>(shapes[i]);
-                // Get transform to apply to object bounds
-                instance->GetTransform(m, minv);
-
-                // Find BVH for the instance
-                Mesh const* basemesh = static_cast<Mesh const*>(instance->GetBaseShape());
-
-                // It should be there
-                auto iter = std::find(shapes.cbegin(), shapes.cbegin() + nummeshes, basemesh);
-
-                // TODO: should be assert
-                ThrowIf(iter == shapes.cbegin() + nummeshes, "Internal error");
+                    auto instance = static_cast<Instance const*>(shapeimpl);
+                    m_cpudata->lod_offsets[i] = numshapedata;
 
-                int bvhidx = (int)std::distance(shapes.cbegin(), iter);
+                    for (int j = 1; j < instance->GetNumLods(); ++j)
+                    {
+                        m_cpudata->lod_bvhidx.push_back(get_bvhidx(instance->GetLod(j)));
+                    }
 
-                // Extract and store bounds. Note they are in object space and we need to translate them to world space
-                object_bounds[i] = transform_bbox(m_bvhs[bvhidx]->Bounds(), m);
+                    numshapedata += instance->GetNumLods() - 1;
+                }
             }
 
-            // Calculate top level BVH
-            m_bvhs[nummeshes]->Build(&object_bounds[0], nummeshes + numinstances);
-            m_cpudata->bvhptrs[nummeshes] = m_bvhs[nummeshes].get();
+            m_cpudata->shapes = shapes;
+            m_cpudata->shapes_disabled = shapes_disabled;
+            m_cpudata->nummeshes = nummeshes;
+            m_cpudata->groups = groups;
 
-            m_cpudata->translator.Flush();
-            // TODO: parallelize this
-            m_cpudata->translator.Process(&m_cpudata->bvhptrs[0], &m_cpudata->mesh_faces_start_idx[0], nummeshes);
+            // This buffer tracks mesh start index for next stage as mesh face indices are relative to 0
+            m_cpudata->mesh_vertices_start_idx.resize(nummeshes);
+            m_cpudata->mesh_faces_start_idx.resize(nummeshes);
+            m_cpudata->mesh_entries.resize(nummeshes);
+            m_cpudata->bvhptrs.resize(nummeshes + numgroups + 1);
+            m_cpudata->shapedata.resize(numshapedata);
+            m_cpudata->shapedata_bvhidx.resize(numshapedata);
 
-            // Update GPU data
-            // Copy translated nodes first
-            m_gpudata->bvh = m_device->CreateBuffer(m_cpudata->translator.nodes_.size() * sizeof(PlainBvhTranslator::Node), Calc::kRead, &m_cpudata->translator.nodes_[0]);
-            m_gpudata->bvhrootidx = m_cpudata->translator.root_;
+            // [0...nummeshes-1] contain bottom level BVHs
+            // [nummeshes...nummeshes+numgroups-1] contain group BVHs
+            // [nummeshes+numgroups] is the top level one
+            m_bvhs.resize(nummeshes + numgroups + 1);
 
-            // Create vertex buffer
+            for (auto& entry : m_cpudata->mesh_cache)
             {
-                // Vertices
-                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::kRead);
-
-                // Get the pointer to mapped data
-                float3* vertexdata = nullptr;
-                Calc::Event* e = nullptr;
-
-                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
-
-                e->Wait();
-                m_device->DeleteEvent(e);
+                entry.second.used = false;
+            }
 
-                // Here we need to put data in world space rather than object space
-                // So we need to get the transform from the mesh and multiply each vertex
-                matrix m, minv;
+            // Meshes are only built if they are not cached or their vertices or build hint have been changed since
+            std::vector<int> built;
+            for (int i = 0; i < nummeshes; ++i)
+            {
+                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+                MeshEntry& entry = m_cpudata->mesh_cache[mesh];
 
-#pragma omp parallel for
-                for (int i = 0; i < nummeshes; ++i)
+                if (!entry.bvh || entry.version != mesh->GetVersion() || entry.hint != mesh->GetBuildHint())
                 {
-                    // Get the mesh
-                    Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
-
-                    // Iterate thru vertices multiply and append them to GPU buffer
-                    for (int j = 0; j < mesh->num_vertices(); ++j)
-                    {
-                        vertexdata[m_cpudata->mesh_vertices_start_idx[i] + j] = myvertexdata[j];
-                    }
+                    entry = MeshEntry();
+                    entry.bvh = CreateMeshBvh(settings, mesh->GetBuildHint());
+                    entry.version = mesh->GetVersion();
+                    entry.hint = mesh->GetBuildHint();
+                    built.push_back(i);
                 }
 
-                m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
-
-                e->Wait();
-                m_device->DeleteEvent(e);
+                entry.used = true;
+                m_cpudata->mesh_entries[i] = &entry;
+                m_bvhs[i] = entry.bvh;
+                m_cpudata->bvhptrs[i] = entry.bvh.get();
             }
 
-            // Create face buffer
+            // Prepare necessary offsets in the arrays
+            // in order to be able to parallelize
+            int numbuilt = (int)built.size();
+            std::vector<int> bounds_start(numbuilt);
+            std::vector<int> numbuiltfaces(numbuilt);
+            int numbounds = 0;
+            for (int k = 0; k < numbuilt; ++k)
             {
-                // Create face buffer
-                m_gpudata->faces = m_device->CreateBuffer(numfaces * sizeof(Face), Calc::kRead);
+                Mesh const* mesh = static_cast<Mesh const*>(shapes[built[k]]);
 
-                // Get the pointer to mapped data
-                Face* facedata = nullptr;
-                Calc::Event* e = nullptr;
+                bounds_start[k] = numbounds;
+                numbuiltfaces[k] = mesh->num_faces();
+                numbounds += mesh->num_faces();
+            }
 
-                m_device->MapBuffer(m_gpudata->faces, 0, 0, numfaces * sizeof(Face), Calc::MapType::kMapWrite, (void**)&facedata, &e);
+            m_cpudata->bounds.resize(numbounds);
 
-                e->Wait();
-                m_device->DeleteEvent(e);
+            // Large meshes are built by several threads each, small ones are packed into tasks,
+            // cached trees outlive the monitor of the commit
+            Bvh::ScheduleBuilds(numbuiltfaces.data(), numbuilt, [&](int k)
+            {
+                Mesh const* mesh = static_cast<Mesh const*>(shapes[built[k]]);
+                bbox* bounds = &m_cpudata->bounds[bounds_start[k]];
+
+                // Request bounds in object space since we build BVHs for objects locally
+                mesh->ComputeAllFaceBounds(matrix(), bounds);
+                UpdateVertexBounds(built[k], bounds);
+                m_bvhs[built[k]]->SetMonitor(world.monitor_.get());
+                m_bvhs[built[k]]->Build(bounds, mesh->num_faces());
+                m_bvhs[built[k]]->SetMonitor(nullptr);
+            });
 
-                // Here the point is to add mesh starting index to actual index contained within the mesh,
-                // getting absolute index in the buffer.
-                // Besides that we need to permute the faces accorningly to BVH reordering, whihc
-                // is contained within bvh.primids_
+            m_cpudata->mesh_bounds.resize(nummeshes);
+            for (int i = 0; i < nummeshes; ++i)
+            {
+                m_cpudata->mesh_bounds[i] = m_bvhs[i]->Bounds();
+            }
 
-#pragma omp parallel for
+            m_cpudata->cut_bounds.clear();
+            if (m_cpudata->tight_bounds)
+            {
+                m_cpudata->cut_bounds.resize((nummeshes + m_cpudata->groups.size()) * kNumCutBounds);
                 for (int i = 0; i < nummeshes; ++i)
                 {
-                    // Reordering indices for a given mesh
-                    int const* reordering = m_bvhs[i]->GetIndices();
-
-                    // Get the mesh
-                    Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+                    UpdateCutBounds(i, m_bvhs[i].get());
+                }
+            }
 
-                    Mesh::Face const* myfaces = mesh->GetFaceData();
+            // Groups are built across the bounds of their shapes
+            BuildGroups(traversal_cost, num_bins, use_sah);
 
-                    int startidx = m_cpudata->mesh_vertices_start_idx[i];
+            // We are storing individual object bounds here to build top level BVH
+            std::vector<bbox> object_bounds;
+            CalculateObjectBounds(object_bounds);
 
-                    for (int j = 0; j < mesh->num_faces(); ++j)
-                    {
-                        // Copy face data to GPU buffer
-                        int myidx = m_cpudata->mesh_faces_start_idx[i] + j;
-                        int faceidx = reordering[j];
+            // Calculate top level BVH
+            m_bvhs.back().reset(use_lbvh ? new LinearBvh(traversal_cost, num_bins) : new Bvh(traversal_cost, num_bins, use_sah));
+            m_bvhs.back()->Build(&object_bounds[0], nummeshes + numinstances);
+            m_cpudata->bvhptrs.back() = m_bvhs.back().get();
 
-                        facedata[myidx].idx[0] = myfaces[faceidx].idx[0] + startidx;
-                        facedata[myidx].idx[1] = myfaces[faceidx].idx[1] + startidx;
-                        facedata[myidx].idx[2] = myfaces[faceidx].idx[2] + startidx;
+            // A cancelled commit stops before touching the device
+            CheckCancelled(world);
 
-                        facedata[myidx].shape_id = mesh->GetId();
-                        facedata[myidx].prim_id = faceidx;
-                    }
-                }
+            for (int i = 0; i < numgroups; ++i)
+            {
+                built.push_back(nummeshes + i);
+            }
 
-                m_device->UnmapBuffer(m_gpudata->faces, 0, facedata, &e);
+            UpdateStats(built);
 
-                e->Wait();
-                m_device->DeleteEvent(e);
+            int numtopnodes = 0;
+            for (int i = nummeshes; i < nummeshes + numgroups + 1; ++i)
+            {
+                numtopnodes += m_bvhs[i]->GetNumNodes();
             }
 
+            auto& translator = m_cpudata->translator;
+            translator.roots_.resize(nummeshes + numgroups);
 
-            // Now we need to collect shapdata
-            int const* topindices = m_bvhs[nummeshes]->GetIndices();
+            // Meshes are paged in by queries if they don't fit into the budget along with the top level,
+            // motion nodes and compact records are not paged
+            m_cpudata->memory_budget = memory_budget;
+            std::size_t page_bytes = 0;
+            bool use_pages = false;
+            if (memory_budget > 0.f && m_gpudata->page_requests_func && !(m_formats & (kMotionBlur | kCompactFaces | kQuantizedVertices | kLodInstances)))
+            {
+                std::size_t budget_bytes = static_cast<std::size_t>(memory_budget * 1024.f * 1024.f);
+                std::size_t top_bytes = numtopnodes * sizeof(PlainBvhTranslator::Node) + numshapedata * sizeof(ShapeData);
 
-#pragma omp parallel for
-            for (int i = 0; i < nummeshes + numinstances; ++i)
-            {
-                // Get the mesh
-                ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(shapes[topindices[i]]);
-
-                m_cpudata->shapedata[i].id = shapeimpl->GetId();
-
-                // For disabled shapes force mask to zero since these shapes 
-                // present only virtually (they have not been added to the scene)
-                // and we need to skip them while doing traversal.
-                if (shapes_disabled.find(shapeimpl) == shapes_disabled.cend())
+                std::size_t mesh_bytes = 0;
+                for (int i = 0; i < nummeshes; ++i)
                 {
-                    m_cpudata->shapedata[i].mask = shapeimpl->GetMask();
+                    mesh_bytes += GetMeshMemory(i);
                 }
-                else
+
+                use_pages = top_bytes + mesh_bytes > budget_bytes;
+                ThrowIf(use_pages && top_bytes >= budget_bytes, "mem.budget is too small to keep the top level BVH and shape data resident.");
+                page_bytes = use_pages ? budget_bytes - top_bytes : 0;
+            }
+
+            std::vector<int> placed;
+            if (use_pages)
+            {
+                BuildPages(page_bytes, numtopnodes);
+            }
+            else
+            {
+                if (paged)
                 {
-                    m_cpudata->shapedata[i].mask = 0x0;
+                    // Buffers hold the page window, all the meshes are placed again
+                    m_cpudata->pages.clear();
+                    m_cpudata->node_capacity = 0;
+                    m_cpudata->face_capacity = 0;
+                    m_cpudata->vertex_capacity = 0;
+                    m_device->DeleteBuffer(m_gpudata->page_bounds);
+                    m_gpudata->page_bounds = nullptr;
+                    m_device->DeleteBuffer(m_gpudata->page_requests);
+                    m_gpudata->page_requests = nullptr;
                 }
 
-                shapeimpl->GetTransform(m, m_cpudata->shapedata[i].minv);
+                LayoutMeshes(numtopnodes, placed);
 
-                if (!shapeimpl->is_instance())
+                for (int i = 0; i < nummeshes; ++i)
                 {
-                    m_cpudata->shapedata[i].bvhidx = m_cpudata->translator.roots_[topindices[i]];
+                    MeshEntry const& entry = *m_cpudata->mesh_entries[i];
+
+                    translator.roots_[i] = entry.node_start;
+                    m_cpudata->mesh_faces_start_idx[i] = entry.face_start;
+                    m_cpudata->mesh_vertices_start_idx[i] = entry.vertex_start;
                 }
-                else
-                {
-                    Instance const* instance = static_cast<Instance const*>(shapes[topindices[i]]);
+            }
 
-                    // Find corresponding mesh
-                    Mesh const* basemesh = static_cast<Mesh const*>(instance->GetBaseShape());
+            // Placed meshes follow each other, so they are uploaded as single ranges along with the top level
+            int node_begin = m_cpudata->nodes_end;
+            int face_begin = m_cpudata->faces_end;
+            int vertex_begin = m_cpudata->vertices_end;
+            if (!placed.empty())
+            {
+                MeshEntry const& first = *m_cpudata->mesh_entries[placed.front()];
 
-                    // It should be there
-                    auto iter = std::find(shapes.cbegin(), shapes.cbegin() + nummeshes, basemesh);
+                node_begin = first.node_start;
+                face_begin = first.face_start;
+                vertex_begin = first.vertex_start;
+            }
 
-                    // TODO: should be assert
-                    ThrowIf(iter == shapes.cbegin() + nummeshes, "Internal error");
+            // Leafs of mesh BVHs reference faces, meshes own disjoint node ranges and are translated concurrently
+            std::vector<int> numplacednodes(placed.size());
+            for (std::size_t k = 0; k < placed.size(); ++k)
+            {
+                numplacednodes[k] = m_bvhs[placed[k]]->GetNumNodes();
+            }
 
-                    int bvhidx = (int)std::distance(shapes.cbegin(), iter);
+            Bvh::ScheduleBuilds(numplacednodes.data(), (int)placed.size(), [this, &placed](int k)
+            {
+                TranslateMesh(placed[k]);
+            });
 
-                    m_cpudata->shapedata[i].bvhidx = m_cpudata->translator.roots_[bvhidx];
-                }
+            // Leafs of group BVHs reference shape data
+            int nodeidx = m_cpudata->nodes_end;
+            for (int i = 0; i < numgroups; ++i)
+            {
+                translator.roots_[nummeshes + i] = nodeidx;
+                nodeidx += translator.ProcessAt(*m_bvhs[nummeshes + i], nodeidx, m_cpudata->group_offsets[i]);
             }
 
-            // Create face ID buffer
-            m_gpudata->shapes = m_device->CreateBuffer((nummeshes + numinstances) * sizeof(ShapeData), Calc::kRead, &m_cpudata->shapedata[0]);
-        }
-        // Refit
-        else if (statechange != ShapeImpl::kStateChangeNone)
-        {
-            //std::cout << "Refit\n";
+            translator.root_ = nodeidx;
+            nodeidx += translator.ProcessAt(*m_bvhs.back(), nodeidx, 0);
 
-            // Copy the shapes here to be able to partition them and handle more efficiently
-            // #22: we need to be able to handle instances whos base shapes are not present 
-            // in the scene, so we have to add them manually here.
-            std::vector<Shape const*> shapes;
-            std::set<Shape const*> shapes_disabled;
+            // Update GPU data
+            // Copy translated nodes first
+            UploadRange(m_gpudata->bvh, node_begin * sizeof(PlainBvhTranslator::Node), (nodeidx - node_begin) * sizeof(PlainBvhTranslator::Node), &translator.nodes_[node_begin]);
+            m_gpudata->bvhrootidx = translator.root_;
+            UpdateMotionNodes(object_bounds);
 
-            for (auto s : world.shapes_)
+            // Create vertex buffer, quantized vertices are relative to the vertex bounds of their meshes
+            if (m_formats & kQuantizedVertices)
             {
-                auto shapeimpl = static_cast<ShapeImpl const*>(s);
+                std::vector<std::uint16_t> vertices_data(3 * (m_cpudata->vertices_end - vertex_begin));
+                std::uint16_t* vertexdata = vertices_data.data();
 
-                if (shapeimpl->is_instance())
+                int numplaced = (int)placed.size();
+
+#pragma omp parallel for
+                for (int k = 0; k < numplaced; ++k)
                 {
-                    // Here we know this is an instance, need to check if its base shape has been added as well
-                    auto instance = static_cast<Instance const*>(shapeimpl);
-                    auto base_shape = instance->GetBaseShape();
+                    int i = placed[k];
+                    QuantizeMeshVertices(i, vertexdata + 3 * (m_cpudata->mesh_vertices_start_idx[i] - vertex_begin));
+                }
+
+                UploadRange(m_gpudata->vertices, vertex_begin * GetVertexRecordSize(), std::move(vertices_data));
+            }
+            else
+            {
+                // Filled on the host and uploaded without blocking
+                std::vector<float3> vertices_data(m_cpudata->vertices_end - vertex_begin);
+                float3* vertexdata = vertices_data.data();
+
+                int numplaced = (int)placed.size();
+
+#pragma omp parallel for
+                for (int k = 0; k < numplaced; ++k)
+                {
+                    int i = placed[k];
+
+                    // Get the mesh
+                    Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
 
-                    if (std::find(world.shapes_.cbegin(), world.shapes_.cend(), base_shape) == world.shapes_.cend())
+                    // Vertices are kept in object space
+                    for (int j = 0; j < mesh->num_vertices(); ++j)
                     {
-                        // Need to add the shape to the list
-                        shapes.push_back(base_shape);
-                        // And mark it disabled
-                        shapes_disabled.insert(base_shape);
+                        vertexdata[m_cpudata->mesh_vertices_start_idx[i] - vertex_begin + j] = mesh->GetVertex(j);
                     }
                 }
 
-                shapes.push_back(s);
+                UploadRange(m_gpudata->vertices, vertex_begin * sizeof(float3), std::move(vertices_data));
             }
 
-            // Now partition the range into meshes and instances
-            auto firstinst = std::partition(shapes.begin(), shapes.end(), [&](Shape const* shape)
+            // Create face buffer, compact faces are kept in the mesh order
+            if (m_formats & kCompactFaces)
             {
-                return !static_cast<ShapeImpl const*>(shape)->is_instance();
-            });
-
-            // Count the number of meshes
-            int nummeshes = (int)std::distance(shapes.begin(), firstinst);
-            // Count the number of instances
-            int numinstances = (int)std::distance(firstinst, shapes.end());
-
-            std::vector<bbox> object_bounds(nummeshes + numinstances);
+                std::vector<CompactFace> faces_data(m_cpudata->faces_end - face_begin);
+                CompactFace* facedata = faces_data.data();
 
-            matrix m, minv;
+                int numplaced = (int)placed.size();
 
-            // Go over meshes and rebuild BVH bounds
 #pragma omp parallel for
-            for (int i = 0; i < nummeshes; ++i)
-            {
-                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                // Get transform to apply to object bounds
-                mesh->GetTransform(m, minv);
-                // Extract and store bounds. Note they are in object space and we need to translate them to world space
-                object_bounds[i] = transform_bbox(m_bvhs[i]->Bounds(), m);
+                for (int k = 0; k < numplaced; ++k)
+                {
+                    int i = placed[k];
+                    FillMeshCompactFaces(i, facedata + m_cpudata->mesh_faces_start_idx[i] - face_begin);
+                }
+
+                UploadRange(m_gpudata->faces, face_begin * sizeof(CompactFace), std::move(faces_data));
             }
+            else
+            {
+                std::vector<Face> faces_data(m_cpudata->faces_end - face_begin);
+                Face* facedata = faces_data.data();
+
+                int numplaced = (int)placed.size();
+
+                // Here the point is to add mesh starting index to actual index contained within the mesh,
+                // getting absolute index in the buffer.
+                // Besides that we need to permute the faces accorningly to BVH reordering, whihc
+                // is contained within bvh.primids_
 
 #pragma omp parallel for
-            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
-            {
+                for (int k = 0; k < numplaced; ++k)
+                {
+                    int i = placed[k];
+                    FillMeshFaces(i, facedata + m_cpudata->mesh_faces_start_idx[i] - face_begin);
+                }
+
+                UploadRange(m_gpudata->faces, face_begin * sizeof(Face), std::move(faces_data));
+            }
 
-                Instance const* instance = static_cast<Instance const*>(shapes[i]);
-                // Get transform to apply to object bounds
-                instance->GetTransform(m, minv);
 
-                // Find BVH for the instance
-                Mesh const* basemesh = static_cast<Mesh const*>(instance->GetBaseShape());
+            // Now we need to collect shapdata
+            UpdateShapeData(m_bvhs.back()->GetIndices());
 
-                // It should be there
-                auto iter = std::find(shapes.cbegin(), shapes.cbegin() + nummeshes, basemesh);
+            // Create face ID buffer
+            m_gpudata->shapes = CreateSceneBuffer(numshapedata * sizeof(ShapeData));
+            Upload(m_gpudata->shapes, numshapedata * sizeof(ShapeData), &m_cpudata->shapedata[0]);
+            UpdateTopMasks();
+            UpdateLods();
 
-                // TODO: should be assert
-                ThrowIf(iter == shapes.cbegin() + nummeshes, "Internal error");
+            if (use_pages)
+            {
+                UpdatePages(object_bounds);
+            }
 
-                int bvhidx = (int)std::distance(shapes.cbegin(), iter);
+            m_cpudata->host_released = false;
+            if (!KeepHostCopies(world))
+            {
+                ReleaseHostCopies();
+            }
+        }
+        // Only shape states have changed, bottom level BVHs, vertices and faces are reused
+        else if (statechange != ShapeImpl::kStateChangeNone)
+        {
+            int nummeshes = m_cpudata->nummeshes;
+            int numshapes = (int)m_cpudata->shapes.size();
 
-                // Extract and store bounds. Note they are in object space and we need to translate them to world space
-                object_bounds[i] = transform_bbox(m_bvhs[bvhidx]->Bounds(), m);
+            // Deformed meshes keep their topology, so only their BVHs are refitted or rebuilt on the device
+            if (statechange & ShapeImpl::kStateChangeGeometry)
+            {
+                RefitMeshes(world, rebuild_on_device);
             }
 
-            // Calculate top level BVH
-            auto builder = world.options_.GetOption("bvh.builder");
-            auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
-            auto nbins = world.options_.GetOption("bvh.sah.num_bins");
+            // Build settings are resolved when the options are set, groups are built as the top level
+            auto const& settings = world.options_.GetBvhSettings().top;
+            bool use_sah = settings.use_sah;
+            bool use_lbvh = settings.use_lbvh;
+            float traversal_cost = settings.traversal_cost;
+            int num_bins = settings.num_bins;
 
-            bool use_sah = false;
-            float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
-            int num_bins = nbins ? (int)nbins->AsFloat() : 64;
+            // Shapes inside groups might have changed as well, group BVHs keep their node count
+            BuildGroups(traversal_cost, num_bins, use_sah);
+
+            Calc::Event* e = nullptr;
+            for (int i = 0; i < (int)m_cpudata->groups.size(); ++i)
+            {
+                int root = m_cpudata->translator.roots_[nummeshes + i];
+                int numnodes = m_cpudata->translator.UpdateBottomLevel(nummeshes + i, *m_bvhs[nummeshes + i], m_cpudata->group_offsets[i]);
 
+                m_device->WriteBuffer(m_gpudata->bvh, 0, root * sizeof(PlainBvhTranslator::Node), numnodes * sizeof(PlainBvhTranslator::Node), (char*)&m_cpudata->translator.nodes_[root], &e);
+                e->Wait();
+                m_device->DeleteEvent(e);
+            }
 
-            if (builder && builder->AsString() == "sah")
+            // The top level is rebuilt from shape transforms without leaving the device
+            if (top_level_on_device)
             {
-                use_sah = true;
+                BuildTopLevelOnDevice();
+                return;
             }
 
-            m_bvhs[nummeshes].reset(new Bvh(traversal_cost, num_bins, use_sah));
-            m_bvhs[nummeshes]->Build(&object_bounds[0], nummeshes + numinstances);
-            m_cpudata->bvhptrs[nummeshes] = m_bvhs[nummeshes].get();
+            std::vector<bbox> object_bounds;
+            CalculateObjectBounds(object_bounds);
+
+            // Calculate top level BVH
+            m_bvhs.back().reset(use_lbvh ? new LinearBvh(traversal_cost, num_bins) : new Bvh(traversal_cost, num_bins, use_sah));
+            m_bvhs.back()->Build(&object_bounds[0], numshapes);
+            m_cpudata->bvhptrs.back() = m_bvhs.back().get();
+            UpdateStats(std::vector<int>());
 
 
-            // TODO: parallelize this
-            m_cpudata->translator.UpdateTopLevel(*m_bvhs[nummeshes]);
+            // Large top levels are translated by concurrent jobs, see PlainBvhTranslator::ProcessTree
+            m_cpudata->translator.UpdateTopLevel(*m_bvhs.back());
 
             // Update GPU data
             // Copy only top BVH data
-            Calc::Event* e = nullptr;
-            m_device->WriteBuffer(m_gpudata->bvh, 0, m_cpudata->translator.root_ * sizeof(PlainBvhTranslator::Node), (2 * (nummeshes + numinstances) - 1) * sizeof(PlainBvhTranslator::Node), (char*)&m_cpudata->translator.nodes_[m_cpudata->translator.root_], &e);
+            m_device->WriteBuffer(m_gpudata->bvh, 0, m_cpudata->translator.root_ * sizeof(PlainBvhTranslator::Node), (2 * numshapes - 1) * sizeof(PlainBvhTranslator::Node), (char*)&m_cpudata->translator.nodes_[m_cpudata->translator.root_], &e);
 
             e->Wait();
             m_device->DeleteEvent(e);
 
+            UpdateMotionNodes(object_bounds);
+
             // Now we need to collect shapdata
-            int const* topindices = m_bvhs[nummeshes]->GetIndices();
+            UpdateShapeData(m_bvhs.back()->GetIndices());
+
+            // Copy shape data
+            m_device->WriteBuffer(m_gpudata->shapes, 0, 0, m_cpudata->shapedata.size() * sizeof(ShapeData), (char*)&m_cpudata->shapedata[0], &e);
+
+            e->Wait();
+            m_device->DeleteEvent(e);
+
+            UpdateTopMasks();
+            UpdateLods();
+        }
+    }
+
+    void IntersectorTwoLevel::RefitMeshes(World const& world, bool rebuild_on_device)
+    {
+        RR_TRACE_SCOPE("IntersectorTwoLevel::RefitMeshes");
+
+        auto const& shapes = m_cpudata->shapes;
+        int nummeshes = m_cpudata->nummeshes;
+
+        std::vector<int> changed;
+        std::vector<int> bounds_start;
+        int numbounds = 0;
+        for (int i = 0; i < nummeshes; ++i)
+        {
+            if (static_cast<ShapeImpl const*>(shapes[i])->GetStateChange() & ShapeImpl::kStateChangeGeometry)
+            {
+                changed.push_back(i);
+                bounds_start.push_back(numbounds);
+                numbounds += static_cast<Mesh const*>(shapes[i])->num_faces();
+            }
+        }
+
+        if (rebuild_on_device)
+        {
+            RebuildMeshes(changed);
+            return;
+        }
+
+        int numchanged = (int)changed.size();
+        m_cpudata->bounds.resize(numbounds);
+
+        for (int k = 0; k < numchanged; ++k)
+        {
+            Mesh const* mesh = static_cast<Mesh const*>(shapes[changed[k]]);
+            mesh->ComputeAllFaceBounds(matrix(), &m_cpudata->bounds[bounds_start[k]]);
+            UpdateVertexBounds(changed[k], &m_cpudata->bounds[bounds_start[k]]);
+        }
+
+        // Rebuilt trees have the same number of nodes, but their faces are reordered
+        std::vector<char> replaced(nummeshes, 0);
+        auto replace = [&](int i, std::shared_ptr<Bvh> bvh)
+        {
+            m_cpudata->mesh_entries[i]->bvh = bvh;
+            m_cpudata->mesh_entries[i]->hint = shapes[i]->GetBuildHint();
+            m_cpudata->bvhptrs[i] = bvh.get();
+            m_bvhs[i] = bvh;
+            replaced[i] = 1;
+        };
+
+        // Trees rebuilt in the background since the last refit are fitted to the new bounds below
+        for (auto i : changed)
+        {
+            MeshEntry& entry = *m_cpudata->mesh_entries[i];
+
+            if (entry.rebuild.valid() && entry.rebuild.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+            {
+                replace(i, entry.rebuild.get());
+            }
+        }
+
+        // Rotations reorganize the nodes above moved faces, translated ranges keep their size
+        auto rotations = world.options_.GetOption("bvh.refit.rotations");
+        bool rotate = rotations && rotations->AsFloat() > 0.f;
 
 #pragma omp parallel for
-            for (int i = 0; i < nummeshes + numinstances; ++i)
+        for (int k = 0; k < numchanged; ++k)
+        {
+            int i = changed[k];
+            m_bvhs[i]->Refit(&m_cpudata->bounds[bounds_start[k]], rotate);
+        }
+
+        // Refitted trees whose SAH cost has grown past the threshold are rebuilt over the new bounds
+        auto max_degradation = world.options_.GetOption("bvh.refit.max_degradation");
+        auto background = world.options_.GetOption("bvh.refit.background");
+
+        // Static meshes are rebuilt on any update, they are expected to keep their vertices
+        std::vector<int> degraded;
+        bool check_degradation = max_degradation && max_degradation->AsFloat() > 0.f;
+        for (int k = 0; k < numchanged; ++k)
+        {
+            if (shapes[changed[k]]->GetBuildHint() == kBuildStatic ||
+                (check_degradation && m_bvhs[changed[k]]->GetRefitDegradation() > 1.f + max_degradation->AsFloat()))
             {
-                // Get the mesh
-                ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(shapes[topindices[i]]);
+                degraded.push_back(k);
+            }
+        }
 
-                m_cpudata->shapedata[i].id = shapeimpl->GetId();
-                // For disabled shapes force mask to zero since these shapes 
-                // present only virtually (they have not been added to the scene)
-                // and we need to skip them while doing traversal.
-                if (shapes_disabled.find(shapeimpl) == shapes_disabled.cend())
-                {
-                    m_cpudata->shapedata[i].mask = shapeimpl->GetMask();
-                }
-                else
+        auto const& settings = world.options_.GetBvhSettings().bottom;
+        int numdegraded = (int)degraded.size();
+
+        if (background && background->AsFloat() > 0.f)
+        {
+            // Refitted trees are traversed until the rebuilt ones are picked up by a later refit
+            for (auto k : degraded)
+            {
+                MeshEntry& entry = *m_cpudata->mesh_entries[changed[k]];
+
+                if (!entry.rebuild.valid())
                 {
-                    m_cpudata->shapedata[i].mask = 0x0;
+                    auto first = m_cpudata->bounds.begin() + bounds_start[k];
+                    host_vector<bbox> bounds(first, first + static_cast<Mesh const*>(shapes[changed[k]])->num_faces());
+                    BuildHint hint = shapes[changed[k]]->GetBuildHint();
+
+                    entry.rebuild = std::async(std::launch::async, [settings, bounds, hint]()
+                    {
+                        SetBuildThreadPriority();
+                        auto bvh = CreateMeshBvh(settings, hint);
+                        bvh->Build(bounds.data(), (int)bounds.size());
+                        return bvh;
+                    });
                 }
+            }
+        }
+        else if (numdegraded > 0)
+        {
+            std::vector<std::shared_ptr<Bvh>> bvhs(numdegraded);
+            std::vector<int> numprims(numdegraded);
+            for (int d = 0; d < numdegraded; ++d)
+            {
+                bvhs[d] = CreateMeshBvh(settings, shapes[changed[degraded[d]]]->GetBuildHint());
+                numprims[d] = static_cast<Mesh const*>(shapes[changed[degraded[d]]])->num_faces();
+            }
+
+            Bvh::ScheduleBuilds(numprims.data(), numdegraded, [&](int d)
+            {
+                bvhs[d]->Build(&m_cpudata->bounds[bounds_start[degraded[d]]], numprims[d]);
+            });
+
+            for (int d = 0; d < numdegraded; ++d)
+            {
+                replace(changed[degraded[d]], bvhs[d]);
+            }
+        }
+
+        for (auto i : changed)
+        {
+            Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+
+            int root = m_cpudata->translator.roots_[i];
+            int numnodes = TranslateMesh(i);
 
-                shapeimpl->GetTransform(m, m_cpudata->shapedata[i].minv);
+            // The cached BVH matches the new vertices now
+            m_cpudata->mesh_entries[i]->version = mesh->GetVersion();
+            m_cpudata->mesh_bounds[i] = m_bvhs[i]->Bounds();
+            UpdateCutBounds(i, m_bvhs[i].get());
+
+            Calc::Event* e = nullptr;
+            m_device->WriteBuffer(m_gpudata->bvh, 0, root * sizeof(PlainBvhTranslator::Node), numnodes * sizeof(PlainBvhTranslator::Node), (char*)&m_cpudata->translator.nodes_[root], &e);
+            e->Wait();
+            m_device->DeleteEvent(e);
 
-                if (!shapeimpl->is_instance())
+            // Vertices are kept in object space, quantized ones relative to the new vertex bounds
+            if (mesh->num_vertices() > 0)
+            {
+                if (m_formats & kQuantizedVertices)
                 {
-                    m_cpudata->shapedata[i].bvhidx = m_cpudata->translator.roots_[topindices[i]];
+                    std::vector<std::uint16_t> vertices(3 * mesh->num_vertices());
+                    QuantizeMeshVertices(i, vertices.data());
+                    UploadRange(m_gpudata->vertices, m_cpudata->mesh_vertices_start_idx[i] * GetVertexRecordSize(), std::move(vertices));
                 }
                 else
                 {
-                    Instance const* instance = static_cast<Instance const*>(shapes[topindices[i]]);
+                    std::vector<float3> vertices(mesh->num_vertices());
+                    for (int j = 0; j < mesh->num_vertices(); ++j)
+                    {
+                        vertices[j] = mesh->GetVertex(j);
+                    }
+
+                    UploadRange(m_gpudata->vertices, m_cpudata->mesh_vertices_start_idx[i] * sizeof(float3), std::move(vertices));
+                }
+            }
 
-                    // Find corresponding mesh
-                    Mesh const* basemesh = static_cast<Mesh const*>(instance->GetBaseShape());
+            // Compact faces don't follow the BVH order
+            if (replaced[i] && !(m_formats & kCompactFaces))
+            {
+                std::vector<Face> faces(mesh->num_faces());
+                FillMeshFaces(i, faces.data());
+                UploadRange(m_gpudata->faces, m_cpudata->mesh_faces_start_idx[i] * sizeof(Face), std::move(faces));
+            }
+        }
+    }
 
-                    // It should be there
-                    auto iter = std::find(shapes.cbegin(), shapes.cbegin() + nummeshes, basemesh);
+    void IntersectorTwoLevel::FillMeshFaces(int meshidx, Face* faces) const
+    {
+        // Reordering indices for a given mesh
+        int const* reordering = m_bvhs[meshidx]->GetIndices();
 
-                    // TODO: should be assert
-                    ThrowIf(iter == shapes.cbegin() + nummeshes, "Internal error");
+        // Get the mesh
+        Mesh const* mesh = static_cast<Mesh const*>(m_cpudata->shapes[meshidx]);
 
-                    int bvhidx = (int)std::distance(shapes.cbegin(), iter);
+        int startidx = m_cpudata->mesh_vertices_start_idx[meshidx];
 
-                    m_cpudata->shapedata[i].bvhidx = m_cpudata->translator.roots_[bvhidx];
-                }
+        for (int j = 0; j < mesh->num_faces(); ++j)
+        {
+            int faceidx = reordering[j];
+            Mesh::Face const face = mesh->GetFace(faceidx);
+
+            faces[j].idx[0] = face.idx[0] + startidx;
+            faces[j].idx[1] = face.idx[1] + startidx;
+            faces[j].idx[2] = face.idx[2] + startidx;
+            faces[j].idx[3] = face.type_ == Mesh::QUAD ? face.idx[3] + startidx : -1;
+
+            faces[j].shape_id = mesh->GetId();
+            faces[j].prim_id = faceidx;
+        }
+    }
+
+    void IntersectorTwoLevel::FillMeshCompactFaces(int meshidx, CompactFace* faces) const
+    {
+        Mesh const* mesh = static_cast<Mesh const*>(m_cpudata->shapes[meshidx]);
+
+        // Meshes with too many vertices for 16-bit indices take two records per face
+        if (GetFaceShift(meshidx))
+        {
+            for (int j = 0; j < mesh->num_faces(); ++j)
+            {
+                Mesh::Face const face = mesh->GetFace(j);
+                int idx[4] = { face.idx[0], face.idx[1], face.idx[2], face.type_ == Mesh::QUAD ? face.idx[3] : -1 };
+                std::memcpy(&faces[2 * j], idx, sizeof(idx));
             }
 
-            // Create face ID buffer
-            m_device->WriteBuffer(m_gpudata->shapes, 0, 0, (nummeshes + numinstances) * sizeof(ShapeData), (char*)&m_cpudata->shapedata[0], &e);
+            return;
+        }
 
-            e->Wait();
-            m_device->DeleteEvent(e);
+        for (int j = 0; j < mesh->num_faces(); ++j)
+        {
+            Mesh::Face const face = mesh->GetFace(j);
 
-            m_device->Finish(0);
+            faces[j].idx[0] = static_cast<std::uint16_t>(face.idx[0]);
+            faces[j].idx[1] = static_cast<std::uint16_t>(face.idx[1]);
+            faces[j].idx[2] = static_cast<std::uint16_t>(face.idx[2]);
+            faces[j].idx[3] = face.type_ == Mesh::QUAD ? static_cast<std::uint16_t>(face.idx[3]) : 0xFFFF;
         }
     }
 
-    void IntersectorTwoLevel::Intersect(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    int IntersectorTwoLevel::GetFaceShift(int meshidx) const
+    {
+        return (m_formats & kCompactFaces) && static_cast<Mesh const*>(m_cpudata->shapes[meshidx])->num_vertices() >= 0xFFFF ? 1 : 0;
+    }
+
+    std::size_t IntersectorTwoLevel::GetFaceRecordSize() const
     {
-        auto& func = m_gpudata->isect_func;
+        return (m_formats & kCompactFaces) ? sizeof(CompactFace) : sizeof(Face);
+    }
 
-        // Set args
-        int arg = 0;
+    std::size_t IntersectorTwoLevel::GetVertexRecordSize() const
+    {
+        return (m_formats & kQuantizedVertices) ? 3 * sizeof(std::uint16_t) : sizeof(float3);
+    }
 
-        func->SetArg(arg++, m_gpudata->bvh);
-        func->SetArg(arg++, m_gpudata->vertices);
-        func->SetArg(arg++, m_gpudata->faces);
-        func->SetArg(arg++, m_gpudata->shapes);
-        func->SetArg(arg++, sizeof(int), &m_gpudata->bvhrootidx);
-        func->SetArg(arg++, rays);
-        func->SetArg(arg++, numrays);
-        func->SetArg(arg++, hits);
+    void IntersectorTwoLevel::UpdateVertexBounds(int meshidx, bbox* face_bounds)
+    {
+        if (!(m_formats & kQuantizedVertices))
+        {
+            return;
+        }
 
-        size_t localsize = kWorkGroupSize;
-        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        Mesh const* mesh = static_cast<Mesh const*>(m_cpudata->shapes[meshidx]);
+
+        // Empty meshes keep empty bounds at the origin
+        bbox vertex_bounds(float3(0.f, 0.f, 0.f));
+        if (mesh->num_vertices() > 0)
+        {
+            vertex_bounds = bbox(mesh->GetVertex(0));
+            for (int j = 1; j < mesh->num_vertices(); ++j)
+            {
+                vertex_bounds.grow(mesh->GetVertex(j));
+            }
+        }
+
+        m_cpudata->mesh_entries[meshidx]->vertex_bounds = vertex_bounds;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        // Dequantized vertices move by up to half a step, a whole one also covers the rounding
+        // of the dequantization, so the BVH stays conservative
+        float3 step = GetQuantizationStep(vertex_bounds);
+        for (int j = 0; j < mesh->num_faces(); ++j)
+        {
+            face_bounds[j].pmin -= step;
+            face_bounds[j].pmax += step;
+        }
     }
 
-    void IntersectorTwoLevel::Occluded(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    void IntersectorTwoLevel::QuantizeMeshVertices(int meshidx, std::uint16_t* vertices) const
     {
-        auto& func = m_gpudata->occlude_func;
+        Mesh const* mesh = static_cast<Mesh const*>(m_cpudata->shapes[meshidx]);
+        bbox const& vertex_bounds = m_cpudata->mesh_entries[meshidx]->vertex_bounds;
+        float3 extents = vertex_bounds.extents();
 
-        // Set args
-        int arg = 0;
+        for (int j = 0; j < mesh->num_vertices(); ++j)
+        {
+            float3 v = mesh->GetVertex(j) - vertex_bounds.pmin;
 
-        func->SetArg(arg++, m_gpudata->bvh);
-        func->SetArg(arg++, m_gpudata->vertices);
-        func->SetArg(arg++, m_gpudata->faces);
-        func->SetArg(arg++, m_gpudata->shapes);
-        func->SetArg(arg++, sizeof(int), &m_gpudata->bvhrootidx);
-        func->SetArg(arg++, rays);
-        func->SetArg(arg++, numrays);
-        func->SetArg(arg++, hits);
+            // Flat axes keep 0
+            float q[3] = {
+                extents.x > 0.f ? v.x / extents.x : 0.f,
+                extents.y > 0.f ? v.y / extents.y : 0.f,
+                extents.z > 0.f ? v.z / extents.z : 0.f
+            };
 
-        size_t localsize = kWorkGroupSize;
-        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+            for (int c = 0; c < 3; ++c)
+            {
+                float value = std::min(std::max(q[c], 0.f), 1.f) * kQuantizedMax + 0.5f;
+                vertices[3 * j + c] = static_cast<std::uint16_t>(value);
+            }
+        }
+    }
+
+    int IntersectorTwoLevel::TranslateMesh(int meshidx)
+    {
+        auto& translator = m_cpudata->translator;
+        int root = translator.roots_[meshidx];
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        if (!(m_formats & kCompactFaces))
+        {
+            return translator.ProcessAt(*m_bvhs[meshidx], root, m_cpudata->mesh_faces_start_idx[meshidx]);
+        }
+
+        // Leafs hold a single face, its position in the BVH order is replaced by the face record in the mesh order
+        int numnodes = translator.ProcessAt(*m_bvhs[meshidx], root, 0);
+        int const* indices = m_bvhs[meshidx]->GetIndices();
+        int start = m_cpudata->mesh_faces_start_idx[meshidx];
+        int shift = GetFaceShift(meshidx);
+
+        for (int idx = root; idx < root + numnodes; ++idx)
+        {
+            auto& node = translator.nodes_[idx];
+
+            if (node.bounds.pmin.w >= 0.f)
+            {
+                int leaf = translator.extra_[idx] >> 4;
+                translator.extra_[idx] = ((start + (indices[leaf] << shift)) << 4) | (translator.extra_[idx] & 0xF);
+                node.bounds.pmin.w = (float)translator.extra_[idx];
+            }
+        }
+
+        return numnodes;
+    }
+
+    void IntersectorTwoLevel::RebuildMeshes(std::vector<int> const& changed)
+    {
+        RR_TRACE_SCOPE("IntersectorTwoLevel::RebuildMeshes");
+
+        auto const& shapes = m_cpudata->shapes;
+        int numchanged = (int)changed.size();
+
+        // Each mesh is a segment built over its faces in place of its nodes, which
+        // always number 2 * num_faces - 1 as the host BVHs have single face leafs
+        std::vector<Hlbvh::Segment> segments(numchanged);
+        for (int k = 0; k < numchanged; ++k)
+        {
+            int i = changed[k];
+            Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+
+            segments[k].face_start = m_cpudata->mesh_faces_start_idx[i];
+            segments[k].num_faces = mesh->num_faces();
+            segments[k].node_start = m_cpudata->translator.roots_[i];
+
+            // Vertices are kept in object space
+            std::vector<float3> vertices(mesh->num_vertices());
+            for (int j = 0; j < mesh->num_vertices(); ++j)
+            {
+                vertices[j] = mesh->GetVertex(j);
+            }
+
+            UploadRange(m_gpudata->vertices, m_cpudata->mesh_vertices_start_idx[i] * sizeof(float3), std::move(vertices));
+        }
+
+        // Builds read the new vertices
+        WaitForUploads();
+
+        host_vector<bbox> bounds(numchanged);
+        GetBuilder().BuildSegments(m_gpudata->vertices, m_gpudata->faces, segments.data(), numchanged, m_gpudata->bvh, bounds.data());
+
+        for (int k = 0; k < numchanged; ++k)
+        {
+            int i = changed[k];
+
+            // Host BVHs keep the old bounds, so the next full rebuild builds these meshes again
+            m_cpudata->mesh_entries[i]->version = 0;
+            m_cpudata->mesh_bounds[i] = bounds[k];
+            UpdateCutBounds(i, nullptr);
+        }
+    }
+
+    void IntersectorTwoLevel::FindDuplicateMeshes(std::vector<Shape const*> const& meshes, std::vector<int>& canonical)
+    {
+        RR_TRACE_SCOPE("IntersectorTwoLevel::FindDuplicateMeshes");
+
+        int nummeshes = (int)meshes.size();
+
+        // Versions are unique across meshes, so only new and updated meshes are hashed
+        std::vector<std::uint64_t> hashes(nummeshes);
+        std::vector<int> missing;
+        for (int i = 0; i < nummeshes; ++i)
+        {
+            auto iter = m_cpudata->mesh_hashes.find(static_cast<Mesh const*>(meshes[i])->GetVersion());
+
+            if (iter != m_cpudata->mesh_hashes.cend())
+            {
+                hashes[i] = iter->second;
+            }
+            else
+            {
+                missing.push_back(i);
+            }
+        }
+
+        int nummissing = (int)missing.size();
+
+#pragma omp parallel for
+        for (int k = 0; k < nummissing; ++k)
+        {
+            hashes[missing[k]] = HashMesh(static_cast<Mesh const*>(meshes[missing[k]]));
+        }
+
+        // Hashes of the meshes which are gone are dropped
+        std::unordered_map<std::uint64_t, std::uint64_t> mesh_hashes;
+        for (int i = 0; i < nummeshes; ++i)
+        {
+            mesh_hashes[static_cast<Mesh const*>(meshes[i])->GetVersion()] = hashes[i];
+        }
+
+        m_cpudata->mesh_hashes.swap(mesh_hashes);
+
+        // Meshes with the same hash are compared with the distinct ones found so far
+        std::unordered_map<std::uint64_t, std::vector<int>> distinct;
+        canonical.resize(nummeshes);
+        for (int i = 0; i < nummeshes; ++i)
+        {
+            auto& candidates = distinct[hashes[i]];
+            canonical[i] = i;
+
+            for (auto c : candidates)
+            {
+                if (SameMesh(static_cast<Mesh const*>(meshes[c]), static_cast<Mesh const*>(meshes[i])))
+                {
+                    canonical[i] = c;
+                    break;
+                }
+            }
+
+            if (canonical[i] == i)
+            {
+                candidates.push_back(i);
+            }
+        }
+    }
+
+    void IntersectorTwoLevel::LayoutMeshes(int numtopnodes, std::vector<int>& placed)
+    {
+        auto& cpudata = *m_cpudata;
+        int nummeshes = cpudata.nummeshes;
+
+        placed.clear();
+        for (int i = 0; i < nummeshes; ++i)
+        {
+            if (cpudata.mesh_entries[i]->node_start < 0)
+            {
+                placed.push_back(i);
+            }
+        }
+
+        auto count = [&](std::vector<int> const& meshes, int& numnodes, int& numfaces, int& numvertices)
+        {
+            numnodes = numfaces = numvertices = 0;
+            for (auto i : meshes)
+            {
+                Mesh const* mesh = static_cast<Mesh const*>(cpudata.shapes[i]);
+
+                numnodes += m_bvhs[i]->GetNumNodes();
+                numfaces += mesh->num_faces() << GetFaceShift(i);
+                numvertices += mesh->num_vertices();
+            }
+        };
+
+        int numnodes, numfaces, numvertices;
+        count(placed, numnodes, numfaces, numvertices);
+
+        // New meshes are appended to the ones in the buffers, group and top level nodes follow them
+        if (!m_gpudata->bvh ||
+            cpudata.nodes_end + numnodes + numtopnodes > cpudata.node_capacity ||
+            cpudata.faces_end + numfaces > cpudata.face_capacity ||
+            cpudata.vertices_end + numvertices > cpudata.vertex_capacity)
+        {
+            RR_TRACE_SCOPE("IntersectorTwoLevel::LayoutMeshes");
+
+            // Ranges of detached meshes are reclaimed and all the meshes placed again
+            for (auto iter = cpudata.mesh_cache.begin(); iter != cpudata.mesh_cache.end();)
+            {
+                if (iter->second.used)
+                {
+                    iter->second.node_start = -1;
+                    ++iter;
+                }
+                else
+                {
+                    iter = cpudata.mesh_cache.erase(iter);
+                }
+            }
+
+            placed.resize(nummeshes);
+            for (int i = 0; i < nummeshes; ++i)
+            {
+                placed[i] = i;
+            }
+
+            count(placed, numnodes, numfaces, numvertices);
+
+            // Leave room for meshes attached later
+            cpudata.node_capacity = numnodes + numtopnodes + (numnodes + numtopnodes) / 2;
+            cpudata.face_capacity = numfaces + numfaces / 2;
+            cpudata.vertex_capacity = numvertices + numvertices / 2;
+            cpudata.nodes_end = 0;
+            cpudata.faces_end = 0;
+            cpudata.vertices_end = 0;
+
+            if (m_gpudata->bvh)
+            {
+                m_device->DeleteBuffer(m_gpudata->bvh);
+                m_device->DeleteBuffer(m_gpudata->vertices);
+                m_device->DeleteBuffer(m_gpudata->faces);
+            }
+
+            m_gpudata->bvh = CreateSceneBuffer(cpudata.node_capacity * sizeof(PlainBvhTranslator::Node));
+            m_gpudata->vertices = CreateSceneBuffer(cpudata.vertex_capacity * GetVertexRecordSize());
+            m_gpudata->faces = CreateSceneBuffer(cpudata.face_capacity * GetFaceRecordSize());
+
+            cpudata.translator.Flush();
+            cpudata.translator.nodes_.resize(cpudata.node_capacity);
+            cpudata.translator.extra_.resize(cpudata.node_capacity);
+        }
+
+        for (auto i : placed)
+        {
+            Mesh const* mesh = static_cast<Mesh const*>(cpudata.shapes[i]);
+            MeshEntry& entry = *cpudata.mesh_entries[i];
+
+            entry.node_start = cpudata.nodes_end;
+            entry.face_start = cpudata.faces_end;
+            entry.vertex_start = cpudata.vertices_end;
+
+            cpudata.nodes_end += m_bvhs[i]->GetNumNodes();
+            cpudata.faces_end += mesh->num_faces() << GetFaceShift(i);
+            cpudata.vertices_end += mesh->num_vertices();
+        }
+    }
+
+    std::size_t IntersectorTwoLevel::GetMeshMemory(int meshidx) const
+    {
+        Mesh const* mesh = static_cast<Mesh const*>(m_cpudata->shapes[meshidx]);
+
+        return m_bvhs[meshidx]->GetNumNodes() * sizeof(PlainBvhTranslator::Node) +
+            (mesh->num_faces() << GetFaceShift(meshidx)) * GetFaceRecordSize() + mesh->num_vertices() * GetVertexRecordSize();
+    }
+
+    void IntersectorTwoLevel::BuildPages(std::size_t page_bytes, int numtopnodes)
+    {
+        RR_TRACE_SCOPE("IntersectorTwoLevel::BuildPages");
+
+        auto& cpudata = *m_cpudata;
+        auto& translator = cpudata.translator;
+        int nummeshes = cpudata.nummeshes;
+        int numgroups = (int)cpudata.groups.size();
+        int numshapes = (int)cpudata.shapes.size();
+
+        // Meshes are taken in the order of top level leafs, so pages hold meshes close to each other
+        std::vector<int> order;
+        std::vector<bool> visited(nummeshes + numgroups, false);
+        std::function<void(int)> visit = [&](int bvhidx)
+        {
+            if (visited[bvhidx])
+            {
+                return;
+            }
+
+            visited[bvhidx] = true;
+
+            if (bvhidx < nummeshes)
+            {
+                order.push_back(bvhidx);
+                return;
+            }
+
+            // Shape BVH indices of a group are laid out as its shape data, which follows the top level one
+            int group = bvhidx - nummeshes;
+            int start = cpudata.group_offsets[group] - numshapes;
+            int count = (int)cpudata.groups[group]->GetShapes().size();
+
+            for (int i = start; i < start + count; ++i)
+            {
+                visit(cpudata.group_shape_bvhidx[i]);
+            }
+        };
+
+        int const* topindices = m_bvhs.back()->GetIndices();
+        for (int i = 0; i < numshapes; ++i)
+        {
+            visit(cpudata.shape_bvhidx[topindices[i]]);
+        }
+
+        auto window_bytes = [](int numnodes, int numfaces, int numvertices)
+        {
+            return numnodes * sizeof(PlainBvhTranslator::Node) + numfaces * sizeof(Face) + numvertices * sizeof(float3);
+        };
+
+        // The window holds the largest node, face and vertex ranges of the pages, a page is closed once
+        // the next mesh would grow the window past the budget
+        cpudata.pages.clear();
+        cpudata.mesh_page.resize(nummeshes);
+        int maxnodes = 0;
+        int maxfaces = 0;
+        int maxvertices = 0;
+        int numnodes = 0;
+        int numfaces = 0;
+        int numvertices = 0;
+        for (auto i : order)
+        {
+            Mesh const* mesh = static_cast<Mesh const*>(cpudata.shapes[i]);
+
+            int meshnodes = m_bvhs[i]->GetNumNodes();
+            int meshfaces = mesh->num_faces();
+            int meshvertices = mesh->num_vertices();
+
+            ThrowIf(GetMeshMemory(i) > page_bytes, "A mesh doesn't fit into mem.budget, meshes are paged as a whole.");
+
+            if (cpudata.pages.empty() || window_bytes(std::max(maxnodes, numnodes + meshnodes),
+                std::max(maxfaces, numfaces + meshfaces), std::max(maxvertices, numvertices + meshvertices)) > page_bytes)
+            {
+                cpudata.pages.emplace_back();
+                numnodes = numfaces = numvertices = 0;
+            }
+
+            cpudata.pages.back().meshes.push_back(i);
+            cpudata.mesh_page[i] = (int)cpudata.pages.size() - 1;
+
+            translator.roots_[i] = numnodes;
+            cpudata.mesh_faces_start_idx[i] = numfaces;
+            cpudata.mesh_vertices_start_idx[i] = numvertices;
+
+            numnodes += meshnodes;
+            numfaces += meshfaces;
+            numvertices += meshvertices;
+            maxnodes = std::max(maxnodes, numnodes);
+            maxfaces = std::max(maxfaces, numfaces);
+            maxvertices = std::max(maxvertices, numvertices);
+        }
+
+        // Group and top level nodes follow the window, cached meshes are placed again once paging is off
+        cpudata.node_capacity = maxnodes + numtopnodes;
+        cpudata.face_capacity = maxfaces;
+        cpudata.vertex_capacity = maxvertices;
+        cpudata.nodes_end = maxnodes;
+        cpudata.faces_end = 0;
+        cpudata.vertices_end = 0;
+        cpudata.resident_page = -1;
+
+        for (auto iter = cpudata.mesh_cache.begin(); iter != cpudata.mesh_cache.end();)
+        {
+            if (iter->second.used)
+            {
+                iter->second.node_start = -1;
+                ++iter;
+            }
+            else
+            {
+                iter = cpudata.mesh_cache.erase(iter);
+            }
+        }
+
+        if (m_gpudata->bvh)
+        {
+            m_device->DeleteBuffer(m_gpudata->bvh);
+            m_device->DeleteBuffer(m_gpudata->vertices);
+            m_device->DeleteBuffer(m_gpudata->faces);
+        }
+
+        m_gpudata->bvh = CreateSceneBuffer(cpudata.node_capacity * sizeof(PlainBvhTranslator::Node));
+        m_gpudata->vertices = CreateSceneBuffer(cpudata.vertex_capacity * sizeof(float3));
+        m_gpudata->faces = CreateSceneBuffer(cpudata.face_capacity * sizeof(Face));
+
+        translator.Flush();
+        translator.nodes_.resize(cpudata.node_capacity);
+        translator.extra_.resize(cpudata.node_capacity);
+
+        // Pages share the window, so their nodes are translated one after another and copied out
+        for (auto& page : cpudata.pages)
+        {
+            int last = page.meshes.back();
+            Mesh const* lastmesh = static_cast<Mesh const*>(cpudata.shapes[last]);
+
+            page.nodes.resize(translator.roots_[last] + m_bvhs[last]->GetNumNodes());
+            page.faces.resize(cpudata.mesh_faces_start_idx[last] + lastmesh->num_faces());
+            page.vertices.resize(cpudata.mesh_vertices_start_idx[last] + lastmesh->num_vertices());
+
+            for (auto i : page.meshes)
+            {
+                translator.ProcessAt(*m_bvhs[i], translator.roots_[i], cpudata.mesh_faces_start_idx[i]);
+            }
+
+            std::copy(translator.nodes_.cbegin(), translator.nodes_.cbegin() + page.nodes.size(), page.nodes.begin());
+
+            int numpagemeshes = (int)page.meshes.size();
+
+#pragma omp parallel for
+            for (int k = 0; k < numpagemeshes; ++k)
+            {
+                int i = page.meshes[k];
+                Mesh const* mesh = static_cast<Mesh const*>(cpudata.shapes[i]);
+
+                FillMeshFaces(i, page.faces.data() + cpudata.mesh_faces_start_idx[i]);
+
+                for (int j = 0; j < mesh->num_vertices(); ++j)
+                {
+                    page.vertices[cpudata.mesh_vertices_start_idx[i] + j] = mesh->GetVertex(j);
+                }
+            }
+        }
+    }
+
+    void IntersectorTwoLevel::UpdatePages(std::vector<bbox> const& object_bounds)
+    {
+        auto& cpudata = *m_cpudata;
+        int nummeshes = cpudata.nummeshes;
+        int numgroups = (int)cpudata.groups.size();
+        int numshapes = (int)cpudata.shapes.size();
+        int numpages = (int)cpudata.pages.size();
+
+        // Pages reached through each mesh and group BVH, groups follow the groups they contain
+        std::vector<std::vector<int>> bvh_pages(nummeshes + numgroups);
+        for (int i = 0; i < nummeshes; ++i)
+        {
+            bvh_pages[i].push_back(cpudata.mesh_page[i]);
+        }
+
+        int const* group_shape_bvhidx = cpudata.group_shape_bvhidx.data();
+        for (int i = 0; i < numgroups; ++i)
+        {
+            auto& pages = bvh_pages[nummeshes + i];
+            int count = (int)cpudata.groups[i]->GetShapes().size();
+
+            for (int j = 0; j < count; ++j)
+            {
+                auto const& shape_pages = bvh_pages[group_shape_bvhidx[j]];
+                pages.insert(pages.end(), shape_pages.cbegin(), shape_pages.cend());
+            }
+
+            std::sort(pages.begin(), pages.end());
+            pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+
+            group_shape_bvhidx += count;
+        }
+
+        std::vector<bbox> page_bounds(numpages);
+        for (int i = 0; i < numshapes; ++i)
+        {
+            // Base shapes which are only referenced are never hit
+            if (cpudata.shapes_disabled.find(cpudata.shapes[i]) != cpudata.shapes_disabled.cend())
+            {
+                continue;
+            }
+
+            for (auto page : bvh_pages[cpudata.shape_bvhidx[i]])
+            {
+                page_bounds[page].grow(object_bounds[i]);
+            }
+        }
+
+        int numshapedata = (int)cpudata.shapedata.size();
+
+#pragma omp parallel for
+        for (int i = 0; i < numpages; ++i)
+        {
+            auto& page = cpudata.pages[i];
+
+            page.bounds = page_bounds[i];
+            page.shapedata = cpudata.shapedata;
+
+            // Roots of meshes in other pages point into the window as well
+            for (int j = 0; j < numshapedata; ++j)
+            {
+                int bvhidx = cpudata.shapedata_bvhidx[j];
+
+                if (bvhidx < nummeshes && cpudata.mesh_page[bvhidx] != i)
+                {
+                    page.shapedata[j].mask = 0x0;
+                }
+            }
+        }
+
+        m_device->DeleteBuffer(m_gpudata->page_bounds);
+        m_device->DeleteBuffer(m_gpudata->page_requests);
+
+        m_gpudata->page_bounds = m_device->CreateBuffer(numpages * sizeof(bbox), Calc::kRead);
+        m_gpudata->page_requests = m_device->CreateBuffer(numpages * sizeof(int), Calc::kWrite);
+        m_gpudata->page_zeros.assign(numpages, 0);
+
+        Upload(m_gpudata->page_bounds, std::move(page_bounds));
+    }
+
+    void IntersectorTwoLevel::LoadPage(std::uint32_t queueidx, int pageidx) const
+    {
+        if (m_cpudata->resident_page == pageidx)
+        {
+            return;
+        }
+
+        // Pages stay on the host until the next full rebuild, so the writes don't block
+        Page const& page = m_cpudata->pages[pageidx];
+        m_device->WriteBuffer(m_gpudata->bvh, queueidx, 0, page.nodes.size() * sizeof(PlainBvhTranslator::Node), const_cast<PlainBvhTranslator::Node*>(page.nodes.data()), nullptr);
+        m_device->WriteBuffer(m_gpudata->faces, queueidx, 0, page.faces.size() * sizeof(Face), const_cast<Face*>(page.faces.data()), nullptr);
+        m_device->WriteBuffer(m_gpudata->vertices, queueidx, 0, page.vertices.size() * sizeof(float3), const_cast<float3*>(page.vertices.data()), nullptr);
+        m_device->WriteBuffer(m_gpudata->shapes, queueidx, 0, page.shapedata.size() * sizeof(ShapeData), const_cast<ShapeData*>(page.shapedata.data()), nullptr);
+
+        m_cpudata->resident_page = pageidx;
+    }
+
+    void IntersectorTwoLevel::ReleaseHostCopies()
+    {
+        auto& cpudata = *m_cpudata;
+
+        // Translated nodes are uploaded straight from the translator
+        WaitForUploads();
+
+        // Cached meshes go along with their ranges, the next rebuild reallocates the buffers for all of them
+        cpudata.mesh_cache.clear();
+        std::vector<MeshEntry*>().swap(cpudata.mesh_entries);
+        cpudata.node_capacity = 0;
+        cpudata.face_capacity = 0;
+        cpudata.vertex_capacity = 0;
+
+        // The vector keeps its size, so the next commit doesn't take it for the first one
+        for (auto& bvh : m_bvhs)
+        {
+            bvh.reset();
+        }
+
+        std::vector<Bvh const*>().swap(cpudata.bvhptrs);
+        cpudata.bounds.clear();
+        cpudata.bounds.shrink_to_fit();
+
+        cpudata.translator.Flush();
+        std::vector<PlainBvhTranslator::Node>().swap(cpudata.translator.nodes_);
+        std::vector<int>().swap(cpudata.translator.extra_);
+
+        cpudata.host_released = true;
+    }
+
+    void IntersectorTwoLevel::BuildGroups(float traversal_cost, int num_bins, bool use_sah)
+    {
+        int nummeshes = m_cpudata->nummeshes;
+        int const* shape_bvhidx = m_cpudata->group_shape_bvhidx.data();
+
+        // Groups come after the groups they contain, so their shape bounds are ready
+        for (auto i = 0U; i < m_cpudata->groups.size(); ++i)
+        {
+            auto const& shapes = m_cpudata->groups[i]->GetShapes();
+            int numshapes = (int)shapes.size();
+
+            std::vector<bbox> bounds(numshapes);
+            for (int j = 0; j < numshapes; ++j)
+            {
+                matrix m, minv;
+                shapes[j]->GetTransform(m, minv);
+
+                bounds[j] = GetShapeBounds(shape_bvhidx[j], m);
+            }
+
+            auto& bvh = m_bvhs[nummeshes + i];
+            bvh.reset(new Bvh(traversal_cost, num_bins, use_sah));
+            bvh->Build(&bounds[0], numshapes);
+            m_cpudata->bvhptrs[nummeshes + i] = bvh.get();
+            UpdateCutBounds(nummeshes + i, bvh.get());
+
+            shape_bvhidx += numshapes;
+        }
+    }
+
+    void IntersectorTwoLevel::CalculateObjectBounds(std::vector<bbox>& object_bounds) const
+    {
+        auto const& shapes = m_cpudata->shapes;
+        int numshapes = (int)shapes.size();
+
+        object_bounds.resize(numshapes);
+
+#pragma omp parallel for
+        for (int i = 0; i < numshapes; ++i)
+        {
+            // Get transform to apply to object bounds,
+            // instance is using its own transform for base shape BVH
+            matrix m, minv;
+            shapes[i]->GetTransform(m, minv);
+
+            // Extract and store bounds. Note they are in object space and we need to translate them to world space
+            object_bounds[i] = GetShapeBounds(m_cpudata->shape_bvhidx[i], m);
+
+            // Leafs of instances with levels of detail bound all of them
+            int lod_offset = m_cpudata->lod_offsets[i];
+            if (lod_offset >= 0)
+            {
+                int numlevels = static_cast<Instance const*>(shapes[i])->GetNumLods();
+                for (int j = 1; j < numlevels; ++j)
+                {
+                    object_bounds[i].grow(GetShapeBounds(m_cpudata->lod_bvhidx[lod_offset - m_cpudata->lod_start + j - 1], m));
+                }
+            }
+        }
+    }
+
+    bbox const& IntersectorTwoLevel::GetBvhBounds(int bvhidx) const
+    {
+        return bvhidx < m_cpudata->nummeshes ? m_cpudata->mesh_bounds[bvhidx] : m_bvhs[bvhidx]->Bounds();
+    }
+
+    bbox IntersectorTwoLevel::GetShapeBounds(int bvhidx, matrix const& m) const
+    {
+        if (m_cpudata->cut_bounds.empty())
+        {
+            return transform_bbox(GetBvhBounds(bvhidx), m);
+        }
+
+        // Each of the cut nodes is transformed separately, so thin rotated shapes
+        // aren't bounded by a box around their whole rotated root box
+        bbox const* cut = &m_cpudata->cut_bounds[bvhidx * kNumCutBounds];
+        bbox bounds = transform_bbox(cut[0], m);
+        for (int i = 1; i < kNumCutBounds; ++i)
+        {
+            bounds = bboxunion(bounds, transform_bbox(cut[i], m));
+        }
+
+        return bounds;
+    }
+
+    void IntersectorTwoLevel::UpdateCutBounds(int bvhidx, Bvh const* bvh)
+    {
+        if (m_cpudata->cut_bounds.empty())
+        {
+            return;
+        }
+
+        // Stale BVHs are covered by the root bounds only, short cuts repeat their last node
+        std::vector<bbox> cut(1, GetBvhBounds(bvhidx));
+        if (bvh)
+        {
+            bvh->GetCutBounds(kNumCutBounds, cut);
+        }
+
+        for (int i = 0; i < kNumCutBounds; ++i)
+        {
+            m_cpudata->cut_bounds[bvhidx * kNumCutBounds + i] = cut[std::min(i, (int)cut.size() - 1)];
+        }
+    }
+
+    void IntersectorTwoLevel::UpdateShapeData(int const* topindices)
+    {
+        auto const& shapes = m_cpudata->shapes;
+        int numshapes = (int)shapes.size();
+        int nummeshes = m_cpudata->nummeshes;
+        int numgroups = (int)m_cpudata->groups.size();
+
+        // Records stay aligned to 64 bytes in the shapes buffer, so the fields read
+        // on entering a shape never straddle cache lines
+        static_assert(sizeof(ShapeData) == 128, "ShapeData has to match Shape of the kernels");
+
+        auto set_transform = [](ShapeImpl const* shapeimpl, ShapeData& data)
+        {
+            matrix m, minv;
+            shapeimpl->GetTransform(m, minv);
+            data.m0 = float3(minv.m00, minv.m01, minv.m02, minv.m03);
+            data.m1 = float3(minv.m10, minv.m11, minv.m12, minv.m13);
+            data.m2 = float3(minv.m20, minv.m21, minv.m22, minv.m23);
+        };
+
+#pragma omp parallel for
+        for (int i = 0; i < numshapes; ++i)
+        {
+            // Get the mesh
+            ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(shapes[topindices[i]]);
+
+            m_cpudata->shapedata[i].id = shapeimpl->GetId();
+
+            // For disabled shapes force mask to zero since these shapes 
+            // present only virtually (they have not been added to the scene)
+            // and we need to skip them while doing traversal.
+            if (m_cpudata->shapes_disabled.find(shapeimpl) == m_cpudata->shapes_disabled.cend())
+            {
+                m_cpudata->shapedata[i].mask = shapeimpl->GetMask();
+            }
+            else
+            {
+                m_cpudata->shapedata[i].mask = 0x0;
+            }
+
+            set_transform(shapeimpl, m_cpudata->shapedata[i]);
+
+            float3 linearvelocity = shapeimpl->GetLinearVelocity();
+            m_cpudata->shapedata[i].linearvelocity[0] = linearvelocity.x;
+            m_cpudata->shapedata[i].linearvelocity[1] = linearvelocity.y;
+            m_cpudata->shapedata[i].linearvelocity[2] = linearvelocity.z;
+            m_cpudata->shapedata[i].angularvelocity = shapeimpl->GetAngularVelocity();
+
+            // Instances reference root node of their base shape BVH
+            int bvhidx = m_cpudata->shape_bvhidx[topindices[i]];
+            m_cpudata->shapedata[i].bvhidx = m_cpudata->translator.roots_[bvhidx];
+            m_cpudata->shapedata_bvhidx[i] = bvhidx;
+            m_cpudata->shapedata[i].is_group = bvhidx >= nummeshes ? 1 : 0;
+            SetMeshRanges(bvhidx, m_cpudata->shapedata[i]);
+        }
+
+        // Shapes of each group in the order of its BVH leafs
+        int const* group_shape_bvhidx = m_cpudata->group_shape_bvhidx.data();
+        for (int i = 0; i < numgroups; ++i)
+        {
+            auto const& groupshapes = m_cpudata->groups[i]->GetShapes();
+            int const* indices = m_bvhs[nummeshes + i]->GetIndices();
+
+            for (int j = 0; j < (int)groupshapes.size(); ++j)
+            {
+                ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(groupshapes[indices[j]]);
+                ShapeData& data = m_cpudata->shapedata[m_cpudata->group_offsets[i] + j];
+
+                data.id = shapeimpl->GetId();
+                data.mask = shapeimpl->GetMask();
+
+                set_transform(shapeimpl, data);
+
+                // Only shapes attached to the scene move
+                std::fill(data.linearvelocity, data.linearvelocity + 3, 0.f);
+                data.angularvelocity = quaternion();
+
+                int bvhidx = group_shape_bvhidx[indices[j]];
+                data.bvhidx = m_cpudata->translator.roots_[bvhidx];
+                m_cpudata->shapedata_bvhidx[m_cpudata->group_offsets[i] + j] = bvhidx;
+                data.is_group = bvhidx >= nummeshes ? 1 : 0;
+                SetMeshRanges(bvhidx, data);
+            }
+
+            group_shape_bvhidx += groupshapes.size();
+        }
+
+        if (!(m_formats & kLodInstances))
+        {
+            return;
+        }
+
+        // Coarser levels of detail copy the shape data of their instance with the ranges of their meshes
+        m_cpudata->lods.resize(numshapes);
+
+#pragma omp parallel for
+        for (int i = 0; i < numshapes; ++i)
+        {
+            Lod& lod = m_cpudata->lods[i];
+            int lod_offset = m_cpudata->lod_offsets[topindices[i]];
+
+            // Distances are measured from the center of the finest level
+            matrix m, minv;
+            shapes[topindices[i]]->GetTransform(m, minv);
+            float3 const center = transform_point(GetBvhBounds(m_cpudata->shapedata_bvhidx[i]).center(), m);
+
+            lod.center[0] = center.x;
+            lod.center[1] = center.y;
+            lod.center[2] = center.z;
+            lod.num_levels = 1;
+            lod.first_level = lod_offset;
+            std::fill(lod.distance, lod.distance + Instance::kMaxLods - 1, 0.f);
+
+            if (lod_offset < 0)
+            {
+                continue;
+            }
+
+            auto instance = static_cast<Instance const*>(shapes[topindices[i]]);
+            lod.num_levels = instance->GetNumLods();
+
+            for (int j = 1; j < lod.num_levels; ++j)
+            {
+                ShapeData& data = m_cpudata->shapedata[lod_offset + j - 1];
+                data = m_cpudata->shapedata[i];
+
+                int bvhidx = m_cpudata->lod_bvhidx[lod_offset - m_cpudata->lod_start + j - 1];
+                data.bvhidx = m_cpudata->translator.roots_[bvhidx];
+                m_cpudata->shapedata_bvhidx[lod_offset + j - 1] = bvhidx;
+                data.is_group = 0;
+                SetMeshRanges(bvhidx, data);
+
+                lod.distance[j - 1] = instance->GetLodDistance(j);
+            }
+        }
+    }
+
+    void IntersectorTwoLevel::SetMeshRanges(int bvhidx, ShapeData& data) const
+    {
+        bool mesh = bvhidx < m_cpudata->nummeshes;
+
+        data.vertex_start = mesh ? m_cpudata->mesh_vertices_start_idx[bvhidx] : 0;
+        data.face_start = mesh ? m_cpudata->mesh_faces_start_idx[bvhidx] : 0;
+        data.face_shift = mesh ? GetFaceShift(bvhidx) : 0;
+
+        if (mesh && (m_formats & kQuantizedVertices))
+        {
+            bbox const& vertex_bounds = m_cpudata->mesh_entries[bvhidx]->vertex_bounds;
+            float3 const vertex_scale = GetQuantizationStep(vertex_bounds);
+
+            for (int i = 0; i < 3; ++i)
+            {
+                data.vertex_min[i] = vertex_bounds.pmin[i];
+                data.vertex_scale[i] = vertex_scale[i];
+            }
+        }
+        else
+        {
+            std::fill(data.vertex_min, data.vertex_min + 3, 0.f);
+            std::fill(data.vertex_scale, data.vertex_scale + 3, 0.f);
+        }
+    }
+
+    void IntersectorTwoLevel::UpdateMotionNodes(std::vector<bbox> const& object_bounds)
+    {
+        if (!(m_formats & kMotionBlur))
+        {
+            return;
+        }
+
+        auto const& shapes = m_cpudata->shapes;
+        int numshapes = (int)shapes.size();
+
+        // Shapes are translated by their linear velocity at ray time 1
+        std::vector<bbox> end_bounds(numshapes);
+        for (int i = 0; i < numshapes; ++i)
+        {
+            float3 const v = shapes[i]->GetLinearVelocity();
+            end_bounds[i] = bbox(object_bounds[i].pmin + v, object_bounds[i].pmax + v);
+        }
+
+        std::vector<PlainBvhTranslator::Node> nodes;
+        m_cpudata->translator.ProcessBounds(*m_bvhs.back(), end_bounds.data(), nodes);
+
+        // The number of top level nodes only changes on full rebuilds
+        if (!m_gpudata->motion_nodes)
+        {
+            m_gpudata->motion_nodes = CreateSceneBuffer(nodes.size() * sizeof(PlainBvhTranslator::Node));
+        }
+
+        Upload(m_gpudata->motion_nodes, std::move(nodes));
+    }
+
+    void IntersectorTwoLevel::UpdateTopMasks()
+    {
+        // GLSL kernels test shape masks at the leafs only
+        if (!(m_formats & kRayMask) || m_device->GetPlatform() != Calc::Platform::kOpenCL)
+        {
+            return;
+        }
+
+        m_gpudata->top_masks_set = false;
+
+        auto const& nodes = m_cpudata->translator.nodes_;
+        int root = m_cpudata->translator.root_;
+        int numnodes = 2 * (int)m_cpudata->shapes.size() - 1;
+
+        // Children follow their parent, so going backwards visits the nodes bottom-up
+        std::vector<int> masks(numnodes, 0);
+        for (int i = numnodes - 1; i >= 0; --i)
+        {
+            auto const& node = nodes[root + i];
+
+            if (node.bounds.pmin.w != -1.f)
+            {
+                int const extra = (int)node.bounds.pmin.w;
+                for (int j = 0; j < (extra & 0xF); ++j)
+                {
+                    masks[i] |= m_cpudata->shapedata[(extra >> 4) + j].mask;
+                }
+            }
+            else
+            {
+                // The left child follows its parent and skips to the right one
+                int const left = i + 1;
+                int const right = (int)nodes[root + left].bounds.pmax.w - root;
+                masks[i] = masks[left] | masks[right];
+            }
+        }
+
+        // The number of top level nodes only changes on full rebuilds
+        if (!m_gpudata->top_masks)
+        {
+            m_gpudata->top_masks = m_device->CreateBuffer(numnodes * sizeof(int), Calc::kRead);
+        }
+
+        Upload(m_gpudata->top_masks, std::move(masks));
+    }
+
+    void IntersectorTwoLevel::UpdateLods()
+    {
+        if (!(m_formats & kLodInstances))
+        {
+            return;
+        }
+
+        // The number of top level shapes only changes on full rebuilds
+        if (!m_gpudata->lods)
+        {
+            m_gpudata->lods = CreateSceneBuffer(m_cpudata->lods.size() * sizeof(Lod));
+        }
+
+        Upload(m_gpudata->lods, m_cpudata->lods.size() * sizeof(Lod), m_cpudata->lods.data());
+    }
+
+    void IntersectorTwoLevel::BuildTopLevelOnDevice()
+    {
+        RR_TRACE_SCOPE("IntersectorTwoLevel::BuildTopLevelOnDevice");
+
+        int numshapes = (int)m_cpudata->shapes.size();
+        int numbvhs = (int)m_bvhs.size() - 1;
+
+        // Leafs reference shapes by their index, so shape data keeps the shape order
+        std::vector<int> order(numshapes);
+        std::iota(order.begin(), order.end(), 0);
+        UpdateShapeData(order.data());
+
+        Calc::Event* e = nullptr;
+        m_device->WriteBuffer(m_gpudata->shapes, 0, 0, m_cpudata->shapedata.size() * sizeof(ShapeData), (char*)&m_cpudata->shapedata[0], &e);
+        e->Wait();
+        m_device->DeleteEvent(e);
+
+        // Shape BVH indices only change on full rebuilds
+        if (!m_gpudata->shape_bvhidx)
+        {
+            m_gpudata->shape_bvhidx = m_device->CreateBuffer(numshapes * sizeof(int), Calc::kRead, m_cpudata->shape_bvhidx.data());
+            m_gpudata->bvh_bounds = m_device->CreateBuffer(numbvhs * sizeof(bbox), Calc::kRead);
+            m_gpudata->shape_bounds = m_device->CreateBuffer(numshapes * sizeof(bbox), Calc::kWrite);
+        }
+
+        // Mesh and group bounds change with refits and group rebuilds
+        std::vector<bbox> bvh_bounds(numbvhs);
+        for (int i = 0; i < numbvhs; ++i)
+        {
+            bvh_bounds[i] = GetBvhBounds(i);
+        }
+
+        m_device->WriteBuffer(m_gpudata->bvh_bounds, 0, 0, numbvhs * sizeof(bbox), bvh_bounds.data(), &e);
+        e->Wait();
+        m_device->DeleteEvent(e);
+
+        int arg = 0;
+        m_gpudata->shape_bounds_func->SetArg(arg++, m_gpudata->shapes);
+        m_gpudata->shape_bounds_func->SetArg(arg++, m_gpudata->shape_bvhidx);
+        m_gpudata->shape_bounds_func->SetArg(arg++, m_gpudata->bvh_bounds);
+        m_gpudata->shape_bounds_func->SetArg(arg++, sizeof(numshapes), &numshapes);
+        m_gpudata->shape_bounds_func->SetArg(arg++, m_gpudata->shape_bounds);
+
+        std::size_t globalsize = ((numshapes + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        Execute(m_gpudata->shape_bounds_func, 0, globalsize, kWorkGroupSize, nullptr, "bvh2l.shape_bounds");
+
+        // Top level nodes are replaced in place, they always number 2 * numshapes - 1
+        GetBuilder().BuildNodes(m_gpudata->shape_bounds, numshapes, 0, m_cpudata->translator.root_, m_gpudata->bvh);
+
+        // Masks of host built top levels don't match the new nodes
+        if (m_gpudata->top_masks && !m_gpudata->top_masks_set)
+        {
+            Upload(m_gpudata->top_masks, std::vector<int>(2 * numshapes - 1, -1));
+            m_gpudata->top_masks_set = true;
+        }
+    }
+
+    Hlbvh& IntersectorTwoLevel::GetBuilder()
+    {
+        if (!m_gpudata->builder)
+        {
+            m_gpudata->builder.reset(new Hlbvh(m_device));
+            m_gpudata->builder->SetProfiler(m_profiler);
+        }
+
+        return *m_gpudata->builder;
+    }
+
+    void IntersectorTwoLevel::UpdateStats(std::vector<int> const& built)
+    {
+        // Top level BVH is the last one
+        m_bvhs.back()->GetStats(m_stats);
+
+        std::vector<bool> is_built(m_bvhs.size(), false);
+        for (auto i : built)
+        {
+            is_built[i] = true;
+        }
+
+        int max_bottom_depth = 0;
+        for (auto i = 0U; i + 1 < m_bvhs.size(); ++i)
+        {
+            AccelStats bottom;
+            m_bvhs[i]->GetStats(bottom);
+
+            m_stats.num_nodes += bottom.num_nodes;
+            m_stats.num_leaves += bottom.num_leaves;
+            m_stats.num_primitives += bottom.num_primitives;
+            m_stats.num_refs += bottom.num_refs;
+            max_bottom_depth = std::max(max_bottom_depth, bottom.max_depth);
+
+            // Sum of CPU times, meshes are built concurrently
+            if (is_built[i])
+            {
+                m_stats.build_time += bottom.build_time;
+            }
+        }
+
+        // Top level leaves point to shapes, mesh leaves to faces
+        m_stats.max_depth += max_bottom_depth;
+        m_stats.avg_leaf_prims = m_stats.num_leaves > 0 ? (float)m_stats.num_refs / m_stats.num_leaves : 0.f;
+    }
+
+    void IntersectorTwoLevel::GetMemoryStats(AccelStats& stats) const
+    {
+        stats.node_memory = GetBufferSize(m_gpudata->bvh) + GetBufferSize(m_gpudata->motion_nodes);
+        stats.vertex_memory = GetBufferSize(m_gpudata->vertices);
+        stats.face_memory = GetBufferSize(m_gpudata->faces);
+        stats.other_memory = GetBufferSize(m_gpudata->shapes) + GetBufferSize(m_gpudata->top_masks) + GetBufferSize(m_gpudata->lods);
+    }
+
+    void IntersectorTwoLevel::Intersect(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        auto func = UsePersistent(queueidx, numrays) ? m_gpudata->isect_persistent_func : m_gpudata->isect_func;
+
+        if (!m_cpudata->pages.empty())
+        {
+            std::size_t hit_size = (m_formats & kCompactHits) ? sizeof(PackedIntersection) : sizeof(Intersection);
+            DispatchPaged(func, m_gpudata->merge_hits_func, queueidx, rays, numrays, maxrays, hits, maxrays * hit_size, event);
+        }
+        else
+        {
+            Dispatch(func, queueidx, rays, numrays, maxrays, hits, event);
+        }
+    }
+
+    void IntersectorTwoLevel::Occluded(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        auto func = UsePersistent(queueidx, numrays) ? m_gpudata->occlude_persistent_func : m_gpudata->occlude_func;
+
+        if (!m_cpudata->pages.empty())
+        {
+            DispatchPaged(func, m_gpudata->merge_occlusion_func, queueidx, rays, numrays, maxrays, hits, maxrays * sizeof(int), event);
+        }
+        else
+        {
+            Dispatch(func, queueidx, rays, numrays, maxrays, hits, event);
+        }
+    }
+
+    void IntersectorTwoLevel::OccludedCompact(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        auto func = UsePersistent(queueidx, numrays) ? m_gpudata->occlude_persistent_compact_func : m_gpudata->occlude_compact_func;
+
+        if (!m_cpudata->pages.empty())
+        {
+            DispatchPaged(func, m_gpudata->merge_occlusion_bits_func, queueidx, rays, numrays, maxrays, hits, ((maxrays + 31) / 32) * sizeof(std::uint32_t), event);
+        }
+        else
+        {
+            Dispatch(func, queueidx, rays, numrays, maxrays, hits, event);
+        }
+    }
+
+    void IntersectorTwoLevel::IntersectMulti(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, int k, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        ThrowIf(!m_cpudata->pages.empty(), "Multi-hit queries are not supported while geometry is paged by mem.budget.");
+
+        Dispatch(m_gpudata->isect_multi_func, queueidx, rays, numrays, maxrays, hits, event, k);
+    }
+
+    bool IntersectorTwoLevel::UsePersistent(std::uint32_t queueidx, Calc::Buffer const* numrays) const
+    {
+        // Device ray counts are usually far below maxrays after compaction, persistent
+        // work groups only fetch the live rays instead of launching maxrays work items
+        return m_gpudata->isect_persistent_func &&
+            (m_gpudata->persistent || (m_indirect_dispatch && IsDeviceCount(queueidx, numrays)));
+    }
+
+    void IntersectorTwoLevel::Dispatch(Calc::Function* func, std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event** event, int k) const
+    {
+        // Set args
+        int arg = 0;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, sizeof(int), &m_gpudata->bvhrootidx);
+        if (m_formats & kMotionBlur)
+        {
+            func->SetArg(arg++, m_gpudata->motion_nodes);
+        }
+        if (m_gpudata->top_masks)
+        {
+            func->SetArg(arg++, m_gpudata->top_masks);
+        }
+        if (m_formats & kLodInstances)
+        {
+            func->SetArg(arg++, m_gpudata->lods);
+            func->SetArg(arg++, sizeof(float), &m_cpudata->lod_transition);
+        }
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, numrays);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        if (k == 0 && UsePersistent(queueidx, numrays))
+        {
+            // Counter reset is ordered before the launch on the same queue
+            auto counter = m_gpudata->GetCounter(queueidx);
+            m_device->WriteBuffer(counter, queueidx, 0, sizeof(int), &m_gpudata->zero, nullptr);
+            func->SetArg(arg++, counter);
+
+            globalsize = std::min<size_t>(globalsize, m_gpudata->persistent_size);
+        }
+
+        func->SetArg(arg++, hits);
+
+        if (func == m_gpudata->isect_func || func == m_gpudata->isect_persistent_func)
+        {
+            SetTraversalStatsArg(func, arg, queueidx, maxrays);
+        }
+
+        if (k > 0)
+        {
+            func->SetArg(arg++, sizeof(int), &k);
+        }
+
+        Execute(func, queueidx, globalsize, localsize, event, "bvh2l.traversal");
+    }
+
+    void IntersectorTwoLevel::DispatchPaged(Calc::Function* func, Calc::Function* merge_func, std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays,
+        std::uint32_t maxrays, Calc::Buffer* hits, std::size_t hits_size, Calc::Event** event) const
+    {
+        int numpages = (int)m_cpudata->pages.size();
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        // Flag the pages the rays reach, the flags are read back before any page is loaded
+        m_device->WriteBuffer(m_gpudata->page_requests, queueidx, 0, numpages * sizeof(int), m_gpudata->page_zeros.data(), nullptr);
+
+        int arg = 0;
+        m_gpudata->page_requests_func->SetArg(arg++, rays);
+        m_gpudata->page_requests_func->SetArg(arg++, numrays);
+        m_gpudata->page_requests_func->SetArg(arg++, m_gpudata->page_bounds);
+        m_gpudata->page_requests_func->SetArg(arg++, sizeof(int), &numpages);
+        m_gpudata->page_requests_func->SetArg(arg++, m_gpudata->page_requests);
+        Execute(m_gpudata->page_requests_func, queueidx, globalsize, localsize, nullptr, "bvh2l.page_requests");
+
+        std::vector<int> requests(numpages);
+        Calc::Event* e = nullptr;
+        m_device->ReadBuffer(m_gpudata->page_requests, queueidx, 0, numpages * sizeof(int), requests.data(), &e);
+        e->Wait();
+        m_device->DeleteEvent(e);
+
+        // The resident page goes first to save its upload, rays reaching no page still get their misses written
+        int resident = m_cpudata->resident_page;
+        std::vector<int> pages;
+        if (resident >= 0 && requests[resident])
+        {
+            pages.push_back(resident);
+        }
+
+        for (int i = 0; i < numpages; ++i)
+        {
+            if (requests[i] && i != resident)
+            {
+                pages.push_back(i);
+            }
+        }
+
+        if (pages.empty())
+        {
+            pages.push_back(resident >= 0 ? resident : 0);
+        }
+
+        // The first page writes the hits, the others are traversed into a temporary buffer and merged
+        Calc::Buffer* page_hits = pages.size() > 1 ? m_gpudata->GetPageHits(queueidx, hits_size) : nullptr;
+
+        for (auto i = 0U; i < pages.size(); ++i)
+        {
+            bool last = i + 1 == pages.size();
+
+            LoadPage(queueidx, pages[i]);
+
+            if (i == 0)
+            {
+                Dispatch(func, queueidx, rays, numrays, maxrays, hits, last ? event : nullptr);
+                continue;
+            }
+
+            Dispatch(func, queueidx, rays, numrays, maxrays, page_hits, nullptr);
+
+            arg = 0;
+            merge_func->SetArg(arg++, rays);
+            merge_func->SetArg(arg++, numrays);
+            merge_func->SetArg(arg++, page_hits);
+            merge_func->SetArg(arg++, hits);
+            Execute(merge_func, queueidx, globalsize, localsize, last ? event : nullptr, "bvh2l.merge_page_hits");
+        }
     }
 }
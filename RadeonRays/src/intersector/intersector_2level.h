@@ -33,13 +33,50 @@ THE SOFTWARE.
     that left child of an internal node lies right next to it in memory. Each BVH node has a 
     skip link to the node traversed next. Intersector builds its own BVH for each scene object 
     and then top level BVH across all bottom level BVHs. Top level leafs keep object transforms and
-    might reference other leafs making instancing possible.
+    might reference other leafs making instancing possible. Shape data records are 128 bytes with
+    the 3x4 inverse transform, bottom level root and mask in the first 64, so a ray entering a shape
+    reads one cache line.
 
+    With "bvh.2level.tight_instance_bounds" top level and group leafs are bounded by the transformed
+    bounds of a few nodes cutting the shape BVH instead of its transformed root bounds, so rays
+    missing rotated thin shapes rarely enter them. The device top level build keeps root bounds.
+
+
+    If only shape states (transforms, ids, masks) change between commits, bottom level BVHs and
+    geometry buffers are reused: only top level BVH and shape data are rebuilt and uploaded.
+    Bottom level BVHs of meshes with updated vertices are refitted and uploaded in place. With
+    "bvh.2level.device_rebuild" they are rebuilt as LBVHs in place instead, all of them in one batched
+    device build. With "bvh.2level.device_top_level" the top level is rebuilt as an LBVH on the device
+    from shape bounds calculated by a kernel, shape data is then kept in the shape order.
+
+    Bottom level BVHs of meshes are cached along with the ranges they occupy in the node, face and
+    vertex buffers. Attaching or detaching shapes rebuilds the top level BVH and places meshes
+    without a cached BVH after the others, detached meshes stay cached until the buffers are full.
+
+    Groups get BVHs over their meshes and instances, which reference shape data placed after
+    the top level one. Instances of groups nest up to kMaxInstanceDepth shapes per ray path.
+
+    Coarser levels of detail of top level instances get shape data copies referencing their meshes
+    after the groups one. With kLodInstances a ray entering such an instance picks the copy by its
+    distance to the instance, jittered per ray within "bvh2l.lod.transition" around the thresholds,
+    and top level leafs are bounded by all the levels. Paging and device top level builds are off then.
+
+    With "bvh.2level.dedup" meshes with the same vertices and faces as an earlier one are found by
+    content hashes at full rebuilds and referenced like instances of it, so they share its BVH and ranges.
+
+    With kCompactFaces faces keep 16-bit mesh-local vertex indices in the mesh face order, vertex and face
+    ranges of the meshes are read from the shape data and primitive IDs follow from the face position.
+    With kQuantizedVertices positions are 16-bit unorm values within the vertex bounds of their mesh.
+
+    If meshes don't fit into "mem.budget" along with the top level, they are split into pages kept
+    on the host and a query streams the pages its rays reach into a single device window one after
+    another, shape data of each page masks the shapes of the other ones and hits are merged.
 
     Pros:
         -Simple and efficient kernel with low VGPR pressure.
         -Can traverse trees of arbitrary depth.
-        -Supports motion blur.
+        -Supports motion blur: with moving shapes nodes of the top level get a second bounding box
+         at ray time 1 and are interpolated by ray time, instance rays are offset by linear velocity.
         -Supports instancing.
         -Fast to refit.
     Cons:
@@ -52,6 +89,7 @@ THE SOFTWARE.
 #include "calc.h"
 #include "device.h"
 #include "intersector.h"
+#include "math/bbox.h"
 #include <memory>
 #include <vector>
 
@@ -59,6 +97,8 @@ THE SOFTWARE.
 namespace RadeonRays
 {
     class Bvh;
+    class Hlbvh;
+    class Shape;
 
     /** 
     \brief Intersector implementation using 2-level skip links BVH
@@ -66,10 +106,20 @@ namespace RadeonRays
     class IntersectorTwoLevel : public Intersector
     {
     public:
-        // Constructor
-        IntersectorTwoLevel(Calc::Device* device);
+        // Constructor, formats selects record layouts, see RecordFormat
+        IntersectorTwoLevel(Calc::Device* device, int formats = kFullRecords);
 
     private:
+        // Gpu data
+        struct GpuData;
+        struct CpuData;
+        struct ShapeData;
+        struct Face;
+        struct CompactFace;
+        struct Lod;
+        struct MeshEntry;
+        struct Page;
+
         // World processing implementation
         void Process(World const& world) override;
         // Intersection implementation
@@ -80,17 +130,103 @@ namespace RadeonRays
         void Occluded(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
             std::uint32_t max_rays, Calc::Buffer *hits, 
             Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Bit packed occlusion implementation
+        void OccludedCompact(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
+            std::uint32_t max_rays, Calc::Buffer *hits, 
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        bool SupportsCompactOcclusion() const override { return true; }
+        // Multi-hit intersection implementation
+        void IntersectMulti(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
+            std::uint32_t max_rays, int k, Calc::Buffer *hits, 
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Device memory of the acceleration structure
+        void GetMemoryStats(AccelStats& stats) const override;
 
     private:
-        // Gpu data
-        struct GpuData;
-        struct CpuData;
-        struct ShapeData;
-        struct Face;
+        // Build group BVHs across the bounds of their shapes in the space of the groups
+        void BuildGroups(float traversal_cost, int num_bins, bool use_sah);
+        // Calculate world space bounds of the shapes from their bottom level BVHs
+        void CalculateObjectBounds(std::vector<bbox>& object_bounds) const;
+        // Refit bottom level BVHs of the meshes with updated vertices and upload them, or rebuild them on the device.
+        // Refits degrading the SAH cost past "bvh.refit.max_degradation" are rebuilt on the host.
+        void RefitMeshes(World const& world, bool rebuild_on_device);
+        // Write faces of the mesh in the order of its BVH leafs
+        void FillMeshFaces(int meshidx, Face* faces) const;
+        // Write compact faces of the mesh in the mesh order, GetFaceShift gives records per face
+        void FillMeshCompactFaces(int meshidx, CompactFace* faces) const;
+        // Log2 of the number of face records per face of the mesh, meshes of compact faces
+        // with too many vertices for 16-bit indices keep 32-bit ones in two records
+        int GetFaceShift(int meshidx) const;
+        // Size of a record in the face buffer
+        std::size_t GetFaceRecordSize() const;
+        // Size of a vertex in the vertex buffer
+        std::size_t GetVertexRecordSize() const;
+        // With kQuantizedVertices, calculate the vertex bounds of the mesh and grow its face bounds
+        // by a quantization step, so its BVH contains the dequantized faces
+        void UpdateVertexBounds(int meshidx, bbox* face_bounds);
+        // Write 3 16-bit unorm values per vertex of the mesh relative to its vertex bounds
+        void QuantizeMeshVertices(int meshidx, std::uint16_t* vertices) const;
+        // Translate the mesh BVH at its root, leafs reference the face buffer, returns the number of nodes
+        int TranslateMesh(int meshidx);
+        // Replace bottom level BVHs of the meshes with LBVHs built on the device in a single batch,
+        // host BVHs are left stale
+        void RebuildMeshes(std::vector<int> const& changed);
+        // Object space bounds of a mesh or group BVH
+        bbox const& GetBvhBounds(int bvhidx) const;
+        // World space bounds of a shape referencing a mesh or group BVH with the transform m
+        bbox GetShapeBounds(int bvhidx, matrix const& m) const;
+        // Store the cut bounds of a mesh or group BVH used by GetShapeBounds, nullptr for stale BVHs
+        void UpdateCutBounds(int bvhidx, Bvh const* bvh);
+        // Fill shape data in the order of top level BVH leafs, topindices maps leafs to shapes
+        void UpdateShapeData(int const* topindices);
+        // Set the face and vertex ranges of the shape data referencing a mesh or group BVH
+        void SetMeshRanges(int bvhidx, ShapeData& data) const;
+        // Build the top level LBVH over shape bounds calculated from shape data on the device
+        void BuildTopLevelOnDevice();
+        // Get the device builder, it is created on first use
+        Hlbvh& GetBuilder();
+        // Upload top level node bounds at ray time 1 if motion blur is compiled in
+        void UpdateMotionNodes(std::vector<bbox> const& object_bounds);
+        // Upload the union of shape masks below each top level node if the kernels test ray masks,
+        // should be called after UpdateShapeData
+        void UpdateTopMasks();
+        // Upload the level of detail records filled by UpdateShapeData if the kernels select levels
+        void UpdateLods();
+        // Map each of the meshes to the first one with the same vertices and faces, or to itself if there is none
+        void FindDuplicateMeshes(std::vector<Shape const*> const& meshes, std::vector<int>& canonical);
+        // Assign buffer ranges to the meshes which don't have one and reserve numtopnodes nodes
+        // for group and top level BVHs after them. If they don't fit, detached meshes are dropped
+        // and the buffers reallocated for all the meshes. Fills the indices of the placed meshes.
+        void LayoutMeshes(int numtopnodes, std::vector<int>& placed);
+        // Device memory of the BVH, faces and vertices of a mesh
+        std::size_t GetMeshMemory(int meshidx) const;
+        // Split the meshes into pages translated to the offsets of a device window of at most page_bytes,
+        // which is allocated along with numtopnodes nodes for group and top level BVHs after it
+        void BuildPages(std::size_t page_bytes, int numtopnodes);
+        // Upload page bounds and fill the shape data of the pages, should be called after UpdateShapeData
+        void UpdatePages(std::vector<bbox> const& object_bounds);
+        // Write the page into the device window on the queue unless it is there already
+        void LoadPage(std::uint32_t queue_idx, int page_idx) const;
+        // Drop mesh, group and top level BVHs and translated nodes after a full rebuild, pages are kept
+        void ReleaseHostCopies();
+        // Combine statistics of the top level BVH and the bottom level ones,
+        // build time includes the bottom level BVHs listed in built only
+        void UpdateStats(std::vector<int> const& built);
+        // Whether to launch persistent kernels, forced by "acc.persistent" or picked for device ray counts
+        bool UsePersistent(std::uint32_t queue_idx, Calc::Buffer const* num_rays) const;
+        // Set arguments and launch the kernel, persistent kernels also get the ray counter of the queue.
+        // Non-zero k launches a multi-hit kernel, which is never persistent, and is passed after the hits.
+        void Dispatch(Calc::Function* func, std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event **event, int k = 0) const;
+        // Dispatch for each of the pages the rays reach, hits of the pages after the first one are merged into
+        // hits by merge_func, hits_size is the size of the hits of a query. Blocks until the pages are known.
+        void DispatchPaged(Calc::Function* func, Calc::Function* merge_func, std::uint32_t queue_idx, Calc::Buffer const* rays,
+            Calc::Buffer const* num_rays, std::uint32_t max_rays, Calc::Buffer* hits, std::size_t hits_size, Calc::Event** event) const;
 
         std::unique_ptr<GpuData> m_gpudata;
         std::unique_ptr<CpuData> m_cpudata;
-        std::vector<std::unique_ptr<Bvh> > m_bvhs;
+        // Mesh BVHs are shared with the cache
+        std::vector<std::shared_ptr<Bvh> > m_bvhs;
     };
 }
 
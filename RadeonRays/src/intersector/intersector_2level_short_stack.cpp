@@ -0,0 +1,594 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "intersector_2level_short_stack.h"
+
+#include "calc.h"
+#include "executable.h"
+#include "../accelerator/bvh.h"
+#include "../accelerator/linear_bvh.h"
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
+#include "../world/world.h"
+
+#include "../translator/fatnode_bvh_translator.h"
+#include "../except/except.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <unordered_map>
+
+// Preferred work group size for Radeon devices
+static int const kWorkGroupSize = 64;
+// Both levels and the transition entry between them share the stack
+static int const kMaxStackSize = 48;
+static int const kMaxBatchSize = 1024 * 1024;
+// Number of work groups per compute unit the LDS stack should leave room for
+static int const kTargetGroupsPerComputeUnit = 16;
+
+namespace RadeonRays
+{
+    namespace
+    {
+        // Mesh geometry of a shape, instances use the base shape
+        Mesh const* GetShapeMesh(Shape const* shape)
+        {
+            if (static_cast<ShapeImpl const*>(shape)->is_instance())
+            {
+                return static_cast<Mesh const*>(static_cast<Instance const*>(shape)->GetBaseShape());
+            }
+
+            return static_cast<Mesh const*>(shape);
+        }
+    }
+
+    struct IntersectorTwoLevelShortStack::ShapeData
+    {
+        // World to object transform
+        matrix minv;
+        // Address of the bottom level root
+        int bvhidx;
+        int padding[3];
+    };
+
+    struct IntersectorTwoLevelShortStack::GpuData
+    {
+        // Device
+        Calc::Device* device;
+        // Top level BVH nodes
+        Calc::Buffer* top;
+        // Bottom level BVH nodes of all the meshes
+        Calc::Buffer* bottom;
+        // Shape data referenced by top level leafs
+        Calc::Buffer* shapes;
+        // Object space vertex positions
+        Calc::Buffer* vertices;
+        // Traversal stacks, one per queue
+        std::vector<Calc::Buffer*> stacks;
+
+        Calc::Executable* executable;
+        Calc::Function* isect_func;
+        Calc::Function* occlude_func;
+        Calc::Function* occlude_compact_func;
+
+        // Work group size, LDS stack is interleaved across the group
+        int group_size;
+        // Number of LDS and global memory stack entries per work item
+        int short_stack_size;
+        int global_stack_size;
+
+        GpuData(Calc::Device* d)
+            : device(d)
+            , top(nullptr)
+            , bottom(nullptr)
+            , shapes(nullptr)
+            , vertices(nullptr)
+            , executable(nullptr)
+            , isect_func(nullptr)
+            , occlude_func(nullptr)
+            , occlude_compact_func(nullptr)
+            , group_size(kWorkGroupSize)
+            , short_stack_size(16)
+            , global_stack_size(0)
+        {
+        }
+
+        // Get traversal stack of the queue, reallocate if it is too small
+        Calc::Buffer* GetStack(std::uint32_t queueidx, std::size_t size)
+        {
+            if (stacks.size() <= queueidx)
+            {
+                stacks.resize(queueidx + 1, nullptr);
+            }
+
+            auto& stack = stacks[queueidx];
+
+            if (!stack || stack->GetSize() < size)
+            {
+                if (stack)
+                {
+                    device->DeleteBuffer(stack);
+                }
+
+                stack = device->CreateBuffer(size, Calc::BufferType::kWrite);
+            }
+
+            return stack;
+        }
+
+        ~GpuData()
+        {
+            device->DeleteBuffer(top);
+            device->DeleteBuffer(bottom);
+            device->DeleteBuffer(shapes);
+            device->DeleteBuffer(vertices);
+            for (auto stack : stacks)
+            {
+                device->DeleteBuffer(stack);
+            }
+
+            if (executable)
+            {
+                executable->DeleteFunction(isect_func);
+                executable->DeleteFunction(occlude_func);
+                executable->DeleteFunction(occlude_compact_func);
+                device->DeleteExecutable(executable);
+            }
+        }
+    };
+
+    struct IntersectorTwoLevelShortStack::CpuData
+    {
+        // Unique meshes of the scene, including base shapes which are not attached
+        std::vector<Mesh const*> meshes;
+        std::unordered_map<Mesh const*, int> mesh_index;
+        // Bottom level root address and object space bounds of each mesh,
+        // meshes without faces have INVALID_IDX root and are left out of the top level
+        std::vector<int> mesh_roots;
+        std::vector<bbox> mesh_bounds;
+        // Largest bottom level tree height
+        int bottom_height;
+        // Tree statistics summed up over the bottom level
+        AccelStats bottom_stats;
+
+        CpuData()
+            : bottom_height(0)
+            , bottom_stats()
+        {
+        }
+    };
+
+    IntersectorTwoLevelShortStack::IntersectorTwoLevelShortStack(Calc::Device* device, int formats)
+        : Intersector(device, formats)
+        , m_gpudata(new GpuData(device))
+        , m_cpudata(new CpuData())
+    {
+        assert(device->GetPlatform() == Calc::Platform::kOpenCL);
+
+        // Concurrent queries on other queues never resize the vector
+        m_gpudata->stacks.resize(m_num_queues, nullptr);
+
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+
+        // Same stack configuration as the flat short stack intersector picks by default:
+        // NVIDIA schedules 32-wide warps and the largest power of two short stack
+        // leaving room for enough resident groups
+        auto& gpudata = *m_gpudata;
+        gpudata.group_size = (spec.vendor && std::strstr(spec.vendor, "NVIDIA")) ? 32 : kWorkGroupSize;
+
+        std::size_t budget = spec.local_mem_size / (kTargetGroupsPerComputeUnit * gpudata.group_size * sizeof(int));
+        gpudata.short_stack_size = 8;
+        while (gpudata.short_stack_size * 2 <= 32 && static_cast<std::size_t>(gpudata.short_stack_size * 2) <= budget)
+        {
+            gpudata.short_stack_size *= 2;
+        }
+
+        // Each LDS overflow moves short_stack_size - 1 entries into a short_stack_size chunk of global memory
+        gpudata.global_stack_size = gpudata.short_stack_size * std::max((kMaxStackSize - 1) / (gpudata.short_stack_size - 1), 1);
+
+        std::string buildopts;
+
+#ifdef USE_SAFE_MATH
+        buildopts.append("-D USE_SAFE_MATH ");
+#endif
+
+        buildopts.append(GetRecordFormatOptions(m_formats));
+        buildopts.append(
+            " -D WAVEFRONT_SIZE=" + std::to_string(gpudata.group_size) +
+            " -D SHORT_STACK_SIZE=" + std::to_string(gpudata.short_stack_size) +
+            " -D GLOBAL_STACK_SIZE=" + std::to_string(gpudata.global_stack_size));
+
+#ifndef RR_EMBED_KERNELS
+        char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+        int numheaders = sizeof(headers) / sizeof(char const*);
+
+        gpudata.executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/intersect_bvh2level_short_stack.cl", headers, numheaders, buildopts.c_str());
+#else
+#if USE_OPENCL
+        gpudata.executable = m_device->CompileExecutable(g_intersect_bvh2level_short_stack_opencl, std::strlen(g_intersect_bvh2level_short_stack_opencl), buildopts.c_str());
+#endif
+#endif
+
+        gpudata.isect_func = gpudata.executable->CreateFunction("intersect_main");
+        gpudata.occlude_func = gpudata.executable->CreateFunction("occluded_main");
+        gpudata.occlude_compact_func = gpudata.executable->CreateFunction("occluded_compact_main");
+    }
+
+    void IntersectorTwoLevelShortStack::Process(World const& world)
+    {
+        int statechange = world.GetStateChange();
+
+        // Transforms, IDs and masks only live in the top level, so bottom level BVHs are kept
+        bool const rebuild_bottom = !m_gpudata->bottom || world.has_changed() || BvhSettingsChanged(world) ||
+            (statechange & ShapeImpl::kStateChangeGeometry) != 0;
+
+        if (!rebuild_bottom && statechange == ShapeImpl::kStateChangeNone)
+        {
+            return;
+        }
+
+        if (rebuild_bottom)
+        {
+            // Check if we can allocate enough stack memory
+            Calc::DeviceSpec spec;
+            m_device->GetSpec(spec);
+            if (spec.max_alloc_size <= kMaxBatchSize * kMaxStackSize * sizeof(int))
+            {
+                throw ExceptionImpl("fatbvh2l accelerator can't allocate enough stack memory, try using bvh instead");
+            }
+
+            BuildBottomLevel(world);
+        }
+
+        BuildTopLevel(world);
+
+        // Stack
+        m_gpudata->GetStack(0, kMaxBatchSize * kMaxStackSize);
+    }
+
+    void IntersectorTwoLevelShortStack::BuildBottomLevel(World const& world)
+    {
+        auto& cpudata = *m_cpudata;
+
+        // Collect unique meshes, instances share the BVH of their base shape
+        cpudata.meshes.clear();
+        cpudata.mesh_index.clear();
+        for (auto shape : world.shapes_)
+        {
+            Mesh const* mesh = GetShapeMesh(shape);
+            if (cpudata.mesh_index.emplace(mesh, static_cast<int>(cpudata.meshes.size())).second)
+            {
+                cpudata.meshes.push_back(mesh);
+            }
+        }
+
+        int nummeshes = static_cast<int>(cpudata.meshes.size());
+        int numvertices = 0;
+        int numfaces = 0;
+
+        std::vector<int> mesh_vertices_start_idx(nummeshes);
+        std::vector<int> mesh_faces_start_idx(nummeshes);
+        std::vector<int> mesh_numfaces(nummeshes);
+
+        for (int i = 0; i < nummeshes; ++i)
+        {
+            mesh_vertices_start_idx[i] = numvertices;
+            mesh_faces_start_idx[i] = numfaces;
+            mesh_numfaces[i] = cpudata.meshes[i]->num_faces();
+
+            numvertices += cpudata.meshes[i]->num_vertices();
+            numfaces += mesh_numfaces[i];
+        }
+
+        auto const& settings = world.options_.GetBvhSettings().bottom;
+
+        // Static meshes always get SAH trees and deforming ones LBVHs
+        std::vector<std::unique_ptr<Bvh>> bvhs(nummeshes);
+        for (int i = 0; i < nummeshes; ++i)
+        {
+            BuildHint hint = cpudata.meshes[i]->GetBuildHint();
+            bool use_lbvh = hint == kBuildDeforming || (settings.use_lbvh && hint != kBuildStatic);
+
+            bvhs[i].reset(use_lbvh ? new LinearBvh(settings.traversal_cost, settings.num_bins) :
+                new Bvh(settings.traversal_cost, settings.num_bins, settings.use_sah || hint == kBuildStatic));
+        }
+
+        // Large meshes are built by several threads each, small ones are packed into tasks
+        std::vector<bbox> bounds(numfaces);
+        Bvh::ScheduleBuilds(mesh_numfaces.data(), nummeshes, [&](int i)
+        {
+            if (mesh_numfaces[i] == 0)
+            {
+                return;
+            }
+
+            // Request bounds in object space since we build BVHs for objects locally
+            bbox* meshbounds = &bounds[mesh_faces_start_idx[i]];
+            cpudata.meshes[i]->ComputeAllFaceBounds(matrix(), meshbounds);
+            bvhs[i]->SetMonitor(world.monitor_.get());
+            bvhs[i]->Build(meshbounds, mesh_numfaces[i]);
+            bvhs[i]->SetMonitor(nullptr);
+        });
+
+        // Internal nodes carry subtree masks, bottom level leafs pass any ray
+        bool const node_masks = (m_formats & kRayMask) != 0;
+
+        // Translate mesh BVHs one after another into a single node array, child addresses are made absolute
+        std::vector<FatNodeBvhTranslator::Node> nodes;
+        cpudata.mesh_roots.assign(nummeshes, -1);
+        cpudata.mesh_bounds.assign(nummeshes, bbox());
+        cpudata.bottom_height = 0;
+        cpudata.bottom_stats = AccelStats();
+
+        for (int i = 0; i < nummeshes; ++i)
+        {
+            if (mesh_numfaces[i] == 0)
+            {
+                continue;
+            }
+
+            Mesh const* mesh = cpudata.meshes[i];
+            Bvh const& bvh = *bvhs[i];
+
+            std::vector<FatNodeBvhTranslator::Face> facedata(bvh.GetNumIndices());
+            int const* reordering = bvh.GetIndices();
+            for (std::size_t j = 0; j < facedata.size(); ++j)
+            {
+                Mesh::Face const face = mesh->GetFace(reordering[j]);
+
+                facedata[j].idx[0] = face.idx[0] + mesh_vertices_start_idx[i];
+                facedata[j].idx[1] = face.idx[1] + mesh_vertices_start_idx[i];
+                facedata[j].idx[2] = face.idx[2] + mesh_vertices_start_idx[i];
+                // Shape ID and mask are taken from the top level leaf
+                facedata[j].shapeidx = 0;
+                facedata[j].shape_mask = -1;
+                facedata[j].id = reordering[j];
+            }
+
+            FatNodeBvhTranslator translator;
+            translator.Process(*bvhs[i], &facedata[0]);
+
+            if (node_masks)
+            {
+                translator.PropagateMasks();
+            }
+
+            int root = static_cast<int>(nodes.size());
+            for (auto node : translator.nodes_)
+            {
+                if (node.s1.child0 != -1)
+                {
+                    node.s1.child0 += root;
+                    node.s1.child1 += root;
+                }
+
+                nodes.push_back(node);
+            }
+
+            cpudata.mesh_roots[i] = root;
+            cpudata.mesh_bounds[i] = bvh.Bounds();
+            cpudata.bottom_height = std::max(cpudata.bottom_height, bvh.GetHeight());
+
+            AccelStats stats;
+            bvh.GetStats(stats);
+            cpudata.bottom_stats.num_nodes += stats.num_nodes;
+            cpudata.bottom_stats.num_leaves += stats.num_leaves;
+            cpudata.bottom_stats.num_primitives += stats.num_primitives;
+            cpudata.bottom_stats.num_refs += stats.num_refs;
+            cpudata.bottom_stats.max_depth = std::max(cpudata.bottom_stats.max_depth, stats.max_depth);
+            // Sum of CPU times, meshes are built concurrently
+            cpudata.bottom_stats.build_time += stats.build_time;
+        }
+
+        // Vertices stay in object space, rays are transformed instead
+        std::vector<float3> vertices(numvertices);
+        for (int i = 0; i < nummeshes; ++i)
+        {
+            Mesh const* mesh = cpudata.meshes[i];
+            for (int j = 0; j < mesh->num_vertices(); ++j)
+            {
+                vertices[mesh_vertices_start_idx[i] + j] = mesh->GetVertex(j);
+            }
+        }
+
+        // A cancelled commit stops before touching the device
+        CheckCancelled(world);
+
+        if (m_gpudata->bottom)
+        {
+            m_device->DeleteBuffer(m_gpudata->bottom);
+            m_device->DeleteBuffer(m_gpudata->vertices);
+            m_gpudata->bottom = m_gpudata->vertices = nullptr;
+        }
+
+        m_gpudata->bottom = CreateSceneBuffer(nodes.size() * sizeof(FatNodeBvhTranslator::Node));
+        Upload(m_gpudata->bottom, std::move(nodes));
+
+        m_gpudata->vertices = CreateSceneBuffer(numvertices * sizeof(float3));
+        Upload(m_gpudata->vertices, std::move(vertices));
+    }
+
+    void IntersectorTwoLevelShortStack::BuildTopLevel(World const& world)
+    {
+        auto const& cpudata = *m_cpudata;
+
+        // Shapes with geometry along with their world space bounds
+        std::vector<Shape const*> shapes;
+        std::vector<bbox> bounds;
+        std::vector<ShapeData> shapedata;
+
+        for (auto shape : world.shapes_)
+        {
+            int meshidx = cpudata.mesh_index.at(GetShapeMesh(shape));
+            if (cpudata.mesh_roots[meshidx] == -1)
+            {
+                continue;
+            }
+
+            // Instance is using its own transform for base shape geometry
+            matrix m, minv;
+            shape->GetTransform(m, minv);
+
+            ShapeData data;
+            data.minv = minv;
+            data.bvhidx = cpudata.mesh_roots[meshidx];
+            data.padding[0] = data.padding[1] = data.padding[2] = 0;
+
+            shapes.push_back(shape);
+            bounds.push_back(transform_bbox(cpudata.mesh_bounds[meshidx], m));
+            shapedata.push_back(data);
+        }
+
+        ThrowIf(shapes.empty(), "fatbvh2l accelerator needs at least one shape with faces.");
+
+        auto const& settings = world.options_.GetBvhSettings().top;
+        std::unique_ptr<Bvh> top(settings.use_lbvh ? new LinearBvh(settings.traversal_cost, settings.num_bins) :
+            new Bvh(settings.traversal_cost, settings.num_bins, settings.use_sah));
+        Bvh& bvh = *top;
+        bvh.Build(&bounds[0], static_cast<int>(bounds.size()));
+
+        // Check if the tree height is reasonable, both levels and the transition entry share the stack
+        if (bvh.GetHeight() + cpudata.bottom_height + 1 >= kMaxStackSize)
+        {
+            throw ExceptionImpl("fatbvh2l accelerator can cause stack overflow for this scene, try using bvh instead");
+        }
+
+        // Top level leafs keep the shape data index in place of the first vertex index
+        std::vector<FatNodeBvhTranslator::Face> facedata(bvh.GetNumIndices());
+        int const* reordering = bvh.GetIndices();
+        for (std::size_t i = 0; i < facedata.size(); ++i)
+        {
+            Shape const* shape = shapes[reordering[i]];
+
+            facedata[i].idx[0] = reordering[i];
+            facedata[i].idx[1] = facedata[i].idx[2] = 0;
+            facedata[i].shapeidx = shape->GetId();
+            facedata[i].shape_mask = shape->GetMask();
+            facedata[i].id = 0;
+        }
+
+        FatNodeBvhTranslator translator;
+        translator.Process(bvh, &facedata[0]);
+
+        if (m_formats & kRayMask)
+        {
+            translator.PropagateMasks();
+        }
+
+        // Top level leafs point to shapes, mesh leafs to faces
+        bvh.GetStats(m_stats);
+        m_stats.num_nodes += cpudata.bottom_stats.num_nodes;
+        m_stats.num_leaves += cpudata.bottom_stats.num_leaves;
+        m_stats.num_primitives += cpudata.bottom_stats.num_primitives;
+        m_stats.num_refs += cpudata.bottom_stats.num_refs;
+        m_stats.max_depth += cpudata.bottom_stats.max_depth;
+        m_stats.build_time += cpudata.bottom_stats.build_time;
+        m_stats.avg_leaf_prims = m_stats.num_leaves > 0 ? (float)m_stats.num_refs / m_stats.num_leaves : 0.f;
+
+        // A cancelled commit stops before touching the device
+        CheckCancelled(world);
+
+        if (m_gpudata->top)
+        {
+            m_device->DeleteBuffer(m_gpudata->top);
+            m_device->DeleteBuffer(m_gpudata->shapes);
+            m_gpudata->top = m_gpudata->shapes = nullptr;
+        }
+
+        m_gpudata->top = CreateSceneBuffer(translator.nodes_.size() * sizeof(FatNodeBvhTranslator::Node));
+        Upload(m_gpudata->top, std::move(translator.nodes_));
+
+        m_gpudata->shapes = CreateSceneBuffer(shapedata.size() * sizeof(ShapeData));
+        Upload(m_gpudata->shapes, std::move(shapedata));
+    }
+
+    void IntersectorTwoLevelShortStack::GetMemoryStats(AccelStats& stats) const
+    {
+        stats.node_memory = GetBufferSize(m_gpudata->top) + GetBufferSize(m_gpudata->bottom);
+        stats.vertex_memory = GetBufferSize(m_gpudata->vertices);
+        stats.face_memory = 0;
+        stats.other_memory = GetBufferSize(m_gpudata->shapes);
+        for (auto stack : m_gpudata->stacks)
+        {
+            stats.other_memory += GetBufferSize(stack);
+        }
+    }
+
+    void IntersectorTwoLevelShortStack::Intersect(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        Dispatch(m_gpudata->isect_func, queueidx, rays, numrays, maxrays, hits, event);
+    }
+
+    void IntersectorTwoLevelShortStack::Occluded(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        Dispatch(m_gpudata->occlude_func, queueidx, rays, numrays, maxrays, hits, event);
+    }
+
+    void IntersectorTwoLevelShortStack::OccludedCompact(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        Dispatch(m_gpudata->occlude_compact_func, queueidx, rays, numrays, maxrays, hits, event);
+    }
+
+    void IntersectorTwoLevelShortStack::Dispatch(Calc::Function* func, std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event** event) const
+    {
+        auto const& gpudata = *m_gpudata;
+        std::uint32_t group_size = static_cast<std::uint32_t>(gpudata.group_size);
+        std::uint32_t slice_size = std::min<std::uint32_t>(maxrays, kMaxBatchSize);
+        // Work groups are rounded up, so the stack covers whole groups
+        std::uint32_t stack_rays = ((slice_size + group_size - 1) / group_size) * group_size;
+        size_t stack_size = stack_rays * gpudata.global_stack_size * sizeof(int);
+        // Queries on different queues may run concurrently, so each queue has its own stack
+        auto stack = m_gpudata->GetStack(queueidx, stack_size);
+
+        // Slices run in order on the queue, so they can share the stack
+        for (std::uint32_t offset = 0; offset < maxrays; offset += slice_size)
+        {
+            std::uint32_t count = std::min(slice_size, maxrays - offset);
+            int slice_offset = static_cast<int>(offset);
+
+            // Set args
+            int arg = 0;
+
+            func->SetArg(arg++, gpudata.top);
+            func->SetArg(arg++, gpudata.bottom);
+            func->SetArg(arg++, gpudata.shapes);
+            func->SetArg(arg++, gpudata.vertices);
+            func->SetArg(arg++, rays);
+            func->SetArg(arg++, numrays);
+            func->SetArg(arg++, sizeof(int), &slice_offset);
+            func->SetArg(arg++, stack);
+            func->SetArg(arg++, hits);
+
+            if (func == gpudata.isect_func)
+            {
+                SetTraversalStatsArg(func, arg, queueidx, maxrays);
+            }
+
+            size_t localsize = group_size;
+            size_t globalsize = ((count + group_size - 1) / group_size) * group_size;
+
+            Execute(func, queueidx, globalsize, localsize, offset + count >= maxrays ? event : nullptr, "fatbvh2l.traversal");
+        }
+    }
+}
@@ -0,0 +1,105 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file intersector_2level_short_stack.h
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Intersector implementation based on 2-level BVH with short stack traversal.
+
+    Intersector is using the fat node layout of IntersectorShortStack for both levels: each
+    unique mesh gets its own object space BVH and the top level BVH is built across world
+    space bounds of meshes and instances. Top level leafs reference shape data holding the
+    world to object transform and the root of the bottom level BVH.
+
+    Traversal uses the same LDS and global memory stack as IntersectorShortStack. When a
+    top level leaf is hit the ray is transformed into object space, a transition entry is
+    pushed and traversal continues at the bottom level root. Popping the transition entry
+    restores the world space ray, so the rest of the stack holds top level nodes again:
+
+        addr <- pop from stack
+        if (addr is transition)
+        {
+            ray <- world space ray
+            addr <- pop from stack
+        }
+
+    Groups and moving shapes are not supported, those scenes use IntersectorTwoLevel.
+    If only shape transforms, IDs or masks have changed, bottom level BVHs are reused and
+    only the top level BVH and shape data are rebuilt. OpenCL only.
+ */
+#pragma once
+
+#include "calc.h"
+#include "device.h"
+#include "intersector.h"
+#include <memory>
+
+
+namespace RadeonRays
+{
+    /**
+    \brief Intersector implementation using 2-level short stack BVH traversal
+    */
+    class IntersectorTwoLevelShortStack : public Intersector
+    {
+    public:
+        // Constructor, formats selects record layouts, see RecordFormat
+        IntersectorTwoLevelShortStack(Calc::Device* device, int formats = kFullRecords);
+
+    private:
+        // World preprocessing implementation
+        void Process(World const& world) override;
+        // Intersection implementation
+        void Intersect(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits,
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Occlusion implementation
+        void Occluded(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits,
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Bit packed occlusion implementation
+        void OccludedCompact(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits,
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        bool SupportsCompactOcclusion() const override { return true; }
+        // Device memory of the acceleration structure
+        void GetMemoryStats(AccelStats& stats) const override;
+
+    private:
+        // Build object space BVHs of the unique meshes and upload them along with the vertices
+        void BuildBottomLevel(World const& world);
+        // Build the top level BVH across the shapes and upload it along with the shape data
+        void BuildTopLevel(World const& world);
+        // Launch the kernel in slices of at most kMaxBatchSize rays back to back on the queue,
+        // so stack memory is bounded for any batch size. The event signals the last slice.
+        void Dispatch(Calc::Function* func, std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event **event) const;
+
+        struct ShapeData;
+        struct GpuData;
+        struct CpuData;
+
+        // Implementation data
+        std::unique_ptr<GpuData> m_gpudata;
+        std::unique_ptr<CpuData> m_cpudata;
+    };
+}
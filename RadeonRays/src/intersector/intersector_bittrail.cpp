@@ -25,6 +25,8 @@
 #include "executable.h"
 #include "../accelerator/bvh.h"
 #include "../accelerator/split_bvh.h"
+#include "../accelerator/linear_bvh.h"
+#include "../accelerator/presplit.h"
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
 #include "../world/world.h"
@@ -36,6 +38,8 @@
 
  // Preferred work group size for Radeon devices
 static int const kWorkGroupSize = 64;
+// Bit trail and node index are 32-bit integers
+static int const kMaxTrailLength = 31;
 
 namespace RadeonRays
 {
@@ -51,12 +55,13 @@ namespace RadeonRays
         Calc::Buffer* displacement;
         // Hash table
         Calc::Buffer* hashmap;
-        // Displacement table size
-        int displacement_size;
+        // Hash table row size
+        int hash_row_size;
 
         Calc::Executable* executable;
         Calc::Function* isect_func;
         Calc::Function* occlude_func;
+        Calc::Function* occlude_compact_func;
 
         GpuData(Calc::Device* d)
         : device(d)
@@ -65,85 +70,74 @@ namespace RadeonRays
                           , executable(nullptr)
                           , isect_func(nullptr)
                           , occlude_func(nullptr)
-                          , displacement_size(0)
+                          , occlude_compact_func(nullptr)
+                          , hash_row_size(0)
                           , displacement(nullptr)
                           , hashmap(nullptr)
         {
         }
 
         ~GpuData()
+        {
+            ReleaseBuffers();
+            executable->DeleteFunction(isect_func);
+            executable->DeleteFunction(occlude_func);
+            executable->DeleteFunction(occlude_compact_func);
+            device->DeleteExecutable(executable);
+        }
+
+        void ReleaseBuffers()
         {
             device->DeleteBuffer(bvh);
             device->DeleteBuffer(vertices);
             device->DeleteBuffer(displacement);
             device->DeleteBuffer(hashmap);
-            executable->DeleteFunction(isect_func);
-            executable->DeleteFunction(occlude_func);
-            device->DeleteExecutable(executable);
+            bvh = vertices = displacement = hashmap = nullptr;
         }
     };
 
-    IntersectorBitTrail::IntersectorBitTrail(Calc::Device* device)
-        : Intersector(device)
+    IntersectorBitTrail::IntersectorBitTrail(Calc::Device* device, int formats)
+        : Intersector(device, formats)
         , m_gpudata(new GpuData(device))
         , m_bvh(nullptr)
     {
-        std::string buildopts =
-#ifdef RR_RAY_MASK
-            "-D RR_RAY_MASK ";
-#else
-            "";
-#endif
+        std::string buildopts;
         
 #ifdef USE_SAFE_MATH
         buildopts.append("-D USE_SAFE_MATH ");
 #endif
 
-#ifndef RR_EMBED_KERNELS
-        if (device->GetPlatform() == Calc::Platform::kOpenCL)
-        {
-            char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+        buildopts.append(GetRecordFormatOptions(m_formats));
 
-            int numheaders = sizeof(headers) / sizeof(char const*);
-            m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/intersect_bvh2_bittrail.cl", headers, numheaders, buildopts.c_str());
-        }
-        else
+        // There is no GLSL version of the kernels
+        if (device->GetPlatform() != Calc::Platform::kOpenCL)
         {
-            assert(device->GetPlatform() == Calc::Platform::kVulkan);
-            m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/GLSL/hash_bvh.comp", nullptr, 0, buildopts.c_str());
+            throw ExceptionImpl("hashbvh accelerator is supported on OpenCL devices only");
         }
+
+#ifndef RR_EMBED_KERNELS
+        char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+        int numheaders = sizeof(headers) / sizeof(char const*);
+        m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/intersect_bvh2_bittrail.cl", headers, numheaders, buildopts.c_str());
 #else
 #if USE_OPENCL
-        if (device->GetPlatform() == Calc::Platform::kOpenCL)
-        {
-            m_gpudata->executable = m_device->CompileExecutable(g_intersect_bvh2_bittrail_opencl, std::strlen(g_intersect_bvh2_bittrail_opencl), buildopts.c_str());
-        }
+        m_gpudata->executable = m_device->CompileExecutable(g_intersect_bvh2_bittrail_opencl, std::strlen(g_intersect_bvh2_bittrail_opencl), buildopts.c_str());
 #endif
-
-#if USE_VULKAN
-        if (m_gpudata->executable == nullptr && device->GetPlatform() == Calc::Platform::kVulkan)
-        {
-            m_gpudata->executable = m_device->CompileExecutable(g_hash_bvh_vulkan, std::strlen(g_hash_bvh_vulkan), buildopts.c_str());
-        }
-#endif
-
 #endif
 
         m_gpudata->isect_func = m_gpudata->executable->CreateFunction("intersect_main");
         m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("occluded_main");
+        m_gpudata->occlude_compact_func = m_gpudata->executable->CreateFunction("occluded_compact_main");
     }
 
     void IntersectorBitTrail::Process(World const& world)
     {
 
         // If something has been changed we need to rebuild BVH
-        if (!m_bvh || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
+        if (!m_gpudata->bvh || world.has_changed() || BvhSettingsChanged(world) || world.GetStateChange() != ShapeImpl::kStateChangeNone)
         {
-            if (m_bvh)
-            {
-                m_device->DeleteBuffer(m_gpudata->bvh);
-                m_device->DeleteBuffer(m_gpudata->vertices);
-            }
+            m_gpudata->ReleaseBuffers();
 
             int numshapes = (int)world.shapes_.size();
             int numvertices = 0;
@@ -153,38 +147,19 @@ namespace RadeonRays
             std::vector<int> mesh_vertices_start_idx(numshapes);
             std::vector<int> mesh_faces_start_idx(numshapes);
 
-            auto builder = world.options_.GetOption("bvh.builder");
-            auto splits = world.options_.GetOption("bvh.sah.use_splits");
-            auto maxdepth = world.options_.GetOption("bvh.sah.max_split_depth");
-            auto overlap = world.options_.GetOption("bvh.sah.min_overlap");
-            auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
-            auto node_budget = world.options_.GetOption("bvh.sah.extra_node_budget");
-            auto nbins = world.options_.GetOption("bvh.sah.num_bins");
-
-
-            bool use_sah = false;
-            bool use_splits = false;
-            int max_split_depth = maxdepth ? (int)maxdepth->AsFloat() : 10;
-            int num_bins = nbins ? (int)nbins->AsFloat() : 64;
-            float min_overlap = overlap ? overlap->AsFloat() : 0.05f;
-            float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
-            float extra_node_budget = node_budget ? node_budget->AsFloat() : 0.5f;
-
-            if (builder && builder->AsString() == "sah")
-            {
-                use_sah = true;
-            }
-
-            if (splits && splits->AsFloat() > 0.f)
-            {
-                use_splits = true;
-            }
+            // Build settings are resolved when the options are set
+            auto const& settings = world.options_.GetBvhSettings();
 
-            m_bvh.reset(use_splits ?
-                new SplitBvh(traversal_cost, num_bins, max_split_depth, min_overlap, extra_node_budget) :
-                new Bvh(traversal_cost, num_bins, use_sah)
+            m_bvh.reset(settings.use_splits ?
+                new SplitBvh(settings.traversal_cost, settings.num_bins, settings.max_split_depth, settings.min_overlap, settings.extra_node_budget) :
+                settings.use_lbvh ? new LinearBvh(settings.traversal_cost, settings.num_bins) :
+                new Bvh(settings.traversal_cost, settings.num_bins, settings.use_sah)
             );
 
+            // Centroids and indices are reused across commits, the monitor of the commit can cancel the build
+            m_bvh->SetScratch(&m_scratch);
+            m_bvh->SetMonitor(world.monitor_.get());
+
             // Partition the array into meshes and instances
             std::vector<Shape const*> shapes(world.shapes_);
 
@@ -223,61 +198,70 @@ namespace RadeonRays
             }
 
 
-            // We can't avoild allocating it here, since bounds aren't stored anywhere
-            std::vector<bbox> bounds(numfaces);
+            // Face bounds are kept across commits, so they are allocated only when the scene grows
+            host_vector<bbox>& bounds = m_scratch.bounds;
+            bounds.resize(numfaces);
 
             // We handle meshes first collecting their world space bounds 
-#pragma omp parallel for 
-            for (int i = 0; i < nummeshes; ++i) 
-            { 
-                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]); 
- 
-                for (int j = 0; j < mesh->num_faces(); ++j) 
-                { 
-                    // Here we directly get world space bounds 
-                    mesh->GetFaceBounds(j, false, bounds[mesh_faces_start_idx[i] + j]); 
-                } 
-            } 
+            for (int i = 0; i < nummeshes; ++i)
+            {
+                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+
+                // Here we directly get world space bounds, faces are processed in parallel
+                matrix m, minv;
+                mesh->GetTransform(m, minv);
+                mesh->ComputeAllFaceBounds(m, &bounds[mesh_faces_start_idx[i]]);
+            }
  
             // Then we handle instances. Need to flatten them into actual geometry. 
-#pragma omp parallel for 
-            for (int i = nummeshes; i < nummeshes + numinstances; ++i) 
-            { 
-                Instance const* instance = static_cast<Instance const*>(shapes[i]); 
-                Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape()); 
- 
-                // Instance is using its own transform for base shape geometry 
-                // so we need to get object space bounds and transform them manually 
-                matrix m, minv; 
-                instance->GetTransform(m, minv); 
- 
-                for (int j = 0; j < mesh->num_faces(); ++j) 
-                { 
-                    bbox tmp; 
-                    mesh->GetFaceBounds(j, true, tmp); 
-                    
-                    bounds[mesh_faces_start_idx[i] + j] = transform_bbox(tmp, m); 
-                } 
-            } 
+            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+            {
+                Instance const* instance = static_cast<Instance const*>(shapes[i]);
+                Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
+
+                // Instance is using its own transform for base shape geometry
+                // so base mesh vertices are transformed by it directly
+                matrix m, minv;
+                instance->GetTransform(m, minv);
+                mesh->ComputeAllFaceBounds(m, &bounds[mesh_faces_start_idx[i]]);
+            }
+
+            // Large faces are split into several references clipped to them, spatial splits do that during the build
+            if (settings.presplit_budget > 0.f && !settings.use_splits)
+            {
+                std::vector<bbox> refbounds;
+                std::vector<int> refprims;
+                PresplitFaces(shapes, mesh_faces_start_idx, &bounds[0], numfaces, settings.presplit_budget, refbounds, refprims);
+                m_bvh->Build(refbounds.data(), (int)refbounds.size(), refprims.data(), numfaces);
+            }
+            else
+            {
+                m_bvh->Build(&bounds[0], numfaces);
+            }
+            m_bvh->GetStats(m_stats);
 
-            m_bvh->Build(&bounds[0], numfaces);
+            // Node indices in a complete tree have to fit bit trail
+            if (m_bvh->GetHeight() >= kMaxTrailLength)
+            {
+                m_bvh.reset(nullptr);
+                throw ExceptionImpl("hashbvh accelerator can't traverse this scene as BVH is too deep, try using bvh instead");
+            }
 
             FatNodeBvhTranslator translator;
             translator.Process(*m_bvh);
+            translator.BuildHashMap();
+
+            // A cancelled commit stops before touching the device
+            CheckCancelled(world);
 
             // Create vertex buffer
             {
                 // Vertices
-                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
+                m_gpudata->vertices = CreateSceneBuffer(numvertices * sizeof(float3));
 
-                // Get the pointer to mapped data
-                float3* vertexdata = nullptr;
-                Calc::Event* e = nullptr;
-
-                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
-
-                e->Wait();
-                m_device->DeleteEvent(e);
+                // Filled on the host and uploaded without blocking
+                std::vector<float3> vertices_data(numvertices);
+                float3* vertexdata = vertices_data.data();
 
                 // Here we need to put data in world space rather than object space
                 // So we need to get the transform from the mesh and multiply each vertex
@@ -288,8 +272,6 @@ namespace RadeonRays
                 {
                     // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
                     // Get mesh transform
                     mesh->GetTransform(m, minv);
 
@@ -297,7 +279,7 @@ namespace RadeonRays
                     // Iterate thru vertices multiply and append them to GPU buffer
                     for (int j = 0; j < mesh->num_vertices(); ++j)
                     {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
                     }
                 }
 
@@ -307,8 +289,6 @@ namespace RadeonRays
                     Instance const* instance = static_cast<Instance const*>(shapes[i]);
                     // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
                     // Get mesh transform
                     instance->GetTransform(m, minv);
 
@@ -316,13 +296,11 @@ namespace RadeonRays
                     // Iterate thru vertices multiply and append them to GPU buffer
                     for (int j = 0; j < mesh->num_vertices(); ++j)
                     {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
                     }
                 }
 
-                m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
-                e->Wait();
-                m_device->DeleteEvent(e);
+                Upload(m_gpudata->vertices, std::move(vertices_data));
             }
 
             // Create face buffer
@@ -359,17 +337,17 @@ namespace RadeonRays
                         mesh = static_cast<Mesh const*>(static_cast<Instance const*>(shapes[shapeidx])->GetBaseShape());
                     }
 
-                    // Get vertex buffer of the current mesh
-                    Mesh::Face const* myfacedata = mesh->GetFaceData();
                     // Find face idx
                     int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
+                    // Get vertex indices of the face
+                    Mesh::Face const face = mesh->GetFace(faceidx);
                     // Find mesh start idx
                     int mystartidx = mesh_vertices_start_idx[shapeidx];
 
                     // Copy face data to GPU buffer
-                    facedata[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
-                    facedata[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
-                    facedata[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
+                    facedata[i].idx[0] = face.idx[0] + mystartidx;
+                    facedata[i].idx[1] = face.idx[1] + mystartidx;
+                    facedata[i].idx[2] = face.idx[2] + mystartidx;
 
                     facedata[i].shapeidx = shapes[shapeidx]->GetId();
                     facedata[i].shape_mask = shapes[shapeidx]->GetMask();
@@ -380,12 +358,13 @@ namespace RadeonRays
             }
 
             // Copy translated nodes first
-            m_gpudata->bvh = m_device->CreateBuffer(translator.nodes_.size() * sizeof(FatNodeBvhTranslator::Node), Calc::BufferType::kRead, &translator.nodes_[0]);
+            m_gpudata->bvh = CreateSceneBuffer(translator.nodes_.size() * sizeof(FatNodeBvhTranslator::Node));
+            Upload(m_gpudata->bvh, std::move(translator.nodes_));
 
             // Create displacement buffer
             auto displacement_size = translator.m_hash_map->displacement_table_size();
 
-            m_gpudata->displacement_size = displacement_size;
+            m_gpudata->hash_row_size = translator.m_hash_map->row_size();
 
             m_gpudata->displacement = m_device->CreateBuffer(displacement_size * sizeof(int),
                 Calc::BufferType::kRead,
@@ -395,37 +374,41 @@ namespace RadeonRays
                 Calc::BufferType::kRead,
                 (void*)translator.m_hash_map->hash_table_ptr());
 
-            // Make sure everything is commited
-            m_device->Finish(0);
+            // Nothing is updated in place, so the tree is only kept on request
+            if (!KeepHostCopies(world))
+            {
+                m_bvh.reset();
+                m_scratch.Release();
+            }
         }
     }
 
-    void IntersectorBitTrail::Intersect(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    void IntersectorBitTrail::GetMemoryStats(AccelStats& stats) const
     {
-        auto& func = m_gpudata->isect_func;
-
-        // Set args
-        int arg = 0;
-
-        func->SetArg(arg++, m_gpudata->bvh);
-        func->SetArg(arg++, m_gpudata->vertices);
-        func->SetArg(arg++, rays);
-        func->SetArg(arg++, numrays);
-        func->SetArg(arg++, m_gpudata->displacement);
-        func->SetArg(arg++, m_gpudata->hashmap);
-        func->SetArg(arg++, sizeof(m_gpudata->displacement_size), &m_gpudata->displacement_size);
-        func->SetArg(arg++, hits);
-
-        size_t localsize = kWorkGroupSize;
-        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        stats.node_memory = GetBufferSize(m_gpudata->bvh);
+        stats.vertex_memory = GetBufferSize(m_gpudata->vertices);
+        stats.face_memory = 0;
+        // Perfect hash of the node bit trails
+        stats.other_memory = GetBufferSize(m_gpudata->displacement) + GetBufferSize(m_gpudata->hashmap);
+    }
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    void IntersectorBitTrail::Intersect(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        Dispatch(m_gpudata->isect_func, queueidx, rays, numrays, maxrays, hits, event);
     }
 
     void IntersectorBitTrail::Occluded(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
     {
-        auto& func = m_gpudata->occlude_func;
+        Dispatch(m_gpudata->occlude_func, queueidx, rays, numrays, maxrays, hits, event);
+    }
 
+    void IntersectorBitTrail::OccludedCompact(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        Dispatch(m_gpudata->occlude_compact_func, queueidx, rays, numrays, maxrays, hits, event);
+    }
+
+    void IntersectorBitTrail::Dispatch(Calc::Function* func, std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event** event) const
+    {
         // Set args
         int arg = 0;
 
@@ -435,12 +418,17 @@ namespace RadeonRays
         func->SetArg(arg++, numrays);
         func->SetArg(arg++, m_gpudata->displacement);
         func->SetArg(arg++, m_gpudata->hashmap);
-        func->SetArg(arg++, sizeof(m_gpudata->displacement_size), &m_gpudata->displacement_size);
+        func->SetArg(arg++, sizeof(m_gpudata->hash_row_size), &m_gpudata->hash_row_size);
         func->SetArg(arg++, hits);
 
+        if (func == m_gpudata->isect_func)
+        {
+            SetTraversalStatsArg(func, arg, queueidx, maxrays);
+        }
+
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        Execute(func, queueidx, globalsize, localsize, event, "hashbvh.traversal");
     }
 }
@@ -24,6 +24,7 @@ THE SOFTWARE.
 #include "calc.h"
 #include "device.h"
 #include "intersector.h"
+#include "../util/build_scratch.h"
 #include <memory>
 /**
     \file intersector_bittrail.h
@@ -87,6 +88,7 @@ THE SOFTWARE.
         -Very fast traversal.
         -Benefits from BVH quality optimization.
         -Low VGPR pressure
+        -No traversal stack memory, ray batches are not limited in size
     Cons:
         -Depth is limited.
         -Generates global memory traffic.
@@ -99,7 +101,7 @@ namespace RadeonRays
     class IntersectorBitTrail : public Intersector
     {
     public:
-        IntersectorBitTrail(Calc::Device* device);
+        IntersectorBitTrail(Calc::Device* device, int formats = kFullRecords);
 
     private:
         void Process(World const& world) override;
@@ -112,7 +114,18 @@ namespace RadeonRays
             std::uint32_t max_rays, Calc::Buffer *hits, 
             Calc::Event const *wait_event, Calc::Event **event) const override;
 
+        void OccludedCompact(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
+            std::uint32_t max_rays, Calc::Buffer *hits, 
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        bool SupportsCompactOcclusion() const override { return true; }
+        // Device memory of the acceleration structure
+        void GetMemoryStats(AccelStats& stats) const override;
+
     private:
+        // Launch one of the traversal kernels, they all share the same arguments
+        void Dispatch(Calc::Function* func, std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event **event) const;
+
         struct GpuData;
         struct ShapeData;
 
@@ -120,5 +133,7 @@ namespace RadeonRays
         std::unique_ptr<GpuData> m_gpudata;
         // Bvh data structure
         std::unique_ptr<Bvh> m_bvh;
+        // Build arrays reused across commits
+        BuildScratch m_scratch;
     };
 }
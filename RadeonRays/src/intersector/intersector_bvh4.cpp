@@ -0,0 +1,504 @@
+/**********************************************************************
+ Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ ********************************************************************/
+#include "intersector_bvh4.h"
+
+#include "calc.h"
+#include "executable.h"
+#include "../accelerator/bvh.h"
+#include "../accelerator/split_bvh.h"
+#include "../accelerator/linear_bvh.h"
+#include "../accelerator/presplit.h"
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
+#include "../world/world.h"
+
+#include "../translator/wide_bvh_translator.h"
+#include "../except/except.h"
+
+#include <algorithm>
+
+ // Preferred work group size for Radeon devices
+static int const kWorkGroupSize = 64;
+// Global stack entries per ray, has to match GLOBAL_STACK_SIZE in the kernels
+static int const kMaxStackSize = 64;
+static int const kMaxBatchSize = 1024 * 1024;
+
+namespace RadeonRays
+{
+    struct IntersectorBvh4::GpuData
+    {
+        // Device
+        Calc::Device* device;
+        // BVH nodes
+        Calc::Buffer* bvh;
+        // Vertex positions
+        Calc::Buffer* vertices;
+        // Indices
+        Calc::Buffer* faces;
+        // Traversal stacks, one per queue
+        std::vector<Calc::Buffer*> stacks;
+
+        Calc::Executable* executable;
+        Calc::Function* isect_func;
+        Calc::Function* occlude_func;
+        Calc::Function* occlude_compact_func;
+
+        GpuData(Calc::Device* d)
+        : device(d)
+                          , bvh(nullptr)
+                          , vertices(nullptr)
+                          , faces(nullptr)
+                          , executable(nullptr)
+                          , isect_func(nullptr)
+                          , occlude_func(nullptr)
+                          , occlude_compact_func(nullptr)
+        {
+        }
+
+        // Get traversal stack of the queue, reallocate if it is too small
+        Calc::Buffer* GetStack(std::uint32_t queueidx, std::size_t size)
+        {
+            if (stacks.size() <= queueidx)
+            {
+                stacks.resize(queueidx + 1, nullptr);
+            }
+
+            auto& stack = stacks[queueidx];
+
+            if (!stack || stack->GetSize() < size)
+            {
+                if (stack)
+                {
+                    device->DeleteBuffer(stack);
+                }
+
+                stack = device->CreateBuffer(size, Calc::BufferType::kWrite);
+            }
+
+            return stack;
+        }
+
+        ~GpuData()
+        {
+            device->DeleteBuffer(bvh);
+            device->DeleteBuffer(vertices);
+            device->DeleteBuffer(faces);
+            for (auto stack : stacks)
+            {
+                device->DeleteBuffer(stack);
+            }
+            executable->DeleteFunction(isect_func);
+            executable->DeleteFunction(occlude_func);
+            executable->DeleteFunction(occlude_compact_func);
+            device->DeleteExecutable(executable);
+        }
+    };
+
+    IntersectorBvh4::IntersectorBvh4(Calc::Device* device, int formats)
+        : Intersector(device, formats)
+        , m_gpudata(new GpuData(device))
+        , m_bvh(nullptr)
+    {
+        // Concurrent queries on other queues never resize the vector
+        m_gpudata->stacks.resize(m_num_queues, nullptr);
+
+        std::string buildopts;
+        
+#ifdef USE_SAFE_MATH
+        buildopts.append("-D USE_SAFE_MATH ");
+#endif
+
+        buildopts.append(GetRecordFormatOptions(m_formats));
+
+#ifndef RR_EMBED_KERNELS
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+            int numheaders = sizeof(headers) / sizeof(char const*);
+
+            m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/intersect_bvh4_stack.cl", headers, numheaders, buildopts.c_str());
+        } 
+        else
+        {
+            assert(device->GetPlatform() == Calc::Platform::kVulkan);
+            m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/GLSL/bvh4.comp", nullptr, 0, buildopts.c_str());
+        }
+#else
+#if USE_OPENCL
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_gpudata->executable = m_device->CompileExecutable(g_intersect_bvh4_stack_opencl, std::strlen(g_intersect_bvh4_stack_opencl), buildopts.c_str());
+        }
+#endif
+
+#if USE_VULKAN
+        if (m_gpudata->executable == nullptr && device->GetPlatform() == Calc::Platform::kVulkan)
+        {
+#ifdef RR_EMBED_SPIRV
+            m_gpudata->executable = m_device->CompileExecutable(g_bvh4_spirv, sizeof(g_bvh4_spirv), buildopts.c_str());
+#else
+            m_gpudata->executable = m_device->CompileExecutable(g_bvh4_vulkan, std::strlen(g_bvh4_vulkan), buildopts.c_str());
+#endif
+        }
+#endif
+
+#endif
+
+        m_gpudata->isect_func = m_gpudata->executable->CreateFunction("intersect_main");
+        m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("occluded_main");
+        m_gpudata->occlude_compact_func = m_gpudata->executable->CreateFunction("occluded_compact_main");
+    }
+
+    void IntersectorBvh4::Process(World const& world)
+    {
+
+        // If something has been changed we need to rebuild BVH
+        if (!m_gpudata->bvh || world.has_changed() || BvhSettingsChanged(world) || world.GetStateChange() != ShapeImpl::kStateChangeNone)
+        {
+            if (m_gpudata->bvh)
+            {
+                m_device->DeleteBuffer(m_gpudata->bvh);
+                m_device->DeleteBuffer(m_gpudata->vertices);
+                m_device->DeleteBuffer(m_gpudata->faces);
+                m_gpudata->bvh = m_gpudata->vertices = m_gpudata->faces = nullptr;
+            }
+
+            // Check if we can allocate enough stack memory
+            Calc::DeviceSpec spec;
+            m_device->GetSpec(spec);
+            if (spec.max_alloc_size <= kMaxBatchSize * kMaxStackSize * sizeof(int))
+            {
+                throw ExceptionImpl("bvh4 accelerator can't allocate enough stack memory, try using bvh instead");
+            }
+
+            int numshapes = (int)world.shapes_.size();
+            int numvertices = 0;
+            int numfaces = 0;
+
+            // This buffer tracks mesh start index for next stage as mesh face indices are relative to 0
+            std::vector<int> mesh_vertices_start_idx(numshapes);
+            std::vector<int> mesh_faces_start_idx(numshapes);
+
+            // Build settings are resolved when the options are set
+            auto const& settings = world.options_.GetBvhSettings();
+
+            m_bvh.reset(settings.use_splits ?
+                new SplitBvh(settings.traversal_cost, settings.num_bins, settings.max_split_depth, settings.min_overlap, settings.extra_node_budget) :
+                settings.use_lbvh ? new LinearBvh(settings.traversal_cost, settings.num_bins) :
+                new Bvh(settings.traversal_cost, settings.num_bins, settings.use_sah)
+            );
+
+            // Centroids and indices are reused across commits, the monitor of the commit can cancel the build
+            m_bvh->SetScratch(&m_scratch);
+            m_bvh->SetMonitor(world.monitor_.get());
+
+            // Partition the array into meshes and instances
+            std::vector<Shape const*> shapes(world.shapes_);
+
+            auto firstinst = std::partition(shapes.begin(), shapes.end(),
+                [&](Shape const* shape)
+            {
+                return !static_cast<ShapeImpl const*>(shape)->is_instance();
+            });
+
+            // Count the number of meshes
+            int nummeshes = (int)std::distance(shapes.begin(), firstinst);
+            // Count the number of instances
+            int numinstances = (int)std::distance(firstinst, shapes.end());
+
+            for (int i = 0; i < nummeshes; ++i)
+            {
+                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+
+                mesh_faces_start_idx[i] = numfaces;
+                mesh_vertices_start_idx[i] = numvertices;
+
+                numfaces += mesh->num_faces();
+                numvertices += mesh->num_vertices();
+            }
+
+            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+            {
+                Instance const* instance = static_cast<Instance const*>(shapes[i]);
+                Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
+
+                mesh_faces_start_idx[i] = numfaces;
+                mesh_vertices_start_idx[i] = numvertices;
+
+                numfaces += mesh->num_faces();
+                numvertices += mesh->num_vertices();
+            }
+
+
+            // Face bounds are kept across commits, so they are allocated only when the scene grows
+            host_vector<bbox>& bounds = m_scratch.bounds;
+            bounds.resize(numfaces);
+
+            // We handle meshes first collecting their world space bounds
+            for (int i = 0; i < nummeshes; ++i)
+            {
+                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+
+                // Here we directly get world space bounds, faces are processed in parallel
+                matrix m, minv;
+                mesh->GetTransform(m, minv);
+                mesh->ComputeAllFaceBounds(m, &bounds[mesh_faces_start_idx[i]]);
+            }
+
+            // Then we handle instances. Need to flatten them into actual geometry.
+            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+            {
+                Instance const* instance = static_cast<Instance const*>(shapes[i]);
+                Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
+
+                // Instance is using its own transform for base shape geometry
+                // so base mesh vertices are transformed by it directly
+                matrix m, minv;
+                instance->GetTransform(m, minv);
+                mesh->ComputeAllFaceBounds(m, &bounds[mesh_faces_start_idx[i]]);
+            }
+
+            // Large faces are split into several references clipped to them, spatial splits do that during the build
+            if (settings.presplit_budget > 0.f && !settings.use_splits)
+            {
+                std::vector<bbox> refbounds;
+                std::vector<int> refprims;
+                PresplitFaces(shapes, mesh_faces_start_idx, &bounds[0], numfaces, settings.presplit_budget, refbounds, refprims);
+                m_bvh->Build(refbounds.data(), (int)refbounds.size(), refprims.data(), numfaces);
+            }
+            else
+            {
+                m_bvh->Build(&bounds[0], numfaces);
+            }
+
+#ifdef RR_PROFILE
+            m_bvh->PrintStatistics(std::cout);
+#endif
+
+            // Shape of the binary tree the wide one is collapsed from
+            m_bvh->GetStats(m_stats);
+
+            WideBvhTranslator translator;
+            translator.Process(*m_bvh);
+
+            // Check if the tree height is reasonable, each level can postpone up to 3 children
+            if ((WideBvhTranslator::kWidth - 1) * translator.GetDepth() >= kMaxStackSize)
+            {
+                m_bvh.reset(nullptr);
+                throw ExceptionImpl("bvh4 accelerator can cause stack overflow for this scene, try using bvh instead");
+            }
+
+            // A cancelled commit stops before touching the device
+            CheckCancelled(world);
+
+            // Update GPU data
+
+            // Create vertex buffer
+            {
+                // Vertices
+                m_gpudata->vertices = CreateSceneBuffer(numvertices * sizeof(float3));
+
+                // Filled on the host and uploaded without blocking
+                std::vector<float3> vertices_data(numvertices);
+                float3* vertexdata = vertices_data.data();
+
+                // Here we need to put data in world space rather than object space
+                // So we need to get the transform from the mesh and multiply each vertex
+                matrix m, minv;
+
+#pragma omp parallel for
+                for (int i = 0; i < nummeshes; ++i)
+                {
+                    // Get the mesh
+                    Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+                    // Get mesh transform
+                    mesh->GetTransform(m, minv);
+
+                    //#pragma omp parallel for
+                    // Iterate thru vertices multiply and append them to GPU buffer
+                    for (int j = 0; j < mesh->num_vertices(); ++j)
+                    {
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
+                    }
+                }
+
+#pragma omp parallel for
+                for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+                {
+                    Instance const* instance = static_cast<Instance const*>(shapes[i]);
+                    // Get the mesh
+                    Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
+                    // Get mesh transform
+                    instance->GetTransform(m, minv);
+
+                    //#pragma omp parallel for
+                    // Iterate thru vertices multiply and append them to GPU buffer
+                    for (int j = 0; j < mesh->num_vertices(); ++j)
+                    {
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
+                    }
+                }
+
+                Upload(m_gpudata->vertices, std::move(vertices_data));
+            }
+
+            // Create face buffer
+            {
+                struct Face
+                {
+                    // Up to 3 indices
+                    int idx[3];
+                    // Shape maks
+                    int shape_mask;
+                    // Shape ID
+                    int shape_id;
+                    // Primitive ID
+                    int prim_id;
+                };
+
+                // This number is different from the number of faces for some BVHs
+                auto numindices = m_bvh->GetNumIndices();
+                // Create face buffer
+                m_gpudata->faces = CreateSceneBuffer(numindices * sizeof(Face));
+
+                std::vector<Face> faces_data(numindices);
+                Face* facedata = faces_data.data();
+
+                // Here the point is to add mesh starting index to actual index contained within the mesh,
+                // getting absolute index in the buffer.
+                // Besides that we need to permute the faces accorningly to BVH reordering, whihc
+                // is contained within bvh.primids_
+                int const* reordering = m_bvh->GetIndices();
+                for (int i = 0; i < numindices; ++i)
+                {
+                    int indextolook4 = reordering[i];
+
+                    // We need to find a shape corresponding to current face
+                    auto iter = std::upper_bound(mesh_faces_start_idx.cbegin(), mesh_faces_start_idx.cend(), indextolook4);
+
+                    // Find the index of the shape
+                    int shapeidx = static_cast<int>(std::distance(mesh_faces_start_idx.cbegin(), iter) - 1);
+
+                    // Get the mesh directly or out of instance
+                    Mesh const* mesh = nullptr;
+                    if (shapeidx < nummeshes)
+                    {
+                        mesh = static_cast<Mesh const*>(shapes[shapeidx]);
+                    }
+                    else
+                    {
+                        mesh = static_cast<Mesh const*>(static_cast<Instance const*>(shapes[shapeidx])->GetBaseShape());
+                    }
+
+                    // Find face idx
+                    int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
+                    // Get vertex indices of the face
+                    Mesh::Face const face = mesh->GetFace(faceidx);
+                    // Find mesh start idx
+                    int mystartidx = mesh_vertices_start_idx[shapeidx];
+
+                    // Copy face data to GPU buffer
+                    facedata[i].idx[0] = face.idx[0] + mystartidx;
+                    facedata[i].idx[1] = face.idx[1] + mystartidx;
+                    facedata[i].idx[2] = face.idx[2] + mystartidx;
+
+                    // Optimization: we are putting faceid here
+                    facedata[i].shape_id = shapes[shapeidx]->GetId();
+                    facedata[i].shape_mask = shapes[shapeidx]->GetMask();
+                    facedata[i].prim_id = faceidx;
+                }
+
+                Upload(m_gpudata->faces, std::move(faces_data));
+            }
+
+            // Copy translated nodes
+            m_gpudata->bvh = CreateSceneBuffer(translator.nodes_.size() * sizeof(WideBvhTranslator::Node));
+            Upload(m_gpudata->bvh, std::move(translator.nodes_));
+
+            // Nothing is updated in place, so the tree is only kept on request
+            if (!KeepHostCopies(world))
+            {
+                m_bvh.reset();
+                m_scratch.Release();
+            }
+
+            // Stack, kept across rebuilds
+            m_gpudata->GetStack(0, kMaxBatchSize * kMaxStackSize * sizeof(int));
+        }
+    }
+
+    void IntersectorBvh4::GetMemoryStats(AccelStats& stats) const
+    {
+        stats.node_memory = GetBufferSize(m_gpudata->bvh);
+        stats.vertex_memory = GetBufferSize(m_gpudata->vertices);
+        stats.face_memory = GetBufferSize(m_gpudata->faces);
+        stats.other_memory = 0;
+        for (auto stack : m_gpudata->stacks)
+        {
+            stats.other_memory += GetBufferSize(stack);
+        }
+    }
+
+    void IntersectorBvh4::Intersect(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        Dispatch(m_gpudata->isect_func, queueidx, rays, numrays, maxrays, hits, event);
+    }
+
+    void IntersectorBvh4::Occluded(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        Dispatch(m_gpudata->occlude_func, queueidx, rays, numrays, maxrays, hits, event);
+    }
+
+    void IntersectorBvh4::OccludedCompact(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        Dispatch(m_gpudata->occlude_compact_func, queueidx, rays, numrays, maxrays, hits, event);
+    }
+
+    void IntersectorBvh4::Dispatch(Calc::Function* func, std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event** event) const
+    {
+        size_t stack_size = 4 * maxrays * kMaxStackSize; //required stack size, kMaxStackSize * sizeof(int) bytes per ray
+        // Queries on different queues may run concurrently, so each queue has its own stack
+        auto stack = m_gpudata->GetStack(queueidx, stack_size);
+
+        // Set args
+        int arg = 0;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, numrays);
+        func->SetArg(arg++, stack);
+        func->SetArg(arg++, hits);
+
+        if (func == m_gpudata->isect_func)
+        {
+            SetTraversalStatsArg(func, arg, queueidx, maxrays);
+        }
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        Execute(func, queueidx, globalsize, localsize, event, "bvh4.traversal");
+    }
+}
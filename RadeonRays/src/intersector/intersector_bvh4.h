@@ -0,0 +1,95 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file intersector_bvh4.h
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Intersector implementation based on 4-wide BVH stacked travesal.
+
+    Intersector is collapsing binary BVH into 4-wide BVH, each node keeps
+    bounding boxes of up to 4 children and all of them are tested at once.
+    Hit children are traversed closest first, postponed ones go into a stack
+    split into LDS and global memory parts as in short stack intersector.
+
+    Pros:
+        -Half the number of traversal steps compared to binary BVH.
+        -Better memory coalescing on wide SIMD architectures.
+    Cons:
+        -Depth is limited.
+        -Generates LDS traffic.
+ */
+#pragma once
+
+#include "calc.h"
+#include "device.h"
+#include "intersector.h"
+#include "../util/build_scratch.h"
+#include <memory>
+
+
+namespace RadeonRays
+{
+    class Bvh;
+
+    /** 
+    \brief Intersector implementation using 4-wide BVH traversal
+    */
+    class IntersectorBvh4 : public Intersector
+    {
+    public:
+        // Constructor, formats selects record layouts, see RecordFormat
+        IntersectorBvh4(Calc::Device* device, int formats = kFullRecords);
+
+    private:
+        // World preprocessing implementation
+        void Process(World const& world) override;
+        // Intersection implementation
+        void Intersect(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
+            std::uint32_t max_rays, Calc::Buffer *hits, 
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Occlusion implementation
+        void Occluded(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
+            std::uint32_t max_rays, Calc::Buffer *hits, 
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Bit packed occlusion implementation
+        void OccludedCompact(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
+            std::uint32_t max_rays, Calc::Buffer *hits, 
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        bool SupportsCompactOcclusion() const override { return true; }
+        // Device memory of the acceleration structure
+        void GetMemoryStats(AccelStats& stats) const override;
+
+    private:
+        // Launch one of the traversal kernels, they all share the same arguments
+        void Dispatch(Calc::Function* func, std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event **event) const;
+
+        struct GpuData;
+
+        // Implementation data
+        std::unique_ptr<GpuData> m_gpudata;
+        // Bvh data structure
+        std::unique_ptr<Bvh> m_bvh;
+        // Build arrays reused across commits
+        BuildScratch m_scratch;
+    };
+}
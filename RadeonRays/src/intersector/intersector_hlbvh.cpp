@@ -22,7 +22,10 @@ THE SOFTWARE.
 #include "intersector_hlbvh.h"
 
 #include "../accelerator/hlbvh.h"
+#include "../accelerator/presplit.h"
 #include "../primitive/mesh.h"
+#include "../primitive/device_mesh.h"
+#include "../device/calc_holder.h"
 #include "../world/world.h"
 #include "../translator/plain_bvh_translator.h"
 
@@ -31,6 +34,7 @@ THE SOFTWARE.
 #include "executable.h"
 #include "../except/except.h"
 #include <algorithm>
+#include <chrono>
 
 // Preferred work group size for Radeon devices
 static int const kWorkGroupSize = 64;
@@ -47,47 +51,87 @@ namespace RadeonRays
         Calc::Buffer* vertices;
         // Indices
         Calc::Buffer* faces;
-        // Traversal stack
-        Calc::Buffer* stack;
+        // Traversal stacks, one per queue
+        std::vector<Calc::Buffer*> stacks;
 
         Calc::Executable* executable;
         Calc::Function* isect_func;
         Calc::Function* occlude_func;
+        Calc::Function* occlude_compact_func;
+        // Copies of device mesh geometry, OpenCL only
+        Calc::Function* copy_vertices_func;
+        Calc::Function* copy_faces_func;
 
         GpuData(Calc::Device* d)
             : device(d)
             , vertices(nullptr)
             , faces(nullptr)
+            , copy_vertices_func(nullptr)
+            , copy_faces_func(nullptr)
         {
         }
 
+        // Get traversal stack of the queue, reallocate if it is too small
+        Calc::Buffer* GetStack(std::uint32_t queueidx, std::size_t size)
+        {
+            if (stacks.size() <= queueidx)
+            {
+                stacks.resize(queueidx + 1, nullptr);
+            }
+
+            auto& stack = stacks[queueidx];
+
+            if (!stack || stack->GetSize() < size)
+            {
+                if (stack)
+                {
+                    device->DeleteBuffer(stack);
+                }
+
+                stack = device->CreateBuffer(size, Calc::BufferType::kWrite);
+            }
+
+            return stack;
+        }
+
         ~GpuData()
         {
             device->DeleteBuffer(vertices);
             device->DeleteBuffer(faces);
-            device->DeleteBuffer(stack);
+            for (auto stack : stacks)
+            {
+                device->DeleteBuffer(stack);
+            }
             executable->DeleteFunction(isect_func);
             executable->DeleteFunction(occlude_func);
+            executable->DeleteFunction(occlude_compact_func);
+            if (copy_vertices_func)
+            {
+                executable->DeleteFunction(copy_vertices_func);
+                executable->DeleteFunction(copy_faces_func);
+            }
             device->DeleteExecutable(executable);
         }
     };
 
-    IntersectorHlbvh::IntersectorHlbvh(Calc::Device* device)
-        : Intersector(device)
+    IntersectorHlbvh::IntersectorHlbvh(Calc::Device* device, Builder builder, int formats)
+        : Intersector(device, formats)
         , m_gpudata(new GpuData(device))
         , m_bvh(nullptr)
+        , m_builder(builder)
+        , m_presplit_budget(0.f)
     {
-        std::string buildopts =
-#ifdef RR_RAY_MASK
-            "-D RR_RAY_MASK ";
-#else
-            "";
-#endif
+        // Concurrent queries on other queues never resize the vector
+        m_gpudata->stacks.resize(m_num_queues, nullptr);
+
+        std::string buildopts;
         
 #ifdef USE_SAFE_MATH
         buildopts.append("-D USE_SAFE_MATH ");
 #endif
 
+        buildopts.append(GetRecordFormatOptions(m_formats));
+
 #ifndef RR_EMBED_KERNELS
         if ( device->GetPlatform() == Calc::Platform::kOpenCL )
         {
@@ -113,7 +157,11 @@ namespace RadeonRays
 #if USE_VULKAN
         if (m_gpudata->executable == nullptr && device->GetPlatform() == Calc::Platform::kVulkan)
         {
-            m_gpudata->executable = m_device->CompileExecutable(g_hlbvh_build_vulkan, std::strlen(g_hlbvh_vulkan), buildopts.c_str());
+#ifdef RR_EMBED_SPIRV
+            m_gpudata->executable = m_device->CompileExecutable(g_hlbvh_spirv, sizeof(g_hlbvh_spirv), buildopts.c_str());
+#else
+            m_gpudata->executable = m_device->CompileExecutable(g_hlbvh_vulkan, std::strlen(g_hlbvh_vulkan), buildopts.c_str());
+#endif
         }
 #endif
 
@@ -121,311 +169,437 @@ namespace RadeonRays
 
         m_gpudata->isect_func = m_gpudata->executable->CreateFunction("intersect_main");
         m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("occluded_main");
+        m_gpudata->occlude_compact_func = m_gpudata->executable->CreateFunction("occluded_compact_main");
+
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_gpudata->copy_vertices_func = m_gpudata->executable->CreateFunction("copy_device_vertices_main");
+            m_gpudata->copy_faces_func = m_gpudata->executable->CreateFunction("copy_device_faces_main");
+        }
     }
 
     void IntersectorHlbvh::Process(World const& world)
     {
-        // If something has been changed we need to rebuild BVH
-        if (!m_bvh || world.has_changed())
+        // If something has been changed we need to rebuild BVH,
+        // if only shapes have been moved we need to refit it
+        bool rebuild = !m_bvh || world.has_changed();
+
+        // Contents of device buffers can't be tracked, so meshes using them are rebuilt on every commit
+        bool has_device_meshes = false;
+        for (auto shape : world.shapes_)
         {
-            if (m_bvh)
-            {
-                m_device->DeleteBuffer(m_gpudata->vertices);
-                m_device->DeleteBuffer(m_gpudata->faces);
-                m_device->DeleteBuffer(m_gpudata->stack);
-            }
-            
-            int numshapes = (int)world.shapes_.size();
-            int numvertices = 0;
-            int numfaces = 0;
+            has_device_meshes = has_device_meshes || static_cast<ShapeImpl const*>(shape)->is_device_mesh();
+        }
+
+        rebuild = rebuild || has_device_meshes;
+
+        auto passes = world.options_.GetOption("hlbvh.restructure_passes");
+        int restructure_passes = passes ? std::max(0, (int)passes->AsFloat()) : 0;
+
+        // Top tree of Morton clusters
+        int sah_top_bits = 0;
+        if (m_builder == kSahTopTree)
+        {
+            auto topbits = world.options_.GetOption("hlbvh.sah.top_bits");
+            sah_top_bits = topbits ? std::min(std::max(1, (int)topbits->AsFloat()), 63) : 18;
+        }
+
+        // Clustering search radius
+        int ploc_radius = 0;
+        if (m_builder == kPloc)
+        {
+            auto radius = world.options_.GetOption("hlbvh.ploc.radius");
+            ploc_radius = radius ? std::min(std::max(1, (int)radius->AsFloat()), 64) : 16;
+        }
+
+        // Presplitting needs host geometry, references depend on transforms, so faces are always uploaded again
+        auto const& settings = world.options_.GetBvhSettings();
+        float presplit_budget = has_device_meshes ? 0.f : settings.presplit_budget;
 
-            // This buffer tracks mesh start index for next stage as mesh face indices are relative to 0
-            std::vector<int> mesh_vertices_start_idx(numshapes);
-            std::vector<int> mesh_faces_start_idx(numshapes);
+        // Tree quality settings changed
+        rebuild = rebuild || m_bvh->GetRestructurePasses() != restructure_passes ||
+            m_bvh->GetSahTopBits() != sah_top_bits || m_bvh->GetPlocRadius() != ploc_radius ||
+            presplit_budget > 0.f || m_presplit_budget != presplit_budget;
 
-            //
+        if (!rebuild && world.GetStateChange() == ShapeImpl::kStateChangeNone)
+        {
+            return;
+        }
+
+        // Build program and buffers are kept across rebuilds
+        if (!m_bvh)
+        {
             m_bvh.reset(new Hlbvh(m_device));
+            m_bvh->SetProfiler(m_profiler);
+        }
 
-            // Here we now that only Meshes are present, otherwise 2level strategy would have been used
-            for (int i = 0; i < numshapes; ++i)
-            {
-                Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
+        m_bvh->SetRestructurePasses(restructure_passes);
+        m_bvh->SetPlocRadius(ploc_radius);
+
+        // Same tree either way, so switching does not force a rebuild
+        auto single_pass = world.options_.GetOption("hlbvh.single_pass");
+        m_bvh->SetSinglePass(single_pass && single_pass->AsFloat() > 0.f);
+
+        m_presplit_budget = presplit_budget;
 
-                mesh_faces_start_idx[i] = numfaces;
-                mesh_vertices_start_idx[i] = numvertices;
+        if (sah_top_bits > 0)
+        {
+            m_bvh->SetSahTopTree(sah_top_bits, settings.traversal_cost, settings.num_bins);
+        }
+        else
+        {
+            m_bvh->SetSahTopTree(0, 10.f, 64);
+        }
 
+        int numshapes = (int)world.shapes_.size();
+        int numvertices = 0;
+        int numfaces = 0;
+
+        // This buffer tracks mesh start index for next stage as mesh face indices are relative to 0
+        std::vector<int> mesh_vertices_start_idx(numshapes);
+        std::vector<int> mesh_faces_start_idx(numshapes);
+
+        // Here we now that only Meshes are present, otherwise 2level strategy would have been used
+        for (int i = 0; i < numshapes; ++i)
+        {
+            mesh_faces_start_idx[i] = numfaces;
+            mesh_vertices_start_idx[i] = numvertices;
+
+            if (static_cast<ShapeImpl const*>(world.shapes_[i])->is_device_mesh())
+            {
+                DeviceMesh const* mesh = static_cast<DeviceMesh const*>(world.shapes_[i]);
                 numfaces += mesh->num_faces();
                 numvertices += mesh->num_vertices();
             }
+            else
+            {
+                Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
+                numfaces += mesh->num_faces();
+                numvertices += mesh->num_vertices();
+            }
+        }
+
+        // Create vertex buffer, reallocate only if it is too small
+        {
+            if (!m_gpudata->vertices || m_gpudata->vertices->GetSize() < numvertices * sizeof(float3))
+            {
+                if (m_gpudata->vertices)
+                {
+                    m_device->DeleteBuffer(m_gpudata->vertices);
+                }
+
+                m_gpudata->vertices = CreateSceneBuffer(numvertices * sizeof(float3));
+            }
 
-            // We can't avoid allocating it here, since bounds aren't stored anywhere
-            std::vector<bbox> bounds(numfaces);
+            // Filled on the host and uploaded without blocking
+            std::vector<float3> vertices_data(numvertices);
+            float3* vertexdata = vertices_data.data();
 
+            // Here we need to put data in world space rather than object space
+            // So we need to get the transform from the mesh and multiply each vertex
 #pragma omp parallel for
             for (int i = 0; i < numshapes; ++i)
             {
+                // Device meshes are copied on the device once the upload is done
+                if (static_cast<ShapeImpl const*>(world.shapes_[i])->is_device_mesh())
+                {
+                    continue;
+                }
+
+                matrix m, minv;
+                // Get the mesh
                 Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
+                // Get mesh transform
+                mesh->GetTransform(m, minv);
 
-                for (int j = 0; j < mesh->num_faces(); ++j)
+                //#pragma omp parallel for
+                // Iterate thru vertices multiply and append them to GPU buffer
+                for (int j = 0; j < mesh->num_vertices(); ++j)
                 {
-                    mesh->GetFaceBounds(j, false, bounds[mesh_faces_start_idx[i] + j]);
+                    vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
                 }
             }
+            Upload(m_gpudata->vertices, std::move(vertices_data));
+        }
 
-            m_bvh->Build(&bounds[0], numfaces);
-
-            // Create vertex buffer
+        // Large faces are split into several references clipped to them, world space bounds are needed on the host
+        std::vector<bbox> refbounds;
+        std::vector<int> refprims;
+        if (presplit_budget > 0.f)
+        {
+            host_vector<bbox>& bounds = m_scratch.bounds;
+            bounds.resize(numfaces);
+            for (int i = 0; i < numshapes; ++i)
             {
-                // Vertices
-                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
-
-                // Get the pointer to mapped data
-                float3* vertexdata = nullptr;
-                Calc::Event* e = nullptr;
+                Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
 
-                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
+                matrix m, minv;
+                mesh->GetTransform(m, minv);
+                mesh->ComputeAllFaceBounds(m, &bounds[mesh_faces_start_idx[i]]);
+            }
 
-                e->Wait();
-                m_device->DeleteEvent(e);
+            PresplitFaces(world.shapes_, mesh_faces_start_idx, bounds.data(), numfaces, presplit_budget, refbounds, refprims);
+        }
 
-                // Here we need to put data in world space rather than object space
-                // So we need to get the transform from the mesh and multiply each vertex
-                matrix m, minv;
+        // Leafs index faces, so there is a face for each reference
+        int numrefs = presplit_budget > 0.f ? (int)refprims.size() : numfaces;
 
-#pragma omp parallel for
-                for (int i = 0; i < numshapes; ++i)
+        // Create face buffer, topology does not change on shape state changes
+        if (rebuild)
+        {
+            struct Face
+            {
+                // Up to 3 indices
+                int idx[3];
+                // Shape maks
+                int shape_mask;
+                // Shape ID
+                int shape_id;
+                // Primitive ID
+                int prim_id;
+            };
+
+            if (!m_gpudata->faces || m_gpudata->faces->GetSize() < numrefs * sizeof(Face))
+            {
+                if (m_gpudata->faces)
                 {
-                    // Get the mesh
-                    Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
-                    // Get mesh transform
-                    mesh->GetTransform(m, minv);
-
-                    //#pragma omp parallel for
-                    // Iterate thru vertices multiply and append them to GPU buffer
-                    for (int j = 0; j < mesh->num_vertices(); ++j)
-                    {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
-                    }
+                    m_device->DeleteBuffer(m_gpudata->faces);
                 }
-                m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e); 
 
-                e->Wait();
-                m_device->DeleteEvent(e);
+                m_gpudata->faces = CreateSceneBuffer(numrefs * sizeof(Face));
             }
 
+            std::vector<Face> faces_data(numfaces);
+            Face* facedata = faces_data.data();
 
-                // Create face buffer
+            // Here the point is to add mesh starting index to actual index contained within the mesh,
+            // getting absolute index in the buffer.
+#pragma omp parallel for
+            for (int i = 0; i < numshapes; ++i)
             {
-                struct Face
+                if (static_cast<ShapeImpl const*>(world.shapes_[i])->is_device_mesh())
                 {
-                    // Up to 3 indices
-                    int idx[3];
-                    // Shape maks
-                    int shape_mask;
-                    // Shape ID
-                    int shape_id;
-                    // Primitive ID
-                    int prim_id;
-                };
-
-                // Create face buffer
-                m_gpudata->faces = m_device->CreateBuffer(numfaces * sizeof(Face), Calc::BufferType::kRead);
-
-                // Get the pointer to mapped data
-                Face* facedata = nullptr;
-                Calc::Event* e = nullptr;
-
-                m_device->MapBuffer(m_gpudata->faces, 0, 0, numfaces * sizeof(Face), Calc::BufferType::kWrite, (void**)&facedata, &e);
-
-                e->Wait();
-                m_device->DeleteEvent(e);
-
-                // Here the point is to add mesh starting index to actual index contained within the mesh,
-                // getting absolute index in the buffer.
-                // Besides that we need to permute the faces accorningly to BVH reordering, whihc
-                // is contained within bvh.primids_
-                for (int i = 0; i < numfaces; ++i)
-                {
-                    int indextolook4 = i;
-
-                    // We need to find a shape corresponding to current face
-                    auto iter = std::upper_bound(mesh_faces_start_idx.cbegin(), mesh_faces_start_idx.cend(), indextolook4);
-
-                    // Find the index of the shape
-                    int shapeidx = static_cast<int>(std::distance(mesh_faces_start_idx.cbegin(), iter) - 1);
+                    continue;
+                }
 
-                    // Get the mesh directly or out of instance
-                    Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[shapeidx]);
+                Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
+                // Find mesh start idx
+                int mystartidx = mesh_vertices_start_idx[i];
 
-                    // Get vertex buffer of the current mesh
-                    Mesh::Face const* myfacedata = mesh->GetFaceData();
-                    // Find face idx
-                    int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
-                    // Find mesh start idx
-                    int mystartidx = mesh_vertices_start_idx[shapeidx];
+                for (int j = 0; j < mesh->num_faces(); ++j)
+                {
+                    // Get vertex indices of the face
+                    Mesh::Face const face = mesh->GetFace(j);
+                    Face& dst = facedata[mesh_faces_start_idx[i] + j];
 
                     // Copy face data to GPU buffer
-                    facedata[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
-                    facedata[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
-                    facedata[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
+                    dst.idx[0] = face.idx[0] + mystartidx;
+                    dst.idx[1] = face.idx[1] + mystartidx;
+                    dst.idx[2] = face.idx[2] + mystartidx;
 
                     // Optimization: we are putting faceid here
-                    facedata[i].shape_id = mesh->GetId();
-                    facedata[i].shape_mask = mesh->GetMask();
-                    facedata[i].prim_id = faceidx;
+                    dst.shape_id = mesh->GetId();
+                    dst.shape_mask = mesh->GetMask();
+                    dst.prim_id = j;
+                }
+            }
+
+            if (presplit_budget > 0.f)
+            {
+                std::vector<Face> ref_faces(numrefs);
+                for (int i = 0; i < numrefs; ++i)
+                {
+                    ref_faces[i] = faces_data[refprims[i]];
                 }
 
-                m_device->UnmapBuffer(m_gpudata->faces, 0, facedata, &e);
-                e->Wait();
-                m_device->DeleteEvent(e);
+                faces_data.swap(ref_faces);
             }
 
-            // Stack
-            m_gpudata->stack = m_device->CreateBuffer(kMaxBatchSize*kMaxStackSize, Calc::BufferType::kWrite);
-            // Make sure everything is commited
-            m_device->Finish(0);
+            Upload(m_gpudata->faces, std::move(faces_data));
         }
-        else if (world.GetStateChange() != ShapeImpl::kStateChangeNone)
-        {
-            int numshapes = (int)world.shapes_.size();
-            int numvertices = 0;
-            int numfaces = 0;
 
-            // This buffer tracks mesh start index for next stage as mesh face indices are relative to 0
-            std::vector<int> mesh_vertices_start_idx(numshapes);
-            std::vector<int> mesh_faces_start_idx(numshapes);
+        // Submission time, the device builds asynchronously, see "profile.kernels" for kernel times
+        auto start = std::chrono::high_resolution_clock::now();
 
-            //
-            //bvh_.reset(new Hlbvh(context_));
+        if (presplit_budget > 0.f)
+        {
+            m_bvh->Build(refbounds.data(), numrefs);
+        }
+        else if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            // Face bounds are evaluated from the uploaded world space
+            // triangles, so the whole build stays on the device
+            WaitForUploads();
 
-            // Here we now that only Meshes are present, otherwise 2level strategy would have been used
-            for (int i = 0; i < numshapes; ++i)
+            if (has_device_meshes)
             {
-                Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
-
-                mesh_faces_start_idx[i] = numfaces;
-                mesh_vertices_start_idx[i] = numvertices;
-
-                numfaces += mesh->num_faces();
-                numvertices += mesh->num_vertices();
+                CopyDeviceMeshes(world, mesh_vertices_start_idx, mesh_faces_start_idx);
             }
 
-            // We can't avoid allocating it here, since bounds aren't stored anywhere
-            std::vector<bbox> bounds(numfaces);
+            m_bvh->Build(m_gpudata->vertices, m_gpudata->faces, numfaces);
+        }
+        else
+        {
+            // Face bounds are kept across commits, so they are allocated only when the scene grows
+            host_vector<bbox>& bounds = m_scratch.bounds;
+            bounds.resize(numfaces);
 
-#pragma omp parallel for
             for (int i = 0; i < numshapes; ++i)
             {
                 Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
 
-                for (int j = 0; j < mesh->num_faces(); ++j)
-                {
-                    mesh->GetFaceBounds(j, false, bounds[mesh_faces_start_idx[i] + j]);
-                }
+                // Here we directly get world space bounds, faces are processed in parallel
+                matrix m, minv;
+                mesh->GetTransform(m, minv);
+                mesh->ComputeAllFaceBounds(m, &bounds[mesh_faces_start_idx[i]]);
             }
 
             m_bvh->Build(&bounds[0], numfaces);
+        }
 
-            // Create vertex buffer
-            {
-                // Vertices
-                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
-
-                // Get the pointer to mapped data
-                float3* vertexdata = nullptr;
-                Calc::Event* e = nullptr;
-
-                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
+        // LBVH has one primitive per leaf, N - 1 internal nodes and N leaves
+        m_stats = AccelStats();
+        m_stats.num_nodes = numrefs > 0 ? 2 * numrefs - 1 : 0;
+        m_stats.num_leaves = numrefs;
+        m_stats.avg_leaf_prims = numrefs > 0 ? 1.f : 0.f;
+        m_stats.num_primitives = numfaces;
+        m_stats.num_refs = numrefs;
+        m_stats.build_time = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
 
-                e->Wait();
-                m_device->DeleteEvent(e);
+        if (rebuild)
+        {
+            // Stack, kept across rebuilds
+            m_gpudata->GetStack(0, 4 * kMaxBatchSize * kMaxStackSize);
+        }
+    }
 
-                // Here we need to put data in world space rather than object space
-                // So we need to get the transform from the mesh and multiply each vertex
-                matrix m, minv;
 
-#pragma omp parallel for
-                for (int i = 0; i < numshapes; ++i)
-                {
-                    // Get the mesh
-                    Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
-                    // Get mesh transform
-                    mesh->GetTransform(m, minv);
-
-                    //#pragma omp parallel for
-                    // Iterate thru vertices multiply and append them to GPU buffer
-                    for (int j = 0; j < mesh->num_vertices(); ++j)
-                    {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
-                    }
-                }
-                m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
+    void IntersectorHlbvh::CopyDeviceMeshes(World const& world, std::vector<int> const& vertices_start_idx,
+        std::vector<int> const& faces_start_idx)
+    {
+        auto copy_vertices = m_gpudata->copy_vertices_func;
+        auto copy_faces = m_gpudata->copy_faces_func;
 
-                e->Wait();
-                m_device->DeleteEvent(e);
+        // Ordered after the uploads and before the build on the same queue
+        for (std::size_t i = 0; i < world.shapes_.size(); ++i)
+        {
+            if (!static_cast<ShapeImpl const*>(world.shapes_[i])->is_device_mesh())
+            {
+                continue;
             }
+
+            DeviceMesh const* mesh = static_cast<DeviceMesh const*>(world.shapes_[i]);
+
+            matrix m, minv;
+            mesh->GetTransform(m, minv);
+
+            int num_vertices = mesh->num_vertices();
+            int vertex_stride = mesh->GetVertexStride() / static_cast<int>(sizeof(float));
+            int vertex_offset = vertices_start_idx[i];
+
+            int arg = 0;
+            copy_vertices->SetArg(arg++, static_cast<CalcBufferHolder const*>(mesh->GetVertexBuffer())->GetData());
+            copy_vertices->SetArg(arg++, sizeof(int), &vertex_stride);
+            copy_vertices->SetArg(arg++, sizeof(int), &num_vertices);
+            copy_vertices->SetArg(arg++, 4 * sizeof(float), &m.m[0][0]);
+            copy_vertices->SetArg(arg++, 4 * sizeof(float), &m.m[1][0]);
+            copy_vertices->SetArg(arg++, 4 * sizeof(float), &m.m[2][0]);
+            copy_vertices->SetArg(arg++, sizeof(int), &vertex_offset);
+            copy_vertices->SetArg(arg++, m_gpudata->vertices);
+
+            std::size_t globalsize = ((num_vertices + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+            Execute(copy_vertices, 0, globalsize, kWorkGroupSize, nullptr, "hlbvh.copy_device_vertices");
+
+            int num_faces = mesh->num_faces();
+            int index_stride = mesh->GetIndexStride() / static_cast<int>(sizeof(int));
+            int shape_id = mesh->GetId();
+            int shape_mask = mesh->GetMask();
+            int face_offset = faces_start_idx[i];
+
+            arg = 0;
+            copy_faces->SetArg(arg++, static_cast<CalcBufferHolder const*>(mesh->GetIndexBuffer())->GetData());
+            copy_faces->SetArg(arg++, sizeof(int), &index_stride);
+            copy_faces->SetArg(arg++, sizeof(int), &num_faces);
+            copy_faces->SetArg(arg++, sizeof(int), &vertex_offset);
+            copy_faces->SetArg(arg++, sizeof(int), &shape_id);
+            copy_faces->SetArg(arg++, sizeof(int), &shape_mask);
+            copy_faces->SetArg(arg++, sizeof(int), &face_offset);
+            copy_faces->SetArg(arg++, m_gpudata->faces);
+
+            globalsize = ((num_faces + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+            Execute(copy_faces, 0, globalsize, kWorkGroupSize, nullptr, "hlbvh.copy_device_faces");
         }
     }
 
-
-    void IntersectorHlbvh::Intersect(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays, std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const
+    void IntersectorHlbvh::GetMemoryStats(AccelStats& stats) const
     {
-        // Check if we can allocate enough stack memory
-        if (max_rays >= kMaxBatchSize)
+        std::size_t tree = 0;
+        std::size_t scratch = 0;
+        if (m_bvh)
         {
-            throw ExceptionImpl("hlbvh accelerator max batch size exceeded");
+            m_bvh->GetMemoryUsage(tree, scratch);
         }
 
-        auto& func = m_gpudata->isect_func;
-
-        // Set args
-        int arg = 0;
-
-        func->SetArg(arg++, m_bvh->GetGpuData().nodes);
-        func->SetArg(arg++, m_bvh->GetGpuData().sorted_bounds);
-        func->SetArg(arg++, m_gpudata->vertices);
-        func->SetArg(arg++, m_gpudata->faces);
-        func->SetArg(arg++, rays);
-        func->SetArg(arg++, num_rays);
-        func->SetArg(arg++, m_gpudata->stack);
-        func->SetArg(arg++, hits);
-
-        size_t localsize = kWorkGroupSize;
-        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        stats.node_memory = tree;
+        stats.vertex_memory = GetBufferSize(m_gpudata->vertices);
+        stats.face_memory = GetBufferSize(m_gpudata->faces);
+        stats.other_memory = scratch;
+        for (auto stack : m_gpudata->stacks)
+        {
+            stats.other_memory += GetBufferSize(stack);
+        }
+    }
 
-        m_device->Execute(func, queue_idx, globalsize, localsize, event);
+    void IntersectorHlbvh::Intersect(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays, std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const
+    {
+        Dispatch(m_gpudata->isect_func, queue_idx, rays, num_rays, max_rays, hits, event);
     }
 
     void IntersectorHlbvh::Occluded(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays, std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
     {
-        // Check if we can allocate enough stack memory
-        if (max_rays >= kMaxBatchSize)
-        {
-            throw ExceptionImpl("hlbvh accelerator max batch size exceeded");
-        }
+        Dispatch(m_gpudata->occlude_func, queue_idx, rays, num_rays, max_rays, hits, event);
+    }
 
-        auto& func = m_gpudata->occlude_func;
+    void IntersectorHlbvh::OccludedCompact(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays, std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        Dispatch(m_gpudata->occlude_compact_func, queue_idx, rays, num_rays, max_rays, hits, event);
+    }
 
-        // Set args
-        int arg = 0;
+    void IntersectorHlbvh::Dispatch(Calc::Function* func, std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays, std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event) const
+    {
+        std::uint32_t slice_size = std::min<std::uint32_t>(max_rays, kMaxBatchSize);
+        // Queries on different queues may run concurrently, so each queue has its own stack,
+        // slices run in order on the queue, so they can share it
+        auto stack = m_gpudata->GetStack(queue_idx, 4 * slice_size * kMaxStackSize);
 
-        func->SetArg(arg++, m_bvh->GetGpuData().nodes);
-        func->SetArg(arg++, m_bvh->GetGpuData().sorted_bounds);
-        func->SetArg(arg++, m_gpudata->vertices);
-        func->SetArg(arg++, m_gpudata->faces);
-        func->SetArg(arg++, rays);
-        func->SetArg(arg++, num_rays);
-        func->SetArg(arg++, m_gpudata->stack);
-        func->SetArg(arg++, hits);
+        for (std::uint32_t offset = 0; offset < max_rays; offset += slice_size)
+        {
+            std::uint32_t count = std::min(slice_size, max_rays - offset);
+            int slice_offset = static_cast<int>(offset);
+
+            // Set args
+            int arg = 0;
+
+            func->SetArg(arg++, m_bvh->GetGpuData().nodes);
+            func->SetArg(arg++, m_bvh->GetGpuData().sorted_bounds);
+            func->SetArg(arg++, m_gpudata->vertices);
+            func->SetArg(arg++, m_gpudata->faces);
+            func->SetArg(arg++, rays);
+            func->SetArg(arg++, num_rays);
+            func->SetArg(arg++, sizeof(int), &slice_offset);
+            func->SetArg(arg++, stack);
+            func->SetArg(arg++, hits);
+
+            if (func == m_gpudata->isect_func)
+            {
+                SetTraversalStatsArg(func, arg, queue_idx, max_rays);
+            }
 
-        size_t localsize = kWorkGroupSize;
-        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+            size_t localsize = kWorkGroupSize;
+            size_t globalsize = ((count + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queue_idx, globalsize, localsize, event);
+            Execute(func, queue_idx, globalsize, localsize, offset + count >= max_rays ? event : nullptr, "hlbvh.traversal");
+        }
     }
 
 }
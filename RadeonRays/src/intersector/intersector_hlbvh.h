@@ -24,6 +24,7 @@ THE SOFTWARE.
 #include "calc.h"
 #include "device.h"
 #include "intersector.h"
+#include "../util/build_scratch.h"
 #include <memory>
 /**
     \file intersector_hlbvh.h
@@ -56,8 +57,19 @@ namespace RadeonRays
     class IntersectorHlbvh : public Intersector
     {
     public:
-        // Constructor
-        IntersectorHlbvh(Calc::Device* device);
+        // Tree construction
+        enum Builder
+        {
+            // Plain LBVH
+            kLbvh,
+            // Upper levels with binned SAH over Morton clusters
+            kSahTopTree,
+            // Parallel locally-ordered clustering of the Morton sorted primitives
+            kPloc
+        };
+
+        // Constructor, formats selects record layouts, see RecordFormat.
+        IntersectorHlbvh(Calc::Device* device, Builder builder = kLbvh, int formats = kFullRecords);
 
     private:
         // World processing implementation
@@ -73,7 +85,22 @@ namespace RadeonRays
             std::uint32_t max_rays, Calc::Buffer *hits, 
             Calc::Event const *wait_event, Calc::Event **event) const override;
 
+        // Bit packed occlusion implemenation
+        void OccludedCompact(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
+            std::uint32_t max_rays, Calc::Buffer *hits, 
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Device memory of the acceleration structure
+        void GetMemoryStats(AccelStats& stats) const override;
+
     private:
+        // Launch the kernel in slices of at most kMaxBatchSize rays back to back on the queue,
+        // so stack memory is bounded for any batch size. The event signals the last slice.
+        void Dispatch(Calc::Function* func, std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event **event) const;
+        // Fill the ranges of the scene buffers reserved for device meshes, OpenCL only
+        void CopyDeviceMeshes(World const& world, std::vector<int> const& vertices_start_idx,
+            std::vector<int> const& faces_start_idx);
+
         struct GpuData;
         struct ShapeData;
 
@@ -81,5 +108,11 @@ namespace RadeonRays
         std::unique_ptr<GpuData> m_gpudata;
         // Bvh data structure
         std::unique_ptr<Hlbvh> m_bvh;
+        // Build arrays reused across commits
+        BuildScratch m_scratch;
+        // Tree construction
+        Builder m_builder;
+        // Reference budget of the last build, 0 if faces were not presplit
+        float m_presplit_budget;
     };
 }
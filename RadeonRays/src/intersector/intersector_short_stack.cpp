@@ -25,22 +25,120 @@
 #include "executable.h"
 #include "../accelerator/bvh.h"
 #include "../accelerator/split_bvh.h"
+#include "../accelerator/linear_bvh.h"
+#include "../accelerator/presplit.h"
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
 #include "../world/world.h"
 
 #include "../translator/fatnode_bvh_translator.h"
+#include "../translator/half_bvh_translator.h"
+#include "../translator/quantized_bvh_translator.h"
+#include "../util/bvh_cache.h"
+#include "../util/sah_calibration.h"
 #include "../except/except.h"
 
 #include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
 
  // Preferred work group size for Radeon devices
 static int const kWorkGroupSize = 64;
 static int const kMaxStackSize = 48;
 static int const kMaxBatchSize = 1024 * 1024;
+// Number of work groups per compute unit the LDS stack should leave room for
+static int const kTargetGroupsPerComputeUnit = 16;
+// Number of rays and runs used to benchmark stack configurations and calibrate SAH costs
+static int const kNumTuneRays = 64 * 1024;
+static int const kNumTuneRuns = 3;
 
 namespace RadeonRays
 {
+    namespace
+    {
+        // Transform vertices of meshes followed by instances into world space
+        void GetWorldVertices(std::vector<Shape const*> const& shapes, int nummeshes,
+            std::vector<int> const& mesh_vertices_start_idx, std::vector<float3>& vertices)
+        {
+            int numshapes = static_cast<int>(shapes.size());
+
+#pragma omp parallel for
+            for (int i = 0; i < numshapes; ++i)
+            {
+                Mesh const* mesh = nullptr;
+                matrix m, minv;
+
+                // Instance is using its own transform for base shape geometry
+                if (i < nummeshes)
+                {
+                    mesh = static_cast<Mesh const*>(shapes[i]);
+                    mesh->GetTransform(m, minv);
+                }
+                else
+                {
+                    Instance const* instance = static_cast<Instance const*>(shapes[i]);
+                    mesh = static_cast<Mesh const*>(instance->GetBaseShape());
+                    instance->GetTransform(m, minv);
+                }
+
+
+                for (int j = 0; j < mesh->num_vertices(); ++j)
+                {
+                    vertices[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
+                }
+            }
+        }
+    }
+
+    struct IntersectorShortStack::StackConfig
+    {
+        // Work group size, LDS stack is interleaved across the group
+        int group_size;
+        // Number of LDS stack entries per work item
+        int short_stack_size;
+        // Number of global memory stack entries per work item
+        int global_stack_size;
+
+        StackConfig(int group, int short_stack)
+            : group_size(group)
+            , short_stack_size(short_stack)
+            // Each LDS overflow moves short_stack_size - 1 entries into a short_stack_size chunk of global memory,
+            // reserve enough chunks for any tree accepted by the kMaxStackSize height check
+            , global_stack_size(short_stack * std::max((kMaxStackSize - 1) / (short_stack - 1), 1))
+        {
+        }
+
+        bool operator == (StackConfig const& rhs) const
+        {
+            return group_size == rhs.group_size && short_stack_size == rhs.short_stack_size;
+        }
+    };
+
+    namespace
+    {
+        // Best work group and short stack sizes found by the autotuner keyed by device name
+        std::map<std::string, std::pair<int, int>> g_tuned_configs;
+        std::mutex g_tuned_configs_mutex;
+
+        // Incoherent rays starting within the bounds
+        void CreateTuneRays(bbox const& bounds, std::vector<ray>& rays)
+        {
+            std::minstd_rand rng(42);
+            std::uniform_real_distribution<float> dist(0.f, 1.f);
+            rays.resize(kNumTuneRays);
+            for (auto& r : rays)
+            {
+                float3 o = bounds.pmin + float3(dist(rng), dist(rng), dist(rng)) * bounds.extents();
+                float3 d = normalize(float3(dist(rng) - 0.5f, dist(rng) - 0.5f, dist(rng) - 0.5f));
+                r = ray(o, d);
+            }
+        }
+    }
+
     struct IntersectorShortStack::GpuData
     {
         // Device
@@ -49,77 +147,212 @@ namespace RadeonRays
         Calc::Buffer* bvh;
         // Vertex positions
         Calc::Buffer* vertices;
-        // Traversal stack
-        Calc::Buffer* stack;
+        // Traversal stacks, one per queue
+        std::vector<Calc::Buffer*> stacks;
 
         Calc::Executable* executable;
         Calc::Function* isect_func;
         Calc::Function* occlude_func;
+        // Bit packed occlusion and multi-hit variants, OpenCL only
+        Calc::Function* occlude_compact_func;
+        Calc::Function* isect_multi_func;
+        // Stack configuration the executable is compiled with
+        StackConfig config;
 
         GpuData(Calc::Device* d)
         : device(d)
                           , bvh(nullptr)
                           , vertices(nullptr)
-                          , stack(nullptr)
                           , executable(nullptr)
                           , isect_func(nullptr)
                           , occlude_func(nullptr)
+                          , occlude_compact_func(nullptr)
+                          , isect_multi_func(nullptr)
+                          , config(kWorkGroupSize, 16)
+        {
+        }
+
+        void ReleaseExecutable()
+        {
+            if (executable)
+            {
+                executable->DeleteFunction(isect_func);
+                executable->DeleteFunction(occlude_func);
+                if (occlude_compact_func)
+                {
+                    executable->DeleteFunction(occlude_compact_func);
+                    occlude_compact_func = nullptr;
+                }
+                if (isect_multi_func)
+                {
+                    executable->DeleteFunction(isect_multi_func);
+                    isect_multi_func = nullptr;
+                }
+                device->DeleteExecutable(executable);
+                executable = nullptr;
+            }
+        }
+
+        // Get traversal stack of the queue, reallocate if it is too small
+        Calc::Buffer* GetStack(std::uint32_t queueidx, std::size_t size)
         {
+            if (stacks.size() <= queueidx)
+            {
+                stacks.resize(queueidx + 1, nullptr);
+            }
+
+            auto& stack = stacks[queueidx];
+
+            if (!stack || stack->GetSize() < size)
+            {
+                if (stack)
+                {
+                    device->DeleteBuffer(stack);
+                }
+
+                stack = device->CreateBuffer(size, Calc::BufferType::kWrite);
+            }
+
+            return stack;
         }
 
         ~GpuData()
         {
             device->DeleteBuffer(bvh);
             device->DeleteBuffer(vertices);
-            device->DeleteBuffer(stack);
-            executable->DeleteFunction(isect_func);
-            executable->DeleteFunction(occlude_func);
-            device->DeleteExecutable(executable);
+            for (auto stack : stacks)
+            {
+                device->DeleteBuffer(stack);
+            }
+            ReleaseExecutable();
         }
     };
 
-    IntersectorShortStack::IntersectorShortStack(Calc::Device* device)
-        : Intersector(device)
+    IntersectorShortStack::IntersectorShortStack(Calc::Device* device, NodeFormat node_format, int formats)
+        : Intersector(device, formats)
         , m_gpudata(new GpuData(device))
         , m_bvh(nullptr)
+        , m_node_format(node_format)
     {
-        std::string buildopts =
-#ifdef RR_RAY_MASK
-            "-D RR_RAY_MASK ";
-#else
-            "";
-#endif
+        // Concurrent queries on other queues never resize the vector
+        m_gpudata->stacks.resize(m_num_queues, nullptr);
+
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+
+        // Vulkan kernels have fixed stack layout
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            std::pair<int, int> tuned;
+            if (FindTunedConfig(spec.name, tuned))
+            {
+                m_gpudata->config = StackConfig(tuned.first, tuned.second);
+            }
+            else
+            {
+                m_gpudata->config = GetDefaultConfig(spec);
+            }
+        }
+
+        Compile(m_gpudata->config);
+    }
+
+    IntersectorShortStack::StackConfig IntersectorShortStack::GetDefaultConfig(Calc::DeviceSpec const& spec)
+    {
+        // NVIDIA schedules 32-wide warps, larger groups only add LDS pressure
+        int group_size = (spec.vendor && std::strstr(spec.vendor, "NVIDIA")) ? 32 : kWorkGroupSize;
+
+        // Pick the largest power of two short stack leaving room for enough resident groups
+        std::size_t budget = spec.local_mem_size / (kTargetGroupsPerComputeUnit * group_size * sizeof(int));
+        int short_stack_size = 8;
+        while (short_stack_size * 2 <= 32 && static_cast<std::size_t>(short_stack_size * 2) <= budget)
+        {
+            short_stack_size *= 2;
+        }
+
+        return StackConfig(group_size, short_stack_size);
+    }
+
+    void IntersectorShortStack::Compile(StackConfig const& config)
+    {
+        m_gpudata->ReleaseExecutable();
+        m_gpudata->config = config;
+
+        std::string buildopts;
         
 #ifdef USE_SAFE_MATH
         buildopts.append("-D USE_SAFE_MATH ");
 #endif
 
+        buildopts.append(GetRecordFormatOptions(m_formats));
+
+        // Half nodes share the traversal with the quantized ones
+        if (m_node_format == kHalfNodes)
+        {
+            buildopts.append(" -D HALF_NODES ");
+        }
+
+        // Stack layout of Vulkan kernels is fixed
+        std::string stackopts =
+            " -D WAVEFRONT_SIZE=" + std::to_string(config.group_size) +
+            " -D SHORT_STACK_SIZE=" + std::to_string(config.short_stack_size) +
+            " -D GLOBAL_STACK_SIZE=" + std::to_string(config.global_stack_size);
+
 #ifndef RR_EMBED_KERNELS
-        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
         {
             char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
 
             int numheaders = sizeof(headers) / sizeof(char const*);
 
-            m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/intersect_bvh2_short_stack.cl", headers, numheaders, buildopts.c_str());
+            char const* kernel = m_node_format == kFullNodes ?
+                "../RadeonRays/src/kernels/CL/intersect_bvh2_short_stack.cl" :
+                "../RadeonRays/src/kernels/CL/intersect_bvh2_quantized_short_stack.cl";
+
+            m_gpudata->executable = m_device->CompileExecutable(kernel, headers, numheaders, (buildopts + stackopts).c_str());
         } 
         else
         {
-            assert(device->GetPlatform() == Calc::Platform::kVulkan);
-            m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/GLSL/fatbvh.comp", nullptr, 0, buildopts.c_str());
+            assert(m_device->GetPlatform() == Calc::Platform::kVulkan);
+
+            char const* kernel = m_node_format == kFullNodes ?
+                "../RadeonRays/src/kernels/GLSL/fatbvh.comp" :
+                "../RadeonRays/src/kernels/GLSL/fatbvh_q.comp";
+
+            m_gpudata->executable = m_device->CompileExecutable(kernel, nullptr, 0, buildopts.c_str());
         }
 #else
 #if USE_OPENCL
-        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
         {
-            m_gpudata->executable = m_device->CompileExecutable(g_intersect_bvh2_short_stack_opencl, std::strlen(g_intersect_bvh2_short_stack_opencl), buildopts.c_str());
+            char const* source = m_node_format == kFullNodes ?
+                g_intersect_bvh2_short_stack_opencl :
+                g_intersect_bvh2_quantized_short_stack_opencl;
+
+            m_gpudata->executable = m_device->CompileExecutable(source, std::strlen(source), (buildopts + stackopts).c_str());
         }
 #endif
 
 #if USE_VULKAN
-        if (m_gpudata->executable == nullptr && device->GetPlatform() == Calc::Platform::kVulkan)
+        if (m_gpudata->executable == nullptr && m_device->GetPlatform() == Calc::Platform::kVulkan)
         {
-            m_gpudata->executable = m_device->CompileExecutable(g_fatbvh_vulkan, std::strlen(g_fatbvh_vulkan), buildopts.c_str());
+#ifdef RR_EMBED_SPIRV
+            // Half nodes are selected by a define, so they are compiled from the source below
+            if (m_node_format == kQuantizedNodes)
+            {
+                m_gpudata->executable = m_device->CompileExecutable(g_fatbvh_q_spirv, sizeof(g_fatbvh_q_spirv), buildopts.c_str());
+            }
+            else if (m_node_format == kFullNodes)
+            {
+                m_gpudata->executable = m_device->CompileExecutable(g_fatbvh_spirv, sizeof(g_fatbvh_spirv), buildopts.c_str());
+            }
+#endif
+            if (m_gpudata->executable == nullptr)
+            {
+                char const* source = m_node_format == kFullNodes ? g_fatbvh_vulkan : g_fatbvh_q_vulkan;
+
+                m_gpudata->executable = m_device->CompileExecutable(source, std::strlen(source), buildopts.c_str());
+            }
         }
 #endif
 
@@ -127,18 +360,258 @@ namespace RadeonRays
 
         m_gpudata->isect_func = m_gpudata->executable->CreateFunction("intersect_main");
         m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("occluded_main");
+
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_gpudata->occlude_compact_func = m_gpudata->executable->CreateFunction("occluded_compact_main");
+            m_gpudata->isect_multi_func = m_gpudata->executable->CreateFunction("intersect_multi_main");
+        }
+    }
+
+    bool IntersectorShortStack::FindTunedConfig(std::string const& device_name, std::pair<int, int>& config)
+    {
+        std::lock_guard<std::mutex> lock(g_tuned_configs_mutex);
+        auto iter = g_tuned_configs.find(device_name);
+
+        if (iter == g_tuned_configs.cend())
+        {
+            return false;
+        }
+
+        config = iter->second;
+        return true;
+    }
+
+    void IntersectorShortStack::Autotune(std::vector<float3> const& vertices)
+    {
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+
+        std::pair<int, int> tuned;
+        if (FindTunedConfig(spec.name, tuned))
+        {
+            StackConfig config(tuned.first, tuned.second);
+            if (!(config == m_gpudata->config))
+            {
+                Compile(config);
+            }
+            return;
+        }
+
+        // Incoherent rays starting within the scene bounds
+        bbox bounds;
+        for (auto const& v : vertices)
+        {
+            bounds.grow(v);
+        }
+
+        std::vector<ray> rays;
+        CreateTuneRays(bounds, rays);
+
+        int numrays = kNumTuneRays;
+        auto ray_buffer = m_device->CreateBuffer(kNumTuneRays * sizeof(ray), Calc::BufferType::kRead, &rays[0]);
+        auto hit_buffer = m_device->CreateBuffer(kNumTuneRays * sizeof(Intersection), Calc::BufferType::kWrite);
+        auto numrays_buffer = m_device->CreateBuffer(sizeof(int), Calc::BufferType::kRead, &numrays);
+
+        // Candidates are limited by LDS and work group size
+        std::vector<StackConfig> candidates;
+        for (int group_size = 32; group_size <= kWorkGroupSize; group_size *= 2)
+        {
+            for (int short_stack_size = 8; short_stack_size <= 32; short_stack_size *= 2)
+            {
+                if (group_size <= static_cast<int>(spec.max_local_size) &&
+                    short_stack_size * group_size * sizeof(int) <= spec.local_mem_size)
+                {
+                    candidates.push_back(StackConfig(group_size, short_stack_size));
+                }
+            }
+        }
+
+        StackConfig best = m_gpudata->config;
+        auto best_time = std::chrono::high_resolution_clock::duration::max();
+
+        for (auto const& config : candidates)
+        {
+            Compile(config);
+
+            // Warm up, then measure
+            Dispatch(m_gpudata->isect_func, 0, ray_buffer, numrays_buffer, kNumTuneRays, hit_buffer, nullptr);
+            m_device->Finish(0);
+
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < kNumTuneRuns; ++i)
+            {
+                Dispatch(m_gpudata->isect_func, 0, ray_buffer, numrays_buffer, kNumTuneRays, hit_buffer, nullptr);
+            }
+            m_device->Finish(0);
+            auto time = std::chrono::high_resolution_clock::now() - start;
+
+            if (time < best_time)
+            {
+                best_time = time;
+                best = config;
+            }
+        }
+
+        m_device->DeleteBuffer(ray_buffer);
+        m_device->DeleteBuffer(hit_buffer);
+        m_device->DeleteBuffer(numrays_buffer);
+
+        if (!(best == m_gpudata->config))
+        {
+            Compile(best);
+        }
+
+        std::lock_guard<std::mutex> lock(g_tuned_configs_mutex);
+        g_tuned_configs[spec.name] = std::make_pair(best.group_size, best.short_stack_size);
+    }
+
+    float IntersectorShortStack::Calibrate(float fallback)
+    {
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+
+        // Node layouts differ in the cost of a node fetch
+        static char const* const layouts[] = { "full", "quantized", "half" };
+        std::string key = std::string(spec.name) + "/fatbvh_" + layouts[m_node_format];
+
+        float traversal_cost = fallback;
+        if (SahCalibration::Find(key, traversal_cost))
+        {
+            return traversal_cost;
+        }
+
+        bool const node_masks = (m_formats & kRayMask) && m_node_format == kFullNodes;
+
+        std::vector<ray> rays;
+        CreateTuneRays(bbox(float3(0.f, 0.f, 0.f), float3(1.f, 1.f, 1.f)), rays);
+
+        int numrays = kNumTuneRays;
+        auto ray_buffer = m_device->CreateBuffer(kNumTuneRays * sizeof(ray), Calc::BufferType::kRead, &rays[0]);
+        auto hit_buffer = m_device->CreateBuffer(kNumTuneRays * sizeof(Intersection), Calc::BufferType::kWrite);
+        auto numrays_buffer = m_device->CreateBuffer(sizeof(int), Calc::BufferType::kRead, &numrays);
+
+        float times[SahCalibration::kNumScenes];
+        float node_terms[SahCalibration::kNumScenes];
+        float prim_terms[SahCalibration::kNumScenes];
+
+        for (int scene = 0; scene < SahCalibration::kNumScenes; ++scene)
+        {
+            std::vector<float3> vertices;
+            std::vector<bbox> bounds;
+            SahCalibration::CreateScene(scene, vertices, bounds);
+
+            // Any reasonable tree works, the terms are taken from the tree itself
+            Bvh bvh(fallback, 64, true);
+            bvh.Build(&bounds[0], static_cast<int>(bounds.size()));
+            bvh.GetSahTerms(node_terms[scene], prim_terms[scene]);
+
+            std::vector<FatNodeBvhTranslator::Face> facedata(bvh.GetNumIndices());
+            int const* reordering = bvh.GetIndices();
+            for (std::size_t i = 0; i < facedata.size(); ++i)
+            {
+                int faceidx = reordering[i];
+                facedata[i].idx[0] = 3 * faceidx;
+                facedata[i].idx[1] = 3 * faceidx + 1;
+                facedata[i].idx[2] = 3 * faceidx + 2;
+                facedata[i].shapeidx = 0;
+                facedata[i].shape_mask = -1;
+                facedata[i].id = faceidx;
+            }
+
+            std::vector<char> nodedata;
+            TranslateNodes(bvh, &facedata[0], node_masks, false, nodedata);
+
+            // Traversal reads the scene buffers, which are not created yet
+            m_gpudata->bvh = m_device->CreateBuffer(nodedata.size(), Calc::BufferType::kRead, &nodedata[0]);
+            m_gpudata->vertices = m_device->CreateBuffer(vertices.size() * sizeof(float3), Calc::BufferType::kRead, &vertices[0]);
+
+            // Warm up, then measure
+            Dispatch(m_gpudata->isect_func, 0, ray_buffer, numrays_buffer, kNumTuneRays, hit_buffer, nullptr);
+            m_device->Finish(0);
+
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < kNumTuneRuns; ++i)
+            {
+                Dispatch(m_gpudata->isect_func, 0, ray_buffer, numrays_buffer, kNumTuneRays, hit_buffer, nullptr);
+            }
+            m_device->Finish(0);
+            times[scene] = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+            m_device->DeleteBuffer(m_gpudata->bvh);
+            m_device->DeleteBuffer(m_gpudata->vertices);
+            m_gpudata->bvh = m_gpudata->vertices = nullptr;
+        }
+
+        m_device->DeleteBuffer(ray_buffer);
+        m_device->DeleteBuffer(hit_buffer);
+        m_device->DeleteBuffer(numrays_buffer);
+
+        traversal_cost = SahCalibration::Solve(times, node_terms, prim_terms, fallback);
+        SahCalibration::Store(key, traversal_cost);
+        return traversal_cost;
+    }
+
+    void IntersectorShortStack::TranslateNodes(Bvh& bvh, FatNodeBvhTranslator::Face const* faces, bool node_masks, bool veb_layout, std::vector<char>& nodedata) const
+    {
+        if (m_node_format == kQuantizedNodes)
+        {
+            QuantizedBvhTranslator translator;
+            translator.Process(bvh);
+            translator.InjectIndices(faces);
+
+            auto begin = reinterpret_cast<char const*>(&translator.nodes_[0]);
+            nodedata.assign(begin, begin + translator.nodes_.size() * sizeof(QuantizedBvhTranslator::Node));
+        }
+        else if (m_node_format == kHalfNodes)
+        {
+            HalfBvhTranslator translator;
+            translator.Process(bvh);
+            translator.InjectIndices(faces);
+
+            auto begin = reinterpret_cast<char const*>(&translator.nodes_[0]);
+            nodedata.assign(begin, begin + translator.nodes_.size() * sizeof(HalfBvhTranslator::Node));
+        }
+        else
+        {
+            // Nodes are written straight into the upload source
+            nodedata.resize(bvh.GetNumNodes() * sizeof(FatNodeBvhTranslator::Node));
+
+            FatNodeBvhTranslator translator;
+            translator.ProcessInto(bvh, reinterpret_cast<FatNodeBvhTranslator::Node*>(&nodedata[0]), faces);
+
+            if (node_masks)
+            {
+                translator.PropagateMasks();
+            }
+
+            if (veb_layout)
+            {
+                translator.ReorderVanEmdeBoas();
+            }
+        }
     }
 
     void IntersectorShortStack::Process(World const& world)
     {
+        // If only transforms or vertex positions have changed the topology is still valid, so just refit the bounds
+        // unless the host copy of the nodes has been dropped
+        int statechange = world.GetStateChange();
+        if (m_gpudata->bvh && !m_nodedata.empty() && !world.has_changed() && !BvhSettingsChanged(world) && statechange != ShapeImpl::kStateChangeNone &&
+            (statechange & ~(ShapeImpl::kStateChangeTransform | ShapeImpl::kStateChangeGeometry)) == 0)
+        {
+            Refit(world);
+            return;
+        }
 
         // If something has been changed we need to rebuild BVH
-        if (!m_bvh || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
+        if (!m_gpudata->bvh || world.has_changed() || BvhSettingsChanged(world) || statechange != ShapeImpl::kStateChangeNone)
         {
-            if (m_bvh)
+            if (m_gpudata->bvh)
             {
                 m_device->DeleteBuffer(m_gpudata->bvh);
                 m_device->DeleteBuffer(m_gpudata->vertices);
+                m_gpudata->bvh = m_gpudata->vertices = nullptr;
             }
 
             // Check if we can allocate enough stack memory
@@ -157,37 +630,26 @@ namespace RadeonRays
             std::vector<int> mesh_vertices_start_idx(numshapes);
             std::vector<int> mesh_faces_start_idx(numshapes);
 
-            auto builder = world.options_.GetOption("bvh.builder");
-            auto splits = world.options_.GetOption("bvh.sah.use_splits");
-            auto maxdepth = world.options_.GetOption("bvh.sah.max_split_depth");
-            auto overlap = world.options_.GetOption("bvh.sah.min_overlap");
-            auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
-            auto node_budget = world.options_.GetOption("bvh.sah.extra_node_budget");
-            auto nbins = world.options_.GetOption("bvh.sah.num_bins");
-
-            bool use_sah = false;
-            bool use_splits = false;
-            int max_split_depth = maxdepth ? (int)maxdepth->AsFloat() : 10;
-            int num_bins = nbins ? (int)nbins->AsFloat() : 64;
-            float min_overlap = overlap ? overlap->AsFloat() : 0.05f;
-            float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
-            float extra_node_budget = node_budget ? node_budget->AsFloat() : 0.5f;
-
-            if (builder && builder->AsString() == "sah")
-            {
-                use_sah = true;
-            }
+            // Build settings are resolved when the options are set
+            auto const& settings = world.options_.GetBvhSettings();
 
-            if (splits && splits->AsFloat() > 0.f)
+            // Trees are tuned to the costs of the device kernels if requested, calibration runs once per device
+            float traversal_cost = settings.traversal_cost;
+            if (settings.calibrate && m_device->GetPlatform() == Calc::Platform::kOpenCL)
             {
-                use_splits = true;
+                traversal_cost = Calibrate(settings.traversal_cost);
             }
 
-            m_bvh.reset(use_splits ?
-                new SplitBvh(traversal_cost, num_bins, max_split_depth, min_overlap, extra_node_budget) :
-                new Bvh(traversal_cost, num_bins, use_sah)
+            m_bvh.reset(settings.use_splits ?
+                new SplitBvh(traversal_cost, settings.num_bins, settings.max_split_depth, settings.min_overlap, settings.extra_node_budget) :
+                settings.use_lbvh ? new LinearBvh(traversal_cost, settings.num_bins) :
+                new Bvh(traversal_cost, settings.num_bins, settings.use_sah)
             );
 
+            // Centroids and indices are reused across commits, the monitor of the commit can cancel the build
+            m_bvh->SetScratch(&m_scratch);
+            m_bvh->SetMonitor(world.monitor_.get());
+
             // Partition the array into meshes and instances
             std::vector<Shape const*> shapes(world.shapes_);
 
@@ -225,125 +687,105 @@ namespace RadeonRays
                 numvertices += mesh->num_vertices();
             }
 
+            // Internal nodes carry subtree masks, GLSL kernels keep child addresses in that slot
+            bool const node_masks = (m_formats & kRayMask) && m_node_format == kFullNodes &&
+                m_device->GetPlatform() == Calc::Platform::kOpenCL;
 
-            // We can't avoild allocating it here, since bounds aren't stored anywhere
-            std::vector<bbox> bounds(numfaces);
+            // Try to fetch translated nodes from the on-disk cache
+            auto cachepath = world.options_.GetOption("bvh.cache.path");
+            std::unique_ptr<BvhCache> cache;
+            std::uint64_t cachekey = 0;
 
-            // We handle meshes first collecting their world space bounds
-#pragma omp parallel for
-            for (int i = 0; i < nummeshes; ++i)
-            {
-                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+            // Translated nodes, layout depends on the node type
+            std::vector<char> nodedata;
+            bool cached = false;
 
-                for (int j = 0; j < mesh->num_faces(); ++j)
+            if (cachepath && !cachepath->AsString().empty())
+            {
+                cache.reset(new BvhCache(cachepath->AsString()));
+                char const* layout = node_masks ? "fatbvh_masked_anyhit" : "fatbvh_anyhit";
+                if (m_node_format == kQuantizedNodes)
                 {
-                    // Here we directly get world space bounds
-                    mesh->GetFaceBounds(j, false, bounds[mesh_faces_start_idx[i] + j]);
+                    layout = "fatbvh_q_anyhit";
                 }
-            }
-
-            // Then we handle instances. Need to flatten them into actual geometry.
-#pragma omp parallel for
-            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
-            {
-                Instance const* instance = static_cast<Instance const*>(shapes[i]);
-                Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
-
-                // Instance is using its own transform for base shape geometry
-                // so we need to get object space bounds and transform them manually
-                matrix m, minv;
-                instance->GetTransform(m, minv);
-
-                for (int j = 0; j < mesh->num_faces(); ++j)
+                else if (m_node_format == kHalfNodes)
                 {
-                    bbox tmp;
-                    mesh->GetFaceBounds(j, true, tmp);
-                    bounds[mesh_faces_start_idx[i] + j] = transform_bbox(tmp, m);
+                    layout = "fatbvh_h_anyhit";
                 }
-            }
 
-            m_bvh->Build(&bounds[0], numfaces);
+                // Calibrated trees differ between devices
+                std::string tag = layout;
+                if (settings.calibrate)
+                {
+                    Calc::DeviceSpec spec;
+                    m_device->GetSpec(spec);
+                    tag = tag + "_" + spec.name;
+                }
 
-#ifdef RR_PROFILE
-            m_bvh->PrintStatistics(std::cout);
-#endif
+                cachekey = BvhCache::ComputeKey(world, tag);
 
-            // Check if the tree height is reasonable
-            if (m_bvh->GetHeight() >= kMaxStackSize)
-            {
-                m_bvh.reset(nullptr);
-                throw ExceptionImpl("fatbvh accelerator can cause stack overflow for this scene, try using bvh instead");
+                BvhCache::Entry entry;
+                cached = cache->Load(cachekey, entry) &&
+                    entry.ReadArray(nodedata) &&
+                    !nodedata.empty();
             }
 
-            FatNodeBvhTranslator translator;
-            translator.Process(*m_bvh);
-
-            // Update GPU data
-
-            // Create vertex buffer
+            if (!cached)
             {
-                // Vertices
-                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
-
-                // Get the pointer to mapped data
-                float3* vertexdata = nullptr;
-                Calc::Event* e = nullptr;
-
-                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
-
-                e->Wait();
-                m_device->DeleteEvent(e);
+                // Face bounds are kept across commits, so they are allocated only when the scene grows
+                host_vector<bbox>& bounds = m_scratch.bounds;
+                bounds.resize(numfaces);
 
-                // Here we need to put data in world space rather than object space
-                // So we need to get the transform from the mesh and multiply each vertex
-                matrix m, minv;
-
-#pragma omp parallel for
+                // We handle meshes first collecting their world space bounds
                 for (int i = 0; i < nummeshes; ++i)
                 {
-                    // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
-                    // Get mesh transform
-                    mesh->GetTransform(m, minv);
 
-                    //#pragma omp parallel for
-                    // Iterate thru vertices multiply and append them to GPU buffer
-                    for (int j = 0; j < mesh->num_vertices(); ++j)
-                    {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
-                    }
+                    // Here we directly get world space bounds, faces are processed in parallel
+                    matrix m, minv;
+                    mesh->GetTransform(m, minv);
+                    mesh->ComputeAllFaceBounds(m, &bounds[mesh_faces_start_idx[i]]);
                 }
 
-#pragma omp parallel for
+                // Then we handle instances. Need to flatten them into actual geometry.
                 for (int i = nummeshes; i < nummeshes + numinstances; ++i)
                 {
                     Instance const* instance = static_cast<Instance const*>(shapes[i]);
-                    // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
-                    // Get mesh transform
+
+                    // Instance is using its own transform for base shape geometry
+                    // so base mesh vertices are transformed by it directly
+                    matrix m, minv;
                     instance->GetTransform(m, minv);
+                    mesh->ComputeAllFaceBounds(m, &bounds[mesh_faces_start_idx[i]]);
+                }
 
-                    //#pragma omp parallel for
-                    // Iterate thru vertices multiply and append them to GPU buffer
-                    for (int j = 0; j < mesh->num_vertices(); ++j)
-                    {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
-                    }
+                // Large faces are split into several references clipped to them, spatial splits do that during the build
+                if (settings.presplit_budget > 0.f && !settings.use_splits)
+                {
+                    std::vector<bbox> refbounds;
+                    std::vector<int> refprims;
+                    PresplitFaces(shapes, mesh_faces_start_idx, &bounds[0], numfaces, settings.presplit_budget, refbounds, refprims);
+                    m_bvh->Build(refbounds.data(), (int)refbounds.size(), refprims.data(), numfaces);
+                }
+                else
+                {
+                    m_bvh->Build(&bounds[0], numfaces);
                 }
 
-                m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
-                e->Wait();
-                m_device->DeleteEvent(e);
-            }
+#ifdef RR_PROFILE
+                m_bvh->PrintStatistics(std::cout);
+#endif
+                m_bvh->GetStats(m_stats);
 
-            // Create face buffer
-            {
-                
-                // This number is different from the number of faces for some BVHs 
+                // Check if the tree height is reasonable
+                if (m_bvh->GetHeight() >= kMaxStackSize)
+                {
+                    m_bvh.reset(nullptr);
+                    throw ExceptionImpl("fatbvh accelerator can cause stack overflow for this scene, try using bvh instead");
+                }
+
+                // This number is different from the number of faces for some BVHs
                 auto numindices = m_bvh->GetNumIndices();
                 std::vector<FatNodeBvhTranslator::Face> facedata(numindices);
 
@@ -373,92 +815,214 @@ namespace RadeonRays
                         mesh = static_cast<Mesh const*>(static_cast<Instance const*>(shapes[shapeidx])->GetBaseShape());
                     }
 
-                    // Get vertex buffer of the current mesh
-                    Mesh::Face const* myfacedata = mesh->GetFaceData();
                     // Find face idx
                     int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
+                    // Get vertex indices of the face
+                    Mesh::Face const face = mesh->GetFace(faceidx);
                     // Find mesh start idx
                     int mystartidx = mesh_vertices_start_idx[shapeidx];
 
                     // Copy face data to GPU buffer
-                    facedata[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
-                    facedata[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
-                    facedata[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
+                    facedata[i].idx[0] = face.idx[0] + mystartidx;
+                    facedata[i].idx[1] = face.idx[1] + mystartidx;
+                    facedata[i].idx[2] = face.idx[2] + mystartidx;
 
                     facedata[i].shapeidx = shapes[shapeidx]->GetId();
                     facedata[i].shape_mask = shapes[shapeidx]->GetMask();
                     facedata[i].id = faceidx;
                 }
 
-                translator.InjectIndices(&facedata[0]);
+                // Translate nodes
+                TranslateNodes(*m_bvh, &facedata[0], node_masks, settings.use_veb_layout, nodedata);
+
+                if (cache)
+                {
+                    BvhCache::Entry entry;
+                    entry.WriteArray(nodedata);
+                    cache->Save(cachekey, entry);
+                }
+            }
+
+            // A cancelled commit stops before touching the device
+            CheckCancelled(world);
+
+            // Update GPU data
+            // Copy translated nodes first, without host copies the upload owns them
+            // and any change rebuilds from the world
+            bool keep_host_copies = KeepHostCopies(world);
+            m_gpudata->bvh = CreateSceneBuffer(nodedata.size());
+            if (keep_host_copies)
+            {
+                Upload(m_gpudata->bvh, nodedata.size(), &nodedata[0]);
+            }
+            else
+            {
+                Upload(m_gpudata->bvh, std::move(nodedata));
+                m_bvh.reset();
+                m_scratch.Release();
             }
 
-            // Copy translated nodes first
-            m_gpudata->bvh = m_device->CreateBuffer(translator.nodes_.size() * sizeof(FatNodeBvhTranslator::Node), Calc::BufferType::kRead, &translator.nodes_[0]);
+            // Create vertex buffer
+            {
+                // Here we need to put data in world space rather than object space
+                std::vector<float3> vertices(numvertices);
+                GetWorldVertices(shapes, nummeshes, mesh_vertices_start_idx, vertices);
+
+                m_gpudata->vertices = CreateSceneBuffer(numvertices * sizeof(float3));
 
-            // Stack
-            m_gpudata->stack = m_device->CreateBuffer(kMaxBatchSize*kMaxStackSize, Calc::BufferType::kWrite);
+                // Pick the fastest stack configuration for the device, runs once per device
+                auto autotune = world.options_.GetOption("acc.shortstack.autotune");
+                if (autotune && autotune->AsFloat() > 0.f && m_device->GetPlatform() == Calc::Platform::kOpenCL)
+                {
+                    Upload(m_gpudata->vertices, numvertices * sizeof(float3), &vertices[0]);
+                    WaitForUploads();
+                    Autotune(vertices);
+                }
+                else
+                {
+                    Upload(m_gpudata->vertices, std::move(vertices));
+                }
+            }
 
-            // Make sure everything is commited
-            m_device->Finish(0);
+            // Keep host copy of the nodes for refitting, the swap keeps
+            // the storage the pending upload reads from, it is empty without host copies
+            m_nodedata.swap(nodedata);
+
+            // Stack
+            m_gpudata->GetStack(0, kMaxBatchSize*kMaxStackSize);
         }
     }
 
-    void IntersectorShortStack::Intersect(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    void IntersectorShortStack::Refit(World const& world)
     {
-        size_t stack_size = 4 * maxrays * kMaxStackSize; //required stack size, kMaxStackSize * sizeof(int) bytes per ray
-        // Check if we need to relocate memory
-        if (stack_size > m_gpudata->stack->GetSize())
+        // Partition the array into meshes and instances, the order is the same as for the build
+        std::vector<Shape const*> shapes(world.shapes_);
+
+        auto firstinst = std::partition(shapes.begin(), shapes.end(),
+            [&](Shape const* shape)
+        {
+            return !static_cast<ShapeImpl const*>(shape)->is_instance();
+        });
+
+        int nummeshes = (int)std::distance(shapes.begin(), firstinst);
+        int numshapes = (int)shapes.size();
+        int numvertices = 0;
+
+        std::vector<int> mesh_vertices_start_idx(numshapes);
+
+        for (int i = 0; i < numshapes; ++i)
         {
-            m_device->DeleteBuffer(m_gpudata->stack);
-            m_gpudata->stack = nullptr;
-            m_gpudata->stack = m_device->CreateBuffer(stack_size, Calc::BufferType::kWrite);
+            Mesh const* mesh = i < nummeshes ?
+                static_cast<Mesh const*>(shapes[i]) :
+                static_cast<Mesh const*>(static_cast<Instance const*>(shapes[i])->GetBaseShape());
+
+            mesh_vertices_start_idx[i] = numvertices;
+            numvertices += mesh->num_vertices();
         }
 
-        auto& func = m_gpudata->isect_func;
+        std::vector<float3> vertices(numvertices);
+        GetWorldVertices(shapes, nummeshes, mesh_vertices_start_idx, vertices);
 
-        // Set args
-        int arg = 0;
+        if (m_node_format == kQuantizedNodes)
+        {
+            int numnodes = static_cast<int>(m_nodedata.size() / sizeof(QuantizedBvhTranslator::Node));
+            QuantizedBvhTranslator::Refit(reinterpret_cast<QuantizedBvhTranslator::Node*>(&m_nodedata[0]), numnodes, &vertices[0]);
+        }
+        else if (m_node_format == kHalfNodes)
+        {
+            int numnodes = static_cast<int>(m_nodedata.size() / sizeof(HalfBvhTranslator::Node));
+            HalfBvhTranslator::Refit(reinterpret_cast<HalfBvhTranslator::Node*>(&m_nodedata[0]), numnodes, &vertices[0]);
+        }
+        else
+        {
+            int numnodes = static_cast<int>(m_nodedata.size() / sizeof(FatNodeBvhTranslator::Node));
+            FatNodeBvhTranslator::Refit(reinterpret_cast<FatNodeBvhTranslator::Node*>(&m_nodedata[0]), numnodes, &vertices[0]);
+        }
 
-        func->SetArg(arg++, m_gpudata->bvh);
-        func->SetArg(arg++, m_gpudata->vertices);
-        func->SetArg(arg++, rays);
-        func->SetArg(arg++, numrays);
-        func->SetArg(arg++, m_gpudata->stack);
-        func->SetArg(arg++, hits);
+        // Buffer sizes are the same, just update the contents
+        Calc::Event* e = nullptr;
+        m_device->WriteBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), &vertices[0], &e);
+        e->Wait();
+        m_device->DeleteEvent(e);
 
-        size_t localsize = kWorkGroupSize;
-        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        m_device->WriteBuffer(m_gpudata->bvh, 0, 0, m_nodedata.size(), &m_nodedata[0], &e);
+        e->Wait();
+        m_device->DeleteEvent(e);
+    }
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    void IntersectorShortStack::GetMemoryStats(AccelStats& stats) const
+    {
+        stats.node_memory = GetBufferSize(m_gpudata->bvh);
+        stats.vertex_memory = GetBufferSize(m_gpudata->vertices);
+        stats.face_memory = 0;
+        stats.other_memory = 0;
+        for (auto stack : m_gpudata->stacks)
+        {
+            stats.other_memory += GetBufferSize(stack);
+        }
+    }
+
+    void IntersectorShortStack::Intersect(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        Dispatch(m_gpudata->isect_func, queueidx, rays, numrays, maxrays, hits, event);
     }
 
     void IntersectorShortStack::Occluded(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
     {
-        size_t stack_size = 4 * maxrays * kMaxStackSize; //required stack size, kMaxStackSize * sizeof(int) bytes per ray
-        // Check if we need to relocate memory
-        if (stack_size > m_gpudata->stack->GetSize())
+        Dispatch(m_gpudata->occlude_func, queueidx, rays, numrays, maxrays, hits, event);
+    }
+
+    void IntersectorShortStack::OccludedCompact(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        Dispatch(m_gpudata->occlude_compact_func, queueidx, rays, numrays, maxrays, hits, event);
+    }
+
+    void IntersectorShortStack::IntersectMulti(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, int k, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        Dispatch(m_gpudata->isect_multi_func, queueidx, rays, numrays, maxrays, hits, event, k);
+    }
+
+    void IntersectorShortStack::Dispatch(Calc::Function* func, std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event** event, int k) const
+    {
+        auto const& config = m_gpudata->config;
+        std::uint32_t slice_size = std::min<std::uint32_t>(maxrays, kMaxBatchSize);
+        // Work groups are rounded up, so the stack covers whole groups
+        std::uint32_t stack_rays = ((slice_size + config.group_size - 1) / config.group_size) * config.group_size;
+        size_t stack_size = stack_rays * config.global_stack_size * sizeof(int);
+        // Queries on different queues may run concurrently, so each queue has its own stack
+        auto stack = m_gpudata->GetStack(queueidx, stack_size);
+
+        // Slices run in order on the queue, so they can share the stack
+        for (std::uint32_t offset = 0; offset < maxrays; offset += slice_size)
         {
-            m_device->DeleteBuffer(m_gpudata->stack);
-            m_gpudata->stack = nullptr;
-            m_gpudata->stack = m_device->CreateBuffer(stack_size, Calc::BufferType::kWrite);
-        }
+            std::uint32_t count = std::min(slice_size, maxrays - offset);
+            int slice_offset = static_cast<int>(offset);
 
-        auto& func = m_gpudata->occlude_func;
+            // Set args
+            int arg = 0;
 
-       // Set args
-        int arg = 0;
+            func->SetArg(arg++, m_gpudata->bvh);
+            func->SetArg(arg++, m_gpudata->vertices);
+            func->SetArg(arg++, rays);
+            func->SetArg(arg++, numrays);
+            func->SetArg(arg++, sizeof(int), &slice_offset);
+            func->SetArg(arg++, stack);
+            func->SetArg(arg++, hits);
 
-        func->SetArg(arg++, m_gpudata->bvh);
-        func->SetArg(arg++, m_gpudata->vertices);
-        func->SetArg(arg++, rays);
-        func->SetArg(arg++, numrays);
-        func->SetArg(arg++, m_gpudata->stack);
-        func->SetArg(arg++, hits);
+            if (func == m_gpudata->isect_func)
+            {
+                SetTraversalStatsArg(func, arg, queueidx, maxrays);
+            }
 
-        size_t localsize = kWorkGroupSize;
-        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+            if (k > 0)
+            {
+                func->SetArg(arg++, sizeof(int), &k);
+            }
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+            size_t localsize = config.group_size;
+            size_t globalsize = ((count + config.group_size - 1) / config.group_size) * config.group_size;
+
+            Execute(func, queueidx, globalsize, localsize, offset + count >= maxrays ? event : nullptr, "fatbvh.traversal");
+        }
     }
 }
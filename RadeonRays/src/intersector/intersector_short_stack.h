@@ -77,13 +77,25 @@ THE SOFTWARE.
     Cons:
         -Depth is limited.
         -Generates LDS traffic.
+
+    Optionally nodes can be stored with quantized child bounds
+    (see QuantizedBvhTranslator) or half float ones (see HalfBvhTranslator)
+    halving the memory footprint at the cost of few extra ALU operations per node.
+
+    If only shape transforms or vertex positions have changed since the last commit, the tree
+    is refitted on the host keeping its topology instead of being rebuilt.
  */
 #pragma once
 
 #include "calc.h"
 #include "device.h"
 #include "intersector.h"
+#include "../translator/fatnode_bvh_translator.h"
+#include "../util/build_scratch.h"
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
 
 namespace RadeonRays
@@ -96,8 +108,20 @@ namespace RadeonRays
     class IntersectorShortStack : public Intersector
     {
     public:
-        // Constructor
-        IntersectorShortStack(Calc::Device* device);
+        // Layout of the child bounds in the nodes
+        enum NodeFormat
+        {
+            // Full precision bounds, 64 byte nodes
+            kFullNodes,
+            // 8-bit offsets on a per node grid, 32 byte nodes
+            kQuantizedNodes,
+            // Half floats rounded outwards, 32 byte nodes
+            kHalfNodes
+        };
+
+        // Constructor, node_format selects node layout,
+        // formats selects record layouts, see RecordFormat
+        IntersectorShortStack(Calc::Device* device, NodeFormat node_format = kFullNodes, int formats = kFullRecords);
 
     private:
         // World preprocessing implementation
@@ -110,14 +134,55 @@ namespace RadeonRays
         void Occluded(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
             std::uint32_t max_rays, Calc::Buffer *hits, 
             Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Bit packed occlusion implementation
+        void OccludedCompact(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
+            std::uint32_t max_rays, Calc::Buffer *hits, 
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        bool SupportsCompactOcclusion() const override { return true; }
+        // Multi-hit intersection implementation
+        void IntersectMulti(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
+            std::uint32_t max_rays, int k, Calc::Buffer *hits, 
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Device memory of the acceleration structure
+        void GetMemoryStats(AccelStats& stats) const override;
 
     private:
+        // Recompute node bounds for the new transforms without rebuilding the tree
+        void Refit(World const& world);
+        // Launch the kernel in slices of at most kMaxBatchSize rays back to back on the queue,
+        // so stack memory is bounded for any batch size. The event signals the last slice.
+        // Non-zero k is passed to multi-hit kernels after the hits.
+        void Dispatch(Calc::Function* func, std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event **event, int k = 0) const;
+
+        struct StackConfig;
         struct GpuData;
 
+        // Stack configuration derived from LDS size and vendor
+        static StackConfig GetDefaultConfig(Calc::DeviceSpec const& spec);
+        // Find configuration tuned for the device earlier, returns false if there is none
+        static bool FindTunedConfig(std::string const& device_name, std::pair<int, int>& config);
+        // (Re)compile kernels with the stack configuration
+        void Compile(StackConfig const& config);
+        // Benchmark candidate configurations with incoherent rays and switch to the fastest,
+        // the result is cached per device name for the lifetime of the process
+        void Autotune(std::vector<float3> const& vertices);
+        // Measure the traversal cost relative to a triangle test on synthetic scenes, see SahCalibration,
+        // fallback is returned if the measurements don't fit, the result is cached per device and node layout
+        float Calibrate(float fallback);
+        // Translate the tree into the node layout, faces are in the order of the tree indices
+        void TranslateNodes(Bvh& bvh, FatNodeBvhTranslator::Face const* faces, bool node_masks, bool veb_layout, std::vector<char>& nodedata) const;
+
         // Implementation data
         std::unique_ptr<GpuData> m_gpudata;
         // Bvh data structure
         std::unique_ptr<Bvh> m_bvh;
+        // Build arrays reused across commits
+        BuildScratch m_scratch;
+        // Layout of the child bounds in the nodes
+        NodeFormat m_node_format;
+        // Host copy of translated nodes used for refitting
+        std::vector<char> m_nodedata;
     };
 }
 
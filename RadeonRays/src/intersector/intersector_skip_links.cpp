@@ -23,11 +23,15 @@ THE SOFTWARE.
 
 #include "../accelerator/bvh.h"
 #include "../accelerator/split_bvh.h"
+#include "../accelerator/linear_bvh.h"
+#include "../accelerator/presplit.h"
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
+#include "../primitive/spheres.h"
 #include "../world/world.h"
 
 #include "../translator/plain_bvh_translator.h"
+#include "../util/bvh_cache.h"
 
 #include "device.h"
 #include "executable.h"
@@ -35,9 +39,33 @@ THE SOFTWARE.
 
 // Preferred work group size for Radeon devices
 static int const kWorkGroupSize = 64;
+// Number of persistent work groups launched per compute unit
+static int const kGroupsPerComputeUnit = 8;
+// Compute unit count assumed when the device does not report it
+static int const kDefaultComputeUnits = 16;
+// Largest SAH leaf allowed by "bvh.sah.max_leaf_prims"
+static int const kMaxLeafPrims = 8;
 
 namespace RadeonRays
 {
+    namespace
+    {
+        struct Face
+        {
+            // Up to 3 indices
+            int idx[3];
+            // Shape maks
+            int shape_mask;
+            // Shape ID
+            int shape_id;
+            // Primitive ID
+            int prim_id;
+        };
+
+        // Sphere faces keep this in idx[1], idx[0] is the vertex holding the center and radius in w
+        int const kSphereFace = -1;
+    }
+
     struct IntersectorSkipLinks::GpuData
     {
         // Device
@@ -48,49 +76,165 @@ namespace RadeonRays
         Calc::Buffer* vertices;
         // Indices
         Calc::Buffer* faces;
+        // First child and skip link per node for each direction octant, kOctantLinks only
+        Calc::Buffer* links;
+        // Number of nodes, octant links are numnodes apart
+        int numnodes;
+        // Number of faces, cached occluders past it are ignored
+        int numfaces;
+        // Vertex attributes in the order of the vertices, a single zero attribute if no mesh has any
+        Calc::Buffer* attributes;
+        // Number of attributes per vertex
+        int num_attributes;
 
         Calc::Executable* executable;
         Calc::Function* isect_func;
         Calc::Function* occlude_func;
+        // Persistent threads variants, OpenCL only
+        Calc::Function* isect_persistent_func;
+        Calc::Function* occlude_persistent_func;
+        // Bit packed occlusion variants, OpenCL only
+        Calc::Function* occlude_compact_func;
+        Calc::Function* occlude_persistent_compact_func;
+        // Packet traversal of coherent rays, OpenCL without octant links only
+        Calc::Function* isect_packet_func;
+        // Traversal interpolating vertex attributes of the hits, OpenCL only
+        Calc::Function* isect_attributes_func;
+        // Occlusion testing the last occluder of the ray first, OpenCL only
+        Calc::Function* occlude_cached_func;
+        // Box overlap traversal, OpenCL only
+        Calc::Function* overlap_func;
+        // Closest point traversal, OpenCL only
+        Calc::Function* closest_point_func;
+
+        // Ray counters of persistent launches, one per queue
+        std::vector<Calc::Buffer*> counters;
+        // Source of counter resets, has to outlive asynchronous writes
+        int zero;
+        // Use persistent threads traversal
+        bool persistent;
+        // Number of work items of a persistent launch
+        std::uint32_t persistent_size;
 
         GpuData(Calc::Device* d)
             : device(d)
             , bvh(nullptr)
             , vertices(nullptr)
             , faces(nullptr)
+            , links(nullptr)
+            , numnodes(0)
+            , numfaces(0)
+            , attributes(nullptr)
+            , num_attributes(0)
             , executable(nullptr)
+            , isect_persistent_func(nullptr)
+            , occlude_persistent_func(nullptr)
+            , occlude_compact_func(nullptr)
+            , occlude_persistent_compact_func(nullptr)
+            , isect_packet_func(nullptr)
+            , isect_attributes_func(nullptr)
+            , occlude_cached_func(nullptr)
+            , overlap_func(nullptr)
+            , closest_point_func(nullptr)
+            , zero(0)
+            , persistent(false)
+            , persistent_size(0)
         {
         }
 
+        // Get ray counter of the queue
+        Calc::Buffer* GetCounter(std::uint32_t queueidx)
+        {
+            if (counters.size() <= queueidx)
+            {
+                counters.resize(queueidx + 1, nullptr);
+            }
+
+            auto& counter = counters[queueidx];
+
+            if (!counter)
+            {
+                counter = device->CreateBuffer(sizeof(int), Calc::BufferType::kWrite);
+            }
+
+            return counter;
+        }
+
         ~GpuData()
         {
             device->DeleteBuffer(bvh);
             device->DeleteBuffer(vertices);
             device->DeleteBuffer(faces);
+            if (links)
+            {
+                device->DeleteBuffer(links);
+            }
+            if (attributes)
+            {
+                device->DeleteBuffer(attributes);
+            }
+            for (auto counter : counters)
+            {
+                if (counter)
+                {
+                    device->DeleteBuffer(counter);
+                }
+            }
             if (executable)
             {
                 executable->DeleteFunction(isect_func);
                 executable->DeleteFunction(occlude_func);
+                if (isect_persistent_func)
+                {
+                    executable->DeleteFunction(isect_persistent_func);
+                    executable->DeleteFunction(occlude_persistent_func);
+                    executable->DeleteFunction(occlude_compact_func);
+                    executable->DeleteFunction(occlude_persistent_compact_func);
+                    executable->DeleteFunction(isect_attributes_func);
+                    executable->DeleteFunction(occlude_cached_func);
+                    executable->DeleteFunction(overlap_func);
+                    executable->DeleteFunction(closest_point_func);
+                }
+                if (isect_packet_func)
+                {
+                    executable->DeleteFunction(isect_packet_func);
+                }
                 device->DeleteExecutable(executable);
             }
         }
     };
 
-    IntersectorSkipLinks::IntersectorSkipLinks(Calc::Device* device)
-        : Intersector(device)
+    struct IntersectorSkipLinks::CpuData
+    {
+        // Host copy of the face buffer
+        std::vector<Face> faces;
+        // Index of the shape each of the faces belongs to
+        std::vector<int> face_shapeidx;
+        // First vertex of each of the shapes and the number of vertices
+        std::vector<int> vertex_starts;
+        int numvertices;
+        // Shapes partitioned into meshes followed by instances
+        std::vector<Shape const*> shapes;
+    };
+
+    IntersectorSkipLinks::IntersectorSkipLinks(Calc::Device* device, int formats)
+        : Intersector(device, formats)
         , m_gpudata(new GpuData(device))
+        , m_cpudata(new CpuData)
         , m_bvh(nullptr)
     {
-        std::string buildopts =
-#ifdef RR_RAY_MASK
-            "-D RR_RAY_MASK ";
-#else
-            "";
-#endif
+        m_cpudata->numvertices = 0;
+
+        // Concurrent queries on other queues never resize the vector
+        m_gpudata->counters.resize(m_num_queues, nullptr);
+
+        std::string buildopts;
 
 #ifdef USE_SAFE_MATH
         buildopts.append("-D USE_SAFE_MATH ");
 #endif
+
+        buildopts.append(GetRecordFormatOptions(m_formats));
         
 #ifndef RR_EMBED_KERNELS
         if ( device->GetPlatform() == Calc::Platform::kOpenCL )
@@ -117,7 +261,11 @@ namespace RadeonRays
 #if USE_VULKAN
         if (m_gpudata->executable == nullptr && device->GetPlatform() == Calc::Platform::kVulkan)
         {
+#ifdef RR_EMBED_SPIRV
+            m_gpudata->executable = m_device->CompileExecutable(g_bvh_spirv, sizeof(g_bvh_spirv), buildopts.c_str());
+#else
             m_gpudata->executable = m_device->CompileExecutable(g_bvh_vulkan, std::strlen(g_bvh_vulkan), buildopts.c_str());
+#endif
         }
 #endif
 #endif
@@ -126,18 +274,69 @@ namespace RadeonRays
 
         m_gpudata->isect_func = m_gpudata->executable->CreateFunction("intersect_main");
         m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("occluded_main");
+
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_gpudata->isect_persistent_func = m_gpudata->executable->CreateFunction("intersect_persistent_main");
+            m_gpudata->occlude_persistent_func = m_gpudata->executable->CreateFunction("occluded_persistent_main");
+            m_gpudata->occlude_compact_func = m_gpudata->executable->CreateFunction("occluded_compact_main");
+            m_gpudata->occlude_persistent_compact_func = m_gpudata->executable->CreateFunction("occluded_persistent_compact_main");
+            m_gpudata->isect_attributes_func = m_gpudata->executable->CreateFunction("intersect_attributes_main");
+            m_gpudata->occlude_cached_func = m_gpudata->executable->CreateFunction("occluded_cached_main");
+            m_gpudata->overlap_func = m_gpudata->executable->CreateFunction("overlap_main");
+            m_gpudata->closest_point_func = m_gpudata->executable->CreateFunction("closest_point_main");
+
+            // Octant links order the children per ray, so a packet can't share the traversal,
+            // counters are kept by the per-ray kernels only
+            if (!(m_formats & (kOctantLinks | kTraversalStats)))
+            {
+                m_gpudata->isect_packet_func = m_gpudata->executable->CreateFunction("intersect_packet_main");
+            }
+        }
+
+        // Launch just enough work groups to fill the device
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+        std::uint32_t num_units = spec.max_compute_units ? spec.max_compute_units : kDefaultComputeUnits;
+        m_gpudata->persistent_size = num_units * kGroupsPerComputeUnit * kWorkGroupSize;
     }
 
     void IntersectorSkipLinks::Process(World const& world)
     {
+        int statechange = world.GetStateChange();
+
+        auto persistent = world.options_.GetOption("acc.persistent");
+        m_gpudata->persistent = persistent && persistent->AsFloat() > 0.f && m_gpudata->isect_persistent_func;
+
+        // IDs and masks are only stored in the face buffer and vertex attributes in their own one,
+        // no need to rebuild for them unless the host copy of the faces has been dropped
+        if (m_gpudata->bvh && !m_cpudata->faces.empty() && !world.has_changed() && !BvhSettingsChanged(world) && statechange != ShapeImpl::kStateChangeNone &&
+            (statechange & ~(ShapeImpl::kStateChangeId | ShapeImpl::kStateChangeMask | ShapeImpl::kStateChangeAttributes)) == 0)
+        {
+            if (statechange & (ShapeImpl::kStateChangeId | ShapeImpl::kStateChangeMask))
+            {
+                UpdateFaces(world);
+            }
+
+            if (statechange & ShapeImpl::kStateChangeAttributes)
+            {
+                UpdateAttributes(m_cpudata->shapes, m_cpudata->vertex_starts, m_cpudata->numvertices);
+            }
+        }
         // If something has been changed we need to rebuild BVH
-        if (!m_bvh || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
+        else if (!m_gpudata->bvh || world.has_changed() || BvhSettingsChanged(world) || statechange != ShapeImpl::kStateChangeNone)
         {
-            if (m_bvh)
+            if (m_gpudata->bvh)
             {
                 m_device->DeleteBuffer(m_gpudata->bvh);
                 m_device->DeleteBuffer(m_gpudata->vertices);
                 m_device->DeleteBuffer(m_gpudata->faces);
+                m_gpudata->bvh = m_gpudata->vertices = m_gpudata->faces = nullptr;
+                if (m_gpudata->links)
+                {
+                    m_device->DeleteBuffer(m_gpudata->links);
+                    m_gpudata->links = nullptr;
+                }
             }
 
             int numshapes = (int)world.shapes_.size();
@@ -148,38 +347,22 @@ namespace RadeonRays
             std::vector<int> mesh_vertices_start_idx(numshapes);
             std::vector<int> mesh_faces_start_idx(numshapes);
 
-            // Check options
-            auto builder = world.options_.GetOption("bvh.builder");
-            auto splits = world.options_.GetOption("bvh.sah.use_splits");
-            auto maxdepth = world.options_.GetOption("bvh.sah.max_split_depth");
-            auto overlap = world.options_.GetOption("bvh.sah.min_overlap");
-            auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
-            auto node_budget = world.options_.GetOption("bvh.sah.extra_node_budget");
-            auto nbins = world.options_.GetOption("bvh.sah.num_bins");
-
-            bool use_sah = false;
-            bool use_splits = false;
-            int max_split_depth = maxdepth ? (int)maxdepth->AsFloat() : 10;
-            int num_bins = nbins ? (int)nbins->AsFloat() : 64;
-            float min_overlap = overlap ? overlap->AsFloat() : 0.05f;
-            float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
-            float extra_node_budget = node_budget ? node_budget->AsFloat() : 0.5f;
-
-            if (builder && builder->AsString() == "sah")
-            {
-                use_sah = true;
-            }
-
-            if (splits && splits->AsFloat() > 0.f)
-            {
-                use_splits = true;
-            }
+            // Build settings are resolved when the options are set
+            auto const& settings = world.options_.GetBvhSettings();
+            // Nodes keep the leaf size in 4 bits, only OpenCL kernels loop over leaf faces
+            int max_leaf_prims = m_device->GetPlatform() == Calc::Platform::kOpenCL ?
+                std::min(std::max(settings.max_leaf_prims, 1), kMaxLeafPrims) : 1;
 
-            m_bvh.reset( use_splits ?
-                new SplitBvh(traversal_cost, num_bins, max_split_depth, min_overlap, extra_node_budget) :
-                new Bvh(traversal_cost, num_bins, use_sah)
+            m_bvh.reset(settings.use_splits ?
+                new SplitBvh(settings.traversal_cost, settings.num_bins, settings.max_split_depth, settings.min_overlap, settings.extra_node_budget, max_leaf_prims) :
+                settings.use_lbvh ? new LinearBvh(settings.traversal_cost, settings.num_bins) :
+                new Bvh(settings.traversal_cost, settings.num_bins, settings.use_sah, max_leaf_prims)
             );
 
+            // Centroids and indices are reused across commits, the monitor of the commit can cancel the build
+            m_bvh->SetScratch(&m_scratch);
+            m_bvh->SetMonitor(world.monitor_.get());
+
             // Partition the array into meshes and instances
             std::vector<Shape const*> shapes(world.shapes_);
 
@@ -194,13 +377,24 @@ namespace RadeonRays
             // Count the number of instances
             int numinstances = (int)std::distance(firstinst, shapes.end());
 
+            // Spheres are a single face and vertex each
+            bool has_spheres = false;
             for (int i = 0; i < nummeshes; ++i)
             {
-                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-
                 mesh_faces_start_idx[i] = numfaces;
                 mesh_vertices_start_idx[i] = numvertices;
 
+                if (static_cast<ShapeImpl const*>(shapes[i])->is_spheres())
+                {
+                    Spheres const* spheres = static_cast<Spheres const*>(shapes[i]);
+                    numfaces += spheres->num_spheres();
+                    numvertices += spheres->num_spheres();
+                    has_spheres = true;
+                    continue;
+                }
+
+                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+
                 numfaces += mesh->num_faces();
                 numvertices += mesh->num_vertices();
             }
@@ -217,66 +411,197 @@ namespace RadeonRays
                 numvertices += mesh->num_vertices();
             }
 
-            // We can't avoild allocating it here, since bounds aren't stored anywhere
-            std::vector<bbox> bounds(numfaces);
+            // Try to fetch translated data from the on-disk cache
+            auto cachepath = world.options_.GetOption("bvh.cache.path");
+            std::unique_ptr<BvhCache> cache;
+            std::uint64_t cachekey = 0;
 
-            // We handle meshes first collecting their world space bounds
-#pragma omp parallel for
-            for (int i = 0; i < nummeshes; ++i)
-            {
-                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+            std::vector<PlainBvhTranslator::Node> nodes;
+            std::vector<Face> faces;
+            bool cached = false;
+            // Nodes nothing else reads on the host are translated straight into the mapped device buffer
+            bool translate_mapped = false;
 
-                for (int j = 0; j < mesh->num_faces(); ++j)
-                {
-                    // Here we directly get world space bounds
-                    mesh->GetFaceBounds(j, false, bounds[mesh_faces_start_idx[i] + j]);
-                }
+            if (cachepath && !cachepath->AsString().empty())
+            {
+                cache.reset(new BvhCache(cachepath->AsString()));
+                cachekey = BvhCache::ComputeKey(world, "bvh");
+
+                BvhCache::Entry entry;
+                cached = cache->Load(cachekey, entry) &&
+                    entry.ReadArray(nodes) &&
+                    entry.ReadArray(faces) &&
+                    !nodes.empty();
             }
 
-            // Then we handle instances. Need to flatten them into actual geometry.
-#pragma omp parallel for
-            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+            if (!cached)
             {
-                Instance const* instance = static_cast<Instance const*>(shapes[i]);
-                Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
+                // Face bounds are kept across commits, so they are allocated only when the scene grows
+                host_vector<bbox>& bounds = m_scratch.bounds;
+                bounds.resize(numfaces);
 
-                // Instance is using its own transform for base shape geometry
-                // so we need to get object space bounds and transform them manually
-                matrix m, minv;
-                instance->GetTransform(m, minv);
+                // We handle meshes first collecting their world space bounds
+                for (int i = 0; i < nummeshes; ++i)
+                {
+                    // Here we directly get world space bounds, faces are processed in parallel
+                    matrix m, minv;
+                    shapes[i]->GetTransform(m, minv);
 
-                for (int j = 0; j < mesh->num_faces(); ++j)
+                    if (static_cast<ShapeImpl const*>(shapes[i])->is_spheres())
+                    {
+                        static_cast<Spheres const*>(shapes[i])->ComputeAllBounds(m, &bounds[mesh_faces_start_idx[i]]);
+                    }
+                    else
+                    {
+                        static_cast<Mesh const*>(shapes[i])->ComputeAllFaceBounds(m, &bounds[mesh_faces_start_idx[i]]);
+                    }
+                }
+
+                // Then we handle instances. Need to flatten them into actual geometry.
+                for (int i = nummeshes; i < nummeshes + numinstances; ++i)
                 {
-                    bbox tmp;
-                    mesh->GetFaceBounds(j, true, tmp);
-                    bounds[mesh_faces_start_idx[i] + j] = transform_bbox(tmp, m);
+                    Instance const* instance = static_cast<Instance const*>(shapes[i]);
+                    Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
+
+                    // Instance is using its own transform for base shape geometry
+                    // so base mesh vertices are transformed by it directly
+                    matrix m, minv;
+                    instance->GetTransform(m, minv);
+                    mesh->ComputeAllFaceBounds(m, &bounds[mesh_faces_start_idx[i]]);
                 }
-            }
 
-            m_bvh->Build(&bounds[0], numfaces);
+                // Large faces are split into several references clipped to them, spatial splits do that during the build.
+                // Clipping is done against triangles, so scenes with spheres are built unsplit.
+                if (settings.presplit_budget > 0.f && !settings.use_splits && !has_spheres)
+                {
+                    std::vector<bbox> refbounds;
+                    std::vector<int> refprims;
+                    PresplitFaces(shapes, mesh_faces_start_idx, &bounds[0], numfaces, settings.presplit_budget, refbounds, refprims);
+                    m_bvh->Build(refbounds.data(), (int)refbounds.size(), refprims.data(), numfaces);
+                }
+                else
+                {
+                    m_bvh->Build(&bounds[0], numfaces);
+                }
 
 #ifdef RR_PROFILE
-            m_bvh->PrintStatistics(std::cout);
+                m_bvh->PrintStatistics(std::cout);
 #endif
-            PlainBvhTranslator translator;
-            translator.Process(*m_bvh);
+                m_bvh->GetStats(m_stats);
+
+                translate_mapped = !cache && !(m_formats & kOctantLinks);
+                if (!translate_mapped)
+                {
+                    PlainBvhTranslator translator;
+                    translator.Process(*m_bvh);
+                    nodes.swap(translator.nodes_);
+                }
+
+                // This number is different from the number of faces for some BVHs
+                auto numindices = m_bvh->GetNumIndices();
+                faces.resize(numindices);
+
+                // Here the point is to add mesh starting index to actual index contained within the mesh,
+                // getting absolute index in the buffer.
+                // Besides that we need to permute the faces accorningly to BVH reordering, whihc
+                // is contained within bvh.primids_
+                int const* reordering = m_bvh->GetIndices();
+                for (int i = 0; i < numindices; ++i)
+                {
+                    int indextolook4 = reordering[i];
+
+                    // We need to find a shape corresponding to current face
+                    auto iter = std::upper_bound(mesh_faces_start_idx.cbegin(), mesh_faces_start_idx.cend(), indextolook4);
+
+                    // Find the index of the shape
+                    int shapeidx = static_cast<int>(std::distance(mesh_faces_start_idx.cbegin(), iter) - 1);
+
+                    // Find face idx
+                    int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
+
+                    faces[i].shape_id = shapes[shapeidx]->GetId();
+                    faces[i].shape_mask = shapes[shapeidx]->GetMask();
+                    faces[i].prim_id = faceidx;
+
+                    if (shapeidx < nummeshes && static_cast<ShapeImpl const*>(shapes[shapeidx])->is_spheres())
+                    {
+                        faces[i].idx[0] = faceidx + mesh_vertices_start_idx[shapeidx];
+                        faces[i].idx[1] = kSphereFace;
+                        faces[i].idx[2] = kSphereFace;
+                        continue;
+                    }
 
-            // Update GPU data
+                    // Get the mesh directly or out of instance
+                    Mesh const* mesh = nullptr;
+                    if (shapeidx < nummeshes)
+                    {
+                        mesh = static_cast<Mesh const*>(shapes[shapeidx]);
+                    }
+                    else
+                    {
+                        mesh = static_cast<Mesh const*>(static_cast<Instance const*>(shapes[shapeidx])->GetBaseShape());
+                    }
+
+                    // Get vertex indices of the face
+                    Mesh::Face const face = mesh->GetFace(faceidx);
+                    // Find mesh start idx
+                    int mystartidx = mesh_vertices_start_idx[shapeidx];
+
+                    // Copy face data to GPU buffer
+                    faces[i].idx[0] = face.idx[0] + mystartidx;
+                    faces[i].idx[1] = face.idx[1] + mystartidx;
+                    faces[i].idx[2] = face.idx[2] + mystartidx;
+                }
+
+                if (cache)
+                {
+                    BvhCache::Entry entry;
+                    entry.WriteArray(nodes);
+                    entry.WriteArray(faces);
+                    cache->Save(cachekey, entry);
+                }
+            }
+
+            // A cancelled commit stops before touching the device
+            CheckCancelled(world);
+
+            // Update GPU data, uploads overlap with preparing the rest of it
             // Copy translated nodes first
-            m_gpudata->bvh = m_device->CreateBuffer(translator.nodes_.size() * sizeof(PlainBvhTranslator::Node), Calc::BufferType::kRead, &translator.nodes_[0]);
+            if (translate_mapped)
+            {
+                std::size_t const size = m_bvh->GetNumNodes() * sizeof(PlainBvhTranslator::Node);
+                m_gpudata->bvh = CreateSceneBuffer(size);
 
-            // Create vertex buffer
+                PlainBvhTranslator translator;
+                void* mapped = MapSceneBuffer(m_gpudata->bvh, size);
+                m_gpudata->numnodes = translator.ProcessInto(*m_bvh, static_cast<PlainBvhTranslator::Node*>(mapped));
+                UnmapSceneBuffer(m_gpudata->bvh, mapped);
+            }
+            else
             {
-                // Vertices
-                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
+                // Links are cheap to derive from the nodes, so they are not cached
+                m_gpudata->numnodes = static_cast<int>(nodes.size());
+                if (m_formats & kOctantLinks)
+                {
+                    std::vector<int> links;
+                    PlainBvhTranslator::ProcessOctantLinks(nodes.data(), m_gpudata->numnodes, links);
 
-                // Get the pointer to mapped data
-                float3* vertexdata = nullptr;
-                Calc::Event* e = nullptr;
-                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
+                    m_gpudata->links = CreateSceneBuffer(links.size() * sizeof(int));
+                    Upload(m_gpudata->links, std::move(links));
+                }
+
+                m_gpudata->bvh = CreateSceneBuffer(nodes.size() * sizeof(PlainBvhTranslator::Node));
+                Upload(m_gpudata->bvh, std::move(nodes));
+            }
+
+            // Create vertex buffer
+            {
+                // Vertices, or the precomputed transforms of the faces
+                std::size_t const numentries = (m_formats & kPrecomputedTriangles) ? faces.size() * 3 : numvertices;
+                m_gpudata->vertices = CreateSceneBuffer(numentries * sizeof(float3));
 
-                e->Wait();
-                m_device->DeleteEvent(e);
+                std::vector<float3> vertices(numvertices);
+                float3* vertexdata = vertices.data();
 
                 // Here we need to put data in world space rather than object space
                 // So we need to get the transform from the mesh and multiply each vertex
@@ -285,10 +610,22 @@ namespace RadeonRays
 #pragma omp parallel for
                 for (int i = 0; i < nummeshes; ++i)
                 {
+                    // Spheres keep their radius in w
+                    if (static_cast<ShapeImpl const*>(shapes[i])->is_spheres())
+                    {
+                        Spheres const* spheres = static_cast<Spheres const*>(shapes[i]);
+                        spheres->GetTransform(m, minv);
+
+                        for (int j = 0; j < spheres->num_spheres(); ++j)
+                        {
+                            vertexdata[mesh_vertices_start_idx[i] + j] = Spheres::TransformSphere(spheres->GetSphere(j), m);
+                        }
+
+                        continue;
+                    }
+
                     // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
                     // Get mesh transform
                     mesh->GetTransform(m, minv);
 
@@ -296,7 +633,7 @@ namespace RadeonRays
                     // Iterate thru vertices multiply and append them to GPU buffer
                     for (int j = 0; j < mesh->num_vertices(); ++j)
                     {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
                     }
                 }
 
@@ -306,8 +643,6 @@ namespace RadeonRays
                     Instance const* instance = static_cast<Instance const*>(shapes[i]);
                     // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
                     // Get mesh transform
                     instance->GetTransform(m, minv);
 
@@ -315,102 +650,215 @@ namespace RadeonRays
                     // Iterate thru vertices multiply and append them to GPU buffer
                     for (int j = 0; j < mesh->num_vertices(); ++j)
                     {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
                     }
                 }
 
-                m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
+                if (m_formats & kPrecomputedTriangles)
+                {
+                    // The vertex buffer holds 3 rows per face in BVH order instead,
+                    // transforming world space into the barycentric space of the face
+                    std::vector<float3> transforms(faces.size() * 3);
 
-                e->Wait();
-                m_device->DeleteEvent(e);
+#pragma omp parallel for
+                    for (int i = 0; i < (int)faces.size(); ++i)
+                    {
+                        float3 const v0 = vertexdata[faces[i].idx[0]];
+                        float3 const e1 = vertexdata[faces[i].idx[1]] - v0;
+                        float3 const e2 = vertexdata[faces[i].idx[2]] - v0;
+                        float3 const n = cross(e1, e2);
+                        float const det = dot(n, n);
+
+                        // Degenerate faces keep zero rows and are never hit
+                        if (det == 0.f)
+                        {
+                            continue;
+                        }
+
+                        float3 const r0 = cross(e2, n) * (1.f / det);
+                        float3 const r1 = cross(n, e1) * (1.f / det);
+                        float3 const r2 = n * (1.f / det);
+
+                        transforms[3 * i] = float3(r0.x, r0.y, r0.z, -dot(r0, v0));
+                        transforms[3 * i + 1] = float3(r1.x, r1.y, r1.z, -dot(r1, v0));
+                        transforms[3 * i + 2] = float3(r2.x, r2.y, r2.z, dot(r2, v0));
+                    }
+
+                    Upload(m_gpudata->vertices, std::move(transforms));
+                }
+                else
+                {
+                    Upload(m_gpudata->vertices, std::move(vertices));
+                }
             }
 
-            // Create face buffer
+            UpdateAttributes(shapes, mesh_vertices_start_idx, numvertices);
+
+            m_gpudata->faces = CreateSceneBuffer(faces.size() * sizeof(Face));
+            m_gpudata->numfaces = static_cast<int>(faces.size());
+
+            // Without host copies any change rebuilds from the world
+            if (!KeepHostCopies(world))
             {
-                struct Face
-                {
-                    // Up to 3 indices
-                    int idx[3];
-                    // Shape maks
-                    int shape_mask;
-                    // Shape ID
-                    int shape_id;
-                    // Primitive ID
-                    int prim_id;
-                };
+                Upload(m_gpudata->faces, std::move(faces));
+                m_bvh.reset();
+                m_scratch.Release();
+                std::vector<Face>().swap(m_cpudata->faces);
+                std::vector<int>().swap(m_cpudata->face_shapeidx);
+                std::vector<Shape const*>().swap(m_cpudata->shapes);
+                std::vector<int>().swap(m_cpudata->vertex_starts);
+                return;
+            }
 
-                // This number is different from the number of faces for some BVHs
-                auto numindices = m_bvh->GetNumIndices();
-                // Create face buffer
-                m_gpudata->faces = m_device->CreateBuffer(numindices * sizeof(Face), Calc::BufferType::kRead);
+            // Create face buffer, the host copy below is kept so it can be uploaded from
+            Upload(m_gpudata->faces, faces.size() * sizeof(Face), faces.data());
 
-                // Get the pointer to mapped data
-                Face* facedata = nullptr;
-                Calc::Event* e = nullptr;
+            // Keep faces on the host to be able to patch them on ID or mask changes,
+            // cached faces have no shape info, so shapes are found by vertex ranges
+            m_cpudata->face_shapeidx.resize(faces.size());
+            for (int i = 0; i < (int)faces.size(); ++i)
+            {
+                auto iter = std::upper_bound(mesh_vertices_start_idx.cbegin(), mesh_vertices_start_idx.cend(), faces[i].idx[0]);
+                m_cpudata->face_shapeidx[i] = static_cast<int>(std::distance(mesh_vertices_start_idx.cbegin(), iter) - 1);
+            }
 
-                m_device->MapBuffer(m_gpudata->faces, 0, 0, numindices * sizeof(Face), Calc::BufferType::kWrite, (void**)&facedata, &e);
+            // Swapping keeps the storage the faces are uploaded from
+            m_cpudata->faces.swap(faces);
+            m_cpudata->shapes.swap(shapes);
+            m_cpudata->vertex_starts.swap(mesh_vertices_start_idx);
+            m_cpudata->numvertices = numvertices;
+        }
+    }
 
-                e->Wait();
-                m_device->DeleteEvent(e);
+    void IntersectorSkipLinks::UpdateFaces(World const& world)
+    {
+        std::vector<Shape const*> changed;
+        world.GetChangedShapes(ShapeImpl::kStateChangeId | ShapeImpl::kStateChangeMask, changed);
 
-                // Here the point is to add mesh starting index to actual index contained within the mesh,
-                // getting absolute index in the buffer.
-                // Besides that we need to permute the faces accorningly to BVH reordering, whihc
-                // is contained within bvh.primids_
-                int const* reordering = m_bvh->GetIndices();
-                for (int i = 0; i < numindices; ++i)
-                {
-                    int indextolook4 = reordering[i];
+        std::vector<char> shape_changed(m_cpudata->shapes.size(), 0);
+        for (auto shape : changed)
+        {
+            auto iter = std::find(m_cpudata->shapes.cbegin(), m_cpudata->shapes.cend(), shape);
+            shape_changed[std::distance(m_cpudata->shapes.cbegin(), iter)] = 1;
+        }
 
-                    // We need to find a shape corresponding to current face
-                    auto iter = std::upper_bound(mesh_faces_start_idx.cbegin(), mesh_faces_start_idx.cend(), indextolook4);
+        auto& faces = m_cpudata->faces;
+        for (int i = 0; i < (int)faces.size(); ++i)
+        {
+            int shapeidx = m_cpudata->face_shapeidx[i];
 
-                    // Find the index of the shape
-                    int shapeidx = static_cast<int>(std::distance(mesh_faces_start_idx.cbegin(), iter) - 1);
+            if (shape_changed[shapeidx])
+            {
+                faces[i].shape_id = m_cpudata->shapes[shapeidx]->GetId();
+                faces[i].shape_mask = m_cpudata->shapes[shapeidx]->GetMask();
+            }
+        }
 
-                    // Get the mesh directly or out of instance
-                    Mesh const* mesh = nullptr;
-                    if (shapeidx < nummeshes)
-                    {
-                        mesh = static_cast<Mesh const*>(shapes[shapeidx]);
-                    }
-                    else
-                    {
-                        mesh = static_cast<Mesh const*>(static_cast<Instance const*>(shapes[shapeidx])->GetBaseShape());
-                    }
+        Calc::Event* e = nullptr;
+        m_device->WriteBuffer(m_gpudata->faces, 0, 0, faces.size() * sizeof(Face), (char*)&faces[0], &e);
 
-                    // Get vertex buffer of the current mesh
-                    Mesh::Face const* myfacedata = mesh->GetFaceData();
-                    // Find face idx
-                    int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
-                    // Find mesh start idx
-                    int mystartidx = mesh_vertices_start_idx[shapeidx];
+        e->Wait();
+        m_device->DeleteEvent(e);
+    }
 
-                    // Copy face data to GPU buffer
-                    facedata[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
-                    facedata[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
-                    facedata[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
-
-                    // Optimization: we are putting faceid here
-                    facedata[i].shape_id = shapes[shapeidx]->GetId();
-                    facedata[i].shape_mask = shapes[shapeidx]->GetMask();
-                    facedata[i].prim_id = faceidx;
-                }
+    void IntersectorSkipLinks::UpdateAttributes(std::vector<Shape const*> const& shapes, std::vector<int> const& vertex_starts, int numvertices)
+    {
+        // Attributes are only interpolated by the OpenCL kernels
+        if (!m_gpudata->isect_attributes_func)
+        {
+            return;
+        }
 
-                m_device->UnmapBuffer(m_gpudata->faces, 0, facedata, &e);
+        // Instances interpolate the attributes of their base mesh
+        auto get_mesh = [](Shape const* shape) -> Mesh const*
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+            if (shapeimpl->is_spheres())
+            {
+                return nullptr;
+            }
+
+            return static_cast<Mesh const*>(shapeimpl->is_instance() ?
+                static_cast<Instance const*>(shapeimpl)->GetBaseShape() : shape);
+        };
+
+        int num_attributes = 0;
+        for (auto shape : shapes)
+        {
+            auto mesh = get_mesh(shape);
+            num_attributes = mesh ? std::max(num_attributes, mesh->num_attributes()) : num_attributes;
+        }
+
+        if (m_gpudata->attributes)
+        {
+            m_device->DeleteBuffer(m_gpudata->attributes);
+        }
 
-                e->Wait();
-                m_device->DeleteEvent(e);
+        m_gpudata->num_attributes = num_attributes;
+
+        // Kernels need a valid buffer even if they never read it
+        std::vector<float3> attributes(std::max((std::size_t)numvertices * num_attributes, std::size_t(1)));
+        m_gpudata->attributes = CreateSceneBuffer(attributes.size() * sizeof(float3));
+
+        // Meshes with fewer attributes are padded with zeros
+#pragma omp parallel for
+        for (int i = 0; i < (int)shapes.size(); ++i)
+        {
+            auto mesh = get_mesh(shapes[i]);
+            if (!mesh || mesh->num_attributes() == 0)
+            {
+                continue;
             }
 
-            // Make sure everything is commited
-            m_device->Finish(0);
+            int const count = mesh->num_attributes();
+            float const* data = mesh->attribute_data();
+            for (int j = 0; j < mesh->num_vertices(); ++j)
+            {
+                for (int k = 0; k < count; ++k)
+                {
+                    float const* a = data + 4 * (j * count + k);
+                    attributes[(vertex_starts[i] + j) * num_attributes + k] = float3(a[0], a[1], a[2], a[3]);
+                }
+            }
         }
+
+        Upload(m_gpudata->attributes, std::move(attributes));
+    }
+
+    void IntersectorSkipLinks::GetMemoryStats(AccelStats& stats) const
+    {
+        stats.node_memory = GetBufferSize(m_gpudata->bvh);
+        stats.vertex_memory = GetBufferSize(m_gpudata->vertices);
+        stats.face_memory = GetBufferSize(m_gpudata->faces);
+        stats.other_memory = (m_gpudata->links ? GetBufferSize(m_gpudata->links) : 0) +
+            (m_gpudata->attributes ? GetBufferSize(m_gpudata->attributes) : 0);
     }
 
     void IntersectorSkipLinks::Intersect(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
     {
-        auto& func = m_gpudata->isect_func;
+        if (UsePersistent(queueidx, numrays))
+        {
+            Dispatch(m_gpudata->isect_persistent_func, queueidx, rays, numrays, maxrays, hits, event);
+        }
+        else
+        {
+            Dispatch(m_gpudata->isect_func, queueidx, rays, numrays, maxrays, hits, event);
+        }
+    }
+
+    void IntersectorSkipLinks::IntersectAttributes(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, int num_attributes, Calc::Buffer* hits, Calc::Buffer* attributes, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        Dispatch(m_gpudata->isect_attributes_func, queueidx, rays, numrays, maxrays, hits, event, attributes, num_attributes);
+    }
+
+    void IntersectorSkipLinks::OccludedCached(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* occluders, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        Dispatch(m_gpudata->occlude_cached_func, queueidx, rays, numrays, maxrays, hits, event, nullptr, 0, occluders);
+    }
+
+    void IntersectorSkipLinks::FindOverlaps(std::uint32_t queueidx, Calc::Buffer const* boxes, Calc::Buffer const* numboxes, std::uint32_t maxboxes, int maxoverlaps, Calc::Buffer* overlaps, Calc::Buffer* counts, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        auto func = m_gpudata->overlap_func;
 
         // Set args
         int arg = 0;
@@ -418,34 +866,162 @@ namespace RadeonRays
         func->SetArg(arg++, m_gpudata->bvh);
         func->SetArg(arg++, m_gpudata->vertices);
         func->SetArg(arg++, m_gpudata->faces);
-        func->SetArg(arg++, rays);
-        func->SetArg(arg++, numrays);
-        func->SetArg(arg++, hits);
+
+        if (m_formats & kOctantLinks)
+        {
+            func->SetArg(arg++, m_gpudata->links);
+            func->SetArg(arg++, sizeof(int), &m_gpudata->numnodes);
+        }
+
+        func->SetArg(arg++, boxes);
+        func->SetArg(arg++, numboxes);
+        func->SetArg(arg++, sizeof(int), &maxoverlaps);
+        func->SetArg(arg++, overlaps);
+        func->SetArg(arg++, counts);
 
         size_t localsize = kWorkGroupSize;
-        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        size_t globalsize = ((maxboxes + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        Execute(func, queueidx, globalsize, localsize, event, "bvh.overlap");
+    }
+
+    void IntersectorSkipLinks::FindClosestPoints(std::uint32_t queueidx, Calc::Buffer const* points, Calc::Buffer const* numpoints, std::uint32_t maxpoints, float maxdist, Calc::Buffer* results, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        auto func = m_gpudata->closest_point_func;
+
+        // Set args
+        int arg = 0;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+
+        if (m_formats & kOctantLinks)
+        {
+            func->SetArg(arg++, m_gpudata->links);
+            func->SetArg(arg++, sizeof(int), &m_gpudata->numnodes);
+        }
+
+        func->SetArg(arg++, points);
+        func->SetArg(arg++, numpoints);
+        func->SetArg(arg++, sizeof(float), &maxdist);
+        func->SetArg(arg++, results);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((maxpoints + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        Execute(func, queueidx, globalsize, localsize, event, "bvh.closest_point");
+    }
+
+    void IntersectorSkipLinks::IntersectCoherent(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        // Persistent launches fetch rays out of order, so they keep their kernels
+        if (m_gpudata->isect_packet_func && !UsePersistent(queueidx, numrays))
+        {
+            Dispatch(m_gpudata->isect_packet_func, queueidx, rays, numrays, maxrays, hits, event);
+        }
+        else
+        {
+            Intersect(queueidx, rays, numrays, maxrays, hits, waitevent, event);
+        }
     }
 
     void IntersectorSkipLinks::Occluded(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
     {
-        auto& func = m_gpudata->occlude_func;
+        if (UsePersistent(queueidx, numrays))
+        {
+            Dispatch(m_gpudata->occlude_persistent_func, queueidx, rays, numrays, maxrays, hits, event);
+        }
+        else
+        {
+            Dispatch(m_gpudata->occlude_func, queueidx, rays, numrays, maxrays, hits, event);
+        }
+    }
 
+    void IntersectorSkipLinks::OccludedCompact(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        if (UsePersistent(queueidx, numrays))
+        {
+            Dispatch(m_gpudata->occlude_persistent_compact_func, queueidx, rays, numrays, maxrays, hits, event);
+        }
+        else
+        {
+            Dispatch(m_gpudata->occlude_compact_func, queueidx, rays, numrays, maxrays, hits, event);
+        }
+    }
+
+    bool IntersectorSkipLinks::UsePersistent(std::uint32_t queueidx, Calc::Buffer const* numrays) const
+    {
+        // Device ray counts are usually far below maxrays after compaction, persistent
+        // work groups only fetch the live rays instead of launching maxrays work items
+        return m_gpudata->isect_persistent_func &&
+            (m_gpudata->persistent || (m_indirect_dispatch && IsDeviceCount(queueidx, numrays)));
+    }
+
+    void IntersectorSkipLinks::Dispatch(Calc::Function* func, std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event** event,
+        Calc::Buffer* attributes, int num_attributes, Calc::Buffer* occluders) const
+    {
         // Set args
         int arg = 0;
 
         func->SetArg(arg++, m_gpudata->bvh);
         func->SetArg(arg++, m_gpudata->vertices);
         func->SetArg(arg++, m_gpudata->faces);
+
+        if (m_formats & kOctantLinks)
+        {
+            func->SetArg(arg++, m_gpudata->links);
+            func->SetArg(arg++, sizeof(int), &m_gpudata->numnodes);
+        }
+
         func->SetArg(arg++, rays);
         func->SetArg(arg++, numrays);
-        func->SetArg(arg++, hits);
 
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        // Attribute and cached occlusion queries always launch a work item per ray
+        if (func != m_gpudata->isect_attributes_func && func != m_gpudata->occlude_cached_func && UsePersistent(queueidx, numrays))
+        {
+            // Counter reset is ordered before the launch on the same queue
+            auto counter = m_gpudata->GetCounter(queueidx);
+            m_device->WriteBuffer(counter, queueidx, 0, sizeof(int), &m_gpudata->zero, nullptr);
+            func->SetArg(arg++, counter);
+
+            globalsize = std::min<size_t>(globalsize, m_gpudata->persistent_size);
+        }
+
+        if (func == m_gpudata->occlude_cached_func)
+        {
+            func->SetArg(arg++, sizeof(int), &m_gpudata->numfaces);
+            func->SetArg(arg++, occluders);
+        }
+
+        func->SetArg(arg++, hits);
+
+        if (func == m_gpudata->isect_attributes_func)
+        {
+            func->SetArg(arg++, m_gpudata->attributes);
+            func->SetArg(arg++, sizeof(int), &m_gpudata->num_attributes);
+            func->SetArg(arg++, attributes);
+            func->SetArg(arg++, sizeof(int), &num_attributes);
+        }
+
+        if (func == m_gpudata->isect_func || func == m_gpudata->isect_persistent_func || func == m_gpudata->isect_attributes_func)
+        {
+            SetTraversalStatsArg(func, arg, queueidx, maxrays);
+        }
+
+        // Kernels of a work item per ray can be split, persistent and packet ones depend on group ids
+        if (func == m_gpudata->isect_func || func == m_gpudata->occlude_func ||
+            func == m_gpudata->isect_attributes_func || func == m_gpudata->occlude_cached_func)
+        {
+            ExecuteSliced(func, queueidx, globalsize, localsize, event, "bvh.traversal");
+        }
+        else
+        {
+            Execute(func, queueidx, globalsize, localsize, event, "bvh.traversal");
+        }
     }
 
 }
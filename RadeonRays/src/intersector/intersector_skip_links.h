@@ -62,6 +62,7 @@ THE SOFTWARE.
 #include "calc.h"
 #include "device.h"
 #include "intersector.h"
+#include "../util/build_scratch.h"
 #include <memory>
 
 namespace RadeonRays
@@ -74,8 +75,8 @@ namespace RadeonRays
     class IntersectorSkipLinks : public Intersector
     {
     public:
-        // Constructor
-        IntersectorSkipLinks(Calc::Device* device);
+        // Constructor, formats selects record layouts, see RecordFormat
+        IntersectorSkipLinks(Calc::Device* device, int formats = kFullRecords);
 
     private:
         // Preprocess implementation
@@ -84,17 +85,60 @@ namespace RadeonRays
         void Intersect(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
             std::uint32_t max_rays, Calc::Buffer *hits, 
             Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Packet traversal of coherent rays, OpenCL without octant links only
+        void IntersectCoherent(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
+            std::uint32_t max_rays, Calc::Buffer *hits, 
+            Calc::Event const *wait_event, Calc::Event **event) const override;
         // Occulusion implementation
         void Occluded(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
             std::uint32_t max_rays, Calc::Buffer *hits, 
             Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Intersection implementation interpolating vertex attributes, OpenCL only
+        void IntersectAttributes(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
+            std::uint32_t max_rays, int num_attributes, Calc::Buffer *hits, Calc::Buffer *attributes, 
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Occlusion implementation testing the last occluders first, OpenCL only
+        void OccludedCached(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
+            std::uint32_t max_rays, Calc::Buffer *occluders, Calc::Buffer *hits, 
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Box overlap implementation, OpenCL only
+        void FindOverlaps(std::uint32_t queue_idx, Calc::Buffer const *boxes, Calc::Buffer const *num_boxes, 
+            std::uint32_t max_boxes, int max_overlaps, Calc::Buffer *overlaps, Calc::Buffer *counts, 
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Closest point implementation, OpenCL only
+        void FindClosestPoints(std::uint32_t queue_idx, Calc::Buffer const *points, Calc::Buffer const *num_points, 
+            std::uint32_t max_points, float max_dist, Calc::Buffer *results, 
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Bit packed occlusion implementation
+        void OccludedCompact(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
+            std::uint32_t max_rays, Calc::Buffer *hits, 
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        bool SupportsCompactOcclusion() const override { return true; }
+        // Device memory of the acceleration structure
+        void GetMemoryStats(AccelStats& stats) const override;
 
     private:
+        // Patch shape IDs and masks of the faces in place
+        void UpdateFaces(World const& world);
+        // Upload vertex attributes of the shapes in the order of the vertex buffer, vertex_starts holds
+        // the first vertex of each shape
+        void UpdateAttributes(std::vector<Shape const*> const& shapes, std::vector<int> const& vertex_starts, int numvertices);
+        // Whether to launch persistent kernels, forced by "acc.persistent" or picked for device ray counts
+        bool UsePersistent(std::uint32_t queue_idx, Calc::Buffer const* num_rays) const;
+        // Set arguments and launch the kernel, persistent kernels also get the ray counter of the queue
+        void Dispatch(Calc::Function* func, std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event **event,
+            Calc::Buffer *attributes = nullptr, int num_attributes = 0, Calc::Buffer *occluders = nullptr) const;
+
         struct GpuData;
+        struct CpuData;
 
         // Implementation data
         std::unique_ptr<GpuData> m_gpudata;
+        std::unique_ptr<CpuData> m_cpudata;
         // Bvh data structure
         std::unique_ptr<Bvh> m_bvh;
+        // Build arrays reused across commits
+        BuildScratch m_scratch;
     };
 }
@@ -0,0 +1,247 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "ray_batcher.h"
+
+#include "../util/kernel_profiler.h"
+
+#include "buffer.h"
+#include "executable.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#ifdef RR_EMBED_KERNELS
+#if USE_OPENCL
+#    include "RadeonRays/src/kernelcache/kernels_cl.h"
+#endif
+#endif // RR_EMBED_KERNELS
+
+// Preferred work group size for Radeon devices
+static int const kWorkGroupSize = 64;
+
+namespace RadeonRays
+{
+    struct RayBatcher::QueueData
+    {
+        // Device
+        Calc::Device* device;
+        // Rays and hits of the batch
+        Calc::Buffer* rays;
+        Calc::Buffer* hits;
+        // Bytes the buffers can hold
+        std::size_t ray_capacity;
+        std::size_t hit_capacity;
+
+        QueueData(Calc::Device* d)
+            : device(d)
+            , rays(nullptr)
+            , hits(nullptr)
+            , ray_capacity(0)
+            , hit_capacity(0)
+        {
+        }
+
+        ~QueueData()
+        {
+            if (rays)
+            {
+                device->DeleteBuffer(rays);
+            }
+
+            if (hits)
+            {
+                device->DeleteBuffer(hits);
+            }
+        }
+    };
+
+    RayBatcher::RayBatcher(Calc::Device* device)
+        : m_device(device)
+        , m_profiler(nullptr)
+        , m_executable(nullptr)
+    {
+        assert(device->GetPlatform() == Calc::Platform::kOpenCL);
+
+#ifndef RR_EMBED_KERNELS
+        char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+        int numheaders = sizeof(headers) / sizeof(char const*);
+
+        m_executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/batch_rays.cl", headers, numheaders, "");
+#else
+#if USE_OPENCL
+        m_executable = m_device->CompileExecutable(g_batch_rays_opencl, std::strlen(g_batch_rays_opencl), "");
+#endif
+#endif
+
+        assert(m_executable);
+
+        m_gather_func = m_executable->CreateFunction("gather_batch_main");
+        m_scatter_func = m_executable->CreateFunction("scatter_batch_main");
+
+        // Concurrent queries on other queues never resize the per queue storage
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+        m_queues.resize(std::max(spec.max_num_queues, 1U));
+    }
+
+    RayBatcher::~RayBatcher()
+    {
+        m_queues.clear();
+        m_executable->DeleteFunction(m_gather_func);
+        m_executable->DeleteFunction(m_scatter_func);
+        m_device->DeleteExecutable(m_executable);
+    }
+
+    RayBatcher::QueueData& RayBatcher::GetQueueData(std::uint32_t queue_idx, std::size_t ray_bytes, std::size_t hit_bytes)
+    {
+        if (m_queues.size() <= queue_idx)
+        {
+            m_queues.resize(queue_idx + 1);
+        }
+
+        auto& data = m_queues[queue_idx];
+
+        if (!data)
+        {
+            data.reset(new QueueData(m_device));
+        }
+
+        if (data->ray_capacity < ray_bytes)
+        {
+            if (data->rays)
+            {
+                m_device->DeleteBuffer(data->rays);
+            }
+
+            data->rays = m_device->CreateBuffer(ray_bytes, Calc::BufferType::kWrite);
+            data->ray_capacity = ray_bytes;
+        }
+
+        if (data->hit_capacity < hit_bytes)
+        {
+            if (data->hits)
+            {
+                m_device->DeleteBuffer(data->hits);
+            }
+
+            data->hits = m_device->CreateBuffer(hit_bytes, Calc::BufferType::kWrite);
+            data->hit_capacity = hit_bytes;
+        }
+
+        return *data;
+    }
+
+    void RayBatcher::Gather(std::uint32_t queue_idx, BatchedQuery const* queries, std::uint32_t num_queries,
+        std::size_t ray_size, std::size_t hit_size, Calc::Buffer** rays, Calc::Buffer** hits)
+    {
+        std::size_t num_rays = 0;
+        for (auto i = 0U; i < num_queries; ++i)
+        {
+            num_rays += queries[i].num_rays;
+        }
+
+        auto& data = GetQueueData(queue_idx, num_rays * ray_size, num_rays * hit_size);
+
+        // Hits are gathered as well, so records the traversal leaves untouched keep their values
+        Copy(m_gather_func, queue_idx, queries, num_queries, ray_size, true, data.rays, nullptr, "batch.gather_rays");
+        Copy(m_gather_func, queue_idx, queries, num_queries, hit_size, false, data.hits, nullptr, "batch.gather_hits");
+
+        *rays = data.rays;
+        *hits = data.hits;
+    }
+
+    void RayBatcher::Scatter(std::uint32_t queue_idx, BatchedQuery const* queries, std::uint32_t num_queries,
+        std::size_t hit_size, Calc::Event** event)
+    {
+        auto& data = *m_queues[queue_idx];
+        Copy(m_scatter_func, queue_idx, queries, num_queries, hit_size, false, data.hits, event, "batch.scatter_hits");
+    }
+
+    void RayBatcher::Copy(Calc::Function* func, std::uint32_t queue_idx, BatchedQuery const* queries, std::uint32_t num_queries,
+        std::size_t record_size, bool rays, Calc::Buffer* batch, Calc::Event** event, char const* name)
+    {
+        assert(record_size % sizeof(int) == 0);
+
+        bool const gather = func == m_gather_func;
+        int const words_per_record = static_cast<int>(record_size / sizeof(int));
+        int first_word = 0;
+
+        for (auto first = 0U; first < num_queries; first += kMaxSources)
+        {
+            auto const count = std::min(num_queries - first, kMaxSources);
+
+            // Unused sources start at the end, so no word is ever copied from them
+            int starts[kMaxSources];
+            int end = first_word;
+            for (auto i = 0U; i < kMaxSources; ++i)
+            {
+                starts[i] = end;
+
+                if (i < count)
+                {
+                    end += static_cast<int>(queries[first + i].num_rays) * words_per_record;
+                }
+            }
+
+            // The batch is the first argument of the scatter kernel and the last of the gather one
+            int arg = 0;
+            if (!gather)
+            {
+                func->SetArg(arg++, batch);
+                func->SetArg(arg++, sizeof(starts), starts);
+                func->SetArg(arg++, sizeof(end), &end);
+            }
+
+            for (auto i = 0U; i < kMaxSources; ++i)
+            {
+                auto const& query = queries[first + std::min(i, count - 1)];
+                if (rays)
+                {
+                    func->SetArg(arg++, query.rays);
+                }
+                else
+                {
+                    func->SetArg(arg++, query.hits);
+                }
+            }
+
+            if (gather)
+            {
+                func->SetArg(arg++, sizeof(starts), starts);
+                func->SetArg(arg++, sizeof(end), &end);
+                func->SetArg(arg++, batch);
+            }
+
+            bool const last = first + count >= num_queries;
+            std::size_t const num_words = static_cast<std::size_t>(end - first_word);
+            std::size_t const localsize = kWorkGroupSize;
+            std::size_t const globalsize = ((num_words + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+            // The queue is in-order, so only the last launch needs an event
+            ProfiledExecute(m_profiler, m_device, func, queue_idx, globalsize, localsize, last ? event : nullptr, name);
+
+            first_word = end;
+        }
+    }
+}
@@ -0,0 +1,97 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file ray_batcher.h
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Combining small queries into a single traversal.
+
+    Rays and hits of the queries are gathered into consecutive ranges of batch buffers,
+    traversed in one dispatch and the hits are scattered back, so many small queries
+    pay for a few copy launches instead of a partially occupied traversal each.
+ */
+
+#pragma once
+#include "calc.h"
+#include "device.h"
+
+#include <memory>
+#include <vector>
+
+namespace RadeonRays
+{
+    class KernelProfiler;
+
+    // Query collected into a batch
+    struct BatchedQuery
+    {
+        Calc::Buffer const* rays;
+        Calc::Buffer* hits;
+        std::uint32_t num_rays;
+    };
+
+    /**
+    \brief Gathers queries into batch buffers and scatters their hits back.
+
+    Every queue has its own batch buffers, so batches on different queues can overlap.
+    */
+    class RayBatcher
+    {
+    public:
+        // Number of queries copied by a single launch
+        static std::uint32_t const kMaxSources = 8;
+
+        RayBatcher(Calc::Device* device);
+        ~RayBatcher();
+
+        // Set the profiler kernel launches are timed with, might be nullptr
+        void SetProfiler(KernelProfiler* profiler) { m_profiler = profiler; }
+
+        // Copy rays and hits of the queries to the batch buffers of the queue, records are
+        // ray_size and hit_size bytes. The buffers stay valid until the next gather on the queue.
+        void Gather(std::uint32_t queue_idx, BatchedQuery const* queries, std::uint32_t num_queries,
+            std::size_t ray_size, std::size_t hit_size, Calc::Buffer** rays, Calc::Buffer** hits);
+        // Copy the hits of the batch buffers of the queue back to the queries
+        void Scatter(std::uint32_t queue_idx, BatchedQuery const* queries, std::uint32_t num_queries,
+            std::size_t hit_size, Calc::Event** event);
+
+        RayBatcher(RayBatcher const&) = delete;
+        RayBatcher& operator = (RayBatcher const&) = delete;
+
+    private:
+        struct QueueData;
+
+        // Get storage of the queue, reallocate if it is too small
+        QueueData& GetQueueData(std::uint32_t queue_idx, std::size_t ray_bytes, std::size_t hit_bytes);
+        // Copy records of the queries between their buffers and the batch, launches are split into kMaxSources queries
+        void Copy(Calc::Function* func, std::uint32_t queue_idx, BatchedQuery const* queries, std::uint32_t num_queries,
+            std::size_t record_size, bool rays, Calc::Buffer* batch, Calc::Event** event, char const* name);
+
+        Calc::Device* m_device;
+        KernelProfiler* m_profiler;
+        Calc::Executable* m_executable;
+        Calc::Function* m_gather_func;
+        Calc::Function* m_scatter_func;
+        // Batch buffers, one set per queue
+        std::vector<std::unique_ptr<QueueData>> m_queues;
+    };
+}
@@ -0,0 +1,201 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "ray_compaction.h"
+#include "intersector.h"
+
+#include "../util/kernel_profiler.h"
+
+#include "buffer.h"
+#include "executable.h"
+#include "primitives.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#ifdef RR_EMBED_KERNELS
+#if USE_OPENCL
+#    include "RadeonRays/src/kernelcache/kernels_cl.h"
+#endif
+#endif // RR_EMBED_KERNELS
+
+// Preferred work group size for Radeon devices
+static int const kWorkGroupSize = 64;
+
+namespace RadeonRays
+{
+    struct RayCompaction::QueueData
+    {
+        // Device
+        Calc::Device* device;
+        // Compaction primitives, temporary storage is not shared between queues
+        Calc::Primitives* primitives;
+        // Ray flags, indices before compaction and after it if the caller doesn't want them
+        Calc::Buffer* flags;
+        Calc::Buffer* indices;
+        Calc::Buffer* compacted_indices;
+        // Number of rays the buffers can hold
+        std::uint32_t capacity;
+
+        QueueData(Calc::Device* d)
+            : device(d)
+            , primitives(d->CreatePrimitives())
+            , flags(nullptr)
+            , indices(nullptr)
+            , compacted_indices(nullptr)
+            , capacity(0)
+        {
+        }
+
+        void Release()
+        {
+            if (capacity)
+            {
+                device->DeleteBuffer(flags);
+                device->DeleteBuffer(indices);
+                device->DeleteBuffer(compacted_indices);
+                capacity = 0;
+            }
+        }
+
+        ~QueueData()
+        {
+            Release();
+            device->DeletePrimitives(primitives);
+        }
+    };
+
+    RayCompaction::RayCompaction(Calc::Device* device, int formats)
+        : m_device(device)
+        , m_profiler(nullptr)
+        , m_executable(nullptr)
+    {
+        assert(device->GetPlatform() == Calc::Platform::kOpenCL);
+        assert(device->HasBuiltinPrimitives());
+
+        // Active flags are read and whole ray records are copied in the intersector layout
+        std::string const buildopts = GetRecordFormatOptions(formats);
+
+#ifndef RR_EMBED_KERNELS
+        char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+        int numheaders = sizeof(headers) / sizeof(char const*);
+
+        m_executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/compact_rays.cl", headers, numheaders, buildopts.c_str());
+#else
+#if USE_OPENCL
+        m_executable = m_device->CompileExecutable(g_compact_rays_opencl, std::strlen(g_compact_rays_opencl), buildopts.c_str());
+#endif
+#endif
+
+        assert(m_executable);
+
+        m_flags_func = m_executable->CreateFunction("calculate_ray_flags_main");
+        m_gather_func = m_executable->CreateFunction("gather_rays_main");
+
+        // Concurrent queries on other queues never resize the per queue storage
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+        m_queues.resize(std::max(spec.max_num_queues, 1U));
+    }
+
+    RayCompaction::~RayCompaction()
+    {
+        m_queues.clear();
+        m_executable->DeleteFunction(m_flags_func);
+        m_executable->DeleteFunction(m_gather_func);
+        m_device->DeleteExecutable(m_executable);
+    }
+
+    RayCompaction::QueueData& RayCompaction::GetQueueData(std::uint32_t queue_idx, std::uint32_t max_rays)
+    {
+        if (m_queues.size() <= queue_idx)
+        {
+            m_queues.resize(queue_idx + 1);
+        }
+
+        auto& data = m_queues[queue_idx];
+
+        if (!data)
+        {
+            data.reset(new QueueData(m_device));
+        }
+
+        if (data->capacity < max_rays)
+        {
+            data->Release();
+            data->flags = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+            data->indices = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+            data->compacted_indices = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+            data->capacity = max_rays;
+        }
+
+        return *data;
+    }
+
+    void RayCompaction::Compact(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+        std::uint32_t max_rays, Calc::Buffer const* predicate, Calc::Buffer* compacted,
+        Calc::Buffer* new_num_rays, Calc::Buffer* indices, Calc::Event** event)
+    {
+        auto& data = GetQueueData(queue_idx, max_rays);
+        auto compacted_indices = indices ? indices : data.compacted_indices;
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        // Flag the rays, the count is only known on the device, so all max_rays flags are filled
+        {
+            int num_flags = static_cast<int>(max_rays);
+            int use_predicate = predicate ? 1 : 0;
+            int arg = 0;
+
+            m_flags_func->SetArg(arg++, rays);
+            m_flags_func->SetArg(arg++, num_rays);
+            m_flags_func->SetArg(arg++, sizeof(int), &num_flags);
+            // The kernel needs a valid buffer even if it doesn't read it
+            m_flags_func->SetArg(arg++, predicate ? predicate : num_rays);
+            m_flags_func->SetArg(arg++, sizeof(int), &use_predicate);
+            m_flags_func->SetArg(arg++, data.flags);
+            m_flags_func->SetArg(arg++, data.indices);
+
+            ProfiledExecute(m_profiler, m_device, m_flags_func, queue_idx, globalsize, localsize, nullptr, "compact.flags");
+        }
+
+        // The queue is in-order, so the count is read by the flags kernel before it is overwritten
+        ProfiledRun(m_profiler, queue_idx, "compact.indices", [&]()
+        {
+            data.primitives->CompactInt32(queue_idx, data.flags, data.indices, compacted_indices, max_rays, new_num_rays);
+        });
+
+        // Gather the kept rays
+        {
+            int arg = 0;
+
+            m_gather_func->SetArg(arg++, rays);
+            m_gather_func->SetArg(arg++, compacted_indices);
+            m_gather_func->SetArg(arg++, new_num_rays);
+            m_gather_func->SetArg(arg++, compacted);
+
+            ProfiledExecute(m_profiler, m_device, m_gather_func, queue_idx, globalsize, localsize, event, "compact.gather");
+        }
+    }
+}
@@ -0,0 +1,85 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file ray_compaction.h
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Ray compaction between wavefront passes.
+
+    Active rays, or rays selected by a user predicate, are copied to the front of
+    another buffer keeping their order, and the new count is written on the device,
+    so wavefront loops don't have to read ray counts back to the host.
+ */
+
+#pragma once
+#include "calc.h"
+#include "device.h"
+#include "radeon_rays.h"
+
+#include <memory>
+#include <vector>
+
+namespace RadeonRays
+{
+    class KernelProfiler;
+
+    /**
+    \brief Compacts ray buffers on the GPU.
+
+    Every queue has its own temporary storage, so compactions on different queues can overlap.
+    */
+    class RayCompaction
+    {
+    public:
+        // Constructor, formats has to match the record layouts of the intersector
+        RayCompaction(Calc::Device* device, int formats = 0);
+        // Destructor
+        ~RayCompaction();
+
+        // Set the profiler kernel launches are timed with, might be nullptr
+        void SetProfiler(KernelProfiler* profiler) { m_profiler = profiler; }
+
+        // Copy the kept rays of the first num_rays to compacted and their count to new_num_rays,
+        // rays are kept if they are active or, if predicate isn't nullptr, their predicate is non-zero.
+        // Source indices of the kept rays are written to indices if it isn't nullptr.
+        void Compact(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Buffer const* predicate, Calc::Buffer* compacted,
+            Calc::Buffer* new_num_rays, Calc::Buffer* indices, Calc::Event** event);
+
+        RayCompaction(RayCompaction const&) = delete;
+        RayCompaction& operator = (RayCompaction const&) = delete;
+
+    private:
+        struct QueueData;
+
+        // Get storage of the queue, reallocate if it is too small
+        QueueData& GetQueueData(std::uint32_t queue_idx, std::uint32_t max_rays);
+
+        Calc::Device* m_device;
+        KernelProfiler* m_profiler;
+        Calc::Executable* m_executable;
+        Calc::Function* m_flags_func;
+        Calc::Function* m_gather_func;
+        // Temporary storage, one per queue
+        std::vector<std::unique_ptr<QueueData>> m_queues;
+    };
+}
@@ -0,0 +1,161 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "ray_generator.h"
+#include "intersector.h"
+
+#include "../util/kernel_profiler.h"
+
+#include "buffer.h"
+#include "executable.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#ifdef RR_EMBED_KERNELS
+#if USE_OPENCL
+#    include "RadeonRays/src/kernelcache/kernels_cl.h"
+#endif
+#endif // RR_EMBED_KERNELS
+
+// Preferred work group size for Radeon devices
+static int const kWorkGroupSize = 64;
+
+namespace RadeonRays
+{
+    RayGenerator::RayGenerator(Calc::Device* device, int formats)
+        : m_device(device)
+        , m_profiler(nullptr)
+        , m_executable(nullptr)
+    {
+        assert(device->GetPlatform() == Calc::Platform::kOpenCL);
+
+        // Rays are written in the layout the intersector reads
+        std::string const buildopts = GetRecordFormatOptions(formats);
+
+#ifndef RR_EMBED_KERNELS
+        char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+        int numheaders = sizeof(headers) / sizeof(char const*);
+
+        m_executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/generate_rays.cl", headers, numheaders, buildopts.c_str());
+#else
+#if USE_OPENCL
+        m_executable = m_device->CompileExecutable(g_generate_rays_opencl, std::strlen(g_generate_rays_opencl), buildopts.c_str());
+#endif
+#endif
+
+        assert(m_executable);
+
+        m_pinhole_func = m_executable->CreateFunction("generate_pinhole_rays_main");
+        m_shadow_func = m_executable->CreateFunction("generate_shadow_rays_main");
+
+        // Concurrent queries on other queues never resize the per queue storage
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+        m_rays.resize(std::max(spec.max_num_queues, 1U));
+        m_capacity.resize(m_rays.size(), 0);
+    }
+
+    RayGenerator::~RayGenerator()
+    {
+        m_rays.clear();
+        m_executable->DeleteFunction(m_pinhole_func);
+        m_executable->DeleteFunction(m_shadow_func);
+        m_device->DeleteExecutable(m_executable);
+    }
+
+    Calc::Buffer* RayGenerator::GetRays(std::uint32_t queue_idx, std::uint32_t max_rays)
+    {
+        if (m_rays.size() <= queue_idx)
+        {
+            m_rays.resize(queue_idx + 1);
+            m_capacity.resize(queue_idx + 1, 0);
+        }
+
+        if (m_capacity[queue_idx] < max_rays)
+        {
+            // Sized for full ray records, compact ones are smaller
+            auto device = m_device;
+            m_rays[queue_idx] = std::unique_ptr<Calc::Buffer, std::function<void(Calc::Buffer*)>>(
+                m_device->CreateBuffer(max_rays * sizeof(ray), Calc::BufferType::kWrite),
+                [device](Calc::Buffer* buffer) { device->DeleteBuffer(buffer); });
+            m_capacity[queue_idx] = max_rays;
+        }
+
+        return m_rays[queue_idx].get();
+    }
+
+    Calc::Buffer* RayGenerator::GeneratePinhole(std::uint32_t queue_idx, PinholeCamera const& camera,
+        std::uint32_t width, std::uint32_t height)
+    {
+        std::uint32_t num_rays = width * height;
+        auto rays = GetRays(queue_idx, num_rays);
+
+        PinholeCamera args = camera;
+        int w = static_cast<int>(width);
+        int h = static_cast<int>(height);
+        int arg = 0;
+
+        m_pinhole_func->SetArg(arg++, sizeof(float4), &args.position);
+        m_pinhole_func->SetArg(arg++, sizeof(float4), &args.forward);
+        m_pinhole_func->SetArg(arg++, sizeof(float4), &args.right);
+        m_pinhole_func->SetArg(arg++, sizeof(float4), &args.up);
+        m_pinhole_func->SetArg(arg++, sizeof(int), &w);
+        m_pinhole_func->SetArg(arg++, sizeof(int), &h);
+        m_pinhole_func->SetArg(arg++, rays);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((num_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        ProfiledExecute(m_profiler, m_device, m_pinhole_func, queue_idx, globalsize, localsize, nullptr, "generate.pinhole");
+
+        return rays;
+    }
+
+    Calc::Buffer* RayGenerator::GenerateShadow(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* hits,
+        Calc::Buffer const* num_rays, std::uint32_t max_rays, float3 const& light, float epsilon,
+        Calc::Buffer* results, bool packed_results)
+    {
+        auto shadow_rays = GetRays(queue_idx, max_rays);
+
+        float4 light_pos = light;
+        int write_results = packed_results ? 0 : 1;
+        int arg = 0;
+
+        m_shadow_func->SetArg(arg++, rays);
+        m_shadow_func->SetArg(arg++, hits);
+        m_shadow_func->SetArg(arg++, num_rays);
+        m_shadow_func->SetArg(arg++, sizeof(float4), &light_pos);
+        m_shadow_func->SetArg(arg++, sizeof(float), &epsilon);
+        m_shadow_func->SetArg(arg++, shadow_rays);
+        m_shadow_func->SetArg(arg++, results);
+        m_shadow_func->SetArg(arg++, sizeof(int), &write_results);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        ProfiledExecute(m_profiler, m_device, m_shadow_func, queue_idx, globalsize, localsize, nullptr, "generate.shadow");
+
+        return shadow_rays;
+    }
+}
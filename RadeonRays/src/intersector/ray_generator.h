@@ -0,0 +1,89 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file ray_generator.h
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Built-in primary and shadow ray generators.
+
+    Rays are generated by OpenCL kernels into storage owned by the generator
+    and traversed by the intersector right after, so callers don't need a
+    ray generation pass of their own.
+ */
+
+#pragma once
+#include "calc.h"
+#include "device.h"
+#include "radeon_rays.h"
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace RadeonRays
+{
+    class KernelProfiler;
+
+    /**
+    \brief Generates rays on the GPU for the queries of an intersector.
+
+    Every queue has its own ray storage, so generated rays stay valid until
+    the next generation on the same queue, which is enough for in-order queues.
+    */
+    class RayGenerator
+    {
+    public:
+        // Constructor, formats has to match the record layouts of the intersector
+        RayGenerator(Calc::Device* device, int formats = 0);
+        // Destructor
+        ~RayGenerator();
+
+        // Set the profiler kernel launches are timed with, might be nullptr
+        void SetProfiler(KernelProfiler* profiler) { m_profiler = profiler; }
+
+        // Generate width * height primary rays of the camera
+        Calc::Buffer* GeneratePinhole(std::uint32_t queue_idx, PinholeCamera const& camera,
+            std::uint32_t width, std::uint32_t height);
+        // Generate shadow rays from the closest hits of rays towards a point light, results of the
+        // inactive ones are set to not occluded if results holds one int per ray, bit packed ones
+        // are written by traversal for all rays
+        Calc::Buffer* GenerateShadow(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* hits,
+            Calc::Buffer const* num_rays, std::uint32_t max_rays, float3 const& light, float epsilon,
+            Calc::Buffer* results, bool packed_results);
+
+        RayGenerator(RayGenerator const&) = delete;
+        RayGenerator& operator = (RayGenerator const&) = delete;
+
+    private:
+        // Get ray storage of the queue, reallocate if it is too small
+        Calc::Buffer* GetRays(std::uint32_t queue_idx, std::uint32_t max_rays);
+
+        Calc::Device* m_device;
+        KernelProfiler* m_profiler;
+        Calc::Executable* m_executable;
+        Calc::Function* m_pinhole_func;
+        Calc::Function* m_shadow_func;
+        // Generated rays and their capacity, one per queue
+        std::vector<std::unique_ptr<Calc::Buffer, std::function<void(Calc::Buffer*)>>> m_rays;
+        std::vector<std::uint32_t> m_capacity;
+    };
+}
@@ -0,0 +1,218 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "ray_layout.h"
+#include "intersector.h"
+
+#include "../util/kernel_profiler.h"
+
+#include "buffer.h"
+#include "executable.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#ifdef RR_EMBED_KERNELS
+#if USE_OPENCL
+#    include "RadeonRays/src/kernelcache/kernels_cl.h"
+#endif
+#endif // RR_EMBED_KERNELS
+
+// Preferred work group size for Radeon devices
+static int const kWorkGroupSize = 64;
+
+namespace RadeonRays
+{
+    struct RayLayoutConverter::QueueData
+    {
+        // Device
+        Calc::Device* device;
+        // Records of the last gather
+        Calc::Buffer* rays;
+        Calc::Buffer* hits;
+        // Bytes the buffers can hold
+        std::size_t ray_capacity;
+        std::size_t hit_capacity;
+
+        QueueData(Calc::Device* d)
+            : device(d)
+            , rays(nullptr)
+            , hits(nullptr)
+            , ray_capacity(0)
+            , hit_capacity(0)
+        {
+        }
+
+        ~QueueData()
+        {
+            if (rays)
+            {
+                device->DeleteBuffer(rays);
+            }
+
+            if (hits)
+            {
+                device->DeleteBuffer(hits);
+            }
+        }
+    };
+
+    RayLayoutConverter::RayLayoutConverter(Calc::Device* device, int formats)
+        : m_device(device)
+        , m_profiler(nullptr)
+        , m_ray_size((formats & kCompactRays) ? sizeof(PackedRay) : sizeof(ray))
+        , m_executable(nullptr)
+    {
+        assert(device->GetPlatform() == Calc::Platform::kOpenCL);
+
+        // Records are built and read in the intersector layout
+        std::string const buildopts = GetRecordFormatOptions(formats);
+
+#ifndef RR_EMBED_KERNELS
+        char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+        int numheaders = sizeof(headers) / sizeof(char const*);
+
+        m_executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/ray_layout.cl", headers, numheaders, buildopts.c_str());
+#else
+#if USE_OPENCL
+        m_executable = m_device->CompileExecutable(g_ray_layout_opencl, std::strlen(g_ray_layout_opencl), buildopts.c_str());
+#endif
+#endif
+
+        assert(m_executable);
+
+        m_gather_func = m_executable->CreateFunction("gather_ray_streams_main");
+        m_scatter_func = m_executable->CreateFunction("scatter_hit_streams_main");
+
+        // Concurrent queries on other queues never resize the per queue storage
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+        m_queues.resize(std::max(spec.max_num_queues, 1U));
+    }
+
+    RayLayoutConverter::~RayLayoutConverter()
+    {
+        m_queues.clear();
+        m_executable->DeleteFunction(m_gather_func);
+        m_executable->DeleteFunction(m_scatter_func);
+        m_device->DeleteExecutable(m_executable);
+    }
+
+    RayLayoutConverter::QueueData& RayLayoutConverter::GetQueueData(std::uint32_t queue_idx, std::size_t ray_bytes, std::size_t hit_bytes)
+    {
+        if (m_queues.size() <= queue_idx)
+        {
+            m_queues.resize(queue_idx + 1);
+        }
+
+        auto& data = m_queues[queue_idx];
+
+        if (!data)
+        {
+            data.reset(new QueueData(m_device));
+        }
+
+        if (data->ray_capacity < ray_bytes)
+        {
+            if (data->rays)
+            {
+                m_device->DeleteBuffer(data->rays);
+            }
+
+            data->rays = m_device->CreateBuffer(ray_bytes, Calc::BufferType::kWrite);
+            data->ray_capacity = ray_bytes;
+        }
+
+        if (data->hit_capacity < hit_bytes)
+        {
+            if (data->hits)
+            {
+                m_device->DeleteBuffer(data->hits);
+            }
+
+            data->hits = m_device->CreateBuffer(hit_bytes, Calc::BufferType::kWrite);
+            data->hit_capacity = hit_bytes;
+        }
+
+        return *data;
+    }
+
+    void RayLayoutConverter::GatherRays(std::uint32_t queue_idx, RayStreams const& streams, std::uint32_t num_rays,
+        std::size_t hit_size, Calc::Buffer** rays, Calc::Buffer** hits)
+    {
+        // Empty queries still get valid buffers
+        std::size_t const size = std::max(num_rays, 1U);
+        auto& data = GetQueueData(queue_idx, size * m_ray_size, size * hit_size);
+
+        // Optional streams are replaced by a bound buffer never read
+        int has_maxt = streams.maxt ? 1 : 0;
+        int has_masks = streams.masks ? 1 : 0;
+        int count = static_cast<int>(num_rays);
+
+        int arg = 0;
+        m_gather_func->SetArg(arg++, streams.origins);
+        m_gather_func->SetArg(arg++, streams.directions);
+        m_gather_func->SetArg(arg++, has_maxt ? streams.maxt : streams.origins);
+        m_gather_func->SetArg(arg++, sizeof(has_maxt), &has_maxt);
+        m_gather_func->SetArg(arg++, has_masks ? streams.masks : streams.origins);
+        m_gather_func->SetArg(arg++, sizeof(has_masks), &has_masks);
+        m_gather_func->SetArg(arg++, sizeof(count), &count);
+        m_gather_func->SetArg(arg++, data.rays);
+
+        std::size_t const localsize = kWorkGroupSize;
+        std::size_t const globalsize = ((size + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        ProfiledExecute(m_profiler, m_device, m_gather_func, queue_idx, globalsize, localsize, nullptr, "layout.gather_rays");
+
+        *rays = data.rays;
+        *hits = data.hits;
+    }
+
+    void RayLayoutConverter::ScatterHits(std::uint32_t queue_idx, HitStreams const& streams, std::uint32_t num_rays, Calc::Event** event)
+    {
+        auto& data = *m_queues[queue_idx];
+
+        // Streams which are not written are replaced by the record buffer
+        Calc::Buffer* outputs[] = { streams.shape_ids, streams.prim_ids, streams.uvs, streams.distances };
+        int fields = 0;
+        int count = static_cast<int>(num_rays);
+
+        int arg = 0;
+        m_scatter_func->SetArg(arg++, data.hits);
+        m_scatter_func->SetArg(arg++, sizeof(count), &count);
+        int const fields_arg = arg++;
+
+        for (int i = 0; i < 4; ++i)
+        {
+            fields |= outputs[i] ? (1 << i) : 0;
+            m_scatter_func->SetArg(arg++, outputs[i] ? outputs[i] : data.hits);
+        }
+
+        m_scatter_func->SetArg(fields_arg, sizeof(fields), &fields);
+
+        std::size_t const localsize = kWorkGroupSize;
+        std::size_t const globalsize = ((std::max(num_rays, 1U) + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        ProfiledExecute(m_profiler, m_device, m_scatter_func, queue_idx, globalsize, localsize, event, "layout.scatter_hits");
+    }
+}
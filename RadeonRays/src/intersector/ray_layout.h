@@ -0,0 +1,110 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file ray_layout.h
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Queries with structure of arrays ray and hit layouts.
+
+    Rays are built from separate streams into the record layout of the intersector on the device
+    and hit records are split back into streams, so callers keeping rays in structure of arrays
+    layouts don't have to convert them, and stream accesses stay coalesced.
+ */
+
+#pragma once
+#include "calc.h"
+#include "device.h"
+
+#include <memory>
+#include <vector>
+
+namespace RadeonRays
+{
+    class KernelProfiler;
+
+    // Ray streams of a query, element i of every stream belongs to ray i
+    struct RayStreams
+    {
+        // 3 floats per ray
+        Calc::Buffer const* origins;
+        Calc::Buffer const* directions;
+        // Float per ray, nullptr for unbounded rays
+        Calc::Buffer const* maxt;
+        // Int per ray, nullptr for all mask bits set
+        Calc::Buffer const* masks;
+    };
+
+    // Hit streams of a query, streams which are nullptr are not written
+    struct HitStreams
+    {
+        // Int per ray
+        Calc::Buffer* shape_ids;
+        Calc::Buffer* prim_ids;
+        // 2 floats per ray
+        Calc::Buffer* uvs;
+        // Float per ray
+        Calc::Buffer* distances;
+    };
+
+    /**
+    \brief Converts between ray and hit streams and records on the GPU.
+
+    Every queue has its own record buffers, so conversions on different queues can overlap.
+    */
+    class RayLayoutConverter
+    {
+    public:
+        // Constructor, formats has to match the record layouts of the intersector
+        RayLayoutConverter(Calc::Device* device, int formats = 0);
+        // Destructor
+        ~RayLayoutConverter();
+
+        // Set the profiler kernel launches are timed with, might be nullptr
+        void SetProfiler(KernelProfiler* profiler) { m_profiler = profiler; }
+
+        // Build records of num_rays rays of the streams, hits holds num_rays records of hit_size bytes.
+        // The buffers stay valid until the next gather on the queue.
+        void GatherRays(std::uint32_t queue_idx, RayStreams const& streams, std::uint32_t num_rays,
+            std::size_t hit_size, Calc::Buffer** rays, Calc::Buffer** hits);
+        // Split the hit records of the last gather on the queue into the streams
+        void ScatterHits(std::uint32_t queue_idx, HitStreams const& streams, std::uint32_t num_rays, Calc::Event** event);
+
+        RayLayoutConverter(RayLayoutConverter const&) = delete;
+        RayLayoutConverter& operator = (RayLayoutConverter const&) = delete;
+
+    private:
+        struct QueueData;
+
+        // Get storage of the queue, reallocate if it is too small
+        QueueData& GetQueueData(std::uint32_t queue_idx, std::size_t ray_bytes, std::size_t hit_bytes);
+
+        Calc::Device* m_device;
+        KernelProfiler* m_profiler;
+        // Size of a ray record
+        std::size_t m_ray_size;
+        Calc::Executable* m_executable;
+        Calc::Function* m_gather_func;
+        Calc::Function* m_scatter_func;
+        // Record buffers, one set per queue
+        std::vector<std::unique_ptr<QueueData>> m_queues;
+    };
+}
@@ -0,0 +1,382 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "ray_reorder.h"
+#include "intersector.h"
+
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
+#include "../primitive/spheres.h"
+#include "../world/world.h"
+#include "../util/kernel_profiler.h"
+#include "math/mathutils.h"
+
+#include "buffer.h"
+#include "executable.h"
+#include "primitives.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#ifdef RR_EMBED_KERNELS
+#if USE_OPENCL
+#    include "RadeonRays/src/kernelcache/kernels_cl.h"
+#endif
+#endif // RR_EMBED_KERNELS
+
+// Preferred work group size for Radeon devices
+static int const kWorkGroupSize = 64;
+
+namespace RadeonRays
+{
+    struct RayReorder::QueueData
+    {
+        // Device
+        Calc::Device* device;
+        // Sorting primitives, temporary storage is not shared between queues
+        Calc::Primitives* primitives;
+        // Ray keys and indices before and after sorting
+        Calc::Buffer* keys;
+        Calc::Buffer* indices;
+        Calc::Buffer* sorted_keys;
+        Calc::Buffer* sorted_indices;
+        // Rays and hits in sorted order
+        Calc::Buffer* sorted_rays;
+        Calc::Buffer* sorted_hits;
+        // Number of rays the buffers can hold
+        std::uint32_t capacity;
+        // Image layout sorted_indices hold the order of, 0 width if they hold a ray key order
+        std::uint32_t image_width;
+        std::uint32_t image_height;
+        RayOrder image_order;
+
+        QueueData(Calc::Device* d)
+            : device(d)
+            , primitives(d->CreatePrimitives())
+            , keys(nullptr)
+            , indices(nullptr)
+            , sorted_keys(nullptr)
+            , sorted_indices(nullptr)
+            , sorted_rays(nullptr)
+            , sorted_hits(nullptr)
+            , capacity(0)
+            , image_width(0)
+            , image_height(0)
+            , image_order(kRayOrderScanline)
+        {
+        }
+
+        void Release()
+        {
+            if (capacity)
+            {
+                device->DeleteBuffer(keys);
+                device->DeleteBuffer(indices);
+                device->DeleteBuffer(sorted_keys);
+                device->DeleteBuffer(sorted_indices);
+                device->DeleteBuffer(sorted_rays);
+                device->DeleteBuffer(sorted_hits);
+                capacity = 0;
+                image_width = 0;
+            }
+        }
+
+        ~QueueData()
+        {
+            Release();
+            device->DeletePrimitives(primitives);
+        }
+    };
+
+    RayReorder::RayReorder(Calc::Device* device, int formats)
+        : m_device(device)
+        , m_profiler(nullptr)
+        , m_executable(nullptr)
+        , m_scene_bound(nullptr)
+    {
+        assert(device->GetPlatform() == Calc::Platform::kOpenCL);
+        assert(device->HasBuiltinPrimitives());
+
+        // Gather and scatter kernels copy whole ray and hit records
+        std::string const buildopts = GetRecordFormatOptions(formats);
+
+#ifndef RR_EMBED_KERNELS
+        char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+        int numheaders = sizeof(headers) / sizeof(char const*);
+
+        m_executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/reorder_rays.cl", headers, numheaders, buildopts.c_str());
+#else
+#if USE_OPENCL
+        m_executable = m_device->CompileExecutable(g_reorder_rays_opencl, std::strlen(g_reorder_rays_opencl), buildopts.c_str());
+#endif
+#endif
+
+        assert(m_executable);
+
+        m_key_func = m_executable->CreateFunction("calculate_ray_keys_main");
+        m_image_key_func = m_executable->CreateFunction("calculate_image_keys_main");
+        m_gather_isect_func = m_executable->CreateFunction("gather_intersections_main");
+        m_scatter_isect_func = m_executable->CreateFunction("scatter_intersections_main");
+        m_gather_occlude_func = m_executable->CreateFunction("gather_occlusions_main");
+        m_scatter_occlude_func = m_executable->CreateFunction("scatter_occlusions_main");
+
+        m_scene_bound = m_device->CreateBuffer(sizeof(bbox), Calc::BufferType::kRead);
+
+        // Concurrent queries on other queues never resize the per queue storage
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+        m_queues.resize(std::max(spec.max_num_queues, 1U));
+    }
+
+    RayReorder::~RayReorder()
+    {
+        m_queues.clear();
+        m_device->DeleteBuffer(m_scene_bound);
+        m_executable->DeleteFunction(m_key_func);
+        m_executable->DeleteFunction(m_image_key_func);
+        m_executable->DeleteFunction(m_gather_isect_func);
+        m_executable->DeleteFunction(m_scatter_isect_func);
+        m_executable->DeleteFunction(m_gather_occlude_func);
+        m_executable->DeleteFunction(m_scatter_occlude_func);
+        m_device->DeleteExecutable(m_executable);
+    }
+
+    void RayReorder::SetWorld(World const& world)
+    {
+        // World space bounds of all the shapes, instances transform bounds of their base meshes
+        bbox scene_bound;
+        for (auto shape : world.shapes_)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+
+            // Positions of device meshes aren't available on the host, the bound only
+            // affects sorting quality since origins outside of it are clamped
+            if (shapeimpl->is_device_mesh())
+            {
+                continue;
+            }
+
+            matrix m, minv;
+            shape->GetTransform(m, minv);
+
+            if (shapeimpl->is_spheres())
+            {
+                auto spheres = static_cast<Spheres const*>(shape);
+                std::vector<bbox> bounds(spheres->num_spheres());
+                spheres->ComputeAllBounds(m, bounds.data());
+
+                for (auto const& b : bounds)
+                {
+                    scene_bound.grow(b);
+                }
+
+                continue;
+            }
+
+            Mesh const* mesh = shapeimpl->is_instance() ?
+                static_cast<Mesh const*>(static_cast<Instance const*>(shape)->GetBaseShape()) :
+                static_cast<Mesh const*>(shape);
+
+            bbox mesh_bound;
+            for (int i = 0; i < mesh->num_vertices(); ++i)
+            {
+                mesh_bound.grow(mesh->GetVertex(i));
+            }
+
+            scene_bound.grow(transform_bbox(mesh_bound, m));
+        }
+
+        m_device->WriteBuffer(m_scene_bound, 0, 0, sizeof(bbox), &scene_bound, nullptr);
+        m_device->Finish(0);
+    }
+
+    RayReorder::QueueData& RayReorder::GetQueueData(std::uint32_t queue_idx, std::uint32_t max_rays)
+    {
+        if (m_queues.size() <= queue_idx)
+        {
+            m_queues.resize(queue_idx + 1);
+        }
+
+        auto& data = m_queues[queue_idx];
+
+        if (!data)
+        {
+            data.reset(new QueueData(m_device));
+        }
+
+        if (data->capacity < max_rays)
+        {
+            data->Release();
+            data->keys = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+            data->indices = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+            data->sorted_keys = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+            data->sorted_indices = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+            data->sorted_rays = m_device->CreateBuffer(max_rays * sizeof(ray), Calc::BufferType::kWrite);
+            // Sized for full closest hit records, compact ones and occlusion results are smaller
+            data->sorted_hits = m_device->CreateBuffer(max_rays * sizeof(Intersection), Calc::BufferType::kWrite);
+            data->capacity = max_rays;
+        }
+
+        return *data;
+    }
+
+    void RayReorder::GatherIntersections(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+        std::uint32_t max_rays, Calc::Buffer const* hits, Calc::Buffer** sorted_rays, Calc::Buffer** sorted_hits)
+    {
+        Gather(m_gather_isect_func, queue_idx, rays, num_rays, max_rays, hits, sorted_rays, sorted_hits);
+    }
+
+    void RayReorder::GatherImageIntersections(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+        std::uint32_t width, std::uint32_t height, RayOrder order, Calc::Buffer const* hits,
+        Calc::Buffer** sorted_rays, Calc::Buffer** sorted_hits)
+    {
+        assert(order != kRayOrderScanline);
+
+        std::uint32_t const num_pixels = width * height;
+        auto& data = GetQueueData(queue_idx, num_pixels);
+
+        // The order only depends on the image layout, so frames of the same size skip the sort
+        if (data.image_width != width || data.image_height != height || data.image_order != order)
+        {
+            size_t localsize = kWorkGroupSize;
+            size_t globalsize = ((num_pixels + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+            int w = static_cast<int>(width);
+            int h = static_cast<int>(height);
+            int o = static_cast<int>(order);
+            int arg = 0;
+
+            m_image_key_func->SetArg(arg++, sizeof(int), &w);
+            m_image_key_func->SetArg(arg++, sizeof(int), &h);
+            m_image_key_func->SetArg(arg++, sizeof(int), &o);
+            m_image_key_func->SetArg(arg++, data.keys);
+            m_image_key_func->SetArg(arg++, data.indices);
+
+            ProfiledExecute(m_profiler, m_device, m_image_key_func, queue_idx, globalsize, localsize, nullptr, "reorder.image_keys");
+
+            ProfiledRun(m_profiler, queue_idx, "reorder.sort", [&]()
+            {
+                data.primitives->SortRadixInt32(queue_idx, data.keys, data.sorted_keys, data.indices, data.sorted_indices, num_pixels);
+            });
+
+            data.image_width = width;
+            data.image_height = height;
+            data.image_order = order;
+        }
+
+        GatherSorted(m_gather_isect_func, data, queue_idx, rays, num_rays, num_pixels, hits, sorted_rays, sorted_hits);
+    }
+
+    void RayReorder::ScatterIntersections(std::uint32_t queue_idx, Calc::Buffer const* num_rays,
+        std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event)
+    {
+        Scatter(m_scatter_isect_func, queue_idx, num_rays, max_rays, hits, event);
+    }
+
+    void RayReorder::GatherOcclusions(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+        std::uint32_t max_rays, Calc::Buffer const* hits, Calc::Buffer** sorted_rays, Calc::Buffer** sorted_hits)
+    {
+        Gather(m_gather_occlude_func, queue_idx, rays, num_rays, max_rays, hits, sorted_rays, sorted_hits);
+    }
+
+    void RayReorder::ScatterOcclusions(std::uint32_t queue_idx, Calc::Buffer const* num_rays,
+        std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event)
+    {
+        Scatter(m_scatter_occlude_func, queue_idx, num_rays, max_rays, hits, event);
+    }
+
+    void RayReorder::Gather(Calc::Function* func, std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+        std::uint32_t max_rays, Calc::Buffer const* hits, Calc::Buffer** sorted_rays, Calc::Buffer** sorted_hits)
+    {
+        auto& data = GetQueueData(queue_idx, max_rays);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        // Calculate keys, the number of rays is only known on the device,
+        // so all max_rays keys are sorted with inactive keys for the padding
+        {
+            int num_keys = static_cast<int>(max_rays);
+            int arg = 0;
+
+            m_key_func->SetArg(arg++, rays);
+            m_key_func->SetArg(arg++, num_rays);
+            m_key_func->SetArg(arg++, sizeof(int), &num_keys);
+            m_key_func->SetArg(arg++, m_scene_bound);
+            m_key_func->SetArg(arg++, data.keys);
+            m_key_func->SetArg(arg++, data.indices);
+
+            ProfiledExecute(m_profiler, m_device, m_key_func, queue_idx, globalsize, localsize, nullptr, "reorder.keys");
+        }
+
+        ProfiledRun(m_profiler, queue_idx, "reorder.sort", [&]()
+        {
+            data.primitives->SortRadixInt32(queue_idx, data.keys, data.sorted_keys, data.indices, data.sorted_indices, max_rays);
+        });
+
+        // Sorted indices no longer hold an image order
+        data.image_width = 0;
+
+        GatherSorted(func, data, queue_idx, rays, num_rays, max_rays, hits, sorted_rays, sorted_hits);
+    }
+
+    void RayReorder::GatherSorted(Calc::Function* func, QueueData& data, std::uint32_t queue_idx, Calc::Buffer const* rays,
+        Calc::Buffer const* num_rays, std::uint32_t max_rays, Calc::Buffer const* hits,
+        Calc::Buffer** sorted_rays, Calc::Buffer** sorted_hits)
+    {
+        int arg = 0;
+
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, hits);
+        func->SetArg(arg++, num_rays);
+        func->SetArg(arg++, data.sorted_indices);
+        func->SetArg(arg++, data.sorted_rays);
+        func->SetArg(arg++, data.sorted_hits);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        ProfiledExecute(m_profiler, m_device, func, queue_idx, globalsize, localsize, nullptr, "reorder.gather");
+
+        *sorted_rays = data.sorted_rays;
+        *sorted_hits = data.sorted_hits;
+    }
+
+    void RayReorder::Scatter(Calc::Function* func, std::uint32_t queue_idx, Calc::Buffer const* num_rays,
+        std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event)
+    {
+        auto& data = *m_queues[queue_idx];
+
+        int arg = 0;
+
+        func->SetArg(arg++, data.sorted_hits);
+        func->SetArg(arg++, num_rays);
+        func->SetArg(arg++, data.sorted_indices);
+        func->SetArg(arg++, hits);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        ProfiledExecute(m_profiler, m_device, func, queue_idx, globalsize, localsize, event, "reorder.scatter");
+    }
+}
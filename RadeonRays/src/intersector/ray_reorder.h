@@ -0,0 +1,118 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file ray_reorder.h
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Ray reordering pass improving traversal coherence.
+
+    Incoherent rays (i.e. diffuse bounces) are sorted by a key made of direction octant
+    and Morton code of the origin before traversal, so neighbouring work items traverse
+    similar parts of the BVH. Image-shaped batches are ordered by pixel position instead.
+    Hits are scattered back to original ray indices afterwards.
+ */
+
+#pragma once
+#include "calc.h"
+#include "device.h"
+#include "radeon_rays.h"
+
+#include <memory>
+#include <vector>
+
+namespace RadeonRays
+{
+    class World;
+    class KernelProfiler;
+
+    /**
+    \brief Sorts rays on the GPU and restores original order of the hits.
+
+    Gather and scatter calls of one query are issued on the same queue, each queue
+    has its own sorting storage, so queries on different queues can overlap.
+    */
+    class RayReorder
+    {
+    public:
+        // Constructor, formats has to match the record layouts of the intersector
+        RayReorder(Calc::Device* device, int formats = 0);
+        // Destructor
+        ~RayReorder();
+
+        // Update scene bounds used for origin quantization
+        void SetWorld(World const& world);
+        // Set the profiler kernel launches are timed with, might be nullptr
+        void SetProfiler(KernelProfiler* profiler) { m_profiler = profiler; }
+
+        // Sort rays and hits, the results are valid until the next call on the queue
+        void GatherIntersections(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Buffer const* hits, Calc::Buffer** sorted_rays, Calc::Buffer** sorted_hits);
+        // Order rays and hits of a width x height image in Morton or tile order of their pixels,
+        // the order is kept between calls on the queue with the same image layout
+        void GatherImageIntersections(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+            std::uint32_t width, std::uint32_t height, RayOrder order, Calc::Buffer const* hits,
+            Calc::Buffer** sorted_rays, Calc::Buffer** sorted_hits);
+        // Write sorted hits back in original order
+        void ScatterIntersections(std::uint32_t queue_idx, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event);
+
+        // Sort rays and occlusion results, the results are valid until the next call on the queue
+        void GatherOcclusions(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Buffer const* hits, Calc::Buffer** sorted_rays, Calc::Buffer** sorted_hits);
+        // Write sorted occlusion results back in original order
+        void ScatterOcclusions(std::uint32_t queue_idx, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event);
+
+        RayReorder(RayReorder const&) = delete;
+        RayReorder& operator = (RayReorder const&) = delete;
+
+    private:
+        struct QueueData;
+
+        // Calculate keys, sort them and gather rays and hits in key order
+        void Gather(Calc::Function* func, std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Buffer const* hits, Calc::Buffer** sorted_rays, Calc::Buffer** sorted_hits);
+        // Gather rays and hits in the order of sorted indices
+        void GatherSorted(Calc::Function* func, QueueData& data, std::uint32_t queue_idx, Calc::Buffer const* rays,
+            Calc::Buffer const* num_rays, std::uint32_t max_rays, Calc::Buffer const* hits,
+            Calc::Buffer** sorted_rays, Calc::Buffer** sorted_hits);
+        // Scatter hits back to original indices
+        void Scatter(Calc::Function* func, std::uint32_t queue_idx, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event);
+        // Get storage of the queue, reallocate if it is too small
+        QueueData& GetQueueData(std::uint32_t queue_idx, std::uint32_t max_rays);
+
+        Calc::Device* m_device;
+        KernelProfiler* m_profiler;
+        Calc::Executable* m_executable;
+        Calc::Function* m_key_func;
+        Calc::Function* m_image_key_func;
+        Calc::Function* m_gather_isect_func;
+        Calc::Function* m_scatter_isect_func;
+        Calc::Function* m_gather_occlude_func;
+        Calc::Function* m_scatter_occlude_func;
+        // Scene bounds
+        Calc::Buffer* m_scene_bound;
+        // Sorting storage, one per queue
+        std::vector<std::unique_ptr<QueueData>> m_queues;
+    };
+}
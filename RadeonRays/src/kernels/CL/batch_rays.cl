@@ -0,0 +1,134 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file batch_rays.cl
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Copies between small queries and a combined batch.
+
+    Records are copied as 32-bit words, so the kernels don't depend on the ray and hit
+    layouts. A launch handles up to 8 sources, starts holds the first word of each of
+    them in the batch, unused sources start at the end and are never selected.
+ */
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+/*************************************************************************
+FUNCTIONS
+**************************************************************************/
+// Index of the source the batch word belongs to
+INLINE int find_batch_source(int word, int8 starts)
+{
+    return (word >= starts.s1) + (word >= starts.s2) + (word >= starts.s3) + (word >= starts.s4) +
+        (word >= starts.s5) + (word >= starts.s6) + (word >= starts.s7);
+}
+
+INLINE int get_batch_start(int source, int8 starts)
+{
+    int start[8];
+    vstore8(starts, 0, start);
+    return start[source];
+}
+
+/*************************************************************************
+KERNELS
+**************************************************************************/
+// Copy the words of the sources to consecutive ranges of the batch
+KERNEL void gather_batch_main(
+    GLOBAL int const* src0,
+    GLOBAL int const* src1,
+    GLOBAL int const* src2,
+    GLOBAL int const* src3,
+    GLOBAL int const* src4,
+    GLOBAL int const* src5,
+    GLOBAL int const* src6,
+    GLOBAL int const* src7,
+    // First word of each source in the batch
+    int8 starts,
+    // End of the last source
+    int end,
+    // Batch
+    GLOBAL int* restrict batch
+)
+{
+    int const word = starts.s0 + (int)get_global_id(0);
+
+    if (word < end)
+    {
+        int const source = find_batch_source(word, starts);
+        int const offset = word - get_batch_start(source, starts);
+
+        switch (source)
+        {
+        case 0: batch[word] = src0[offset]; break;
+        case 1: batch[word] = src1[offset]; break;
+        case 2: batch[word] = src2[offset]; break;
+        case 3: batch[word] = src3[offset]; break;
+        case 4: batch[word] = src4[offset]; break;
+        case 5: batch[word] = src5[offset]; break;
+        case 6: batch[word] = src6[offset]; break;
+        default: batch[word] = src7[offset]; break;
+        }
+    }
+}
+
+// Copy consecutive ranges of the batch back to the destinations
+KERNEL void scatter_batch_main(
+    // Batch
+    GLOBAL int const* restrict batch,
+    // First word of each destination in the batch
+    int8 starts,
+    // End of the last destination
+    int end,
+    GLOBAL int* dst0,
+    GLOBAL int* dst1,
+    GLOBAL int* dst2,
+    GLOBAL int* dst3,
+    GLOBAL int* dst4,
+    GLOBAL int* dst5,
+    GLOBAL int* dst6,
+    GLOBAL int* dst7
+)
+{
+    int const word = starts.s0 + (int)get_global_id(0);
+
+    if (word < end)
+    {
+        int const source = find_batch_source(word, starts);
+        int const offset = word - get_batch_start(source, starts);
+        int const value = batch[word];
+
+        switch (source)
+        {
+        case 0: dst0[offset] = value; break;
+        case 1: dst1[offset] = value; break;
+        case 2: dst2[offset] = value; break;
+        case 3: dst3[offset] = value; break;
+        case 4: dst4[offset] = value; break;
+        case 5: dst5[offset] = value; break;
+        case 6: dst6[offset] = value; break;
+        default: dst7[offset] = value; break;
+        }
+    }
+}
@@ -47,6 +47,13 @@ DEFINES
 #define NODEIDX(i) (i)
 // Shortcut for delta evaluation
 #define DELTA(i,j) delta(morton_codes,num_prims,i,j)
+// Maximum number of treelet leaves for the restructuring, 2^n subsets are evaluated
+#define TREELET_SIZE 7
+#define TREELET_SUBSETS (1 << TREELET_SIZE)
+// Leaf check
+#define IS_LEAF(n) ((n).left == (n).right)
+// Morton codes are 63 bits, so the top bit is always zero
+#define MORTON_UNUSED_BITS 1
 
 /*************************************************************************
 TYPE DEFINITIONS
@@ -59,32 +66,48 @@ typedef struct
     int next;
 } HlbvhNode;
 
+// Triangle, has to match the face layout of the intersector
+typedef struct
+{
+    // Vertex indices
+    int idx[3];
+    // Shape maks
+    int shape_mask;
+    // Shape ID
+    int shape_id;
+    // Primitive ID
+    int prim_id;
+} Face;
+
 /*************************************************************************
 FUNCTIONS
 **************************************************************************/
-// The following two functions are from
+// The following two functions are based on
 // http://devblogs.nvidia.com/parallelforall/thinking-parallel-part-iii-tree-construction-gpu/
-// Expands a 10-bit integer into 30 bits
+// Expands a 21-bit integer into 63 bits
 // by inserting 2 zeros after each bit.
-INLINE uint expand_bits(uint v)
+INLINE ulong expand_bits64(ulong v)
 {
-    v = (v * 0x00010001u) & 0xFF0000FFu;
-    v = (v * 0x00000101u) & 0x0F00F00Fu;
-    v = (v * 0x00000011u) & 0xC30C30C3u;
-    v = (v * 0x00000005u) & 0x49249249u;
+    v &= 0x1ffffful;
+    v = (v | (v << 32)) & 0x1f00000000fffful;
+    v = (v | (v << 16)) & 0x1f0000ff0000fful;
+    v = (v | (v << 8)) & 0x100f00f00f00f00ful;
+    v = (v | (v << 4)) & 0x10c30c30c30c30c3ul;
+    v = (v | (v << 2)) & 0x1249249249249249ul;
     return v;
 }
 
-// Calculates a 30-bit Morton code for the
+// Calculates a 63-bit Morton code for the
 // given 3D point located within the unit cube [0,1].
-INLINE uint calculate_morton_code(float3 p)
+// 21 bits per axis keep codes unique on large sparse scenes.
+INLINE ulong calculate_morton_code64(float3 p)
 {
-    float x = min(max(p.x * 1024.0f, 0.0f), 1023.0f);
-    float y = min(max(p.y * 1024.0f, 0.0f), 1023.0f);
-    float z = min(max(p.z * 1024.0f, 0.0f), 1023.0f);
-    unsigned int xx = expand_bits((uint)x);
-    unsigned int yy = expand_bits((uint)y);
-    unsigned int zz = expand_bits((uint)z);
+    float x = min(max(p.x * 2097152.0f, 0.0f), 2097151.0f);
+    float y = min(max(p.y * 2097152.0f, 0.0f), 2097151.0f);
+    float z = min(max(p.z * 2097152.0f, 0.0f), 2097151.0f);
+    ulong xx = expand_bits64((ulong)x);
+    ulong yy = expand_bits64((ulong)y);
+    ulong zz = expand_bits64((ulong)z);
     return xx * 4 + yy * 2 + zz;
 }
 
@@ -97,6 +120,36 @@ INLINE bbox bbox_union(bbox b1, bbox b2)
     return res;
 }
 
+// Calculate bounds of the triangles resident in device memory
+KERNEL void calculate_face_bounds_main(
+    // World space vertices
+    GLOBAL float3 const* restrict vertices,
+    // Faces
+    GLOBAL Face const* restrict faces,
+    // Number of faces
+    int num_faces,
+    // Face bounds
+    GLOBAL bbox* bounds
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_faces)
+    {
+        Face const face = faces[global_id];
+        float3 const v0 = vertices[face.idx[0]];
+        float3 const v1 = vertices[face.idx[1]];
+        float3 const v2 = vertices[face.idx[2]];
+        float3 const pmin = min(min(v0, v1), v2);
+        float3 const pmax = max(max(v0, v1), v2);
+
+        bbox bound;
+        bound.pmin = make_float4(pmin.x, pmin.y, pmin.z, 0.f);
+        bound.pmax = make_float4(pmax.x, pmax.y, pmax.z, 0.f);
+        bounds[global_id] = bound;
+    }
+}
+
 // Assign Morton codes to each of positions
 KERNEL void calculate_morton_code_main(
     // Centers of primitive bounding boxes
@@ -106,13 +159,18 @@ KERNEL void calculate_morton_code_main(
     // Scene extents
     GLOBAL bbox const* restrict scene_bound, 
     // Morton codes
-    GLOBAL int* morton_codes
+    GLOBAL ulong* morton_codes,
+    // Propagation flags of the refit, internal nodes are reset here
+    // so that the host does not need to clear them
+    GLOBAL int* flags
     )
 {
     int global_id = get_global_id(0);
 
     if (global_id < num_primitive_bounds)
     {
+        flags[global_id] = 0;
+
         // Fetch primitive bound
         bbox bound = primitive_bounds[global_id];
         // Calculate center and scene extents
@@ -120,7 +178,7 @@ KERNEL void calculate_morton_code_main(
         float3 const scene_min = scene_bound->pmin.xyz;
         float3 const scene_extents = scene_bound->pmax.xyz - scene_bound->pmin.xyz;
         // Calculate morton code
-        morton_codes[global_id] = calculate_morton_code((center - scene_min) / scene_extents);
+        morton_codes[global_id] = calculate_morton_code64((center - scene_min) / scene_extents);
     }
 }
 
@@ -128,7 +186,7 @@ KERNEL void calculate_morton_code_main(
 
 // Calculates longest common prefix length of bit representations
 // if  representations are equal we consider sucessive indices
-INLINE int delta(GLOBAL int const* morton_codes, int num_prims, int i1, int i2)
+INLINE int delta(GLOBAL ulong const* morton_codes, int num_prims, int i1, int i2)
 {
     // Select left end
     int left = min(i1, i2);
@@ -140,15 +198,15 @@ INLINE int delta(GLOBAL int const* morton_codes, int num_prims, int i1, int i2)
         return -1;
     }
     // Fetch Morton codes for both ends
-    int left_code = morton_codes[left];
-    int right_code = morton_codes[right];
+    ulong left_code = morton_codes[left];
+    ulong right_code = morton_codes[right];
 
     // Special handling of duplicated codes: use their indices as a fallback
-    return left_code != right_code ? clz(left_code ^ right_code) : (32 + clz(left ^ right));
+    return left_code != right_code ? (int)clz(left_code ^ right_code) : (64 + clz(left ^ right));
 }
 
 // Find span occupied by internal node with index idx
-INLINE int2 find_span(GLOBAL int const* restrict morton_codes, int num_prims, int idx)
+INLINE int2 find_span(GLOBAL ulong const* restrict morton_codes, int num_prims, int idx)
 {
     // Find the direction of the range
     int d = sign((float)(DELTA(idx, idx+1) - DELTA(idx, idx-1)));
@@ -183,7 +241,7 @@ INLINE int2 find_span(GLOBAL int const* restrict morton_codes, int num_prims, in
 }
 
 // Find split idx within the span
-INLINE int find_split(GLOBAL int const* restrict morton_codes, int num_prims, int2 span)
+INLINE int find_split(GLOBAL ulong const* restrict morton_codes, int num_prims, int2 span)
 {
     // Fetch codes for both ends
     int left = span.x;
@@ -215,7 +273,7 @@ INLINE int find_split(GLOBAL int const* restrict morton_codes, int num_prims, in
 // Set parent-child relationship
 KERNEL void emit_hierarchy_main(
     // Sorted Morton codes of the primitives
-    GLOBAL int const* restrict morton_codes,
+    GLOBAL ulong const* restrict morton_codes,
     // Bounds
     GLOBAL bbox const* restrict bounds,
     // Primitive indices
@@ -260,6 +318,101 @@ KERNEL void emit_hierarchy_main(
     }
 }
 
+// Emit the hierarchy and its bounds in a single bottom-up pass, see
+// "Fast and Simple Agglomerative LBVH Construction"
+// Ciprian Apetrei, in Computer Graphics and Visual Computing 2014.
+// A node spanning [left, right] becomes a child of the split at right or at left - 1, whichever
+// boundary has the longer common prefix. The second work item arriving at a split continues
+// with the merged node, the first one stops. Node indices match emit_hierarchy_main: left
+// children are stored at the end of their span and right children at the start, so the tree
+// is the same as the one of emission and refit. Flags of all internal nodes end up at 2.
+KERNEL void emit_hierarchy_bottom_up_main(
+    // Sorted Morton codes of the primitives
+    GLOBAL ulong const* restrict morton_codes,
+    // Bounds
+    GLOBAL bbox const* restrict bounds,
+    // Primitive indices
+    GLOBAL int const* restrict indices,
+    // Number of primitives
+    int num_prims,
+    // Nodes
+    GLOBAL HlbvhNode* nodes,
+    // Node bounds
+    GLOBAL bbox* bounds_sorted,
+    // Children and span of each split as int4, written by the first work item arriving
+    GLOBAL int* links,
+    // Atomic flags of the splits
+    GLOBAL int* flags
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_prims)
+    {
+        int left = global_id;
+        int right = global_id;
+        int2 children = (int2)(-1, -1);
+        bbox b = bounds[indices[global_id]];
+
+        for (;;)
+        {
+            bool const root = left == 0 && right == num_prims - 1;
+            bool const left_child = !root && (left == 0 ||
+                (right != num_prims - 1 && DELTA(right, right + 1) > DELTA(left - 1, left)));
+
+            // Node index is known once the side of the parent is chosen
+            int idx;
+            if (left == right)
+            {
+                idx = LEAFIDX(left);
+                nodes[idx].left = nodes[idx].right = indices[left];
+            }
+            else
+            {
+                idx = root ? NODEIDX(0) : NODEIDX(left_child ? right : left);
+                nodes[idx].left = children.x;
+                nodes[idx].right = children.y;
+                nodes[children.x].parent = idx;
+                nodes[children.y].parent = idx;
+            }
+
+            bounds_sorted[idx] = b;
+
+            if (root)
+            {
+                break;
+            }
+
+            int const split = left_child ? right : left - 1;
+            if (left_child)
+            {
+                links[4 * split] = idx;
+                links[4 * split + 2] = left;
+            }
+            else
+            {
+                links[4 * split + 1] = idx;
+                links[4 * split + 3] = right;
+            }
+
+            // Make the node visible before signaling
+            mem_fence(CLK_GLOBAL_MEM_FENCE);
+
+            if (atomic_inc(flags + split) == 0)
+            {
+                // The work item of the other child handles the split
+                break;
+            }
+
+            int4 const link = vload4(split, links);
+            children = link.xy;
+            left = link.z;
+            right = link.w;
+            b = bbox_union(bounds_sorted[children.x], bounds_sorted[children.y]);
+        }
+    }
+}
+
 // Propagate bounds up to the root
 KERNEL void refit_bounds_main(
     // Node bounds
@@ -311,4 +464,718 @@ KERNEL void refit_bounds_main(
         }
         while (idx != 0);
     }
-}
\ No newline at end of file
+}
+
+// Calculate the length of Morton code prefix shared by primitives of each internal node
+KERNEL void calculate_node_prefixes_main(
+    // Sorted Morton codes of the primitives
+    GLOBAL ulong const* restrict morton_codes,
+    // Number of primitives
+    int num_prims,
+    // Prefix length per internal node
+    GLOBAL int* prefixes
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_prims - 1)
+    {
+        int2 range = find_span(morton_codes, num_prims, global_id);
+        prefixes[NODEIDX(global_id)] = DELTA(range.x, range.y);
+    }
+}
+
+// Collect the input of SAH top tree build: internal nodes splitting on the top
+// Morton bits and cluster roots right below them, which share top_bits of their codes.
+// The top nodes form a binary tree over the clusters, so there are num_clusters - 1 of them.
+KERNEL void find_clusters_main(
+    // Nodes
+    GLOBAL HlbvhNode const* restrict nodes,
+    // Node bounds
+    GLOBAL bbox const* restrict bounds,
+    // Prefix length per internal node
+    GLOBAL int const* restrict prefixes,
+    // Number of primitives
+    int num_prims,
+    // Number of Morton bits handled by the top tree
+    int top_bits,
+    // Top node indices
+    GLOBAL int* top_nodes,
+    // Cluster root indices
+    GLOBAL int* clusters,
+    // Cluster bounds
+    GLOBAL bbox* cluster_bounds,
+    // Number of top nodes and clusters
+    GLOBAL int* counters
+    )
+{
+    int global_id = get_global_id(0);
+    int const min_prefix = top_bits + MORTON_UNUSED_BITS;
+
+    if (global_id < num_prims - 1 && prefixes[NODEIDX(global_id)] < min_prefix)
+    {
+        top_nodes[atomic_inc(counters)] = NODEIDX(global_id);
+
+        int const children[2] = { nodes[NODEIDX(global_id)].left, nodes[NODEIDX(global_id)].right };
+
+        for (int i = 0; i < 2; ++i)
+        {
+            // Leaves are always below the top tree
+            if (children[i] >= LEAFIDX(0) || prefixes[children[i]] >= min_prefix)
+            {
+                int cluster = atomic_inc(counters + 1);
+                clusters[cluster] = children[i];
+                cluster_bounds[cluster] = bounds[children[i]];
+            }
+        }
+    }
+}
+
+// Rewire top nodes according to the tree built over the clusters on the host
+KERNEL void apply_top_tree_main(
+    // Top node indices
+    GLOBAL int const* restrict top_nodes,
+    // Children of top nodes
+    GLOBAL int2 const* restrict top_children,
+    // Top node bounds
+    GLOBAL bbox const* restrict top_bounds,
+    // Number of top nodes
+    int num_top_nodes,
+    // Nodes
+    GLOBAL HlbvhNode* nodes,
+    // Node bounds
+    GLOBAL bbox* bounds
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_top_nodes)
+    {
+        int idx = top_nodes[global_id];
+        int2 children = top_children[global_id];
+
+        // Fields are written separately since parents are set by other work items
+        nodes[idx].left = children.x;
+        nodes[idx].right = children.y;
+        nodes[children.x].parent = idx;
+        nodes[children.y].parent = idx;
+        bounds[idx] = top_bounds[global_id];
+    }
+}
+
+// Find optimal topology of a treelet: exhaustive dynamic programming over
+// all subsets of treelet leaves, see
+// "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies"
+// Tero Karras, Timo Aila (NVIDIA), in High Performance Graphics 2013.
+// Treelet internal nodes are rewired in place keeping the root index.
+INLINE void restructure_treelet(
+    GLOBAL bbox* bounds,
+    GLOBAL HlbvhNode* nodes,
+    int root
+    )
+{
+    // Treelet leaves and internal nodes
+    int leaves[TREELET_SIZE];
+    int internals[TREELET_SIZE - 1];
+    int num_leaves = 2;
+    int num_internals = 1;
+
+    leaves[0] = nodes[root].left;
+    leaves[1] = nodes[root].right;
+    internals[0] = root;
+
+    // Grow the treelet expanding the leaf with the largest surface area
+    while (num_leaves < TREELET_SIZE)
+    {
+        int best = -1;
+        float best_area = -1.f;
+
+        for (int i = 0; i < num_leaves; ++i)
+        {
+            if (!IS_LEAF(nodes[leaves[i]]))
+            {
+                float area = bbox_surface_area(bounds[leaves[i]]);
+
+                if (area > best_area)
+                {
+                    best_area = area;
+                    best = i;
+                }
+            }
+        }
+
+        // Only primitives left
+        if (best < 0)
+        {
+            break;
+        }
+
+        int expanded = leaves[best];
+        internals[num_internals++] = expanded;
+        leaves[best] = nodes[expanded].left;
+        leaves[num_leaves++] = nodes[expanded].right;
+    }
+
+    // Two leaves have a single topology
+    if (num_leaves < 3)
+    {
+        return;
+    }
+
+    bbox leaf_bounds[TREELET_SIZE];
+    for (int i = 0; i < num_leaves; ++i)
+    {
+        leaf_bounds[i] = bounds[leaves[i]];
+    }
+
+    // Optimal SAH cost of each subset: surface area of its internal nodes,
+    // since treelet leaves contribute the same cost to any topology
+    float area[TREELET_SUBSETS];
+    float cost[TREELET_SUBSETS];
+    uchar partition[TREELET_SUBSETS];
+
+    int const num_subsets = 1 << num_leaves;
+
+    for (int s = 1; s < num_subsets; ++s)
+    {
+        bbox b;
+        b.pmin = make_float4(FLT_MAX, FLT_MAX, FLT_MAX, 0.f);
+        b.pmax = make_float4(-FLT_MAX, -FLT_MAX, -FLT_MAX, 0.f);
+
+        for (int i = 0; i < num_leaves; ++i)
+        {
+            if (s & (1 << i))
+            {
+                b = bbox_union(b, leaf_bounds[i]);
+            }
+        }
+
+        area[s] = bbox_surface_area(b);
+    }
+
+    // Subsets of s are numerically smaller than s, so increasing order is valid
+    for (int s = 1; s < num_subsets; ++s)
+    {
+        if (popcount(s) == 1)
+        {
+            cost[s] = 0.f;
+            continue;
+        }
+
+        // Each partition is evaluated once: left part holds the lowest bit of s
+        int const lowest = s & -s;
+        float best_cost = FLT_MAX;
+        int best_partition = lowest;
+
+        for (int p = (s - 1) & s; p > 0; p = (p - 1) & s)
+        {
+            if (p & lowest)
+            {
+                float c = cost[p] + cost[s ^ p];
+
+                if (c < best_cost)
+                {
+                    best_cost = c;
+                    best_partition = p;
+                }
+            }
+        }
+
+        cost[s] = area[s] + best_cost;
+        partition[s] = (uchar)best_partition;
+    }
+
+    // Rewire internal nodes top-down following the optimal partitions
+    int subset_stack[TREELET_SIZE];
+    int node_stack[TREELET_SIZE];
+    int sp = 0;
+    int next_internal = 1;
+
+    subset_stack[sp] = num_subsets - 1;
+    node_stack[sp++] = root;
+
+    while (sp > 0)
+    {
+        --sp;
+        int const s = subset_stack[sp];
+        int const node = node_stack[sp];
+        int const parts[2] = { partition[s], s ^ partition[s] };
+        int children[2];
+
+        for (int c = 0; c < 2; ++c)
+        {
+            if (popcount(parts[c]) == 1)
+            {
+                int i = 0;
+                while (!(parts[c] & (1 << i))) ++i;
+                children[c] = leaves[i];
+            }
+            else
+            {
+                children[c] = internals[next_internal++];
+                subset_stack[sp] = parts[c];
+                node_stack[sp++] = children[c];
+            }
+
+            nodes[children[c]].parent = node;
+        }
+
+        nodes[node].left = children[0];
+        nodes[node].right = children[1];
+
+        // Node bound is the union of its leaves
+        bbox b;
+        b.pmin = make_float4(FLT_MAX, FLT_MAX, FLT_MAX, 0.f);
+        b.pmax = make_float4(-FLT_MAX, -FLT_MAX, -FLT_MAX, 0.f);
+
+        for (int i = 0; i < num_leaves; ++i)
+        {
+            if (s & (1 << i))
+            {
+                b = bbox_union(b, leaf_bounds[i]);
+            }
+        }
+
+        bounds[node] = b;
+    }
+}
+
+// Restructure treelets bottom-up, launched after refit_bounds_main.
+// Each node is processed once both of its subtrees are done. Flags are not reset
+// between passes: every internal node is visited twice per pass, so the second
+// visitor of pass i sees flag_base + 1 with flag_base = 1 + 2 * i (refit leaves flags at 1).
+KERNEL void restructure_treelets_main(
+    // Node bounds
+    GLOBAL bbox* bounds,
+    // Number of primitives
+    int num_prims,
+    // Nodes
+    GLOBAL HlbvhNode* nodes,
+    // Atomic flags
+    GLOBAL int* flags,
+    // Flag value at the start of the pass
+    int flag_base
+    )
+{
+    int global_id = get_global_id(0);
+
+    // Start from leaf nodes
+    if (global_id < num_prims && num_prims > 1)
+    {
+        int idx = LEAFIDX(global_id);
+
+        do
+        {
+            // Move to parent node
+            idx = nodes[idx].parent;
+
+            // Make sure subtree updates are visible before signaling
+            mem_fence(CLK_GLOBAL_MEM_FENCE);
+
+            if (atomic_inc(flags + idx) == flag_base + 1)
+            {
+                // Both subtrees are done
+                restructure_treelet(bounds, nodes, idx);
+            }
+            else
+            {
+                // The thread handling the second child will
+                // handle this node.
+                break;
+            }
+        }
+        while (idx != 0);
+    }
+}
+
+/*************************************************************************
+SEGMENTED BUILDS
+**************************************************************************/
+// Batched builds of many small trees: primitives of all the segments are sorted at once with
+// the segment index above the Morton code, so each segment forms a subtree of the LBVH.
+// Segments are int4 of (first primitive, number of primitives, first face or shape leafs reference, first output node).
+
+// Face of the 2-level intersector, idx[3] is -1 for triangles
+typedef struct
+{
+    int idx[4];
+    int shape_mask;
+    int shape_id;
+    int prim_id;
+    int padding;
+} SegmentFace;
+
+// Index of the segment the primitive belongs to, segments are ordered by their first primitive
+INLINE int find_segment(GLOBAL int4 const* restrict segments, int num_segments, int prim)
+{
+    int lo = 0;
+    int hi = num_segments - 1;
+
+    while (lo < hi)
+    {
+        int const mid = (lo + hi + 1) / 2;
+
+        if (segments[mid].x <= prim)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+
+    return lo;
+}
+
+// Calculate bounds of the faces of all the segments
+KERNEL void calculate_segment_face_bounds_main(
+    // Object space vertices
+    GLOBAL float3 const* restrict vertices,
+    // Faces
+    GLOBAL SegmentFace const* restrict faces,
+    // Segments
+    GLOBAL int4 const* restrict segments,
+    // Number of segments
+    int num_segments,
+    // Number of primitives of all the segments
+    int num_prims,
+    // Primitive bounds
+    GLOBAL bbox* bounds
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_prims)
+    {
+        int4 const segment = segments[find_segment(segments, num_segments, global_id)];
+        SegmentFace const face = faces[segment.z + global_id - segment.x];
+        float3 pmin = min(min(vertices[face.idx[0]], vertices[face.idx[1]]), vertices[face.idx[2]]);
+        float3 pmax = max(max(vertices[face.idx[0]], vertices[face.idx[1]]), vertices[face.idx[2]]);
+
+        if (face.idx[3] >= 0)
+        {
+            pmin = min(pmin, vertices[face.idx[3]]);
+            pmax = max(pmax, vertices[face.idx[3]]);
+        }
+
+        bbox bound;
+        bound.pmin = make_float4(pmin.x, pmin.y, pmin.z, 0.f);
+        bound.pmax = make_float4(pmax.x, pmax.y, pmax.z, 0.f);
+        bounds[global_id] = bound;
+    }
+}
+
+// Reduce primitive bounds of each segment, a work group of 64 per segment
+KERNEL void calculate_segment_bounds_main(
+    // Primitive bounds
+    GLOBAL bbox const* restrict bounds,
+    // Segments
+    GLOBAL int4 const* restrict segments,
+    // Segment bounds
+    GLOBAL bbox* segment_bounds
+    )
+{
+    __local bbox lds[64];
+
+    int const local_id = get_local_id(0);
+    int4 const segment = segments[get_group_id(0)];
+
+    bbox bound;
+    bound.pmin = (float4)(FLT_MAX, FLT_MAX, FLT_MAX, 0.f);
+    bound.pmax = (float4)(-FLT_MAX, -FLT_MAX, -FLT_MAX, 0.f);
+
+    for (int i = segment.x + local_id; i < segment.x + segment.y; i += 64)
+    {
+        bound = bbox_union(bound, bounds[i]);
+    }
+
+    lds[local_id] = bound;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int stride = 32; stride > 0; stride >>= 1)
+    {
+        if (local_id < stride)
+        {
+            lds[local_id] = bbox_union(lds[local_id], lds[local_id + stride]);
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (local_id == 0)
+    {
+        segment_bounds[get_group_id(0)] = lds[0];
+    }
+}
+
+// Assign Morton codes relative to the segment bounds prefixed by the segment index
+KERNEL void calculate_segment_morton_code_main(
+    // Primitive bounds
+    GLOBAL bbox const* restrict primitive_bounds,
+    // Segments
+    GLOBAL int4 const* restrict segments,
+    // Number of segments
+    int num_segments,
+    // Number of primitives of all the segments
+    int num_prims,
+    // Segment bounds
+    GLOBAL bbox const* restrict segment_bounds,
+    // Bits per axis, the segment index takes the bits above 3 * axis_bits
+    int axis_bits,
+    // Morton codes
+    GLOBAL ulong* morton_codes,
+    // Propagation flags of the refit, internal nodes are reset here
+    GLOBAL int* flags
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_prims)
+    {
+        int const segment = find_segment(segments, num_segments, global_id);
+        bbox const bound = primitive_bounds[global_id];
+        bbox const extents = segment_bounds[segment];
+
+        // Flat meshes have zero extents along an axis
+        float3 const center = (bound.pmax + bound.pmin).xyz * 0.5f;
+        float3 const size = max(extents.pmax.xyz - extents.pmin.xyz, (float3)(1e-20f, 1e-20f, 1e-20f));
+        float const scale = (float)(1 << axis_bits);
+        float3 const p = clamp((center - extents.pmin.xyz) / size * scale, 0.f, scale - 1.f);
+
+        ulong const code = expand_bits64((ulong)p.x) * 4 + expand_bits64((ulong)p.y) * 2 + expand_bits64((ulong)p.z);
+        morton_codes[global_id] = ((ulong)segment << (3 * axis_bits)) | code;
+        flags[global_id] = 0;
+    }
+}
+
+// Sorted primitive ranges of internal nodes followed by the leaves
+KERNEL void calculate_node_ranges_main(
+    // Sorted Morton codes of the primitives
+    GLOBAL ulong const* restrict morton_codes,
+    // Number of primitives
+    int num_prims,
+    // Ranges
+    GLOBAL int2* ranges
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_prims - 1)
+    {
+        ranges[NODEIDX(global_id)] = find_span(morton_codes, num_prims, global_id);
+    }
+
+    if (global_id < num_prims)
+    {
+        ranges[LEAFIDX(global_id)] = (int2)(global_id, global_id);
+    }
+}
+
+// Write the subtree of each segment in depth first order with skip links, the layout of the 2-level intersector,
+// leafs reference the item at the third segment component plus the primitive index in the segment
+KERNEL void emit_segment_nodes_main(
+    // Nodes
+    GLOBAL HlbvhNode const* restrict nodes,
+    // Node bounds
+    GLOBAL bbox const* restrict bounds,
+    // Node ranges
+    GLOBAL int2 const* restrict ranges,
+    // Segments
+    GLOBAL int4 const* restrict segments,
+    // Number of segments
+    int num_segments,
+    // Number of primitives of all the segments
+    int num_prims,
+    // Output nodes
+    GLOBAL bbox* out_nodes
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < 2 * num_prims - 1)
+    {
+        int2 const range = ranges[global_id];
+        int4 const segment = segments[find_segment(segments, num_segments, range.x)];
+        int const segment_end = segment.x + segment.y - 1;
+
+        // Nodes above the segment roots are dropped
+        if (range.y > segment_end)
+        {
+            return;
+        }
+
+        // Count left children on the way up to the segment root
+        int num_left = 0;
+        int idx = global_id;
+        while (ranges[idx].x != segment.x || ranges[idx].y != segment_end)
+        {
+            int const parent = nodes[idx].parent;
+            num_left += nodes[parent].left == idx ? 1 : 0;
+            idx = parent;
+        }
+
+        // Subtrees to the left hold 2 * n - 1 nodes of their n primitives, so the
+        // depth first position is twice the preceding primitives plus left ancestors
+        int const pos = 2 * (range.x - segment.x) + num_left;
+        int const next = pos + 2 * (range.y - range.x) + 1;
+
+        bbox node = bounds[global_id];
+        node.pmax.w = next < 2 * segment.y - 1 ? (float)(segment.w + next) : -1.f;
+
+        if (global_id >= num_prims - 1)
+        {
+            // Leaves reference a single face
+            int const prim = nodes[global_id].left;
+            node.pmin.w = (float)(((segment.z + prim - segment.x) << 4) | 1);
+        }
+        else
+        {
+            node.pmin.w = -1.f;
+        }
+
+        out_nodes[segment.w + pos] = node;
+    }
+}
+
+/*************************************************************************
+PLOC
+**************************************************************************/
+// Parallel locally-ordered clustering, see
+// "Parallel Locally-Ordered Clustering for Bounding Volume Hierarchy Construction"
+// Daniel Meister, Jiri Bittner, IEEE Transactions on Visualization and Computer Graphics 2018.
+// Clusters start as leaves in Morton order, each pass merges mutual nearest neighbours found
+// within a window and compacts the survivors, so the order and the window locality are kept.
+// Internal nodes are allocated downwards from N - 2, the last merge is the only one of its pass
+// and writes the root to node 0. Nodes use the LBVH layout.
+
+// Set up leaves and initial clusters, primitives are sorted by their Morton codes
+KERNEL void init_ploc_clusters_main(
+    // Bounds
+    GLOBAL bbox const* restrict bounds,
+    // Primitive indices
+    GLOBAL int const* restrict indices,
+    // Number of primitives
+    int num_prims,
+    // Nodes
+    GLOBAL HlbvhNode* nodes,
+    // Node bounds
+    GLOBAL bbox* bounds_sorted,
+    // Clusters
+    GLOBAL int* clusters
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_prims)
+    {
+        nodes[LEAFIDX(global_id)].left = nodes[LEAFIDX(global_id)].right = indices[global_id];
+        bounds_sorted[LEAFIDX(global_id)] = bounds[indices[global_id]];
+        clusters[global_id] = LEAFIDX(global_id);
+    }
+}
+
+// Find the cluster within the radius giving the smallest merged surface area, ties go to the
+// lower index, so the closest pair with the lowest indices is always mutual and each pass merges
+KERNEL void find_ploc_neighbours_main(
+    // Node bounds
+    GLOBAL bbox const* restrict bounds,
+    // Clusters
+    GLOBAL int const* restrict clusters,
+    // Number of clusters
+    int num_clusters,
+    // Search radius
+    int radius,
+    // Nearest neighbours
+    GLOBAL int* neighbours
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_clusters)
+    {
+        bbox const b = bounds[clusters[global_id]];
+        int const first = max(global_id - radius, 0);
+        int const last = min(global_id + radius, num_clusters - 1);
+
+        float best_area = INFINITY;
+        int best = -1;
+
+        for (int i = first; i <= last; ++i)
+        {
+            if (i == global_id)
+            {
+                continue;
+            }
+
+            float const area = bbox_surface_area(bbox_union(b, bounds[clusters[i]]));
+
+            if (area < best_area)
+            {
+                best_area = area;
+                best = i;
+            }
+        }
+
+        neighbours[global_id] = best;
+    }
+}
+
+// Merge mutual nearest neighbours, the lower index emits the node and keeps the merged
+// cluster, the higher one is dropped. Merged nodes are flagged as refit would do.
+KERNEL void merge_ploc_clusters_main(
+    // Clusters
+    GLOBAL int const* restrict clusters,
+    // Nearest neighbours
+    GLOBAL int const* restrict neighbours,
+    // Number of clusters
+    int num_clusters,
+    // Number of primitives
+    int num_prims,
+    // Nodes
+    GLOBAL HlbvhNode* nodes,
+    // Node bounds
+    GLOBAL bbox* bounds,
+    // Atomic flags
+    GLOBAL int* flags,
+    // Number of allocated internal nodes
+    GLOBAL int* counter,
+    // Clusters after the merge and their predicate
+    GLOBAL int* merged,
+    GLOBAL int* valid
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_clusters)
+    {
+        int const neighbour = neighbours[global_id];
+        int const cluster = clusters[global_id];
+
+        if (neighbours[neighbour] != global_id)
+        {
+            merged[global_id] = cluster;
+            valid[global_id] = 1;
+        }
+        else if (global_id < neighbour)
+        {
+            int const idx = NODEIDX(num_prims - 2 - atomic_inc(counter));
+            int const other = clusters[neighbour];
+
+            nodes[idx].left = cluster;
+            nodes[idx].right = other;
+            nodes[cluster].parent = idx;
+            nodes[other].parent = idx;
+            bounds[idx] = bbox_union(bounds[cluster], bounds[other]);
+            flags[idx] = 1;
+
+            merged[global_id] = idx;
+            valid[global_id] = 1;
+        }
+        else
+        {
+            merged[global_id] = -1;
+            valid[global_id] = 0;
+        }
+    }
+}
@@ -30,6 +30,8 @@ DEFINES
 #define HIT_MARKER 1
 #define MISS_MARKER -1
 #define INVALID_IDX -1
+// Hit list size of multi-hit queries, has to match kMaxMultiHits on the host
+#define MAX_MULTI_HITS 8
 
 /*************************************************************************
 EXTENSIONS
@@ -38,6 +40,14 @@ EXTENSIONS
 #pragma OPENCL EXTENSION cl_amd_media_ops2 : enable
 #endif
 
+#ifdef cl_khr_subgroups
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#endif
+
+#ifdef cl_khr_subgroup_ballot
+#pragma OPENCL EXTENSION cl_khr_subgroup_ballot : enable
+#endif
+
 /*************************************************************************
 TYPES
 **************************************************************************/
@@ -58,6 +68,21 @@ typedef struct
     int2 padding;
 } ray;
 
+// Compact ray definition, o.w holds maxt with the sign bit set for inactive rays,
+// d.w holds time as a half float in the lower 16 bits and the lower 16 bits of the mask
+typedef struct
+{
+    float4 o;
+    float4 d;
+} PackedRay;
+
+// Ray record read by the queries
+#ifdef RR_COMPACT_RAYS
+typedef PackedRay RayRecord;
+#else
+typedef ray RayRecord;
+#endif
+
 // Intersection definition
 typedef struct
 {
@@ -68,6 +93,68 @@ typedef struct
     float4 uvwt;
 } Intersection;
 
+// Compact intersection definition, barycentrics are stored as half floats
+typedef struct
+{
+    int shape_id;
+    int prim_id;
+    uint uv;
+    float t;
+} PackedIntersection;
+
+// Primitive overlapping a box of overlap queries
+typedef struct
+{
+    int shape_id;
+    int prim_id;
+} Overlap;
+
+// Closest surface point of closest point queries, uvwt.w holds the distance
+typedef struct
+{
+    int shape_id;
+    int prim_id;
+    int2 padding;
+
+    float4 uvwt;
+    float4 p;
+} ClosestPoint;
+
+// Hit record written by intersection kernels
+#ifdef RR_COMPACT_HITS
+typedef PackedIntersection HitRecord;
+#else
+typedef Intersection HitRecord;
+#endif
+
+#ifdef RR_TRAVERSAL_STATS
+// Per-ray counters of closest hit traversal
+typedef struct
+{
+    // Bounding boxes tested
+    int nodes;
+    // Primitives tested
+    int primitives;
+    // Short stack spills to global memory
+    int spills;
+    // Traversal loop iterations
+    int iterations;
+} TraversalStats;
+
+// Stats buffer is the last argument of closest hit kernels and ray functions
+#define TRAVERSAL_STATS_PARAM , GLOBAL TraversalStats* restrict traversal_stats
+#define TRAVERSAL_STATS_ARG , traversal_stats
+#define INIT_STATS() TraversalStats stats = { 0, 0, 0, 0 }
+#define COUNT_STAT(field, n) stats.field += (n)
+#define STORE_STATS(idx) traversal_stats[idx] = stats
+#else
+#define TRAVERSAL_STATS_PARAM
+#define TRAVERSAL_STATS_ARG
+#define INIT_STATS()
+#define COUNT_STAT(field, n)
+#define STORE_STATS(idx)
+#endif
+
 
 /*************************************************************************
 HELPER FUNCTIONS
@@ -228,6 +315,14 @@ float2 fast_intersect_bbox1(bbox box, float3 invdir, float3 oxinvdir, float t_ma
     return make_float2(t0, t1);
 }
 
+// Surface area of the bbox, proportional to the probability of a random ray hitting it
+INLINE
+float bbox_surface_area(bbox box)
+{
+    float3 const ext = box.pmax.xyz - box.pmin.xyz;
+    return 2.f * (ext.x * ext.y + ext.x * ext.z + ext.y * ext.z);
+}
+
 // Given a point in triangle plane, calculate its barycentrics
 INLINE
 float2 triangle_calculate_barycentrics(float3 p, float3 v1, float3 v2, float3 v3)
@@ -251,3 +346,204 @@ float2 triangle_calculate_barycentrics(float3 p, float3 v1, float3 v2, float3 v3
     float const b2 = (d00 * d21 - d01 * d20) * invdenom;
     return make_float2(b1, b2);
 }
+
+// Load the ray from the ray record format selected at compile time
+INLINE
+ray load_ray(GLOBAL RayRecord const* rays, int idx)
+{
+#ifdef RR_COMPACT_RAYS
+    PackedRay const p = rays[idx];
+    uint const maxt = as_uint(p.o.w);
+    uint const extra = as_uint(p.d.w);
+    ushort const time = (ushort)(extra & 0xffff);
+
+    ray r;
+    r.o = make_float4(p.o.x, p.o.y, p.o.z, as_float(maxt & 0x7fffffff));
+    r.d = make_float4(p.d.x, p.d.y, p.d.z, vload_half(0, (half const*)&time));
+    r.extra = make_int2((int)(extra >> 16), (maxt >> 31) ? 0 : 1);
+    r.padding = make_int2(0, 0);
+    return r;
+#else
+    return rays[idx];
+#endif
+}
+
+// Store the ray in the ray record format selected at compile time
+INLINE
+void store_ray(GLOBAL RayRecord* rays, int idx, ray const* r)
+{
+#ifdef RR_COMPACT_RAYS
+    uint const maxt = as_uint(fabs(r->o.w)) | (r->extra.y ? 0u : 0x80000000u);
+    ushort time;
+    vstore_half(r->d.w, 0, (half*)&time);
+
+    PackedRay p;
+    p.o = make_float4(r->o.x, r->o.y, r->o.z, as_float(maxt));
+    p.d = make_float4(r->d.x, r->d.y, r->d.z, as_float(((uint)r->extra.x << 16) | (uint)time));
+    rays[idx] = p;
+#else
+    rays[idx] = *r;
+#endif
+}
+
+// Distance of the closest hit in the hit record format selected at compile time
+INLINE
+float load_hit_t(GLOBAL HitRecord const* hits, int idx)
+{
+#ifdef RR_COMPACT_HITS
+    return hits[idx].t;
+#else
+    return hits[idx].uvwt.w;
+#endif
+}
+
+// Store closest hit of the ray in the hit record format selected at compile time
+INLINE
+void store_hit(GLOBAL HitRecord* hits, int idx, int shape_id, int prim_id, float2 uv, float t)
+{
+    hits[idx].shape_id = shape_id;
+    hits[idx].prim_id = prim_id;
+#ifdef RR_COMPACT_HITS
+    vstore_half2(uv, 0, (GLOBAL half*)&hits[idx].uv);
+    hits[idx].t = t;
+#else
+    hits[idx].uvwt = make_float4(uv.x, uv.y, 0.f, t);
+#endif
+}
+
+// Mark the ray as missed, the rest of the record is left untouched
+INLINE
+void store_miss(GLOBAL HitRecord* hits, int idx)
+{
+    hits[idx].shape_id = MISS_MARKER;
+    hits[idx].prim_id = MISS_MARKER;
+}
+
+// Insert the hit into the distance sorted list of k closest hits, farther entries
+// move down and the last one drops out. Loops are bounded at compile time, so the
+// list stays in registers. Returns the distance of the k-th entry used for culling.
+INLINE
+float insert_multi_hit(float* hit_t, int2* hit_data, int k, float t, int2 data)
+{
+    float cull_t = t;
+
+    for (int i = 0; i < MAX_MULTI_HITS; ++i)
+    {
+        if (i < k)
+        {
+            if (t < hit_t[i])
+            {
+                float const tmp_t = hit_t[i];
+                int2 const tmp_data = hit_data[i];
+                hit_t[i] = t;
+                hit_data[i] = data;
+                t = tmp_t;
+                data = tmp_data;
+            }
+
+            cull_t = hit_t[i];
+        }
+    }
+
+    return cull_t;
+}
+
+// Fetch the start of the next ray batch for a persistent work-group,
+// the whole group takes get_local_size(0) consecutive rays at once
+INLINE
+int fetch_ray_batch(GLOBAL int* ray_counter, __local int* batch_start)
+{
+    if (get_local_id(0) == 0)
+    {
+        *batch_start = atomic_add(ray_counter, (int)get_local_size(0));
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+    int const start = *batch_start;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    return start;
+}
+
+// Fetch the next batch of rays for persistent kernels not sharing local memory between rays.
+// With sub-groups each one fetches its own batch and moves on without waiting for the slowest
+// sub-group of the work-group at barriers, batch_start is only used otherwise.
+// Rays of the batch are indexed with wave_ray_local_id.
+INLINE
+int fetch_wave_ray_batch(GLOBAL int* ray_counter, __local int* batch_start)
+{
+#ifdef cl_khr_subgroups
+    int start = 0;
+
+    if (get_sub_group_local_id() == 0)
+    {
+        start = atomic_add(ray_counter, (int)get_sub_group_size());
+    }
+
+    return sub_group_broadcast(start, 0);
+#else
+    return fetch_ray_batch(ray_counter, batch_start);
+#endif
+}
+
+// Index of the work item within the batch returned by fetch_wave_ray_batch
+INLINE
+int wave_ray_local_id()
+{
+#ifdef cl_khr_subgroups
+    return (int)get_sub_group_local_id();
+#else
+    return (int)get_local_id(0);
+#endif
+}
+
+// Store occlusion results of a work-group as 1 bit per ray, the bit is set if the ray is occluded.
+// The group handles get_local_size(0) consecutive rays starting at group_start, both should be
+// multiples of 32. Every word covering rays below num_rays is written, so results of inactive rays are 0.
+INLINE
+void store_occlusion_bits(GLOBAL uint* hits, __local uint* words, int group_start, int num_rays, bool occluded)
+{
+    int const local_id = get_local_id(0);
+    int const num_words = (int)get_local_size(0) >> 5;
+
+#ifdef cl_khr_subgroup_ballot
+    // Sub-groups made of whole words build them with a single ballot and skip LDS,
+    // the condition is uniform across the work-group, so no barrier is ever skipped partially
+    uint const sub_group_size = get_max_sub_group_size();
+    if ((sub_group_size & 31) == 0 && (get_local_size(0) % sub_group_size) == 0)
+    {
+        uint4 const ballot = sub_group_ballot(occluded);
+        uint const lane = get_sub_group_local_id();
+        int const word = ((group_start + (int)(get_sub_group_id() * sub_group_size)) >> 5) + (int)lane;
+
+        if (lane < (sub_group_size >> 5) && (word << 5) < num_rays)
+        {
+            hits[word] = lane == 0 ? ballot.x : (lane == 1 ? ballot.y : (lane == 2 ? ballot.z : ballot.w));
+        }
+
+        return;
+    }
+#endif
+
+    if (local_id < num_words)
+    {
+        words[local_id] = 0;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (occluded)
+    {
+        atomic_or(&words[local_id >> 5], 1u << (local_id & 31));
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int const word = (group_start >> 5) + local_id;
+    if (local_id < num_words && (word << 5) < num_rays)
+    {
+        hits[word] = words[local_id];
+    }
+
+    // Words can be reused by the next batch of a persistent group
+    barrier(CLK_LOCAL_MEM_FENCE);
+}
@@ -0,0 +1,99 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file compact_rays.cl
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Ray compaction between wavefront passes.
+
+    Rays are flagged by their active flag or a user predicate, indices of the flagged
+    ones are compacted with the device primitives and the rays are gathered in order,
+    so the number of rays never leaves the device.
+ */
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+/*************************************************************************
+KERNELS
+**************************************************************************/
+// Flag the rays to keep, rays past the count are never kept
+KERNEL void calculate_ray_flags_main(
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Number of flags to fill
+    int num_flags,
+    // User predicate, one int per ray, used if use_predicate is set
+    GLOBAL int const* restrict predicate,
+    int use_predicate,
+    // Ray flags
+    GLOBAL int* flags,
+    // Ray indices
+    GLOBAL int* indices
+)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_flags)
+    {
+        int keep = 0;
+
+        if (global_id < *num_rays)
+        {
+            if (use_predicate)
+            {
+                keep = predicate[global_id] != 0;
+            }
+            else
+            {
+                ray const r = load_ray(rays, global_id);
+                keep = ray_is_active(&r) != 0;
+            }
+        }
+
+        flags[global_id] = keep;
+        indices[global_id] = global_id;
+    }
+}
+
+// Gather the kept rays in order
+KERNEL void gather_rays_main(
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Compacted ray indices
+    GLOBAL int const* restrict indices,
+    // Number of kept rays
+    GLOBAL int const* restrict num_rays,
+    // Compacted rays
+    GLOBAL RayRecord* compacted_rays
+)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < *num_rays)
+    {
+        compacted_rays[global_id] = rays[indices[global_id]];
+    }
+}
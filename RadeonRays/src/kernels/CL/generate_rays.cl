@@ -0,0 +1,132 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file generate_rays.cl
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Built-in ray generators.
+
+    Primary rays of a pinhole camera and shadow rays starting at the hits of another
+    query are generated on the device, so the caller doesn't need a generation pass of
+    its own. Rays are written in the record format the intersector is compiled with.
+ */
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+/*************************************************************************
+KERNELS
+**************************************************************************/
+// Generate one primary ray per pixel, ray i belongs to pixel (i % width, i / width)
+KERNEL void generate_pinhole_rays_main(
+    // Camera position, w holds maxt
+    float4 position,
+    // Viewing direction
+    float4 forward,
+    // Horizontal and vertical extents of the image plane at unit distance
+    float4 right,
+    float4 up,
+    // Image size
+    int width,
+    int height,
+    // Generated rays
+    GLOBAL RayRecord* rays
+)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < width * height)
+    {
+        float const sx = 2.f * ((global_id % width) + 0.5f) / width - 1.f;
+        float const sy = 2.f * ((global_id / width) + 0.5f) / height - 1.f;
+
+        float3 const d = normalize(forward.xyz + sx * right.xyz + sy * up.xyz);
+
+        ray r;
+        r.o = position;
+        r.d = make_float4(d.x, d.y, d.z, 0.f);
+        r.extra = make_int2(-1, 1);
+        r.padding = make_int2(0, 0);
+
+        store_ray(rays, global_id, &r);
+    }
+}
+
+// Generate rays from the hit points towards a point light, rays which missed
+// or were inactive give inactive shadow rays. Traversal leaves results of
+// inactive rays untouched, so they are reported as not occluded here
+KERNEL void generate_shadow_rays_main(
+    // Rays the hits belong to
+    GLOBAL RayRecord const* restrict rays,
+    // Closest hits
+    GLOBAL HitRecord const* restrict hits,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Light position
+    float4 light,
+    // Offset keeping the shadow rays off the surface at both ends
+    float epsilon,
+    // Generated rays
+    GLOBAL RayRecord* shadow_rays,
+    // Occlusion results, only written if they hold one int per ray
+    GLOBAL int* results,
+    int write_results
+)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < *num_rays)
+    {
+        ray const r = load_ray(rays, global_id);
+
+        ray s;
+        s.extra = make_int2(ray_get_mask(&r), 0);
+        s.padding = make_int2(0, 0);
+
+        if (ray_is_active(&r) && hits[global_id].shape_id != MISS_MARKER)
+        {
+            float3 const p = r.o.xyz + load_hit_t(hits, global_id) * r.d.xyz;
+            float3 const to_light = light.xyz - p;
+            float const dist = length(to_light);
+            float3 const d = to_light / max(dist, 1e-8f);
+
+            float3 const o = p + epsilon * d;
+
+            s.o = make_float4(o.x, o.y, o.z, max(dist - 2.f * epsilon, 0.f));
+            s.d = make_float4(d.x, d.y, d.z, r.d.w);
+            s.extra.y = 1;
+        }
+        else
+        {
+            s.o = make_float4(0.f, 0.f, 0.f, 0.f);
+            s.d = make_float4(0.f, 0.f, 1.f, r.d.w);
+
+            if (write_results)
+            {
+                results[global_id] = MISS_MARKER;
+            }
+        }
+
+        store_ray(shadow_rays, global_id, &s);
+    }
+}
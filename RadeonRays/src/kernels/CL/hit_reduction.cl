@@ -0,0 +1,110 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file hit_reduction.cl
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Reduced query outputs for depth and ambient occlusion passes.
+
+    Closest hits are reduced to their distances and occlusion results to the number
+    of occluded rays of every group of consecutive rays, so passes only needing those
+    read a fraction of the full output.
+ */
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+/*************************************************************************
+KERNELS
+**************************************************************************/
+// Write the distance of the closest hit of every ray, -1 for missed and inactive rays
+KERNEL void hit_distances_main(
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Closest hits of the rays
+    GLOBAL HitRecord const* restrict hits,
+    // Number of rays
+    int num_rays,
+    // Float per ray
+    GLOBAL float* restrict distances
+)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_rays)
+    {
+        ray const r = load_ray(rays, global_id);
+        bool const hit = ray_is_active(&r) && hits[global_id].shape_id != MISS_MARKER;
+        distances[global_id] = hit ? load_hit_t(hits, global_id) : -1.f;
+    }
+}
+
+// Count occluded rays of every group of group_size consecutive rays, the last group might be partial.
+// Results are 1 bit per ray if packed is set, otherwise an int per ray which inactive rays leave untouched.
+KERNEL void count_occluded_main(
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Occlusion results of the rays
+    GLOBAL int const* restrict results,
+    int packed,
+    // Number of rays
+    int num_rays,
+    // Number of rays per group
+    int group_size,
+    // Int per group
+    GLOBAL int* restrict counts
+)
+{
+    int global_id = get_global_id(0);
+    int const num_groups = (num_rays + group_size - 1) / group_size;
+
+    if (global_id < num_groups)
+    {
+        int const begin = global_id * group_size;
+        int const end = min(begin + group_size, num_rays);
+        int count = 0;
+
+        if (packed)
+        {
+            // Whole words are counted at once, partial ones are masked to the group
+            for (int i = begin; i < end;)
+            {
+                int const bit = i & 31;
+                int const num_bits = min(32 - bit, end - i);
+                uint const mask = (num_bits == 32 ? 0xffffffffu : ((1u << num_bits) - 1u)) << bit;
+                count += popcount(as_uint(results[i >> 5]) & mask);
+                i += num_bits;
+            }
+        }
+        else
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                ray const r = load_ray(rays, i);
+                count += (ray_is_active(&r) && results[i] == HIT_MARKER) ? 1 : 0;
+            }
+        }
+
+        counts[global_id] = count;
+    }
+}
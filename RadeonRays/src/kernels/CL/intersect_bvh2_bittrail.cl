@@ -97,6 +97,7 @@ TYPE DEFINITIONS
 **************************************************************************/
 
 #define LEAFNODE(x) (((x).child0) == -1)
+#define ORDER(x) ((int)((x).bounds[1].pmin.w))
 
 // BVH node
 typedef struct
@@ -129,6 +130,127 @@ typedef struct
 } bvh_node;
 
 
+// Any hit traversal of a single ray, returns true as soon as an occluder is found.
+// The child to visit first is precomputed by the builder (leaves first, then larger boxes)
+// and stored in the order bits of the node, so child distances are not compared.
+INLINE
+bool occlude_ray(
+    GLOBAL bvh_node const * restrict nodes,
+    GLOBAL float3 const * restrict vertices,
+    ray const r,
+    GLOBAL int const * restrict displacement_table,
+    GLOBAL int const * restrict hash_table,
+    int const hash_row_size
+    )
+{
+    // Precompute inverse direction and origin / dir for bbox testing
+    float3 const invdir = safe_invdir(r);
+    float3 const oxinvdir = -r.o.xyz * invdir;
+    // Intersection parametric distance
+    float const t_max = r.o.w;
+
+    // Bit tail to track traversal
+    int bit_trail = 0;
+    // Current node index (complete tree enumeration)
+    int node_idx = 1;
+    // Current node address
+    int addr = 0;
+
+    // Start from 0 node (root)
+    while (addr != INVALID_IDX)
+    {
+        // Fetch next node
+        bvh_node const node = nodes[addr];
+
+        // Check if it is a leaf
+        if (LEAFNODE(node))
+        {
+            // Leafs directly store vertex indices
+            // so we load vertices directly
+            float3 const v1 = vertices[node.i0];
+            float3 const v2 = vertices[node.i1];
+            float3 const v3 = vertices[node.i2];
+            // Intersect triangle
+            float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
+            // If hit bail out
+            if (f < t_max)
+            {
+                return true;
+            }
+        }
+        else
+        {
+            // It is internal node, so intersect vs both children bounds
+            float2 const s0 = fast_intersect_bbox1(node.bounds[0], invdir, oxinvdir, t_max);
+            float2 const s1 = fast_intersect_bbox1(node.bounds[1], invdir, oxinvdir, t_max);
+
+            // Determine which one to traverse
+            bool const traverse_c0 = (s0.x <= s0.y);
+            bool const traverse_c1 = (s1.x <= s1.y);
+            bool const c1first = traverse_c1 && ((ORDER(node) >> 3) & 1);
+
+            if (traverse_c0 || traverse_c1)
+            {
+                // Go one level down => shift bit trail
+                bit_trail = bit_trail << 1;
+                // idx = idx * 2 (this is for left child)
+                node_idx = node_idx << 1;
+
+                // If we postpone one node here we 
+                // set last bit in bit trail
+                if (traverse_c0 && traverse_c1)
+                {
+                    bit_trail = bit_trail ^ 0x1;
+                }
+
+                // Determine which one to traverse first
+                if (c1first || !traverse_c0)
+                {
+                    // Right one is more likely to occlude or left one not travesed
+                    addr = node.child1;
+                    // Fix index
+                    // idx = 2 * idx + 1 for right one
+                    node_idx = node_idx ^ 0x1;
+                }
+                else
+                {
+                    // Traverse left node otherwise
+                    addr = node.child0;
+                }
+
+                // Continue traversal
+                continue;
+            }
+        }
+
+        // Here we need to either backtrack or
+        // stop traversal.
+        // If bit trail is zero, there is nothing 
+        // to traverse.
+        if (bit_trail == 0)
+        {
+            addr = INVALID_IDX;
+            continue;
+        }
+        
+        // Backtrack
+        // Calculate where we postponed the last node.
+        // = number of trailing zeroes in bit_trail
+        int const num_levels = 31 - clz(bit_trail & -bit_trail);
+        // Update bit trail (shift and unset last bit)
+        bit_trail = (bit_trail >> num_levels) ^ 0x1;
+        // Calculate postponed index
+        node_idx = (node_idx >> num_levels) ^ 0x1;
+
+        // Calculate node address using perfect hasing of node indices
+        int const displacement = displacement_table[node_idx / hash_row_size];
+        addr = hash_table[displacement + (node_idx & (hash_row_size - 1))];
+    }
+
+    // Finished traversal, but no intersection found
+    return false;
+}
+
 __attribute__((reqd_work_group_size(64, 1, 1)))
 KERNEL void
 occluded_main(
@@ -137,139 +259,73 @@ occluded_main(
     // Triangles vertices
     GLOBAL float3 const * restrict vertices,
     // Rays
-    GLOBAL ray const * restrict rays,
+    GLOBAL RayRecord const* restrict rays,
     // Number of rays in rays buffer
     GLOBAL int const * restrict num_rays,
     // Displacement table for perfect hashing
     GLOBAL int const * restrict displacement_table,
     // Hash table for perfect hashing
     GLOBAL int const * restrict hash_table,
-    // Displacement table size
-    int const displacement_table_size,
+    // Row size of the hash table
+    int const hash_row_size,
     // Hit results: 1 for hit and -1 for miss
     GLOBAL int* hits
     )
 {
     int global_id = get_global_id(0);
-    int local_id = get_local_id(0);
-    int group_id = get_group_id(0);
 
     // Handle only working set
     if (global_id < *num_rays)
     {
-        ray const r = rays[global_id];
+        ray const r = load_ray(rays, global_id);
 
         if (ray_is_active(&r))
         {
-            // Precompute inverse direction and origin / dir for bbox testing
-            float3 const invdir = safe_invdir(r);
-            float3 const oxinvdir = -r.o.xyz * invdir;
-            // Intersection parametric distance
-            float const t_max = r.o.w;
-
-            // Bit tail to track traversal
-            int bit_trail = 0;
-            // Current node index (complete tree enumeration)
-            int node_idx = 1;
-            // Current node address
-            int addr = 0;
-
-            // Start from 0 node (root)
-            while (addr != INVALID_IDX)
-            {
-                // Fetch next node
-                bvh_node const node = nodes[addr];
-
-                // Check if it is a leaf
-                if (LEAFNODE(node))
-                {
-                    // Leafs directly store vertex indices
-                    // so we load vertices directly
-                    float3 const v1 = vertices[node.i0];
-                    float3 const v2 = vertices[node.i1];
-                    float3 const v3 = vertices[node.i2];
-                    // Intersect triangle
-                    float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
-                    // If hit store the result and bail out
-                    if (f < t_max)
-                    {
-                        hits[global_id] = HIT_MARKER;
-                        return;
-                    }
-                }
-                else
-                {
-                    // It is internal node, so intersect vs both children bounds
-                    float2 const s0 = fast_intersect_bbox1(node.bounds[0], invdir, oxinvdir, t_max);
-                    float2 const s1 = fast_intersect_bbox1(node.bounds[1], invdir, oxinvdir, t_max);
-
-                    // Determine which one to traverse
-                    bool const traverse_c0 = (s0.x <= s0.y);
-                    bool const traverse_c1 = (s1.x <= s1.y);
-                    bool const c1first = traverse_c1 && (s0.x > s1.x);
-
-                    if (traverse_c0 || traverse_c1)
-                    {
-                        // Go one level down => shift bit trail
-                        bit_trail = bit_trail << 1;
-                        // idx = idx * 2 (this is for left child)
-                        node_idx = node_idx << 1;
-
-                        // If we postpone one node here we 
-                        // set last bit in bit trail
-                        if (traverse_c0 && traverse_c1)
-                        {
-                            bit_trail = bit_trail ^ 0x1;
-                        }
-
-                        // Determine which one to traverse first
-                        if (c1first || !traverse_c0)
-                        {
-                            // Right one is closer or left one not travesed
-                            addr = node.child1;
-                            // Fix index
-                            // idx = 2 * idx + 1 for right one
-                            node_idx = node_idx ^ 0x1;
-                        }
-                        else
-                        {
-                            // Traverse left node otherwise
-                            addr = node.child0;
-                        }
+            hits[global_id] = occlude_ray(nodes, vertices, r, displacement_table, hash_table, hash_row_size) ? HIT_MARKER : MISS_MARKER;
+        }
+    }
+}
 
-                        // Continue traversal
-                        continue;
-                    }
-                }
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void
+occluded_compact_main(
+    // Bvh nodes
+    GLOBAL bvh_node const * restrict nodes,
+    // Triangles vertices
+    GLOBAL float3 const * restrict vertices,
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const * restrict num_rays,
+    // Displacement table for perfect hashing
+    GLOBAL int const * restrict displacement_table,
+    // Hash table for perfect hashing
+    GLOBAL int const * restrict hash_table,
+    // Row size of the hash table
+    int const hash_row_size,
+    // Hit bits
+    GLOBAL uint* hits
+    )
+{
+    int global_id = get_global_id(0);
+    int group_id = get_group_id(0);
+    int const count = *num_rays;
+    bool occluded = false;
 
-                // Here we need to either backtrack or
-                // stop traversal.
-                // If bit trail is zero, there is nothing 
-                // to traverse.
-                if (bit_trail == 0)
-                {
-                    addr = INVALID_IDX;
-                    continue;
-                }
-                
-                // Backtrack
-                // Calculate where we postponed the last node.
-                // = number of trailing zeroes in bit_trail
-                int const num_levels = 31 - clz(bit_trail & -bit_trail);
-                // Update bit trail (shift and unset last bit)
-                bit_trail = (bit_trail >> num_levels) ^ 0x1;
-                // Calculate postponed index
-                node_idx = (node_idx >> num_levels) ^ 0x1;
+    __local uint words[2];
 
-                // Calculate node address using perfect hasing of node indices
-                int const displacement = displacement_table[node_idx / displacement_table_size];
-                addr = hash_table[displacement + (node_idx & (displacement_table_size - 1))];
-            }
+    // Handle only working set
+    if (global_id < count)
+    {
+        ray const r = load_ray(rays, global_id);
 
-            // Finished traversal, but no intersection found
-            hits[global_id] = MISS_MARKER;
+        if (ray_is_active(&r))
+        {
+            occluded = occlude_ray(nodes, vertices, r, displacement_table, hash_table, hash_row_size);
         }
     }
+
+    store_occlusion_bits(hits, words, group_id * 64, count, occluded);
 }
 
 
@@ -280,17 +336,19 @@ KERNEL void intersect_main(
     // Triangles vertices
     GLOBAL float3 const * restrict vertices,
     // Rays
-    GLOBAL ray const * restrict rays,
+    GLOBAL RayRecord const* restrict rays,
     // Number of rays in rays buffer
     GLOBAL int const * restrict num_rays,
     // Displacement table for perfect hashing
     GLOBAL int const * restrict displacement_table,
     // Hash table for perfect hashing
     GLOBAL int const * restrict hash_table,
-    // Displacement table size
-    int const displacement_table_size,
+    // Row size of the hash table
+    int const hash_row_size,
     // Hit results: 1 for hit and -1 for miss
-    GLOBAL Intersection* hits)
+    GLOBAL HitRecord* hits
+    // Per-ray counters
+    TRAVERSAL_STATS_PARAM)
 {
     int global_id = get_global_id(0);
     int local_id = get_local_id(0);
@@ -299,7 +357,8 @@ KERNEL void intersect_main(
     // Handle only working subset
     if (global_id < *num_rays)
     {
-        ray const r = rays[global_id];
+        ray const r = load_ray(rays, global_id);
+        INIT_STATS();
 
         if (ray_is_active(&r))
         {
@@ -323,6 +382,7 @@ KERNEL void intersect_main(
             {
                 // Fetch next node
                 bvh_node const node = nodes[addr];
+                COUNT_STAT(iterations, 1);
 
                 // Check if it is a leaf
                 if (LEAFNODE(node))
@@ -332,6 +392,7 @@ KERNEL void intersect_main(
                     float3 const v1 = vertices[node.i0];
                     float3 const v2 = vertices[node.i1];
                     float3 const v3 = vertices[node.i2];
+                    COUNT_STAT(primitives, 1);
                     // Intersect triangle
                     float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
                     // If hit update closest hit distance and index
@@ -344,6 +405,7 @@ KERNEL void intersect_main(
                 else
                 {
                     // It is internal node, so intersect vs both children bounds
+                    COUNT_STAT(nodes, 2);
                     float2 const s0 = fast_intersect_bbox1(node.bounds[0], invdir, oxinvdir, t_max);
                     float2 const s1 = fast_intersect_bbox1(node.bounds[1], invdir, oxinvdir, t_max);
 
@@ -406,8 +468,8 @@ KERNEL void intersect_main(
                 node_idx = (node_idx >> num_levels) ^ 0x1;
 
                 // Calculate node address using perfect hasing of node indices
-                int displacement = displacement_table[node_idx / displacement_table_size];
-                addr = hash_table[displacement + (node_idx & (displacement_table_size - 1))];
+                int displacement = displacement_table[node_idx / hash_row_size];
+                addr = hash_table[displacement + (node_idx & (hash_row_size - 1))];
             }
 
             // Check if we have found an intersection
@@ -423,16 +485,15 @@ KERNEL void intersect_main(
                 // Calculte barycentric coordinates
                 float2 const uv = triangle_calculate_barycentrics(p, v1, v2, v3);
                 // Update hit information
-                hits[global_id].shape_id = node.shape_id;
-                hits[global_id].prim_id = node.prim_id;
-                hits[global_id].uvwt = make_float4(uv.x, uv.y, 0.f, t_max);
+                store_hit(hits, global_id, node.shape_id, node.prim_id, uv, t_max);
             }
             else
             {
                 // Miss here
-                hits[global_id].shape_id = MISS_MARKER;
-                hits[global_id].prim_id = MISS_MARKER;
+                store_miss(hits, global_id);
             }
         }
+
+        STORE_STATS(global_id);
     }
 }
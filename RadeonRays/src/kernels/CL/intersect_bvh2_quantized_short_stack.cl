@@ -0,0 +1,794 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file intersect_bvh2_quantized_short_stack.cl
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Intersector implementation based on quantized BVH stacked travesal.
+
+    Intersector is using binary BVH with two quantized bounding boxes per node.
+    Child bounds are stored as 8-bit offsets on a per node grid defined by
+    the origin and power of two scale per axis (see QuantizedBvhTranslator).
+    The bounds are decoded in registers before the slab test, node is
+    32 bytes instead of 64 bytes for intersect_bvh2_short_stack.cl.
+    With HALF_NODES defined child bounds are half floats rounded outwards
+    instead (see HalfBvhTranslator), node size is the same.
+    Traversal is using a stack which is split into two parts:
+        -Top part in fast LDS memory
+        -Bottom part in slow global memory.
+    Push operations first check for top part overflow and offload top
+    part into slow global memory if necessary.
+    Pop operations first check for top part emptiness and try to offload
+    from bottom part if necessary. 
+
+    Traversal pseudocode:
+
+        while(addr is valid)
+        {
+            node <- fetch next node at addr
+
+            if (node is leaf)
+                intersect leaf
+            else
+            {
+                intersect ray vs left child
+                intersect ray vs right child
+                if (intersect any of children)
+                {
+                    determine closer child
+                    if intersect both
+                    {
+                        addr = closer child
+                        check top stack and offload if necesary
+                        push farther child into the stack
+                    }
+                    else
+                    {
+                        addr = intersected child
+                    }
+                    continue
+                }
+            }
+
+            addr <- pop from top stack
+            if (addr is not valid)
+            {
+                try loading data from bottom stack to top stack
+                addr <- pop from top stack
+            }
+        }
+
+    Pros:
+        -Very fast traversal.
+        -Benefits from BVH quality optimization.
+    Cons:
+        -Depth is limited.
+        -Generates LDS traffic.
+ */
+
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+
+/*************************************************************************
+TYPE DEFINITIONS
+**************************************************************************/
+
+#define LEAFNODE(x) (((x).child0) == -1)
+// Stack sizes and work group size are passed as build options by the host
+// depending on the device, defaults match GCN
+#ifndef GLOBAL_STACK_SIZE
+#define GLOBAL_STACK_SIZE 48
+#endif
+#ifndef SHORT_STACK_SIZE
+#define SHORT_STACK_SIZE 16
+#endif
+#ifndef WAVEFRONT_SIZE
+#define WAVEFRONT_SIZE 64
+#endif
+
+#ifdef HALF_NODES
+// Half BVH node
+typedef struct
+{
+    union 
+    {
+        struct
+        {
+            // Half child bounds indexed as [child * 3 + axis]
+            ushort pmin[6];
+            ushort pmax[6];
+            // 1 if any hit traversal should visit the right child first
+            int order;
+        };
+
+        struct
+        {
+            // If node is a leaf we keep vertex indices here
+            int i0, i1, i2;
+            // Shape mask
+            int shape_mask;
+            // Shape ID
+            int shape_id;
+            // Primitive ID
+            int prim_id;
+            int padding;
+        };
+    };
+
+    // Address of a left child, right child is at child0 + 1
+    int child0;
+
+} bvh_node;
+
+#define OCCLUSION_ORDER(x) ((x).order)
+
+// Decode child bounding box, half to float conversion is exact
+INLINE
+bbox decode_child_bounds(bvh_node const* node, int child)
+{
+    bbox box;
+    box.pmin.xyz = vload_half3(child, (half const*)node->pmin);
+    box.pmax.xyz = vload_half3(child, (half const*)node->pmax);
+    return box;
+}
+#else
+// Quantized BVH node
+typedef struct
+{
+    union 
+    {
+        struct
+        {
+            // Quantization grid origin
+            float origin[3];
+            // Biased exponents of the grid scale per axis
+            uchar exponent[4];
+            // Quantized child bounds indexed as [child * 3 + axis]
+            uchar qmin[6];
+            uchar qmax[6];
+        };
+
+        struct
+        {
+            // If node is a leaf we keep vertex indices here
+            int i0, i1, i2;
+            // Shape mask
+            int shape_mask;
+            // Shape ID
+            int shape_id;
+            // Primitive ID
+            int prim_id;
+            int padding;
+        };
+    };
+
+    // Address of a left child, right child is at child0 + 1
+    int child0;
+
+} bvh_node;
+
+#define OCCLUSION_ORDER(x) ((x).exponent[3])
+
+// Decode child bounding box from the node grid,
+// q * scale is exact, so bounds are the same as on the host
+INLINE
+bbox decode_child_bounds(bvh_node const* node, int child)
+{
+    float3 const origin = make_float3(node->origin[0], node->origin[1], node->origin[2]);
+    float3 const scale = make_float3(
+        as_float((uint)node->exponent[0] << 23),
+        as_float((uint)node->exponent[1] << 23),
+        as_float((uint)node->exponent[2] << 23));
+
+    int const offset = child * 3;
+    float3 const qmin = make_float3(node->qmin[offset], node->qmin[offset + 1], node->qmin[offset + 2]);
+    float3 const qmax = make_float3(node->qmax[offset], node->qmax[offset + 1], node->qmax[offset + 2]);
+
+    bbox box;
+    box.pmin.xyz = origin + qmin * scale;
+    box.pmax.xyz = origin + qmax * scale;
+    return box;
+}
+#endif
+
+
+// Find any intersection for a single active ray, returns true if the ray is occluded
+INLINE bool occlude_ray(
+    // Bvh nodes
+    GLOBAL bvh_node const * restrict nodes,
+    // Triangles vertices
+    GLOBAL float3 const * restrict vertices,
+    // Ray
+    ray const r,
+    // Global memory stack of the ray
+    GLOBAL int* gm_stack_base,
+    // Short stack of the ray in LDS, entries are WAVEFRONT_SIZE apart
+    __local int* lm_stack_base
+    )
+{
+    __global int* gm_stack = gm_stack_base;
+    __local int* lm_stack = lm_stack_base;
+
+    // Precompute inverse direction and origin / dir for bbox testing
+    float3 const invdir = safe_invdir(r);
+    float3 const oxinvdir = -r.o.xyz * invdir;
+    // Intersection parametric distance
+    float const t_max = r.o.w;
+
+    // Current node address
+    int addr = 0;
+
+    //  Initalize local stack
+    *lm_stack = INVALID_IDX;
+    lm_stack += WAVEFRONT_SIZE;
+
+    // Start from 0 node (root)
+    while (addr != INVALID_IDX)
+    {
+        // Fetch next node
+        bvh_node const node = nodes[addr];
+
+        // Check if it is a leaf
+        if (LEAFNODE(node))
+        {
+            // Leafs directly store vertex indices
+            // so we load vertices directly
+            float3 const v1 = vertices[node.i0];
+            float3 const v2 = vertices[node.i1];
+            float3 const v3 = vertices[node.i2];
+            // Intersect triangle
+            float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
+            // If hit bail out
+            if (f < t_max)
+            {
+                return true;
+            }
+        }
+        else
+        {
+            // It is internal node, so intersect vs both children bounds
+            float2 const s0 = fast_intersect_bbox1(decode_child_bounds(&node, 0), invdir, oxinvdir, t_max);
+            float2 const s1 = fast_intersect_bbox1(decode_child_bounds(&node, 1), invdir, oxinvdir, t_max);
+
+            // Determine which one to traverse
+            bool const traverse_c0 = (s0.x <= s0.y);
+            bool const traverse_c1 = (s1.x <= s1.y);
+            // Any hit does not need the closest child, visit the one likely to terminate traversal first
+            bool const c1first = traverse_c1 && OCCLUSION_ORDER(node);
+
+            if (traverse_c0 || traverse_c1)
+            {
+                int deferred = -1;
+
+                // Determine which one to traverse first
+                if (c1first || !traverse_c0)
+                {
+                    // Right one goes first or left one not travesed
+                    addr = node.child0 + 1;
+                    deferred = node.child0;
+                }
+                else
+                {
+                    // Traverse left node otherwise
+                    addr = node.child0;
+                    deferred = node.child0 + 1;
+                }
+
+                // If we traverse both children we need to postpone the node
+                if (traverse_c0 && traverse_c1)
+                {
+                    // If short stack is full, we offload it into global memory
+                    if (lm_stack - lm_stack_base >= SHORT_STACK_SIZE * WAVEFRONT_SIZE)
+                    {
+                        for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+                        {
+                            gm_stack[i] = lm_stack_base[i * WAVEFRONT_SIZE];
+                        }
+
+                        gm_stack += SHORT_STACK_SIZE;
+                        lm_stack = lm_stack_base + WAVEFRONT_SIZE;
+                    }
+
+                    *lm_stack = deferred;
+                    lm_stack += WAVEFRONT_SIZE;
+                }
+
+                // Continue traversal
+                continue;
+            }
+        }
+
+        // Try popping from local stack
+        lm_stack -= WAVEFRONT_SIZE;
+        addr = *(lm_stack);
+
+        // If we popped INVALID_IDX then check global stack
+        if (addr == INVALID_IDX && gm_stack > gm_stack_base)
+        {
+            // Adjust stack pointer
+            gm_stack -= SHORT_STACK_SIZE;
+            // Copy data from global memory to LDS
+            for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+            {
+                lm_stack_base[i * WAVEFRONT_SIZE] = gm_stack[i];
+            }
+            // Point local stack pointer to the end
+            lm_stack = lm_stack_base + (SHORT_STACK_SIZE - 1) * WAVEFRONT_SIZE;
+            addr = lm_stack_base[WAVEFRONT_SIZE * (SHORT_STACK_SIZE - 1)];
+        }
+    }
+
+    // Finished traversal, but no intersection found
+    return false;
+}
+
+__attribute__((reqd_work_group_size(WAVEFRONT_SIZE, 1, 1)))
+KERNEL void
+occluded_main(
+    // Bvh nodes
+    GLOBAL bvh_node const * restrict nodes,
+    // Triangles vertices
+    GLOBAL float3 const * restrict vertices,
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const * restrict num_rays,
+    // Index of the first ray in the dispatch
+    int offset,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit results: 1 for hit and -1 for miss
+    GLOBAL int* hits
+    )
+{
+    int global_id = get_global_id(0) + offset;
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+
+    // Allocate stack in LDS
+    __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+
+    // Handle only working set
+    if (global_id < *num_rays)
+    {
+        ray const r = load_ray(rays, global_id);
+
+        if (ray_is_active(&r))
+        {
+            GLOBAL int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
+            hits[global_id] = occlude_ray(nodes, vertices, r, gm_stack_base, lds + local_id) ? HIT_MARKER : MISS_MARKER;
+        }
+    }
+}
+
+// Compact variant: results are stored as 1 bit per ray
+__attribute__((reqd_work_group_size(WAVEFRONT_SIZE, 1, 1)))
+KERNEL void
+occluded_compact_main(
+    // Bvh nodes
+    GLOBAL bvh_node const * restrict nodes,
+    // Triangles vertices
+    GLOBAL float3 const * restrict vertices,
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const * restrict num_rays,
+    // Index of the first ray in the dispatch
+    int offset,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit bits
+    GLOBAL uint* hits
+    )
+{
+    int global_id = get_global_id(0) + offset;
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+    int const count = *num_rays;
+    bool occluded = false;
+
+    // Allocate stack in LDS
+    __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+    __local uint words[WAVEFRONT_SIZE / 32];
+
+    // Handle only working set
+    if (global_id < count)
+    {
+        ray const r = load_ray(rays, global_id);
+
+        if (ray_is_active(&r))
+        {
+            GLOBAL int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
+            occluded = occlude_ray(nodes, vertices, r, gm_stack_base, lds + local_id);
+        }
+    }
+
+    store_occlusion_bits(hits, words, offset + group_id * WAVEFRONT_SIZE, count, occluded);
+}
+
+__attribute__((reqd_work_group_size(WAVEFRONT_SIZE, 1, 1)))
+KERNEL void intersect_main(
+    // Bvh nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangles vertices
+    GLOBAL float3 const* restrict vertices,
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const* restrict num_rays,
+    // Index of the first ray in the dispatch
+    int offset,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit data
+    GLOBAL HitRecord* hits
+    // Per-ray counters
+    TRAVERSAL_STATS_PARAM)
+{
+    int global_id = get_global_id(0) + offset;
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+
+    // Handle only working subset
+    if (global_id < *num_rays)
+    {
+        ray const r = load_ray(rays, global_id);
+        INIT_STATS();
+
+        if (ray_is_active(&r))
+        {
+            // Allocate stack in global memory 
+            __global int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
+            __global int* gm_stack = gm_stack_base;
+            // Allocate stack in LDS
+            __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+            __local int* lm_stack_base = lds + local_id;
+            __local int* lm_stack = lm_stack_base;
+
+            // Precompute inverse direction and origin / dir for bbox testing
+            float3 const invdir = safe_invdir(r);
+            float3 const oxinvdir = -r.o.xyz * invdir;
+            // Intersection parametric distance
+            float t_max = r.o.w;
+
+            // Current node address
+            int addr = 0;
+            // Current closest intersection leaf index
+            int isect_idx = INVALID_IDX;
+
+            //  Initalize local stack
+            *lm_stack = INVALID_IDX;
+            lm_stack += WAVEFRONT_SIZE;
+
+            // Start from 0 node (root)
+            while (addr != INVALID_IDX)
+            {
+                // Fetch next node
+                bvh_node const node = nodes[addr];
+                COUNT_STAT(iterations, 1);
+
+                // Check if it is a leaf
+                if (LEAFNODE(node))
+                {
+                    // Leafs directly store vertex indices
+                    // so we load vertices directly
+                    float3 const v1 = vertices[node.i0];
+                    float3 const v2 = vertices[node.i1];
+                    float3 const v3 = vertices[node.i2];
+                    COUNT_STAT(primitives, 1);
+                    // Intersect triangle
+                    float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
+                    // If hit update closest hit distance and index
+                    if (f < t_max)
+                    {
+                        t_max = f;
+                        isect_idx = addr;
+                    }
+                }
+                else
+                {
+                    // It is internal node, so intersect vs both children bounds
+                    COUNT_STAT(nodes, 2);
+                    float2 const s0 = fast_intersect_bbox1(decode_child_bounds(&node, 0), invdir, oxinvdir, t_max);
+                    float2 const s1 = fast_intersect_bbox1(decode_child_bounds(&node, 1), invdir, oxinvdir, t_max);
+
+                    // Determine which one to traverse
+                    bool const traverse_c0 = (s0.x <= s0.y);
+                    bool const traverse_c1 = (s1.x <= s1.y);
+                    bool const c1first = traverse_c1 && (s0.x > s1.x);
+
+                    if (traverse_c0 || traverse_c1)
+                    {
+                        int deferred = -1;
+
+                        // Determine which one to traverse first
+                        if (c1first || !traverse_c0)
+                        {
+                            // Right one is closer or left one not travesed
+                            addr = node.child0 + 1;
+                            deferred = node.child0;
+                        }
+                        else
+                        {
+                            // Traverse left node otherwise
+                            addr = node.child0;
+                            deferred = node.child0 + 1;
+                        }
+
+                        // If we traverse both children we need to postpone the node
+                        if (traverse_c0 && traverse_c1)
+                        {
+                            // If short stack is full, we offload it into global memory
+                            if ( lm_stack - lm_stack_base >= SHORT_STACK_SIZE * WAVEFRONT_SIZE)
+                            {
+                                for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+                                {
+                                    gm_stack[i] = lm_stack_base[i * WAVEFRONT_SIZE];
+                                }
+
+                                gm_stack += SHORT_STACK_SIZE;
+                                lm_stack = lm_stack_base + WAVEFRONT_SIZE;
+                                COUNT_STAT(spills, 1);
+                            }
+
+                            *lm_stack = deferred;
+                            lm_stack += WAVEFRONT_SIZE;
+                        }
+
+                        // Continue traversal
+                        continue;
+                    }
+                }
+
+                // Try popping from local stack
+                lm_stack -= WAVEFRONT_SIZE;
+                addr = *(lm_stack);
+
+                // If we popped INVALID_IDX then check global stack
+                if (addr == INVALID_IDX && gm_stack > gm_stack_base)
+                {
+                    // Adjust stack pointer
+                    gm_stack -= SHORT_STACK_SIZE;
+                    // Copy data from global memory to LDS
+                    for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+                    {
+                        lm_stack_base[i * WAVEFRONT_SIZE] = gm_stack[i];
+                    }
+                    // Point local stack pointer to the end
+                    lm_stack = lm_stack_base + (SHORT_STACK_SIZE - 1) * WAVEFRONT_SIZE;
+                    addr = lm_stack_base[WAVEFRONT_SIZE * (SHORT_STACK_SIZE - 1)];
+                }
+            }
+
+            // Check if we have found an intersection
+            if (isect_idx != INVALID_IDX)
+            {
+                // Fetch the node & vertices
+                bvh_node const node = nodes[isect_idx];
+                float3 const v1 = vertices[node.i0];
+                float3 const v2 = vertices[node.i1];
+                float3 const v3 = vertices[node.i2];
+                // Calculate hit position
+                float3 const p = r.o.xyz + r.d.xyz * t_max;
+                // Calculte barycentric coordinates
+                float2 const uv = triangle_calculate_barycentrics(p, v1, v2, v3);
+                // Update hit information
+                store_hit(hits, global_id, node.shape_id, node.prim_id, uv, t_max);
+            }
+            else
+            {
+                // Miss here
+                store_miss(hits, global_id);
+            }
+        }
+
+        STORE_STATS(global_id);
+    }
+}
+
+// Find k closest intersections in a single traversal, hits of the ray are sorted by distance
+__attribute__((reqd_work_group_size(WAVEFRONT_SIZE, 1, 1)))
+KERNEL void intersect_multi_main(
+    // Bvh nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangles vertices
+    GLOBAL float3 const* restrict vertices,
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const* restrict num_rays,
+    // Index of the first ray in the dispatch
+    int offset,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit data, k records per ray
+    GLOBAL HitRecord* hits,
+    // Number of hits per ray
+    int k)
+{
+    int global_id = get_global_id(0) + offset;
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+
+    // Handle only working subset
+    if (global_id < *num_rays)
+    {
+        ray const r = load_ray(rays, global_id);
+
+        if (ray_is_active(&r))
+        {
+            // Allocate stack in global memory 
+            __global int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
+            __global int* gm_stack = gm_stack_base;
+            // Allocate stack in LDS
+            __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+            __local int* lm_stack_base = lds + local_id;
+            __local int* lm_stack = lm_stack_base;
+
+            // Precompute inverse direction and origin / dir for bbox testing
+            float3 const invdir = safe_invdir(r);
+            float3 const oxinvdir = -r.o.xyz * invdir;
+            // Culling distance, distance of the k-th closest hit found so far
+            float t_max = r.o.w;
+
+            // Closest hits sorted by distance, leaf indices are kept in x
+            float hit_t[MAX_MULTI_HITS];
+            int2 hit_data[MAX_MULTI_HITS];
+            for (int i = 0; i < MAX_MULTI_HITS; ++i)
+            {
+                hit_t[i] = t_max;
+                hit_data[i] = make_int2(INVALID_IDX, INVALID_IDX);
+            }
+
+            // Current node address
+            int addr = 0;
+
+            //  Initalize local stack
+            *lm_stack = INVALID_IDX;
+            lm_stack += WAVEFRONT_SIZE;
+
+            // Start from 0 node (root)
+            while (addr != INVALID_IDX)
+            {
+                // Fetch next node
+                bvh_node const node = nodes[addr];
+
+                // Check if it is a leaf
+                if (LEAFNODE(node))
+                {
+                    // Leafs directly store vertex indices
+                    // so we load vertices directly
+                    float3 const v1 = vertices[node.i0];
+                    float3 const v2 = vertices[node.i1];
+                    float3 const v3 = vertices[node.i2];
+                    // Intersect triangle
+                    float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
+                    // If hit insert it into the list and shrink culling distance once the list is full
+                    if (f < t_max)
+                    {
+                        t_max = insert_multi_hit(hit_t, hit_data, k, f, make_int2(addr, INVALID_IDX));
+                    }
+                }
+                else
+                {
+                    // It is internal node, so intersect vs both children bounds
+                    float2 const s0 = fast_intersect_bbox1(decode_child_bounds(&node, 0), invdir, oxinvdir, t_max);
+                    float2 const s1 = fast_intersect_bbox1(decode_child_bounds(&node, 1), invdir, oxinvdir, t_max);
+
+                    // Determine which one to traverse
+                    bool const traverse_c0 = (s0.x <= s0.y);
+                    bool const traverse_c1 = (s1.x <= s1.y);
+                    bool const c1first = traverse_c1 && (s0.x > s1.x);
+
+                    if (traverse_c0 || traverse_c1)
+                    {
+                        int deferred = -1;
+
+                        // Determine which one to traverse first
+                        if (c1first || !traverse_c0)
+                        {
+                            // Right one is closer or left one not travesed
+                            addr = node.child0 + 1;
+                            deferred = node.child0;
+                        }
+                        else
+                        {
+                            // Traverse left node otherwise
+                            addr = node.child0;
+                            deferred = node.child0 + 1;
+                        }
+
+                        // If we traverse both children we need to postpone the node
+                        if (traverse_c0 && traverse_c1)
+                        {
+                            // If short stack is full, we offload it into global memory
+                            if ( lm_stack - lm_stack_base >= SHORT_STACK_SIZE * WAVEFRONT_SIZE)
+                            {
+                                for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+                                {
+                                    gm_stack[i] = lm_stack_base[i * WAVEFRONT_SIZE];
+                                }
+
+                                gm_stack += SHORT_STACK_SIZE;
+                                lm_stack = lm_stack_base + WAVEFRONT_SIZE;
+                            }
+
+                            *lm_stack = deferred;
+                            lm_stack += WAVEFRONT_SIZE;
+                        }
+
+                        // Continue traversal
+                        continue;
+                    }
+                }
+
+                // Try popping from local stack
+                lm_stack -= WAVEFRONT_SIZE;
+                addr = *(lm_stack);
+
+                // If we popped INVALID_IDX then check global stack
+                if (addr == INVALID_IDX && gm_stack > gm_stack_base)
+                {
+                    // Adjust stack pointer
+                    gm_stack -= SHORT_STACK_SIZE;
+                    // Copy data from global memory to LDS
+                    for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+                    {
+                        lm_stack_base[i * WAVEFRONT_SIZE] = gm_stack[i];
+                    }
+                    // Point local stack pointer to the end
+                    lm_stack = lm_stack_base + (SHORT_STACK_SIZE - 1) * WAVEFRONT_SIZE;
+                    addr = lm_stack_base[WAVEFRONT_SIZE * (SHORT_STACK_SIZE - 1)];
+                }
+            }
+
+            // Write the list, unused entries are misses
+            for (int i = 0; i < MAX_MULTI_HITS; ++i)
+            {
+                if (i < k)
+                {
+                    if (hit_data[i].x != INVALID_IDX)
+                    {
+                        // Fetch the node & vertices
+                        bvh_node const node = nodes[hit_data[i].x];
+                        float3 const v1 = vertices[node.i0];
+                        float3 const v2 = vertices[node.i1];
+                        float3 const v3 = vertices[node.i2];
+                        // Calculate hit position
+                        float3 const p = r.o.xyz + r.d.xyz * hit_t[i];
+                        // Calculte barycentric coordinates
+                        float2 const uv = triangle_calculate_barycentrics(p, v1, v2, v3);
+                        // Update hit information
+                        store_hit(hits, global_id * k + i, node.shape_id, node.prim_id, uv, hit_t[i]);
+                    }
+                    else
+                    {
+                        store_miss(hits, global_id * k + i);
+                    }
+                }
+            }
+        }
+    }
+}
@@ -90,9 +90,26 @@ TYPE DEFINITIONS
 **************************************************************************/
 
 #define LEAFNODE(x) (((x).child0) == -1)
-#define GLOBAL_STACK_SIZE 32
+// Traversal order of internal node: split axis and swap flag
+#define ORDER(x) ((int)((x).bounds[1].pmin.w))
+#ifdef RR_RAY_MASK
+// Leafs keep their shape mask, internal nodes the union of shape masks below them
+#define NODE_MASK(x) (LEAFNODE(x) ? (x).shape_mask : as_int((x).bounds[1].pmax.w))
+#define NODE_VISIBLE(x, r) ((NODE_MASK(x) & ray_get_mask(&(r))) != 0)
+#else
+#define NODE_VISIBLE(x, r) true
+#endif
+// Stack sizes and work group size are passed as build options by the host
+// depending on the device, defaults match GCN
+#ifndef GLOBAL_STACK_SIZE
+#define GLOBAL_STACK_SIZE 48
+#endif
+#ifndef SHORT_STACK_SIZE
 #define SHORT_STACK_SIZE 16
+#endif
+#ifndef WAVEFRONT_SIZE
 #define WAVEFRONT_SIZE 64
+#endif
 
 // BVH node
 typedef struct
@@ -125,7 +142,141 @@ typedef struct
 } bvh_node;
 
 
-__attribute__((reqd_work_group_size(64, 1, 1)))
+// Find any intersection for a single active ray, returns true if the ray is occluded
+INLINE bool occlude_ray(
+    // Bvh nodes
+    GLOBAL bvh_node const * restrict nodes,
+    // Triangles vertices
+    GLOBAL float3 const * restrict vertices,
+    // Ray
+    ray const r,
+    // Global memory stack of the ray
+    GLOBAL int* gm_stack_base,
+    // Short stack of the ray in LDS, entries are WAVEFRONT_SIZE apart
+    __local int* lm_stack_base
+    )
+{
+    __global int* gm_stack = gm_stack_base;
+    __local int* lm_stack = lm_stack_base;
+
+    // Precompute inverse direction and origin / dir for bbox testing
+    float3 const invdir = safe_invdir(r);
+    float3 const oxinvdir = -r.o.xyz * invdir;
+    // Intersection parametric distance
+    float const t_max = r.o.w;
+
+    // Current node address
+    int addr = 0;
+
+    //  Initalize local stack
+    *lm_stack = INVALID_IDX;
+    lm_stack += WAVEFRONT_SIZE;
+
+    // Start from 0 node (root)
+    while (addr != INVALID_IDX)
+    {
+        // Fetch next node
+        bvh_node const node = nodes[addr];
+
+        // Subtrees without shapes visible to the ray are skipped
+        if (!NODE_VISIBLE(node, r))
+        {
+        }
+        // Check if it is a leaf
+        else if (LEAFNODE(node))
+        {
+            // Leafs directly store vertex indices
+            // so we load vertices directly
+            float3 const v1 = vertices[node.i0];
+            float3 const v2 = vertices[node.i1];
+            float3 const v3 = vertices[node.i2];
+            // Intersect triangle
+            float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
+            // If hit bail out
+            if (f < t_max)
+            {
+                return true;
+            }
+        }
+        else
+        {
+            // It is internal node, so intersect vs both children bounds
+            float2 const s0 = fast_intersect_bbox1(node.bounds[0], invdir, oxinvdir, t_max);
+            float2 const s1 = fast_intersect_bbox1(node.bounds[1], invdir, oxinvdir, t_max);
+
+            // Determine which one to traverse
+            bool const traverse_c0 = (s0.x <= s0.y);
+            bool const traverse_c1 = (s1.x <= s1.y);
+            // Any hit does not need the closest child, visit the one likely to terminate traversal first
+            bool const c1first = traverse_c1 && ((ORDER(node) >> 3) & 1);
+
+            if (traverse_c0 || traverse_c1)
+            {
+                int deferred = -1;
+
+                // Determine which one to traverse first
+                if (c1first || !traverse_c0)
+                {
+                    // Right one goes first or left one not travesed
+                    addr = node.child1;
+                    deferred = node.child0;
+                }
+                else
+                {
+                    // Traverse left node otherwise
+                    addr = node.child0;
+                    deferred = node.child1;
+                }
+
+                // If we traverse both children we need to postpone the node
+                if (traverse_c0 && traverse_c1)
+                {
+                    // If short stack is full, we offload it into global memory
+                    if (lm_stack - lm_stack_base >= SHORT_STACK_SIZE * WAVEFRONT_SIZE)
+                    {
+                        for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+                        {
+                            gm_stack[i] = lm_stack_base[i * WAVEFRONT_SIZE];
+                        }
+
+                        gm_stack += SHORT_STACK_SIZE;
+                        lm_stack = lm_stack_base + WAVEFRONT_SIZE;
+                    }
+
+                    *lm_stack = deferred;
+                    lm_stack += WAVEFRONT_SIZE;
+                }
+
+                // Continue traversal
+                continue;
+            }
+        }
+
+        // Try popping from local stack
+        lm_stack -= WAVEFRONT_SIZE;
+        addr = *(lm_stack);
+
+        // If we popped INVALID_IDX then check global stack
+        if (addr == INVALID_IDX && gm_stack > gm_stack_base)
+        {
+            // Adjust stack pointer
+            gm_stack -= SHORT_STACK_SIZE;
+            // Copy data from global memory to LDS
+            for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+            {
+                lm_stack_base[i * WAVEFRONT_SIZE] = gm_stack[i];
+            }
+            // Point local stack pointer to the end
+            lm_stack = lm_stack_base + (SHORT_STACK_SIZE - 1) * WAVEFRONT_SIZE;
+            addr = lm_stack_base[WAVEFRONT_SIZE * (SHORT_STACK_SIZE - 1)];
+        }
+    }
+
+    // Finished traversal, but no intersection found
+    return false;
+}
+
+__attribute__((reqd_work_group_size(WAVEFRONT_SIZE, 1, 1)))
 KERNEL void
 occluded_main(
     // Bvh nodes
@@ -133,23 +284,110 @@ occluded_main(
     // Triangles vertices
     GLOBAL float3 const * restrict vertices,
     // Rays
-    GLOBAL ray const * restrict rays,
+    GLOBAL RayRecord const* restrict rays,
     // Number of rays in rays buffer
     GLOBAL int const * restrict num_rays,
+    // Index of the first ray in the dispatch
+    int offset,
     // Stack memory
     GLOBAL int* stack,
     // Hit results: 1 for hit and -1 for miss
     GLOBAL int* hits
     )
 {
-    int global_id = get_global_id(0);
+    int global_id = get_global_id(0) + offset;
     int local_id = get_local_id(0);
     int group_id = get_group_id(0);
 
+    // Allocate stack in LDS
+    __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+
     // Handle only working set
     if (global_id < *num_rays)
     {
-        ray const r = rays[global_id];
+        ray const r = load_ray(rays, global_id);
+
+        if (ray_is_active(&r))
+        {
+            GLOBAL int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
+            hits[global_id] = occlude_ray(nodes, vertices, r, gm_stack_base, lds + local_id) ? HIT_MARKER : MISS_MARKER;
+        }
+    }
+}
+
+// Compact variant: results are stored as 1 bit per ray
+__attribute__((reqd_work_group_size(WAVEFRONT_SIZE, 1, 1)))
+KERNEL void
+occluded_compact_main(
+    // Bvh nodes
+    GLOBAL bvh_node const * restrict nodes,
+    // Triangles vertices
+    GLOBAL float3 const * restrict vertices,
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const * restrict num_rays,
+    // Index of the first ray in the dispatch
+    int offset,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit bits
+    GLOBAL uint* hits
+    )
+{
+    int global_id = get_global_id(0) + offset;
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+    int const count = *num_rays;
+    bool occluded = false;
+
+    // Allocate stack in LDS
+    __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+    __local uint words[WAVEFRONT_SIZE / 32];
+
+    // Handle only working set
+    if (global_id < count)
+    {
+        ray const r = load_ray(rays, global_id);
+
+        if (ray_is_active(&r))
+        {
+            GLOBAL int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
+            occluded = occlude_ray(nodes, vertices, r, gm_stack_base, lds + local_id);
+        }
+    }
+
+    store_occlusion_bits(hits, words, offset + group_id * WAVEFRONT_SIZE, count, occluded);
+}
+
+__attribute__((reqd_work_group_size(WAVEFRONT_SIZE, 1, 1)))
+KERNEL void intersect_main(
+    // Bvh nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangles vertices
+    GLOBAL float3 const* restrict vertices,
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const* restrict num_rays,
+    // Index of the first ray in the dispatch
+    int offset,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit data
+    GLOBAL HitRecord* hits
+    // Per-ray counters
+    TRAVERSAL_STATS_PARAM)
+{
+    int global_id = get_global_id(0) + offset;
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+
+    // Handle only working subset
+    if (global_id < *num_rays)
+    {
+        ray const r = load_ray(rays, global_id);
+        INIT_STATS();
 
         if (ray_is_active(&r))
         {
@@ -164,8 +402,10 @@ occluded_main(
             // Precompute inverse direction and origin / dir for bbox testing
             float3 const invdir = safe_invdir(r);
             float3 const oxinvdir = -r.o.xyz * invdir;
+            // Direction signs, bit per axis is set for negative direction
+            int const dirsign = (r.d.x < 0.f ? 1 : 0) | (r.d.y < 0.f ? 2 : 0) | (r.d.z < 0.f ? 4 : 0);
             // Intersection parametric distance
-            float const t_max = r.o.w;
+            float t_max = r.o.w;
 
             // Current node address
             int addr = 0;
@@ -181,34 +421,43 @@ occluded_main(
             {
                 // Fetch next node
                 bvh_node const node = nodes[addr];
+                COUNT_STAT(iterations, 1);
 
+                // Subtrees without shapes visible to the ray are skipped
+                if (!NODE_VISIBLE(node, r))
+                {
+                }
                 // Check if it is a leaf
-                if (LEAFNODE(node))
+                else if (LEAFNODE(node))
                 {
                     // Leafs directly store vertex indices
                     // so we load vertices directly
                     float3 const v1 = vertices[node.i0];
                     float3 const v2 = vertices[node.i1];
                     float3 const v3 = vertices[node.i2];
+                    COUNT_STAT(primitives, 1);
                     // Intersect triangle
                     float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
                     // If hit update closest hit distance and index
                     if (f < t_max)
                     {
-                        hits[global_id] = HIT_MARKER;
-                        return;
+                        t_max = f;
+                        isect_idx = addr;
                     }
                 }
                 else
                 {
                     // It is internal node, so intersect vs both children bounds
+                    COUNT_STAT(nodes, 2);
                     float2 const s0 = fast_intersect_bbox1(node.bounds[0], invdir, oxinvdir, t_max);
                     float2 const s1 = fast_intersect_bbox1(node.bounds[1], invdir, oxinvdir, t_max);
 
                     // Determine which one to traverse
                     bool const traverse_c0 = (s0.x <= s0.y);
                     bool const traverse_c1 = (s1.x <= s1.y);
-                    bool const c1first = traverse_c1 && (s0.x > s1.x);
+                    // Child order is known from the ray direction along the split axis
+                    int const order = ORDER(node);
+                    bool const c1first = traverse_c1 && (((dirsign >> (order & 3)) ^ ((order >> 2) & 1)) & 1);
 
                     if (traverse_c0 || traverse_c1)
                     {
@@ -232,7 +481,7 @@ occluded_main(
                         if (traverse_c0 && traverse_c1)
                         {
                             // If short stack is full, we offload it into global memory
-                            if (lm_stack - lm_stack_base >= SHORT_STACK_SIZE * WAVEFRONT_SIZE)
+                            if ( lm_stack - lm_stack_base >= SHORT_STACK_SIZE * WAVEFRONT_SIZE)
                             {
                                 for (int i = 1; i < SHORT_STACK_SIZE; ++i)
                                 {
@@ -241,6 +490,7 @@ occluded_main(
 
                                 gm_stack += SHORT_STACK_SIZE;
                                 lm_stack = lm_stack_base + WAVEFRONT_SIZE;
+                                COUNT_STAT(spills, 1);
                             }
 
                             *lm_stack = deferred;
@@ -272,35 +522,60 @@ occluded_main(
                 }
             }
 
-            // Finished traversal, but no intersection found
-            hits[global_id] = MISS_MARKER;
+            // Check if we have found an intersection
+            if (isect_idx != INVALID_IDX)
+            {
+                // Fetch the node & vertices
+                bvh_node const node = nodes[isect_idx];
+                float3 const v1 = vertices[node.i0];
+                float3 const v2 = vertices[node.i1];
+                float3 const v3 = vertices[node.i2];
+                // Calculate hit position
+                float3 const p = r.o.xyz + r.d.xyz * t_max;
+                // Calculte barycentric coordinates
+                float2 const uv = triangle_calculate_barycentrics(p, v1, v2, v3);
+                // Update hit information
+                store_hit(hits, global_id, node.shape_id, node.prim_id, uv, t_max);
+            }
+            else
+            {
+                // Miss here
+                store_miss(hits, global_id);
+            }
         }
+
+        STORE_STATS(global_id);
     }
 }
 
-__attribute__((reqd_work_group_size(64, 1, 1)))
-KERNEL void intersect_main(
+// Find k closest intersections in a single traversal, hits of the ray are sorted by distance
+__attribute__((reqd_work_group_size(WAVEFRONT_SIZE, 1, 1)))
+KERNEL void intersect_multi_main(
     // Bvh nodes
     GLOBAL bvh_node const* restrict nodes,
     // Triangles vertices
     GLOBAL float3 const* restrict vertices,
     // Rays
-    GLOBAL ray const* restrict rays,
+    GLOBAL RayRecord const* restrict rays,
     // Number of rays in rays buffer
     GLOBAL int const* restrict num_rays,
+    // Index of the first ray in the dispatch
+    int offset,
     // Stack memory
     GLOBAL int* stack,
-    // Hit data
-    GLOBAL Intersection* hits)
+    // Hit data, k records per ray
+    GLOBAL HitRecord* hits,
+    // Number of hits per ray
+    int k)
 {
-    int global_id = get_global_id(0);
+    int global_id = get_global_id(0) + offset;
     int local_id = get_local_id(0);
     int group_id = get_group_id(0);
 
     // Handle only working subset
     if (global_id < *num_rays)
     {
-        ray const r = rays[global_id];
+        ray const r = load_ray(rays, global_id);
 
         if (ray_is_active(&r))
         {
@@ -315,13 +590,22 @@ KERNEL void intersect_main(
             // Precompute inverse direction and origin / dir for bbox testing
             float3 const invdir = safe_invdir(r);
             float3 const oxinvdir = -r.o.xyz * invdir;
-            // Intersection parametric distance
+            // Direction signs, bit per axis is set for negative direction
+            int const dirsign = (r.d.x < 0.f ? 1 : 0) | (r.d.y < 0.f ? 2 : 0) | (r.d.z < 0.f ? 4 : 0);
+            // Culling distance, distance of the k-th closest hit found so far
             float t_max = r.o.w;
 
+            // Closest hits sorted by distance, leaf indices are kept in x
+            float hit_t[MAX_MULTI_HITS];
+            int2 hit_data[MAX_MULTI_HITS];
+            for (int i = 0; i < MAX_MULTI_HITS; ++i)
+            {
+                hit_t[i] = t_max;
+                hit_data[i] = make_int2(INVALID_IDX, INVALID_IDX);
+            }
+
             // Current node address
             int addr = 0;
-            // Current closest intersection leaf index
-            int isect_idx = INVALID_IDX;
 
             //  Initalize local stack
             *lm_stack = INVALID_IDX;
@@ -333,8 +617,12 @@ KERNEL void intersect_main(
                 // Fetch next node
                 bvh_node const node = nodes[addr];
 
+                // Subtrees without shapes visible to the ray are skipped
+                if (!NODE_VISIBLE(node, r))
+                {
+                }
                 // Check if it is a leaf
-                if (LEAFNODE(node))
+                else if (LEAFNODE(node))
                 {
                     // Leafs directly store vertex indices
                     // so we load vertices directly
@@ -343,11 +631,10 @@ KERNEL void intersect_main(
                     float3 const v3 = vertices[node.i2];
                     // Intersect triangle
                     float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
-                    // If hit update closest hit distance and index
+                    // If hit insert it into the list and shrink culling distance once the list is full
                     if (f < t_max)
                     {
-                        t_max = f;
-                        isect_idx = addr;
+                        t_max = insert_multi_hit(hit_t, hit_data, k, f, make_int2(addr, INVALID_IDX));
                     }
                 }
                 else
@@ -359,7 +646,9 @@ KERNEL void intersect_main(
                     // Determine which one to traverse
                     bool const traverse_c0 = (s0.x <= s0.y);
                     bool const traverse_c1 = (s1.x <= s1.y);
-                    bool const c1first = traverse_c1 && (s0.x > s1.x);
+                    // Child order is known from the ray direction along the split axis
+                    int const order = ORDER(node);
+                    bool const c1first = traverse_c1 && (((dirsign >> (order & 3)) ^ ((order >> 2) & 1)) & 1);
 
                     if (traverse_c0 || traverse_c1)
                     {
@@ -423,28 +712,30 @@ KERNEL void intersect_main(
                 }
             }
 
-            // Check if we have found an intersection
-            if (isect_idx != INVALID_IDX)
-            {
-                // Fetch the node & vertices
-                bvh_node const node = nodes[isect_idx];
-                float3 const v1 = vertices[node.i0];
-                float3 const v2 = vertices[node.i1];
-                float3 const v3 = vertices[node.i2];
-                // Calculate hit position
-                float3 const p = r.o.xyz + r.d.xyz * t_max;
-                // Calculte barycentric coordinates
-                float2 const uv = triangle_calculate_barycentrics(p, v1, v2, v3);
-                // Update hit information
-                hits[global_id].shape_id = node.shape_id;
-                hits[global_id].prim_id = node.prim_id;
-                hits[global_id].uvwt = make_float4(uv.x, uv.y, 0.f, t_max);
-            }
-            else
+            // Write the list, unused entries are misses
+            for (int i = 0; i < MAX_MULTI_HITS; ++i)
             {
-                // Miss here
-                hits[global_id].shape_id = MISS_MARKER;
-                hits[global_id].prim_id = MISS_MARKER;
+                if (i < k)
+                {
+                    if (hit_data[i].x != INVALID_IDX)
+                    {
+                        // Fetch the node & vertices
+                        bvh_node const node = nodes[hit_data[i].x];
+                        float3 const v1 = vertices[node.i0];
+                        float3 const v2 = vertices[node.i1];
+                        float3 const v3 = vertices[node.i2];
+                        // Calculate hit position
+                        float3 const p = r.o.xyz + r.d.xyz * hit_t[i];
+                        // Calculte barycentric coordinates
+                        float2 const uv = triangle_calculate_barycentrics(p, v1, v2, v3);
+                        // Update hit information
+                        store_hit(hits, global_id * k + i, node.shape_id, node.prim_id, uv, hit_t[i]);
+                    }
+                    else
+                    {
+                        store_miss(hits, global_id * k + i);
+                    }
+                }
             }
         }
     }
@@ -50,6 +50,10 @@ THE SOFTWARE.
             addr <- skiplink at node (follow next)
         }
 
+    With RR_OCTANT_LINKS defined the first child and the skip link are read from
+    one of 8 link arrays picked by the ray direction octant instead, so near
+    children are visited first (see PlainBvhTranslator::ProcessOctantLinks).
+
     Pros:
         -Simple and efficient kernel with low VGPR pressure.
         -Can traverse trees of arbitrary depth.
@@ -75,6 +79,22 @@ DEFINES
 #define LEAFNODE(x)     (((x).pmin.w) != -1.f)
 #define NEXT(x)     ((int)((x).pmax.w))
 
+#ifdef RR_OCTANT_LINKS
+#define OCTANT_LINKS_PARAM GLOBAL int2 const* restrict octant_links, int num_nodes,
+#define OCTANT_LINKS_ARG octant_links, num_nodes,
+// Links of the ray direction octant, (first child, skip link) per node
+#define INIT_LINKS(r) GLOBAL int2 const* restrict links = octant_links + get_ray_octant(&(r)) * num_nodes
+#define FIRST_CHILD(node, addr) (links[(addr)].x)
+#define SKIP_LINK(node, addr) (links[(addr)].y)
+#else
+#define OCTANT_LINKS_PARAM
+#define OCTANT_LINKS_ARG
+#define INIT_LINKS(r)
+// Left child is always at addr + 1
+#define FIRST_CHILD(node, addr) ((addr) + 1)
+#define SKIP_LINK(node, addr) NEXT(node)
+#endif
+
 
 
 /*************************************************************************
@@ -94,122 +114,814 @@ typedef struct
     int prim_id;
 } Face;
 
-__attribute__((reqd_work_group_size(64, 1, 1)))
-KERNEL 
-void intersect_main(
+#ifdef RR_PRECOMPUTED_TRIANGLES
+// Faces in BVH order store 3 rows of the inverse of the affine transform
+// taking the unit triangle into the face (Woop), in place of the vertices
+typedef float4 TriangleData;
+
+// Intersect the precomputed triangle, returns t_max on a miss and sets barycentrics on a hit
+INLINE float fast_intersect_precomputed_triangle(ray r, GLOBAL float4 const* restrict m, float t_max, float2* uv)
+{
+    float4 const m0 = m[0];
+    float4 const m1 = m[1];
+    float4 const m2 = m[2];
+
+    // Distance to the triangle plane
+    float const t = (m2.w - dot(r.o.xyz, m2.xyz)) / dot(r.d.xyz, m2.xyz);
+
+    if (t > 0.f && t < t_max)
+    {
+        float const u = m0.w + dot(r.o.xyz, m0.xyz) + t * dot(r.d.xyz, m0.xyz);
+
+        if (u >= 0.f && u <= 1.f)
+        {
+            float const v = m1.w + dot(r.o.xyz, m1.xyz) + t * dot(r.d.xyz, m1.xyz);
+
+            if (v >= 0.f && u + v <= 1.f)
+            {
+                *uv = make_float2(u, v);
+                return t;
+            }
+        }
+    }
+
+    return t_max;
+}
+#else
+typedef float3 TriangleData;
+
+// Sphere faces keep this in idx[1], idx[0] is the vertex holding the center and radius in w
+#define SPHERE_FACE (-1)
+
+// Intersect the sphere (center, radius), returns t_max on a miss. The far root is
+// taken if the origin is inside, so rays leaving a sphere hit it as well.
+INLINE float fast_intersect_sphere(ray r, float4 sphere, float t_max)
+{
+    float3 const oc = r.o.xyz - sphere.xyz;
+    float const a = dot(r.d.xyz, r.d.xyz);
+    float const b = dot(oc, r.d.xyz);
+    float const c = dot(oc, oc) - sphere.w * sphere.w;
+    float const disc = b * b - a * c;
+
+    if (disc < 0.f)
+    {
+        return t_max;
+    }
+
+    float const q = sqrt(disc);
+    float t = (-b - q) / a;
+    if (t <= 0.f)
+    {
+        t = (-b + q) / a;
+    }
+
+    return (t > 0.f && t < t_max) ? t : t_max;
+}
+
+// Intersect a triangle or sphere face, returns t_max on a miss
+INLINE float fast_intersect_face(ray r, GLOBAL float3 const* restrict vertices, Face face, float t_max)
+{
+    if (face.idx[1] == SPHERE_FACE)
+    {
+        return fast_intersect_sphere(r, ((GLOBAL float4 const*)vertices)[face.idx[0]], t_max);
+    }
+
+    float3 const v1 = vertices[face.idx[0]];
+    float3 const v2 = vertices[face.idx[1]];
+    float3 const v3 = vertices[face.idx[2]];
+
+    return fast_intersect_triangle(r, v1, v2, v3, t_max);
+}
+
+// Barycentrics of a triangle hit, spherical coordinates around the center over (2 pi, pi) of a sphere hit
+INLINE float2 face_calculate_uv(ray r, GLOBAL float3 const* restrict vertices, Face face, float t)
+{
+    float3 const p = r.o.xyz + r.d.xyz * t;
+
+    if (face.idx[1] == SPHERE_FACE)
+    {
+        float3 const n = normalize(p - vertices[face.idx[0]]);
+        return make_float2(atan2(n.y, n.x) * (0.5f / PI) + 0.5f, acos(clamp(n.z, -1.f, 1.f)) * (1.f / PI));
+    }
+
+    float3 const v1 = vertices[face.idx[0]];
+    float3 const v2 = vertices[face.idx[1]];
+    float3 const v3 = vertices[face.idx[2]];
+
+    return triangle_calculate_barycentrics(p, v1, v2, v3);
+}
+#endif
+
+// Write num_attributes vertex attributes of the face interpolated at the barycentrics, the scene keeps
+// num_vertex_attributes per vertex, the rest and attributes of spheres are zero
+INLINE void store_attributes(
+    GLOBAL float4 const* restrict vertex_attributes,
+    int num_vertex_attributes,
+    Face face,
+    float2 uv,
+    GLOBAL float4* attributes,
+    int num_attributes
+)
+{
+#ifdef RR_PRECOMPUTED_TRIANGLES
+    bool const interpolate = true;
+#else
+    bool const interpolate = face.idx[1] != SPHERE_FACE;
+#endif
+
+    for (int i = 0; i < num_attributes; ++i)
+    {
+        float4 value = make_float4(0.f, 0.f, 0.f, 0.f);
+
+        if (interpolate && i < num_vertex_attributes)
+        {
+            float4 const a0 = vertex_attributes[face.idx[0] * num_vertex_attributes + i];
+            float4 const a1 = vertex_attributes[face.idx[1] * num_vertex_attributes + i];
+            float4 const a2 = vertex_attributes[face.idx[2] * num_vertex_attributes + i];
+            value = a0 * (1.f - uv.x - uv.y) + a1 * uv.x + a2 * uv.y;
+        }
+
+        attributes[i] = value;
+    }
+}
+
+#ifdef RR_OCTANT_LINKS
+// Octant of the ray direction, bit i is set for negative direction along axis i
+INLINE int get_ray_octant(ray const* r)
+{
+    return (r->d.x < 0.f ? 1 : 0) | (r->d.y < 0.f ? 2 : 0) | (r->d.z < 0.f ? 4 : 0);
+}
+#endif
+
+// Find the closest intersection for a single ray
+INLINE void intersect_ray(
     // BVH nodes
     GLOBAL bvh_node const* restrict nodes,
     // Triangle vertices
-    GLOBAL float3 const* restrict vertices,
+    GLOBAL TriangleData const* restrict vertices,
     // Triangle indices
     GLOBAL Face const* restrict faces,
+    // Child order and skip links per direction octant
+    OCTANT_LINKS_PARAM
     // Rays 
-    GLOBAL ray const* restrict rays,
-    // Number of rays
-    GLOBAL int const* restrict num_rays,
+    GLOBAL RayRecord const* restrict rays,
     // Hit data
-    GLOBAL Intersection* hits
+    GLOBAL HitRecord* hits,
+    // Vertex attributes and their number per vertex, attribute queries only
+    GLOBAL float4 const* restrict vertex_attributes,
+    int num_vertex_attributes,
+    // Interpolated attributes and their number per ray, 0 skips the interpolation
+    GLOBAL float4* attributes,
+    int num_attributes,
+    // Index of the ray
+    int ray_idx
+    // Per-ray counters
+    TRAVERSAL_STATS_PARAM
 )
 {
-    int global_id = get_global_id(0);
+    // Fetch ray
+    ray const r = load_ray(rays, ray_idx);
+    INIT_STATS();
 
-    if (global_id < *num_rays)
+    if (ray_is_active(&r))
     {
-        // Fetch ray
-        ray const r = rays[global_id];
+        // Precompute inverse direction and origin / dir for bbox testing
+        float3 const invdir = safe_invdir(r);
+        float3 const oxinvdir = -r.o.xyz * invdir;
+        // Intersection parametric distance
+        float t_max = r.o.w;
 
-        if (ray_is_active(&r))
+        // Current node address
+        int addr = 0;
+        INIT_LINKS(r);
+        // Current closest face index
+        int isect_idx = INVALID_IDX;
+#ifdef RR_PRECOMPUTED_TRIANGLES
+        // Barycentrics of the closest hit
+        float2 isect_uv = make_float2(0.f, 0.f);
+#endif
+
+        while (addr != INVALID_IDX)
         {
-            // Precompute inverse direction and origin / dir for bbox testing
-            float3 const invdir = safe_invdir(r);
-            float3 const oxinvdir = -r.o.xyz * invdir;
-            // Intersection parametric distance
-            float t_max = r.o.w;
-
-            // Current node address
-            int addr = 0;
-            // Current closest face index
-            int isect_idx = INVALID_IDX;
-
-            while (addr != INVALID_IDX)
-            {
-                // Fetch next node
-                bvh_node node = nodes[addr];
-                // Intersect against bbox
-                float2 s = fast_intersect_bbox1(node, invdir, oxinvdir, t_max);
+            // Fetch next node
+            bvh_node node = nodes[addr];
+            // Intersect against bbox
+            float2 s = fast_intersect_bbox1(node, invdir, oxinvdir, t_max);
+            COUNT_STAT(iterations, 1);
+            COUNT_STAT(nodes, 1);
 
-                if (s.x <= s.y)
+            if (s.x <= s.y)
+            {
+                // Check if the node is a leaf
+                if (LEAFNODE(node))
                 {
-                    // Check if the node is a leaf
-                    if (LEAFNODE(node))
+                    // Leaf faces are stored contiguously
+                    int const start_idx = STARTIDX(node);
+                    int const end_idx = start_idx + NUMPRIMS(node);
+                    COUNT_STAT(primitives, end_idx - start_idx);
+
+                    for (int face_idx = start_idx; face_idx < end_idx; ++face_idx)
                     {
-                        int const face_idx = STARTIDX(node);
-                        Face const face = faces[face_idx];
-                        float3 const v1 = vertices[face.idx[0]];
-                        float3 const v2 = vertices[face.idx[1]];
-                        float3 const v3 = vertices[face.idx[2]];
-
-                        // Intersect triangle
-                        float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
+#ifdef RR_PRECOMPUTED_TRIANGLES
+                        // Single contiguous load, barycentrics come with the test
+                        float2 uv;
+                        float const f = fast_intersect_precomputed_triangle(r, vertices + 3 * face_idx, t_max, &uv);
                         // If hit update closest hit distance and index
                         if (f < t_max)
                         {
                             t_max = f;
                             isect_idx = face_idx;
+                            isect_uv = uv;
                         }
+#else
+                        // Intersect triangle or sphere
+                        float const f = fast_intersect_face(r, vertices, faces[face_idx], t_max);
+                        // If hit update closest hit distance and index
+                        if (f < t_max)
+                        {
+                            t_max = f;
+                            isect_idx = face_idx;
+                        }
+#endif
                     }
-                    else
+                }
+                else
+                {
+                    // Move to the first child otherwise
+                    addr = FIRST_CHILD(node, addr);
+                    continue;
+                }
+            }
+
+            addr = SKIP_LINK(node, addr);
+        }
+
+        // Check if we have found an intersection
+        if (isect_idx != INVALID_IDX)
+        {
+            // Fetch the node & vertices
+            Face const face = faces[isect_idx];
+#ifdef RR_PRECOMPUTED_TRIANGLES
+            float2 const uv = isect_uv;
+#else
+            // Calculte barycentric or spherical coordinates
+            float2 const uv = face_calculate_uv(r, vertices, face, t_max);
+#endif
+            // Update hit information
+            store_hit(hits, ray_idx, face.shape_id, face.prim_id, uv, t_max);
+
+            // Vertices of the face have just been read, so are likely in cache
+            if (num_attributes > 0)
+            {
+                store_attributes(vertex_attributes, num_vertex_attributes, face, uv, attributes + ray_idx * num_attributes, num_attributes);
+            }
+        }
+        else
+        {
+            // Miss here
+            store_miss(hits, ray_idx);
+
+            for (int i = 0; i < num_attributes; ++i)
+            {
+                attributes[ray_idx * num_attributes + i] = make_float4(0.f, 0.f, 0.f, 0.f);
+            }
+        }
+    }
+
+    STORE_STATS(ray_idx);
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void intersect_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices
+    GLOBAL TriangleData const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Child order and skip links per direction octant
+    OCTANT_LINKS_PARAM
+    // Rays 
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Hit data
+    GLOBAL HitRecord* hits
+    // Per-ray counters
+    TRAVERSAL_STATS_PARAM
+)
+{
+    int global_id = get_global_id(0);
+
+    // Handle only working subset
+    if (global_id < *num_rays)
+    {
+        intersect_ray(nodes, vertices, faces, OCTANT_LINKS_ARG rays, hits, 0, 0, 0, 0, global_id TRAVERSAL_STATS_ARG);
+    }
+}
+
+// Closest hits with the vertex attributes of the hit faces interpolated in the same pass,
+// so shading doesn't gather the vertices again
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void intersect_attributes_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices
+    GLOBAL TriangleData const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Child order and skip links per direction octant
+    OCTANT_LINKS_PARAM
+    // Rays 
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Hit data
+    GLOBAL HitRecord* hits,
+    // Vertex attributes, num_vertex_attributes per vertex in the order of the vertices
+    GLOBAL float4 const* restrict vertex_attributes,
+    int num_vertex_attributes,
+    // Interpolated attributes, num_attributes per ray
+    GLOBAL float4* attributes,
+    int num_attributes
+    // Per-ray counters
+    TRAVERSAL_STATS_PARAM
+)
+{
+    int global_id = get_global_id(0);
+
+    // Handle only working subset
+    if (global_id < *num_rays)
+    {
+        intersect_ray(nodes, vertices, faces, OCTANT_LINKS_ARG rays, hits, vertex_attributes, num_vertex_attributes,
+            attributes, num_attributes, global_id TRAVERSAL_STATS_ARG);
+    }
+}
+
+// Persistent threads variant: work-groups keep fetching batches of rays until none are left
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void intersect_persistent_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices
+    GLOBAL TriangleData const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Child order and skip links per direction octant
+    OCTANT_LINKS_PARAM
+    // Rays 
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Number of rays fetched so far, zero on launch
+    GLOBAL int* ray_counter,
+    // Hit data
+    GLOBAL HitRecord* hits
+    // Per-ray counters
+    TRAVERSAL_STATS_PARAM
+)
+{
+    __local int batch_start;
+    int const count = *num_rays;
+
+    for (;;)
+    {
+        int const start = fetch_wave_ray_batch(ray_counter, &batch_start);
+
+        if (start >= count)
+            break;
+
+        int const ray_idx = start + wave_ray_local_id();
+
+        if (ray_idx < count)
+        {
+            intersect_ray(nodes, vertices, faces, OCTANT_LINKS_ARG rays, hits, 0, 0, 0, 0, ray_idx TRAVERSAL_STATS_ARG);
+        }
+    }
+}
+
+#ifndef RR_OCTANT_LINKS
+// Packet variant for coherent rays, e.g. camera rays of an 8x8 pixel tile. Skip link order doesn't
+// depend on the ray, so the work-group walks the tree together: a node is fetched once into local
+// memory, every ray tests it and the packet descends if any of them hits it. Rays only test leaves
+// they hit themselves, so the hits are the same as of intersect_main.
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void intersect_packet_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices
+    GLOBAL TriangleData const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Hit data
+    GLOBAL HitRecord* hits
+)
+{
+    // Double buffered, so a node is written while the previous vote is still being read
+    __local bvh_node packet_node[2];
+    __local int packet_hit[2];
+
+    int const global_id = get_global_id(0);
+    int const local_id = get_local_id(0);
+
+    // Every work item takes part in the loop to reach the barriers, rays out of range are inactive
+    ray r;
+    bool active = global_id < *num_rays;
+    if (active)
+    {
+        r = load_ray(rays, global_id);
+        active = ray_is_active(&r);
+    }
+
+    float3 const invdir = active ? safe_invdir(r) : make_float3(0.f, 0.f, 0.f);
+    float3 const oxinvdir = active ? -r.o.xyz * invdir : make_float3(0.f, 0.f, 0.f);
+    float t_max = active ? r.o.w : 0.f;
+    int isect_idx = INVALID_IDX;
+#ifdef RR_PRECOMPUTED_TRIANGLES
+    float2 isect_uv = make_float2(0.f, 0.f);
+#endif
+
+    // Address and buffer are uniform across the work-group
+    int addr = 0;
+    int slot = 0;
+
+    while (addr != INVALID_IDX)
+    {
+        if (local_id == 0)
+        {
+            packet_node[slot] = nodes[addr];
+            packet_hit[slot] = 0;
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        bvh_node const node = packet_node[slot];
+        bool hit = false;
+
+        if (active)
+        {
+            float2 const s = fast_intersect_bbox1(node, invdir, oxinvdir, t_max);
+            hit = s.x <= s.y;
+
+            if (hit)
+            {
+                packet_hit[slot] = 1;
+            }
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        if (packet_hit[slot] == 0)
+        {
+            // No ray of the packet hits the node
+            addr = NEXT(node);
+        }
+        else if (LEAFNODE(node))
+        {
+            if (hit)
+            {
+                int const start_idx = STARTIDX(node);
+                int const end_idx = start_idx + NUMPRIMS(node);
+
+                for (int face_idx = start_idx; face_idx < end_idx; ++face_idx)
+                {
+#ifdef RR_PRECOMPUTED_TRIANGLES
+                    float2 uv;
+                    float const f = fast_intersect_precomputed_triangle(r, vertices + 3 * face_idx, t_max, &uv);
+                    if (f < t_max)
+                    {
+                        t_max = f;
+                        isect_idx = face_idx;
+                        isect_uv = uv;
+                    }
+#else
+                    float const f = fast_intersect_face(r, vertices, faces[face_idx], t_max);
+                    if (f < t_max)
                     {
-                        // Move to next node otherwise.
-                        // Left child is always at addr + 1
-                        ++addr;
-                        continue;
+                        t_max = f;
+                        isect_idx = face_idx;
                     }
+#endif
                 }
-
-                addr = NEXT(node);
             }
 
-            // Check if we have found an intersection
-            if (isect_idx != INVALID_IDX)
+            addr = NEXT(node);
+        }
+        else
+        {
+            // Left child is always at addr + 1
+            addr = addr + 1;
+        }
+
+        slot ^= 1;
+    }
+
+    if (active)
+    {
+        if (isect_idx != INVALID_IDX)
+        {
+            Face const face = faces[isect_idx];
+#ifdef RR_PRECOMPUTED_TRIANGLES
+            float2 const uv = isect_uv;
+#else
+            float2 const uv = face_calculate_uv(r, vertices, face, t_max);
+#endif
+            store_hit(hits, global_id, face.shape_id, face.prim_id, uv, t_max);
+        }
+        else
+        {
+            store_miss(hits, global_id);
+        }
+    }
+}
+#endif
+
+// Intersect the face at face_idx of the BVH order, returns t_max on a miss
+INLINE float occlude_face(
+    ray const r,
+    GLOBAL TriangleData const* restrict vertices,
+    GLOBAL Face const* restrict faces,
+    int face_idx,
+    float t_max
+)
+{
+#ifdef RR_PRECOMPUTED_TRIANGLES
+    float2 uv;
+    return fast_intersect_precomputed_triangle(r, vertices + 3 * face_idx, t_max, &uv);
+#else
+    // Intersect triangle or sphere
+    return fast_intersect_face(r, vertices, faces[face_idx], t_max);
+#endif
+}
+
+// Find any intersection for a single active ray, returns the index of the occluding face or INVALID_IDX
+INLINE int find_occluder(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices
+    GLOBAL TriangleData const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Child order and skip links per direction octant
+    OCTANT_LINKS_PARAM
+    // Ray
+    ray const r
+)
+{
+    // Precompute inverse direction and origin / dir for bbox testing
+    float3 const invdir = safe_invdir(r);
+    float3 const oxinvdir = -r.o.xyz * invdir;
+    // Intersection parametric distance
+    float t_max = r.o.w;
+
+    // Current node address
+    int addr = 0;
+    INIT_LINKS(r);
+
+    while (addr != INVALID_IDX)
+    {
+        // Fetch next node
+        bvh_node node = nodes[addr];
+        // Intersect against bbox
+        float2 s = fast_intersect_bbox1(node, invdir, oxinvdir, t_max);
+
+        if (s.x <= s.y)
+        {
+            // Check if the node is a leaf
+            if (LEAFNODE(node))
             {
-                // Fetch the node & vertices
-                Face const face = faces[isect_idx];
-                float3 const v1 = vertices[face.idx[0]];
-                float3 const v2 = vertices[face.idx[1]];
-                float3 const v3 = vertices[face.idx[2]];
-                // Calculate hit position
-                float3 const p = r.o.xyz + r.d.xyz * t_max;
-                // Calculte barycentric coordinates
-                float2 const uv = triangle_calculate_barycentrics(p, v1, v2, v3);
-                // Update hit information
-                hits[global_id].shape_id = face.shape_id;
-                hits[global_id].prim_id = face.prim_id;
-                hits[global_id].uvwt = make_float4(uv.x, uv.y, 0.f, t_max);
+                int const start_idx = STARTIDX(node);
+                int const end_idx = start_idx + NUMPRIMS(node);
+
+                for (int face_idx = start_idx; face_idx < end_idx; ++face_idx)
+                {
+                    // If hit bail out
+                    if (occlude_face(r, vertices, faces, face_idx, t_max) < t_max)
+                    {
+                        return face_idx;
+                    }
+                }
             }
             else
             {
-                // Miss here
-                hits[global_id].shape_id = MISS_MARKER;
-                hits[global_id].prim_id = MISS_MARKER;
+                // Move to the first child otherwise
+                addr = FIRST_CHILD(node, addr);
+                continue;
+            }
+        }
+
+        addr = SKIP_LINK(node, addr);
+    }
+
+    // Finished traversal, but no intersection found
+    return INVALID_IDX;
+}
+
+// Find any intersection for a single active ray, returns true if the ray is occluded
+INLINE bool occlude_ray(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices
+    GLOBAL TriangleData const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Child order and skip links per direction octant
+    OCTANT_LINKS_PARAM
+    // Ray
+    ray const r
+)
+{
+    return find_occluder(nodes, vertices, faces, OCTANT_LINKS_ARG r) != INVALID_IDX;
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void occluded_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices
+    GLOBAL TriangleData const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Child order and skip links per direction octant
+    OCTANT_LINKS_PARAM
+    // Rays 
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Hit data
+    GLOBAL int* hits
+)
+{
+    int global_id = get_global_id(0);
+
+    // Handle only working subset
+    if (global_id < *num_rays)
+    {
+        ray const r = load_ray(rays, global_id);
+
+        if (ray_is_active(&r))
+        {
+            hits[global_id] = occlude_ray(nodes, vertices, faces, OCTANT_LINKS_ARG r) ? HIT_MARKER : MISS_MARKER;
+        }
+    }
+}
+
+// Compact variant: results are stored as 1 bit per ray
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void occluded_compact_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices
+    GLOBAL TriangleData const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Child order and skip links per direction octant
+    OCTANT_LINKS_PARAM
+    // Rays 
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Hit bits
+    GLOBAL uint* hits
+)
+{
+    __local uint words[64 / 32];
+    int global_id = get_global_id(0);
+    int const count = *num_rays;
+    bool occluded = false;
+
+    // Handle only working subset
+    if (global_id < count)
+    {
+        ray const r = load_ray(rays, global_id);
+
+        if (ray_is_active(&r))
+        {
+            occluded = occlude_ray(nodes, vertices, faces, OCTANT_LINKS_ARG r);
+        }
+    }
+
+    store_occlusion_bits(hits, words, get_group_id(0) * get_local_size(0), count, occluded);
+}
+
+// Persistent threads variant: work-groups keep fetching batches of rays until none are left
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void occluded_persistent_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices
+    GLOBAL TriangleData const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Child order and skip links per direction octant
+    OCTANT_LINKS_PARAM
+    // Rays 
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Number of rays fetched so far, zero on launch
+    GLOBAL int* ray_counter,
+    // Hit data
+    GLOBAL int* hits
+)
+{
+    __local int batch_start;
+    int const count = *num_rays;
+
+    for (;;)
+    {
+        int const start = fetch_wave_ray_batch(ray_counter, &batch_start);
+
+        if (start >= count)
+            break;
+
+        int const ray_idx = start + wave_ray_local_id();
+
+        if (ray_idx < count)
+        {
+            ray const r = load_ray(rays, ray_idx);
+
+            if (ray_is_active(&r))
+            {
+                hits[ray_idx] = occlude_ray(nodes, vertices, faces, OCTANT_LINKS_ARG r) ? HIT_MARKER : MISS_MARKER;
+            }
+        }
+    }
+}
+
+// Persistent threads variant storing results as 1 bit per ray
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void occluded_persistent_compact_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices
+    GLOBAL TriangleData const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Child order and skip links per direction octant
+    OCTANT_LINKS_PARAM
+    // Rays 
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Number of rays fetched so far, zero on launch
+    GLOBAL int* ray_counter,
+    // Hit bits
+    GLOBAL uint* hits
+)
+{
+    __local int batch_start;
+    __local uint words[64 / 32];
+    int const count = *num_rays;
+
+    for (;;)
+    {
+        int const start = fetch_ray_batch(ray_counter, &batch_start);
+
+        if (start >= count)
+            break;
+
+        int const ray_idx = start + get_local_id(0);
+        bool occluded = false;
+
+        if (ray_idx < count)
+        {
+            ray const r = load_ray(rays, ray_idx);
+
+            if (ray_is_active(&r))
+            {
+                occluded = occlude_ray(nodes, vertices, faces, OCTANT_LINKS_ARG r);
             }
         }
+
+        store_occlusion_bits(hits, words, start, count, occluded);
     }
 }
 
+// Test the last occluder of the ray before traversal, the traversal is skipped if it still
+// blocks the ray, otherwise the occluder found by the traversal is stored for the next query
 __attribute__((reqd_work_group_size(64, 1, 1)))
-KERNEL 
-void occluded_main(
+KERNEL void occluded_cached_main(
     // BVH nodes
     GLOBAL bvh_node const* restrict nodes,
     // Triangle vertices
-    GLOBAL float3 const* restrict vertices,
+    GLOBAL TriangleData const* restrict vertices,
     // Triangle indices
     GLOBAL Face const* restrict faces,
+    // Child order and skip links per direction octant
+    OCTANT_LINKS_PARAM
     // Rays 
-    GLOBAL ray const* restrict rays,
+    GLOBAL RayRecord const* restrict rays,
     // Number of rays
     GLOBAL int const* restrict num_rays,
+    // Number of faces, occluders past it are stale
+    int num_faces,
+    // Last occluder per ray, INVALID_IDX if there is none
+    GLOBAL int* occluders,
     // Hit data
     GLOBAL int* hits
 )
@@ -219,61 +931,424 @@ void occluded_main(
     // Handle only working subset
     if (global_id < *num_rays)
     {
-        // Fetch ray
-        ray const r = rays[global_id];
+        ray const r = load_ray(rays, global_id);
 
         if (ray_is_active(&r))
         {
-            // Precompute inverse direction and origin / dir for bbox testing
-            float3 const invdir = safe_invdir(r);
-            float3 const oxinvdir = -r.o.xyz * invdir;
-            // Intersection parametric distance
-            float t_max = r.o.w;
+            int occluder = occluders[global_id];
+
+            // Occluders of a previous build might be out of range, an in range one is just another face
+            if (occluder < 0 || occluder >= num_faces || occlude_face(r, vertices, faces, occluder, r.o.w) >= r.o.w)
+            {
+                occluder = find_occluder(nodes, vertices, faces, OCTANT_LINKS_ARG r);
+                occluders[global_id] = occluder;
+            }
+
+            hits[global_id] = occluder != INVALID_IDX ? HIT_MARKER : MISS_MARKER;
+        }
+    }
+}
+
+// Separating axis test of the triangle against the box of center c and half extents h
+INLINE bool triangle_overlaps_box(float3 v0, float3 v1, float3 v2, float3 c, float3 h)
+{
+    v0 -= c;
+    v1 -= c;
+    v2 -= c;
+
+    // Box face normals
+    if (any(fmin(fmin(v0, v1), v2) > h) || any(fmax(fmax(v0, v1), v2) < -h))
+    {
+        return false;
+    }
 
-            // Current node address
-            int addr = 0;
+    // Triangle normal
+    float3 const e0 = v1 - v0;
+    float3 const e1 = v2 - v1;
+    float3 const e2 = v0 - v2;
+    float3 const n = cross(e0, e1);
+
+    if (fabs(dot(n, v0)) > dot(h, fabs(n)))
+    {
+        return false;
+    }
+
+    // Cross products of the edges with the box axes
+    float3 const edges[3] = { e0, e1, e2 };
+    for (int i = 0; i < 3; ++i)
+    {
+        float3 const e = edges[i];
+        float3 const axes[3] = {
+            (float3)(0.f, -e.z, e.y),
+            (float3)(e.z, 0.f, -e.x),
+            (float3)(-e.y, e.x, 0.f)
+        };
+
+        for (int j = 0; j < 3; ++j)
+        {
+            float3 const a = axes[j];
+            float const p0 = dot(a, v0);
+            float const p1 = dot(a, v1);
+            float const p2 = dot(a, v2);
+            float const r = dot(h, fabs(a));
 
-            while (addr != INVALID_IDX)
+            if (fmin(fmin(p0, p1), p2) > r || fmax(fmax(p0, p1), p2) < -r)
             {
-                // Fetch next node
-                bvh_node node = nodes[addr];
-                // Intersect against bbox
-                float2 s = fast_intersect_bbox1(node, invdir, oxinvdir, t_max);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Check if the face at face_idx of the BVH order overlaps the box
+INLINE bool face_overlaps_box(
+    GLOBAL TriangleData const* restrict vertices,
+    GLOBAL Face const* restrict faces,
+    int face_idx,
+    bbox const box
+)
+{
+#ifdef RR_PRECOMPUTED_TRIANGLES
+    // Vertices are not kept, the leaf holding the face has already been tested
+    return true;
+#else
+    Face const face = faces[face_idx];
+
+    if (face.idx[1] == SPHERE_FACE)
+    {
+        // Distance from the center to the closest point of the box
+        float4 const sphere = ((GLOBAL float4 const*)vertices)[face.idx[0]];
+        float3 const d = sphere.xyz - clamp(sphere.xyz, box.pmin.xyz, box.pmax.xyz);
+        return dot(d, d) <= sphere.w * sphere.w;
+    }
+
+    float3 const c = 0.5f * (box.pmin.xyz + box.pmax.xyz);
+    float3 const h = 0.5f * (box.pmax.xyz - box.pmin.xyz);
+    return triangle_overlaps_box(vertices[face.idx[0]], vertices[face.idx[1]], vertices[face.idx[2]], c, h);
+#endif
+}
+
+// Find faces overlapping the boxes, the first max_overlaps of each box are stored
+// and the count keeps going, so the caller can tell the list has been cut
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void overlap_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices
+    GLOBAL TriangleData const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Child order and skip links per direction octant
+    OCTANT_LINKS_PARAM
+    // Boxes
+    GLOBAL bbox const* restrict boxes,
+    // Number of boxes
+    GLOBAL int const* restrict num_boxes,
+    // Number of overlap records per box
+    int max_overlaps,
+    // Overlap records, max_overlaps per box
+    GLOBAL Overlap* overlaps,
+    // Number of overlapping faces per box
+    GLOBAL int* counts
+)
+{
+    int global_id = get_global_id(0);
+
+    // Handle only working subset
+    if (global_id < *num_boxes)
+    {
+        bbox const box = boxes[global_id];
+        GLOBAL Overlap* box_overlaps = overlaps + global_id * max_overlaps;
+        int count = 0;
+
+#ifdef RR_OCTANT_LINKS
+        // Links of any octant visit every node
+        GLOBAL int2 const* restrict links = octant_links;
+#endif
+
+        // Current node address
+        int addr = 0;
+
+        while (addr != INVALID_IDX)
+        {
+            // Fetch next node
+            bvh_node node = nodes[addr];
 
-                if (s.x <= s.y)
+            // Empty boxes fail the test at the root
+            if (all(node.pmin.xyz <= box.pmax.xyz) && all(node.pmax.xyz >= box.pmin.xyz))
+            {
+                // Check if the node is a leaf
+                if (LEAFNODE(node))
                 {
-                    // Check if the node is a leaf
-                    if (LEAFNODE(node))
+                    int const start_idx = STARTIDX(node);
+                    int const end_idx = start_idx + NUMPRIMS(node);
+
+                    for (int face_idx = start_idx; face_idx < end_idx; ++face_idx)
                     {
-                        int const face_idx = STARTIDX(node);
-                        Face const face = faces[face_idx];
-                        float3 const v1 = vertices[face.idx[0]];
-                        float3 const v2 = vertices[face.idx[1]];
-                        float3 const v3 = vertices[face.idx[2]];
-
-                        // Intersect triangle
-                        float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
-                        // If hit store the result and bail out
-                        if (f < t_max)
+                        if (face_overlaps_box(vertices, faces, face_idx, box))
                         {
-                            hits[global_id] = HIT_MARKER;
-                            return;
+                            if (count < max_overlaps)
+                            {
+                                Face const face = faces[face_idx];
+                                box_overlaps[count].shape_id = face.shape_id;
+                                box_overlaps[count].prim_id = face.prim_id;
+                            }
+
+                            ++count;
                         }
                     }
-                    else
+                }
+                else
+                {
+                    // Move to the first child otherwise
+                    addr = FIRST_CHILD(node, addr);
+                    continue;
+                }
+            }
+
+            addr = SKIP_LINK(node, addr);
+        }
+
+        counts[global_id] = count;
+    }
+}
+
+// Closest point of the triangle to p, barycentrics of the point are written
+// to uv the same way as for hits, so the weights of v1 and v2
+INLINE float3 closest_point_on_triangle(float3 const p, float3 const v0, float3 const v1, float3 const v2, float2* uv)
+{
+    float3 const e1 = v1 - v0;
+    float3 const e2 = v2 - v0;
+
+    // Vertex region of v0
+    float3 const p0 = p - v0;
+    float const d1 = dot(e1, p0);
+    float const d2 = dot(e2, p0);
+    if (d1 <= 0.f && d2 <= 0.f)
+    {
+        *uv = make_float2(0.f, 0.f);
+        return v0;
+    }
+
+    // Vertex region of v1
+    float3 const p1 = p - v1;
+    float const d3 = dot(e1, p1);
+    float const d4 = dot(e2, p1);
+    if (d3 >= 0.f && d4 <= d3)
+    {
+        *uv = make_float2(1.f, 0.f);
+        return v1;
+    }
+
+    // Edge region of v0 v1
+    float const vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.f && d1 >= 0.f && d3 <= 0.f)
+    {
+        float const u = d1 / (d1 - d3);
+        *uv = make_float2(u, 0.f);
+        return v0 + u * e1;
+    }
+
+    // Vertex region of v2
+    float3 const p2 = p - v2;
+    float const d5 = dot(e1, p2);
+    float const d6 = dot(e2, p2);
+    if (d6 >= 0.f && d5 <= d6)
+    {
+        *uv = make_float2(0.f, 1.f);
+        return v2;
+    }
+
+    // Edge region of v0 v2
+    float const vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.f && d2 >= 0.f && d6 <= 0.f)
+    {
+        float const v = d2 / (d2 - d6);
+        *uv = make_float2(0.f, v);
+        return v0 + v * e2;
+    }
+
+    // Edge region of v1 v2
+    float const va = d3 * d6 - d5 * d4;
+    if (va <= 0.f && d4 - d3 >= 0.f && d5 - d6 >= 0.f)
+    {
+        float const v = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+        *uv = make_float2(1.f - v, v);
+        return v1 + v * (v2 - v1);
+    }
+
+    // Inside the face
+    float const denom = 1.f / (va + vb + vc);
+    float const u = vb * denom;
+    float const v = vc * denom;
+    *uv = make_float2(u, v);
+    return v0 + u * e1 + v * e2;
+}
+
+// Find the closest point of the face at face_idx of the BVH order to p,
+// returns false for faces without one (degenerate precomputed triangles)
+INLINE bool closest_point_on_face(
+    GLOBAL TriangleData const* restrict vertices,
+    GLOBAL Face const* restrict faces,
+    int face_idx,
+    float3 const p,
+    float3* q,
+    float2* uv
+)
+{
+#ifdef RR_PRECOMPUTED_TRIANGLES
+    // The rows are the inverse of the matrix with the edges and the scaled normal
+    // as its columns, so the vertices are recovered by inverting them back
+    GLOBAL float4 const* m = vertices + 3 * face_idx;
+    float4 const m0 = m[0];
+    float4 const m1 = m[1];
+    float4 const m2 = m[2];
+
+    float3 const c0 = cross(m1.xyz, m2.xyz);
+    float const det = dot(m0.xyz, c0);
+
+    // Degenerate faces keep zero rows
+    if (det == 0.f)
+    {
+        return false;
+    }
+
+    float const invdet = 1.f / det;
+    float3 const e1 = c0 * invdet;
+    float3 const e2 = cross(m2.xyz, m0.xyz) * invdet;
+    float3 const n = cross(m0.xyz, m1.xyz) * invdet;
+    float3 const v0 = n * m2.w - e1 * m0.w - e2 * m1.w;
+
+    *q = closest_point_on_triangle(p, v0, v0 + e1, v0 + e2, uv);
+    return true;
+#else
+    Face const face = faces[face_idx];
+
+    if (face.idx[1] == SPHERE_FACE)
+    {
+        // Project the point onto the sphere, the center projects anywhere
+        float4 const sphere = ((GLOBAL float4 const*)vertices)[face.idx[0]];
+        float3 const d = p - sphere.xyz;
+        float const len = length(d);
+        *q = sphere.xyz + (len > 0.f ? d * (sphere.w / len) : (float3)(sphere.w, 0.f, 0.f));
+        *uv = make_float2(0.f, 0.f);
+        return true;
+    }
+
+    *q = closest_point_on_triangle(p, vertices[face.idx[0]], vertices[face.idx[1]], vertices[face.idx[2]], uv);
+    return true;
+#endif
+}
+
+// Find the closest surface points within max_dist, nodes farther
+// than the closest point found so far are skipped
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void closest_point_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices
+    GLOBAL TriangleData const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Child order and skip links per direction octant
+    OCTANT_LINKS_PARAM
+    // Points
+    GLOBAL float4 const* restrict points,
+    // Number of points
+    GLOBAL int const* restrict num_points,
+    // Distance to search the surface within
+    float max_dist,
+    // Closest points
+    GLOBAL ClosestPoint* results
+)
+{
+    int global_id = get_global_id(0);
+
+    // Handle only working subset
+    if (global_id < *num_points)
+    {
+        float3 const p = points[global_id].xyz;
+
+        // Squared distance to the closest point so far
+        float d2_max = max_dist * max_dist;
+        int closest_idx = INVALID_IDX;
+        float3 closest_p = p;
+        float2 closest_uv = make_float2(0.f, 0.f);
+
+#ifdef RR_OCTANT_LINKS
+        // Links of any octant visit every node
+        GLOBAL int2 const* restrict links = octant_links;
+#endif
+
+        // Current node address
+        int addr = 0;
+
+        while (addr != INVALID_IDX)
+        {
+            // Fetch next node
+            bvh_node node = nodes[addr];
+
+            // Distance to the box, zero inside
+            float3 const d = p - clamp(p, node.pmin.xyz, node.pmax.xyz);
+
+            if (dot(d, d) <= d2_max)
+            {
+                // Check if the node is a leaf
+                if (LEAFNODE(node))
+                {
+                    int const start_idx = STARTIDX(node);
+                    int const end_idx = start_idx + NUMPRIMS(node);
+
+                    for (int face_idx = start_idx; face_idx < end_idx; ++face_idx)
                     {
-                        // Move to next node otherwise.
-                        // Left child is always at addr + 1
-                        ++addr;
-                        continue;
+                        float3 q;
+                        float2 uv;
+                        if (closest_point_on_face(vertices, faces, face_idx, p, &q, &uv))
+                        {
+                            float3 const e = q - p;
+                            float const d2 = dot(e, e);
+
+                            if (d2 <= d2_max)
+                            {
+                                d2_max = d2;
+                                closest_idx = face_idx;
+                                closest_p = q;
+                                closest_uv = uv;
+                            }
+                        }
                     }
                 }
-
-                addr = NEXT(node);
+                else
+                {
+                    // Move to the first child otherwise
+                    addr = FIRST_CHILD(node, addr);
+                    continue;
+                }
             }
 
-            // Finished traversal, but no intersection found
-            hits[global_id] = MISS_MARKER;
+            addr = SKIP_LINK(node, addr);
         }
+
+        ClosestPoint result;
+        result.padding = make_int2(0, 0);
+        result.p = make_float4(closest_p.x, closest_p.y, closest_p.z, 0.f);
+
+        if (closest_idx != INVALID_IDX)
+        {
+            Face const face = faces[closest_idx];
+            result.shape_id = face.shape_id;
+            result.prim_id = face.prim_id;
+            result.uvwt = make_float4(closest_uv.x, closest_uv.y, 0.f, sqrt(d2_max));
+        }
+        else
+        {
+            result.shape_id = MISS_MARKER;
+            result.prim_id = MISS_MARKER;
+            result.uvwt = make_float4(0.f, 0.f, 0.f, max_dist);
+        }
+
+        results[global_id] = result;
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,607 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file intersect_bvh2level_short_stack.cl
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Intersector implementation based on 2-level BVH with short stack traversal.
+
+    Both levels use the fat node layout and the split LDS / global memory stack of
+    intersect_bvh2_short_stack.cl. Top level leafs reference shapes keeping the world
+    to object transform and the root of the bottom level BVH of their mesh.
+
+    Entering a shape transforms the ray into object space and pushes TRANSITION_IDX,
+    so the stack holds top level entries below it and bottom level entries above it.
+    Popping TRANSITION_IDX restores the world space ray and traversal continues with
+    the next top level entry:
+
+        addr <- pop from stack
+        if (addr is TRANSITION_IDX)
+        {
+            ray <- world space ray
+            addr <- pop from stack
+        }
+
+    Transforms are affine and ray directions are not normalized, so hit distances are
+    the same in both spaces and t_max carries over between levels.
+ */
+
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+
+/*************************************************************************
+TYPE DEFINITIONS
+**************************************************************************/
+
+#define LEAFNODE(x) (((x).child0) == -1)
+// Traversal order of internal node: split axis and swap flag
+#define ORDER(x) ((int)((x).bounds[1].pmin.w))
+#ifdef RR_RAY_MASK
+// Leafs keep their shape mask, internal nodes the union of shape masks below them
+#define NODE_MASK(x) (LEAFNODE(x) ? (x).shape_mask : as_int((x).bounds[1].pmax.w))
+#define NODE_VISIBLE(x, r) ((NODE_MASK(x) & ray_get_mask(&(r))) != 0)
+#else
+#define NODE_VISIBLE(x, r) true
+#endif
+// Stack entry separating bottom level entries above it from top level ones below
+#define TRANSITION_IDX -2
+// Stack sizes and work group size are passed as build options by the host
+// depending on the device, defaults match GCN
+#ifndef GLOBAL_STACK_SIZE
+#define GLOBAL_STACK_SIZE 48
+#endif
+#ifndef SHORT_STACK_SIZE
+#define SHORT_STACK_SIZE 16
+#endif
+#ifndef WAVEFRONT_SIZE
+#define WAVEFRONT_SIZE 64
+#endif
+
+// BVH node
+typedef struct
+{
+    union
+    {
+        struct
+        {
+            // Child bounds
+            bbox bounds[2];
+        };
+
+        struct
+        {
+            // Top level leafs keep shape index in i0, bottom level ones vertex indices
+            int i0, i1, i2;
+            // Address of a left child
+            int child0;
+            // Shape mask
+            int shape_mask;
+            // Shape ID
+            int shape_id;
+            // Primitive ID
+            int prim_id;
+            // Address of a right child
+            int child1;
+        };
+    };
+
+} bvh_node;
+
+// Shape referenced by a top level leaf
+typedef struct
+{
+    // World to object transform
+    float4 m0;
+    float4 m1;
+    float4 m2;
+    float4 m3;
+    // Address of the bottom level root
+    int bvh_idx;
+    int padding[3];
+} Shape;
+
+
+/*************************************************************************
+FUNCTIONS
+**************************************************************************/
+
+// Transform a world space ray into the object space of a shape
+INLINE ray shape_local_ray(ray r, GLOBAL Shape const* restrict shape)
+{
+    float3 const o = r.o.xyz;
+    float3 const d = r.d.xyz;
+    r.o.xyz = make_float3(dot(shape->m0.xyz, o) + shape->m0.w, dot(shape->m1.xyz, o) + shape->m1.w, dot(shape->m2.xyz, o) + shape->m2.w);
+    r.d.xyz = make_float3(dot(shape->m0.xyz, d), dot(shape->m1.xyz, d), dot(shape->m2.xyz, d));
+    return r;
+}
+
+// Direction signs, bit per axis is set for negative direction
+INLINE int ray_dirsign(ray const r)
+{
+    return (r.d.x < 0.f ? 1 : 0) | (r.d.y < 0.f ? 2 : 0) | (r.d.z < 0.f ? 4 : 0);
+}
+
+// Push an entry, the short stack is offloaded into global memory if it is full.
+// Returns true if the short stack has been offloaded.
+INLINE bool push_entry(int addr, __local int* lm_stack_base, __local int** lm_stack, GLOBAL int** gm_stack)
+{
+    bool const spill = *lm_stack - lm_stack_base >= SHORT_STACK_SIZE * WAVEFRONT_SIZE;
+
+    if (spill)
+    {
+        for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+        {
+            (*gm_stack)[i] = lm_stack_base[i * WAVEFRONT_SIZE];
+        }
+
+        *gm_stack += SHORT_STACK_SIZE;
+        *lm_stack = lm_stack_base + WAVEFRONT_SIZE;
+    }
+
+    **lm_stack = addr;
+    *lm_stack += WAVEFRONT_SIZE;
+    return spill;
+}
+
+// Pop an entry, the short stack is reloaded from global memory if it is empty.
+// Returns INVALID_IDX once both parts are empty.
+INLINE int pop_entry(__local int* lm_stack_base, __local int** lm_stack, GLOBAL int* gm_stack_base, GLOBAL int** gm_stack)
+{
+    *lm_stack -= WAVEFRONT_SIZE;
+    int addr = **lm_stack;
+
+    // If we popped INVALID_IDX then check global stack
+    if (addr == INVALID_IDX && *gm_stack > gm_stack_base)
+    {
+        // Adjust stack pointer
+        *gm_stack -= SHORT_STACK_SIZE;
+        // Copy data from global memory to LDS
+        for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+        {
+            lm_stack_base[i * WAVEFRONT_SIZE] = (*gm_stack)[i];
+        }
+        // Point local stack pointer to the end
+        *lm_stack = lm_stack_base + (SHORT_STACK_SIZE - 1) * WAVEFRONT_SIZE;
+        addr = lm_stack_base[WAVEFRONT_SIZE * (SHORT_STACK_SIZE - 1)];
+    }
+
+    return addr;
+}
+
+// Find any intersection for a single active ray, returns true if the ray is occluded
+INLINE bool occlude_ray(
+    // Top level nodes
+    GLOBAL bvh_node const* restrict top,
+    // Bottom level nodes
+    GLOBAL bvh_node const* restrict bottom,
+    // Shapes
+    GLOBAL Shape const* restrict shapes,
+    // Object space vertices
+    GLOBAL float3 const* restrict vertices,
+    // World space ray
+    ray const r_world,
+    // Global memory stack of the ray
+    GLOBAL int* gm_stack_base,
+    // Short stack of the ray in LDS, entries are WAVEFRONT_SIZE apart
+    __local int* lm_stack_base
+    )
+{
+    GLOBAL int* gm_stack = gm_stack_base;
+    __local int* lm_stack = lm_stack_base;
+
+    // Ray in the space of the current level
+    ray r = r_world;
+    float3 invdir = safe_invdir(r);
+    float3 oxinvdir = -r.o.xyz * invdir;
+    // Intersection parametric distance
+    float const t_max = r.o.w;
+
+    // Current level nodes, traversal starts at the top level root
+    GLOBAL bvh_node const* nodes = top;
+    int addr = 0;
+
+    //  Initalize local stack
+    *lm_stack = INVALID_IDX;
+    lm_stack += WAVEFRONT_SIZE;
+
+    while (addr != INVALID_IDX)
+    {
+        // Fetch next node
+        bvh_node const node = nodes[addr];
+
+        // Subtrees without shapes visible to the ray are skipped
+        if (!NODE_VISIBLE(node, r))
+        {
+        }
+        else if (LEAFNODE(node))
+        {
+            if (nodes == top)
+            {
+                // Enter the shape, its entries go above the transition
+                GLOBAL Shape const* shape = shapes + node.i0;
+                r = shape_local_ray(r_world, shape);
+                invdir = safe_invdir(r);
+                oxinvdir = -r.o.xyz * invdir;
+
+                push_entry(TRANSITION_IDX, lm_stack_base, &lm_stack, &gm_stack);
+                nodes = bottom;
+                addr = shape->bvh_idx;
+                continue;
+            }
+
+            float3 const v1 = vertices[node.i0];
+            float3 const v2 = vertices[node.i1];
+            float3 const v3 = vertices[node.i2];
+            // Intersect triangle
+            float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
+            // If hit bail out
+            if (f < t_max)
+            {
+                return true;
+            }
+        }
+        else
+        {
+            // It is internal node, so intersect vs both children bounds
+            float2 const s0 = fast_intersect_bbox1(node.bounds[0], invdir, oxinvdir, t_max);
+            float2 const s1 = fast_intersect_bbox1(node.bounds[1], invdir, oxinvdir, t_max);
+
+            // Determine which one to traverse
+            bool const traverse_c0 = (s0.x <= s0.y);
+            bool const traverse_c1 = (s1.x <= s1.y);
+            // Any hit does not need the closest child, visit the one likely to terminate traversal first
+            bool const c1first = traverse_c1 && ((ORDER(node) >> 3) & 1);
+
+            if (traverse_c0 || traverse_c1)
+            {
+                int deferred = -1;
+
+                if (c1first || !traverse_c0)
+                {
+                    addr = node.child1;
+                    deferred = node.child0;
+                }
+                else
+                {
+                    addr = node.child0;
+                    deferred = node.child1;
+                }
+
+                // If we traverse both children we need to postpone the node
+                if (traverse_c0 && traverse_c1)
+                {
+                    push_entry(deferred, lm_stack_base, &lm_stack, &gm_stack);
+                }
+
+                continue;
+            }
+        }
+
+        addr = pop_entry(lm_stack_base, &lm_stack, gm_stack_base, &gm_stack);
+
+        // Leave the shape, the rest of the stack belongs to the top level
+        if (addr == TRANSITION_IDX)
+        {
+            r = r_world;
+            invdir = safe_invdir(r);
+            oxinvdir = -r.o.xyz * invdir;
+            nodes = top;
+            addr = pop_entry(lm_stack_base, &lm_stack, gm_stack_base, &gm_stack);
+        }
+    }
+
+    // Finished traversal, but no intersection found
+    return false;
+}
+
+/*************************************************************************
+KERNELS
+**************************************************************************/
+
+__attribute__((reqd_work_group_size(WAVEFRONT_SIZE, 1, 1)))
+KERNEL void
+occluded_main(
+    // Top level nodes
+    GLOBAL bvh_node const* restrict top,
+    // Bottom level nodes
+    GLOBAL bvh_node const* restrict bottom,
+    // Shapes
+    GLOBAL Shape const* restrict shapes,
+    // Object space vertices
+    GLOBAL float3 const* restrict vertices,
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const* restrict num_rays,
+    // Index of the first ray in the dispatch
+    int offset,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit results: 1 for hit and -1 for miss
+    GLOBAL int* hits
+    )
+{
+    int global_id = get_global_id(0) + offset;
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+
+    // Allocate stack in LDS
+    __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+
+    // Handle only working set
+    if (global_id < *num_rays)
+    {
+        ray const r = load_ray(rays, global_id);
+
+        if (ray_is_active(&r))
+        {
+            GLOBAL int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
+            hits[global_id] = occlude_ray(top, bottom, shapes, vertices, r, gm_stack_base, lds + local_id) ? HIT_MARKER : MISS_MARKER;
+        }
+    }
+}
+
+// Compact variant: results are stored as 1 bit per ray
+__attribute__((reqd_work_group_size(WAVEFRONT_SIZE, 1, 1)))
+KERNEL void
+occluded_compact_main(
+    // Top level nodes
+    GLOBAL bvh_node const* restrict top,
+    // Bottom level nodes
+    GLOBAL bvh_node const* restrict bottom,
+    // Shapes
+    GLOBAL Shape const* restrict shapes,
+    // Object space vertices
+    GLOBAL float3 const* restrict vertices,
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const* restrict num_rays,
+    // Index of the first ray in the dispatch
+    int offset,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit bits
+    GLOBAL uint* hits
+    )
+{
+    int global_id = get_global_id(0) + offset;
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+    int const count = *num_rays;
+    bool occluded = false;
+
+    // Allocate stack in LDS
+    __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+    __local uint words[WAVEFRONT_SIZE / 32];
+
+    // Handle only working set
+    if (global_id < count)
+    {
+        ray const r = load_ray(rays, global_id);
+
+        if (ray_is_active(&r))
+        {
+            GLOBAL int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
+            occluded = occlude_ray(top, bottom, shapes, vertices, r, gm_stack_base, lds + local_id);
+        }
+    }
+
+    store_occlusion_bits(hits, words, offset + group_id * WAVEFRONT_SIZE, count, occluded);
+}
+
+__attribute__((reqd_work_group_size(WAVEFRONT_SIZE, 1, 1)))
+KERNEL void intersect_main(
+    // Top level nodes
+    GLOBAL bvh_node const* restrict top,
+    // Bottom level nodes
+    GLOBAL bvh_node const* restrict bottom,
+    // Shapes
+    GLOBAL Shape const* restrict shapes,
+    // Object space vertices
+    GLOBAL float3 const* restrict vertices,
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const* restrict num_rays,
+    // Index of the first ray in the dispatch
+    int offset,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit data
+    GLOBAL HitRecord* hits
+    // Per-ray counters
+    TRAVERSAL_STATS_PARAM)
+{
+    int global_id = get_global_id(0) + offset;
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+
+    // Allocate stack in LDS
+    __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+
+    // Handle only working subset
+    if (global_id < *num_rays)
+    {
+        ray const r_world = load_ray(rays, global_id);
+        INIT_STATS();
+
+        if (ray_is_active(&r_world))
+        {
+            // Allocate stack in global memory
+            GLOBAL int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
+            GLOBAL int* gm_stack = gm_stack_base;
+            __local int* lm_stack_base = lds + local_id;
+            __local int* lm_stack = lm_stack_base;
+
+            // Ray in the space of the current level
+            ray r = r_world;
+            float3 invdir = safe_invdir(r);
+            float3 oxinvdir = -r.o.xyz * invdir;
+            int dirsign = ray_dirsign(r);
+            // Intersection parametric distance
+            float t_max = r.o.w;
+
+            // Current level nodes, traversal starts at the top level root
+            GLOBAL bvh_node const* nodes = top;
+            int addr = 0;
+            // Shape being traversed and its ID
+            int shape_idx = INVALID_IDX;
+            int shape_id = INVALID_IDX;
+            // Current closest intersection leaf and its shape
+            int isect_idx = INVALID_IDX;
+            int isect_shape_idx = INVALID_IDX;
+            int isect_shape_id = INVALID_IDX;
+
+            //  Initalize local stack
+            *lm_stack = INVALID_IDX;
+            lm_stack += WAVEFRONT_SIZE;
+
+            while (addr != INVALID_IDX)
+            {
+                // Fetch next node
+                bvh_node const node = nodes[addr];
+                COUNT_STAT(iterations, 1);
+
+                // Subtrees without shapes visible to the ray are skipped
+                if (!NODE_VISIBLE(node, r))
+                {
+                }
+                else if (LEAFNODE(node))
+                {
+                    if (shape_idx == INVALID_IDX)
+                    {
+                        // Enter the shape, its entries go above the transition
+                        GLOBAL Shape const* shape = shapes + node.i0;
+                        r = shape_local_ray(r_world, shape);
+                        invdir = safe_invdir(r);
+                        oxinvdir = -r.o.xyz * invdir;
+                        dirsign = ray_dirsign(r);
+
+                        bool const spill = push_entry(TRANSITION_IDX, lm_stack_base, &lm_stack, &gm_stack);
+                        COUNT_STAT(spills, spill ? 1 : 0);
+                        nodes = bottom;
+                        addr = shape->bvh_idx;
+                        shape_idx = node.i0;
+                        shape_id = node.shape_id;
+                        continue;
+                    }
+
+                    float3 const v1 = vertices[node.i0];
+                    float3 const v2 = vertices[node.i1];
+                    float3 const v3 = vertices[node.i2];
+                    COUNT_STAT(primitives, 1);
+                    // Intersect triangle
+                    float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
+                    // If hit update closest hit distance and index
+                    if (f < t_max)
+                    {
+                        t_max = f;
+                        isect_idx = addr;
+                        isect_shape_idx = shape_idx;
+                        isect_shape_id = shape_id;
+                    }
+                }
+                else
+                {
+                    // It is internal node, so intersect vs both children bounds
+                    COUNT_STAT(nodes, 2);
+                    float2 const s0 = fast_intersect_bbox1(node.bounds[0], invdir, oxinvdir, t_max);
+                    float2 const s1 = fast_intersect_bbox1(node.bounds[1], invdir, oxinvdir, t_max);
+
+                    // Determine which one to traverse
+                    bool const traverse_c0 = (s0.x <= s0.y);
+                    bool const traverse_c1 = (s1.x <= s1.y);
+                    // Child order is known from the ray direction along the split axis
+                    int const order = ORDER(node);
+                    bool const c1first = traverse_c1 && (((dirsign >> (order & 3)) ^ ((order >> 2) & 1)) & 1);
+
+                    if (traverse_c0 || traverse_c1)
+                    {
+                        int deferred = -1;
+
+                        if (c1first || !traverse_c0)
+                        {
+                            addr = node.child1;
+                            deferred = node.child0;
+                        }
+                        else
+                        {
+                            addr = node.child0;
+                            deferred = node.child1;
+                        }
+
+                        // If we traverse both children we need to postpone the node
+                        if (traverse_c0 && traverse_c1)
+                        {
+                            bool const spill = push_entry(deferred, lm_stack_base, &lm_stack, &gm_stack);
+                            COUNT_STAT(spills, spill ? 1 : 0);
+                        }
+
+                        continue;
+                    }
+                }
+
+                addr = pop_entry(lm_stack_base, &lm_stack, gm_stack_base, &gm_stack);
+
+                // Leave the shape, the rest of the stack belongs to the top level
+                if (addr == TRANSITION_IDX)
+                {
+                    r = r_world;
+                    invdir = safe_invdir(r);
+                    oxinvdir = -r.o.xyz * invdir;
+                    dirsign = ray_dirsign(r);
+                    nodes = top;
+                    shape_idx = INVALID_IDX;
+                    addr = pop_entry(lm_stack_base, &lm_stack, gm_stack_base, &gm_stack);
+                }
+            }
+
+            // Check if we have found an intersection
+            if (isect_idx != INVALID_IDX)
+            {
+                // Barycentrics are calculated in object space
+                ray const r_local = shape_local_ray(r_world, shapes + isect_shape_idx);
+                bvh_node const node = bottom[isect_idx];
+                float3 const v1 = vertices[node.i0];
+                float3 const v2 = vertices[node.i1];
+                float3 const v3 = vertices[node.i2];
+                // Calculate hit position
+                float3 const p = r_local.o.xyz + r_local.d.xyz * t_max;
+                // Calculte barycentric coordinates
+                float2 const uv = triangle_calculate_barycentrics(p, v1, v2, v3);
+                // Update hit information
+                store_hit(hits, global_id, isect_shape_id, node.prim_id, uv, t_max);
+            }
+            else
+            {
+                // Miss here
+                store_miss(hits, global_id);
+            }
+        }
+
+        STORE_STATS(global_id);
+    }
+}
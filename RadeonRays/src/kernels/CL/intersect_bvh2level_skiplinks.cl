@@ -40,7 +40,7 @@ THE SOFTWARE.
         -Simple and efficient kernel with low VGPR pressure.
         -Can traverse trees of arbitrary depth.
         -Supports motion blur.
-        -Supports instancing.
+        -Supports instancing, instances of groups nest up to MAX_INSTANCE_DEPTH levels.
         -Fast to refit.
     Cons:
         -Travesal order is fixed, so poor algorithmic characteristics.
@@ -65,6 +65,43 @@ DEFINES
 #define SHAPEIDX(x)     (((int)(x.pmin.w)) >> 4)
 #define LEAFNODE(x)     (((x).pmin.w) != -1.f)
 #define NEXT(x)     ((int)((x).pmax.w))
+// Maximum number of shapes entered on the way to geometry, instances of groups nest,
+// scenes without groups keep a single level and fewer registers
+#ifdef RR_NESTED_INSTANCES
+#define MAX_INSTANCE_DEPTH 4
+#else
+#define MAX_INSTANCE_DEPTH 1
+#endif
+
+#ifdef RR_MOTION_BLUR
+#define MOTION_NODES_PARAM GLOBAL bvh_node const* restrict motion_nodes,
+#define MOTION_NODES_ARG motion_nodes,
+#else
+#define MOTION_NODES_PARAM
+#define MOTION_NODES_ARG
+#endif
+
+#ifdef RR_RAY_MASK
+#define TOP_MASKS_PARAM GLOBAL int const* restrict top_masks,
+#define TOP_MASKS_ARG top_masks,
+// Top level subtrees without shapes visible to the ray are treated as missed
+#define TOP_NODE_VISIBLE(addr, level, r) ((level) > 0 || (top_masks[(addr) - root_idx] & ray_get_mask(&(r))) != 0)
+#else
+#define TOP_MASKS_PARAM
+#define TOP_MASKS_ARG
+#define TOP_NODE_VISIBLE(addr, level, r) true
+#endif
+
+#ifdef RR_LOD_INSTANCES
+#define LODS_PARAM GLOBAL Lod const* restrict lods, float lod_transition,
+#define LODS_ARG lods, lod_transition,
+// Top level leafs of instances with levels of detail enter the level picked for the ray
+#define SELECT_LOD(shape_idx, level, r) ((level) > 0 ? (shape_idx) : select_lod(lods, lod_transition, (shape_idx), &(r)))
+#else
+#define LODS_PARAM
+#define LODS_ARG
+#define SELECT_LOD(shape_idx, level, r) (shape_idx)
+#endif
 
 /*************************************************************************
 TYPE DEFINITIONS
@@ -74,37 +111,114 @@ typedef bbox bvh_node;
 
 typedef struct
 {
+    // World to object transform rows, the last row is always (0, 0, 0, 1).
+    // Records are 128 bytes and the rows with the fields below fill the first
+    // 64, so entering a shape from a top level leaf touches one cache line.
+    float4 m0;
+    float4 m1;
+    float4 m2;
     // Shape ID
     int id;
     // Shape BVH index (bottom level)
     int bvh_idx;
     // Shape mask
     int mask;
-    int padding1;
-    // Transform
-    float4 m0;
-    float4 m1;
-    float4 m2;
-    float4 m3;
+    // Non-zero if the BVH has shape leafs (group)
+    int is_group;
     // Motion blur params
-    float4 velocity_linear;
     float4 velocity_angular;
+    float velocity_linear[3];
+    // Start of the mesh vertices, compact faces index vertices relative to it
+    int vertex_start;
+    // Quantized vertices of the mesh are vertex_min + q * vertex_scale
+    float vertex_min[3];
+    // Start of the mesh faces
+    int face_start;
+    float vertex_scale[3];
+    // 1 if the compact faces of the mesh keep 32-bit indices in two records, 0 otherwise
+    int face_shift;
 } Shape;
 
+#ifdef RR_LOD_INSTANCES
+// Levels of detail of a top level shape, indexed as the top level shape data
+typedef struct
+{
+    // World space center distances are measured from
+    float center[3];
+    // Number of levels, 1 for shapes without levels of detail
+    int num_levels;
+    // Shape data index of level 1, the following levels come next
+    int first_level;
+    // Distances level 1 and further start at
+    float distance[3];
+} Lod;
+
+// Random number in [0, 1) derived from the ray, so the same ray always picks the same level
+INLINE float ray_random(ray const* r)
+{
+    uint h = as_uint(r->o.x) ^ (as_uint(r->o.y) * 0x9e3779b9u) ^ (as_uint(r->o.z) * 0x85ebca6bu);
+    h ^= (as_uint(r->d.x) * 0xc2b2ae35u) ^ (as_uint(r->d.y) * 0x27d4eb2fu) ^ (as_uint(r->d.z) * 0x165667b1u);
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return (h >> 8) * (1.f / 16777216.f);
+}
+
+// Shape data index of the level of detail the ray traverses, distances are jittered by
+// lod_transition of the threshold, so neighbouring rays blend levels instead of popping
+INLINE int select_lod(GLOBAL Lod const* restrict lods, float lod_transition, int shape_idx, ray const* r)
+{
+    int const num_levels = lods[shape_idx].num_levels;
+    if (num_levels == 1)
+    {
+        return shape_idx;
+    }
+
+    float3 const center = (float3)(lods[shape_idx].center[0], lods[shape_idx].center[1], lods[shape_idx].center[2]);
+    float const d = length(center - r->o.xyz) * (1.f + lod_transition * (2.f * ray_random(r) - 1.f));
+
+    int lod = 0;
+    while (lod < num_levels - 1 && d >= lods[shape_idx].distance[lod])
+    {
+        ++lod;
+    }
+
+    return lod == 0 ? shape_idx : lods[shape_idx].first_level + lod - 1;
+}
+#endif
+
 typedef struct
 {
-    // Vertex indices
-    int idx[3];
+    // Vertex indices, idx[3] is INVALID_IDX for triangles
+    int idx[4];
     // Shape maks
     int shape_mask;
     // Shape ID
     int shape_id;
     // Primitive ID
     int prim_id;
+    int padding;
 } Face;
 
+#ifdef RR_COMPACT_FACES
+// Mesh-local 16-bit vertex indices in the mesh face order, w is 0xFFFF for triangles.
+// Meshes with more vertices keep 32-bit indices in two consecutive records.
+typedef ushort4 FaceRecord;
+#else
+typedef Face FaceRecord;
+#endif
+
+#ifdef RR_QUANTIZED_VERTICES
+// Positions as 3 16-bit unorm values within the vertex bounds of the mesh
+typedef ushort VertexRecord;
+#else
+typedef float3 VertexRecord;
+#endif
+
 
-INLINE float3 transform_point(float3 p, float4 m0, float4 m1, float4 m2, float4 m3)
+INLINE float3 transform_point(float3 p, float4 m0, float4 m1, float4 m2)
 {
     float3 res;
     res.x = m0.s0 * p.x + m0.s1 * p.y + m0.s2 * p.z + m0.s3;
@@ -113,7 +227,7 @@ INLINE float3 transform_point(float3 p, float4 m0, float4 m1, float4 m2, float4
     return res;
 }
 
-INLINE float3 transform_vector(float3 p, float4 m0, float4 m1, float4 m2, float4 m3)
+INLINE float3 transform_vector(float3 p, float4 m0, float4 m1, float4 m2)
 {
     float3 res;
     res.x = m0.s0 * p.x + m0.s1 * p.y + m0.s2 * p.z;
@@ -122,35 +236,468 @@ INLINE float3 transform_vector(float3 p, float4 m0, float4 m1, float4 m2, float4
     return res;
 }
 
-INLINE ray transform_ray(ray r, float4 m0, float4 m1, float4 m2, float4 m3)
+INLINE ray transform_ray(ray r, float4 m0, float4 m1, float4 m2)
 {
     ray res;
-    res.o.xyz = transform_point(r.o.xyz, m0, m1, m2, m3);
-    res.d.xyz = transform_vector(r.d.xyz, m0, m1, m2, m3);
+    res.o.xyz = transform_point(r.o.xyz, m0, m1, m2);
+    res.d.xyz = transform_vector(r.d.xyz, m0, m1, m2);
     res.o.w = r.o.w;
     res.d.w = r.d.w;
+    // Keep the mask for tests against nested shapes
+    res.extra = r.extra;
     return res;
 }
 
+// Transform a world space ray into the object space of a shape,
+// moving shapes are offset by their linear velocity at ray time
+INLINE ray shape_local_ray(ray r, GLOBAL Shape const* restrict shape)
+{
+#ifdef RR_MOTION_BLUR
+    r.o.xyz -= vload3(0, shape->velocity_linear) * r.d.w;
+#endif
+    return transform_ray(r, shape->m0, shape->m1, shape->m2);
+}
+
+// Transform a world space ray into the space of the shape entered at the given level
+INLINE ray level_local_ray(ray r, GLOBAL Shape const* restrict shapes, int const* level_shape, int level)
+{
+    for (int i = 0; i < level; ++i)
+    {
+        r = shape_local_ray(r, shapes + level_shape[i]);
+    }
+
+    return r;
+}
+
+#ifdef RR_MOTION_BLUR
+// Interpolate top level node bounds by ray time keeping the links
+INLINE bvh_node lerp_node_bounds(bvh_node node, bvh_node end, float time)
+{
+    node.pmin.xyz = mix(node.pmin.xyz, end.pmin.xyz, time);
+    node.pmax.xyz = mix(node.pmax.xyz, end.pmax.xyz, time);
+    return node;
+}
+#endif
+
+// Fetch the face referenced by a leaf of the mesh BVH entered through the shape, compact faces
+// get absolute vertex indices and the primitive ID from the leaf offset
+INLINE Face load_face(GLOBAL FaceRecord const* restrict faces, int face_idx, GLOBAL Shape const* restrict shape)
+{
+#ifdef RR_COMPACT_FACES
+    int4 idx;
+    if (shape->face_shift)
+    {
+        idx = vload4(0, (GLOBAL int const*)(faces + face_idx));
+    }
+    else
+    {
+        ushort4 const local = faces[face_idx];
+        idx = (int4)(local.x, local.y, local.z, local.w == 0xFFFF ? INVALID_IDX : local.w);
+    }
+
+    Face face;
+    face.idx[0] = idx.x + shape->vertex_start;
+    face.idx[1] = idx.y + shape->vertex_start;
+    face.idx[2] = idx.z + shape->vertex_start;
+    face.idx[3] = idx.w == INVALID_IDX ? INVALID_IDX : idx.w + shape->vertex_start;
+    face.shape_mask = 0;
+    face.shape_id = INVALID_IDX;
+    face.prim_id = (face_idx - shape->face_start) >> shape->face_shift;
+    face.padding = 0;
+    return face;
+#else
+    return faces[face_idx];
+#endif
+}
+
+// Fetch a vertex of the mesh entered through the shape, quantized vertices of the same index
+// always give the same position, so faces of a mesh stay watertight
+INLINE float3 load_vertex(GLOBAL VertexRecord const* restrict vertices, int idx, GLOBAL Shape const* restrict shape)
+{
+#ifdef RR_QUANTIZED_VERTICES
+    return vload3(0, shape->vertex_min) + convert_float3(vload3(idx, vertices)) * vload3(0, shape->vertex_scale);
+#else
+    return vertices[idx];
+#endif
+}
+
+// Intersect a triangle or a quad, quads are tested as triangles (v0, v1, v2) and (v0, v2, v3)
+INLINE float fast_intersect_face(ray r, GLOBAL VertexRecord const* restrict vertices, GLOBAL Shape const* restrict shape, Face const face, float t_max)
+{
+    float3 const v1 = load_vertex(vertices, face.idx[0], shape);
+    float3 const v2 = load_vertex(vertices, face.idx[1], shape);
+    float3 const v3 = load_vertex(vertices, face.idx[2], shape);
+    float f = fast_intersect_triangle(r, v1, v2, v3, t_max);
+
+    if (face.idx[3] != INVALID_IDX)
+    {
+        f = fast_intersect_triangle(r, v1, v3, load_vertex(vertices, face.idx[3], shape), f);
+    }
+
+    return f;
+}
+
+// Barycentrics for triangles. Quads get coordinates in the unit square
+// with v0 at (0, 0), v1 at (1, 0), v2 at (1, 1) and v3 at (0, 1).
+INLINE float2 face_calculate_uv(float3 p, GLOBAL VertexRecord const* restrict vertices, GLOBAL Shape const* restrict shape, Face const face)
+{
+    float3 const v1 = load_vertex(vertices, face.idx[0], shape);
+    float3 const v2 = load_vertex(vertices, face.idx[1], shape);
+    float3 const v3 = load_vertex(vertices, face.idx[2], shape);
+    float2 const b = triangle_calculate_barycentrics(p, v1, v2, v3);
+
+    if (face.idx[3] == INVALID_IDX)
+    {
+        return b;
+    }
+
+    if (b.x >= 0.f && b.x + b.y <= 1.f)
+    {
+        return make_float2(b.x + b.y, b.y);
+    }
+
+    float2 const c = triangle_calculate_barycentrics(p, v1, v3, load_vertex(vertices, face.idx[3], shape));
+    return make_float2(c.x, c.x + c.y);
+}
+
+
+// Find the closest intersection for a single ray
+INLINE void intersect_ray(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Vertices
+    GLOBAL VertexRecord const* restrict vertices,
+    // Faces
+    GLOBAL FaceRecord const* restrict faces,
+    // Shapes
+    GLOBAL Shape const* restrict shapes,
+    // BVH root index
+    int root_idx,              
+    // Top level node bounds at ray time 1, motion blur only
+    MOTION_NODES_PARAM
+    // Union of shape masks below each top level node, ray masks only
+    TOP_MASKS_PARAM
+    // Levels of detail of top level shapes and their transition width, level of detail instances only
+    LODS_PARAM
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Hits 
+    GLOBAL HitRecord* hits,
+    // Index of the ray
+    int ray_idx
+    // Per-ray counters
+    TRAVERSAL_STATS_PARAM
+)
+{
+    // Fetch ray
+    ray r = load_ray(rays, ray_idx);
+    INIT_STATS();
+
+    if (ray_is_active(&r))
+    {
+        // Precompute invdir for bbox testing
+        float3 invdir = safe_invdir(r);
+        float3 invdirtop = invdir;
+        float t_max = r.o.w;
+
+        // We need to keep original ray around for returns from bottom hierarchy
+        ray top_ray = r;
+        // Fetch top level BVH index
+        int addr = root_idx;
+
+        // Number of shapes entered, zero at the top level
+        int level = 0;
+        // Leafs to return to and shapes entered at each level
+        int return_addr[MAX_INSTANCE_DEPTH];
+        int level_shape[MAX_INSTANCE_DEPTH];
+        // Set while traversing a mesh BVH
+        bool face_leaves = false;
+        // Current shape ID
+        int shape_id = INVALID_IDX;
+        // Closest shape ID
+        int closest_shape_id = INVALID_IDX;
+        int closest_prim_id = INVALID_IDX;
+        float2 closest_barycentrics;
+        while (addr != INVALID_IDX)
+        {
+            // Fetch next node
+            bvh_node node = nodes[addr];
+#ifdef RR_MOTION_BLUR
+            // Top level bounds follow moving shapes
+            if (level == 0)
+            {
+                node = lerp_node_bounds(node, motion_nodes[addr - root_idx], r.d.w);
+            }
+#endif
+
+            // Intersect against bbox
+            float2 s = fast_intersect_bbox1(node, invdir, -r.o.xyz * invdir, t_max);
+            COUNT_STAT(iterations, 1);
+            COUNT_STAT(nodes, 1);
+
+            if (s.x <= s.y && TOP_NODE_VISIBLE(addr, level, r))
+            {
+                if (LEAFNODE(node))
+                {
+                    // If this is the leaf it can be either a leaf containing primitives (bottom hierarchy)
+                    // or referencing shapes (top level or group hierarchy)
+                    if (face_leaves)
+                    {
+                        // Intersect leaf here
+                        //
+                        int const face_idx = STARTIDX(node);
+                        GLOBAL Shape const* mesh = shapes + level_shape[level - 1];
+                        Face const face = load_face(faces, face_idx, mesh);
+                        COUNT_STAT(primitives, 1);
+
+                        // Intersect triangle or quad
+                        float const f = fast_intersect_face(r, vertices, mesh, face, t_max);
+                        // If hit update closest hit distance and index
+                        if (f < t_max)
+                        {
+                            t_max = f;
+                            closest_prim_id = face.prim_id;
+                            closest_shape_id = shape_id;
+
+                            float3 const p = r.o.xyz + r.d.xyz * t_max;
+                            // Calculte barycentric coordinates
+                            closest_barycentrics = face_calculate_uv(p, vertices, mesh, face);
+                        }
+
+                        // And goto next node
+                        addr = NEXT(node);
+                    }
+                    else
+                    {
+                        // This is top level or group hierarchy leaf
+                        // Get shape descrition struct index
+                        int shape_idx = SELECT_LOD(SHAPEIDX(node), level, r);
+                        // Get shape mask
+                        int shape_mask = shapes[shape_idx].mask;
+                        // Drill into nested BVH only if the geometry is not masked vs current ray
+                        // otherwise skip the subtree
+                        if ((ray_get_mask(&r) & shape_mask) && level < MAX_INSTANCE_DEPTH)
+                        {
+                            // Save leaf index for return and the shape for ray restores
+                            return_addr[level] = addr;
+                            level_shape[level] = shape_idx;
+                            // Hits report the shape attached to the scene
+                            if (level == 0)
+                            {
+                                shape_id = shapes[shape_idx].id;
+                            }
+                            ++level;
+
+                            // Fetch nested BVH index
+                            addr = shapes[shape_idx].bvh_idx;
+                            face_leaves = !shapes[shape_idx].is_group;
+
+                            // Move the ray into the shape space
+                            r = shape_local_ray(r, shapes + shape_idx);
+                            // Recalc invdir
+                            invdir = safe_invdir(r);
+                            // And continue traversal of the nested BVH
+                            continue;
+                        }
+                        else
+                        {
+                            addr = NEXT(node);
+                        }
+                    }
+                }
+                // Traverse child nodes otherwise.
+                else
+                {
+                    // This is an internal node, proceed to left child (it is at current + 1 index)
+                    addr = addr + 1;
+                }
+            }
+            else
+            {
+                // We missed the node, goto next one
+                addr = NEXT(node);
+            }
+
+            // Here check if we ended up traversing a nested BVH
+            // in this case addr = -1 and we return to the leafs referencing it
+            if (addr == INVALID_IDX && level > 0)
+            {
+                // Proceed to next node of the enclosing levels
+                do
+                {
+                    --level;
+                    addr = NEXT(nodes[return_addr[level]]);
+                }
+                while (addr == INVALID_IDX && level > 0);
+
+                // Leafs referencing BVHs never reference faces
+                face_leaves = false;
+                // Restore ray here
+                r = level_local_ray(top_ray, shapes, level_shape, level);
+                // Restore invdir
+                invdir = level > 0 ? safe_invdir(r) : invdirtop;
+            }
+        }
+
+        // Check if we have found an intersection
+        if (closest_shape_id != INVALID_IDX)
+        {
+            // Update hit information
+            store_hit(hits, ray_idx, closest_shape_id, closest_prim_id, closest_barycentrics, t_max);
+        }
+        else
+        {
+            // Miss here
+            store_miss(hits, ray_idx);
+        }
+    }
+
+    STORE_STATS(ray_idx);
+}
 
 __attribute__((reqd_work_group_size(64, 1, 1)))
 KERNEL void intersect_main(
     // BVH nodes
     GLOBAL bvh_node const* restrict nodes,
     // Vertices
-    GLOBAL float3 const* restrict vertices,
+    GLOBAL VertexRecord const* restrict vertices,
     // Faces
-    GLOBAL Face const* restrict faces,
+    GLOBAL FaceRecord const* restrict faces,
     // Shapes
     GLOBAL Shape const* restrict shapes,
     // BVH root index
     int root_idx,              
+    // Top level node bounds at ray time 1, motion blur only
+    MOTION_NODES_PARAM
+    // Union of shape masks below each top level node, ray masks only
+    TOP_MASKS_PARAM
+    // Levels of detail of top level shapes and their transition width, level of detail instances only
+    LODS_PARAM
     // Rays
-    GLOBAL ray const* restrict rays,
+    GLOBAL RayRecord const* restrict rays,
     // Number of rays in ray buffer
     GLOBAL int const* restrict num_rays,
     // Hits 
-    GLOBAL Intersection* hits
+    GLOBAL HitRecord* hits
+    // Per-ray counters
+    TRAVERSAL_STATS_PARAM
+)
+{
+    int global_id = get_global_id(0);
+
+    // Handle only working subset
+    if (global_id < *num_rays)
+    {
+        intersect_ray(nodes, vertices, faces, shapes, root_idx, MOTION_NODES_ARG TOP_MASKS_ARG LODS_ARG rays, hits, global_id TRAVERSAL_STATS_ARG);
+    }
+}
+
+// Persistent threads variant: work-groups keep fetching batches of rays until none are left
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void intersect_persistent_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Vertices
+    GLOBAL VertexRecord const* restrict vertices,
+    // Faces
+    GLOBAL FaceRecord const* restrict faces,
+    // Shapes
+    GLOBAL Shape const* restrict shapes,
+    // BVH root index
+    int root_idx,              
+    // Top level node bounds at ray time 1, motion blur only
+    MOTION_NODES_PARAM
+    // Union of shape masks below each top level node, ray masks only
+    TOP_MASKS_PARAM
+    // Levels of detail of top level shapes and their transition width, level of detail instances only
+    LODS_PARAM
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in ray buffer
+    GLOBAL int const* restrict num_rays,
+    // Number of rays fetched so far, zero on launch
+    GLOBAL int* ray_counter,
+    // Hits 
+    GLOBAL HitRecord* hits
+    // Per-ray counters
+    TRAVERSAL_STATS_PARAM
+)
+{
+    __local int batch_start;
+    int const count = *num_rays;
+
+    for (;;)
+    {
+        int const start = fetch_wave_ray_batch(ray_counter, &batch_start);
+
+        if (start >= count)
+            break;
+
+        int const ray_idx = start + wave_ray_local_id();
+
+        if (ray_idx < count)
+        {
+            intersect_ray(nodes, vertices, faces, shapes, root_idx, MOTION_NODES_ARG TOP_MASKS_ARG LODS_ARG rays, hits, ray_idx TRAVERSAL_STATS_ARG);
+        }
+    }
+}
+
+// Insert a hit with its barycentrics into the sorted list of insert_multi_hit, returns the culling distance
+INLINE float insert_multi_hit_uv(float* hit_t, int2* hit_data, float2* hit_uv, int k, float t, int2 data, float2 uv)
+{
+    float cull_t = t;
+
+    for (int i = 0; i < MAX_MULTI_HITS; ++i)
+    {
+        if (i < k)
+        {
+            if (t < hit_t[i])
+            {
+                float const tmp_t = hit_t[i];
+                int2 const tmp_data = hit_data[i];
+                float2 const tmp_uv = hit_uv[i];
+                hit_t[i] = t;
+                hit_data[i] = data;
+                hit_uv[i] = uv;
+                t = tmp_t;
+                data = tmp_data;
+                uv = tmp_uv;
+            }
+
+            cull_t = hit_t[i];
+        }
+    }
+
+    return cull_t;
+}
+
+// Find k closest intersections in a single traversal, hits of the ray are sorted by distance
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void intersect_multi_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Vertices
+    GLOBAL VertexRecord const* restrict vertices,
+    // Faces
+    GLOBAL FaceRecord const* restrict faces,
+    // Shapes
+    GLOBAL Shape const* restrict shapes,
+    // BVH root index
+    int root_idx,
+    // Top level node bounds at ray time 1, motion blur only
+    MOTION_NODES_PARAM
+    // Union of shape masks below each top level node, ray masks only
+    TOP_MASKS_PARAM
+    // Levels of detail of top level shapes and their transition width, level of detail instances only
+    LODS_PARAM
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in ray buffer
+    GLOBAL int const* restrict num_rays,
+    // Hits, k records per ray
+    GLOBAL HitRecord* hits,
+    // Number of hits per ray
+    int k
 )
 {
     int global_id = get_global_id(0);
@@ -159,64 +706,79 @@ KERNEL void intersect_main(
     if (global_id < *num_rays)
     {
         // Fetch ray
-        ray r = rays[global_id];
+        ray r = load_ray(rays, global_id);
 
         if (ray_is_active(&r))
         {
             // Precompute invdir for bbox testing
             float3 invdir = safe_invdir(r);
             float3 invdirtop = invdir;
+            // Culling distance, distance of the k-th closest hit found so far
             float t_max = r.o.w;
 
+            // Closest hits sorted by distance, primitive and shape ID are kept in x and y
+            float hit_t[MAX_MULTI_HITS];
+            int2 hit_data[MAX_MULTI_HITS];
+            float2 hit_uv[MAX_MULTI_HITS];
+            for (int i = 0; i < MAX_MULTI_HITS; ++i)
+            {
+                hit_t[i] = t_max;
+                hit_data[i] = make_int2(INVALID_IDX, INVALID_IDX);
+                hit_uv[i] = make_float2(0.f, 0.f);
+            }
+
             // We need to keep original ray around for returns from bottom hierarchy
             ray top_ray = r;
             // Fetch top level BVH index
             int addr = root_idx;
 
-            // Set top index
-            int top_addr = INVALID_IDX;
+            // Number of shapes entered, zero at the top level
+            int level = 0;
+            // Leafs to return to and shapes entered at each level
+            int return_addr[MAX_INSTANCE_DEPTH];
+            int level_shape[MAX_INSTANCE_DEPTH];
+            // Set while traversing a mesh BVH
+            bool face_leaves = false;
             // Current shape ID
             int shape_id = INVALID_IDX;
-            // Closest shape ID
-            int closest_shape_id = INVALID_IDX;
-            int closest_prim_id = INVALID_IDX;
-            float2 closest_barycentrics;
             while (addr != INVALID_IDX)
             {
                 // Fetch next node
                 bvh_node node = nodes[addr];
+#ifdef RR_MOTION_BLUR
+                // Top level bounds follow moving shapes
+                if (level == 0)
+                {
+                    node = lerp_node_bounds(node, motion_nodes[addr - root_idx], r.d.w);
+                }
+#endif
 
                 // Intersect against bbox
                 float2 s = fast_intersect_bbox1(node, invdir, -r.o.xyz * invdir, t_max);
 
-                if (s.x <= s.y)
+                if (s.x <= s.y && TOP_NODE_VISIBLE(addr, level, r))
                 {
                     if (LEAFNODE(node))
                     {
                         // If this is the leaf it can be either a leaf containing primitives (bottom hierarchy)
-                        // or containing another BVH (top level hierarhcy)
-                        if (top_addr != INVALID_IDX)
+                        // or referencing shapes (top level or group hierarchy)
+                        if (face_leaves)
                         {
                             // Intersect leaf here
                             //
                             int const face_idx = STARTIDX(node);
-                            Face const face = faces[face_idx];
-                            float3 const v1 = vertices[face.idx[0]];
-                            float3 const v2 = vertices[face.idx[1]];
-                            float3 const v3 = vertices[face.idx[2]];
-
-                            // Intersect triangle
-                            float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
-                            // If hit update closest hit distance and index
+                            GLOBAL Shape const* mesh = shapes + level_shape[level - 1];
+                            Face const face = load_face(faces, face_idx, mesh);
+
+                            // Intersect triangle or quad
+                            float const f = fast_intersect_face(r, vertices, mesh, face, t_max);
+                            // If hit insert it into the list and shrink culling distance once the list is full
                             if (f < t_max)
                             {
-                                t_max = f;
-                                closest_prim_id = face.prim_id;
-                                closest_shape_id = shape_id;
-
-                                float3 const p = r.o.xyz + r.d.xyz * t_max;
-                                // Calculte barycentric coordinates
-                                closest_barycentrics = triangle_calculate_barycentrics(p, v1, v2, v3);
+                                // Barycentrics are computed in object space the hit was found in
+                                float3 const p = r.o.xyz + r.d.xyz * f;
+                                float2 const uv = face_calculate_uv(p, vertices, mesh, face);
+                                t_max = insert_multi_hit_uv(hit_t, hit_data, hit_uv, k, f, make_int2(face.prim_id, shape_id), uv);
                             }
 
                             // And goto next node
@@ -224,36 +786,39 @@ KERNEL void intersect_main(
                         }
                         else
                         {
-                            // This is top level hierarchy leaf
-                            // Save top node index for return
-                            top_addr = addr;
+                            // This is top level or group hierarchy leaf
                             // Get shape descrition struct index
-                            int shape_idx = SHAPEIDX(node);
+                            int shape_idx = SELECT_LOD(SHAPEIDX(node), level, r);
                             // Get shape mask
                             int shape_mask = shapes[shape_idx].mask;
-                            // Drill into 2nd level BVH only if the geometry is not masked vs current ray
+                            // Drill into nested BVH only if the geometry is not masked vs current ray
                             // otherwise skip the subtree
-                            if (ray_get_mask(&r) & shape_mask)
+                            if ((ray_get_mask(&r) & shape_mask) && level < MAX_INSTANCE_DEPTH)
                             {
-                                // Fetch bottom level BVH index
-                                addr = shapes[shape_idx].bvh_idx;
-                                shape_id = shapes[shape_idx].id;
+                                // Save leaf index for return and the shape for ray restores
+                                return_addr[level] = addr;
+                                level_shape[level] = shape_idx;
+                                // Hits report the shape attached to the scene
+                                if (level == 0)
+                                {
+                                    shape_id = shapes[shape_idx].id;
+                                }
+                                ++level;
 
-                                // Fetch BVH transform
-                                float4 wmi0 = shapes[shape_idx].m0;
-                                float4 wmi1 = shapes[shape_idx].m1;
-                                float4 wmi2 = shapes[shape_idx].m2;
-                                float4 wmi3 = shapes[shape_idx].m3;
+                                // Fetch nested BVH index
+                                addr = shapes[shape_idx].bvh_idx;
+                                face_leaves = !shapes[shape_idx].is_group;
 
-                                r = transform_ray(r, wmi0, wmi1, wmi2, wmi3);
+                                // Move the ray into the shape space
+                                r = shape_local_ray(r, shapes + shape_idx);
                                 // Recalc invdir
                                 invdir = safe_invdir(r);
-                                // And continue traversal of the bottom level BVH
+                                // And continue traversal of the nested BVH
                                 continue;
                             }
                             else
                             {
-                                addr = INVALID_IDX;
+                                addr = NEXT(node);
                             }
                         }
                     }
@@ -270,37 +835,194 @@ KERNEL void intersect_main(
                     addr = NEXT(node);
                 }
 
-                // Here check if we ended up traversing bottom level BVH
-                // in this case idx = -1 and topidx has valid value
-                if (addr == INVALID_IDX && top_addr != INVALID_IDX)
+                // Here check if we ended up traversing a nested BVH
+                // in this case addr = -1 and we return to the leafs referencing it
+                if (addr == INVALID_IDX && level > 0)
                 {
-                    //  Proceed to next top level node
-                    addr = NEXT(nodes[top_addr]);
-                    // Set topidx
-                    top_addr = INVALID_IDX;
+                    // Proceed to next node of the enclosing levels
+                    do
+                    {
+                        --level;
+                        addr = NEXT(nodes[return_addr[level]]);
+                    }
+                    while (addr == INVALID_IDX && level > 0);
+
+                    // Leafs referencing BVHs never reference faces
+                    face_leaves = false;
                     // Restore ray here
-                    r = top_ray;
+                    r = level_local_ray(top_ray, shapes, level_shape, level);
                     // Restore invdir
-                    invdir = invdirtop;
+                    invdir = level > 0 ? safe_invdir(r) : invdirtop;
                 }
             }
 
-            // Check if we have found an intersection
-            if (closest_shape_id != INVALID_IDX)
+            // Write the list, unused entries are misses
+            for (int i = 0; i < MAX_MULTI_HITS; ++i)
+            {
+                if (i < k)
+                {
+                    if (hit_data[i].x != INVALID_IDX)
+                    {
+                        store_hit(hits, global_id * k + i, hit_data[i].y, hit_data[i].x, hit_uv[i], hit_t[i]);
+                    }
+                    else
+                    {
+                        store_miss(hits, global_id * k + i);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Find any intersection for a single active ray, returns true if the ray is occluded
+INLINE bool occlude_ray(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Vertices
+    GLOBAL VertexRecord const* restrict vertices,
+    // Faces
+    GLOBAL FaceRecord const* restrict faces,
+    // Shapes
+    GLOBAL Shape const* restrict shapes,
+    // BVH root index
+    int root_idx,
+    // Top level node bounds at ray time 1, motion blur only
+    MOTION_NODES_PARAM
+    // Union of shape masks below each top level node, ray masks only
+    TOP_MASKS_PARAM
+    // Levels of detail of top level shapes and their transition width, level of detail instances only
+    LODS_PARAM
+    // Ray
+    ray r
+)
+{
+    // Precompute invdir for bbox testing
+    float3 invdir = safe_invdir(r);
+    float3 invdirtop = invdir;
+    float const t_max = r.o.w;
+
+    // We need to keep original ray around for returns from bottom hierarchy
+    ray top_ray = r;
+
+    // Fetch top level BVH index
+    int addr = root_idx;
+    // Number of shapes entered, zero at the top level
+    int level = 0;
+    // Leafs to return to and shapes entered at each level
+    int return_addr[MAX_INSTANCE_DEPTH];
+    int level_shape[MAX_INSTANCE_DEPTH];
+    // Set while traversing a mesh BVH
+    bool face_leaves = false;
+
+    while (addr != INVALID_IDX)
+    {
+        // Fetch next node
+        bvh_node node = nodes[addr];
+#ifdef RR_MOTION_BLUR
+        // Top level bounds follow moving shapes
+        if (level == 0)
+        {
+            node = lerp_node_bounds(node, motion_nodes[addr - root_idx], r.d.w);
+        }
+#endif
+        // Intersect against bbox
+        float2 s = fast_intersect_bbox1(node, invdir, -r.o.xyz * invdir, t_max);
+
+        if (s.x <= s.y && TOP_NODE_VISIBLE(addr, level, r))
+        {
+            if (LEAFNODE(node))
             {
-                // Update hit information
-                hits[global_id].shape_id = closest_shape_id;
-                hits[global_id].prim_id = closest_prim_id;
-                hits[global_id].uvwt = make_float4(closest_barycentrics.x, closest_barycentrics.y, 0.f, t_max);
+                // If this is the leaf it can be either a leaf containing primitives (bottom hierarchy)
+                // or referencing shapes (top level or group hierarchy)
+                if (face_leaves)
+                {
+                    // Intersect leaf here
+                    //
+                    int const face_idx = STARTIDX(node);
+                    GLOBAL Shape const* mesh = shapes + level_shape[level - 1];
+                    Face const face = load_face(faces, face_idx, mesh);
+
+                    // Intersect triangle or quad
+                    float const f = fast_intersect_face(r, vertices, mesh, face, t_max);
+                    // If hit bail out
+                    if (f < t_max)
+                    {
+                        return true;
+                    }
+
+                    // And goto next node
+                    addr = NEXT(node);
+                }
+                else
+                {
+                    // This is top level or group hierarchy leaf
+                    // Get shape descrition struct index
+                    int shape_idx = SELECT_LOD(SHAPEIDX(node), level, r);
+                    // Get shape mask
+                    int shape_mask = shapes[shape_idx].mask;
+                    // Drill into nested BVH only if the geometry is not masked vs current ray
+                    // otherwise skip the subtree
+                    if ((ray_get_mask(&r) & shape_mask) && level < MAX_INSTANCE_DEPTH)
+                    {
+                        // Save leaf index for return and the shape for ray restores
+                        return_addr[level] = addr;
+                        level_shape[level] = shape_idx;
+                        ++level;
+
+                        // Fetch nested BVH index
+                        addr = shapes[shape_idx].bvh_idx;
+                        face_leaves = !shapes[shape_idx].is_group;
+
+                        // Move the ray into the shape space
+                        r = shape_local_ray(r, shapes + shape_idx);
+                        // Recalc invdir
+                        invdir = safe_invdir(r);
+                        // And continue traversal of the nested BVH
+                        continue;
+                    }
+                    else
+                    {
+                        addr = NEXT(node);
+                    }
+                }
             }
+            // Traverse child nodes otherwise.
             else
             {
-                // Miss here
-                hits[global_id].shape_id = MISS_MARKER;
-                hits[global_id].prim_id = MISS_MARKER;
+                // This is an internal node, proceed to left child (it is at current + 1 index)
+                addr = addr + 1;
             }
         }
+        else
+        {
+            // We missed the node, goto next one
+            addr = NEXT(node);
+        }
+
+        // Here check if we ended up traversing a nested BVH
+        // in this case addr = -1 and we return to the leafs referencing it
+        if (addr == INVALID_IDX && level > 0)
+        {
+            // Proceed to next node of the enclosing levels
+            do
+            {
+                --level;
+                addr = NEXT(nodes[return_addr[level]]);
+            }
+            while (addr == INVALID_IDX && level > 0);
+
+            // Leafs referencing BVHs never reference faces
+            face_leaves = false;
+            // Restore ray here
+            r = level_local_ray(top_ray, shapes, level_shape, level);
+            // Restore invdir
+            invdir = level > 0 ? safe_invdir(r) : invdirtop;
+        }
     }
+
+    // Finished traversal, but no intersection found
+    return false;
 }
 
 __attribute__((reqd_work_group_size(64, 1, 1)))
@@ -308,15 +1030,21 @@ KERNEL void occluded_main(
     // BVH nodes
     GLOBAL bvh_node const* restrict nodes,
     // Vertices
-    GLOBAL float3 const* restrict vertices,
+    GLOBAL VertexRecord const* restrict vertices,
     // Faces
-    GLOBAL Face const* restrict faces,
+    GLOBAL FaceRecord const* restrict faces,
     // Shapes
     GLOBAL Shape const* restrict shapes,
     // BVH root index
     int root_idx,
+    // Top level node bounds at ray time 1, motion blur only
+    MOTION_NODES_PARAM
+    // Union of shape masks below each top level node, ray masks only
+    TOP_MASKS_PARAM
+    // Levels of detail of top level shapes and their transition width, level of detail instances only
+    LODS_PARAM
     // Rays
-    GLOBAL ray const* restrict rays,
+    GLOBAL RayRecord const* restrict rays,
     // Number of rays in ray buffer
     GLOBAL int const* restrict num_rays,
     // Hits 
@@ -328,122 +1056,333 @@ KERNEL void occluded_main(
     // Handle only working subset
     if (global_id < *num_rays)
     {
-        // Fetch ray
-        ray r = rays[global_id];
+        ray const r = load_ray(rays, global_id);
 
         if (ray_is_active(&r))
         {
-            // Precompute invdir for bbox testing
-            float3 invdir = safe_invdir(r);
-            float3 invdirtop = invdir;
-            float const t_max = r.o.w;
+            hits[global_id] = occlude_ray(nodes, vertices, faces, shapes, root_idx, MOTION_NODES_ARG TOP_MASKS_ARG LODS_ARG r) ? HIT_MARKER : MISS_MARKER;
+        }
+    }
+}
 
-            // We need to keep original ray around for returns from bottom hierarchy
-            ray top_ray = r;
+// Compact variant: results are stored as 1 bit per ray
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void occluded_compact_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Vertices
+    GLOBAL VertexRecord const* restrict vertices,
+    // Faces
+    GLOBAL FaceRecord const* restrict faces,
+    // Shapes
+    GLOBAL Shape const* restrict shapes,
+    // BVH root index
+    int root_idx,
+    // Top level node bounds at ray time 1, motion blur only
+    MOTION_NODES_PARAM
+    // Union of shape masks below each top level node, ray masks only
+    TOP_MASKS_PARAM
+    // Levels of detail of top level shapes and their transition width, level of detail instances only
+    LODS_PARAM
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in ray buffer
+    GLOBAL int const* restrict num_rays,
+    // Hit bits
+    GLOBAL uint* hits
+)
+{
+    __local uint words[64 / 32];
+    int global_id = get_global_id(0);
+    int const count = *num_rays;
+    bool occluded = false;
 
-            // Fetch top level BVH index
-            int addr = root_idx;
-            // Set top index
-            int top_addr = INVALID_IDX;
+    // Handle only working subset
+    if (global_id < count)
+    {
+        ray const r = load_ray(rays, global_id);
 
-            while (addr != INVALID_IDX)
+        if (ray_is_active(&r))
+        {
+            occluded = occlude_ray(nodes, vertices, faces, shapes, root_idx, MOTION_NODES_ARG TOP_MASKS_ARG LODS_ARG r);
+        }
+    }
+
+    store_occlusion_bits(hits, words, get_group_id(0) * get_local_size(0), count, occluded);
+}
+
+// Persistent threads variant: work-groups keep fetching batches of rays until none are left
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void occluded_persistent_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Vertices
+    GLOBAL VertexRecord const* restrict vertices,
+    // Faces
+    GLOBAL FaceRecord const* restrict faces,
+    // Shapes
+    GLOBAL Shape const* restrict shapes,
+    // BVH root index
+    int root_idx,
+    // Top level node bounds at ray time 1, motion blur only
+    MOTION_NODES_PARAM
+    // Union of shape masks below each top level node, ray masks only
+    TOP_MASKS_PARAM
+    // Levels of detail of top level shapes and their transition width, level of detail instances only
+    LODS_PARAM
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in ray buffer
+    GLOBAL int const* restrict num_rays,
+    // Number of rays fetched so far, zero on launch
+    GLOBAL int* ray_counter,
+    // Hits 
+    GLOBAL int* hits
+)
+{
+    __local int batch_start;
+    int const count = *num_rays;
+
+    for (;;)
+    {
+        int const start = fetch_wave_ray_batch(ray_counter, &batch_start);
+
+        if (start >= count)
+            break;
+
+        int const ray_idx = start + wave_ray_local_id();
+
+        if (ray_idx < count)
+        {
+            ray const r = load_ray(rays, ray_idx);
+
+            if (ray_is_active(&r))
             {
-                // Fetch next node
-                bvh_node node = nodes[addr];
-                // Intersect against bbox
-                float2 s = fast_intersect_bbox1(node, invdir, -r.o.xyz * invdir, t_max);
+                hits[ray_idx] = occlude_ray(nodes, vertices, faces, shapes, root_idx, MOTION_NODES_ARG TOP_MASKS_ARG LODS_ARG r) ? HIT_MARKER : MISS_MARKER;
+            }
+        }
+    }
+}
 
-                if (s.x <= s.y)
-                {
-                    if (LEAFNODE(node))
-                    {
-                        // If this is the leaf it can be either a leaf containing primitives (bottom hierarchy)
-                        // or containing another BVH (top level hierarhcy)
-                        if (top_addr != INVALID_IDX)
-                        {
-                            // Intersect leaf here
-                            //
-                            int const face_idx = STARTIDX(node);
-                            Face const face = faces[face_idx];
-                            float3 const v1 = vertices[face.idx[0]];
-                            float3 const v2 = vertices[face.idx[1]];
-                            float3 const v3 = vertices[face.idx[2]];
-
-                            // Intersect triangle
-                            float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
-                            // If hit update closest hit distance and index
-                            if (f < t_max)
-                            {
-                                hits[global_id] = HIT_MARKER;
-                                return;
-                            }
+// Persistent threads variant storing results as 1 bit per ray
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void occluded_persistent_compact_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Vertices
+    GLOBAL VertexRecord const* restrict vertices,
+    // Faces
+    GLOBAL FaceRecord const* restrict faces,
+    // Shapes
+    GLOBAL Shape const* restrict shapes,
+    // BVH root index
+    int root_idx,
+    // Top level node bounds at ray time 1, motion blur only
+    MOTION_NODES_PARAM
+    // Union of shape masks below each top level node, ray masks only
+    TOP_MASKS_PARAM
+    // Levels of detail of top level shapes and their transition width, level of detail instances only
+    LODS_PARAM
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in ray buffer
+    GLOBAL int const* restrict num_rays,
+    // Number of rays fetched so far, zero on launch
+    GLOBAL int* ray_counter,
+    // Hit bits
+    GLOBAL uint* hits
+)
+{
+    __local int batch_start;
+    __local uint words[64 / 32];
+    int const count = *num_rays;
 
-                            // And goto next node
-                            addr = NEXT(node);
-                        }
-                        else
-                        {
-                            // This is top level hierarchy leaf
-                            // Save top node index for return
-                            top_addr = addr;
-                            // Get shape descrition struct index
-                            int shape_idx = SHAPEIDX(node);
-                            // Get shape mask
-                            int shape_mask = shapes[shape_idx].mask;
-                            // Drill into 2nd level BVH only if the geometry is not masked vs current ray
-                            // otherwise skip the subtree
-                            if (ray_get_mask(&r) & shape_mask)
-                            {
-                                // Fetch bottom level BVH index
-                                addr = shapes[shape_idx].bvh_idx;
+    for (;;)
+    {
+        int const start = fetch_ray_batch(ray_counter, &batch_start);
 
-                                // Fetch BVH transform
-                                float4 wmi0 = shapes[shape_idx].m0;
-                                float4 wmi1 = shapes[shape_idx].m1;
-                                float4 wmi2 = shapes[shape_idx].m2;
-                                float4 wmi3 = shapes[shape_idx].m3;
+        if (start >= count)
+            break;
 
-                                r = transform_ray(r, wmi0, wmi1, wmi2, wmi3);
-                                // Recalc invdir
-                                invdir = safe_invdir(r);;
-                                // And continue traversal of the bottom level BVH
-                                continue;
-                            }
-                            else
-                            {
-                                addr = INVALID_IDX;
-                            }
-                        }
-                    }
-                    // Traverse child nodes otherwise.
-                    else
-                    {
-                        // This is an internal node, proceed to left child (it is at current + 1 index)
-                        addr = addr + 1;
-                    }
-                }
-                else
-                {
-                    // We missed the node, goto next one
-                    addr = NEXT(node);
-                }
+        int const ray_idx = start + get_local_id(0);
+        bool occluded = false;
+
+        if (ray_idx < count)
+        {
+            ray const r = load_ray(rays, ray_idx);
+
+            if (ray_is_active(&r))
+            {
+                occluded = occlude_ray(nodes, vertices, faces, shapes, root_idx, MOTION_NODES_ARG TOP_MASKS_ARG LODS_ARG r);
+            }
+        }
+
+        store_occlusion_bits(hits, words, start, count, occluded);
+    }
+}
+
+// World space bounds of the shapes for top level builds on the device. Shapes keep
+// the inverse of their transform, it is inverted back since it is affine.
+KERNEL void calculate_shape_bounds_main(
+    // Shapes in the order of top level leafs
+    GLOBAL Shape const* restrict shapes,
+    // Mesh or group BVH index of each shape
+    GLOBAL int const* restrict shape_bvh_idx,
+    // Object space bounds of mesh and group BVHs
+    GLOBAL bbox const* restrict bvh_bounds,
+    // Number of shapes
+    int num_shapes,
+    // World space bounds
+    GLOBAL bbox* bounds
+)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_shapes)
+    {
+        GLOBAL Shape const* shape = &shapes[global_id];
+        bbox const object_bounds = bvh_bounds[shape_bvh_idx[global_id]];
+
+        // Inverse of the linear part by cofactors
+        float3 const r0 = shape->m0.xyz;
+        float3 const r1 = shape->m1.xyz;
+        float3 const r2 = shape->m2.xyz;
+        float3 const c0 = cross(r1, r2);
+        float3 const c1 = cross(r2, r0);
+        float3 const c2 = cross(r0, r1);
+        float const inv_det = 1.f / dot(r0, c0);
+        float3 const m0 = (float3)(c0.x, c1.x, c2.x) * inv_det;
+        float3 const m1 = (float3)(c0.y, c1.y, c2.y) * inv_det;
+        float3 const m2 = (float3)(c0.z, c1.z, c2.z) * inv_det;
+        float3 const t = (float3)(shape->m0.w, shape->m1.w, shape->m2.w);
+        float3 const translation = -(float3)(dot(m0, t), dot(m1, t), dot(m2, t));
+
+        // Transformed center and extents along absolute rows
+        float3 const center = (object_bounds.pmax.xyz + object_bounds.pmin.xyz) * 0.5f;
+        float3 const extents = (object_bounds.pmax.xyz - object_bounds.pmin.xyz) * 0.5f;
+        float3 const world_center = (float3)(dot(m0, center), dot(m1, center), dot(m2, center)) + translation;
+        float3 const world_extents = (float3)(dot(fabs(m0), extents), dot(fabs(m1), extents), dot(fabs(m2), extents));
+
+        bbox bound;
+        bound.pmin = (float4)(world_center - world_extents, 0.f);
+        bound.pmax = (float4)(world_center + world_extents, 0.f);
+        bounds[global_id] = bound;
+    }
+}
+
+// Flag the geometry pages whose world space bounds are hit by active rays, flags are cleared before the launch
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void page_requests_main(
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in ray buffer
+    GLOBAL int const* restrict num_rays,
+    // World space bounds of the pages
+    GLOBAL bbox const* restrict page_bounds,
+    // Number of pages
+    int num_pages,
+    // Non-zero for the pages rays reach
+    GLOBAL int* requests
+)
+{
+    int global_id = get_global_id(0);
 
-                // Here check if we ended up traversing bottom level BVH
-                // in this case idx = -1 and topidx has valid value
-                if (addr == INVALID_IDX && top_addr != INVALID_IDX)
+    if (global_id < *num_rays)
+    {
+        ray const r = load_ray(rays, global_id);
+
+        if (ray_is_active(&r))
+        {
+            float3 const invdir = safe_invdir(r);
+            float3 const oxinvdir = -r.o.xyz * invdir;
+            float const t_max = ray_get_maxt(&r);
+
+            for (int i = 0; i < num_pages; ++i)
+            {
+                float2 s = fast_intersect_bbox1(page_bounds[i], invdir, oxinvdir, t_max);
+
+                // Pages are few, flags already set are not written again
+                if (s.x <= s.y && !requests[i])
                 {
-                    //  Proceed to next top level node
-                    addr = NEXT(nodes[top_addr]);
-                    // Set topidx
-                    top_addr = INVALID_IDX;
-                    // Restore ray here
-                    r = top_ray;
-                    // Restore invdir
-                    invdir = invdirtop;
+                    requests[i] = 1;
                 }
             }
+        }
+    }
+}
 
-            hits[global_id] = MISS_MARKER;
+// Keep the closer of the hits found in the previous pages and the hits of the last one
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void merge_page_hits_main(
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in ray buffer
+    GLOBAL int const* restrict num_rays,
+    // Hits of the last page
+    GLOBAL HitRecord const* restrict page_hits,
+    // Hits
+    GLOBAL HitRecord* hits
+)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < *num_rays)
+    {
+        ray const r = load_ray(rays, global_id);
+
+        // Hits of inactive rays are left untouched by the traversal
+        if (ray_is_active(&r) && page_hits[global_id].shape_id != MISS_MARKER &&
+            (hits[global_id].shape_id == MISS_MARKER || load_hit_t(page_hits, global_id) < load_hit_t(hits, global_id)))
+        {
+            hits[global_id] = page_hits[global_id];
         }
     }
-}
\ No newline at end of file
+}
+
+// Rays occluded in the last page are occluded
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void merge_page_occlusion_main(
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in ray buffer
+    GLOBAL int const* restrict num_rays,
+    // Hits of the last page
+    GLOBAL int const* restrict page_hits,
+    // Hits
+    GLOBAL int* hits
+)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < *num_rays)
+    {
+        ray const r = load_ray(rays, global_id);
+
+        if (ray_is_active(&r) && page_hits[global_id] == HIT_MARKER)
+        {
+            hits[global_id] = HIT_MARKER;
+        }
+    }
+}
+
+// Bit packed variant, inactive rays have their bits cleared in every page,
+// rays are only passed to keep the arguments of the merge kernels the same
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void merge_page_occlusion_bits_main(
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in ray buffer
+    GLOBAL int const* restrict num_rays,
+    // Hit bits of the last page
+    GLOBAL uint const* restrict page_hits,
+    // Hit bits
+    GLOBAL uint* hits
+)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < (*num_rays + 31) / 32)
+    {
+        hits[global_id] |= page_hits[global_id];
+    }
+}
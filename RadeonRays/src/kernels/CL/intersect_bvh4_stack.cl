@@ -0,0 +1,484 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file intersect_bvh4_stack.cl
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Intersector implementation based on 4-wide BVH stacked travesal.
+
+    Intersector is using 4-wide BVH with children bounding boxes stored
+    in SoA form within the node, so all four boxes are tested at once.
+    Leaf children are intersected right away, hit internal children are
+    sorted by entry distance, the closest one is traversed next and
+    the others are pushed into the stack farthest first.
+    Traversal stack is split into two parts:
+        -Top part in fast LDS memory
+        -Bottom part in slow global memory.
+
+    Pros:
+        -Half the number of traversal steps of binary BVH.
+        -Better memory coalescing, node is 128 bytes.
+    Cons:
+        -Depth is limited.
+        -Generates LDS traffic.
+ */
+
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+
+/*************************************************************************
+TYPE DEFINITIONS
+**************************************************************************/
+
+#define LEAFCHILD(x) ((x) < INVALID_IDX)
+#define STARTIDX(x) (-((x) + 2))
+#define GLOBAL_STACK_SIZE 64
+#define SHORT_STACK_SIZE 16
+#define WAVEFRONT_SIZE 64
+
+// BVH4 node
+typedef struct
+{
+    // Children bounds
+    float4 minx;
+    float4 miny;
+    float4 minz;
+    float4 maxx;
+    float4 maxy;
+    float4 maxz;
+    // Children addresses:
+    // >= 0 for internal nodes, -1 for empty slots, -(face index + 2) for leaves
+    int4 child;
+    // x - number of valid children
+    int4 info;
+} bvh4_node;
+
+typedef struct
+{
+    // Vertex indices
+    int idx[3];
+    // Shape maks
+    int shape_mask;
+    // Shape ID
+    int shape_id;
+    // Primitive ID
+    int prim_id;
+} Face;
+
+
+// Intersect ray against 4 children bounding boxes, returns entry distances
+// and non zero value for each child hit
+INLINE
+int4 fast_intersect_bbox4(bvh4_node const* node, float3 invdir, float3 oxinvdir, float t_max, float4* t)
+{
+    float4 const fx = mad(node->maxx, (float4)(invdir.x), (float4)(oxinvdir.x));
+    float4 const fy = mad(node->maxy, (float4)(invdir.y), (float4)(oxinvdir.y));
+    float4 const fz = mad(node->maxz, (float4)(invdir.z), (float4)(oxinvdir.z));
+    float4 const nx = mad(node->minx, (float4)(invdir.x), (float4)(oxinvdir.x));
+    float4 const ny = mad(node->miny, (float4)(invdir.y), (float4)(oxinvdir.y));
+    float4 const nz = mad(node->minz, (float4)(invdir.z), (float4)(oxinvdir.z));
+
+    float4 const t1 = min(min(max(fx, nx), max(fy, ny)), min(max(fz, nz), (float4)(t_max)));
+    float4 const t0 = max(max(min(fx, nx), min(fy, ny)), max(min(fz, nz), (float4)(0.f)));
+
+    *t = t0;
+    return (t0 <= t1) & (node->child != (int4)(INVALID_IDX));
+}
+
+// Push node address into the short stack offloading it into global memory if necessary
+INLINE
+void stack_push(__local int** lm_stack, __local int* lm_stack_base, __global int** gm_stack, int addr)
+{
+    // If short stack is full, we offload it into global memory
+    if (*lm_stack - lm_stack_base >= SHORT_STACK_SIZE * WAVEFRONT_SIZE)
+    {
+        for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+        {
+            (*gm_stack)[i] = lm_stack_base[i * WAVEFRONT_SIZE];
+        }
+
+        *gm_stack += SHORT_STACK_SIZE;
+        *lm_stack = lm_stack_base + WAVEFRONT_SIZE;
+    }
+
+    **lm_stack = addr;
+    *lm_stack += WAVEFRONT_SIZE;
+}
+
+// Pop node address from the short stack reloading it from global memory if necessary
+INLINE
+int stack_pop(__local int** lm_stack, __local int* lm_stack_base, __global int** gm_stack, __global int* gm_stack_base)
+{
+    // Try popping from local stack
+    *lm_stack -= WAVEFRONT_SIZE;
+    int addr = **lm_stack;
+
+    // If we popped INVALID_IDX then check global stack
+    if (addr == INVALID_IDX && *gm_stack > gm_stack_base)
+    {
+        // Adjust stack pointer
+        *gm_stack -= SHORT_STACK_SIZE;
+        // Copy data from global memory to LDS
+        for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+        {
+            lm_stack_base[i * WAVEFRONT_SIZE] = (*gm_stack)[i];
+        }
+        // Point local stack pointer to the end
+        *lm_stack = lm_stack_base + (SHORT_STACK_SIZE - 1) * WAVEFRONT_SIZE;
+        addr = **lm_stack;
+    }
+
+    return addr;
+}
+
+// Any hit traversal of a single ray, returns true as soon as an occluder is found.
+// Children slots are sorted by the builder (leaves first, then larger boxes),
+// so they are visited in slot order without any distance sorting.
+INLINE
+bool occlude_ray(
+    GLOBAL bvh4_node const * restrict nodes,
+    GLOBAL float3 const * restrict vertices,
+    GLOBAL Face const * restrict faces,
+    ray const r,
+    __global int* gm_stack_base,
+    __local int* lm_stack_base
+    )
+{
+    __global int* gm_stack = gm_stack_base;
+    __local int* lm_stack = lm_stack_base;
+
+    // Precompute inverse direction and origin / dir for bbox testing
+    float3 const invdir = safe_invdir(r);
+    float3 const oxinvdir = -r.o.xyz * invdir;
+    // Intersection parametric distance
+    float const t_max = r.o.w;
+
+    // Current node address
+    int addr = 0;
+
+    //  Initalize local stack
+    *lm_stack = INVALID_IDX;
+    lm_stack += WAVEFRONT_SIZE;
+
+    // Start from 0 node (root)
+    while (addr != INVALID_IDX)
+    {
+        // Fetch next node
+        bvh4_node const node = nodes[addr];
+
+        // Intersect vs all children bounds
+        float4 t;
+        int4 const hit = fast_intersect_bbox4(&node, invdir, oxinvdir, t_max, &t);
+
+        int children[4];
+        int traverse[4];
+        vstore4(node.child, 0, children);
+        vstore4(hit, 0, traverse);
+
+        addr = INVALID_IDX;
+
+        for (int i = 0; i < 4; ++i)
+        {
+            if (!traverse[i])
+                continue;
+
+            if (LEAFCHILD(children[i]))
+            {
+                Face const face = faces[STARTIDX(children[i])];
+                float3 const v1 = vertices[face.idx[0]];
+                float3 const v2 = vertices[face.idx[1]];
+                float3 const v3 = vertices[face.idx[2]];
+                // Intersect triangle
+                float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
+                // If hit bail out
+                if (f < t_max)
+                {
+                    return true;
+                }
+            }
+            else if (addr == INVALID_IDX)
+            {
+                // Traverse the most likely occluder first
+                addr = children[i];
+            }
+            else
+            {
+                stack_push(&lm_stack, lm_stack_base, &gm_stack, children[i]);
+            }
+        }
+
+        if (addr == INVALID_IDX)
+        {
+            addr = stack_pop(&lm_stack, lm_stack_base, &gm_stack, gm_stack_base);
+        }
+    }
+
+    // Finished traversal, but no intersection found
+    return false;
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void
+occluded_main(
+    // Bvh nodes
+    GLOBAL bvh4_node const * restrict nodes,
+    // Triangles vertices
+    GLOBAL float3 const * restrict vertices,
+    // Triangle indices
+    GLOBAL Face const * restrict faces,
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const * restrict num_rays,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit results: 1 for hit and -1 for miss
+    GLOBAL int* hits
+    )
+{
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+
+    // Allocate stack in LDS
+    __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+
+    // Handle only working set
+    if (global_id < *num_rays)
+    {
+        ray const r = load_ray(rays, global_id);
+
+        if (ray_is_active(&r))
+        {
+            // Allocate stack in global memory 
+            __global int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
+            hits[global_id] = occlude_ray(nodes, vertices, faces, r, gm_stack_base, lds + local_id) ? HIT_MARKER : MISS_MARKER;
+        }
+    }
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void
+occluded_compact_main(
+    // Bvh nodes
+    GLOBAL bvh4_node const * restrict nodes,
+    // Triangles vertices
+    GLOBAL float3 const * restrict vertices,
+    // Triangle indices
+    GLOBAL Face const * restrict faces,
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const * restrict num_rays,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit bits
+    GLOBAL uint* hits
+    )
+{
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+    int const count = *num_rays;
+    bool occluded = false;
+
+    // Allocate stack in LDS
+    __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+    __local uint words[WAVEFRONT_SIZE / 32];
+
+    // Handle only working set
+    if (global_id < count)
+    {
+        ray const r = load_ray(rays, global_id);
+
+        if (ray_is_active(&r))
+        {
+            // Allocate stack in global memory 
+            __global int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
+            occluded = occlude_ray(nodes, vertices, faces, r, gm_stack_base, lds + local_id);
+        }
+    }
+
+    store_occlusion_bits(hits, words, group_id * WAVEFRONT_SIZE, count, occluded);
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void intersect_main(
+    // Bvh nodes
+    GLOBAL bvh4_node const* restrict nodes,
+    // Triangles vertices
+    GLOBAL float3 const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const * restrict faces,
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const* restrict num_rays,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit data
+    GLOBAL HitRecord* hits
+    // Per-ray counters
+    TRAVERSAL_STATS_PARAM)
+{
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+
+    // Allocate stack in LDS
+    __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+
+    // Handle only working subset
+    if (global_id < *num_rays)
+    {
+        ray const r = load_ray(rays, global_id);
+        INIT_STATS();
+
+        if (ray_is_active(&r))
+        {
+            // Allocate stack in global memory 
+            __global int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
+            __global int* gm_stack = gm_stack_base;
+            __local int* lm_stack_base = lds + local_id;
+            __local int* lm_stack = lm_stack_base;
+
+            // Precompute inverse direction and origin / dir for bbox testing
+            float3 const invdir = safe_invdir(r);
+            float3 const oxinvdir = -r.o.xyz * invdir;
+            // Intersection parametric distance
+            float t_max = r.o.w;
+
+            // Current node address
+            int addr = 0;
+            // Current closest face index
+            int isect_idx = INVALID_IDX;
+
+            //  Initalize local stack
+            *lm_stack = INVALID_IDX;
+            lm_stack += WAVEFRONT_SIZE;
+
+            // Start from 0 node (root)
+            while (addr != INVALID_IDX)
+            {
+                // Fetch next node
+                bvh4_node const node = nodes[addr];
+                COUNT_STAT(iterations, 1);
+                COUNT_STAT(nodes, 4);
+
+                // Intersect vs all children bounds
+                float4 t;
+                int4 const hit = fast_intersect_bbox4(&node, invdir, oxinvdir, t_max, &t);
+
+                int children[4];
+                int traverse[4];
+                float dist[4];
+                vstore4(node.child, 0, children);
+                vstore4(hit, 0, traverse);
+                vstore4(t, 0, dist);
+
+                // Internal children to traverse sorted by entry distance
+                int sorted_addr[4];
+                float sorted_dist[4];
+                int num_sorted = 0;
+
+                for (int i = 0; i < 4; ++i)
+                {
+                    if (!traverse[i])
+                        continue;
+
+                    if (LEAFCHILD(children[i]))
+                    {
+                        int const face_idx = STARTIDX(children[i]);
+                        Face const face = faces[face_idx];
+                        float3 const v1 = vertices[face.idx[0]];
+                        float3 const v2 = vertices[face.idx[1]];
+                        float3 const v3 = vertices[face.idx[2]];
+                        COUNT_STAT(primitives, 1);
+                        // Intersect triangle
+                        float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
+                        // If hit update closest hit distance and index
+                        if (f < t_max)
+                        {
+                            t_max = f;
+                            isect_idx = face_idx;
+                        }
+                    }
+                    else
+                    {
+                        // Insertion sort, there are at most 4 entries
+                        int j = num_sorted++;
+                        while (j > 0 && sorted_dist[j - 1] > dist[i])
+                        {
+                            sorted_dist[j] = sorted_dist[j - 1];
+                            sorted_addr[j] = sorted_addr[j - 1];
+                            --j;
+                        }
+
+                        sorted_dist[j] = dist[i];
+                        sorted_addr[j] = children[i];
+                    }
+                }
+
+                if (num_sorted > 0)
+                {
+                    // Postpone farther children, the farthest one goes first
+                    for (int i = num_sorted - 1; i > 0; --i)
+                    {
+                        stack_push(&lm_stack, lm_stack_base, &gm_stack, sorted_addr[i]);
+                    }
+
+                    // Continue traversal with the closest child
+                    addr = sorted_addr[0];
+                    continue;
+                }
+
+                addr = stack_pop(&lm_stack, lm_stack_base, &gm_stack, gm_stack_base);
+            }
+
+            // Check if we have found an intersection
+            if (isect_idx != INVALID_IDX)
+            {
+                // Fetch the face & vertices
+                Face const face = faces[isect_idx];
+                float3 const v1 = vertices[face.idx[0]];
+                float3 const v2 = vertices[face.idx[1]];
+                float3 const v3 = vertices[face.idx[2]];
+                // Calculate hit position
+                float3 const p = r.o.xyz + r.d.xyz * t_max;
+                // Calculte barycentric coordinates
+                float2 const uv = triangle_calculate_barycentrics(p, v1, v2, v3);
+                // Update hit information
+                store_hit(hits, global_id, face.shape_id, face.prim_id, uv, t_max);
+            }
+            else
+            {
+                // Miss here
+                store_miss(hits, global_id);
+            }
+        }
+
+        STORE_STATS(global_id);
+    }
+}
@@ -76,6 +76,138 @@ typedef struct
     int prim_id;
 } Face;
 
+// Any hit traversal of a single ray, returns true as soon as an occluder is found.
+// Instead of sorting by distance the child with larger surface area is visited first
+// as it is more likely to contain an occluder.
+INLINE
+bool occlude_ray(
+    GLOBAL bvh_node const * restrict nodes,
+    GLOBAL bbox const* restrict bounds,
+    GLOBAL float3 const * restrict vertices,
+    GLOBAL Face const* faces,
+    ray const r,
+    __global int* gm_stack_base,
+    __local int* lm_stack_base
+    )
+{
+    __global int* gm_stack = gm_stack_base;
+    __local int* lm_stack = lm_stack_base;
+
+    // Precompute inverse direction and origin / dir for bbox testing
+    float3 const invdir = safe_invdir(r);
+    float3 const oxinvdir = -r.o.xyz * invdir;
+    // Intersection parametric distance
+    float const t_max = r.o.w;
+
+    // Current node address
+    int addr = 0;
+
+    //  Initalize local stack
+    *lm_stack = INVALID_IDX;
+    lm_stack += WAVEFRONT_SIZE;
+
+    // Start from 0 node (root)
+    while (addr != INVALID_IDX)
+    {
+        // Fetch next node
+        bvh_node const node = nodes[addr];
+
+        // Check if it is a leaf
+        if (LEAFNODE(node))
+        {
+            Face face = faces[STARTIDX(node)];
+            // Leafs directly store vertex indices
+            // so we load vertices directly
+            float3 const v1 = vertices[face.idx[0]];
+            float3 const v2 = vertices[face.idx[1]];
+            float3 const v3 = vertices[face.idx[2]];
+            // Intersect triangle
+            float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
+            // If hit bail out
+            if (f < t_max)
+            {
+                return true;
+            }
+        }
+        else
+        {
+            // It is internal node, so intersect vs both children bounds
+            bbox const b0 = bounds[node.child0];
+            bbox const b1 = bounds[node.child1];
+            float2 const s0 = fast_intersect_bbox1(b0, invdir, oxinvdir, t_max);
+            float2 const s1 = fast_intersect_bbox1(b1, invdir, oxinvdir, t_max);
+
+            // Determine which one to traverse
+            bool const traverse_c0 = (s0.x <= s0.y);
+            bool const traverse_c1 = (s1.x <= s1.y);
+            bool const c1first = traverse_c1 && (bbox_surface_area(b1) > bbox_surface_area(b0));
+
+            if (traverse_c0 || traverse_c1)
+            {
+                int deferred = -1;
+
+                // Determine which one to traverse first
+                if (c1first || !traverse_c0)
+                {
+                    // Right one is larger or left one not travesed
+                    addr = node.child1;
+                    deferred = node.child0;
+                }
+                else
+                {
+                    // Traverse left node otherwise
+                    addr = node.child0;
+                    deferred = node.child1;
+                }
+
+                // If we traverse both children we need to postpone the node
+                if (traverse_c0 && traverse_c1)
+                {
+                    // If short stack is full, we offload it into global memory
+                    if (lm_stack - lm_stack_base >= SHORT_STACK_SIZE * WAVEFRONT_SIZE)
+                    {
+                        for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+                        {
+                            gm_stack[i] = lm_stack_base[i * WAVEFRONT_SIZE];
+                        }
+
+                        gm_stack += SHORT_STACK_SIZE;
+                        lm_stack = lm_stack_base + WAVEFRONT_SIZE;
+                    }
+
+                    *lm_stack = deferred;
+                    lm_stack += WAVEFRONT_SIZE;
+                }
+
+                // Continue traversal
+                continue;
+            }
+        }
+
+        // Try popping from local stack
+        lm_stack -= WAVEFRONT_SIZE;
+        addr = *(lm_stack);
+
+        // If we popped INVALID_IDX then check global stack
+        if (addr == INVALID_IDX && gm_stack > gm_stack_base)
+        {
+            // Adjust stack pointer
+            gm_stack -= SHORT_STACK_SIZE;
+            // Copy data from global memory to LDS
+            for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+            {
+                lm_stack_base[i * WAVEFRONT_SIZE] = gm_stack[i];
+            }
+            // Point local stack pointer to the end
+            lm_stack = lm_stack_base + (SHORT_STACK_SIZE - 1) * WAVEFRONT_SIZE;
+            addr = lm_stack_base[WAVEFRONT_SIZE * (SHORT_STACK_SIZE - 1)];
+        }
+    }
+
+    // Finished traversal, but no intersection found
+    return false;
+}
+
 __attribute__((reqd_work_group_size(64, 1, 1)))
 KERNEL void
 occluded_main(
@@ -88,150 +220,85 @@ occluded_main(
     // Triangle indices
     GLOBAL Face const* faces,
     // Rays
-    GLOBAL ray const * restrict rays,
+    GLOBAL RayRecord const* restrict rays,
     // Number of rays in rays buffer
     GLOBAL int const * restrict num_rays,
+    // Index of the first ray in the dispatch
+    int offset,
     // Stack memory
     GLOBAL int* stack,
     // Hit results: 1 for hit and -1 for miss
     GLOBAL int* hits
     )
 {
-    int global_id = get_global_id(0);
+    int global_id = get_global_id(0) + offset;
     int local_id = get_local_id(0);
     int group_id = get_group_id(0);
 
+    // Allocate stack in LDS
+    __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+
     // Handle only working set
     if (global_id < *num_rays)
     {
-        ray const r = rays[global_id];
+        ray const r = load_ray(rays, global_id);
 
         if (ray_is_active(&r))
         {
             // Allocate stack in global memory 
             __global int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
-            __global int* gm_stack = gm_stack_base;
-            // Allocate stack in LDS
-            __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
-            __local int* lm_stack_base = lds + local_id;
-            __local int* lm_stack = lm_stack_base;
-
-            // Precompute inverse direction and origin / dir for bbox testing
-            float3 const invdir = safe_invdir(r);
-            float3 const oxinvdir = -r.o.xyz * invdir;
-            // Intersection parametric distance
-            float const t_max = r.o.w;
-
-            // Current node address
-            int addr = 0;
-            // Current closest intersection leaf index
-            int isect_idx = INVALID_IDX;
-
-            //  Initalize local stack
-            *lm_stack = INVALID_IDX;
-            lm_stack += WAVEFRONT_SIZE;
-
-            // Start from 0 node (root)
-            while (addr != INVALID_IDX)
-            {
-                // Fetch next node
-                bvh_node const node = nodes[addr];
-
-                // Check if it is a leaf
-                if (LEAFNODE(node))
-                {
-                    Face face = faces[STARTIDX(node)];
-                    // Leafs directly store vertex indices
-                    // so we load vertices directly
-                    float3 const v1 = vertices[face.idx[0]];
-                    float3 const v2 = vertices[face.idx[1]];
-                    float3 const v3 = vertices[face.idx[2]];
-                    // Intersect triangle
-                    float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
-                    // If hit update closest hit distance and index
-                    if (f < t_max)
-                    {
-                        hits[global_id] = HIT_MARKER;
-                        return;
-                    }
-                }
-                else
-                {
-                    // It is internal node, so intersect vs both children bounds
-                    float2 const s0 = fast_intersect_bbox1(bounds[node.child0], invdir, oxinvdir, t_max);
-                    float2 const s1 = fast_intersect_bbox1(bounds[node.child1], invdir, oxinvdir, t_max);
-
-                    // Determine which one to traverse
-                    bool const traverse_c0 = (s0.x <= s0.y);
-                    bool const traverse_c1 = (s1.x <= s1.y);
-                    bool const c1first = traverse_c1 && (s0.x > s1.x);
-
-                    if (traverse_c0 || traverse_c1)
-                    {
-                        int deferred = -1;
-
-                        // Determine which one to traverse first
-                        if (c1first || !traverse_c0)
-                        {
-                            // Right one is closer or left one not travesed
-                            addr = node.child1;
-                            deferred = node.child0;
-                        }
-                        else
-                        {
-                            // Traverse left node otherwise
-                            addr = node.child0;
-                            deferred = node.child1;
-                        }
-
-                        // If we traverse both children we need to postpone the node
-                        if (traverse_c0 && traverse_c1)
-                        {
-                            // If short stack is full, we offload it into global memory
-                            if (lm_stack - lm_stack_base >= SHORT_STACK_SIZE * WAVEFRONT_SIZE)
-                            {
-                                for (int i = 1; i < SHORT_STACK_SIZE; ++i)
-                                {
-                                    gm_stack[i] = lm_stack_base[i * WAVEFRONT_SIZE];
-                                }
-
-                                gm_stack += SHORT_STACK_SIZE;
-                                lm_stack = lm_stack_base + WAVEFRONT_SIZE;
-                            }
-
-                            *lm_stack = deferred;
-                            lm_stack += WAVEFRONT_SIZE;
-                        }
+            hits[global_id] = occlude_ray(nodes, bounds, vertices, faces, r, gm_stack_base, lds + local_id) ? HIT_MARKER : MISS_MARKER;
+        }
+    }
+}
 
-                        // Continue traversal
-                        continue;
-                    }
-                }
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void
+occluded_compact_main(
+    // Bvh nodes
+    GLOBAL bvh_node const * restrict nodes,
+    // Bounding boxes
+    GLOBAL bbox const* restrict bounds,
+    // Triangles vertices
+    GLOBAL float3 const * restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* faces,
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const * restrict num_rays,
+    // Index of the first ray in the dispatch
+    int offset,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit bits
+    GLOBAL uint* hits
+    )
+{
+    int global_id = get_global_id(0) + offset;
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+    int const count = *num_rays;
+    bool occluded = false;
 
-                // Try popping from local stack
-                lm_stack -= WAVEFRONT_SIZE;
-                addr = *(lm_stack);
+    // Allocate stack in LDS
+    __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+    __local uint words[WAVEFRONT_SIZE / 32];
 
-                // If we popped INVALID_IDX then check global stack
-                if (addr == INVALID_IDX && gm_stack > gm_stack_base)
-                {
-                    // Adjust stack pointer
-                    gm_stack -= SHORT_STACK_SIZE;
-                    // Copy data from global memory to LDS
-                    for (int i = 1; i < SHORT_STACK_SIZE; ++i)
-                    {
-                        lm_stack_base[i * WAVEFRONT_SIZE] = gm_stack[i];
-                    }
-                    // Point local stack pointer to the end
-                    lm_stack = lm_stack_base + (SHORT_STACK_SIZE - 1) * WAVEFRONT_SIZE;
-                    addr = lm_stack_base[WAVEFRONT_SIZE * (SHORT_STACK_SIZE - 1)];
-                }
-            }
+    // Handle only working set
+    if (global_id < count)
+    {
+        ray const r = load_ray(rays, global_id);
 
-            // Finished traversal, but no intersection found
-            hits[global_id] = MISS_MARKER;
+        if (ray_is_active(&r))
+        {
+            // Allocate stack in global memory 
+            __global int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
+            occluded = occlude_ray(nodes, bounds, vertices, faces, r, gm_stack_base, lds + local_id);
         }
     }
+
+    store_occlusion_bits(hits, words, offset + group_id * WAVEFRONT_SIZE, count, occluded);
 }
 
 __attribute__((reqd_work_group_size(64, 1, 1)))
@@ -245,22 +312,27 @@ KERNEL void intersect_main(
     // Faces
     GLOBAL Face const* restrict faces,
     // Rays
-    GLOBAL ray const* restrict rays,
+    GLOBAL RayRecord const* restrict rays,
     // Number of rays in rays buffer
     GLOBAL int const* restrict num_rays,
+    // Index of the first ray in the dispatch
+    int offset,
     // Stack memory
     GLOBAL int* stack,
     // Hit data
-    GLOBAL Intersection* hits)
+    GLOBAL HitRecord* hits
+    // Per-ray counters
+    TRAVERSAL_STATS_PARAM)
 {
-    int global_id = get_global_id(0);
+    int global_id = get_global_id(0) + offset;
     int local_id = get_local_id(0);
     int group_id = get_group_id(0);
 
     // Handle only working subset
     if (global_id < *num_rays)
     {
-        ray const r = rays[global_id];
+        ray const r = load_ray(rays, global_id);
+        INIT_STATS();
 
         if (ray_is_active(&r))
         {
@@ -292,6 +364,7 @@ KERNEL void intersect_main(
             {
                 // Fetch next node
                 bvh_node const node = nodes[addr];
+                COUNT_STAT(iterations, 1);
 
                 // Check if it is a leaf
                 if (LEAFNODE(node))
@@ -302,6 +375,7 @@ KERNEL void intersect_main(
                     float3 const v1 = vertices[face.idx[0]];
                     float3 const v2 = vertices[face.idx[1]];
                     float3 const v3 = vertices[face.idx[2]];
+                    COUNT_STAT(primitives, 1);
                     // Intersect triangle
                     float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
                     // If hit update closest hit distance and index
@@ -314,6 +388,7 @@ KERNEL void intersect_main(
                 else
                 {
                     // It is internal node, so intersect vs both children bounds
+                    COUNT_STAT(nodes, 2);
                     float2 const s0 = fast_intersect_bbox1(bounds[node.child0], invdir, oxinvdir, t_max);
                     float2 const s1 = fast_intersect_bbox1(bounds[node.child1], invdir, oxinvdir, t_max);
 
@@ -353,6 +428,7 @@ KERNEL void intersect_main(
 
                                 gm_stack += SHORT_STACK_SIZE;
                                 lm_stack = lm_stack_base + WAVEFRONT_SIZE;
+                                COUNT_STAT(spills, 1);
                             }
 
                             *lm_stack = deferred;
@@ -397,19 +473,82 @@ KERNEL void intersect_main(
                 // Calculte barycentric coordinates
                 float2 const uv = triangle_calculate_barycentrics(p, v1, v2, v3);
                 // Update hit information
-                hits[global_id].shape_id = face.shape_id;
-                hits[global_id].prim_id = face.prim_id;
-                hits[global_id].uvwt = make_float4(uv.x, uv.y, 0.f, t_max);
+                store_hit(hits, global_id, face.shape_id, face.prim_id, uv, t_max);
             }
             else
             {
                 // Miss here
-                hits[global_id].shape_id = MISS_MARKER;
-                hits[global_id].prim_id = MISS_MARKER;
+                store_miss(hits, global_id);
             }
         }
+
+        STORE_STATS(global_id);
     }
 }
 
+// Copy positions of a mesh held in a device buffer into the scene vertex
+// buffer, transforming them into world space
+KERNEL void
+copy_device_vertices_main(
+    // Source positions, 3 floats each
+    GLOBAL float const* restrict src,
+    // Distance between positions in floats
+    int stride,
+    // Number of vertices
+    int num,
+    // Rows of the world transform
+    float4 m0,
+    float4 m1,
+    float4 m2,
+    // Index of the first vertex in the scene buffer
+    int offset,
+    // Scene vertices
+    GLOBAL float3* restrict vertices
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num)
+    {
+        GLOBAL float const* v = src + global_id * stride;
+        float4 const p = (float4)(v[0], v[1], v[2], 1.f);
+        vertices[offset + global_id] = (float3)(dot(m0, p), dot(m1, p), dot(m2, p));
+    }
+}
 
+// Copy indices of a mesh held in a device buffer into the scene face
+// buffer, rebasing them to the first vertex of the mesh
+KERNEL void
+copy_device_faces_main(
+    // Source indices, 3 ints per face
+    GLOBAL int const* restrict src,
+    // Distance between faces in ints
+    int stride,
+    // Number of faces
+    int num,
+    // Index of the first vertex of the mesh in the scene buffer
+    int vertex_offset,
+    // Shape properties
+    int shape_id,
+    int shape_mask,
+    // Index of the first face in the scene buffer
+    int offset,
+    // Scene faces
+    GLOBAL Face* restrict faces
+    )
+{
+    int global_id = get_global_id(0);
 
+    if (global_id < num)
+    {
+        GLOBAL int const* idx = src + global_id * stride;
+        Face face;
+        face.idx[0] = idx[0] + vertex_offset;
+        face.idx[1] = idx[1] + vertex_offset;
+        face.idx[2] = idx[2] + vertex_offset;
+        face.shape_mask = shape_mask;
+        face.shape_id = shape_id;
+        face.prim_id = global_id;
+        faces[offset + global_id] = face;
+    }
+}
@@ -0,0 +1,127 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file ray_layout.cl
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Conversion between structure of arrays layouts and ray and hit records.
+
+    Every work item handles a single ray and reads or writes element i of every stream,
+    so the stream accesses are coalesced. Records are in the layout selected at compile
+    time, so traversal kernels read them as they do for regular queries.
+ */
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+/*************************************************************************
+KERNELS
+**************************************************************************/
+// Build ray records from the streams, optional ones are replaced by defaults if their flag is unset
+KERNEL void gather_ray_streams_main(
+    // 3 floats per ray
+    GLOBAL float const* restrict origins,
+    GLOBAL float const* restrict directions,
+    // Float per ray, used if has_maxt is set
+    GLOBAL float const* restrict maxt,
+    int has_maxt,
+    // Int per ray, used if has_masks is set
+    GLOBAL int const* restrict masks,
+    int has_masks,
+    // Number of rays
+    int num_rays,
+    // Ray records
+    GLOBAL RayRecord* restrict rays
+)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_rays)
+    {
+        ray r;
+        r.o.xyz = vload3(global_id, origins);
+        r.o.w = has_maxt ? maxt[global_id] : MAXFLOAT;
+        r.d.xyz = vload3(global_id, directions);
+        r.d.w = 0.f;
+        r.extra = make_int2(has_masks ? masks[global_id] : -1, 1);
+        r.padding = make_int2(0, 0);
+        store_ray(rays, global_id, &r);
+    }
+}
+
+// Split hit records into the streams, a stream is written if its bit of fields is set.
+// Barycentrics and distances of missed rays are left untouched as in hit records.
+KERNEL void scatter_hit_streams_main(
+    // Hit records
+    GLOBAL HitRecord const* restrict hits,
+    // Number of rays
+    int num_rays,
+    // Streams to write, bits in the order of the arguments
+    int fields,
+    // Int per ray
+    GLOBAL int* restrict shape_ids,
+    GLOBAL int* restrict prim_ids,
+    // 2 floats per ray
+    GLOBAL float* restrict uvs,
+    // Float per ray
+    GLOBAL float* restrict distances
+)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_rays)
+    {
+        HitRecord const hit = hits[global_id];
+
+        if (fields & 0x1)
+        {
+            shape_ids[global_id] = hit.shape_id;
+        }
+
+        if (fields & 0x2)
+        {
+            prim_ids[global_id] = hit.prim_id;
+        }
+
+        if (hit.shape_id != MISS_MARKER)
+        {
+#ifdef RR_COMPACT_HITS
+            float2 const uv = vload_half2(0, (half const*)&hit.uv);
+            float const t = hit.t;
+#else
+            float2 const uv = hit.uvwt.xy;
+            float const t = hit.uvwt.w;
+#endif
+
+            if (fields & 0x4)
+            {
+                vstore2(uv, global_id, uvs);
+            }
+
+            if (fields & 0x8)
+            {
+                distances[global_id] = t;
+            }
+        }
+    }
+}
@@ -0,0 +1,259 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file reorder_rays.cl
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Ray reordering pass improving traversal coherence.
+
+    Rays are assigned 30-bit keys composed of direction octant (3 bits) followed by
+    Morton code of the origin quantized within scene bounds (27 bits). Rays and their hits
+    are gathered in key order, traversed and hits are scattered back to original indices.
+    Inactive rays get the largest key so they end up at the tail of the batch.
+    Rays of image-shaped batches get keys made of their pixel position instead, in Morton
+    order (15 bits per axis) or in scanline order of 8x8 tiles.
+ */
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+/*************************************************************************
+DEFINES
+**************************************************************************/
+#define INACTIVE_RAY_KEY 0x7FFFFFFF
+// Has to match RayOrder enum of radeon_rays.h
+#define RAY_ORDER_MORTON 1
+#define RAY_ORDER_TILED 2
+#define TILE_SIZE 8
+
+/*************************************************************************
+FUNCTIONS
+**************************************************************************/
+// Expands a 9-bit integer into 27 bits
+// by inserting 2 zeros after each bit.
+INLINE uint expand_bits9(uint v)
+{
+    v = (v | (v << 16)) & 0x030000FFu;
+    v = (v | (v << 8)) & 0x0300F00Fu;
+    v = (v | (v << 4)) & 0x030C30C3u;
+    v = (v | (v << 2)) & 0x09249249u;
+    return v;
+}
+
+// Expands a 15-bit integer into 30 bits
+// by inserting a zero after each bit.
+INLINE uint expand_bits15(uint v)
+{
+    v = (v | (v << 8)) & 0x00FF00FFu;
+    v = (v | (v << 4)) & 0x0F0F0F0Fu;
+    v = (v | (v << 2)) & 0x33333333u;
+    v = (v | (v << 1)) & 0x55555555u;
+    return v;
+}
+
+// Calculate ray sorting key
+INLINE int calculate_ray_key(ray const* r, float3 scene_min, float3 scene_extents)
+{
+    // Direction octant
+    uint const octant = (r->d.x < 0.f ? 4u : 0u) | (r->d.y < 0.f ? 2u : 0u) | (r->d.z < 0.f ? 1u : 0u);
+
+    // Origin within scene bounds, rays starting outside are clamped
+    float3 const p = (r->o.xyz - scene_min) / scene_extents;
+    uint const x = (uint)clamp(p.x * 512.f, 0.f, 511.f);
+    uint const y = (uint)clamp(p.y * 512.f, 0.f, 511.f);
+    uint const z = (uint)clamp(p.z * 512.f, 0.f, 511.f);
+    uint const morton = expand_bits9(x) * 4u + expand_bits9(y) * 2u + expand_bits9(z);
+
+    return (int)((octant << 27) | morton);
+}
+
+// Assign sorting keys to rays
+KERNEL void calculate_ray_keys_main(
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Number of keys to fill, padding keys are inactive
+    int num_keys,
+    // Scene extents
+    GLOBAL bbox const* restrict scene_bound,
+    // Ray keys
+    GLOBAL int* keys,
+    // Ray indices
+    GLOBAL int* indices
+)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_keys)
+    {
+        int key = INACTIVE_RAY_KEY;
+
+        if (global_id < *num_rays)
+        {
+            ray const r = load_ray(rays, global_id);
+
+            if (ray_is_active(&r))
+            {
+                float3 const scene_min = scene_bound->pmin.xyz;
+                float3 const scene_extents = max(scene_bound->pmax.xyz - scene_min, make_float3(1e-5f, 1e-5f, 1e-5f));
+                key = calculate_ray_key(&r, scene_min, scene_extents);
+            }
+        }
+
+        keys[global_id] = key;
+        indices[global_id] = global_id;
+    }
+}
+
+// Assign sorting keys to the pixels of an image
+KERNEL void calculate_image_keys_main(
+    // Image width
+    int width,
+    // Image height
+    int height,
+    // Ray order
+    int order,
+    // Pixel keys
+    GLOBAL int* keys,
+    // Pixel indices
+    GLOBAL int* indices
+)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < width * height)
+    {
+        uint const x = (uint)(global_id % width);
+        uint const y = (uint)(global_id / width);
+        uint key = 0;
+
+        if (order == RAY_ORDER_MORTON)
+        {
+            key = expand_bits15(x) * 2u + expand_bits15(y);
+        }
+        else
+        {
+            uint const tiles_x = ((uint)width + TILE_SIZE - 1) / TILE_SIZE;
+            uint const tile = (y / TILE_SIZE) * tiles_x + x / TILE_SIZE;
+            key = tile * TILE_SIZE * TILE_SIZE + (y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE;
+        }
+
+        keys[global_id] = (int)key;
+        indices[global_id] = global_id;
+    }
+}
+
+// Gather rays and closest hits in sorted order
+KERNEL void gather_intersections_main(
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Hits
+    GLOBAL HitRecord const* restrict hits,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Sorted ray indices
+    GLOBAL int const* restrict indices,
+    // Sorted rays
+    GLOBAL RayRecord* sorted_rays,
+    // Sorted hits
+    GLOBAL HitRecord* sorted_hits
+)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < *num_rays)
+    {
+        int const idx = indices[global_id];
+        sorted_rays[global_id] = rays[idx];
+        // Hits of inactive rays are left untouched by traversal, so they are carried over
+        sorted_hits[global_id] = hits[idx];
+    }
+}
+
+// Scatter closest hits back to original ray order
+KERNEL void scatter_intersections_main(
+    // Sorted hits
+    GLOBAL HitRecord const* restrict sorted_hits,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Sorted ray indices
+    GLOBAL int const* restrict indices,
+    // Hits
+    GLOBAL HitRecord* hits
+)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < *num_rays)
+    {
+        hits[indices[global_id]] = sorted_hits[global_id];
+    }
+}
+
+// Gather rays and occlusion results in sorted order
+KERNEL void gather_occlusions_main(
+    // Rays
+    GLOBAL RayRecord const* restrict rays,
+    // Hits
+    GLOBAL int const* restrict hits,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Sorted ray indices
+    GLOBAL int const* restrict indices,
+    // Sorted rays
+    GLOBAL RayRecord* sorted_rays,
+    // Sorted hits
+    GLOBAL int* sorted_hits
+)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < *num_rays)
+    {
+        int const idx = indices[global_id];
+        sorted_rays[global_id] = rays[idx];
+        // Hits of inactive rays are left untouched by traversal, so they are carried over
+        sorted_hits[global_id] = hits[idx];
+    }
+}
+
+// Scatter occlusion results back to original ray order
+KERNEL void scatter_occlusions_main(
+    // Sorted hits
+    GLOBAL int const* restrict sorted_hits,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Sorted ray indices
+    GLOBAL int const* restrict indices,
+    // Hits
+    GLOBAL int* hits
+)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < *num_rays)
+    {
+        hits[indices[global_id]] = sorted_hits[global_id];
+    }
+}
@@ -0,0 +1,105 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file sort_hits.cl
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Hit sorting by shape for coherent shading.
+
+    Every ray gets its hit shape ID as a key, missed rays and rays past the count get
+    keys above any shape ID. Ray indices are sorted by the keys with the device primitives
+    and the number of hits is found at the boundary of the sorted keys, so neither keys
+    nor counts leave the device.
+ */
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+/*************************************************************************
+DEFINES
+**************************************************************************/
+// Keys of missed rays and rays past the count, sorted after all the shape IDs
+#define MISS_KEY 0x7ffffffe
+#define INVALID_KEY 0x7fffffff
+
+/*************************************************************************
+KERNELS
+**************************************************************************/
+// Calculate hit keys, rays past the count get the invalid key
+KERNEL void calculate_hit_keys_main(
+    // Closest hits
+    GLOBAL HitRecord const* restrict hits,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Number of keys to fill
+    int num_keys,
+    // Hit keys
+    GLOBAL int* keys,
+    // Ray indices
+    GLOBAL int* indices
+)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_keys)
+    {
+        int key = INVALID_KEY;
+
+        if (global_id < *num_rays)
+        {
+            int const shape_id = hits[global_id].shape_id;
+            key = shape_id == MISS_MARKER ? MISS_KEY : shape_id;
+        }
+
+        keys[global_id] = key;
+        indices[global_id] = global_id;
+    }
+}
+
+// Write the number of hits, the only key followed by a miss or the end writes it
+KERNEL void count_hits_main(
+    // Sorted hit keys
+    GLOBAL int const* restrict sorted_keys,
+    // Number of keys
+    int num_keys,
+    // Number of hits
+    GLOBAL int* num_hits
+)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_keys)
+    {
+        bool const hit = sorted_keys[global_id] < MISS_KEY;
+        bool const next_hit = global_id + 1 < num_keys && sorted_keys[global_id + 1] < MISS_KEY;
+
+        if (hit && !next_hit)
+        {
+            *num_hits = global_id + 1;
+        }
+        else if (global_id == 0 && !hit)
+        {
+            *num_hits = 0;
+        }
+    }
+}
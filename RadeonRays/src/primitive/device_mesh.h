@@ -0,0 +1,114 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef DEVICE_MESH_H
+#define DEVICE_MESH_H
+
+#include "shapeimpl.h"
+
+namespace RadeonRays
+{
+    ///< Triangle mesh whose positions and indices live in device buffers
+    ///< created by the intersection API. The buffers are referenced, not
+    ///< copied, and are read by the device every time the scene is committed.
+    ///<
+    class DeviceMesh : public ShapeImpl
+    {
+    public:
+        // Constructor, strides are in bytes and 0 means dense packing
+        DeviceMesh(Buffer const* vertices, int vnum, int vstride,
+                   Buffer const* indices, int istride, int nfaces);
+
+        // Device mesh flag
+        bool is_device_mesh() const override;
+
+        // Buffers holding positions (3 floats each) and indices (3 ints per face)
+        Buffer const* GetVertexBuffer() const;
+        Buffer const* GetIndexBuffer() const;
+
+        // Strides in bytes
+        int GetVertexStride() const;
+        int GetIndexStride() const;
+
+        int num_vertices() const;
+        int num_faces() const;
+
+    private:
+        /// Disallow to copy meshes
+        DeviceMesh(DeviceMesh const& o);
+        DeviceMesh& operator = (DeviceMesh const& o);
+
+        Buffer const* vertices_;
+        Buffer const* indices_;
+        int vertex_stride_;
+        int index_stride_;
+        int num_vertices_;
+        int num_faces_;
+    };
+
+    inline DeviceMesh::DeviceMesh(Buffer const* vertices, int vnum, int vstride,
+                                  Buffer const* indices, int istride, int nfaces)
+        : vertices_(vertices)
+        , indices_(indices)
+        , vertex_stride_(vstride ? vstride : 3 * sizeof(float))
+        , index_stride_(istride ? istride : 3 * sizeof(int))
+        , num_vertices_(vnum)
+        , num_faces_(nfaces)
+    {
+    }
+
+    inline bool DeviceMesh::is_device_mesh() const
+    {
+        return true;
+    }
+
+    inline Buffer const* DeviceMesh::GetVertexBuffer() const
+    {
+        return vertices_;
+    }
+
+    inline Buffer const* DeviceMesh::GetIndexBuffer() const
+    {
+        return indices_;
+    }
+
+    inline int DeviceMesh::GetVertexStride() const
+    {
+        return vertex_stride_;
+    }
+
+    inline int DeviceMesh::GetIndexStride() const
+    {
+        return index_stride_;
+    }
+
+    inline int DeviceMesh::num_vertices() const
+    {
+        return num_vertices_;
+    }
+
+    inline int DeviceMesh::num_faces() const
+    {
+        return num_faces_;
+    }
+}
+
+#endif // DEVICE_MESH_H
@@ -39,6 +39,9 @@ namespace RadeonRays
     class Instance : public ShapeImpl
     {
     public:
+        // Maximum number of levels of detail, 2-level kernels keep the distances of 3 coarser ones
+        static int const kMaxLods = 4;
+
         // Constructor
         Instance(Shape const* baseshape);
 
@@ -47,6 +50,16 @@ namespace RadeonRays
 
         // Instance flag
         bool is_instance() const;
+
+        // Levels of detail, level 0 is the base shape and the coarser ones are used from
+        // the distances to the instance, distances has numlevels - 1 increasing entries
+        void SetLods(Shape const* const* shapes, float const* distances, int numlevels);
+
+        // Number of levels of detail, 1 if only the base shape is used
+        int GetNumLods() const;
+        Shape const* GetLod(int level) const;
+        // Distance from which the level is used, level is at least 1
+        float GetLodDistance(int level) const;
     private:
         /// Disallow to copy meshes, too heavy
         Instance(Instance const& o);
@@ -54,6 +67,9 @@ namespace RadeonRays
 
         /// Base shape
         Shape const* shape_;
+        /// Coarser levels of detail and the distances they are used from
+        std::vector<Shape const*> lods_;
+        std::vector<float> lod_distances_;
     };
 
     inline Instance::Instance(Shape const* baseshape)
@@ -61,6 +77,28 @@ namespace RadeonRays
     {
     }
 
+    inline void Instance::SetLods(Shape const* const* shapes, float const* distances, int numlevels)
+    {
+        shape_ = shapes[0];
+        lods_.assign(shapes + 1, shapes + numlevels);
+        lod_distances_.assign(distances, distances + numlevels - 1);
+    }
+
+    inline int Instance::GetNumLods() const
+    {
+        return static_cast<int>(lods_.size()) + 1;
+    }
+
+    inline Shape const* Instance::GetLod(int level) const
+    {
+        return level == 0 ? shape_ : lods_[level - 1];
+    }
+
+    inline float Instance::GetLodDistance(int level) const
+    {
+        return lod_distances_[level - 1];
+    }
+
     inline Shape const* Instance::GetBaseShape() const
     {
         return shape_;
@@ -24,23 +24,43 @@ THE SOFTWARE.
 #include "../except/except.h"
 
 #include <algorithm>
+#include <atomic>
 #include <functional>
+#include <numeric>
 
 namespace RadeonRays
 {
+    // Faces of mixed meshes loaded by a single task
+    static int const kFaceChunkSize = 4096;
+
+    // Versions are shared by all meshes, so they are unique across the process
+    static std::uint64_t GetNextVersion()
+    {
+        static std::atomic<std::uint64_t> version(0);
+        return ++version;
+    }
+
     Mesh::Mesh(float const* vertices, int vnum, int vstride,
         int const* vidx, int vistride,
         int const* nfaceverts,
         int nfaces)
         : puretriangle_(true)
+        , external_(false)
+        , vertex_data_(nullptr)
+        , vertex_stride_(3 * sizeof(float))
+        , index_data_(nullptr)
+        , index_stride_(3 * sizeof(int))
+        , num_vertices_(vnum)
+        , num_faces_(nfaces)
+        , num_attributes_(0)
+        , version_(GetNextVersion())
     {
         // Handle vertices
-        // Allocate space in advance
-        vertices_.resize(vnum);
+        // Allocate space in advance, padding lets the last position be loaded as a float4
+        positions_.resize(3 * vnum + 1);
+        vertex_data_ = (char const*)positions_.data();
         // Calculate vertex stride, assume dense packing if non passed
         vstride = (vstride == 0) ? (3 * sizeof(float)) : vstride;
-        // Allocate space for faces
-        faces_.resize(nfaces);
 
         // Load vertices
 #pragma omp parallel for
@@ -48,80 +68,190 @@ namespace RadeonRays
         {
             float const* current = (float const*)((char*)vertices + i*vstride);
 
-            float3 temp;
-            temp.x = current[0];
-            temp.y = current[1];
-            temp.z = current[2];
+            positions_[3 * i] = current[0];
+            positions_[3 * i + 1] = current[1];
+            positions_[3 * i + 2] = current[2];
+        }
 
-            vertices_[i] = temp;
+        // Triangle meshes are packed whether or not face sizes are passed
+        if (nfaceverts)
+        {
+            puretriangle_ = std::all_of(nfaceverts, nfaceverts + nfaces, [](int n) { return n == 3; });
         }
 
         // If mesh consists of triangles only apply parallel loading
-        if (nfaceverts == nullptr)
+        if (puretriangle_)
         {
-            puretriangle_ = true;
+            indices_.resize(3 * nfaces);
+            index_data_ = (char const*)indices_.data();
 
             int istride = (vistride == 0) ? (3 * sizeof(int)) : vistride;
 
 #pragma omp parallel for
             for (int i = 0; i < nfaces; ++i)
             {
-                faces_[i].i0 = *((int const*)((char const*)vidx + i * istride));
-                faces_[i].i1 = *((int const*)((char const*)vidx + i * istride + sizeof(int)));
-                faces_[i].i2 = *((int const*)((char const*)vidx + i * istride + 2 * sizeof(int)));
-                faces_[i].type_ = FaceType::TRIANGLE;
+                int const* current = (int const*)((char const*)vidx + i * istride);
+
+                indices_[3 * i] = current[0];
+                indices_[3 * i + 1] = current[1];
+                indices_[3 * i + 2] = current[2];
             }
         }
-        // Otherwise execute serially
+        // Otherwise faces are loaded in chunks, indices of a chunk start after the faces of the ones before it
         else
         {
-            char const* vidxptr = (char const*)vidx;
+            // Allocate space for faces
+            faces_.resize(nfaces);
 
-            for (int i = 0; i < nfaces; ++i)
+            // Densely packed faces take as many indices as they have vertices
+            auto facesize = [vistride](int numverts) -> std::size_t
             {
-                // Triangle case
-                if (nfaceverts[i] == 3)
-                {
-                    faces_[i].i0 = *((int const*)(vidxptr));
-                    faces_[i].i1 = *((int const*)(vidxptr + sizeof(int)));
-                    faces_[i].i2 = *((int const*)(vidxptr + 2 * sizeof(int)));
-                    faces_[i].type_ = FaceType::TRIANGLE;
+                return (vistride == 0) ? (numverts * sizeof(int)) : vistride;
+            };
 
-                    // Goto next primitive
-                    vidxptr += (vistride == 0) ? (3 * sizeof(int)) : vistride;
+            int const numchunks = (nfaces + kFaceChunkSize - 1) / kFaceChunkSize;
+            std::vector<std::size_t> chunkstarts(numchunks + 1, 0);
+            int valid = 1;
+
+            // Sizes of the chunks in bytes, the exclusive prefix sum gives their starts
+#pragma omp parallel for reduction(&&:valid)
+            for (int c = 0; c < numchunks; ++c)
+            {
+                int const end = std::min((c + 1) * kFaceChunkSize, nfaces);
+                std::size_t size = 0;
+
+                for (int i = c * kFaceChunkSize; i < end; ++i)
+                {
+                    valid = valid && (nfaceverts[i] == 3 || nfaceverts[i] == 4);
+                    size += facesize(nfaceverts[i]);
                 }
-                // Quad case
-                else if (nfaceverts[i] == 4)
+
+                chunkstarts[c + 1] = size;
+            }
+
+            if (!valid)
+            {
+                throw ExceptionImpl("Wrong number of vertices per face");
+            }
+
+            std::partial_sum(chunkstarts.begin(), chunkstarts.end(), chunkstarts.begin());
+
+#pragma omp parallel for
+            for (int c = 0; c < numchunks; ++c)
+            {
+                int const end = std::min((c + 1) * kFaceChunkSize, nfaces);
+                char const* vidxptr = (char const*)vidx + chunkstarts[c];
+
+                for (int i = c * kFaceChunkSize; i < end; ++i)
                 {
-                    faces_[i].i0 = *((int const*)(vidxptr));
-                    faces_[i].i1 = *((int const*)(vidxptr + sizeof(int)));
-                    faces_[i].i2 = *((int const*)(vidxptr + 2 * sizeof(int)));
-                    faces_[i].i3 = *((int const*)(vidxptr + 3 * sizeof(int)));
-                    faces_[i].type_ = FaceType::QUAD;
+                    int const* current = (int const*)vidxptr;
+
+                    faces_[i].i0 = current[0];
+                    faces_[i].i1 = current[1];
+                    faces_[i].i2 = current[2];
 
-                    puretriangle_ = false;
+                    // Triangle case
+                    if (nfaceverts[i] == 3)
+                    {
+                        faces_[i].type_ = FaceType::TRIANGLE;
+                    }
+                    // Quad case
+                    else
+                    {
+                        faces_[i].i3 = current[3];
+                        faces_[i].type_ = FaceType::QUAD;
+                    }
 
                     // Goto next primitive
-                    vidxptr += (vistride == 0) ? (4 * sizeof(int)) : vistride;
-                }
-                else
-                {
-                    throw ExceptionImpl("Wrong number of vertices per face");
+                    vidxptr += facesize(nfaceverts[i]);
                 }
             }
         }
     }
 
+    Mesh::Mesh(float const* vertices, int vnum, int vstride,
+        int const* vidx, int vistride,
+        int nfaces, ExternalMemory)
+        : puretriangle_(true)
+        , external_(true)
+        , vertex_data_((char const*)vertices)
+        , vertex_stride_((vstride == 0) ? (3 * sizeof(float)) : vstride)
+        , index_data_((char const*)vidx)
+        , index_stride_((vistride == 0) ? (3 * sizeof(int)) : vistride)
+        , num_vertices_(vnum)
+        , num_faces_(nfaces)
+        , num_attributes_(0)
+        , version_(GetNextVersion())
+    {
+        if ((vnum > 0 && !vertices) || (nfaces > 0 && !vidx))
+        {
+            throw ExceptionImpl("External mesh requires vertex and index data");
+        }
+    }
+
+    void Mesh::UpdateVertices(float const* vertices, int vstride)
+    {
+        vstride = (vstride == 0) ? (3 * sizeof(float)) : vstride;
+
+        if (external_)
+        {
+            // Caller memory is read directly, just switch to the new array if there is one
+            if (vertices)
+            {
+                vertex_data_ = (char const*)vertices;
+                vertex_stride_ = vstride;
+            }
+        }
+        else
+        {
+            if (!vertices && num_vertices_ > 0)
+            {
+                throw ExceptionImpl("Vertex data is required");
+            }
+
+#pragma omp parallel for
+            for (int i = 0; i < num_vertices_; ++i)
+            {
+                float const* current = (float const*)((char const*)vertices + i * vstride);
+
+                positions_[3 * i] = current[0];
+                positions_[3 * i + 1] = current[1];
+                positions_[3 * i + 2] = current[2];
+            }
+        }
+
+        version_ = GetNextVersion();
+        statechange_ |= kStateChangeGeometry;
+    }
+
+    void Mesh::SetVertexAttributes(float const* attributes, int numattributes)
+    {
+        if (numattributes < 0 || numattributes > kMaxVertexAttributes)
+        {
+            throw ExceptionImpl("Number of vertex attributes is out of range");
+        }
+
+        if (numattributes > 0 && !attributes && num_vertices_ > 0)
+        {
+            throw ExceptionImpl("Attribute data is required");
+        }
+
+        attributes_.assign(attributes, attributes + (std::size_t)num_vertices_ * numattributes * 4);
+        num_attributes_ = numattributes;
+        statechange_ |= kStateChangeAttributes;
+    }
+
     int Mesh::GetTransformedFace(int const faceidx, matrix const & transform, float3* outverts) const
     {
         // origin code special cased identity matrix. TODO check speed regressions
-        outverts[0] = transform_point(vertices_[faces_[faceidx].i0], transform);
-        outverts[1] = transform_point(vertices_[faces_[faceidx].i1], transform);
-        outverts[2] = transform_point(vertices_[faces_[faceidx].i2], transform);
+        Face const face = GetFace(faceidx);
+        outverts[0] = transform_point(GetVertex(face.i0), transform);
+        outverts[1] = transform_point(GetVertex(face.i1), transform);
+        outverts[2] = transform_point(GetVertex(face.i2), transform);
 
-        if (faces_[faceidx].type_ == FaceType::QUAD)
+        if (face.type_ == FaceType::QUAD)
         {
-            outverts[3] = transform_point(vertices_[faces_[faceidx].i3], transform);
+            outverts[3] = transform_point(GetVertex(face.i3), transform);
             return 4;
         } else
         {
@@ -142,6 +272,32 @@ namespace RadeonRays
         }
     }
 
+    void Mesh::ComputeAllFaceBounds(matrix const& transform, bbox* out) const
+    {
+        std::vector<float3> verts(num_vertices_);
+
+#pragma omp parallel for
+        for (int i = 0; i < num_vertices_; ++i)
+        {
+            verts[i] = transform_point(GetVertex(i), transform);
+        }
+
+#pragma omp parallel for
+        for (int i = 0; i < num_faces_; ++i)
+        {
+            Face const face = GetFace(i);
+            bbox bounds(verts[face.i0], verts[face.i1]);
+            bounds.grow(verts[face.i2]);
+
+            if (face.type_ == FaceType::QUAD)
+            {
+                bounds.grow(verts[face.i3]);
+            }
+
+            out[i] = bounds;
+        }
+    }
+
     Mesh::~Mesh()
     {
     }
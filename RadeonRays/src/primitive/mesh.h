@@ -25,6 +25,7 @@ THE SOFTWARE.
 #include <vector>
 #include <memory>
 #include <cassert>
+#include <cstdint>
 
 #include "shapeimpl.h"
 #include "math/bbox.h"
@@ -36,6 +37,8 @@ namespace RadeonRays
     ///< Transformable primitive implementation which represents
     ///< triangle mesh. Vertices, normals and uvs are indixed separately
     ///< using their own index buffers each.
+    ///< Positions and triangle indices are stored packed, 12 bytes each,
+    ///< meshes with quads keep their faces in a Face side table.
     ///<
     class Mesh : public ShapeImpl
     {
@@ -68,6 +71,15 @@ namespace RadeonRays
             int const* vidx, int vistride,
             int const* nfaceverts,
             int nfaces);
+
+        // Tag selecting the constructor referencing caller memory
+        struct ExternalMemory {};
+
+        // Triangle mesh reading vertices and indices from the caller arrays, which have
+        // to stay valid and unchanged until the mesh is deleted. Nothing is copied.
+        Mesh(float const* vertices, int vnum, int vstride,
+            int const* vidx, int vistride,
+            int nfaces, ExternalMemory);
         
         //
         ~Mesh();
@@ -77,12 +89,36 @@ namespace RadeonRays
         int num_vertices() const;
         // 
         void GetFaceBounds(int faceidx, bool objectspace, bbox& bounds) const;
-        //
-        float3 const* GetVertexData() const { return &vertices_[0]; }
-        //
-        Face const* GetFaceData() const { return &faces_[0]; }
+        // Bounds of all faces under the transform into out, which has num_faces() entries.
+        // Vertices are transformed once and shared by faces, both passes run in parallel.
+        void ComputeAllFaceBounds(matrix const& transform, bbox* out) const;
+        // Object space vertex position
+        float3 GetVertex(int idx) const;
+        // Vertex indices of the face
+        Face GetFace(int idx) const;
+        // Replace positions, the number of vertices stays the same
+        void UpdateVertices(float const* vertices, int vstride) override;
+        // Replace vertex attributes, changing them doesn't touch the BVH
+        void SetVertexAttributes(float const* attributes, int numattributes) override;
+        // Number of float4 attributes per vertex, 0 if none are attached
+        int num_attributes() const { return num_attributes_; }
+        // Attribute j of vertex i starts at 4 * (i * num_attributes() + j)
+        float const* attribute_data() const { return attributes_.data(); }
+        // Changes whenever positions are replaced and never repeats across meshes,
+        // so a mesh created at the address of a deleted one has another version
+        std::uint64_t GetVersion() const { return version_; }
+        // True if the mesh references caller memory
+        bool is_external() const { return external_; }
         // True if the mesh consists of triangles only
         bool puretriangle() const { return puretriangle_;  }
+        // Positions of 3 floats every vertex_stride() bytes. Unless the mesh is external,
+        // 4 bytes past the last position are readable, so it can be loaded as a float4.
+        char const* vertex_data() const { return vertex_data_; }
+        int vertex_stride() const { return vertex_stride_; }
+        // Triangle indices of 3 ints every index_stride() bytes, nullptr if faces
+        // are kept in the side table
+        char const* index_data() const { return index_data_; }
+        int index_stride() const { return index_stride_; }
 
     private:
         /// Disallow to copy meshes, too heavy
@@ -92,24 +128,67 @@ namespace RadeonRays
         // transforms face vertices, outverts but be at least 4 float3 in size, no of vertices in face returned
         int GetTransformedFace(int const faceidx, matrix const & transform, float3* outverts) const;
 
-        /// Vertices
-        std::vector<float3> vertices_;
-        /// Primitives
+        /// Packed positions, 3 floats per vertex and a float of padding
+        std::vector<float> positions_;
+        /// Packed triangle indices, 3 per face
+        std::vector<int> indices_;
+        /// Side table of meshes with quads, indices_ is empty then
         std::vector<Face> faces_;
         /// Pure triangle flag
         bool puretriangle_;
+        /// Caller memory is referenced instead of the arrays above
+        bool external_;
+
+        /// Vertex and triangle index sources, the packed arrays or caller memory.
+        /// Strides are in bytes, index source is nullptr if faces_ is used.
+        char const* vertex_data_;
+        int vertex_stride_;
+        char const* index_data_;
+        int index_stride_;
+        int num_vertices_;
+        int num_faces_;
+        /// Vertex attributes, 4 floats each
+        std::vector<float> attributes_;
+        int num_attributes_;
+        /// Version of the positions
+        std::uint64_t version_;
     };
 
     //
     inline int Mesh::num_faces() const
     {
-        return (int)faces_.size();
+        return num_faces_;
     }
 
     //
     inline int Mesh::num_vertices() const
     {
-        return (int)vertices_.size();
+        return num_vertices_;
+    }
+
+    inline float3 Mesh::GetVertex(int idx) const
+    {
+        float const* v = (float const*)(vertex_data_ + (std::size_t)idx * vertex_stride_);
+        return float3(v[0], v[1], v[2]);
+    }
+
+    inline Mesh::Face Mesh::GetFace(int idx) const
+    {
+        if (index_data_)
+        {
+            int const* i = (int const*)(index_data_ + (std::size_t)idx * index_stride_);
+
+            // Same layout as triangles of the side table
+            Face face;
+            face.i0 = i[0];
+            face.i1 = i[1];
+            face.i2 = i[2];
+            face.i3 = 0;
+            face.type_ = FaceType::TRIANGLE;
+            return face;
+        }
+
+        return faces_[idx];
     }
 }
 
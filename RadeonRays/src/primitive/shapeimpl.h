@@ -25,6 +25,7 @@ THE SOFTWARE.
 #include "radeon_rays.h"
 #include "math/float3.h"
 #include "math/matrix.h"
+#include "../except/except.h"
 
 namespace RadeonRays
 {
@@ -41,7 +42,9 @@ namespace RadeonRays
             kStateChangeTransform = 0x1,
             kStateChangeMotion = 0x2,
             kStateChangeId = 0x4,
-            kStateChangeMask = 0x5
+            kStateChangeMask = 0x8,
+            kStateChangeGeometry = 0x10,
+            kStateChangeAttributes = 0x20
         };
         
         // Constructor
@@ -53,6 +56,15 @@ namespace RadeonRays
         // This is needed since instances need special API handling
         virtual bool is_instance() const;
 
+        // Meshes referencing device buffers are only handled by some intersectors
+        virtual bool is_device_mesh() const;
+
+        // Analytic spheres are only handled by the flat skip links intersector
+        virtual bool is_spheres() const;
+
+        // Groups of shapes can only be referenced by instances
+        virtual bool is_group() const;
+
         // World space transform
         void SetTransform(matrix const& m, matrix const& minv) override;
         
@@ -80,8 +92,26 @@ namespace RadeonRays
         // Set intersection mask 
         void SetMask(int mask) override;
 
-        // Get intersection mask
+        // Get intersection mask, layer bits are replaced by the layer membership
         int  GetMask() const override;
+
+        // Add the shape to or remove it from the layer
+        void SetLayer(int layer, bool member) const;
+
+        // Set mask bits taken by layers, applied by the world on commit
+        void SetLayerBits(int layerbits) const;
+
+        // Vertex updates, unsupported unless the shape owns vertices
+        void UpdateVertices(float const* vertices, int vstride) override;
+
+        // Vertex attributes, unsupported unless the shape owns vertices
+        void SetVertexAttributes(float const* attributes, int numattributes) override;
+
+        // Build quality hint
+        void SetBuildHint(BuildHint hint) override;
+
+        // Get build quality hint
+        BuildHint GetBuildHint() const override;
         
         // Get state changes since last OnCommit
         int GetStateChange() const;
@@ -96,13 +126,21 @@ namespace RadeonRays
         float3 linearmotion_;
         quaternion angulrmotion_;
         int mask_;
+        // Layers the shape is in and mask bits taken by layers
+        mutable int layers_;
+        mutable int layerbits_;
         // Id
         Id id_;
+        // Build quality hint
+        BuildHint buildhint_;
         // State change
         mutable int statechange_;
     };
 
     inline ShapeImpl::ShapeImpl()
+        : layers_(0)
+        , layerbits_(0)
+        , buildhint_(kBuildDefault)
     {
         SetMask(0xFFFFFFFF);
     }
@@ -156,6 +194,16 @@ namespace RadeonRays
     {
         return id_;
     }
+
+    inline void ShapeImpl::SetBuildHint(BuildHint hint)
+    {
+        buildhint_ = hint;
+    }
+
+    inline BuildHint ShapeImpl::GetBuildHint() const
+    {
+        return buildhint_;
+    }
     
     inline int ShapeImpl::GetStateChange() const
     {
@@ -172,6 +220,21 @@ namespace RadeonRays
         return false;
     }
 
+    inline bool ShapeImpl::is_device_mesh() const
+    {
+        return false;
+    }
+
+    inline bool ShapeImpl::is_spheres() const
+    {
+        return false;
+    }
+
+    inline bool ShapeImpl::is_group() const
+    {
+        return false;
+    }
+
     inline void ShapeImpl::SetMask(int mask)
     {
         mask_ = mask;
@@ -180,7 +243,37 @@ namespace RadeonRays
 
     inline int  ShapeImpl::GetMask() const
     {
-        return mask_;
+        return (mask_ & ~layerbits_) | (layers_ & layerbits_);
+    }
+
+    inline void ShapeImpl::SetLayer(int layer, bool member) const
+    {
+        int layers = member ? (layers_ | (1 << layer)) : (layers_ & ~(1 << layer));
+
+        if (layers != layers_)
+        {
+            layers_ = layers;
+            statechange_ |= kStateChangeMask;
+        }
+    }
+
+    inline void ShapeImpl::SetLayerBits(int layerbits) const
+    {
+        if (layerbits != layerbits_)
+        {
+            layerbits_ = layerbits;
+            statechange_ |= kStateChangeMask;
+        }
+    }
+
+    inline void ShapeImpl::UpdateVertices(float const* vertices, int vstride)
+    {
+        throw ExceptionImpl("The shape has no vertices to update");
+    }
+
+    inline void ShapeImpl::SetVertexAttributes(float const* attributes, int numattributes)
+    {
+        throw ExceptionImpl("The shape has no vertices to attach attributes to");
     }
 }
 
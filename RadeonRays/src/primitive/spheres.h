@@ -0,0 +1,116 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef SPHERES_H
+#define SPHERES_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "shapeimpl.h"
+#include "math/bbox.h"
+#include "math/mathutils.h"
+
+namespace RadeonRays
+{
+    ///< Set of spheres intersected analytically, each sphere is a single
+    ///< primitive of the shape. Builders only see their bounds, so a particle
+    ///< costs one BVH leaf instead of a tessellated mesh.
+    ///<
+    class Spheres : public ShapeImpl
+    {
+    public:
+        // Constructor, centers has 3 floats per sphere
+        Spheres(float const* centers, float const* radii, int count);
+
+        // Spheres flag
+        bool is_spheres() const override;
+
+        int num_spheres() const;
+
+        // Center of the sphere in xyz and its radius in w
+        float3 const& GetSphere(int idx) const;
+
+        // Sphere under the transform, radius is scaled by the largest axis scale,
+        // so non-uniform scales give the bounding sphere of the ellipsoid
+        static float3 TransformSphere(float3 const& sphere, matrix const& transform);
+
+        // Bounds of all spheres under the transform into out, which has num_spheres() entries
+        void ComputeAllBounds(matrix const& transform, bbox* out) const;
+
+    private:
+        /// Disallow to copy spheres
+        Spheres(Spheres const& o);
+        Spheres& operator = (Spheres const& o);
+
+        std::vector<float3> spheres_;
+    };
+
+    inline Spheres::Spheres(float const* centers, float const* radii, int count)
+        : spheres_(count)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            spheres_[i] = float3(centers[3 * i], centers[3 * i + 1], centers[3 * i + 2], radii[i]);
+        }
+    }
+
+    inline bool Spheres::is_spheres() const
+    {
+        return true;
+    }
+
+    inline int Spheres::num_spheres() const
+    {
+        return static_cast<int>(spheres_.size());
+    }
+
+    inline float3 const& Spheres::GetSphere(int idx) const
+    {
+        return spheres_[idx];
+    }
+
+    inline float3 Spheres::TransformSphere(float3 const& sphere, matrix const& transform)
+    {
+        float const sx = transform.m00 * transform.m00 + transform.m10 * transform.m10 + transform.m20 * transform.m20;
+        float const sy = transform.m01 * transform.m01 + transform.m11 * transform.m11 + transform.m21 * transform.m21;
+        float const sz = transform.m02 * transform.m02 + transform.m12 * transform.m12 + transform.m22 * transform.m22;
+
+        float3 res = transform_point(float3(sphere.x, sphere.y, sphere.z), transform);
+        res.w = sphere.w * std::sqrt(std::max(sx, std::max(sy, sz)));
+        return res;
+    }
+
+    inline void Spheres::ComputeAllBounds(matrix const& transform, bbox* out) const
+    {
+#pragma omp parallel for
+        for (int i = 0; i < num_spheres(); ++i)
+        {
+            float3 const s = TransformSphere(spheres_[i], transform);
+            float3 const r(s.w, s.w, s.w);
+            float3 const c(s.x, s.y, s.z);
+            out[i] = bbox(c - r, c + r);
+        }
+    }
+}
+
+#endif // SPHERES_H
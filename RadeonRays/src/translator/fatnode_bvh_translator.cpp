@@ -24,112 +24,352 @@ THE SOFTWARE.
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
 #include "../except/except.h"
+#include "trace.h"
 
 #include <cassert>
-#include <queue>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <functional>
 #include <iostream>
 
 namespace RadeonRays
 {
-    void FatNodeBvhTranslator::Process(Bvh& bvh)
+    // Find the axis with the largest distance between child centers,
+    // kernels visit the child lying first along the ray direction on this axis first
+    static int GetTraversalOrder(bbox const& b0, bbox const& b1)
     {
+        float3 const delta = b1.center() - b0.center();
+
+        int axis = 0;
+        for (int i = 1; i < 3; ++i)
+        {
+            if (std::abs(delta[i]) > std::abs(delta[axis]))
+            {
+                axis = i;
+            }
+        }
+
+        return delta[axis] < 0.f ? (axis | 4) : axis;
+    }
+
+    bool FatNodeBvhTranslator::GetOcclusionOrder(bbox const& lbounds, bool lleaf, bbox const& rbounds, bool rleaf)
+    {
+        // Leaves can terminate any hit traversal right away
+        if (lleaf != rleaf)
+        {
+            return rleaf;
+        }
+
+        // Otherwise the child with larger area is more likely to be hit
+        return rbounds.surface_area() > lbounds.surface_area();
+    }
+
+    void FatNodeBvhTranslator::Process(Bvh& bvh, Face const* faces)
+    {
+        RR_TRACE_SCOPE("FatNodeBvhTranslator::Process");
+
         // WARNING: this is crucial in order for the nodes not to migrate in memory as push_back adds nodes
+        nodes_.resize(bvh.m_nodecnt);
+        ProcessLevels(bvh, nodes_.data(), faces);
+        nodes_.resize(nodecnt_);
+    }
+
+    void FatNodeBvhTranslator::ProcessInto(Bvh& bvh, Node* out, Face const* faces)
+    {
+        RR_TRACE_SCOPE("FatNodeBvhTranslator::ProcessInto");
+
+        nodes_.clear();
+        ProcessLevels(bvh, out, faces);
+    }
+
+    void FatNodeBvhTranslator::ProcessLevels(Bvh& bvh, Node* out, Face const* faces)
+    {
         nodecnt_ = 0;
         max_idx_ = -1;
+        output_ = out;
         int newsize = bvh.m_nodecnt;
-        nodes_.resize(newsize);
         extra_.resize(newsize);
         indices_.resize(newsize);
         addresses_.resize(newsize);
 
         // Check if we have been initialized
-        assert(bvh.m_root);
+        assert(bvh.m_nodecnt > 0);
 
-        // Process root
-        ProcessRootNode(bvh.m_root);
+        // Nodes are laid out breadth first: children of a level follow it in the order of their parents,
+        // so the addresses of a level are known before it is written and its nodes are independent
+        Bvh::Node const* bvhnodes = bvh.m_nodes.data();
+        std::vector<int> level(1, 0);
+        std::vector<int> nextlevel;
+        std::vector<int> childidx;
+
+        while (!level.empty())
+        {
+            int numnodes = (int)level.size();
+            int nextlevelidx = nodecnt_ + numnodes;
+
+            childidx.resize(numnodes);
+            int numchildren = 0;
+            for (int i = 0; i < numnodes; ++i)
+            {
+                childidx[i] = nextlevelidx + numchildren;
+                numchildren += bvhnodes[level[i]].type == Bvh::NodeType::kInternal ? 2 : 0;
+                max_idx_ = std::max(max_idx_, bvhnodes[level[i]].index);
+            }
+
+            nextlevel.resize(numchildren);
+
+            int levelidx = nodecnt_;
+            Bvh::ParallelForChunks(Bvh::GetNumJobs(numnodes, 0), 0, numnodes,
+                [this, bvhnodes, &level, &nextlevel, &childidx, levelidx, nextlevelidx, faces](int, int begin, int end)
+            {
+                for (int i = begin; i < end; ++i)
+                {
+                    Bvh::Node const* n = bvhnodes + level[i];
+                    ProcessNode(bvhnodes, n, levelidx + i, childidx[i], faces);
+
+                    if (n->type == Bvh::NodeType::kInternal)
+                    {
+                        nextlevel[childidx[i] - nextlevelidx] = n->lc;
+                        nextlevel[childidx[i] - nextlevelidx + 1] = n->rc;
+                    }
+                }
+            });
+
+            nodecnt_ += numnodes;
+            level.swap(nextlevel);
+        }
 
-        nodes_.resize(nodecnt_);
         extra_.resize(nodecnt_);
         indices_.resize(nodecnt_);
         addresses_.resize(nodecnt_);
-
-        // Build a hash
-        //m_hash_map.reset(new PerfectHashMap<int, int>(max_idx_, &indices_[0], &addresses_[0], (int)indices_.size(), -1));
-        //std::cout << "Finished hash building\n";
-
-//#define CONSISTENCY_TEST
-//#ifdef CONSISTENCY_TEST
-//        for (int i = 0; i < indices_.size(); ++i)
-//        {
-//            auto val = (*m_hash_map)[indices_[i]];
-//            assert(val == addresses_[i]);
-//        }
-//#endif
     }
 
-    void FatNodeBvhTranslator::InjectIndices(Face const* faces)
+    void FatNodeBvhTranslator::ReorderVanEmdeBoas()
     {
-        for (auto& node : nodes_)
+        RR_TRACE_SCOPE("FatNodeBvhTranslator::ReorderVanEmdeBoas");
+
+        int numnodes = nodecnt_;
+
+        if (numnodes == 0)
         {
-            if (node.s1.child0 == -1)
+            return;
+        }
+
+        // Parents precede children, so node depths are known when the children are reached
+        std::vector<int> depth(numnodes, 0);
+        int height = 1;
+        for (int i = 0; i < numnodes; ++i)
+        {
+            height = std::max(height, depth[i] + 1);
+
+            if (output_[i].s1.child0 != -1)
             {
-                auto idx = node.s1.i0;
-                node.s1.i0 = faces[idx].idx[0];
-                node.s1.i1 = faces[idx].idx[1];
-                node.s1.i2 = faces[idx].idx[2];
-                node.s1.shape_id = faces[idx].shapeidx;
-                node.s1.prim_id = faces[idx].id;
-                node.s1.shape_mask = faces[idx].shape_mask;
+                depth[output_[i].s1.child0] = depth[output_[i].s1.child1] = depth[i] + 1;
             }
         }
-    }
 
+        std::vector<int> order;
+        order.reserve(numnodes);
+        std::vector<int> bottom;
+        LayoutVanEmdeBoas(0, height, order, bottom);
+
+        std::vector<int> newaddr(numnodes);
+        for (int i = 0; i < numnodes; ++i)
+        {
+            newaddr[order[i]] = i;
+        }
+
+        std::vector<Node> nodes(numnodes);
+        std::vector<int> indices(numnodes);
+        for (int i = 0; i < numnodes; ++i)
+        {
+            Node node = output_[order[i]];
+
+            if (node.s1.child0 != -1)
+            {
+                node.s1.child0 = newaddr[node.s1.child0];
+                node.s1.child1 = newaddr[node.s1.child1];
+            }
 
-    int FatNodeBvhTranslator::ProcessRootNode(Bvh::Node const* root)
+            nodes[i] = node;
+            indices[i] = indices_[order[i]];
+        }
+
+        // addresses_ stays the identity
+        if (output_ == nodes_.data())
+        {
+            nodes_.swap(nodes);
+            output_ = nodes_.data();
+        }
+        else
+        {
+            std::copy(nodes.begin(), nodes.end(), output_);
+        }
+
+        indices_.swap(indices);
+    }
+
+    void FatNodeBvhTranslator::LayoutVanEmdeBoas(int root, int height, std::vector<int>& order, std::vector<int>& bottom) const
     {
-        // Keep the nodes to process here
-        std::queue<std::pair<Bvh::Node const*, int> > workqueue;
+        Node const& node = output_[root];
+
+        if (node.s1.child0 == -1)
+        {
+            order.push_back(root);
+            return;
+        }
 
-        workqueue.push(std::make_pair(root, 0));
+        if (height == 1)
+        {
+            order.push_back(root);
+            bottom.push_back(node.s1.child0);
+            bottom.push_back(node.s1.child1);
+            return;
+        }
 
-        while (!workqueue.empty())
+        int const topheight = height / 2;
+
+        std::vector<int> middle;
+        LayoutVanEmdeBoas(root, topheight, order, middle);
+
+        for (auto subtree : middle)
         {
-            auto current = workqueue.front();
-            workqueue.pop();
+            LayoutVanEmdeBoas(subtree, height - topheight, order, bottom);
+        }
+    }
 
-            Node& node(nodes_[nodecnt_]);
-            indices_[nodecnt_] = current.first->index;
-            addresses_[nodecnt_] = nodecnt_;
-            ++nodecnt_;
+    void FatNodeBvhTranslator::BuildHashMap()
+    {
+        // Map node indices in a complete tree to node addresses
+        int numindices = (int)indices_.size();
+        m_hash_map.reset(new PerfectHashMap<int, int>(max_idx_, &indices_[0], &addresses_[0], numindices, -1,
+            [numindices](int begin, int end, std::function<void(int, int)> const& func)
+        {
+            Bvh::ParallelForChunks(Bvh::GetNumJobs(numindices, 0), begin, end, [&func](int, int chunkbegin, int chunkend)
+            {
+                func(chunkbegin, chunkend);
+            });
+        }));
+    }
 
-            if (current.first->index > max_idx_)
+    void FatNodeBvhTranslator::InjectIndices(Face const* faces)
+    {
+        int numnodes = nodecnt_;
+        Bvh::ParallelForChunks(Bvh::GetNumJobs(numnodes, 0), 0, numnodes, [this, faces](int, int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
             {
-                max_idx_ = current.first->index;
+                if (output_[i].s1.child0 == -1)
+                {
+                    InjectIndices(output_[i], faces);
+                }
             }
+        });
+    }
+
+    void FatNodeBvhTranslator::InjectIndices(Node& node, Face const* faces)
+    {
+        auto idx = node.s1.i0;
+        node.s1.i0 = faces[idx].idx[0];
+        node.s1.i1 = faces[idx].idx[1];
+        node.s1.i2 = faces[idx].idx[2];
+        node.s1.shape_id = faces[idx].shapeidx;
+        node.s1.prim_id = faces[idx].id;
+        node.s1.shape_mask = faces[idx].shape_mask;
+    }
+
+
+    void FatNodeBvhTranslator::PropagateMasks()
+    {
+        int numnodes = nodecnt_;
+        std::vector<int> masks(numnodes);
+
+        // Parents precede their children in both layouts, so going backwards visits the nodes bottom-up
+        for (int i = numnodes - 1; i >= 0; --i)
+        {
+            Node& node = output_[i];
 
-            if (current.first->type == Bvh::NodeType::kInternal)
+            if (node.s1.child0 == -1)
             {
-                node.s0.bounds[0] = current.first->lc->bounds;
-                node.s0.bounds[1] = current.first->rc->bounds;
-                workqueue.push(std::make_pair(current.first->lc, nodecnt_));
-                workqueue.push(std::make_pair(current.first->rc, -nodecnt_));
+                masks[i] = node.s1.shape_mask;
             }
             else
             {
-                node.s1.child0 = node.s1.child1 = -1;
-                node.s1.i0 = current.first->startidx;
+                masks[i] = masks[node.s1.child0] | masks[node.s1.child1];
+                // Kernels read the mask back with as_int
+                std::memcpy(&node.s0.bounds[1].pmax.w, &masks[i], sizeof(int));
             }
+        }
+    }
+
+    void FatNodeBvhTranslator::Refit(Node* nodes, int numnodes, float3 const* vertices)
+    {
+        std::vector<bbox> bounds(numnodes);
+
+        // Children always follow their parent in breadth first layout,
+        // so going backwards visits the nodes bottom-up
+        for (int i = numnodes - 1; i >= 0; --i)
+        {
+            Node& node = nodes[i];
 
-            if (current.second > 0)
+            if (node.s1.child0 == -1)
+            {
+                bounds[i] = bbox(vertices[node.s1.i0]);
+                bounds[i].grow(vertices[node.s1.i1]);
+                bounds[i].grow(vertices[node.s1.i2]);
+            }
+            else
             {
-                nodes_[current.second - 1].s1.child0 = nodecnt_ - 1;
+                int const child0 = node.s1.child0;
+                int const child1 = node.s1.child1;
+
+                // Child addresses live in w components of the first box, update xyz only
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    node.s0.bounds[0].pmin[axis] = bounds[child0].pmin[axis];
+                    node.s0.bounds[0].pmax[axis] = bounds[child0].pmax[axis];
+                    node.s0.bounds[1].pmin[axis] = bounds[child1].pmin[axis];
+                    node.s0.bounds[1].pmax[axis] = bounds[child1].pmax[axis];
+                }
+
+                bounds[i] = bboxunion(bounds[child0], bounds[child1]);
             }
-            else if (current.second < 0)
+        }
+    }
+
+    void FatNodeBvhTranslator::ProcessNode(Bvh::Node const* nodes, Bvh::Node const* n, int idx, int childidx, Face const* faces)
+    {
+        Node& node = output_[idx];
+        indices_[idx] = n->index;
+        addresses_[idx] = idx;
+
+        if (n->type == Bvh::NodeType::kInternal)
+        {
+            Bvh::Node const* lc = nodes + n->lc;
+            Bvh::Node const* rc = nodes + n->rc;
+
+            node.s0.bounds[0] = lc->bounds;
+            node.s0.bounds[1] = rc->bounds;
+            int order = GetTraversalOrder(lc->bounds, rc->bounds);
+            if (GetOcclusionOrder(lc->bounds, lc->type == Bvh::NodeType::kLeaf,
+                rc->bounds, rc->type == Bvh::NodeType::kLeaf))
             {
-                nodes_[-current.second - 1].s1.child1 = nodecnt_ - 1;
-            }           
+                order |= 8;
+            }
+            node.s0.bounds[1].pmin.w = static_cast<float>(order);
+            node.s1.child0 = childidx;
+            node.s1.child1 = childidx + 1;
         }
+        else
+        {
+            node.s1.child0 = node.s1.child1 = -1;
+            node.s1.i0 = n->startidx;
 
-        return 0;
+            if (faces)
+            {
+                InjectIndices(node, faces);
+            }
+        }
     }
 }
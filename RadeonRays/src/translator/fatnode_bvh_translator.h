@@ -59,12 +59,18 @@ namespace RadeonRays
         FatNodeBvhTranslator()
             : nodecnt_(0)
             , root_(0)
+            , output_(nullptr)
         {
         }
 
         // Fat BVH node
         // Encoding:
         // xbound.pmin.w == -1.f if x-child is an internal node otherwise triangle index
+        // bounds[1].pmin.w of an internal node holds traversal order: bits 0-1 are the axis children
+        // are separated along the most, bit 2 is set if child1 lies before child0 on this axis,
+        // bit 3 is set if any hit traversal should visit child1 first
+        // bounds[1].pmax.w of an internal node holds the bits of the OR of shape masks below it
+        // once PropagateMasks has been called
         //
         struct Node
         {
@@ -101,8 +107,32 @@ namespace RadeonRays
         };
 
         void Flush();
-        void Process(Bvh& bvh);
+        // Translate the tree level by level, large levels are split between concurrent jobs.
+        // If faces are passed the leafs get their indices right away and InjectIndices is not needed.
+        void Process(Bvh& bvh, Face const* faces = nullptr);
+        // Same as Process, but the nodes are written to out, which has to hold bvh.GetNumNodes() nodes.
+        // Out can be the upload source or a mapped device buffer, so the nodes are written once without
+        // an intermediate copy. nodes_ is left empty and the calls below work on out.
+        void ProcessInto(Bvh& bvh, Node* out, Face const* faces = nullptr);
         void InjectIndices(Face const* faces);
+        // Store the union of leaf shape masks of each subtree in its internal node,
+        // so masked traversal can skip whole subtrees. Leafs should have indices injected.
+        void PropagateMasks();
+        // Reorder nodes into van Emde Boas layout: the top half of the tree levels is stored first,
+        // followed by each of the subtrees hanging below it, all laid out the same way recursively.
+        // Nodes close in the tree end up close in memory regardless of cache line size.
+        // Parents still precede their children and the root stays at 0, so traversal is unchanged.
+        // The reordered nodes are copied back to the output of ProcessInto.
+        void ReorderVanEmdeBoas();
+        // Build perfect hash map from node indices in a complete tree to node addresses,
+        // required for stackless traversal, should be called after Process
+        void BuildHashMap();
+        // Recompute node bounds bottom-up from vertex positions keeping the topology,
+        // nodes should have indices injected
+        static void Refit(Node* nodes, int numnodes, float3 const* vertices);
+        // Returns true if any hit traversal should visit the right child first:
+        // leaf children go first, then the child with larger surface area
+        static bool GetOcclusionOrder(bbox const& lbounds, bool lleaf, bbox const& rbounds, bool rleaf);
         //void Process(Bvh const** bvhs, int const* offsets, int numbvhs);
         //void UpdateTopLevel(Bvh const& bvh);
 
@@ -117,7 +147,17 @@ namespace RadeonRays
         int max_idx_;
 
     private:
-        int ProcessRootNode(Bvh::Node const* node);
+        // Translate the tree level by level into out
+        void ProcessLevels(Bvh& bvh, Node* out, Face const* faces);
+
+        // Nodes being translated, nodes_ or the output of ProcessInto
+        Node* output_;
+
+        // Write node n of the nodes array at address idx, children of internal nodes are placed at childidx and childidx + 1
+        void ProcessNode(Bvh::Node const* nodes, Bvh::Node const* n, int idx, int childidx, Face const* faces);
+        static void InjectIndices(Node& node, Face const* faces);
+        // Append the top height levels of the subtree at root to order, nodes right below them go to bottom
+        void LayoutVanEmdeBoas(int root, int height, std::vector<int>& order, std::vector<int>& bottom) const;
         //int ProcessNode(Bvh::Node const* n, int offset);
 
         FatNodeBvhTranslator(FatNodeBvhTranslator const&);
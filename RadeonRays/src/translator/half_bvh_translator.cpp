@@ -0,0 +1,222 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "half_bvh_translator.h"
+#include "trace.h"
+
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <queue>
+
+namespace RadeonRays
+{
+    static_assert(sizeof(HalfBvhTranslator::Node) == 32, "Half BVH node size should match the one in the kernel");
+
+    namespace
+    {
+        // Largest finite half and the bit patterns around it
+        float const kMaxHalf = 65504.f;
+        std::uint16_t const kMaxHalfBits = 0x7bff;
+        std::uint16_t const kSignBit = 0x8000;
+    }
+
+    void HalfBvhTranslator::Process(Bvh const& bvh)
+    {
+        RR_TRACE_SCOPE("HalfBvhTranslator::Process");
+
+        // Check if we have been initialized
+        assert(bvh.m_nodecnt > 0);
+
+        nodes_.clear();
+        nodes_.reserve(bvh.m_nodecnt);
+
+        Bvh::Node const* bvhnodes = bvh.m_nodes.data();
+
+        // Keep the nodes to process here along with their addresses
+        std::queue<std::pair<Bvh::Node const*, int> > workqueue;
+
+        nodes_.push_back(Node());
+        workqueue.push(std::make_pair(bvhnodes, 0));
+
+        while (!workqueue.empty())
+        {
+            auto current = workqueue.front();
+            workqueue.pop();
+
+            Bvh::Node const* bvhnode = current.first;
+
+            if (bvhnode->type == Bvh::NodeType::kInternal)
+            {
+                // Both children are allocated together to keep them adjacent
+                int child0 = static_cast<int>(nodes_.size());
+                nodes_.resize(nodes_.size() + 2);
+
+                Bvh::Node const* lc = bvhnodes + bvhnode->lc;
+                Bvh::Node const* rc = bvhnodes + bvhnode->rc;
+
+                Node& node = nodes_[current.second];
+                EncodeBounds(lc->bounds, rc->bounds, node);
+                node.s0.order = FatNodeBvhTranslator::GetOcclusionOrder(lc->bounds, lc->type == Bvh::NodeType::kLeaf,
+                    rc->bounds, rc->type == Bvh::NodeType::kLeaf) ? 1 : 0;
+                node.child0 = child0;
+
+                workqueue.push(std::make_pair(lc, child0));
+                workqueue.push(std::make_pair(rc, child0 + 1));
+            }
+            else
+            {
+                Node& node = nodes_[current.second];
+                node.s1.i0 = bvhnode->startidx;
+                node.child0 = -1;
+            }
+        }
+    }
+
+    void HalfBvhTranslator::InjectIndices(Face const* faces)
+    {
+        for (auto& node : nodes_)
+        {
+            if (node.child0 == -1)
+            {
+                auto idx = node.s1.i0;
+                node.s1.i0 = faces[idx].idx[0];
+                node.s1.i1 = faces[idx].idx[1];
+                node.s1.i2 = faces[idx].idx[2];
+                node.s1.shape_id = faces[idx].shapeidx;
+                node.s1.prim_id = faces[idx].id;
+                node.s1.shape_mask = faces[idx].shape_mask;
+                node.s1.padding = 0;
+            }
+        }
+    }
+
+    void HalfBvhTranslator::Refit(Node* nodes, int numnodes, float3 const* vertices)
+    {
+        // Exact bounds of the nodes, parents are rounded from them rather than from decoded boxes
+        std::vector<bbox> bounds(numnodes);
+
+        // Children always follow their parent, so going backwards visits the nodes bottom-up
+        for (int i = numnodes - 1; i >= 0; --i)
+        {
+            Node& node = nodes[i];
+
+            if (node.child0 == -1)
+            {
+                bounds[i] = bbox(vertices[node.s1.i0]);
+                bounds[i].grow(vertices[node.s1.i1]);
+                bounds[i].grow(vertices[node.s1.i2]);
+            }
+            else
+            {
+                EncodeBounds(bounds[node.child0], bounds[node.child0 + 1], node);
+                node.s0.order = FatNodeBvhTranslator::GetOcclusionOrder(bounds[node.child0], nodes[node.child0].child0 == -1,
+                    bounds[node.child0 + 1], nodes[node.child0 + 1].child0 == -1) ? 1 : 0;
+                bounds[i] = bboxunion(bounds[node.child0], bounds[node.child0 + 1]);
+            }
+        }
+    }
+
+    void HalfBvhTranslator::EncodeBounds(bbox const& lbounds, bbox const& rbounds, Node& node)
+    {
+        bbox const* bounds[2] = { &lbounds, &rbounds };
+
+        for (int c = 0; c < 2; ++c)
+        {
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                node.s0.pmin[c * 3 + axis] = FloatToHalf(bounds[c]->pmin[axis], false);
+                node.s0.pmax[c * 3 + axis] = FloatToHalf(bounds[c]->pmax[axis], true);
+            }
+        }
+    }
+
+    bbox HalfBvhTranslator::DecodeBounds(Node const& node, int child)
+    {
+        float3 pmin, pmax;
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            pmin[axis] = HalfToFloat(node.s0.pmin[child * 3 + axis]);
+            pmax[axis] = HalfToFloat(node.s0.pmax[child * 3 + axis]);
+        }
+
+        return bbox(pmin, pmax);
+    }
+
+    std::uint16_t HalfBvhTranslator::FloatToHalf(float value, bool round_up)
+    {
+        std::uint16_t const sign = std::signbit(value) ? kSignBit : 0;
+        float const magnitude = std::fabs(value);
+        // Rounding away from zero is up for positive values and down for negative ones
+        bool const away_from_zero = (sign == 0) == round_up;
+
+        // Truncate the magnitude first, all the steps are exact in single precision
+        std::uint16_t bits = 0;
+        if (magnitude >= kMaxHalf)
+        {
+            bits = kMaxHalfBits;
+        }
+        else if (magnitude < std::ldexp(1.f, -14))
+        {
+            // Denormals are multiples of 2^-24
+            bits = static_cast<std::uint16_t>(std::ldexp(magnitude, 24));
+        }
+        else
+        {
+            int exponent = 0;
+            float const mantissa = std::frexp(magnitude, &exponent);
+            // mantissa is in [0.5, 1), half stores it as 1.m * 2^(exponent - 1) with the bias of 15
+            bits = static_cast<std::uint16_t>(((exponent + 14) << 10) |
+                static_cast<int>(std::ldexp(mantissa, 11) - 1024.f));
+        }
+
+        // Step to the next half away from zero if truncation lost anything, max half steps to infinity
+        if (away_from_zero && HalfToFloat(bits) < magnitude)
+        {
+            ++bits;
+        }
+
+        return sign | bits;
+    }
+
+    float HalfBvhTranslator::HalfToFloat(std::uint16_t value)
+    {
+        int const exponent = (value >> 10) & 0x1f;
+        int const mantissa = value & 0x3ff;
+
+        float magnitude = 0.f;
+        if (exponent == 0)
+        {
+            magnitude = std::ldexp(static_cast<float>(mantissa), -24);
+        }
+        else if (exponent == 0x1f)
+        {
+            magnitude = mantissa ? std::numeric_limits<float>::quiet_NaN() : std::numeric_limits<float>::infinity();
+        }
+        else
+        {
+            magnitude = std::ldexp(static_cast<float>(mantissa | 0x400), exponent - 25);
+        }
+
+        return (value & kSignBit) ? -magnitude : magnitude;
+    }
+}
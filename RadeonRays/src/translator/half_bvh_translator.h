@@ -0,0 +1,124 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef HALF_BVH_TRANSLATOR_H
+#define HALF_BVH_TRANSLATOR_H
+
+#include <cstdint>
+#include <vector>
+
+#include "radeon_rays.h"
+#include "../accelerator/bvh.h"
+#include "fatnode_bvh_translator.h"
+
+#include "math/float3.h"
+
+namespace RadeonRays
+{
+    /// Half translator transforms regular binary BVH into the layout of
+    /// QuantizedBvhTranslator, but child bounds are stored as IEEE half floats:
+    /// * Min bounds are rounded down and max bounds up, so decoded boxes always
+    ///   enclose the original ones
+    /// * Coordinates beyond the half range decode to infinity, which keeps the
+    ///   boxes conservative at the cost of extra traversal steps
+    /// * Right child immediately follows the left one, so a single address is stored
+    ///
+    /// Node size is 32 bytes, precision relative to the coordinate magnitude is 11 bits
+    /// compared to 8 bits relative to the parent extent for the quantized node.
+    ///
+    class HalfBvhTranslator
+    {
+    public:
+        using Face = FatNodeBvhTranslator::Face;
+
+        // Half BVH node
+        // Encoding:
+        // child0 == -1 if the node is a leaf, internal node children are at child0 and child0 + 1
+        //
+        struct Node
+        {
+            union
+            {
+                struct
+                {
+                    // Half bounds indexed as [child * 3 + axis]
+                    std::uint16_t pmin[6];
+                    std::uint16_t pmax[6];
+                    // 1 if any hit traversal should visit the right child first
+                    int order;
+                }s0;
+
+                struct
+                {
+                    // If node is a leaf we keep vertex indices here
+                    int i0, i1, i2;
+                    // Shape mask
+                    int shape_mask;
+                    // Shape ID
+                    int shape_id;
+                    // Primitive ID
+                    int prim_id;
+                    int padding;
+                }s1;
+            };
+
+            // Address of a left child
+            int child0;
+
+            Node()
+                : s1()
+                , child0(-1)
+            {
+            }
+        };
+
+        // Constructor
+        HalfBvhTranslator()
+        {
+        }
+
+        void Process(Bvh const& bvh);
+        void InjectIndices(Face const* faces);
+        // Recompute node bounds bottom-up from vertex positions keeping the topology,
+        // nodes should have indices injected
+        static void Refit(Node* nodes, int numnodes, float3 const* vertices);
+
+        // Decode child bounds the same way traversal kernel does
+        static bbox DecodeBounds(Node const& node, int child);
+
+        // Convert float to the closest half not greater (round_up == false) or not less than it
+        static std::uint16_t FloatToHalf(float value, bool round_up);
+        // Exact conversion of half to float
+        static float HalfToFloat(std::uint16_t value);
+
+        std::vector<Node> nodes_;
+
+    private:
+        // Round children bounds outwards into the node
+        static void EncodeBounds(bbox const& lbounds, bbox const& rbounds, Node& node);
+
+        HalfBvhTranslator(HalfBvhTranslator const&);
+        HalfBvhTranslator& operator =(HalfBvhTranslator const&);
+    };
+}
+
+
+#endif // HALF_BVH_TRANSLATOR_H
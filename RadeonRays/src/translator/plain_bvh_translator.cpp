@@ -24,8 +24,11 @@ THE SOFTWARE.
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
 #include "../except/except.h"
+#include "trace.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <stack>
 #include <iostream>
 
@@ -33,6 +36,8 @@ namespace RadeonRays
 {
     void PlainBvhTranslator::Process(Bvh& bvh)
     {
+        RR_TRACE_SCOPE("PlainBvhTranslator::Process");
+
         // WARNING: this is crucial in order for the nodes not to migrate in memory as push_back adds nodes
         nodecnt_ = 0;
         int newsize = bvh.m_nodecnt;
@@ -40,75 +45,81 @@ namespace RadeonRays
         extra_.resize(newsize);
 
         // Check if we have been initialized
-        assert(bvh.m_root);
+        assert(bvh.m_nodecnt > 0);
 
-        // Save current root position
-        int rootidx = 0;
+        nodecnt_ = ProcessTree(bvh, 0, 0, nodes_.data());
+    }
 
-        // Process root
-        ProcessNode(bvh.m_root);
+    int PlainBvhTranslator::ProcessInto(Bvh& bvh, Node* out)
+    {
+        RR_TRACE_SCOPE("PlainBvhTranslator::ProcessInto");
 
-        // Set next ptr
-        nodes_[rootidx].bounds.pmax.w = -1;
+        nodecnt_ = 0;
+        nodes_.clear();
+        extra_.resize(bvh.m_nodecnt);
 
-        //
-        for (int i = rootidx; i < (int)nodes_.size(); ++i)
-        {
-            if (nodes_[i].bounds.pmin.w != -1.f)
-            {
-                nodes_[i + 1].bounds.pmax.w = nodes_[i].bounds.pmin.w;
-                nodes_[(int)(nodes_[i].bounds.pmin.w)].bounds.pmax.w = nodes_[i].bounds.pmax.w;
-            }
-        }
+        // Check if we have been initialized
+        assert(bvh.m_nodecnt > 0);
 
-        for (int i = rootidx; i < (int)nodes_.size(); ++i)
-        {
-            if (nodes_[i].bounds.pmin.w == -1.f)
-            {
-                nodes_[i].bounds.pmin.w = (float)extra_[i];
-            }
-            else
-            {
-                nodes_[i].bounds.pmin.w = -1.f;
-            }
-        }
+        nodecnt_ = ProcessTree(bvh, 0, 0, out);
+        return nodecnt_;
     }
 
     void PlainBvhTranslator::UpdateTopLevel(Bvh const& bvh)
     {
-        nodecnt_ = root_;
+        RR_TRACE_SCOPE("PlainBvhTranslator::UpdateTopLevel");
+
+        ProcessTree(bvh, root_, 0, nodes_.data());
+    }
+
+    int PlainBvhTranslator::UpdateBottomLevel(int idx, Bvh const& bvh, int offset)
+    {
+        // The topology is unchanged, so nodes land at the same positions
+        return ProcessTree(bvh, roots_[idx], offset, nodes_.data());
+    }
+
+    int PlainBvhTranslator::ProcessAt(Bvh const& bvh, int rootidx, int offset)
+    {
+        assert(rootidx + bvh.m_nodecnt <= (int)nodes_.size());
+
+        return ProcessTree(bvh, rootidx, offset, nodes_.data());
+    }
+
+    void PlainBvhTranslator::ProcessBounds(Bvh const& bvh, bbox const* bounds, std::vector<Node>& nodes) const
+    {
+        nodes.resize(bvh.m_nodecnt);
 
-        // Process root
-        ProcessNode(bvh.m_root);
+        Node* out = nodes.data();
+        ProcessBoundsNode(bvh.m_nodes.data(), bvh.m_nodes.data(), bounds, bvh.GetIndices(), out);
+    }
 
-        // Set next ptr
-        nodes_[root_].bounds.pmax.w = -1;
+    bbox PlainBvhTranslator::ProcessBoundsNode(Bvh::Node const* nodes, Bvh::Node const* n, bbox const* bounds, int const* indices, Node*& out) const
+    {
+        // Nodes are written in the same depth first order as ProcessNode
+        Node& node = *out++;
+        node.bounds = bbox();
 
-        for (int j = root_; j < root_ + bvh.m_nodecnt; ++j)
+        if (n->type == Bvh::kLeaf)
         {
-            if (nodes_[j].bounds.pmin.w != -1.f)
+            for (int i = 0; i < n->numprims; ++i)
             {
-                nodes_[j + 1].bounds.pmax.w = nodes_[j].bounds.pmin.w;
-                nodes_[(int)(nodes_[j].bounds.pmin.w)].bounds.pmax.w = nodes_[j].bounds.pmax.w;
+                node.bounds.grow(bounds[indices[n->startidx + i]]);
             }
         }
-
-        for (int j = root_; j < root_ + bvh.m_nodecnt; ++j)
+        else
         {
-            if (nodes_[j].bounds.pmin.w == -1.f)
-            {
-                nodes_[j].bounds.pmin.w = (float)extra_[j];
-            }
-            else
-            {
-                nodes_[j].bounds.pmin.w = -1.f;
-            }
+            bbox const lbounds = ProcessBoundsNode(nodes, nodes + n->lc, bounds, indices, out);
+            bbox const rbounds = ProcessBoundsNode(nodes, nodes + n->rc, bounds, indices, out);
+            node.bounds = bboxunion(lbounds, rbounds);
         }
 
+        return node.bounds;
     }
 
     void PlainBvhTranslator::Process(Bvh const** bvhs, int const* offsets, int numbvhs)
     {
+        RR_TRACE_SCOPE("PlainBvhTranslator::Process");
+
         // First of all count the number of required nodes for all BVH's
         int nodecnt = 0;
         for (int i = 0; i < numbvhs + 1; ++i)
@@ -132,114 +143,220 @@ namespace RadeonRays
                 continue;
             }
 
-            int currentroot = nodecnt_;
+            roots_[i] = nodecnt_;
+            nodecnt_ += ProcessTree(*bvhs[i], nodecnt_, offsets[i], nodes_.data());
+        }
+
+        // The final one
+        root_ = nodecnt_;
+        nodecnt_ += ProcessTree(*bvhs[numbvhs], root_, 0, nodes_.data());
+    }
+
+    void PlainBvhTranslator::ProcessOctantLinks(Node const* nodes, int numnodes, std::vector<int>& links)
+    {
+        RR_TRACE_SCOPE("PlainBvhTranslator::ProcessOctantLinks");
 
-            roots_[i] = currentroot;
-            
-            // Process root
-            ProcessNode(bvhs[i]->m_root, offsets[i]);
+        links.resize(8 * 2 * numnodes);
 
-            // Set next ptr
-            nodes_[currentroot].bounds.pmax.w = -1;
+        for (int octant = 0; octant < 8; ++octant)
+        {
+            int* octantlinks = &links[octant * 2 * numnodes];
+
+            // Nodes to link along with the address to skip to after their subtree
+            std::stack<std::pair<int, int> > stack;
+            stack.push(std::make_pair(0, -1));
 
-            for (int j = currentroot; j < currentroot + bvhs[i]->m_nodecnt; ++j)
+            while (!stack.empty())
             {
-                if (nodes_[j].bounds.pmin.w != -1.f)
+                int const idx = stack.top().first;
+                int const next = stack.top().second;
+                stack.pop();
+
+                octantlinks[2 * idx + 1] = next;
+
+                if (nodes[idx].bounds.pmin.w != -1.f)
                 {
-                    nodes_[j + 1].bounds.pmax.w = nodes_[j].bounds.pmin.w;
-                    nodes_[(int)(nodes_[j].bounds.pmin.w)].bounds.pmax.w = nodes_[j].bounds.pmax.w;
+                    octantlinks[2 * idx] = next;
+                    continue;
                 }
+
+                // Left child follows its parent, the right one is where the left one skips to
+                int const left = idx + 1;
+                int const right = (int)nodes[left].bounds.pmax.w;
+
+                float3 const delta = nodes[right].bounds.center() - nodes[left].bounds.center();
+                int const axis = std::fabs(delta.x) >= std::max(std::fabs(delta.y), std::fabs(delta.z)) ? 0 :
+                    (std::fabs(delta.y) >= std::fabs(delta.z) ? 1 : 2);
+
+                // Octant bit is set for negative direction along the axis
+                bool const negative = (octant >> axis) & 1;
+                bool const rightfirst = negative ? delta[axis] > 0.f : delta[axis] < 0.f;
+
+                int const first = rightfirst ? right : left;
+                int const second = rightfirst ? left : right;
+
+                octantlinks[2 * idx] = first;
+                stack.push(std::make_pair(second, next));
+                stack.push(std::make_pair(first, second));
             }
+        }
+    }
+
+    int PlainBvhTranslator::ProcessTree(Bvh const& bvh, int rootidx, int offset, Node* out)
+    {
+        int numnodes = bvh.m_nodecnt;
+        int numjobs = Bvh::GetNumJobs(numnodes, 0);
+        Bvh::Node const* nodes = bvh.m_nodes.data();
 
-            for (int j = currentroot; j < currentroot + bvhs[i]->m_nodecnt; ++j)
+        if (numjobs == 1)
+        {
+            ProcessNode(nodes, nodes, rootidx, -1, offset, out);
+        }
+        else
+        {
+            // Subtrees below the top levels are sized and then translated by concurrent jobs,
+            // the few nodes above them are laid out here
+            int maxlevel = bvh.m_num_parallel_levels;
+            std::vector<Subtree> subtrees;
+            CollectSubtrees(nodes, nodes, 0, maxlevel, subtrees);
+
+            Bvh::ParallelForChunks(numjobs, 0, (int)subtrees.size(), [nodes, &subtrees](int, int begin, int end)
             {
-                if (nodes_[j].bounds.pmin.w == -1.f)
+                for (int i = begin; i < end; ++i)
                 {
-                    nodes_[j].bounds.pmin.w = (float)extra_[j];
+                    subtrees[i].numnodes = GetNodeCount(nodes, subtrees[i].node);
                 }
-                else
+            });
+
+            int subtreeidx = 0;
+            ProcessTopNode(nodes, nodes, 0, maxlevel, rootidx, -1, subtrees, subtreeidx, out);
+
+            Bvh::ParallelForChunks(numjobs, 0, (int)subtrees.size(), [this, nodes, &subtrees, offset, out](int, int begin, int end)
+            {
+                for (int i = begin; i < end; ++i)
                 {
-                    nodes_[j].bounds.pmin.w = -1.f;
+                    ProcessNode(nodes, subtrees[i].node, subtrees[i].idx, subtrees[i].next, offset, out);
                 }
-            }
+            });
         }
 
-        // The final one
-        root_ = nodecnt_;
-
-        // Process root
-        ProcessNode(bvhs[numbvhs]->m_root);
+        return numnodes;
+    }
 
-        // Set next ptr
-        nodes_[root_].bounds.pmax.w = -1;
+    // Encoding:
+    // bounds.pmin.w is -1 for internal nodes, (startidx << 4) | numprims for leafs,
+    // bounds.pmax.w is the address to continue with if the node is missed, -1 for the root.
+    // The left child follows its parent, so the right child is where the left one skips to.
+    int PlainBvhTranslator::ProcessNode(Bvh::Node const* nodes, Bvh::Node const* n, int idx, int next, int offset, Node* out)
+    {
+        Node& node = out[idx];
+        node.bounds = n->bounds;
+        node.bounds.pmax.w = (float)next;
 
-        for (int j = root_; j < root_ + bvhs[numbvhs]->m_nodecnt; ++j)
+        if (n->type == Bvh::kLeaf)
         {
-            if (nodes_[j].bounds.pmin.w != -1.f)
-            {
-                nodes_[j + 1].bounds.pmax.w = nodes_[j].bounds.pmin.w;
-                nodes_[(int)(nodes_[j].bounds.pmin.w)].bounds.pmax.w = nodes_[j].bounds.pmax.w;
-            }
+            int startidx = n->startidx + offset;
+            extra_[idx] = (startidx << 4) | (n->numprims & 0xF);
+            node.bounds.pmin.w = (float)extra_[idx];
+            return idx + 1;
         }
 
-        for (int j = root_; j < root_ + bvhs[numbvhs]->m_nodecnt; ++j)
+        node.bounds.pmin.w = -1.f;
+
+        int right = ProcessNode(nodes, nodes + n->lc, idx + 1, next, offset, out);
+
+        // The right child address is known once the left subtree is written,
+        // patch it into the nodes on the right spine of the left subtree
+        Bvh::Node const* spine = nodes + n->lc;
+        int spineidx = idx + 1;
+        for (;;)
         {
-            if (nodes_[j].bounds.pmin.w == -1.f)
-            {
-                nodes_[j].bounds.pmin.w = (float)extra_[j];
-            }
-            else
+            out[spineidx].bounds.pmax.w = (float)right;
+
+            if (spine->type == Bvh::kLeaf)
             {
-                nodes_[j].bounds.pmin.w = -1.f;
+                break;
             }
+
+            // The left child of a spine node skips to its right sibling
+            spineidx = (int)out[spineidx + 1].bounds.pmax.w;
+            spine = nodes + spine->rc;
         }
 
+        return ProcessNode(nodes, nodes + n->rc, right, next, offset, out);
     }
 
-    int PlainBvhTranslator::ProcessNode(Bvh::Node const* n)
+    int PlainBvhTranslator::ProcessTopNode(Bvh::Node const* nodes, Bvh::Node const* n, int level, int maxlevel, int idx, int next,
+        std::vector<Subtree>& subtrees, int& subtreeidx, Node* out)
     {
-        int idx = nodecnt_;
-        //std::cout << "Index " << idx << "\n";
-        Node& node = nodes_[nodecnt_];
+        if (level == maxlevel || n->type == Bvh::kLeaf)
+        {
+            Subtree& subtree = subtrees[subtreeidx++];
+            subtree.idx = idx;
+            subtree.next = next;
+            return subtree.numnodes;
+        }
+
+        Node& node = out[idx];
         node.bounds = n->bounds;
-        int& extra = extra_[nodecnt_++];
+        node.bounds.pmin.w = -1.f;
+        node.bounds.pmax.w = (float)next;
 
-        if (n->type == Bvh::kLeaf)
+        int leftidx = subtreeidx;
+        int right = idx + 1 + GetTopNodeCount(nodes, nodes + n->lc, level + 1, maxlevel, subtrees, leftidx);
+
+        int numleft = ProcessTopNode(nodes, nodes + n->lc, level + 1, maxlevel, idx + 1, right, subtrees, subtreeidx, out);
+        int numright = ProcessTopNode(nodes, nodes + n->rc, level + 1, maxlevel, right, next, subtrees, subtreeidx, out);
+
+        return 1 + numleft + numright;
+    }
+
+    void PlainBvhTranslator::CollectSubtrees(Bvh::Node const* nodes, Bvh::Node const* n, int level, int maxlevel, std::vector<Subtree>& subtrees)
+    {
+        // Subtrees are collected in depth first order, the same order ProcessTopNode visits them
+        if (level == maxlevel || n->type == Bvh::kLeaf)
         {
-            int startidx = n->startidx;
-            extra = (startidx << 4) | (n->numprims & 0xF);
-            node.bounds.pmin.w = -1.f;
+            Subtree subtree = { n, 0, 0, 0 };
+            subtrees.push_back(subtree);
+            return;
         }
-        else
+
+        CollectSubtrees(nodes, nodes + n->lc, level + 1, maxlevel, subtrees);
+        CollectSubtrees(nodes, nodes + n->rc, level + 1, maxlevel, subtrees);
+    }
+
+    int PlainBvhTranslator::GetTopNodeCount(Bvh::Node const* nodes, Bvh::Node const* n, int level, int maxlevel, std::vector<Subtree> const& subtrees, int& subtreeidx)
+    {
+        if (level == maxlevel || n->type == Bvh::kLeaf)
         {
-            ProcessNode(n->lc);
-            node.bounds.pmin.w = (float)ProcessNode(n->rc);
+            return subtrees[subtreeidx++].numnodes;
         }
 
-        return idx;
+        int numleft = GetTopNodeCount(nodes, nodes + n->lc, level + 1, maxlevel, subtrees, subtreeidx);
+        int numright = GetTopNodeCount(nodes, nodes + n->rc, level + 1, maxlevel, subtrees, subtreeidx);
+        return 1 + numleft + numright;
     }
 
-    int PlainBvhTranslator::ProcessNode(Bvh::Node const* n, int offset)
+    int PlainBvhTranslator::GetNodeCount(Bvh::Node const* nodes, Bvh::Node const* n)
     {
-        int idx = nodecnt_;
-        //std::cout << "Index " << idx << "\n";
-        Node& node = nodes_[nodecnt_];
-        node.bounds = n->bounds;
-        int& extra = extra_[nodecnt_++];
+        std::stack<Bvh::Node const*> stack;
+        stack.push(n);
 
-        if (n->type == Bvh::kLeaf)
+        int numnodes = 0;
+        while (!stack.empty())
         {
-            int startidx = n->startidx + offset;
-            extra = (startidx << 4) | (n->numprims & 0xF);
-            node.bounds.pmin.w = -1.f;
-        }
-        else
-        {
-            ProcessNode(n->lc, offset);
-            node.bounds.pmin.w = (float)ProcessNode(n->rc, offset);
+            Bvh::Node const* current = stack.top();
+            stack.pop();
+            ++numnodes;
+
+            if (current->type == Bvh::kInternal)
+            {
+                stack.push(nodes + current->lc);
+                stack.push(nodes + current->rc);
+            }
         }
 
-        return idx;
+        return numnodes;
     }
 
 
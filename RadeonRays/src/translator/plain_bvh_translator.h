@@ -55,8 +55,26 @@ namespace RadeonRays
 
         void Flush();
         void Process(Bvh& bvh);
+        // Same as Process, but the nodes are written to out, which has to hold bvh.GetNumNodes() nodes.
+        // Out can be the upload source or a mapped device buffer, so the nodes are written once without
+        // an intermediate copy. nodes_ is left empty, returns the number of nodes.
+        int ProcessInto(Bvh& bvh, Node* out);
         void Process(Bvh const** bvhs, int const* offsets, int numbvhs);
         void UpdateTopLevel(Bvh const& bvh);
+        // Translate the refitted BVH idx of Process(bvhs, offsets, numbvhs) again in place,
+        // returns the number of nodes starting at roots_[idx]
+        int UpdateBottomLevel(int idx, Bvh const& bvh, int offset);
+        // Translate a single tree at rootidx, nodes_ has to be large enough to hold it,
+        // leaf primitive indices are shifted by offset, returns the number of nodes.
+        // Only the nodes of the tree are written, so disjoint trees can be translated concurrently.
+        int ProcessAt(Bvh const& bvh, int rootidx, int offset);
+        // Write node bounds recomputed from primitive bounds in the node order of UpdateTopLevel,
+        // the tree is left untouched and no links are written
+        void ProcessBounds(Bvh const& bvh, bbox const* bounds, std::vector<Node>& nodes) const;
+        // Write (first child, skip link) pairs of a single translated tree for each of the 8 ray direction
+        // octants, links of octant o start at o * numnodes. Children are ordered along the axis separating
+        // their centroids the most, leaves have the skip link in place of the first child.
+        static void ProcessOctantLinks(Node const* nodes, int numnodes, std::vector<int>& links);
 
         std::vector<Node> nodes_;
         std::vector<int>  extra_;
@@ -65,8 +83,28 @@ namespace RadeonRays
         int root_;
 
     private:
-        int ProcessNode(Bvh::Node const* node);
-        int ProcessNode(Bvh::Node const* n, int offset);
+        // Subtree translated by a single job
+        struct Subtree
+        {
+            Bvh::Node const* node;
+            int numnodes;
+            int idx;
+            int next;
+        };
+
+        // Translate the tree into out starting at rootidx, subtrees are translated concurrently
+        // for large trees, returns the number of nodes
+        int ProcessTree(Bvh const& bvh, int rootidx, int offset, Node* out);
+        // Node n points into the nodes array of the translated tree, children are resolved through it
+        // Write the subtree in depth first order at idx of out with the final encoding, next is the
+        // address to skip to on a miss, returns the address following the subtree
+        int ProcessNode(Bvh::Node const* nodes, Bvh::Node const* n, int idx, int next, int offset, Node* out);
+        // Lay out the nodes above the concurrently translated subtrees, returns the number of nodes
+        int ProcessTopNode(Bvh::Node const* nodes, Bvh::Node const* n, int level, int maxlevel, int idx, int next, std::vector<Subtree>& subtrees, int& subtreeidx, Node* out);
+        static void CollectSubtrees(Bvh::Node const* nodes, Bvh::Node const* n, int level, int maxlevel, std::vector<Subtree>& subtrees);
+        static int GetTopNodeCount(Bvh::Node const* nodes, Bvh::Node const* n, int level, int maxlevel, std::vector<Subtree> const& subtrees, int& subtreeidx);
+        static int GetNodeCount(Bvh::Node const* nodes, Bvh::Node const* n);
+        bbox ProcessBoundsNode(Bvh::Node const* nodes, Bvh::Node const* n, bbox const* bounds, int const* indices, Node*& out) const;
 
         PlainBvhTranslator(PlainBvhTranslator const&);
         PlainBvhTranslator& operator =(PlainBvhTranslator const&);
@@ -0,0 +1,216 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "quantized_bvh_translator.h"
+#include "trace.h"
+
+#include <cassert>
+#include <cmath>
+#include <queue>
+
+namespace RadeonRays
+{
+    static_assert(sizeof(QuantizedBvhTranslator::Node) == 32, "Quantized BVH node size should match the one in the kernel");
+
+    namespace
+    {
+        // Power of two scale corresponding to the biased exponent
+        inline float GetScale(int biased_exponent)
+        {
+            return std::ldexp(1.f, biased_exponent - QuantizedBvhTranslator::kExponentBias);
+        }
+
+        // Dequantize a grid coordinate, q * scale is exact so the result
+        // matches the kernel regardless of mad contraction
+        inline float Dequantize(float origin, float scale, int q)
+        {
+            return origin + static_cast<float>(q) * scale;
+        }
+    }
+
+    void QuantizedBvhTranslator::Process(Bvh const& bvh)
+    {
+        RR_TRACE_SCOPE("QuantizedBvhTranslator::Process");
+
+        // Check if we have been initialized
+        assert(bvh.m_nodecnt > 0);
+
+        nodes_.clear();
+        nodes_.reserve(bvh.m_nodecnt);
+
+        Bvh::Node const* bvhnodes = bvh.m_nodes.data();
+
+        // Keep the nodes to process here along with their addresses
+        std::queue<std::pair<Bvh::Node const*, int> > workqueue;
+
+        nodes_.push_back(Node());
+        workqueue.push(std::make_pair(bvhnodes, 0));
+
+        while (!workqueue.empty())
+        {
+            auto current = workqueue.front();
+            workqueue.pop();
+
+            Bvh::Node const* bvhnode = current.first;
+
+            if (bvhnode->type == Bvh::NodeType::kInternal)
+            {
+                // Both children are allocated together to keep them adjacent
+                int child0 = static_cast<int>(nodes_.size());
+                nodes_.resize(nodes_.size() + 2);
+
+                Bvh::Node const* lc = bvhnodes + bvhnode->lc;
+                Bvh::Node const* rc = bvhnodes + bvhnode->rc;
+
+                Node& node = nodes_[current.second];
+                EncodeBounds(lc->bounds, rc->bounds, node);
+                node.s0.exponent[3] = FatNodeBvhTranslator::GetOcclusionOrder(lc->bounds, lc->type == Bvh::NodeType::kLeaf,
+                    rc->bounds, rc->type == Bvh::NodeType::kLeaf) ? 1 : 0;
+                node.child0 = child0;
+
+                workqueue.push(std::make_pair(lc, child0));
+                workqueue.push(std::make_pair(rc, child0 + 1));
+            }
+            else
+            {
+                Node& node = nodes_[current.second];
+                node.s1.i0 = bvhnode->startidx;
+                node.child0 = -1;
+            }
+        }
+    }
+
+    void QuantizedBvhTranslator::InjectIndices(Face const* faces)
+    {
+        for (auto& node : nodes_)
+        {
+            if (node.child0 == -1)
+            {
+                auto idx = node.s1.i0;
+                node.s1.i0 = faces[idx].idx[0];
+                node.s1.i1 = faces[idx].idx[1];
+                node.s1.i2 = faces[idx].idx[2];
+                node.s1.shape_id = faces[idx].shapeidx;
+                node.s1.prim_id = faces[idx].id;
+                node.s1.shape_mask = faces[idx].shape_mask;
+                node.s1.padding = 0;
+            }
+        }
+    }
+
+    void QuantizedBvhTranslator::Refit(Node* nodes, int numnodes, float3 const* vertices)
+    {
+        // Exact bounds of the nodes, grids are fitted to them rather than to decoded boxes
+        std::vector<bbox> bounds(numnodes);
+
+        // Children always follow their parent, so going backwards visits the nodes bottom-up
+        for (int i = numnodes - 1; i >= 0; --i)
+        {
+            Node& node = nodes[i];
+
+            if (node.child0 == -1)
+            {
+                bounds[i] = bbox(vertices[node.s1.i0]);
+                bounds[i].grow(vertices[node.s1.i1]);
+                bounds[i].grow(vertices[node.s1.i2]);
+            }
+            else
+            {
+                EncodeBounds(bounds[node.child0], bounds[node.child0 + 1], node);
+                node.s0.exponent[3] = FatNodeBvhTranslator::GetOcclusionOrder(bounds[node.child0], nodes[node.child0].child0 == -1,
+                    bounds[node.child0 + 1], nodes[node.child0 + 1].child0 == -1) ? 1 : 0;
+                bounds[i] = bboxunion(bounds[node.child0], bounds[node.child0 + 1]);
+            }
+        }
+    }
+
+    void QuantizedBvhTranslator::EncodeBounds(bbox const& lbounds, bbox const& rbounds, Node& node)
+    {
+        bbox const* bounds[2] = { &lbounds, &rbounds };
+        bbox const parent = bboxunion(lbounds, rbounds);
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float const origin = parent.pmin[axis];
+            float const extent = parent.pmax[axis] - origin;
+
+            // Pick the smallest power of two scale covering the extent with the grid
+            int exponent = 1;
+            if (extent > 0.f)
+            {
+                int e = 0;
+                std::frexp(extent / kNumQuantizationSteps, &e);
+                exponent = std::min(std::max(e - 1 + kExponentBias, 1), 2 * kExponentBias);
+            }
+
+            while (exponent < 2 * kExponentBias &&
+                   Dequantize(origin, GetScale(exponent), kNumQuantizationSteps) < parent.pmax[axis])
+            {
+                ++exponent;
+            }
+
+            float const scale = GetScale(exponent);
+
+            node.s0.origin[axis] = origin;
+            node.s0.exponent[axis] = static_cast<std::uint8_t>(exponent);
+
+            for (int c = 0; c < 2; ++c)
+            {
+                float const pmin = bounds[c]->pmin[axis];
+                float const pmax = bounds[c]->pmax[axis];
+
+                int qmin = static_cast<int>(std::floor((pmin - origin) / scale));
+                int qmax = static_cast<int>(std::ceil((pmax - origin) / scale));
+                qmin = std::min(std::max(qmin, 0), kNumQuantizationSteps);
+                qmax = std::min(std::max(qmax, 0), kNumQuantizationSteps);
+
+                // Fix up rounding of the division to stay conservative
+                while (qmin > 0 && Dequantize(origin, scale, qmin) > pmin)
+                {
+                    --qmin;
+                }
+
+                while (qmax < kNumQuantizationSteps && Dequantize(origin, scale, qmax) < pmax)
+                {
+                    ++qmax;
+                }
+
+                node.s0.qmin[c * 3 + axis] = static_cast<std::uint8_t>(qmin);
+                node.s0.qmax[c * 3 + axis] = static_cast<std::uint8_t>(qmax);
+            }
+        }
+
+    }
+
+    bbox QuantizedBvhTranslator::DecodeBounds(Node const& node, int child)
+    {
+        float3 pmin, pmax;
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float const scale = GetScale(node.s0.exponent[axis]);
+            pmin[axis] = Dequantize(node.s0.origin[axis], scale, node.s0.qmin[child * 3 + axis]);
+            pmax[axis] = Dequantize(node.s0.origin[axis], scale, node.s0.qmax[child * 3 + axis]);
+        }
+
+        return bbox(pmin, pmax);
+    }
+}
@@ -0,0 +1,126 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef QUANTIZED_BVH_TRANSLATOR_H
+#define QUANTIZED_BVH_TRANSLATOR_H
+
+#include <cstdint>
+#include <vector>
+
+#include "radeon_rays.h"
+#include "../accelerator/bvh.h"
+#include "fatnode_bvh_translator.h"
+
+#include "math/float3.h"
+
+namespace RadeonRays
+{
+    /// Quantized translator transforms regular binary BVH into the same layout
+    /// as FatNodeBvhTranslator, but child bounds are stored as 8-bit offsets:
+    /// * Each node keeps a grid spanning the union of its children, defined by
+    ///   an origin and a power of two scale per axis
+    /// * Child bounds are rounded outwards to the grid, so decoded boxes always
+    ///   enclose the original ones
+    /// * Right child immediately follows the left one, so a single address is stored
+    ///
+    /// Node size is 32 bytes compared to 64 bytes of the fat node.
+    ///
+    class QuantizedBvhTranslator
+    {
+    public:
+        using Face = FatNodeBvhTranslator::Face;
+
+        // Number of quantization steps per axis
+        static int constexpr kNumQuantizationSteps = 255;
+        // Exponent bias of the grid scale, same as IEEE single precision
+        static int constexpr kExponentBias = 127;
+
+        // Quantized BVH node
+        // Encoding:
+        // child0 == -1 if the node is a leaf, internal node children are at child0 and child0 + 1
+        //
+        struct Node
+        {
+            union
+            {
+                struct
+                {
+                    // Grid origin (min corner of the children union)
+                    float origin[3];
+                    // Biased exponents of the grid scale per axis, last one is 1 if
+                    // any hit traversal should visit the right child first
+                    std::uint8_t exponent[4];
+                    // Quantized child bounds indexed as [child * 3 + axis]
+                    std::uint8_t qmin[6];
+                    std::uint8_t qmax[6];
+                }s0;
+
+                struct
+                {
+                    // If node is a leaf we keep vertex indices here
+                    int i0, i1, i2;
+                    // Shape mask
+                    int shape_mask;
+                    // Shape ID
+                    int shape_id;
+                    // Primitive ID
+                    int prim_id;
+                    int padding;
+                }s1;
+            };
+
+            // Address of a left child
+            int child0;
+
+            Node()
+                : s0()
+                , child0(-1)
+            {
+            }
+        };
+
+        // Constructor
+        QuantizedBvhTranslator()
+        {
+        }
+
+        void Process(Bvh const& bvh);
+        void InjectIndices(Face const* faces);
+        // Recompute node bounds bottom-up from vertex positions keeping the topology,
+        // nodes should have indices injected
+        static void Refit(Node* nodes, int numnodes, float3 const* vertices);
+
+        // Decode child bounds the same way traversal kernel does
+        static bbox DecodeBounds(Node const& node, int child);
+
+        std::vector<Node> nodes_;
+
+    private:
+        // Quantize children bounds into the node
+        static void EncodeBounds(bbox const& lbounds, bbox const& rbounds, Node& node);
+
+        QuantizedBvhTranslator(QuantizedBvhTranslator const&);
+        QuantizedBvhTranslator& operator =(QuantizedBvhTranslator const&);
+    };
+}
+
+
+#endif // QUANTIZED_BVH_TRANSLATOR_H
@@ -0,0 +1,163 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "wide_bvh_translator.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cassert>
+#include <queue>
+
+namespace RadeonRays
+{
+    void WideBvhTranslator::SetChild(Node& node, int slot, bbox const& bounds, int address) const
+    {
+        node.minx[slot] = bounds.pmin.x;
+        node.miny[slot] = bounds.pmin.y;
+        node.minz[slot] = bounds.pmin.z;
+        node.maxx[slot] = bounds.pmax.x;
+        node.maxy[slot] = bounds.pmax.y;
+        node.maxz[slot] = bounds.pmax.z;
+        node.child[slot] = address;
+    }
+
+    void WideBvhTranslator::Process(Bvh const& bvh)
+    {
+        RR_TRACE_SCOPE("WideBvhTranslator::Process");
+
+        // Check if we have been initialized
+        assert(bvh.m_nodecnt > 0);
+
+        Bvh::Node const* bvhnodes = bvh.m_nodes.data();
+
+        // Wide tree never has more nodes than the binary one
+        nodes_.clear();
+        nodes_.reserve(bvh.m_nodecnt);
+        depth_ = 0;
+
+        // Keep binary nodes to collapse along with their wide node address and level
+        struct Request
+        {
+            Bvh::Node const* node;
+            int address;
+            int level;
+        };
+
+        std::queue<Request> workqueue;
+
+        nodes_.push_back(Node());
+        workqueue.push(Request{ bvhnodes, 0, 1 });
+
+        while (!workqueue.empty())
+        {
+            auto current = workqueue.front();
+            workqueue.pop();
+
+            depth_ = std::max(depth_, current.level);
+
+            // Gather up to kWidth children pulling up the largest internal ones
+            Bvh::Node const* children[kWidth];
+            int numchildren = 0;
+
+            if (current.node->type == Bvh::NodeType::kLeaf)
+            {
+                // Only happens for a single primitive tree
+                children[numchildren++] = current.node;
+            }
+            else
+            {
+                children[numchildren++] = bvhnodes + current.node->lc;
+                children[numchildren++] = bvhnodes + current.node->rc;
+
+                while (numchildren < kWidth)
+                {
+                    int best = -1;
+                    float bestarea = -1.f;
+
+                    for (int i = 0; i < numchildren; ++i)
+                    {
+                        if (children[i]->type == Bvh::NodeType::kInternal &&
+                            children[i]->bounds.surface_area() > bestarea)
+                        {
+                            best = i;
+                            bestarea = children[i]->bounds.surface_area();
+                        }
+                    }
+
+                    // All the children are leaves
+                    if (best == -1)
+                        break;
+
+                    Bvh::Node const* collapsed = children[best];
+                    children[best] = bvhnodes + collapsed->lc;
+                    children[numchildren++] = bvhnodes + collapsed->rc;
+                }
+            }
+
+            // Any hit traversal visits children in slot order, so leaves go first
+            // followed by the children with larger area which are more likely to be hit
+            std::stable_sort(children, children + numchildren, [](Bvh::Node const* lhs, Bvh::Node const* rhs)
+            {
+                if (lhs->type != rhs->type)
+                {
+                    return lhs->type == Bvh::NodeType::kLeaf;
+                }
+
+                return lhs->bounds.surface_area() > rhs->bounds.surface_area();
+            });
+
+            // Empty slots are skipped by address, give them degenerate bounds
+            // to avoid producing infinities in the slab test
+            Node node;
+            for (int i = 0; i < kWidth; ++i)
+            {
+                SetChild(node, i, bbox(float3(0.f, 0.f, 0.f)), kInvalidChild);
+            }
+
+            node.numchildren = numchildren;
+            for (int i = 0; i < kWidth - 1; ++i)
+            {
+                node.padding[i] = 0;
+            }
+
+            for (int i = 0; i < numchildren; ++i)
+            {
+                int address = kInvalidChild;
+
+                if (children[i]->type == Bvh::NodeType::kLeaf)
+                {
+                    assert(children[i]->numprims == 1);
+                    address = EncodeLeaf(children[i]->startidx);
+                }
+                else
+                {
+                    address = static_cast<int>(nodes_.size());
+                    nodes_.push_back(Node());
+                    workqueue.push(Request{ children[i], address, current.level + 1 });
+                }
+
+                SetChild(node, i, children[i]->bounds, address);
+            }
+
+            nodes_[current.address] = node;
+        }
+    }
+}
@@ -0,0 +1,94 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef WIDE_BVH_TRANSLATOR_H
+#define WIDE_BVH_TRANSLATOR_H
+
+#include <vector>
+
+#include "radeon_rays.h"
+#include "../accelerator/bvh.h"
+
+#include "math/float3.h"
+
+namespace RadeonRays
+{
+    /// Wide translator collapses regular binary BVH into 4-wide BVH:
+    /// * Each node contains bounding boxes of up to 4 children in SoA form,
+    ///   so all 4 boxes can be tested with a single vectorized slab test
+    /// * Internal nodes are collapsed greedily pulling up the children
+    ///   with the largest surface area first
+    /// * Children follow parent node in the layout (breadth first)
+    ///
+    class WideBvhTranslator
+    {
+    public:
+        // Branching factor
+        static int constexpr kWidth = 4;
+
+        // Child address encoding
+        // Empty child slot
+        static int constexpr kInvalidChild = -1;
+        // Leaves are encoded as -(startidx + 2), where startidx points into Bvh::GetIndices()
+        static int EncodeLeaf(int startidx) { return -(startidx + 2); }
+
+        // Wide BVH node, 128 bytes
+        struct Node
+        {
+            // Children bounding boxes
+            float minx[kWidth];
+            float miny[kWidth];
+            float minz[kWidth];
+            float maxx[kWidth];
+            float maxy[kWidth];
+            float maxz[kWidth];
+            // Children addresses
+            int child[kWidth];
+            // Number of valid children
+            int numchildren;
+            int padding[kWidth - 1];
+        };
+
+        // Constructor
+        WideBvhTranslator()
+            : depth_(0)
+        {
+        }
+
+        void Process(Bvh const& bvh);
+
+        // Number of wide tree levels
+        int GetDepth() const { return depth_; }
+
+        std::vector<Node> nodes_;
+
+    private:
+        // Fill child slot of a wide node
+        void SetChild(Node& node, int slot, bbox const& bounds, int address) const;
+
+        int depth_;
+
+        WideBvhTranslator(WideBvhTranslator const&);
+        WideBvhTranslator& operator =(WideBvhTranslator const&);
+    };
+}
+
+#endif // WIDE_BVH_TRANSLATOR_H
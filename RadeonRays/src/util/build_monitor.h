@@ -0,0 +1,109 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef BUILD_MONITOR_H
+#define BUILD_MONITOR_H
+
+#include "progressreporter.h"
+#include "../except/except.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+namespace RadeonRays
+{
+    ///< Progress and cooperative cancellation of a commit. Builders add the primitives
+    ///< they are going to place and advance as subtrees are finished, nodes large
+    ///< enough to amortize it check for cancellation, so a cancelled build throws soon.
+    ///<
+    class BuildMonitor
+    {
+    public:
+        // Subtrees of fewer primitives are built without checks
+        static int const kCheckPrims = 4096;
+
+        // Reporter might be nullptr, only cancellable monitors throw from Check
+        BuildMonitor(ProgressReporter* reporter, bool cancellable)
+            : m_reporter(reporter)
+            , m_cancellable(cancellable)
+            , m_cancelled(false)
+            , m_total(0)
+            , m_done(0)
+            , m_reported(0.f)
+        {
+        }
+
+        // Make the next check of the build throw
+        void Cancel() { m_cancelled = true; }
+
+        // Throw if the build has been cancelled
+        void Check() const
+        {
+            if (m_cancellable && m_cancelled)
+            {
+                throw ExceptionImpl("Commit has been cancelled.");
+            }
+        }
+
+        // Primitives the build is going to place
+        void AddWork(std::int64_t numprims) { m_total += numprims; }
+
+        // Primitives placed into finished subtrees
+        void Advance(std::int64_t numprims)
+        {
+            std::int64_t done = m_done += numprims;
+            std::int64_t total = m_total;
+            Report(total > 0 ? std::min((float)done / total, 1.f) : 0.f);
+        }
+
+        // Report the commit is complete
+        void Finish() { Report(1.f); }
+
+    private:
+        // Reporter calls are serialized and only made for progress of at least 1%
+        void Report(float progress)
+        {
+            if (!m_reporter)
+            {
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(m_report_mutex);
+            if (progress >= 1.f ? m_reported < 1.f : progress >= m_reported + 0.01f)
+            {
+                m_reported = progress;
+                m_reporter->Report(progress);
+            }
+        }
+
+        ProgressReporter* m_reporter;
+        bool m_cancellable;
+        std::atomic<bool> m_cancelled;
+        std::atomic<std::int64_t> m_total;
+        std::atomic<std::int64_t> m_done;
+        std::mutex m_report_mutex;
+        float m_reported;
+    };
+}
+
+#endif // BUILD_MONITOR_H
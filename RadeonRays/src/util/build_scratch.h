@@ -0,0 +1,55 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef BUILD_SCRATCH_H
+#define BUILD_SCRATCH_H
+
+#include "math/bbox.h"
+#include "hostalloc.h"
+
+namespace RadeonRays
+{
+    ///< Scratch arrays of host builds, kept by an intersector across commits,
+    ///< so commits don't allocate and first touch them again. Builds resize
+    ///< the arrays they use, their capacity only grows until released.
+    ///<
+    struct BuildScratch
+    {
+        // Face bounds the tree is built over
+        host_vector<bbox> bounds;
+        // Centroids and partitioned primitive indices of Bvh::BuildImpl
+        host_vector<float3> centroids;
+        host_vector<int> indices;
+
+        // Free the memory, e.g. when host copies are dropped
+        void Release()
+        {
+            bounds.clear();
+            bounds.shrink_to_fit();
+            centroids.clear();
+            centroids.shrink_to_fit();
+            indices.clear();
+            indices.shrink_to_fit();
+        }
+    };
+}
+
+#endif // BUILD_SCRATCH_H
@@ -0,0 +1,260 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "bvh_cache.h"
+
+#include "../world/world.h"
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
+#include "../primitive/spheres.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+namespace RadeonRays
+{
+    namespace
+    {
+        // File header, entry is discarded if any of the fields does not match
+        struct Header
+        {
+            std::uint32_t magic;
+            std::uint32_t version;
+            std::uint64_t key;
+            std::uint64_t size;
+        };
+
+        std::uint32_t const kMagic = 0x43425252; // "RRBC"
+        // Bump this when serialized layout of any intersector changes
+        std::uint32_t const kVersion = 1;
+
+        // 64-bit FNV-1a hash
+        class Hasher
+        {
+        public:
+            Hasher() : m_hash(14695981039346656037ull) {}
+
+            void Add(void const* data, std::size_t size)
+            {
+                auto bytes = static_cast<unsigned char const*>(data);
+
+                for (std::size_t i = 0; i < size; ++i)
+                {
+                    m_hash ^= bytes[i];
+                    m_hash *= 1099511628211ull;
+                }
+            }
+
+            template <typename T>
+            void Add(T const& value)
+            {
+                Add(&value, sizeof(T));
+            }
+
+            void Add(std::string const& value)
+            {
+                Add(value.size());
+                Add(value.data(), value.size());
+            }
+
+            std::uint64_t Get() const { return m_hash; }
+
+        private:
+            std::uint64_t m_hash;
+        };
+
+        void HashMesh(Mesh const* mesh, Hasher& hasher)
+        {
+            hasher.Add(mesh->num_vertices());
+            hasher.Add(mesh->num_faces());
+
+            // Element-wise, so meshes referencing caller memory hash the same as the copied ones
+            for (int i = 0; i < mesh->num_vertices(); ++i)
+            {
+                hasher.Add(mesh->GetVertex(i));
+            }
+
+            for (int i = 0; i < mesh->num_faces(); ++i)
+            {
+                hasher.Add(mesh->GetFace(i));
+            }
+        }
+
+        void HashSpheres(Spheres const* spheres, Hasher& hasher)
+        {
+            hasher.Add(spheres->num_spheres());
+
+            for (int i = 0; i < spheres->num_spheres(); ++i)
+            {
+                hasher.Add(spheres->GetSphere(i));
+            }
+        }
+    }
+
+    BvhCache::BvhCache(std::string const& path)
+        : m_path(path)
+    {
+    }
+
+    std::string BvhCache::GetFileName(std::uint64_t key) const
+    {
+        std::ostringstream name;
+        name << m_path;
+
+        if (!m_path.empty() && m_path.back() != '/' && m_path.back() != '\\')
+        {
+            name << '/';
+        }
+
+        name << std::hex << std::setw(16) << std::setfill('0') << key << ".rrbvh";
+        return name.str();
+    }
+
+    bool BvhCache::Load(std::uint64_t key, Entry& entry) const
+    {
+        std::ifstream in(GetFileName(key), std::ios::binary);
+
+        if (!in)
+        {
+            return false;
+        }
+
+        Header header;
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+            header.magic != kMagic ||
+            header.version != kVersion ||
+            header.key != key)
+        {
+            return false;
+        }
+
+        entry.m_data.resize(static_cast<std::size_t>(header.size));
+        entry.m_offset = 0;
+
+        if (header.size > 0 && !in.read(&entry.m_data[0], entry.m_data.size()))
+        {
+            entry.m_data.clear();
+            return false;
+        }
+
+        return true;
+    }
+
+    void BvhCache::Save(std::uint64_t key, Entry const& entry) const
+    {
+        auto filename = GetFileName(key);
+
+        // Write into a temporary file first, so concurrent readers
+        // never see partially written entries
+        std::ostringstream tmpname;
+        tmpname << filename << '.' << std::hex << std::chrono::steady_clock::now().time_since_epoch().count();
+
+        {
+            std::ofstream out(tmpname.str(), std::ios::binary | std::ios::trunc);
+
+            if (!out)
+            {
+                return;
+            }
+
+            Header header = { kMagic, kVersion, key, entry.m_data.size() };
+            out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+
+            if (!entry.m_data.empty())
+            {
+                out.write(&entry.m_data[0], entry.m_data.size());
+            }
+
+            if (!out)
+            {
+                out.close();
+                std::remove(tmpname.str().c_str());
+                return;
+            }
+        }
+
+        // Rename fails on some platforms if the file exists,
+        // in this case the other process has already stored the same entry
+        if (std::rename(tmpname.str().c_str(), filename.c_str()) != 0)
+        {
+            std::remove(tmpname.str().c_str());
+        }
+    }
+
+    std::uint64_t BvhCache::ComputeKey(World const& world, std::string const& tag)
+    {
+        Hasher hasher;
+        hasher.Add(kVersion);
+        hasher.Add(tag);
+
+        // Build options affecting the tree
+        auto const& settings = world.options_.GetBvhSettings();
+        hasher.Add(settings.use_sah);
+        hasher.Add(settings.use_lbvh);
+        hasher.Add(settings.use_splits);
+        hasher.Add(settings.max_split_depth);
+        hasher.Add(settings.min_overlap);
+        hasher.Add(settings.traversal_cost);
+        hasher.Add(settings.extra_node_budget);
+        hasher.Add(settings.num_bins);
+        hasher.Add(settings.max_leaf_prims);
+        hasher.Add(settings.calibrate);
+        hasher.Add(settings.presplit_budget);
+        hasher.Add(settings.use_veb_layout);
+
+        // Shapes in the order they are attached, intersectors
+        // derive face and vertex layout from this order
+        hasher.Add(world.shapes_.size());
+
+        for (auto shape : world.shapes_)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+
+            matrix m, minv;
+            shape->GetTransform(m, minv);
+
+            hasher.Add(shape->GetId());
+            hasher.Add(shape->GetMask());
+            hasher.Add(shapeimpl->is_instance());
+            hasher.Add(shapeimpl->is_spheres());
+            hasher.Add(m);
+
+            if (shapeimpl->is_instance())
+            {
+                auto instance = static_cast<Instance const*>(shape);
+                HashMesh(static_cast<Mesh const*>(instance->GetBaseShape()), hasher);
+            }
+            else if (shapeimpl->is_spheres())
+            {
+                HashSpheres(static_cast<Spheres const*>(shape), hasher);
+            }
+            else
+            {
+                HashMesh(static_cast<Mesh const*>(shape), hasher);
+            }
+        }
+
+        return hasher.Get();
+    }
+}
@@ -0,0 +1,131 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace RadeonRays
+{
+    class World;
+
+    ///< On-disk cache of translated acceleration structures.
+    ///< Entries are keyed by a hash of the scene geometry, transforms
+    ///< and bvh.* build options, so a process starting with the same
+    ///< scene can skip BVH construction and translation entirely.
+    ///< Each entry is a sequence of arrays stored in a single file.
+    ///<
+    class BvhCache
+    {
+    public:
+        ///< Serialized data of a single cache entry.
+        ///< Arrays are read back in the same order they were written.
+        ///<
+        class Entry
+        {
+        public:
+            Entry() : m_offset(0) {}
+
+            // Append an array to the entry
+            template <typename T>
+            void WriteArray(std::vector<T> const& values);
+
+            // Read next array from the entry, returns false if the data is malformed
+            template <typename T>
+            bool ReadArray(std::vector<T>& values);
+
+        private:
+            std::vector<char> m_data;
+            std::size_t m_offset;
+
+            friend class BvhCache;
+        };
+
+        // Cache files are stored in the directory specified
+        explicit BvhCache(std::string const& path);
+
+        // Load the entry, returns false if there is no valid entry for the key
+        bool Load(std::uint64_t key, Entry& entry) const;
+        // Save the entry, failures are silently ignored as the cache is optional
+        void Save(std::uint64_t key, Entry const& entry) const;
+
+        // Calculate the key for the world, tag distinguishes data layouts of different intersectors
+        static std::uint64_t ComputeKey(World const& world, std::string const& tag);
+
+    private:
+        // Full path of the entry file
+        std::string GetFileName(std::uint64_t key) const;
+
+        // Cache directory
+        std::string m_path;
+    };
+
+    template <typename T>
+    inline void BvhCache::Entry::WriteArray(std::vector<T> const& values)
+    {
+        std::uint64_t const count = values.size();
+        std::size_t const size = values.size() * sizeof(T);
+        std::size_t const offset = m_data.size();
+
+        m_data.resize(offset + sizeof(count) + size);
+        std::memcpy(&m_data[offset], &count, sizeof(count));
+
+        if (size > 0)
+        {
+            std::memcpy(&m_data[offset + sizeof(count)], values.data(), size);
+        }
+    }
+
+    template <typename T>
+    inline bool BvhCache::Entry::ReadArray(std::vector<T>& values)
+    {
+        std::uint64_t count = 0;
+
+        if (m_offset + sizeof(count) > m_data.size())
+        {
+            return false;
+        }
+
+        std::memcpy(&count, &m_data[m_offset], sizeof(count));
+
+        if (count > (m_data.size() - m_offset - sizeof(count)) / sizeof(T))
+        {
+            return false;
+        }
+
+        std::size_t const size = static_cast<std::size_t>(count) * sizeof(T);
+        values.resize(static_cast<std::size_t>(count));
+
+        if (size > 0)
+        {
+            std::memcpy(values.data(), &m_data[m_offset + sizeof(count)], size);
+        }
+
+        m_offset += sizeof(count) + size;
+        return true;
+    }
+}
+
+#endif // BVH_CACHE_H
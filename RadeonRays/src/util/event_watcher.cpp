@@ -0,0 +1,156 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "event_watcher.h"
+#include "radeon_rays.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace RadeonRays
+{
+    namespace
+    {
+        // Polling interval bounds in microseconds
+        int const kMinPollInterval = 20;
+        int const kMaxPollInterval = 1000;
+
+        class EventWatcher
+        {
+        public:
+            EventWatcher()
+                : m_done(false)
+            {
+            }
+
+            ~EventWatcher()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_done = true;
+                }
+
+                m_cv.notify_all();
+                if (m_thread.joinable())
+                {
+                    m_thread.join();
+                }
+            }
+
+            void Watch(Event const* event, void (*callback)(void*), void* userdata)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_pending.push_back({ event, callback, userdata });
+
+                    // Started on first use, so processes that never watch events don't get the thread
+                    if (!m_thread.joinable())
+                    {
+                        m_thread = std::thread(&EventWatcher::Run, this);
+                    }
+                }
+
+                m_cv.notify_one();
+            }
+
+        private:
+            struct Entry
+            {
+                Event const* event;
+                void (*callback)(void*);
+                void* userdata;
+            };
+
+            void Run()
+            {
+                std::vector<Entry> watched;
+                int interval = kMinPollInterval;
+
+                for (;;)
+                {
+                    {
+                        std::unique_lock<std::mutex> lock(m_mutex);
+                        m_cv.wait(lock, [this, &watched]() { return m_done || !watched.empty() || !m_pending.empty(); });
+
+                        if (m_done)
+                        {
+                            return;
+                        }
+
+                        if (!m_pending.empty())
+                        {
+                            watched.insert(watched.end(), m_pending.begin(), m_pending.end());
+                            m_pending.clear();
+                            interval = kMinPollInterval;
+                        }
+                    }
+
+                    // Callbacks run without the lock, so they can watch other events.
+                    // Failed events count as complete, Wait reports the error.
+                    auto complete = std::stable_partition(watched.begin(), watched.end(), [](Entry const& entry)
+                    {
+                        try
+                        {
+                            return !entry.event->Complete();
+                        }
+                        catch (...)
+                        {
+                            return false;
+                        }
+                    });
+
+                    std::vector<Entry> done(complete, watched.end());
+                    watched.erase(complete, watched.end());
+
+                    for (auto const& entry : done)
+                    {
+                        entry.callback(entry.userdata);
+                    }
+
+                    if (!watched.empty())
+                    {
+                        interval = done.empty() ? std::min(interval * 2, kMaxPollInterval) : kMinPollInterval;
+
+                        std::unique_lock<std::mutex> lock(m_mutex);
+                        m_cv.wait_for(lock, std::chrono::microseconds(interval), [this]() { return m_done || !m_pending.empty(); });
+                    }
+                }
+            }
+
+            std::mutex m_mutex;
+            std::condition_variable m_cv;
+            // Events added since the service thread has last looked
+            std::vector<Entry> m_pending;
+            bool m_done;
+            std::thread m_thread;
+        };
+    }
+
+    void WatchEvent(Event const* event, void (*callback)(void*), void* userdata)
+    {
+        static EventWatcher watcher;
+        watcher.Watch(event, callback, userdata);
+    }
+}
@@ -0,0 +1,112 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef HOSTALLOC_H
+#define HOSTALLOC_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace RadeonRays
+{
+    ///< Callbacks host build temporaries are allocated with, allocations use
+    ///< operator new if alloc is nullptr
+    ///<
+    struct HostMemoryHooks
+    {
+        void* (*alloc)(std::size_t size, std::size_t alignment, void* userdata) = nullptr;
+        void (*free)(void* ptr, void* userdata) = nullptr;
+        void* userdata = nullptr;
+    };
+
+    // Hooks set by IntersectionApi::SetAllocator, safe to call from any thread
+    void SetHostMemoryHooks(HostMemoryHooks const& hooks);
+    HostMemoryHooks GetHostMemoryHooks();
+
+    /**
+    * STL-compliant allocator that allocates with the host memory hooks.
+    * The hooks are captured on construction, so memory always returns
+    * to the callbacks it came from.
+    */
+    template <class T>
+    struct host_allocator
+    {
+        typedef T value_type;
+
+        host_allocator()
+            : hooks(GetHostMemoryHooks())
+        {
+        }
+
+        template <class U>
+        host_allocator(host_allocator<U> const& other)
+            : hooks(other.hooks)
+        {
+        }
+
+        T* allocate(std::size_t n)
+        {
+            if (!hooks.alloc)
+            {
+                return std::allocator<T>().allocate(n);
+            }
+
+            void* p = hooks.alloc(n * sizeof(T), alignof(T), hooks.userdata);
+            if (!p)
+                throw std::bad_alloc();
+            return static_cast<T*>(p);
+        }
+
+        void deallocate(T* p, std::size_t n)
+        {
+            if (!hooks.alloc)
+            {
+                std::allocator<T>().deallocate(p, n);
+                return;
+            }
+
+            hooks.free(p, hooks.userdata);
+        }
+
+        HostMemoryHooks hooks;
+    };
+
+    template <class T1, class T2>
+    bool operator == (host_allocator<T1> const& lhs, host_allocator<T2> const& rhs)
+    {
+        return lhs.hooks.alloc == rhs.hooks.alloc && lhs.hooks.free == rhs.hooks.free &&
+            lhs.hooks.userdata == rhs.hooks.userdata;
+    }
+
+    template <class T1, class T2>
+    bool operator != (host_allocator<T1> const& lhs, host_allocator<T2> const& rhs)
+    {
+        return !(lhs == rhs);
+    }
+
+    // Vector of build temporaries
+    template <class T>
+    using host_vector = std::vector<T, host_allocator<T>>;
+}
+
+#endif // HOSTALLOC_H
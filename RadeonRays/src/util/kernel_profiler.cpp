@@ -0,0 +1,176 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "kernel_profiler.h"
+
+#include <chrono>
+
+namespace RadeonRays
+{
+    KernelProfiler::KernelProfiler(Calc::Device* device)
+        : m_device(device)
+        , m_enabled(false)
+    {
+    }
+
+    KernelProfiler::~KernelProfiler()
+    {
+        for (auto& launch : m_pending)
+        {
+            launch.event->Wait();
+            m_device->DeleteEvent(launch.event);
+        }
+    }
+
+    void KernelProfiler::SetEnabled(bool enabled)
+    {
+        m_enabled = enabled;
+    }
+
+    bool KernelProfiler::IsEnabled() const
+    {
+        return m_enabled;
+    }
+
+    void KernelProfiler::Execute(Calc::Function const* func, std::uint32_t queue, std::size_t global_size, std::size_t local_size,
+        Calc::Event** event, char const* name)
+    {
+        ExecuteRange(func, queue, 0, global_size, local_size, event, name);
+    }
+
+    void KernelProfiler::ExecuteRange(Calc::Function const* func, std::uint32_t queue, std::size_t global_offset, std::size_t global_size,
+        std::size_t local_size, Calc::Event** event, char const* name)
+    {
+        if (!m_enabled)
+        {
+            m_device->ExecuteRange(func, queue, global_offset, global_size, local_size, event);
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Collect(false);
+
+        Calc::Event* e = nullptr;
+        m_device->ExecuteRange(func, queue, global_offset, global_size, local_size, &e);
+
+        PendingLaunch launch = { e, &m_stats[name] };
+
+        if (event)
+        {
+            // The caller owns the event and may release it any time
+            e->Wait();
+            Accumulate(*launch.stats, e);
+            *event = e;
+        }
+        else
+        {
+            m_pending.push_back(launch);
+        }
+    }
+
+    void KernelProfiler::Run(std::uint32_t queue, char const* name, std::function<void()> const& work)
+    {
+        if (!m_enabled)
+        {
+            work();
+            return;
+        }
+
+        m_device->Finish(queue);
+        auto start = std::chrono::high_resolution_clock::now();
+
+        work();
+
+        m_device->Finish(queue);
+        auto end = std::chrono::high_resolution_clock::now();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto& stats = m_stats[name];
+        stats.calls++;
+        stats.time += std::chrono::duration<double, std::milli>(end - start).count();
+    }
+
+    void KernelProfiler::GetProfile(std::vector<KernelProfile>& profile)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Collect(true);
+
+        profile.clear();
+
+        for (auto& stats : m_stats)
+        {
+            KernelProfile entry;
+            entry.name = stats.first.c_str();
+            entry.calls = stats.second.calls;
+            entry.time = static_cast<float>(stats.second.time);
+            profile.push_back(entry);
+        }
+    }
+
+    void KernelProfiler::Reset()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // Pending launches point into the stats
+        for (auto& launch : m_pending)
+        {
+            launch.event->Wait();
+            m_device->DeleteEvent(launch.event);
+        }
+
+        m_pending.clear();
+        m_stats.clear();
+    }
+
+    void KernelProfiler::Accumulate(Stats& stats, Calc::Event const* event)
+    {
+        std::uint64_t start = 0;
+        std::uint64_t end = 0;
+
+        stats.calls++;
+
+        if (event->GetProfilingInfo(start, end))
+        {
+            stats.time += (end - start) * 1e-6;
+        }
+    }
+
+    void KernelProfiler::Collect(bool wait)
+    {
+        while (!m_pending.empty())
+        {
+            auto& launch = m_pending.front();
+
+            if (wait)
+            {
+                launch.event->Wait();
+            }
+            else if (!launch.event->IsComplete())
+            {
+                break;
+            }
+
+            Accumulate(*launch.stats, launch.event);
+            m_device->DeleteEvent(launch.event);
+            m_pending.pop_front();
+        }
+    }
+}
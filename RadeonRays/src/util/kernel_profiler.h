@@ -0,0 +1,147 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef KERNEL_PROFILER_H
+#define KERNEL_PROFILER_H
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "radeon_rays.h"
+#include "calc.h"
+#include "device.h"
+#include "event.h"
+
+namespace RadeonRays
+{
+    ///< Accumulates device times of kernel launches per kernel name.
+    ///< Launches are timed with event timestamps while profiling is enabled,
+    ///< events are collected once complete so the queues are not stalled.
+    ///< Work launched without an event (e.g. Calc primitives) is timed on the host.
+    ///<
+    class KernelProfiler
+    {
+    public:
+        explicit KernelProfiler(Calc::Device* device);
+        ~KernelProfiler();
+
+        void SetEnabled(bool enabled);
+        bool IsEnabled() const;
+
+        // Launch the function and time it under the name if profiling is enabled.
+        // A launch returning an event to the caller is waited for to read its timing.
+        void Execute(Calc::Function const* func, std::uint32_t queue, std::size_t global_size, std::size_t local_size,
+            Calc::Event** event, char const* name);
+        // Same for a part of a grid starting at global_offset, see Calc::Device::ExecuteRange
+        void ExecuteRange(Calc::Function const* func, std::uint32_t queue, std::size_t global_offset, std::size_t global_size,
+            std::size_t local_size, Calc::Event** event, char const* name);
+
+        // Run the work and time it under the name if profiling is enabled,
+        // the queue is drained before and after the work
+        void Run(std::uint32_t queue, char const* name, std::function<void()> const& work);
+
+        // Wait for the timed launches and get the times per kernel,
+        // names are valid until Reset
+        void GetProfile(std::vector<KernelProfile>& profile);
+
+        // Drop the accumulated times
+        void Reset();
+
+        KernelProfiler(KernelProfiler const&) = delete;
+        KernelProfiler& operator = (KernelProfiler const&) = delete;
+
+    private:
+        struct Stats
+        {
+            int calls;
+            // Milliseconds
+            double time;
+        };
+
+        struct PendingLaunch
+        {
+            Calc::Event* event;
+            Stats* stats;
+        };
+
+        // Add the timing of the complete event to the stats
+        static void Accumulate(Stats& stats, Calc::Event const* event);
+        // Record completed launches, waits for all of them if wait is set
+        void Collect(bool wait);
+
+        Calc::Device* m_device;
+        std::atomic<bool> m_enabled;
+        // Launches in submission order
+        std::deque<PendingLaunch> m_pending;
+        std::map<std::string, Stats> m_stats;
+        // Queries and builds may launch from different threads
+        std::mutex m_mutex;
+    };
+
+    // Launch through the profiler if there is one
+    inline void ProfiledExecute(KernelProfiler* profiler, Calc::Device* device, Calc::Function const* func, std::uint32_t queue,
+        std::size_t global_size, std::size_t local_size, Calc::Event** event, char const* name)
+    {
+        if (profiler)
+        {
+            profiler->Execute(func, queue, global_size, local_size, event, name);
+        }
+        else
+        {
+            device->Execute(func, queue, global_size, local_size, event);
+        }
+    }
+
+    // Launch a part of a grid through the profiler if there is one
+    inline void ProfiledExecuteRange(KernelProfiler* profiler, Calc::Device* device, Calc::Function const* func, std::uint32_t queue,
+        std::size_t global_offset, std::size_t global_size, std::size_t local_size, Calc::Event** event, char const* name)
+    {
+        if (profiler)
+        {
+            profiler->ExecuteRange(func, queue, global_offset, global_size, local_size, event, name);
+        }
+        else
+        {
+            device->ExecuteRange(func, queue, global_offset, global_size, local_size, event);
+        }
+    }
+
+    // Run the work through the profiler if there is one
+    inline void ProfiledRun(KernelProfiler* profiler, std::uint32_t queue, char const* name, std::function<void()> const& work)
+    {
+        if (profiler)
+        {
+            profiler->Run(queue, name, work);
+        }
+        else
+        {
+            work();
+        }
+    }
+}
+
+#endif
@@ -27,11 +27,102 @@ namespace RadeonRays
     void Options::SetValue(std::string const& name, std::string const& value)
     {
         values_[name] = Option(value);
+        UpdateSettings(name);
     }
 
     void Options::SetValue(std::string const& name, float value)
     {
         values_[name] = Option(value);
+        UpdateSettings(name);
+    }
+
+    void Options::UpdateSettings(std::string const& name)
+    {
+        bool level_option = name.compare(0, 6, "bvh2l.") == 0;
+        if (name.compare(0, 4, "bvh.") != 0 && !level_option)
+        {
+            return;
+        }
+
+        auto const& value = values_[name];
+
+        if (name == "bvh.builder")
+        {
+            bvh_.use_sah = value.AsString() == "sah";
+            bvh_.use_lbvh = value.AsString() == "lbvh";
+        }
+        else if (name == "bvh.sah.use_splits")
+        {
+            bvh_.use_splits = value.AsFloat() > 0.f;
+        }
+        else if (name == "bvh.sah.max_split_depth")
+        {
+            bvh_.max_split_depth = (int)value.AsFloat();
+        }
+        else if (name == "bvh.sah.num_bins")
+        {
+            bvh_.num_bins = (int)value.AsFloat();
+        }
+        else if (name == "bvh.sah.min_overlap")
+        {
+            bvh_.min_overlap = value.AsFloat();
+        }
+        else if (name == "bvh.sah.traversal_cost")
+        {
+            bvh_.traversal_cost = value.AsFloat();
+        }
+        else if (name == "bvh.sah.extra_node_budget")
+        {
+            bvh_.extra_node_budget = value.AsFloat();
+        }
+        else if (name == "bvh.sah.max_leaf_prims")
+        {
+            bvh_.max_leaf_prims = (int)value.AsFloat();
+        }
+        else if (name == "bvh.sah.calibrate")
+        {
+            bvh_.calibrate = value.AsFloat() > 0.f;
+        }
+        else if (name == "bvh.presplit.budget")
+        {
+            bvh_.presplit_budget = value.AsFloat() > 0.f ? value.AsFloat() : 0.f;
+        }
+        else if (name == "bvh.layout")
+        {
+            bvh_.use_veb_layout = value.AsString() == "veb";
+        }
+        else if (name == "bvh.force2level")
+        {
+            bvh_.force2level = value.AsFloat() > 0.f;
+        }
+        else if (name == "bvh.forceflat")
+        {
+            bvh_.forceflat = value.AsFloat() > 0.f;
+        }
+        else if (!level_option)
+        {
+            // Other bvh.* options don't change the tree
+            return;
+        }
+
+        // Levels follow the bvh.* options they don't override
+        ResolveLevelSettings("bvh2l.top.", bvh_.top);
+        ResolveLevelSettings("bvh2l.bottom.", bvh_.bottom);
+
+        ++bvh_.version;
+    }
+
+    void Options::ResolveLevelSettings(std::string const& prefix, BvhLevelSettings& level) const
+    {
+        auto builder = GetOption(prefix + "builder");
+        level.use_sah = builder ? builder->AsString() == "sah" : bvh_.use_sah;
+        level.use_lbvh = builder ? builder->AsString() == "lbvh" : bvh_.use_lbvh;
+
+        auto num_bins = GetOption(prefix + "sah.num_bins");
+        level.num_bins = num_bins ? (int)num_bins->AsFloat() : bvh_.num_bins;
+
+        auto traversal_cost = GetOption(prefix + "sah.traversal_cost");
+        level.traversal_cost = traversal_cost ? traversal_cost->AsFloat() : bvh_.traversal_cost;
     }
 
     Options::Option const* Options::GetOption(std::string const& name) const
@@ -22,14 +22,63 @@ THE SOFTWARE.
 #ifndef OPTIONS_H
 #define OPTIONS_H
 
+#include <cstdint>
 #include <map>
 #include <string>
 
 namespace RadeonRays
 {
+    ///< Builder of one level of 2-level BVHs resolved from the bvh2l.top.* or
+    ///< bvh2l.bottom.* options, the bvh.* ones are used for options not set
+    ///<
+    struct BvhLevelSettings
+    {
+        // "builder" is "sah"
+        bool use_sah = false;
+        // "builder" is "lbvh"
+        bool use_lbvh = false;
+        // "sah.num_bins" and "sah.traversal_cost"
+        int num_bins = 64;
+        float traversal_cost = 10.f;
+    };
+
+    ///< BVH build settings resolved from the bvh.* options,
+    ///< so builds don't look up and parse the strings on every commit
+    ///<
+    struct BvhSettings
+    {
+        // "bvh.builder" is "sah"
+        bool use_sah = false;
+        // "bvh.builder" is "lbvh"
+        bool use_lbvh = false;
+        // "bvh.sah.use_splits"
+        bool use_splits = false;
+        int max_split_depth = 10;
+        int num_bins = 64;
+        float min_overlap = 0.05f;
+        float traversal_cost = 10.f;
+        float extra_node_budget = 0.5f;
+        int max_leaf_prims = 1;
+        // "bvh.sah.calibrate", traversal_cost is measured with the kernels of the device
+        bool calibrate = false;
+        // "bvh.presplit.budget", extra references relative to the number of faces, 0 disables presplitting
+        float presplit_budget = 0.f;
+        // "bvh.layout" is "veb"
+        bool use_veb_layout = false;
+        // "bvh.force2level" and "bvh.forceflat"
+        bool force2level = false;
+        bool forceflat = false;
+        // Top level and bottom level of 2-level BVHs, groups are built as the top level
+        BvhLevelSettings top;
+        BvhLevelSettings bottom;
+        // Incremented whenever one of the bvh.* options is set
+        std::uint32_t version = 0;
+    };
+
     ///< The class stores a set of key-value options. 
     ///< The value might be either float or string and 
-    ///< lookup is O(nlg(n))
+    ///< lookup is O(nlg(n)), bvh.* and bvh2l.* options are also
+    ///< available as typed settings
     ///<
     class Options
     {
@@ -43,14 +92,20 @@ namespace RadeonRays
                 float floatval;
             } value;
 
+            // Set from a string, so the option can be copied to other Options
+            bool isstring;
+
             // Construct from string
             Option(std::string const& val="")
+                : isstring(true)
             {
                 value.strval = val;
+                value.floatval = 0.f;
             }
 
             // Construct from float
             Option(float val)
+                : isstring(false)
             {
                 value.floatval = val;
             }
@@ -78,11 +133,33 @@ namespace RadeonRays
 
         // Get option
         Option const* GetOption(std::string const& name) const;
+        // Get all the options set, sorted by name
+        std::map<std::string, Option> const& GetOptions() const;
+
+        // Get BVH build settings
+        BvhSettings const& GetBvhSettings() const;
 
     private:
+        // Re-resolve the typed settings after an option is set
+        void UpdateSettings(std::string const& name);
+        // Resolve level settings from the options starting with prefix
+        void ResolveLevelSettings(std::string const& prefix, BvhLevelSettings& level) const;
+
         // Options 
         std::map<std::string, Option> values_;
+        // Typed bvh.* settings
+        BvhSettings bvh_;
     };
+
+    inline BvhSettings const& Options::GetBvhSettings() const
+    {
+        return bvh_;
+    }
+
+    inline std::map<std::string, Options::Option> const& Options::GetOptions() const
+    {
+        return values_;
+    }
 }
 
 #endif
\ No newline at end of file
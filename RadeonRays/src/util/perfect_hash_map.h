@@ -7,7 +7,9 @@
 #include <numeric>
 #include <array>
 #include <cstdlib>
-#include <map>
+#include <atomic>
+#include <functional>
+#include <memory>
 
 // Round up to next power of two
 template <typename T> inline T round_up_to_pow2(T v);
@@ -45,6 +47,11 @@ public:
     // keys and values are arrays of size count
     // invalid_value is returned by the query later if there is no such key in the table
     PerfectHashMap(K max_key, K const* keys, V const* values, D count, V invalid_value);
+    // Same, passes over the keys are split by parallel_for(begin, end, func), which
+    // calls func(chunkbegin, chunkend) for chunks of [begin, end) concurrently,
+    // func is passed as std::function<void(D, D)>
+    template <typename ParallelFor>
+    PerfectHashMap(K max_key, K const* keys, V const* values, D count, V invalid_value, ParallelFor const& parallel_for);
     PerfectHashMap() = delete;
 
     // Look up value for a specified key
@@ -52,14 +59,15 @@ public:
     V operator[](K key) const;
 
 
-    // DEBUG:
+    // Tables layout, lookup is hash_table[displacement_table[key / row_size] + (key & (row_size - 1))]
     D hash_table_size() const { return static_cast<D>(m_hash_table.size()); }
-    D displacement_table_size() const { return m_t; }
+    D displacement_table_size() const { return static_cast<D>(m_displacement.size()); }
+    D row_size() const { return m_t; }
     D const* displacement_table_ptr() const { return &m_displacement[0]; }
     V const* hash_table_ptr() const { return &m_hash_table[0]; }
 
 private:
-    // Intermediate table dim, should be at least sqrt(max_key)
+    // Row size of the intermediate table, power of 2
     D m_t;
     // Displacement table of rows
     std::vector<D> m_displacement;
@@ -71,106 +79,193 @@ private:
 template <typename K, typename V, typename D>
 inline
 PerfectHashMap<K,V,D>::PerfectHashMap(K max_key, K const* keys, V const* values, D count, V invalid_value)
+    : PerfectHashMap(max_key, keys, values, count, invalid_value, [](D begin, D end, std::function<void(D, D)> const& func) { func(begin, end); })
 {
-    // 1. We first hash keys into an intermediate 2D array of m_t * m_t size
-    // 2. We build a histogram over rows
-    // 3. We sort rows according to this histogram
-    // 4. We iterate over all the rows and shift each one to the right
-    //    until it does not have collisions with previous rows (each column has
-    //    at most 1 element), storing offsets into m_displacement array.
-    // 5. We compress the rows into a hash table.
-
-    // Row structure to build histogram over rows
-    struct Row
+}
+
+template <typename K, typename V, typename D>
+template <typename ParallelFor>
+inline
+PerfectHashMap<K,V,D>::PerfectHashMap(K max_key, K const* keys, V const* values, D count, V invalid_value, ParallelFor const& parallel_for)
+{
+    // 1. We first hash keys into rows of an intermediate array with m_t columns,
+    //    keys are bucketed by row with a counting sort running in parallel.
+    // 2. We iterate over the rows holding several keys in descending order of
+    //    their size and shift each one to the right until it does not have collisions
+    //    with previous rows (each column has at most 1 element), storing offsets
+    //    into m_displacement array and compressing the rows into a hash table.
+    // 3. Rows holding a single key, most of them for sparse keys, take the first
+    //    free slot at or after their column in column order.
+    //
+    // Keys can be sparse (e.g. node indices of a deep complete tree), so the
+    // intermediate array is never allocated densely. Free slots are found
+    // through a path compressed next free slot table, so placement stays
+    // close to linear in the size of the table.
+
+    // Occupied column of the intermediate array
+    struct Entry
     {
-        D index;
-        D count;
+        D col;
+        V value;
     };
 
-    // Row vector
-    std::vector<Row> rows;
-    // Intermediate 2D array to hash keys into
-    std::vector<V> intermediate;
-
     // Determine intermediate table size:
-    // to be able to hash max_key it should be at least sqrt(max_key)
-    m_t = round_up_to_pow2(static_cast<D>(std::ceil(std::sqrt(max_key))));
-    // Allocate intermediate table
-    intermediate.resize(m_t * m_t);
-    // Allocate displacement table
-    m_displacement.resize(m_t);
-    // Allocate space for row histogram bins
-    rows.resize(m_t);
-
-    // Initialize rows
-    for (auto i = 0; i < rows.size(); ++i)
-    {
-        rows[i].count = 0;
-        rows[i].index = i;
-    }
+    // rows are sized to hold about one key each, which keeps
+    // displacement search fast for sparse keys
+    auto key_range = static_cast<double>(max_key) + 1.0;
+    m_t = round_up_to_pow2(static_cast<D>(std::ceil(key_range / std::max(count, D(1)))));
+    // Allocate displacement table, rows without keys point to the start of
+    // the table, so querying a missing key always lands on a valid slot
+    auto num_rows = static_cast<D>(std::ceil(key_range / m_t));
+    m_displacement.assign(num_rows, D(0));
 
-    // Initialize tables
-    std::fill(std::begin(intermediate), std::end(intermediate), invalid_value);
-    std::fill(std::begin(m_displacement), std::end(m_displacement), invalid_value);
+    // Count keys of each row, the counters become row cursors below
+    std::unique_ptr<std::atomic<D>[]> cursors(new std::atomic<D>[num_rows]());
+    std::atomic<bool> valid(true);
 
-    // Hash keys into an intermediate table
-    for (auto i = 0; i < count; ++i)
+    parallel_for(D(0), count, [&](D begin, D end)
     {
-        auto key = keys[i];
-        auto value = values[i];
+        for (auto i = begin; i < end; ++i)
+        {
+            // Check max key constraint
+            if (keys[i] > max_key)
+            {
+                valid = false;
+                continue;
+            }
+
+            cursors[keys[i] / m_t].fetch_add(1, std::memory_order_relaxed);
+        }
+    });
 
-        // Check max key constraint
-        if (key > max_key)
-            throw std::runtime_error("Max key condition violated");
+    if (!valid)
+        throw std::runtime_error("Max key condition violated");
 
-        // Hash key into row, col
-        auto row = key / m_t;
-        // We can & (m_t - 1) since it is pow of 2
-        auto col = key & (m_t - 1);
+    // Entries of row r start at row_start[r]
+    std::vector<D> row_start(num_rows + 1, D(0));
+    for (D r = 0; r < num_rows; ++r)
+    {
+        row_start[r + 1] = row_start[r] + cursors[r].load(std::memory_order_relaxed);
+        cursors[r].store(row_start[r], std::memory_order_relaxed);
+    }
 
-        // Update intermediate table
-        intermediate[row * m_t + col] = value;
+    // Scatter keys to their rows, placement doesn't depend on the order within a row
+    std::vector<Entry> entries(count);
+    parallel_for(D(0), count, [&](D begin, D end)
+    {
+        for (auto i = begin; i < end; ++i)
+        {
+            // We can & (m_t - 1) since it is pow of 2
+            auto slot = cursors[keys[i] / m_t].fetch_add(1, std::memory_order_relaxed);
+            entries[slot] = Entry{ static_cast<D>(keys[i] & (m_t - 1)), values[i] };
+        }
+    });
 
-        // Update histogram
-        ++rows[row].count;
+    // Rows in descending order of the number of keys, single key rows by column
+    std::vector<D> multi_rows;
+    std::vector<D> single_rows;
+    for (D r = 0; r < num_rows; ++r)
+    {
+        auto size = row_start[r + 1] - row_start[r];
+        if (size > 1)
+            multi_rows.push_back(r);
+        else if (size == 1)
+            single_rows.push_back(r);
     }
 
-    // Sort rows in descending order based on histogram
-    std::sort(std::begin(rows), std::end(rows), [](Row const& lhs, Row const& rhs)
+    std::sort(std::begin(multi_rows), std::end(multi_rows), [&row_start](D lhs, D rhs)
     {
-        return lhs.count > rhs.count;
+        auto lhs_size = row_start[lhs + 1] - row_start[lhs];
+        auto rhs_size = row_start[rhs + 1] - row_start[rhs];
+        return lhs_size != rhs_size ? lhs_size > rhs_size : lhs < rhs;
     });
 
+    std::stable_sort(std::begin(single_rows), std::end(single_rows), [&row_start, &entries](D lhs, D rhs)
+    {
+        return entries[row_start[lhs]].col < entries[row_start[rhs]].col;
+    });
+
+    // Smallest free slot at or after each slot, slots past the end are free
+    std::vector<D> next_free;
+
+    auto find_free = [&next_free](D slot)
+    {
+        auto root = slot;
+        while (root < static_cast<D>(next_free.size()) && next_free[root] != root)
+        {
+            root = next_free[root];
+        }
+
+        // Compress the path
+        while (slot < root)
+        {
+            auto next = next_free[slot];
+            next_free[slot] = root;
+            slot = next;
+        }
+
+        return root;
+    };
+
+    // Store displacement value for the row and compress the row into the table,
+    // missing keys past the end are filled with invalid values and can be reused
+    // by successive rows
+    auto place = [&](D row, D offset)
+    {
+        m_displacement[row] = offset;
+
+        auto size = static_cast<D>(m_hash_table.size());
+        if (size < offset + m_t)
+        {
+            m_hash_table.resize(offset + m_t, invalid_value);
+            next_free.resize(offset + m_t);
+            std::iota(std::begin(next_free) + size, std::end(next_free), size);
+        }
+
+        for (auto i = row_start[row]; i < row_start[row + 1]; ++i)
+        {
+            auto slot = offset + entries[i].col;
+            m_hash_table[slot] = entries[i].value;
+            next_free[slot] = slot + 1;
+        }
+    };
+
+    // Maximum number of free slots tried per row
+    int const kMaxAttempts = 64;
+
     // Start shifting rows to the right
-    for (auto& row: rows)
+    for (auto row : multi_rows)
     {
-        // If we have zero here it is guaranteed we can early-out
-        // since the rows are sorted in descending order.
-        if (!row.count)
+        // Only offsets placing the leftmost column into a free slot can succeed
+        D min_col = m_t;
+        for (auto i = row_start[row]; i < row_start[row + 1]; ++i)
         {
-            break;
+            min_col = std::min(min_col, entries[i].col);
         }
 
-        // Try increasing offsets
-        auto idx = row.index;
-        for (auto offset = 0;;++offset)
+        auto size = static_cast<D>(m_hash_table.size());
+
+        // Offset which puts the whole row past the end of the table never collides
+        D offset = std::max(size, min_col) - min_col;
+
+        // Try increasing offsets, the number of attempts is bounded to keep the build
+        // fast for dense keys at the expense of a slightly larger table
+        int attempts = 0;
+        for (auto slot = find_free(min_col); slot < size && attempts < kMaxAttempts; slot = find_free(slot + 1), ++attempts)
         {
+            D candidate = slot - min_col;
+
             bool collision = false;
             // Check if current row has no collisions
-            for (auto i = 0; i < m_t; ++i)
+            for (auto i = row_start[row]; i < row_start[row + 1]; ++i)
             {
-                // Check if there is current element which can potentially create collision
-                if (intermediate[idx * m_t + i] != invalid_value)
+                // If dstidx > m_hash_table size there can be no collision, since
+                // no rows has been compressed into the table past the end
+                auto dstidx = candidate + entries[i].col;
+                if (dstidx < size && m_hash_table[dstidx] != invalid_value)
                 {
-                    // Check if collision is actually happening
-                    auto dstidx = offset + i;
-                    // If dstidx > m_hash_table size there can be no collision, since
-                    // no rows has been compressed into the table past the end
-                    if (dstidx < m_hash_table.size() && m_hash_table[dstidx] != invalid_value)
-                    {
-                        collision = true;
-                        break;
-                    }
+                    collision = true;
+                    break;
                 }
             }
 
@@ -178,37 +273,25 @@ PerfectHashMap<K,V,D>::PerfectHashMap(K max_key, K const* keys, V const* values,
             // with current offset
             if (!collision)
             {
-                // Store displacement value for the row
-                m_displacement[idx] = offset;
-
-                // Compress the row into the table
-                for (auto i = 0; i < m_t; ++i)
-                {
-                    auto value = intermediate[idx * m_t + i];
-                    auto dstidx = offset + i;
-
-                    // If we are adding past the end we do not care of
-                    // missing keys (successive rows can rewrite missing values)
-                    if (dstidx >= m_hash_table.size())
-                    {
-                        m_hash_table.push_back(value);
-                    }
-                    else
-                    {
-                        // If we are adding prior to the end we only add valid entries
-                        // in order not to overwrite existing ones.
-                        if (value != invalid_value)
-                        {
-                            m_hash_table[dstidx] = value;
-                        }
-                    }
-
-                }
-
-                // Stop trying offsets and go to the next row
+                offset = candidate;
                 break;
             }
         }
+
+        place(row, offset);
+    }
+
+    // Single key rows never collide in a free slot, a slot skipped
+    // by a row is left of the columns of all the rows after it
+    for (auto row : single_rows)
+    {
+        auto col = entries[row_start[row]].col;
+        place(row, find_free(col) - col);
+    }
+
+    if (m_hash_table.empty())
+    {
+        m_hash_table.resize(m_t, invalid_value);
     }
 }
 
@@ -0,0 +1,108 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "sah_calibration.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <random>
+
+namespace RadeonRays
+{
+    namespace
+    {
+        // Faces of each synthetic scene and their extents relative to the scene
+        int const kNumSceneFaces = 16 * 1024;
+        float const kFaceSizes[SahCalibration::kNumScenes] = { 0.005f, 0.5f };
+
+        // Calibrated costs beyond this range come from noise rather than the kernels
+        float const kMinTraversalCost = 0.5f;
+        float const kMaxTraversalCost = 100.f;
+
+        // Calibrated traversal costs keyed by device name and node layout
+        std::map<std::string, float> g_calibrated_costs;
+        std::mutex g_calibrated_costs_mutex;
+    }
+
+    void SahCalibration::CreateScene(int scene, std::vector<float3>& vertices, std::vector<bbox>& bounds)
+    {
+        // Scenes are the same on every run, so devices are compared on equal terms
+        std::minstd_rand rng(42 + scene);
+        std::uniform_real_distribution<float> dist(0.f, 1.f);
+
+        float size = kFaceSizes[scene];
+        vertices.resize(3 * kNumSceneFaces);
+        bounds.resize(kNumSceneFaces);
+
+        for (int i = 0; i < kNumSceneFaces; ++i)
+        {
+            float3 center(dist(rng), dist(rng), dist(rng));
+            bounds[i] = bbox();
+
+            for (int j = 0; j < 3; ++j)
+            {
+                float3 offset(dist(rng) - 0.5f, dist(rng) - 0.5f, dist(rng) - 0.5f);
+                vertices[3 * i + j] = center + size * offset;
+                bounds[i].grow(vertices[3 * i + j]);
+            }
+        }
+    }
+
+    float SahCalibration::Solve(float const* times, float const* node_terms, float const* prim_terms, float fallback)
+    {
+        // times[i] = node_cost * node_terms[i] + prim_cost * prim_terms[i]
+        float det = node_terms[0] * prim_terms[1] - node_terms[1] * prim_terms[0];
+        if (det == 0.f)
+        {
+            return fallback;
+        }
+
+        float node_cost = (times[0] * prim_terms[1] - times[1] * prim_terms[0]) / det;
+        float prim_cost = (node_terms[0] * times[1] - node_terms[1] * times[0]) / det;
+        if (!(node_cost > 0.f) || !(prim_cost > 0.f))
+        {
+            return fallback;
+        }
+
+        return std::min(std::max(node_cost / prim_cost, kMinTraversalCost), kMaxTraversalCost);
+    }
+
+    bool SahCalibration::Find(std::string const& key, float& traversal_cost)
+    {
+        std::lock_guard<std::mutex> lock(g_calibrated_costs_mutex);
+
+        auto iter = g_calibrated_costs.find(key);
+        if (iter == g_calibrated_costs.cend())
+        {
+            return false;
+        }
+
+        traversal_cost = iter->second;
+        return true;
+    }
+
+    void SahCalibration::Store(std::string const& key, float traversal_cost)
+    {
+        std::lock_guard<std::mutex> lock(g_calibrated_costs_mutex);
+        g_calibrated_costs[key] = traversal_cost;
+    }
+}
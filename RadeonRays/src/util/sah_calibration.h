@@ -0,0 +1,60 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef SAH_CALIBRATION_H
+#define SAH_CALIBRATION_H
+
+#include <string>
+#include <vector>
+
+#include "math/bbox.h"
+
+namespace RadeonRays
+{
+    ///< SAH traversal costs measured with the traversal kernels of a device.
+    ///< A tree of node area term Sn and primitive area term Sp (see Bvh::GetSahTerms)
+    ///< is traced in about Cn * Sn + Cp * Sp, so the trace times of two scenes of
+    ///< different terms give the node and primitive costs, their ratio is the
+    ///< traversal cost the builders take. Results are kept per device and node
+    ///< layout for the lifetime of the process.
+    ///<
+    class SahCalibration
+    {
+    public:
+        // Number of synthetic scenes Solve takes measurements of
+        static int const kNumScenes = 2;
+
+        // Generate triangles of a synthetic scene in the unit cube, the first one has many
+        // small scattered triangles dominated by node visits, the second one large overlapping
+        // triangles dominated by primitive tests
+        static void CreateScene(int scene, std::vector<float3>& vertices, std::vector<bbox>& bounds);
+
+        // Fit node and primitive costs to trace times of the scenes and return their
+        // ratio clamped to a sane range, fallback if the measurements are inconsistent
+        static float Solve(float const* times, float const* node_terms, float const* prim_terms, float fallback);
+
+        // Find traversal cost calibrated earlier, key combines device name and node layout
+        static bool Find(std::string const& key, float& traversal_cost);
+        static void Store(std::string const& key, float traversal_cost);
+    };
+}
+
+#endif // SAH_CALIBRATION_H
@@ -0,0 +1,255 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "tcp_stream.h"
+
+#include "../except/except.h"
+
+#include <algorithm>
+#include <mutex>
+
+#ifdef _WIN32
+#   define NOMINMAX
+#   include <winsock2.h>
+#   include <ws2tcpip.h>
+typedef SOCKET SocketHandle;
+typedef int IoSize;
+#   define RR_INVALID_SOCKET INVALID_SOCKET
+#   define RR_SHUTDOWN_BOTH SD_BOTH
+#   define RR_SEND_FLAGS 0
+#else
+#   include <netdb.h>
+#   include <netinet/in.h>
+#   include <netinet/tcp.h>
+#   include <sys/socket.h>
+#   include <unistd.h>
+typedef int SocketHandle;
+typedef std::size_t IoSize;
+#   define RR_INVALID_SOCKET (-1)
+#   define RR_SHUTDOWN_BOTH SHUT_RDWR
+#   ifdef MSG_NOSIGNAL
+#       define RR_SEND_FLAGS MSG_NOSIGNAL
+#   else
+#       define RR_SEND_FLAGS 0
+#   endif
+#endif
+
+namespace RadeonRays
+{
+    namespace
+    {
+        // Largest single send or receive, Winsock takes int sizes
+        std::size_t const kMaxIoSize = 1 << 30;
+
+        void InitSockets()
+        {
+#ifdef _WIN32
+            static std::once_flag s_once;
+            std::call_once(s_once, []()
+            {
+                WSADATA data;
+                ThrowIf(WSAStartup(MAKEWORD(2, 2), &data) != 0, "Can't initialize sockets.");
+            });
+#endif
+        }
+
+        void CloseSocket(SocketHandle s)
+        {
+#ifdef _WIN32
+            closesocket(s);
+#else
+            close(s);
+#endif
+        }
+
+        // Small messages go out right away, streams are sent in large blocks anyway
+        void ConfigureSocket(SocketHandle s)
+        {
+            int one = 1;
+            setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char const*>(&one), sizeof(one));
+#ifdef SO_NOSIGPIPE
+            setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+        }
+    }
+
+    TcpStream::TcpStream(std::intptr_t socket)
+        : m_socket(socket)
+    {
+    }
+
+    TcpStream::~TcpStream()
+    {
+        CloseSocket(static_cast<SocketHandle>(m_socket));
+    }
+
+    std::unique_ptr<TcpStream> TcpStream::Connect(std::string const& host, std::uint16_t port)
+    {
+        InitSockets();
+
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+
+        addrinfo* addresses = nullptr;
+        std::string const service = std::to_string(port);
+        ThrowIf(getaddrinfo(host.c_str(), service.c_str(), &hints, &addresses) != 0 || !addresses,
+            "Can't resolve remote host " + host + ".");
+
+        // Try all the addresses the name resolves to
+        SocketHandle s = RR_INVALID_SOCKET;
+        for (addrinfo* a = addresses; a; a = a->ai_next)
+        {
+            s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (s == RR_INVALID_SOCKET)
+                continue;
+
+            if (connect(s, a->ai_addr, static_cast<int>(a->ai_addrlen)) == 0)
+                break;
+
+            CloseSocket(s);
+            s = RR_INVALID_SOCKET;
+        }
+
+        freeaddrinfo(addresses);
+
+        ThrowIf(s == RR_INVALID_SOCKET, "Can't connect to " + host + ":" + service + ".");
+
+        ConfigureSocket(s);
+        return std::unique_ptr<TcpStream>(new TcpStream(static_cast<std::intptr_t>(s)));
+    }
+
+    std::unique_ptr<TcpStream> TcpStream::Accept(std::string const& address, std::uint16_t port,
+        std::function<void(std::uint16_t)> const& listening)
+    {
+        InitSockets();
+
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST;
+
+        addrinfo* addresses = nullptr;
+        std::string const service = std::to_string(port);
+        ThrowIf(getaddrinfo(address.c_str(), service.c_str(), &hints, &addresses) != 0 || !addresses,
+            "Invalid local address " + address + ".");
+
+        SocketHandle listener = socket(addresses->ai_family, addresses->ai_socktype, addresses->ai_protocol);
+        if (listener == RR_INVALID_SOCKET)
+        {
+            freeaddrinfo(addresses);
+            Throw("Can't create a socket.");
+        }
+
+        // Workers serving one client after another bind the port again right away
+        int one = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char const*>(&one), sizeof(one));
+
+        bool const bound = bind(listener, addresses->ai_addr, static_cast<int>(addresses->ai_addrlen)) == 0 &&
+            listen(listener, 1) == 0;
+        freeaddrinfo(addresses);
+
+        // Read back the port picked for port 0
+        sockaddr_storage local = {};
+        socklen_t locallen = sizeof(local);
+        if (!bound || getsockname(listener, reinterpret_cast<sockaddr*>(&local), &locallen) != 0)
+        {
+            CloseSocket(listener);
+            Throw("Can't listen on " + address + ":" + service + ".");
+        }
+
+        port = ntohs(local.ss_family == AF_INET6 ?
+            reinterpret_cast<sockaddr_in6 const*>(&local)->sin6_port :
+            reinterpret_cast<sockaddr_in const*>(&local)->sin_port);
+
+        if (listening)
+        {
+            try
+            {
+                listening(port);
+            }
+            catch (...)
+            {
+                CloseSocket(listener);
+                throw;
+            }
+        }
+
+        SocketHandle s = accept(listener, nullptr, nullptr);
+        CloseSocket(listener);
+
+        ThrowIf(s == RR_INVALID_SOCKET, "Can't accept a connection on port " + std::to_string(port) + ".");
+
+        ConfigureSocket(s);
+        return std::unique_ptr<TcpStream>(new TcpStream(static_cast<std::intptr_t>(s)));
+    }
+
+    void TcpStream::Send(void const* data, std::size_t size)
+    {
+        char const* ptr = static_cast<char const*>(data);
+
+        while (size > 0)
+        {
+            auto const chunk = static_cast<IoSize>(std::min(size, kMaxIoSize));
+            auto const sent = send(static_cast<SocketHandle>(m_socket), ptr, chunk, RR_SEND_FLAGS);
+            ThrowIf(sent <= 0, "Remote connection is lost.");
+
+            ptr += sent;
+            size -= static_cast<std::size_t>(sent);
+        }
+    }
+
+    void TcpStream::Receive(void* data, std::size_t size)
+    {
+        ThrowIf(!TryReceive(data, size), "Remote connection is closed.");
+    }
+
+    bool TcpStream::TryReceive(void* data, std::size_t size)
+    {
+        char* ptr = static_cast<char*>(data);
+        bool first = true;
+
+        while (size > 0)
+        {
+            auto const chunk = static_cast<IoSize>(std::min(size, kMaxIoSize));
+            auto const received = recv(static_cast<SocketHandle>(m_socket), ptr, chunk, 0);
+
+            // Orderly close between messages
+            if (received == 0 && first)
+                return false;
+
+            ThrowIf(received <= 0, "Remote connection is lost.");
+
+            ptr += received;
+            size -= static_cast<std::size_t>(received);
+            first = false;
+        }
+
+        return true;
+    }
+
+    void TcpStream::Shutdown()
+    {
+        shutdown(static_cast<SocketHandle>(m_socket), RR_SHUTDOWN_BOTH);
+    }
+}
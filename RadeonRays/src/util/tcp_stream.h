@@ -0,0 +1,66 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace RadeonRays
+{
+    ///< Blocking TCP connection. Sending and receiving may run on two
+    ///< threads at once, errors and lost connections throw ExceptionImpl.
+    ///<
+    class TcpStream
+    {
+    public:
+        // Connect to the port of the host, name or address
+        static std::unique_ptr<TcpStream> Connect(std::string const& host, std::uint16_t port);
+        // Wait for a single connection on the port of the local address, port 0 picks a free one.
+        // listening is called with the bound port before blocking, might be empty.
+        static std::unique_ptr<TcpStream> Accept(std::string const& address, std::uint16_t port,
+            std::function<void(std::uint16_t)> const& listening);
+
+        ~TcpStream();
+
+        // Send size bytes
+        void Send(void const* data, std::size_t size);
+        // Receive exactly size bytes
+        void Receive(void* data, std::size_t size);
+        // Receive exactly size bytes, returns false if the peer has closed
+        // the connection before the first byte
+        bool TryReceive(void* data, std::size_t size);
+        // Stop both directions, blocked calls return with an error
+        void Shutdown();
+
+    private:
+        explicit TcpStream(std::intptr_t socket);
+
+        TcpStream(TcpStream const&) = delete;
+        TcpStream& operator = (TcpStream const&) = delete;
+
+        // Platform socket handle
+        std::intptr_t m_socket;
+    };
+}
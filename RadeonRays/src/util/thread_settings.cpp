@@ -0,0 +1,197 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "thread_settings.h"
+
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#   define NOMINMAX
+#   include <windows.h>
+#elif defined(__APPLE__)
+#   include <pthread.h>
+#else
+#   include <pthread.h>
+#   include <sched.h>
+#   include <sys/resource.h>
+#   include <sys/syscall.h>
+#   include <unistd.h>
+#endif
+
+namespace RadeonRays
+{
+    static std::mutex s_settings_mutex;
+    static ThreadSettings s_settings;
+
+    static int resolve_num_threads(int numthreads)
+    {
+        if (numthreads > 0)
+        {
+            return numthreads;
+        }
+
+        numthreads = static_cast<int>(std::thread::hardware_concurrency());
+        return numthreads > 0 ? numthreads : 1;
+    }
+
+    // CPUs of each NUMA node, empty if the topology is unknown
+    static std::vector<std::vector<int>> const& get_numa_nodes()
+    {
+        static std::vector<std::vector<int>> const nodes = []()
+        {
+            std::vector<std::vector<int>> result;
+#ifdef _WIN32
+            ULONG highest = 0;
+            if (GetNumaHighestNodeNumber(&highest))
+            {
+                for (ULONG node = 0; node <= highest; ++node)
+                {
+                    ULONGLONG mask = 0;
+                    if (!GetNumaNodeProcessorMask(static_cast<UCHAR>(node), &mask) || mask == 0)
+                        continue;
+
+                    std::vector<int> cpus;
+                    for (int cpu = 0; cpu < 64; ++cpu)
+                    {
+                        if (mask & (1ull << cpu))
+                            cpus.push_back(cpu);
+                    }
+                    result.push_back(cpus);
+                }
+            }
+#elif !defined(__APPLE__)
+            // Each node lists its CPUs as ranges, e.g. "0-15,32-47"
+            for (int node = 0;; ++node)
+            {
+                std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+                if (!file)
+                    break;
+
+                std::vector<int> cpus;
+                std::string range;
+                while (std::getline(file, range, ','))
+                {
+                    int first = 0;
+                    int last = 0;
+                    char dash = 0;
+                    std::istringstream stream(range);
+                    if (!(stream >> first))
+                        continue;
+                    if (!(stream >> dash >> last) || dash != '-')
+                        last = first;
+
+                    for (int cpu = first; cpu <= last; ++cpu)
+                        cpus.push_back(cpu);
+                }
+
+                if (!cpus.empty())
+                    result.push_back(cpus);
+            }
+#endif
+            return result;
+        }();
+
+        return nodes;
+    }
+
+    void SetThreadSettings(ThreadSettings const& settings)
+    {
+        std::lock_guard<std::mutex> lock(s_settings_mutex);
+        s_settings = settings;
+    }
+
+    ThreadSettings GetThreadSettings()
+    {
+        std::lock_guard<std::mutex> lock(s_settings_mutex);
+        return s_settings;
+    }
+
+    int GetNumBuildThreads()
+    {
+        return resolve_num_threads(GetThreadSettings().build_threads);
+    }
+
+    int GetNumQueryThreads()
+    {
+        return resolve_num_threads(GetThreadSettings().query_threads);
+    }
+
+    void SetBuildThreadPriority()
+    {
+        if (!GetThreadSettings().low_priority_builds)
+        {
+            return;
+        }
+
+        // Failures are ignored, the build just runs at normal priority
+#ifdef _WIN32
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+#elif defined(__APPLE__)
+        pthread_set_qos_class_self_np(QOS_CLASS_UTILITY, 0);
+#else
+        // Nice values are per thread on Linux, raising it is always allowed
+        int const tid = static_cast<int>(syscall(SYS_gettid));
+        int const nice = getpriority(PRIO_PROCESS, tid);
+        if (nice < 10)
+        {
+            setpriority(PRIO_PROCESS, tid, 10);
+        }
+#endif
+    }
+
+    int GetNumQueryNodes()
+    {
+        if (!GetThreadSettings().numa_aware)
+        {
+            return 1;
+        }
+
+        int numnodes = static_cast<int>(get_numa_nodes().size());
+        return numnodes > 1 ? numnodes : 1;
+    }
+
+    void PinThreadToNode(int node)
+    {
+        auto const& nodes = get_numa_nodes();
+        if (GetNumQueryNodes() == 1 || node < 0 || node >= static_cast<int>(nodes.size()))
+        {
+            return;
+        }
+
+#ifdef _WIN32
+        DWORD_PTR mask = 0;
+        for (int cpu : nodes[node])
+            mask |= DWORD_PTR(1) << cpu;
+        SetThreadAffinityMask(GetCurrentThread(), mask);
+#elif !defined(__APPLE__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : nodes[node])
+            CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+    }
+}
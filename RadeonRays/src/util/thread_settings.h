@@ -0,0 +1,63 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef THREAD_SETTINGS_H
+#define THREAD_SETTINGS_H
+
+namespace RadeonRays
+{
+    ///< Limits of the threads the library runs host work on, zero number
+    ///< of threads means hardware concurrency
+    ///<
+    struct ThreadSettings
+    {
+        // Threads BVH builds and mesh creation are spread across
+        int build_threads = 0;
+        // Threads of the CPU devices query pools
+        int query_threads = 0;
+        // Run build threads below normal priority
+        bool low_priority_builds = false;
+        // Pin query threads to NUMA nodes and split ray ranges between the nodes
+        bool numa_aware = false;
+    };
+
+    // Settings set by IntersectionApi::SetThreadLimits, safe to call from any thread
+    void SetThreadSettings(ThreadSettings const& settings);
+    ThreadSettings GetThreadSettings();
+
+    // Number of build and query threads with zero resolved to hardware concurrency
+    int GetNumBuildThreads();
+    int GetNumQueryThreads();
+
+    // Lower the priority of the calling thread if low priority builds are enabled,
+    // called at the start of every build task the library spawns
+    void SetBuildThreadPriority();
+
+    // Number of NUMA nodes query pools split their threads between,
+    // 1 unless NUMA awareness is enabled and the system has several nodes
+    int GetNumQueryNodes();
+
+    // Restrict the calling thread to the CPUs of a NUMA node if NUMA awareness
+    // is enabled, failures are ignored
+    void PinThreadToNode(int node);
+}
+
+#endif
@@ -23,14 +23,75 @@ THE SOFTWARE.
 
 #include "../primitive/shapeimpl.h"
 
+#include <algorithm>
+#include <unordered_set>
+
 namespace RadeonRays
 {
+    namespace
+    {
+        // Remove the shape from the list, returns true if it was there
+        bool EraseShape(std::vector<Shape const*>& shapes, Shape const* shape)
+        {
+            auto iter = std::find(shapes.begin(), shapes.end(), shape);
+
+            if (iter == shapes.end())
+            {
+                return false;
+            }
+
+            shapes.erase(iter);
+            return true;
+        }
+    }
+
     void World::AttachShape(Shape const* shape)
     {
         if (std::find(shapes_.cbegin(), shapes_.cend(), shape) == shapes_.cend())
         {
             shapes_.push_back(shape);
             has_changed_ = true;
+
+            // Reattaching a shape detached within the same commit cancels the removal
+            if (!EraseShape(shapes_removed_, shape))
+            {
+                shapes_added_.push_back(shape);
+            }
+        }
+    }
+
+    void World::AttachShapes(Shape const* const* shapes, int count)
+    {
+        // Linear lookups per shape would make loading large scenes quadratic
+        std::unordered_set<Shape const*> attached(shapes_.cbegin(), shapes_.cend());
+        std::unordered_set<Shape const*> removed(shapes_removed_.cbegin(), shapes_removed_.cend());
+        bool reattached = false;
+
+        for (int i = 0; i < count; ++i)
+        {
+            Shape const* shape = shapes[i];
+
+            if (attached.insert(shape).second)
+            {
+                shapes_.push_back(shape);
+                has_changed_ = true;
+
+                // Reattaching a shape detached within the same commit cancels the removal
+                if (removed.erase(shape) > 0)
+                {
+                    reattached = true;
+                }
+                else
+                {
+                    shapes_added_.push_back(shape);
+                }
+            }
+        }
+
+        if (reattached)
+        {
+            shapes_removed_.erase(std::remove_if(shapes_removed_.begin(), shapes_removed_.end(),
+                [&removed](Shape const* shape) { return removed.count(shape) == 0; }), shapes_removed_.end());
         }
     }
 
@@ -41,11 +102,25 @@ namespace RadeonRays
         {
             shapes_.erase(iter);
             has_changed_ = true;
+
+            // Detaching a shape attached within the same commit cancels the addition
+            if (!EraseShape(shapes_added_, shape))
+            {
+                shapes_removed_.push_back(shape);
+            }
         }
     }
     
     void World::DetachAll()
     {
+        for (auto shape : shapes_)
+        {
+            if (!EraseShape(shapes_added_, shape))
+            {
+                shapes_removed_.push_back(shape);
+            }
+        }
+
         shapes_.clear();
         has_changed_ = true;
     }
@@ -64,6 +139,43 @@ namespace RadeonRays
         return statechange_;
     }
 
+    void World::GetChangedShapes(int flags, std::vector<Shape const*>& shapes) const
+    {
+        shapes.clear();
+
+        for (auto shape : shapes_)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+
+            if (shapeimpl->GetStateChange() & flags)
+            {
+                shapes.push_back(shape);
+            }
+        }
+    }
+
+    int World::GetLayer(std::string const& name) const
+    {
+        auto iter = std::find(layers_.cbegin(), layers_.cend(), name);
+        return iter != layers_.cend() ? static_cast<int>(iter - layers_.cbegin()) : -1;
+    }
+
+    void World::UpdateLayerMasks()
+    {
+        // Masks are untouched until a layer is created
+        if (layers_.empty())
+        {
+            return;
+        }
+
+        int layerbits = static_cast<int>((1u << layers_.size()) - 1);
+
+        for (auto shape : shapes_)
+        {
+            static_cast<ShapeImpl const*>(shape)->SetLayerBits(layerbits);
+        }
+    }
+
     void World::OnCommit()
     {
         for (auto iter = shapes_.cbegin(); iter != shapes_.cend(); ++iter)
@@ -73,6 +185,8 @@ namespace RadeonRays
             shapeimpl->OnCommit();
         }
 
+        shapes_added_.clear();
+        shapes_removed_.clear();
         has_changed_ = false;
     }
 }
\ No newline at end of file
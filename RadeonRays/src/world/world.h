@@ -23,6 +23,7 @@ THE SOFTWARE.
 #define WORLD_H
 
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "radeon_rays.h"
@@ -30,6 +31,8 @@ THE SOFTWARE.
 
 namespace RadeonRays
 {
+    class BuildMonitor;
+
     ///< World class is a container for all entities for the scene. 
     ///< It hosts entities and is in charge of destroying them.
     ///< For convenience reasons it impelements Primitive interface
@@ -44,6 +47,8 @@ namespace RadeonRays
         virtual ~World();
         // Attach the shape updating all the flags
         void AttachShape(Shape const* shape);
+        // Attach several shapes, membership is checked once for all of them
+        void AttachShapes(Shape const* const* shapes, int count);
         // Detach the shape 
         void DetachShape(Shape const* shape);
         // Detach all
@@ -54,20 +59,36 @@ namespace RadeonRays
         bool has_changed() const;
         //
         int GetStateChange() const;
+        // Shapes attached since last commit
+        std::vector<Shape const*> const& GetAddedShapes() const;
+        // Shapes detached since last commit
+        std::vector<Shape const*> const& GetRemovedShapes() const;
+        // Collect shapes having any of the state change flags set since last commit
+        void GetChangedShapes(int flags, std::vector<Shape const*>& shapes) const;
+        // Index of the layer with the name, -1 if there is none
+        int GetLayer(std::string const& name) const;
+        // Replace the layer bits of the masks of attached shapes by their membership
+        void UpdateLayerMasks();
 
 
     public:
         // Shapes in the scene
         std::vector<Shape const*> shapes_;
-        // Flags to indicate shapes have been changed
-        std::vector<int> shapes_dirty_;
+        // Names of the layers, layer i takes mask bit i
+        std::vector<std::string> layers_;
+        // Shapes attached and detached since last commit,
+        // a shape attached and detached within the same commit is in neither
+        std::vector<Shape const*> shapes_added_;
+        std::vector<Shape const*> shapes_removed_;
 
-        // TODO: Do more preciese dirty flags tracking
+        // Set if the set of shapes has changed
         bool has_changed_;
         // Global flags
         int hint_;
         // Options
         Options options_;
+        // Progress and cancellation of the commit building the world, might be nullptr
+        std::shared_ptr<BuildMonitor> monitor_;
     };
 
     inline World::World()
@@ -83,6 +104,16 @@ namespace RadeonRays
     {
         return has_changed_;
     }
+
+    inline std::vector<Shape const*> const& World::GetAddedShapes() const
+    {
+        return shapes_added_;
+    }
+
+    inline std::vector<Shape const*> const& World::GetRemovedShapes() const
+    {
+        return shapes_removed_;
+    }
 }
 
 
@@ -0,0 +1,23 @@
+project "SceneConverter"
+    location "../SceneConverter"
+    kind "ConsoleApp"
+    includedirs { "../RadeonRays/include", "." }
+    files { "**.cpp", "**.h", "../Tutorials/Tools/tiny_obj_loader.cpp", "../Tutorials/Tools/mapped_file.cpp", "../Tutorials/Tools/parallel_obj_loader.cpp", "../Tutorials/Tools/scene_file.cpp" }
+
+    if os.is("macosx") then
+        buildoptions "-std=c++11 -stdlib=libc++"
+    else if os.is("linux") then
+        buildoptions "-std=c++11"
+        os.execute("rm -rf obj");
+        end
+    end
+
+    configuration {"x32", "Debug"}
+        targetdir "../Bin/Debug/x86"
+    configuration {"x64", "Debug"}
+        targetdir "../Bin/Debug/x64"
+    configuration {"x32", "Release"}
+        targetdir "../Bin/Release/x86"
+    configuration {"x64", "Release"}
+        targetdir "../Bin/Release/x64"
+    configuration {}
@@ -0,0 +1,88 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+
+// Scene converter: parses an OBJ file once and writes its shapes as meshes of the binary
+// scene format, see Tutorials/Tools/scene_file.h, which the benchmarks and tests map into
+// memory instead of parsing text on every run.
+//
+// Usage: SceneConverter input.obj output.rrs
+//
+// Every OBJ shape with faces becomes a mesh, the scene has no instances. Faces are
+// triangulated by the OBJ loader, materials and normals are dropped.
+
+#include "../Tutorials/Tools/tiny_obj_loader.h"
+#include "../Tutorials/Tools/parallel_obj_loader.h"
+#include "../Tutorials/Tools/scene_file.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace tinyobj;
+
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        std::cerr << "Usage: SceneConverter input.obj output.rrs\n";
+        return EXIT_FAILURE;
+    }
+
+    std::string filename = argv[1];
+    std::string basepath = filename.substr(0, filename.find_last_of("/\\") + 1);
+
+    std::vector<shape_t> objshapes;
+    std::vector<material_t> objmaterials;
+    std::string res = LoadObjParallel(objshapes, objmaterials, filename.c_str(), basepath.c_str());
+    if (!res.empty())
+    {
+        std::cerr << res << "\n";
+        return EXIT_FAILURE;
+    }
+
+    std::vector<SceneFile::Mesh> meshes;
+    std::size_t numfaces = 0;
+
+    for (auto const& objshape : objshapes)
+    {
+        auto const& mesh = objshape.mesh;
+        if (mesh.indices.size() < 3)
+        {
+            continue;
+        }
+
+        meshes.push_back({ mesh.positions.data(), (int)mesh.positions.size() / 3,
+            mesh.indices.data(), (int)mesh.indices.size() / 3 });
+        numfaces += mesh.indices.size() / 3;
+    }
+
+    res = SceneFile::WriteScene(argv[2], meshes, std::vector<SceneFile::Instance>());
+    if (!res.empty())
+    {
+        std::cerr << res << "\n";
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "Wrote " << meshes.size() << " meshes, " << numfaces << " triangles to " << argv[2] << "\n";
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,97 @@
+#!/usr/bin/env python
+# Compiles GLSL compute kernels to SPIR-V and prints them as C arrays.
+# Every parameterless function of a file is treated as an entry point
+# and compiled with it renamed to main, in the same way Calc does at runtime.
+# Usage: spirvify.py <dir> <ext> [glslangValidator]
+import sys
+import os
+import re
+import shutil
+import struct
+import subprocess
+import tempfile
+
+# Has to match the executable binary layout in Calc/src/spirv_vk.h
+MAGIC = 0x56535252 # "RRSV"
+VERSION = 1
+
+def compile_function(source, name, compiler, tmpdir):
+    # Definitions go right after #version as Anvil does
+    lines = source.split("\n")
+    lines.insert(1, "#define " + name + " main")
+
+    src = os.path.join(tmpdir, name + ".comp")
+    dst = os.path.join(tmpdir, name + ".spv")
+
+    with open(src, "w") as fh:
+        fh.write("\n".join(lines))
+
+    with open(os.devnull, "w") as null:
+        status = subprocess.call([compiler, "-V", "-S", "comp", "-o", dst, src], stdout=null, stderr=null)
+
+    if status != 0:
+        return None
+
+    with open(dst, "rb") as fh:
+        return fh.read()
+
+def spirvify(filename, dir, varname, compiler, tmpdir):
+    with open(os.path.join(dir, filename)) as fh:
+        source = fh.read()
+
+    entries = []
+    for name in re.findall(r"^void\s+(\w+)\s*\(\s*\)", source, re.MULTILINE):
+        if name in [e[0] for e in entries]:
+            continue
+
+        spirv = compile_function(source, name, compiler, tmpdir)
+
+        if spirv is None:
+            sys.stderr.write("spirvify: failed to compile " + name + " from " + filename + "\n")
+            sys.exit(1)
+
+        entries.append((name, spirv))
+
+    data = struct.pack("<III", MAGIC, VERSION, len(entries))
+    for name, spirv in entries:
+        encoded = name.encode("ascii")
+        padding = (4 - len(encoded) % 4) % 4
+        data += struct.pack("<I", len(encoded)) + encoded + b"\0" * padding
+        data += struct.pack("<I", len(spirv) // 4) + spirv
+
+    print("static const std::uint8_t g_" + varname + "_spirv[]= {")
+    values = [str(b) for b in bytearray(data)]
+    for i in range(0, len(values), 32):
+        print("    " + ", ".join(values[i:i + 32]) + ",")
+    print("};\n")
+
+argvs = sys.argv
+
+if len(argvs) < 3:
+    sys.stderr.write("usage: spirvify.py <dir> <ext> [glslangValidator]\n")
+    sys.exit(1)
+
+dir = argvs[1]
+ext = argvs[2]
+compiler = argvs[3] if len(argvs) > 3 else "glslangValidator"
+
+# Fail early so the build falls back to runtime compilation
+try:
+    with open(os.devnull, "w") as null:
+        subprocess.call([compiler, "-v"], stdout=null, stderr=null)
+except OSError:
+    sys.stderr.write("spirvify: " + compiler + " not found\n")
+    sys.exit(1)
+
+tmpdir = tempfile.mkdtemp()
+
+print("/* This is an auto-generated file. Do not edit manually*/\n")
+print("#include <cstdint>\n")
+
+for file in sorted(os.listdir(dir)):
+    if not file.endswith(ext):
+        continue
+
+    spirvify(file, dir, file.replace(ext, ""), compiler, tmpdir)
+
+shutil.rmtree(tmpdir)
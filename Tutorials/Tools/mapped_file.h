@@ -0,0 +1,50 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include <cstddef>
+
+// Read-only memory map of a whole file, loaders parse or reference it in place
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    // Map the file, returns false if it can't be opened or mapped. Empty files open without data
+    bool Open(char const* filename);
+    void Close();
+
+    char const* GetData() const { return static_cast<char const*>(m_data); }
+    std::size_t GetSize() const { return m_size; }
+
+private:
+    MappedFile(MappedFile const&);
+    MappedFile& operator = (MappedFile const&);
+
+    void const* m_data;
+    std::size_t m_size;
+#ifdef WIN32
+    void* m_file;
+    void* m_mapping;
+#endif
+};
@@ -0,0 +1,637 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "parallel_obj_loader.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+namespace tinyobj
+{
+    namespace
+    {
+        // Face vertex as written in the file, indices are fixed up once the number
+        // of elements in the chunks before is known
+        struct RawIndex
+        {
+            int v;
+            int vt;
+            int vn;
+        };
+
+        int const kNoIndex = INT_MIN;
+
+        struct Face
+        {
+            // First vertex in Chunk::vertices and number of vertices
+            std::size_t first;
+            int count;
+            // Positions, normals and texcoords of the chunk before the face, relative indices count back from them
+            int nv;
+            int nvn;
+            int nvt;
+        };
+
+        // Statements the shapes are assembled from, in file order
+        struct Command
+        {
+            enum Type
+            {
+                kFaces,
+                kUseMtl,
+                kMtlLib,
+                kGroup,
+                kObject
+            };
+
+            Type type;
+            // Chunk faces [first_face, end_face) of kFaces
+            std::size_t first_face;
+            std::size_t end_face;
+            // Material, library, group or object name of the others
+            std::string name;
+        };
+
+        struct Chunk
+        {
+            std::vector<float> v;
+            std::vector<float> vn;
+            std::vector<float> vt;
+            std::vector<RawIndex> vertices;
+            std::vector<Face> faces;
+            std::vector<Command> commands;
+            // Positions, normals and texcoords in the chunks before
+            int base_v;
+            int base_vn;
+            int base_vt;
+        };
+
+        // Consecutive faces of a chunk
+        struct FaceRange
+        {
+            std::size_t chunk;
+            std::size_t first;
+            std::size_t end;
+        };
+
+        // Face group written to a shape with a single vertex cache, as LoadObj exports them
+        struct ExportJob
+        {
+            int material;
+            std::vector<FaceRange> faces;
+            mesh_t mesh;
+        };
+
+        struct PendingShape
+        {
+            std::string name;
+            std::vector<std::size_t> jobs;
+        };
+
+        struct VertexKey
+        {
+            int v_idx;
+            int vt_idx;
+            int vn_idx;
+
+            bool operator == (VertexKey const& o) const
+            {
+                return v_idx == o.v_idx && vt_idx == o.vt_idx && vn_idx == o.vn_idx;
+            }
+        };
+
+        struct VertexKeyHash
+        {
+            std::size_t operator () (VertexKey const& k) const
+            {
+                return (std::size_t)k.v_idx * 73856093u ^ (std::size_t)k.vt_idx * 19349663u ^ (std::size_t)k.vn_idx * 83492791u;
+            }
+        };
+
+        // Parsing helpers behave as the ones of LoadObj, so the results match
+        inline bool isSpace(const char c)
+        {
+            return (c == ' ') || (c == '\t');
+        }
+
+        inline bool isNewLine(const char c)
+        {
+            return (c == '\r') || (c == '\n') || (c == '\0');
+        }
+
+        inline int fixIndex(int idx, int n)
+        {
+            if (idx > 0)
+                return idx - 1;
+            else if (idx == 0)
+                return 0;
+            else
+                return n + idx;
+        }
+
+        inline std::string parseString(const char*& token)
+        {
+            int b = (int)strspn(token, " \t");
+            int e = (int)strcspn(token, " \t\r");
+            std::string s(&token[b], &token[e]);
+
+            token += (e - b);
+            return s;
+        }
+
+        inline float parseFloat(const char*& token)
+        {
+            token += strspn(token, " \t");
+            float f = (float)atof(token);
+            token += strcspn(token, " \t\r");
+            return f;
+        }
+
+        // Parse triples: i, i/j/k, i//k, i/j
+        RawIndex parseRawTriple(const char*& token)
+        {
+            RawIndex vi = { atoi(token), kNoIndex, kNoIndex };
+            token += strcspn(token, "/ \t\r");
+            if (token[0] != '/')
+            {
+                return vi;
+            }
+            token++;
+
+            // i//k
+            if (token[0] == '/')
+            {
+                token++;
+                vi.vn = atoi(token);
+                token += strcspn(token, "/ \t\r");
+                return vi;
+            }
+
+            // i/j/k or i/j
+            vi.vt = atoi(token);
+            token += strcspn(token, "/ \t\r");
+            if (token[0] != '/')
+            {
+                return vi;
+            }
+
+            token++;
+            vi.vn = atoi(token);
+            token += strcspn(token, "/ \t\r");
+            return vi;
+        }
+
+        std::string parseName(const char* token)
+        {
+            char namebuf[4096];
+            namebuf[0] = '\0';
+            sscanf(token, "%4095s", namebuf);
+            return namebuf;
+        }
+
+        void ParseChunk(char const* begin, char const* end, Chunk& chunk)
+        {
+            std::string linebuf;
+
+            for (char const* line = begin; line < end;)
+            {
+                auto eol = static_cast<char const*>(std::memchr(line, '\n', end - line));
+                char const* next = eol ? eol + 1 : end;
+
+                // Lines are copied, so parsing stops at their end as with getline
+                linebuf.assign(line, eol ? eol : end);
+                line = next;
+
+                if (!linebuf.empty() && linebuf[linebuf.size() - 1] == '\r')
+                {
+                    linebuf.erase(linebuf.size() - 1);
+                }
+
+                const char* token = linebuf.c_str();
+                token += strspn(token, " \t");
+
+                if (token[0] == '\0' || token[0] == '#')
+                {
+                    continue;
+                }
+
+                // vertex
+                if (token[0] == 'v' && isSpace(token[1]))
+                {
+                    token += 2;
+                    float x = parseFloat(token);
+                    float y = parseFloat(token);
+                    float z = parseFloat(token);
+                    chunk.v.push_back(x);
+                    chunk.v.push_back(y);
+                    chunk.v.push_back(z);
+                    continue;
+                }
+
+                // normal
+                if (token[0] == 'v' && token[1] == 'n' && isSpace(token[2]))
+                {
+                    token += 3;
+                    float x = parseFloat(token);
+                    float y = parseFloat(token);
+                    float z = parseFloat(token);
+                    chunk.vn.push_back(x);
+                    chunk.vn.push_back(y);
+                    chunk.vn.push_back(z);
+                    continue;
+                }
+
+                // texcoord
+                if (token[0] == 'v' && token[1] == 't' && isSpace(token[2]))
+                {
+                    token += 3;
+                    float x = parseFloat(token);
+                    float y = parseFloat(token);
+                    chunk.vt.push_back(x);
+                    chunk.vt.push_back(y);
+                    continue;
+                }
+
+                // face
+                if (token[0] == 'f' && isSpace(token[1]))
+                {
+                    token += 2;
+                    token += strspn(token, " \t");
+
+                    Face face = { chunk.vertices.size(), 0,
+                        (int)chunk.v.size() / 3, (int)chunk.vn.size() / 3, (int)chunk.vt.size() / 2 };
+
+                    while (!isNewLine(token[0]))
+                    {
+                        chunk.vertices.push_back(parseRawTriple(token));
+                        ++face.count;
+                        token += strspn(token, " \t\r");
+                    }
+
+                    if (chunk.commands.empty() || chunk.commands.back().type != Command::kFaces)
+                    {
+                        Command command = { Command::kFaces, chunk.faces.size(), chunk.faces.size(), "" };
+                        chunk.commands.push_back(command);
+                    }
+
+                    chunk.faces.push_back(face);
+                    chunk.commands.back().end_face = chunk.faces.size();
+                    continue;
+                }
+
+                // use mtl
+                if ((0 == strncmp(token, "usemtl", 6)) && isSpace(token[6]))
+                {
+                    Command command = { Command::kUseMtl, 0, 0, parseName(token + 7) };
+                    chunk.commands.push_back(command);
+                    continue;
+                }
+
+                // load mtl
+                if ((0 == strncmp(token, "mtllib", 6)) && isSpace(token[6]))
+                {
+                    Command command = { Command::kMtlLib, 0, 0, parseName(token + 7) };
+                    chunk.commands.push_back(command);
+                    continue;
+                }
+
+                // group name, the first string is 'g' itself
+                if (token[0] == 'g' && isSpace(token[1]))
+                {
+                    std::vector<std::string> names;
+                    while (!isNewLine(token[0]))
+                    {
+                        names.push_back(parseString(token));
+                        token += strspn(token, " \t\r");
+                    }
+
+                    Command command = { Command::kGroup, 0, 0, names.size() > 1 ? names[1] : "" };
+                    chunk.commands.push_back(command);
+                    continue;
+                }
+
+                // object name
+                if (token[0] == 'o' && isSpace(token[1]))
+                {
+                    Command command = { Command::kObject, 0, 0, parseName(token + 2) };
+                    chunk.commands.push_back(command);
+                    continue;
+                }
+
+                // Ignore unknown command.
+            }
+        }
+
+        unsigned int UpdateVertex(std::unordered_map<VertexKey, unsigned int, VertexKeyHash>& cache, mesh_t& mesh,
+            std::vector<float> const& in_positions, std::vector<float> const& in_normals, std::vector<float> const& in_texcoords,
+            VertexKey const& i)
+        {
+            auto it = cache.find(i);
+            if (it != cache.end())
+            {
+                return it->second;
+            }
+
+            assert(in_positions.size() > (unsigned int)(3 * i.v_idx + 2));
+
+            mesh.positions.push_back(in_positions[3 * i.v_idx + 0]);
+            mesh.positions.push_back(in_positions[3 * i.v_idx + 1]);
+            mesh.positions.push_back(in_positions[3 * i.v_idx + 2]);
+
+            if (i.vn_idx >= 0)
+            {
+                mesh.normals.push_back(in_normals[3 * i.vn_idx + 0]);
+                mesh.normals.push_back(in_normals[3 * i.vn_idx + 1]);
+                mesh.normals.push_back(in_normals[3 * i.vn_idx + 2]);
+            }
+
+            if (i.vt_idx >= 0)
+            {
+                mesh.texcoords.push_back(in_texcoords[2 * i.vt_idx + 0]);
+                mesh.texcoords.push_back(in_texcoords[2 * i.vt_idx + 1]);
+            }
+
+            unsigned int idx = (unsigned)mesh.positions.size() / 3 - 1;
+            cache[i] = idx;
+            return idx;
+        }
+
+        // Triangulate the faces into fans and number the vertices of the group
+        void ExportFaces(std::vector<Chunk> const& chunks, std::vector<float> const& v, std::vector<float> const& vn,
+            std::vector<float> const& vt, ExportJob& job)
+        {
+            std::unordered_map<VertexKey, unsigned int, VertexKeyHash> cache;
+            std::vector<VertexKey> face;
+
+            for (auto const& range : job.faces)
+            {
+                auto const& chunk = chunks[range.chunk];
+
+                for (auto f = range.first; f < range.end; ++f)
+                {
+                    auto const& raw = chunk.faces[f];
+
+                    face.resize(raw.count);
+                    for (int k = 0; k < raw.count; ++k)
+                    {
+                        auto const& vi = chunk.vertices[raw.first + k];
+                        face[k].v_idx = fixIndex(vi.v, chunk.base_v + raw.nv);
+                        face[k].vt_idx = vi.vt == kNoIndex ? -1 : fixIndex(vi.vt, chunk.base_vt + raw.nvt);
+                        face[k].vn_idx = vi.vn == kNoIndex ? -1 : fixIndex(vi.vn, chunk.base_vn + raw.nvn);
+                    }
+
+                    // Polygon -> triangle fan conversion
+                    for (int k = 2; k < raw.count; ++k)
+                    {
+                        unsigned int v0 = UpdateVertex(cache, job.mesh, v, vn, vt, face[0]);
+                        unsigned int v1 = UpdateVertex(cache, job.mesh, v, vn, vt, face[k - 1]);
+                        unsigned int v2 = UpdateVertex(cache, job.mesh, v, vn, vt, face[k]);
+
+                        job.mesh.indices.push_back(v0);
+                        job.mesh.indices.push_back(v1);
+                        job.mesh.indices.push_back(v2);
+
+                        job.mesh.material_ids.push_back(job.material);
+                    }
+                }
+            }
+        }
+
+        // Run func(i) for i in [0, count) on up to numthreads threads
+        void ParallelFor(std::size_t count, unsigned numthreads, std::function<void(std::size_t)> const& func)
+        {
+            std::atomic<std::size_t> next(0);
+            auto worker = [&]()
+            {
+                for (auto i = next++; i < count; i = next++)
+                {
+                    func(i);
+                }
+            };
+
+            std::vector<std::thread> threads;
+            for (unsigned i = 1; i < std::min<std::size_t>(numthreads, count); ++i)
+            {
+                threads.emplace_back(worker);
+            }
+
+            worker();
+
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+        }
+
+        template <typename T>
+        void Append(std::vector<T>& dst, std::vector<T> const& src)
+        {
+            dst.insert(dst.end(), src.begin(), src.end());
+        }
+    }
+
+    std::string LoadObjParallel(
+        std::vector<shape_t>& shapes,
+        std::vector<material_t>& materials,
+        const char* filename,
+        const char* mtl_basepath,
+        unsigned numthreads)
+    {
+        shapes.clear();
+
+        MappedFile file;
+        if (!file.Open(filename))
+        {
+            std::stringstream err;
+            err << "Cannot open file [" << filename << "]" << std::endl;
+            return err.str();
+        }
+
+        if (numthreads == 0)
+        {
+            numthreads = std::max(std::thread::hardware_concurrency(), 1U);
+        }
+
+        // Chunks end after a line break, so no line is split
+        char const* data = file.GetData();
+        std::size_t size = file.GetSize();
+        std::vector<std::size_t> bounds(1, 0);
+        for (unsigned i = 1; i < numthreads; ++i)
+        {
+            std::size_t bound = std::max(size * i / numthreads, bounds.back());
+            auto eol = static_cast<char const*>(std::memchr(data + bound, '\n', size - bound));
+            bound = eol ? eol - data + 1 : size;
+            if (bound > bounds.back() && bound < size)
+            {
+                bounds.push_back(bound);
+            }
+        }
+        bounds.push_back(size);
+
+        std::vector<Chunk> chunks(bounds.size() - 1);
+        ParallelFor(chunks.size(), numthreads, [&](std::size_t i)
+        {
+            ParseChunk(data + bounds[i], data + bounds[i + 1], chunks[i]);
+        });
+
+        // Relative indices and the arrays the faces index are global
+        std::vector<float> v;
+        std::vector<float> vn;
+        std::vector<float> vt;
+        for (auto& chunk : chunks)
+        {
+            chunk.base_v = (int)v.size() / 3;
+            chunk.base_vn = (int)vn.size() / 3;
+            chunk.base_vt = (int)vt.size() / 2;
+            Append(v, chunk.v);
+            Append(vn, chunk.vn);
+            Append(vt, chunk.vt);
+        }
+
+        // Replay the statements as LoadObj does to find the face groups of every shape
+        std::string basePath = mtl_basepath ? mtl_basepath : "";
+        MaterialFileReader readMatFn(basePath);
+        std::map<std::string, int> material_map;
+        int material = -1;
+        std::string name;
+        std::string err;
+
+        std::vector<ExportJob> jobs;
+        std::vector<PendingShape> pending;
+        std::vector<std::size_t> shape_jobs;
+        std::vector<FaceRange> faceGroup;
+
+        auto exportFaceGroup = [&]()
+        {
+            if (faceGroup.empty())
+            {
+                return false;
+            }
+
+            ExportJob job;
+            job.material = material;
+            job.faces.swap(faceGroup);
+            shape_jobs.push_back(jobs.size());
+            jobs.push_back(std::move(job));
+            return true;
+        };
+
+        // Shapes exported at usemtl are dropped if the group ends without faces, as in LoadObj
+        auto flushShape = [&]()
+        {
+            if (exportFaceGroup())
+            {
+                PendingShape shape = { name, shape_jobs };
+                pending.push_back(shape);
+            }
+
+            shape_jobs.clear();
+            faceGroup.clear();
+        };
+
+        for (std::size_t c = 0; c < chunks.size() && err.empty(); ++c)
+        {
+            for (auto const& command : chunks[c].commands)
+            {
+                if (command.type == Command::kFaces)
+                {
+                    FaceRange range = { c, command.first_face, command.end_face };
+                    faceGroup.push_back(range);
+                }
+                else if (command.type == Command::kUseMtl)
+                {
+                    exportFaceGroup();
+                    faceGroup.clear();
+
+                    auto it = material_map.find(command.name);
+                    material = it != material_map.end() ? it->second : -1;
+                }
+                else if (command.type == Command::kMtlLib)
+                {
+                    err = readMatFn(command.name, materials, material_map);
+                    if (!err.empty())
+                    {
+                        break;
+                    }
+                }
+                else
+                {
+                    flushShape();
+                    name = command.name;
+                }
+            }
+        }
+
+        if (err.empty())
+        {
+            flushShape();
+        }
+
+        // Only the groups of the shapes kept are triangulated
+        std::vector<std::size_t> used;
+        for (auto const& shape : pending)
+        {
+            Append(used, shape.jobs);
+        }
+
+        ParallelFor(used.size(), numthreads, [&](std::size_t i)
+        {
+            ExportFaces(chunks, v, vn, vt, jobs[used[i]]);
+        });
+
+        // Indices of the groups follow the vertices of the groups before in the shape
+        shapes.resize(pending.size());
+        for (std::size_t s = 0; s < pending.size(); ++s)
+        {
+            auto& mesh = shapes[s].mesh;
+            shapes[s].name = pending[s].name;
+
+            for (auto j : pending[s].jobs)
+            {
+                auto const& part = jobs[j].mesh;
+                int offset = (int)mesh.positions.size() / 3;
+
+                Append(mesh.positions, part.positions);
+                Append(mesh.normals, part.normals);
+                Append(mesh.texcoords, part.texcoords);
+                Append(mesh.material_ids, part.material_ids);
+
+                mesh.indices.reserve(mesh.indices.size() + part.indices.size());
+                for (auto idx : part.indices)
+                {
+                    mesh.indices.push_back(idx + offset);
+                }
+            }
+        }
+
+        return err;
+    }
+}
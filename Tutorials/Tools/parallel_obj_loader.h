@@ -0,0 +1,38 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "tiny_obj_loader.h"
+
+namespace tinyobj
+{
+    /// Loads .obj from a file like LoadObj and returns the same shapes and materials.
+    /// The file is mapped into memory and split into line aligned chunks parsed concurrently,
+    /// faces are then assembled into shapes in file order, groups of faces concurrently.
+    /// 'numthreads' 0 uses all hardware threads.
+    std::string LoadObjParallel(
+        std::vector<shape_t>& shapes,   // [output]
+        std::vector<material_t>& materials,   // [output]
+        const char* filename,
+        const char* mtl_basepath = NULL,
+        unsigned numthreads = 0);
+}
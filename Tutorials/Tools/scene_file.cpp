@@ -0,0 +1,281 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "scene_file.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+using namespace RadeonRays;
+
+namespace SceneFile
+{
+    namespace
+    {
+        char const kMagic[4] = { 'R', 'R', 'S', 'C' };
+        std::uint32_t const kVersion = 1;
+        std::uint64_t const kAlignment = 16;
+
+        struct Header
+        {
+            char magic[4];
+            std::uint32_t version;
+            std::uint32_t num_meshes;
+            std::uint32_t num_instances;
+            std::uint64_t meshes_offset;
+            std::uint64_t instances_offset;
+        };
+
+        struct MeshRecord
+        {
+            std::uint64_t positions_offset;
+            std::uint64_t indices_offset;
+            std::uint32_t num_vertices;
+            std::uint32_t num_faces;
+        };
+
+        struct InstanceRecord
+        {
+            std::uint32_t mesh;
+            std::uint32_t padding[3];
+            float transform[16];
+        };
+
+        std::uint64_t Align(std::uint64_t offset)
+        {
+            return (offset + kAlignment - 1) / kAlignment * kAlignment;
+        }
+
+        // Check that count elements starting at offset are aligned and within the file
+        bool IsInFile(std::uint64_t offset, std::uint64_t count, std::uint64_t elemsize, std::size_t size)
+        {
+            return offset % kAlignment == 0 && offset <= size && count <= (size - offset) / elemsize;
+        }
+
+        void WritePadding(std::ofstream& out, std::uint64_t offset)
+        {
+            char const zeros[kAlignment] = {};
+            auto pos = (std::uint64_t)out.tellp();
+            out.write(zeros, offset - pos);
+        }
+    }
+
+    std::string MappedScene::Open(char const* filename)
+    {
+        Close();
+
+        if (!m_file.Open(filename) || m_file.GetSize() == 0)
+        {
+            Close();
+            return std::string("Cannot map ") + filename;
+        }
+
+        auto bytes = m_file.GetData();
+        auto size = m_file.GetSize();
+        Header header;
+        if (size < sizeof(header))
+        {
+            Close();
+            return std::string(filename) + " is not a scene file";
+        }
+
+        std::memcpy(&header, bytes, sizeof(header));
+        if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion)
+        {
+            Close();
+            return std::string(filename) + " is not a scene file of version " + std::to_string(kVersion);
+        }
+
+        if (!IsInFile(header.meshes_offset, header.num_meshes, sizeof(MeshRecord), size) ||
+            !IsInFile(header.instances_offset, header.num_instances, sizeof(InstanceRecord), size))
+        {
+            Close();
+            return std::string(filename) + " is truncated";
+        }
+
+        for (std::uint32_t i = 0; i < header.num_meshes; ++i)
+        {
+            MeshRecord record;
+            std::memcpy(&record, bytes + header.meshes_offset + i * sizeof(MeshRecord), sizeof(record));
+
+            if (record.num_vertices > (std::uint32_t)std::numeric_limits<int>::max() ||
+                record.num_faces > (std::uint32_t)std::numeric_limits<int>::max() ||
+                !IsInFile(record.positions_offset, 3ull * record.num_vertices, sizeof(float), size) ||
+                !IsInFile(record.indices_offset, 3ull * record.num_faces, sizeof(int), size))
+            {
+                Close();
+                return std::string(filename) + ": mesh " + std::to_string(i) + " is out of the file";
+            }
+
+            Mesh mesh;
+            mesh.positions = reinterpret_cast<float const*>(bytes + record.positions_offset);
+            mesh.num_vertices = (int)record.num_vertices;
+            mesh.indices = reinterpret_cast<int const*>(bytes + record.indices_offset);
+            mesh.num_faces = (int)record.num_faces;
+            m_meshes.push_back(mesh);
+        }
+
+        for (std::uint32_t i = 0; i < header.num_instances; ++i)
+        {
+            InstanceRecord record;
+            std::memcpy(&record, bytes + header.instances_offset + i * sizeof(InstanceRecord), sizeof(record));
+
+            if (record.mesh >= header.num_meshes)
+            {
+                Close();
+                return std::string(filename) + ": instance " + std::to_string(i) + " has no mesh";
+            }
+
+            Instance instance;
+            instance.mesh = (int)record.mesh;
+            std::memcpy(&instance.transform.m[0][0], record.transform, sizeof(record.transform));
+            m_instances.push_back(instance);
+        }
+
+        return "";
+    }
+
+    void MappedScene::Close()
+    {
+        m_meshes.clear();
+        m_instances.clear();
+
+        m_file.Close();
+    }
+
+    std::vector<PlacedMesh> MappedScene::GetPlacedMeshes() const
+    {
+        std::vector<PlacedMesh> placed;
+
+        if (m_instances.empty())
+        {
+            for (auto const& mesh : m_meshes)
+            {
+                placed.push_back({ mesh, nullptr });
+            }
+        }
+        else
+        {
+            for (auto const& instance : m_instances)
+            {
+                placed.push_back({ m_meshes[instance.mesh], &instance.transform });
+            }
+        }
+
+        return placed;
+    }
+
+    std::string WriteScene(char const* filename, std::vector<Mesh> const& meshes, std::vector<Instance> const& instances)
+    {
+        std::ofstream out(filename, std::ios::binary);
+        if (!out)
+        {
+            return std::string("Cannot create ") + filename;
+        }
+
+        Header header;
+        std::memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.version = kVersion;
+        header.num_meshes = (std::uint32_t)meshes.size();
+        header.num_instances = (std::uint32_t)instances.size();
+        header.meshes_offset = Align(sizeof(Header));
+        header.instances_offset = Align(header.meshes_offset + meshes.size() * sizeof(MeshRecord));
+
+        // Arrays follow the records in mesh order
+        std::vector<MeshRecord> records(meshes.size());
+        std::uint64_t offset = Align(header.instances_offset + instances.size() * sizeof(InstanceRecord));
+        for (std::size_t i = 0; i < meshes.size(); ++i)
+        {
+            records[i].positions_offset = offset;
+            records[i].num_vertices = (std::uint32_t)meshes[i].num_vertices;
+            offset = Align(offset + 3ull * meshes[i].num_vertices * sizeof(float));
+
+            records[i].indices_offset = offset;
+            records[i].num_faces = (std::uint32_t)meshes[i].num_faces;
+            offset = Align(offset + 3ull * meshes[i].num_faces * sizeof(int));
+        }
+
+        out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+        WritePadding(out, header.meshes_offset);
+        if (!records.empty())
+        {
+            out.write(reinterpret_cast<char const*>(records.data()), records.size() * sizeof(MeshRecord));
+        }
+        WritePadding(out, header.instances_offset);
+
+        for (auto const& instance : instances)
+        {
+            InstanceRecord record = {};
+            record.mesh = (std::uint32_t)instance.mesh;
+            std::memcpy(record.transform, &instance.transform.m[0][0], sizeof(record.transform));
+            out.write(reinterpret_cast<char const*>(&record), sizeof(record));
+        }
+
+        for (std::size_t i = 0; i < meshes.size(); ++i)
+        {
+            WritePadding(out, records[i].positions_offset);
+            out.write(reinterpret_cast<char const*>(meshes[i].positions), 3ull * meshes[i].num_vertices * sizeof(float));
+            WritePadding(out, records[i].indices_offset);
+            out.write(reinterpret_cast<char const*>(meshes[i].indices), 3ull * meshes[i].num_faces * sizeof(int));
+        }
+
+        return out ? "" : std::string("Cannot write ") + filename;
+    }
+
+    void CreateShapes(IntersectionApi* api, MappedScene const& scene, std::vector<Shape*>& created, std::vector<Shape*>& attached)
+    {
+        std::vector<Shape*> meshes(scene.GetNumMeshes(), nullptr);
+
+        for (int i = 0; i < scene.GetNumMeshes(); ++i)
+        {
+            auto const& mesh = scene.GetMesh(i);
+            if (mesh.num_faces == 0)
+            {
+                continue;
+            }
+
+            meshes[i] = api->CreateMeshFromExternalMemory(mesh.positions, mesh.num_vertices, 3 * sizeof(float),
+                mesh.indices, 3 * sizeof(int), mesh.num_faces);
+            created.push_back(meshes[i]);
+
+            if (scene.GetNumInstances() == 0)
+            {
+                attached.push_back(meshes[i]);
+            }
+        }
+
+        for (int i = 0; i < scene.GetNumInstances(); ++i)
+        {
+            auto const& instance = scene.GetInstance(i);
+            if (!meshes[instance.mesh])
+            {
+                continue;
+            }
+
+            Shape* shape = api->CreateInstance(meshes[instance.mesh]);
+            shape->SetTransform(instance.transform, inverse(instance.transform));
+            created.push_back(shape);
+            attached.push_back(shape);
+        }
+    }
+}
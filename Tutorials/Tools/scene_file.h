@@ -0,0 +1,97 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "radeon_rays.h"
+#include "mapped_file.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Binary scene container the tools and tests map into memory instead of parsing OBJ text.
+//
+// All values are little endian, arrays start at 16 byte aligned offsets from the file start:
+//   Header        magic "RRSC", version, number of meshes and instances, offsets of their records
+//   MeshRecord    offsets of 3 floats per vertex and 3 ints per face, vertex and face counts
+//   Instance      mesh index and a row-major 4x4 transform as RadeonRays::matrix stores it
+// Scenes without instances place every mesh once as it is, otherwise only the instances are placed.
+namespace SceneFile
+{
+    // Mesh arrays are dense and point into the mapped file or the caller memory
+    struct Mesh
+    {
+        float const* positions;
+        int num_vertices;
+        int const* indices;
+        int num_faces;
+    };
+
+    struct Instance
+    {
+        int mesh;
+        RadeonRays::matrix transform;
+    };
+
+    // Mesh as it appears in the scene, transform is nullptr if the mesh is placed as it is
+    struct PlacedMesh
+    {
+        Mesh mesh;
+        RadeonRays::matrix const* transform;
+    };
+
+    // Read-only memory map of a scene file, meshes point into the map until it is closed
+    class MappedScene
+    {
+    public:
+        MappedScene() {}
+
+        // Map the file and check its layout, returns an empty string on success or the error otherwise
+        std::string Open(char const* filename);
+        void Close();
+
+        int GetNumMeshes() const { return (int)m_meshes.size(); }
+        Mesh const& GetMesh(int idx) const { return m_meshes[idx]; }
+        int GetNumInstances() const { return (int)m_instances.size(); }
+        Instance const& GetInstance(int idx) const { return m_instances[idx]; }
+
+        // Meshes of the instances, or every mesh once if the scene has no instances
+        std::vector<PlacedMesh> GetPlacedMeshes() const;
+
+    private:
+        MappedScene(MappedScene const&);
+        MappedScene& operator = (MappedScene const&);
+
+        MappedFile m_file;
+        std::vector<Mesh> m_meshes;
+        // Copied out of the map, matrices need SIMD alignment
+        std::vector<Instance> m_instances;
+    };
+
+    // Write meshes and instances of meshes, returns an empty string on success or the error otherwise
+    std::string WriteScene(char const* filename, std::vector<Mesh> const& meshes, std::vector<Instance> const& instances);
+
+    // Create the meshes of the scene referencing the map, so it has to stay open until they are deleted,
+    // and the instances of them. Shapes are appended to created, the ones to attach to attached.
+    void CreateShapes(RadeonRays::IntersectionApi* api, MappedScene const& scene,
+        std::vector<RadeonRays::Shape*>& created, std::vector<RadeonRays::Shape*>& attached);
+}
@@ -3,7 +3,15 @@ project "UnitTest"
     kind "ConsoleApp"
     includedirs { "../RadeonRays/include", "../Gtest/include", "../Calc/inc", "." }
     links {"Gtest", "RadeonRays", "Calc"}
-    files { "**.cpp", "**.h" }
+    files { "**.cpp", "**.h", "../Tutorials/Tools/mapped_file.cpp", "../Tutorials/Tools/parallel_obj_loader.cpp", "../Tutorials/Tools/scene_file.cpp" }
+
+    -- remote worker tests talk to the worker directly, the shared library doesn't export the stream
+    if not _OPTIONS["static_library"] then
+        files { "../RadeonRays/src/util/tcp_stream.cpp" }
+    end
+    if os.is("windows") then
+        links {"ws2_32"}
+    end
     
     if _OPTIONS["shared_calc"] then
        defines {"CALC_IMPORT_API"};
@@ -242,6 +242,52 @@ TEST_F(CalcTestkOpenCL, ReadWriteBuffer)
     ASSERT_NO_THROW(m_calc->DeleteDevice(device));
 }
 
+// Small buffers are sub-allocated from shared blocks, their ranges must not overlap
+// and have to be reusable after the buffers are deleted
+TEST_F(CalcTestkOpenCL, ReadWriteHeapBuffers)
+{
+    Calc::Device* device = nullptr;
+
+    ASSERT_NO_THROW(device = m_calc->CreateDevice(0));
+
+    const auto kNumBuffers = 64;
+
+    for (auto pass = 0; pass < 3; ++pass)
+    {
+        std::vector<Calc::Buffer*> buffers(kNumBuffers);
+        std::vector<std::vector<int>> numbers(kNumBuffers);
+
+        for (auto i = 0; i < kNumBuffers; ++i)
+        {
+            numbers[i].resize(1 + std::rand() % 100000);
+            std::generate(numbers[i].begin(), numbers[i].end(), std::rand);
+
+            ASSERT_NO_THROW(buffers[i] = device->CreateBuffer(numbers[i].size() * sizeof(int), Calc::BufferType::kWrite, &numbers[i][0]));
+        }
+
+        for (auto i = 0; i < kNumBuffers; ++i)
+        {
+            std::vector<int> numbers_calc(numbers[i].size());
+
+            Calc::Event* e = nullptr;
+
+            ASSERT_NO_THROW(device->ReadBuffer(buffers[i], 0, 0, numbers_calc.size() * sizeof(int), &numbers_calc[0], &e));
+
+            e->Wait();
+            device->DeleteEvent(e);
+
+            ASSERT_TRUE(numbers_calc == numbers[i]);
+        }
+
+        for (auto i = 0; i < kNumBuffers; ++i)
+        {
+            ASSERT_NO_THROW(device->DeleteBuffer(buffers[i]));
+        }
+    }
+
+    ASSERT_NO_THROW(m_calc->DeleteDevice(device));
+}
+
 TEST_F(CalcTestkOpenCL, ReadWriteTypedBuffer)
 {
     auto num_devices = m_calc->GetDeviceCount();
@@ -422,6 +468,46 @@ TEST_F(CalcTestkOpenCL, CompileExecutable)
     ASSERT_NO_THROW(m_calc->DeleteDevice(device));
 }
 
+TEST_F(CalcTestkOpenCL, CompileExecutableBinary)
+{
+    auto num_devices = m_calc->GetDeviceCount();
+
+    ASSERT_GE(num_devices, 0U);
+
+    // Programs built by this device go through the kernel cache
+    m_calc->SetKernelCachePath(".");
+
+    Calc::Device* device = nullptr;
+
+    ASSERT_NO_THROW(device = m_calc->CreateDevice(0));
+
+    Calc::Executable* executable = nullptr;
+    ASSERT_NO_THROW(executable = device->CompileExecutable(cl_source_code.c_str(), cl_source_code.size(), ""));
+
+    std::size_t size = 0;
+    ASSERT_NO_THROW(size = device->GetExecutableBinarySize(executable));
+    ASSERT_GT(size, 0U);
+
+    std::vector<std::uint8_t> binary(size);
+    ASSERT_NO_THROW(device->GetExecutableBinary(executable, &binary[0]));
+    ASSERT_NO_THROW(device->DeleteExecutable(executable));
+
+    // Second compilation is served from the cache
+    ASSERT_NO_THROW(executable = device->CompileExecutable(cl_source_code.c_str(), cl_source_code.size(), ""));
+    ASSERT_NO_THROW(device->DeleteExecutable(executable));
+
+    ASSERT_NO_THROW(executable = device->CompileExecutable(&binary[0], binary.size(), ""));
+
+    Calc::Function* func = nullptr;
+    ASSERT_NO_THROW(func = executable->CreateFunction("add"));
+
+    ASSERT_NO_THROW(executable->DeleteFunction(func));
+    ASSERT_NO_THROW(device->DeleteExecutable(executable));
+    ASSERT_NO_THROW(m_calc->DeleteDevice(device));
+
+    m_calc->SetKernelCachePath(nullptr);
+}
+
 TEST_F(CalcTestkOpenCL, Execute)
 {
     auto num_devices = m_calc->GetDeviceCount();
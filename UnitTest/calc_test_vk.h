@@ -33,10 +33,12 @@ THE SOFTWARE.
 #include "gtest/gtest.h"
 #include "calc.h"
 #include "device.h"
+#include "device_vk.h"
 #include "buffer.h"
 #include "except.h"
 #include "event.h"
 #include "executable.h"
+#include "primitives.h"
 #include <radeon_rays.h>
 
 // Api creation fixture, prepares api_ for further tests
@@ -241,6 +243,43 @@ TEST_F(CalcTestkVulkan, ReadWriteBuffer)
     ASSERT_NO_THROW(m_calc->DeleteDevice(device));
 }
 
+// Large buffers are device local and copied through a staging ring smaller than them
+TEST_F(CalcTestkVulkan, ReadWriteDeviceLocalBuffer)
+{
+    Calc::Device* device = nullptr;
+
+    ASSERT_NO_THROW(device = m_calc->CreateDevice(0));
+
+    Calc::Buffer* buffer = nullptr;
+
+    const auto kBufferSize = 5 * 1024 * 1024;
+    std::vector<int> numbers(kBufferSize);
+
+    std::generate(numbers.begin(), numbers.end(), std::rand);
+    ASSERT_NO_THROW(buffer = device->CreateBuffer(kBufferSize * sizeof(int), Calc::BufferType::kWrite, &numbers[0]));
+
+    // overwrite a part at an offset
+    const auto kOffset = 1000;
+    const auto kPartSize = 100000;
+    std::vector<int> part(kPartSize);
+    std::generate(part.begin(), part.end(), std::rand);
+    std::copy(part.begin(), part.end(), numbers.begin() + kOffset);
+
+    ASSERT_NO_THROW(device->WriteBuffer(buffer, 0, kOffset * sizeof(int), kPartSize * sizeof(int), &part[0], nullptr));
+
+    std::vector<int> numbers_calc(kBufferSize);
+
+    ASSERT_NO_THROW(device->ReadBuffer(buffer, 0, 0, kBufferSize * sizeof(int), &numbers_calc[0], nullptr));
+
+    for (auto i = 0; i < kBufferSize; ++i)
+    {
+        ASSERT_EQ(numbers[i], numbers_calc[i]);
+    }
+
+    ASSERT_NO_THROW(device->DeleteBuffer(buffer));
+    ASSERT_NO_THROW(m_calc->DeleteDevice(device));
+}
+
 TEST_F(CalcTestkVulkan, ReadWriteTypedBuffer)
 {
     auto num_devices = m_calc->GetDeviceCount();
@@ -563,4 +602,162 @@ TEST_F(CalcTestkVulkan, ExecuteRawParams)
 }
 
 
+TEST_F(CalcTestkVulkan, ExecuteBatched)
+{
+    auto num_devices = m_calc->GetDeviceCount();
+
+    ASSERT_GE(num_devices, 0U);
+
+    Calc::Device* device = nullptr;
+
+    ASSERT_NO_THROW(device = m_calc->CreateDevice(0));
+
+    auto device_vk = dynamic_cast<Calc::DeviceVulkan*>(device);
+    ASSERT_NE(device_vk, nullptr);
+
+    // All the dispatches below go into a single command buffer
+    device_vk->SetMaxBatchSize(8);
+
+    Calc::Executable* executable = nullptr;
+    Calc::Executable* executable2 = nullptr;
+    ASSERT_NO_THROW(executable = device->CompileExecutable(gl_source_code2.c_str(), gl_source_code2.size(), ""));
+    ASSERT_NO_THROW(executable2 = device->CompileExecutable(gl_source_code2.c_str(), gl_source_code2.size(), ""));
+
+    Calc::Function* func = nullptr;
+    Calc::Function* func2 = nullptr;
+    ASSERT_NO_THROW(func = executable->CreateFunction("add"));
+    ASSERT_NO_THROW(func2 = executable2->CreateFunction("add"));
+
+    // Multiple of the group size, the kernel has no bounds check
+    const auto kBufferSize = 1024;
+    std::vector<int> numbers_a(kBufferSize);
+
+    std::generate(numbers_a.begin(), numbers_a.end(), std::rand);
+
+    Calc::Buffer* buffer_a = nullptr;
+    Calc::Buffer* buffer_c = nullptr;
+    Calc::Buffer* buffer_d = nullptr;
+    Calc::Buffer* buffer_e = nullptr;
+    ASSERT_NO_THROW(buffer_a = device->CreateBuffer(kBufferSize * sizeof(int), Calc::BufferType::kWrite, &numbers_a[0]));
+    ASSERT_NO_THROW(buffer_c = device->CreateBuffer(kBufferSize * sizeof(int), Calc::BufferType::kWrite));
+    ASSERT_NO_THROW(buffer_d = device->CreateBuffer(kBufferSize * sizeof(int), Calc::BufferType::kWrite));
+    ASSERT_NO_THROW(buffer_e = device->CreateBuffer(kBufferSize * sizeof(int), Calc::BufferType::kWrite));
+
+    // Each dispatch reads the result of the previous one, func is reused within the batch
+    std::uint32_t b = 5;
+    ASSERT_NO_THROW(func->SetArg(0, buffer_a));
+    ASSERT_NO_THROW(func->SetArg(1, sizeof(b), &b));
+    ASSERT_NO_THROW(func->SetArg(2, buffer_c));
+    ASSERT_NO_THROW(device->Execute(func, 0, kBufferSize, 64, nullptr));
+
+    ASSERT_NO_THROW(func2->SetArg(0, buffer_c));
+    ASSERT_NO_THROW(func2->SetArg(1, sizeof(b), &b));
+    ASSERT_NO_THROW(func2->SetArg(2, buffer_d));
+    ASSERT_NO_THROW(device->Execute(func2, 0, kBufferSize, 64, nullptr));
+
+    ASSERT_NO_THROW(func->SetArg(0, buffer_d));
+    ASSERT_NO_THROW(func->SetArg(1, sizeof(b), &b));
+    ASSERT_NO_THROW(func->SetArg(2, buffer_e));
+    ASSERT_NO_THROW(device->Execute(func, 0, kBufferSize, 64, nullptr));
+
+    std::vector<int> numbers_e(kBufferSize);
+    ASSERT_NO_THROW(device->ReadBuffer(buffer_e, 0, 0, kBufferSize * sizeof(int), &numbers_e[0], nullptr));
+
+    for (auto i = 0; i < kBufferSize; ++i)
+    {
+        ASSERT_EQ(numbers_e[i], numbers_a[i] + 3 * b);
+    }
+
+    ASSERT_NO_THROW(device->DeleteBuffer(buffer_a));
+    ASSERT_NO_THROW(device->DeleteBuffer(buffer_c));
+    ASSERT_NO_THROW(device->DeleteBuffer(buffer_d));
+    ASSERT_NO_THROW(device->DeleteBuffer(buffer_e));
+    ASSERT_NO_THROW(executable->DeleteFunction(func));
+    ASSERT_NO_THROW(executable2->DeleteFunction(func2));
+    ASSERT_NO_THROW(device->DeleteExecutable(executable));
+    ASSERT_NO_THROW(device->DeleteExecutable(executable2));
+    ASSERT_NO_THROW(m_calc->DeleteDevice(device));
+}
+
+TEST_F(CalcTestkVulkan, PrimitivesSortRadix)
+{
+    Calc::Device* device = nullptr;
+
+    ASSERT_NO_THROW(device = m_calc->CreateDevice(0));
+    ASSERT_TRUE(device->HasBuiltinPrimitives());
+
+    Calc::Primitives* prims = nullptr;
+    ASSERT_NO_THROW(prims = device->CreatePrimitives());
+
+    const auto kBufferSize = 100005;
+    std::vector<std::uint64_t> keys(kBufferSize);
+    std::vector<int> values(kBufferSize);
+
+    for (auto i = 0; i < kBufferSize; ++i)
+    {
+        keys[i] = ((std::uint64_t)(std::rand() % 1024) << 40) | (std::uint64_t)(std::rand() % 65536);
+        values[i] = i;
+    }
+
+    Calc::Buffer* keys_in = device->CreateBuffer(kBufferSize * sizeof(std::uint64_t), Calc::BufferType::kWrite, &keys[0]);
+    Calc::Buffer* keys_out = device->CreateBuffer(kBufferSize * sizeof(std::uint64_t), Calc::BufferType::kWrite);
+    Calc::Buffer* values_in = device->CreateBuffer(kBufferSize * sizeof(int), Calc::BufferType::kWrite, &values[0]);
+    Calc::Buffer* values_out = device->CreateBuffer(kBufferSize * sizeof(int), Calc::BufferType::kWrite);
+
+    ASSERT_NO_THROW(prims->SortRadixInt64(0, keys_in, keys_out, values_in, values_out, kBufferSize));
+
+    std::vector<std::uint64_t> sorted_keys(kBufferSize);
+    std::vector<int> sorted_values(kBufferSize);
+    device->ReadBuffer(keys_out, 0, 0, kBufferSize * sizeof(std::uint64_t), &sorted_keys[0], nullptr);
+    device->ReadBuffer(values_out, 0, 0, kBufferSize * sizeof(int), &sorted_values[0], nullptr);
+
+    for (auto i = 0; i < kBufferSize; ++i)
+    {
+        ASSERT_EQ(sorted_keys[i], keys[sorted_values[i]]);
+
+        if (i < kBufferSize - 1)
+        {
+            ASSERT_LE(sorted_keys[i], sorted_keys[i + 1]);
+        }
+    }
+
+    // Exclusive scan of the values
+    std::vector<int> counts(kBufferSize);
+    std::generate(counts.begin(), counts.end(), []() { return std::rand() % 8; });
+    device->WriteBuffer(values_in, 0, 0, kBufferSize * sizeof(int), &counts[0], nullptr);
+
+    ASSERT_NO_THROW(prims->ScanExclusiveAddInt32(0, values_in, values_out, kBufferSize));
+
+    std::vector<int> scanned(kBufferSize);
+    device->ReadBuffer(values_out, 0, 0, kBufferSize * sizeof(int), &scanned[0], nullptr);
+
+    int sum = 0;
+    for (auto i = 0; i < kBufferSize; ++i)
+    {
+        ASSERT_EQ(scanned[i], sum);
+        sum += counts[i];
+    }
+
+    device->DeleteBuffer(keys_in);
+    device->DeleteBuffer(keys_out);
+    device->DeleteBuffer(values_in);
+    device->DeleteBuffer(values_out);
+    ASSERT_NO_THROW(device->DeletePrimitives(prims));
+    ASSERT_NO_THROW(m_calc->DeleteDevice(device));
+}
+
+TEST_F(CalcTestkVulkan, CompileExecutableInvalidBinary)
+{
+    Calc::Device* device = nullptr;
+
+    ASSERT_NO_THROW(device = m_calc->CreateDevice(0));
+
+    // SPIR-V executables are generated by the build, anything else is rejected
+    std::vector<std::uint8_t> binary(64, 0xff);
+    ASSERT_THROW(device->CompileExecutable(binary.data(), binary.size(), nullptr), Calc::Exception);
+    ASSERT_THROW(device->CompileExecutable(binary.data(), 0, nullptr), Calc::Exception);
+
+    ASSERT_NO_THROW(m_calc->DeleteDevice(device));
+}
+
 #endif // USE_VULKAN
\ No newline at end of file
@@ -31,6 +31,7 @@ THE SOFTWARE.
 #include <numeric>
 #include <cstdlib>
 #include <ctime>
+#include <cfloat>
 
 #include "gtest/gtest.h"
 
@@ -343,6 +344,56 @@ TEST_F(CLW, ExclusiveScanRandom)
     }
 }
 
+// Checks scan correctness when temporary buffers are reused across sizes
+TEST_F(CLW, ExclusiveScanPooledBuffers)
+{
+    // Init rand
+    std::srand((unsigned)std::time(0));
+
+    // Single prims object with a small pool to exercise reuse and eviction
+    CLWParallelPrimitives prims(context_, buildopts_.c_str());
+    prims.SetTempBufferBudget(64 << 10);
+
+    for (int i = 0; i < 20; ++i)
+    {
+        int arraysize = 1 + rand() % 300000;
+
+        // Device buffers
+        auto devinput = context_.CreateBuffer<cl_int>(arraysize, CL_MEM_READ_WRITE);
+        auto devoutput = context_.CreateBuffer<cl_int>(arraysize, CL_MEM_READ_WRITE);
+
+        // Host buffers
+        std::vector<int> hostarray(arraysize);
+        std::vector<int> hostarray_gold(arraysize);
+
+        // Fill host buffer with data
+        std::generate(hostarray.begin(), hostarray.end(), []{ return rand() % 1000; });
+
+        // Perform gold scan
+        int sum = 0;
+        for (int j = 0; j < arraysize; ++j)
+        {
+            hostarray_gold[j] = sum;
+            sum += hostarray[j];
+        }
+
+        // Send data to device
+        context_.WriteBuffer(0, devinput, &hostarray[0], arraysize).Wait();
+
+        // Perform scan
+        prims.ScanExclusiveAdd(0, devinput, devoutput, arraysize).Wait();
+
+        // Read data back to host
+        context_.ReadBuffer(0, devoutput, &hostarray[0], arraysize).Wait();
+
+        // Check correctness
+        for (int j = 0; j < arraysize; ++j)
+        {
+            ASSERT_EQ(hostarray[j], hostarray_gold[j]);
+        }
+    }
+}
+
 // Compact test
 TEST_F(CLW, CompactIdentity)
 {
@@ -427,6 +478,188 @@ TEST_F(CLW, RadixSortLarge)
     }
 }
 
+// Checks key-value sort is stable, values are the original indices
+TEST_F(CLW, RadixSortStable)
+{
+    // Init rand
+    std::srand((unsigned)std::time(0));
+    int arraysize = 2000003;
+
+    // Host buffers, few distinct keys to get long runs of equal ones
+    std::vector<cl_int> hostkeys(arraysize);
+    std::vector<cl_int> hostvalues(arraysize);
+    for (int i = 0; i < arraysize; ++i)
+    {
+        hostkeys[i] = (rand() % 64) << 20;
+        hostvalues[i] = i;
+    }
+
+    // Device buffers
+    auto devkeys = context_.CreateBuffer<cl_int>(arraysize, CL_MEM_READ_WRITE, &hostkeys[0]);
+    auto devsortedkeys = context_.CreateBuffer<cl_int>(arraysize, CL_MEM_READ_WRITE);
+    auto devvalues = context_.CreateBuffer<cl_int>(arraysize, CL_MEM_READ_WRITE, &hostvalues[0]);
+    auto devsortedvalues = context_.CreateBuffer<cl_int>(arraysize, CL_MEM_READ_WRITE);
+
+    // Create parallel prims object
+    CLWParallelPrimitives prims(context_, buildopts_.c_str());
+
+    // Perform sort
+    prims.SortRadix(0, devkeys, devsortedkeys, devvalues, devsortedvalues, arraysize).Wait();
+
+    // Read data back to host
+    std::vector<cl_int> sortedkeys(arraysize);
+    std::vector<cl_int> sortedvalues(arraysize);
+    context_.ReadBuffer(0, devsortedkeys, &sortedkeys[0], arraysize).Wait();
+    context_.ReadBuffer(0, devsortedvalues, &sortedvalues[0], arraysize).Wait();
+
+    // Check correctness
+    for (int i = 0; i < arraysize; ++i)
+    {
+        ASSERT_EQ(sortedkeys[i], hostkeys[sortedvalues[i]]);
+
+        if (i < arraysize - 1)
+        {
+            ASSERT_LE(sortedkeys[i], sortedkeys[i + 1]);
+
+            if (sortedkeys[i] == sortedkeys[i + 1])
+            {
+                ASSERT_LT(sortedvalues[i], sortedvalues[i + 1]);
+            }
+        }
+    }
+}
+
+// Checks 64-bit key sort correctness, values follow their keys
+TEST_F(CLW, RadixSort64)
+{
+    // Init rand
+    std::srand((unsigned)std::time(0));
+    int arraysize = 1000005;
+
+    // Host buffers, keys differ in both halves to exercise both passes
+    std::vector<cl_ulong> hostkeys(arraysize);
+    std::vector<cl_int> hostvalues(arraysize);
+    for (int i = 0; i < arraysize; ++i)
+    {
+        hostkeys[i] = ((cl_ulong)(rand() % 1024) << 40) | ((cl_ulong)(rand() % 4) << 32) | (cl_ulong)(rand() % 65536) << 16;
+        hostvalues[i] = i;
+    }
+
+    // Device buffers
+    auto devkeys = context_.CreateBuffer<cl_ulong>(arraysize, CL_MEM_READ_WRITE, &hostkeys[0]);
+    auto devsortedkeys = context_.CreateBuffer<cl_ulong>(arraysize, CL_MEM_READ_WRITE);
+    auto devvalues = context_.CreateBuffer<cl_int>(arraysize, CL_MEM_READ_WRITE, &hostvalues[0]);
+    auto devsortedvalues = context_.CreateBuffer<cl_int>(arraysize, CL_MEM_READ_WRITE);
+
+    // Create parallel prims object
+    CLWParallelPrimitives prims(context_, buildopts_.c_str());
+
+    // Perform sort
+    prims.SortRadix(0, devkeys, devsortedkeys, devvalues, devsortedvalues, arraysize).Wait();
+
+    // Read data back to host
+    std::vector<cl_ulong> sortedkeys(arraysize);
+    std::vector<cl_int> sortedvalues(arraysize);
+    context_.ReadBuffer(0, devsortedkeys, &sortedkeys[0], arraysize).Wait();
+    context_.ReadBuffer(0, devsortedvalues, &sortedvalues[0], arraysize).Wait();
+
+    // Check correctness
+    for (int i = 0; i < arraysize; ++i)
+    {
+        ASSERT_EQ(sortedkeys[i], hostkeys[sortedvalues[i]]);
+
+        if (i < arraysize - 1)
+        {
+            ASSERT_LE(sortedkeys[i], sortedkeys[i + 1]);
+        }
+    }
+}
+
+// Checks float keys are sorted by value, negative ones included
+TEST_F(CLW, RadixSortFloat)
+{
+    // Init rand
+    std::srand((unsigned)std::time(0));
+    int arraysize = 300007;
+
+    // Host buffers
+    std::vector<cl_float> hostkeys(arraysize);
+    std::generate(hostkeys.begin(), hostkeys.end(), []{ return (cl_float)(rand() % 20000 - 10000) * 0.125f; });
+
+    // Device buffers
+    auto devkeys = context_.CreateBuffer<cl_float>(arraysize, CL_MEM_READ_WRITE, &hostkeys[0]);
+    auto devsortedkeys = context_.CreateBuffer<cl_float>(arraysize, CL_MEM_READ_WRITE);
+
+    // Create parallel prims object
+    CLWParallelPrimitives prims(context_, buildopts_.c_str());
+
+    // Perform sort
+    prims.SortRadix(0, devkeys, devsortedkeys).Wait();
+
+    // Read data back to host
+    std::vector<cl_float> sortedkeys(arraysize);
+    context_.ReadBuffer(0, devsortedkeys, &sortedkeys[0], arraysize).Wait();
+
+    // Check correctness against the host sort
+    std::sort(hostkeys.begin(), hostkeys.end());
+    for (int i = 0; i < arraysize; ++i)
+    {
+        ASSERT_EQ(sortedkeys[i], hostkeys[i]);
+    }
+}
+
+TEST_F(CLW, ReduceBbox)
+{
+    // Init rand
+    std::srand((unsigned)std::time(0));
+    int numboxes = 100005;
+
+    // Host boxes as pmin/pmax float4 pairs
+    std::vector<cl_float> hostboxes(numboxes * 8);
+    cl_float refmin[4] = { FLT_MAX, FLT_MAX, FLT_MAX, FLT_MAX };
+    cl_float refmax[4] = { -FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for (int i = 0; i < numboxes; ++i)
+    {
+        for (int c = 0; c < 4; ++c)
+        {
+            cl_float a = (cl_float)(rand() % 20000 - 10000);
+            cl_float b = a + (cl_float)(rand() % 100);
+            hostboxes[i * 8 + c] = a;
+            hostboxes[i * 8 + 4 + c] = b;
+            refmin[c] = std::min(refmin[c], a);
+            refmax[c] = std::max(refmax[c], b);
+        }
+    }
+
+    // Device buffers
+    auto devboxes = context_.CreateBuffer<cl_float>(numboxes * 8, CL_MEM_READ_ONLY, &hostboxes[0]);
+    auto devresult = context_.CreateBuffer<cl_float>(8, CL_MEM_READ_WRITE);
+
+    // Create parallel prims object
+    CLWParallelPrimitives prims(context_, buildopts_.c_str());
+
+    // Perform reduction
+    prims.ReduceBbox(0, devboxes, devresult, numboxes).Wait();
+
+    // Read data back to host
+    cl_float result[8];
+    context_.ReadBuffer(0, devresult, result, 8).Wait();
+
+    // Check correctness
+    for (int c = 0; c < 4; ++c)
+    {
+        ASSERT_EQ(result[c], refmin[c]);
+        ASSERT_EQ(result[4 + c], refmax[c]);
+    }
+
+    // Min/max of the flat array
+    prims.ReduceMinMax(0, devboxes, devresult, numboxes * 8).Wait();
+    context_.ReadBuffer(0, devresult, result, 2).Wait();
+
+    ASSERT_EQ(result[0], *std::min_element(refmin, refmin + 4));
+    ASSERT_EQ(result[1], *std::max_element(refmax, refmax + 4));
+}
+
 #endif
 
 #endif //USE_OPENCL
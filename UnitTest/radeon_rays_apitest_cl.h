@@ -30,6 +30,18 @@ THE SOFTWARE.
 #include "math/quaternion.h"
 #include "tiny_obj_loader.h"
 #include "utils.h"
+#include "scene_generator.h"
+#include "../Tutorials/Tools/scene_file.h"
+#include "../Tutorials/Tools/parallel_obj_loader.h"
+#include "../RadeonRays/src/device/remote_protocol.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <thread>
 
 using namespace RadeonRays;
 
@@ -59,6 +71,7 @@ public:
 
         ASSERT_NE(nativeidx, -1);
 
+        nativeidx_ = nativeidx;
         api_ = IntersectionApi::Create(nativeidx);
     }
 
@@ -75,6 +88,7 @@ public:
 
     IntersectionApi* api_;
     Event* e_;
+    int nativeidx_;
 
     static float const * vertices() {
         static float const vertices[] = {
@@ -244,136 +258,62 @@ TEST_F(ApiBackendOpenCL, Intersection_1Ray)
 }
 
 
-#ifdef RR_RAY_MASK
-// The test creates a single triangle mesh and tests attach/detach functionality
-TEST_F(ApiBackendOpenCL, Intersection_1Ray_Masked)
-#else
-// The test creates a single triangle mesh and tests attach/detach functionality
-TEST_F(ApiBackendOpenCL, DISABLED_Intersection_1Ray_Masked)
-#endif
+// The test intersects a ray using buffers allocated in pinned host memory
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_StreamBuffers)
 {
-
     Shape* mesh = nullptr;
 
-    api_->SetOption("acc.type", "bvh");
-
-    // Create mesh
-    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
-
-    // Set mask 
-    ASSERT_NO_THROW(mesh->SetMask(0xFFFFFFFF));
-
-    ASSERT_TRUE(mesh != nullptr);
-
-    // Attach the mesh to the scene
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
     ASSERT_NO_THROW(api_->AttachShape(mesh));
 
-    // Prepare the ray
     ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
-    r.SetMask(0xFFFFFFFF);
-
-    // Intersection and hit data
-    Intersection isect;
 
-    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
-    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
-    auto isect_flag_buffer = api_->CreateBuffer(sizeof(int), nullptr);
+    Buffer* ray_buffer = nullptr;
+    Buffer* isect_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(sizeof(ray), &r, kBufferStream));
+    ASSERT_NO_THROW(isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr, kBufferStream));
 
-    // Commit geometry update
     ASSERT_NO_THROW(api_->Commit());
-    
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
-    
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
     Intersection* tmp = nullptr;
     ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
     Wait();
-    isect = *tmp;
-    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
-    Wait();
-    
-    // Check results
-    ASSERT_EQ(isect.shapeid, mesh->GetId());
-
-    mesh->SetMask(0x0);
 
-    // Commit geometry update
-    ASSERT_NO_THROW(api_->Commit());
-    
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
-    
-    tmp = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
-    Wait();
-    isect = *tmp;
+    Intersection isect = *tmp;
     ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
     Wait();
-    
-    // Check results
-    ASSERT_EQ(isect.shapeid, kNullId);
-
-    mesh->SetMask(0xFF000000);
-    
-    int result = kNullId;
-    // Commit geometry update
-    ASSERT_NO_THROW(api_->Commit());
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 1, isect_flag_buffer, nullptr, nullptr ));
-    
-    int* isect_flag = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_flag_buffer, kMapRead, 0, sizeof(int), (void**)&isect_flag, &e_));
-    Wait();
-    result = *isect_flag;
-    ASSERT_NO_THROW(api_->UnmapBuffer(isect_flag_buffer, isect_flag, &e_));
-    Wait();
-    
-    // Check results
-    ASSERT_GT(result, 0);
-
-    mesh->SetMask(0xFF000000);
-    
-    r.SetMask(0x000000FF);
-    
-    ray* rr = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(ray_buffer, kMapWrite, 0, sizeof(ray), (void**)&rr, &e_));
-    Wait();
-    *rr = r;
-    ASSERT_NO_THROW(api_->UnmapBuffer(ray_buffer, rr, &e_));
-    Wait();
-
-    // Commit geometry update
-    ASSERT_NO_THROW(api_->Commit());
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 1, isect_flag_buffer, nullptr, nullptr ));
-    
-    isect_flag = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_flag_buffer, kMapRead, 0, sizeof(int), (void**)&isect_flag, &e_));
-    Wait();
-    result = *isect_flag;
-    ASSERT_NO_THROW(api_->UnmapBuffer(isect_flag_buffer, isect_flag, &e_));
-    Wait();
-    // Check results
-    ASSERT_EQ(result, kNullId);
 
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+    ASSERT_EQ(isect.primid, 0);
 
-    // Bail out
     ASSERT_NO_THROW(api_->DetachShape(mesh));
     ASSERT_NO_THROW(api_->DeleteShape(mesh));
     ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
     ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
-    ASSERT_NO_THROW(api_->DeleteBuffer(isect_flag_buffer));
-
 }
 
-
-// The test creates a single triangle mesh and tests attach/detach functionality
-TEST_F(ApiBackendOpenCL, Intersection_1Ray_Active)
+// The test intersects a strided triangle mesh referencing caller memory
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_ExternalMemory)
 {
+    struct Vertex
+    {
+        float position[3];
+        float normal[3];
+    };
+
+    // Caller owned data, has to outlive the mesh
+    Vertex mvertices[] = {
+        { -1.f, -1.f, 0.f, 0.f, 0.f, 1.f },
+        { 1.f, -1.f, 0.f, 0.f, 0.f, 1.f },
+        { 0.f, 1.f, 0.f, 0.f, 0.f, 1.f }
+    };
+
+    int mindices[] = { 0, 1, 2, 0 };
+
     Shape* mesh = nullptr;
 
-    // Create mesh
-    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(mesh = api_->CreateMeshFromExternalMemory((float*)mvertices, 3, sizeof(Vertex), mindices, 4*sizeof(int), 1));
 
     ASSERT_TRUE(mesh != nullptr);
 
@@ -385,58 +325,26 @@ TEST_F(ApiBackendOpenCL, Intersection_1Ray_Active)
 
     // Intersection and hit data
     Intersection isect;
-    
+
     auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
     auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
 
     // Commit geometry update
     ASSERT_NO_THROW(api_->Commit());
-    
     // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
-    
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
     Intersection* tmp = nullptr;
     ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
     Wait();
-    isect = *tmp;
-    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
-    Wait();
-    
-    // Check results
-    ASSERT_EQ(isect.shapeid, mesh->GetId());
-
-    isect.primid = kNullId;
-    isect.shapeid = kNullId;
 
-    r.SetActive(false);
-    
-    ray* rr = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(ray_buffer, kMapWrite, 0, sizeof(ray), (void**)&rr, &e_));
-    Wait();
-    *rr = r;
-    ASSERT_NO_THROW(api_->UnmapBuffer(ray_buffer, rr, &e_));
-    Wait();
-    
-    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapWrite, 0, sizeof(Intersection), (void**)&tmp, &e_));
-    Wait();
-    *tmp = isect;
-    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
-    Wait();
-    
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
-    
-    tmp = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
-    Wait();
     isect = *tmp;
     ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
     Wait();
 
-    
     // Check results
-    ASSERT_EQ(isect.shapeid, kNullId);
-
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+    ASSERT_EQ(isect.primid, 0);
 
     // Bail out
     ASSERT_NO_THROW(api_->DetachShape(mesh));
@@ -445,153 +353,123 @@ TEST_F(ApiBackendOpenCL, Intersection_1Ray_Active)
     ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
 
-// The test creates a single triangle mesh and tests attach/detach functionality
-TEST_F(ApiBackendOpenCL, Intersection_3Rays)
+// The test intersects both halves of a quad stored as a single primitive
+TEST_F(ApiBackendOpenCL, Intersection_2Rays_Quad2Level)
 {
+    float mvertices[] = {
+        -1.f, -1.f, 0.f,
+        1.f, -1.f, 0.f,
+        1.f, 1.f, 0.f,
+        -1.f, 1.f, 0.f
+    };
 
-    Shape* mesh = nullptr;
-
-    // 
-    ASSERT_NO_THROW(api_->SetOption("acc.type", "grid"));
-
-    // Create mesh
-    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    int mindices[] = { 0, 1, 2, 3 };
+    int mnumfaceverts[] = { 4 };
 
-    ASSERT_TRUE(mesh != nullptr);
+    Shape* mesh = nullptr;
 
-    // Attach the mesh to the scene
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(mvertices, 4, 3*sizeof(float), mindices, 0, mnumfaceverts, 1));
     ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 1.f));
 
-    // Rays
-    ray rays[3];
-
-    // Prepare the ray
-    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
-    rays[0].d = float3(0.f,0.f,1.f);
-
-    rays[1].o = float4(0.f,0.5f,-10.f, 1000.f);
-    rays[1].d = float3(0.f,0.f,1.f);
-
-    rays[2].o = float4(0.5f,0.f,-10.f, 1000.f);
-    rays[2].d = float3(0.f,0.f,1.f);
+    // Rays hitting the (v0, v1, v2) and (v0, v2, v3) halves
+    ray r[2];
+    r[0] = ray(float3(0.5f, -0.5f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    r[1] = ray(float3(-0.5f, 0.5f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
 
-    // Intersection and hit data
-    Intersection isect[3];
-    
-    auto ray_buffer = api_->CreateBuffer(3*sizeof(ray), rays);
-    auto isect_buffer = api_->CreateBuffer(3*sizeof(Intersection), nullptr);
+    auto ray_buffer = api_->CreateBuffer(2 * sizeof(ray), r);
+    auto isect_buffer = api_->CreateBuffer(2 * sizeof(Intersection), nullptr);
 
-    // Commit geometry update
     ASSERT_NO_THROW(api_->Commit());
-    
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr ));
-    
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, nullptr));
+
     Intersection* tmp = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 2 * sizeof(Intersection), (void**)&tmp, &e_));
     Wait();
-    isect[0] = tmp[0];
-    isect[1] = tmp[1];
-    isect[2] = tmp[2];
+
+    Intersection isect[2] = { tmp[0], tmp[1] };
     ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
     Wait();
-    
-    // Check results
-    for (int i=0; i<3; ++i)
+
+    // Both hit the same primitive, uv spans the quad
+    for (int i = 0; i < 2; ++i)
     {
         ASSERT_EQ(isect[i].shapeid, mesh->GetId());
+        ASSERT_EQ(isect[i].primid, 0);
     }
 
+    ASSERT_NEAR(isect[0].uvwt.x, 0.75f, 0.001f);
+    ASSERT_NEAR(isect[0].uvwt.y, 0.25f, 0.001f);
+    ASSERT_NEAR(isect[1].uvwt.x, 0.25f, 0.001f);
+    ASSERT_NEAR(isect[1].uvwt.y, 0.75f, 0.001f);
+
     // Bail out
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 0.f));
     ASSERT_NO_THROW(api_->DetachShape(mesh));
     ASSERT_NO_THROW(api_->DeleteShape(mesh));
     ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
     ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
 
-
-// Test is checking if mesh transform is working as expected
-TEST_F(ApiBackendOpenCL, Intersection_1Ray_Transformed)
+// The test loads a mesh of alternating quads and triangles spanning several loading chunks
+TEST_F(ApiBackendOpenCL, Intersection_MixedFacesMesh)
 {
+    int const kNumFaces = 10000;
 
-    Shape* mesh = nullptr;
+    // Face i covers [i, i + 1] along x with vertices of its own
+    std::vector<float> mvertices;
+    std::vector<int> mindices;
+    std::vector<int> mnumfaceverts(kNumFaces);
+    for (int i = 0; i < kNumFaces; ++i)
+    {
+        float const x = (float)i;
+        float const corners[] = { x, -1.f, 0.f, x + 1.f, -1.f, 0.f, x + 1.f, 1.f, 0.f, x, 1.f, 0.f };
 
-    // Create mesh
-    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+        int const base = (int)mvertices.size() / 3;
+        mnumfaceverts[i] = (i & 1) ? 3 : 4;
 
-    ASSERT_TRUE(mesh != nullptr);
+        for (int j = 0; j < mnumfaceverts[i]; ++j)
+        {
+            // Triangles drop the third corner
+            int const corner = (mnumfaceverts[i] == 3 && j == 2) ? 3 : j;
+            mvertices.insert(mvertices.end(), corners + 3 * corner, corners + 3 * corner + 3);
+            mindices.push_back(base + j);
+        }
+    }
 
-    // Attach the mesh to the scene
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(mvertices.data(), (int)mvertices.size() / 3, 3 * sizeof(float), mindices.data(), 0, mnumfaceverts.data(), kNumFaces));
     ASSERT_NO_THROW(api_->AttachShape(mesh));
 
-    // Prepare the ray
-    ray r;
-    r.o = float4(0.f,0.f,-10.f, 1000.f);
-    r.d = float3(0.f,0.f,1.f);
+    // Rays hit the first triangle of each face
+    std::vector<ray> r(kNumFaces);
+    for (int i = 0; i < kNumFaces; ++i)
+    {
+        r[i] = ray(float3((float)i + 0.6f, -0.6f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    }
 
-    // Intersection and hit data
-    Intersection isect;
-    
-    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
-    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+    auto ray_buffer = api_->CreateBuffer(kNumFaces * sizeof(ray), r.data());
+    auto isect_buffer = api_->CreateBuffer(kNumFaces * sizeof(Intersection), nullptr);
 
-    // Commit geometry update
     ASSERT_NO_THROW(api_->Commit());
-    
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
-    
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumFaces, isect_buffer, nullptr, nullptr));
+
     Intersection* tmp = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumFaces * sizeof(Intersection), (void**)&tmp, &e_));
     Wait();
-    isect = *tmp;
+    std::vector<Intersection> isect(tmp, tmp + kNumFaces);
     ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
     Wait();
-    
-    // Check results
-    ASSERT_EQ(isect.shapeid, mesh->GetId());
 
-    matrix m = translation(float3(0,2,0));
-    matrix minv = inverse(m);
-    // Move the mesh
-    ASSERT_NO_THROW(mesh->SetTransform(m, minv));
-    // Reset ray
+    for (int i = 0; i < kNumFaces; ++i)
+    {
+        ASSERT_EQ(isect[i].shapeid, mesh->GetId());
+        ASSERT_EQ(isect[i].primid, i);
+    }
 
-    // Commit geometry update
-    ASSERT_NO_THROW(api_->Commit());
-    
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
-    
-    tmp = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
-    Wait();
-    isect = *tmp;
-    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
-    Wait();
-    
-    // Check results
-    ASSERT_EQ(isect.shapeid, -1);
-
-    // Set transform to identity
-    m = matrix();
-    ASSERT_NO_THROW(mesh->SetTransform(m, m));
-
-    // Commit geometry update
-    ASSERT_NO_THROW(api_->Commit());
-    
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
-    
-    tmp = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
-    Wait();
-    isect = *tmp;
-    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
-    Wait();
-    
-    // Check results
-    ASSERT_EQ(isect.shapeid, mesh->GetId());
+    // Faces of other sizes are rejected
+    mnumfaceverts[kNumFaces - 1] = 5;
+    ASSERT_THROW(api_->CreateMesh(mvertices.data(), (int)mvertices.size() / 3, 3 * sizeof(float), mindices.data(), 0, mnumfaceverts.data(), kNumFaces), Exception);
 
     // Bail out
     ASSERT_NO_THROW(api_->DetachShape(mesh));
@@ -600,503 +478,6796 @@ TEST_F(ApiBackendOpenCL, Intersection_1Ray_Transformed)
     ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
 
-// The test checks intersection after geometry addition
-TEST_F(ApiBackendOpenCL, Intersection_1Ray_DynamicGeo)
+// The test detaches and attaches meshes of a 2-level BVH, which reuses bottom level BVHs of cached meshes
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_2LevelDetachAttach)
 {
-    // Mesh vertices
-    float vertices[] = {
-        -1.f,-1.f,0.f,
-        1.f,-1.f,0.f,
-        0.f,1.f,0.f,
-        
-    };
-    
-    float vertices1[] = {
-        -1.f,-1.f,-1.f,
-        1.f,-1.f,-1.f,
-        0.f,1.f,-1.f,
-        
+    int const kNumMeshes = 3;
+
+    // Triangles side by side along x, each ray hits one of them
+    auto create_mesh = [this](float x)
+    {
+        float mvertices[] = {
+            x - 1.f, -1.f, 0.f,
+            x + 1.f, -1.f, 0.f,
+            x, 1.f, 0.f
+        };
+
+        return api_->CreateMesh(mvertices, 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1);
     };
 
-    Shape* closemesh = nullptr;
-    Shape* farmesh = nullptr;
+    Shape* meshes[kNumMeshes] = { nullptr };
+    ray r[kNumMeshes];
+    for (int i = 0; i < kNumMeshes; ++i)
+    {
+        float x = 4.f * (i - 1);
+        ASSERT_NO_THROW(meshes[i] = create_mesh(x));
+        ASSERT_NO_THROW(api_->AttachShape(meshes[i]));
+        r[i] = ray(float3(x, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    }
 
-    // Create two meshes
-    ASSERT_NO_THROW(farmesh = api_->CreateMesh(vertices, 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
-    ASSERT_NO_THROW(closemesh = api_->CreateMesh(vertices1, 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 1.f));
 
-    ASSERT_TRUE(farmesh != nullptr);
-    ASSERT_TRUE(closemesh != nullptr);
+    auto ray_buffer = api_->CreateBuffer(kNumMeshes * sizeof(ray), r);
+    auto isect_buffer = api_->CreateBuffer(kNumMeshes * sizeof(Intersection), nullptr);
 
-    // Attach the mesh to the scene
-    ASSERT_NO_THROW(api_->AttachShape(farmesh));
+    // Commit and check which mesh each ray hits, nullptr for misses
+    auto check = [&](Shape* const* expected)
+    {
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumMeshes, isect_buffer, nullptr, nullptr));
 
-    // Prepare the ray
-    ray r;
-    r.o = float4(0.f,0.f,-10.f, 1000.f);
-    r.d = float3(0.f,0.f,1.f);
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumMeshes * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
 
+        for (int i = 0; i < kNumMeshes; ++i)
+        {
+            ASSERT_EQ(tmp[i].shapeid, expected[i] ? expected[i]->GetId() : kNullId);
+        }
 
-    // Intersection and hit data
-    Intersection isect;
-    
-    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
-    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+    };
 
-    // Commit geometry update
-    ASSERT_NO_THROW(api_->Commit());
-    
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
-    
-    Intersection* tmp = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
-    Wait();
-    isect = *tmp;
-    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
-    Wait();
-    
-    // Check results
-    ASSERT_EQ(isect.shapeid, farmesh->GetId());
+    check(meshes);
 
-    // Attach closer mesh to the scene
-    ASSERT_NO_THROW(api_->AttachShape(closemesh));
+    // Detached mesh is missed and hit again once attached
+    ASSERT_NO_THROW(api_->DetachShape(meshes[1]));
+    Shape* detached[kNumMeshes] = { meshes[0], nullptr, meshes[2] };
+    check(detached);
 
-    // Commit geometry update
-    ASSERT_NO_THROW(api_->Commit());
-    
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
-    
-    tmp = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
-    Wait();
-    isect = *tmp;
-    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
-    Wait();
-    
-    // Check results
-    ASSERT_EQ(isect.shapeid, closemesh->GetId());
+    ASSERT_NO_THROW(api_->AttachShape(meshes[1]));
+    check(meshes);
 
-    // Attach closer mesh to the scene
-    ASSERT_NO_THROW(api_->DetachShape(closemesh));
+    // Vertices replaced while the mesh is detached are not taken from the cache
+    float moved[] = {
+        7.f, -1.f, 0.f,
+        9.f, -1.f, 0.f,
+        8.f, 1.f, 0.f
+    };
 
-    // Commit geometry update
-    ASSERT_NO_THROW(api_->Commit());
-    
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
-    
-    tmp = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
-    Wait();
-    isect = *tmp;
-    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
-    Wait();
-    
-    // Check results
-    ASSERT_EQ(isect.shapeid, farmesh->GetId());
+    ASSERT_NO_THROW(api_->DetachShape(meshes[1]));
+    ASSERT_NO_THROW(meshes[1]->UpdateVertices(moved, 3 * sizeof(float)));
+    ASSERT_NO_THROW(api_->AttachShape(meshes[1]));
+    check(detached);
+
+    // A mesh replacing a deleted one gets its own BVH
+    ASSERT_NO_THROW(api_->DetachShape(meshes[1]));
+    ASSERT_NO_THROW(api_->DeleteShape(meshes[1]));
+    ASSERT_NO_THROW(meshes[1] = create_mesh(0.f));
+    ASSERT_NO_THROW(api_->AttachShape(meshes[1]));
+    check(meshes);
 
     // Bail out
-    ASSERT_NO_THROW(api_->DetachShape(farmesh));
-    ASSERT_NO_THROW(api_->DeleteShape(farmesh));
-    ASSERT_NO_THROW(api_->DeleteShape(closemesh));
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 0.f));
+    for (int i = 0; i < kNumMeshes; ++i)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(meshes[i]));
+        ASSERT_NO_THROW(api_->DeleteShape(meshes[i]));
+    }
     ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
     ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
 
-TEST_F(ApiBackendOpenCL, CornellBoxLoad)
+// The test checks that identical meshes traversed as instances of one of them keep their own transforms and IDs
+TEST_F(ApiBackendOpenCL, Intersection_2LevelDedupMeshes)
 {
-    using namespace tinyobj;
-    std::vector<shape_t> shapes;
-    std::vector<material_t> materials;
-    std::vector<Shape*> apishapes;
+    static int const kNumMeshes = 3;
 
-    // Load obj file 
-    std::string res = LoadObj(shapes, materials, "../Resources/CornellBox/orig.objm");
+    Shape* meshes[kNumMeshes] = { nullptr };
+    ray r[kNumMeshes];
+    for (int i = 0; i < kNumMeshes; ++i)
+    {
+        float x = 4.f * (i - 1);
+        ASSERT_NO_THROW(meshes[i] = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+        ASSERT_NO_THROW(api_->AttachShape(meshes[i]));
 
-    ASSERT_NO_THROW(api_->SetOption("acc.type", "grid"));
+        matrix m = translation(float3(x, 0.f, 0.f));
+        ASSERT_NO_THROW(meshes[i]->SetTransform(m, inverse(m)));
+        r[i] = ray(float3(x, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    }
 
-    // Create meshes within IntersectionApi
-    for  (int i=0; i<(int)shapes.size(); ++i)
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 1.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.2level.dedup", 1.f));
+
+    auto ray_buffer = api_->CreateBuffer(kNumMeshes * sizeof(ray), r);
+    auto isect_buffer = api_->CreateBuffer(kNumMeshes * sizeof(Intersection), nullptr);
+
+    // Commit and check which mesh each ray hits, nullptr for misses
+    auto check = [&](Shape* const* expected)
     {
-        Shape* shape = nullptr;
-        ASSERT_NO_THROW(shape = api_->CreateMesh(&shapes[i].mesh.positions[0], (int)shapes[i].mesh.positions.size() / 3, 3*sizeof(float),
-            &shapes[i].mesh.indices[0], 0, nullptr, (int)shapes[i].mesh.indices.size() / 3));
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumMeshes, isect_buffer, nullptr, nullptr));
 
-        ASSERT_NO_THROW(api_->AttachShape(shape));
-        apishapes.push_back(shape);
-    }
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumMeshes * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
 
-    // Commit update
-    ASSERT_NO_THROW(api_->Commit());
+        for (int i = 0; i < kNumMeshes; ++i)
+        {
+            ASSERT_EQ(tmp[i].shapeid, expected[i] ? expected[i]->GetId() : kNullId);
+        }
 
-    // Delete meshes
-    for (int i=0; i<(int)apishapes.size(); ++i)
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+    };
+
+    check(meshes);
+
+    // Moving the vertices of one of the duplicates leaves the others in place
+    float moved[] = {
+        -1.f, 5.f, 0.f,
+        1.f, 5.f, 0.f,
+        0.f, 7.f, 0.f
+    };
+
+    ASSERT_NO_THROW(meshes[1]->UpdateVertices(moved, 3 * sizeof(float)));
+    Shape* expected[kNumMeshes] = { meshes[0], nullptr, meshes[2] };
+    check(expected);
+
+    // Detaching the mesh the others share the BVH with
+    ASSERT_NO_THROW(api_->DetachShape(meshes[0]));
+    expected[0] = nullptr;
+    check(expected);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("bvh.2level.dedup", 0.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 0.f));
+    for (int i = 1; i < kNumMeshes; ++i)
     {
-        ASSERT_NO_THROW(api_->DeleteShape(apishapes[i]));
+        ASSERT_NO_THROW(api_->DetachShape(meshes[i]));
     }
+    for (int i = 0; i < kNumMeshes; ++i)
+    {
+        ASSERT_NO_THROW(api_->DeleteShape(meshes[i]));
+    }
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
 
-TEST_F(ApiBackendOpenCL, CornellBox_1Ray)
+// The test moves vertices of a mesh refitting its bottom level BVH
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_UpdateVertices)
 {
-    using namespace tinyobj;
-    std::vector<shape_t> shapes;
-    std::vector<material_t> materials;
-    std::vector<Shape*> apishapes;
+    Shape* mesh = nullptr;
 
-    // Load obj file 
-    std::string res = LoadObj(shapes, materials, "../Resources/CornellBox/orig.objm");
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 1.f));
 
-    //ASSERT_NO_THROW(api_->SetOption("acc.type", "grid"));
+    // Prepare the ray
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
 
-    // Create meshes within IntersectionApi
-    for (int i = 0; i<(int)shapes.size(); ++i)
-    {
-        Shape* shape = nullptr;
-        ASSERT_NO_THROW(shape = api_->CreateMesh(&shapes[i].mesh.positions[0], (int)shapes[i].mesh.positions.size() / 3, 3 * sizeof(float),
-            &shapes[i].mesh.indices[0], 0, nullptr, (int)shapes[i].mesh.indices.size() / 3));
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
 
-        ASSERT_NO_THROW(api_->AttachShape(shape));
-        apishapes.push_back(shape);
+    float moved[9];
+    for (int i = 0; i < 9; ++i)
+    {
+        moved[i] = vertices()[i] + (i % 3 == 2 ? 5.f : 0.f);
     }
 
-    // Prepare the ray
-    ray r;
-    r.o = float4(0.f, 0.5f, -10.f, 1000.f);
-    r.d = float3(0.f, 0.f, 1.f);
-
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        // Second pass moves the triangle 5 units away from the ray origin
+        if (pass == 1)
+        {
+            ASSERT_NO_THROW(mesh->UpdateVertices(moved, 0));
+        }
 
-    // Intersection and hit data
-    Intersection isect;
-    
-    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
-    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
 
-    // Commit geometry update
-    ASSERT_NO_THROW(api_->Commit());
-    
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
-    
-    Intersection* tmp = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
-    Wait();
-    isect = *tmp;
-    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
-    Wait();
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
 
+        Intersection isect = *tmp;
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
 
-    // Delete meshes
-    for (int i = 0; i<(int)apishapes.size(); ++i)
-    {
-        ASSERT_NO_THROW(api_->DeleteShape(apishapes[i]));
+        ASSERT_EQ(isect.shapeid, mesh->GetId());
+        ASSERT_NEAR(isect.uvwt.w, pass == 0 ? 10.f : 15.f, 0.001f);
     }
 
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 0.f));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
     ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
     ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
 
-
-// Test is checking if mesh transform is working as expected
-TEST_F(ApiBackendOpenCL, Intersection_1Ray_TransformedInstance1)
+// The test checks meshes built and updated as their build hints suggest are hit at their new position
+TEST_F(ApiBackendOpenCL, Intersection_2LevelBuildHints)
 {
-    // this test uses a single mesh, it added into the world as itself
-    // at <0,-1,1000> AND as an instance at <0,0,2>
-    // ray from <0,0,-10> along the pos z should hit the uninstanced mesh
+    static int const kNumMeshes = 3;
+    BuildHint const hints[kNumMeshes] = { kBuildDefault, kBuildStatic, kBuildDeforming };
 
-    std::vector<TestShape> shapes = { TestShape(vertices(), 3, indices(), 3, numfaceverts(), 1),
-                            TestShape(vertices(), 3, indices(), 3, numfaceverts(), 1), 
-                            TestShape(vertices(), 3, indices(), 3, numfaceverts(), 1)};
-    TestShape& mesh0 = shapes[0];
-    TestShape& mesh1 = shapes[1];
-    TestShape& instance = shapes[2];
+    Shape* meshes[kNumMeshes] = { nullptr };
+    ray r[kNumMeshes];
+    for (int i = 0; i < kNumMeshes; ++i)
+    {
+        float x = 4.f * i;
+        ASSERT_NO_THROW(meshes[i] = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+        ASSERT_NO_THROW(meshes[i]->SetBuildHint(hints[i]));
+        ASSERT_EQ(meshes[i]->GetBuildHint(), hints[i]);
+        ASSERT_NO_THROW(api_->AttachShape(meshes[i]));
+
+        matrix m = translation(float3(x, 0.f, 0.f));
+        ASSERT_NO_THROW(meshes[i]->SetTransform(m, inverse(m)));
+        r[i] = ray(float3(x, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    }
 
-    // Create meshes
-    // NOTE mesh in world and as a instance upsets the simple TestIntersection API call 
-    ASSERT_NO_THROW(mesh0.shape = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
-    ASSERT_TRUE(mesh0.shape != nullptr);
-    ASSERT_NO_THROW(mesh1.shape = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
-    ASSERT_TRUE(mesh1.shape != nullptr);
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 1.f));
 
-    // Attach the mesh to the scene
-    ASSERT_NO_THROW(api_->AttachShape(mesh0.shape));
-    // Create instance of a triangle
-    ASSERT_NO_THROW(instance.shape = api_->CreateInstance(mesh1.shape));
+    auto ray_buffer = api_->CreateBuffer(kNumMeshes * sizeof(ray), r);
+    auto isect_buffer = api_->CreateBuffer(kNumMeshes * sizeof(Intersection), nullptr);
 
-    matrix m = translation(float3(0, 0, 2));
-    const matrix minv = inverse(m);
-    ASSERT_NO_THROW(instance.shape->SetTransform(m, minv));
+    float moved[9];
+    for (int i = 0; i < 9; ++i)
+    {
+        moved[i] = vertices()[i] + (i % 3 == 2 ? 5.f : 0.f);
+    }
 
-    ASSERT_NO_THROW(api_->AttachShape(instance.shape));
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        // Second pass moves the triangles 5 units away, the static one is rebuilt, the others refitted
+        if (pass == 1)
+        {
+            for (auto mesh : meshes)
+            {
+                ASSERT_NO_THROW(mesh->UpdateVertices(moved, 0));
+            }
+        }
 
-    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumMeshes, isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumMeshes * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+
+        for (int i = 0; i < kNumMeshes; ++i)
+        {
+            ASSERT_EQ(tmp[i].shapeid, meshes[i]->GetId());
+            ASSERT_NEAR(tmp[i].uvwt.w, pass == 0 ? 10.f : 15.f, 0.001f);
+        }
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 0.f));
+    for (auto mesh : meshes)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(mesh));
+        ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    }
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks analytic spheres are hit next to triangles and can't be instanced
+TEST_F(ApiBackendOpenCL, Intersection_Spheres)
+{
+    // Spheres of radius 1 at x = 0, 4 and of radius 0.5 at x = 8
+    float const centers[] = { 0.f, 0.f, 0.f, 4.f, 0.f, 0.f, 8.f, 0.f, 0.f };
+    float const radii[] = { 1.f, 1.f, 0.5f };
+
+    Shape* spheres = nullptr;
+    ASSERT_NO_THROW(spheres = api_->CreateSpheres(centers, radii, 3));
+    ASSERT_THROW(api_->CreateInstance(spheres), Exception);
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    matrix m = translation(float3(12.f, 0.f, 0.f));
+    ASSERT_NO_THROW(mesh->SetTransform(m, inverse(m)));
+
+    ASSERT_NO_THROW(api_->AttachShape(spheres));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays along z through the centers, the triangle, a gap and out of the first sphere
+    static int const kNumRays = 6;
+    ray r[kNumRays] =
+    {
+        ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f),
+        ray(float3(4.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f),
+        ray(float3(8.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f),
+        ray(float3(12.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f),
+        ray(float3(2.5f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f),
+        ray(float3(0.f, 0.f, 0.f), float3(0.f, 0.f, 1.f), 10000.f)
+    };
+
+    // Second pass scales the spheres by 2 around the last one, moving the others to x = -8 and 0
+    Shape const* const expected_shapes[2][kNumRays] =
+    {
+        { spheres, spheres, spheres, mesh, nullptr, spheres },
+        { spheres, nullptr, spheres, mesh, nullptr, spheres }
+    };
+    int const expected_prims[2][kNumRays] = { { 0, 1, 2, 0, kNullId, 0 }, { 1, kNullId, 2, 0, kNullId, 1 } };
+    float const expected_t[2][kNumRays] = { { 9.f, 9.f, 9.5f, 10.f, 0.f, 1.f }, { 8.f, 0.f, 9.f, 10.f, 0.f, 2.f } };
+
+    auto ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), r);
+    auto isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        if (pass == 1)
+        {
+            matrix s = translation(float3(8.f, 0.f, 0.f)) * scale(float3(2.f, 2.f, 2.f)) * translation(float3(-8.f, 0.f, 0.f));
+            ASSERT_NO_THROW(spheres->SetTransform(s, inverse(s)));
+        }
+
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+
+        for (int i = 0; i < kNumRays; ++i)
+        {
+            ASSERT_EQ(tmp[i].shapeid, expected_shapes[pass][i] ? expected_shapes[pass][i]->GetId() : kNullId);
+
+            if (expected_shapes[pass][i])
+            {
+                ASSERT_EQ(tmp[i].primid, expected_prims[pass][i]);
+                ASSERT_NEAR(tmp[i].uvwt.w, expected_t[pass][i], 0.001f);
+            }
+        }
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(spheres));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(spheres));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks meshes deformed with device rebuilds are hit at their new position
+TEST_F(ApiBackendOpenCL, Intersection_2LevelDeviceRebuild)
+{
+    // Grids of 4 x 4 cells split into 2 triangles each, 2 units apart along x
+    int const kNumMeshes = 3;
+    int const kGridSize = 4;
+    int const kNumVertices = (kGridSize + 1) * (kGridSize + 1);
+    int const kNumFaces = 2 * kGridSize * kGridSize;
+
+    std::vector<int> grid_indices;
+    for (int j = 0; j < kGridSize; ++j)
+    {
+        for (int i = 0; i < kGridSize; ++i)
+        {
+            int const v00 = j * (kGridSize + 1) + i;
+            int const v10 = v00 + 1;
+            int const v01 = v00 + kGridSize + 1;
+            int const v11 = v01 + 1;
+            int const face[] = { v00, v10, v11, v00, v11, v01 };
+            grid_indices.insert(grid_indices.end(), face, face + 6);
+        }
+    }
+
+    std::vector<int> face_verts(kNumFaces, 3);
+
+    auto make_vertices = [&](int k, float z)
+    {
+        std::vector<float> v;
+        for (int j = 0; j <= kGridSize; ++j)
+        {
+            for (int i = 0; i <= kGridSize; ++i)
+            {
+                float const p[] = { 2.f * k + (float)i / kGridSize, (float)j / kGridSize, z };
+                v.insert(v.end(), p, p + 3);
+            }
+        }
+        return v;
+    };
+
+    Shape* meshes[kNumMeshes] = {};
+    std::vector<float> vertices[kNumMeshes];
+    for (int k = 0; k < kNumMeshes; ++k)
+    {
+        vertices[k] = make_vertices(k, 0.f);
+        ASSERT_NO_THROW(meshes[k] = api_->CreateMesh(vertices[k].data(), kNumVertices, 3 * sizeof(float), grid_indices.data(), 0, face_verts.data(), kNumFaces));
+        ASSERT_NO_THROW(api_->AttachShape(meshes[k]));
+    }
+
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 1.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.2level.device_rebuild", 1.f));
+
+    // A ray through the first triangle of each cell
+    int const kNumRays = kNumMeshes * kGridSize * kGridSize;
+    std::vector<ray> rays;
+    for (int k = 0; k < kNumMeshes; ++k)
+    {
+        for (int j = 0; j < kGridSize; ++j)
+        {
+            for (int i = 0; i < kGridSize; ++i)
+            {
+                float3 const o(2.f * k + (i + 0.7f) / kGridSize, (j + 0.2f) / kGridSize, -10.f);
+                rays.push_back(ray(o, float3(0.f, 0.f, 1.f), 10000.f));
+            }
+        }
+    }
+
+    auto ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+
+    // Initial build, two device rebuilds and a full rebuild after detaching the last mesh
+    float const offsets[] = { 0.f, 5.f, 7.f, 7.f };
+    for (int pass = 0; pass < 4; ++pass)
+    {
+        if (pass == 1 || pass == 2)
+        {
+            for (int k = 0; k < kNumMeshes; ++k)
+            {
+                // Meshes move by different amounts
+                vertices[k] = make_vertices(k, offsets[pass] + k);
+                ASSERT_NO_THROW(meshes[k]->UpdateVertices(vertices[k].data(), 0));
+            }
+        }
+        else if (pass == 3)
+        {
+            ASSERT_NO_THROW(api_->DetachShape(meshes[kNumMeshes - 1]));
+        }
+
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+
+        std::vector<Intersection> isect(tmp, tmp + kNumRays);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        for (int r = 0; r < kNumRays; ++r)
+        {
+            int const k = r / (kGridSize * kGridSize);
+            int const cell = r % (kGridSize * kGridSize);
+
+            if (pass == 3 && k == kNumMeshes - 1)
+            {
+                ASSERT_EQ(isect[r].shapeid, kNullId);
+                continue;
+            }
+
+            ASSERT_EQ(isect[r].shapeid, meshes[k]->GetId());
+            ASSERT_EQ(isect[r].primid, 2 * cell);
+            ASSERT_NEAR(isect[r].uvwt.w, 10.f + (pass == 0 ? 0.f : offsets[pass] + k), 0.001f);
+        }
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("bvh.2level.device_rebuild", 0.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 0.f));
+    for (int k = 0; k < kNumMeshes; ++k)
+    {
+        if (k != kNumMeshes - 1)
+        {
+            ASSERT_NO_THROW(api_->DetachShape(meshes[k]));
+        }
+
+        ASSERT_NO_THROW(api_->DeleteShape(meshes[k]));
+    }
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test shears a mesh until its refitted BVH degrades and is rebuilt on the host,
+// refits rotate nodes above the moved faces
+TEST_F(ApiBackendOpenCL, Intersection_2LevelRefitRebuild)
+{
+    // Grid of 8 x 8 cells split into 2 triangles each
+    int const kGridSize = 8;
+    int const kNumVertices = (kGridSize + 1) * (kGridSize + 1);
+    int const kNumFaces = 2 * kGridSize * kGridSize;
+
+    std::vector<int> grid_indices;
+    for (int j = 0; j < kGridSize; ++j)
+    {
+        for (int i = 0; i < kGridSize; ++i)
+        {
+            int const v00 = j * (kGridSize + 1) + i;
+            int const v10 = v00 + 1;
+            int const v01 = v00 + kGridSize + 1;
+            int const v11 = v01 + 1;
+            int const face[] = { v00, v10, v11, v00, v11, v01 };
+            grid_indices.insert(grid_indices.end(), face, face + 6);
+        }
+    }
+
+    std::vector<int> face_verts(kNumFaces, 3);
+
+    // Rows are shifted along x by shear times their y, which stretches the refitted boxes
+    auto make_vertices = [&](float shear, float z)
+    {
+        std::vector<float> v;
+        for (int j = 0; j <= kGridSize; ++j)
+        {
+            for (int i = 0; i <= kGridSize; ++i)
+            {
+                float const y = (float)j / kGridSize;
+                float const p[] = { (float)i / kGridSize + shear * y, y, z };
+                v.insert(v.end(), p, p + 3);
+            }
+        }
+        return v;
+    };
+
+    std::vector<float> vertices = make_vertices(0.f, 0.f);
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices.data(), kNumVertices, 3 * sizeof(float), grid_indices.data(), 0, face_verts.data(), kNumFaces));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 1.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.refit.max_degradation", 0.1f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.refit.rotations", 1.f));
+
+    int const kNumRays = kGridSize * kGridSize;
+    auto isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+
+    // Initial build, a rebuild after the shear and a refit of the rebuilt tree
+    float const shears[] = { 0.f, 4.f, 4.5f };
+    for (int pass = 0; pass < 3; ++pass)
+    {
+        if (pass > 0)
+        {
+            vertices = make_vertices(shears[pass], (float)pass);
+            ASSERT_NO_THROW(mesh->UpdateVertices(vertices.data(), 0));
+        }
+
+        // A ray through the first triangle of each cell
+        std::vector<ray> rays;
+        for (int j = 0; j < kGridSize; ++j)
+        {
+            for (int i = 0; i < kGridSize; ++i)
+            {
+                float const y = (j + 0.2f) / kGridSize;
+                float3 const o((i + 0.7f) / kGridSize + shears[pass] * y, y, -10.f);
+                rays.push_back(ray(o, float3(0.f, 0.f, 1.f), 10000.f));
+            }
+        }
+
+        auto ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), rays.data());
+
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+
+        std::vector<Intersection> isect(tmp, tmp + kNumRays);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+        ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+
+        for (int r = 0; r < kNumRays; ++r)
+        {
+            ASSERT_EQ(isect[r].shapeid, mesh->GetId());
+            ASSERT_EQ(isect[r].primid, 2 * r);
+            ASSERT_NEAR(isect[r].uvwt.w, 10.f + pass, 0.001f);
+        }
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("bvh.refit.rotations", 0.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.refit.max_degradation", 0.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 0.f));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks meshes paged in by a small memory budget give the closest hits of resident ones
+TEST_F(ApiBackendOpenCL, Intersection_2LevelPagedGeometry)
+{
+    // Columns of grids in two layers, the front one hides the back one
+    int const kGridSize = 8;
+    int const kNumColumns = 3;
+    int const kNumVertices = (kGridSize + 1) * (kGridSize + 1);
+    int const kNumFaces = 2 * kGridSize * kGridSize;
+
+    std::vector<int> grid_indices;
+    for (int j = 0; j < kGridSize; ++j)
+    {
+        for (int i = 0; i < kGridSize; ++i)
+        {
+            int const v00 = j * (kGridSize + 1) + i;
+            int const v10 = v00 + 1;
+            int const v01 = v00 + kGridSize + 1;
+            int const v11 = v01 + 1;
+            int const face[] = { v00, v10, v11, v00, v11, v01 };
+            grid_indices.insert(grid_indices.end(), face, face + 6);
+        }
+    }
+
+    std::vector<int> face_verts(kNumFaces, 3);
+
+    std::vector<Shape*> meshes;
+    for (int layer = 0; layer < 2; ++layer)
+    {
+        for (int column = 0; column < kNumColumns; ++column)
+        {
+            std::vector<float> v;
+            for (int j = 0; j <= kGridSize; ++j)
+            {
+                for (int i = 0; i <= kGridSize; ++i)
+                {
+                    float const p[] = { 2.f * column + (float)i / kGridSize, (float)j / kGridSize, (float)layer };
+                    v.insert(v.end(), p, p + 3);
+                }
+            }
+
+            Shape* mesh = nullptr;
+            ASSERT_NO_THROW(mesh = api_->CreateMesh(v.data(), kNumVertices, 3 * sizeof(float), grid_indices.data(), 0, face_verts.data(), kNumFaces));
+            ASSERT_NO_THROW(api_->AttachShape(mesh));
+            meshes.push_back(mesh);
+        }
+    }
+
+    // A mesh takes about 14KB, so pages hold a couple of them
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 1.f));
+    ASSERT_NO_THROW(api_->SetOption("mem.budget", 0.04f));
+
+    // A ray through each cell of the columns and one between each pair of them
+    std::vector<ray> rays;
+    for (int column = 0; column < kNumColumns; ++column)
+    {
+        for (int i = 0; i < kGridSize; ++i)
+        {
+            float3 const o(2.f * column + (i + 0.7f) / kGridSize, 0.2f, -10.f);
+            rays.push_back(ray(o, float3(0.f, 0.f, 1.f), 10000.f));
+        }
+
+        rays.push_back(ray(float3(2.f * column + 1.5f, 0.5f, -10.f), float3(0.f, 0.f, 1.f), 10000.f));
+    }
+
+    int const kNumRays = (int)rays.size();
+    auto ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+    auto occl_buffer = api_->CreateBuffer(kNumRays * sizeof(int), nullptr);
+
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, kNumRays, occl_buffer, nullptr, nullptr));
+
+    Intersection* isect = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect, &e_));
+    Wait();
+
+    for (int r = 0; r < kNumRays; ++r)
+    {
+        int const column = r / (kGridSize + 1);
+        int const cell = r % (kGridSize + 1);
+
+        if (cell == kGridSize)
+        {
+            ASSERT_EQ(isect[r].shapeid, kNullId);
+        }
+        else
+        {
+            ASSERT_EQ(isect[r].shapeid, meshes[column]->GetId());
+            ASSERT_NEAR(isect[r].uvwt.w, 10.f, 0.001f);
+        }
+    }
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+    Wait();
+
+    int* occl = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(occl_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&occl, &e_));
+    Wait();
+
+    for (int r = 0; r < kNumRays; ++r)
+    {
+        ASSERT_EQ(occl[r], r % (kGridSize + 1) == kGridSize ? kNullId : 1);
+    }
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(occl_buffer, occl, &e_));
+    Wait();
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("mem.budget", 0.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 0.f));
+    for (auto mesh : meshes)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(mesh));
+        ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    }
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occl_buffer));
+}
+
+// The test checks compact 2-level faces give the same hits as the full ones, including a mesh
+// with too many vertices for 16-bit indices and an instance sharing the faces of a mesh
+TEST_F(ApiBackendOpenCL, Intersection_2LevelCompactFaces)
+{
+    int const kGridSize = 8;
+    int const kNumVertices = (kGridSize + 1) * (kGridSize + 1);
+    int const kNumFaces = 2 * kGridSize * kGridSize;
+    // Unused vertices in front of the grid of the large mesh
+    int const kNumUnused = 65536;
+
+    std::vector<float> grid_vertices;
+    for (int j = 0; j <= kGridSize; ++j)
+    {
+        for (int i = 0; i <= kGridSize; ++i)
+        {
+            float const p[] = { (float)i / kGridSize, (float)j / kGridSize, 0.f };
+            grid_vertices.insert(grid_vertices.end(), p, p + 3);
+        }
+    }
+
+    std::vector<int> grid_indices;
+    for (int j = 0; j < kGridSize; ++j)
+    {
+        for (int i = 0; i < kGridSize; ++i)
+        {
+            int const v00 = j * (kGridSize + 1) + i;
+            int const v10 = v00 + 1;
+            int const v01 = v00 + kGridSize + 1;
+            int const v11 = v01 + 1;
+            int const face[] = { v00, v10, v11, v00, v11, v01 };
+            grid_indices.insert(grid_indices.end(), face, face + 6);
+        }
+    }
+
+    std::vector<float> large_vertices(3 * kNumUnused, 0.f);
+    large_vertices.insert(large_vertices.end(), grid_vertices.cbegin(), grid_vertices.cend());
+    std::vector<int> large_indices(grid_indices);
+    for (auto& idx : large_indices)
+    {
+        idx += kNumUnused;
+    }
+
+    std::vector<int> face_verts(kNumFaces, 3);
+
+    Shape* shapes[3] = { nullptr };
+    ASSERT_NO_THROW(shapes[0] = api_->CreateMesh(grid_vertices.data(), kNumVertices, 3 * sizeof(float), grid_indices.data(), 0, face_verts.data(), kNumFaces));
+    ASSERT_NO_THROW(shapes[1] = api_->CreateMesh(large_vertices.data(), kNumUnused + kNumVertices, 3 * sizeof(float), large_indices.data(), 0, face_verts.data(), kNumFaces));
+    ASSERT_NO_THROW(shapes[2] = api_->CreateInstance(shapes[0]));
+
+    // Shapes are placed in columns along x
+    for (int column = 0; column < 3; ++column)
+    {
+        matrix m = translation(float3(2.f * column, 0.f, 0.f));
+        ASSERT_NO_THROW(shapes[column]->SetTransform(m, inverse(m)));
+        ASSERT_NO_THROW(api_->AttachShape(shapes[column]));
+    }
+
+    // A ray through each of the cells, off the diagonal to pick one of its triangles
+    std::vector<ray> rays;
+    for (int column = 0; column < 3; ++column)
+    {
+        for (int j = 0; j < kGridSize; ++j)
+        {
+            for (int i = 0; i < kGridSize; ++i)
+            {
+                float3 const o(2.f * column + (i + (j % 2 ? 0.3f : 0.7f)) / kGridSize, (j + 0.5f) / kGridSize, -10.f);
+                rays.push_back(ray(o, float3(0.f, 0.f, 1.f), 10000.f));
+            }
+        }
+    }
+
+    int const kNumRays = (int)rays.size();
+    Buffer* ray_buffer = nullptr;
+    Buffer* isect_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), rays.data()));
+    ASSERT_NO_THROW(isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr));
+
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 1.f));
+
+    std::vector<Intersection> isects[2];
+    char const* formats[] = { "full", "compact" };
+    for (int f = 0; f < 2; ++f)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.face.format", formats[f]));
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, &e_));
+        Wait();
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        isects[f].assign(tmp, tmp + kNumRays);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+    }
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        ASSERT_EQ(isects[0][i].shapeid, shapes[i / (kGridSize * kGridSize)]->GetId()) << "ray " << i;
+        ASSERT_EQ(isects[1][i].shapeid, isects[0][i].shapeid) << "ray " << i;
+        ASSERT_EQ(isects[1][i].primid, isects[0][i].primid) << "ray " << i;
+        ASSERT_NEAR(isects[1][i].uvwt.x, isects[0][i].uvwt.x, 0.001f) << "ray " << i;
+        ASSERT_NEAR(isects[1][i].uvwt.y, isects[0][i].uvwt.y, 0.001f) << "ray " << i;
+        ASSERT_NEAR(isects[1][i].uvwt.w, 10.f, 0.001f) << "ray " << i;
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("acc.face.format", "full"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 0.f));
+    for (int i = 2; i >= 0; --i)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(shapes[i]));
+        ASSERT_NO_THROW(api_->DeleteShape(shapes[i]));
+    }
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks quantized vertices hit the same faces as full ones at about the same distance
+TEST_F(ApiBackendOpenCL, Intersection_2LevelQuantizedVertices)
+{
+    int const kGridSize = 8;
+    int const kNumVertices = (kGridSize + 1) * (kGridSize + 1);
+    int const kNumFaces = 2 * kGridSize * kGridSize;
+
+    // Bumpy grid, so the vertices don't fall onto quantized positions
+    std::vector<float> grid_vertices;
+    for (int j = 0; j <= kGridSize; ++j)
+    {
+        for (int i = 0; i <= kGridSize; ++i)
+        {
+            float const p[] = { (float)i / kGridSize, (float)j / kGridSize, 0.1f * std::sin(1.3f * i + 0.7f * j) };
+            grid_vertices.insert(grid_vertices.end(), p, p + 3);
+        }
+    }
+
+    std::vector<int> grid_indices;
+    for (int j = 0; j < kGridSize; ++j)
+    {
+        for (int i = 0; i < kGridSize; ++i)
+        {
+            int const v00 = j * (kGridSize + 1) + i;
+            int const v10 = v00 + 1;
+            int const v01 = v00 + kGridSize + 1;
+            int const v11 = v01 + 1;
+            int const face[] = { v00, v10, v11, v00, v11, v01 };
+            grid_indices.insert(grid_indices.end(), face, face + 6);
+        }
+    }
+
+    std::vector<int> face_verts(kNumFaces, 3);
+
+    Shape* shapes[2] = { nullptr };
+    ASSERT_NO_THROW(shapes[0] = api_->CreateMesh(grid_vertices.data(), kNumVertices, 3 * sizeof(float), grid_indices.data(), 0, face_verts.data(), kNumFaces));
+    ASSERT_NO_THROW(shapes[1] = api_->CreateInstance(shapes[0]));
+
+    // Shapes are placed in columns along x
+    for (int column = 0; column < 2; ++column)
+    {
+        matrix m = translation(float3(2.f * column, 0.f, 0.f));
+        ASSERT_NO_THROW(shapes[column]->SetTransform(m, inverse(m)));
+        ASSERT_NO_THROW(api_->AttachShape(shapes[column]));
+    }
+
+    // A ray through each of the cells, off the diagonal to pick one of its triangles
+    std::vector<ray> rays;
+    for (int column = 0; column < 2; ++column)
+    {
+        for (int j = 0; j < kGridSize; ++j)
+        {
+            for (int i = 0; i < kGridSize; ++i)
+            {
+                float3 const o(2.f * column + (i + (j % 2 ? 0.3f : 0.7f)) / kGridSize, (j + 0.5f) / kGridSize, -10.f);
+                rays.push_back(ray(o, float3(0.f, 0.f, 1.f), 10000.f));
+            }
+        }
+    }
+
+    int const kNumRays = (int)rays.size();
+    Buffer* ray_buffer = nullptr;
+    Buffer* isect_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), rays.data()));
+    ASSERT_NO_THROW(isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr));
+
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 1.f));
+
+    std::vector<Intersection> isects[2];
+    char const* formats[] = { "full", "quantized" };
+    for (int f = 0; f < 2; ++f)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.vertex.format", formats[f]));
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, &e_));
+        Wait();
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        isects[f].assign(tmp, tmp + kNumRays);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+    }
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        ASSERT_EQ(isects[0][i].shapeid, shapes[i / (kGridSize * kGridSize)]->GetId()) << "ray " << i;
+        ASSERT_EQ(isects[1][i].shapeid, isects[0][i].shapeid) << "ray " << i;
+        ASSERT_EQ(isects[1][i].primid, isects[0][i].primid) << "ray " << i;
+        ASSERT_NEAR(isects[1][i].uvwt.w, isects[0][i].uvwt.w, 0.001f) << "ray " << i;
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("acc.vertex.format", "full"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 0.f));
+    for (int i = 1; i >= 0; --i)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(shapes[i]));
+        ASSERT_NO_THROW(api_->DeleteShape(shapes[i]));
+    }
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks instances moved with device top level builds are hit at their new position
+TEST_F(ApiBackendOpenCL, Intersection_2LevelDeviceTopLevel)
+{
+    int const kNumInstances = 100;
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    // Only instances are attached, the base mesh is referenced by them
+    std::vector<Shape*> instances(kNumInstances);
+    for (int i = 0; i < kNumInstances; ++i)
+    {
+        ASSERT_NO_THROW(instances[i] = api_->CreateInstance(mesh));
+        ASSERT_NO_THROW(api_->AttachShape(instances[i]));
+    }
+
+    ASSERT_NO_THROW(api_->SetOption("bvh.2level.device_top_level", 1.f));
+
+    // A ray through the origin of each instance row
+    std::vector<ray> rays(kNumInstances);
+    for (int i = 0; i < kNumInstances; ++i)
+    {
+        rays[i] = ray(float3(3.f * i, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    }
+
+    auto ray_buffer = api_->CreateBuffer(kNumInstances * sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(kNumInstances * sizeof(Intersection), nullptr);
+
+    // The first commit builds on the host, the others on the device.
+    // Instances are rotated and scaled around their origin, which stays inside the triangle.
+    for (int pass = 0; pass < 3; ++pass)
+    {
+        for (int i = 0; i < kNumInstances; ++i)
+        {
+            // Odd instances leave their rays on the last pass
+            float const y = pass == 2 && (i & 1) ? 10.f : 0.f;
+            matrix m = translation(float3(3.f * i, y, 5.f * pass)) * rotation_z(0.1f * (i + pass)) * scale(float3(1.f + 0.01f * i, 1.f, 1.f));
+            instances[i]->SetTransform(m, inverse(m));
+        }
+
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumInstances, isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumInstances * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+
+        std::vector<Intersection> isect(tmp, tmp + kNumInstances);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        for (int i = 0; i < kNumInstances; ++i)
+        {
+            if (pass == 2 && (i & 1))
+            {
+                ASSERT_EQ(isect[i].shapeid, kNullId);
+                continue;
+            }
+
+            ASSERT_EQ(isect[i].shapeid, instances[i]->GetId());
+            ASSERT_NEAR(isect[i].uvwt.w, 10.f + 5.f * pass, 0.001f);
+        }
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("bvh.2level.device_top_level", 0.f));
+    for (auto instance : instances)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(instance));
+        ASSERT_NO_THROW(api_->DeleteShape(instance));
+    }
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks rotated thin instances bounded by transformed BVH cuts keep their hits and misses
+TEST_F(ApiBackendOpenCL, Intersection_2LevelTightInstanceBounds)
+{
+    int const kNumSegments = 16;
+    int const kNumInstances = 8;
+
+    // A beam along the x axis, 32 units long and 0.2 units high, made of a triangle strip
+    std::vector<float> beam;
+    std::vector<int> beam_indices;
+    for (int i = 0; i <= kNumSegments; ++i)
+    {
+        float x = -16.f + 32.f * i / kNumSegments;
+        float y[] = { -0.1f, 0.1f };
+        for (auto v : y)
+        {
+            beam.push_back(x);
+            beam.push_back(v);
+            beam.push_back(0.f);
+        }
+
+        if (i < kNumSegments)
+        {
+            int const base = 2 * i;
+            int const strip[] = { base, base + 2, base + 1, base + 1, base + 2, base + 3 };
+            beam_indices.insert(beam_indices.end(), strip, strip + 6);
+        }
+    }
+
+    std::vector<int> beam_numfaceverts(2 * kNumSegments, 3);
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(beam.data(), (int)beam.size() / 3, 3 * sizeof(float), beam_indices.data(), 0, beam_numfaceverts.data(), 2 * kNumSegments));
+
+    std::vector<Shape*> instances(kNumInstances);
+    for (int i = 0; i < kNumInstances; ++i)
+    {
+        ASSERT_NO_THROW(instances[i] = api_->CreateInstance(mesh));
+        ASSERT_NO_THROW(api_->AttachShape(instances[i]));
+    }
+
+    ASSERT_NO_THROW(api_->SetOption("bvh.2level.tight_instance_bounds", 1.f));
+
+    // Each instance gets a ray through a point on the beam and one through the corner of its rotated bounds
+    std::vector<ray> rays(2 * kNumInstances);
+    auto ray_buffer = api_->CreateBuffer(rays.size() * sizeof(ray), nullptr);
+    auto isect_buffer = api_->CreateBuffer(rays.size() * sizeof(Intersection), nullptr);
+
+    // The second pass moves the beams, which only rebuilds the top level
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        for (int i = 0; i < kNumInstances; ++i)
+        {
+            float const angle = 0.785398f + 0.1f * (i + pass);
+            float3 const origin(100.f * i, 10.f * pass, 0.f);
+            matrix m = translation(origin) * rotation_z(angle);
+            instances[i]->SetTransform(m, inverse(m));
+
+            float3 const on_beam = origin + float3(std::cos(angle), std::sin(angle), 0.f) * 10.f;
+            float3 const off_beam = origin + float3(std::cos(angle) + std::sin(angle), std::sin(angle) - std::cos(angle), 0.f) * 5.f;
+            rays[2 * i] = ray(on_beam + float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+            rays[2 * i + 1] = ray(off_beam + float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+        }
+
+        ray* mapped = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(ray_buffer, kMapWrite, 0, rays.size() * sizeof(ray), (void**)&mapped, &e_));
+        Wait();
+        std::copy(rays.begin(), rays.end(), mapped);
+        ASSERT_NO_THROW(api_->UnmapBuffer(ray_buffer, mapped, &e_));
+        Wait();
+
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, (int)rays.size(), isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, rays.size() * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+
+        std::vector<Intersection> isect(tmp, tmp + rays.size());
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        for (int i = 0; i < kNumInstances; ++i)
+        {
+            ASSERT_EQ(isect[2 * i].shapeid, instances[i]->GetId());
+            ASSERT_NEAR(isect[2 * i].uvwt.w, 10.f, 0.001f);
+            ASSERT_EQ(isect[2 * i + 1].shapeid, kNullId);
+        }
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("bvh.2level.tight_instance_bounds", 0.f));
+    for (auto instance : instances)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(instance));
+        ASSERT_NO_THROW(api_->DeleteShape(instance));
+    }
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks 2-level BVHs built with different top and bottom level builders find the same hits
+TEST_F(ApiBackendOpenCL, Intersection_2LevelLevelBuilders)
+{
+    int const kNumInstances = 64;
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    std::vector<Shape*> instances(kNumInstances);
+    std::vector<ray> rays(kNumInstances);
+    for (int i = 0; i < kNumInstances; ++i)
+    {
+        ASSERT_NO_THROW(instances[i] = api_->CreateInstance(mesh));
+        ASSERT_NO_THROW(api_->AttachShape(instances[i]));
+
+        matrix m = translation(float3(3.f * (i % 8), 3.f * (i / 8), 0.f)) * rotation_z(0.2f * i);
+        instances[i]->SetTransform(m, inverse(m));
+        rays[i] = ray(float3(3.f * (i % 8), 3.f * (i / 8), -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    }
+
+    auto ray_buffer = api_->CreateBuffer(kNumInstances * sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(kNumInstances * sizeof(Intersection), nullptr);
+
+    // Bottom levels keep SAH trees, the top level is rebuilt as an LBVH, then the other way around
+    char const* builders[][2] = { { "sah", "lbvh" }, { "lbvh", "median" }, { "median", "sah" } };
+    for (auto const& builder : builders)
+    {
+        ASSERT_NO_THROW(api_->SetOption("bvh2l.bottom.builder", builder[0]));
+        ASSERT_NO_THROW(api_->SetOption("bvh2l.top.builder", builder[1]));
+
+        // The second commit only moves the instances along z, which rebuilds the top level alone
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            for (int i = 0; i < kNumInstances; ++i)
+            {
+                matrix m = translation(float3(3.f * (i % 8), 3.f * (i / 8), 5.f * pass)) * rotation_z(0.2f * i);
+                instances[i]->SetTransform(m, inverse(m));
+            }
+
+            ASSERT_NO_THROW(api_->Commit());
+            ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumInstances, isect_buffer, nullptr, nullptr));
+
+            Intersection* tmp = nullptr;
+            ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumInstances * sizeof(Intersection), (void**)&tmp, &e_));
+            Wait();
+
+            for (int i = 0; i < kNumInstances; ++i)
+            {
+                ASSERT_EQ(tmp[i].shapeid, instances[i]->GetId());
+                ASSERT_NEAR(tmp[i].uvwt.w, 10.f + 5.f * pass, 0.001f);
+            }
+
+            ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+            Wait();
+        }
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("bvh2l.bottom.builder", "median"));
+    ASSERT_NO_THROW(api_->SetOption("bvh2l.top.builder", "median"));
+    for (auto instance : instances)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(instance));
+        ASSERT_NO_THROW(api_->DeleteShape(instance));
+    }
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks level of detail instances are traversed at the level picked by the ray origin distance
+TEST_F(ApiBackendOpenCL, Intersection_2LevelLod)
+{
+    // Quads of the finer level at z = 0 and the coarser one at z = 1
+    float const quads[][12] =
+    {
+        { -1.f, -1.f, 0.f, 1.f, -1.f, 0.f, 1.f, 1.f, 0.f, -1.f, 1.f, 0.f },
+        { -1.f, -1.f, 1.f, 1.f, -1.f, 1.f, 1.f, 1.f, 1.f, -1.f, 1.f, 1.f }
+    };
+    int const quad_indices[] = { 0, 1, 2, 0, 2, 3 };
+    int const quad_numfaceverts[] = { 3, 3 };
+
+    Shape* meshes[2] = { nullptr, nullptr };
+    for (int i = 0; i < 2; ++i)
+    {
+        ASSERT_NO_THROW(meshes[i] = api_->CreateMesh(quads[i], 4, 3 * sizeof(float), quad_indices, 0, quad_numfaceverts, 2));
+    }
+
+    // Levels have to be meshes with increasing distances
+    float const distance = 50.f;
+    float const bad_distance = -1.f;
+    Shape const* levels[] = { meshes[0], meshes[1] };
+    ASSERT_THROW(api_->CreateLodInstance(levels, &bad_distance, 2), Exception);
+
+    Shape* instance = nullptr;
+    ASSERT_NO_THROW(instance = api_->CreateLodInstance(levels, &distance, 2));
+    ASSERT_NO_THROW(api_->AttachShape(instance));
+
+    // Sharp transitions, rays from 10 and 100 units away
+    ASSERT_NO_THROW(api_->SetOption("bvh2l.lod.transition", 0.f));
+    ray const rays[] =
+    {
+        ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f),
+        ray(float3(0.5f, 0.f, -100.f), float3(0.f, 0.f, 1.f), 10000.f)
+    };
+    float const expected[][2] = { { 10.f, 101.f }, { 111.f, 201.f } };
+
+    auto ray_buffer = api_->CreateBuffer(2 * sizeof(ray), (void*)rays);
+    auto isect_buffer = api_->CreateBuffer(2 * sizeof(Intersection), nullptr);
+
+    // The second pass moves the instance away, so both rays see the coarser level
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        matrix m = translation(float3(0.f, 0.f, 100.f * pass));
+        instance->SetTransform(m, inverse(m));
+
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 2 * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+
+        for (int i = 0; i < 2; ++i)
+        {
+            ASSERT_EQ(tmp[i].shapeid, instance->GetId());
+            ASSERT_NEAR(tmp[i].uvwt.w, expected[pass][i], 0.001f);
+        }
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("bvh2l.lod.transition", 0.1f));
+    ASSERT_NO_THROW(api_->DetachShape(instance));
+    ASSERT_NO_THROW(api_->DeleteShape(instance));
+    for (auto mesh : meshes)
+    {
+        ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    }
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks fat node 2-level traversal finds the same hits as skip links for instanced scenes
+TEST_F(ApiBackendOpenCL, Intersection_2LevelShortStack)
+{
+    int const kNumInstances = 100;
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    std::vector<Shape*> instances(kNumInstances);
+    for (int i = 0; i < kNumInstances; ++i)
+    {
+        ASSERT_NO_THROW(instances[i] = api_->CreateInstance(mesh));
+        ASSERT_NO_THROW(api_->AttachShape(instances[i]));
+    }
+
+    // A ray through the origin of each instance row and one hitting the mesh
+    std::vector<ray> rays(kNumInstances + 1);
+    for (int i = 0; i < kNumInstances; ++i)
+    {
+        rays[i] = ray(float3(3.f * (i + 1), 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    }
+    rays[kNumInstances] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    int const numrays = kNumInstances + 1;
+    auto ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+    auto occlu_buffer = api_->CreateBuffer(numrays * sizeof(int), nullptr);
+
+    // The second pass only moves the instances, which rebuilds the top level alone
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        for (int i = 0; i < kNumInstances; ++i)
+        {
+            // Odd instances leave their rays on the last pass
+            float const y = pass == 1 && (i & 1) ? 10.f : 0.f;
+            matrix m = translation(float3(3.f * (i + 1), y, 5.f * pass)) * rotation_z(0.1f * (i + pass)) * scale(float3(1.f + 0.01f * i, 1.f, 1.f));
+            instances[i]->SetTransform(m, inverse(m));
+        }
+
+        std::vector<Intersection> isect[2];
+        std::vector<int> occluded[2];
+        char const* acctypes[] = { "bvh", "fatbvh2l" };
+        for (int j = 0; j < 2; ++j)
+        {
+            ASSERT_NO_THROW(api_->SetOption("acc.type", acctypes[j]));
+            ASSERT_NO_THROW(api_->Commit());
+            ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, nullptr));
+            ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, numrays, occlu_buffer, nullptr, nullptr));
+
+            Intersection* tmp = nullptr;
+            ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&tmp, &e_));
+            Wait();
+            isect[j].assign(tmp, tmp + numrays);
+            ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+            Wait();
+
+            int* otmp = nullptr;
+            ASSERT_NO_THROW(api_->MapBuffer(occlu_buffer, kMapRead, 0, numrays * sizeof(int), (void**)&otmp, &e_));
+            Wait();
+            occluded[j].assign(otmp, otmp + numrays);
+            ASSERT_NO_THROW(api_->UnmapBuffer(occlu_buffer, otmp, &e_));
+            Wait();
+        }
+
+        for (int i = 0; i < numrays; ++i)
+        {
+            ASSERT_EQ(isect[1][i].shapeid, isect[0][i].shapeid);
+            ASSERT_EQ(isect[1][i].primid, isect[0][i].primid);
+            ASSERT_EQ(occluded[1][i], occluded[0][i]);
+
+            if (isect[0][i].shapeid != kNullId)
+            {
+                ASSERT_NEAR(isect[1][i].uvwt.w, isect[0][i].uvwt.w, 0.001f);
+                ASSERT_NEAR(isect[1][i].uvwt.x, isect[0][i].uvwt.x, 0.001f);
+                ASSERT_NEAR(isect[1][i].uvwt.y, isect[0][i].uvwt.y, 0.001f);
+            }
+        }
+
+        ASSERT_EQ(isect[1][kNumInstances].shapeid, mesh->GetId());
+        ASSERT_EQ(isect[1][0].shapeid, instances[0]->GetId());
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    for (auto instance : instances)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(instance));
+        ASSERT_NO_THROW(api_->DeleteShape(instance));
+    }
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occlu_buffer));
+}
+
+// The test checks precomputed triangles give the same hit as vertex fetches
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_PrecomputedTriangles)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray, slightly off the center to get distinct barycentrics
+    ray r(float3(0.25f, -0.25f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    Intersection isect[2];
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.triangle.precompute", pass == 0 ? 0.f : 1.f));
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+
+        isect[pass] = *tmp;
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+    }
+
+    ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[1].primid, isect[0].primid);
+    ASSERT_NEAR(isect[1].uvwt.x, isect[0].uvwt.x, 0.001f);
+    ASSERT_NEAR(isect[1].uvwt.y, isect[0].uvwt.y, 0.001f);
+    ASSERT_NEAR(isect[1].uvwt.w, 10.f, 0.001f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("acc.triangle.precompute", 0.f));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks octant links find the closest of stacked triangles from both sides
+TEST_F(ApiBackendOpenCL, Intersection_OctantLinks)
+{
+    // Three triangles stacked along z
+    std::vector<Shape*> meshes;
+    for (int i = 0; i < 3; ++i)
+    {
+        Shape* mesh = nullptr;
+        ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+        matrix m = translation(float3(0.f, 0.f, (float)i));
+        ASSERT_NO_THROW(mesh->SetTransform(m, inverse(m)));
+        ASSERT_NO_THROW(api_->AttachShape(mesh));
+        meshes.push_back(mesh);
+    }
+
+    // Rays going forward and backward along z
+    int const kNumRays = 2;
+    ray rays[kNumRays] =
+    {
+        ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f)),
+        ray(float3(0.f, 0.f, 10.f), float3(0.f, 0.f, -1.f))
+    };
+
+    Buffer* ray_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), rays));
+    Buffer* isect_buffer = nullptr;
+    ASSERT_NO_THROW(isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr));
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->SetOption("acc.octant_links", 1.f));
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, &e_));
+    Wait();
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    std::vector<Intersection> isects(tmp, tmp + kNumRays);
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_EQ(isects[0].shapeid, meshes[0]->GetId());
+    ASSERT_NEAR(isects[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(isects[1].shapeid, meshes[2]->GetId());
+    ASSERT_NEAR(isects[1].uvwt.w, 8.f, 0.001f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("acc.octant_links", 0.f));
+    for (auto mesh : meshes)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(mesh));
+        ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    }
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test intersects a moving triangle at different ray times
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_MotionBlur)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    // The triangle moves 5 units away from the rays during the frame
+    ASSERT_NO_THROW(mesh->SetLinearVelocity(float3(0.f, 0.f, 5.f)));
+
+    // Prepare the rays at the start, in the middle and at the end of the frame
+    ray r[3];
+    r[0] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f, 0.f);
+    r[1] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f, 0.5f);
+    r[2] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f, 1.f);
+
+    auto ray_buffer = api_->CreateBuffer(3 * sizeof(ray), r);
+    auto isect_buffer = api_->CreateBuffer(3 * sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3 * sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+
+    Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    for (int i = 0; i < 3; ++i)
+    {
+        ASSERT_EQ(isect[i].shapeid, mesh->GetId());
+        ASSERT_NEAR(isect[i].uvwt.w, 10.f + 2.5f * i, 0.001f);
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test creates and attaches two meshes in a single call each
+TEST_F(ApiBackendOpenCL, Intersection_2Rays_CreateMeshes)
+{
+    // The second mesh is the same triangle moved down
+    float mvertices[] = {
+        -1.f, -4.f, 0.f,
+        1.f, -4.f, 0.f,
+        0.f, -2.f, 0.f
+    };
+
+    MeshDesc descs[2] = {
+        { vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1 },
+        { mvertices, 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1 }
+    };
+
+    Shape* meshes[2] = { nullptr, nullptr };
+
+    ASSERT_NO_THROW(api_->CreateMeshes(descs, 2, meshes));
+
+    ASSERT_TRUE(meshes[0] != nullptr);
+    ASSERT_TRUE(meshes[1] != nullptr);
+    ASSERT_NE(meshes[0]->GetId(), meshes[1]->GetId());
+
+    // Attach both meshes, the duplicate is ignored
+    Shape const* shapes[3] = { meshes[0], meshes[1], meshes[0] };
+    ASSERT_NO_THROW(api_->AttachShapes(shapes, 3));
+
+    // Prepare the rays
+    ray r[2];
+    r[0] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    r[1] = ray(float3(0.f, -3.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(2 * sizeof(ray), r);
+    auto isect_buffer = api_->CreateBuffer(2 * sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 2 * sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+
+    Intersection isect[2] = { tmp[0], tmp[1] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect[0].shapeid, meshes[0]->GetId());
+    ASSERT_EQ(isect[1].shapeid, meshes[1]->GetId());
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachAll());
+    ASSERT_NO_THROW(api_->DeleteShape(meshes[0]));
+    ASSERT_NO_THROW(api_->DeleteShape(meshes[1]));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks every face of a multi-primitive SAH leaf is intersected
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_MultiPrimLeaves)
+{
+    // Two triangles next to each other end up in a single leaf
+    float mvertices[] = {
+        -1.f, -1.f, 0.f,
+        1.f, -1.f, 0.f,
+        0.f, 1.f, 0.f,
+        2.f, -1.f, 0.f,
+        4.f, -1.f, 0.f,
+        3.f, 1.f, 0.f
+    };
+
+    int mindices[] = { 0, 1, 2, 3, 4, 5 };
+    int mnumfaceverts[] = { 3, 3 };
+
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(mvertices, 6, 3*sizeof(float), mindices, 0, mnumfaceverts, 2));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->SetOption("bvh.builder", "sah"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.sah.max_leaf_prims", 4.f));
+
+    // Prepare the rays, the last one passes between the triangles
+    ray r[3];
+    r[0] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    r[1] = ray(float3(3.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    r[2] = ray(float3(1.5f, 0.5f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(3 * sizeof(ray), r);
+    auto isect_buffer = api_->CreateBuffer(3 * sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3 * sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+
+    Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[0].primid, 0);
+    ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[1].primid, 1);
+    ASSERT_EQ(isect[2].shapeid, kNullId);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("bvh.sah.max_leaf_prims", 1.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.builder", "median"));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks trees built with the traversal cost calibrated on the device are intersected correctly
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_CalibratedSah)
+{
+    float mvertices[] = {
+        -1.f, -1.f, 0.f,
+        1.f, -1.f, 0.f,
+        0.f, 1.f, 0.f,
+        2.f, -1.f, 0.f,
+        4.f, -1.f, 0.f,
+        3.f, 1.f, 0.f
+    };
+
+    int mindices[] = { 0, 1, 2, 3, 4, 5 };
+    int mnumfaceverts[] = { 3, 3 };
+
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(mvertices, 6, 3*sizeof(float), mindices, 0, mnumfaceverts, 2));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "fatbvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.builder", "sah"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.sah.calibrate", 1.f));
+
+    // Prepare the rays, the last one passes between the triangles
+    ray r[3];
+    r[0] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    r[1] = ray(float3(3.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    r[2] = ray(float3(1.5f, 0.5f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(3 * sizeof(ray), r);
+    auto isect_buffer = api_->CreateBuffer(3 * sizeof(Intersection), nullptr);
+
+    // The second commit takes the cost calibrated by the first one
+    for (int i = 0; i < 2; ++i)
+    {
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3 * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+
+        Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        // Check results
+        ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+        ASSERT_EQ(isect[0].primid, 0);
+        ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+        ASSERT_EQ(isect[1].primid, 1);
+        ASSERT_EQ(isect[2].shapeid, kNullId);
+
+        // Setting the option again rebuilds the tree
+        ASSERT_NO_THROW(api_->SetOption("bvh.sah.calibrate", 1.f));
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("bvh.sah.calibrate", 0.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.builder", "median"));
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test intersects a translated triangle mesh read from device buffers
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_DeviceBuffers)
+{
+    float mvertices[] = {
+        -1.f, -1.f, 0.f,
+        1.f, -1.f, 0.f,
+        0.f, 1.f, 0.f
+    };
+
+    int mindices[] = { 0, 1, 2 };
+
+    auto vertex_buffer = api_->CreateBuffer(sizeof(mvertices), mvertices);
+    auto index_buffer = api_->CreateBuffer(sizeof(mindices), mindices);
+
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMeshFromDeviceBuffers(vertex_buffer, 3, 0, index_buffer, 0, 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Positions are transformed on the device
+    matrix m = translation(float3(0.f, 0.f, 5.f));
+    mesh->SetTransform(m, inverse(m));
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    // Intersection and hit data
+    Intersection isect;
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+    ASSERT_EQ(isect.primid, 0);
+    ASSERT_NEAR(isect.uvwt.w, 15.f, 0.001f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(vertex_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(index_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test commits a single triangle mesh on a worker thread
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_CommitAsync)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    // Intersection and hit data
+    Intersection isect;
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Commit geometry update and wait for the build
+    ASSERT_NO_THROW(api_->CommitAsync(&e_));
+    Wait();
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks completion callbacks are called once the query is done and right away afterwards
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_OnComplete)
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    auto notify = [](void* userdata)
+    {
+        static_cast<std::promise<void>*>(userdata)->set_value();
+    };
+
+    std::promise<void> done;
+    auto completed = done.get_future();
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, &e_));
+    ASSERT_NO_THROW(e_->OnComplete(notify, &done));
+    ASSERT_EQ(completed.wait_for(std::chrono::seconds(10)), std::future_status::ready);
+    ASSERT_TRUE(e_->Complete());
+
+    // The event is complete, so the callback runs on this thread
+    std::promise<void> again;
+    ASSERT_NO_THROW(e_->OnComplete(notify, &again));
+    ASSERT_EQ(again.get_future().wait_for(std::chrono::seconds(0)), std::future_status::ready);
+    Wait();
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks an event joining two queries completes once both of them are done
+TEST_F(ApiBackendOpenCL, Intersection_JoinEvents)
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    ray r[2] =
+    {
+        ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f),
+        ray(float3(0.f, 0.5f, -10.f), float3(0.f, 0.f, 1.f), 10000.f)
+    };
+
+    auto ray_buffer = api_->CreateBuffer(2 * sizeof(ray), r);
+    auto isect_buffer = api_->CreateBuffer(2 * sizeof(Intersection), nullptr);
+    auto occl_buffer = api_->CreateBuffer(2 * sizeof(int), nullptr);
+
+    Event* events[3] = { nullptr, nullptr, nullptr };
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, &events[0]));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 2, occl_buffer, nullptr, &events[2]));
+
+    Event* joined = nullptr;
+    ASSERT_NO_THROW(api_->JoinEvents(events, 3, &joined));
+    ASSERT_NE(joined, nullptr);
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 2 * sizeof(Intersection), (void**)&tmp, &e_));
+    ASSERT_NO_THROW(api_->WaitForEvents(&joined, 1));
+    Wait();
+    Intersection isect[2] = { tmp[0], tmp[1] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    int* occl = nullptr;
+    ASSERT_NO_THROW(api_->WaitForEvents(events, 3));
+    ASSERT_NO_THROW(api_->MapBuffer(occl_buffer, kMapRead, 0, 2 * sizeof(int), (void**)&occl, &e_));
+    Wait();
+    int occluded[2] = { occl[0], occl[1] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(occl_buffer, occl, &e_));
+    Wait();
+
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+    ASSERT_EQ(occluded[0], 1);
+    ASSERT_EQ(occluded[1], 1);
+
+    api_->DeleteEvent(joined);
+    api_->DeleteEvent(events[0]);
+    api_->DeleteEvent(events[2]);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occl_buffer));
+}
+
+// The test checks a ray stream returns the hits of its batches in submission order
+TEST_F(ApiBackendOpenCL, Intersection_RayStream)
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    int const kNumBatches = 5;
+    int const kMaxRays = 16;
+
+    RayStream* stream = nullptr;
+    ASSERT_NO_THROW(stream = api_->CreateRayStream(kMaxRays, 2));
+    ASSERT_EQ(stream->GetMaxRays(), kMaxRays);
+
+    // Batch i has i + 1 rays, rays of odd batches miss
+    auto fill = [&](int batch)
+    {
+        ray* rays = stream->AcquireRays();
+        for (int i = 0; i <= batch; ++i)
+        {
+            float const x = (batch & 1) ? 10.f : 0.f;
+            rays[i] = ray(float3(x, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+        }
+        stream->Submit(batch + 1);
+    };
+
+    ASSERT_NO_THROW(fill(0));
+    ASSERT_NO_THROW(fill(1));
+    ASSERT_THROW(stream->AcquireRays(), Exception);
+
+    for (int batch = 0; batch < kNumBatches; ++batch)
+    {
+        int numrays = 0;
+        Intersection const* hits = nullptr;
+        ASSERT_NO_THROW(hits = stream->AcquireHits(&numrays));
+        ASSERT_EQ(numrays, batch + 1);
+
+        for (int i = 0; i < numrays; ++i)
+        {
+            ASSERT_EQ(hits[i].shapeid, (batch & 1) ? kNullId : mesh->GetId());
+        }
+
+        // The slot of the hits is reused once they are released
+        ASSERT_NO_THROW(stream->ReleaseHits());
+        if (batch + 2 < kNumBatches)
+        {
+            ASSERT_NO_THROW(fill(batch + 2));
+        }
+    }
+
+    ASSERT_NO_THROW(api_->DeleteRayStream(stream));
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// The test checks queries submitted at once give the same hits as separate ones
+TEST_F(ApiBackendOpenCL, Intersection_SubmitQueries)
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // The first ray hits, the second one misses
+    ray r[2] =
+    {
+        ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f),
+        ray(float3(10.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f)
+    };
+
+    auto hit_ray = api_->CreateBuffer(sizeof(ray), &r[0]);
+    auto miss_ray = api_->CreateBuffer(sizeof(ray), &r[1]);
+    auto hit_isect = api_->CreateBuffer(sizeof(Intersection), nullptr);
+    auto miss_isect = api_->CreateBuffer(sizeof(Intersection), nullptr);
+    auto occl_buffer = api_->CreateBuffer(2 * sizeof(int), nullptr);
+    auto both_rays = api_->CreateBuffer(2 * sizeof(ray), r);
+
+    QueryDesc descs[] =
+    {
+        { kQueryIntersection, hit_ray, 1, hit_isect },
+        { kQueryIntersection, miss_ray, 1, miss_isect },
+        { kQueryOcclusion, both_rays, 2, occl_buffer }
+    };
+
+    ASSERT_NO_THROW(api_->SubmitQueries(descs, 3, nullptr, &e_));
+    Wait();
+
+    Intersection isect[2];
+    int occluded[2] = { 0, 0 };
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(hit_isect, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect[0] = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(hit_isect, tmp, &e_));
+    Wait();
+    ASSERT_NO_THROW(api_->MapBuffer(miss_isect, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect[1] = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(miss_isect, tmp, &e_));
+    Wait();
+    int* occl = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(occl_buffer, kMapRead, 0, 2 * sizeof(int), (void**)&occl, &e_));
+    Wait();
+    occluded[0] = occl[0];
+    occluded[1] = occl[1];
+    ASSERT_NO_THROW(api_->UnmapBuffer(occl_buffer, occl, &e_));
+    Wait();
+
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[1].shapeid, kNullId);
+    ASSERT_EQ(occluded[0], 1);
+    ASSERT_EQ(occluded[1], -1);
+
+    // An empty submission still returns an event
+    ASSERT_NO_THROW(api_->SubmitQueries(nullptr, 0, nullptr, &e_));
+    Wait();
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hit_ray));
+    ASSERT_NO_THROW(api_->DeleteBuffer(miss_ray));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hit_isect));
+    ASSERT_NO_THROW(api_->DeleteBuffer(miss_isect));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occl_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(both_rays));
+}
+
+// The test checks query hints don't change the hits
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_QueryHints)
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->SetOption("acc.reorder", 1.f));
+    ASSERT_NO_THROW(api_->Commit());
+
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    QueryHint const hints[] = { kQueryHintCoherent, kQueryHintIncoherent, kQueryHintShortRays, kQueryHintShadow, kQueryHintDefault };
+
+    for (auto hint : hints)
+    {
+        ASSERT_NO_THROW(api_->SetQueryHint(hint));
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        Intersection isect = *tmp;
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        ASSERT_EQ(isect.shapeid, mesh->GetId());
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks structure of arrays queries match ray and hit records
+TEST_F(ApiBackendOpenCL, Intersection_SoaLayout)
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // The first ray hits, the second one misses and the third one is too short
+    float origins[] = { 0.f, 0.f, -10.f, 10.f, 0.f, -10.f, 0.f, 0.f, -10.f };
+    float directions[] = { 0.f, 0.f, 1.f, 0.f, 0.f, 1.f, 0.f, 0.f, 1.f };
+    float maxt[] = { 10000.f, 10000.f, 1.f };
+
+    auto origin_buffer = api_->CreateBuffer(sizeof(origins), origins);
+    auto direction_buffer = api_->CreateBuffer(sizeof(directions), directions);
+    auto maxt_buffer = api_->CreateBuffer(sizeof(maxt), maxt);
+    auto shapeid_buffer = api_->CreateBuffer(3 * sizeof(Id), nullptr);
+    auto distance_buffer = api_->CreateBuffer(3 * sizeof(float), nullptr);
+    auto occl_buffer = api_->CreateBuffer(3 * sizeof(int), nullptr);
+
+    RayLayout rays = { origin_buffer, direction_buffer, maxt_buffer, nullptr };
+    HitLayout hits = { shapeid_buffer, nullptr, nullptr, distance_buffer };
+
+    ASSERT_NO_THROW(api_->QueryIntersection(rays, 3, hits, nullptr, &e_));
+    Wait();
+    ASSERT_NO_THROW(api_->QueryOcclusion(rays, 3, occl_buffer, nullptr, &e_));
+    Wait();
+
+    Id* shapeids = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(shapeid_buffer, kMapRead, 0, 3 * sizeof(Id), (void**)&shapeids, &e_));
+    Wait();
+    ASSERT_EQ(shapeids[0], mesh->GetId());
+    ASSERT_EQ(shapeids[1], kNullId);
+    ASSERT_EQ(shapeids[2], kNullId);
+    ASSERT_NO_THROW(api_->UnmapBuffer(shapeid_buffer, shapeids, &e_));
+    Wait();
+
+    float* distances = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(distance_buffer, kMapRead, 0, sizeof(float), (void**)&distances, &e_));
+    Wait();
+    ASSERT_NEAR(distances[0], 10.f, 1e-4f);
+    ASSERT_NO_THROW(api_->UnmapBuffer(distance_buffer, distances, &e_));
+    Wait();
+
+    int* occl = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(occl_buffer, kMapRead, 0, 3 * sizeof(int), (void**)&occl, &e_));
+    Wait();
+    ASSERT_EQ(occl[0], 1);
+    ASSERT_EQ(occl[1], -1);
+    ASSERT_EQ(occl[2], -1);
+    ASSERT_NO_THROW(api_->UnmapBuffer(occl_buffer, occl, &e_));
+    Wait();
+
+    // Origins and directions are required
+    RayLayout invalid = { nullptr, direction_buffer, nullptr, nullptr };
+    ASSERT_THROW(api_->QueryIntersection(invalid, 3, hits, nullptr, nullptr), Exception);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(origin_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(direction_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(maxt_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(shapeid_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(distance_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occl_buffer));
+}
+
+// The test checks distance and occlusion count queries reduce the hits of the rays
+TEST_F(ApiBackendOpenCL, Intersection_DistanceAndOcclusionCount)
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // The first and the third rays hit, the second one misses and the last one is inactive
+    ray r[4] =
+    {
+        ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f),
+        ray(float3(10.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f),
+        ray(float3(0.f, 0.f, -5.f), float3(0.f, 0.f, 1.f), 10000.f),
+        ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f)
+    };
+    r[3].SetActive(false);
+
+    auto ray_buffer = api_->CreateBuffer(4 * sizeof(ray), r);
+    auto distance_buffer = api_->CreateBuffer(4 * sizeof(float), nullptr);
+    auto count_buffer = api_->CreateBuffer(2 * sizeof(int), nullptr);
+
+    ASSERT_NO_THROW(api_->QueryDistance(ray_buffer, 4, distance_buffer, nullptr, &e_));
+    Wait();
+    // Groups of 3 rays, the last one holds the inactive ray only
+    ASSERT_NO_THROW(api_->QueryOcclusionCount(ray_buffer, 4, 3, count_buffer, nullptr, &e_));
+    Wait();
+
+    float* distances = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(distance_buffer, kMapRead, 0, 4 * sizeof(float), (void**)&distances, &e_));
+    Wait();
+    ASSERT_NEAR(distances[0], 10.f, 1e-4f);
+    ASSERT_EQ(distances[1], -1.f);
+    ASSERT_NEAR(distances[2], 5.f, 1e-4f);
+    ASSERT_EQ(distances[3], -1.f);
+    ASSERT_NO_THROW(api_->UnmapBuffer(distance_buffer, distances, &e_));
+    Wait();
+
+    int* counts = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(count_buffer, kMapRead, 0, 2 * sizeof(int), (void**)&counts, &e_));
+    Wait();
+    ASSERT_EQ(counts[0], 2);
+    ASSERT_EQ(counts[1], 0);
+    ASSERT_NO_THROW(api_->UnmapBuffer(count_buffer, counts, &e_));
+    Wait();
+
+    ASSERT_THROW(api_->QueryOcclusionCount(ray_buffer, 4, 0, count_buffer, nullptr, nullptr), Exception);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(distance_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(count_buffer));
+}
+
+// The test checks per-ray traversal counters and their histogram
+TEST_F(ApiBackendOpenCL, Intersection_TraversalStats)
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->SetOption("profile.traversal_stats", 1.f));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // The first ray hits, the second one misses and the last one is inactive
+    ray r[3] =
+    {
+        ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f),
+        ray(float3(10.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f),
+        ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f)
+    };
+    r[2].SetActive(false);
+
+    auto ray_buffer = api_->CreateBuffer(3 * sizeof(ray), r);
+    auto hit_buffer = api_->CreateBuffer(3 * sizeof(Intersection), nullptr);
+    auto stats_buffer = api_->CreateBuffer(3 * sizeof(TraversalStats), nullptr);
+
+    // Kernels counting traversal need the buffer
+    ASSERT_THROW(api_->QueryIntersection(ray_buffer, 3, hit_buffer, nullptr, nullptr), Exception);
+
+    ASSERT_NO_THROW(api_->SetTraversalStatsBuffer(stats_buffer));
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, hit_buffer, nullptr, &e_));
+    Wait();
+
+    TraversalStats* stats = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(stats_buffer, kMapRead, 0, 3 * sizeof(TraversalStats), (void**)&stats, &e_));
+    Wait();
+    ASSERT_GT(stats[0].nodes, 0);
+    ASSERT_GT(stats[0].primitives, 0);
+    ASSERT_GT(stats[0].iterations, 0);
+    ASSERT_EQ(stats[2].nodes, 0);
+    ASSERT_EQ(stats[2].primitives, 0);
+    ASSERT_EQ(stats[2].iterations, 0);
+
+    // A bin wider than any count of a single triangle scene holds every ray
+    int histogram[2] = {};
+    BuildTraversalHistogram(stats, 3, kTraversalNodes, 1000, 2, histogram);
+    ASSERT_EQ(histogram[0], 3);
+    ASSERT_EQ(histogram[1], 0);
+    // Counts past the last bin go to it, the hit ray tested a primitive
+    BuildTraversalHistogram(stats, 3, kTraversalPrimitives, 1, 2, histogram);
+    ASSERT_EQ(histogram[0] + histogram[1], 3);
+    ASSERT_GE(histogram[1], 1);
+    ASSERT_NO_THROW(api_->UnmapBuffer(stats_buffer, stats, &e_));
+    Wait();
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetTraversalStatsBuffer(nullptr));
+    ASSERT_NO_THROW(api_->SetOption("profile.traversal_stats", 0.f));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hit_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(stats_buffer));
+}
+
+// The test checks commits report progress and a cancelled build keeps the previous scene
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_CommitAsyncCancel)
+{
+    int const kGridSize = 256;
+
+    // Large enough for the build to check for cancellation
+    std::vector<float> grid_vertices;
+    for (int j = 0; j <= kGridSize; ++j)
+    {
+        for (int i = 0; i <= kGridSize; ++i)
+        {
+            float const p[] = { (float)i / kGridSize - 0.5f, (float)j / kGridSize - 0.5f, 0.f };
+            grid_vertices.insert(grid_vertices.end(), p, p + 3);
+        }
+    }
+
+    std::vector<int> grid_indices;
+    for (int j = 0; j < kGridSize; ++j)
+    {
+        for (int i = 0; i < kGridSize; ++i)
+        {
+            int const v00 = j * (kGridSize + 1) + i;
+            int const v10 = v00 + 1;
+            int const v01 = v00 + kGridSize + 1;
+            int const v11 = v01 + 1;
+            int const face[] = { v00, v10, v11, v00, v11, v01 };
+            grid_indices.insert(grid_indices.end(), face, face + 6);
+        }
+    }
+
+    int const kNumFaces = 2 * kGridSize * kGridSize;
+    std::vector<int> face_verts(kNumFaces, 3);
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(grid_vertices.data(), (kGridSize + 1) * (kGridSize + 1), 3 * sizeof(float),
+        grid_indices.data(), 0, face_verts.data(), kNumFaces));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    std::vector<float> progress;
+    auto report = [](float value, void* userdata)
+    {
+        static_cast<std::vector<float>*>(userdata)->push_back(value);
+    };
+
+    ASSERT_NO_THROW(api_->SetProgressCallback(report, &progress));
+    ASSERT_NO_THROW(api_->SetOption("bvh.builder", "sah"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.sah.use_splits", 1.f));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Progress only goes up and ends with the commit
+    ASSERT_FALSE(progress.empty());
+    ASSERT_TRUE(std::is_sorted(progress.cbegin(), progress.cend()));
+    ASSERT_EQ(progress.back(), 1.f);
+
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    auto query = [&]()
+    {
+        Intersection* tmp = nullptr;
+        api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr);
+        api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_);
+        Wait();
+        Intersection isect = *tmp;
+        api_->UnmapBuffer(isect_buffer, tmp, &e_);
+        Wait();
+        return isect.shapeid;
+    };
+
+    ASSERT_EQ(query(), mesh->GetId());
+
+    // Move the mesh away from the ray and cancel the build, it might have finished already
+    matrix m = translation(float3(10.f, 0.f, 0.f));
+    ASSERT_NO_THROW(mesh->SetTransform(m, inverse(m)));
+    ASSERT_NO_THROW(api_->CommitAsync(&e_));
+    ASSERT_NO_THROW(api_->CancelCommit());
+
+    bool cancelled = false;
+    try
+    {
+        e_->Wait();
+    }
+    catch (Exception&)
+    {
+        cancelled = true;
+    }
+    api_->DeleteEvent(e_);
+
+    ASSERT_EQ(query(), cancelled ? mesh->GetId() : kNullId);
+
+    // Commits after a cancelled one see all the changes
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_EQ(query(), kNullId);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetProgressCallback(nullptr, nullptr));
+    ASSERT_NO_THROW(api_->SetOption("bvh.sah.use_splits", 0.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.builder", "median"));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks traversal kernel times are collected if profiling is enabled
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_KernelProfile)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->SetOption("profile.kernels", 1.f));
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    // Intersect twice
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, &e_));
+    Wait();
+
+    KernelProfile profiles[16];
+    int count = 0;
+    ASSERT_NO_THROW(count = api_->GetKernelProfile(profiles, 16));
+    ASSERT_GE(count, 1);
+
+    bool found = false;
+    for (int i = 0; i < std::min(count, 16); ++i)
+    {
+        if (std::string(profiles[i].name) == "bvh.traversal")
+        {
+            ASSERT_EQ(profiles[i].calls, 2);
+            ASSERT_GE(profiles[i].time, 0.f);
+            found = true;
+        }
+    }
+
+    ASSERT_TRUE(found);
+
+    // Times are dropped on reset
+    ASSERT_NO_THROW(api_->ResetKernelProfile());
+    ASSERT_EQ(api_->GetKernelProfile(nullptr, 0), 0);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("profile.kernels", 0.f));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks acceleration structure statistics of a single triangle
+TEST_F(ApiBackendOpenCL, AccelStats_1Triangle)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    AccelStats stats;
+    ASSERT_NO_THROW(api_->GetStats(stats));
+
+    // The tree is a single leaf
+    ASSERT_EQ(stats.num_primitives, 1);
+    ASSERT_EQ(stats.num_refs, 1);
+    ASSERT_EQ(stats.num_leaves, 1);
+    ASSERT_EQ(stats.num_nodes, 1);
+    ASSERT_EQ(stats.max_depth, 0);
+    ASSERT_FLOAT_EQ(stats.avg_leaf_prims, 1.f);
+    ASSERT_GT(stats.sah_cost, 0.f);
+    ASSERT_GT(stats.node_memory, 0u);
+    ASSERT_GT(stats.vertex_memory, 0u);
+    ASSERT_GE(stats.build_time, 0.f);
+    ASSERT_GE(stats.commit_time, stats.build_time);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// The test checks the tree is rebuilt when only the build options change
+TEST_F(ApiBackendOpenCL, AccelStats_RebuildOnBvhOptionChange)
+{
+    SceneGenerator::MeshData sphere = SceneGenerator::GenerateSphere(float3(0.f, 0.f, 0.f), 1.f, 32, 64);
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = SceneGenerator::CreateMesh(api_, sphere));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.builder", "sah"));
+    ASSERT_NO_THROW(api_->Commit());
+
+    AccelStats single;
+    ASSERT_NO_THROW(api_->GetStats(single));
+    ASSERT_FLOAT_EQ(single.avg_leaf_prims, 1.f);
+
+    // Nothing but the options changed
+    ASSERT_NO_THROW(api_->SetOption("bvh.sah.max_leaf_prims", 4.f));
+    ASSERT_NO_THROW(api_->Commit());
+
+    AccelStats multi;
+    ASSERT_NO_THROW(api_->GetStats(multi));
+    ASSERT_EQ(multi.num_primitives, single.num_primitives);
+    ASSERT_LT(multi.num_leaves, single.num_leaves);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("bvh.sah.max_leaf_prims", 1.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.builder", "median"));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+#ifdef RR_RAY_MASK
+// The test creates a single triangle mesh and tests attach/detach functionality
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_Masked)
+#else
+// The test creates a single triangle mesh and tests attach/detach functionality
+TEST_F(ApiBackendOpenCL, DISABLED_Intersection_1Ray_Masked)
+#endif
+{
+
+    Shape* mesh = nullptr;
+
+    api_->SetOption("acc.type", "bvh");
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    // Set mask 
+    ASSERT_NO_THROW(mesh->SetMask(0xFFFFFFFF));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    r.SetMask(0xFFFFFFFF);
+
+    // Intersection and hit data
+    Intersection isect;
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+    auto isect_flag_buffer = api_->CreateBuffer(sizeof(int), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+    
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+    
+    // Check results
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+
+    mesh->SetMask(0x0);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+    
+    tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+    
+    // Check results
+    ASSERT_EQ(isect.shapeid, kNullId);
+
+    mesh->SetMask(0xFF000000);
+    
+    int result = kNullId;
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 1, isect_flag_buffer, nullptr, nullptr ));
+    
+    int* isect_flag = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_flag_buffer, kMapRead, 0, sizeof(int), (void**)&isect_flag, &e_));
+    Wait();
+    result = *isect_flag;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_flag_buffer, isect_flag, &e_));
+    Wait();
+    
+    // Check results
+    ASSERT_GT(result, 0);
+
+    mesh->SetMask(0xFF000000);
+    
+    r.SetMask(0x000000FF);
+    
+    ray* rr = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(ray_buffer, kMapWrite, 0, sizeof(ray), (void**)&rr, &e_));
+    Wait();
+    *rr = r;
+    ASSERT_NO_THROW(api_->UnmapBuffer(ray_buffer, rr, &e_));
+    Wait();
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 1, isect_flag_buffer, nullptr, nullptr ));
+    
+    isect_flag = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_flag_buffer, kMapRead, 0, sizeof(int), (void**)&isect_flag, &e_));
+    Wait();
+    result = *isect_flag;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_flag_buffer, isect_flag, &e_));
+    Wait();
+    // Check results
+    ASSERT_EQ(result, kNullId);
+
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_flag_buffer));
+
+}
+
+
+#ifdef RR_RAY_MASK
+// Subtrees masked for the ray are skipped by both single and two level traversal
+TEST_F(ApiBackendOpenCL, Intersection_MaskedSubtrees)
+#else
+// Subtrees masked for the ray are skipped by both single and two level traversal
+TEST_F(ApiBackendOpenCL, DISABLED_Intersection_MaskedSubtrees)
+#endif
+{
+    // Three triangles stacked along z with a mask bit each
+    std::vector<Shape*> meshes;
+    for (int i = 0; i < 3; ++i)
+    {
+        Shape* mesh = nullptr;
+        ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+        ASSERT_TRUE(mesh != nullptr);
+        matrix m = translation(float3(0.f, 0.f, (float)i));
+        ASSERT_NO_THROW(mesh->SetTransform(m, inverse(m)));
+        ASSERT_NO_THROW(mesh->SetMask(1 << i));
+        ASSERT_NO_THROW(api_->AttachShape(mesh));
+        meshes.push_back(mesh);
+    }
+
+    // Rays see the last layer, the last two layers and none of them
+    int const kNumRays = 3;
+    int const masks[kNumRays] = { 0x4, 0x6, 0x8 };
+    ray rays[kNumRays];
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        rays[i] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f));
+        rays[i].SetMask(masks[i]);
+    }
+
+    Buffer* ray_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), rays));
+    Buffer* isect_buffer = nullptr;
+    ASSERT_NO_THROW(isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr));
+
+    for (int twolevel = 0; twolevel < 2; ++twolevel)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.type", "fatbvh"));
+        ASSERT_NO_THROW(api_->SetOption("bvh.force2level", (float)twolevel));
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, &e_));
+        Wait();
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        std::vector<Intersection> isects(tmp, tmp + kNumRays);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        ASSERT_EQ(isects[0].shapeid, meshes[2]->GetId());
+        ASSERT_EQ(isects[1].shapeid, meshes[1]->GetId());
+        ASSERT_EQ(isects[2].shapeid, kNullId);
+    }
+
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 0.f));
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+
+    // Bail out
+    for (auto mesh : meshes)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(mesh));
+        ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    }
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+#ifdef RR_RAY_MASK
+// Rays select scene layers by mask without recommitting the scene
+TEST_F(ApiBackendOpenCL, Intersection_Layers)
+#else
+TEST_F(ApiBackendOpenCL, DISABLED_Intersection_Layers)
+#endif
+{
+    // Three triangles stacked along z, the middle one is in no layer
+    std::vector<Shape*> meshes;
+    for (int i = 0; i < 3; ++i)
+    {
+        Shape* mesh = nullptr;
+        ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+        ASSERT_TRUE(mesh != nullptr);
+        matrix m = translation(float3(0.f, 0.f, (float)i));
+        ASSERT_NO_THROW(mesh->SetTransform(m, inverse(m)));
+        ASSERT_NO_THROW(api_->AttachShape(mesh));
+        meshes.push_back(mesh);
+    }
+
+    int front = -1;
+    int back = -1;
+    ASSERT_NO_THROW(front = api_->CreateLayer("front"));
+    ASSERT_NO_THROW(back = api_->CreateLayer("back"));
+    ASSERT_EQ(api_->GetLayer("back"), back);
+    ASSERT_EQ(api_->GetLayer("side"), -1);
+    ASSERT_ANY_THROW(api_->CreateLayer("front"));
+    ASSERT_NO_THROW(api_->SetLayerMembership(front, meshes[0], true));
+    ASSERT_NO_THROW(api_->SetLayerMembership(back, meshes[2], true));
+
+    // Rays see the front layer, the back layer, both of them and the whole scene
+    int const kNumRays = 4;
+    int const masks[kNumRays] = { GetLayerMask(front), GetLayerMask(back), GetLayerMask(front) | GetLayerMask(back), -1 };
+    ray rays[kNumRays];
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        rays[i] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f));
+        rays[i].SetMask(masks[i]);
+    }
+
+    Buffer* ray_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), rays));
+    Buffer* isect_buffer = nullptr;
+    ASSERT_NO_THROW(isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr));
+
+    auto query = [&]()
+    {
+        std::vector<Intersection> isects;
+        EXPECT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, &e_));
+        Wait();
+
+        Intersection* tmp = nullptr;
+        EXPECT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        isects.assign(tmp, tmp + kNumRays);
+        EXPECT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+        return isects;
+    };
+
+    ASSERT_NO_THROW(api_->Commit());
+    auto isects = query();
+    ASSERT_EQ(isects[0].shapeid, meshes[0]->GetId());
+    ASSERT_EQ(isects[1].shapeid, meshes[2]->GetId());
+    ASSERT_EQ(isects[2].shapeid, meshes[0]->GetId());
+    ASSERT_EQ(isects[3].shapeid, meshes[0]->GetId());
+
+    // Membership changes are applied on commit
+    ASSERT_NO_THROW(api_->SetLayerMembership(front, meshes[0], false));
+    ASSERT_NO_THROW(api_->SetLayerMembership(front, meshes[1], true));
+    ASSERT_NO_THROW(api_->Commit());
+    isects = query();
+    ASSERT_EQ(isects[0].shapeid, meshes[1]->GetId());
+    ASSERT_EQ(isects[1].shapeid, meshes[2]->GetId());
+    ASSERT_EQ(isects[2].shapeid, meshes[1]->GetId());
+    ASSERT_EQ(isects[3].shapeid, meshes[0]->GetId());
+
+    // Bail out
+    for (auto mesh : meshes)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(mesh));
+        ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    }
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+#ifndef RR_RAY_MASK
+// Layers can't be created when the kernels don't test ray masks, rather than hitting every shape
+TEST_F(ApiBackendOpenCL, Intersection_LayersWithoutRayMasks)
+{
+    ASSERT_ANY_THROW(api_->CreateLayer("front"));
+    ASSERT_EQ(api_->GetLayer("front"), -1);
+}
+#endif
+
+// The test changes shape ID between commits and checks hits report the new one
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_ChangeId)
+{
+    Shape* mesh = nullptr;
+
+    api_->SetOption("acc.type", "bvh");
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    // Intersection and hit data
+    Intersection isect;
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+
+    // Change ID only, face data is patched without BVH rebuild
+    ASSERT_NO_THROW(mesh->SetId(42));
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+    tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect.shapeid, 42);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+
+// The test creates a single triangle mesh and tests attach/detach functionality
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_Active)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    // Intersection and hit data
+    Intersection isect;
+    
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+    
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+    
+    // Check results
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+
+    isect.primid = kNullId;
+    isect.shapeid = kNullId;
+
+    r.SetActive(false);
+    
+    ray* rr = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(ray_buffer, kMapWrite, 0, sizeof(ray), (void**)&rr, &e_));
+    Wait();
+    *rr = r;
+    ASSERT_NO_THROW(api_->UnmapBuffer(ray_buffer, rr, &e_));
+    Wait();
+    
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapWrite, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    *tmp = isect;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+    
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+    
+    tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    
+    // Check results
+    ASSERT_EQ(isect.shapeid, kNullId);
+
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test creates a single triangle mesh and tests attach/detach functionality
+TEST_F(ApiBackendOpenCL, Intersection_3Rays)
+{
+
+    Shape* mesh = nullptr;
+
+    // 
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "grid"));
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays
+    ray rays[3];
+
+    // Prepare the ray
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(0.f,0.5f,-10.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,1.f);
+
+    rays[2].o = float4(0.5f,0.f,-10.f, 1000.f);
+    rays[2].d = float3(0.f,0.f,1.f);
+
+    // Intersection and hit data
+    Intersection isect[3];
+    
+    auto ray_buffer = api_->CreateBuffer(3*sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(3*sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr ));
+    
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect[0] = tmp[0];
+    isect[1] = tmp[1];
+    isect[2] = tmp[2];
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+    
+    // Check results
+    for (int i=0; i<3; ++i)
+    {
+        ASSERT_EQ(isect[i].shapeid, mesh->GetId());
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+
+// The test checks that batches split between GPU and CPU are merged correctly
+TEST_F(ApiBackendOpenCL, Intersection_Hybrid)
+{
+    IntersectionApi::Delete(api_);
+    api_ = IntersectionApi::CreateHybrid(nativeidx_);
+
+    ASSERT_TRUE(api_ != nullptr);
+
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Even rays hit the triangle, odd ones miss it
+    int const kNumRays = 256;
+    std::vector<ray> rays(kNumRays);
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        rays[i].o = float4((i & 1) ? 5.f : 0.f, 0.f, -10.f, 1000.f);
+        rays[i].d = float3(0.f, 0.f, 1.f);
+    }
+
+    auto ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Run several times to let the split change
+    for (int pass = 0; pass < 4; ++pass)
+    {
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+
+        // Check results
+        for (int i = 0; i < kNumRays; ++i)
+        {
+            ASSERT_EQ(tmp[i].shapeid, (i & 1) ? kNullId : mesh->GetId());
+        }
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks that the built-in CPU device traverses the same scene as the GPU one
+TEST_F(ApiBackendOpenCL, Intersection_NativeCpu)
+{
+    IntersectionApi::SetPlatform(static_cast<DeviceInfo::Platform>(DeviceInfo::kOpenCL | DeviceInfo::kNative));
+
+    int cpuidx = -1;
+    for (auto idx = 0U; idx < IntersectionApi::GetDeviceCount(); ++idx)
+    {
+        DeviceInfo devinfo;
+        IntersectionApi::GetDeviceInfo(idx, devinfo);
+
+        if (devinfo.type == DeviceInfo::kCpu && devinfo.platform == DeviceInfo::kNative)
+        {
+            cpuidx = idx;
+        }
+    }
+
+    ASSERT_NE(cpuidx, -1);
+
+    IntersectionApi* apis[] = { api_, IntersectionApi::Create(cpuidx) };
+    ASSERT_TRUE(apis[1] != nullptr);
+
+    // Even rays hit the triangle, odd ones miss it
+    int const kNumRays = 1024;
+    std::vector<ray> rays(kNumRays);
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        rays[i].o = float4((i & 1) ? 5.f : 0.f, 0.f, -10.f, 1000.f);
+        rays[i].d = float3(0.f, 0.f, 1.f);
+    }
+
+    Intersection results[2][kNumRays];
+    int occluded[2][kNumRays];
+
+    for (int a = 0; a < 2; ++a)
+    {
+        IntersectionApi* api = apis[a];
+
+        Shape* mesh = nullptr;
+        ASSERT_NO_THROW(mesh = api->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+        ASSERT_NO_THROW(api->AttachShape(mesh));
+        ASSERT_NO_THROW(api->Commit());
+
+        auto ray_buffer = api->CreateBuffer(kNumRays * sizeof(ray), rays.data());
+        auto isect_buffer = api->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+        auto occl_buffer = api->CreateBuffer(kNumRays * sizeof(int), nullptr);
+
+        ASSERT_NO_THROW(api->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api->QueryOcclusion(ray_buffer, kNumRays, occl_buffer, nullptr, nullptr));
+
+        Event* e = nullptr;
+        Intersection* isect = nullptr;
+        ASSERT_NO_THROW(api->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect, &e));
+        e->Wait();
+        api->DeleteEvent(e);
+        std::copy(isect, isect + kNumRays, results[a]);
+        ASSERT_NO_THROW(api->UnmapBuffer(isect_buffer, isect, &e));
+        e->Wait();
+        api->DeleteEvent(e);
+
+        int* occl = nullptr;
+        ASSERT_NO_THROW(api->MapBuffer(occl_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&occl, &e));
+        e->Wait();
+        api->DeleteEvent(e);
+        std::copy(occl, occl + kNumRays, occluded[a]);
+        ASSERT_NO_THROW(api->UnmapBuffer(occl_buffer, occl, &e));
+        e->Wait();
+        api->DeleteEvent(e);
+
+        for (int i = 0; i < kNumRays; ++i)
+        {
+            ASSERT_EQ(results[a][i].shapeid, (i & 1) ? kNullId : mesh->GetId());
+        }
+
+        ASSERT_NO_THROW(api->DetachShape(mesh));
+        ASSERT_NO_THROW(api->DeleteShape(mesh));
+        ASSERT_NO_THROW(api->DeleteBuffer(ray_buffer));
+        ASSERT_NO_THROW(api->DeleteBuffer(isect_buffer));
+        ASSERT_NO_THROW(api->DeleteBuffer(occl_buffer));
+    }
+
+    IntersectionApi::Delete(apis[1]);
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        ASSERT_EQ(results[0][i].primid, results[1][i].primid);
+        ASSERT_NEAR(results[0][i].uvwt.w, results[1][i].uvwt.w, 1e-4f);
+        ASSERT_EQ(occluded[0][i], occluded[1][i]);
+    }
+}
+
+// The test checks that batches split across devices are merged correctly
+TEST_F(ApiBackendOpenCL, Intersection_MultiDevice)
+{
+    // The same device twice still goes through range splitting
+    std::uint32_t devices[] = { static_cast<std::uint32_t>(nativeidx_), static_cast<std::uint32_t>(nativeidx_) };
+
+    IntersectionApi::Delete(api_);
+    api_ = IntersectionApi::CreateMultiDevice(devices, 2);
+
+    ASSERT_TRUE(api_ != nullptr);
+
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Even rays hit the triangle, odd ones miss it
+    int const kNumRays = 300;
+    std::vector<ray> rays(kNumRays);
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        rays[i].o = float4((i & 1) ? 5.f : 0.f, 0.f, -10.f, 1000.f);
+        rays[i].d = float3(0.f, 0.f, 1.f);
+    }
+
+    auto ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, &e_));
+    Wait();
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+
+    // Check results
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        ASSERT_EQ(tmp[i].shapeid, (i & 1) ? kNullId : mesh->GetId());
+    }
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks that a scene split between remote workers gives the closest hits
+TEST_F(ApiBackendOpenCL, Intersection_RemotePartition)
+{
+    // Workers listen on free loopback ports and report them through the promises
+    struct Workers
+    {
+        std::promise<std::uint16_t> ports[2];
+        std::vector<std::thread> threads;
+        std::vector<std::string> endpoints;
+        IntersectionApi* remote = nullptr;
+
+        // Joins the workers however the test ends, workers still waiting for
+        // the client are released by connecting to them and hanging up
+        ~Workers()
+        {
+            if (remote)
+            {
+                IntersectionApi::Delete(remote);
+            }
+
+            for (auto const& endpoint : endpoints)
+            {
+                char const* endpoints[] = { endpoint.c_str() };
+                try
+                {
+                    IntersectionApi::Delete(IntersectionApi::CreateRemote(endpoints, 1));
+                }
+                catch (Exception&)
+                {
+                }
+            }
+
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+        }
+    } workers;
+
+    for (auto& port : workers.ports)
+    {
+        auto promise = &port;
+        workers.threads.emplace_back([this, promise]()
+        {
+            bool listening = false;
+            auto ready = [](std::uint16_t port, void* userdata)
+            {
+                auto state = static_cast<std::pair<std::promise<std::uint16_t>*, bool*>*>(userdata);
+                *state->second = true;
+                state->first->set_value(port);
+            };
+            std::pair<std::promise<std::uint16_t>*, bool*> state(promise, &listening);
+
+            try
+            {
+                IntersectionApi::ServeRemote(nativeidx_, 0, "127.0.0.1", ready, &state);
+            }
+            catch (Exception&)
+            {
+                if (!listening)
+                {
+                    promise->set_exception(std::current_exception());
+                }
+            }
+        });
+    }
+
+    // Wait for both workers before asserting, so ~Workers knows all the listening ones
+    std::string error;
+    for (auto& port : workers.ports)
+    {
+        try
+        {
+            workers.endpoints.push_back("127.0.0.1:" + std::to_string(port.get_future().get()));
+        }
+        catch (Exception& e)
+        {
+            error = e.what();
+        }
+    }
+
+    ASSERT_TRUE(error.empty()) << error;
+
+    char const* endpoints[] = { workers.endpoints[0].c_str(), workers.endpoints[1].c_str() };
+    ASSERT_NO_THROW(workers.remote = IntersectionApi::CreateRemote(endpoints, 2));
+    ASSERT_TRUE(workers.remote != nullptr);
+    auto remote = workers.remote;
+
+    remote->SetOption("remote.partition", 1.f);
+    remote->SetOption("remote.chunk_rays", 64.f);
+
+    // Triangles one behind another end up on different workers
+    Shape* front = nullptr;
+    Shape* back = nullptr;
+    ASSERT_NO_THROW(front = remote->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(back = remote->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    matrix m = translation(float3(0.f, 0.f, 5.f));
+    ASSERT_NO_THROW(back->SetTransform(m, inverse(m)));
+
+    ASSERT_NO_THROW(remote->AttachShape(back));
+    ASSERT_NO_THROW(remote->AttachShape(front));
+
+    // Even rays hit both triangles, odd ones miss them
+    int const kNumRays = 300;
+    std::vector<ray> rays(kNumRays);
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        rays[i].o = float4((i & 1) ? 5.f : 0.f, 0.f, -10.f, 1000.f);
+        rays[i].d = float3(0.f, 0.f, 1.f);
+    }
+
+    auto ray_buffer = remote->CreateBuffer(kNumRays * sizeof(ray), rays.data());
+    auto isect_buffer = remote->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+    auto occl_buffer = remote->CreateBuffer(kNumRays * sizeof(int), nullptr);
+
+    ASSERT_NO_THROW(remote->Commit());
+
+    Event* e = nullptr;
+    ASSERT_NO_THROW(remote->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, &e));
+    e->Wait();
+    remote->DeleteEvent(e);
+
+    ASSERT_NO_THROW(remote->QueryOcclusion(ray_buffer, kNumRays, occl_buffer, nullptr, &e));
+    e->Wait();
+    remote->DeleteEvent(e);
+
+    Intersection* hits = nullptr;
+    int* occluded = nullptr;
+    ASSERT_NO_THROW(remote->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&hits, nullptr));
+    ASSERT_NO_THROW(remote->MapBuffer(occl_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&occluded, nullptr));
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        if (i & 1)
+        {
+            ASSERT_EQ(hits[i].shapeid, kNullId);
+            ASSERT_EQ(occluded[i], kNullId);
+        }
+        else
+        {
+            ASSERT_EQ(hits[i].shapeid, front->GetId());
+            ASSERT_NEAR(hits[i].uvwt.w, 10.f, 1e-4f);
+            ASSERT_NE(occluded[i], kNullId);
+        }
+    }
+
+    ASSERT_NO_THROW(remote->UnmapBuffer(isect_buffer, hits, nullptr));
+    ASSERT_NO_THROW(remote->UnmapBuffer(occl_buffer, occluded, nullptr));
+
+    // Workers return once the client disconnects, see ~Workers
+    ASSERT_NO_THROW(remote->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(remote->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(remote->DeleteBuffer(occl_buffer));
+    ASSERT_NO_THROW(remote->DeleteShape(front));
+    ASSERT_NO_THROW(remote->DeleteShape(back));
+}
+
+// The test checks that a worker answers a scene instancing an instance with an error instead of building it
+TEST_F(ApiBackendOpenCL, Intersection_RemoteInstanceOfInstance)
+{
+    // Joins the worker however the test ends, it returns once the client hangs up
+    struct Worker
+    {
+        std::promise<std::uint16_t> port;
+        std::thread thread;
+        std::unique_ptr<TcpStream> stream;
+
+        ~Worker()
+        {
+            stream.reset();
+            thread.join();
+        }
+    } worker;
+
+    worker.thread = std::thread([this, &worker]()
+    {
+        bool listening = false;
+        auto ready = [](std::uint16_t port, void* userdata)
+        {
+            auto state = static_cast<std::pair<std::promise<std::uint16_t>*, bool*>*>(userdata);
+            *state->second = true;
+            state->first->set_value(port);
+        };
+        std::pair<std::promise<std::uint16_t>*, bool*> state(&worker.port, &listening);
+
+        try
+        {
+            IntersectionApi::ServeRemote(nativeidx_, 0, "127.0.0.1", ready, &state);
+        }
+        catch (Exception&)
+        {
+            if (!listening)
+            {
+                worker.port.set_exception(std::current_exception());
+            }
+        }
+    });
+
+    std::string error;
+    try
+    {
+        worker.stream = TcpStream::Connect("127.0.0.1", worker.port.get_future().get());
+    }
+    catch (Exception& e)
+    {
+        error = e.what();
+    }
+
+    ASSERT_TRUE(error.empty()) << error;
+    auto stream = worker.stream.get();
+
+    Remote::MessageHeader header;
+    std::vector<char> payload;
+    Remote::RecordFormat format = { sizeof(ray), sizeof(Intersection), 0 };
+
+    Remote::SendMessage(*stream, Remote::kHello, Remote::kProtocolVersion, 0, nullptr, 0);
+    ASSERT_TRUE(Remote::ReceiveMessage(*stream, header, payload, format, 0));
+    ASSERT_EQ(header.type, static_cast<std::uint32_t>(Remote::kHello));
+
+    // A triangle, an instance of it and an instance of that instance
+    Remote::MessageWriter writer;
+    writer.Write(format);
+    writer.Write(static_cast<std::uint32_t>(0));
+    writer.Write(static_cast<std::uint32_t>(3));
+
+    auto write_shape = [&writer](std::uint32_t kind, Id id)
+    {
+        writer.Write(kind);
+        writer.Write(static_cast<std::uint32_t>(kind == Remote::kInstance ? 1 : 0));
+        writer.Write(id);
+        writer.Write(-1);
+        writer.Write(matrix());
+        writer.Write(matrix());
+        writer.Write(float3());
+        writer.Write(quaternion());
+    };
+
+    write_shape(Remote::kMesh, 1);
+    writer.Write(static_cast<std::uint32_t>(3));
+    for (int i = 0; i < 3; ++i)
+    {
+        writer.Write(float3(vertices()[3 * i], vertices()[3 * i + 1], vertices()[3 * i + 2]));
+    }
+    writer.Write(static_cast<std::uint32_t>(1));
+    writer.Write(3);
+    int const faces[] = { 0, 1, 2, 0 };
+    writer.Write(faces, sizeof(faces));
+
+    write_shape(Remote::kInstance, 2);
+    writer.Write(static_cast<std::uint32_t>(0));
+
+    write_shape(Remote::kInstance, 3);
+    writer.Write(static_cast<std::uint32_t>(1));
+
+    Remote::SendMessage(*stream, Remote::kScene, 0, 0, writer.GetData().data(), writer.GetData().size());
+    ASSERT_TRUE(Remote::ReceiveMessage(*stream, header, payload, format, 0));
+    ASSERT_EQ(header.type, static_cast<std::uint32_t>(Remote::kError));
+    ASSERT_EQ(std::string(payload.begin(), payload.end()), "Malformed remote message.");
+}
+
+
+// The test checks that queries submitted to different queues are ordered by events
+TEST_F(ApiBackendOpenCL, Intersection_MultiQueue)
+{
+    ASSERT_GT(api_->GetQueueCount(), 1U);
+
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r;
+    r.o = float4(0.f, 0.f, -10.f, 1000.f);
+    r.d = float3(0.f, 0.f, 1.f);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), nullptr);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Upload the ray on queue 1
+    ASSERT_NO_THROW(api_->SetQueue(1));
+
+    ray* ray_data = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(ray_buffer, kMapWrite, 0, sizeof(ray), (void**)&ray_data, &e_));
+    Wait();
+    *ray_data = r;
+
+    Event* upload_event = nullptr;
+    ASSERT_NO_THROW(api_->UnmapBuffer(ray_buffer, ray_data, &upload_event));
+
+    // Intersect on queue 0 after the upload
+    ASSERT_NO_THROW(api_->SetQueue(0));
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, upload_event, &e_));
+    Wait();
+    api_->DeleteEvent(upload_event);
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    ASSERT_EQ(tmp->shapeid, mesh->GetId());
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks that sliced low priority queries and high priority queries issued meanwhile give the same hits
+TEST_F(ApiBackendOpenCL, Intersection_QueryPriority)
+{
+    SceneGenerator::MeshData sphere = SceneGenerator::GenerateSphere(float3(0.f, 0.f, 0.f), 1.f, 32, 64);
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = SceneGenerator::CreateMesh(api_, sphere));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Even rays hit the sphere, odd ones pass beside it
+    int const kNumRays = 1000;
+    std::vector<ray> r(kNumRays);
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        r[i] = ray(float3((i & 1) ? 10.f : 0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    }
+
+    auto ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), &r[0]);
+    auto isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+    auto occl_buffer = api_->CreateBuffer(kNumRays * sizeof(int), nullptr);
+
+    // Split the background launch into several slices
+    ASSERT_NO_THROW(api_->SetOption("acc.lowpriority.slice", 128.f));
+    ASSERT_NO_THROW(api_->Commit());
+
+    Event* events[2] = { nullptr, nullptr };
+    ASSERT_NO_THROW(api_->SetQueryPriority(kQueryPriorityLow));
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, &events[0]));
+    ASSERT_NO_THROW(api_->SetQueryPriority(kQueryPriorityHigh));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, kNumRays, occl_buffer, nullptr, &events[1]));
+    events[0]->Wait();
+    events[1]->Wait();
+    api_->DeleteEvent(events[0]);
+    api_->DeleteEvent(events[1]);
+
+    ASSERT_NO_THROW(api_->SetQueryPriority(kQueryPriorityNormal));
+
+    Intersection* isect = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect, &e_));
+    Wait();
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        ASSERT_EQ(isect[i].shapeid, (i & 1) ? kNullId : mesh->GetId());
+    }
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+    Wait();
+
+    int* occl = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(occl_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&occl, &e_));
+    Wait();
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        ASSERT_EQ(occl[i], (i & 1) ? kNullId : 1);
+    }
+    ASSERT_NO_THROW(api_->UnmapBuffer(occl_buffer, occl, &e_));
+    Wait();
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("acc.lowpriority.slice", 262144.f));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occl_buffer));
+}
+
+// The test checks that buffer dependencies are honored on out of order queues
+TEST_F(ApiBackendOpenCL, Intersection_OutOfOrderQueues)
+{
+    IntersectionApi::SetOutOfOrderQueues(true);
+    IntersectionApi* api = IntersectionApi::Create(nativeidx_);
+    IntersectionApi::SetOutOfOrderQueues(false);
+    ASSERT_TRUE(api != nullptr);
+
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r;
+    r.o = float4(0.f, 0.f, -10.f, 1000.f);
+    r.d = float3(0.f, 0.f, 1.f);
+
+    auto ray_buffer = api->CreateBuffer(sizeof(ray), nullptr);
+    auto isect_buffer = api->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api->Commit());
+
+    // Nothing is waited on between the upload, the query and the readback
+    ray* ray_data = nullptr;
+    ASSERT_NO_THROW(api->MapBuffer(ray_buffer, kMapWrite, 0, sizeof(ray), (void**)&ray_data, &e_));
+    e_->Wait();
+    api->DeleteEvent(e_);
+    *ray_data = r;
+    ASSERT_NO_THROW(api->UnmapBuffer(ray_buffer, ray_data, nullptr));
+    ASSERT_NO_THROW(api->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    e_->Wait();
+    api->DeleteEvent(e_);
+    ASSERT_EQ(tmp->shapeid, mesh->GetId());
+    ASSERT_NO_THROW(api->UnmapBuffer(isect_buffer, tmp, &e_));
+    e_->Wait();
+    api->DeleteEvent(e_);
+
+    // Bail out
+    ASSERT_NO_THROW(api->DetachShape(mesh));
+    ASSERT_NO_THROW(api->DeleteShape(mesh));
+    ASSERT_NO_THROW(api->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api->DeleteBuffer(isect_buffer));
+    IntersectionApi::Delete(api);
+}
+
+// The test checks that APIs created from a snapshot keep its scene after the source changes
+TEST_F(ApiBackendOpenCL, Intersection_SceneSnapshot)
+{
+    Shape* mesh = nullptr;
+    Shape* instance = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(instance = api_->CreateInstance(mesh));
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    SceneSnapshot* snapshot = nullptr;
+    ASSERT_NO_THROW(snapshot = api_->CreateSnapshot());
+
+    IntersectionApi* apis[] = { IntersectionApi::CreateFromSnapshot(snapshot), IntersectionApi::CreateFromSnapshot(snapshot) };
+    ASSERT_TRUE(apis[0] != nullptr && apis[1] != nullptr);
+    IntersectionApi::DeleteSnapshot(snapshot);
+
+    // Move the source to another scene, the snapshot still holds the mesh
+    matrix m = translation(float3(10.f, 0.f, 0.f));
+    instance->SetTransform(m, inverse(m));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->AttachShape(instance));
+    ASSERT_NO_THROW(api_->Commit());
+
+    ray r;
+    r.o = float4(0.f, 0.f, -10.f, 1000.f);
+    r.d = float3(0.f, 0.f, 1.f);
+
+    for (auto api : apis)
+    {
+        // Buffers are shared, the ray comes from the source API
+        auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+        auto isect_buffer = api->CreateBuffer(sizeof(Intersection), nullptr);
+
+        Event* e = nullptr;
+        ASSERT_NO_THROW(api->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e));
+        e->Wait();
+        api->DeleteEvent(e);
+        ASSERT_EQ(tmp->shapeid, mesh->GetId());
+        ASSERT_NO_THROW(api->UnmapBuffer(isect_buffer, tmp, &e));
+        e->Wait();
+        api->DeleteEvent(e);
+
+        // The scene of a snapshot can't be changed
+        ASSERT_NO_THROW(api->AttachShape(mesh));
+        ASSERT_ANY_THROW(api->Commit());
+        ASSERT_NO_THROW(api->DetachShape(mesh));
+
+        ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+        ASSERT_NO_THROW(api->DeleteBuffer(isect_buffer));
+    }
+
+    // Bail out
+    IntersectionApi::Delete(apis[0]);
+    IntersectionApi::Delete(apis[1]);
+    ASSERT_NO_THROW(api_->DetachShape(instance));
+    ASSERT_NO_THROW(api_->DeleteShape(instance));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// The test checks that APIs created from a snapshot can be queried from several threads at once
+TEST_F(ApiBackendOpenCL, Intersection_ConcurrentSnapshots)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    SceneSnapshot* snapshot = nullptr;
+    ASSERT_NO_THROW(snapshot = api_->CreateSnapshot());
+
+    int const kNumThreads = 4;
+    std::vector<IntersectionApi*> apis(kNumThreads);
+    for (auto& api : apis)
+    {
+        api = IntersectionApi::CreateFromSnapshot(snapshot);
+        ASSERT_TRUE(api != nullptr);
+    }
+
+    IntersectionApi::DeleteSnapshot(snapshot);
+
+    // Every other ray misses the triangle
+    int const kNumRays = 1000;
+    std::vector<ray> rays(kNumRays);
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        float x = (i & 1) ? 5.f : 0.f;
+        rays[i] = ray(float3(x, 0.f, -10.f), float3(0.f, 0.f, 1.f));
+    }
+
+    // Queries of each thread are repeated to overlap the submissions of the others
+    int const kNumQueries = 50;
+    Id const mesh_id = mesh->GetId();
+    std::vector<int> failures(kNumThreads, 0);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < kNumThreads; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            auto api = apis[t];
+            auto ray_buffer = api->CreateBuffer(kNumRays * sizeof(ray), &rays[0]);
+            auto isect_buffer = api->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+
+            for (int q = 0; q < kNumQueries; ++q)
+            {
+                api->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr);
+
+                Event* e = nullptr;
+                Intersection* tmp = nullptr;
+                api->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&tmp, &e);
+                e->Wait();
+                api->DeleteEvent(e);
+
+                for (int i = 0; i < kNumRays; ++i)
+                {
+                    Id expected = (i & 1) ? kNullId : mesh_id;
+                    failures[t] += tmp[i].shapeid != expected ? 1 : 0;
+                }
+
+                api->UnmapBuffer(isect_buffer, tmp, &e);
+                e->Wait();
+                api->DeleteEvent(e);
+            }
+
+            api->DeleteBuffer(ray_buffer);
+            api->DeleteBuffer(isect_buffer);
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    for (int t = 0; t < kNumThreads; ++t)
+    {
+        ASSERT_EQ(failures[t], 0);
+    }
+
+    // Bail out
+    for (auto api : apis)
+    {
+        IntersectionApi::Delete(api);
+    }
+
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// Test is checking if ray reordering keeps hits in original ray order
+TEST_F(ApiBackendOpenCL, Intersection_Reorder)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays in both directions over the triangle, some of them inactive
+    int const kNumRays = 1000;
+    std::vector<ray> rays(kNumRays);
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        float x = -2.f + 4.f * (i % 37) / 36.f;
+        float y = -2.f + 4.f * (i % 29) / 28.f;
+        float z = (i & 1) ? 10.f : -10.f;
+        rays[i] = ray(float3(x, y, z), float3(0.f, 0.f, (i & 1) ? -1.f : 1.f));
+        rays[i].SetActive(i % 7 != 0);
+    }
+
+    // Hits of inactive rays should be left untouched
+    Intersection init;
+    init.shapeid = -2;
+    init.primid = -2;
+    std::vector<Intersection> hits(kNumRays, init);
+
+    Buffer* ray_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), &rays[0]));
+
+    std::vector<Intersection> results[2];
+    for (int reorder = 0; reorder < 2; ++reorder)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.reorder", (float)reorder));
+        ASSERT_NO_THROW(api_->Commit());
+
+        Buffer* isect_buffer = nullptr;
+        ASSERT_NO_THROW(isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), &hits[0]));
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, &e_));
+        Wait();
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        results[reorder].assign(tmp, tmp + kNumRays);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    }
+
+    int num_hits = 0;
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        ASSERT_EQ(results[0][i].shapeid, results[1][i].shapeid);
+        ASSERT_EQ(results[0][i].primid, results[1][i].primid);
+
+        if (i % 7 == 0)
+        {
+            ASSERT_EQ(results[1][i].shapeid, -2);
+        }
+        else if (results[1][i].shapeid != kNullId)
+        {
+            ASSERT_EQ(results[1][i].shapeid, mesh->GetId());
+            ASSERT_NEAR(results[0][i].uvwt.w, results[1][i].uvwt.w, 1e-5f);
+            ++num_hits;
+        }
+    }
+
+    ASSERT_GT(num_hits, 0);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+}
+
+TEST_F(ApiBackendOpenCL, Intersection_Batch)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // More queries than a single copy launch takes, so batches are split and dispatched when full
+    int const kNumQueries = 21;
+    std::vector<Buffer*> ray_buffers(kNumQueries);
+    std::vector<Buffer*> isect_buffers(kNumQueries);
+    std::vector<Buffer*> occl_buffers(kNumQueries);
+    std::vector<int> num_rays(kNumQueries);
+
+    // Hits of inactive rays should be left untouched
+    Intersection init;
+    init.shapeid = -2;
+    init.primid = -2;
+
+    for (int q = 0; q < kNumQueries; ++q)
+    {
+        num_rays[q] = 1 + q * 5;
+
+        // Every other ray misses the triangle
+        std::vector<ray> rays(num_rays[q]);
+        for (int i = 0; i < num_rays[q]; ++i)
+        {
+            rays[i] = ray(float3((i & 1) ? 5.f : 0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f));
+            rays[i].SetActive(i % 7 != 3);
+        }
+
+        std::vector<Intersection> hits(num_rays[q], init);
+        std::vector<int> occluded(num_rays[q], -2);
+        ASSERT_NO_THROW(ray_buffers[q] = api_->CreateBuffer(num_rays[q] * sizeof(ray), &rays[0]));
+        ASSERT_NO_THROW(isect_buffers[q] = api_->CreateBuffer(num_rays[q] * sizeof(Intersection), &hits[0]));
+        ASSERT_NO_THROW(occl_buffers[q] = api_->CreateBuffer(num_rays[q] * sizeof(int), &occluded[0]));
+    }
+
+    ASSERT_NO_THROW(api_->SetOption("acc.batch", 256.f));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Occlusion queries are waited on, closest hit ones are flushed by the first map
+    std::vector<Event*> events(kNumQueries, nullptr);
+    for (int q = 0; q < kNumQueries; ++q)
+    {
+        ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffers[q], num_rays[q], occl_buffers[q], nullptr, &events[q]));
+    }
+
+    for (int q = 0; q < kNumQueries; ++q)
+    {
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffers[q], num_rays[q], isect_buffers[q], nullptr, nullptr));
+    }
+
+    for (auto e : events)
+    {
+        e->Wait();
+        api_->DeleteEvent(e);
+    }
+
+    for (int q = 0; q < kNumQueries; ++q)
+    {
+        Intersection* isect = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffers[q], kMapRead, 0, num_rays[q] * sizeof(Intersection), (void**)&isect, &e_));
+        Wait();
+
+        int* occluded = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(occl_buffers[q], kMapRead, 0, num_rays[q] * sizeof(int), (void**)&occluded, &e_));
+        Wait();
+
+        for (int i = 0; i < num_rays[q]; ++i)
+        {
+            if (i % 7 == 3)
+            {
+                ASSERT_EQ(isect[i].shapeid, -2);
+                ASSERT_EQ(occluded[i], -2);
+            }
+            else if (i & 1)
+            {
+                ASSERT_EQ(isect[i].shapeid, kNullId);
+                ASSERT_EQ(occluded[i], kNullId);
+            }
+            else
+            {
+                ASSERT_EQ(isect[i].shapeid, mesh->GetId());
+                ASSERT_GT(occluded[i], 0);
+            }
+        }
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffers[q], isect, &e_));
+        Wait();
+        ASSERT_NO_THROW(api_->UnmapBuffer(occl_buffers[q], occluded, &e_));
+        Wait();
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("acc.batch", 0.f));
+
+    for (int q = 0; q < kNumQueries; ++q)
+    {
+        ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffers[q]));
+        ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffers[q]));
+        ASSERT_NO_THROW(api_->DeleteBuffer(occl_buffers[q]));
+    }
+
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+TEST_F(ApiBackendOpenCL, Intersection_HashBvh)
+{
+    // Grid of triangles deep enough to require backtracking
+    int const kGridSize = 32;
+    std::vector<float> gridvertices;
+    std::vector<int> gridindices;
+    for (int y = 0; y <= kGridSize; ++y)
+    {
+        for (int x = 0; x <= kGridSize; ++x)
+        {
+            gridvertices.push_back(-2.f + 4.f * x / kGridSize);
+            gridvertices.push_back(-2.f + 4.f * y / kGridSize);
+            // Bumps to make bounds of the neighbours overlap
+            gridvertices.push_back(((x + y) & 1) ? 0.1f : -0.1f);
+        }
+    }
+
+    for (int y = 0; y < kGridSize; ++y)
+    {
+        for (int x = 0; x < kGridSize; ++x)
+        {
+            int i0 = y * (kGridSize + 1) + x;
+            int i1 = i0 + 1;
+            int i2 = i0 + kGridSize + 1;
+            int i3 = i2 + 1;
+            int quad[] = { i0, i1, i3, i0, i3, i2 };
+            gridindices.insert(gridindices.end(), quad, quad + 6);
+        }
+    }
+
+    int numfaces = (int)gridindices.size() / 3;
+    std::vector<int> gridnumfaceverts(numfaces, 3);
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(&gridvertices[0], (int)gridvertices.size() / 3, 3 * sizeof(float), &gridindices[0], 0, &gridnumfaceverts[0], numfaces));
+    ASSERT_TRUE(mesh != nullptr);
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays from both sides of the grid, sloped to go through several triangles bounds
+    int const kNumRays = 4096;
+    std::vector<ray> rays(kNumRays);
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        float x = -2.5f + 5.f * (i % 64) / 63.f;
+        float y = -2.5f + 5.f * (i / 64) / 63.f;
+        float z = (i & 1) ? 10.f : -10.f;
+        rays[i] = ray(float3(x, y, z), normalize(float3(0.1f, -0.05f, (i & 1) ? -1.f : 1.f)));
+    }
+
+    Buffer* ray_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), &rays[0]));
+
+    char const* acctypes[] = { "bvh", "hashbvh" };
+    std::vector<Intersection> hits[2];
+    std::vector<int> occlusions[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.type", acctypes[i]));
+        ASSERT_NO_THROW(api_->Commit());
+
+        Buffer* isect_buffer = nullptr;
+        Buffer* occlusion_buffer = nullptr;
+        ASSERT_NO_THROW(isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr));
+        ASSERT_NO_THROW(occlusion_buffer = api_->CreateBuffer(kNumRays * sizeof(int), nullptr));
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, kNumRays, occlusion_buffer, nullptr, &e_));
+        Wait();
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        hits[i].assign(tmp, tmp + kNumRays);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        int* flags = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(occlusion_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&flags, &e_));
+        Wait();
+        occlusions[i].assign(flags, flags + kNumRays);
+        ASSERT_NO_THROW(api_->UnmapBuffer(occlusion_buffer, flags, &e_));
+        Wait();
+
+        ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+        ASSERT_NO_THROW(api_->DeleteBuffer(occlusion_buffer));
+    }
+
+    int num_hits = 0;
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        ASSERT_EQ(hits[0][i].shapeid, hits[1][i].shapeid);
+        ASSERT_EQ(hits[0][i].primid, hits[1][i].primid);
+        ASSERT_EQ(occlusions[0][i], occlusions[1][i]);
+
+        if (hits[1][i].shapeid != kNullId)
+        {
+            ASSERT_NEAR(hits[0][i].uvwt.w, hits[1][i].uvwt.w, 1e-5f);
+            ++num_hits;
+        }
+    }
+
+    ASSERT_GT(num_hits, 0);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+}
+
+// Test is checking if bit packed occlusion results match per ray ones for all accelerators
+TEST_F(ApiBackendOpenCL, Occlusion_Compact)
+{
+    // Grid of triangles deep enough to require backtracking
+    int const kGridSize = 32;
+    std::vector<float> gridvertices;
+    std::vector<int> gridindices;
+    for (int y = 0; y <= kGridSize; ++y)
+    {
+        for (int x = 0; x <= kGridSize; ++x)
+        {
+            gridvertices.push_back(-2.f + 4.f * x / kGridSize);
+            gridvertices.push_back(-2.f + 4.f * y / kGridSize);
+            // Bumps to make bounds of the neighbours overlap
+            gridvertices.push_back(((x + y) & 1) ? 0.1f : -0.1f);
+        }
+    }
+
+    for (int y = 0; y < kGridSize; ++y)
+    {
+        for (int x = 0; x < kGridSize; ++x)
+        {
+            int i0 = y * (kGridSize + 1) + x;
+            int i1 = i0 + 1;
+            int i2 = i0 + kGridSize + 1;
+            int i3 = i2 + 1;
+            int quad[] = { i0, i1, i3, i0, i3, i2 };
+            gridindices.insert(gridindices.end(), quad, quad + 6);
+        }
+    }
+
+    int numfaces = (int)gridindices.size() / 3;
+    std::vector<int> gridnumfaceverts(numfaces, 3);
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(&gridvertices[0], (int)gridvertices.size() / 3, 3 * sizeof(float), &gridindices[0], 0, &gridnumfaceverts[0], numfaces));
+    ASSERT_TRUE(mesh != nullptr);
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Ray count is not a multiple of 32 to check the last partial word,
+    // some rays are inactive and some are too short to reach the grid
+    int const kNumRays = 4000;
+    int const kNumWords = (kNumRays + 31) / 32;
+    std::vector<ray> rays(kNumRays);
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        float x = -2.5f + 5.f * (i % 64) / 63.f;
+        float y = -2.5f + 5.f * (i / 64) / 63.f;
+        float z = (i & 1) ? 10.f : -10.f;
+        rays[i] = ray(float3(x, y, z), normalize(float3(0.1f, -0.05f, (i & 1) ? -1.f : 1.f)));
+        rays[i].SetMaxT((i % 5) == 0 ? 5.f : 100.f);
+        rays[i].SetActive((i % 7) != 0);
+    }
+
+    Buffer* ray_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), &rays[0]));
+
+    char const* acctypes[] = { "bvh", "fatbvh", "fatbvh_q", "fatbvh_h", "bvh4", "hlbvh", "hashbvh" };
+    for (auto acctype : acctypes)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.type", acctype));
+
+        // Inactive rays keep the initial value
+        std::vector<int> occlusions(kNumRays, -1);
+        Buffer* occlusion_buffer = nullptr;
+        ASSERT_NO_THROW(occlusion_buffer = api_->CreateBuffer(kNumRays * sizeof(int), &occlusions[0]));
+        ASSERT_NO_THROW(api_->SetOption("acc.occlusion.compact", 0.f));
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, kNumRays, occlusion_buffer, nullptr, &e_));
+        Wait();
+
+        int* flags = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(occlusion_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&flags, &e_));
+        Wait();
+        occlusions.assign(flags, flags + kNumRays);
+        ASSERT_NO_THROW(api_->UnmapBuffer(occlusion_buffer, flags, &e_));
+        Wait();
+
+        // Fill with garbage to make sure every word is written
+        std::vector<std::uint32_t> words(kNumWords, 0xFFFFFFFFu);
+        Buffer* bits_buffer = nullptr;
+        ASSERT_NO_THROW(bits_buffer = api_->CreateBuffer(kNumWords * sizeof(std::uint32_t), &words[0]));
+        ASSERT_NO_THROW(api_->SetOption("acc.occlusion.compact", 1.f));
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, kNumRays, bits_buffer, nullptr, &e_));
+        Wait();
+
+        std::uint32_t* bits = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(bits_buffer, kMapRead, 0, kNumWords * sizeof(std::uint32_t), (void**)&bits, &e_));
+        Wait();
+        words.assign(bits, bits + kNumWords);
+        ASSERT_NO_THROW(api_->UnmapBuffer(bits_buffer, bits, &e_));
+        Wait();
+
+        int num_occluded = 0;
+        for (int i = 0; i < kNumRays; ++i)
+        {
+            bool occluded = ((words[i / 32] >> (i % 32)) & 1) != 0;
+            ASSERT_EQ(occlusions[i] > 0, occluded) << acctype << " ray " << i;
+            num_occluded += occluded ? 1 : 0;
+        }
+
+        // Bits past the last ray are zero
+        ASSERT_EQ(words[kNumWords - 1] >> (kNumRays % 32), 0u) << acctype;
+        ASSERT_GT(num_occluded, 0) << acctype;
+
+        ASSERT_NO_THROW(api_->DeleteBuffer(occlusion_buffer));
+        ASSERT_NO_THROW(api_->DeleteBuffer(bits_buffer));
+    }
+
+    ASSERT_NO_THROW(api_->SetOption("acc.occlusion.compact", 0.f));
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+}
+
+// Test is checking packed occlusion queries and host helpers iterating the result bits
+TEST_F(ApiBackendOpenCL, Occlusion_Packed)
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_TRUE(mesh != nullptr);
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Every third ray hits the triangle, the rest pass by
+    int const kNumRays = 100;
+    std::vector<ray> rays(kNumRays);
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        float x = (i % 3) == 0 ? 0.f : 5.f;
+        rays[i] = ray(float3(x, 0.f, -10.f), float3(0.f, 0.f, 1.f));
+    }
+
+    Buffer* ray_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), &rays[0]));
+
+    int const kNumWords = GetPackedOcclusionSize(kNumRays);
+    ASSERT_EQ(kNumWords, 4);
+
+    // Packed queries keep the user order even if rays are reordered
+    for (int reorder = 0; reorder < 2; ++reorder)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.reorder", (float)reorder));
+        ASSERT_NO_THROW(api_->Commit());
+
+        Buffer* bits_buffer = nullptr;
+        ASSERT_NO_THROW(bits_buffer = api_->CreateBuffer(kNumWords * sizeof(std::uint32_t), nullptr));
+        ASSERT_NO_THROW(api_->QueryOcclusionPacked(ray_buffer, kNumRays, bits_buffer, nullptr, &e_));
+        Wait();
+
+        std::uint32_t* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(bits_buffer, kMapRead, 0, kNumWords * sizeof(std::uint32_t), (void**)&tmp, &e_));
+        Wait();
+        std::vector<std::uint32_t> bits(tmp, tmp + kNumWords);
+        ASSERT_NO_THROW(api_->UnmapBuffer(bits_buffer, tmp, &e_));
+        Wait();
+
+        for (int i = 0; i < kNumRays; ++i)
+        {
+            ASSERT_EQ(IsOccluded(&bits[0], i), (i % 3) == 0);
+        }
+
+        std::vector<int> occluded;
+        ForEachOccluded(&bits[0], kNumRays, [&occluded](int index) { occluded.push_back(index); });
+        ASSERT_EQ(occluded.size(), 34u);
+        for (std::size_t i = 0; i < occluded.size(); ++i)
+        {
+            ASSERT_EQ(occluded[i], (int)i * 3);
+        }
+
+        std::vector<int> hits(kNumRays);
+        UnpackOcclusion(&bits[0], kNumRays, &hits[0]);
+        for (int i = 0; i < kNumRays; ++i)
+        {
+            ASSERT_EQ(hits[i], (i % 3) == 0 ? 1 : -1);
+        }
+
+        ASSERT_NO_THROW(api_->DeleteBuffer(bits_buffer));
+    }
+
+    ASSERT_NO_THROW(api_->SetOption("acc.reorder", 0.f));
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+}
+
+// Compact hit records should match full ones for every OpenCL intersector
+TEST_F(ApiBackendOpenCL, Intersection_CompactHits)
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_TRUE(mesh != nullptr);
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays scanning across the triangle, some of them miss
+    int const kNumRays = 64;
+    std::vector<ray> rays(kNumRays);
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        float x = -1.f + 2.f * (i % 8) / 7.f;
+        float y = -1.f + 2.f * (i / 8) / 7.f;
+        rays[i] = ray(float3(x, y, -10.f), float3(0.f, 0.f, 1.f));
+    }
+
+    Buffer* ray_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), &rays[0]));
+    Buffer* isect_buffer = nullptr;
+    ASSERT_NO_THROW(isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr));
+
+    char const* acctypes[] = { "bvh", "fatbvh", "fatbvh_q", "fatbvh_h", "bvh4", "hlbvh", "hashbvh" };
+
+    for (auto acctype : acctypes)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.type", acctype));
+        ASSERT_NO_THROW(api_->SetOption("acc.hit.format", "full"));
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, &e_));
+        Wait();
+
+        Intersection* full = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&full, &e_));
+        Wait();
+        std::vector<Intersection> reference(full, full + kNumRays);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, full, &e_));
+        Wait();
+
+        ASSERT_NO_THROW(api_->SetOption("acc.hit.format", "compact"));
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, &e_));
+        Wait();
+
+        PackedIntersection* compact = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(PackedIntersection), (void**)&compact, &e_));
+        Wait();
+        std::vector<PackedIntersection> packed(compact, compact + kNumRays);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, compact, &e_));
+        Wait();
+
+        for (int i = 0; i < kNumRays; ++i)
+        {
+            ASSERT_EQ(packed[i].shapeid, reference[i].shapeid);
+            ASSERT_EQ(packed[i].primid, reference[i].primid);
+
+            if (reference[i].shapeid != kNullId)
+            {
+                auto uv = GetPackedUv(packed[i]);
+                ASSERT_NEAR(packed[i].t, reference[i].uvwt.w, 1e-5f);
+                ASSERT_NEAR(uv.x, reference[i].uvwt.x, 1e-3f);
+                ASSERT_NEAR(uv.y, reference[i].uvwt.y, 1e-3f);
+            }
+        }
+    }
+
+    ASSERT_NO_THROW(api_->SetOption("acc.hit.format", "full"));
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Compact rays should give the same hits as full ones for every OpenCL intersector
+TEST_F(ApiBackendOpenCL, Intersection_CompactRays)
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_TRUE(mesh != nullptr);
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays scanning across the triangle, every fifth one is inactive and some are too short
+    int const kNumRays = 64;
+    std::vector<ray> rays(kNumRays);
+    std::vector<PackedRay> packed_rays(kNumRays);
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        float x = -1.f + 2.f * (i % 8) / 7.f;
+        float y = -1.f + 2.f * (i / 8) / 7.f;
+        float maxt = (i % 7) == 0 ? 5.f : 100.f;
+        rays[i] = ray(float3(x, y, -10.f), float3(0.f, 0.f, 1.f), maxt);
+        rays[i].SetActive((i % 5) != 0);
+        packed_rays[i] = PackRay(rays[i]);
+    }
+
+    Buffer* ray_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), &rays[0]));
+    Buffer* packed_ray_buffer = nullptr;
+    ASSERT_NO_THROW(packed_ray_buffer = api_->CreateBuffer(kNumRays * sizeof(PackedRay), &packed_rays[0]));
+    Buffer* isect_buffer = nullptr;
+    ASSERT_NO_THROW(isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr));
+
+    char const* acctypes[] = { "bvh", "fatbvh", "fatbvh_q", "fatbvh_h", "bvh4", "hlbvh", "hashbvh" };
+
+    for (auto acctype : acctypes)
+    {
+        std::vector<Intersection> results[2];
+
+        for (int compact = 0; compact < 2; ++compact)
+        {
+            ASSERT_NO_THROW(api_->SetOption("acc.type", acctype));
+            ASSERT_NO_THROW(api_->SetOption("acc.ray.format", compact ? "compact" : "full"));
+            ASSERT_NO_THROW(api_->Commit());
+            ASSERT_NO_THROW(api_->QueryIntersection(compact ? packed_ray_buffer : ray_buffer, kNumRays, isect_buffer, nullptr, &e_));
+            Wait();
+
+            Intersection* tmp = nullptr;
+            ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&tmp, &e_));
+            Wait();
+            results[compact].assign(tmp, tmp + kNumRays);
+            ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+            Wait();
+        }
+
+        for (int i = 0; i < kNumRays; ++i)
+        {
+            if (!rays[i].IsActive())
+            {
+                continue;
+            }
+
+            ASSERT_EQ(results[1][i].shapeid, results[0][i].shapeid);
+            ASSERT_EQ(results[1][i].primid, results[0][i].primid);
+            ASSERT_EQ(results[1][i].uvwt.w, results[0][i].uvwt.w);
+        }
+    }
+
+    ASSERT_NO_THROW(api_->SetOption("acc.ray.format", "full"));
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(packed_ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Treelet restructuring and SAH top tree change the HLBVH topology but not the hits
+TEST_F(ApiBackendOpenCL, Intersection_HlbvhTreeQuality)
+{
+    // Height field grid, 2 triangles per cell
+    int const kGridSize = 32;
+    std::vector<float> grid_vertices;
+    std::vector<int> grid_indices;
+    for (int y = 0; y <= kGridSize; ++y)
+    {
+        for (int x = 0; x <= kGridSize; ++x)
+        {
+            grid_vertices.push_back((float)x);
+            grid_vertices.push_back((float)y);
+            grid_vertices.push_back(0.1f * ((x * 7 + y * 13) % 5));
+        }
+    }
+
+    for (int y = 0; y < kGridSize; ++y)
+    {
+        for (int x = 0; x < kGridSize; ++x)
+        {
+            int v = y * (kGridSize + 1) + x;
+            int quad[] = { v, v + 1, v + kGridSize + 2, v, v + kGridSize + 2, v + kGridSize + 1 };
+            grid_indices.insert(grid_indices.end(), quad, quad + 6);
+        }
+    }
+
+    int num_faces = 2 * kGridSize * kGridSize;
+    std::vector<int> num_face_vertices(num_faces, 3);
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(&grid_vertices[0], (int)grid_vertices.size() / 3, 3 * sizeof(float), &grid_indices[0], 0, &num_face_vertices[0], num_faces));
+    ASSERT_TRUE(mesh != nullptr);
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // One ray per triangle
+    std::vector<ray> rays(num_faces);
+    for (int i = 0; i < num_faces; ++i)
+    {
+        int cell = i / 2;
+        float x = (cell % kGridSize) + ((i & 1) ? 0.25f : 0.75f);
+        float y = (cell / kGridSize) + ((i & 1) ? 0.75f : 0.25f);
+        rays[i] = ray(float3(x, y, -10.f), float3(0.f, 0.f, 1.f));
+    }
+
+    Buffer* ray_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(num_faces * sizeof(ray), &rays[0]));
+    Buffer* isect_buffer = nullptr;
+    ASSERT_NO_THROW(isect_buffer = api_->CreateBuffer(num_faces * sizeof(Intersection), nullptr));
+
+    // Plain LBVH first, then restructured, SAH top tree with few and many clusters,
+    // clustering with a wide radius and with a narrow one followed by restructuring,
+    // single pass emission alone, restructured and under SAH top tree
+    char const* acctypes[] = { "hlbvh", "hlbvh", "hlbvh_sah", "hlbvh_sah", "hlbvh_ploc", "hlbvh_ploc", "hlbvh", "hlbvh", "hlbvh_sah" };
+    float passes[] = { 0.f, 2.f, 0.f, 1.f, 0.f, 1.f, 0.f, 2.f, 1.f };
+    float top_bits[] = { 18.f, 18.f, 6.f, 18.f, 18.f, 18.f, 18.f, 18.f, 6.f };
+    float radius[] = { 16.f, 16.f, 16.f, 16.f, 16.f, 1.f, 16.f, 16.f, 16.f };
+    float single_pass[] = { 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 1.f, 1.f, 1.f };
+    int const kNumConfigs = sizeof(passes) / sizeof(float);
+
+    std::vector<Intersection> results[kNumConfigs];
+    for (int config = 0; config < kNumConfigs; ++config)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.type", acctypes[config]));
+        ASSERT_NO_THROW(api_->SetOption("hlbvh.restructure_passes", passes[config]));
+        ASSERT_NO_THROW(api_->SetOption("hlbvh.sah.top_bits", top_bits[config]));
+        ASSERT_NO_THROW(api_->SetOption("hlbvh.ploc.radius", radius[config]));
+        ASSERT_NO_THROW(api_->SetOption("hlbvh.single_pass", single_pass[config]));
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, num_faces, isect_buffer, nullptr, &e_));
+        Wait();
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, num_faces * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        results[config].assign(tmp, tmp + num_faces);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+    }
+
+    for (int config = 1; config < kNumConfigs; ++config)
+    {
+        for (int i = 0; i < num_faces; ++i)
+        {
+            ASSERT_EQ(results[0][i].shapeid, mesh->GetId());
+            ASSERT_EQ(results[config][i].shapeid, results[0][i].shapeid);
+            ASSERT_EQ(results[config][i].primid, results[0][i].primid);
+            ASSERT_EQ(results[config][i].uvwt.w, results[0][i].uvwt.w);
+        }
+    }
+
+    ASSERT_NO_THROW(api_->SetOption("hlbvh.restructure_passes", 0.f));
+    ASSERT_NO_THROW(api_->SetOption("hlbvh.single_pass", 0.f));
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Multi-hit query should return all the layers a ray pierces sorted by distance
+TEST_F(ApiBackendOpenCL, Intersection_MultiHit)
+{
+    // Three triangles stacked along z, attached out of order
+    float const depths[] = { 2.f, 0.f, 1.f };
+    std::vector<Shape*> meshes;
+    for (auto depth : depths)
+    {
+        Shape* mesh = nullptr;
+        ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+        ASSERT_TRUE(mesh != nullptr);
+        matrix m = translation(float3(0.f, 0.f, depth));
+        ASSERT_NO_THROW(mesh->SetTransform(m, inverse(m)));
+        ASSERT_NO_THROW(api_->AttachShape(mesh));
+        meshes.push_back(mesh);
+    }
+
+    // First ray pierces all the layers, second one is too short for the last layer, third one misses
+    ray rays[3];
+    rays[0] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f));
+    rays[1] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 11.5f);
+    rays[2] = ray(float3(5.f, 0.f, -10.f), float3(0.f, 0.f, 1.f));
+
+    int const kNumRays = 3;
+    int const kNumHits = 4;
+    Buffer* ray_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), rays));
+    Buffer* isect_buffer = nullptr;
+    ASSERT_NO_THROW(isect_buffer = api_->CreateBuffer(kNumRays * kNumHits * sizeof(Intersection), nullptr));
+
+    // Out of range hit counts are rejected
+    ASSERT_ANY_THROW(api_->QueryIntersectionMulti(ray_buffer, kNumRays, 0, isect_buffer, nullptr, nullptr));
+    ASSERT_ANY_THROW(api_->QueryIntersectionMulti(ray_buffer, kNumRays, kMaxMultiHits + 1, isect_buffer, nullptr, nullptr));
+
+    for (int twolevel = 0; twolevel < 2; ++twolevel)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.type", "fatbvh"));
+        ASSERT_NO_THROW(api_->SetOption("bvh.force2level", (float)twolevel));
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersectionMulti(ray_buffer, kNumRays, kNumHits, isect_buffer, nullptr, &e_));
+        Wait();
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * kNumHits * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        std::vector<Intersection> isects(tmp, tmp + kNumRays * kNumHits);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        // Hits are sorted by distance
+        ASSERT_EQ(isects[0].shapeid, meshes[1]->GetId());
+        ASSERT_EQ(isects[1].shapeid, meshes[2]->GetId());
+        ASSERT_EQ(isects[2].shapeid, meshes[0]->GetId());
+        ASSERT_EQ(isects[3].shapeid, kNullId);
+        ASSERT_NEAR(isects[0].uvwt.w, 10.f, 1e-5f);
+        ASSERT_NEAR(isects[1].uvwt.w, 11.f, 1e-5f);
+        ASSERT_NEAR(isects[2].uvwt.w, 12.f, 1e-5f);
+
+        ASSERT_EQ(isects[kNumHits].shapeid, meshes[1]->GetId());
+        ASSERT_EQ(isects[kNumHits + 1].shapeid, meshes[2]->GetId());
+        ASSERT_EQ(isects[kNumHits + 2].shapeid, kNullId);
+
+        for (int i = 0; i < kNumHits; ++i)
+        {
+            ASSERT_EQ(isects[2 * kNumHits + i].shapeid, kNullId);
+        }
+
+        // Single hit query gives the closest hit
+        ASSERT_NO_THROW(api_->QueryIntersectionMulti(ray_buffer, kNumRays, 1, isect_buffer, nullptr, &e_));
+        Wait();
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        ASSERT_EQ(tmp[0].shapeid, meshes[1]->GetId());
+        ASSERT_EQ(tmp[1].shapeid, meshes[1]->GetId());
+        ASSERT_EQ(tmp[2].shapeid, kNullId);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+    }
+
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 0.f));
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+
+    // Bail out
+    for (auto mesh : meshes)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(mesh));
+        ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    }
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+TEST_F(ApiBackendOpenCL, Intersection_Attributes)
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Position and vertex index as the two attributes of every vertex
+    float attributes[3 * 2 * 4] = {};
+    for (int i = 0; i < 3; ++i)
+    {
+        attributes[8 * i + 0] = vertices()[3 * i + 0];
+        attributes[8 * i + 1] = vertices()[3 * i + 1];
+        attributes[8 * i + 2] = vertices()[3 * i + 2];
+        attributes[8 * i + 3] = 1.f;
+        attributes[8 * i + 4] = (float)i;
+    }
+
+    ASSERT_ANY_THROW(mesh->SetVertexAttributes(attributes, kMaxVertexAttributes + 1));
+    ASSERT_NO_THROW(mesh->SetVertexAttributes(attributes, 2));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // First ray hits off the triangle center, second one misses
+    ray rays[2];
+    rays[0] = ray(float3(0.2f, -0.3f, -10.f), float3(0.f, 0.f, 1.f));
+    rays[1] = ray(float3(5.f, 0.f, -10.f), float3(0.f, 0.f, 1.f));
+
+    // One more attribute than the mesh has, it is zero filled
+    int const kNumRays = 2;
+    int const kNumAttributes = 3;
+    Buffer* ray_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), rays));
+    Buffer* isect_buffer = nullptr;
+    ASSERT_NO_THROW(isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr));
+    Buffer* attribute_buffer = nullptr;
+    ASSERT_NO_THROW(attribute_buffer = api_->CreateBuffer(kNumRays * kNumAttributes * sizeof(float4), nullptr));
+
+    // Out of range attribute counts are rejected
+    ASSERT_ANY_THROW(api_->QueryIntersectionAttributes(ray_buffer, kNumRays, 0, isect_buffer, attribute_buffer, nullptr, nullptr));
+    ASSERT_ANY_THROW(api_->QueryIntersectionAttributes(ray_buffer, kNumRays, kMaxVertexAttributes + 1, isect_buffer, attribute_buffer, nullptr, nullptr));
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        ASSERT_NO_THROW(api_->QueryIntersectionAttributes(ray_buffer, kNumRays, kNumAttributes, isect_buffer, attribute_buffer, nullptr, &e_));
+        Wait();
+
+        Intersection* isects = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isects, &e_));
+        Wait();
+        float4 hit_uvwt = isects[0].uvwt;
+        ASSERT_EQ(isects[0].shapeid, mesh->GetId());
+        ASSERT_EQ(isects[1].shapeid, kNullId);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isects, &e_));
+        Wait();
+
+        float4* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(attribute_buffer, kMapRead, 0, kNumRays * kNumAttributes * sizeof(float4), (void**)&tmp, &e_));
+        Wait();
+        std::vector<float4> values(tmp, tmp + kNumRays * kNumAttributes);
+        ASSERT_NO_THROW(api_->UnmapBuffer(attribute_buffer, tmp, &e_));
+        Wait();
+
+        // Interpolated position is the hit point, the index is weighted by the barycentrics
+        float const scale = pass == 0 ? 1.f : 2.f;
+        ASSERT_NEAR(values[0].x, 0.2f * scale, 1e-5f);
+        ASSERT_NEAR(values[0].y, -0.3f * scale, 1e-5f);
+        ASSERT_NEAR(values[0].z, 0.f, 1e-5f);
+        ASSERT_NEAR(values[0].w, scale, 1e-5f);
+        ASSERT_NEAR(values[1].x, (hit_uvwt.x + 2.f * hit_uvwt.y) * scale, 1e-5f);
+        ASSERT_EQ(values[2].x, 0.f);
+        ASSERT_EQ(values[2].w, 0.f);
+
+        for (int i = 0; i < kNumAttributes; ++i)
+        {
+            ASSERT_EQ(values[kNumAttributes + i].x, 0.f);
+            ASSERT_EQ(values[kNumAttributes + i].w, 0.f);
+        }
+
+        // Changing attributes alone is picked up by the next commit
+        for (auto& value : attributes)
+        {
+            value *= 2.f;
+        }
+        ASSERT_NO_THROW(mesh->SetVertexAttributes(attributes, 2));
+        ASSERT_NO_THROW(api_->Commit());
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(attribute_buffer));
+}
+
+TEST_F(ApiBackendOpenCL, Intersection_VebLayout)
+{
+    // Grid of triangles, enough for the van Emde Boas order to differ from breadth first
+    int const kGridSize = 8;
+    std::vector<Shape*> meshes;
+    for (int y = 0; y < kGridSize; ++y)
+    {
+        for (int x = 0; x < kGridSize; ++x)
+        {
+            Shape* mesh = nullptr;
+            ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+            matrix m = translation(float3(3.f * x, 3.f * y, (float)((x + y) % 3)));
+            ASSERT_NO_THROW(mesh->SetTransform(m, inverse(m)));
+            ASSERT_NO_THROW(api_->AttachShape(mesh));
+            meshes.push_back(mesh);
+        }
+    }
+
+    // One ray through each triangle and one between them
+    int const kNumRays = 2 * kGridSize * kGridSize;
+    std::vector<ray> rays(kNumRays);
+    for (int i = 0; i < kGridSize * kGridSize; ++i)
+    {
+        float3 center(3.f * (i % kGridSize), 3.f * (i / kGridSize), -10.f);
+        rays[2 * i] = ray(center, float3(0.f, 0.f, 1.f));
+        rays[2 * i + 1] = ray(center + float3(1.5f, 1.5f, 0.f), float3(0.f, 0.f, 1.f));
+    }
+
+    Buffer* ray_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), rays.data()));
+    Buffer* isect_buffer = nullptr;
+    ASSERT_NO_THROW(isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr));
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "fatbvh"));
+
+    char const* layouts[] = { "bfs", "veb" };
+    for (auto layout : layouts)
+    {
+        ASSERT_NO_THROW(api_->SetOption("bvh.layout", layout));
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, &e_));
+        Wait();
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+
+        for (int i = 0; i < kGridSize * kGridSize; ++i)
+        {
+            ASSERT_EQ(tmp[2 * i].shapeid, meshes[i]->GetId()) << layout;
+            ASSERT_NEAR(tmp[2 * i].uvwt.w, 10.f + (float)((i % kGridSize + i / kGridSize) % 3), 1e-5f) << layout;
+            ASSERT_EQ(tmp[2 * i + 1].shapeid, kNullId) << layout;
+        }
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+    }
+
+    ASSERT_NO_THROW(api_->SetOption("bvh.layout", "bfs"));
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+
+    // Bail out
+    for (auto mesh : meshes)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(mesh));
+        ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    }
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking if mesh transform is working as expected
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_Transformed)
+{
+
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r;
+    r.o = float4(0.f,0.f,-10.f, 1000.f);
+    r.d = float3(0.f,0.f,1.f);
+
+    // Intersection and hit data
+    Intersection isect;
+    
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+    
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+    
+    // Check results
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+
+    matrix m = translation(float3(0,2,0));
+    matrix minv = inverse(m);
+    // Move the mesh
+    ASSERT_NO_THROW(mesh->SetTransform(m, minv));
+    // Reset ray
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+    
+    tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+    
+    // Check results
+    ASSERT_EQ(isect.shapeid, -1);
+
+    // Set transform to identity
+    m = matrix();
+    ASSERT_NO_THROW(mesh->SetTransform(m, m));
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+    
+    tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+    
+    // Check results
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks HLBVH device build is refreshed after a shape is moved
+TEST_F(ApiBackendOpenCL, Intersection_Hlbvh_Transformed)
+{
+    Shape* mesh = nullptr;
+
+    api_->SetOption("acc.type", "hlbvh");
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays hitting the original and the moved mesh
+    ray r[2];
+    r[0].o = float4(0.f, 0.f, -10.f, 1000.f);
+    r[0].d = float3(0.f, 0.f, 1.f);
+    r[1].o = float4(0.f, 2.f, -10.f, 1000.f);
+    r[1].d = float3(0.f, 0.f, 1.f);
+
+    Intersection isect[2];
+
+    auto ray_buffer = api_->CreateBuffer(2 * sizeof(ray), r);
+    auto isect_buffer = api_->CreateBuffer(2 * sizeof(Intersection), nullptr);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        // Commit geometry update
+        ASSERT_NO_THROW(api_->Commit());
+
+        // Intersect
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 2 * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        isect[0] = tmp[0];
+        isect[1] = tmp[1];
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        // Check results, only the ray at the current mesh position hits it
+        ASSERT_EQ(isect[i].shapeid, mesh->GetId());
+        ASSERT_EQ(isect[1 - i].shapeid, kNullId);
+
+        // Move the mesh
+        matrix m = translation(float3(0, 2, 0));
+        ASSERT_NO_THROW(mesh->SetTransform(m, inverse(m)));
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks intersection after geometry addition
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_DynamicGeo)
+{
+    // Mesh vertices
+    float vertices[] = {
+        -1.f,-1.f,0.f,
+        1.f,-1.f,0.f,
+        0.f,1.f,0.f,
+        
+    };
+    
+    float vertices1[] = {
+        -1.f,-1.f,-1.f,
+        1.f,-1.f,-1.f,
+        0.f,1.f,-1.f,
+        
+    };
+
+    Shape* closemesh = nullptr;
+    Shape* farmesh = nullptr;
+
+    // Create two meshes
+    ASSERT_NO_THROW(farmesh = api_->CreateMesh(vertices, 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(closemesh = api_->CreateMesh(vertices1, 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(farmesh != nullptr);
+    ASSERT_TRUE(closemesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(farmesh));
+
+    // Prepare the ray
+    ray r;
+    r.o = float4(0.f,0.f,-10.f, 1000.f);
+    r.d = float3(0.f,0.f,1.f);
+
+
+    // Intersection and hit data
+    Intersection isect;
+    
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+    
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+    
+    // Check results
+    ASSERT_EQ(isect.shapeid, farmesh->GetId());
+
+    // Attach closer mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(closemesh));
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+    
+    tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+    
+    // Check results
+    ASSERT_EQ(isect.shapeid, closemesh->GetId());
+
+    // Attach closer mesh to the scene
+    ASSERT_NO_THROW(api_->DetachShape(closemesh));
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+    
+    tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+    
+    // Check results
+    ASSERT_EQ(isect.shapeid, farmesh->GetId());
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(farmesh));
+    ASSERT_NO_THROW(api_->DeleteShape(farmesh));
+    ASSERT_NO_THROW(api_->DeleteShape(closemesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking that dropping host copies after the upload still allows geometry updates
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_NoHostCopies)
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_TRUE(mesh != nullptr);
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    ray r;
+    r.o = float4(0.f, 0.f, -10.f, 1000.f);
+    r.d = float3(0.f, 0.f, 1.f);
+
+    Buffer* ray_buffer = nullptr;
+    Buffer* isect_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(sizeof(ray), &r));
+    ASSERT_NO_THROW(isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr));
+
+    ASSERT_NO_THROW(api_->SetOption("mem.keep_host_copies", 0.f));
+
+    char const* acctypes[] = { "bvh", "fatbvh", "bvh4" };
+    for (int twolevel = 0; twolevel < 2; ++twolevel)
+    {
+        ASSERT_NO_THROW(api_->SetOption("bvh.force2level", (float)twolevel));
+
+        for (auto acctype : acctypes)
+        {
+            ASSERT_NO_THROW(api_->SetOption("acc.type", acctype));
+
+            // Moving the mesh away and back makes the intersector rebuild from the world
+            for (int pass = 0; pass < 3; ++pass)
+            {
+                matrix m = translation(float3(pass == 1 ? 5.f : 0.f, 0.f, 0.f));
+                ASSERT_NO_THROW(mesh->SetTransform(m, inverse(m)));
+                ASSERT_NO_THROW(api_->Commit());
+                ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, &e_));
+                Wait();
+
+                Intersection* tmp = nullptr;
+                ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+                Wait();
+                Intersection isect = *tmp;
+                ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+                Wait();
+
+                ASSERT_EQ(isect.shapeid, pass == 1 ? kNullId : mesh->GetId()) << acctype << " twolevel " << twolevel << " pass " << pass;
+            }
+        }
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("mem.keep_host_copies", 1.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 0.f));
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "fatbvh"));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking that build temporaries come from the allocator set and are all returned to it
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_CustomAllocator)
+{
+    struct AllocStats
+    {
+        std::atomic<int> num_allocs;
+        std::atomic<int> num_frees;
+    };
+
+    AllocStats stats;
+    stats.num_allocs = 0;
+    stats.num_frees = 0;
+
+    auto alloc = [](std::size_t size, std::size_t alignment, void* userdata) -> void*
+    {
+        static_cast<AllocStats*>(userdata)->num_allocs++;
+        return alignment <= alignof(std::max_align_t) ? std::malloc(size) : nullptr;
+    };
+
+    auto release = [](void* ptr, void* userdata)
+    {
+        static_cast<AllocStats*>(userdata)->num_frees++;
+        std::free(ptr);
+    };
+
+    // The allocator is set before the API is created
+    ASSERT_NO_THROW(IntersectionApi::SetAllocator(alloc, release, &stats));
+
+    IntersectionApi* api = nullptr;
+    ASSERT_NO_THROW(api = IntersectionApi::Create(nativeidx_));
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api->AttachShape(mesh));
+
+    ray r;
+    r.o = float4(0.f, 0.f, -10.f, 1000.f);
+    r.d = float3(0.f, 0.f, 1.f);
+
+    Buffer* ray_buffer = nullptr;
+    Buffer* isect_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api->CreateBuffer(sizeof(ray), &r));
+    ASSERT_NO_THROW(isect_buffer = api->CreateBuffer(sizeof(Intersection), nullptr));
+
+    char const* acctypes[] = { "bvh", "fatbvh", "bvh4" };
+    for (auto acctype : acctypes)
+    {
+        ASSERT_NO_THROW(api->SetOption("acc.type", acctype));
+        ASSERT_NO_THROW(api->Commit());
+
+        Event* e = nullptr;
+        ASSERT_NO_THROW(api->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, &e));
+        e->Wait();
+        api->DeleteEvent(e);
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e));
+        e->Wait();
+        api->DeleteEvent(e);
+        Intersection isect = *tmp;
+        ASSERT_NO_THROW(api->UnmapBuffer(isect_buffer, tmp, &e));
+        e->Wait();
+        api->DeleteEvent(e);
+
+        ASSERT_EQ(isect.shapeid, mesh->GetId()) << acctype;
+    }
+
+    ASSERT_NO_THROW(api->DetachShape(mesh));
+    ASSERT_NO_THROW(api->DeleteShape(mesh));
+    ASSERT_NO_THROW(api->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api->DeleteBuffer(isect_buffer));
+    IntersectionApi::Delete(api);
+
+    // Bail out
+    ASSERT_NO_THROW(IntersectionApi::SetAllocator(nullptr, nullptr, nullptr));
+
+    ASSERT_GT(stats.num_allocs, 0);
+    ASSERT_EQ(stats.num_allocs, stats.num_frees);
+}
+
+// The test checks builds are correct on a single low priority thread
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_ThreadLimits)
+{
+    ASSERT_ANY_THROW(IntersectionApi::SetThreadLimits(-1, 0, false));
+
+    // The limits are set before the API is created
+    ASSERT_NO_THROW(IntersectionApi::SetThreadLimits(1, 1, true));
+
+    IntersectionApi* api = nullptr;
+    ASSERT_NO_THROW(api = IntersectionApi::Create(nativeidx_));
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api->AttachShape(mesh));
+
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    Buffer* ray_buffer = nullptr;
+    Buffer* isect_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api->CreateBuffer(sizeof(ray), &r));
+    ASSERT_NO_THROW(isect_buffer = api->CreateBuffer(sizeof(Intersection), nullptr));
+
+    Event* e = nullptr;
+    ASSERT_NO_THROW(api->CommitAsync(&e));
+    e->Wait();
+    api->DeleteEvent(e);
+
+    ASSERT_NO_THROW(api->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, &e));
+    e->Wait();
+    api->DeleteEvent(e);
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e));
+    e->Wait();
+    api->DeleteEvent(e);
+    Intersection isect = *tmp;
+    ASSERT_NO_THROW(api->UnmapBuffer(isect_buffer, tmp, &e));
+    e->Wait();
+    api->DeleteEvent(e);
+
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+
+    ASSERT_NO_THROW(api->DetachShape(mesh));
+    ASSERT_NO_THROW(api->DeleteShape(mesh));
+    ASSERT_NO_THROW(api->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api->DeleteBuffer(isect_buffer));
+    IntersectionApi::Delete(api);
+
+    // Bail out
+    ASSERT_NO_THROW(IntersectionApi::SetThreadLimits(0, 0, false));
+}
+
+// The test checks parallel builds produce the same tree as a single threaded one
+TEST_F(ApiBackendOpenCL, AccelStats_ThreadLimitsDeterminism)
+{
+    // Large enough for nodes to be binned and partitioned by several jobs
+    SceneGenerator::MeshData sphere = SceneGenerator::GenerateSphere(float3(0.f, 0.f, 0.f), 1.f, 256, 512);
+
+    int const kNumRays = 256;
+    std::vector<ray> r(kNumRays * kNumRays);
+    for (int i = 0; i < kNumRays * kNumRays; ++i)
+    {
+        float x = -1.5f + 3.f * (i % kNumRays) / kNumRays;
+        float y = -1.5f + 3.f * (i / kNumRays) / kNumRays;
+        r[i] = ray(float3(x, y, -10.f), float3(0.01f * (i % 7), 0.f, 1.f), 10000.f);
+    }
+
+    auto build = [&](int numthreads, float use_splits, AccelStats& stats, std::vector<Intersection>& hits)
+    {
+        ASSERT_NO_THROW(IntersectionApi::SetThreadLimits(numthreads, 0, false));
+
+        IntersectionApi* api = nullptr;
+        ASSERT_NO_THROW(api = IntersectionApi::Create(nativeidx_));
+
+        Shape* mesh = nullptr;
+        ASSERT_NO_THROW(mesh = SceneGenerator::CreateMesh(api, sphere));
+        ASSERT_NO_THROW(api->AttachShape(mesh));
+
+        ASSERT_NO_THROW(api->SetOption("acc.type", "bvh"));
+        ASSERT_NO_THROW(api->SetOption("bvh.builder", "sah"));
+        ASSERT_NO_THROW(api->SetOption("bvh.sah.use_splits", use_splits));
+        // Keep the spatial split budget tight to check it is shared the same way
+        ASSERT_NO_THROW(api->SetOption("bvh.sah.extra_node_budget", 0.002f));
+        ASSERT_NO_THROW(api->Commit());
+        ASSERT_NO_THROW(api->GetStats(stats));
+
+        Buffer* ray_buffer = nullptr;
+        Buffer* isect_buffer = nullptr;
+        ASSERT_NO_THROW(ray_buffer = api->CreateBuffer(r.size() * sizeof(ray), &r[0]));
+        ASSERT_NO_THROW(isect_buffer = api->CreateBuffer(r.size() * sizeof(Intersection), nullptr));
+
+        Event* e = nullptr;
+        ASSERT_NO_THROW(api->QueryIntersection(ray_buffer, (int)r.size(), isect_buffer, nullptr, &e));
+        e->Wait();
+        api->DeleteEvent(e);
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api->MapBuffer(isect_buffer, kMapRead, 0, r.size() * sizeof(Intersection), (void**)&tmp, &e));
+        e->Wait();
+        api->DeleteEvent(e);
+        hits.assign(tmp, tmp + r.size());
+        ASSERT_NO_THROW(api->UnmapBuffer(isect_buffer, tmp, &e));
+        e->Wait();
+        api->DeleteEvent(e);
+
+        ASSERT_NO_THROW(api->DetachShape(mesh));
+        ASSERT_NO_THROW(api->DeleteShape(mesh));
+        ASSERT_NO_THROW(api->DeleteBuffer(ray_buffer));
+        ASSERT_NO_THROW(api->DeleteBuffer(isect_buffer));
+        IntersectionApi::Delete(api);
+    };
+
+    for (int use_splits = 0; use_splits < 2; ++use_splits)
+    {
+        AccelStats serial, parallel;
+        std::vector<Intersection> serialhits, parallelhits;
+        build(1, (float)use_splits, serial, serialhits);
+        build(8, (float)use_splits, parallel, parallelhits);
+
+        ASSERT_EQ(serial.num_nodes, parallel.num_nodes);
+        ASSERT_EQ(serial.num_leaves, parallel.num_leaves);
+        ASSERT_EQ(serial.num_refs, parallel.num_refs);
+        ASSERT_EQ(serial.max_depth, parallel.max_depth);
+        ASSERT_EQ(serial.sah_cost, parallel.sah_cost);
+
+        // Leaves hold the same primitives, so every ray reports the same hit
+        ASSERT_EQ(serialhits.size(), parallelhits.size());
+        for (size_t i = 0; i < serialhits.size(); ++i)
+        {
+            ASSERT_EQ(serialhits[i].primid, parallelhits[i].primid);
+
+            if (serialhits[i].primid != kNullId)
+            {
+                ASSERT_EQ(serialhits[i].uvwt.w, parallelhits[i].uvwt.w);
+            }
+        }
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(IntersectionApi::SetThreadLimits(0, 0, false));
+}
+
+TEST_F(ApiBackendOpenCL, CornellBoxLoad)
+{
+    using namespace tinyobj;
+    std::vector<shape_t> shapes;
+    std::vector<material_t> materials;
+    std::vector<Shape*> apishapes;
+
+    // Load obj file 
+    std::string res = LoadObj(shapes, materials, "../Resources/CornellBox/orig.objm");
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "grid"));
+
+    // Create meshes within IntersectionApi
+    for  (int i=0; i<(int)shapes.size(); ++i)
+    {
+        Shape* shape = nullptr;
+        ASSERT_NO_THROW(shape = api_->CreateMesh(&shapes[i].mesh.positions[0], (int)shapes[i].mesh.positions.size() / 3, 3*sizeof(float),
+            &shapes[i].mesh.indices[0], 0, nullptr, (int)shapes[i].mesh.indices.size() / 3));
+
+        ASSERT_NO_THROW(api_->AttachShape(shape));
+        apishapes.push_back(shape);
+    }
+
+    // Commit update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Delete meshes
+    for (int i=0; i<(int)apishapes.size(); ++i)
+    {
+        ASSERT_NO_THROW(api_->DeleteShape(apishapes[i]));
+    }
+}
+
+TEST_F(ApiBackendOpenCL, CornellBox_1Ray)
+{
+    using namespace tinyobj;
+    std::vector<shape_t> shapes;
+    std::vector<material_t> materials;
+    std::vector<Shape*> apishapes;
+
+    // Load obj file 
+    std::string res = LoadObj(shapes, materials, "../Resources/CornellBox/orig.objm");
+
+    //ASSERT_NO_THROW(api_->SetOption("acc.type", "grid"));
+
+    // Create meshes within IntersectionApi
+    for (int i = 0; i<(int)shapes.size(); ++i)
+    {
+        Shape* shape = nullptr;
+        ASSERT_NO_THROW(shape = api_->CreateMesh(&shapes[i].mesh.positions[0], (int)shapes[i].mesh.positions.size() / 3, 3 * sizeof(float),
+            &shapes[i].mesh.indices[0], 0, nullptr, (int)shapes[i].mesh.indices.size() / 3));
+
+        ASSERT_NO_THROW(api_->AttachShape(shape));
+        apishapes.push_back(shape);
+    }
+
+    // Prepare the ray
+    ray r;
+    r.o = float4(0.f, 0.5f, -10.f, 1000.f);
+    r.d = float3(0.f, 0.f, 1.f);
+
+
+    // Intersection and hit data
+    Intersection isect;
+    
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+    
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+
+    // Delete meshes
+    for (int i = 0; i<(int)apishapes.size(); ++i)
+    {
+        ASSERT_NO_THROW(api_->DeleteShape(apishapes[i]));
+    }
+
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+
+// Test is checking if mesh transform is working as expected
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_TransformedInstance1)
+{
+    // this test uses a single mesh, it added into the world as itself
+    // at <0,-1,1000> AND as an instance at <0,0,2>
+    // ray from <0,0,-10> along the pos z should hit the uninstanced mesh
+
+    std::vector<TestShape> shapes = { TestShape(vertices(), 3, indices(), 3, numfaceverts(), 1),
+                            TestShape(vertices(), 3, indices(), 3, numfaceverts(), 1), 
+                            TestShape(vertices(), 3, indices(), 3, numfaceverts(), 1)};
+    TestShape& mesh0 = shapes[0];
+    TestShape& mesh1 = shapes[1];
+    TestShape& instance = shapes[2];
+
+    // Create meshes
+    // NOTE mesh in world and as a instance upsets the simple TestIntersection API call 
+    ASSERT_NO_THROW(mesh0.shape = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_TRUE(mesh0.shape != nullptr);
+    ASSERT_NO_THROW(mesh1.shape = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_TRUE(mesh1.shape != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh0.shape));
+    // Create instance of a triangle
+    ASSERT_NO_THROW(instance.shape = api_->CreateInstance(mesh1.shape));
+
+    matrix m = translation(float3(0, 0, 2));
+    const matrix minv = inverse(m);
+    ASSERT_NO_THROW(instance.shape->SetTransform(m, minv));
+
+    ASSERT_NO_THROW(api_->AttachShape(instance.shape));
+
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    // Intersection and hit data
+    Intersection isect;
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results for 1st ray
+    Intersection isect_brute;
+    TestIntersections(shapes.data(), (int)shapes.size(), &r, 1, &isect_brute);
+    // check the test gets the mesh we expect
+    EXPECT_EQ(isect_brute.shapeid, mesh0.shape->GetId());
+    // does the accelerated radeon rays match the test
+    EXPECT_EQ(isect.shapeid, isect_brute.shapeid);
+    EXPECT_LE(std::fabs(isect.uvwt.w - 10.f), 0.01f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(instance.shape));
+    ASSERT_NO_THROW(api_->DetachShape(mesh0.shape));
+    ASSERT_NO_THROW(api_->DetachShape(mesh1.shape));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+
+}
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_TransformedInstance2)
+{
+    // this test uses a single mesh, it added into the world as itself
+    // at <0,-1,1000> AND as an instance at <0,0,-2>
+    // ray from <0,0,-10> along the pos z should hit the instanced mesh
+
+    std::vector<TestShape> shapes = { TestShape(vertices(), 3, indices(), 3, numfaceverts(), 1),
+        TestShape(vertices(), 3, indices(), 3, numfaceverts(), 1),
+        TestShape(vertices(), 3, indices(), 3, numfaceverts(), 1) };
+    TestShape& mesh0 = shapes[0];
+    TestShape& mesh1 = shapes[1];
+    TestShape& instance = shapes[2];
+
+    // Create meshes
+    // NOTE mesh in world and as a instance upsets the simple TestIntersection API call 
+    ASSERT_NO_THROW(mesh0.shape = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_TRUE(mesh0.shape != nullptr);
+    ASSERT_NO_THROW(mesh1.shape = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_TRUE(mesh1.shape != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh0.shape));
+    // Create instance of a triangle
+    ASSERT_NO_THROW(instance.shape = api_->CreateInstance(mesh1.shape));
+
+    //
+    const matrix m = translation(float3(0, 0, -2));
+    const matrix minv = inverse(m);
+    ASSERT_NO_THROW(instance.shape->SetTransform(m, minv));
+
+    // Prepare the ray
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+
+    // Commit geometry update
+    EXPECT_NO_THROW(api_->Commit());
+
+    ASSERT_NO_THROW(api_->AttachShape(instance.shape));
+
+    // Intersection and hit data
+    Intersection isect;
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results for 1st ray
+    Intersection isect_brute;
+    TestIntersections(shapes.data(), (int)shapes.size(), &r, 1, &isect_brute);
+    // check the test gets the mesh we expect
+    EXPECT_EQ(isect_brute.shapeid, instance.shape->GetId());
+    // does the accelerated radeon rays match the test
+    EXPECT_EQ(isect.shapeid, isect_brute.shapeid);
+    EXPECT_LE(std::fabs(isect.uvwt.w - 8.f), 0.01f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(instance.shape));
+    ASSERT_NO_THROW(api_->DetachShape(mesh0.shape));
+    ASSERT_NO_THROW(api_->DetachShape(mesh1.shape));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_TransformedInstanceFlat)
+{
+
+    // Set flattening
+    api_->SetOption("bvh.forceflat", 1.f);
+    
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r;
+    r.o = float3(0.f,0.f,-10.f, 1000.f);
+    r.d = float3(0.f,0.f,1.f);
+
+    // Intersection and hit data
+    Intersection isect;
+    
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+    
+    // Create instance of a triangle
+    Shape* instance = nullptr;
+    ASSERT_NO_THROW(instance = api_->CreateInstance(mesh));
+    
+    matrix m = translation(float3(0,0,-2));
+    matrix minv = inverse(m);
+    ASSERT_NO_THROW(instance->SetTransform(m, minv));
+    
+    ASSERT_NO_THROW(api_->AttachShape(instance));
+    
+    // Prepare the ray
+    r.o = float3(0.f,0.f,-10.f, 1000.f);
+    r.d = float3(0.f,0.f,1.f);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+    
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+    
+    // Check results
+    ASSERT_EQ(isect.shapeid, instance->GetId());
+    ASSERT_LE(std::fabs(isect.uvwt.w - 8.f), 0.01f);
+    
+    //
+    m = translation(float3(0,0,2));
+    minv = inverse(m);
+    ASSERT_NO_THROW(instance->SetTransform(m, minv));
+
+    // Prepare the ray
+    r.o = float3(0.f,0.f,-10.f, 1000.f);
+    r.d = float3(0.f,0.f,1.f);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+    
+    tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+    ASSERT_LE(std::fabs(isect.uvwt.w - 10.f), 0.01f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(instance));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+// Test is checking if mesh transform is working as expected
+// DK: #22 repro case : Commit throws if base shape has not been attached
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_InstanceNoShape)
+{
+
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    //ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r;
+    r.o = float3(0.f, 0.f, -10.f, 1000.f);
+    r.d = float3(0.f, 0.f, 1.f);
 
     // Intersection and hit data
     Intersection isect;
 
-    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
-    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Create instance of a triangle
+    Shape* instance = nullptr;
+    ASSERT_NO_THROW(instance = api_->CreateInstance(mesh));
+
+    matrix m = translation(float3(0, 0, 2));
+    matrix minv = inverse(m);
+    ASSERT_NO_THROW(instance->SetTransform(m, minv));
+
+    ASSERT_NO_THROW(api_->AttachShape(instance));
+
+    // Prepare the ray
+    r.o = float3(0.f, 0.f, -10.f, 1000.f);
+    r.d = float3(0.f, 0.f, 1.f);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect.shapeid, instance->GetId());
+    ASSERT_LE(std::fabs(isect.uvwt.w - 12.f), 0.01f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(instance));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test instances a group of two triangle instances twice
+TEST_F(ApiBackendOpenCL, Intersection_4Rays_NestedInstances)
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    // The group holds the triangle at the origin and moved by 3 along x
+    Shape* inner[2] = { nullptr, nullptr };
+    ASSERT_NO_THROW(inner[0] = api_->CreateInstance(mesh));
+    ASSERT_NO_THROW(inner[1] = api_->CreateInstance(mesh));
 
+    matrix m = translation(float3(3.f, 0.f, 0.f));
+    ASSERT_NO_THROW(inner[1]->SetTransform(m, inverse(m)));
+
+    Shape* group = nullptr;
+    ASSERT_NO_THROW(group = api_->CreateGroup(inner, 2));
+
+    // Groups are only visible through instances
+    ASSERT_THROW(api_->AttachShape(group), Exception);
+
+    Shape* outer[2] = { nullptr, nullptr };
+    ASSERT_NO_THROW(outer[0] = api_->CreateInstance(group));
+    ASSERT_NO_THROW(outer[1] = api_->CreateInstance(group));
+
+    // The second copy of the group is moved down by 5 and away by 2
+    m = translation(float3(0.f, -5.f, 2.f));
+    ASSERT_NO_THROW(outer[1]->SetTransform(m, inverse(m)));
+
+    ASSERT_NO_THROW(api_->AttachShape(outer[0]));
+    ASSERT_NO_THROW(api_->AttachShape(outer[1]));
+
+    // Prepare the rays
+    ray r[4];
+    r[0] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    r[1] = ray(float3(3.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    r[2] = ray(float3(0.f, -5.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    r[3] = ray(float3(3.f, -5.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(4 * sizeof(ray), r);
+    auto isect_buffer = api_->CreateBuffer(4 * sizeof(Intersection), nullptr);
 
     // Commit geometry update
     ASSERT_NO_THROW(api_->Commit());
 
     // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 4, isect_buffer, nullptr, nullptr));
 
     Intersection* tmp = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 4 * sizeof(Intersection), (void**)&tmp, &e_));
     Wait();
-    isect = *tmp;
+    Intersection isect[4] = { tmp[0], tmp[1], tmp[2], tmp[3] };
     ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
     Wait();
 
-    // Check results for 1st ray
-    Intersection isect_brute;
-    TestIntersections(shapes.data(), (int)shapes.size(), &r, 1, &isect_brute);
-    // check the test gets the mesh we expect
-    EXPECT_EQ(isect_brute.shapeid, mesh0.shape->GetId());
-    // does the accelerated radeon rays match the test
-    EXPECT_EQ(isect.shapeid, isect_brute.shapeid);
-    EXPECT_LE(std::fabs(isect.uvwt.w - 10.f), 0.01f);
+    // Hits report the instances attached to the scene
+    for (int i = 0; i < 4; ++i)
+    {
+        ASSERT_EQ(isect[i].shapeid, outer[i / 2]->GetId());
+        ASSERT_EQ(isect[i].primid, 0);
+        ASSERT_NEAR(isect[i].uvwt.w, i < 2 ? 10.f : 12.f, 0.01f);
+    }
 
     // Bail out
-    ASSERT_NO_THROW(api_->DetachShape(instance.shape));
-    ASSERT_NO_THROW(api_->DetachShape(mesh0.shape));
-    ASSERT_NO_THROW(api_->DetachShape(mesh1.shape));
+    ASSERT_NO_THROW(api_->DetachShape(outer[0]));
+    ASSERT_NO_THROW(api_->DetachShape(outer[1]));
+    ASSERT_NO_THROW(api_->DeleteShape(outer[0]));
+    ASSERT_NO_THROW(api_->DeleteShape(outer[1]));
+    ASSERT_NO_THROW(api_->DeleteShape(group));
+    ASSERT_NO_THROW(api_->DeleteShape(inner[0]));
+    ASSERT_NO_THROW(api_->DeleteShape(inner[1]));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test traces a grid of instanced generated spheres
+TEST_F(ApiBackendOpenCL, Intersection_16Rays_GeneratedInstanceGrid)
+{
+    SceneGenerator::MeshData sphere = SceneGenerator::GenerateSphere(float3(0.f, 0.f, 0.f), 1.f, 32, 64);
+    ASSERT_EQ(sphere.num_faces(), 2 * 32 * 64);
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = SceneGenerator::CreateMesh(api_, sphere));
+
+    std::vector<Shape*> instances;
+    ASSERT_NO_THROW(SceneGenerator::CreateInstanceGrid(api_, mesh, 4, 4, 1, float3(3.f, 3.f, 0.f), instances));
+    ASSERT_EQ(instances.size(), 16U);
+
+    for (auto instance : instances)
+    {
+        ASSERT_NO_THROW(api_->AttachShape(instance));
+    }
+
+    // One ray at the center of every sphere
+    ray r[16];
+    for (int i = 0; i < 16; ++i)
+    {
+        r[i] = ray(float3(3.f * (i % 4), 3.f * (i / 4), -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    }
+
+    auto ray_buffer = api_->CreateBuffer(16 * sizeof(ray), r);
+    auto isect_buffer = api_->CreateBuffer(16 * sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 16, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 16 * sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    std::vector<Intersection> isect(tmp, tmp + 16);
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Instances are created in x, y order and the tessellation is within 1% of the radius
+    for (int i = 0; i < 16; ++i)
+    {
+        ASSERT_EQ(isect[i].shapeid, instances[i]->GetId());
+        ASSERT_NEAR(isect[i].uvwt.w, 9.f, 0.01f);
+    }
+
+    // Bail out
+    for (auto instance : instances)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(instance));
+        ASSERT_NO_THROW(api_->DeleteShape(instance));
+    }
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
     ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
     ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+TEST_F(ApiBackendOpenCL, Intersection_4Rays_AutoAccType)
+{
+    SceneGenerator::MeshData sphere = SceneGenerator::GenerateSphere(float3(0.f, 0.f, 0.f), 1.f, 32, 64);
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = SceneGenerator::CreateMesh(api_, sphere));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    api_->SetOption("acc.type", "auto");
 
+    ray r[4];
+    r[0] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    r[1] = ray(float3(0.f, 0.f, 10.f), float3(0.f, 0.f, -1.f), 10000.f);
+    r[2] = ray(float3(-10.f, 0.f, 0.f), float3(1.f, 0.f, 0.f), 10000.f);
+    r[3] = ray(float3(0.f, 10.f, 0.f), float3(0.f, -1.f, 0.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(4 * sizeof(ray), r);
+    auto isect_buffer = api_->CreateBuffer(4 * sizeof(Intersection), nullptr);
+
+    // Reattaching rebuilds the scene on every commit, which eventually switches to a dynamic scene choice
+    for (int commit = 0; commit < 5; ++commit)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(mesh));
+        ASSERT_NO_THROW(api_->AttachShape(mesh));
+        ASSERT_NO_THROW(api_->Commit());
+
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 4, isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 4 * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        std::vector<Intersection> isect(tmp, tmp + 4);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        for (int i = 0; i < 4; ++i)
+        {
+            ASSERT_EQ(isect[i].shapeid, mesh->GetId());
+            ASSERT_NEAR(isect[i].uvwt.w, 9.f, 0.01f);
+        }
+    }
+
+    // Bail out
+    api_->SetOption("acc.type", "bvh");
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
-TEST_F(ApiBackendOpenCL, Intersection_1Ray_TransformedInstance2)
+
+TEST_F(ApiBackendOpenCL, Intersection_GeneratedPinholeRays)
 {
-    // this test uses a single mesh, it added into the world as itself
-    // at <0,-1,1000> AND as an instance at <0,0,-2>
-    // ray from <0,0,-10> along the pos z should hit the instanced mesh
+    SceneGenerator::MeshData sphere = SceneGenerator::GenerateSphere(float3(0.f, 0.f, 0.f), 1.f, 32, 64);
 
-    std::vector<TestShape> shapes = { TestShape(vertices(), 3, indices(), 3, numfaceverts(), 1),
-        TestShape(vertices(), 3, indices(), 3, numfaceverts(), 1),
-        TestShape(vertices(), 3, indices(), 3, numfaceverts(), 1) };
-    TestShape& mesh0 = shapes[0];
-    TestShape& mesh1 = shapes[1];
-    TestShape& instance = shapes[2];
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = SceneGenerator::CreateMesh(api_, sphere));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
 
-    // Create meshes
-    // NOTE mesh in world and as a instance upsets the simple TestIntersection API call 
-    ASSERT_NO_THROW(mesh0.shape = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
-    ASSERT_TRUE(mesh0.shape != nullptr);
-    ASSERT_NO_THROW(mesh1.shape = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
-    ASSERT_TRUE(mesh1.shape != nullptr);
+    // Narrow field of view, every pixel sees the sphere
+    int const kWidth = 16;
+    int const kHeight = 8;
+    PinholeCamera camera;
+    camera.position = float4(0.f, 0.f, -10.f, 10000.f);
+    camera.forward = float4(0.f, 0.f, 1.f);
+    camera.right = float4(0.02f, 0.f, 0.f);
+    camera.up = float4(0.f, 0.01f, 0.f);
+
+    auto isect_buffer = api_->CreateBuffer(kWidth * kHeight * sizeof(Intersection), nullptr);
+    ASSERT_NO_THROW(api_->QueryPrimaryPinhole(camera, kWidth, kHeight, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kWidth * kHeight * sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    std::vector<Intersection> isect(tmp, tmp + kWidth * kHeight);
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    for (auto const& hit : isect)
+    {
+        ASSERT_EQ(hit.shapeid, mesh->GetId());
+        ASSERT_NEAR(hit.uvwt.w, 9.f, 0.05f);
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+TEST_F(ApiBackendOpenCL, Occlusion_Cached)
+{
+    // Grid of triangles, so occluders differ between rays
+    int const kGridSize = 8;
+    std::vector<float> gridvertices;
+    std::vector<int> gridindices;
+    for (int y = 0; y <= kGridSize; ++y)
+    {
+        for (int x = 0; x <= kGridSize; ++x)
+        {
+            gridvertices.push_back(-2.f + 4.f * x / kGridSize);
+            gridvertices.push_back(-2.f + 4.f * y / kGridSize);
+            gridvertices.push_back(0.f);
+        }
+    }
+
+    for (int y = 0; y < kGridSize; ++y)
+    {
+        for (int x = 0; x < kGridSize; ++x)
+        {
+            int i0 = y * (kGridSize + 1) + x;
+            int i1 = i0 + 1;
+            int i2 = i0 + kGridSize + 1;
+            int i3 = i2 + 1;
+            int quad[] = { i0, i1, i3, i0, i3, i2 };
+            gridindices.insert(gridindices.end(), quad, quad + 6);
+        }
+    }
+
+    int numfaces = (int)gridindices.size() / 3;
+    std::vector<int> gridnumfaceverts(numfaces, 3);
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(&gridvertices[0], (int)gridvertices.size() / 3, 3 * sizeof(float), &gridindices[0], 0, &gridnumfaceverts[0], numfaces));
+    ASSERT_TRUE(mesh != nullptr);
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Some rays miss the grid, some are too short to reach it and some are inactive
+    int const kNumRays = 256;
+    std::vector<ray> rays(kNumRays);
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        float x = -2.5f + 5.f * (i % 16) / 15.f;
+        float y = -2.5f + 5.f * (i / 16) / 15.f;
+        rays[i] = ray(float3(x, y, -10.f), float3(0.f, 0.f, 1.f));
+        rays[i].SetMaxT((i % 5) == 0 ? 5.f : 100.f);
+        rays[i].SetActive((i % 7) != 0);
+    }
+
+    std::vector<int> occluders(kNumRays, -1);
+
+    Buffer* ray_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), &rays[0]));
+    Buffer* occluder_buffer = nullptr;
+    ASSERT_NO_THROW(occluder_buffer = api_->CreateBuffer(kNumRays * sizeof(int), &occluders[0]));
+    Buffer* expected_buffer = nullptr;
+    ASSERT_NO_THROW(expected_buffer = api_->CreateBuffer(kNumRays * sizeof(int), nullptr));
+    Buffer* hit_buffer = nullptr;
+    ASSERT_NO_THROW(hit_buffer = api_->CreateBuffer(kNumRays * sizeof(int), nullptr));
+
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, kNumRays, expected_buffer, nullptr, &e_));
+    Wait();
+
+    int* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(expected_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&tmp, &e_));
+    Wait();
+    std::vector<int> expected(tmp, tmp + kNumRays);
+    ASSERT_NO_THROW(api_->UnmapBuffer(expected_buffer, tmp, &e_));
+    Wait();
+
+    // Empty cache, cache of the previous query and a cache of out of range and wrong occluders
+    for (int pass = 0; pass < 3; ++pass)
+    {
+        if (pass == 2)
+        {
+            ASSERT_NO_THROW(api_->MapBuffer(occluder_buffer, kMapWrite, 0, kNumRays * sizeof(int), (void**)&tmp, &e_));
+            Wait();
+            for (int i = 0; i < kNumRays; ++i)
+            {
+                tmp[i] = (i & 1) ? numfaces * 4 : (i * 3) % numfaces;
+            }
+            ASSERT_NO_THROW(api_->UnmapBuffer(occluder_buffer, tmp, &e_));
+            Wait();
+        }
+
+        // Inactive rays keep their results
+        ASSERT_NO_THROW(api_->MapBuffer(hit_buffer, kMapWrite, 0, kNumRays * sizeof(int), (void**)&tmp, &e_));
+        Wait();
+        for (int i = 0; i < kNumRays; ++i)
+        {
+            tmp[i] = expected[i];
+        }
+        ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffer, tmp, &e_));
+        Wait();
+
+        ASSERT_NO_THROW(api_->QueryOcclusionCached(ray_buffer, kNumRays, occluder_buffer, hit_buffer, nullptr, &e_));
+        Wait();
+
+        ASSERT_NO_THROW(api_->MapBuffer(hit_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&tmp, &e_));
+        Wait();
+        std::vector<int> results(tmp, tmp + kNumRays);
+        ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffer, tmp, &e_));
+        Wait();
+
+        ASSERT_NO_THROW(api_->MapBuffer(occluder_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&tmp, &e_));
+        Wait();
+        std::copy(tmp, tmp + kNumRays, occluders.begin());
+        ASSERT_NO_THROW(api_->UnmapBuffer(occluder_buffer, tmp, &e_));
+        Wait();
+
+        for (int i = 0; i < kNumRays; ++i)
+        {
+            ASSERT_EQ(results[i], expected[i]);
+
+            // Active rays store their occluder or none
+            if ((i % 7) != 0)
+            {
+                ASSERT_EQ(occluders[i] >= 0, results[i] > 0);
+                ASSERT_LT(occluders[i], numfaces);
+            }
+        }
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occluder_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(expected_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hit_buffer));
+}
+
+// The test checks box overlap queries against triangles, their bounds and truncated lists
+TEST_F(ApiBackendOpenCL, Overlap_Boxes)
+{
+    float mvertices[] = {
+        -1.f, -1.f, 0.f,
+        1.f, -1.f, 0.f,
+        0.f, 1.f, 0.f,
+        2.f, -1.f, 0.f,
+        4.f, -1.f, 0.f,
+        3.f, 1.f, 0.f
+    };
+
+    int mindices[] = { 0, 1, 2, 3, 4, 5 };
+    int mnumfaceverts[] = { 3, 3 };
+
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(mvertices, 6, 3*sizeof(float), mindices, 0, mnumfaceverts, 2));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // First face, both faces, the gap between them, the first face bounds outside
+    // of the face and an empty box
+    int const kNumBoxes = 5;
+    bbox boxes[kNumBoxes] = {
+        bbox(float3(-0.1f, -0.1f, -0.1f), float3(0.1f, 0.1f, 0.1f)),
+        bbox(float3(-5.f, -5.f, -5.f), float3(5.f, 5.f, 5.f)),
+        bbox(float3(1.4f, -0.1f, -0.1f), float3(1.6f, 0.1f, 0.1f)),
+        bbox(float3(0.85f, 0.85f, -0.1f), float3(0.95f, 0.95f, 0.1f)),
+        bbox()
+    };
+    int const expected[kNumBoxes] = { 1, 2, 0, 0, 0 };
+
+    Buffer* box_buffer = nullptr;
+    ASSERT_NO_THROW(box_buffer = api_->CreateBuffer(kNumBoxes * sizeof(bbox), boxes));
+    Buffer* overlap_buffer = nullptr;
+    ASSERT_NO_THROW(overlap_buffer = api_->CreateBuffer(kNumBoxes * 2 * sizeof(Overlap), nullptr));
+    Buffer* count_buffer = nullptr;
+    ASSERT_NO_THROW(count_buffer = api_->CreateBuffer(kNumBoxes * sizeof(int), nullptr));
+
+    // Full lists, then lists cut to a single record
+    for (int maxoverlaps = 2; maxoverlaps > 0; --maxoverlaps)
+    {
+        ASSERT_NO_THROW(api_->QueryOverlap(box_buffer, kNumBoxes, maxoverlaps, overlap_buffer, count_buffer, nullptr, &e_));
+        Wait();
+
+        int* counts = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(count_buffer, kMapRead, 0, kNumBoxes * sizeof(int), (void**)&counts, &e_));
+        Wait();
+        std::vector<int> numoverlaps(counts, counts + kNumBoxes);
+        ASSERT_NO_THROW(api_->UnmapBuffer(count_buffer, counts, &e_));
+        Wait();
+
+        Overlap* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(overlap_buffer, kMapRead, 0, kNumBoxes * maxoverlaps * sizeof(Overlap), (void**)&tmp, &e_));
+        Wait();
+        std::vector<Overlap> overlaps(tmp, tmp + kNumBoxes * maxoverlaps);
+        ASSERT_NO_THROW(api_->UnmapBuffer(overlap_buffer, tmp, &e_));
+        Wait();
+
+        for (int i = 0; i < kNumBoxes; ++i)
+        {
+            ASSERT_EQ(numoverlaps[i], expected[i]);
+        }
+
+        ASSERT_EQ(overlaps[0].shapeid, mesh->GetId());
+        ASSERT_EQ(overlaps[0].primid, 0);
+
+        // Both faces are listed in any order, the cut list has one of them
+        int primmask = 0;
+        for (int j = 0; j < maxoverlaps; ++j)
+        {
+            ASSERT_EQ(overlaps[maxoverlaps + j].shapeid, mesh->GetId());
+            primmask |= 1 << overlaps[maxoverlaps + j].primid;
+        }
+        ASSERT_EQ(primmask == 3, maxoverlaps == 2);
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(box_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(overlap_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(count_buffer));
+}
+
+TEST_F(ApiBackendOpenCL, ClosestPoint_Points)
+{
+    float mvertices[] = {
+        -1.f, -1.f, 0.f,
+        1.f, -1.f, 0.f,
+        0.f, 1.f, 0.f,
+        2.f, -1.f, 0.f,
+        4.f, -1.f, 0.f,
+        3.f, 1.f, 0.f
+    };
+
+    int mindices[] = { 0, 1, 2, 3, 4, 5 };
+    int mnumfaceverts[] = { 3, 3 };
+
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(mvertices, 6, 3*sizeof(float), mindices, 0, mnumfaceverts, 2));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Above the first face, next to an edge of the second face,
+    // next to a vertex of the first face and out of the distance
+    int const kNumPoints = 4;
+    float const kMaxDist = 5.f;
+    float3 points[kNumPoints] = {
+        float3(0.f, 0.f, 0.5f),
+        float3(1.6f, 0.f, 0.f),
+        float3(-2.f, -2.f, 0.f),
+        float3(10.f, 10.f, 10.f)
+    };
+
+    Buffer* point_buffer = nullptr;
+    ASSERT_NO_THROW(point_buffer = api_->CreateBuffer(kNumPoints * sizeof(float3), points));
+    Buffer* result_buffer = nullptr;
+    ASSERT_NO_THROW(result_buffer = api_->CreateBuffer(kNumPoints * sizeof(ClosestPoint), nullptr));
+
+    ASSERT_NO_THROW(api_->QueryClosestPoint(point_buffer, kNumPoints, kMaxDist, result_buffer, nullptr, &e_));
+    Wait();
+
+    ClosestPoint* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(result_buffer, kMapRead, 0, kNumPoints * sizeof(ClosestPoint), (void**)&tmp, &e_));
+    Wait();
+    std::vector<ClosestPoint> results(tmp, tmp + kNumPoints);
+    ASSERT_NO_THROW(api_->UnmapBuffer(result_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_EQ(results[0].shapeid, mesh->GetId());
+    ASSERT_EQ(results[0].primid, 0);
+    ASSERT_NEAR(results[0].uvwt.w, 0.5f, 1e-5f);
+    ASSERT_NEAR(results[0].uvwt.x, 0.25f, 1e-5f);
+    ASSERT_NEAR(results[0].uvwt.y, 0.5f, 1e-5f);
+    ASSERT_NEAR(results[0].p.z, 0.f, 1e-5f);
+
+    ASSERT_EQ(results[1].shapeid, mesh->GetId());
+    ASSERT_EQ(results[1].primid, 1);
+    ASSERT_NEAR(results[1].uvwt.w, 1.8f / std::sqrt(5.f), 1e-5f);
+
+    ASSERT_EQ(results[2].primid, 0);
+    ASSERT_NEAR(results[2].uvwt.w, std::sqrt(2.f), 1e-5f);
+    ASSERT_NEAR(results[2].p.x, -1.f, 1e-5f);
+    ASSERT_NEAR(results[2].p.y, -1.f, 1e-5f);
+
+    ASSERT_EQ(results[3].shapeid, kNullId);
+    ASSERT_EQ(results[3].uvwt.w, kMaxDist);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(point_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(result_buffer));
+}
+
+TEST_F(ApiBackendOpenCL, Occlusion_GeneratedShadowRays)
+{
+    SceneGenerator::MeshData sphere = SceneGenerator::GenerateSphere(float3(0.f, 0.f, 0.f), 1.f, 32, 64);
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = SceneGenerator::CreateMesh(api_, sphere));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // The last ray misses the sphere
+    ray r[3];
+    r[0] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    r[1] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    r[2] = ray(float3(5.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(3 * sizeof(ray), r);
+    auto isect_buffer = api_->CreateBuffer(3 * sizeof(Intersection), nullptr);
+    auto occlusion_buffer = api_->CreateBuffer(3 * sizeof(int), nullptr);
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr));
+
+    // The light in front of the sphere is visible from its front, the one behind it is not
+    float3 const lights[] = { float3(0.f, 0.f, -20.f), float3(0.f, 0.f, 20.f) };
+    int const expected[] = { kNullId, 1 };
+
+    for (int i = 0; i < 2; ++i)
+    {
+        ASSERT_NO_THROW(api_->QueryShadowFromHits(ray_buffer, isect_buffer, 3, lights[i], 0.001f, occlusion_buffer, nullptr, nullptr));
+
+        int* flags = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(occlusion_buffer, kMapRead, 0, 3 * sizeof(int), (void**)&flags, &e_));
+        Wait();
+        std::vector<int> occluded(flags, flags + 3);
+        ASSERT_NO_THROW(api_->UnmapBuffer(occlusion_buffer, flags, &e_));
+        Wait();
+
+        ASSERT_EQ(occluded[0] > 0 ? 1 : kNullId, expected[i]);
+        ASSERT_EQ(occluded[1] > 0 ? 1 : kNullId, expected[i]);
+        // Shadow rays of missed rays are inactive
+        ASSERT_EQ(occluded[2], kNullId);
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occlusion_buffer));
+}
+
+TEST_F(ApiBackendOpenCL, CompactRays)
+{
+    // Every other ray is inactive
+    int const kNumRays = 8;
+    ray r[kNumRays];
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        r[i] = ray(float3((float)i, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+        r[i].SetActive(i % 2 == 0);
+    }
 
-    // Attach the mesh to the scene
-    ASSERT_NO_THROW(api_->AttachShape(mesh0.shape));
-    // Create instance of a triangle
-    ASSERT_NO_THROW(instance.shape = api_->CreateInstance(mesh1.shape));
+    int numrays = kNumRays;
+    // The predicate keeps the last three rays
+    int predicate[kNumRays] = { 0, 0, 0, 0, 0, 1, 1, 1 };
 
-    //
-    const matrix m = translation(float3(0, 0, -2));
-    const matrix minv = inverse(m);
-    ASSERT_NO_THROW(instance.shape->SetTransform(m, minv));
+    auto ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), r);
+    auto numrays_buffer = api_->CreateBuffer(sizeof(int), &numrays);
+    auto predicate_buffer = api_->CreateBuffer(kNumRays * sizeof(int), predicate);
+    auto compacted_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), nullptr);
+    auto newnumrays_buffer = api_->CreateBuffer(sizeof(int), nullptr);
+    auto index_buffer = api_->CreateBuffer(kNumRays * sizeof(int), nullptr);
 
-    // Prepare the ray
-    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    Buffer const* predicates[] = { nullptr, predicate_buffer };
+    std::vector<int> expected[] = { { 0, 2, 4, 6 }, { 5, 6, 7 } };
 
+    for (int p = 0; p < 2; ++p)
+    {
+        ASSERT_NO_THROW(api_->CompactRays(ray_buffer, numrays_buffer, kNumRays, predicates[p], compacted_buffer, newnumrays_buffer, index_buffer, nullptr, nullptr));
+
+        int* count = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(newnumrays_buffer, kMapRead, 0, sizeof(int), (void**)&count, &e_));
+        Wait();
+        int newnumrays = *count;
+        ASSERT_NO_THROW(api_->UnmapBuffer(newnumrays_buffer, count, &e_));
+        Wait();
+
+        ASSERT_EQ(newnumrays, (int)expected[p].size());
+
+        int* idx = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(index_buffer, kMapRead, 0, newnumrays * sizeof(int), (void**)&idx, &e_));
+        Wait();
+        std::vector<int> indices(idx, idx + newnumrays);
+        ASSERT_NO_THROW(api_->UnmapBuffer(index_buffer, idx, &e_));
+        Wait();
+
+        ray* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(compacted_buffer, kMapRead, 0, newnumrays * sizeof(ray), (void**)&tmp, &e_));
+        Wait();
+        std::vector<ray> compacted(tmp, tmp + newnumrays);
+        ASSERT_NO_THROW(api_->UnmapBuffer(compacted_buffer, tmp, &e_));
+        Wait();
+
+        for (int i = 0; i < newnumrays; ++i)
+        {
+            ASSERT_EQ(indices[i], expected[p][i]);
+            ASSERT_EQ(compacted[i].o.x, (float)expected[p][i]);
+        }
+    }
 
-    // Commit geometry update
-    EXPECT_NO_THROW(api_->Commit());
+    // Rays can't be compacted in place
+    ASSERT_THROW(api_->CompactRays(ray_buffer, numrays_buffer, kNumRays, nullptr, ray_buffer, numrays_buffer, nullptr, nullptr, nullptr), Exception);
 
-    ASSERT_NO_THROW(api_->AttachShape(instance.shape));
+    // Bail out
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(numrays_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(predicate_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(compacted_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(newnumrays_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(index_buffer));
+}
 
-    // Intersection and hit data
-    Intersection isect;
+TEST_F(ApiBackendOpenCL, SortHits)
+{
+    // The last hit is past the ray count
+    int const kMaxRays = 8;
+    int const shapeids[kMaxRays] = { 3, kNullId, 1, 3, 2, kNullId, 1, 0 };
+    Intersection hits[kMaxRays];
+    for (int i = 0; i < kMaxRays; ++i)
+    {
+        hits[i].shapeid = shapeids[i];
+        hits[i].primid = shapeids[i];
+    }
 
-    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
-    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+    int numrays = kMaxRays - 1;
+    auto hit_buffer = api_->CreateBuffer(kMaxRays * sizeof(Intersection), hits);
+    auto numrays_buffer = api_->CreateBuffer(sizeof(int), &numrays);
+    auto index_buffer = api_->CreateBuffer(kMaxRays * sizeof(int), nullptr);
+    auto numhits_buffer = api_->CreateBuffer(sizeof(int), nullptr);
 
-    // Commit geometry update
-    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->SortHits(hit_buffer, numrays_buffer, kMaxRays, index_buffer, numhits_buffer, nullptr, &e_));
+    Wait();
 
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+    int* count = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(numhits_buffer, kMapRead, 0, sizeof(int), (void**)&count, &e_));
+    Wait();
+    int numhits = *count;
+    ASSERT_NO_THROW(api_->UnmapBuffer(numhits_buffer, count, &e_));
+    Wait();
 
-    Intersection* tmp = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    int* idx = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(index_buffer, kMapRead, 0, numrays * sizeof(int), (void**)&idx, &e_));
     Wait();
-    isect = *tmp;
-    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    std::vector<int> indices(idx, idx + numrays);
+    ASSERT_NO_THROW(api_->UnmapBuffer(index_buffer, idx, &e_));
     Wait();
 
-    // Check results for 1st ray
-    Intersection isect_brute;
-    TestIntersections(shapes.data(), (int)shapes.size(), &r, 1, &isect_brute);
-    // check the test gets the mesh we expect
-    EXPECT_EQ(isect_brute.shapeid, instance.shape->GetId());
-    // does the accelerated radeon rays match the test
-    EXPECT_EQ(isect.shapeid, isect_brute.shapeid);
-    EXPECT_LE(std::fabs(isect.uvwt.w - 8.f), 0.01f);
+    // Hits are grouped by increasing shape ID, the missed rays follow them
+    ASSERT_EQ(numhits, 5);
+    for (int i = 0; i < numhits; ++i)
+    {
+        ASSERT_NE(shapeids[indices[i]], kNullId);
+        if (i > 0)
+        {
+            ASSERT_LE(shapeids[indices[i - 1]], shapeids[indices[i]]);
+        }
+    }
+
+    for (int i = numhits; i < numrays; ++i)
+    {
+        ASSERT_EQ(shapeids[indices[i]], kNullId);
+    }
+
+    // Every ray is listed once
+    std::sort(indices.begin(), indices.end());
+    for (int i = 0; i < numrays; ++i)
+    {
+        ASSERT_EQ(indices[i], i);
+    }
+
+    // The count might replace the number of rays
+    ASSERT_NO_THROW(api_->SortHits(hit_buffer, numrays_buffer, kMaxRays, index_buffer, numrays_buffer, nullptr, &e_));
+    Wait();
+    ASSERT_NO_THROW(api_->MapBuffer(numrays_buffer, kMapRead, 0, sizeof(int), (void**)&count, &e_));
+    Wait();
+    ASSERT_EQ(*count, 5);
+    ASSERT_NO_THROW(api_->UnmapBuffer(numrays_buffer, count, &e_));
+    Wait();
 
     // Bail out
-    ASSERT_NO_THROW(api_->DetachShape(instance.shape));
-    ASSERT_NO_THROW(api_->DetachShape(mesh0.shape));
-    ASSERT_NO_THROW(api_->DetachShape(mesh1.shape));
-    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
-    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hit_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(numrays_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(index_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(numhits_buffer));
 }
 
-
-TEST_F(ApiBackendOpenCL, Intersection_1Ray_TransformedInstanceFlat)
+TEST_F(ApiBackendOpenCL, Intersection_DeviceRayCount)
 {
+    SceneGenerator::MeshData sphere = SceneGenerator::GenerateSphere(float3(0.f, 0.f, 0.f), 1.f, 32, 64);
 
-    // Set flattening
-    api_->SetOption("bvh.forceflat", 1.f);
-    
     Shape* mesh = nullptr;
-
-    // Create mesh
-    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
-
-    ASSERT_TRUE(mesh != nullptr);
-
-    // Attach the mesh to the scene
+    ASSERT_NO_THROW(mesh = SceneGenerator::CreateMesh(api_, sphere));
     ASSERT_NO_THROW(api_->AttachShape(mesh));
 
-    // Prepare the ray
-    ray r;
-    r.o = float3(0.f,0.f,-10.f, 1000.f);
-    r.d = float3(0.f,0.f,1.f);
+    // Only the first rays are live, the rest of the batch is left over from a previous bounce
+    int const kMaxRays = 256;
+    int const kNumRays = 5;
+    std::vector<ray> r(kMaxRays, ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f));
 
-    // Intersection and hit data
-    Intersection isect;
-    
-    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
-    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
-    
-    // Create instance of a triangle
-    Shape* instance = nullptr;
-    ASSERT_NO_THROW(instance = api_->CreateInstance(mesh));
-    
-    matrix m = translation(float3(0,0,-2));
-    matrix minv = inverse(m);
-    ASSERT_NO_THROW(instance->SetTransform(m, minv));
-    
-    ASSERT_NO_THROW(api_->AttachShape(instance));
-    
-    // Prepare the ray
-    r.o = float3(0.f,0.f,-10.f, 1000.f);
-    r.d = float3(0.f,0.f,1.f);
+    auto ray_buffer = api_->CreateBuffer(kMaxRays * sizeof(ray), &r[0]);
+    auto numrays_buffer = api_->CreateBuffer(sizeof(int), (void*)&kNumRays);
+    auto isect_buffer = api_->CreateBuffer(kMaxRays * sizeof(Intersection), nullptr);
 
-    // Commit geometry update
-    ASSERT_NO_THROW(api_->Commit());
-    
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
-    
-    Intersection* tmp = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
-    Wait();
-    isect = *tmp;
-    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
-    Wait();
-    
-    // Check results
-    ASSERT_EQ(isect.shapeid, instance->GetId());
-    ASSERT_LE(std::fabs(isect.uvwt.w - 8.f), 0.01f);
-    
-    //
-    m = translation(float3(0,0,2));
-    minv = inverse(m);
-    ASSERT_NO_THROW(instance->SetTransform(m, minv));
+    for (int indirect = 0; indirect < 2; ++indirect)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.indirect", (float)indirect));
+        ASSERT_NO_THROW(api_->Commit());
+
+        // Mark all the hits to find out which ones are written
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapWrite, 0, kMaxRays * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        for (int i = 0; i < kMaxRays; ++i)
+        {
+            tmp[i].shapeid = 12345;
+        }
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
 
-    // Prepare the ray
-    r.o = float3(0.f,0.f,-10.f, 1000.f);
-    r.d = float3(0.f,0.f,1.f);
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays_buffer, kMaxRays, isect_buffer, nullptr, nullptr));
 
-    // Commit geometry update
-    ASSERT_NO_THROW(api_->Commit());
-    
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
-    
-    tmp = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
-    Wait();
-    isect = *tmp;
-    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
-    Wait();
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kMaxRays * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        std::vector<Intersection> isect(tmp, tmp + kMaxRays);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
 
-    // Check results
-    ASSERT_EQ(isect.shapeid, mesh->GetId());
-    ASSERT_LE(std::fabs(isect.uvwt.w - 10.f), 0.01f);
+        for (int i = 0; i < kMaxRays; ++i)
+        {
+            ASSERT_EQ(isect[i].shapeid, i < kNumRays ? mesh->GetId() : 12345);
+        }
+    }
 
     // Bail out
-    ASSERT_NO_THROW(api_->DetachShape(instance));
+    ASSERT_NO_THROW(api_->SetOption("acc.indirect", 1.f));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
     ASSERT_NO_THROW(api_->DeleteShape(mesh));
     ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(numrays_buffer));
     ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
-// Test is checking if mesh transform is working as expected
-// DK: #22 repro case : Commit throws if base shape has not been attached
-TEST_F(ApiBackendOpenCL, Intersection_1Ray_InstanceNoShape)
+
+TEST_F(ApiBackendOpenCL, Intersection_2DRayOrders)
 {
+    SceneGenerator::MeshData sphere = SceneGenerator::GenerateSphere(float3(0.f, 0.f, 0.f), 1.f, 32, 64);
 
     Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = SceneGenerator::CreateMesh(api_, sphere));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
 
-    // Create mesh
-    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    // Neither side is a multiple of the tile size, the image covers the sphere partially
+    int const kWidth = 67;
+    int const kHeight = 45;
+    int const kNumRays = kWidth * kHeight;
+    std::vector<ray> r(kNumRays);
+    for (int y = 0; y < kHeight; ++y)
+    {
+        for (int x = 0; x < kWidth; ++x)
+        {
+            float3 o(3.f * (x + 0.5f) / kWidth - 1.5f, 3.f * (y + 0.5f) / kHeight - 1.5f, -10.f);
+            r[y * kWidth + x] = ray(o, float3(0.f, 0.f, 1.f), 10000.f);
+        }
+    }
 
-    ASSERT_TRUE(mesh != nullptr);
+    auto ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), &r[0]);
+    auto isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
 
-    // Attach the mesh to the scene
-    //ASSERT_NO_THROW(api_->AttachShape(mesh));
+    RayOrder const orders[] = { kRayOrderScanline, kRayOrderMorton, kRayOrderTiled };
+    std::vector<Intersection> reference;
 
-    // Prepare the ray
-    ray r;
-    r.o = float3(0.f, 0.f, -10.f, 1000.f);
-    r.d = float3(0.f, 0.f, 1.f);
+    for (auto order : orders)
+    {
+        ASSERT_NO_THROW(api_->QueryIntersection2D(ray_buffer, kWidth, kHeight, order, isect_buffer, nullptr, nullptr));
 
-    // Intersection and hit data
-    Intersection isect;
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        std::vector<Intersection> isect(tmp, tmp + kNumRays);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
 
-    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
-    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+        if (reference.empty())
+        {
+            reference = isect;
 
-    // Create instance of a triangle
-    Shape* instance = nullptr;
-    ASSERT_NO_THROW(instance = api_->CreateInstance(mesh));
+            // Corner pixels miss and the center ones hit
+            ASSERT_EQ(reference[0].shapeid, kNullId);
+            ASSERT_EQ(reference[(kHeight / 2) * kWidth + kWidth / 2].shapeid, mesh->GetId());
+            continue;
+        }
 
-    matrix m = translation(float3(0, 0, 2));
-    matrix minv = inverse(m);
-    ASSERT_NO_THROW(instance->SetTransform(m, minv));
+        // Hits are written back in the original order
+        for (int i = 0; i < kNumRays; ++i)
+        {
+            ASSERT_EQ(isect[i].shapeid, reference[i].shapeid);
+            ASSERT_EQ(isect[i].primid, reference[i].primid);
+        }
+    }
 
-    ASSERT_NO_THROW(api_->AttachShape(instance));
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
 
-    // Prepare the ray
-    r.o = float3(0.f, 0.f, -10.f, 1000.f);
-    r.d = float3(0.f, 0.f, 1.f);
+TEST_F(ApiBackendOpenCL, Intersection_SharedMemoryScene)
+{
+    SceneGenerator::MeshData sphere = SceneGenerator::GenerateSphere(float3(0.f, 0.f, 0.f), 1.f, 32, 64);
 
-    // Commit geometry update
-    ASSERT_NO_THROW(api_->Commit());
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = SceneGenerator::CreateMesh(api_, sphere));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
 
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+    int const kSide = 32;
+    int const kNumRays = kSide * kSide;
+    std::vector<ray> r(kNumRays);
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        float3 o(3.f * (i % kSide + 0.5f) / kSide - 1.5f, 3.f * (i / kSide + 0.5f) / kSide - 1.5f, -10.f);
+        r[i] = ray(o, float3(0.f, 0.f, 1.f), 10000.f);
+    }
 
-    Intersection* tmp = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
-    Wait();
-    isect = *tmp;
-    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
-    Wait();
+    // Stream buffers are in shared virtual memory where the device supports it
+    Buffer* ray_buffer = nullptr;
+    Buffer* isect_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), &r[0], kBufferStream));
+    ASSERT_NO_THROW(isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr, kBufferStream));
 
-    // Check results
-    ASSERT_EQ(isect.shapeid, instance->GetId());
-    ASSERT_LE(std::fabs(isect.uvwt.w - 12.f), 0.01f);
+    // The option is ignored by devices without shared virtual memory, so the results match either way.
+    // Switching the type creates a new intersector, which allocates the scene buffers with the option
+    char const* types[] = { "bvh", "fatbvh", "bvh4" };
+    std::vector<Intersection> reference[3];
+
+    for (int shared = 0; shared < 2; ++shared)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.shared_memory", (float)shared));
+
+        for (int t = 0; t < 3; ++t)
+        {
+            ASSERT_NO_THROW(api_->SetOption("acc.type", types[t]));
+            ASSERT_NO_THROW(api_->Commit());
+            ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr));
+
+            Intersection* tmp = nullptr;
+            ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&tmp, &e_));
+            Wait();
+            std::vector<Intersection> isect(tmp, tmp + kNumRays);
+            ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+            Wait();
+
+            if (!shared)
+            {
+                reference[t] = isect;
+                ASSERT_EQ(isect[0].shapeid, kNullId);
+                ASSERT_EQ(isect[(kSide / 2) * kSide + kSide / 2].shapeid, mesh->GetId());
+                continue;
+            }
+
+            for (int i = 0; i < kNumRays; ++i)
+            {
+                ASSERT_EQ(isect[i].shapeid, reference[t][i].shapeid);
+                ASSERT_EQ(isect[i].primid, reference[t][i].primid);
+            }
+        }
+    }
 
     // Bail out
-    ASSERT_NO_THROW(api_->DetachShape(instance));
+    ASSERT_NO_THROW(api_->SetOption("acc.shared_memory", 0.f));
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
     ASSERT_NO_THROW(api_->DeleteShape(mesh));
     ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
     ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
 
+TEST_F(ApiBackendOpenCL, Intersection_MappedSceneFile)
+{
+    SceneGenerator::MeshData sphere = SceneGenerator::GenerateSphere(float3(0.f, 0.f, 0.f), 1.f, 16, 32);
+
+    // The sphere is placed twice, at the origin and 3 units along x
+    std::vector<SceneFile::Mesh> meshes(1);
+    meshes[0] = { sphere.positions.data(), sphere.num_vertices(), sphere.indices.data(), sphere.num_faces() };
+    std::vector<SceneFile::Instance> instances(2);
+    instances[0].mesh = 0;
+    instances[1].mesh = 0;
+    instances[1].transform = translation(float3(3.f, 0.f, 0.f));
+
+    char const* filename = "mapped_scene_test.rrs";
+    ASSERT_EQ(SceneFile::WriteScene(filename, meshes, instances), "");
+
+    std::vector<Shape*> created;
+    std::vector<Shape*> attached;
+    {
+        SceneFile::MappedScene scene;
+        ASSERT_EQ(scene.Open(filename), "");
+        ASSERT_EQ(scene.GetNumMeshes(), 1);
+        ASSERT_EQ(scene.GetNumInstances(), 2);
+        ASSERT_EQ(scene.GetMesh(0).num_faces, sphere.num_faces());
+
+        ASSERT_NO_THROW(SceneFile::CreateShapes(api_, scene, created, attached));
+        ASSERT_EQ(attached.size(), 2U);
+        for (auto shape : attached)
+        {
+            ASSERT_NO_THROW(api_->AttachShape(shape));
+        }
+
+        // Rays through both spheres and beside them, down the z axis
+        ray r[3];
+        r[0] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+        r[1] = ray(float3(3.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+        r[2] = ray(float3(6.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+        auto ray_buffer = api_->CreateBuffer(3 * sizeof(ray), r);
+        auto isect_buffer = api_->CreateBuffer(3 * sizeof(Intersection), nullptr);
+
+        // Meshes reference the map, so it is kept open until they are gone
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3 * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        std::vector<Intersection> isect(tmp, tmp + 3);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        ASSERT_EQ(isect[0].shapeid, attached[0]->GetId());
+        ASSERT_EQ(isect[1].shapeid, attached[1]->GetId());
+        ASSERT_EQ(isect[2].shapeid, kNullId);
+        ASSERT_NEAR(isect[0].uvwt.w, 9.f, 0.01f);
+        ASSERT_NEAR(isect[1].uvwt.w, 9.f, 0.01f);
+
+        // Bail out
+        for (auto shape : attached)
+        {
+            ASSERT_NO_THROW(api_->DetachShape(shape));
+        }
+        for (auto shape : created)
+        {
+            ASSERT_NO_THROW(api_->DeleteShape(shape));
+        }
+        ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+        ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    }
+
+    std::remove(filename);
+}
+
+TEST_F(ApiBackendOpenCL, ParallelObjLoader)
+{
+    using namespace tinyobj;
+
+    // Groups, materials and relative indices exercise the merge of chunks
+    char const* filename = "parallel_obj_test.obj";
+    FILE* file = std::fopen(filename, "w");
+    ASSERT_NE(file, nullptr);
+    std::fputs(
+        "mtllib orig.mtl\n"
+        "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\nvn 0 0 1\nvt 0 0\nvt 1 0\nvt 1 1\n"
+        "f 1/1/1 2/2/1 3/3/1 4/1/1\n"
+        "usemtl light\n"
+        "f -4/-3/-1 -3/-2/-1 -2/-1/-1\n"
+        "g first\n"
+        "v 2 2 2\n"
+        "f 1//1 3//1 5//1\n"
+        "usemtl floor\n"
+        "f 5 4 3 2\n"
+        "o second\n"
+        "usemtl light\n"
+        "g empty\n"
+        "usemtl floor\n"
+        "f 1 2 3\n"
+        "usemtl light\n"
+        "g dropped\n"
+        "f 2 3 4\n"
+        "g last\n"
+        "v 3 3 3\n"
+        "f 6 5 4\n"
+        "f 1/2 2/3 -1/1\n", file);
+    std::fclose(file);
+
+    char const* basepath = "../Resources/CornellBox/";
+    char const* files[] = { "../Resources/CornellBox/orig.objm", filename };
+    for (auto name : files)
+    {
+        std::vector<shape_t> expected;
+        std::vector<material_t> expected_materials;
+        ASSERT_EQ(LoadObj(expected, expected_materials, name, basepath), "");
+
+        for (unsigned numthreads = 1; numthreads <= 8; numthreads *= 2)
+        {
+            std::vector<shape_t> shapes;
+            std::vector<material_t> materials;
+            ASSERT_EQ(LoadObjParallel(shapes, materials, name, basepath, numthreads), "");
+            ASSERT_EQ(materials.size(), expected_materials.size());
+            ASSERT_EQ(shapes.size(), expected.size());
+
+            for (std::size_t i = 0; i < shapes.size(); ++i)
+            {
+                ASSERT_EQ(shapes[i].name, expected[i].name);
+                ASSERT_EQ(shapes[i].mesh.positions, expected[i].mesh.positions);
+                ASSERT_EQ(shapes[i].mesh.normals, expected[i].mesh.normals);
+                ASSERT_EQ(shapes[i].mesh.texcoords, expected[i].mesh.texcoords);
+                ASSERT_EQ(shapes[i].mesh.indices, expected[i].mesh.indices);
+                ASSERT_EQ(shapes[i].mesh.material_ids, expected[i].mesh.material_ids);
+            }
+        }
+    }
+
+    std::remove(filename);
+}
+
 #endif // USE_OPENCL
\ No newline at end of file
@@ -268,6 +268,53 @@ TEST_F(ApiBackendEmbree, Intersection_1Ray)
 }
 
 
+// The test checks queries read and write host memory in place
+TEST_F(ApiBackendEmbree, Intersection_1Ray_HostPtr)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    // Intersection and hit data
+    Intersection isect;
+
+    Buffer* ray_buffer = nullptr;
+    Buffer* isect_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBufferFromHostPtr(&r, sizeof(ray)));
+    ASSERT_NO_THROW(isect_buffer = api_->CreateBufferFromHostPtr(&isect, sizeof(Intersection)));
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+    // Check results
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+
+    // Move the ray away without touching the buffer
+    r.o = float4(10.f, 10.f, -10.f, 10000.f);
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+    // Check results
+    ASSERT_EQ(isect.shapeid, kNullId);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+
 // The test creates a single triangle mesh and tests attach/detach functionality
 TEST_F(ApiBackendEmbree, Intersection_1Ray_Masked)
 {
@@ -35,6 +35,8 @@ using namespace tinyobj;
 #include "tiny_obj_loader.h"
 #include "utils.h"
 
+#include <algorithm>
+#include <cmath>
 #include <vector>
 #include <cstdio>
 
@@ -59,6 +61,12 @@ public:
 
     template< int kNumRays> void ExpectAnyRaysOk(RadeonRays::IntersectionApi* api) const;
 
+    // Random rays starting inside the scene like the ones of ExpectClosestRaysOk
+    void GenerateRays(ray* rays, int numrays) const;
+
+    // Closest hits of rays traced by api, the scene has to be committed
+    void QueryClosestHits(RadeonRays::IntersectionApi* api, ray* rays, int numrays, std::vector<Intersection>& isects) const;
+
     // CPU api
     IntersectionApi* apicpu_;
     // GPU api
@@ -244,6 +252,60 @@ TEST_F(ApiConformanceCL, CPU_CornellBox_10000RaysRandom_ClosestHit_Force2level_B
     ExpectClosestRaysOk<10000>(api);
 }
 
+TEST_F(ApiConformanceCL, CPU_CornellBox_10000RaysRandom_ClosestHit_Bruteforce_Lbvh)
+{
+    if (!apicpu_)
+        return;
+
+    auto api = apicpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "lbvh");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, CPU_CornellBox_10000RaysRandom_ClosestHit_Force2level_Bruteforce_Lbvh)
+{
+    if (!apicpu_)
+        return;
+
+    auto api = apicpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "lbvh");
+    api->SetOption("bvh.force2level", 1.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, CPU_CornellBox_10000RaysRandom_ClosestHit_Bruteforce_Presplit)
+{
+    if (!apicpu_)
+        return;
+
+    auto api = apicpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.presplit.budget", 0.5f);
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, CPU_CornellBox_10000RaysRandom_ClosestHit_Bruteforce_Lbvh_Presplit)
+{
+    if (!apicpu_)
+        return;
+
+    auto api = apicpu_;
+    api->SetOption("acc.type", "fatbvh");
+    api->SetOption("bvh.builder", "lbvh");
+    api->SetOption("bvh.presplit.budget", 0.5f);
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
 TEST_F(ApiConformanceCL, CPU_CornellBox_1000RandomRays_ClosestHit_Bruteforce_FatBvh)
 {
     if (!apicpu_)
@@ -377,6 +439,60 @@ TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_ClosestHit_Force2level_B
 
 }
 
+// Mesh BVHs refitted with rotations after their faces moved far from where they were built
+// have to keep every face reachable and the node count of the build
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_ClosestHit_Force2level_RefitRotations)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 1.f);
+    api->SetOption("bvh.refit.rotations", 1.f);
+    EXPECT_NO_THROW(api->Commit());
+
+    AccelStats built;
+    EXPECT_NO_THROW(api->GetStats(built));
+
+    std::vector<std::vector<float>> original;
+    for (auto const& shape : shapes_)
+    {
+        original.push_back(shape.mesh.positions);
+    }
+
+    // Twist the box around the y axis a bit more each step, the brute force shapes share the positions
+    int const kNumSteps = 4;
+    for (int step = 1; step <= kNumSteps; ++step)
+    {
+        for (auto i = 0U; i < shapes_.size(); ++i)
+        {
+            auto& positions = shapes_[i].mesh.positions;
+            for (auto v = 0U; v < positions.size(); v += 3)
+            {
+                float const angle = 0.8f * step * original[i][v + 1];
+                float const c = std::cos(angle);
+                float const s = std::sin(angle);
+                positions[v] = c * original[i][v] - s * original[i][v + 2];
+                positions[v + 2] = s * original[i][v] + c * original[i][v + 2];
+            }
+
+            EXPECT_NO_THROW(apishapes_gpu_[i]->UpdateVertices(&positions[0], 0));
+        }
+
+        ExpectClosestRaysOk<10000>(api);
+
+        AccelStats refitted;
+        EXPECT_NO_THROW(api->GetStats(refitted));
+        ASSERT_EQ(refitted.num_nodes, built.num_nodes) << "step " << step;
+        ASSERT_EQ(refitted.num_leaves, built.num_leaves) << "step " << step;
+        ASSERT_EQ(refitted.num_refs, built.num_refs) << "step " << step;
+        ASSERT_EQ(refitted.num_primitives, built.num_primitives) << "step " << step;
+        ASSERT_LT(refitted.max_depth, refitted.num_leaves) << "step " << step;
+    }
+
+    api->SetOption("bvh.refit.rotations", 0.f);
+    api->SetOption("bvh.force2level", 0.f);
+}
+
 TEST_F(ApiConformanceCL, GPU_CornellBox_1000RandomRays_ClosestHit_Bruteforce_FatBvh)
 {
     auto api = apigpu_;
@@ -388,6 +504,91 @@ TEST_F(ApiConformanceCL, GPU_CornellBox_1000RandomRays_ClosestHit_Bruteforce_Fat
 
 }
 
+TEST_F(ApiConformanceCL, GPU_CornellBox_1000RandomRays_ClosestHit_Bruteforce_CachedBvh)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "fatbvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+    api->SetOption("bvh.cache.path", ".");
+
+    // First commit builds and stores the tree
+    ExpectClosestRaysOk<1000>(api);
+
+    // Reattach the shapes to force the rebuild, tree should come from the cache
+    for (auto shape : apishapes_gpu_)
+    {
+        api->DetachShape(shape);
+    }
+
+    for (auto shape : apishapes_gpu_)
+    {
+        api->AttachShape(shape);
+    }
+
+    ExpectClosestRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_1000RandomRays_ClosestHit_Bruteforce_FatBvhQuantized)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "fatbvh_q");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_1000RandomRays_AnyHit_Bruteforce_FatBvhQuantized)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "fatbvh_q");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectAnyRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_1000RandomRays_ClosestHit_Bruteforce_FatBvhHalf)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "fatbvh_h");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_1000RandomRays_AnyHit_Bruteforce_FatBvhHalf)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "fatbvh_h");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectAnyRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_1000RandomRays_ClosestHit_Bruteforce_Bvh4)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh4");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_1000RandomRays_AnyHit_Bruteforce_Bvh4)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh4");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectAnyRaysOk<1000>(api);
+}
+
 TEST_F(ApiConformanceCL, DISABLED_GPU_CornellBox_1000Rays_Brutforce_HlBvh)
 {
     auto api = apigpu_;
@@ -400,6 +601,193 @@ TEST_F(ApiConformanceCL, DISABLED_GPU_CornellBox_1000Rays_Brutforce_HlBvh)
 }
 
 
+// Device built trees of hlbvh_ploc have to give the hits of the host built bvh and of the plain hlbvh
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_ClosestHit_HlbvhPloc)
+{
+    auto api = apigpu_;
+    api->SetOption("bvh.force2level", 0.f);
+
+    int const kNumRays = 10000;
+    std::vector<ray> rays(kNumRays);
+    GenerateRays(rays.data(), kNumRays);
+
+    std::vector<Intersection> isect_bvh;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    EXPECT_NO_THROW(api->Commit());
+    QueryClosestHits(api, rays.data(), kNumRays, isect_bvh);
+
+    std::vector<Intersection> isect_hlbvh;
+    api->SetOption("acc.type", "hlbvh");
+    EXPECT_NO_THROW(api->Commit());
+    QueryClosestHits(api, rays.data(), kNumRays, isect_hlbvh);
+
+    // Default clustering radius and the narrowest one
+    float const radii[] = { 16.f, 1.f };
+    for (auto radius : radii)
+    {
+        std::vector<Intersection> isect_ploc;
+        api->SetOption("acc.type", "hlbvh_ploc");
+        api->SetOption("hlbvh.ploc.radius", radius);
+        EXPECT_NO_THROW(api->Commit());
+        QueryClosestHits(api, rays.data(), kNumRays, isect_ploc);
+
+        for (int i = 0; i < kNumRays; ++i)
+        {
+            ExpectClosestIntersectionOk(isect_bvh[i], isect_ploc[i]);
+            ExpectClosestIntersectionOk(isect_hlbvh[i], isect_ploc[i]);
+        }
+    }
+
+    api->SetOption("hlbvh.ploc.radius", 16.f);
+}
+
+// Single pass node emission has to build the tree of the two pass one, a ray aimed at every face
+// reaches all the leaves, so a lost or duplicated subtree shows up against brute force
+TEST_F(ApiConformanceCL, GPU_CornellBox_ClosestHit_HlbvhSinglePass)
+{
+    auto api = apigpu_;
+    api->SetOption("bvh.force2level", 0.f);
+
+    int numfaces = 0;
+    std::vector<ray> rays;
+    for (auto const& shape : shapes_)
+    {
+        auto const& positions = shape.mesh.positions;
+        auto const& indices = shape.mesh.indices;
+        for (auto i = 0U; i < indices.size(); i += 3)
+        {
+            float3 centroid;
+            for (int k = 0; k < 3; ++k)
+            {
+                int v = indices[i + k];
+                centroid += float3(positions[3 * v], positions[3 * v + 1], positions[3 * v + 2]);
+            }
+            centroid *= (1.f / 3.f);
+
+            float3 o(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f);
+            rays.push_back(ray(o, normalize(centroid - o), 1000.f));
+            ++numfaces;
+        }
+    }
+
+    // Random rays on top of the aimed ones
+    int const kNumRandomRays = 10000;
+    rays.resize(numfaces + kNumRandomRays);
+    GenerateRays(rays.data() + numfaces, kNumRandomRays);
+    int const numrays = (int)rays.size();
+
+    std::vector<Intersection> isect_brute(numrays);
+    TestIntersections(test_shapes_.data(), (int)test_shapes_.size(), rays.data(), numrays, isect_brute.data());
+
+    char const* acctypes[] = { "hlbvh", "hlbvh_sah" };
+    for (auto acctype : acctypes)
+    {
+        api->SetOption("acc.type", acctype);
+
+        std::vector<Intersection> isect[2];
+        AccelStats stats[2];
+        for (int single_pass = 0; single_pass < 2; ++single_pass)
+        {
+            api->SetOption("hlbvh.single_pass", (float)single_pass);
+            EXPECT_NO_THROW(api->Commit());
+            QueryClosestHits(api, rays.data(), numrays, isect[single_pass]);
+            EXPECT_NO_THROW(api->GetStats(stats[single_pass]));
+        }
+
+        for (int i = 0; i < numrays; ++i)
+        {
+            ExpectClosestIntersectionOk(isect_brute[i], isect[1][i]);
+            ASSERT_EQ(isect[0][i].shapeid, isect[1][i].shapeid) << acctype << " ray " << i;
+            ASSERT_EQ(isect[0][i].primid, isect[1][i].primid) << acctype << " ray " << i;
+            ASSERT_EQ(isect[0][i].uvwt.w, isect[1][i].uvwt.w) << acctype << " ray " << i;
+        }
+
+        // A leaf per face and a full binary tree above them either way
+        for (auto const& s : stats)
+        {
+            ASSERT_EQ(s.num_leaves, numfaces);
+            ASSERT_EQ(s.num_nodes, 2 * s.num_leaves - 1);
+        }
+        ASSERT_EQ(stats[0].num_nodes, stats[1].num_nodes);
+    }
+
+    api->SetOption("hlbvh.single_pass", 0.f);
+}
+
+// Coherent rays are traversed in packets of 64, the hits have to match the per ray traversal
+// whether the rays of a packet agree on the nodes or not
+TEST_F(ApiConformanceCL, GPU_CornellBox_ClosestHit_Packets)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+    api->SetOption("acc.reorder", 0.f);
+    EXPECT_NO_THROW(api->Commit());
+
+    // The last packet is partial
+    int const kPacketSize = 64;
+    int const kNumPackets = 64;
+    int const kNumRays = kPacketSize * kNumPackets + 17;
+
+    std::vector<ray> rays(kNumRays);
+    for (int p = 0; p * kPacketSize < kNumRays; ++p)
+    {
+        float3 origin(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f);
+        float3 dir = normalize(float3(rand_float() * 2.f - 1.f, rand_float() * 2.f - 1.f, rand_float() * 2.f - 1.f));
+
+        for (int i = p * kPacketSize; i < std::min((p + 1) * kPacketSize, kNumRays); ++i)
+        {
+            int lane = i % kPacketSize;
+            float3 jitter(rand_float() * 0.1f - 0.05f, rand_float() * 0.1f - 0.05f, rand_float() * 0.1f - 0.05f);
+
+            switch (p % 4)
+            {
+            // Camera like packet, a narrow cone from a single origin
+            case 0:
+                rays[i] = ray(origin, normalize(dir + jitter), 1000.f);
+                break;
+            // Every ray goes its own way
+            case 1:
+                rays[i] = ray(origin, normalize(float3(rand_float() * 2.f - 1.f, rand_float() * 2.f - 1.f, rand_float() * 2.f - 1.f)), 1000.f);
+                break;
+            // The two halves of the packet split at the root
+            case 2:
+                rays[i] = ray(origin, normalize((lane & 1 ? -1.f : 1.f) * dir + jitter), 1000.f);
+                break;
+            // Inactive rays and rays too short to reach most of the nodes the others visit
+            default:
+                rays[i] = ray(origin, normalize(dir + jitter), lane % 5 == 0 ? 0.05f : 1000.f);
+                rays[i].SetActive(lane % 3 != 0);
+                break;
+            }
+        }
+    }
+
+    std::vector<Intersection> isect_rays;
+    api->SetQueryHint(kQueryHintDefault);
+    QueryClosestHits(api, rays.data(), kNumRays, isect_rays);
+
+    std::vector<Intersection> isect_packets;
+    api->SetQueryHint(kQueryHintCoherent);
+    QueryClosestHits(api, rays.data(), kNumRays, isect_packets);
+
+    api->SetQueryHint(kQueryHintDefault);
+
+    int numhits = 0;
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        ExpectClosestIntersectionOk(isect_rays[i], isect_packets[i]);
+        ASSERT_EQ(isect_rays[i].primid, isect_packets[i].primid) << "ray " << i;
+        numhits += isect_packets[i].shapeid != kNullId ? 1 : 0;
+    }
+
+    // Both hits and misses are covered
+    ASSERT_GT(numhits, 0);
+    ASSERT_LT(numhits, kNumRays);
+}
+
 TEST_F(ApiConformanceCL, GPU_CornellBox_1RandomRays_AnyHit_Bruteforce)
 {
     auto api = apigpu_;
@@ -539,6 +927,42 @@ inline void ApiConformanceCL::ExpectClosestIntersectionOk(const Intersection& ex
     }
 }
 
+inline void ApiConformanceCL::GenerateRays(ray* rays, int numrays) const
+{
+    for (int i = 0; i < numrays; ++i)
+    {
+        rays[i].o = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, 1000.f);
+        rays[i].d = normalize(float3(rand_float(), rand_float(), rand_float()));
+
+        rays[i].SetActive(true);
+        rays[i].SetMask(0xFFFFFFFF);
+    }
+}
+
+inline void ApiConformanceCL::QueryClosestHits(RadeonRays::IntersectionApi* api, ray* rays, int numrays, std::vector<Intersection>& isects) const
+{
+    // Hits of inactive rays aren't written, they keep the default records
+    std::vector<Intersection> init(numrays);
+    auto ray_buffer = api->CreateBuffer(numrays * sizeof(ray), rays);
+    auto isect_buffer = api->CreateBuffer(numrays * sizeof(Intersection), init.data());
+
+    Event* ev = nullptr;
+    EXPECT_NO_THROW(api->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    Intersection* isect = nullptr;
+    EXPECT_NO_THROW(api->MapBuffer(isect_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&isect, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    isects.assign(isect, isect + numrays);
+
+    EXPECT_NO_THROW(api->UnmapBuffer(isect_buffer, isect, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    EXPECT_NO_THROW(api->DeleteBuffer(ray_buffer));
+    EXPECT_NO_THROW(api->DeleteBuffer(isect_buffer));
+}
+
 template<int kNumRays>
 inline void ApiConformanceCL::ExpectClosestRaysOk(RadeonRays::IntersectionApi* api)const
 {
@@ -30,12 +30,14 @@ THE SOFTWARE.
 using namespace RadeonRays;
 
 #include "tiny_obj_loader.h"
+#include "../Tutorials/Tools/parallel_obj_loader.h"
 
 using namespace tinyobj;
 
 #include <vector>
 #include <cstdio>
 #include <chrono>
+#include <limits>
 
 #ifdef __APPLE__
 #include <OpenCL/OpenCL.h>
@@ -78,7 +80,7 @@ public:
         ASSERT_NO_THROW(api_ = IntersectionApiCL::CreateFromOpenClContext(rawcontext_, device, queue_));
 
         // Load obj file 
-        std::string res = LoadObj(shapes_, materials_, "../Resources/bmw/i8.obj");
+        std::string res = LoadObjParallel(shapes_, materials_, "../Resources/bmw/i8.obj");
 
         // Create meshes within IntersectionApi
         for  (int i=0; i<(int)shapes_.size(); ++i)
@@ -133,4 +135,79 @@ TEST_F(ApiPerformance, BvhBuild)
     std::cout << "Bvh build time: " << delta << " ms\n";
 }
 
+TEST_F(ApiPerformance, PersistentTraversal)
+{
+    api_->SetOption("acc.type", "bvh");
+    api_->SetOption("bvh.builder", "sah");
+
+    // Find scene bounds to aim the rays at
+    float3 pmin(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+    float3 pmax = -pmin;
+    for (auto const& shape : shapes_)
+    {
+        auto const& positions = shape.mesh.positions;
+        for (std::size_t i = 0; i + 2 < positions.size(); i += 3)
+        {
+            float3 p(positions[i], positions[i + 1], positions[i + 2]);
+            pmin = vmin(pmin, p);
+            pmax = vmax(pmax, p);
+        }
+    }
+
+    // Orthographic grid of rays along -z
+    int const kResolution = 1024;
+    int const kNumIterations = 10;
+    int const numrays = kResolution * kResolution;
+    std::vector<ray> rays(numrays);
+    for (int y = 0; y < kResolution; ++y)
+    {
+        for (int x = 0; x < kResolution; ++x)
+        {
+            float u = (x + 0.5f) / kResolution;
+            float v = (y + 0.5f) / kResolution;
+            float3 o(pmin.x + u * (pmax.x - pmin.x), pmin.y + v * (pmax.y - pmin.y), pmax.z + 1.f);
+            rays[y * kResolution + x] = ray(o, float3(0.f, 0.f, -1.f));
+        }
+    }
+
+    Buffer* ray_buffer = nullptr;
+    Buffer* isect_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), &rays[0]));
+    ASSERT_NO_THROW(isect_buffer = api_->CreateBuffer(numrays * sizeof(Intersection), nullptr));
+
+    auto measure = [&](float persistent)
+    {
+        api_->SetOption("acc.persistent", persistent);
+        api_->Commit();
+
+        // Warm up
+        Event* e = nullptr;
+        api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, &e);
+        e->Wait();
+        api_->DeleteEvent(e);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < kNumIterations; ++i)
+        {
+            api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, &e);
+            e->Wait();
+            api_->DeleteEvent(e);
+        }
+        auto delta = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+        return delta / 1000.f / kNumIterations;
+    };
+
+    float regular = 0.f;
+    float persistent = 0.f;
+    ASSERT_NO_THROW(regular = measure(0.f));
+    ASSERT_NO_THROW(persistent = measure(1.f));
+
+    std::cout << "Regular traversal time: " << regular << " ms\n";
+    std::cout << "Persistent traversal time: " << persistent << " ms\n";
+    std::cout << "Persistent traversal speedup: " << regular / persistent << "x\n";
+
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
 #endif // USE_OPENCL
@@ -0,0 +1,515 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "gtest/gtest.h"
+
+#include "../RadeonRays/src/util/perfect_hash_map.h"
+#include "../RadeonRays/src/async/thread_pool.h"
+#include "../RadeonRays/src/async/lockfree_pool.h"
+#include "math/mathutils.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <future>
+#include <functional>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+// Splits [begin, end) into numjobs chunks processed by concurrent tasks
+class AsyncParallelFor
+{
+public:
+    explicit AsyncParallelFor(int numjobs) : numjobs_(numjobs) {}
+
+    void operator()(int begin, int end, std::function<void(int, int)> const& func) const
+    {
+        std::vector<std::future<void>> jobs;
+        int chunk = (end - begin + numjobs_ - 1) / numjobs_;
+
+        for (int b = begin; b < end; b += chunk)
+        {
+            int e = std::min(b + chunk, end);
+            jobs.push_back(std::async(std::launch::async, [&func, b, e]() { func(b, e); }));
+        }
+
+        for (auto& job : jobs)
+        {
+            job.get();
+        }
+    }
+
+private:
+    int numjobs_;
+};
+
+class PerfectHashMapTest : public ::testing::Test
+{
+public:
+    typedef PerfectHashMap<int, int> HashMap;
+
+    // Checks every key maps to its value and tables built by any number of jobs are the same
+    void Check(int max_key, std::vector<int> const& keys, std::vector<int> const& values)
+    {
+        int count = static_cast<int>(keys.size());
+        HashMap serial(max_key, &keys[0], &values[0], count, -1);
+
+        for (int i = 0; i < count; ++i)
+        {
+            ASSERT_EQ(serial[keys[i]], values[i]);
+        }
+
+        int const numjobs[] = { 1, 2, 7 };
+        for (auto n : numjobs)
+        {
+            HashMap parallel(max_key, &keys[0], &values[0], count, -1, AsyncParallelFor(n));
+
+            for (int i = 0; i < count; ++i)
+            {
+                ASSERT_EQ(parallel[keys[i]], values[i]);
+            }
+
+            ASSERT_EQ(parallel.row_size(), serial.row_size());
+            ASSERT_EQ(parallel.displacement_table_size(), serial.displacement_table_size());
+            ASSERT_EQ(parallel.hash_table_size(), serial.hash_table_size());
+            ASSERT_TRUE(std::equal(serial.displacement_table_ptr(),
+                serial.displacement_table_ptr() + serial.displacement_table_size(), parallel.displacement_table_ptr()));
+            ASSERT_TRUE(std::equal(serial.hash_table_ptr(),
+                serial.hash_table_ptr() + serial.hash_table_size(), parallel.hash_table_ptr()));
+        }
+    }
+};
+
+// The test builds the map from a few keys spread over a large range
+TEST_F(PerfectHashMapTest, SparseKeys)
+{
+    int const kMaxKey = 1 << 24;
+    int const kNumKeys = 50000;
+
+    std::mt19937 rng(17);
+    std::uniform_int_distribution<int> dist(0, kMaxKey);
+
+    // Unique keys in random order
+    std::vector<char> used(kMaxKey + 1, 0);
+    std::vector<int> keys;
+    while (static_cast<int>(keys.size()) < kNumKeys)
+    {
+        int key = dist(rng);
+        if (!used[key])
+        {
+            used[key] = 1;
+            keys.push_back(key);
+        }
+    }
+
+    std::vector<int> values(kNumKeys);
+    for (int i = 0; i < kNumKeys; ++i)
+    {
+        values[i] = i;
+    }
+
+    Check(kMaxKey, keys, values);
+}
+
+// The test builds the map from every key of a range in shuffled order
+TEST_F(PerfectHashMapTest, DenseKeys)
+{
+    int const kNumKeys = 100000;
+
+    std::vector<int> keys(kNumKeys);
+    std::vector<int> values(kNumKeys);
+    for (int i = 0; i < kNumKeys; ++i)
+    {
+        keys[i] = i;
+    }
+
+    std::mt19937 rng(29);
+    std::shuffle(keys.begin(), keys.end(), rng);
+
+    for (int i = 0; i < kNumKeys; ++i)
+    {
+        values[i] = kNumKeys - keys[i];
+    }
+
+    Check(kNumKeys - 1, keys, values);
+}
+
+// The test runs parallel_for over many small ranges and checks each index is processed exactly once
+TEST(ThreadPoolTest, ParallelForSmallRanges)
+{
+    for (int num_parts = 1; num_parts <= 2; ++num_parts)
+    {
+        RadeonRays::thread_pool<int> pool(4, num_parts);
+
+        for (int size = 0; size < 200; ++size)
+        {
+            for (int grain_size = 1; grain_size < 8; ++grain_size)
+            {
+                std::vector<std::atomic<int>> counters(size + 1);
+                for (auto& counter : counters)
+                {
+                    counter.store(0);
+                }
+
+                // Ranges do not start at zero to catch offset errors
+                pool.parallel_for(1, size + 1, grain_size, [&counters](int begin, int end)
+                {
+                    for (int i = begin; i < end; ++i)
+                    {
+                        counters[i].fetch_add(1);
+                    }
+                });
+
+                ASSERT_EQ(counters[0].load(), 0);
+                for (int i = 1; i <= size; ++i)
+                {
+                    ASSERT_EQ(counters[i].load(), 1);
+                }
+            }
+        }
+    }
+}
+
+// The test runs parallel_for from the bodies of another parallel_for
+TEST(ThreadPoolTest, ParallelForNested)
+{
+    RadeonRays::thread_pool<int> pool(4);
+
+    int const kOuter = 64;
+    int const kInner = 1000;
+
+    for (int iteration = 0; iteration < 20; ++iteration)
+    {
+        std::vector<std::atomic<int>> counters(kOuter * kInner);
+        for (auto& counter : counters)
+        {
+            counter.store(0);
+        }
+
+        pool.parallel_for(0, kOuter, 1, [&](int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                pool.parallel_for(0, kInner, 16, [&, i](int b, int e)
+                {
+                    for (int j = b; j < e; ++j)
+                    {
+                        counters[i * kInner + j].fetch_add(1);
+                    }
+                });
+            }
+        });
+
+        for (auto& counter : counters)
+        {
+            ASSERT_EQ(counter.load(), 1);
+        }
+    }
+}
+
+// The test submits tasks and waits for them from several threads at once
+TEST(ThreadPoolTest, SubmitFromSeveralThreads)
+{
+    RadeonRays::thread_pool<int> pool(4);
+
+    int const kNumThreads = 8;
+    int const kNumTasks = 2000;
+
+    std::vector<std::atomic<int>> counters(kNumThreads * kNumTasks);
+    for (auto& counter : counters)
+    {
+        counter.store(0);
+    }
+
+    std::atomic<int> errors(0);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < kNumThreads; ++t)
+    {
+        threads.push_back(std::thread([&, t]()
+        {
+            std::vector<std::future<int>> futures;
+
+            for (int i = 0; i < kNumTasks; ++i)
+            {
+                int idx = t * kNumTasks + i;
+                futures.push_back(pool.submit([&counters, idx]()
+                {
+                    counters[idx].fetch_add(1);
+                    return idx;
+                }));
+
+                // Wait for a batch of tasks while other threads keep submitting
+                if ((i & 63) == 63)
+                {
+                    for (int j = i - 63; j <= i; ++j)
+                    {
+                        if (futures[j].get() != t * kNumTasks + j)
+                            ++errors;
+                    }
+                }
+            }
+
+            for (int i = kNumTasks & ~63; i < kNumTasks; ++i)
+            {
+                if (futures[i].get() != t * kNumTasks + i)
+                    ++errors;
+            }
+        }));
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    ASSERT_EQ(errors.load(), 0);
+    for (auto& counter : counters)
+    {
+        ASSERT_EQ(counter.load(), 1);
+    }
+}
+
+// Pool object counting its holders
+struct LockfreePoolItem
+{
+    LockfreePoolItem() : holders(0) {}
+
+    std::atomic<int> holders;
+};
+
+// The test acquires and releases objects from several threads while the pool grows
+// and checks no object is handed out to two holders at once
+TEST(LockfreePoolTest, ConcurrentAcquireRelease)
+{
+    // Start from a single object, so most of the acquires race against growing
+    RadeonRays::lockfree_pool<LockfreePoolItem> pool(1);
+
+    int const kNumThreads = 8;
+    int const kNumIterations = 20000;
+    int const kMaxHeld = 16;
+
+    std::atomic<int> errors(0);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < kNumThreads; ++t)
+    {
+        threads.push_back(std::thread([&, t]()
+        {
+            LockfreePoolItem* held[kMaxHeld];
+
+            for (int i = 0; i < kNumIterations; ++i)
+            {
+                // Hold a varying number of objects to keep the free list changing
+                int count = 1 + (i * 7 + t) % kMaxHeld;
+
+                for (int j = 0; j < count; ++j)
+                {
+                    held[j] = pool.acquire();
+                    if (held[j]->holders.fetch_add(1) != 0)
+                        ++errors;
+                }
+
+                for (int j = 0; j < count; ++j)
+                {
+                    if (held[j]->holders.fetch_sub(1) != 1)
+                        ++errors;
+                    pool.release(held[j]);
+                }
+            }
+        }));
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    ASSERT_EQ(errors.load(), 0);
+
+    // All the objects are back, so they can be held at once again
+    std::vector<LockfreePoolItem*> all;
+    for (int i = 0; i < kNumThreads * kMaxHeld; ++i)
+    {
+        all.push_back(pool.acquire());
+        ASSERT_EQ(all.back()->holders.load(), 0);
+        all.back()->holders.store(1);
+    }
+
+    std::sort(all.begin(), all.end());
+    ASSERT_TRUE(std::adjacent_find(all.begin(), all.end()) == all.end());
+
+    for (auto item : all)
+    {
+        item->holders.store(0);
+        pool.release(item);
+    }
+}
+
+// Host math is checked against plain scalar formulas, so the SSE/NEON path of a "--simd_math" build
+// has to give the results of the scalar one up to rounding
+class SimdMathTest : public ::testing::Test
+{
+public:
+    typedef RadeonRays::float3 float3;
+    typedef RadeonRays::matrix matrix;
+
+    SimdMathTest() : rng_(0x5EED), dist_(-10.f, 10.f) {}
+
+    float Random() { return dist_(rng_); }
+    float3 RandomVector() { return float3(Random(), Random(), Random(), Random()); }
+
+    matrix RandomMatrix()
+    {
+        matrix m;
+        for (int i = 0; i < 4; ++i)
+        {
+            for (int j = 0; j < 4; ++j)
+            {
+                m.m[i][j] = Random();
+            }
+        }
+        return m;
+    }
+
+    // Sums of products of the random values may cancel, so the error is relative to their scale
+    static void ExpectNear(float expected, float actual, float scale = 1.f)
+    {
+        EXPECT_NEAR(expected, actual, 1e-5f * std::max(scale, std::fabs(expected)));
+    }
+
+    static void ExpectNear(float3 const& expected, float3 const& actual, float scale = 1.f)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            ExpectNear(expected[i], actual[i], scale);
+        }
+    }
+
+    // Largest sum of 4 products of the random values
+    static constexpr float kScale = 400.f;
+
+    std::mt19937 rng_;
+    std::uniform_real_distribution<float> dist_;
+};
+
+TEST_F(SimdMathTest, Layout)
+{
+    float3 v(1.f, 2.f, 3.f, 4.f);
+    float const* f = &v.x;
+    ASSERT_EQ(f[0], 1.f);
+    ASSERT_EQ(f[1], 2.f);
+    ASSERT_EQ(f[2], 3.f);
+    ASSERT_EQ(f[3], 4.f);
+
+    // Rows follow each other without padding
+    matrix m;
+    ASSERT_EQ(&m.m[1][0], &m.m00 + 4);
+    ASSERT_EQ(&m.m33, &m.m00 + 15);
+
+    // Arrays keep every element aligned for the vector loads
+    std::vector<float3> vectors(7);
+    std::vector<matrix> matrices(7);
+    for (int i = 0; i < 7; ++i)
+    {
+        ASSERT_EQ(reinterpret_cast<std::uintptr_t>(&vectors[i]) % alignof(float3), 0u);
+        ASSERT_EQ(reinterpret_cast<std::uintptr_t>(&matrices[i]) % alignof(matrix), 0u);
+    }
+}
+
+TEST_F(SimdMathTest, Vector)
+{
+    for (int n = 0; n < 1000; ++n)
+    {
+        float3 a = RandomVector();
+        float3 b = RandomVector();
+        float c = Random();
+
+        // Arithmetic keeps w of the left operand
+        ExpectNear(float3(a.x + b.x, a.y + b.y, a.z + b.z, a.w), a + b);
+        ExpectNear(float3(a.x - b.x, a.y - b.y, a.z - b.z, a.w), a - b);
+        ExpectNear(float3(a.x * b.x, a.y * b.y, a.z * b.z, a.w), a * b);
+        ExpectNear(float3(a.x * c, a.y * c, a.z * c, a.w), a * c);
+
+        ExpectNear(a.x * b.x + a.y * b.y + a.z * b.z, RadeonRays::dot(a, b), kScale);
+        ExpectNear(float3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x), RadeonRays::cross(a, b), kScale);
+
+        float len = std::sqrt(a.x * a.x + a.y * a.y + a.z * a.z);
+        ExpectNear(float3(a.x / len, a.y / len, a.z / len, a.w), RadeonRays::normalize(a));
+
+        ExpectNear(float3(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z)), RadeonRays::vmin(a, b));
+        ExpectNear(float3(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z)), RadeonRays::vmax(a, b));
+    }
+}
+
+TEST_F(SimdMathTest, Matrix)
+{
+    for (int n = 0; n < 1000; ++n)
+    {
+        matrix a = RandomMatrix();
+        matrix b = RandomMatrix();
+        float3 p = RandomVector();
+
+        matrix ab = a * b;
+        matrix at = a.transpose();
+        for (int i = 0; i < 4; ++i)
+        {
+            for (int j = 0; j < 4; ++j)
+            {
+                float expected = 0.f;
+                for (int k = 0; k < 4; ++k)
+                {
+                    expected += a.m[i][k] * b.m[k][j];
+                }
+                ExpectNear(expected, ab.m[i][j], kScale);
+                ASSERT_EQ(a.m[j][i], at.m[i][j]);
+            }
+        }
+
+        // Vectors ignore the translation and points add it, w is zero either way
+        float3 v(a.m00 * p.x + a.m01 * p.y + a.m02 * p.z, a.m10 * p.x + a.m11 * p.y + a.m12 * p.z, a.m20 * p.x + a.m21 * p.y + a.m22 * p.z);
+        ExpectNear(v, a * p, kScale);
+        ExpectNear(v, RadeonRays::transform_vector(p, a), kScale);
+        ExpectNear(v + float3(a.m03, a.m13, a.m23), RadeonRays::transform_point(p, a), kScale);
+
+        // The box of the 8 transformed corners
+        RadeonRays::bbox box(RandomVector(), RandomVector());
+        RadeonRays::bbox expected;
+        for (int corner = 0; corner < 8; ++corner)
+        {
+            float3 c((corner & 1) ? box.pmax.x : box.pmin.x, (corner & 2) ? box.pmax.y : box.pmin.y, (corner & 4) ? box.pmax.z : box.pmin.z);
+            expected.grow(float3(a.m00 * c.x + a.m01 * c.y + a.m02 * c.z + a.m03,
+                a.m10 * c.x + a.m11 * c.y + a.m12 * c.z + a.m13,
+                a.m20 * c.x + a.m21 * c.y + a.m22 * c.z + a.m23));
+        }
+
+        RadeonRays::bbox transformed = RadeonRays::transform_bbox(box, a);
+        for (int i = 0; i < 3; ++i)
+        {
+            ExpectNear(expected.pmin[i], transformed.pmin[i], kScale);
+            ExpectNear(expected.pmax[i], transformed.pmax[i], kScale);
+        }
+    }
+}
@@ -0,0 +1,176 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "scene_generator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+using namespace RadeonRays;
+
+namespace SceneGenerator
+{
+    namespace
+    {
+        float const kPi = 3.14159265358979323846f;
+
+        void AddVertex(MeshData& data, float3 const& p)
+        {
+            data.positions.push_back(p.x);
+            data.positions.push_back(p.y);
+            data.positions.push_back(p.z);
+        }
+
+        void AddTriangle(MeshData& data, int i0, int i1, int i2)
+        {
+            data.indices.push_back(i0);
+            data.indices.push_back(i1);
+            data.indices.push_back(i2);
+        }
+
+        float3 RandomDirection(std::mt19937& rng)
+        {
+            std::uniform_real_distribution<float> dist(0.f, 1.f);
+            float z = 1.f - 2.f * dist(rng);
+            float r = std::sqrt(std::max(0.f, 1.f - z * z));
+            float phi = 2.f * kPi * dist(rng);
+            return float3(r * std::cos(phi), r * std::sin(phi), z);
+        }
+
+        float3 RandomPoint(float3 const& pmin, float3 const& pmax, std::mt19937& rng)
+        {
+            std::uniform_real_distribution<float> dist(0.f, 1.f);
+            return float3(pmin.x + dist(rng) * (pmax.x - pmin.x), pmin.y + dist(rng) * (pmax.y - pmin.y), pmin.z + dist(rng) * (pmax.z - pmin.z));
+        }
+    }
+
+    MeshData GenerateSphere(float3 const& center, float radius, int rings, int segments)
+    {
+        rings = std::max(rings, 2);
+        segments = std::max(segments, 3);
+
+        MeshData data;
+        data.positions.reserve(3 * ((rings + 1) * segments));
+        data.indices.reserve(3 * 2 * rings * segments);
+
+        // Every ring gets its own copy of the pole vertex, so all quads are uniform
+        for (int i = 0; i <= rings; ++i)
+        {
+            float theta = kPi * i / rings;
+
+            for (int j = 0; j < segments; ++j)
+            {
+                float phi = 2.f * kPi * j / segments;
+                float3 n(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+                AddVertex(data, center + radius * n);
+            }
+        }
+
+        for (int i = 0; i < rings; ++i)
+        {
+            for (int j = 0; j < segments; ++j)
+            {
+                int i0 = i * segments + j;
+                int i1 = i * segments + (j + 1) % segments;
+                int i2 = i0 + segments;
+                int i3 = i1 + segments;
+
+                AddTriangle(data, i0, i1, i3);
+                AddTriangle(data, i0, i3, i2);
+            }
+        }
+
+        return data;
+    }
+
+    MeshData GenerateTriangleSoup(int numtriangles, float3 const& pmin, float3 const& pmax, float size, unsigned seed)
+    {
+        std::mt19937 rng(seed);
+
+        MeshData data;
+        data.positions.reserve(9 * numtriangles);
+        data.indices.reserve(3 * numtriangles);
+
+        for (int i = 0; i < numtriangles; ++i)
+        {
+            float3 p = RandomPoint(pmin, pmax, rng);
+
+            AddVertex(data, p);
+            AddVertex(data, p + size * RandomDirection(rng));
+            AddVertex(data, p + size * RandomDirection(rng));
+            AddTriangle(data, 3 * i, 3 * i + 1, 3 * i + 2);
+        }
+
+        return data;
+    }
+
+    MeshData GenerateThinTriangles(int numtriangles, float3 const& pmin, float3 const& pmax, float width, unsigned seed)
+    {
+        std::mt19937 rng(seed);
+
+        MeshData data;
+        data.positions.reserve(9 * numtriangles);
+        data.indices.reserve(3 * numtriangles);
+
+        for (int i = 0; i < numtriangles; ++i)
+        {
+            // Both ends lie in the bounds, the third vertex sits next to the first one
+            float3 p0 = RandomPoint(pmin, pmax, rng);
+            float3 p1 = RandomPoint(pmin, pmax, rng);
+
+            AddVertex(data, p0);
+            AddVertex(data, p1);
+            AddVertex(data, p0 + width * RandomDirection(rng));
+            AddTriangle(data, 3 * i, 3 * i + 1, 3 * i + 2);
+        }
+
+        return data;
+    }
+
+    Shape* CreateMesh(IntersectionApi* api, MeshData const& data)
+    {
+        return api->CreateMesh(data.positions.data(), data.num_vertices(), 3 * sizeof(float),
+            data.indices.data(), 0, nullptr, data.num_faces());
+    }
+
+    void CreateInstanceGrid(IntersectionApi* api, Shape const* base, int nx, int ny, int nz, float3 const& spacing,
+        std::vector<Shape*>& instances)
+    {
+        instances.reserve(instances.size() + nx * ny * nz);
+
+        for (int z = 0; z < nz; ++z)
+        {
+            for (int y = 0; y < ny; ++y)
+            {
+                for (int x = 0; x < nx; ++x)
+                {
+                    Shape* instance = api->CreateInstance(base);
+
+                    matrix m = translation(float3(x * spacing.x, y * spacing.y, z * spacing.z));
+                    instance->SetTransform(m, inverse(m));
+
+                    instances.push_back(instance);
+                }
+            }
+        }
+    }
+}
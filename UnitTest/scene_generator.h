@@ -0,0 +1,61 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "radeon_rays.h"
+
+#include <vector>
+
+// Procedural scenes of arbitrary size built in memory for benchmarks and scaling tests
+namespace SceneGenerator
+{
+    // Indexed triangle mesh, 3 floats per vertex and 3 indices per triangle
+    struct MeshData
+    {
+        std::vector<float> positions;
+        std::vector<int> indices;
+
+        int num_vertices() const { return (int)positions.size() / 3; }
+        int num_faces() const { return (int)indices.size() / 3; }
+    };
+
+    // UV sphere of 2 * rings * segments triangles, half of the triangles at the poles are degenerate.
+    // Rings and segments are clamped to at least 2 and 3.
+    MeshData GenerateSphere(RadeonRays::float3 const& center, float radius, int rings, int segments);
+
+    // Randomly placed and oriented triangles of the given edge size inside the bounds
+    MeshData GenerateTriangleSoup(int numtriangles, RadeonRays::float3 const& pmin, RadeonRays::float3 const& pmax,
+        float size, unsigned seed);
+
+    // Worst case for BVH builders: long thin triangles spanning the bounds diagonally in random directions,
+    // their boxes overlap heavily while the triangles themselves barely cover any area.
+    MeshData GenerateThinTriangles(int numtriangles, RadeonRays::float3 const& pmin, RadeonRays::float3 const& pmax,
+        float width, unsigned seed);
+
+    // Create an API mesh from the data, the shape is not attached
+    RadeonRays::Shape* CreateMesh(RadeonRays::IntersectionApi* api, MeshData const& data);
+
+    // Create nx * ny * nz instances of the base shape translated by multiples of spacing,
+    // instances are appended to the vector in x, y, z order and are not attached
+    void CreateInstanceGrid(RadeonRays::IntersectionApi* api, RadeonRays::Shape const* base, int nx, int ny, int nz,
+        RadeonRays::float3 const& spacing, std::vector<RadeonRays::Shape*>& instances);
+}
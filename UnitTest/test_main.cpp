@@ -42,6 +42,8 @@ THE SOFTWARE.
 
 #endif
 
+#include "radeon_rays_util_test.h"
+
 #include "gtest/gtest.h"
 
 
@@ -49,11 +49,31 @@ newoption {
     description = "Add tutorials projects"
 }
 
+newoption {
+    trigger     = "benchmarks",
+    description = "Add trace throughput and parallel primitives benchmark projects, the path tracer and the scene converter"
+}
+
+newoption {
+    trigger     = "heatmap",
+    description = "Add BVH cost heatmap tool project"
+}
+
 newoption {
     trigger     = "safe_math",
     description = "use safe math"
 }
 
+newoption {
+    trigger     = "simd_math",
+    description = "Use SSE/NEON for host side float3, bbox and matrix math"
+}
+
+newoption {
+    trigger     = "enable_trace",
+    description = "Record build and query scopes as Chrome trace JSON"
+}
+
 if not _OPTIONS["use_opencl"] and not _OPTIONS["use_vulkan"] and not _OPTIONS["use_embree"] then
     _OPTIONS["use_opencl"] = 1
 end
@@ -127,6 +147,10 @@ end
 if _OPTIONS["use_opencl"] then
 	defines{"USE_OPENCL=1"}
 end
+if _OPTIONS["enable_trace"] then
+	print ">> Trace instrumentation enabled"
+	defines{"RR_ENABLE_TRACE=1"}
+end
 if _OPTIONS["use_vulkan"] then
 print ">> Vulkan backend enabled"
 	defines{"USE_VULKAN=1"}
@@ -178,6 +202,11 @@ if _OPTIONS["safe_math"] then
 	defines { "USE_SAFE_MATH" }
 end
 
+if _OPTIONS["simd_math"] then
+	print ">> SIMD host math enabled"
+	defines { "RR_SIMD_MATH=1" }
+end
+
 if fileExists("./RadeonRays/RadeonRays.lua") then
 	dofile("./RadeonRays/RadeonRays.lua")
 end
@@ -205,4 +234,25 @@ if _OPTIONS["tutorials"] then
 	if fileExists("./Tutorials/Tutorials.lua") then
 		dofile("./Tutorials/Tutorials.lua")
 	end
-end
\ No newline at end of file
+end
+
+if _OPTIONS["benchmarks"] then
+	if fileExists("./Benchmark/Benchmark.lua") then
+		dofile("./Benchmark/Benchmark.lua")
+	end
+	if fileExists("./PrimitivesBenchmark/PrimitivesBenchmark.lua") then
+		dofile("./PrimitivesBenchmark/PrimitivesBenchmark.lua")
+	end
+	if fileExists("./SceneConverter/SceneConverter.lua") then
+		dofile("./SceneConverter/SceneConverter.lua")
+	end
+	if _OPTIONS["use_opencl"] and fileExists("./PathTracer/PathTracer.lua") then
+		dofile("./PathTracer/PathTracer.lua")
+	end
+end
+
+if _OPTIONS["heatmap"] then
+	if fileExists("./Heatmap/Heatmap.lua") then
+		dofile("./Heatmap/Heatmap.lua")
+	end
+end